@@ -439,6 +439,16 @@ struct fuse_operations {
 	int (*ioctl) (const char *, int cmd, void *arg,
 		      struct fuse_file_info *, unsigned int flags, void *data); 
 
+	/**
+	 * Allocate space to an open file
+	 *
+	 * Allocate the range starting at offset and of length bytes.
+	 * Unless FALLOC_FL_KEEP_SIZE is set in mode, the file is
+	 * extended to the end of the range.
+	 */
+	int (*fallocate) (const char *, int mode, off_t offset, off_t length,
+			struct fuse_file_info *);
+
 	/*
 	 * The flags below have been discarded, they should not be used
 	 */
@@ -622,6 +632,8 @@ int fuse_fs_bmap(struct fuse_fs *fs, const char *path, size_t blocksize,
 		 uint64_t *idx);
 int fuse_fs_ioctl(struct fuse_fs *fs, const char *path, int cmd, void *arg,
 		  struct fuse_file_info *fi, unsigned int flags, void *data);
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+		      off_t offset, off_t length, struct fuse_file_info *fi);
 void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn);
 void fuse_fs_destroy(struct fuse_fs *fs);
 
@@ -52,6 +52,16 @@ extern "C" {
 
 #define FUSE_CAP_BIG_WRITES	(1 << 5)
 #define FUSE_CAP_IOCTL_DIR	(1 << 11)
+#define FUSE_CAP_READDIRPLUS	(1 << 13)
+
+/*
+ * FUSE_CAP_WRITEBACK_CACHE: let the kernel cache the buffered writes
+ * FUSE_CAP_PARALLEL_DIROPS: allow parallel lookups and readdir
+ * FUSE_CAP_MAX_PAGES: allow requests of more than 32 pages
+ */
+#define FUSE_CAP_WRITEBACK_CACHE	(1 << 16)
+#define FUSE_CAP_PARALLEL_DIROPS	(1 << 17)
+#define FUSE_CAP_MAX_PAGES	(1 << 22)
 
 /**
  * Ioctl flags
@@ -143,10 +153,18 @@ struct fuse_conn_info {
 
 	unsigned capable;
 	unsigned want;
+
+	/**
+	 * Maximum number of pages in a request (read-write), only
+	 * used when FUSE_CAP_MAX_PAGES is wanted, limited by the
+	 * receive buffer size of the channel
+	 */
+	unsigned max_pages;
+
 	/**
 	 * For future use.
 	 */
-	unsigned reserved[25];
+	unsigned reserved[24];
     };
 
 struct fuse_session;
@@ -40,6 +40,7 @@
 #define __u64 uint64_t
 #define __u32 uint32_t
 #define __s32 int32_t
+#define __s64 int64_t
 #else
 #include <asm/types.h>
 #include <linux/major.h>
@@ -63,6 +64,32 @@
 #define FUSE_KERNEL_MAJOR_FALLBACK 7
 #define FUSE_KERNEL_MINOR_FALLBACK 12
 
+/*
+ * Protocol 7.21 is only requested when the kernel supports it and
+ * the file system wants to reply to readdirplus requests
+ */
+
+#define FUSE_KERNEL_MINOR_READDIRPLUS 21
+
+/*
+ * Protocols 7.23 (writeback cache), 7.25 (parallel directory
+ * operations) and 7.28 (more than 32 pages per request) are only
+ * requested when the kernel supports them and the file system wants
+ * the matching feature
+ */
+
+#define FUSE_KERNEL_MINOR_WRITEBACK_CACHE 23
+#define FUSE_KERNEL_MINOR_PARALLEL_DIROPS 25
+#define FUSE_KERNEL_MINOR_MAX_PAGES 28
+
+/*
+ * Default and maximum number of pages in a request, the maximum
+ * being limited by kernels to 256, or to fs.fuse.max_pages_limit
+ * since Linux 6.13
+ */
+#define FUSE_DEFAULT_MAX_PAGES 32
+#define FUSE_MAX_MAX_PAGES 65535
+
 /** The node ID of the root inode */
 #define FUSE_ROOT_ID 1
 
@@ -138,14 +165,24 @@ struct fuse_file_lock {
  * FUSE_BIG_WRITES: allow big writes to be issued to the file system
  * FUSE_DONT_MASK: don't apply umask to file mode on create operations
  * FUSE_HAS_IOCTL_DIR: kernel supports ioctl on directories
+ * FUSE_DO_READDIRPLUS: do READDIRPLUS (READDIR+LOOKUP in one)
+ * FUSE_READDIRPLUS_AUTO: adaptive readdirplus
+ * FUSE_WRITEBACK_CACHE: use writeback cache for buffered writes
+ * FUSE_PARALLEL_DIROPS: allow parallel lookups and readdir
  * FUSE_POSIX_ACL: kernel supports Posix ACLs
+ * FUSE_MAX_PAGES: init_out.max_pages contains the max number of req pages
  */
 #define FUSE_ASYNC_READ		(1 << 0)
 #define FUSE_POSIX_LOCKS	(1 << 1)
 #define FUSE_BIG_WRITES		(1 << 5)
 #define FUSE_DONT_MASK		(1 << 6)
 #define FUSE_HAS_IOCTL_DIR	(1 << 11)
+#define FUSE_DO_READDIRPLUS	(1 << 13)
+#define FUSE_READDIRPLUS_AUTO	(1 << 14)
+#define FUSE_WRITEBACK_CACHE	(1 << 16)
+#define FUSE_PARALLEL_DIROPS	(1 << 18)
 #define FUSE_POSIX_ACL		(1 << 19)
+#define FUSE_MAX_PAGES		(1 << 22)
 
 /**
  * Release flags
@@ -190,6 +227,11 @@ enum fuse_opcode {
 	FUSE_BMAP          = 37,
 	FUSE_DESTROY       = 38,
 	FUSE_IOCTL         = 39,
+	FUSE_BATCH_FORGET  = 42,
+	FUSE_FALLOCATE     = 43,
+	FUSE_READDIRPLUS   = 44,
+	FUSE_LSEEK         = 46,
+	FUSE_COPY_FILE_RANGE = 47,
 };
 
 /* The read buffer is required to be at least 8k, but may be much larger */
@@ -211,6 +253,40 @@ struct fuse_forget_in {
 	__u64	nlookup;
 };
 
+enum fuse_notify_code {
+	FUSE_NOTIFY_POLL   = 1,
+	FUSE_NOTIFY_INVAL_INODE = 2,
+	FUSE_NOTIFY_INVAL_ENTRY = 3,
+	FUSE_NOTIFY_CODE_MAX,
+};
+
+/*
+ * Protocol 7.12 is required for the cache invalidation notifications
+ */
+#define FUSE_KERNEL_MINOR_NOTIFY_INVAL 12
+
+struct fuse_notify_inval_inode_out {
+	__u64	ino;
+	__s64	off;
+	__s64	len;
+};
+
+struct fuse_notify_inval_entry_out {
+	__u64	parent;
+	__u32	namelen;
+	__u32	padding;
+};
+
+struct fuse_forget_one {
+	__u64	nodeid;
+	__u64	nlookup;
+};
+
+struct fuse_batch_forget_in {
+	__u32	count;
+	__u32	dummy;
+};
+
 #define FUSE_COMPAT_FUSE_ATTR_OUT_SIZE 96  /* JPA */
 
 struct fuse_attr_out {
@@ -371,10 +447,17 @@ struct fuse_init_out {
 	__u32	minor;
 	__u32	max_readahead;
 	__u32	flags;
-	__u32	unused;
+	__u16	max_background;
+	__u16	congestion_threshold;
 	__u32	max_write;
+	__u32	time_gran;
+	__u16	max_pages;
+	__u16	map_alignment;
+	__u32	unused[8];
 };
 
+#define FUSE_COMPAT_22_INIT_OUT_SIZE 24
+
 struct fuse_interrupt_in {
 	__u64	unique;
 };
@@ -398,6 +481,35 @@ struct fuse_ioctl_in {
 	__u32	out_size;
 };
 
+struct fuse_fallocate_in {
+	__u64	fh;
+	__u64	offset;
+	__u64	length;
+	__u32	mode;
+	__u32	padding;
+};
+
+struct fuse_lseek_in {
+	__u64	fh;
+	__u64	offset;
+	__u32	whence;
+	__u32	padding;
+};
+
+struct fuse_lseek_out {
+	__u64	offset;
+};
+
+struct fuse_copy_file_range_in {
+	__u64	fh_in;
+	__u64	off_in;
+	__u64	nodeid_out;
+	__u64	fh_out;
+	__u64	off_out;
+	__u64	len;
+	__u64	flags;
+};
+
 struct fuse_ioctl_iovec {
 	__u64	base;
 	__u64	len;
@@ -439,3 +551,13 @@ struct fuse_dirent {
 #define FUSE_DIRENT_ALIGN(x) (((x) + sizeof(__u64) - 1) & ~(sizeof(__u64) - 1))
 #define FUSE_DIRENT_SIZE(d) \
 	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + (d)->namelen)
+
+struct fuse_direntplus {
+	struct fuse_entry_out entry_out;
+	struct fuse_dirent dirent;
+};
+
+#define FUSE_NAME_OFFSET_DIRENTPLUS \
+	offsetof(struct fuse_direntplus, dirent.name)
+#define FUSE_DIRENTPLUS_SIZE(d) \
+	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + (d)->dirent.namelen)
@@ -55,6 +55,14 @@ struct fuse_session;
  */
 struct fuse_chan;
 
+/** An inode to forget, as supplied to the forget_multi() method */
+struct fuse_forget_data {
+	/** Inode number */
+	uint64_t ino;
+	/** Number of lookups to forget */
+	uint64_t nlookup;
+};
+
 /** Directory entry parameters supplied to fuse_reply_entry() */
 struct fuse_entry_param {
 	/** Unique inode number
@@ -837,6 +845,117 @@ struct fuse_lowlevel_ops {
 		       struct fuse_file_info *fi, unsigned flags,
 		       const void *in_buf, size_t in_bufsz, size_t out_bufsz);
 
+	/**
+	 * Read directory with attributes
+	 *
+	 * Send a buffer filled using fuse_add_direntry_plus(), with size
+	 * not exceeding the requested size.  Send an empty buffer on end
+	 * of stream.
+	 *
+	 * Only requested by the kernel when FUSE_CAP_READDIRPLUS has
+	 * been set in conn->want by the init method.  Each entry with
+	 * a non-zero inode number in its entry parameters is looked up
+	 * by the kernel, the same way as a reply to lookup.
+	 *
+	 * fi->fh will contain the value set by the opendir method, or
+	 * will be undefined if the opendir method didn't set any value.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_buf
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param size maximum number of bytes to send
+	 * @param off offset to continue reading the directory stream
+	 * @param fi file information
+	 */
+	void (*readdirplus) (fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi);
+
+	/**
+	 * Allocate space to an open file
+	 *
+	 * Allocate the range starting at offset and of length bytes,
+	 * so that subsequent writes to it do not fail for lack of
+	 * space. Unless FALLOC_FL_KEEP_SIZE is set in mode, the file
+	 * is extended to the end of the range.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param mode the allocation mode, as defined by fallocate(2)
+	 * @param offset start of the range
+	 * @param length length of the range
+	 * @param fi file information
+	 */
+	void (*fallocate) (fuse_req_t req, fuse_ino_t ino, int mode,
+			off_t offset, off_t length, struct fuse_file_info *fi);
+
+	/**
+	 * Batch forget inodes
+	 *
+	 * Sent by the kernel instead of a forget for each inode, when
+	 * several inodes are evicted at once. If not implemented, the
+	 * forget method is called for each inode.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_none
+	 *
+	 * @param req request handle
+	 * @param count the number of inodes to forget
+	 * @param forgets the inodes and their numbers of lookups
+	 */
+	void (*forget_multi) (fuse_req_t req, size_t count,
+			struct fuse_forget_data *forgets);
+
+	/**
+	 * Find the next data or hole of an open file
+	 *
+	 * Only called for SEEK_DATA and SEEK_HOLE, the other kinds of
+	 * lseek() are processed by the kernel. If not implemented,
+	 * the kernel assumes the data has no holes.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_lseek
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param off offset to start searching from
+	 * @param whence SEEK_DATA or SEEK_HOLE
+	 * @param fi file information
+	 */
+	void (*lseek) (fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+			struct fuse_file_info *fi);
+
+	/**
+	 * Copy a range of data from an open file to another one
+	 *
+	 * The data is copied within the file system, without being
+	 * transferred to the kernel. If not implemented, the kernel
+	 * reads and writes the data.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_write
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino_in the inode number of the source file
+	 * @param off_in the offset of the data to copy
+	 * @param fi_in file information of the source file
+	 * @param ino_out the inode number of the destination file
+	 * @param off_out the offset where to copy the data
+	 * @param fi_out file information of the destination file
+	 * @param len the number of bytes to copy
+	 * @param flags the flags of copy_file_range(2)
+	 */
+	void (*copy_file_range) (fuse_req_t req, fuse_ino_t ino_in,
+			off_t off_in, struct fuse_file_info *fi_in,
+			fuse_ino_t ino_out, off_t off_out,
+			struct fuse_file_info *fi_out, size_t len, int flags);
 };
 
 /**
@@ -938,7 +1057,7 @@ int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi);
  * Reply with number of bytes written
  *
  * Possible requests:
- *   write
+ *   write, copy_file_range
  *
  * @param req request handle
  * @param count the number of bytes written
@@ -959,7 +1078,6 @@ int fuse_reply_write(fuse_req_t req, size_t count);
  */
 int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
 
-#ifdef POSIXACLS
 /**
  * Reply with data vector
  *
@@ -972,7 +1090,6 @@ int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
  * @return zero for success, -errno for failure to send reply
  */
 int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count);
-#endif
 
 /**
  * Reply with filesystem statistics
@@ -1022,6 +1139,18 @@ int fuse_reply_lock(fuse_req_t req, struct flock *lock);
  */
 int fuse_reply_bmap(fuse_req_t req, uint64_t idx);
 
+/**
+ * Reply with the offset found by lseek
+ *
+ * Possible requests:
+ *   lseek
+ *
+ * @param req request handle
+ * @param off offset of the data or hole found
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_lseek(fuse_req_t req, off_t off);
+
 /* ----------------------------------------------------------- *
  * Filling a buffer in readdir				       *
  * ----------------------------------------------------------- */
@@ -1054,6 +1183,26 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 			 const char *name, const struct stat *stbuf,
 			 off_t off);
 
+/**
+ * Add a directory entry and its attributes to the buffer
+ *
+ * Same as fuse_add_direntry(), for replying to readdirplus.  All
+ * the fields of the entry parameters are used, an inode number of
+ * zero meaning that the kernel has to look up the entry by itself
+ * (the directory entry then gets its inode number from e->attr).
+ *
+ * @param req request handle
+ * @param buf the point where the new entry will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param the name of the entry
+ * @param e the entry parameters, as for a lookup reply
+ * @param off the offset of the next entry
+ * @return the space needed for the entry
+ */
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+			 const char *name, const struct fuse_entry_param *e,
+			 off_t off);
+
 /**
  * Reply to finish ioctl
  *
@@ -1068,6 +1217,46 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size);
 
 
+/* ----------------------------------------------------------- *
+ * Notification						       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Notify to invalidate cache for an inode
+ *
+ * The attributes of the inode are invalidated, and if off is not
+ * negative, the cached data in the range [off, off+len) too, a zero
+ * len meaning up to the end of file.
+ *
+ * Data must not be invalidated from within a request on the same
+ * inode, as the kernel may wait for the request to be completed.
+ *
+ * @param ch the channel through which to send the notification
+ * @param ino the inode number
+ * @param off the offset in the inode where to start invalidating
+ *            or negative to invalidate attributes only
+ * @param len the amount of cache to invalidate or 0 for all
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len);
+
+/**
+ * Notify to invalidate parent attributes and the dentry matching
+ * parent/name
+ *
+ * This must not be called from within a request on the parent
+ * directory, as the kernel locks the directory while invalidating.
+ *
+ * @param ch the channel through which to send the notification
+ * @param parent inode number
+ * @param name file name
+ * @param namelen strlen() of file name
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen);
+
 /* ----------------------------------------------------------- *
  * Utility functions					       *
  * ----------------------------------------------------------- */
@@ -1275,6 +1464,14 @@ void fuse_session_reset(struct fuse_session *se);
  */
 int fuse_session_exited(struct fuse_session *se);
 
+/**
+ * Get the user data provided to the session
+ *
+ * @param se the session
+ * @return the user data
+ */
+void *fuse_session_data(struct fuse_session *se);
+
 /**
  * Enter a single threaded event loop
  *
@@ -1291,6 +1488,33 @@ int fuse_session_loop(struct fuse_session *se);
  */
 int fuse_session_loop_mt(struct fuse_session *se);
 
+/**
+ * Function called by a worker before and after processing a request
+ *
+ * @param data the user data passed to fuse_session_loop_pool()
+ * @param opcode the opcode of the request
+ * @param done 0 before processing the request, 1 after
+ */
+typedef void (*fuse_worker_hook)(void *data, int opcode, int done);
+
+/**
+ * Enter a multi-threaded event loop with a fixed pool of workers
+ *
+ * The hook may be used to lock the file system according to the
+ * request being processed. Bulk requests (big reads and writes,
+ * syncs) are only processed by three quarters of the workers, and
+ * with a lower priority for the device transfers, so that the other
+ * requests are not delayed behind them.
+ *
+ * @param se the session
+ * @param workers the number of worker threads
+ * @param hook the function called around each request, or NULL
+ * @param data user data passed to the hook
+ * @return 0 on success, -1 on error
+ */
+int fuse_session_loop_pool(struct fuse_session *se, int workers,
+                           fuse_worker_hook hook, void *data);
+
 /* ----------------------------------------------------------- *
  * Channel interface					       *
  * ----------------------------------------------------------- */
@@ -1361,6 +1585,18 @@ int fuse_chan_fd(struct fuse_chan *ch);
  */
 size_t fuse_chan_bufsize(struct fuse_chan *ch);
 
+/**
+ * Enlarge the receive buffer size
+ *
+ * This has to be done before starting the session loop, so that
+ * requests of more than 32 pages can be received.  The size is
+ * never reduced.
+ *
+ * @param ch the channel
+ * @param bufsize the new buffer size
+ */
+void fuse_chan_set_bufsize(struct fuse_chan *ch, size_t bufsize);
+
 /**
  * Query the user data
  *
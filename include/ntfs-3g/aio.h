@@ -0,0 +1,46 @@
+/*
+ * aio.h - Exports for the asynchronous reads of attributes.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_AIO_H
+#define _NTFS_AIO_H
+
+#include "types.h"
+#include "volume.h"
+#include "attrib.h"
+
+struct NTFS_AIO_QUEUE;
+
+/*
+ *	Function called when a read completes, with the count of bytes
+ *	read in @res, or minus the error code.
+ */
+
+typedef void (*ntfs_aio_callback)(ntfs_attr *na, s64 pos, s64 count,
+			void *buf, s64 res, void *data);
+
+extern struct NTFS_AIO_QUEUE *ntfs_aio_create(ntfs_volume *vol, int threads);
+extern int ntfs_aio_destroy(struct NTFS_AIO_QUEUE *queue);
+extern int ntfs_aio_submit(struct NTFS_AIO_QUEUE *queue, ntfs_attr *na,
+			s64 pos, s64 count, void *buf,
+			ntfs_aio_callback callback, void *data);
+extern int ntfs_aio_pump(struct NTFS_AIO_QUEUE *queue, BOOL wait);
+extern int ntfs_aio_pending(struct NTFS_AIO_QUEUE *queue);
+extern int ntfs_aio_fd(struct NTFS_AIO_QUEUE *queue);
+
+#endif /* defined _NTFS_AIO_H */
@@ -40,6 +40,8 @@ typedef struct _ntfs_attr_search_ctx ntfs_attr_search_ctx;
 extern ntfschar AT_UNNAMED[];
 extern ntfschar STREAM_SDS[];
 
+extern void ntfs_attr_layout_changed(void);
+
 /* The little endian Unicode string $TXF_DATA as a global constant. */
 extern ntfschar TXF_DATA[10];
 
@@ -181,7 +183,34 @@ static __inline__ int ntfs_attrs_walk(ntfs_attr_search_ctx *ctx)
  *
  * @state contains NTFS attribute specific flags describing this attribute
  * structure. See ntfs_attr_state_bits above.
+ *
+ * @ra is the state of the read-ahead of the attribute data, it may be saved
+ * and restored by callers which reopen the attribute for each read.
+ *
+ * @rl_index, @rl_count and @rl_hint let ntfs_attr_find_vcn() do a binary
+ * search in @rl, and check first the run found by the previous lookup. They
+ * are only meaningful while @rl_index is equal to @rl. As a runlist may be
+ * reallocated at the same address, they have to be dropped by calling
+ * ntfs_attr_rl_changed() whenever @rl is reallocated or freed, or runs are
+ * inserted into it or removed from it.
+ *
+ * @crl, when not NULL, is a compact copy of the complete runlist of a big
+ * attribute, and @rl is then only a window of it, decoded on demand by
+ * ntfs_attr_map_runlist(). It is dropped by ntfs_attr_rl_expand() before
+ * the runlist is modified.
+ *
+ * @rl_dirty_start and @rl_dirty_end delimit the vcns whose mapping has been
+ * changed since the mapping pairs were last updated, they are only meaningful
+ * while NAttrRunlistDirty() is true. They are set by ntfs_attr_rl_dirty(), so
+ * that ntfs_attr_update_mapping_pairs() does not rebuild the mapping pairs of
+ * the extents beyond the changes.
  */
+struct ntfs_readahead {
+	s64 next;	/* position of next sequential read */
+	s64 window;	/* current read-ahead size, zero if not sequential */
+	s64 end;	/* end of data already read ahead */
+} ;
+
 struct _ntfs_attr {
 	runlist_element *rl;
 	ntfs_inode *ni;
@@ -198,6 +227,17 @@ struct _ntfs_attr {
 	u8 compression_block_size_bits;
 	u8 compression_block_clusters;
 	s8 unused_runs; /* pre-reserved entries available */
+	struct ntfs_readahead ra;
+	runlist_element *rl_index; /* runlist described by the fields below */
+	int rl_count;	/* number of runs, excluding the terminator */
+	int rl_hint;	/* run found by the previous lookup */
+	struct RUNLIST_COMPACT *crl; /* compact copy of the full runlist */
+	VCN rl_dirty_start;	/* first vcn whose mapping was changed */
+	VCN rl_dirty_end;	/* vcn after the last one changed */
+	char *append_buf;	/* small appends gathered, if requested */
+	s64 append_pos;		/* position of the gathered data */
+	u32 append_count;	/* count of bytes gathered */
+	u32 append_size;	/* size of the buffer */
 };
 
 /**
@@ -212,6 +252,10 @@ typedef enum {
 	NA_DataAppending,	/* 1: Attribute is being appended to */
 	NA_ComprClosing,	/* 1: Compressed attribute is being closed */
 	NA_RunlistDirty,	/* 1: Runlist has been updated */
+	NA_BeingRead,		/* 1: Attribute is being read (nested reads) */
+	NA_FullRunlist,		/* 1: Runlist must not be compacted */
+	NA_ConcurrentRead,	/* 1: Volume unlocked while reading data */
+	NA_ConcurrentWrite,	/* 1: Volume unlocked while writing data */
 } ntfs_attr_state_bits;
 
 #define  test_nattr_flag(na, flag)	 test_bit(NA_##flag, (na)->state)
@@ -242,6 +286,22 @@ typedef enum {
 #define NAttrSetRunlistDirty(na)	set_nattr_flag(na, RunlistDirty)
 #define NAttrClearRunlistDirty(na)	clear_nattr_flag(na, RunlistDirty)
 
+#define NAttrBeingRead(na)		test_nattr_flag(na, BeingRead)
+#define NAttrSetBeingRead(na)		set_nattr_flag(na, BeingRead)
+#define NAttrClearBeingRead(na)		clear_nattr_flag(na, BeingRead)
+
+#define NAttrFullRunlist(na)		test_nattr_flag(na, FullRunlist)
+#define NAttrSetFullRunlist(na)		set_nattr_flag(na, FullRunlist)
+#define NAttrClearFullRunlist(na)	clear_nattr_flag(na, FullRunlist)
+
+#define NAttrConcurrentRead(na)		test_nattr_flag(na, ConcurrentRead)
+#define NAttrSetConcurrentRead(na)	set_nattr_flag(na, ConcurrentRead)
+#define NAttrClearConcurrentRead(na)	clear_nattr_flag(na, ConcurrentRead)
+
+#define NAttrConcurrentWrite(na)	test_nattr_flag(na, ConcurrentWrite)
+#define NAttrSetConcurrentWrite(na)	set_nattr_flag(na, ConcurrentWrite)
+#define NAttrClearConcurrentWrite(na)	clear_nattr_flag(na, ConcurrentWrite)
+
 #define NAttrComprClosing(na)		test_nattr_flag(na, ComprClosing)
 #define NAttrSetComprClosing(na)	set_nattr_flag(na, ComprClosing)
 #define NAttrClearComprClosing(na)	clear_nattr_flag(na, ComprClosing)
@@ -298,10 +358,57 @@ extern void ntfs_attr_close(ntfs_attr *na);
 
 extern s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count,
 		void *b);
+struct ntfs_io_segment;
+
+extern s64 ntfs_attr_pread_map(ntfs_attr *na, s64 pos, s64 count, void *b,
+		struct ntfs_io_segment *seg, int maxseg, int *pnseg);
 extern s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count,
 		const void *b);
+extern BOOL ntfs_attr_overwrites(ntfs_attr *na, s64 pos, s64 count);
+extern int ntfs_attr_set_append_buffer(ntfs_attr *na, u32 size);
+extern int ntfs_attr_flush_append(ntfs_attr *na);
 extern int ntfs_attr_pclose(ntfs_attr *na);
 
+/**
+ * enum ntfs_extent_flags - kinds of extents returned by ntfs_attr_next_extent
+ *
+ * An extent with none of HOLE and DECODED is stored as is on the device,
+ * at the device offset returned.
+ */
+typedef enum {
+	NTFS_EXTENT_HOLE		= 1,	/* reads as zeroes */
+	NTFS_EXTENT_DECODED		= 2,	/* data is in ctx->data */
+	NTFS_EXTENT_UNINITIALIZED	= 4,	/* (hole) beyond initialized
+						   size */
+	NTFS_EXTENT_COMPRESSED		= 8,	/* (decoded) from compressed
+						   blocks */
+} ntfs_extent_flags;
+
+/**
+ * struct ntfs_attr_extent_ctx - iterator over the extents of an attribute
+ *
+ * After each successful call to ntfs_attr_next_extent(), the extent is
+ * described by @offset, @length and @flags, with either @device_offset
+ * or @data set. @pos may be changed by the caller to restart from
+ * another offset.
+ */
+typedef struct {
+	ntfs_attr *na;
+	s64 pos;		/* where the next extent starts */
+	char *buf;		/* decoded data, allocated on first use */
+	s64 bufsize;
+	s64 offset;		/* offset of the extent in the attribute */
+	s64 device_offset;	/* offset of the extent on the device */
+	s64 length;
+	ntfs_extent_flags flags;
+	const char *data;	/* the data, if decoded */
+} ntfs_attr_extent_ctx;
+
+extern ntfs_attr_extent_ctx *ntfs_attr_get_extent_ctx(ntfs_attr *na,
+		s64 bufsize);
+extern int ntfs_attr_next_extent(ntfs_attr_extent_ctx *ctx);
+extern void ntfs_attr_put_extent_ctx(ntfs_attr_extent_ctx *ctx);
+
 extern void *ntfs_attr_readall(ntfs_inode *ni, const ATTR_TYPES type,
 			       ntfschar *name, u32 name_len, s64 *data_size);
 
@@ -312,10 +419,45 @@ extern s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos,
 
 extern int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn);
 extern int ntfs_attr_map_whole_runlist(ntfs_attr *na);
+extern int ntfs_attr_rl_compact(ntfs_attr *na, VCN vcn);
+extern int ntfs_attr_rl_expand(ntfs_attr *na);
+extern s64 ntfs_attr_rl_release(ntfs_attr *na, VCN keep);
 
 extern LCN ntfs_attr_vcn_to_lcn(ntfs_attr *na, const VCN vcn);
 extern runlist_element *ntfs_attr_find_vcn(ntfs_attr *na, const VCN vcn);
 
+/*
+ *		Forget the runlist index after the runlist has been changed
+ */
+static __inline__ void ntfs_attr_rl_changed(ntfs_attr *na)
+{
+	na->rl_index = (runlist_element*)NULL;
+}
+
+/*
+ *		Record that the mapping of a range of vcns has been changed
+ *
+ *	Use RUNLIST_DIRTY_END as @end_vcn when the runs beyond
+ *	@start_vcn may have been moved or the size has changed.
+ */
+
+#define RUNLIST_DIRTY_END ((VCN)0x7fffffffffffffffLL)
+
+static __inline__ void ntfs_attr_rl_dirty(ntfs_attr *na,
+			VCN start_vcn, VCN end_vcn)
+{
+	if (!NAttrRunlistDirty(na)) {
+		na->rl_dirty_start = start_vcn;
+		na->rl_dirty_end = end_vcn;
+		NAttrSetRunlistDirty(na);
+	} else {
+		if (start_vcn < na->rl_dirty_start)
+			na->rl_dirty_start = start_vcn;
+		if (end_vcn > na->rl_dirty_end)
+			na->rl_dirty_end = end_vcn;
+	}
+}
+
 extern int ntfs_attr_size_bounds_check(const ntfs_volume *vol,
 		const ATTR_TYPES type, const s64 size);
 extern int ntfs_attr_can_be_resident(const ntfs_volume *vol,
@@ -352,6 +494,12 @@ extern int ntfs_attr_update_mapping_pairs(ntfs_attr *na, VCN from_vcn);
 
 extern int ntfs_attr_truncate(ntfs_attr *na, const s64 newsize);
 extern int ntfs_attr_truncate_solid(ntfs_attr *na, const s64 newsize);
+extern int ntfs_attr_trim_prealloc(ntfs_attr *na);
+extern int ntfs_attr_fallocate(ntfs_attr *na, s64 offset, s64 length,
+			BOOL keep_size);
+extern s64 ntfs_attr_seek_data(ntfs_attr *na, s64 pos, BOOL hole);
+extern int ntfs_set_prealloc_size(ntfs_volume *vol, s64 size);
+extern int ntfs_set_hole_unit(ntfs_volume *vol, s64 size);
 
 /**
  * get_attribute_value_length - return the length of the value of an attribute
@@ -389,6 +537,9 @@ extern int   ntfs_attr_exist(ntfs_inode *ni, const ATTR_TYPES type,
 		const ntfschar *name, u32 name_len);
 extern int   ntfs_attr_remove(ntfs_inode *ni, const ATTR_TYPES type,
 			      ntfschar *name, u32 name_len);
+struct CACHED_GENERIC;
+extern int ntfs_attr_streams_hash(const struct CACHED_GENERIC *cached);
+extern int ntfs_attr_stream_names(ntfs_inode *ni, char **pnames);
 extern s64   ntfs_attr_get_free_bits(ntfs_attr *na);
 extern int ntfs_attr_data_read(ntfs_inode *ni,
 		ntfschar *stream_name, int stream_name_len,
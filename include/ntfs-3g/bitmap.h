@@ -30,7 +30,8 @@
  * NOTES:
  *
  * - Operations are 8-bit only to ensure the functions work both on little
- *   and big endian machines! So don't make them 32-bit ops!
+ *   and big endian machines! So don't make them 32-bit ops! The scans
+ *   and counts use 64-bit words, converted from little endian.
  * - bitmap starts at bit = 0 and ends at bit = bitmap size - 1.
  * - _Caller_ has to make sure that the bit to operate on is less than the
  *   size of the bitmap.
@@ -39,6 +40,10 @@
 extern void ntfs_bit_set(u8 *bitmap, const u64 bit, const u8 new_value);
 extern char ntfs_bit_get(const u8 *bitmap, const u64 bit);
 extern char ntfs_bit_get_and_set(u8 *bitmap, const u64 bit, const u8 new_value);
+extern s64  ntfs_bit_find_zero(const u8 *bitmap, s64 start, s64 end);
+extern s64  ntfs_bit_find_one(const u8 *bitmap, s64 start, s64 end);
+extern s64  ntfs_bit_count_zeroes(const u8 *bitmap, s64 size);
+extern void ntfs_bit_set_range(u8 *bitmap, s64 start, s64 count, int value);
 extern int  ntfs_bitmap_set_run(ntfs_attr *na, s64 start_bit, s64 count);
 extern int  ntfs_bitmap_clear_run(ntfs_attr *na, s64 start_bit, s64 count);
 
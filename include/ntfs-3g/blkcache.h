@@ -0,0 +1,88 @@
+/*
+ * blkcache.h : cache of device blocks
+ *
+ * Copyright (c) 2026 ntfs-3g contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_BLKCACHE_H_
+#define _NTFS_BLKCACHE_H_
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "param.h"
+#include "volume.h"
+
+struct BLOCK_CACHED {
+	struct BLOCK_CACHED *next;	/* next older block */
+	struct BLOCK_CACHED *previous;	/* next more recent block */
+	struct BLOCK_CACHED *hnext;	/* next block with same hash */
+	s64 blknum;			/* device position / block size */
+	u32 valid;			/* count of valid bytes */
+	BOOL dirty;			/* must be written back */
+	char data[0];
+} ;
+
+struct BLOCK_CACHE_SHARD {
+	struct BLOCK_CACHED *most_recent_entry;
+	struct BLOCK_CACHED *oldest_entry;
+	int count;			/* number of blocks allocated */
+	int max_count;			/* max number of blocks */
+	int dirty_count;		/* number of dirty blocks */
+	struct BLOCK_CACHED *first_hash[BLOCK_CACHE_HASH];
+} ;
+
+struct BLOCK_CACHE {
+	u32 blksize;			/* size of blocks, a power of 2 */
+	int blkbits;			/* log2 of blksize */
+	s64 capacity;			/* max bytes cached */
+	unsigned long reads;
+	unsigned long hits;
+	unsigned long writebacks;
+	unsigned long bypasses;		/* writes not through cached blocks */
+	unsigned long changes;		/* writes of any kind */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;		/* for concurrent readers */
+#endif
+	struct BLOCK_CACHE_SHARD shard[BLOCK_CACHE_SHARDS];
+} ;
+
+int ntfs_create_block_cache(ntfs_volume *vol, s64 size);
+int ntfs_resize_block_cache(ntfs_volume *vol, s64 size);
+int ntfs_flush_block_cache(struct ntfs_device *dev);
+int ntfs_free_block_cache(ntfs_volume *vol);
+
+s64 ntfs_block_cache_pread(struct ntfs_device *dev, s64 pos,
+			s64 count, void *b);
+s64 ntfs_block_cache_pwrite(struct ntfs_device *dev, s64 pos,
+			s64 count, const void *b);
+s64 ntfs_block_cache_preadv(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg);
+s64 ntfs_block_cache_pwritev(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg);
+int ntfs_block_cache_prefetch(struct ntfs_device *dev, s64 pos, s64 count);
+void ntfs_block_cache_zero(struct ntfs_device *dev, s64 pos, s64 count);
+BOOL ntfs_block_cache_dirty(struct ntfs_device *dev, s64 pos, s64 count);
+s64 ntfs_block_cache_map(struct ntfs_device *dev, s64 pos, s64 count,
+			void *b, void **pdata);
+s64 ntfs_block_cache_memory(struct ntfs_device *dev);
+s64 ntfs_block_cache_shrink(struct ntfs_device *dev, s64 wanted);
+
+#endif /* _NTFS_BLKCACHE_H_ */
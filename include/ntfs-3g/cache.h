@@ -22,6 +22,12 @@
 #ifndef _NTFS_CACHE_H_
 #define _NTFS_CACHE_H_
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 #include "volume.h"
 
 struct CACHED_GENERIC {
@@ -60,6 +66,105 @@ struct CACHED_LOOKUP {
 	u64 inum;
 } ;
 
+struct CACHED_CBLOCK {
+	struct CACHED_CBLOCK *next;
+	struct CACHED_CBLOCK *previous;
+	const u8 *data;		/* decompressed compression block */
+	size_t datasize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;
+	VCN vcn;		/* first vcn of the compression block */
+} ;
+
+struct CACHED_MFTREC {
+	struct CACHED_MFTREC *next;
+	struct CACHED_MFTREC *previous;
+	MFT_RECORD *mrec;	/* fixed up mft record */
+	size_t recsize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;
+} ;
+
+struct CACHED_INDEX_BLOCK {
+	struct CACHED_INDEX_BLOCK *next;
+	struct CACHED_INDEX_BLOCK *previous;
+	INDEX_BLOCK *ib;	/* fixed up index block */
+	size_t blocksize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 mref;		/* inode, with its sequence number */
+	u64 namekey;		/* name of the index */
+	s64 pos;		/* position in the index allocation */
+} ;
+
+struct CACHED_LISTING {
+	struct CACHED_LISTING *next;
+	struct CACHED_LISTING *previous;
+	const char *records;	/* entries handed to filldir */
+	size_t size;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 mref;		/* directory, with its sequence number */
+} ;
+
+struct CACHED_SYMLINK {
+	struct CACHED_SYMLINK *next;
+	struct CACHED_SYMLINK *previous;
+	const char *target;	/* target, as returned by ntfs_make_symlink */
+	size_t size;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 mref;		/* symlink, with its sequence number */
+	u32 changes;		/* directory updates when resolved */
+} ;
+
+struct CACHED_EA {
+	struct CACHED_EA *next;
+	struct CACHED_EA *previous;
+	void *ea;		/* the full $EA attribute */
+	size_t size;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 mref;		/* inode, with its sequence number */
+} ;
+
+struct CACHED_STREAMS {
+	struct CACHED_STREAMS *next;
+	struct CACHED_STREAMS *previous;
+	char *names;		/* as returned by ntfs_attr_stream_names */
+	size_t size;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 mref;		/* inode, with its sequence number */
+} ;
+
+struct CACHED_STAT {
+	struct CACHED_STAT *next;
+	struct CACHED_STAT *previous;
+	void *unused;
+	size_t unusedsize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;
+	u32 changes;		/* directory updates when computed */
+	BOOL reparse;		/* depends on the directory updates */
+	struct stat stbuf;	/* as computed by the front end */
+} ;
+
+	/* the LRU caches which may be resized */
+enum {
+	NTFS_CACHE_INODE,	/* path to inode (high level) */
+	NTFS_CACHE_NIDATA,	/* inodes kept open */
+	NTFS_CACHE_LOOKUP,	/* directory and name to inode */
+	NTFS_CACHE_SECURID,	/* owner, group and mode to securid */
+	NTFS_CACHE_LEGACY,	/* permissions of legacy directories */
+	NTFS_CACHE_LISTING,	/* directory listings */
+	NTFS_CACHE_SECURDESC,	/* securid to security descriptor */
+	NTFS_CACHE_INHERIT,	/* parent securid and creator to securid */
+	NTFS_CACHE_SDH,		/* security descriptor to securid */
+	NTFS_CACHE_TRAVERSE,	/* directories found searchable */
+	NTFS_CACHE_GROUPS,	/* supplementary groups of threads */
+	NTFS_CACHE_SYMLINK,	/* symlink and junction targets */
+	NTFS_CACHE_EA,		/* extended attributes */
+	NTFS_CACHE_STREAMS,	/* names of data streams */
+	NTFS_CACHE_STAT,	/* stats computed for the front ends */
+	NTFS_LRU_CACHES		/* number of caches which may be resized */
+} ;
+
 enum {
 	CACHE_FREE = 1,
 	CACHE_NOHASH = 2
@@ -87,8 +192,18 @@ struct CACHE_HEADER {
 	unsigned long reads;
 	unsigned long writes;
 	unsigned long hits;
+	unsigned long evictions;	/* entries reused for a new one */
+	s64 fixed_bytes;	/* memory allocated for the cache */
+	s64 held_bytes;		/* variable parts and memory held */
+	size_t held_size;	/* memory held by an entry out of the cache */
+	int refill_cost;	/* relative cost of entering an entry again */
 	int fixed_size;
 	int max_hash;
+	BOOL concurrent;	/* fetched concurrently, CLOCK replacement */
+	u8 *referenced;		/* per entry reference bits (concurrent) */
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_t lock;	/* shared for fetching (concurrent) */
+#endif
 	struct CACHED_GENERIC entry[0];
 } ;
 
@@ -98,6 +213,12 @@ struct CACHE_HEADER {
 struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 			const struct CACHED_GENERIC *wanted,
 			cache_compare compare);
+BOOL ntfs_fetch_cache_copy(struct CACHE_HEADER *cache,
+			const struct CACHED_GENERIC *wanted,
+			cache_compare compare, struct CACHED_GENERIC *copy);
+BOOL ntfs_fetch_cache_dup(struct CACHE_HEADER *cache,
+			const struct CACHED_GENERIC *wanted,
+			cache_compare compare, struct CACHED_GENERIC *copy);
 struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 			const struct CACHED_GENERIC *item,
 			cache_compare compare);
@@ -110,5 +231,13 @@ int ntfs_remove_cache(struct CACHE_HEADER *cache,
 void ntfs_create_lru_caches(ntfs_volume *vol);
 void ntfs_free_lru_caches(ntfs_volume *vol);
 
+int ntfs_set_cache_size(ntfs_volume *vol, int which, int count);
+int ntfs_create_mftrec_cache(ntfs_volume *vol, s64 size);
+int ntfs_create_index_cache(ntfs_volume *vol, s64 size);
+
+s64 ntfs_cache_memory(ntfs_volume *vol);
+int ntfs_set_memory_budget(ntfs_volume *vol, s64 budget);
+s64 ntfs_trim_caches(ntfs_volume *vol, BOOL pressure);
+
 #endif /* _NTFS_CACHE_H_ */
 
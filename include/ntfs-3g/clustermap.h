@@ -0,0 +1,82 @@
+/*
+ * clustermap.h - Exports for the map of clusters to their owners.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_CLUSTERMAP_H
+#define _NTFS_CLUSTERMAP_H
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+
+/*
+ *		An extent of clusters allocated to an attribute
+ *
+ *	The attribute record is designated by the mft record holding it
+ *	(the base record or an extent record) and its instance within
+ *	this record.
+ */
+
+struct CLUSTER_EXTENT {
+	LCN lcn;		/* first cluster */
+	s64 length;		/* number of clusters */
+	VCN vcn;		/* first vcn within the attribute */
+	MFT_REF mref;		/* base inode, with its sequence number */
+	u64 record;		/* mft record holding the attribute */
+	ATTR_TYPES type;	/* type of the attribute */
+	u16 instance;		/* instance of the attribute record */
+} ;
+
+/*
+ *		The extents of a volume, sorted by their first cluster
+ *
+ *	reach[i] is the first cluster beyond all the extents up to the
+ *	i-th one, so that the extents overlapping a cluster can be
+ *	searched by dichotomy even when some clusters are referenced
+ *	several times.
+ */
+
+struct CLUSTER_MAP {
+	s64 count;		/* number of extents */
+	struct CLUSTER_EXTENT *extents;
+	LCN *reach;
+	s64 nr_clusters;	/* clusters of the volume mapped */
+	u64 serial;		/* serial number of the volume mapped */
+} ;
+
+/**
+ * ntfs_cluster_map_t - callback for ntfs_cluster_map_find()
+ *
+ * Called in the order of the clusters for each extent overlapping the
+ * searched range. Return zero to go on searching, a positive value to
+ * stop, or -1 with errno set to abort.
+ */
+typedef int (*ntfs_cluster_map_t)(const struct CLUSTER_EXTENT *extent,
+		void *data);
+
+extern struct CLUSTER_MAP *ntfs_cluster_map_build(ntfs_volume *vol,
+		int threads);
+extern int ntfs_cluster_map_find(const struct CLUSTER_MAP *map,
+		LCN first, LCN last, ntfs_cluster_map_t callback, void *data);
+extern int ntfs_cluster_map_save(ntfs_volume *vol,
+		const struct CLUSTER_MAP *map, const char *path);
+extern struct CLUSTER_MAP *ntfs_cluster_map_load(ntfs_volume *vol,
+		const char *path);
+extern void ntfs_cluster_map_free(struct CLUSTER_MAP *map);
+
+#endif /* defined _NTFS_CLUSTERMAP_H */
@@ -26,6 +26,15 @@
 #include "types.h"
 #include "attrib.h"
 
+/*
+ *		Compression levels, trading the compression ratio for speed
+ */
+enum {
+	NTFS_COMPRESS_FAST = 1,		/* greedy parsing, single probe */
+	NTFS_COMPRESS_DEFAULT = 2,	/* lazy parsing */
+	NTFS_COMPRESS_BEST = 3,		/* lazy parsing, deep search */
+} ;
+
 extern s64 ntfs_compressed_attr_pread(ntfs_attr *na, s64 pos, s64 count,
 		void *b);
 
@@ -37,5 +46,49 @@ extern s64 ntfs_compressed_pwrite(ntfs_attr *na, runlist_element *brl, s64 wpos,
 extern int ntfs_compressed_close(ntfs_attr *na, runlist_element *brl,
 				s64 offs, VCN *update_from);
 
+#if CACHE_CBLOCK_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_compressed_cblock_hash(const struct CACHED_GENERIC *item);
+extern void ntfs_compressed_invalidate(ntfs_volume *vol, u64 inum);
+
+#endif
+
+/*
+ *		Processors provided by an environment with no threads
+ *
+ *	run() calls proc(arg, index) for each index from 0 to n - 1,
+ *	spreading the calls over the count processors, the calling one
+ *	included, and returns when all of them have returned. proc()
+ *	only works on memory and does not call the environment.
+ */
+
+struct NTFS_PROCESSORS {
+	int count;	/* processors available, including the caller */
+	void (*run)(void *data, void (*proc)(void *arg, int index),
+			void *arg, int n);
+	void *data;	/* passed to run() */
+} ;
+
+extern int ntfs_set_compression_level(ntfs_volume *vol, int level);
+extern int ntfs_set_compress_threads(ntfs_volume *vol, int threads);
+extern int ntfs_set_compress_processors(ntfs_volume *vol,
+			const struct NTFS_PROCESSORS *procs);
+
+/*
+ *		Reading the files compressed by the Windows Overlay Filter
+ */
+
+struct WOF_FILE;
+
+extern int ntfs_wof_getsize(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			s64 *size, s64 *allocated);
+extern struct WOF_FILE *ntfs_wof_open(ntfs_inode *ni,
+			const REPARSE_POINT *reparse);
+extern s64 ntfs_wof_pread(struct WOF_FILE *wof, ntfs_inode *ni,
+			s64 pos, s64 count, void *b);
+extern void ntfs_wof_close(struct WOF_FILE *wof);
+
 #endif /* defined _NTFS_COMPRESS_H */
 
@@ -0,0 +1,31 @@
+/*
+ * defrag.h - Exports for the relocation of fragmented attributes.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_DEFRAG_H
+#define _NTFS_DEFRAG_H
+
+#include "types.h"
+#include "attrib.h"
+#include "inode.h"
+
+extern s64 ntfs_attr_extent_count(ntfs_attr *na, LCN *first_lcn);
+extern int ntfs_attr_relocate(ntfs_attr *na, LCN limit);
+extern int ntfs_inode_defragment(ntfs_inode *ni);
+
+#endif /* defined _NTFS_DEFRAG_H */
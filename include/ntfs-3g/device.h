@@ -43,6 +43,9 @@ typedef enum {
 	ND_Dirty,	/* 1: Device is dirty, needs sync. */
 	ND_Block,	/* 1: Device is a block device. */
 	ND_Sync,	/* 1: Device is mounted with "-o sync" */
+	ND_Direct,	/* 1: Device is accessed bypassing the cache */
+	ND_Mapped,	/* 1: Device data can be accessed in place */
+	ND_NoZeroOut,	/* 1: Device cannot zero out ranges by itself */
 } ntfs_device_state_bits;
 
 #define  test_ndev_flag(nd, flag)	   test_bit(ND_##flag, (nd)->d_state)
@@ -69,6 +72,32 @@ typedef enum {
 #define NDevSetSync(nd)		  set_ndev_flag(nd, Sync)
 #define NDevClearSync(nd)	clear_ndev_flag(nd, Sync)
 
+#define NDevDirect(nd)		 test_ndev_flag(nd, Direct)
+#define NDevSetDirect(nd)	  set_ndev_flag(nd, Direct)
+#define NDevClearDirect(nd)	clear_ndev_flag(nd, Direct)
+
+#define NDevMapped(nd)		 test_ndev_flag(nd, Mapped)
+#define NDevSetMapped(nd)	  set_ndev_flag(nd, Mapped)
+#define NDevClearMapped(nd)	clear_ndev_flag(nd, Mapped)
+
+#define NDevNoZeroOut(nd)	 test_ndev_flag(nd, NoZeroOut)
+#define NDevSetNoZeroOut(nd)	  set_ndev_flag(nd, NoZeroOut)
+#define NDevClearNoZeroOut(nd)	clear_ndev_flag(nd, NoZeroOut)
+
+/**
+ * struct ntfs_device_stats -
+ *
+ * Counters of the requests to a device, through ntfs_pread(), ntfs_pwrite()
+ * and the batched and mst variants, whether they are served from the cache
+ * of device blocks or not.
+ */
+struct ntfs_device_stats {
+	u64 reads;				/* Read requests. */
+	u64 read_bytes;				/* Bytes read. */
+	u64 writes;				/* Write requests. */
+	u64 written_bytes;			/* Bytes written. */
+};
+
 /**
  * struct ntfs_device -
  *
@@ -90,9 +119,38 @@ struct ntfs_device {
 						   heads or -1. */
 	int d_sectors_per_track;		/* Disk geometry: number of
 						   sectors per track or -1. */
+	struct BLOCK_CACHE *d_cache;		/* Cache of device blocks
+						   or NULL. */
+	struct ntfs_device_stats d_stats;	/* Counters of requests. */
+	struct NTFS_TRACE *d_trace;		/* Trace of requests or
+						   NULL. */
+	struct NTFS_PREFETCH *d_prefetch;	/* Reads recorded for
+						   prefetching or NULL. */
 };
 
 struct stat;
+struct BLOCK_CACHE;
+struct NTFS_TRACE;
+struct NTFS_PREFETCH;
+
+/*
+ *	Maximum number of segments which can be submitted in a single
+ *	ntfs_preadv() or ntfs_pwritev() call
+ */
+
+#define NTFS_MAX_IO_SEGMENTS 16
+
+/**
+ * struct ntfs_io_segment -
+ *
+ * One element of a batched device transfer : @count bytes at device
+ * position @pos are transferred from or to the buffer @buf.
+ */
+struct ntfs_io_segment {
+	s64 pos;		/* Position on device */
+	s64 count;		/* Number of bytes */
+	void *buf;		/* Memory buffer */
+};
 
 /**
  * struct ntfs_device_operations -
@@ -109,6 +167,30 @@ struct ntfs_device_operations {
 	s64 (*pread)(struct ntfs_device *dev, void *buf, s64 count, s64 offset);
 	s64 (*pwrite)(struct ntfs_device *dev, const void *buf, s64 count,
 			s64 offset);
+		/*
+		 * Optional batched transfers, returning the number of bytes
+		 * transferred from the segments, taken in order. When not
+		 * defined, the segments are transferred through pread/pwrite.
+		 */
+	s64 (*preadv)(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg);
+	s64 (*pwritev)(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg);
+		/*
+		 * Optional access in place to a read-only device, returning
+		 * a pointer to the @count bytes at @offset, valid until the
+		 * device is closed, or NULL if they have to be read.
+		 */
+	const void *(*map)(struct ntfs_device *dev, s64 count, s64 offset);
+		/*
+		 * Optional discard of the ranges described by the segments,
+		 * whose buffers are not used, returning 0 when all of them
+		 * have been discarded. This may be called from another
+		 * thread than the one accessing the device, so the state
+		 * of the device must not be updated.
+		 */
+	int (*discard)(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg);
 	int (*sync)(struct ntfs_device *dev);
 	int (*stat)(struct ntfs_device *dev, struct stat *buf);
 	int (*ioctl)(struct ntfs_device *dev, unsigned long request,
@@ -124,6 +206,16 @@ extern s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		void *b);
 extern s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const void *b);
+extern const void *ntfs_pmap(struct ntfs_device *dev, const s64 pos,
+		s64 count);
+extern int ntfs_device_zero(struct ntfs_device *dev, s64 pos, s64 count);
+extern int ntfs_device_discard(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg);
+
+extern s64 ntfs_preadv(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg);
+extern s64 ntfs_pwritev(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg);
 
 extern s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b);
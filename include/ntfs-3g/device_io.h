@@ -41,6 +41,24 @@
 #define ntfs_device_default_io_ops ntfs_device_uefi_io_ops
 #else
 #define ntfs_device_default_io_ops ntfs_device_unix_io_ops
+	/* Alternate operations submitting batches through io_uring */
+#define NTFS_DEVICE_URING_IO_OPS 1
+	/* Operations serving an image from memory, for "mem:" names */
+#define NTFS_DEVICE_MEM_IO_OPS 1
+
+struct unix_direct_io;
+
+/*
+ *	Private data of unix devices, which is also the beginning of
+ *	the private data of io_uring devices.
+ */
+
+struct ntfs_unix_private {
+	int fd;				/* File descriptor */
+	struct unix_direct_io *direct;	/* Direct I/O state, or NULL */
+	char *map;			/* Read-only mapping, or NULL */
+	s64 map_size;			/* Size of the mapping */
+} ;
 #endif /* UEFI_DRIVER */
 
 #else /* HAVE_WINDOWS_H */
@@ -85,6 +103,13 @@ int ntfs_device_win32_ftruncate(struct ntfs_device*, s64);
 struct ntfs_device_operations;
 
 extern struct ntfs_device_operations ntfs_device_default_io_ops;
+#ifdef NTFS_DEVICE_URING_IO_OPS
+extern struct ntfs_device_operations ntfs_device_uring_io_ops;
+#endif
+#ifdef NTFS_DEVICE_MEM_IO_OPS
+extern struct ntfs_device_operations ntfs_device_mem_io_ops;
+extern int ntfs_device_mem_name(const char *name);
+#endif
 
 #endif /* NO_NTFS_DEVICE_DEFAULT_IO_OPS */
 
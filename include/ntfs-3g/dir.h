@@ -119,6 +119,20 @@ typedef int (*ntfs_filldir_t)(void *dirent, const ntfschar *name,
 extern int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		void *dirent, ntfs_filldir_t filldir);
 
+/*
+ * Same as "ntfs_filldir", also getting the file name attribute from the
+ * index entry, or NULL for the emulated "." and "..". The times and sizes
+ * in an index entry may be older than the ones in the inode, as Windows
+ * only updates them lazily.
+ */
+typedef int (*ntfs_filldir_fn_t)(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type, const s64 pos,
+		const MFT_REF mref, const unsigned dt_type,
+		const FILE_NAME_ATTR *fn);
+
+extern int ntfs_readdir_fn(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_fn_t filldir);
+
 ntfs_inode *ntfs_dir_parent_inode(ntfs_inode *ni);
 u32 ntfs_interix_types(ntfs_inode *ni);
 
@@ -138,5 +152,14 @@ extern int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached);
 
 #endif
 
+#if CACHE_LISTING_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_dir_listing_hash(const struct CACHED_GENERIC *cached);
+extern void ntfs_dir_listing_forget(ntfs_volume *vol, u64 mref);
+
+#endif
+
 #endif /* defined _NTFS_DIR_H */
 
@@ -24,6 +24,10 @@
 #ifndef EA_H
 #define EA_H
 
+struct CACHED_GENERIC;
+
+int ntfs_ea_hash(const struct CACHED_GENERIC *cached);
+
 int ntfs_ea_check_wsldev(ntfs_inode *ni, dev_t *rdevp);
 
 int ntfs_ea_set_wsl_not_symlink(ntfs_inode *ni, mode_t mode, dev_t dev);
@@ -27,4 +27,44 @@ int ntfs_set_efs_info(ntfs_inode *ni,
 			const char *value, size_t size,	int flags);
 int ntfs_efs_fixup_attribute(ntfs_attr_search_ctx *ctx, ntfs_attr *na);
 
+/*
+ *	Raw export of an encrypted file
+ *
+ *	A header is followed by records made of a record header, the name
+ *	of the stream (little endian) and the raw data : first the $EFS
+ *	attribute, then the data streams as read when mounted with efs_raw
+ *	(the encrypted data rounded to a multiple of 512 bytes, followed
+ *	by the le16 count of padding bytes), and an end record with
+ *	no name and no data.
+ */
+
+#define EFS_RAW_MAGIC "NTFSEFS"		/* 8 bytes with the null */
+#define EFS_RAW_VERSION 1
+
+typedef struct {
+	char magic[8];
+	le32 version;
+	le32 file_attributes;	/* FILE_ATTR_* of the exported inode */
+} __attribute__((__packed__)) EFS_RAW_HEADER;
+
+typedef enum {
+	EFS_RAW_END = 0,
+	EFS_RAW_EFSINFO = 1,	/* the $EFS attribute */
+	EFS_RAW_STREAM = 2,	/* a raw encrypted data stream */
+} EFS_RAW_TYPES;
+
+typedef struct {
+	le32 type;		/* EFS_RAW_TYPES */
+	le32 name_length;	/* ntfschars following the header */
+	le64 size;		/* bytes following the name */
+} __attribute__((__packed__)) EFS_RAW_RECORD;
+
+	/* transfers the full count, returns zero or -1 (errno set) */
+typedef int (*ntfs_efs_raw_io)(void *param, void *buf, size_t size);
+
+int ntfs_efs_export_raw(ntfs_inode *ni, ntfs_efs_raw_io output,
+			void *param);
+int ntfs_efs_import_raw(ntfs_inode *ni, ntfs_efs_raw_io input,
+			void *param);
+
 #endif /* EFS_H */
@@ -84,6 +84,8 @@ typedef int (*COLLATE)(ntfs_volume *vol, const void *data1, int len1,
  * @new_vcn:            new VCN if we need to create a new index block
  * @median:		move to the parent if splitting index blocks
  * @ib_dirty:		TRUE if index block was changed
+ * @bound:		entry collating after the node found, if @want_bound
+ * @want_bound:		TRUE if lookups have to record @bound
  * @block_size:		index block size
  * @vcn_size_bits:	VCN size bits for this index block
  *
@@ -103,6 +105,10 @@ typedef int (*COLLATE)(ntfs_volume *vol, const void *data1, int len1,
  * INDEX_ALLOCATION attribute. @ib_dirty is TRUE if index block was changed and
  * FALSE otherwise.
  *
+ * If @want_bound is TRUE, ntfs_index_lookup() records into @bound a copy of
+ * the entry with the lowest key collating after all the keys of the node
+ * holding @entry, or NULL if this node is at the right end of the index.
+ *
  * To obtain a context call ntfs_index_ctx_get().
  *
  * When finished with the @entry and its @data, call ntfs_index_ctx_put() to
@@ -120,6 +126,7 @@ typedef struct {
 	void *data;
 	u16 data_len;
 	COLLATE collate;
+	COLLATION_RULES collation_rule;	/* rule of @collate */
 	BOOL is_in_root;
 	INDEX_ROOT *ir;
 	ntfs_attr_search_ctx *actx;
@@ -132,6 +139,8 @@ typedef struct {
 	BOOL bad_index;
 	u32 block_size;
 	u8 vcn_size_bits;
+	INDEX_ENTRY *bound;   /* copy of the tightest upper bound, or NULL */
+	BOOL want_bound;
 } ntfs_index_context;
 
 extern ntfs_index_context *ntfs_index_ctx_get(ntfs_inode *ni,
@@ -139,6 +148,36 @@ extern ntfs_index_context *ntfs_index_ctx_get(ntfs_inode *ni,
 extern void ntfs_index_ctx_put(ntfs_index_context *ictx);
 extern void ntfs_index_ctx_reinit(ntfs_index_context *ictx);
 
+/**
+ * ntfs_ie_collate_t - collate a key against the key of an index entry
+ *
+ * Returns -1, 0 or 1 as the key collates before, equal to or after the
+ * key of the entry, or NTFS_COLLATION_ERROR.
+ */
+typedef int (*ntfs_ie_collate_t)(const void *data, const INDEX_ENTRY *ie);
+
+extern int ntfs_ie_search(INDEX_HEADER *ih, u8 *index_end,
+		ntfs_ie_collate_t collate, const void *data,
+		INDEX_ENTRY **ie_out, int *item);
+
+extern s64 ntfs_index_block_read(ntfs_attr *ia_na, s64 pos, u32 block_size,
+		INDEX_BLOCK *dst);
+
+extern int ntfs_set_index_writeback(ntfs_volume *vol, s64 size);
+extern int ntfs_index_writeback_flush(ntfs_volume *vol, BOOL all);
+extern void ntfs_index_writeback_forget(ntfs_inode *ni);
+
+extern int ntfs_set_index_lazy_delete(ntfs_volume *vol, int count);
+extern int ntfs_index_lazy_flush(ntfs_volume *vol, BOOL all);
+
+#if CACHE_INDEX_HASH
+
+struct CACHED_GENERIC;
+
+extern int ntfs_index_block_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
 extern int ntfs_index_lookup(const void *key, const int key_len,
 		ntfs_index_context *ictx) __attribute_warn_unused_result__;
 
@@ -147,8 +186,16 @@ extern INDEX_ENTRY *ntfs_index_next(INDEX_ENTRY *ie,
 
 extern int ntfs_index_add_filename(ntfs_inode *ni, FILE_NAME_ATTR *fn,
 		MFT_REF mref);
+extern int ntfs_index_add_filenames(ntfs_inode *ni, FILE_NAME_ATTR **fns,
+		const MFT_REF *mrefs, int count);
+extern int ntfs_index_build_filenames(ntfs_inode *ni, FILE_NAME_ATTR **fns,
+		const MFT_REF *mrefs, int count, int fill);
 extern int ntfs_index_remove(ntfs_inode *dir_ni, ntfs_inode *ni,
 		const void *key, const int keylen);
+extern int ntfs_index_lazy_remove(ntfs_inode *dir_ni, ntfs_inode *ni,
+		FILE_NAME_ATTR *fn, const int keylen);
+extern BOOL ntfs_index_lazy_pending(ntfs_inode *dir_ni, const INDEX_ENTRY *ie);
+extern int ntfs_index_lazy_apply(ntfs_inode *dir_ni);
 
 extern INDEX_ROOT *ntfs_index_root_get(ntfs_inode *ni, ATTR_RECORD *attr);
 
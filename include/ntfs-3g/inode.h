@@ -52,6 +52,8 @@ typedef enum {
 	NI_v3_Extensions,	/* 1: JPA v3.x extensions present. */
 	NI_TimesSet,		/* 1: Use times which were set */
 	NI_KnownSize,		/* 1: Set if sizes are meaningful */
+	NI_Delayed,		/* 1: Writing delayed by the inode writeback */
+	NI_KnownNlink,		/* 1: (d) Posix link count is meaningful */
 } ntfs_inode_state_bits;
 
 #define  test_nino_flag(ni, flag)	   test_bit(NI_##flag, (ni)->state)
@@ -64,11 +66,15 @@ typedef enum {
 				 test_and_clear_bit(NI_##flag, (ni)->state)
 
 #define NInoDirty(ni)				  test_nino_flag(ni, Dirty)
-#define NInoSetDirty(ni)			   set_nino_flag(ni, Dirty)
+#define NInoSetDirty(ni)			ntfs_inode_set_dirty(ni)
 #define NInoClearDirty(ni)			 clear_nino_flag(ni, Dirty)
 #define NInoTestAndSetDirty(ni)		  test_and_set_nino_flag(ni, Dirty)
 #define NInoTestAndClearDirty(ni)	test_and_clear_nino_flag(ni, Dirty)
 
+#define NInoDelayed(ni)				  test_nino_flag(ni, Delayed)
+#define NInoSetDelayed(ni)			   set_nino_flag(ni, Delayed)
+#define NInoClearDelayed(ni)			 clear_nino_flag(ni, Delayed)
+
 #define NInoAttrList(ni)			  test_nino_flag(ni, AttrList)
 #define NInoSetAttrList(ni)			   set_nino_flag(ni, AttrList)
 #define NInoClearAttrList(ni)			 clear_nino_flag(ni, AttrList)
@@ -118,6 +124,12 @@ struct _ntfs_inode {
 	 */
 	u32 attr_list_size;	/* Length of attribute list value in bytes. */
 	u8 *attr_list;		/* Attribute list value itself. */
+	struct ATTRLIST_INDEX *attr_list_index; /* Index of the attribute
+				   list entries, built on first lookup. */
+	struct ATTR_OFFSETS *attr_offsets; /* Offsets of the attributes
+				   looked up in the record, or NULL. */
+	struct READDIR_CURSOR *readdir_cursor; /* Index block in which
+				   the last listing stopped, or NULL. */
 	/* Below fields are always valid. */
 	s32 nr_extents;		/* For a base mft record, the number of
 				   attached extent inodes (0 if none), for
@@ -148,6 +160,20 @@ struct _ntfs_inode {
 				   encrypted files and to compressed size
 				   of the unnamed data attribute for sparse or
 				   compressed files.) */
+	/*
+	 * For directories, the Posix link count ("." and ".." and the
+	 * subdirectories), provided the flag KnownNlink is set. It is
+	 * updated when subdirectories are inserted into the index or
+	 * removed from it.
+	 */
+	s32 dir_nlink;
+	/*
+	 * For compressed files, the count of successive compression
+	 * blocks which could not be compressed, and the count of blocks
+	 * still to be written without trying to compress them.
+	 */
+	u16 comp_failures;
+	u16 comp_skipped;
 
 	/*
 	 * These four fields are copy of relevant fields from
@@ -178,6 +204,7 @@ typedef enum {
 extern ntfs_inode *ntfs_inode_base(ntfs_inode *ni);
 
 extern ntfs_inode *ntfs_inode_allocate(ntfs_volume *vol);
+extern void ntfs_free_spare_inodes(ntfs_volume *vol);
 
 extern ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref);
 
@@ -200,8 +227,24 @@ extern ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni,
 		const leMFT_REF mref);
 
 extern int ntfs_inode_attach_all_extents(ntfs_inode *ni);
+extern int ntfs_inode_attach_next_extent(ntfs_inode *ni, u32 *pos);
 
 extern void ntfs_inode_mark_dirty(ntfs_inode *ni);
+extern void ntfs_inode_set_dirty(ntfs_inode *ni);
+
+struct stat;
+struct CACHED_GENERIC;
+
+extern int ntfs_inode_stat_hash(const struct CACHED_GENERIC *cached);
+extern BOOL ntfs_inode_fetch_stat(ntfs_volume *vol, u64 inum,
+			struct stat *stbuf, u32 *pchanges);
+extern void ntfs_inode_enter_stat(ntfs_inode *ni, const struct stat *stbuf,
+			u32 changes);
+extern void ntfs_inode_forget_stat(ntfs_inode *ni);
+
+extern int ntfs_set_inode_writeback(ntfs_volume *vol, int count);
+extern int ntfs_inode_writeback_flush(ntfs_volume *vol, BOOL all);
+extern BOOL ntfs_inode_writeback_pending(ntfs_volume *vol, u64 inum);
 
 extern void ntfs_inode_update_times(ntfs_inode *ni, ntfs_time_update_flags mask);
 
@@ -32,4 +32,17 @@
 int ntfs_ioctl(ntfs_inode *ni, unsigned long cmd, void *arg,
                         unsigned int flags, void *data);
 
+/*
+ * Relocate the data of a fragmented file to contiguous clusters,
+ * without argument. Fails with ENOSPC if there is no free extent
+ * big enough.
+ */
+#ifdef _IO
+#define NTFS_IOC_DEFRAG _IO('N', 0x40)
+#endif
+
+#if defined(FITRIM) && defined(BLKDISCARD)
+int ntfs_volume_trim(ntfs_volume *vol, struct fstrim_range *range);
+#endif
+
 #endif /* IOCTL_H */
@@ -2547,6 +2547,37 @@ typedef struct {
 
 _Static_assert(sizeof(REPARSE_POINT) == 8, "Incorrect REPARSE_POINT size");
 
+/**
+ * struct WOF_FILE_REPARSE_DATA - Reparse data of a system compressed file
+ *
+ * Files compressed by the Windows Overlay Filter (IO_REPARSE_TAG_WOF) from
+ * the file provider have their data in a stream named "WofCompressedData",
+ * and an empty unnamed data stream whose size is the size of the file.
+ */
+typedef struct {
+	le32 version;		/* WOF version, currently 1 */
+	le32 provider;		/* WOF_PROVIDER_FILE */
+	le32 file_version;	/* File provider version, currently 1 */
+	le32 algorithm;		/* WOF_COMPRESSION_* */
+} __attribute__((__packed__)) WOF_FILE_REPARSE_DATA;
+
+_Static_assert(sizeof(WOF_FILE_REPARSE_DATA) == 16,
+		"Incorrect WOF_FILE_REPARSE_DATA size");
+
+typedef enum {
+	WOF_CURRENT_VERSION		= const_cpu_to_le32(1),
+	WOF_PROVIDER_WIM		= const_cpu_to_le32(1),
+	WOF_PROVIDER_FILE		= const_cpu_to_le32(2),
+	WOF_FILE_PROVIDER_VERSION	= const_cpu_to_le32(1),
+} WOF_FILE_REPARSE_VALUES;
+
+typedef enum {
+	WOF_COMPRESSION_XPRESS4K	= const_cpu_to_le32(0),
+	WOF_COMPRESSION_LZX		= const_cpu_to_le32(1),
+	WOF_COMPRESSION_XPRESS8K	= const_cpu_to_le32(2),
+	WOF_COMPRESSION_XPRESS16K	= const_cpu_to_le32(3),
+} WOF_COMPRESSION_ALGORITHMS;
+
 /**
  * struct EA_INFORMATION - Attribute: Extended attribute information (0xd0).
  *
@@ -2803,6 +2834,78 @@ typedef struct {
 	} __attribute__((__packed__));
 } __attribute__((__packed__)) INTX_FILE;
 
+/**
+ * struct USN_RECORD - a record of the change journal FILE_Extend/$UsnJrnl
+ *
+ * The changes to the files are appended to the named data stream $J of
+ * FILE_Extend/$UsnJrnl as records, whose offset in the stream is their
+ * update sequence number (usn). The records are aligned to 8 bytes and
+ * never cross a boundary of USN_PAGE_SIZE bytes, the end of a page being
+ * filled with zeroes. The beginning of the stream is converted to a hole
+ * when the journal grows beyond its maximum size. Only the version 2.0
+ * of the records, with 64-bit file references, is defined here.
+ */
+typedef struct {
+/*  0*/	le32 record_length;		/* Size of the record, name included,
+					   a multiple of 8. */
+	le16 major_version;		/* 2 */
+	le16 minor_version;		/* 0 */
+/*  8*/	leMFT_REF file_reference_number; /* The file changed. */
+/* 16*/	leMFT_REF parent_file_reference_number; /* The directory of the
+					   name in the record. */
+/* 24*/	sle64 usn;			/* Offset of the record in $J. */
+/* 32*/	sle64 time_stamp;		/* Time of the change. */
+/* 40*/	le32 reason;			/* USN_REASON_* flags accumulated since
+					   the file was opened. */
+	le32 source_info;		/* Zero for user changes. */
+/* 48*/	le32 security_id;		/* Security id of the file. */
+	le32 file_attributes;		/* FILE_ATTR_* flags of the file. */
+/* 56*/	le16 file_name_length;		/* Length of the name in bytes. */
+	le16 file_name_offset;		/* Offset of the name, here 60. */
+/* 60*/	ntfschar file_name[0];		/* Name, not terminated. */
+} __attribute__((__packed__)) USN_RECORD;
+
+_Static_assert(sizeof(USN_RECORD) == 60, "Incorrect USN_RECORD size");
+
+#define USN_PAGE_SIZE 4096		/* records never cross these pages */
+
+/* Reasons for the change journal records, as le32 */
+#define USN_REASON_DATA_OVERWRITE	const_cpu_to_le32(0x00000001)
+#define USN_REASON_DATA_EXTEND		const_cpu_to_le32(0x00000002)
+#define USN_REASON_DATA_TRUNCATION	const_cpu_to_le32(0x00000004)
+#define USN_REASON_NAMED_DATA_OVERWRITE	const_cpu_to_le32(0x00000010)
+#define USN_REASON_NAMED_DATA_EXTEND	const_cpu_to_le32(0x00000020)
+#define USN_REASON_NAMED_DATA_TRUNCATION const_cpu_to_le32(0x00000040)
+#define USN_REASON_FILE_CREATE		const_cpu_to_le32(0x00000100)
+#define USN_REASON_FILE_DELETE		const_cpu_to_le32(0x00000200)
+#define USN_REASON_EA_CHANGE		const_cpu_to_le32(0x00000400)
+#define USN_REASON_SECURITY_CHANGE	const_cpu_to_le32(0x00000800)
+#define USN_REASON_RENAME_OLD_NAME	const_cpu_to_le32(0x00001000)
+#define USN_REASON_RENAME_NEW_NAME	const_cpu_to_le32(0x00002000)
+#define USN_REASON_INDEXABLE_CHANGE	const_cpu_to_le32(0x00004000)
+#define USN_REASON_BASIC_INFO_CHANGE	const_cpu_to_le32(0x00008000)
+#define USN_REASON_HARD_LINK_CHANGE	const_cpu_to_le32(0x00010000)
+#define USN_REASON_COMPRESSION_CHANGE	const_cpu_to_le32(0x00020000)
+#define USN_REASON_ENCRYPTION_CHANGE	const_cpu_to_le32(0x00040000)
+#define USN_REASON_OBJECT_ID_CHANGE	const_cpu_to_le32(0x00080000)
+#define USN_REASON_REPARSE_POINT_CHANGE	const_cpu_to_le32(0x00100000)
+#define USN_REASON_STREAM_CHANGE	const_cpu_to_le32(0x00200000)
+#define USN_REASON_CLOSE		const_cpu_to_le32(0x80000000)
+
+/**
+ * struct USN_JOURNAL_MAX - the named data stream $Max of FILE_Extend/$UsnJrnl
+ */
+typedef struct {
+/*  0*/	sle64 maximum_size;		/* Size of $J kept, in bytes. */
+/*  8*/	sle64 allocation_delta;		/* Growth beyond maximum_size before
+					   the beginning of $J is freed. */
+/* 16*/	le64 usn_journal_id;		/* Identifies this instance of the
+					   journal, usually its creation time. */
+/* 24*/	sle64 lowest_valid_usn;		/* Lowest usn of this instance. */
+} __attribute__((__packed__)) USN_JOURNAL_MAX;
+
+_Static_assert(sizeof(USN_JOURNAL_MAX) == 32, "Incorrect USN_JOURNAL_MAX size");
+
 #if defined(_MSC_VER)
 __pragma(pack(pop))
 #endif
@@ -47,5 +47,33 @@ extern int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count);
 extern int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn,
 		s64 count);
 
+extern int ntfs_cluster_count_free(ntfs_volume *vol, BOOL background);
+extern int ntfs_cluster_count_start(ntfs_volume *vol);
+extern void ntfs_cluster_count_stop(ntfs_volume *vol);
+extern BOOL ntfs_cluster_count_pending(ntfs_volume *vol);
+
+extern s64 ntfs_lcnbmp_pread(const ntfs_volume *vol, s64 pos, s64 count,
+		void *b);
+extern s64 ntfs_lcnbmp_pwrite(const ntfs_volume *vol, s64 pos, s64 count,
+		const void *b);
+extern int ntfs_lcnbmp_flush(ntfs_volume *vol, BOOL all);
+extern int ntfs_lcnbmp_flush_allocated(const ntfs_volume *vol);
+extern int ntfs_set_lcnbmp_writeback(ntfs_volume *vol, s64 size);
+extern int ntfs_cluster_discard_flush(ntfs_volume *vol, BOOL all);
+extern int ntfs_set_cluster_discard(ntfs_volume *vol, BOOL on);
+
+/**
+ * ntfs_free_extent_t - callback for ntfs_cluster_free_extents()
+ *
+ * Called in the order of the clusters for each extent of free clusters.
+ * Return zero to go on walking, a positive value to stop, or -1 with
+ * errno set to abort.
+ */
+typedef int (*ntfs_free_extent_t)(ntfs_volume *vol, LCN lcn, s64 count,
+		void *data);
+
+extern int ntfs_cluster_free_extents(ntfs_volume *vol, LCN start, s64 count,
+		s64 max_count, ntfs_free_extent_t callback, void *data);
+
 #endif /* defined _NTFS_LCNALLOC_H */
 
@@ -99,26 +99,39 @@ int ntfs_log_redirect(const char *function, const char *file, int line,
 #define NTFS_LOG_FLAG_FUNCTION	(1 << 3) /* Show the function name containing the message */
 #define NTFS_LOG_FLAG_ONLYNAME	(1 << 4) /* Only display the filename, not the pathname */
 
+/* Levels which are logged, zero while logging to the null handler */
+extern u32 ntfs_log_active_levels;
+
+/* Log a message, the level being checked before the arguments are
+ * evaluated, so that a skipped message costs no call.
+ */
+#define ntfs_log_at(level, ...) \
+	do { \
+		if (ntfs_log_active_levels & (level)) \
+			ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__, \
+					(level),NULL,__VA_ARGS__); \
+	} while (0)
+
 /* Macros to simplify logging.  One for each level defined above.
  * Note, ntfs_log_debug/trace have effect only if DEBUG is defined.
  */
-#define ntfs_log_critical(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_CRITICAL,NULL,__VA_ARGS__)
-#define ntfs_log_error(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_ERROR,NULL,__VA_ARGS__)
-#define ntfs_log_info(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_INFO,NULL,__VA_ARGS__)
-#define ntfs_log_perror(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_PERROR,NULL,__VA_ARGS__)
-#define ntfs_log_progress(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_PROGRESS,NULL,__VA_ARGS__)
-#define ntfs_log_quiet(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_QUIET,NULL,__VA_ARGS__)
-#define ntfs_log_verbose(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_VERBOSE,NULL,__VA_ARGS__)
-#define ntfs_log_warning(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_WARNING,NULL,__VA_ARGS__)
+#define ntfs_log_critical(...) ntfs_log_at(NTFS_LOG_LEVEL_CRITICAL, __VA_ARGS__)
+#define ntfs_log_error(...) ntfs_log_at(NTFS_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define ntfs_log_info(...) ntfs_log_at(NTFS_LOG_LEVEL_INFO, __VA_ARGS__)
+#define ntfs_log_perror(...) ntfs_log_at(NTFS_LOG_LEVEL_PERROR, __VA_ARGS__)
+#define ntfs_log_progress(...) ntfs_log_at(NTFS_LOG_LEVEL_PROGRESS, __VA_ARGS__)
+#define ntfs_log_quiet(...) ntfs_log_at(NTFS_LOG_LEVEL_QUIET, __VA_ARGS__)
+#define ntfs_log_verbose(...) ntfs_log_at(NTFS_LOG_LEVEL_VERBOSE, __VA_ARGS__)
+#define ntfs_log_warning(...) ntfs_log_at(NTFS_LOG_LEVEL_WARNING, __VA_ARGS__)
 
 /* By default debug and trace messages are compiled into the program,
  * but not displayed.
  */
 #ifdef ENABLE_DEBUG
-#define ntfs_log_debug(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_DEBUG,NULL,__VA_ARGS__)
-#define ntfs_log_trace(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_TRACE,NULL,__VA_ARGS__)
-#define ntfs_log_enter(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_ENTER,NULL,__VA_ARGS__)
-#define ntfs_log_leave(...) ntfs_log_redirect(__FUNCTION__,__FILE__,__LINE__,NTFS_LOG_LEVEL_LEAVE,NULL,__VA_ARGS__)
+#define ntfs_log_debug(...) ntfs_log_at(NTFS_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define ntfs_log_trace(...) ntfs_log_at(NTFS_LOG_LEVEL_TRACE, __VA_ARGS__)
+#define ntfs_log_enter(...) ntfs_log_at(NTFS_LOG_LEVEL_ENTER, __VA_ARGS__)
+#define ntfs_log_leave(...) ntfs_log_at(NTFS_LOG_LEVEL_LEAVE, __VA_ARGS__)
 #else
 #define ntfs_log_debug(...)do {} while (0)
 #define ntfs_log_trace(...)do {} while (0)
@@ -64,9 +64,18 @@ extern int ntfs_mft_record_check(const ntfs_volume *vol, const MFT_REF mref,
 extern int ntfs_file_record_read(const ntfs_volume *vol, const MFT_REF mref,
 		MFT_RECORD **mrec, ATTR_RECORD **attr);
 
+extern int ntfs_mft_records_prefetch(ntfs_volume *vol, const MFT_REF *mrefs,
+		int count);
+
 extern int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 		const s64 count, MFT_RECORD *b);
 
+extern int ntfs_mft_batch_begin(ntfs_volume *vol);
+extern int ntfs_mft_batch_end(ntfs_volume *vol);
+extern int ntfs_mft_writeback_flush(ntfs_volume *vol, BOOL all);
+extern int ntfs_set_mft_writeback(ntfs_volume *vol, int count);
+extern int ntfs_mft_freed_flush(ntfs_volume *vol, BOOL all);
+
 /**
  * ntfs_mft_record_write - write an mft record to disk
  * @vol:	volume to write to
@@ -130,5 +139,28 @@ extern int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni);
 
 extern int ntfs_mft_usn_dec(MFT_RECORD *mrec);
 
+#if CACHE_MFTREC_HASH
+
+struct CACHED_GENERIC;
+
+extern int ntfs_mft_record_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
+/**
+ * ntfs_mft_scan_t - callback for ntfs_mft_scan()
+ *
+ * Called in the order of the records for each valid mft record in use,
+ * with @mref including the sequence number. The record is a copy read
+ * ahead of the callback, it is not updated by the changes the callback
+ * makes to the mft. Return zero to go on scanning, a positive value to
+ * stop, or -1 with errno set to abort.
+ */
+typedef int (*ntfs_mft_scan_t)(ntfs_volume *vol, const MFT_REF mref,
+		MFT_RECORD *mrec, void *data);
+
+extern int ntfs_mft_scan(ntfs_volume *vol, int threads,
+		ntfs_mft_scan_t callback, void *data);
+
 #endif /* defined _NTFS_MFT_H */
 
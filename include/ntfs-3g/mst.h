@@ -33,5 +33,11 @@ extern int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 extern int ntfs_mst_pre_write_fixup(NTFS_RECORD *b, const u32 size);
 extern void ntfs_mst_post_write_fixup(NTFS_RECORD *b);
 
+extern int ntfs_mst_post_read_fixup_many(void *b, s64 count, const u32 size,
+					BOOL warn);
+extern s64 ntfs_mst_pre_write_fixup_many(void *b, s64 count, const u32 size);
+extern void ntfs_mst_post_write_fixup_many(void *b, s64 count,
+					const u32 size);
+
 #endif /* defined _NTFS_MST_H */
 
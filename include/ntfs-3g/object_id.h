@@ -31,5 +31,6 @@ int ntfs_set_ntfs_object_id(ntfs_inode *ni, const char *value,
 int ntfs_remove_ntfs_object_id(ntfs_inode *ni);
 
 int ntfs_delete_object_id_index(ntfs_inode *ni);
+int ntfs_close_object_id_index(ntfs_volume *vol);
 
 #endif /* OBJECT_ID_H */
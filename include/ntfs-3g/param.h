@@ -22,11 +22,27 @@
 #ifndef _NTFS_PARAM_H
 #define _NTFS_PARAM_H
 
-#define CACHE_INODE_SIZE 32	/* inode cache, zero or >= 3 and not too big */
-#define CACHE_NIDATA_SIZE 64	/* idata cache, zero or >= 3 and not too big */
-#define CACHE_LOOKUP_SIZE 64	/* lookup cache, zero or >= 3 and not too big */
-#define CACHE_SECURID_SIZE 16    /* securid cache, zero or >= 3 and not too big */
-#define CACHE_LEGACY_SIZE 8    /* legacy cache size, zero or >= 3 and not too big */
+	/* default cache sizes, may be changed by ntfs_set_cache_size() */
+#define CACHE_INODE_SIZE 256	/* inode cache, zero or >= 3 */
+#define CACHE_NIDATA_SIZE 64	/* idata cache, zero or >= 3 */
+#define CACHE_LOOKUP_SIZE 64	/* lookup cache, zero or >= 3 */
+#define CACHE_SECURID_SIZE 16    /* securid cache, >= 3 */
+#define CACHE_LEGACY_SIZE 8    /* legacy cache size, zero or >= 3 */
+#define CACHE_SECURDESC_SIZE 256 /* security descriptors cache, zero or >= 3 */
+#define CACHE_INHERIT_SIZE 32	/* inherited securid cache, zero or >= 3 */
+#define CACHE_SDH_SIZE 32	/* descriptor to securid cache, zero or >= 3 */
+#define CACHE_TRAVERSE_SIZE 64	/* searchable directories cache, zero or >= 3 */
+#define CACHE_GROUPS_SIZE 16	/* groups of threads cache, zero or >= 3 */
+#define CACHE_CBLOCK_SIZE 32	/* decompressed blocks cache, zero or >= 3 */
+#define CACHE_MFTREC_HASH 16384	/* mft records cache hash, zero or power of 2 */
+#define CACHE_INDEX_HASH 4096	/* index blocks cache hash, zero or power of 2 */
+#define CACHE_LISTING_SIZE 8	/* directory listings cache, zero or >= 3 */
+#define CACHE_SYMLINK_SIZE 64	/* symlink targets cache, zero or >= 3 */
+#define CACHE_EA_SIZE 32	/* extended attributes cache, zero or >= 3 */
+#define CACHE_STREAMS_SIZE 64	/* stream names cache, zero or >= 3 */
+#define CACHE_STAT_SIZE 256	/* computed stats cache, zero or >= 3 */
+
+#define EFS_RAW_CHUNK 1048576	/* bytes per raw transfer of encrypted files */
 
 #define FORCE_FORMAT_v1x 0	/* Insert security data as in NTFS v1.x */
 #define OWNERFROMACL 1		/* Get the owner from ACL (not Windows owner) */
@@ -56,6 +72,16 @@ enum {
 #define STANDARD_COMPRESSION_UNIT 4
 	/* maximum cluster size for allowing compression for new files */
 #define MAX_COMPRESSION_CLUSTER_SIZE 4096
+	/* one byte sampled out of this count to detect random data */
+#define COMPRESS_SAMPLE_STEP 16
+	/* fewer sampled bytes are not significant */
+#define COMPRESS_MIN_SAMPLES 256
+	/* random if two sampled bytes are equal less than once per ratio */
+#define COMPRESS_RANDOM_RATIO 232
+	/* successive blocks not compressed before skipping some */
+#define COMPRESS_BACKOFF_FAILS 4
+	/* max successive blocks skipped, power of 2 */
+#define COMPRESS_BACKOFF_MAX 64
 
 /*
  *		Parameters for default options
@@ -72,9 +98,14 @@ enum {
  *	number of chunks (capacity/(32768*clsiz)) is less than the number
  *	of clusters in the biggest write buffer (131072/clsiz). Hence
  *	a safe minimal capacity is 4GB
+ *
+ *	The same applies to bigger requests (option max_pages) : writes
+ *	of n bytes are safe on volumes of at least 32768*n bytes, so
+ *	1MB writes need 32GB.
  */
 
 #define SAFE_CAPACITY_FOR_BIG_WRITES 0x100000000LL
+#define SAFE_CAPACITY_PER_WRITE_BYTE 32768
 
 /*
  *		Parameters for runlists
@@ -83,6 +114,453 @@ enum {
 	/* only update the final extent of a runlist when appending data */
 #define PARTIAL_RUNLIST_UPDATING 1
 
+/*
+ *		Parameters for the device block cache
+ *
+ *	The blocks are spread over shards according to their position,
+ *	each shard having its own LRU list and hash table. Requests
+ *	bigger than BLOCK_CACHE_MAX_REQUEST are not cached (file data
+ *	being streamed), but are kept consistent with cached blocks.
+ */
+
+#define BLOCK_CACHE_SHARDS 8	/* number of shards */
+#define BLOCK_CACHE_HASH 256	/* hash table size in each shard */
+#define BLOCK_CACHE_MAX_BLOCK 65536 /* max block size */
+#define BLOCK_CACHE_MAX_REQUEST 65536 /* max size of cached requests */
+#define BLOCK_CACHE_SCAN 8	/* old blocks scanned for a clean one */
+#define BLOCK_CACHE_UEFI_SIZE 4194304 /* total cache size for the UEFI driver */
+#define BLOCK_CACHE_UEFI_MIN 1048576 /* min cache size of a UEFI volume */
+
+/*
+ *		Parameters for the read-ahead of sequential reads
+ *
+ *	When reads of an attribute are sequential, the data which follows
+ *	is read ahead into the block cache, with a window doubling on
+ *	each sequential read, up to a quarter of the cache size.
+ */
+
+#define READAHEAD_MIN_WINDOW 131072	/* initial read-ahead size */
+#define READAHEAD_MAX_WINDOW 2097152	/* max read-ahead size */
+
+/*
+ *		Parameters for mapping read-only image files
+ *
+ *	An image file opened read-only is mapped into memory, so that its
+ *	data is read from the page cache of the kernel with no system call,
+ *	and can be used in place by the readers which accept it.
+ */
+
+#define MMAP_READONLY 1		/* map the read-only image files */
+
+/*
+ *		Parameters for the Windows device
+ *
+ *	The unaligned transfers go through aligned bounce buffers, a few
+ *	of which are kept for reuse. When overlapped i/o is selected, the
+ *	aligned segments of a batched transfer are all submitted before
+ *	waiting for their completion.
+ */
+
+#define WIN32_OVERLAPPED_IO 1	/* use overlapped i/o on devices and files */
+#define WIN32_BOUNCE_BUFFERS 4	/* number of bounce buffers kept */
+#define WIN32_BOUNCE_SIZE 65536	/* size of the bounce buffers kept */
+
+/*
+ *		Parameters for reading data in place
+ *
+ *	The data of a read which is found in the block cache is not
+ *	copied into the read buffer, it is replied to fuse directly from
+ *	the cache, the reply being made of READ_MAP_FRAGMENTS fragments
+ *	at most.
+ */
+
+#define READ_MAP_FRAGMENTS 64	/* max fragments of a read reply */
+
+/*
+ *		Parameters for compressing and decompressing in parallel
+ *
+ *	When a pool of compression threads has been created for a
+ *	volume, the compression blocks of a big read are decompressed by
+ *	the pool, while the next ones are being read from the device.
+ *	Up to DECOMPRESS_JOBS_PER_THREAD blocks per thread are in flight.
+ *	When writing, the sub-blocks of a compression block are
+ *	compressed by the pool.
+ */
+
+#define COMPRESS_MAX_THREADS 16		/* max threads in a pool */
+#define DECOMPRESS_JOBS_PER_THREAD 2	/* blocks in flight per thread */
+
+/*
+ *		Parameters for reading system compressed files
+ *
+ *	The chunks of the files compressed by the Windows Overlay Filter
+ *	are read and decompressed by batches of WOF_BATCH_SIZE bytes of
+ *	uncompressed data, the chunks of a batch being decompressed by
+ *	the pool of compression threads if there is one.
+ */
+
+#define WOF_BATCH_SIZE 131072	/* uncompressed bytes per batch */
+
+/*
+ *		Parameters for scanning the whole MFT
+ *
+ *	The MFT is read by batches of MFT_SCAN_RECORDS records (a multiple
+ *	of 8), skipping the records free in $MFT/$Bitmap, and the fixups
+ *	of a batch are applied by slices of MFT_SCAN_SLICE records, by
+ *	a pool of threads when requested.
+ */
+
+#define MFT_SCAN_RECORDS 1024		/* records read at once */
+#define MFT_SCAN_SLICE 64		/* records fixed up by a thread at once */
+#define MFT_SCAN_MAX_THREADS 16		/* max threads fixing up */
+
+/*
+ *		Parameters for allocating clusters
+ *
+ *	The free clusters are counted by chunks of $Bitmap when first
+ *	allocating, reading LCN_SUMMARY_READ_SIZE bytes of $Bitmap at
+ *	once, so that the allocator can skip the full chunks.
+ */
+
+#define LCN_SUMMARY_READ_SIZE 65536	/* bitmap bytes read at once */
+
+/*
+ *		Parameters for counting the free clusters
+ *
+ *	When requested, the free clusters of a volume whose $Bitmap is
+ *	at least LCN_COUNT_BACKGROUND_MIN bytes are estimated from
+ *	LCN_COUNT_SAMPLES samples, then counted by a thread, reading
+ *	LCN_COUNT_SLICE bytes at once with allocations locked out.
+ */
+
+#define LCN_COUNT_BACKGROUND_MIN 4194304 /* 32M clusters */
+#define LCN_COUNT_SAMPLES 16
+#define LCN_COUNT_SAMPLE_SIZE 4096	/* bitmap bytes per sample */
+#define LCN_COUNT_SLICE 262144		/* bitmap bytes counted at once */
+
+/*
+ *		Parameters for the allocation streams
+ *
+ *	The goals of the LCN_MAX_STREAMS most recent streams of allocations
+ *	are recorded, and the allocations which do not extend a stream
+ *	are not started in the room left for another stream to grow,
+ *	as big as the stream, bounded by LCN_STREAM_ROOM_MAX clusters.
+ */
+
+#define LCN_MAX_STREAMS 16
+#define LCN_STREAM_ROOM_MAX 262144	/* clusters */
+
+/*
+ *		Parameters for delaying the writing of $Bitmap
+ *
+ *	When set up, the modified pages of $Bitmap are kept in memory,
+ *	those showing clusters as allocated are written before the next
+ *	mft record, the other ones when the volume is synced or unmounted,
+ *	when there is no more room for them, or when a page has been dirty
+ *	for LCN_WRITEBACK_DELAY seconds. Up to LCN_WRITEBACK_RUN adjacent
+ *	pages are written at once.
+ */
+
+#define LCN_WRITEBACK_DELAY 30		/* seconds before writing */
+#define LCN_WRITEBACK_RUN 64		/* pages written at once */
+
+/*
+ *		Parameters for discarding the freed clusters
+ *
+ *	When requested, the runs of clusters freed are kept allocated in
+ *	$Bitmap and gathered for LCN_DISCARD_DELAY seconds, then kept for
+ *	as long again, so that the metadata which freed them has been
+ *	written, before being discarded by a thread, at most
+ *	LCN_DISCARD_BATCH ranges at a time. They are released when their
+ *	discard is complete.
+ */
+
+#define LCN_DISCARD_DELAY 60		/* seconds before discarding */
+#define LCN_DISCARD_BATCH 16		/* ranges discarded at once */
+
+/*
+ *		Parameters for preallocating when appending
+ *
+ *	When requested, the clusters preallocated ahead of the data of
+ *	files being appended to are recorded for at most
+ *	PREALLOC_MAX_WINDOWS files at a time, so that they can be released
+ *	when the files are closed. Other files are not preallocated.
+ */
+
+#define PREALLOC_MAX_WINDOWS 64
+
+/*
+ *		Parameters for gathering small appends
+ *
+ *	When requested for an open attribute, the small writes which
+ *	append to its data are gathered into a buffer, and written at once
+ *	when APPEND_BUFFER_SIZE bytes (rounded up to a cluster multiple)
+ *	are gathered, or when the attribute is read, truncated, flushed
+ *	or closed.
+ */
+
+#define APPEND_BUFFER_SIZE 65536	/* default bytes gathered */
+
+/*
+ *		Parameters for zeroing the data beyond the initialized size
+ *
+ *	When writing beyond the initialized size of a file, the gap is
+ *	zeroed. The clusters not allocated are left as holes, and the
+ *	allocated ones are zeroed by the device, without transferring
+ *	buffers, when at least ZEROOUT_MIN bytes are contiguous.
+ */
+
+#define ZEROOUT_MIN 1048576		/* min bytes zeroed by the device */
+
+/*
+ *	The end of a write at the end of the data, or into clusters
+ *	which were a hole, is padded with zeroes to a multiple of
+ *	ZERO_PAD_SIZE bytes (or of the cluster size if smaller), so that
+ *	the device does not have to read the end of a page. The rest of
+ *	ex-sparse clusters is zeroed like the gaps, so that on volumes
+ *	with big clusters a small write does not transfer a full cluster.
+ */
+
+#define ZERO_PAD_SIZE 4096		/* bytes of zero padding unit */
+
+/*
+ *		Parameters for allocating mft records
+ *
+ *	Up to MFT_FREE_CACHE_SIZE free records are collected at once from
+ *	$MFT/$Bitmap. When at least MFT_BURST_RECORDS records are allocated
+ *	in a second, $MFT is extended to a multiple of MFT_BURST_EXTEND
+ *	records (a power of 2), and up to MFT_BURST_FORMAT records are
+ *	formatted and written at once.
+ */
+
+#define MFT_FREE_CACHE_SIZE 256		/* free records collected at once */
+#define MFT_BURST_RECORDS 64		/* records per second in a burst */
+#define MFT_BURST_EXTEND 4096		/* records allocated at once */
+#define MFT_BURST_FORMAT 64		/* records formatted at once */
+
+/*
+ *		Parameters for reusing freed mft records
+ *
+ *	Up to MFT_FREED_RECORDS freed records are kept allocated in
+ *	$MFT/$Bitmap, and written as free when they are not reused within
+ *	MFT_FREED_DELAY seconds.
+ */
+
+#define MFT_FREED_RECORDS 16		/* freed records kept at once */
+#define MFT_FREED_DELAY 30		/* seconds before writing */
+
+/*
+ *		Parameters for prefetching mft records
+ *
+ *	When a list of records is about to be opened (the entries of a
+ *	directory index block), the records are read into the block cache
+ *	beforehand, merging into a single read the records separated by
+ *	at most MFT_PREFETCH_GAP free or unwanted records.
+ */
+
+#define MFT_PREFETCH_GAP 4		/* records skipped within a read */
+
+/*
+ *		Parameters for searching in index nodes
+ *
+ *	The entries of an index node are located by chunks, and the key
+ *	is searched by dichotomy within a chunk. A 4096 byte block of
+ *	short file names holds up to about 50 entries.
+ */
+
+#define INDEX_SEARCH_CHUNK 128		/* entries located at once */
+
+/*
+ *		Parameters for building indexes bottom-up
+ *
+ *	When a directory index is built from a whole list of filenames,
+ *	the index blocks are filled up to INDEX_BUILD_FILL percent by
+ *	default, leaving room for a few insertions before blocks have to
+ *	be split.
+ */
+
+#define INDEX_BUILD_FILL 90		/* default percentage filled */
+#define INDEX_BUILD_MIN_FILL 50		/* min percentage filled */
+
+/*
+ *		Parameters for caching directory listings
+ *
+ *	The full listings of directories are kept in memory until the
+ *	directories are modified, except those taking more than
+ *	LISTING_CACHE_MAX_SIZE bytes (about 100 bytes per entry with
+ *	short names).
+ */
+
+#define LISTING_CACHE_MAX_SIZE 1048576	/* max bytes per cached listing */
+
+/*
+ *		Parameters for delaying the writing of index blocks
+ *
+ *	When set up, the modified blocks of directory indexes are kept
+ *	in memory, and written when the volume is synced or unmounted,
+ *	when there is no more room for them, or when a block which has
+ *	been dirty for INDEX_WRITEBACK_DELAY seconds is modified again.
+ */
+
+#define INDEX_WRITEBACK_HASH 256	/* hash table size, a power of 2 */
+#define INDEX_WRITEBACK_DELAY 30	/* seconds before writing */
+
+/*
+ *		Parameters for removing directory entries lazily
+ *
+ *	When set up, the entries of deleted files are recorded, and
+ *	only removed from a directory when it is updated otherwise,
+ *	when there is no more room for recording them, or when it has
+ *	not been updated for INDEX_LAZY_DELAY seconds. The hash table
+ *	is sized to about a quarter of the entries which can be recorded.
+ */
+
+#define INDEX_LAZY_DELAY 30		/* seconds before removing */
+#define INDEX_LAZY_MIN_HASH 256		/* min hash table size */
+#define INDEX_LAZY_MAX_HASH 262144	/* max hash table size */
+
+/*
+ *		Parameters for updating the copies of file names in directories
+ *
+ *	The access time recorded in the directories is not updated when
+ *	a file is only read, unless it lags by FN_ATIME_DELAY seconds,
+ *	which is what Windows does.
+ */
+
+#define FN_ATIME_DELAY 3600		/* seconds the access time may lag */
+
+/*
+ *		Parameters for delaying the writing of inodes
+ *
+ *	When set up, the modified inodes are kept in memory when closed,
+ *	so that the updates of their times, sizes and attributes by
+ *	successive requests are written once, with the copies of the
+ *	file names in the parent directories. They are written in mft
+ *	order when the volume is synced or unmounted, and when they have
+ *	been kept modified for INODE_WRITEBACK_DELAY seconds.
+ *	This relies on the inode cache, for reopening the inodes in
+ *	their latest state.
+ */
+
+#define INODE_WRITEBACK_HASH 256	/* hash table size, a power of 2 */
+#define INODE_WRITEBACK_DELAY 30	/* seconds before writing */
+
+/*
+ *		Parameters for grouping the writes of mft records
+ *
+ *	When flushing the delayed metadata, the mft records are kept in
+ *	memory, and written in order of record numbers, adjacent ones
+ *	together, when the flush completes or when MFT_BATCH_RECORDS
+ *	records are pending.
+ *	When the write-back of mft records is set up, they are kept this
+ *	way between flushes, and written when they have been pending for
+ *	MFT_WRITEBACK_DELAY seconds, at most MFT_BATCH_RECORDS at once.
+ */
+
+#define MFT_BATCH_RECORDS 64		/* records kept before writing */
+#define MFT_WRITEBACK_DELAY 30		/* seconds before writing */
+
+/*
+ *		Parameters for reusing the released objects
+ *
+ *	Up to SPARE_INODES inodes of each volume, with the buffer for their
+ *	mft record lying next to them, and up to SPARE_ATTRS attribute
+ *	handles and SPARE_SEARCH_CTXS search contexts are kept when
+ *	released, for being reused without calling the allocator.
+ */
+
+#define SPARE_INODES 64			/* inodes kept per volume */
+#define SPARE_ATTRS 64			/* attribute handles kept */
+#define SPARE_SEARCH_CTXS 32		/* search contexts kept */
+
+/*
+ *		Parameters for the table of attribute offsets
+ *
+ *	The offsets in the base record of an inode of the last
+ *	ATTR_OFFSETS_COUNT attributes looked up by type and name, found
+ *	or not, are kept with the inode. Names longer than
+ *	ATTR_OFFSETS_NAME_LEN characters are not kept.
+ */
+
+#define ATTR_OFFSETS_COUNT 8		/* attributes kept per inode */
+#define ATTR_OFFSETS_NAME_LEN 16	/* max length of names kept */
+
+/*
+ *		Parameters for the memory budget of the caches
+ *
+ *	When the memory used by the caches of a volume exceeds its
+ *	budget, at least CACHE_TRIM_MIN bytes are released at once from
+ *	the cache chosen. On memory pressure, the usage is brought down
+ *	to CACHE_PRESSURE_PERCENT percent of the budget, or of the
+ *	current usage when there is no budget.
+ */
+
+#define CACHE_TRIM_MIN 65536		/* min bytes released at once */
+#define CACHE_PRESSURE_PERCENT 50	/* usage kept on memory pressure */
+
+/*
+ *		Parameters for the performance counters
+ *
+ *	When enabled, the latencies of the requests are recorded for
+ *	up to NTFS_STATS_OPS request codes, in NTFS_STATS_BUCKETS ranges
+ *	of increasing powers of two microseconds.
+ */
+
+#define NTFS_STATS_OPS 64		/* request codes recorded */
+#define NTFS_STATS_BUCKETS 24		/* latency ranges, up to 8s */
+#define NTFS_STATS_REPORT_SLACK 1024	/* growth allowed in the report */
+
+/*
+ *		Parameters for tracing the device transfers
+ *
+ *	The ring of transfers holds at most NTFS_TRACE_MAX_RECORDS
+ *	records, and at most NTFS_TRACE_FETCH_MAX bytes are fetched at
+ *	once, which is the biggest extended attribute Linux accepts.
+ */
+
+#define NTFS_TRACE_MAX_RECORDS 1048576	/* records in the ring */
+#define NTFS_TRACE_FETCH_MAX 65536	/* bytes fetched at once */
+
+/*
+ *		Parameters for prefetching the data read after mounting
+ *
+ *	The device ranges read during the first PREFETCH_RECORD_TIME
+ *	seconds after mounting are recorded, up to PREFETCH_MAX_RANGES
+ *	ranges, and the ranges less than PREFETCH_MERGE_GAP bytes apart
+ *	are merged when saved. When replaying without a block cache, at
+ *	most PREFETCH_MAX_BYTES are read, by chunks of PREFETCH_CHUNK.
+ */
+
+#define PREFETCH_RECORD_TIME 60		/* seconds recorded */
+#define PREFETCH_MAX_RANGES 16384	/* ranges recorded */
+#define PREFETCH_MERGE_GAP 65536	/* max gap between merged ranges */
+#define PREFETCH_MAX_BYTES 268435456	/* max bytes read, without cache */
+#define PREFETCH_CHUNK 1048576		/* bytes read at once */
+
+/*
+ *		Parameters for compacting the runlists of big attributes
+ *
+ *	When more runs than RUNLIST_COMPACT_THRESHOLD get mapped for an
+ *	attribute which is not being modified, its runlist is kept in a
+ *	compact encoding, and only a window of runs is decoded on demand.
+ *	Only done on volumes set up by ntfs_set_compact_runlists().
+ */
+
+#define RUNLIST_COMPACT_THRESHOLD 65536 /* runs mapped before compacting */
+#define RUNLIST_COMPACT_BLOCK 64	/* runs per entry of the skip index */
+#define RUNLIST_COMPACT_WINDOW 1024	/* runs decoded on each mapping */
+
+/*
+ *		Parameters for indexing attribute lists
+ *
+ *	When an attribute list has at least ATTRLIST_INDEX_MIN entries,
+ *	the offsets of its entries are indexed by attribute type and name
+ *	on the first lookup, so that the entry covering a vcn is found
+ *	by a binary search. Shorter lists are just scanned.
+ */
+
+#define ATTRLIST_INDEX_MIN 32		/* entries needed for indexing */
+
 /*
  *		Parameters for upper-case table
  */
@@ -93,9 +571,35 @@ enum {
 
 /*
  *		Parameters for user and xattr mappings
+ *
+ *	The user and group mappings having at least MAPPING_INDEX_MIN
+ *	items are indexed by hash tables keyed by SID and by uid or gid.
  */
 
 #define XATTRMAPPINGFILE ".NTFS-3G/XattrMapping" /* default mapping file */
+#define MAPPING_INDEX_MIN 8	/* items for indexing a mapping */
+
+/*
+ *		Parameters for the cache of searchable directories
+ *
+ *	Search permissions granted to a thread on a directory are kept
+ *	for TRAVERSE_CACHE_TIMEOUT seconds, as the groups of the thread
+ *	may change without notice. The kernel keeps the directory entries
+ *	for a similar duration.
+ */
+
+#define TRAVERSE_CACHE_TIMEOUT 1	/* seconds */
+
+/*
+ *		Parameters for the cache of groups of threads
+ *
+ *	The supplementary groups of a thread read from /proc are kept
+ *	for GROUPS_CACHE_TIMEOUT seconds, and only when there are no more
+ *	than GROUPS_CACHE_MAX of them.
+ */
+
+#define GROUPS_CACHE_TIMEOUT 1		/* seconds */
+#define GROUPS_CACHE_MAX 64		/* groups per thread */
 
 /*
  *		Parameters for path canonicalization
@@ -160,4 +664,55 @@ enum {
 #define LPERMSCONFIG 3
 #endif /* defined(__sun) && defined(__SVR4) */
 
+/*
+ *		Parameters for relocating fragmented attributes
+ *
+ *	The clusters are gathered from the runs into a buffer of
+ *	DEFRAG_COPY_SIZE bytes, a multiple of the biggest cluster size,
+ *	which is written at once to the new location.
+ */
+
+#define DEFRAG_COPY_SIZE 4194304	/* bytes copied at once */
+
+/*
+ *		Parameters for the asynchronous reads
+ *
+ *	The device segments of the reads submitted are transferred by
+ *	AIO_DEFAULT_THREADS threads unless another count is requested,
+ *	at most AIO_MAX_THREADS, so that as many reads are in flight.
+ */
+
+#define AIO_DEFAULT_THREADS 4		/* threads transferring the data */
+#define AIO_MAX_THREADS 32		/* max threads in a queue */
+
+/*
+ *		Parameters for the change journal
+ *
+ *	The records of the changes are gathered in memory and appended to
+ *	$UsnJrnl:$J when the metadata is flushed, once USN_BATCH_SIZE
+ *	bytes are gathered or the oldest one has waited for
+ *	USN_WRITEBACK_DELAY seconds. The reasons of the changes to at most
+ *	USN_PENDING_FILES files are accumulated, the records which close
+ *	them being gathered when more files are changed. The journals
+ *	created by ntfsusn are kept to USN_DEFAULT_MAX_SIZE bytes, the
+ *	older records being freed by USN_DEFAULT_DELTA bytes.
+ */
+
+#define USN_BATCH_SIZE 65536		/* bytes gathered before writing */
+#define USN_WRITEBACK_DELAY 30		/* seconds before writing */
+#define USN_PENDING_FILES 1024		/* files with accumulated reasons */
+#define USN_DEFAULT_MAX_SIZE 33554432	/* size of a new journal */
+#define USN_DEFAULT_DELTA 8388608	/* bytes freed at once */
+
+/*
+ *		Parameters for the memory allocator of the UEFI driver
+ *
+ *	The blocks up to 1 << UEFI_SLAB_MAX_SHIFT bytes, header included,
+ *	are allocated from slabs of UEFI_SLAB_PAGES pages.
+ */
+
+#define UEFI_SLAB_MIN_SHIFT 5 /* smallest block : 32 bytes */
+#define UEFI_SLAB_MAX_SHIFT 11 /* largest block : 2048 bytes */
+#define UEFI_SLAB_PAGES 16 /* pages per slab */
+
 #endif /* defined _NTFS_PARAM_H */
@@ -0,0 +1,31 @@
+/*
+ * prefetch.h - Exports for prefetching the data read after mounting.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_PREFETCH_H
+#define _NTFS_PREFETCH_H
+
+#include "types.h"
+#include "volume.h"
+#include "device.h"
+
+extern int ntfs_prefetch_start(ntfs_volume *vol, const char *path);
+extern void ntfs_prefetch_stop(ntfs_volume *vol);
+extern void ntfs_prefetch_io(struct ntfs_device *dev, s64 pos, s64 count);
+
+#endif /* defined _NTFS_PREFETCH_H */
@@ -0,0 +1,74 @@
+/*
+ * probes.h - Static tracepoints for profiling the library.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_PROBES_H
+#define _NTFS_PROBES_H
+
+/*
+ *	When configured with --enable-usdt, the library defines static
+ *	tracepoints (USDT probes) of provider "ntfs3g", which can be used
+ *	by bpftrace, perf or SystemTap on a running mount, for instance:
+ *
+ *	bpftrace -e 'usdt:/usr/lib/libntfs-3g.so:ntfs3g:attr_pread_entry
+ *		{ @[ustack] = count(); }'
+ *
+ *	A probe is a no-op instruction when not traced, and it is not
+ *	compiled at all by default.
+ *
+ *	   probe			arguments
+ *
+ *	inode_open_entry		inode number
+ *	inode_open_return		inode number, inode (NULL if failed)
+ *	attr_pread_entry		inode number, type, position, count
+ *	attr_pread_return		inode number, type, bytes read or -1
+ *	attr_pwrite_entry		inode number, type, position, count
+ *	attr_pwrite_return		inode number, type, bytes written or -1
+ *	compressed_pread_entry		inode number, type, position, count
+ *	compressed_pread_return		inode number, type, bytes read or -1
+ *	index_lookup_entry		inode number, key length
+ *	index_lookup_return		inode number, 0 if found or -1
+ *	cluster_alloc_entry		count, start lcn, zone
+ *	cluster_alloc_return		count, runlist (NULL if failed)
+ *	mft_record_alloc_entry		base inode number, -1 for a base
+ *	mft_record_alloc_return		inode number, -1 if failed
+ *	readdir_entry			inode number, position
+ *	readdir_return			inode number, 0 or -1
+ *	cache_hit			cache name (a string)
+ *	cache_miss			cache name (a string)
+ */
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define NTFS_PROBE1(name, a) DTRACE_PROBE1(ntfs3g, name, a)
+#define NTFS_PROBE2(name, a, b) DTRACE_PROBE2(ntfs3g, name, a, b)
+#define NTFS_PROBE3(name, a, b, c) DTRACE_PROBE3(ntfs3g, name, a, b, c)
+#define NTFS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(ntfs3g, name, a, b, c, d)
+
+#else /* ENABLE_USDT */
+
+#define NTFS_PROBE1(name, a) do { } while (0)
+#define NTFS_PROBE2(name, a, b) do { } while (0)
+#define NTFS_PROBE3(name, a, b, c) do { } while (0)
+#define NTFS_PROBE4(name, a, b, c, d) do { } while (0)
+
+#endif /* ENABLE_USDT */
+
+#endif /* defined _NTFS_PROBES_H */
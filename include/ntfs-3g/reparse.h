@@ -26,6 +26,11 @@
 
 char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point);
 
+struct CACHED_GENERIC;
+
+int ntfs_reparse_symlink_hash(const struct CACHED_GENERIC *cached);
+void ntfs_reparse_symlink_forget(ntfs_inode *ni);
+
 BOOL ntfs_possible_symlink(ntfs_inode *ni);
 
 int ntfs_get_ntfs_reparse_data(ntfs_inode *ni, char *value, size_t size);
@@ -47,5 +52,6 @@ int ntfs_set_ntfs_reparse_data(ntfs_inode *ni, const char *value,
 int ntfs_remove_ntfs_reparse_data(ntfs_inode *ni);
 
 int ntfs_delete_reparse_index(ntfs_inode *ni);
+int ntfs_close_reparse_index(ntfs_volume *vol);
 
 #endif /* REPARSE_H */
@@ -61,6 +61,8 @@ extern s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 
 extern runlist_element *ntfs_runlists_merge(runlist_element *drl,
 		runlist_element *srl);
+extern runlist_element *ntfs_runlists_merge_tail(runlist_element *drl,
+		int *pcount, runlist_element *srl);
 
 extern runlist_element *ntfs_mapping_pairs_decompress(const ntfs_volume *vol,
 		const ATTR_RECORD *attr, runlist_element *old_rl);
@@ -69,6 +71,9 @@ extern int ntfs_get_nr_significant_bytes(const s64 n);
 
 extern int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		const runlist_element *rl, const VCN start_vcn, int max_size);
+extern int ntfs_get_size_for_mapping_pairs_range(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn,
+		const VCN last_vcn, int max_size);
 
 extern int ntfs_write_significant_bytes(u8 *dst, const u8 *dst_max,
 		const s64 n);
@@ -76,12 +81,53 @@ extern int ntfs_write_significant_bytes(u8 *dst, const u8 *dst_max,
 extern int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		const int dst_len, const runlist_element *rl,
 		const VCN start_vcn, runlist_element const **stop_rl);
+extern int ntfs_mapping_pairs_build_range(const ntfs_volume *vol, u8 *dst,
+		const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, const VCN last_vcn,
+		runlist_element const **stop_rl, VCN *stop_vcn);
 
 extern int ntfs_rl_truncate(runlist **arl, const VCN start_vcn);
 
 extern int ntfs_rl_sparse(runlist *rl);
 extern s64 ntfs_rl_get_compressed_size(ntfs_volume *vol, runlist *rl);
 
+/*
+ *		Compact copy of a complete runlist
+ *
+ *	Each run is stored as the variable-length encoded length and
+ *	difference to the previous lcn, much like in mapping pairs.
+ *	The skip index records where each group of RUNLIST_COMPACT_BLOCK
+ *	runs begins, so that a part of the runlist can be decoded without
+ *	going through the runs before it.
+ */
+
+struct RUNLIST_SKIP {
+	VCN vcn;		/* vcn of the first run of the group */
+	LCN lcn;		/* lcn the first difference relates to */
+	u32 offset;		/* offset of the group in data[] */
+} ;
+
+struct RUNLIST_COMPACT {
+	int count;		/* number of runs */
+	int max_blocks;		/* allocated entries in skip[] */
+	u32 size;		/* bytes used in data[] */
+	u32 allocated;		/* bytes allocated to data[] */
+	VCN end_vcn;		/* vcn of the terminator */
+	LCN end_lcn;		/* lcn of the terminator */
+	LCN last_lcn;		/* lcn the next difference relates to */
+	struct RUNLIST_SKIP *skip;
+	u8 *data;
+} ;
+
+extern struct RUNLIST_COMPACT *ntfs_rl_compact_alloc(void);
+extern int ntfs_rl_compact_append(struct RUNLIST_COMPACT *crl,
+		const runlist_element *rl);
+extern runlist_element *ntfs_rl_compact_decode(
+		const struct RUNLIST_COMPACT *crl, VCN vcn, int max_runs);
+extern LCN ntfs_rl_compact_vcn_to_lcn(const struct RUNLIST_COMPACT *crl,
+		VCN vcn);
+extern void ntfs_rl_compact_free(struct RUNLIST_COMPACT *crl);
+
 #ifdef NTFS_TEST
 int test_rl_main(int argc, char *argv[]);
 #endif
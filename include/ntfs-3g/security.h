@@ -39,12 +39,15 @@
  *          item in the mapping list
  */
 
+struct MAPPING_INDEX;
+
 struct MAPPING {
 	struct MAPPING *next;
 	int xid;		/* linux id : uid or gid */
 	SID *sid;		/* Windows id : usid or gsid */
 	int grcnt;		/* group count (for users only) */
 	gid_t *groups;		/* groups which the user is member of */
+	struct MAPPING_INDEX *index; /* hashed lookups, first item only */
 };
 
 /*
@@ -95,6 +98,82 @@ struct CACHED_SECURID {
 	le32 securid;
 } ;
 
+/*
+ *	Entry in the security descriptor cache
+ */
+
+struct CACHED_SECURDESC {
+	struct CACHED_SECURDESC *next;
+	struct CACHED_SECURDESC *previous;
+	char *securattr;	/* descriptor, as stored in $SDS */
+	size_t attrsz;
+		/* above fields must match "struct CACHED_GENERIC" */
+	le32 securid;
+} ;
+
+/*
+ *	Entry in the cache of securids inherited from a parent directory
+ */
+
+struct CACHED_INHERIT {
+	struct CACHED_INHERIT *next;
+	struct CACHED_INHERIT *previous;
+	void *variable;
+	size_t varsize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	le32 parentid;		/* securid of the parent directory */
+	uid_t uid;		/* creator */
+	gid_t gid;
+	BOOL fordir;
+	le32 securid;		/* securid inherited */
+} ;
+
+/*
+ *	Entry in the cache of descriptors found or entered in $SDH
+ */
+
+struct CACHED_SDH {
+	struct CACHED_SDH *next;
+	struct CACHED_SDH *previous;
+	char *securattr;	/* full descriptor */
+	size_t attrsz;
+		/* above fields must match "struct CACHED_GENERIC" */
+	le32 hash;		/* hash as in $SDH */
+	le32 securid;
+} ;
+
+/*
+ *	Entry in the cache of directories found searchable
+ */
+
+struct CACHED_TRAVERSE {
+	struct CACHED_TRAVERSE *next;
+	struct CACHED_TRAVERSE *previous;
+	void *variable;
+	size_t varsize;
+		/* above fields must match "struct CACHED_GENERIC" */
+	le32 securid;		/* securid of the directory */
+	uid_t uid;		/* requester */
+	gid_t gid;
+	pid_t tid;
+	time_t granted;		/* when search was allowed */
+} ;
+
+/*
+ *	Entry in the cache of supplementary groups of threads
+ */
+
+struct CACHED_GROUPS {
+	struct CACHED_GROUPS *next;
+	struct CACHED_GROUPS *previous;
+	gid_t *groups;		/* supplementary groups */
+	size_t grsize;		/* size of groups, in bytes */
+		/* above fields must match "struct CACHED_GENERIC" */
+	pid_t tid;
+	uid_t uid;
+	time_t read;		/* when read from /proc */
+} ;
+
 /*
  *	Header of the security cache
  *	(has no cache structure by itself)
@@ -253,6 +332,15 @@ int ntfs_set_owner_mode(struct SECURITY_CONTEXT *scx,
 #endif
 le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 		ntfs_inode *dir_ni, BOOL fordir);
+struct CACHED_GENERIC;
+
+int ntfs_securid_hash(const struct CACHED_GENERIC *item);
+int ntfs_legacy_hash(const struct CACHED_GENERIC *item);
+int ntfs_securdesc_hash(const struct CACHED_GENERIC *item);
+int ntfs_inherit_hash(const struct CACHED_GENERIC *item);
+int ntfs_sdh_hash(const struct CACHED_GENERIC *item);
+int ntfs_traverse_hash(const struct CACHED_GENERIC *item);
+int ntfs_groups_hash(const struct CACHED_GENERIC *item);
 int ntfs_open_secure(ntfs_volume *vol);
 int ntfs_close_secure(ntfs_volume *vol);
 
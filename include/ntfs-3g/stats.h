@@ -0,0 +1,78 @@
+/*
+ * stats.h - Exports for the performance counters.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_STATS_H
+#define _NTFS_STATS_H
+
+#include "types.h"
+#include "param.h"
+#include "volume.h"
+
+/*
+ *	Counters updated by concurrent threads without a lock are
+ *	incremented atomically when the compiler supports it, the
+ *	counts are otherwise only approximate.
+ */
+
+#if defined(__GNUC__)
+#define NTFS_STATS_ADD(counter, n) \
+		__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#else
+#define NTFS_STATS_ADD(counter, n) ((counter) += (n))
+#endif
+
+/*
+ *		Latencies of a type of request
+ *
+ *	buckets[i] is the count of requests which took less than
+ *	2^i microseconds, the last one also counts the longer ones.
+ */
+
+struct NTFS_OP_STATS {
+	const char *name;
+	u64 count;
+	u64 total_us;
+	u64 max_us;
+	u64 buckets[NTFS_STATS_BUCKETS];
+} ;
+
+/*
+ *		Counters of a volume, the device ones being kept
+ *	in struct ntfs_device
+ */
+
+struct NTFS_STATS {
+	u64 lcn_allocs;		/* calls to ntfs_cluster_alloc() */
+	u64 lcn_clusters;	/* clusters requested */
+	u64 lcn_scanned;	/* bytes of $Bitmap scanned */
+	u64 lcn_skipped;	/* bytes of $Bitmap skipped as full */
+	u64 mft_allocs;		/* mft records allocated */
+	u64 mft_reused;		/* freed mft records reused */
+	u64 mft_scanned;	/* bytes of $MFT/$BITMAP scanned */
+	struct NTFS_OP_STATS ops[NTFS_STATS_OPS];
+} ;
+
+extern int ntfs_set_stats(ntfs_volume *vol, BOOL on);
+extern void ntfs_stats_reset(ntfs_volume *vol);
+extern u64 ntfs_stats_clock(void);
+extern void ntfs_stats_record_op(ntfs_volume *vol, int op,
+		const char *name, u64 usecs);
+extern int ntfs_stats_report(ntfs_volume *vol, char *buf, size_t size);
+
+#endif /* defined _NTFS_STATS_H */
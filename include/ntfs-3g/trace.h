@@ -0,0 +1,102 @@
+/*
+ * trace.h - Exports for the tracing of device transfers.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_TRACE_H
+#define _NTFS_TRACE_H
+
+#include "types.h"
+#include "param.h"
+#include "volume.h"
+#include "device.h"
+#include "attrib.h"
+
+/*
+ *		What a device transfer is done for
+ */
+
+enum NTFS_TRACE_ORIGIN {
+	NTFS_TRACE_OTHER,	/* boot sector, unattributed transfers */
+	NTFS_TRACE_MFT,		/* mft records, $MFT bitmap and mirror */
+	NTFS_TRACE_INDEX,	/* index blocks */
+	NTFS_TRACE_BITMAP,	/* $Bitmap */
+	NTFS_TRACE_LOGFILE,	/* $LogFile */
+	NTFS_TRACE_DATA,	/* other attributes, mostly user data */
+	NTFS_TRACE_COMPRESSED,	/* compression blocks */
+	NTFS_TRACE_ORIGINS	/* number of the above */
+} ;
+
+#define NTFS_TRACE_MAGIC 0x4352544e	/* "NTRC" */
+#define NTFS_TRACE_VERSION 1
+
+#define NTFS_TRACE_WRITE 1	/* record flag for writes */
+
+/*
+ *		A device transfer, as recorded
+ *
+ *	The records are fetched through the extended attribute
+ *	system.ntfs_trace in the native byte order, preceded by
+ *	a header.
+ */
+
+struct NTFS_TRACE_RECORD {
+	u64 time;		/* microseconds, see ntfs_stats_clock() */
+	u64 request;		/* user request, 0 if none */
+	u64 inode;		/* inode, or first mft record for MFT */
+	s64 pos;		/* position on device */
+	u32 count;		/* bytes transferred */
+	u32 type;		/* attribute type (cpu order), 0 if none */
+	u16 opcode;		/* code of the user request */
+	u8 origin;		/* enum NTFS_TRACE_ORIGIN */
+	u8 flags;		/* NTFS_TRACE_WRITE */
+	u32 reserved;
+} ;
+
+struct NTFS_TRACE_HEADER {
+	u32 magic;		/* NTFS_TRACE_MAGIC */
+	u16 version;		/* NTFS_TRACE_VERSION */
+	u16 record_size;	/* sizeof(struct NTFS_TRACE_RECORD) */
+	u32 count;		/* records following */
+	u32 lost;		/* records overwritten since last fetch */
+} ;
+
+/*
+ *		Origin of the transfers issued by the current thread,
+ *	saved by ntfs_trace_enter() and restored by ntfs_trace_leave()
+ */
+
+struct NTFS_TRACE_TAG {
+	u64 inode;
+	u32 type;
+	u8 origin;
+	BOOL set;
+} ;
+
+extern int ntfs_set_trace(ntfs_volume *vol, int records);
+extern void ntfs_trace_request(struct ntfs_device *dev, int opcode);
+extern void ntfs_trace_request_end(struct ntfs_device *dev);
+extern void ntfs_trace_enter(struct ntfs_device *dev,
+		struct NTFS_TRACE_TAG *saved, int origin, u64 inode, u32 type);
+extern void ntfs_trace_enter_attr(ntfs_attr *na, s64 pos,
+		struct NTFS_TRACE_TAG *saved);
+extern void ntfs_trace_leave(const struct NTFS_TRACE_TAG *saved);
+extern void ntfs_trace_io(struct ntfs_device *dev, s64 pos, s64 count,
+		BOOL write);
+extern int ntfs_trace_fetch(ntfs_volume *vol, char *buf, size_t size);
+
+#endif /* defined _NTFS_TRACE_H */
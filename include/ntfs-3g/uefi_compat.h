@@ -279,6 +279,7 @@ void* memcpy(void* dest, const void* src, size_t n);
 void* memset(void* s, int c, size_t n);
 void* memmove(void* dest, const void* src, size_t n);
 void  free(void* a);
+int   malloc_trim(size_t pad);
 
 size_t strlen(const char* s);
 int   strcmp(const char* s1, const char* s2);
@@ -0,0 +1,67 @@
+/*
+ * usnjrnl.h - Exports for the change journal $Extend/$UsnJrnl.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _NTFS_USNJRNL_H
+#define _NTFS_USNJRNL_H
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "inode.h"
+#include "attrib.h"
+
+struct USN_JOURNAL;
+
+/*
+ *	The state of the change journal, as returned by ntfs_usn_get_info()
+ */
+
+struct NTFS_USN_INFO {
+	u64 journal_id;		/* identifies the instance of the journal */
+	s64 first_usn;		/* usn of the first record kept */
+	s64 next_usn;		/* usn of the next record */
+	s64 lowest_valid_usn;	/* lowest usn of this instance */
+	s64 max_size;		/* bytes of records kept */
+	s64 allocation_delta;	/* bytes freed at once */
+};
+
+/*
+ *	Function called for each record read, which returns non-zero
+ *	to stop reading.
+ */
+
+typedef int (*ntfs_usn_filler)(void *data, const USN_RECORD *rec);
+
+extern int ntfs_usn_open(ntfs_volume *vol);
+extern int ntfs_usn_close(ntfs_volume *vol);
+extern int ntfs_usn_flush(ntfs_volume *vol, BOOL all);
+extern int ntfs_usn_create(ntfs_volume *vol, s64 max_size, s64 delta);
+extern int ntfs_usn_get_info(ntfs_volume *vol, struct NTFS_USN_INFO *info);
+extern s64 ntfs_usn_read(ntfs_volume *vol, s64 from,
+			ntfs_usn_filler filler, void *data);
+extern void ntfs_usn_renaming(ntfs_volume *vol, u64 inum);
+
+extern void ntfs_usn_change(ntfs_inode *ni, ntfs_inode *dir_ni,
+			const ntfschar *name, int name_len, le32 reason);
+extern void ntfs_usn_link(ntfs_inode *ni, ntfs_inode *dir_ni,
+			const ntfschar *name, int name_len, BOOL added);
+extern void ntfs_usn_write(ntfs_attr *na, s64 pos, s64 count);
+extern void ntfs_usn_resize(ntfs_attr *na, s64 newsize);
+
+#endif /* defined _NTFS_USNJRNL_H */
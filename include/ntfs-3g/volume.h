@@ -60,12 +60,20 @@ typedef struct _ntfs_volume ntfs_volume;
 enum {
 	NTFS_MNT_NONE                   = 0x00000000,
 	NTFS_MNT_RDONLY                 = 0x00000001,
+	NTFS_MNT_CONCURRENT             = 0x00400000, /* Readers in several
+	                                               * threads (read-only) */
+	NTFS_MNT_DEFER_LOADS            = 0x00800000, /* Defer the loads not
+	                                               * needed for mounting */
+	NTFS_MNT_DIRECT_IO              = 0x01000000, /* Bypass the device
+	                                               * cache */
 	NTFS_MNT_MAY_RDONLY             = 0x02000000, /* Allow fallback to ro */
 	NTFS_MNT_FORENSIC               = 0x04000000, /* No modification during
 	                                               * mount. */
 	NTFS_MNT_EXCLUSIVE              = 0x08000000,
 	NTFS_MNT_RECOVER                = 0x10000000,
 	NTFS_MNT_IGNORE_HIBERFILE       = 0x20000000,
+	NTFS_MNT_URING                  = 0x40000000, /* Use io_uring if
+	                                               * available */
 };
 typedef unsigned long ntfs_mount_flags;
 
@@ -117,6 +125,12 @@ typedef enum {
 	NV_HideDotFiles,	/* 1: Set hidden flag on dot files */
 	NV_Compression,		/* 1: allow compression */
 	NV_NoFixupWarn,		/* 1: Do not log fixup errors */
+	NV_CompactRunlists,	/* 1: Compact the runlists of big attributes */
+	NV_MftMirrUnchecked,	/* 1: $MFTMirr not compared to $MFT yet */
+	NV_AttrDefDeferred,	/* 1: $AttrDef to be loaded on first use */
+	NV_SecureDeferred,	/* 1: $Secure to be opened on first use */
+	NV_FreeSpaceUncounted,	/* 1: Free clusters and records not counted */
+	NV_UncompressedOverwrites, /* 1: Overwrite compressed blocks uncompressed */
 } ntfs_volume_state_bits;
 
 #define  test_nvol_flag(nv, flag)	 test_bit(NV_##flag, (nv)->state)
@@ -155,6 +169,30 @@ typedef enum {
 #define NVolSetNoFixupWarn(nv)		  set_nvol_flag(nv, NoFixupWarn)
 #define NVolClearNoFixupWarn(nv)	clear_nvol_flag(nv, NoFixupWarn)
 
+#define NVolCompactRunlists(nv)		 test_nvol_flag(nv, CompactRunlists)
+#define NVolSetCompactRunlists(nv)	  set_nvol_flag(nv, CompactRunlists)
+#define NVolClearCompactRunlists(nv)	clear_nvol_flag(nv, CompactRunlists)
+
+#define NVolMftMirrUnchecked(nv)	 test_nvol_flag(nv, MftMirrUnchecked)
+#define NVolSetMftMirrUnchecked(nv)	  set_nvol_flag(nv, MftMirrUnchecked)
+#define NVolClearMftMirrUnchecked(nv)	clear_nvol_flag(nv, MftMirrUnchecked)
+
+#define NVolAttrDefDeferred(nv)		 test_nvol_flag(nv, AttrDefDeferred)
+#define NVolSetAttrDefDeferred(nv)	  set_nvol_flag(nv, AttrDefDeferred)
+#define NVolClearAttrDefDeferred(nv)	clear_nvol_flag(nv, AttrDefDeferred)
+
+#define NVolSecureDeferred(nv)		 test_nvol_flag(nv, SecureDeferred)
+#define NVolSetSecureDeferred(nv)	  set_nvol_flag(nv, SecureDeferred)
+#define NVolClearSecureDeferred(nv)	clear_nvol_flag(nv, SecureDeferred)
+
+#define NVolFreeSpaceUncounted(nv)	 test_nvol_flag(nv, FreeSpaceUncounted)
+#define NVolSetFreeSpaceUncounted(nv)	  set_nvol_flag(nv, FreeSpaceUncounted)
+#define NVolClearFreeSpaceUncounted(nv)	clear_nvol_flag(nv, FreeSpaceUncounted)
+
+#define NVolUncompressedOverwrites(nv)	 test_nvol_flag(nv, UncompressedOverwrites)
+#define NVolSetUncompressedOverwrites(nv)  set_nvol_flag(nv, UncompressedOverwrites)
+#define NVolClearUncompressedOverwrites(nv) clear_nvol_flag(nv, UncompressedOverwrites)
+
 /*
  * NTFS version 1.1 and 1.2 are used by Windows NT4.
  * NTFS version 2.x is used by Windows 2000 Beta
@@ -203,11 +241,19 @@ struct _ntfs_volume {
 	u8 full_zones;		/* cluster zones which are full */
 	s64 mft_data_pos;	/* Mft record number at which to allocate the
 				   next mft record. */
+	struct MFT_FREE_CACHE *mft_free_cache; /* Free mft records found,
+				   NULL until first allocating. */
 	LCN mft_zone_start;	/* First cluster of the mft zone. */
 	LCN mft_zone_end;	/* First cluster beyond the mft zone. */
 	LCN mft_zone_pos;	/* Current position in the mft zone. */
 	LCN data1_zone_pos;	/* Current position in the first data zone. */
 	LCN data2_zone_pos;	/* Current position in the second data zone. */
+	u16 *lcn_summary;	/* Free clusters in each chunk of lcn_bitmap,
+				   NULL until first allocating. */
+	s64 lcn_summary_chunks;	/* Number of chunks in lcn_summary. */
+	struct LCN_STREAMS *lcn_streams; /* Goals of the recent allocations,
+				   NULL until first allocating. */
+	struct LCN_WRITEBACK *lcn_writeback; /* Delayed pages of lcn_bitmap */
 
 	s64 nr_clusters;	/* Volume size in clusters, hence also the
 				   number of bits in lcn_bitmap. */
@@ -234,6 +280,11 @@ struct _ntfs_volume {
 	ntfs_index_context *secure_xsii; /* index for using $Secure:$SII */
 	ntfs_index_context *secure_xsdh; /* index for using $Secure:$SDH */
 	int secure_reentry;  /* check for non-rentries */
+	ntfs_inode *reparse_ni;	/* $Extend/$Reparse, once needed */
+	ntfs_index_context *reparse_xr; /* index for using $Reparse */
+	ntfs_inode *objid_ni;	/* $Extend/$ObjId, once needed */
+	ntfs_index_context *objid_xo; /* index for using $ObjId */
+	struct USN_JOURNAL *usn_journal; /* $Extend/$UsnJrnl, if maintained */
 	unsigned int secure_flags;  /* flags, see security.h for values */
 
 	int mftmirr_size;	/* Size of the FILE_MFTMirr in mft records. */
@@ -282,6 +333,56 @@ struct _ntfs_volume {
 #if CACHE_LEGACY_SIZE
 	struct CACHE_HEADER *legacy_cache;
 #endif
+#if CACHE_SECURDESC_SIZE
+	struct CACHE_HEADER *securdesc_cache;
+#endif
+#if CACHE_INHERIT_SIZE
+	struct CACHE_HEADER *inherit_cache;
+#endif
+#if CACHE_SDH_SIZE
+	struct CACHE_HEADER *sdh_cache;
+#endif
+#if CACHE_TRAVERSE_SIZE
+	struct CACHE_HEADER *traverse_cache;
+#endif
+#if CACHE_GROUPS_SIZE
+	struct CACHE_HEADER *groups_cache;
+#endif
+#if CACHE_LISTING_SIZE
+	struct CACHE_HEADER *listing_cache;
+	u32 listing_changes;	/* count of directory index updates */
+	struct CACHE_HEADER *symlink_cache;
+	struct CACHE_HEADER *ea_cache;
+	struct CACHE_HEADER *streams_cache;
+	struct CACHE_HEADER *stat_cache;
+	u32 stat_changes;	/* count of stat invalidations */
+#endif
+#if CACHE_CBLOCK_SIZE
+	struct CACHE_HEADER *cblock_cache;
+#endif
+#if CACHE_MFTREC_HASH
+	struct CACHE_HEADER *mftrec_cache;
+#endif
+#if CACHE_INDEX_HASH
+	struct CACHE_HEADER *index_cache;
+#endif
+	s64 mem_budget;		/* bytes the caches may use, or 0 */
+	struct INDEX_WRITEBACK *index_writeback; /* Delayed index blocks */
+	struct INDEX_LAZY *index_lazy; /* Directory entries removed lazily */
+	struct INODE_WRITEBACK *inode_writeback; /* Delayed inodes */
+	struct MFT_BATCH *mft_batch; /* Mft records written together */
+	ntfs_inode *spare_inodes; /* Released inodes kept for reuse */
+	int spare_inode_count;
+	struct NTFS_STATS *stats; /* Performance counters, or NULL */
+	struct ntfs_volume_locks *locks; /* Locks for concurrent accesses */
+	struct COMPRESS_POOL *compress_pool; /* Compression threads */
+	struct LCN_COUNT *lcn_count; /* Background count of free clusters */
+	struct LCN_DISCARD *lcn_discard; /* Freed clusters to discard */
+	struct MOUNT_SNAPSHOT *snapshot; /* Snapshot of mount-time metadata */
+	s64 prealloc_size;	/* Max bytes preallocated when appending */
+	struct PREALLOC_WINDOWS *prealloc_windows; /* Files preallocated */
+	s64 hole_unit;		/* Clusters allocated at once in holes, or 0 */
+	int compression_level;	/* NTFS_COMPRESS_*, or 0 for default */
 };
 
 extern const char *ntfs_home;
@@ -299,6 +400,8 @@ extern int ntfs_umount(ntfs_volume *vol, const BOOL force);
 
 extern int ntfs_version_is_supported(ntfs_volume *vol);
 extern int ntfs_volume_check_hiberfile(ntfs_volume *vol, int verbose);
+extern int ntfs_volume_check_mftmirr(ntfs_volume *vol);
+extern int ntfs_volume_load_attrdef(ntfs_volume *vol);
 extern int ntfs_logfile_reset(ntfs_volume *vol);
 
 extern int ntfs_volume_write_flags(ntfs_volume *vol, const le16 flags);
@@ -307,6 +410,9 @@ extern int ntfs_volume_error(int err);
 extern void ntfs_mount_error(const char *vol, const char *mntpoint, int err);
 
 extern int ntfs_volume_get_free_space(ntfs_volume *vol);
+extern int ntfs_volume_flush_metadata(ntfs_volume *vol, BOOL all);
+extern int ntfs_volume_sync(ntfs_volume *vol);
+extern int ntfs_volume_snapshot_load(ntfs_volume *vol, const char *path);
 extern int ntfs_volume_rename(ntfs_volume *vol, const ntfschar *label,
 		int label_len);
 
@@ -314,6 +420,15 @@ extern int ntfs_set_shown_files(ntfs_volume *vol,
 		BOOL show_sys_files, BOOL show_hid_files, BOOL hide_dot_files);
 extern int ntfs_set_locale(void);
 extern int ntfs_set_ignore_case(ntfs_volume *vol);
+extern int ntfs_set_compact_runlists(ntfs_volume *vol, BOOL compact);
+extern int ntfs_set_concurrent(ntfs_volume *vol, BOOL concurrent);
+
+extern void ntfs_volume_lock(ntfs_volume *vol, BOOL shared);
+extern void ntfs_volume_unlock(ntfs_volume *vol, BOOL shared);
+extern BOOL ntfs_volume_enter(ntfs_volume *vol);
+extern void ntfs_volume_leave(ntfs_volume *vol);
+extern BOOL ntfs_volume_transfer_begin(ntfs_volume *vol);
+extern void ntfs_volume_transfer_end(ntfs_volume *vol, BOOL released);
 
 #endif /* defined _NTFS_VOLUME_H */
 
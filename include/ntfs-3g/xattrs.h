@@ -60,7 +60,9 @@ enum SYSTEMXATTRS {
 	XATTR_NTFS_CRTIME_BE,
 	XATTR_NTFS_EA,
 	XATTR_POSIX_ACC, 
-	XATTR_POSIX_DEF
+	XATTR_POSIX_DEF,
+	XATTR_NTFS_STATS,
+	XATTR_NTFS_TRACE
 } ;
 
 struct XATTRMAPPING {
@@ -32,16 +32,25 @@
 #define FILE_ROOT           5
 #define FILE_FIRST_USER     16
 
+/* Policies for updating the access time on reads, similar to FUSE's */
+#define FS_ATIME_DISABLED   0   /* noatime */
+#define FS_ATIME_RELATIVE   1   /* relatime (default) */
+#define FS_ATIME_ENABLED    2   /* strictatime */
+
 /* Similar to the MREF() macro from libntfs-3g */
 #define GetInodeNumber(x)   ((UINT64)((x) & 0XFFFFFFFFFFFFULL))
 
-/* This typedef mirrors the ntfs_filldir_t one in ntfs-3g's dir.h */
+/* This typedef mirrors the ntfs_filldir_fn_t one in ntfs-3g's dir.h */
 typedef INT32(*NTFS_DIRHOOK)(VOID* HookData, CONST CHAR16* Name,
 	CONST INT32 NameLen, CONST INT32 NameType, CONST INT64 Pos,
-	CONST UINT64 MRef, CONST UINT32 DtType);
+	CONST UINT64 MRef, CONST UINT32 DtType, CONST VOID* FileName);
 
 VOID NtfsSetErrno(EFI_STATUS Status);
 VOID NtfsSetLogger(UINTN LogLevel);
+VOID NtfsSetAtimePolicy(VOID);
+VOID NtfsSetProcessors(VOID);
+VOID NtfsFreeProcessors(VOID);
+VOID NtfsReleaseMemory(VOID);
 VOID NtfsGetEfiTime(EFI_NTFS_FILE* File, EFI_TIME* Time, INTN Type);
 BOOLEAN NtfsIsVolumeReadOnly(VOID* NtfsVolume);
 EFI_STATUS NtfsMountVolume(EFI_FS* FileSystem);
@@ -57,6 +66,8 @@ EFI_STATUS NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len);
 EFI_STATUS NtfsWriteFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len);
 EFI_STATUS NtfsGetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info,
 	CONST UINT64 MRef, BOOLEAN IsDir);
+EFI_STATUS NtfsGetDirEntryInfo(EFI_NTFS_FILE* Parent, EFI_FILE_INFO* Info,
+	CONST UINT64 MRef, CONST VOID* FileName, BOOLEAN IsDir);
 EFI_STATUS NtfsSetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info,
 	BOOLEAN ReadOnly);
 UINT64 NtfsGetVolumeFreeSpace(VOID* NtfsVolume);
@@ -38,6 +38,7 @@
 #include <Library/DevicePathLib.h>
 #include <Library/PrintLib.h>
 #include <Library/UefiLib.h>
+#include <Library/SynchronizationLib.h>
 
 #include <Protocol/LoadedImage.h>
 #include <Protocol/DriverBinding.h>
@@ -50,6 +51,7 @@
 #include <Protocol/DiskIo2.h>
 #include <Protocol/ComponentName.h>
 #include <Protocol/ComponentName2.h>
+#include <Protocol/MpService.h>
 
 #include <Guid/FileSystemInfo.h>
 #include <Guid/FileInfo.h>
@@ -99,8 +101,28 @@ typedef struct _EFI_NTFS_FILE {
 	INTN                             RefCount;
 	struct _EFI_FS                  *FileSystem;
 	VOID                            *NtfsInode;
+	VOID                            *NtfsAttr;	/* Data attribute, kept open */
+	VOID                            *LookupEntry;	/* Entry in the lookup tables */
+	VOID                            *DirCursor;	/* Buffered directory entries */
+	VOID                            *ReadAhead;	/* Data read in advance */
+	VOID                            *InfoCache;	/* Information last returned */
 } EFI_NTFS_FILE;
 
+/* Size of the buffer holding the directory entries read in advance */
+#define DIR_CURSOR_SIZE (16 * 1024)
+
+/* Size of the buffer holding the data of a file read in advance */
+#define READ_AHEAD_SIZE (1024 * 1024)
+
+/* Number of DiskIo2 tokens, for the requests submitted concurrently */
+#define DISKIO2_POOL_SIZE 16
+
+/* Minimum size of the aligned reads issued directly through BlockIo */
+#define BLOCKIO_DIRECT_MIN (64 * 1024)
+
+/* Number of buckets of the hash tables used to look up open files */
+#define LOOKUP_HASH_SIZE 256
+
 /* A file system instance */
 typedef struct _EFI_FS {
 	LIST_ENTRY                      *ForwardLink;
@@ -111,6 +133,9 @@ typedef struct _EFI_FS {
 	EFI_DISK_IO_PROTOCOL            *DiskIo;
 	EFI_DISK_IO2_PROTOCOL           *DiskIo2;
 	EFI_DISK_IO2_TOKEN               DiskIo2Token;
+	EFI_DISK_IO2_TOKEN               DiskIo2Pool[DISKIO2_POOL_SIZE];
+	EFI_BLOCK_IO2_TOKEN              BlockIo2Token;
+	EFI_BLOCK_IO2_TOKEN              BlockIo2Pool[DISKIO2_POOL_SIZE];
 	CHAR16                          *DevicePathString;
 	VOID                            *NtfsVolume;
 	CHAR16                          *NtfsVolumeLabel;
@@ -119,6 +144,8 @@ typedef struct _EFI_FS {
 	INTN                             MountCount;
 	INTN                             TotalRefCount;
 	LIST_ENTRY                       LookupListHead;
+	LIST_ENTRY                       LookupPathHash[LOOKUP_HASH_SIZE];
+	LIST_ENTRY                       LookupInumHash[LOOKUP_HASH_SIZE];
 } EFI_FS;
 
 /* The top of our file system instances list */
@@ -40,6 +40,8 @@
 #define FUSE_DEFAULT_INTR_SIGNAL SIGUSR1
 
 #define FUSE_UNKNOWN_INO 0xffffffff
+
+#define NODE_TABLE_MIN_SIZE 8192
 #define OFFSET_MAX 0x7fffffffffffffffLL
 
 struct fuse_config {
@@ -84,12 +86,24 @@ struct fusemod_so {
 };
 #endif /* __SOLARIS__ */
 
+/*
+ * The node tables are resized incrementally (linear hashing) : the
+ * buckets below split use all the bits of the hash, the other ones
+ * one bit less, and one bucket is split or merged at a time, so that
+ * the chains stay short without rehashing a whole table at once.
+ */
+struct node_table {
+    struct node **array;
+    size_t use;
+    size_t size;
+    size_t split;
+};
+
 struct fuse {
     struct fuse_session *se;
-    struct node **name_table;
-    size_t name_table_size;
-    struct node **id_table;
-    size_t id_table_size;
+    struct node_table name_table;
+    struct node_table id_table;
+    unsigned int path_generation;
     fuse_ino_t ctr;
     unsigned int generation;
     unsigned int hidectr;
@@ -117,6 +131,8 @@ struct node {
     int refctr;
     struct node *parent;
     char *name;
+    char *path;                 /* cached full path, or NULL */
+    unsigned int path_generation;
     uint64_t nlookup;
     int open_count;
     int is_hidden;
@@ -253,12 +269,77 @@ static void fuse_put_module(struct fuse_module *m)
 }
 #endif /* __SOLARIS__ */
 
+static int node_table_init(struct node_table *t)
+{
+    t->size = NODE_TABLE_MIN_SIZE;
+    t->array = (struct node **) calloc(1, sizeof(struct node *) * t->size);
+    if (t->array == NULL) {
+        fprintf(stderr, "fuse: memory allocation failed\n");
+        return -1;
+    }
+    t->use = 0;
+    t->split = 0;
+
+    return 0;
+}
+
+static int node_table_resize(struct node_table *t)
+{
+    size_t newsize = t->size * 2;
+    void *newarray;
+
+    newarray = realloc(t->array, sizeof(struct node *) * newsize);
+    if (newarray == NULL)
+        return -1;
+
+    t->array = newarray;
+    memset(t->array + t->size, 0, t->size * sizeof(struct node *));
+    t->size = newsize;
+    t->split = 0;
+
+    return 0;
+}
+
+static void node_table_reduce(struct node_table *t)
+{
+    size_t newsize = t->size / 2;
+    void *newarray;
+
+    if (newsize < NODE_TABLE_MIN_SIZE)
+        return;
+
+    newarray = realloc(t->array, sizeof(struct node *) * newsize);
+    if (newarray != NULL)
+        t->array = newarray;
+
+    t->size = newsize;
+    t->split = t->size / 2;
+}
+
+static size_t node_table_bucket(const struct node_table *t, uint64_t hash)
+{
+    size_t bucket = hash % t->size;
+    size_t oldbucket = bucket % (t->size / 2);
+
+    if (oldbucket >= t->split)
+        return oldbucket;
+    else
+        return bucket;
+}
+
+static size_t id_hash(struct fuse *f, fuse_ino_t ino)
+{
+    uint64_t hash = (uint32_t) ino * 2654435761U;
+
+    return node_table_bucket(&f->id_table, hash);
+}
+
 static struct node *get_node_nocheck(struct fuse *f, fuse_ino_t nodeid)
 {
-    size_t hash = nodeid % f->id_table_size;
+    size_t hash = id_hash(f, nodeid);
     struct node *node;
 
-    for (node = f->id_table[hash]; node != NULL; node = node->id_next)
+    for (node = f->id_table.array[hash]; node != NULL; node = node->id_next)
         if (node->nodeid == nodeid)
             return node;
 
@@ -279,38 +360,168 @@ static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
 static void free_node(struct node *node)
 {
     free(node->name);
+    free(node->path);
     free(node);
 }
 
+/*
+ * Merge the upper bucket of the last split back when few nodes are
+ * left, skipping a few empty buckets at a time
+ */
+static void remerge_id(struct fuse *f)
+{
+    struct node_table *t = &f->id_table;
+    int iter;
+
+    if (t->split == 0)
+        node_table_reduce(t);
+
+    for (iter = 8; t->split > 0 && iter; iter--) {
+        struct node **upper;
+
+        t->split--;
+        upper = &t->array[t->split + t->size / 2];
+        if (*upper) {
+            struct node **nodep;
+
+            for (nodep = &t->array[t->split]; *nodep;
+                 nodep = &(*nodep)->id_next);
+
+            *nodep = *upper;
+            *upper = NULL;
+            break;
+        }
+    }
+}
+
 static void unhash_id(struct fuse *f, struct node *node)
 {
-    size_t hash = node->nodeid % f->id_table_size;
-    struct node **nodep = &f->id_table[hash];
+    struct node **nodep = &f->id_table.array[id_hash(f, node->nodeid)];
 
     for (; *nodep != NULL; nodep = &(*nodep)->id_next)
         if (*nodep == node) {
             *nodep = node->id_next;
+            f->id_table.use--;
+
+            if(f->id_table.use < f->id_table.size / 4)
+                remerge_id(f);
             return;
         }
 }
 
+/* Split the next bucket when the table is getting full */
+static void rehash_id(struct fuse *f)
+{
+    struct node_table *t = &f->id_table;
+    struct node **nodep;
+    struct node **next;
+    size_t hash;
+
+    if (t->split == t->size / 2)
+        return;
+
+    hash = t->split;
+    t->split++;
+    for (nodep = &t->array[hash]; *nodep != NULL; nodep = next) {
+        struct node *node = *nodep;
+        size_t newhash = id_hash(f, node->nodeid);
+
+        if (newhash != hash) {
+            next = nodep;
+            *nodep = node->id_next;
+            node->id_next = t->array[newhash];
+            t->array[newhash] = node;
+        } else {
+            next = &node->id_next;
+        }
+    }
+    if (t->split == t->size / 2)
+        node_table_resize(t);
+}
+
 static void hash_id(struct fuse *f, struct node *node)
 {
-    size_t hash = node->nodeid % f->id_table_size;
-    node->id_next = f->id_table[hash];
-    f->id_table[hash] = node;
+    size_t hash = id_hash(f, node->nodeid);
+    node->id_next = f->id_table.array[hash];
+    f->id_table.array[hash] = node;
+    f->id_table.use++;
+
+    if (f->id_table.use >= f->id_table.size / 2)
+        rehash_id(f);
 }
 
-static unsigned int name_hash(struct fuse *f, fuse_ino_t parent,
-                              const char *name)
+/* FNV-1a of the parent node id and the name */
+static size_t name_hash(struct fuse *f, fuse_ino_t parent,
+                        const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        hash ^= (parent >> (i * 8)) & 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return node_table_bucket(&f->name_table, hash ^ (hash >> 32));
+}
+
+static void remerge_name(struct fuse *f)
+{
+    struct node_table *t = &f->name_table;
+    int iter;
+
+    if (t->split == 0)
+        node_table_reduce(t);
+
+    for (iter = 8; t->split > 0 && iter; iter--) {
+        struct node **upper;
+
+        t->split--;
+        upper = &t->array[t->split + t->size / 2];
+        if (*upper) {
+            struct node **nodep;
+
+            for (nodep = &t->array[t->split]; *nodep;
+                 nodep = &(*nodep)->name_next);
+
+            *nodep = *upper;
+            *upper = NULL;
+            break;
+        }
+    }
+}
+
+static void rehash_name(struct fuse *f)
 {
-    unsigned int hash = *name;
+    struct node_table *t = &f->name_table;
+    struct node **nodep;
+    struct node **next;
+    size_t hash;
 
-    if (hash)
-        for (name += 1; *name != '\0'; name++)
-            hash = (hash << 5) - hash + *name;
+    if (t->split == t->size / 2)
+        return;
 
-    return (hash + parent) % f->name_table_size;
+    hash = t->split;
+    t->split++;
+    for (nodep = &t->array[hash]; *nodep != NULL; nodep = next) {
+        struct node *node = *nodep;
+        size_t newhash = name_hash(f, node->parent->nodeid, node->name);
+
+        if (newhash != hash) {
+            next = nodep;
+            *nodep = node->name_next;
+            node->name_next = t->array[newhash];
+            t->array[newhash] = node;
+        } else {
+            next = &node->name_next;
+        }
+    }
+    if (t->split == t->size / 2)
+        node_table_resize(t);
 }
 
 static void unref_node(struct fuse *f, struct node *node);
@@ -319,7 +530,7 @@ static void unhash_name(struct fuse *f, struct node *node)
 {
     if (node->name) {
         size_t hash = name_hash(f, node->parent->nodeid, node->name);
-        struct node **nodep = &f->name_table[hash];
+        struct node **nodep = &f->name_table.array[hash];
 
         for (; *nodep != NULL; nodep = &(*nodep)->name_next)
             if (*nodep == node) {
@@ -329,6 +540,15 @@ static void unhash_name(struct fuse *f, struct node *node)
                 free(node->name);
                 node->name = NULL;
                 node->parent = NULL;
+                /* the paths cached below this node are stale */
+                free(node->path);
+                node->path = NULL;
+                if (node->refctr > 1)
+                    f->path_generation++;
+                f->name_table.use--;
+
+                if (f->name_table.use < f->name_table.size / 4)
+                    remerge_name(f);
                 return;
             }
         fprintf(stderr, "fuse internal error: unable to unhash node: %llu\n",
@@ -348,8 +568,12 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 
     parent->refctr ++;
     node->parent = parent;
-    node->name_next = f->name_table[hash];
-    f->name_table[hash] = node;
+    node->name_next = f->name_table.array[hash];
+    f->name_table.array[hash] = node;
+    f->name_table.use++;
+
+    if (f->name_table.use >= f->name_table.size / 2)
+        rehash_name(f);
     return 0;
 }
 
@@ -388,7 +612,8 @@ static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
     size_t hash = name_hash(f, parent, name);
     struct node *node;
 
-    for (node = f->name_table[hash]; node != NULL; node = node->name_next)
+    for (node = f->name_table.array[hash]; node != NULL;
+         node = node->name_next)
         if (node->parent->nodeid == parent && strcmp(node->name, name) == 0)
             return node;
 
@@ -425,134 +650,93 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
     return node;
 }
 
-#ifndef __SOLARIS__
-static char *add_name(char **buf, unsigned *bufsize, char *s, const char *name)
-#else /* __SOLARIS__ */
-static char *add_name(char *buf, char *s, const char *name)
-#endif /* __SOLARIS__ */
-{
-    size_t len = strlen(name);
-
-#ifndef __SOLARIS__
-    if (s - len <= *buf) {
-	unsigned pathlen = *bufsize - (s - *buf);
-	unsigned newbufsize = *bufsize;
-	char *newbuf;
-
-	while (newbufsize < pathlen + len + 1) {
-	    if (newbufsize >= 0x80000000)
-	    	newbufsize = 0xffffffff;
-	    else
-	    	newbufsize *= 2;
-	}
-
-	newbuf = realloc(*buf, newbufsize);
-	if (newbuf == NULL)
-		return NULL;
-
-	*buf = newbuf;
-	s = newbuf + newbufsize - pathlen;
-	memmove(s, newbuf + *bufsize - pathlen, pathlen);
-	*bufsize = newbufsize;
-    }
-    s -= len;
-#else /* ! __SOLARIS__ */
-    s -= len;
-    if (s <= buf) {
-        fprintf(stderr, "fuse: path too long: ...%s\n", s + len);
-        return NULL;
-    }
-#endif /* __SOLARIS__ */
-    memcpy(s, name, len);
-    s--;
-    *s = '/';
-
-    return s;
-}
-
-static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
-{
-#ifdef __SOLARIS__
-    char buf[FUSE_MAX_PATH];
-    char *s = buf + FUSE_MAX_PATH - 1;
-    struct node *node;
-
-    *s = '\0';
-
-    if (name != NULL) {
-        s = add_name(buf, s, name);
-        if (s == NULL)
-            return NULL;
-    }
+/*
+ * Get the full path of a node, the lock being held. It is cached in the
+ * node and built from the nearest ancestor with a valid cached path,
+ * the cached paths of the nodes below a node which is renamed or
+ * removed being all invalidated by a new generation.
+ * The path of the root is empty, NULL is returned for a removed node.
+ */
+static const char *get_node_path(struct fuse *f, struct node *node)
+{
+    struct node *anc;
+    const char *prefix;
+    size_t prefixlen;
+    size_t namelen;
+    size_t len;
+    char *path;
+    char *s;
 
-    pthread_mutex_lock(&f->lock);
-    for (node = get_node(f, nodeid); node && node->nodeid != FUSE_ROOT_ID;
-         node = node->parent) {
-        if (node->name == NULL) {
-            s = NULL;
+    if (node->nodeid == FUSE_ROOT_ID)
+        return "";
+    if (node->path && node->path_generation == f->path_generation)
+        return node->path;
+
+    prefix = "";
+    len = 0;
+    for (anc = node; anc->nodeid != FUSE_ROOT_ID; anc = anc->parent) {
+        if (anc != node && anc->path &&
+            anc->path_generation == f->path_generation) {
+            prefix = anc->path;
             break;
         }
-
-        s = add_name(buf, s, node->name);
-        if (s == NULL)
-            break;
+        if (anc->name == NULL)
+            return NULL;
+        len += strlen(anc->name) + 1;
     }
-    pthread_mutex_unlock(&f->lock);
 
-    if (node == NULL || s == NULL)
+    prefixlen = strlen(prefix);
+    path = malloc(prefixlen + len + 1);
+    if (path == NULL)
         return NULL;
-    else if (*s == '\0')
-        return strdup("/");
-    else
-        return strdup(s);
-
-#else /* __SOLARIS__ */
-
-    unsigned bufsize = 256;
-    char *buf;
-    char *s;
-    struct node *node;
-
-    buf = malloc(bufsize);
-    if (buf == NULL)
-            return NULL;
 
-    s = buf + bufsize - 1;
+    memcpy(path, prefix, prefixlen);
+    s = path + prefixlen + len;
     *s = '\0';
-
-    if (name != NULL) {
-        s = add_name(&buf, &bufsize, s, name);
-        if (s == NULL)
-            goto out_free;
+    for (anc = node; s > path + prefixlen; anc = anc->parent) {
+        namelen = strlen(anc->name);
+        s -= namelen;
+        memcpy(s, anc->name, namelen);
+        *--s = '/';
     }
 
+    free(node->path);
+    node->path = path;
+    node->path_generation = f->path_generation;
+    return path;
+}
+
+static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
+{
+    const char *path;
+    size_t len;
+    char *s = NULL;
+
     pthread_mutex_lock(&f->lock);
-    for (node = get_node(f, nodeid); node && node->nodeid != FUSE_ROOT_ID;
-         node = node->parent) {
-        if (node->name == NULL) {
-            s = NULL;
-            break;
+    path = get_node_path(f, get_node(f, nodeid));
+    if (path != NULL) {
+        len = strlen(path);
+#ifdef __SOLARIS__
+        if (len + (name != NULL ? strlen(name) + 1 : 0) >= FUSE_MAX_PATH) {
+            fprintf(stderr, "fuse: path too long: ...%s\n",
+                    name != NULL ? name : path);
+            pthread_mutex_unlock(&f->lock);
+            return NULL;
         }
-
-        s = add_name(&buf, &bufsize, s, node->name);
-        if (s == NULL)
-            break;
+#endif /* __SOLARIS__ */
+        if (name != NULL) {
+            s = malloc(len + strlen(name) + 2);
+            if (s != NULL) {
+                memcpy(s, path, len);
+                s[len] = '/';
+                strcpy(s + len + 1, name);
+            }
+        } else
+            s = strdup(len ? path : "/");
     }
     pthread_mutex_unlock(&f->lock);
 
-    if (node == NULL || s == NULL)
-        goto out_free;
-    
-    if (s[0])
-            memmove(buf, s, bufsize - (s - buf));
-    else
-            strcpy(buf, "/");
-    return buf;
-    
-out_free:
-    free(buf);
-    return NULL;
-#endif /* __SOLARIS__ */
+    return s;
 }
 
 static char *get_path(struct fuse *f, fuse_ino_t nodeid)
@@ -1054,6 +1238,16 @@ int fuse_fs_ioctl(struct fuse_fs *fs, const char *path, int cmd, void *arg,
 	return -ENOSYS;
 }
 
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+                      off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    fuse_get_context()->private_data = fs->user_data;
+    if (fs->op.fallocate)
+        return fs->op.fallocate(path, mode, offset, length, fi);
+    else
+        return -ENOSYS;
+}
+
 static int is_open(struct fuse *f, fuse_ino_t dir, const char *name)
 {
     struct node *node;
@@ -2029,6 +2223,32 @@ static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
     reply_err(req, err);
 }
 
+static void fuse_lib_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                       off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    struct fuse *f = req_fuse_prepare(req);
+    char *path;
+    int err;
+
+    err = -ENOENT;
+    pthread_rwlock_rdlock(&f->tree_lock);
+    path = get_path(f, ino);
+    if (path != NULL) {
+        struct fuse_intr_data d;
+        if (f->conf.debug)
+            fprintf(stderr, "FALLOCATE[%llu] mode 0x%x %llu+%llu\n",
+                    (unsigned long long) fi->fh, mode,
+                    (unsigned long long) offset,
+                    (unsigned long long) length);
+        fuse_prepare_interrupt(f, req, &d);
+        err = fuse_fs_fallocate(f->fs, path, mode, offset, length, fi);
+        fuse_finish_interrupt(f, req, &d);
+        free(path);
+    }
+    pthread_rwlock_unlock(&f->tree_lock);
+    reply_err(req, err);
+}
+
 static struct fuse_dh *get_dirhandle(const struct fuse_file_info *llfi,
                                      struct fuse_file_info *fi)
 {
@@ -2827,6 +3047,7 @@ static struct fuse_lowlevel_ops fuse_path_ops = {
     .setlk = fuse_lib_setlk,
     .bmap = fuse_lib_bmap,
     .ioctl = fuse_lib_ioctl,
+    .fallocate = fuse_lib_fallocate,
 };
 
 struct fuse_session *fuse_get_session(struct fuse *f)
@@ -3129,22 +3350,12 @@ struct fuse *fuse_new(struct fuse_chan *ch, struct fuse_args *args,
 
     f->ctr = 0;
     f->generation = 0;
-    /* FIXME: Dynamic hash table */
-    f->name_table_size = 14057;
-    f->name_table = (struct node **)
-        calloc(1, sizeof(struct node *) * f->name_table_size);
-    if (f->name_table == NULL) {
-        fprintf(stderr, "fuse: memory allocation failed\n");
+    f->path_generation = 0;
+    if (node_table_init(&f->name_table) == -1)
         goto out_free_session;
-    }
 
-    f->id_table_size = 14057;
-    f->id_table = (struct node **)
-        calloc(1, sizeof(struct node *) * f->id_table_size);
-    if (f->id_table == NULL) {
-        fprintf(stderr, "fuse: memory allocation failed\n");
+    if (node_table_init(&f->id_table) == -1)
         goto out_free_name_table;
-    }
 
     fuse_mutex_init(&f->lock);
     pthread_rwlock_init(&f->tree_lock, NULL);
@@ -3179,9 +3390,9 @@ struct fuse *fuse_new(struct fuse_chan *ch, struct fuse_args *args,
  out_free_root:
     free(root);
  out_free_id_table:
-    free(f->id_table);
+    free(f->id_table.array);
  out_free_name_table:
-    free(f->name_table);
+    free(f->name_table.array);
  out_free_session:
     fuse_session_destroy(f->se);
  out_free_fs:
@@ -3213,10 +3424,11 @@ void fuse_destroy(struct fuse *f)
         memset(c, 0, sizeof(*c));
         c->ctx.fuse = f;
 
-        for (i = 0; i < f->id_table_size; i++) {
+        for (i = 0; i < f->id_table.size; i++) {
             struct node *node;
 
-            for (node = f->id_table[i]; node != NULL; node = node->id_next) {
+            for (node = f->id_table.array[i]; node != NULL;
+                 node = node->id_next) {
                 if (node->is_hidden) {
                     char *path = get_path(f, node->nodeid);
                     if (path) {
@@ -3227,17 +3439,17 @@ void fuse_destroy(struct fuse *f)
             }
         }
     }
-    for (i = 0; i < f->id_table_size; i++) {
+    for (i = 0; i < f->id_table.size; i++) {
         struct node *node;
         struct node *next;
 
-        for (node = f->id_table[i]; node != NULL; node = next) {
+        for (node = f->id_table.array[i]; node != NULL; node = next) {
             next = node->id_next;
             free_node(node);
         }
     }
-    free(f->id_table);
-    free(f->name_table);
+    free(f->id_table.array);
+    free(f->name_table.array);
     pthread_mutex_destroy(&f->lock);
     pthread_rwlock_destroy(&f->tree_lock);
     fuse_session_destroy(f->se);
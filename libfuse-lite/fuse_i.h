@@ -20,6 +20,9 @@ struct fuse_cmd {
 };
 
 struct fuse_chan *fuse_kern_chan_new(int fd);
+int fuse_kern_chan_set_splice(struct fuse_chan *ch, int splice_write);
+
+char *fuse_loop_buf_alloc(size_t bufsize, void **pbase);
 
 void fuse_kern_unmount(const char *mountpoint, int fd);
 int fuse_kern_mount(const char *mountpoint, struct fuse_args *args);
@@ -12,9 +12,143 @@
 #include "fuse_i.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <assert.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_SPLICE) && defined(HAVE_VMSPLICE) && defined(SPLICE_F_MOVE)
+#define FUSE_SPLICE 1
+#endif
+
+struct fuse_kern_chan {
+    int splice_write;
+    pthread_key_t pipe_key;
+};
+
+#ifdef FUSE_SPLICE
+
+/* Replies smaller than this are written the usual way */
+#define SPLICE_MIN_SIZE 8192
+
+struct fuse_pipe {
+    int fd[2];
+    size_t size;
+};
+
+static void fuse_pipe_close(void *data)
+{
+    struct fuse_pipe *p = (struct fuse_pipe *) data;
+
+    close(p->fd[0]);
+    close(p->fd[1]);
+    free(p);
+}
+
+/*
+ * Get the pipe of the current thread, creating it if needed, with
+ * a capacity for the whole reply
+ */
+static struct fuse_pipe *fuse_kern_chan_pipe(struct fuse_kern_chan *kc,
+                                             size_t size)
+{
+    struct fuse_pipe *p = pthread_getspecific(kc->pipe_key);
+
+    if (!p) {
+        p = (struct fuse_pipe *) malloc(sizeof(struct fuse_pipe));
+        if (!p)
+            return NULL;
+        if (pipe(p->fd) == -1) {
+            free(p);
+            return NULL;
+        }
+        p->size = getpagesize() * 16;
+        pthread_setspecific(kc->pipe_key, p);
+    }
+#ifdef F_SETPIPE_SZ
+    if (p->size < size) {
+        int res = fcntl(p->fd[0], F_SETPIPE_SZ, size);
+        if (res == -1)
+            return NULL;
+        p->size = res;
+    }
+#endif
+    return (p->size < size ? NULL : p);
+}
+
+static void fuse_kern_chan_drop_pipe(struct fuse_kern_chan *kc)
+{
+    struct fuse_pipe *p = pthread_getspecific(kc->pipe_key);
+
+    if (p) {
+        pthread_setspecific(kc->pipe_key, NULL);
+        fuse_pipe_close(p);
+    }
+}
+
+/*
+ * Send a reply by mapping the user pages into a pipe, and moving
+ * them to the device, the data not being copied through user space.
+ *
+ * Returns 0 if the reply was sent, 1 if it has to be sent the usual
+ * way, or a negated error code.
+ */
+static int fuse_kern_chan_splice(struct fuse_chan *ch,
+                                 const struct iovec iov[], size_t count)
+{
+    struct fuse_kern_chan *kc = (struct fuse_kern_chan *) fuse_chan_data(ch);
+    struct fuse_pipe *p;
+    size_t len = 0;
+    ssize_t res;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        len += iov[i].iov_len;
+    if (len < SPLICE_MIN_SIZE)
+        return 1;
+    p = fuse_kern_chan_pipe(kc, len);
+    if (!p)
+        return 1;
+    res = vmsplice(p->fd[1], iov, count, SPLICE_F_NONBLOCK);
+    if (res != (ssize_t) len) {
+        /* the pipe may hold a part of the reply */
+        fuse_kern_chan_drop_pipe(kc);
+        if (res == -1 && errno != EAGAIN)
+            kc->splice_write = 0;
+        return 1;
+    }
+    res = splice(p->fd[0], NULL, fuse_chan_fd(ch), NULL, len, SPLICE_F_MOVE);
+    if (res == (ssize_t) len)
+        return 0;
+    fuse_kern_chan_drop_pipe(kc);
+    if (res == -1) {
+        int err = errno;
+        /* not supported by the kernel, do not try again */
+        if (err == EINVAL || err == ENOSYS)
+            kc->splice_write = 0;
+        else
+            return -err;
+    }
+    return 1;
+}
+
+#endif /* FUSE_SPLICE */
+
+int fuse_kern_chan_set_splice(struct fuse_chan *ch, int splice_write)
+{
+#ifdef FUSE_SPLICE
+    struct fuse_kern_chan *kc = (struct fuse_kern_chan *) fuse_chan_data(ch);
+
+    kc->splice_write = splice_write;
+    return 0;
+#else
+    (void) ch;
+    return splice_write ? -ENOSYS : 0;
+#endif
+}
 
 static int fuse_kern_chan_receive(struct fuse_chan **chp, char *buf,
                                   size_t size)
@@ -59,8 +193,25 @@ static int fuse_kern_chan_send(struct fuse_chan *ch, const struct iovec iov[],
                                size_t count)
 {
     if (iov) {
-        ssize_t res = writev(fuse_chan_fd(ch), iov, count);
-        int err = errno;
+        ssize_t res;
+        int err;
+
+#ifdef FUSE_SPLICE
+        if (((struct fuse_kern_chan *) fuse_chan_data(ch))->splice_write) {
+            res = fuse_kern_chan_splice(ch, iov, count);
+            if (res <= 0) {
+                if (res < 0) {
+                    struct fuse_session *se = fuse_chan_session(ch);
+
+                    if (!fuse_session_exited(se) && res != -ENOENT)
+                        perror("fuse: splicing to device");
+                }
+                return res;
+            }
+        }
+#endif
+        res = writev(fuse_chan_fd(ch), iov, count);
+        err = errno;
 
         if (res == -1) {
             struct fuse_session *se = fuse_chan_session(ch);
@@ -78,7 +229,14 @@ static int fuse_kern_chan_send(struct fuse_chan *ch, const struct iovec iov[],
 
 static void fuse_kern_chan_destroy(struct fuse_chan *ch)
 {
+    struct fuse_kern_chan *kc = (struct fuse_kern_chan *) fuse_chan_data(ch);
+
     close(fuse_chan_fd(ch));
+#ifdef FUSE_SPLICE
+    fuse_kern_chan_drop_pipe(kc);
+#endif
+    pthread_key_delete(kc->pipe_key);
+    free(kc);
 }
 
 #define MIN_BUFSIZE 0x21000
@@ -91,6 +249,27 @@ struct fuse_chan *fuse_kern_chan_new(int fd)
         .destroy = fuse_kern_chan_destroy,
     };
     size_t bufsize = getpagesize() + 0x1000;
+    struct fuse_kern_chan *kc;
+    struct fuse_chan *ch;
+
     bufsize = bufsize < MIN_BUFSIZE ? MIN_BUFSIZE : bufsize;
-    return fuse_chan_new(&op, fd, bufsize, NULL);
+    kc = (struct fuse_kern_chan *) calloc(1, sizeof(struct fuse_kern_chan));
+    if (!kc) {
+        fprintf(stderr, "fuse: failed to allocate channel\n");
+        return NULL;
+    }
+#ifdef FUSE_SPLICE
+    if (pthread_key_create(&kc->pipe_key, fuse_pipe_close)) {
+#else
+    if (pthread_key_create(&kc->pipe_key, NULL)) {
+#endif
+        free(kc);
+        return NULL;
+    }
+    ch = fuse_chan_new(&op, fd, bufsize, kc);
+    if (!ch) {
+        pthread_key_delete(kc->pipe_key);
+        free(kc);
+    }
+    return ch;
 }
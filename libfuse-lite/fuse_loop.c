@@ -8,17 +8,37 @@
 
 #include "config.h"
 #include "fuse_lowlevel.h"
+#include "fuse_kernel.h"
+#include "fuse_i.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
 
+/*
+ * Allocate a buffer for receiving requests, placed so that the data
+ * of write requests is page aligned. The file system can then write
+ * it to a device opened with O_DIRECT without copying it again.
+ * The base of the allocation is returned for freeing it.
+ */
+char *fuse_loop_buf_alloc(size_t bufsize, void **pbase)
+{
+    size_t pagesize = getpagesize();
+    size_t ofs = sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in);
+
+    if (posix_memalign(pbase, pagesize, bufsize + pagesize))
+        return NULL;
+    return (char *) *pbase + pagesize - ofs;
+}
+
 int fuse_session_loop(struct fuse_session *se)
 {
     int res = 0;
     struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
     size_t bufsize = fuse_chan_bufsize(ch);
-    char *buf = (char *) malloc(bufsize);
+    void *base;
+    char *buf = fuse_loop_buf_alloc(bufsize, &base);
     if (!buf) {
         fprintf(stderr, "fuse: failed to allocate read buffer\n");
         return -1;
@@ -34,7 +54,7 @@ int fuse_session_loop(struct fuse_session *se)
         fuse_session_process(se, buf, res, tmpch);
     }
 
-    free(buf);
+    free(base);
     fuse_session_reset(se);
     return res < 0 ? -1 : 0;
 }
@@ -0,0 +1,334 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU LGPLv2.
+    See the file COPYING.LIB
+*/
+
+#include "config.h"
+#include "fuse_lowlevel.h"
+#include "fuse_kernel.h"
+#include "fuse_i.h"
+#include "fuse_misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#define FUSE_LOOP_MT_WORKERS 10
+
+/*
+ * Bulk requests (big reads and writes, syncs) are only processed by
+ * a share of the workers, the others being kept for the interactive
+ * ones (lookups, attributes, listings...). The bulk requests received
+ * when all the bulk workers are busy are parked with their buffer,
+ * and processed in order by the bulk workers when they are done.
+ */
+#define FUSE_LOOP_MT_SMALL_IO 65536     /* transfers still interactive */
+#define FUSE_LOOP_MT_MAX_PARKED 64      /* bulk requests parked */
+
+struct fuse_parked {
+    struct fuse_parked *next;
+    struct fuse_chan *ch;
+    size_t len;
+    char *buf;
+    void *base;
+};
+
+struct fuse_mt {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    fuse_worker_hook hook;
+    void *data;
+    int error;
+    sem_t finish;
+    pthread_mutex_t lock;
+    int bulk;                   /* bulk requests being processed */
+    int bulk_max;               /* workers allowed to process them */
+    int parked_count;
+    struct fuse_parked *first;  /* oldest bulk request parked */
+    struct fuse_parked *last;
+    struct fuse_parked *spare;  /* unused entries, with their buffer */
+};
+
+struct fuse_worker {
+    pthread_t thread_id;
+    struct fuse_mt *mt;
+    size_t bufsize;
+    char *buf;
+    void *base;
+    int ioprio;                 /* bulk or interactive, -1 if not set */
+};
+
+static int fuse_request_is_bulk(const char *buf, size_t len)
+{
+    const struct fuse_in_header *in = (const struct fuse_in_header *) buf;
+    /* the size is at the same place in fuse_write_in */
+    const struct fuse_read_in *arg = (const struct fuse_read_in *) &in[1];
+
+    switch (in->opcode) {
+    case FUSE_READ:
+    case FUSE_WRITE:
+        return len >= sizeof(*in) + sizeof(*arg)
+            && arg->size > FUSE_LOOP_MT_SMALL_IO;
+    case FUSE_FSYNC:
+    case FUSE_FALLOCATE:
+    case FUSE_COPY_FILE_RANGE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+
+/*
+ * Serve the device transfers of the current thread at the lowest
+ * best-effort level for a bulk request and the highest otherwise
+ */
+static void fuse_worker_ioprio(struct fuse_worker *w, int bulk)
+{
+    if (w->ioprio != bulk) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | (bulk ? 7 : 0));
+        w->ioprio = bulk;
+    }
+}
+
+#else
+
+static void fuse_worker_ioprio(struct fuse_worker *w, int bulk)
+{
+    (void) w;
+    (void) bulk;
+}
+
+#endif
+
+static void fuse_process(struct fuse_mt *mt, char *buf, size_t len,
+                         struct fuse_chan *ch)
+{
+    int opcode = ((const struct fuse_in_header *) buf)->opcode;
+
+    if (mt->hook)
+        mt->hook(mt->data, opcode, 0);
+    fuse_session_process(mt->se, buf, len, ch);
+    if (mt->hook)
+        mt->hook(mt->data, opcode, 1);
+}
+
+/*
+ * Park the request in the buffer of the worker, which gets another
+ * buffer. Called with the lock held, returns 0 if the request could
+ * not be parked, and has to be processed anyway.
+ */
+static int fuse_park(struct fuse_mt *mt, struct fuse_worker *w,
+                     size_t len, struct fuse_chan *ch)
+{
+    struct fuse_parked *p;
+    char *buf;
+    void *base;
+
+    if (mt->parked_count >= FUSE_LOOP_MT_MAX_PARKED)
+        return 0;
+    p = mt->spare;
+    if (p)
+        mt->spare = p->next;
+    else {
+        p = (struct fuse_parked *) malloc(sizeof(struct fuse_parked));
+        if (!p)
+            return 0;
+        p->buf = fuse_loop_buf_alloc(w->bufsize, &p->base);
+        if (!p->buf) {
+            free(p);
+            return 0;
+        }
+    }
+    buf = p->buf;
+    base = p->base;
+    p->buf = w->buf;
+    p->base = w->base;
+    p->len = len;
+    p->ch = ch;
+    p->next = NULL;
+    w->buf = buf;
+    w->base = base;
+    if (mt->last)
+        mt->last->next = p;
+    else
+        mt->first = p;
+    mt->last = p;
+    mt->parked_count++;
+    return 1;
+}
+
+/*
+ * Process a bulk request, then the ones parked meanwhile
+ */
+static void fuse_process_bulk(struct fuse_mt *mt, struct fuse_worker *w,
+                              size_t len, struct fuse_chan *ch)
+{
+    struct fuse_parked *p;
+
+    pthread_mutex_lock(&mt->lock);
+    if (mt->bulk >= mt->bulk_max && fuse_park(mt, w, len, ch)) {
+        pthread_mutex_unlock(&mt->lock);
+        return;
+    }
+    mt->bulk++;
+    pthread_mutex_unlock(&mt->lock);
+    fuse_worker_ioprio(w, 1);
+    fuse_process(mt, w->buf, len, ch);
+    pthread_mutex_lock(&mt->lock);
+    while (mt->first && !fuse_session_exited(mt->se)) {
+        p = mt->first;
+        mt->first = p->next;
+        if (!mt->first)
+            mt->last = NULL;
+        mt->parked_count--;
+        pthread_mutex_unlock(&mt->lock);
+        fuse_process(mt, p->buf, p->len, p->ch);
+        pthread_mutex_lock(&mt->lock);
+        p->next = mt->spare;
+        mt->spare = p;
+    }
+    mt->bulk--;
+    pthread_mutex_unlock(&mt->lock);
+}
+
+static void *fuse_do_work(void *data)
+{
+    struct fuse_worker *w = (struct fuse_worker *) data;
+    struct fuse_mt *mt = w->mt;
+
+    while (!fuse_session_exited(mt->se)) {
+        struct fuse_chan *ch = mt->ch;
+        int res;
+
+        /* only cancelled while waiting for a request */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_chan_recv(&ch, w->buf, w->bufsize);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(mt->se);
+                mt->error = -1;
+            }
+            break;
+        }
+        if (fuse_request_is_bulk(w->buf, res))
+            fuse_process_bulk(mt, w, res, ch);
+        else {
+            fuse_worker_ioprio(w, 0);
+            fuse_process(mt, w->buf, res, ch);
+        }
+    }
+    sem_post(&mt->finish);
+    return NULL;
+}
+
+static void fuse_free_parked(struct fuse_parked *p)
+{
+    struct fuse_parked *next;
+
+    for (; p; p = next) {
+        next = p->next;
+        free(p->base);
+        free(p);
+    }
+}
+
+int fuse_session_loop_pool(struct fuse_session *se, int workers,
+                           fuse_worker_hook hook, void *data)
+{
+    struct fuse_mt mt;
+    struct fuse_worker *w;
+    sigset_t oldset;
+    sigset_t newset;
+    int started;
+    int i;
+
+    if (workers < 1)
+        workers = 1;
+    w = (struct fuse_worker *) calloc(workers, sizeof(struct fuse_worker));
+    if (!w) {
+        fprintf(stderr, "fuse: failed to allocate workers\n");
+        return -1;
+    }
+    memset(&mt, 0, sizeof(mt));
+    mt.se = se;
+    mt.ch = fuse_session_next_chan(se, NULL);
+    mt.hook = hook;
+    mt.data = data;
+    /* keep a quarter of the workers for the interactive requests */
+    mt.bulk_max = workers > 1 ? workers - (workers + 3) / 4 : workers;
+    sem_init(&mt.finish, 0, 0);
+    pthread_mutex_init(&mt.lock, NULL);
+
+    /* Disallow signal reception in worker threads */
+    sigemptyset(&newset);
+    sigaddset(&newset, SIGTERM);
+    sigaddset(&newset, SIGINT);
+    sigaddset(&newset, SIGHUP);
+    sigaddset(&newset, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    for (started = 0; started < workers; started++) {
+        w[started].mt = &mt;
+        w[started].ioprio = -1;
+        w[started].bufsize = fuse_chan_bufsize(mt.ch);
+        w[started].buf = fuse_loop_buf_alloc(w[started].bufsize,
+                                             &w[started].base);
+        if (!w[started].buf) {
+            fprintf(stderr, "fuse: failed to allocate read buffer\n");
+            break;
+        }
+        if (pthread_create(&w[started].thread_id, NULL, fuse_do_work,
+                           &w[started])) {
+            fprintf(stderr, "fuse: error creating thread\n");
+            free(w[started].base);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (!started)
+        mt.error = -1;
+    else {
+        /* Wait for a worker to stop, or for a signal */
+        while (!fuse_session_exited(se))
+            sem_wait(&mt.finish);
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_cancel(w[i].thread_id);
+    for (i = 0; i < started; i++) {
+        pthread_join(w[i].thread_id, NULL);
+        free(w[i].base);
+    }
+    fuse_free_parked(mt.first);
+    fuse_free_parked(mt.spare);
+    pthread_mutex_destroy(&mt.lock);
+    sem_destroy(&mt.finish);
+    free(w);
+    fuse_session_reset(se);
+    return mt.error;
+}
+
+int fuse_session_loop_mt(struct fuse_session *se)
+{
+    return fuse_session_loop_pool(se, FUSE_LOOP_MT_WORKERS,
+                                  (fuse_worker_hook) NULL, NULL);
+}
@@ -35,6 +35,11 @@
 #define PARAM(inarg) (((const char *)(inarg)) + sizeof(*(inarg)))
 #define OFFSET_MAX 0x7fffffffffffffffLL
 
+/* Free requests kept by each thread for reuse */
+#define REQ_CACHE_SIZE 16
+/* Replies with fewer iovecs are sent without allocating */
+#define REPLY_IOV_MAX 16
+
 struct fuse_ll;
 
 struct fuse_req {
@@ -70,6 +75,20 @@ struct fuse_ll {
     struct fuse_req interrupts;
     pthread_mutex_t lock;
     int got_destroy;
+    int splice_write;
+    pthread_key_t req_cache_key;
+};
+
+/*
+ * The requests are freed into a list of the current thread, from
+ * where the next requests received by the thread are taken, so that
+ * no allocation is needed in a steady state. The thread also has
+ * room for the iovecs of the replies.
+ */
+struct fuse_req_cache {
+    struct fuse_req *free_reqs;
+    int count;
+    struct iovec iov[REPLY_IOV_MAX];
 };
 
 static void convert_stat(const struct stat *stbuf, struct fuse_attr *attr)
@@ -144,10 +163,59 @@ static void list_add_req(struct fuse_req *req, struct fuse_req *next)
     next->prev = req;
 }
 
+static void fuse_req_cache_free(void *data)
+{
+    struct fuse_req_cache *cache = (struct fuse_req_cache *) data;
+    struct fuse_req *req;
+
+    while ((req = cache->free_reqs) != NULL) {
+        cache->free_reqs = req->next;
+        free(req);
+    }
+    free(cache);
+}
+
+static struct fuse_req_cache *get_req_cache(struct fuse_ll *f)
+{
+    struct fuse_req_cache *cache = pthread_getspecific(f->req_cache_key);
+
+    if (!cache) {
+        cache = (struct fuse_req_cache *)
+            calloc(1, sizeof(struct fuse_req_cache));
+        if (cache && pthread_setspecific(f->req_cache_key, cache)) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+static struct fuse_req *alloc_req(struct fuse_ll *f)
+{
+    struct fuse_req_cache *cache = get_req_cache(f);
+    struct fuse_req *req;
+
+    if (cache && cache->free_reqs) {
+        req = cache->free_reqs;
+        cache->free_reqs = req->next;
+        cache->count--;
+        memset(req, 0, sizeof(struct fuse_req));
+    } else
+        req = (struct fuse_req *) calloc(1, sizeof(struct fuse_req));
+    return req;
+}
+
 static void destroy_req(fuse_req_t req)
 {
+    struct fuse_req_cache *cache = get_req_cache(req->f);
+
     pthread_mutex_destroy(&req->lock);
-    free(req);
+    if (cache && cache->count < REQ_CACHE_SIZE) {
+        req->next = cache->free_reqs;
+        cache->free_reqs = req;
+        cache->count++;
+    } else
+        free(req);
 }
 
 static void free_req(fuse_req_t req)
@@ -195,6 +263,72 @@ static int send_reply_iov(fuse_req_t req, int error, struct iovec *iov,
     return res;
 }
 
+static int send_notify_iov(struct fuse_ll *f, struct fuse_chan *ch,
+                           int notify_code, struct iovec *iov, int count)
+{
+    struct fuse_out_header out;
+
+    if (!f->got_init)
+        return -ENOTCONN;
+    if ((f->conn.proto_major == 7)
+        && (f->conn.proto_minor < FUSE_KERNEL_MINOR_NOTIFY_INVAL))
+        return -ENOSYS;
+    out.unique = 0;
+    out.error = notify_code;
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(struct fuse_out_header);
+    out.len = iov_length(iov, count);
+
+    if (f->debug)
+        fprintf(stderr, "   NOTIFY: code=%d length=%u\n",
+                notify_code, out.len);
+    return fuse_chan_send(ch, iov, count);
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len)
+{
+    struct fuse_notify_inval_inode_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[2];
+
+    if (!ch || !fuse_chan_session(ch))
+        return -EINVAL;
+    f = (struct fuse_ll *) fuse_session_data(fuse_chan_session(ch));
+    if (!f)
+        return -ENODEV;
+
+    outarg.ino = ino;
+    outarg.off = off;
+    outarg.len = len;
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_INODE, iov, 2);
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen)
+{
+    struct fuse_notify_inval_entry_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[3];
+
+    if (!ch || !fuse_chan_session(ch))
+        return -EINVAL;
+    f = (struct fuse_ll *) fuse_session_data(fuse_chan_session(ch));
+    if (!f)
+        return -ENODEV;
+
+    outarg.parent = parent;
+    outarg.namelen = namelen;
+    outarg.padding = 0;
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+    iov[2].iov_base = (void *) name;
+    iov[2].iov_len = namelen + 1;
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_ENTRY, iov, 3);
+}
+
 static int send_reply(fuse_req_t req, int error, const void *arg,
                       size_t argsize)
 {
@@ -209,25 +343,29 @@ static int send_reply(fuse_req_t req, int error, const void *arg,
     return send_reply_iov(req, error, iov, count);
 }
 
-#if 0 /* not used */
 int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
 {
     int res;
     struct iovec *padded_iov;
+    struct fuse_req_cache *cache = get_req_cache(req->f);
 
-    padded_iov = malloc((count + 1) * sizeof(struct iovec));
-    if (padded_iov == NULL)
-        return fuse_reply_err(req, -ENOMEM);
+    if (cache && count < REPLY_IOV_MAX)
+        padded_iov = cache->iov;
+    else {
+        padded_iov = malloc((count + 1) * sizeof(struct iovec));
+        if (padded_iov == NULL)
+            return fuse_reply_err(req, -ENOMEM);
+    }
 
     memcpy(padded_iov + 1, iov, count * sizeof(struct iovec));
     count++;
 
     res = send_reply_iov(req, 0, padded_iov, count);
-    free(padded_iov);
+    if (!cache || padded_iov != cache->iov)
+        free(padded_iov);
 
     return res;
 }
-#endif
 
 size_t fuse_dirent_size(size_t namelen)
 {
@@ -329,6 +467,30 @@ static void fill_entry(struct fuse_entry_out *arg,
     convert_stat(&e->attr, &arg->attr);
 }
 
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+                              const char *name,
+                              const struct fuse_entry_param *e, off_t off)
+{
+    unsigned namelen = strlen(name);
+    unsigned entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
+    unsigned entsize = FUSE_DIRENT_ALIGN(entlen);
+    struct fuse_direntplus *dp = (struct fuse_direntplus *) buf;
+
+    (void) req;
+    if (entsize <= bufsize && buf) {
+        memset(&dp->entry_out, 0, sizeof(dp->entry_out));
+        fill_entry(&dp->entry_out, e);
+        dp->dirent.ino = e->attr.st_ino;
+        dp->dirent.off = off;
+        dp->dirent.namelen = namelen;
+        dp->dirent.type = (e->attr.st_mode & 0170000) >> 12;
+        memcpy(dp->dirent.name, name, namelen);
+        if (entsize > entlen)
+            memset(buf + entlen, 0, entsize - entlen);
+    }
+    return entsize;
+}
+
 static void fill_open(struct fuse_open_out *arg,
                       const struct fuse_file_info *f)
 {
@@ -466,6 +628,16 @@ int fuse_reply_bmap(fuse_req_t req, uint64_t idx)
     return send_reply_ok(req, &arg, sizeof(arg));
 }
 
+int fuse_reply_lseek(fuse_req_t req, off_t off)
+{
+    struct fuse_lseek_out arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.offset = off;
+
+    return send_reply_ok(req, &arg, sizeof(arg));
+}
+
 int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size)
 {
     struct fuse_ioctl_out arg;
@@ -508,6 +680,38 @@ static void do_forget(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_none(req);
 }
 
+static void do_batch_forget(fuse_req_t req, fuse_ino_t nodeid,
+                            const void *inarg)
+{
+    const struct fuse_batch_forget_in *arg =
+                            (const struct fuse_batch_forget_in *) inarg;
+    struct fuse_forget_one *param = (struct fuse_forget_one *) PARAM(arg);
+    struct fuse_req *dummy_req;
+    unsigned int i;
+
+    (void) nodeid;
+    if (req->f->op.forget_multi) {
+        req->f->op.forget_multi(req, arg->count,
+                            (struct fuse_forget_data *) param);
+    } else if (req->f->op.forget) {
+        /* each forget frees its request, so use a copy for each */
+        for (i = 0; i < arg->count; i++) {
+            dummy_req = alloc_req(req->f);
+            if (!dummy_req)
+                break;
+            dummy_req->f = req->f;
+            dummy_req->ctx = req->ctx;
+            dummy_req->ch = req->ch;
+            dummy_req->ctr = 1;
+            list_init_req(dummy_req);
+            fuse_mutex_init(&dummy_req->lock);
+            req->f->op.forget(dummy_req, param[i].nodeid, param[i].nlookup);
+        }
+        fuse_reply_none(req);
+    } else
+        fuse_reply_none(req);
+}
+
 static void do_getattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     (void) inarg;
@@ -805,6 +1009,22 @@ static void do_readdir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_err(req, ENOSYS);
 }
 
+static void do_readdirplus(fuse_req_t req, fuse_ino_t nodeid,
+                           const void *inarg)
+{
+    const struct fuse_read_in *arg = (const struct fuse_read_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+    fi.fh_old = fi.fh;
+
+    if (req->f->op.readdirplus)
+        req->f->op.readdirplus(req, nodeid, arg->size, arg->offset, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
 static void do_releasedir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const struct fuse_release_in *arg = (const struct fuse_release_in *) inarg;
@@ -1014,7 +1234,7 @@ static struct fuse_req *check_interrupt(struct fuse_ll *f, struct fuse_req *req)
         if (curr->u.i.unique == req->unique) {
             req->interrupted = 1;
             list_del_req(curr);
-            free(curr);
+            destroy_req(curr);
             return NULL;
         }
     }
@@ -1070,6 +1290,58 @@ static void do_ioctl(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     	fuse_reply_err(req, ENOSYS);
 }
 
+static void do_fallocate(fuse_req_t req, fuse_ino_t nodeid,
+			const void *inarg)
+{
+    const struct fuse_fallocate_in *arg =
+			(const struct fuse_fallocate_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+
+    if (req->f->op.fallocate)
+        req->f->op.fallocate(req, nodeid, arg->mode, arg->offset,
+			arg->length, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
+static void do_lseek(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
+{
+    const struct fuse_lseek_in *arg = (const struct fuse_lseek_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+
+    if (req->f->op.lseek)
+        req->f->op.lseek(req, nodeid, arg->offset, arg->whence, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
+static void do_copy_file_range(fuse_req_t req, fuse_ino_t nodeid,
+			const void *inarg)
+{
+    const struct fuse_copy_file_range_in *arg =
+			(const struct fuse_copy_file_range_in *) inarg;
+    struct fuse_file_info fi_in;
+    struct fuse_file_info fi_out;
+
+    memset(&fi_in, 0, sizeof(fi_in));
+    fi_in.fh = arg->fh_in;
+    memset(&fi_out, 0, sizeof(fi_out));
+    fi_out.fh = arg->fh_out;
+
+    if (req->f->op.copy_file_range)
+        req->f->op.copy_file_range(req, nodeid, arg->off_in, &fi_in,
+			arg->nodeid_out, arg->off_out, &fi_out,
+			arg->len, arg->flags);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
 static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const struct fuse_init_in *arg = (const struct fuse_init_in *) inarg;
@@ -1110,6 +1382,17 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	    f->conn.capable |= FUSE_CAP_BIG_WRITES;
 	if (arg->flags & FUSE_HAS_IOCTL_DIR)
 	    f->conn.capable |= FUSE_CAP_IOCTL_DIR;
+	if (arg->flags & FUSE_DO_READDIRPLUS)
+	    f->conn.capable |= FUSE_CAP_READDIRPLUS;
+	if ((arg->major > 7 || arg->minor >= FUSE_KERNEL_MINOR_WRITEBACK_CACHE)
+	    && (arg->flags & FUSE_WRITEBACK_CACHE))
+	    f->conn.capable |= FUSE_CAP_WRITEBACK_CACHE;
+	if ((arg->major > 7 || arg->minor >= FUSE_KERNEL_MINOR_PARALLEL_DIROPS)
+	    && (arg->flags & FUSE_PARALLEL_DIROPS))
+	    f->conn.capable |= FUSE_CAP_PARALLEL_DIROPS;
+	if ((arg->major > 7 || arg->minor >= FUSE_KERNEL_MINOR_MAX_PAGES)
+	    && (arg->flags & FUSE_MAX_PAGES))
+	    f->conn.capable |= FUSE_CAP_MAX_PAGES;
     } else {
         f->conn.async_read = 0;
         f->conn.max_readahead = 0;
@@ -1125,6 +1408,9 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     if (bufsize < f->conn.max_write)
         f->conn.max_write = bufsize;
 
+    if (f->splice_write && fuse_kern_chan_set_splice(req->ch, 1))
+        fprintf(stderr, "fuse: splice is not supported\n");
+
     f->got_init = 1;
     if (f->op.init)
         f->op.init(f->userdata, &f->conn);
@@ -1137,11 +1423,49 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	 * Protocol 7.12 has the ability to process the umask
 	 * conditionnally (as needed if POSIXACLS is set)
 	 * Protocol 7.18 has the ability to process the ioctls
+	 * Protocol 7.21 has the ability to process readdirplus, only
+	 * suggested when wanted (the adaptive mode is never requested,
+	 * so that the requests on a directory are all of the same kind)
+	 * Protocols 7.23, 7.25 and 7.28 are only suggested when the
+	 * writeback cache, the parallel directory operations or the
+	 * requests of more than 32 pages are wanted.
 	 */
     if (arg->major > 7 || (arg->major == 7 && arg->minor >= 18)) {
 	    outarg.minor = FUSE_KERNEL_MINOR_VERSION;
 	    if (f->conn.want & FUSE_CAP_IOCTL_DIR)
 		outarg.flags |= FUSE_HAS_IOCTL_DIR;
+	    if ((arg->major > 7 || arg->minor >= FUSE_KERNEL_MINOR_READDIRPLUS)
+		&& (f->conn.want & f->conn.capable & FUSE_CAP_READDIRPLUS)
+		&& f->op.readdirplus) {
+		outarg.minor = FUSE_KERNEL_MINOR_READDIRPLUS;
+		outarg.flags |= FUSE_DO_READDIRPLUS;
+	    }
+	    if (f->conn.want & f->conn.capable & FUSE_CAP_WRITEBACK_CACHE) {
+		outarg.minor = FUSE_KERNEL_MINOR_WRITEBACK_CACHE;
+		outarg.flags |= FUSE_WRITEBACK_CACHE;
+			/* the NTFS times have a 100ns granularity */
+		outarg.time_gran = 100;
+	    }
+	    if (f->conn.want & f->conn.capable & FUSE_CAP_PARALLEL_DIROPS) {
+		outarg.minor = FUSE_KERNEL_MINOR_PARALLEL_DIROPS;
+		outarg.flags |= FUSE_PARALLEL_DIROPS;
+	    }
+	    if (f->conn.want & f->conn.capable & FUSE_CAP_MAX_PAGES) {
+		unsigned max_pages;
+
+		max_pages = bufsize / getpagesize();
+		if (f->conn.max_pages && (f->conn.max_pages < max_pages))
+		    max_pages = f->conn.max_pages;
+		if (max_pages > FUSE_MAX_MAX_PAGES)
+		    max_pages = FUSE_MAX_MAX_PAGES;
+		if (max_pages > FUSE_DEFAULT_MAX_PAGES) {
+		    outarg.minor = FUSE_KERNEL_MINOR_MAX_PAGES;
+		    outarg.flags |= FUSE_MAX_PAGES;
+		    outarg.max_pages = max_pages;
+		    if (f->conn.max_write > max_pages * getpagesize())
+			f->conn.max_write = max_pages * getpagesize();
+		}
+	    }
 #ifdef POSIXACLS
 	    if (f->conn.want & FUSE_CAP_DONT_MASK)
 		outarg.flags |= FUSE_DONT_MASK;
@@ -1180,9 +1504,17 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fprintf(stderr, "   flags=0x%08x\n", outarg.flags);
         fprintf(stderr, "   max_readahead=0x%08x\n", outarg.max_readahead);
         fprintf(stderr, "   max_write=0x%08x\n", outarg.max_write);
+        if (outarg.max_pages)
+            fprintf(stderr, "   max_pages=%u\n", outarg.max_pages);
     }
 
-    send_reply_ok(req, &outarg, arg->minor < 5 ? 8 : sizeof(outarg));
+	/* Only reply the extended fields to a kernel expecting them */
+    if (arg->minor < 5)
+        send_reply_ok(req, &outarg, 8);
+    else if ((arg->major == 7) && (outarg.minor < FUSE_KERNEL_MINOR_WRITEBACK_CACHE))
+        send_reply_ok(req, &outarg, FUSE_COMPAT_22_INIT_OUT_SIZE);
+    else
+        send_reply_ok(req, &outarg, sizeof(outarg));
 }
 
 static void do_destroy(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
@@ -1271,6 +1603,11 @@ static struct {
     [FUSE_INTERRUPT]   = { do_interrupt,   "INTERRUPT"   },
     [FUSE_BMAP]        = { do_bmap,        "BMAP"        },
     [FUSE_IOCTL]       = { do_ioctl,       "IOCTL"       },
+    [FUSE_BATCH_FORGET] = { do_batch_forget, "BATCH_FORGET" },
+    [FUSE_FALLOCATE]   = { do_fallocate,   "FALLOCATE"   },
+    [FUSE_READDIRPLUS] = { do_readdirplus, "READDIRPLUS" },
+    [FUSE_LSEEK]       = { do_lseek,       "LSEEK"       },
+    [FUSE_COPY_FILE_RANGE] = { do_copy_file_range, "COPY_FILE_RANGE" },
     [FUSE_DESTROY]     = { do_destroy,     "DESTROY"     },
 };
 
@@ -1298,7 +1635,7 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
                 opname((enum fuse_opcode) in->opcode), in->opcode,
                 (unsigned long) in->nodeid, len);
 
-    req = (struct fuse_req *) calloc(1, sizeof(struct fuse_req));
+    req = alloc_req(f);
     if (req == NULL) {
         fprintf(stderr, "fuse: failed to allocate request\n");
         return;
@@ -1320,7 +1657,8 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
              in->opcode != FUSE_INIT && in->opcode != FUSE_READ &&
              in->opcode != FUSE_WRITE && in->opcode != FUSE_FSYNC &&
              in->opcode != FUSE_RELEASE && in->opcode != FUSE_READDIR &&
-             in->opcode != FUSE_FSYNCDIR && in->opcode != FUSE_RELEASEDIR) {
+             in->opcode != FUSE_FSYNCDIR && in->opcode != FUSE_RELEASEDIR &&
+             in->opcode != FUSE_READDIRPLUS) {
         fuse_reply_err(req, EACCES);
     } else if (in->opcode >= FUSE_MAXOP || !fuse_ll_ops[in->opcode].func)
         fuse_reply_err(req, ENOSYS);
@@ -1351,6 +1689,7 @@ static struct fuse_opt fuse_ll_opts[] = {
     { "max_readahead=%u", offsetof(struct fuse_ll, conn.max_readahead), 0 },
     { "async_read", offsetof(struct fuse_ll, conn.async_read), 1 },
     { "sync_read", offsetof(struct fuse_ll, conn.async_read), 0 },
+    { "splice_write", offsetof(struct fuse_ll, splice_write), 1 },
     FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("-h", KEY_HELP),
     FUSE_OPT_KEY("--help", KEY_HELP),
@@ -1371,7 +1710,8 @@ static void fuse_ll_help(void)
 "    -o max_write=N         set maximum size of write requests\n"
 "    -o max_readahead=N     set maximum readahead\n"
 "    -o async_read          perform reads asynchronously (default)\n"
-"    -o sync_read           perform reads synchronously\n");
+"    -o sync_read           perform reads synchronously\n"
+"    -o splice_write        use splice to write to the fuse device\n");
 }
 
 static int fuse_ll_opt_proc(void *data, const char *arg, int key,
@@ -1407,12 +1747,19 @@ int fuse_lowlevel_is_lib_option(const char *opt)
 static void fuse_ll_destroy(void *data)
 {
     struct fuse_ll *f = (struct fuse_ll *) data;
+    struct fuse_req_cache *cache;
 
     if (f->got_init && !f->got_destroy) {
         if (f->op.destroy)
             f->op.destroy(f->userdata);
     }
 
+    cache = pthread_getspecific(f->req_cache_key);
+    if (cache) {
+        pthread_setspecific(f->req_cache_key, NULL);
+        fuse_req_cache_free(cache);
+    }
+    pthread_key_delete(f->req_cache_key);
     pthread_mutex_destroy(&f->lock);
     free(f);
 }
@@ -1445,9 +1792,13 @@ struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
     list_init_req(&f->list);
     list_init_req(&f->interrupts);
     fuse_mutex_init(&f->lock);
+    if (pthread_key_create(&f->req_cache_key, fuse_req_cache_free)) {
+        fprintf(stderr, "fuse: failed to create thread specific key\n");
+        goto out_free_lock;
+    }
 
     if (fuse_opt_parse(args, f, fuse_ll_opts, fuse_ll_opt_proc) == -1)
-        goto out_free;
+        goto out_key_destroy;
 
     memcpy(&f->op, op, op_size);
     f->owner = getuid();
@@ -1455,11 +1806,14 @@ struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
 
     se = fuse_session_new(&sop, f);
     if (!se)
-        goto out_free;
+        goto out_key_destroy;
 
     return se;
 
- out_free:
+ out_key_destroy:
+    pthread_key_delete(f->req_cache_key);
+ out_free_lock:
+    pthread_mutex_destroy(&f->lock);
     free(f);
  out:
     return NULL;
@@ -61,6 +61,7 @@
 #include "layout.h"
 #include "security.h"
 #include "acls.h"
+#include "param.h"
 #include "misc.h"
 
 /*
@@ -172,15 +173,21 @@ int ntfs_sid_size(const SID * sid)
 
 /*
  *		Test whether two SID are equal
+ *
+ *	SIDs generally only differ by their last sub-authority (the
+ *	relative id), which is checked first to reject most of them
+ *	before comparing the whole SIDs.
  */
 
 BOOL ntfs_same_sid(const SID *first, const SID *second)
 {
-	int size;
+	int cnt;
 
-	size = ntfs_sid_size(first);
-	return ((ntfs_sid_size(second) == size)
-		&& !memcmp(first, second, size));
+	cnt = first->sub_authority_count;
+	return ((second->sub_authority_count == cnt)
+		&& (!cnt || (first->sub_authority[cnt - 1]
+				== second->sub_authority[cnt - 1]))
+		&& !memcmp(first, second, ntfs_sid_size(first)));
 }
 
 /*
@@ -409,6 +416,125 @@ static u32 findimplicit(const SID *xsid, const SID *pattern, int parity)
 	return (xid);
 }
 
+/*
+ *		Index of a user or group mapping
+ *
+ *	The items located before the implicit mapping pattern are hashed
+ *	by SID and by uid or gid into tables with linear probing. Only
+ *	the first of the items having the same key is entered, so that
+ *	a lookup gets the item a scan of the list would stop on.
+ */
+
+struct MAPPING_INDEX {
+	const struct MAPPING *pattern;	/* implicit pattern, if any */
+	unsigned int mask;
+	const struct MAPPING **bysid;
+	const struct MAPPING **byxid;
+} ;
+
+static unsigned int sid_hash(const SID *sid)
+{
+	unsigned int h;
+	int i;
+
+	h = sid->sub_authority_count;
+	for (i=0; i<sid->sub_authority_count; i++)
+		h = h*31 + le32_to_cpu(sid->sub_authority[i]);
+	h *= 2654435761U;
+	return (h ^ (h >> 16));
+}
+
+static unsigned int xid_hash(unsigned int xid)
+{
+	unsigned int h;
+
+	h = xid*2654435761U;
+	return (h ^ (h >> 16));
+}
+
+/*
+ *		Build the index of a mapping list
+ *
+ *	Returns NULL if the list is too short to be worth indexing, or
+ *	if there is not enough memory, the list is then scanned.
+ */
+
+static struct MAPPING_INDEX *index_mapping(const struct MAPPING *first)
+{
+	struct MAPPING_INDEX *index;
+	const struct MAPPING *p;
+	unsigned int size;
+	unsigned int h;
+	int count;
+
+	index = (struct MAPPING_INDEX*)NULL;
+	size = 16;
+	count = 0;
+	for (p=first; p && p->xid; p=p->next)
+		count++;
+	if (count >= MAPPING_INDEX_MIN) {
+		while (size < (unsigned int)(2*count))
+			size <<= 1;
+		index = (struct MAPPING_INDEX*)ntfs_malloc(
+				sizeof(struct MAPPING_INDEX)
+				+ 2*size*sizeof(const struct MAPPING*));
+	}
+	if (index) {
+		index->mask = size - 1;
+		index->bysid = (const struct MAPPING**)&index[1];
+		index->byxid = &index->bysid[size];
+		memset(index->bysid, 0, 2*size*sizeof(const struct MAPPING*));
+		for (p=first; p && p->xid; p=p->next) {
+			h = sid_hash(p->sid) & index->mask;
+			while (index->bysid[h]
+			    && !ntfs_same_sid(index->bysid[h]->sid, p->sid))
+				h = (h + 1) & index->mask;
+			if (!index->bysid[h])
+				index->bysid[h] = p;
+			h = xid_hash(p->xid) & index->mask;
+			while (index->byxid[h]
+			    && (index->byxid[h]->xid != p->xid))
+				h = (h + 1) & index->mask;
+			if (!index->byxid[h])
+				index->byxid[h] = p;
+		}
+		index->pattern = p;
+	}
+	return (index);
+}
+
+/*
+ *		Find the mapping item for a SID, or the implicit pattern
+ */
+
+static const struct MAPPING *find_indexed_sid(const struct MAPPING_INDEX *index,
+			const SID *sid)
+{
+	const struct MAPPING *p;
+	unsigned int h;
+
+	h = sid_hash(sid) & index->mask;
+	while ((p = index->bysid[h]) && !ntfs_same_sid(sid, p->sid))
+		h = (h + 1) & index->mask;
+	return (p ? p : index->pattern);
+}
+
+/*
+ *		Find the mapping item for a uid or gid, or the implicit pattern
+ */
+
+static const struct MAPPING *find_indexed_xid(const struct MAPPING_INDEX *index,
+			unsigned int xid)
+{
+	const struct MAPPING *p;
+	unsigned int h;
+
+	h = xid_hash(xid) & index->mask;
+	while ((p = index->byxid[h]) && ((unsigned int)p->xid != xid))
+		h = (h + 1) & index->mask;
+	return (p ? p : index->pattern);
+}
+
 /*
  *		Find usid mapped to a Linux user
  *	Returns NULL if not found
@@ -426,9 +552,13 @@ const SID *ntfs_find_usid(const struct MAPPING* usermapping,
 	if (!uid)
 		sid = adminsid;
 	else {
-		p = usermapping;
-		while (p && p->xid && ((uid_t)p->xid != uid))
-			p = p->next;
+		if (usermapping && usermapping->index)
+			p = find_indexed_xid(usermapping->index, uid);
+		else {
+			p = usermapping;
+			while (p && p->xid && ((uid_t)p->xid != uid))
+				p = p->next;
+		}
 		if (p && !p->xid) {
 			/*
 			 * default pattern has been reached :
@@ -470,9 +600,13 @@ const SID *ntfs_find_gsid(const struct MAPPING* groupmapping,
 	if (!gid)
 		sid = adminsid;
 	else {
-		p = groupmapping;
-		while (p && p->xid && ((gid_t)p->xid != gid))
-			p = p->next;
+		if (groupmapping && groupmapping->index)
+			p = find_indexed_xid(groupmapping->index, gid);
+		else {
+			p = groupmapping;
+			while (p && p->xid && ((gid_t)p->xid != gid))
+				p = p->next;
+		}
 		if (p && !p->xid) {
 			/*
 			 * default pattern has been reached :
@@ -507,9 +641,13 @@ uid_t ntfs_find_user(const struct MAPPING* usermapping, const SID *usid)
 	uid_t uid;
 	const struct MAPPING *p;
 
-	p = usermapping;
-	while (p && p->xid && !ntfs_same_sid(usid, p->sid))
-		p = p->next;
+	if (usermapping && usermapping->index)
+		p = find_indexed_sid(usermapping->index, usid);
+	else {
+		p = usermapping;
+		while (p && p->xid && !ntfs_same_sid(usid, p->sid))
+			p = p->next;
+	}
 	if (p && !p->xid)
 		/*
 		 * No explicit mapping found, try implicit mapping
@@ -530,9 +668,13 @@ gid_t ntfs_find_group(const struct MAPPING* groupmapping, const SID * gsid)
 	gid_t gid;
 	const struct MAPPING *p;
 
-	p = groupmapping;
-	while (p && p->xid && !ntfs_same_sid(gsid, p->sid))
-		p = p->next;
+	if (groupmapping && groupmapping->index)
+		p = find_indexed_sid(groupmapping->index, gsid);
+	else {
+		p = groupmapping;
+		while (p && p->xid && !ntfs_same_sid(gsid, p->sid))
+			p = p->next;
+	}
 	if (p && !p->xid)
 		/*
 		 * No explicit mapping found, try implicit mapping
@@ -4336,6 +4478,7 @@ void ntfs_free_mapping(struct MAPPING *mapping[])
 			/* free group list if any */
 		if (user->grcnt)
 			free(user->groups);
+		free(user->index);
 			/* unchain item and free */
 		mapping[MAPUSERS] = user->next;
 		free(user);
@@ -4344,6 +4487,7 @@ void ntfs_free_mapping(struct MAPPING *mapping[])
 	while (mapping[MAPGROUPS]) {
 		group = mapping[MAPGROUPS];
 		free(group->sid);
+		free(group->index);
 			/* unchain item and free */
 		mapping[MAPGROUPS] = group->next;
 		free(group);
@@ -4418,6 +4562,7 @@ struct MAPPING *ntfs_do_user_mapping(struct MAPLIST *firstitem)
 					mapping->sid = sid;
 					mapping->xid = uid;
 					mapping->grcnt = 0;
+					mapping->index = (struct MAPPING_INDEX*)NULL;
 					mapping->next = (struct MAPPING*)NULL;
 					if (lastmapping)
 						lastmapping->next = mapping;
@@ -4429,6 +4574,8 @@ struct MAPPING *ntfs_do_user_mapping(struct MAPLIST *firstitem)
 			}
 		}
 	}
+	if (firstmapping)
+		firstmapping->index = index_mapping(firstmapping);
 	return (firstmapping);
 }
 
@@ -4509,8 +4656,7 @@ struct MAPPING *ntfs_do_group_mapping(struct MAPLIST *firstitem)
 							mapping->grcnt = 1;
 						} else
 							mapping->grcnt = 0;
-
-
+						mapping->index = (struct MAPPING_INDEX*)NULL;
 						mapping->next = (struct MAPPING*)NULL;
 						if (lastmapping)
 							lastmapping->next = mapping;
@@ -4522,5 +4668,7 @@ struct MAPPING *ntfs_do_group_mapping(struct MAPLIST *firstitem)
 			}
 		}
 	}
+	if (firstmapping)
+		firstmapping->index = index_mapping(firstmapping);
 	return (firstmapping);
 }
@@ -0,0 +1,691 @@
+/**
+ * aio.c - Asynchronous reads of attributes, for event loops.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "volume.h"
+#include "attrib.h"
+#include "device.h"
+#include "blkcache.h"
+#include "aio.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Asynchronous reads of attributes
+ *
+ *	An application driven by an event loop submits reads through
+ *	ntfs_aio_submit(), and gets the completions by calling
+ *	ntfs_aio_pump() when the descriptor returned by ntfs_aio_fd()
+ *	is readable. The callbacks are called from ntfs_aio_pump(), in
+ *	the thread of the application, which is the only one to use the
+ *	library.
+ *
+ *	When submitting, the runlist is mapped and the read is split into
+ *	device segments, the holes and the data beyond the initialized
+ *	size being zeroed at once. The segments are then transferred by
+ *	the threads of the queue through the device operations, so that
+ *	the reads of many files are in flight while the application maps
+ *	the next ones. The data of resident, compressed or encrypted
+ *	attributes is read when submitting, and so is the data which is
+ *	dirty in the block cache. When anything was written through the
+ *	block cache while a read was in flight, the segments which have
+ *	become dirty are read again from the cache before completing.
+ *
+ *	The attribute and the buffer must be kept until the read has
+ *	completed, and the data being read must not be relocated or
+ *	freed meanwhile. Without threads, the segments are transferred
+ *	by ntfs_aio_pump().
+ */
+
+struct AIO_REQUEST {
+	struct AIO_REQUEST *next;
+	ntfs_attr *na;
+	s64 pos;			/* position in attribute */
+	s64 count;			/* bytes to read */
+	char *buf;
+	ntfs_aio_callback callback;
+	void *data;			/* argument for the callback */
+	struct ntfs_io_segment *seg;	/* device segments to transfer */
+	int nseg;
+	int allocseg;			/* segments allocated */
+	unsigned long changes;		/* changes of the cache when mapped */
+	s64 res;			/* bytes read or minus the error */
+} ;
+
+struct NTFS_AIO_QUEUE {
+	ntfs_volume *vol;
+	struct AIO_REQUEST *first;	/* oldest request to transfer */
+	struct AIO_REQUEST *last;	/* latest request to transfer */
+	struct AIO_REQUEST *done_first;	/* oldest request to complete */
+	struct AIO_REQUEST *done_last;	/* latest request to complete */
+	int pending;			/* submitted and not completed */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* signalled when a request is queued */
+	pthread_cond_t done;		/* broadcast when a request is done */
+	int fds[2];			/* pipe signalling the completions */
+	BOOL signaled;			/* a byte is in the pipe */
+	BOOL stop;
+	int count;			/* number of threads */
+	pthread_t thread[AIO_MAX_THREADS];
+#endif
+} ;
+
+/*
+ *		Transfer a segment from the device, by as many reads
+ *	as needed
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+static int aio_read_segment(struct ntfs_device *dev, s64 pos, s64 count,
+			char *buf)
+{
+	s64 ret;
+
+	while (count > 0) {
+		ret = dev->d_ops->pread(dev, buf, count, pos);
+		if (ret <= 0) {
+			if (!ret)
+				errno = EIO;
+			return (-1);
+		}
+		pos += ret;
+		buf += ret;
+		count -= ret;
+	}
+	return (0);
+}
+
+/*
+ *		Transfer the segments of a request from the device,
+ *	in batches when the device supports them
+ *
+ *	This is called from the threads, and only uses the device
+ *	operations, which support concurrent reads.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+static int aio_transfer(struct ntfs_device *dev, struct AIO_REQUEST *req)
+{
+	const struct ntfs_io_segment *seg;
+	s64 ret;
+	int i, n;
+
+	i = 0;
+	while (i < req->nseg) {
+		seg = &req->seg[i];
+		n = req->nseg - i;
+		if (n > NTFS_MAX_IO_SEGMENTS)
+			n = NTFS_MAX_IO_SEGMENTS;
+		ret = 0;
+		if (dev->d_ops->preadv && (n > 1)) {
+			ret = dev->d_ops->preadv(dev, seg, n);
+			if (ret < 0)
+				return (-1);
+				/* skip the segments fully transferred */
+			while (n && (ret >= seg->count)) {
+				ret -= seg->count;
+				seg++;
+				n--;
+				i++;
+			}
+		}
+			/* complete a short transfer, or transfer alone */
+		if (n) {
+			if (aio_read_segment(dev, seg->pos + ret,
+					seg->count - ret,
+					(char*)seg->buf + ret))
+				return (-1);
+			i++;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Append a device segment to a request, merging it with
+ *	the previous one when contiguous
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+static int aio_add_segment(struct AIO_REQUEST *req, s64 pos, s64 count,
+			char *buf)
+{
+	struct ntfs_io_segment *seg;
+	int allocseg;
+
+	if (req->nseg) {
+		seg = &req->seg[req->nseg - 1];
+		if (((seg->pos + seg->count) == pos)
+		    && (((char*)seg->buf + seg->count) == buf)) {
+			seg->count += count;
+			return (0);
+		}
+	}
+	if (req->nseg >= req->allocseg) {
+		allocseg = (req->allocseg ? 2*req->allocseg : 4);
+		seg = (struct ntfs_io_segment*)realloc(req->seg,
+				allocseg*sizeof(struct ntfs_io_segment));
+		if (!seg) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		req->seg = seg;
+		req->allocseg = allocseg;
+	}
+	seg = &req->seg[req->nseg++];
+	seg->pos = pos;
+	seg->count = count;
+	seg->buf = buf;
+	return (0);
+}
+
+/*
+ *		Locate the data of a plain non-resident attribute
+ *
+ *	The holes and the data beyond the initialized size are zeroed,
+ *	and the data which is dirty in the block cache is read, the
+ *	other data is recorded as device segments.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+static int aio_map(struct AIO_REQUEST *req)
+{
+	ntfs_attr *na;
+	ntfs_volume *vol;
+	struct ntfs_device *dev;
+	runlist_element *rl;
+	VCN vcn;
+	s64 ofs;
+	s64 end;
+	s64 len;
+	s64 pos;
+
+	na = req->na;
+	vol = na->ni->vol;
+	dev = vol->dev;
+	end = req->pos + req->count;
+	if (end > na->initialized_size) {
+		ofs = (req->pos > na->initialized_size
+				? req->pos : na->initialized_size);
+		memset(&req->buf[ofs - req->pos], 0, end - ofs);
+		end = ofs;
+	}
+	if (dev->d_cache)
+		req->changes = dev->d_cache->changes;
+	for (ofs=req->pos; ofs<end; ofs+=len) {
+		vcn = ofs >> vol->cluster_size_bits;
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (!rl)
+			return (-1);
+		len = ((rl->vcn + rl->length) << vol->cluster_size_bits)
+				- ofs;
+		if (len > (end - ofs))
+			len = end - ofs;
+		if (rl->lcn == LCN_HOLE)
+			memset(&req->buf[ofs - req->pos], 0, len);
+		else {
+			if (rl->lcn < 0) {
+				errno = EIO;
+				return (-1);
+			}
+			pos = ((rl->lcn + vcn - rl->vcn)
+					<< vol->cluster_size_bits)
+				+ (ofs & (vol->cluster_size - 1));
+				/* the cached data is more recent */
+			if (ntfs_block_cache_dirty(dev, pos, len)) {
+				if (ntfs_pread(dev, pos, len,
+					&req->buf[ofs - req->pos]) != len) {
+					if (!errno)
+						errno = EIO;
+					return (-1);
+				}
+			} else
+				if (aio_add_segment(req, pos, len,
+						&req->buf[ofs - req->pos]))
+					return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Complete a request, in the thread of the application
+ */
+
+static void aio_complete(struct NTFS_AIO_QUEUE *queue,
+			struct AIO_REQUEST *req)
+{
+	struct ntfs_device *dev;
+	struct ntfs_io_segment *seg;
+	int i;
+
+	dev = queue->vol->dev;
+		/* read again what was written meanwhile */
+	if ((req->res >= 0) && dev->d_cache
+	    && (dev->d_cache->changes != req->changes)) {
+		for (i=0; (i<req->nseg) && (req->res >= 0); i++) {
+			seg = &req->seg[i];
+			if (ntfs_block_cache_dirty(dev, seg->pos, seg->count)
+			    && (ntfs_pread(dev, seg->pos, seg->count,
+					seg->buf) != seg->count))
+				req->res = -(errno ? errno : EIO);
+		}
+	}
+	queue->pending--;
+	req->callback(req->na, req->pos, req->count, req->buf,
+			req->res, req->data);
+	free(req->seg);
+	free(req);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ *		Queue a request to be completed, and signal it through
+ *	the pipe. Must be called with the queue locked.
+ */
+
+static void aio_done(struct NTFS_AIO_QUEUE *queue, struct AIO_REQUEST *req)
+{
+	req->next = (struct AIO_REQUEST*)NULL;
+	if (queue->done_last)
+		queue->done_last->next = req;
+	else
+		queue->done_first = req;
+	queue->done_last = req;
+	if (!queue->signaled) {
+		queue->signaled = TRUE;
+		if (write(queue->fds[1], "", 1) != 1)
+			queue->signaled = FALSE;
+	}
+	pthread_cond_broadcast(&queue->done);
+}
+
+static void *aio_worker(void *arg)
+{
+	struct NTFS_AIO_QUEUE *queue;
+	struct AIO_REQUEST *req;
+	s64 res;
+
+	queue = (struct NTFS_AIO_QUEUE*)arg;
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->stop) {
+		req = queue->first;
+		if (req) {
+			queue->first = req->next;
+			if (!queue->first)
+				queue->last = (struct AIO_REQUEST*)NULL;
+			pthread_mutex_unlock(&queue->lock);
+			res = req->count;
+			if (aio_transfer(queue->vol->dev, req))
+				res = -(errno ? errno : EIO);
+			pthread_mutex_lock(&queue->lock);
+			req->res = res;
+			aio_done(queue, req);
+		} else
+			pthread_cond_wait(&queue->work, &queue->lock);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Queue a request, to the threads if it has segments to
+ *	transfer, or to be completed otherwise
+ */
+
+static void aio_queue(struct NTFS_AIO_QUEUE *queue, struct AIO_REQUEST *req)
+{
+	pthread_mutex_lock(&queue->lock);
+	if (req->nseg) {
+		req->next = (struct AIO_REQUEST*)NULL;
+		if (queue->last)
+			queue->last->next = req;
+		else
+			queue->first = req;
+		queue->last = req;
+		pthread_cond_signal(&queue->work);
+	} else
+		aio_done(queue, req);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ *		Get the requests to complete, waiting for one if asked to
+ */
+
+static struct AIO_REQUEST *aio_get_done(struct NTFS_AIO_QUEUE *queue,
+			BOOL wait)
+{
+	struct AIO_REQUEST *list;
+	char drain[16];
+
+	pthread_mutex_lock(&queue->lock);
+	while (wait && !queue->done_first && (queue->pending > 0))
+		pthread_cond_wait(&queue->done, &queue->lock);
+	list = queue->done_first;
+	queue->done_first = queue->done_last = (struct AIO_REQUEST*)NULL;
+	if (queue->signaled) {
+		while (read(queue->fds[0], drain, sizeof(drain)) > 0)
+			;
+		queue->signaled = FALSE;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return (list);
+}
+
+static void aio_queue_free(struct NTFS_AIO_QUEUE *queue)
+{
+	int i;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->stop = TRUE;
+	pthread_cond_broadcast(&queue->work);
+	pthread_mutex_unlock(&queue->lock);
+	for (i=0; i<queue->count; i++)
+		pthread_join(queue->thread[i], (void**)NULL);
+	pthread_cond_destroy(&queue->done);
+	pthread_cond_destroy(&queue->work);
+	pthread_mutex_destroy(&queue->lock);
+	close(queue->fds[0]);
+	close(queue->fds[1]);
+	free(queue);
+}
+
+static struct NTFS_AIO_QUEUE *aio_queue_alloc(ntfs_volume *vol, int threads)
+{
+	struct NTFS_AIO_QUEUE *queue;
+
+	queue = (struct NTFS_AIO_QUEUE*)ntfs_calloc(
+				sizeof(struct NTFS_AIO_QUEUE));
+	if (queue) {
+		queue->vol = vol;
+		if (pipe(queue->fds)) {
+			free(queue);
+			return ((struct NTFS_AIO_QUEUE*)NULL);
+		}
+		fcntl(queue->fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(queue->fds[1], F_SETFL, O_NONBLOCK);
+		if (pthread_mutex_init(&queue->lock,
+				(pthread_mutexattr_t*)NULL)) {
+			close(queue->fds[0]);
+			close(queue->fds[1]);
+			free(queue);
+			errno = ENOMEM;
+			return ((struct NTFS_AIO_QUEUE*)NULL);
+		}
+		pthread_cond_init(&queue->work, (pthread_condattr_t*)NULL);
+		pthread_cond_init(&queue->done, (pthread_condattr_t*)NULL);
+		while ((queue->count < threads)
+		    && !pthread_create(&queue->thread[queue->count],
+				(pthread_attr_t*)NULL,
+				aio_worker, queue))
+			queue->count++;
+		if (!queue->count) {
+			aio_queue_free(queue);
+			queue = (struct NTFS_AIO_QUEUE*)NULL;
+			errno = EAGAIN;
+		}
+	}
+	return (queue);
+}
+
+#else /* HAVE_PTHREAD_H */
+
+/*
+ *		Without threads, the requests are transferred when pumped
+ */
+
+static void aio_queue(struct NTFS_AIO_QUEUE *queue, struct AIO_REQUEST *req)
+{
+	req->next = (struct AIO_REQUEST*)NULL;
+	if (queue->last)
+		queue->last->next = req;
+	else
+		queue->first = req;
+	queue->last = req;
+}
+
+static struct AIO_REQUEST *aio_get_done(struct NTFS_AIO_QUEUE *queue,
+			BOOL wait __attribute__((unused)))
+{
+	struct AIO_REQUEST *list;
+	struct AIO_REQUEST *req;
+
+	list = queue->first;
+	queue->first = queue->last = (struct AIO_REQUEST*)NULL;
+	for (req=list; req; req=req->next)
+		if (req->nseg && aio_transfer(queue->vol->dev, req))
+			req->res = -(errno ? errno : EIO);
+	return (list);
+}
+
+static void aio_queue_free(struct NTFS_AIO_QUEUE *queue)
+{
+	free(queue);
+}
+
+static struct NTFS_AIO_QUEUE *aio_queue_alloc(ntfs_volume *vol,
+			int threads __attribute__((unused)))
+{
+	struct NTFS_AIO_QUEUE *queue;
+
+	queue = (struct NTFS_AIO_QUEUE*)ntfs_calloc(
+				sizeof(struct NTFS_AIO_QUEUE));
+	if (queue)
+		queue->vol = vol;
+	return (queue);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Create a queue of asynchronous reads for a volume
+ *
+ *	The reads are transferred by @threads threads (the default count
+ *	when not positive).
+ *
+ *	Returns the queue, or NULL if failed (errno set)
+ */
+
+struct NTFS_AIO_QUEUE *ntfs_aio_create(ntfs_volume *vol, int threads)
+{
+	struct NTFS_AIO_QUEUE *queue;
+
+	if (!vol) {
+		errno = EINVAL;
+		return ((struct NTFS_AIO_QUEUE*)NULL);
+	}
+	if (threads <= 0)
+		threads = AIO_DEFAULT_THREADS;
+	if (threads > AIO_MAX_THREADS)
+		threads = AIO_MAX_THREADS;
+	queue = aio_queue_alloc(vol, threads);
+	if (!queue)
+		ntfs_log_perror("Failed to create an asynchronous read queue");
+	return (queue);
+}
+
+/*
+ *		Delete a queue, after completing the reads in flight
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_aio_destroy(struct NTFS_AIO_QUEUE *queue)
+{
+	if (!queue) {
+		errno = EINVAL;
+		return (-1);
+	}
+	while (queue->pending > 0)
+		ntfs_aio_pump(queue, TRUE);
+	aio_queue_free(queue);
+	return (0);
+}
+
+/*
+ *		Submit the read of @count bytes at @pos in an attribute
+ *
+ *	The read is clipped to the size of the attribute, and @callback
+ *	is called from a later ntfs_aio_pump() with the count of bytes
+ *	read, or minus the error code.
+ *
+ *	Returns zero if the read was submitted, -1 otherwise (errno set)
+ *		and the callback will not be called.
+ */
+
+int ntfs_aio_submit(struct NTFS_AIO_QUEUE *queue, ntfs_attr *na,
+			s64 pos, s64 count, void *buf,
+			ntfs_aio_callback callback, void *data)
+{
+	struct AIO_REQUEST *req;
+	s64 ret;
+
+	if (!queue || !na || (pos < 0) || (count < 0)
+	    || (count && !buf) || !callback
+	    || (na->ni->vol != queue->vol)) {
+		errno = EINVAL;
+		return (-1);
+	}
+		/* the data gathered for appending has to be read as well */
+	if (ntfs_attr_flush_append(na))
+		return (-1);
+	req = (struct AIO_REQUEST*)ntfs_calloc(sizeof(struct AIO_REQUEST));
+	if (!req)
+		return (-1);
+	if (pos >= na->data_size)
+		count = 0;
+	else
+		if (count > (na->data_size - pos))
+			count = na->data_size - pos;
+	req->na = na;
+	req->pos = pos;
+	req->count = count;
+	req->buf = (char*)buf;
+	req->callback = callback;
+	req->data = data;
+	req->res = count;
+	if (count) {
+		if (NAttrNonResident(na)
+		    && !(na->data_flags
+			& (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))) {
+			if (aio_map(req)) {
+				free(req->seg);
+				free(req);
+				return (-1);
+			}
+		} else {
+			ret = ntfs_attr_pread(na, pos, count, buf);
+			req->res = (ret < 0 ? -(errno ? errno : EIO) : ret);
+		}
+	}
+	queue->pending++;
+	aio_queue(queue, req);
+	return (0);
+}
+
+/*
+ *		Complete the reads which have been transferred, calling
+ *	their callbacks, after waiting for one if @wait is set and
+ *	some read is pending
+ *
+ *	Returns the number of reads completed, or -1 if failed (errno set)
+ */
+
+int ntfs_aio_pump(struct NTFS_AIO_QUEUE *queue, BOOL wait)
+{
+	struct AIO_REQUEST *req;
+	struct AIO_REQUEST *next;
+	int done;
+
+	if (!queue) {
+		errno = EINVAL;
+		return (-1);
+	}
+	done = 0;
+	for (req=aio_get_done(queue, wait); req; req=next) {
+		next = req->next;
+		aio_complete(queue, req);
+		done++;
+	}
+	return (done);
+}
+
+/*
+ *		Get the number of reads submitted and not completed
+ */
+
+int ntfs_aio_pending(struct NTFS_AIO_QUEUE *queue)
+{
+	return (queue ? queue->pending : 0);
+}
+
+/*
+ *		Get a descriptor which is readable when some read
+ *	is ready to be completed, to be polled by an event loop
+ *
+ *	Returns the descriptor, or -1 if there is none (errno set)
+ */
+
+int ntfs_aio_fd(struct NTFS_AIO_QUEUE *queue)
+{
+	int fd;
+
+	fd = -1;
+	if (!queue)
+		errno = EINVAL;
+	else {
+#ifdef HAVE_PTHREAD_H
+		fd = queue->fds[0];
+#else
+		errno = ENOTSUP;
+#endif
+	}
+	return (fd);
+}
@@ -43,6 +43,9 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "param.h"
 #include "compat.h"
@@ -64,6 +67,13 @@
 #include "logging.h"
 #include "misc.h"
 #include "efs.h"
+#include "blkcache.h"
+#include "trace.h"
+#include "probes.h"
+#include "cache.h"
+#include "usnjrnl.h"
+
+#define EXTENT_BUFSIZE 1048576 /* default max size of decoded extents */
 
 ntfschar AT_UNNAMED[] = { const_cpu_to_le16('\0') };
 ntfschar STREAM_SDS[] = { const_cpu_to_le16('$'),
@@ -83,6 +93,69 @@ ntfschar TXF_DATA[] = { const_cpu_to_le16('$'),
 			const_cpu_to_le16('A'),
 			const_cpu_to_le16('\0') };
 
+/*
+ *		Reuse of attribute handles and search contexts
+ *
+ *	Up to SPARE_ATTRS attribute handles and SPARE_SEARCH_CTXS search
+ *	contexts are kept when released, for being reused without calling
+ *	the allocator. As an attribute may be closed after its inode, they
+ *	are not related to a volume, and the lists are shared under a lock.
+ */
+
+struct SPARE_OBJECT {
+	struct SPARE_OBJECT *next;
+} ;
+
+struct SPARE_LIST {
+	struct SPARE_OBJECT *first;
+	int count;
+} ;
+
+static struct SPARE_LIST spare_attrs;
+static struct SPARE_LIST spare_ctxs;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void *spare_get(struct SPARE_LIST *list)
+{
+	struct SPARE_OBJECT *obj;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&spare_lock);
+#endif
+	obj = list->first;
+	if (obj) {
+		list->first = obj->next;
+		list->count--;
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&spare_lock);
+#endif
+	return (obj);
+}
+
+static void spare_put(struct SPARE_LIST *list, void *p, int max)
+{
+	struct SPARE_OBJECT *obj;
+
+	obj = (struct SPARE_OBJECT*)p;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&spare_lock);
+#endif
+	if (list->count < max) {
+		obj->next = list->first;
+		list->first = obj;
+		list->count++;
+		obj = (struct SPARE_OBJECT*)NULL;
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&spare_lock);
+#endif
+	free(obj);
+}
+
 static int NAttrFlag(ntfs_attr *na, FILE_ATTR_FLAGS flag)
 {
 	if (na->type == AT_DATA && na->name == AT_UNNAMED)
@@ -215,60 +288,30 @@ s64 ntfs_get_attribute_value(const ntfs_volume *vol,
 	for (i = 0, total = 0; rl[i].length; i++) {
 		if (total + (rl[i].length << vol->cluster_size_bits) >=
 				sle64_to_cpu(a->data_size)) {
-			unsigned char *intbuf = NULL;
-			/*
-			 * We have reached the last run so we were going to
-			 * overflow when executing the ntfs_pread() which is
-			 * BAAAAAAAD!
-			 * Temporary fix:
-			 *	Allocate a new buffer with size:
-			 *	rl[i].length << vol->cluster_size_bits, do the
-			 *	read into our buffer, then memcpy the correct
-			 *	amount of data into the caller supplied buffer,
-			 *	free our buffer, and continue.
-			 * We have reached the end of data size so we were
-			 * going to overflow in the same fashion.
-			 * Temporary fix:  same as above.
-			 */
-			intbuf = ntfs_malloc(rl[i].length << vol->cluster_size_bits);
-			if (!intbuf) {
-				free(rl);
-				return 0;
-			}
+			s64 last;
+
 			/*
-			 * FIXME: If compressed file: Only read if lcn != -1.
-			 * Otherwise, we are dealing with a sparse run and we
-			 * just memset the user buffer to 0 for the length of
-			 * the run, which should be 16 (= compression unit
-			 * size).
-			 * FIXME: Really only when file is compressed, or can
-			 * we have sparse runs in uncompressed files as well?
-			 * - Yes we can, in sparse files! But not necessarily
-			 * size of 16, just run length.
+			 * We have reached the last run, only read the
+			 * data up to data_size directly into the caller
+			 * supplied buffer : reading the full run into an
+			 * intermediate buffer would transfer up to a full
+			 * cluster uselessly.
 			 */
+			last = sle64_to_cpu(a->data_size) - total;
 			r = ntfs_pread(vol->dev, rl[i].lcn <<
-					vol->cluster_size_bits, rl[i].length <<
-					vol->cluster_size_bits, intbuf);
-			if (r != rl[i].length << vol->cluster_size_bits) {
+					vol->cluster_size_bits, last, b + total);
+			if (r != last) {
 #define ESTR "Error reading attribute value"
 				if (r == -1)
 					ntfs_log_perror(ESTR);
-				else if (r < rl[i].length <<
-						vol->cluster_size_bits) {
+				else {
 					ntfs_log_debug(ESTR ": Ran out of input data.\n");
 					errno = EIO;
-				} else {
-					ntfs_log_debug(ESTR ": unknown error\n");
-					errno = EIO;
 				}
 #undef ESTR
 				free(rl);
-				free(intbuf);
 				return 0;
 			}
-			memcpy(b + total, intbuf, sle64_to_cpu(a->data_size) -
-					total);
-			free(intbuf);
 			total = sle64_to_cpu(a->data_size);
 			break;
 		}
@@ -322,6 +365,8 @@ static void __ntfs_attr_init(ntfs_attr *na, ntfs_inode *ni,
 		const ATTR_TYPES type, ntfschar *name, const u32 name_len)
 {
 	na->rl = NULL;
+	na->rl_index = (runlist_element*)NULL;
+	na->crl = (struct RUNLIST_COMPACT*)NULL;
 	na->ni = ni;
 	na->type = type;
 	na->name = name;
@@ -380,22 +425,11 @@ void ntfs_attr_init(ntfs_attr *na, const BOOL non_resident,
 	}
 }
 
-/**
- * ntfs_attr_open - open an ntfs attribute for access
- * @ni:		open ntfs inode in which the ntfs attribute resides
- * @type:	attribute type
- * @name:	attribute name in little endian Unicode or AT_UNNAMED or NULL
- * @name_len:	length of attribute @name in Unicode characters (if @name given)
- *
- * Allocate a new ntfs attribute structure, initialize it with @ni, @type,
- * @name, and @name_len, then return it. Return NULL on error with
- * errno set to the error code.
- *
- * If @name is AT_UNNAMED look specifically for an unnamed attribute.  If you
- * do not care whether the attribute is named or not set @name to NULL.  In
- * both those cases @name_len is not used at all.
+/*
+ *		Open an attribute, the volume being entered
  */
-ntfs_attr *ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type,
+
+static ntfs_attr *attr_open(ntfs_inode *ni, const ATTR_TYPES type,
 		ntfschar *name, u32 name_len)
 {
 	ntfs_attr_search_ctx *ctx;
@@ -411,7 +445,11 @@ ntfs_attr *ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type,
 		errno = EINVAL;
 		goto out;
 	}
-	na = ntfs_calloc(sizeof(ntfs_attr));
+	na = (ntfs_attr*)spare_get(&spare_attrs);
+	if (na)
+		memset(na, 0, sizeof(ntfs_attr));
+	else
+		na = ntfs_calloc(sizeof(ntfs_attr));
 	if (!na)
 		goto out;
 	if (name && name != AT_UNNAMED && name != NTFS_INDEX_I30) {
@@ -521,11 +559,50 @@ put_err_out:
 	ntfs_attr_put_search_ctx(ctx);
 err_out:
 	free(newname);
-	free(na);
+	spare_put(&spare_attrs, na, SPARE_ATTRS);
 	na = NULL;
 	goto out;
 }
 
+/**
+ * ntfs_attr_open - open an ntfs attribute for access
+ * @ni:		open ntfs inode in which the ntfs attribute resides
+ * @type:	attribute type
+ * @name:	attribute name in little endian Unicode or AT_UNNAMED or NULL
+ * @name_len:	length of attribute @name in Unicode characters (if @name given)
+ *
+ * Allocate a new ntfs attribute structure, initialize it with @ni, @type,
+ * @name, and @name_len, then return it. Return NULL on error with
+ * errno set to the error code.
+ *
+ * If @name is AT_UNNAMED look specifically for an unnamed attribute.  If you
+ * do not care whether the attribute is named or not set @name to NULL.  In
+ * both those cases @name_len is not used at all.
+ */
+ntfs_attr *ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type,
+		ntfschar *name, u32 name_len)
+{
+	ntfs_attr *na;
+	BOOL outer;
+
+	if (!ni || !ni->vol) {
+		errno = EINVAL;
+		return ((ntfs_attr*)NULL);
+	}
+	outer = ntfs_volume_enter(ni->vol);
+	na = attr_open(ni, type, name, name_len);
+		/*
+		 * An attribute opened by a concurrent reader is only used
+		 * by this reader, so the data can be transferred while the
+		 * other readers proceed.
+		 */
+	if (na && outer && NAttrNonResident(na)
+	    && !(na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)))
+		NAttrSetConcurrentRead(na);
+	ntfs_volume_leave(ni->vol);
+	return (na);
+}
+
 /**
  * ntfs_attr_close - free an ntfs attribute structure
  * @na:		ntfs attribute structure to free
@@ -537,13 +614,292 @@ void ntfs_attr_close(ntfs_attr *na)
 {
 	if (!na)
 		return;
+	if (na->append_buf) {
+		if (ntfs_attr_flush_append(na))
+			ntfs_log_perror("Failed to write the appended data "
+					"of inode %lld",
+					(long long)na->ni->mft_no);
+		free(na->append_buf);
+	}
 	if (NAttrNonResident(na) && na->rl)
 		free(na->rl);
+	ntfs_rl_compact_free(na->crl);
 	/* Don't release if using an internal constant. */
 	if (na->name != AT_UNNAMED && na->name != NTFS_INDEX_I30
 				&& na->name != STREAM_SDS)
 		free(na->name);
-	free(na);
+	spare_put(&spare_attrs, na, SPARE_ATTRS);
+}
+
+/*
+ *		Install a window of a compact runlist as the runlist
+ *
+ *	Returns 0 if success,
+ *		-1 if it failed (errno telling why)
+ */
+
+static int ntfs_attr_rl_window(ntfs_attr *na, VCN vcn)
+{
+	runlist_element *rl;
+
+	rl = ntfs_rl_compact_decode(na->crl, vcn, RUNLIST_COMPACT_WINDOW);
+	if (!rl)
+		return (-1);
+	free(na->rl);
+	na->rl = rl;
+	ntfs_attr_rl_changed(na);
+	NAttrClearFullyMapped(na);
+	return (0);
+}
+
+/**
+ * ntfs_attr_rl_compact - keep the runlist of an attribute in compact form
+ * @na:		non-resident ntfs attribute which is not being modified
+ * @vcn:	vcn which the window of decoded runs has to contain
+ *
+ * Build a compact copy of the whole runlist of @na, from memory if fully
+ * mapped, or else from the attribute extents, and replace the runlist by
+ * a window of it. Further mappings only decode other windows, until the
+ * runlist is expanded by ntfs_attr_rl_expand() before a modification.
+ *
+ * Return 0 on success and -1 on error with errno set to the error code,
+ * the runlist is then left unchanged.
+ */
+int ntfs_attr_rl_compact(ntfs_attr *na, VCN vcn)
+{
+	struct RUNLIST_COMPACT *crl;
+	ntfs_attr_search_ctx *ctx;
+	runlist_element *rl;
+	VCN last_vcn;
+	VCN old_end;
+	BOOL whole;
+	int err;
+
+	if (na->crl)
+		return (0);
+	if (!NAttrNonResident(na) || NAttrFullRunlist(na)
+	    || NAttrRunlistDirty(na) || NAttrBeingNonResident(na)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	crl = ntfs_rl_compact_alloc();
+	if (!crl)
+		return (-1);
+	last_vcn = na->allocated_size >> na->ni->vol->cluster_size_bits;
+	err = 0;
+		/* Use the runlist in memory if it is complete */
+	whole = FALSE;
+	if (na->rl) {
+		for (rl=na->rl; rl->length
+				&& (rl->lcn != LCN_RL_NOT_MAPPED); rl++) { }
+		whole = !rl->length && (rl->lcn == LCN_ENOENT)
+				&& (rl->vcn == last_vcn);
+	}
+	if (whole)
+		err = ntfs_rl_compact_append(crl, na->rl);
+	else {
+		ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
+		if (!ctx)
+			err = -1;
+		while (!err && (crl->end_vcn < last_vcn)) {
+			old_end = crl->end_vcn;
+			rl = (runlist_element*)NULL;
+			if (!ntfs_attr_lookup(na->type, na->name, na->name_len,
+					CASE_SENSITIVE, crl->end_vcn,
+					NULL, 0, ctx))
+				rl = ntfs_mapping_pairs_decompress(na->ni->vol,
+						ctx->attr, NULL);
+			if (!rl
+			    || ntfs_rl_compact_append(crl, rl)
+			    || (crl->end_vcn <= old_end)) {
+				if (rl && (crl->end_vcn <= old_end))
+					errno = EIO;
+				err = -1;
+			}
+			free(rl);
+			ntfs_attr_reinit_search_ctx(ctx);
+		}
+		if (ctx)
+			ntfs_attr_put_search_ctx(ctx);
+	}
+	if (!err && (crl->end_vcn != last_vcn)) {
+		errno = EIO;
+		err = -1;
+	}
+	if (!err) {
+		crl->end_lcn = LCN_ENOENT;
+		na->crl = crl;
+		err = ntfs_attr_rl_window(na, vcn);
+		if (err)
+			na->crl = (struct RUNLIST_COMPACT*)NULL;
+	}
+	if (err)
+		ntfs_rl_compact_free(crl);
+	return (err);
+}
+
+/**
+ * ntfs_attr_rl_expand - get back to a full runlist before modifying it
+ * @na:		ntfs attribute whose runlist may be compacted
+ *
+ * If the runlist of @na is compacted, decode all of it, so that it can
+ * be modified and used for updating the mapping pairs. In all cases the
+ * runlist will not be compacted any more while @na stays open.
+ *
+ * Return 0 on success and -1 on error with errno set to the error code.
+ */
+int ntfs_attr_rl_expand(ntfs_attr *na)
+{
+	runlist_element *rl;
+
+	NAttrSetFullRunlist(na);
+	if (na->crl) {
+		rl = ntfs_rl_compact_decode(na->crl, 0, 0);
+		if (!rl)
+			return (-1);
+		free(na->rl);
+		na->rl = rl;
+		ntfs_attr_rl_changed(na);
+		ntfs_rl_compact_free(na->crl);
+		na->crl = (struct RUNLIST_COMPACT*)NULL;
+		NAttrSetFullyMapped(na);
+	}
+	return (0);
+}
+
+/*
+ *		Get the vcns delimiting the extent of an attribute which
+ *	contains a vcn, from the attribute list if there is one
+ */
+
+static void ntfs_attr_extent_bounds(ntfs_attr *na, VCN vcn,
+			VCN *plow, VCN *phigh)
+{
+	const ATTR_LIST_ENTRY *ale;
+	const u8 *end;
+	ntfs_inode *ni;
+	VCN lowest;
+	u32 length;
+
+	ni = na->ni;
+	*plow = 0;
+	*phigh = na->allocated_size >> ni->vol->cluster_size_bits;
+	if (NInoAttrList(ni) && ni->attr_list) {
+		ale = (const ATTR_LIST_ENTRY*)ni->attr_list;
+		end = ni->attr_list + ni->attr_list_size;
+		while (((const u8*)ale + sizeof(ATTR_LIST_ENTRY)) <= end) {
+			length = le16_to_cpu(ale->length);
+			if ((length < sizeof(ATTR_LIST_ENTRY))
+			    || (((const u8*)ale + length) > end))
+				break;
+			if ((ale->type == na->type)
+			    && (ale->name_length == na->name_len)
+			    && (((const u8*)ale + ale->name_offset
+					+ 2*ale->name_length) <= end)
+			    && !memcmp((const u8*)ale + ale->name_offset,
+					na->name, 2*na->name_len)) {
+				lowest = sle64_to_cpu(ale->lowest_vcn);
+				if ((lowest <= vcn) && (lowest > *plow))
+					*plow = lowest;
+				if ((lowest > vcn) && (lowest < *phigh))
+					*phigh = lowest;
+			}
+			ale = (const ATTR_LIST_ENTRY*)((const u8*)ale + length);
+		}
+	}
+}
+
+/**
+ * ntfs_attr_rl_release - unmap the runs of the extents not in use
+ * @na:		non-resident ntfs attribute which is not being accessed
+ * @keep:	vcn whose extent stays mapped, or -1 to unmap all
+ *
+ * Replace the runs of all the extents of @na but the one containing @keep
+ * by unmapped runs, so that the memory used by a long lived attribute with
+ * many extents can be released. The runs are mapped again when needed,
+ * as in a newly opened attribute. Nothing is done if the runlist has been
+ * changed, or is compacted, as only a window of it is decoded.
+ *
+ * Return the count of bytes released
+ */
+s64 ntfs_attr_rl_release(ntfs_attr *na, VCN keep)
+{
+	runlist_element *rl;
+	runlist_element *newrl;
+	VCN last_vcn;
+	VCN start;
+	VCN end;
+	VCN low;
+	VCN high;
+	BOOL mapped;
+	int count;
+	int kept;
+	int k;
+
+	if (!na || !NAttrNonResident(na) || !na->rl || na->crl
+	    || NAttrRunlistDirty(na) || NAttrBeingNonResident(na)
+	    || NAttrDataAppending(na) || na->append_count)
+		return (0);
+	last_vcn = na->allocated_size >> na->ni->vol->cluster_size_bits;
+	low = high = 0;
+	if ((keep >= 0) && (keep < last_vcn))
+		ntfs_attr_extent_bounds(na, keep, &low, &high);
+		/* count the runs, and those overlapping the kept extent */
+	for (count=0; na->rl[count].length; count++) { }
+	if (na->rl[count].vcn < high)
+		high = na->rl[count].vcn;
+	kept = 0;
+	mapped = FALSE;
+	for (rl=na->rl; rl->length; rl++) {
+		if ((rl->vcn < high) && ((rl->vcn + rl->length) > low)) {
+			kept++;
+			if (rl->lcn != LCN_RL_NOT_MAPPED)
+				mapped = TRUE;
+		}
+	}
+	if (!mapped) {
+		free(na->rl);
+		na->rl = (runlist_element*)NULL;
+		k = -1;
+	} else {
+			/* not worth unless several runs are released */
+		if ((kept + 3) >= count)
+			return (0);
+			/* runlists are reallocated by pages */
+		newrl = (runlist_element*)ntfs_malloc(((kept + 3)
+				*sizeof(runlist_element) + 0xfff) & ~0xfff);
+		if (!newrl)
+			return (0);
+		k = 0;
+		if (low) {
+			newrl[0].vcn = 0;
+			newrl[0].lcn = LCN_RL_NOT_MAPPED;
+			newrl[0].length = low;
+			k++;
+		}
+		for (rl=na->rl; rl->length; rl++) {
+			start = (rl->vcn > low ? rl->vcn : low);
+			end = rl->vcn + rl->length;
+			if (end > high)
+				end = high;
+			if (start < end) {
+				newrl[k].vcn = start;
+				newrl[k].length = end - start;
+				newrl[k].lcn = (rl->lcn >= 0
+					? rl->lcn + start - rl->vcn : rl->lcn);
+				k++;
+			}
+		}
+		newrl[k].vcn = high;
+		newrl[k].length = 0;
+		newrl[k].lcn = (high < last_vcn ? LCN_RL_NOT_MAPPED
+					: na->rl[count].lcn);
+		free(na->rl);
+		na->rl = newrl;
+	}
+	ntfs_attr_rl_changed(na);
+	NAttrClearFullyMapped(na);
+	return ((s64)(count - k)*sizeof(runlist_element));
 }
 
 /**
@@ -567,6 +923,10 @@ int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
 	if (lcn >= 0 || lcn == LCN_HOLE || lcn == LCN_ENOENT)
 		return 0;
 
+	/* A compacted runlist only needs decoding another window. */
+	if (na->crl)
+		return (ntfs_attr_rl_window(na, vcn));
+
 	ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
 	if (!ctx)
 		return -1;
@@ -575,13 +935,32 @@ int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
 	if (!ntfs_attr_lookup(na->type, na->name, na->name_len, CASE_SENSITIVE,
 			vcn, NULL, 0, ctx)) {
 		runlist_element *rl;
+		int count;
 
 		/* Decode the runlist. */
 		rl = ntfs_mapping_pairs_decompress(na->ni->vol, ctx->attr,
 				na->rl);
 		if (rl) {
 			na->rl = rl;
+			ntfs_attr_rl_changed(na);
 			ntfs_attr_put_search_ctx(ctx);
+			/*
+			 * Compact the runlist once it gets big, unless it
+			 * may have to be modified. Failing to do so is not
+			 * an error, the full runlist is just kept.
+			 */
+			if (NVolCompactRunlists(na->ni->vol)
+			    && !NAttrFullRunlist(na)
+			    && !NAttrRunlistDirty(na)
+			    && !NAttrBeingNonResident(na)) {
+				for (count=0; rl[count].length; count++) { }
+				na->rl_index = rl;
+				na->rl_count = count;
+				na->rl_hint = 0;
+				if ((count > RUNLIST_COMPACT_THRESHOLD)
+				    && ntfs_attr_rl_compact(na, vcn))
+					NAttrSetFullRunlist(na);
+			}
 			return 0;
 		}
 	}
@@ -611,6 +990,8 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 	BOOL done;
 	BOOL newrunlist;
 
+	if (ntfs_attr_rl_expand(na))
+		return -1;
 	if (NAttrFullyMapped(na))
 		return 0;
 
@@ -643,6 +1024,7 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
 				rl = na->rl;
 			if (rl) {
 				na->rl = rl;
+				ntfs_attr_rl_changed(na);
 				highest_vcn = sle64_to_cpu(a->highest_vcn);
 				if (highest_vcn < needed) {
 				/* corruption detection on unchanged runlists */
@@ -706,6 +1088,8 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
 	ntfs_log_enter("Entering for inode %llu, attr 0x%x.\n",
 		       (unsigned long long)na->ni->mft_no, le32_to_cpu(na->type));
 
+	if (ntfs_attr_rl_expand(na))
+		goto out;
 		/* avoid multiple full runlist mappings */
 	if (NAttrFullyMapped(na)) {
 		ret = 0;
@@ -738,6 +1122,7 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
 			if (!rl)
 				goto err_out;
 			na->rl = rl;
+			ntfs_attr_rl_changed(na);
 		}
 
 		/* Are we in the first extent? */
@@ -852,6 +1237,96 @@ retry:
 	return lcn;
 }
 
+/*
+ *		Search the run containing a vcn in the runlist of an attribute
+ *
+ *	The run found by the previous search and the next one are checked
+ *	first, as they are the likely ones for sequential accesses, then
+ *	a binary search is done, the vcns of the runs being in ascending
+ *	order. The count of runs is determined once for each new runlist.
+ *
+ *	Returns the run containing @vcn, the terminator if @vcn is
+ *		beyond the last run, or NULL if @vcn is before the first run
+ */
+
+static runlist_element *ntfs_attr_rl_search(ntfs_attr *na, const VCN vcn)
+{
+	runlist_element *rl;
+	int lo, hi, mid;
+	int hint;
+
+	rl = na->rl;
+	if (na->rl_index != rl) {
+		for (hi = 0; rl[hi].length; hi++) { }
+		na->rl_index = rl;
+		na->rl_count = hi;
+		na->rl_hint = 0;
+	}
+	if (vcn < rl[0].vcn)
+		return ((runlist_element*)NULL);
+	lo = 0;
+	hi = na->rl_count;
+	hint = na->rl_hint;
+	if (hint < hi) {
+		if (vcn >= rl[hint].vcn) {
+			if (vcn < rl[hint + 1].vcn)
+				return (&rl[hint]);
+			lo = hint + 1;
+			if ((lo < hi) && (vcn < rl[lo + 1].vcn)) {
+				na->rl_hint = lo;
+				return (&rl[lo]);
+			}
+		} else
+			hi = hint - 1;
+	}
+	/* Find the last run beginning at or before vcn, within [lo, hi] */
+	while (lo < hi) {
+		mid = lo + ((hi - lo + 1) >> 1);
+		if (rl[mid].vcn <= vcn)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	if (lo < na->rl_count)
+		na->rl_hint = lo;
+	return (&rl[lo]);
+}
+
+/*
+ *		Merge newly allocated runs into the runlist of an attribute
+ *
+ *	The count of runs kept for searching lets the runs appended
+ *	to the runlist be merged in place, and it is kept up to date.
+ *
+ *	Returns the merged runlist, to be set as the runlist of @na
+ *		or NULL if failed (with errno set)
+ */
+
+static runlist_element *ntfs_attr_rl_merge(ntfs_attr *na,
+			runlist_element *srl)
+{
+	runlist_element *rl;
+	int count;
+
+	rl = na->rl;
+	count = -1;
+	if (rl) {
+		if (na->rl_index == rl)
+			count = na->rl_count;
+		else
+			for (count=0; rl[count].length; count++) { }
+	}
+	rl = ntfs_runlists_merge_tail(rl, &count, srl);
+	if (rl && (count >= 0)) {
+		na->rl_index = rl;
+		na->rl_count = count;
+		if (na->rl_hint >= count)
+			na->rl_hint = 0;
+	} else
+		ntfs_attr_rl_changed(na);
+	return (rl);
+}
+
 /**
  * ntfs_attr_find_vcn - find a vcn in the runlist of an ntfs attribute
  * @na:		ntfs attribute whose runlist to search
@@ -886,19 +1361,13 @@ runlist_element *ntfs_attr_find_vcn(ntfs_attr *na, const VCN vcn)
 		       (unsigned long long)na->ni->mft_no, le32_to_cpu(na->type),
 		       (long long)vcn);
 retry:
-	rl = na->rl;
-	if (!rl)
+	if (!na->rl)
 		goto map_rl;
-	if (vcn < rl[0].vcn)
+	rl = ntfs_attr_rl_search(na, vcn);
+	if (!rl)
 		goto map_rl;
-	while (rl->length) {
-		if (vcn < rl[1].vcn) {
-			if (rl->lcn >= (LCN)LCN_HOLE)
-				return rl;
-			break;
-		}
-		rl++;
-	}
+	if (rl->length && (rl->lcn >= (LCN)LCN_HOLE))
+		return rl;
 	switch (rl->lcn) {
 	case (LCN)LCN_RL_NOT_MAPPED:
 		goto map_rl;
@@ -930,15 +1399,100 @@ map_rl:
 	return NULL;
 }
 
+/*
+ *		Locate the value of a resident attribute
+ *
+ *	When the inode has no attribute list, the attribute can only be
+ *	in the base mft record, which is scanned directly, so that reading
+ *	or writing a small file does not need a search context. Otherwise
+ *	a full lookup is done, and the search context is returned in *pctx
+ *	for the caller to release.
+ *
+ *	Returns the value, and the inode holding it in *pni,
+ *		or NULL if there was an error (errno set)
+ */
+
+static char *resident_value(ntfs_attr *na, ntfs_inode **pni,
+			ntfs_attr_search_ctx **pctx)
+{
+	ntfs_attr_search_ctx *ctx;
+	ntfs_inode *ni;
+	ATTR_RECORD *a;
+	MFT_RECORD *m;
+	char *val;
+	char *end;
+	u32 len;
+	BOOL found;
+
+	ni = na->ni;
+	*pctx = (ntfs_attr_search_ctx*)NULL;
+	found = FALSE;
+	a = (ATTR_RECORD*)NULL;
+	m = ni->mrec;
+	if (!NInoAttrList(ni) && m) {
+		end = (char*)m + ni->vol->mft_record_size;
+		a = (ATTR_RECORD*)((char*)m + le16_to_cpu(m->attrs_offset));
+		while (!found
+		    && ((char*)a + offsetof(ATTR_RECORD, resident_end) <= end)
+		    && (le32_to_cpu(a->type) <= le32_to_cpu(na->type))) {
+			len = le32_to_cpu(a->length);
+			if (!len || (len > (u32)(end - (char*)a)))
+				break;
+			if ((a->type == na->type)
+			    && (a->name_length == na->name_len)
+			    && !a->non_resident
+			    && (le16_to_cpu(a->name_offset)
+					+ a->name_length*sizeof(ntfschar) <= len)
+			    && !memcmp((char*)a + le16_to_cpu(a->name_offset),
+					na->name, a->name_length*sizeof(ntfschar)))
+				found = TRUE;
+			else
+				a = (ATTR_RECORD*)((char*)a + len);
+		}
+	}
+	if (!found) {
+			/* not obvious, do a full lookup */
+		ctx = ntfs_attr_get_search_ctx(ni, NULL);
+		if (!ctx)
+			return ((char*)NULL);
+		if (ntfs_attr_lookup(na->type, na->name, na->name_len, 0,
+				0, NULL, 0, ctx)) {
+			ntfs_attr_put_search_ctx(ctx);
+			return ((char*)NULL);
+		}
+		*pctx = ctx;
+		ni = ctx->ntfs_ino;
+		a = ctx->attr;
+		m = ctx->mrec;
+	}
+	val = (char*)a + le16_to_cpu(a->value_offset);
+	if (val < (char*)a || val +
+			le32_to_cpu(a->value_length) >
+			(char*)m + ni->vol->mft_record_size) {
+		errno = EIO;
+		ntfs_log_perror("%s: Sanity check failed", __FUNCTION__);
+		if (*pctx) {
+			ntfs_attr_put_search_ctx(*pctx);
+			*pctx = (ntfs_attr_search_ctx*)NULL;
+		}
+		return ((char*)NULL);
+	}
+	*pni = ni;
+	return (val);
+}
+
 /**
  * ntfs_attr_pread_i - see description at ntfs_attr_pread()
  */ 
 static s64 ntfs_attr_pread_i(ntfs_attr *na, const s64 pos, s64 count, void *b)
 {
-	s64 br, to_read, ofs, total, total2, max_read, max_init;
+	struct ntfs_io_segment seg[NTFS_MAX_IO_SEGMENTS];
+	s64 br, to_read, ofs, total, total2, max_read, max_init, pending;
 	ntfs_volume *vol;
 	runlist_element *rl;
 	u16 efs_padding_length;
+	int nseg;
+	BOOL released;
 
 	/* Sanity checking arguments is done in ntfs_attr_pread(). */
 	
@@ -990,27 +1544,15 @@ static s64 ntfs_attr_pread_i(ntfs_attr *na, const s64 pos, s64 count, void *b)
 	/* If it is a resident attribute, get the value from the mft record. */
 	if (!NAttrNonResident(na)) {
 		ntfs_attr_search_ctx *ctx;
+		ntfs_inode *ni;
 		char *val;
 
-		ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
-		if (!ctx)
-			return -1;
-		if (ntfs_attr_lookup(na->type, na->name, na->name_len, 0,
-				0, NULL, 0, ctx)) {
-res_err_out:
-			ntfs_attr_put_search_ctx(ctx);
+		val = resident_value(na, &ni, &ctx);
+		if (!val)
 			return -1;
-		}
-		val = (char*)ctx->attr + le16_to_cpu(ctx->attr->value_offset);
-		if (val < (char*)ctx->attr || val +
-				le32_to_cpu(ctx->attr->value_length) >
-				(char*)ctx->mrec + vol->mft_record_size) {
-			errno = EIO;
-			ntfs_log_perror("%s: Sanity check failed", __FUNCTION__);
-			goto res_err_out;
-		}
 		memcpy(b, val + pos, count);
-		ntfs_attr_put_search_ctx(ctx);
+		if (ctx)
+			ntfs_attr_put_search_ctx(ctx);
 		return count;
 	}
 	total = total2 = 0;
@@ -1071,12 +1613,54 @@ res_err_out:
 	 * length.
 	 */
 	ofs = pos - (rl->vcn << vol->cluster_size_bits);
-	for (; count; rl++, ofs = 0) {
-		if (rl->lcn == LCN_RL_NOT_MAPPED) {
-			rl = ntfs_attr_find_vcn(na, rl->vcn);
-			if (!rl) {
-				if (errno == ENOENT) {
-					errno = EIO;
+	while (count) {
+		/*
+		 * Gather the consecutive real lcns into @dst, so that they
+		 * are read by a single batched device call.
+		 */
+		for (nseg = 0, pending = 0; count && rl->length
+				&& (rl->lcn >= 0) && (nseg < NTFS_MAX_IO_SEGMENTS);
+				rl++, ofs = 0, nseg++) {
+			to_read = min(count, (rl->length <<
+					vol->cluster_size_bits) - ofs);
+			ntfs_log_trace("Reading %lld bytes from vcn %lld, lcn %lld, ofs"
+					" %lld.\n", (long long)to_read, (long long)rl->vcn,
+				       (long long )rl->lcn, (long long)ofs);
+			seg[nseg].pos = (rl->lcn << vol->cluster_size_bits)
+					+ ofs;
+			seg[nseg].count = to_read;
+			seg[nseg].buf = b;
+			pending += to_read;
+			count -= to_read;
+			b = (u8*)b + to_read;
+		}
+		if (nseg) {
+			do {
+				/* let other readers run during the transfer */
+				released = NAttrConcurrentRead(na)
+					&& ntfs_volume_transfer_begin(vol);
+				br = ntfs_preadv(vol->dev, seg, nseg);
+				if (released)
+					ntfs_volume_transfer_end(vol, TRUE);
+				/* If the syscall was interrupted, try again. */
+			} while (br == (s64)-1 && errno == EINTR);
+			/* If everything ok, update progress counter. */
+			if (br > 0)
+				total += br;
+			if (br == pending)
+				continue;
+			if (total)
+				return total;
+			if (!br)
+				errno = EIO;
+			ntfs_log_perror("%s: ntfs_pread failed", __FUNCTION__);
+			return -1;
+		}
+		if (rl->lcn == LCN_RL_NOT_MAPPED) {
+			rl = ntfs_attr_find_vcn(na, rl->vcn);
+			if (!rl) {
+				if (errno == ENOENT) {
+					errno = EIO;
 					ntfs_log_perror("%s: Failed to find VCN #2",
 							__FUNCTION__);
 				}
@@ -1084,55 +1668,29 @@ res_err_out:
 			}
 			/* Needed for case when runs merged. */
 			ofs = pos + total - (rl->vcn << vol->cluster_size_bits);
+			continue;
 		}
 		if (!rl->length) {
 			errno = EIO;
 			ntfs_log_perror("%s: Zero run length", __FUNCTION__);
 			goto rl_err_out;
 		}
-		if (rl->lcn < (LCN)0) {
-			if (rl->lcn != (LCN)LCN_HOLE) {
-				ntfs_log_perror("%s: Bad run (%lld)", 
-						__FUNCTION__,
-						(long long)rl->lcn);
-				goto rl_err_out;
-			}
-			/* It is a hole, just zero the matching @b range. */
-			to_read = min(count, (rl->length <<
-					vol->cluster_size_bits) - ofs);
-			memset(b, 0, to_read);
-			/* Update progress counters. */
-			total += to_read;
-			count -= to_read;
-			b = (u8*)b + to_read;
-			continue;
-		}
-		/* It is a real lcn, read it into @dst. */
-		to_read = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		ntfs_log_trace("Reading %lld bytes from vcn %lld, lcn %lld, ofs"
-				" %lld.\n", (long long)to_read, (long long)rl->vcn,
-			       (long long )rl->lcn, (long long)ofs);
-		br = ntfs_pread(vol->dev, (rl->lcn << vol->cluster_size_bits) +
-				ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (br > 0) {
-			total += br;
-			count -= br;
-			b = (u8*)b + br;
+		if (rl->lcn != (LCN)LCN_HOLE) {
+			ntfs_log_perror("%s: Bad run (%lld)", 
+					__FUNCTION__,
+					(long long)rl->lcn);
+			goto rl_err_out;
 		}
-		if (br == to_read)
-			continue;
-		/* If the syscall was interrupted, try again. */
-		if (br == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (total)
-			return total;
-		if (!br)
-			errno = EIO;
-		ntfs_log_perror("%s: ntfs_pread failed", __FUNCTION__);
-		return -1;
+		/* It is a hole, just zero the matching @b range. */
+		to_read = min(count, (rl->length <<
+				vol->cluster_size_bits) - ofs);
+		memset(b, 0, to_read);
+		/* Update progress counters and proceed with next run. */
+		total += to_read;
+		count -= to_read;
+		b = (u8*)b + to_read;
+		rl++;
+		ofs = 0;
 	}
 	/* Finally, return the number of bytes read. */
 	return total + total2;
@@ -1162,8 +1720,95 @@ rl_err_out:
  * to the return code of ntfs_pread(), or to EINVAL in case of invalid
  * arguments.
  */
+/*
+ *		Read ahead the data following a sequential read
+ *
+ *	A read is sequential when it starts where the previous one ended.
+ *	The read-ahead window then doubles on each sequential read, and
+ *	the data following the current read is read into the block cache
+ *	once less than half a window has already been read ahead.
+ *	For a compressed attribute, the read-ahead is extended to whole
+ *	compression blocks, so that the next compression block is read
+ *	ahead while the current one is being decompressed.
+ *
+ *	Errors are ignored, as the data is read again when needed.
+ */
+
+static void ntfs_attr_readahead(ntfs_attr *na, s64 pos, s64 count)
+{
+	struct ntfs_readahead *ra;
+	struct BLOCK_CACHE *cache;
+	ntfs_volume *vol;
+	runlist_element *rl;
+	VCN vcn;
+	VCN endvcn;
+	s64 start;
+	s64 end;
+	s64 n;
+	int olderrno;
+	int err;
+	BOOL released;
+
+	ra = &na->ra;
+	vol = na->ni->vol;
+	cache = vol->dev->d_cache;
+	if (!NAttrNonResident(na)
+	    || (na->data_flags & ATTR_IS_ENCRYPTED)
+	    || (pos != ra->next)) {
+		ra->window = 0;
+		ra->end = 0;
+	} else {
+		if (!ra->window)
+			ra->window = READAHEAD_MIN_WINDOW;
+		else
+			if ((ra->window*2 <= READAHEAD_MAX_WINDOW)
+			    && (ra->window*2 <= cache->capacity/4))
+				ra->window *= 2;
+		start = max(ra->end, pos + count);
+		end = min(pos + count + ra->window, na->initialized_size);
+		if ((ra->end - pos - count) < ra->window/2) {
+			if (na->data_flags & ATTR_COMPRESSION_MASK) {
+				start &= -(s64)na->compression_block_size;
+				end = (end + na->compression_block_size - 1)
+					& -(s64)na->compression_block_size;
+			}
+			olderrno = errno;
+			vcn = start >> vol->cluster_size_bits;
+			endvcn = (end + vol->cluster_size - 1)
+					>> vol->cluster_size_bits;
+			while (vcn < endvcn) {
+				rl = ntfs_attr_find_vcn(na, vcn);
+				if (!rl || (rl->length <= 0)
+				    || ((rl->lcn < 0) && (rl->lcn != LCN_HOLE)))
+					break;
+				n = min(rl->length - (vcn - rl->vcn),
+						endvcn - vcn);
+				if (rl->lcn >= 0) {
+					released = NAttrConcurrentRead(na)
+					    && ntfs_volume_transfer_begin(vol);
+					err = ntfs_block_cache_prefetch(vol->dev,
+						(rl->lcn + vcn - rl->vcn)
+						    << vol->cluster_size_bits,
+						n << vol->cluster_size_bits);
+					if (released)
+						ntfs_volume_transfer_end(vol,
+								TRUE);
+					if (err)
+						break;
+				}
+				vcn += n;
+			}
+			if (end > ra->end)
+				ra->end = end;
+			errno = olderrno;
+		}
+	}
+	ra->next = pos + count;
+}
+
 s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count, void *b)
 {
+	struct NTFS_TRACE_TAG tag;
 	s64 ret;
 	
 	if (!na || !na->ni || !na->ni->vol || !b || pos < 0 || count < 0) {
@@ -1178,12 +1823,400 @@ s64 ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count, void *b)
 		       "%lld\n", (unsigned long long)na->ni->mft_no,
 		       le32_to_cpu(na->type), (long long)pos, (long long)count);
 
-	ret = ntfs_attr_pread_i(na, pos, count, b);
+		/* the data gathered is written before being read */
+	if (na->append_count && ((pos + count) > na->append_pos)
+	    && ntfs_attr_flush_append(na)) {
+		ntfs_log_leave("\n");
+		return -1;
+	}
+	ntfs_volume_enter(na->ni->vol);
+	ntfs_trace_enter_attr(na, pos, &tag);
+	NTFS_PROBE4(attr_pread_entry, na->ni->mft_no, le32_to_cpu(na->type),
+			pos, count);
+	if (NAttrBeingRead(na)) {
+		/* raw read of a compression block, no read-ahead */
+		ret = ntfs_attr_pread_i(na, pos, count, b);
+	} else {
+		NAttrSetBeingRead(na);
+		ret = ntfs_attr_pread_i(na, pos, count, b);
+		NAttrClearBeingRead(na);
+		if ((ret > 0) && na->ni->vol->dev->d_cache)
+			ntfs_attr_readahead(na, pos, ret);
+	}
+	NTFS_PROBE3(attr_pread_return, na->ni->mft_no, le32_to_cpu(na->type),
+			ret);
+	ntfs_trace_leave(&tag);
+	ntfs_volume_leave(na->ni->vol);
 	
 	ntfs_log_leave("\n");
 	return ret;
 }
 
+/*
+ *		Read from an attribute, not copying the cached data
+ *
+ *	This is meant for readers which can use the data in place, such
+ *	as fuse replies made of several fragments. The data read is
+ *	described in @seg as fragments in order, each of them pointing
+ *	either into the block cache or into @b, where the data which is
+ *	not cached is read, at the same offset as by ntfs_attr_pread().
+ *	The @pos field of a fragment is the attribute position of its
+ *	data. The pointers into the cache are only valid until the next
+ *	transfer through the device, including the writing of an inode.
+ *	When the device can be accessed in place (a mapped read-only
+ *	image), the fragments point into the device data, which is
+ *	preferred to the cache.
+ *
+ *	This is only done for non-resident attributes which are neither
+ *	compressed nor encrypted, when there is a block cache or the
+ *	device can be accessed in place. For other
+ *	attributes, the data is read into @b as a single fragment. If
+ *	more than @maxseg fragments would be needed, the data of the last
+ *	ones is grouped into @b.
+ *
+ *	Returns the count of bytes read, with the count of fragments
+ *		set into *@pnseg,
+ *		or -1 if there was an error and nothing could be read
+ *		(with errno set)
+ */
+
+s64 ntfs_attr_pread_map(ntfs_attr *na, s64 pos, s64 count, void *b,
+			struct ntfs_io_segment *seg, int maxseg, int *pnseg)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	struct ntfs_io_segment *last;
+	const void *mapped;
+	void *data;
+	VCN vcn;
+	VCN endvcn;
+	s64 lpos;
+	s64 total;
+	s64 ofs;
+	s64 n;
+	int nseg;
+
+	if (!na || !na->ni || !na->ni->vol || !b || !seg || (maxseg < 1)
+	    || (pos < 0) || (count < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	*pnseg = 0;
+	if (na->append_count && ((pos + count) > na->append_pos)
+	    && ntfs_attr_flush_append(na))
+		return (-1);
+	vol = na->ni->vol;
+	if ((!vol->dev->d_cache && !NDevMapped(vol->dev))
+	    || !NAttrNonResident(na)
+	    || NAttrBeingRead(na)
+	    || (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))) {
+		total = ntfs_attr_pread(na, pos, count, b);
+		if (total > 0) {
+			seg[0].pos = pos;
+			seg[0].count = total;
+			seg[0].buf = b;
+			*pnseg = 1;
+		}
+		return (total);
+	}
+	if ((pos + count) > na->data_size) {
+		if (pos >= na->data_size)
+			return (0);
+		count = na->data_size - pos;
+	}
+	if (!count)
+		return (0);
+		/*
+		 * Read ahead first, as this may evict blocks from the
+		 * cache, but only the blocks beyond this read are needed.
+		 */
+	if (vol->dev->d_cache)
+		ntfs_attr_readahead(na, pos, count);
+		/*
+		 * Likewise, map the runlist before getting pointers
+		 * into the cache, as an extent may have to be read.
+		 */
+	endvcn = (min(pos + count, na->initialized_size)
+			+ vol->cluster_size - 1) >> vol->cluster_size_bits;
+	for (vcn = pos >> vol->cluster_size_bits; vcn < endvcn;
+			vcn = rl->vcn + rl->length) {
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (!rl || (rl->length <= 0))
+			break;
+	}
+	nseg = 0;
+	last = (struct ntfs_io_segment*)NULL;
+	total = 0;
+	while (total < count) {
+		data = (char*)b + total;
+		n = count - total;
+		if ((pos + total) >= na->initialized_size)
+			memset(data, 0, n);
+		else {
+			rl = ntfs_attr_find_vcn(na,
+				(pos + total) >> vol->cluster_size_bits);
+			if (!rl) {
+				if (errno == ENOENT)
+					errno = EIO;
+				break;
+			}
+			ofs = pos + total - (rl->vcn << vol->cluster_size_bits);
+			n = min(n, (rl->length << vol->cluster_size_bits) - ofs);
+			n = min(n, na->initialized_size - pos - total);
+			if (rl->lcn >= 0) {
+				lpos = (rl->lcn << vol->cluster_size_bits) + ofs;
+				if (NDevMapped(vol->dev)) {
+					mapped = ntfs_pmap(vol->dev, lpos, n);
+					if (mapped)
+						data = (void*)mapped;
+					else
+						n = ntfs_pread(vol->dev,
+							lpos, n, data);
+				} else
+					n = ntfs_block_cache_map(vol->dev,
+						lpos, n, data, &data);
+				if (n <= 0) {
+					if (!n)
+						errno = EIO;
+					break;
+				}
+			} else {
+				if ((rl->lcn != LCN_HOLE) || (n <= 0)) {
+					errno = EIO;
+					break;
+				}
+				memset(data, 0, n);
+			}
+		}
+		if (last && (data == (char*)last->buf + last->count))
+			last->count += n;
+		else {
+			if (nseg >= maxseg) {
+				/* Too many fragments, group into @b */
+				if (last->buf != (char*)b + last->pos - pos) {
+					memcpy((char*)b + last->pos - pos,
+						last->buf, last->count);
+					last->buf = (char*)b + last->pos - pos;
+				}
+				if (data != (char*)b + total)
+					memcpy((char*)b + total, data, n);
+				last->count += n;
+			} else {
+				last = &seg[nseg++];
+				last->pos = pos + total;
+				last->count = n;
+				last->buf = data;
+			}
+		}
+		total += n;
+	}
+	*pnseg = nseg;
+	return (total ? total : -1);
+}
+
+/**
+ * ntfs_attr_get_extent_ctx - get an iterator over the extents of an attribute
+ * @na:		opened ntfs attribute to iterate over
+ * @bufsize:	max size of the extents which have to be decoded, or 0
+ *		for the default
+ *
+ * The extents are returned in order by ntfs_attr_next_extent() so that
+ * the plain parts of a non-resident attribute can be read directly from
+ * the device with large transfers, while the holes need no reading and
+ * the other parts are decoded as needed.
+ *
+ * As the device is read directly, bypassing the caches, the volume
+ * should be mounted read-only or synced before iterating.
+ *
+ * Returns the iterator, to be freed by ntfs_attr_put_extent_ctx()
+ *	or NULL if there was an error (with errno set)
+ */
+ntfs_attr_extent_ctx *ntfs_attr_get_extent_ctx(ntfs_attr *na, s64 bufsize)
+{
+	ntfs_attr_extent_ctx *ctx;
+
+	if (!na || !na->ni || !na->ni->vol || (bufsize < 0)) {
+		errno = EINVAL;
+		return ((ntfs_attr_extent_ctx*)NULL);
+	}
+	if (!bufsize)
+		bufsize = EXTENT_BUFSIZE;
+	if ((na->data_flags & ATTR_COMPRESSION_MASK)
+	    && na->compression_block_size)
+		bufsize = (bufsize + na->compression_block_size - 1)
+				& -(s64)na->compression_block_size;
+	ctx = (ntfs_attr_extent_ctx*)ntfs_calloc(sizeof(ntfs_attr_extent_ctx));
+	if (ctx) {
+		ctx->na = na;
+		ctx->bufsize = bufsize;
+	}
+	return (ctx);
+}
+
+/*
+ *		Decode the next extent into the buffer of an iterator
+ *
+ *	A compression block fully made of a hole is returned as a hole.
+ *
+ *	Returns 1 if an extent was decoded
+ *		-1 if there was an error (with errno set)
+ */
+
+static int ntfs_attr_decode_extent(ntfs_attr_extent_ctx *ctx)
+{
+	ntfs_attr *na;
+	runlist_element *rl;
+	VCN vcn;
+	s64 count;
+	s64 n;
+
+	na = ctx->na;
+	if ((na->data_flags & ATTR_COMPRESSION_MASK)
+	    && NAttrNonResident(na)
+	    && !(ctx->pos & (na->compression_block_size - 1))) {
+		vcn = ctx->pos >> na->ni->vol->cluster_size_bits;
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (rl && (rl->lcn == LCN_HOLE)) {
+			n = (rl->vcn + rl->length - vcn)
+				& -(s64)na->compression_block_clusters;
+			if (n > 0) {
+				count = n << na->ni->vol->cluster_size_bits;
+				ctx->length = min(count,
+						na->data_size - ctx->pos);
+				ctx->flags = NTFS_EXTENT_HOLE;
+				return (1);
+			}
+		}
+	}
+	if (!ctx->buf) {
+		ctx->buf = (char*)ntfs_malloc(ctx->bufsize);
+		if (!ctx->buf)
+			return (-1);
+	}
+	count = min(ctx->bufsize, na->data_size - ctx->pos);
+	n = ntfs_attr_pread(na, ctx->pos, count, ctx->buf);
+	if (n <= 0) {
+		if (!n)
+			errno = EIO;
+		return (-1);
+	}
+	ctx->length = n;
+	ctx->data = ctx->buf;
+	ctx->flags = NTFS_EXTENT_DECODED;
+	if (na->data_flags & ATTR_COMPRESSION_MASK)
+		ctx->flags |= NTFS_EXTENT_COMPRESSED;
+	return (1);
+}
+
+/**
+ * ntfs_attr_next_extent - get the next extent of an attribute
+ * @ctx:	iterator got from ntfs_attr_get_extent_ctx()
+ *
+ * The next extent is described in @ctx. A plain extent is stored on
+ * the device at ctx->device_offset, a hole reads as zeroes, and the
+ * data of a decoded extent (resident, compressed or encrypted) is
+ * at ctx->data, and is only valid until the next call.
+ *
+ * Returns 1 if an extent was found
+ *	0 at the end of the attribute
+ *	-1 if there was an error (with errno set)
+ */
+int ntfs_attr_next_extent(ntfs_attr_extent_ctx *ctx)
+{
+	ntfs_attr *na;
+	ntfs_volume *vol;
+	runlist_element *rl;
+	s64 ofs;
+	s64 n;
+	int res;
+
+	if (!ctx || !ctx->na || (ctx->pos < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	na = ctx->na;
+	vol = na->ni->vol;
+	if (ctx->pos >= na->data_size)
+		return (0);
+	ctx->offset = ctx->pos;
+	ctx->device_offset = 0;
+	ctx->data = (const char*)NULL;
+	if (!NAttrNonResident(na)
+	    || (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)))
+		res = ntfs_attr_decode_extent(ctx);
+	else if (ctx->pos >= na->initialized_size) {
+		ctx->length = na->data_size - ctx->pos;
+		ctx->flags = NTFS_EXTENT_HOLE | NTFS_EXTENT_UNINITIALIZED;
+		res = 1;
+	} else {
+		res = -1;
+		rl = ntfs_attr_find_vcn(na, ctx->pos >> vol->cluster_size_bits);
+		if (!rl) {
+			if (errno == ENOENT)
+				errno = EIO;
+		} else {
+			ofs = ctx->pos - (rl->vcn << vol->cluster_size_bits);
+			n = (rl->length << vol->cluster_size_bits) - ofs;
+			n = min(n, na->initialized_size - ctx->pos);
+			if ((n <= 0) || ((rl->lcn < 0)
+					&& (rl->lcn != LCN_HOLE)))
+				errno = EIO;
+			else {
+				ctx->length = n;
+				if (rl->lcn == LCN_HOLE)
+					ctx->flags = NTFS_EXTENT_HOLE;
+				else {
+					ctx->flags = (ntfs_extent_flags)0;
+					ctx->device_offset = (rl->lcn
+						<< vol->cluster_size_bits)
+							+ ofs;
+				}
+				res = 1;
+			}
+		}
+	}
+	if (res > 0)
+		ctx->pos += ctx->length;
+	return (res);
+}
+
+/**
+ * ntfs_attr_put_extent_ctx - release an iterator over extents
+ * @ctx:	iterator to free
+ */
+void ntfs_attr_put_extent_ctx(ntfs_attr_extent_ctx *ctx)
+{
+	if (ctx) {
+		free(ctx->buf);
+		free(ctx);
+	}
+}
+
+/*
+ *		Zero the full clusters of a run by the device
+ *
+ *	The clusters from @pos to @end or to the end of the run are
+ *	zeroed, if they are at least ZEROOUT_MIN bytes. @pos must be
+ *	at a cluster boundary.
+ *
+ *	Returns the number of bytes zeroed, or zero if they have to be
+ *	written.
+ */
+
+static s64 fill_zero_device(ntfs_volume *vol, const runlist_element *rl,
+			s64 ofs, s64 pos, s64 end)
+{
+	s64 count;
+
+	count = min(end, ofs + (rl->length << vol->cluster_size_bits)) - pos;
+	count &= ~(s64)(vol->cluster_size - 1);
+	if ((count < ZEROOUT_MIN)
+	    || ntfs_device_zero(vol->dev, (rl->lcn << vol->cluster_size_bits)
+				+ pos - ofs, count))
+		count = 0;
+	return (count);
+}
+
 static int ntfs_attr_fill_zero(ntfs_attr *na, s64 pos, s64 count)
 {
 	char *buf;
@@ -1228,7 +2261,25 @@ static int ntfs_attr_fill_zero(ntfs_attr *na, s64 pos, s64 count)
 				+ (rli->length << vol->cluster_size_bits));
 			pos += size;
 		} else {
-			written = ntfs_rl_pwrite(vol, rli, ofsi, pos,
+			/*
+			 * When big enough, let the device zero the full
+			 * clusters of the run, after writing the partial
+			 * first one.
+			 */
+			written = 0;
+			if ((rli->lcn >= 0) && !NDevNoZeroOut(vol->dev)
+			    && (min(end, ofsi + (rli->length
+					<< vol->cluster_size_bits)) - pos
+				>= ZEROOUT_MIN + vol->cluster_size)) {
+				if (pos & (vol->cluster_size - 1))
+					size = min(size, vol->cluster_size
+					    - (pos & (vol->cluster_size - 1)));
+				else
+					written = fill_zero_device(vol, rli,
+							ofsi, pos, end);
+			}
+			if (!written)
+				written = ntfs_rl_pwrite(vol, rli, ofsi, pos,
 							size, buf);
 			if (written <= 0) {
 				ntfs_log_perror("Failed to zero space");
@@ -1255,6 +2306,9 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
 	runlist *rlc;
 	LCN lcn_seek_from = -1;
 	VCN cur_vcn, from_vcn;
+	VCN dirty_vcn;
+	s64 tail_pos = 0;
+	s64 tail_end = 0;
 
 	to_write = min(count, ((*rl)->length << vol->cluster_size_bits) - *ofs);
 	
@@ -1353,18 +2407,61 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
 		}
 		rlc = ntfs_cluster_alloc(vol, alloc_vcn, need,
 				 lcn_seek_from, DATA_ZONE);
-	} else
-		rlc = ntfs_cluster_alloc(vol, from_vcn, need,
+	} else {
+		rlc = (runlist*)NULL;
+		if (vol->hole_unit
+		    && !(na->data_flags & ATTR_COMPRESSION_MASK)) {
+			/*
+			 * Fill the hole by aligned units, as much as the
+			 * hole allows, so that random writes do not split
+			 * it into many small runs. The allocated clusters
+			 * which are not written to are zeroed up to the
+			 * initialized size.
+			 */
+			VCN alloc_vcn, alloc_end;
+
+			alloc_vcn = from_vcn & -vol->hole_unit;
+			if (alloc_vcn < (*rl)->vcn)
+				alloc_vcn = (*rl)->vcn;
+			alloc_end = (from_vcn + need + vol->hole_unit - 1)
+					& -vol->hole_unit;
+			if (alloc_end > ((*rl)->vcn + (*rl)->length))
+				alloc_end = (*rl)->vcn + (*rl)->length;
+			if (lcn_seek_from >= 0) {
+				lcn_seek_from -= from_vcn - alloc_vcn;
+				if (lcn_seek_from < 0)
+					lcn_seek_from = -1;
+			}
+			rlc = ntfs_cluster_alloc(vol, alloc_vcn,
+					alloc_end - alloc_vcn,
+					lcn_seek_from, DATA_ZONE);
+			if (rlc) {
+				tail_pos = (from_vcn + need)
+						<< vol->cluster_size_bits;
+				tail_end = min(alloc_end
+						<< vol->cluster_size_bits,
+						na->initialized_size);
+				need = alloc_end - alloc_vcn;
+			} else
+				if (errno != ENOSPC)
+					goto err_out;
+		}
+			/* otherwise, or when short of space, be exact */
+		if (!rlc)
+			rlc = ntfs_cluster_alloc(vol, from_vcn, need,
 				 lcn_seek_from, DATA_ZONE);
+	}
 	if (!rlc)
 		goto err_out;
 	if (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_SPARSE))
 		na->compressed_size += need << vol->cluster_size_bits;
 	
-	*rl = ntfs_runlists_merge(na->rl, rlc);
+	dirty_vcn = rlc->vcn;
+	*rl = ntfs_attr_rl_merge(na, rlc);
 	if (*rl)
 		rlc = NULL;
-	NAttrSetRunlistDirty(na);
+		/* only the mapping of the allocated clusters has changed */
+	ntfs_attr_rl_dirty(na, dirty_vcn, dirty_vcn + need);
 		/*
 		 * For a compressed attribute, we must be sure there are two
 		 * available entries, so reserve them before it gets too late.
@@ -1377,6 +2474,7 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
 	}
 	if (!*rl) {
 		eo = errno;
+		ntfs_attr_rl_changed(na);
 		ntfs_log_perror("Failed to merge runlists");
 		if (ntfs_cluster_free_from_rl(vol, rlc)) {
 			ntfs_log_perror("Failed to free hot clusters. "
@@ -1416,6 +2514,10 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
 					*ofs))
 			goto err_out;
 	}
+		/* Clear the clusters allocated beyond the ones written */
+	if ((tail_end > tail_pos)
+	    && ntfs_attr_fill_zero(na, tail_pos, tail_end - tail_pos))
+		goto err_out;
 	if ((*rl)->vcn < cur_vcn) {
 		/*
 		 * Clusters that replaced hole are merged with
@@ -1594,7 +2696,8 @@ ntfs_log_error("No free run, case 4\n");
 				rl = ++(*prl);
 			}
 		}
-	NAttrSetRunlistDirty(na);
+	ntfs_attr_rl_dirty(na, (*prl)->vcn, RUNLIST_DIRTY_END);
+	ntfs_attr_rl_changed(na);
 	if ((*update_from == -1) || ((*prl)->vcn < *update_from))
 		*update_from = (*prl)->vcn;
 	}
@@ -1731,7 +2834,9 @@ static int borrow_from_hole(ntfs_attr *na, runlist_element **prl,
 				zrl->length = endblock - allocated;
 				zrl[1].length -= zrl->length;
 				zrl[1].vcn = zrl->vcn + zrl->length;
-				NAttrSetRunlistDirty(na);
+				ntfs_attr_rl_dirty(na, zrl->vcn,
+						RUNLIST_DIRTY_END);
+				ntfs_attr_rl_changed(na);
 			}
 		}
 		if (*prl) {
@@ -1762,6 +2867,66 @@ static int borrow_from_hole(ntfs_attr *na, runlist_element **prl,
 
 static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 				hole_type holes);
+static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
+				const s64 allocsize, hole_type holes);
+
+/*
+ *		The files which have clusters preallocated beyond their data
+ *
+ *	Only these clusters are released when closing, those allocated
+ *	by ntfs_attr_fallocate() are kept.
+ */
+
+struct PREALLOC_WINDOWS {
+	int count;
+	u64 inum[PREALLOC_MAX_WINDOWS];
+} ;
+
+static int prealloc_window_find(struct PREALLOC_WINDOWS *windows, u64 inum)
+{
+	int i;
+
+	i = windows->count;
+	while ((--i >= 0) && (windows->inum[i] != inum)) { }
+	return (i);
+}
+
+/*
+ *		Preallocate clusters beyond the end of a plain file
+ *	being appended to, so that files being appended to concurrently
+ *	do not get interleaved extents.
+ *
+ *	The preallocation grows with the file up to the volume setting.
+ *	Failing to preallocate is not an error, the exact allocation
+ *	is done later anyway.
+ */
+
+static void ntfs_attr_prealloc(ntfs_attr *na, s64 end)
+{
+	struct PREALLOC_WINDOWS *windows;
+	ntfs_volume *vol;
+	s64 extra;
+	int olderrno;
+	int i;
+
+	vol = na->ni->vol;
+	windows = vol->prealloc_windows;
+	i = prealloc_window_find(windows, na->ni->mft_no);
+	if ((i >= 0) || (windows->count < PREALLOC_MAX_WINDOWS)) {
+		extra = (end < vol->prealloc_size ? end : vol->prealloc_size);
+		olderrno = errno;
+		if (ntfs_non_resident_attr_expand_i(na, na->data_size,
+					end + extra, HOLES_NO))
+			ntfs_log_debug("Could not preallocate %lld bytes to "
+					"inode %lld\n", (long long)extra,
+					(long long)na->ni->mft_no);
+		else
+			if (i < 0)
+				windows->inum[windows->count++]
+						= na->ni->mft_no;
+		errno = olderrno;
+	}
+}
 
 /**
  * ntfs_attr_pwrite - positioned write to an ntfs attribute
@@ -1782,6 +2947,93 @@ static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
  * appropriately to the return code of ntfs_pwrite(), or to EINVAL in case of
  * invalid arguments.
  */
+/*
+ *		Write the data of an attribute to the device
+ *
+ *	When the attribute is flagged as ConcurrentWrite, the data is
+ *	only overwritten, and other readers and writers may use the
+ *	volume during the transfer.
+ */
+
+static s64 attr_write_data(ntfs_attr *na, s64 wpos, s64 count,
+			const void *b)
+{
+	ntfs_volume *vol;
+	s64 written;
+	BOOL released;
+
+	vol = na->ni->vol;
+	released = NAttrConcurrentWrite(na)
+			&& ntfs_volume_transfer_begin(vol);
+	written = ntfs_pwrite(vol->dev, wpos, count, b);
+	if (released)
+		ntfs_volume_transfer_end(vol, TRUE);
+	return (written);
+}
+
+/*
+ *		Write data to a big cluster with zero padding
+ *
+ *	The end of the data is padded with zeroes to a multiple of
+ *	ZERO_PAD_SIZE, only copying the last partial unit to a small
+ *	buffer. When the cluster was a hole, the rest of it is then
+ *	zeroed like a gap up to the initialized size, rather than
+ *	written from a full cluster buffer : the data beyond the
+ *	initialized size is zeroed when the initialized size grows.
+ *
+ *	Returns the number of bytes of data written, or -1 if an error
+ *	occurred and nothing was written (errno set)
+ */
+
+static s64 write_zero_padded(ntfs_attr *na, s64 wpos, s64 wend,
+			s64 count, const void *b, BOOL exsparse)
+{
+	ntfs_volume *vol;
+	char *cb;
+	s64 written;
+	s64 head;
+	s64 tail;
+	s64 pad;
+	s64 cend;
+
+	vol = na->ni->vol;
+	tail = wend & (ZERO_PAD_SIZE - 1);
+	if (tail > count)
+		tail = count;
+	head = count - tail;
+	pad = ((wend + ZERO_PAD_SIZE - 1) & ~(s64)(ZERO_PAD_SIZE - 1)) - wend;
+	written = 0;
+	if (head) {
+		written = attr_write_data(na, wpos, head, b);
+		if (written != head)
+			return (written);
+	}
+	if (tail + pad) {
+		cb = (char*)ntfs_malloc(tail + pad);
+		if (!cb)
+			return (head ? head : -1);
+		memcpy(cb, (const char*)b + head, tail);
+		memset(cb + tail, 0, pad);
+		written = attr_write_data(na, wpos + head, tail + pad, cb);
+		free(cb);
+		if (written != (tail + pad)) {
+			if (written < 0)
+				return (head ? head : -1);
+			return (head + min(written, tail));
+		}
+	}
+	if (exsparse) {
+		cend = (wend + vol->cluster_size - 1)
+				& ~(s64)(vol->cluster_size - 1);
+		if (cend > na->initialized_size)
+			cend = na->initialized_size;
+		if ((cend > (wend + pad))
+		    && ntfs_attr_fill_zero(na, wend + pad, cend - wend - pad))
+			return (-1);
+	}
+	return (count);
+}
+
 static s64 ntfs_attr_pwrite_i(ntfs_attr *na, const s64 pos, s64 count,
 								const void *b)
 {
@@ -1816,6 +3068,15 @@ static s64 ntfs_attr_pwrite_i(ntfs_attr *na, const s64 pos, s64 count,
 		errno = EACCES;
 		goto errno_set;
 	}
+		/*
+		 * The runlist has to be complete if it may be updated, which
+		 * is not the case when overwriting the data of a plain file.
+		 */
+	if ((compressed
+	    || (na->data_flags & ATTR_IS_SPARSE)
+	    || ((pos + count) > na->initialized_size))
+	    && ntfs_attr_rl_expand(na))
+		goto errno_set;
 		/*
 		 * Fill the gap, when writing beyond the end of a compressed
 		 * file. This will make recursive calls
@@ -1849,6 +3110,19 @@ static s64 ntfs_attr_pwrite_i(ntfs_attr *na, const s64 pos, s64 count,
 	if ((na->type == AT_DATA) && (pos >= old_data_size)
 	    && NAttrNonResident(na))
 		NAttrSetDataAppending(na);
+		/*
+		 * When appending to a plain file, allocate ahead of the
+		 * data, the clusters beyond the data are released by
+		 * ntfs_attr_trim_prealloc() when the file is closed.
+		 */
+	if (vol->prealloc_size
+	    && NAttrDataAppending(na)
+	    && (na->name == AT_UNNAMED)
+	    && !(na->data_flags & (ATTR_COMPRESSION_MASK
+				| ATTR_IS_SPARSE | ATTR_IS_ENCRYPTED))
+	    && (pos <= na->initialized_size)
+	    && ((pos + count) > na->allocated_size))
+		ntfs_attr_prealloc(na, pos + count);
 	if (pos + count > na->data_size) {
 #if PARTIAL_RUNLIST_UPDATING
 		/*
@@ -1899,38 +3173,23 @@ static s64 ntfs_attr_pwrite_i(ntfs_attr *na, const s64 pos, s64 count,
 	old_initialized_size = na->initialized_size;
 	/* If it is a resident attribute, write the data to the mft record. */
 	if (!NAttrNonResident(na)) {
+		ntfs_inode *ni;
 		char *val;
 
-		ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
-		if (!ctx)
-			goto err_out;
-		if (ntfs_attr_lookup(na->type, na->name, na->name_len, 0,
-				0, NULL, 0, ctx)) {
+		val = resident_value(na, &ni, &ctx);
+		if (!val) {
 			ntfs_log_perror("%s: lookup failed", __FUNCTION__);
 			goto err_out;
 		}
-		val = (char*)ctx->attr + le16_to_cpu(ctx->attr->value_offset);
-		if (val < (char*)ctx->attr || val +
-				le32_to_cpu(ctx->attr->value_length) >
-				(char*)ctx->mrec + vol->mft_record_size) {
-			errno = EIO;
-			ntfs_log_perror("%s: Sanity check failed", __FUNCTION__);
-			goto err_out;
-		}
 		memcpy(val + pos, b, count);
-		if (ntfs_mft_record_write(vol, ctx->ntfs_ino->mft_no,
-				ctx->mrec)) {
 			/*
-			 * NOTE: We are in a bad state at this moment. We have
-			 * dirtied the mft record but we failed to commit it to
-			 * disk. Since we have read the mft record ok before,
-			 * it is unlikely to fail writing it, so is ok to just
-			 * return error here... (AIA)
+			 * Only mark the record dirty, so that successive
+			 * small writes to the file are committed together
+			 * when the inode is synced or closed.
 			 */
-			ntfs_log_perror("%s: failed to write mft record", __FUNCTION__);
-			goto err_out;
-		}
-		ntfs_attr_put_search_ctx(ctx);
+		ntfs_inode_mark_dirty(ni);
+		if (ctx)
+			ntfs_attr_put_search_ctx(ctx);
 		total = count;
 		goto out;
 	}
@@ -2181,7 +3440,14 @@ retry:
 			 * This is done even for compressed files, because
 			 * data is generally first written uncompressed.
 			 */
-			if (rounding && ((wend == na->initialized_size) ||
+			if (rounding && !compressed
+			    && (bsize > ZERO_PAD_SIZE)
+			    && ((wend == na->initialized_size) ||
+				(wend < (hole_end << vol->cluster_size_bits)))){
+				written = write_zero_padded(na, wpos, wend,
+						to_write, b,
+					wend < (hole_end << vol->cluster_size_bits));
+			} else if (rounding && ((wend == na->initialized_size) ||
 				(wend < (hole_end << vol->cluster_size_bits)))){
 				
 				char *cb;
@@ -2201,7 +3467,7 @@ retry:
 						rounding, cb, compressed_part,
 						&update_from);
 				} else {
-					written = ntfs_pwrite(vol->dev, wpos,
+					written = attr_write_data(na, wpos,
 						rounding, cb); 
 					if (written == rounding)
 						written = to_write;
@@ -2215,7 +3481,7 @@ retry:
 						to_write, b, compressed_part,
 						&update_from);
 				} else
-					written = ntfs_pwrite(vol->dev, wpos,
+					written = attr_write_data(na, wpos,
 						to_write, b);
 			}
 		} else
@@ -2328,8 +3594,149 @@ errno_set:
 	goto out;
 }
 
+/*
+ *		Gathering of small appends
+ *
+ *	When requested by ntfs_attr_set_append_buffer(), the writes
+ *	smaller than the buffer which append to the data of an open
+ *	attribute, or to the data already gathered, are copied to the
+ *	buffer, and written as a single write when the buffer is full, so
+ *	that many small appends (such as by log writers) do not each
+ *	resize the attribute, allocate clusters, update the mapping pairs
+ *	and the mft record.
+ *
+ *	The data gathered is not accounted for in the sizes of the
+ *	attribute and of the inode until it is written, which is done
+ *	when the attribute is read beyond the gathered position,
+ *	truncated, flushed by ntfs_attr_flush_append() (fsync) or closed,
+ *	and before any other write. So this is only meant for callers
+ *	which keep the attribute open and get the sizes after flushing,
+ *	such as the UEFI driver which has no write-back cache above. An
+ *	error while writing the gathered data is reported by the next
+ *	operation which writes it, and that data is lost.
+ */
+
+static s64 ntfs_attr_write_all(ntfs_attr *na, s64 pos, s64 count,
+			const void *b)
+{
+	s64 total;
+	s64 written;
+
+	total = 0;
+	do {
+		written = ntfs_attr_pwrite_i(na, pos + total,
+				count - total, (const u8*)b + total);
+		if (written > 0)
+			total += written;
+	} while ((written > 0) && (total < count));
+	if ((written >= 0) && (total < count)) {
+		errno = EIO;
+		written = -1;
+	}
+	return (written < 0 ? -1 : total);
+}
+
+/*
+ *		Write the data gathered from small appends
+ *
+ *	Returns 0 if there was nothing to write or it was written,
+ *		-1 if it failed (with errno set, the data is lost)
+ */
+
+int ntfs_attr_flush_append(ntfs_attr *na)
+{
+	u32 count;
+	int res;
+
+	res = 0;
+	count = na->append_count;
+	if (count) {
+		na->append_count = 0;
+		if (ntfs_attr_write_all(na, na->append_pos, count,
+				na->append_buf) < 0)
+			res = -1;
+	}
+	return (res);
+}
+
+/*
+ *		Gather a small append, if possible
+ *
+ *	Returns the count of bytes gathered,
+ *		0 if the write is not a small append and has to be done,
+ *			the data previously gathered having been written
+ *		-1 if writing the gathered data failed
+ */
+
+static s64 ntfs_attr_gather(ntfs_attr *na, s64 pos, s64 count,
+			const void *b)
+{
+	s64 next;
+
+	if (na->append_count)
+		next = na->append_pos + na->append_count;
+	else
+		next = na->data_size;
+	if ((pos == next) && (count < na->append_size)) {
+		if (!na->append_buf) {
+			na->append_buf = (char*)ntfs_malloc(na->append_size);
+				/* not gathering is not an error */
+			if (!na->append_buf)
+				return (0);
+		}
+		if (((na->append_count + count) > na->append_size)
+		    && ntfs_attr_flush_append(na))
+			return (-1);
+		if (!na->append_count)
+			na->append_pos = pos;
+		memcpy(na->append_buf + na->append_count, b, count);
+		na->append_count += count;
+		if ((na->append_count == na->append_size)
+		    && ntfs_attr_flush_append(na))
+			return (-1);
+		return (count);
+	}
+	if (na->append_count && ntfs_attr_flush_append(na))
+		return (-1);
+	return (0);
+}
+
+/*
+ *		Request the gathering of small appends to an open attribute
+ *
+ *	@size is the count of bytes to gather before writing them, it is
+ *	rounded up to a multiple of the cluster size, zero meaning the
+ *	default APPEND_BUFFER_SIZE. The buffer is only allocated when
+ *	a small append is made.
+ *	Encrypted attributes cannot be written this way, and the other
+ *	attributes than data may be updated behind the back of the open
+ *	attribute, so they are not gathered.
+ *
+ *	Returns 0 if the appends are gathered,
+ *		-1 if they cannot be (with errno set)
+ */
+
+int ntfs_attr_set_append_buffer(ntfs_attr *na, u32 size)
+{
+	u32 csize;
+
+	if ((na->type != AT_DATA)
+	    || (na->data_flags & ATTR_IS_ENCRYPTED)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if (!na->append_size) {
+		csize = na->ni->vol->cluster_size;
+		if (!size)
+			size = APPEND_BUFFER_SIZE;
+		na->append_size = (size + csize - 1) & ~(csize - 1);
+	}
+	return (0);
+}
+
 s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count, const void *b)
 {
+	struct NTFS_TRACE_TAG tag;
 	s64 total;
 	s64 written;
 
@@ -2345,21 +3752,75 @@ s64 ntfs_attr_pwrite(ntfs_attr *na, const s64 pos, s64 count, const void *b)
 		goto out;
 	}
 
+	if (na->ni->vol->usn_journal)
+		ntfs_usn_write(na, pos, count);
+	if (na->append_size && count) {
+		written = ntfs_attr_gather(na, pos, count, b);
+		if (written)
+			goto out;
+	}
 		/*
 		 * Compressed attributes may be written partially, so
 		 * we may have to iterate.
 		 */
+	ntfs_trace_enter_attr(na, pos, &tag);
+	NTFS_PROBE4(attr_pwrite_entry, na->ni->mft_no, le32_to_cpu(na->type),
+			pos, count);
 	do {
 		written = ntfs_attr_pwrite_i(na, pos + total,
 				count - total, (const u8*)b + total);
 		if (written > 0)
 			total += written;
 	} while ((written > 0) && (total < count));
+	NTFS_PROBE3(attr_pwrite_return, na->ni->mft_no, le32_to_cpu(na->type),
+			(total > 0 ? total : written));
+	ntfs_trace_leave(&tag);
 out :
 	ntfs_log_leave("\n");
 	return (total > 0 ? total : written);
 }
 
+/*
+ *		Check whether a write only overwrites data
+ *
+ *	This is the case when the attribute is plain non-resident (neither
+ *	compressed nor encrypted) and the written range is initialized
+ *	and allocated in the mapped part of the runlist. Such a write
+ *	does not change any metadata, and its data may be transferred
+ *	while other requests use the volume (see NAttrConcurrentWrite).
+ *
+ *	Returns TRUE if the write only overwrites data
+ */
+
+BOOL ntfs_attr_overwrites(ntfs_attr *na, s64 pos, s64 count)
+{
+	runlist_element *rl;
+	VCN vcn;
+	VCN endvcn;
+	BOOL ok;
+
+	ok = FALSE;
+	if (NAttrNonResident(na)
+	    && !(na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))
+	    && (pos >= 0) && (count > 0)
+	    && ((pos + count) <= na->initialized_size)
+	    && na->rl) {
+		vcn = pos >> na->ni->vol->cluster_size_bits;
+		endvcn = (pos + count - 1) >> na->ni->vol->cluster_size_bits;
+		for (rl=na->rl; rl->length && ((rl->vcn + rl->length) <= vcn);
+				rl++) { }
+		ok = TRUE;
+		while (ok && (vcn <= endvcn)) {
+			if (!rl->length || (rl->vcn > vcn) || (rl->lcn < 0))
+				ok = FALSE;
+			else {
+				vcn = rl->vcn + rl->length;
+				rl++;
+			}
+		}
+	}
+	return (ok);
+}
 
 int ntfs_attr_pclose(ntfs_attr *na)
 {
@@ -2384,6 +3845,8 @@ int ntfs_attr_pclose(ntfs_attr *na)
 		goto errno_set;
 	}
 	vol = na->ni->vol;
+	if (na->append_count && ntfs_attr_flush_append(na))
+		goto errno_set;
 	na->unused_runs = 0;
 	compressed = (na->data_flags & ATTR_COMPRESSION_MASK)
 			 != const_cpu_to_le16(0);
@@ -2399,6 +3862,8 @@ int ntfs_attr_pclose(ntfs_attr *na)
 	/* same if it is resident */
 	if (!compressed || !NAttrNonResident(na))
 		goto out;
+	if (ntfs_attr_rl_expand(na))
+		goto errno_set;
 
 		/* safety check : no recursion on close */
 	if (NAttrComprClosing(na)) {
@@ -2592,7 +4057,6 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 		const u32 bk_size, void *dst)
 {
 	s64 br;
-	u8 *end;
 	BOOL warn;
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr type 0x%x, pos 0x%llx.\n",
@@ -2609,9 +4073,7 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 	br /= bk_size;
 		/* log errors unless silenced */
 	warn = !na->ni || !na->ni->vol || !NVolNoFixupWarn(na->ni->vol);
-	for (end = (u8*)dst + br * bk_size; (u8*)dst < end; dst = (u8*)dst +
-			bk_size)
-		ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)dst, bk_size, warn);
+	ntfs_mst_post_read_fixup_many(dst, br, bk_size, warn);
 	/* Finally, return the number of blocks read. */
 	return br;
 }
@@ -2649,7 +4111,7 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 		const u32 bk_size, void *src)
 {
-	s64 written, i;
+	s64 written, prepared;
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr type 0x%x, pos 0x%llx.\n",
 			(unsigned long long)na->ni->mft_no, le32_to_cpu(na->type),
@@ -2660,20 +4122,13 @@ s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 	}
 	if (!bk_cnt)
 		return 0;
-	/* Prepare data for writing. */
-	for (i = 0; i < bk_cnt; ++i) {
-		int err;
-
-		err = ntfs_mst_pre_write_fixup((NTFS_RECORD*)
-				((u8*)src + i * bk_size), bk_size);
-		if (err < 0) {
-			/* Abort write at this position. */
-			ntfs_log_perror("%s #1", __FUNCTION__);
-			if (!i)
-				return err;
-			bk_cnt = i;
-			break;
-		}
+	/* Prepare data for writing, aborting at a bad block. */
+	prepared = ntfs_mst_pre_write_fixup_many(src, bk_cnt, bk_size);
+	if (prepared < bk_cnt) {
+		ntfs_log_perror("%s #1", __FUNCTION__);
+		if (prepared < 0)
+			return prepared;
+		bk_cnt = prepared;
 	}
 	/* Write the prepared data. */
 	written = ntfs_attr_pwrite(na, pos, bk_cnt * bk_size, src);
@@ -2682,86 +4137,169 @@ s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 				(long long)written);
 	}
 	/* Quickly deprotect the data again. */
-	for (i = 0; i < bk_cnt; ++i)
-		ntfs_mst_post_write_fixup((NTFS_RECORD*)((u8*)src + i *
-				bk_size));
+	ntfs_mst_post_write_fixup_many(src, bk_cnt, bk_size);
 	if (written <= 0)
 		return written;
 	/* Finally, return the number of complete blocks written. */
 	return written / bk_size;
 }
 
-/**
- * ntfs_attr_find - find (next) attribute in mft record
- * @type:	attribute type to find
- * @name:	attribute name to find (optional, i.e. NULL means don't care)
- * @name_len:	attribute name length (only needed if @name present)
- * @ic:		IGNORE_CASE or CASE_SENSITIVE (ignored if @name not present)
- * @val:	attribute value to find (optional, resident attributes only)
- * @val_len:	attribute value length
- * @ctx:	search context with mft record and attribute to search from
- *
- * You shouldn't need to call this function directly. Use lookup_attr() instead.
- *
- * ntfs_attr_find() takes a search context @ctx as parameter and searches the
- * mft record specified by @ctx->mrec, beginning at @ctx->attr, for an
- * attribute of @type, optionally @name and @val. If found, ntfs_attr_find()
- * returns 0 and @ctx->attr will point to the found attribute.
- *
- * If not found, ntfs_attr_find() returns -1, with errno set to ENOENT and
- * @ctx->attr will point to the attribute before which the attribute being
- * searched for would need to be inserted if such an action were to be desired.
- *
- * On actual error, ntfs_attr_find() returns -1 with errno set to the error
- * code but not to ENOENT.  In this case @ctx->attr is undefined and in
- * particular do not rely on it not changing.
- *
- * If @ctx->is_first is TRUE, the search begins with @ctx->attr itself. If it
- * is FALSE, the search begins after @ctx->attr.
- *
- * If @type is AT_UNUSED, return the first found attribute, i.e. one can
- * enumerate all attributes by setting @type to AT_UNUSED and then calling
- * ntfs_attr_find() repeatedly until it returns -1 with errno set to ENOENT to
- * indicate that there are no more entries. During the enumeration, each
- * successful call of ntfs_attr_find() will return the next attribute in the
- * mft record @ctx->mrec.
- *
- * If @type is AT_END, seek to the end and return -1 with errno set to ENOENT.
- * AT_END is not a valid attribute, its length is zero for example, thus it is
- * safer to return error instead of success in this case. This also allows us
- * to interoperate cleanly with ntfs_external_attr_find().
- *
- * If @name is AT_UNNAMED search for an unnamed attribute. If @name is present
- * but not AT_UNNAMED search for a named attribute matching @name. Otherwise,
- * match both named and unnamed attributes.
- *
- * If @ic is IGNORE_CASE, the @name comparison is not case sensitive and
- * @ctx->ntfs_ino must be set to the ntfs inode to which the mft record
- * @ctx->mrec belongs. This is so we can get at the ntfs volume and hence at
- * the upcase table. If @ic is CASE_SENSITIVE, the comparison is case
- * sensitive. When @name is present, @name_len is the @name length in Unicode
- * characters.
+/*
+ *		Table of the attributes looked up in the record of an inode
+ *
+ *	Looking up an attribute by type and name from the beginning of the
+ *	record of an inode, the offset of the attribute found, or of the
+ *	attribute before which it would be inserted, is kept with the inode,
+ *	so that the next lookups of the same attribute do not scan the
+ *	record. Any change of the layout of an mft record increments a
+ *	count through ntfs_attr_layout_changed(), and the table is only
+ *	valid for the count it was filled with, so that the library does
+ *	not have to locate the inodes whose records are modified. The
+ *	callers are expected to serialize their accesses to a volume.
+ */
+
+#define ATTR_OFFSET_ANY_NAME 1		/* matching any name */
+#define ATTR_OFFSET_FOUND 2		/* the attribute exists */
+
+struct ATTR_OFFSET {
+	ATTR_TYPES type;
+	u16 offset;			/* offset in the record */
+	u8 name_len;
+	u8 flags;
+	ntfschar name[ATTR_OFFSETS_NAME_LEN];
+} ;
+
+struct ATTR_OFFSETS {
+	const MFT_RECORD *mrec;		/* record the offsets apply to */
+	unsigned int layout;		/* count of layout changes */
+	int count;
+	int next;			/* next entry to replace */
+	struct ATTR_OFFSET entries[ATTR_OFFSETS_COUNT];
+} ;
+
+static unsigned int attr_layout_count;
+
+/*
+ *		Declare the layout of an mft record has changed
  *
- * If @name is not present (NULL), we assume that the unnamed attribute is
- * being searched for.
+ *	This invalidates the offsets of attributes kept in all inodes.
+ */
+
+void ntfs_attr_layout_changed(void)
+{
+	attr_layout_count++;
+}
+
+/*
+ *		Check whether a lookup can use the table of attribute offsets
+ */
+
+static BOOL attr_offsets_usable(const ATTR_TYPES type, const ntfschar *name,
+		const u32 name_len, const u8 *val, ntfs_attr_search_ctx *ctx,
+		const IGNORE_CASE_BOOL ic)
+{
+	ntfs_inode *ni;
+
+	ni = ctx->ntfs_ino;
+	return (ni && !val && ctx->is_first
+		&& (ctx->mrec == ni->mrec)
+		&& (type != AT_UNUSED) && (type != AT_END)
+		&& ((char*)ctx->attr == (char*)ctx->mrec
+			+ le16_to_cpu(ctx->mrec->attrs_offset))
+		&& (!name || (name == AT_UNNAMED)
+			|| ((ic == CASE_SENSITIVE)
+			    && (name_len <= ATTR_OFFSETS_NAME_LEN))));
+}
+
+/*
+ *		Locate the entry of an attribute in the table of an inode
  *
- * Finally, the resident attribute value @val is looked for, if present.
- * If @val is not present (NULL), @val_len is ignored.
+ *	The table is emptied when it is no longer valid.
  *
- * ntfs_attr_find() only searches the specified mft record and it ignores the
- * presence of an attribute list attribute (unless it is the one being searched
- * for, obviously). If you need to take attribute lists into consideration, use
- * ntfs_attr_lookup() instead (see below). This also means that you cannot use
- * ntfs_attr_find() to search for extent records of non-resident attributes, as
- * extents with lowest_vcn != 0 are usually described by the attribute list
- * attribute only. - Note that it is possible that the first extent is only in
- * the attribute list while the last extent is in the base mft record, so don't
- * rely on being able to find the first extent in the base mft record.
+ *	Returns the entry, or NULL if there is none
+ */
+
+static struct ATTR_OFFSET *attr_offsets_find(ntfs_inode *ni,
+		const ATTR_TYPES type, const ntfschar *name, u32 name_len)
+{
+	struct ATTR_OFFSETS *table;
+	struct ATTR_OFFSET *e;
+	int i;
+
+	table = ni->attr_offsets;
+	if (!table)
+		return ((struct ATTR_OFFSET*)NULL);
+	if ((table->mrec != ni->mrec) || (table->layout != attr_layout_count)) {
+		table->mrec = ni->mrec;
+		table->layout = attr_layout_count;
+		table->count = 0;
+		table->next = 0;
+		return ((struct ATTR_OFFSET*)NULL);
+	}
+	if (!name || (name == AT_UNNAMED))
+		name_len = 0;
+	for (i=0; i<table->count; i++) {
+		e = &table->entries[i];
+		if ((e->type == type)
+		    && (!name == !!(e->flags & ATTR_OFFSET_ANY_NAME))
+		    && (e->name_len == name_len)
+		    && (!name_len
+			|| !memcmp(e->name, name, name_len*sizeof(ntfschar))))
+			return (e);
+	}
+	return ((struct ATTR_OFFSET*)NULL);
+}
+
+/*
+ *		Record the result of a lookup in the table of an inode
+ */
+
+static void attr_offsets_enter(ntfs_inode *ni, const ATTR_TYPES type,
+		const ntfschar *name, u32 name_len, const ATTR_RECORD *a,
+		BOOL found)
+{
+	struct ATTR_OFFSETS *table;
+	struct ATTR_OFFSET *e;
+
+	table = ni->attr_offsets;
+	if (!table) {
+		table = (struct ATTR_OFFSETS*)ntfs_malloc(
+					sizeof(struct ATTR_OFFSETS));
+		if (!table)
+			return;
+		table->mrec = ni->mrec;
+		table->layout = attr_layout_count;
+		table->count = 0;
+		table->next = 0;
+		ni->attr_offsets = table;
+	}
+	if ((table->mrec != ni->mrec) || (table->layout != attr_layout_count))
+		return;
+	if (table->count < ATTR_OFFSETS_COUNT)
+		e = &table->entries[table->count++];
+	else {
+		e = &table->entries[table->next];
+		table->next = (table->next + 1) % ATTR_OFFSETS_COUNT;
+	}
+	e->type = type;
+	e->offset = (char*)a - (char*)ni->mrec;
+	e->flags = (name ? 0 : ATTR_OFFSET_ANY_NAME)
+			| (found ? ATTR_OFFSET_FOUND : 0);
+	if (!name || (name == AT_UNNAMED))
+		e->name_len = 0;
+	else {
+		e->name_len = name_len;
+		memcpy(e->name, name, name_len*sizeof(ntfschar));
+	}
+}
+
+/*
+ *		Scan an mft record for an attribute
  *
- * Warning: Never use @val when looking for attribute types which can be
- *	    non-resident as this most likely will result in a crash!
+ *	See ntfs_attr_find() below
  */
-static int ntfs_attr_find(const ATTR_TYPES type, const ntfschar *name,
+
+static int attr_find_scan(const ATTR_TYPES type, const ntfschar *name,
 		const u32 name_len, const IGNORE_CASE_BOOL ic,
 		const u8 *val, const u32 val_len, ntfs_attr_search_ctx *ctx)
 {
@@ -2855,32 +4393,139 @@ static int ntfs_attr_find(const ATTR_TYPES type, const ntfschar *name,
 		else {
 			register int rc;
 
-			rc = memcmp(val, (char*)a +le16_to_cpu(a->value_offset),
-					min(val_len,
-					le32_to_cpu(a->value_length)));
-			/*
-			 * If @val collates before the current attribute's
-			 * value, there is no matching attribute.
-			 */
-			if (!rc) {
-				register u32 avl;
-				avl = le32_to_cpu(a->value_length);
-				if (val_len == avl)
-					return 0;
-				if (val_len < avl) {
-					errno = ENOENT;
-					return -1;
-				}
-			} else if (rc < 0) {
+			rc = memcmp(val, (char*)a +le16_to_cpu(a->value_offset),
+					min(val_len,
+					le32_to_cpu(a->value_length)));
+			/*
+			 * If @val collates before the current attribute's
+			 * value, there is no matching attribute.
+			 */
+			if (!rc) {
+				register u32 avl;
+				avl = le32_to_cpu(a->value_length);
+				if (val_len == avl)
+					return 0;
+				if (val_len < avl) {
+					errno = ENOENT;
+					return -1;
+				}
+			} else if (rc < 0) {
+				errno = ENOENT;
+				return -1;
+			}
+		}
+	}
+	errno = EIO;
+	ntfs_log_perror("%s: Corrupt inode (%lld)", __FUNCTION__, 
+			ctx->ntfs_ino ? (long long)ctx->ntfs_ino->mft_no : -1);
+	return -1;
+}
+
+/**
+ * ntfs_attr_find - find (next) attribute in mft record
+ * @type:	attribute type to find
+ * @name:	attribute name to find (optional, i.e. NULL means don't care)
+ * @name_len:	attribute name length (only needed if @name present)
+ * @ic:		IGNORE_CASE or CASE_SENSITIVE (ignored if @name not present)
+ * @val:	attribute value to find (optional, resident attributes only)
+ * @val_len:	attribute value length
+ * @ctx:	search context with mft record and attribute to search from
+ *
+ * You shouldn't need to call this function directly. Use lookup_attr() instead.
+ *
+ * ntfs_attr_find() takes a search context @ctx as parameter and searches the
+ * mft record specified by @ctx->mrec, beginning at @ctx->attr, for an
+ * attribute of @type, optionally @name and @val. If found, ntfs_attr_find()
+ * returns 0 and @ctx->attr will point to the found attribute.
+ *
+ * If not found, ntfs_attr_find() returns -1, with errno set to ENOENT and
+ * @ctx->attr will point to the attribute before which the attribute being
+ * searched for would need to be inserted if such an action were to be desired.
+ *
+ * On actual error, ntfs_attr_find() returns -1 with errno set to the error
+ * code but not to ENOENT.  In this case @ctx->attr is undefined and in
+ * particular do not rely on it not changing.
+ *
+ * If @ctx->is_first is TRUE, the search begins with @ctx->attr itself. If it
+ * is FALSE, the search begins after @ctx->attr.
+ *
+ * If @type is AT_UNUSED, return the first found attribute, i.e. one can
+ * enumerate all attributes by setting @type to AT_UNUSED and then calling
+ * ntfs_attr_find() repeatedly until it returns -1 with errno set to ENOENT to
+ * indicate that there are no more entries. During the enumeration, each
+ * successful call of ntfs_attr_find() will return the next attribute in the
+ * mft record @ctx->mrec.
+ *
+ * If @type is AT_END, seek to the end and return -1 with errno set to ENOENT.
+ * AT_END is not a valid attribute, its length is zero for example, thus it is
+ * safer to return error instead of success in this case. This also allows us
+ * to interoperate cleanly with ntfs_external_attr_find().
+ *
+ * If @name is AT_UNNAMED search for an unnamed attribute. If @name is present
+ * but not AT_UNNAMED search for a named attribute matching @name. Otherwise,
+ * match both named and unnamed attributes.
+ *
+ * If @ic is IGNORE_CASE, the @name comparison is not case sensitive and
+ * @ctx->ntfs_ino must be set to the ntfs inode to which the mft record
+ * @ctx->mrec belongs. This is so we can get at the ntfs volume and hence at
+ * the upcase table. If @ic is CASE_SENSITIVE, the comparison is case
+ * sensitive. When @name is present, @name_len is the @name length in Unicode
+ * characters.
+ *
+ * If @name is not present (NULL), we assume that the unnamed attribute is
+ * being searched for.
+ *
+ * Finally, the resident attribute value @val is looked for, if present.
+ * If @val is not present (NULL), @val_len is ignored.
+ *
+ * ntfs_attr_find() only searches the specified mft record and it ignores the
+ * presence of an attribute list attribute (unless it is the one being searched
+ * for, obviously). If you need to take attribute lists into consideration, use
+ * ntfs_attr_lookup() instead (see below). This also means that you cannot use
+ * ntfs_attr_find() to search for extent records of non-resident attributes, as
+ * extents with lowest_vcn != 0 are usually described by the attribute list
+ * attribute only. - Note that it is possible that the first extent is only in
+ * the attribute list while the last extent is in the base mft record, so don't
+ * rely on being able to find the first extent in the base mft record.
+ *
+ * Warning: Never use @val when looking for attribute types which can be
+ *	    non-resident as this most likely will result in a crash!
+ */
+static int ntfs_attr_find(const ATTR_TYPES type, const ntfschar *name,
+		const u32 name_len, const IGNORE_CASE_BOOL ic,
+		const u8 *val, const u32 val_len, ntfs_attr_search_ctx *ctx)
+{
+	struct ATTR_OFFSET *e;
+	ATTR_RECORD *a;
+	BOOL usable;
+	int ret;
+
+	usable = attr_offsets_usable(type, name, name_len, val, ctx, ic);
+	if (usable) {
+		e = attr_offsets_find(ctx->ntfs_ino, type, name, name_len);
+		if (e) {
+			a = (ATTR_RECORD*)((char*)ctx->mrec + e->offset);
+			/* only a sanity check, the layout is known unchanged */
+			if (((e->offset + 8) <= le32_to_cpu(ctx->mrec->bytes_in_use))
+			    && (!(e->flags & ATTR_OFFSET_FOUND)
+				|| (a->type == type))) {
+				ctx->attr = a;
+				ctx->is_first = FALSE;
+				if (e->flags & ATTR_OFFSET_FOUND)
+					return (0);
 				errno = ENOENT;
-				return -1;
+				return (-1);
 			}
 		}
 	}
-	errno = EIO;
-	ntfs_log_perror("%s: Corrupt inode (%lld)", __FUNCTION__, 
-			ctx->ntfs_ino ? (long long)ctx->ntfs_ino->mft_no : -1);
-	return -1;
+	ret = attr_find_scan(type, name, name_len, ic, val, val_len, ctx);
+	if (usable && (!ret || (errno == ENOENT))) {
+		attr_offsets_enter(ctx->ntfs_ino, type, name, name_len,
+					ctx->attr, !ret);
+		if (ret)
+			errno = ENOENT;
+	}
+	return (ret);
 }
 
 void ntfs_attr_name_free(char **name)
@@ -3019,6 +4664,17 @@ static int ntfs_external_attr_find(ATTR_TYPES type, const ntfschar *name,
 	if (ctx->is_first) {
 		al_entry = ctx->al_entry;
 		ctx->is_first = FALSE;
+		/*
+		 * When searching a named or unnamed attribute from the
+		 * beginning of the list, skip directly to the entry which a
+		 * linear scan would stop at, if the list is indexed.
+		 */
+		if ((type != AT_UNUSED) && is_first_search && name) {
+			next_al_entry = ntfs_attrlist_index_lookup(base_ni,
+					type, name, name_len, ic, lowest_vcn);
+			if (next_al_entry)
+				al_entry = next_al_entry;
+		}
 		/*
 		 * If an enumeration and the first attribute is higher than
 		 * the attribute list itself, need to return the attribute list
@@ -3507,7 +5163,9 @@ ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
 		ntfs_log_perror("NULL arguments");
 		return NULL;
 	}
-	ctx = ntfs_malloc(sizeof(ntfs_attr_search_ctx));
+	ctx = (ntfs_attr_search_ctx*)spare_get(&spare_ctxs);
+	if (!ctx)
+		ctx = ntfs_malloc(sizeof(ntfs_attr_search_ctx));
 	if (ctx)
 		ntfs_attr_init_search_ctx(ctx, ni, mrec);
 	return ctx;
@@ -3522,7 +5180,8 @@ ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
 void ntfs_attr_put_search_ctx(ntfs_attr_search_ctx *ctx)
 {
 	// NOTE: save errno if it could change and function stays void!
-	free(ctx);
+	if (ctx)
+		spare_put(&spare_ctxs, ctx, SPARE_SEARCH_CTXS);
 }
 
 /**
@@ -3531,7 +5190,8 @@ void ntfs_attr_put_search_ctx(ntfs_attr_search_ctx *ctx)
  * @type:	attribute type which to find
  *
  * Search for the attribute definition record corresponding to the attribute
- * @type in the $AttrDef system file.
+ * @type in the $AttrDef system file, which is loaded now if its loading
+ * was deferred when mounting.
  *
  * Return the attribute type definition record if found and NULL if not found
  * or an error occurred. On error the error code is stored in errno. The
@@ -3544,6 +5204,8 @@ ATTR_DEF *ntfs_attr_find_in_attrdef(const ntfs_volume *vol,
 {
 	ATTR_DEF *ad;
 
+	if (vol && NVolAttrDefDeferred(vol))
+		ntfs_volume_load_attrdef((ntfs_volume*)vol);
 	if (!vol || !vol->attrdef || !type) {
 		errno = EINVAL;
 		ntfs_log_perror("%s: type=%d", __FUNCTION__, le32_to_cpu(type));
@@ -3707,6 +5369,8 @@ static int ntfs_attr_can_be_non_resident(const ntfs_volume *vol, const ATTR_TYPE
  */
 int ntfs_attr_can_be_resident(const ntfs_volume *vol, const ATTR_TYPES type)
 {
+	if (vol && NVolAttrDefDeferred(vol))
+		ntfs_volume_load_attrdef((ntfs_volume*)vol);
 	if (!vol || !vol->attrdef || !type) {
 		errno = EINVAL;
 		return -1;
@@ -3770,6 +5434,7 @@ int ntfs_make_room_for_attr(MFT_RECORD *m, u8 *pos, u32 size)
 	memmove(pos + size, pos, biu - (pos - (u8*)m));
 	/* Update mft record. */
 	m->bytes_in_use = cpu_to_le32(biu + size);
+	ntfs_attr_layout_changed();
 	return 0;
 }
 
@@ -4110,6 +5775,7 @@ int ntfs_attr_record_rm(ntfs_attr_search_ctx *ctx)
 	if (type == AT_ATTRIBUTE_LIST) {
 		if (NInoAttrList(base_ni) && base_ni->attr_list)
 			free(base_ni->attr_list);
+		ntfs_attrlist_index_free(base_ni);
 		base_ni->attr_list = NULL;
 		NInoClearAttrList(base_ni);
 		NInoAttrListClearDirty(base_ni);
@@ -4179,6 +5845,57 @@ int ntfs_attr_record_rm(ntfs_attr_search_ctx *ctx)
 	return 0;
 }
 
+#if CACHE_STREAMS_SIZE
+
+/*
+ *		Cache of the names of data streams
+ *
+ *	Listing the extended attributes of a file requires the names
+ *	of its named data streams, which are kept in cache until a
+ *	named data stream is added to the inode or removed from it.
+ *	Entries are identified by the inode number and sequence
+ *	number, and files with no named stream have an empty entry.
+ */
+
+static int streams_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	return (((const struct CACHED_STREAMS*)cached)->mref
+			!= ((const struct CACHED_STREAMS*)wanted)->mref);
+}
+
+#endif /* CACHE_STREAMS_SIZE */
+
+/*
+ *		Stream names hashing
+ */
+
+int ntfs_attr_streams_hash(const struct CACHED_GENERIC *cached)
+{
+	return ((int)(MREF(((const struct CACHED_STREAMS*)cached)->mref)
+			& INT_MAX));
+}
+
+/*
+ *		Forget the names of the streams of an inode
+ *
+ *	To be called when a named data stream is added or removed.
+ */
+
+static void streams_forget(ntfs_inode *ni, ATTR_TYPES type, u32 name_len)
+{
+#if CACHE_STREAMS_SIZE
+	struct CACHED_STREAMS item;
+
+	if ((type == AT_DATA) && name_len && ni->vol->streams_cache) {
+		item.mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		ntfs_invalidate_cache(ni->vol->streams_cache,
+				GENERIC(&item), streams_cache_compare, 0);
+	}
+#endif /* CACHE_STREAMS_SIZE */
+}
+
 /**
  * ntfs_attr_add - add attribute to inode
  * @ni:		opened ntfs inode to which add attribute
@@ -4209,7 +5926,8 @@ int ntfs_attr_add(ntfs_inode *ni, ATTR_TYPES type,
 		ntfschar *name, u8 name_len, const u8 *val, s64 size)
 {
 	u32 attr_rec_size;
-	int err, i, offset;
+	u32 pos;
+	int err, i, offset, res;
 	BOOL is_resident;
 	BOOL can_be_non_resident = FALSE;
 	ntfs_inode *attr_ni;
@@ -4228,6 +5946,7 @@ int ntfs_attr_add(ntfs_inode *ni, ATTR_TYPES type,
 
 	if (ni->nr_extents == -1)
 		ni = ni->base_ni;
+	streams_forget(ni, type, name_len);
 
 	/* Check the attribute type and the size. */
 	if (ntfs_attr_size_bounds_check(ni->vol, type, size)) {
@@ -4291,19 +6010,27 @@ int ntfs_attr_add(ntfs_inode *ni, ATTR_TYPES type,
 		goto add_attr_record;
 	}
 
-	/* Try to add to extent inodes. */
-	if (ntfs_inode_attach_all_extents(ni)) {
+	/*
+	 * Try to add to extent inodes, first the attached ones, then
+	 * attaching the other ones until one has enough space.
+	 */
+	pos = 0;
+	i = 0;
+	do {
+		for (; i < ni->nr_extents; i++) {
+			attr_ni = ni->extent_nis[i];
+			if (le32_to_cpu(attr_ni->mrec->bytes_allocated) -
+					le32_to_cpu(attr_ni->mrec->bytes_in_use)
+					>= attr_rec_size)
+				goto add_attr_record;
+		}
+		res = ntfs_inode_attach_next_extent(ni, &pos);
+	} while (res > 0);
+	if (res < 0) {
 		err = errno;
-		ntfs_log_perror("Failed to attach all extents to inode");
+		ntfs_log_perror("Failed to attach extents to inode");
 		goto err_out;
 	}
-	for (i = 0; i < ni->nr_extents; i++) {
-		attr_ni = ni->extent_nis[i];
-		if (le32_to_cpu(attr_ni->mrec->bytes_allocated) -
-				le32_to_cpu(attr_ni->mrec->bytes_in_use) >=
-				attr_rec_size)
-			goto add_attr_record;
-	}
 
 	/* There is no extent that contain enough space for new attribute. */
 	if (!NInoAttrList(ni)) {
@@ -4447,6 +6174,7 @@ int ntfs_attr_rm(ntfs_attr *na)
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr 0x%x.\n",
 		(long long) na->ni->mft_no, le32_to_cpu(na->type));
+	streams_forget(na->ni, na->type, na->name_len);
 
 	/* Free cluster allocation. */
 	if (NAttrNonResident(na)) {
@@ -4541,6 +6269,7 @@ int ntfs_attr_record_resize(MFT_RECORD *m, ATTR_RECORD *a, u32 new_size)
 		
 		/* Adjust @m to reflect the change in used space. */
 		m->bytes_in_use = cpu_to_le32(new_muse);
+		ntfs_attr_layout_changed();
 		
 		/* Adjust @a to reflect the new size. */
 		if (new_size >= offsetof(ATTR_REC, length) + sizeof(a->length))
@@ -4696,6 +6425,8 @@ int ntfs_attr_record_move_away(ntfs_attr_search_ctx *ctx, int extra)
 {
 	ntfs_inode *base_ni, *ni;
 	MFT_RECORD *m;
+	u32 pos;
+	int res;
 	int i;
 
 	if (!ctx || !ctx->attr || !ctx->ntfs_ino || extra < 0) {
@@ -4721,32 +6452,39 @@ int ntfs_attr_record_move_away(ntfs_attr_search_ctx *ctx, int extra)
 		return -1;
 	}
 
-	if (ntfs_inode_attach_all_extents(ctx->ntfs_ino)) {
-		ntfs_log_perror("Couldn't attach extents, inode=%llu", 
-				(unsigned long long)base_ni->mft_no);
-		return -1;
-	}
-
-	/* Walk through all extents and try to move attribute to them. */
-	for (i = 0; i < base_ni->nr_extents; i++) {
-		ni = base_ni->extent_nis[i];
-		m = ni->mrec;
+	/*
+	 * Walk through the extents and try to move attribute to them,
+	 * attaching the extents one at a time.
+	 */
+	pos = 0;
+	i = 0;
+	do {
+		for (; i < base_ni->nr_extents; i++) {
+			ni = base_ni->extent_nis[i];
+			m = ni->mrec;
 
-		if (ctx->ntfs_ino->mft_no == ni->mft_no)
-			continue;
+			if (ctx->ntfs_ino->mft_no == ni->mft_no)
+				continue;
 
-		if (le32_to_cpu(m->bytes_allocated) -
-				le32_to_cpu(m->bytes_in_use) <
-				le32_to_cpu(ctx->attr->length) + extra)
-			continue;
+			if (le32_to_cpu(m->bytes_allocated) -
+					le32_to_cpu(m->bytes_in_use) <
+					le32_to_cpu(ctx->attr->length) + extra)
+				continue;
 
-		/*
-		 * ntfs_attr_record_move_to can fail if extent with other lowest
-		 * VCN already present in inode we trying move record to. So,
-		 * do not return error.
-		 */
-		if (!ntfs_attr_record_move_to(ctx, ni))
-			return 0;
+			/*
+			 * ntfs_attr_record_move_to can fail if extent with
+			 * other lowest VCN already present in inode we trying
+			 * move record to. So, do not return error.
+			 */
+			if (!ntfs_attr_record_move_to(ctx, ni))
+				return 0;
+		}
+		res = ntfs_inode_attach_next_extent(base_ni, &pos);
+	} while (res > 0);
+	if (res < 0) {
+		ntfs_log_perror("Couldn't attach extents, inode=%llu", 
+				(unsigned long long)base_ni->mft_no);
+		return -1;
 	}
 
 	/*
@@ -4833,6 +6571,7 @@ int ntfs_attr_make_non_resident(ntfs_attr *na,
 	NAttrSetNonResident(na);
 	NAttrSetBeingNonResident(na);
 	na->rl = rl;
+	ntfs_attr_rl_changed(na);
 	na->allocated_size = new_allocated_size;
 	na->data_size = na->initialized_size = le32_to_cpu(a->value_length);
 	/*
@@ -4953,6 +6692,7 @@ cluster_free_err_out:
 	NAttrClearFullyMapped(na);
 	na->allocated_size = na->data_size;
 	na->rl = NULL;
+	ntfs_attr_rl_changed(na);
 	free(rl);
 	errno = err;
 	return -1;
@@ -5434,6 +7174,7 @@ static int ntfs_attr_make_resident(ntfs_attr *na, ntfs_attr_search_ctx *ctx)
 	/* Throw away the now unused runlist. */
 	free(na->rl);
 	na->rl = NULL;
+	ntfs_attr_rl_changed(na);
 
 	/* Update in-memory struct ntfs_attr. */
 	NAttrClearNonResident(na);
@@ -5587,9 +7328,16 @@ static int ntfs_attr_update_mapping_pairs_i(ntfs_attr *na, VCN from_vcn,
 	MFT_RECORD *m;
 	ATTR_RECORD *a;
 	VCN stop_vcn;
+	VCN dirty_end;
+	VCN old_end;
+	VCN gap_last;
 	const runlist_element *stop_rl;
+	runlist_element *xrl;
 	int err, mp_size, cur_max_mp_size, exp_max_mp_size, ret = -1;
+	int extents;
 	BOOL finished_build;
+	BOOL up_to_date;
+	BOOL keep_end;
 	BOOL first_updated = FALSE;
 
 retry:
@@ -5607,6 +7355,8 @@ retry:
 		ntfs_log_perror("%s: resident attribute", __FUNCTION__);
 		return -1;
 	}
+	if (ntfs_attr_rl_expand(na))
+		return -1;
 
 #if PARTIAL_RUNLIST_UPDATING
 		/*
@@ -5623,14 +7373,16 @@ retry:
 
 		if (!(na->data_flags & ATTR_IS_SPARSE)) {
 			int sparse = 0;
-			runlist_element *xrl;
 
 				/*
 				 * If attribute was not sparse, we only
 				 * have to check whether there is a hole
 				 * in the updated region.
 				 */
-			for (xrl = na->rl; xrl->length; xrl++) {
+			xrl = ntfs_attr_rl_search(na, from_vcn);
+			if (!xrl)
+				xrl = na->rl;
+			for (; xrl->length; xrl++) {
 				if (xrl->lcn < 0) {
 					if (xrl->lcn == LCN_HOLE) {
 						sparse = 1;
@@ -5678,14 +7430,40 @@ retry:
 	if (!ctx)
 		return -1;
 
+		/*
+		 * The mapping of vcns beyond the dirty range is unchanged,
+		 * so the extents beyond it do not have to be rebuilt,
+		 * unless the runlist was changed without recording it.
+		 */
+	if (NAttrRunlistDirty(na) && (from_vcn <= na->rl_dirty_start))
+		dirty_end = na->rl_dirty_end;
+	else
+		dirty_end = RUNLIST_DIRTY_END;
+
 	/* Fill attribute records with new mapping pairs. */
 	stop_vcn = 0;
 	stop_rl = na->rl;
 	finished_build = FALSE;
+	up_to_date = FALSE;
+	gap_last = -1;
+	extents = 0;
 	while (!ntfs_attr_lookup(na->type, na->name, na->name_len,
 				CASE_SENSITIVE, from_vcn, NULL, 0, ctx)) {
 		a = ctx->attr;
 		m = ctx->mrec;
+		/*
+		 * When past the dirty range, an extent beginning where the
+		 * previous one now ends is up to date, and so are the next
+		 * ones.
+		 */
+		if (extents++
+		    && !finished_build
+		    && (stop_vcn >= dirty_end)
+		    && (sle64_to_cpu(a->lowest_vcn) == stop_vcn)) {
+			up_to_date = TRUE;
+			break;
+		}
+		old_end = sle64_to_cpu(a->highest_vcn) + 1;
 		if (!a->lowest_vcn)
 			first_updated = TRUE;
 		/*
@@ -5704,7 +7482,12 @@ retry:
 			 * the last run in runlist, if so, then deallocate
 			 * all attrubute extents starting this one.
 			 */
-			first_lcn = ntfs_rl_vcn_to_lcn(na->rl, stop_vcn);
+			xrl = ntfs_attr_rl_search(na, stop_vcn);
+			if (xrl) {
+				stop_rl = xrl;
+				first_lcn = xrl->lcn;
+			} else
+				first_lcn = LCN_ENOENT;
 			if (first_lcn == LCN_EINVAL) {
 				errno = EIO;
 				ntfs_log_perror("Bad runlist");
@@ -5749,9 +7532,22 @@ retry:
 		 */
 		exp_max_mp_size = le32_to_cpu(m->bytes_allocated) -
 				le32_to_cpu(m->bytes_in_use) + cur_max_mp_size;
+		/*
+		 * Beyond the dirty range, try to keep the end of the
+		 * extent, so that the next one is not changed.
+		 */
+		keep_end = (old_end >= dirty_end) && (stop_vcn < old_end);
+		if (keep_end) {
+			mp_size = ntfs_get_size_for_mapping_pairs_range(
+					na->ni->vol, stop_rl, stop_vcn,
+					old_end - 1, exp_max_mp_size);
+			if (mp_size > exp_max_mp_size)
+				keep_end = FALSE;
+		}
 		/* Get the size for the rest of mapping pairs array. */
-		mp_size = ntfs_get_size_for_mapping_pairs(na->ni->vol, stop_rl,
-						stop_vcn, exp_max_mp_size);
+		if (!keep_end)
+			mp_size = ntfs_get_size_for_mapping_pairs(na->ni->vol,
+					stop_rl, stop_vcn, exp_max_mp_size);
 		if (mp_size <= 0) {
 			ntfs_log_perror("%s: get MP size failed", __FUNCTION__);
 			goto put_err_out;
@@ -5818,22 +7614,47 @@ retry:
 		 * Generate the new mapping pairs array directly into the
 		 * correct destination, i.e. the attribute record itself.
 		 */
-		if (!ntfs_mapping_pairs_build(na->ni->vol, (u8*)a + le16_to_cpu(
-				a->mapping_pairs_offset), mp_size, na->rl,
-				stop_vcn, &stop_rl))
-			finished_build = TRUE;
-		if (stop_rl)
-			stop_vcn = stop_rl->vcn;
-		else
-			stop_vcn = 0;
-		if (!finished_build && errno != ENOSPC) {
-			ntfs_log_perror("Failed to build mapping pairs");
-			goto put_err_out;
+		if (keep_end) {
+			/* The end of the extent is kept */
+			if (ntfs_mapping_pairs_build_range(na->ni->vol,
+					(u8*)a + le16_to_cpu(
+					a->mapping_pairs_offset), mp_size,
+					stop_rl, stop_vcn, old_end - 1,
+					&stop_rl, &stop_vcn)) {
+				ntfs_log_perror("Failed to build mapping pairs");
+				goto put_err_out;
+			}
+			if (!stop_rl->length)
+				finished_build = TRUE;
+		} else {
+			if (!ntfs_mapping_pairs_build(na->ni->vol,
+					(u8*)a + le16_to_cpu(
+					a->mapping_pairs_offset), mp_size,
+					stop_rl, stop_vcn, &stop_rl))
+				finished_build = TRUE;
+			if (stop_rl)
+				stop_vcn = stop_rl->vcn;
+			else
+				stop_vcn = 0;
+			if (!finished_build && errno != ENOSPC) {
+				ntfs_log_perror("Failed to build mapping pairs");
+				goto put_err_out;
+			}
 		}
 		a->highest_vcn = cpu_to_sle64(stop_vcn - 1);
+		/*
+		 * If the end of the extent could not be kept, insert new
+		 * extents for the runs up to it, rather than shifting all
+		 * the next extents.
+		 */
+		if (!finished_build && !keep_end
+		    && (old_end >= dirty_end) && (stop_vcn < old_end)) {
+			gap_last = old_end - 1;
+			break;
+		}
 	}
 	/* Check whether error occurred. */
-	if (errno != ENOENT) {
+	if (!up_to_date && (gap_last < 0) && (errno != ENOENT)) {
 		ntfs_log_perror("%s: Attribute lookup failed", __FUNCTION__);
 		goto put_err_out;
 	}
@@ -5869,6 +7690,11 @@ retry:
 		}
 	}
 
+	/* The next extents were already up to date. */
+	if (up_to_date) {
+		ntfs_attr_put_search_ctx(ctx);
+		goto ok;
+	}
 	/* Deallocate not used attribute extents and return with success. */
 	if (finished_build) {
 		ntfs_attr_reinit_search_ctx(ctx);
@@ -5896,11 +7722,14 @@ retry:
 	ntfs_attr_put_search_ctx(ctx);
 	ctx = NULL;
 
-	/* Allocate new MFT records for the rest of mapping pairs. */
+	/*
+	 * Allocate new MFT records for the rest of mapping pairs, or
+	 * for the runs which could not be kept before the next extent.
+	 */
 	while (1) {
 		/* Calculate size of rest mapping pairs. */
-		mp_size = ntfs_get_size_for_mapping_pairs(na->ni->vol,
-						na->rl, stop_vcn, INT_MAX);
+		mp_size = ntfs_get_size_for_mapping_pairs_range(na->ni->vol,
+				stop_rl, stop_vcn, gap_last, INT_MAX);
 		if (mp_size <= 0) {
 			ntfs_log_perror("%s: get mp size failed", __FUNCTION__);
 			goto put_err_out;
@@ -5943,13 +7772,9 @@ retry:
 		}
 		a = (ATTR_RECORD*)((u8*)m + err);
 
-		err = ntfs_mapping_pairs_build(na->ni->vol, (u8*)a +
-			le16_to_cpu(a->mapping_pairs_offset), mp_size, na->rl,
-			stop_vcn, &stop_rl);
-		if (stop_rl)
-			stop_vcn = stop_rl->vcn;
-		else
-			stop_vcn = 0;
+		err = ntfs_mapping_pairs_build_range(na->ni->vol, (u8*)a +
+			le16_to_cpu(a->mapping_pairs_offset), mp_size, stop_rl,
+			stop_vcn, gap_last, &stop_rl, &stop_vcn);
 		if (err < 0 && errno != ENOSPC) {
 			err = errno;
 			ntfs_log_perror("Failed to build MP");
@@ -6090,10 +7915,12 @@ static int ntfs_non_resident_attr_shrink(ntfs_attr *na, const s64 newsize)
 			 */
 			free(na->rl);
 			na->rl = NULL;
+			ntfs_attr_rl_changed(na);
 			ntfs_log_trace("Eeek! Run list truncation failed.\n");
 			return -1;
 		}
-		NAttrSetRunlistDirty(na);
+		ntfs_attr_rl_dirty(na, first_free_vcn, RUNLIST_DIRTY_END);
+		ntfs_attr_rl_changed(na);
 
 		/* Prepare to mapping pairs update. */
 		na->allocated_size = first_free_vcn << vol->cluster_size_bits;
@@ -6168,9 +7995,11 @@ put_err_out:
  * ntfs_non_resident_attr_expand - expand a non-resident, open ntfs attribute
  * @na:		non-resident ntfs attribute to expand
  * @newsize:	new size (in bytes) to which to expand the attribute
+ * @allocsize:	size (in bytes) to allocate, ignored if lower than @newsize
  *
  * Expand the size of a non-resident, open ntfs attribute @na to @newsize bytes,
- * by allocating new clusters.
+ * by allocating new clusters. The allocation may extend beyond @newsize
+ * when clusters are preallocated for appending.
  *
  * On success return 0 and on error return -1 with errno set to the error code.
  * The following error codes are defined:
@@ -6179,7 +8008,7 @@ put_err_out:
  *	ENOSPC - There is no enough space in base mft to resize $ATTRIBUTE_LIST.
  */
 static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
-					hole_type holes)
+					const s64 allocsize, hole_type holes)
 {
 	LCN lcn_seek_from;
 	VCN first_free_vcn;
@@ -6211,8 +8040,8 @@ static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
 	/* Save for future use. */
 	org_alloc_size = na->allocated_size;
 	/* The first cluster outside the new allocation. */
-	first_free_vcn = (newsize + vol->cluster_size - 1) >>
-			vol->cluster_size_bits;
+	first_free_vcn = ((allocsize > newsize ? allocsize : newsize)
+			+ vol->cluster_size - 1) >> vol->cluster_size_bits;
 	/*
 	 * Compare the new allocation with the old one and only allocate
 	 * clusters if there is a change.
@@ -6299,7 +8128,7 @@ static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
 		}
 
 		/* Append new clusters to attribute runlist. */
-		rln = ntfs_runlists_merge(na->rl, rl);
+		rln = ntfs_attr_rl_merge(na, rl);
 		if (!rln) {
 			/* Failed, free just allocated clusters. */
 			err = errno;
@@ -6310,7 +8139,9 @@ static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
 			return -1;
 		}
 		na->rl = rln;
-		NAttrSetRunlistDirty(na);
+		ntfs_attr_rl_dirty(na,
+			na->allocated_size >> vol->cluster_size_bits,
+			RUNLIST_DIRTY_END);
 
 		/* Prepare to mapping pairs update. */
 		na->allocated_size = first_free_vcn << vol->cluster_size_bits;
@@ -6394,9 +8225,12 @@ rollback:
 		 */
 		free(na->rl);
 		na->rl = NULL;
+		ntfs_attr_rl_changed(na);
 		ntfs_log_perror("Couldn't truncate runlist. Rollback failed");
 	} else {
-		NAttrSetRunlistDirty(na);
+		ntfs_attr_rl_dirty(na, org_alloc_size >> vol->cluster_size_bits,
+				RUNLIST_DIRTY_END);
+		ntfs_attr_rl_changed(na);
 		/* Prepare to mapping pairs update. */
 		na->allocated_size = org_alloc_size;
 		/* Restore mapping pairs. */
@@ -6420,7 +8254,7 @@ static int ntfs_non_resident_attr_expand(ntfs_attr *na, const s64 newsize,
 	int ret; 
 	
 	ntfs_log_enter("Entering\n");
-	ret = ntfs_non_resident_attr_expand_i(na, newsize, holes);
+	ret = ntfs_non_resident_attr_expand_i(na, newsize, newsize, holes);
 	ntfs_log_leave("\n");
 	return ret;
 }
@@ -6469,6 +8303,8 @@ static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 		ret = STATUS_OK;
 		goto out;
 	}
+	if (ntfs_attr_rl_expand(na))
+		goto out;
 	/*
 	 * Encrypted attributes are not supported. We return access denied,
 	 * which is what Windows NT4 does, too.
@@ -6487,6 +8323,10 @@ static int ntfs_attr_truncate_i(ntfs_attr *na, const s64 newsize,
 	 */
 	compressed = (na->data_flags & ATTR_COMPRESSION_MASK)
 			 != const_cpu_to_le16(0);
+#if CACHE_CBLOCK_SIZE
+	if (compressed)
+		ntfs_compressed_invalidate(na->ni->vol, na->ni->mft_no);
+#endif
 	if (compressed
 	   && NAttrNonResident(na)
 	   && ((na->data_flags & ATTR_COMPRESSION_MASK) != ATTR_IS_COMPRESSED)) {
@@ -6531,6 +8371,10 @@ int ntfs_attr_truncate(ntfs_attr *na, const s64 newsize)
 {
 	int r;
 
+	if (na->append_count && ntfs_attr_flush_append(na))
+		return (-1);
+	if (na->ni->vol->usn_journal)
+		ntfs_usn_resize(na, newsize);
 	r = ntfs_attr_truncate_i(na, newsize, HOLES_OK);
 	NAttrClearDataAppending(na);
 	NAttrClearBeingNonResident(na);
@@ -6543,9 +8387,288 @@ int ntfs_attr_truncate(ntfs_attr *na, const s64 newsize)
 
 int ntfs_attr_truncate_solid(ntfs_attr *na, const s64 newsize)
 {
+	if (na->append_count && ntfs_attr_flush_append(na))
+		return (-1);
+	if (na->ni->vol->usn_journal)
+		ntfs_usn_resize(na, newsize);
 	return (ntfs_attr_truncate_i(na, newsize, HOLES_NO));
 }
 
+/*
+ *		Release the clusters preallocated beyond the end of data
+ *
+ *	To be called when a file which may have been appended to is closed.
+ *
+ *	Returns 0 if succeeded,
+ *		-1 if it failed (as explained in errno)
+ */
+
+int ntfs_attr_trim_prealloc(ntfs_attr *na)
+{
+	struct PREALLOC_WINDOWS *windows;
+	ntfs_volume *vol;
+	int r;
+	int i;
+
+	r = 0;
+	vol = na->ni->vol;
+	windows = vol->prealloc_windows;
+	i = (windows && (na->name == AT_UNNAMED)
+		? prealloc_window_find(windows, na->ni->mft_no) : -1);
+	if (i >= 0)
+		windows->inum[i] = windows->inum[--windows->count];
+	if ((i >= 0)
+	    && NAttrNonResident(na)
+	    && !(na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_SPARSE))
+	    && (na->allocated_size > ((na->data_size + vol->cluster_size - 1)
+				& ~(s64)(vol->cluster_size - 1)))) {
+		ntfs_log_enter("Entering for inode %lld, attr 0x%x\n",
+			(long long)na->ni->mft_no, le32_to_cpu(na->type));
+		r = ntfs_non_resident_attr_shrink(na, na->data_size);
+		ntfs_log_leave("Return status %d\n", r);
+	}
+	return (r);
+}
+
+/*
+ *		Allocate clusters to a range of an attribute
+ *
+ *	The clusters allocated beyond the initialized size are not
+ *	written to : reading them returns zeroes, and they are only
+ *	zeroed when data is written beyond them, which extends the
+ *	initialized size. The holes of sparse attributes within the data
+ *	are filled by writing zeroes.
+ *	Unless @keep_size is set, the data is extended to the end of the
+ *	range. The clusters preallocated for appending become permanent.
+ *
+ *	Returns 0 if succeeded,
+ *		-1 if it failed (as explained in errno)
+ */
+
+int ntfs_attr_fallocate(ntfs_attr *na, s64 offset, s64 length,
+			BOOL keep_size)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	char *zeroes;
+	s64 end;
+	s64 pos;
+	s64 limit;
+	s64 size;
+	s64 newsize;
+	s64 zsize;
+	int r;
+
+	if (!na || (offset < 0) || (length <= 0)
+	    || ((offset + length) < offset)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	ntfs_log_enter("Entering for inode %lld, attr 0x%x, range %lld+%lld\n",
+			(long long)na->ni->mft_no, le32_to_cpu(na->type),
+			(long long)offset, (long long)length);
+	vol = na->ni->vol;
+	end = offset + length;
+	r = 0;
+		/* only keep what was requested of the preallocation */
+	if (ntfs_attr_trim_prealloc(na))
+		r = -1;
+		/* space beyond resident data requires a non-resident one */
+	if (!r && !NAttrNonResident(na) && (end > na->data_size)) {
+		if (keep_size)
+			r = ntfs_attr_force_non_resident(na);
+		else
+			r = ntfs_attr_truncate_solid(na, end);
+	}
+	if (!r && NAttrNonResident(na)) {
+		if (ntfs_attr_rl_expand(na))
+			r = -1;
+			/* fill the holes within the data */
+		limit = (end < na->data_size ? end : na->data_size);
+		pos = offset;
+		zeroes = (char*)NULL;
+		zsize = (vol->cluster_size > 65536 ? vol->cluster_size : 65536);
+		while (!r && (na->data_flags & ATTR_IS_SPARSE)
+		    && (pos < limit)) {
+			rl = ntfs_attr_find_vcn(na, pos >> vol->cluster_size_bits);
+			if (!rl)
+				r = -1;
+			else {
+				size = ((rl->vcn + rl->length)
+					<< vol->cluster_size_bits) - pos;
+				if (size > (limit - pos))
+					size = limit - pos;
+				if (rl->lcn == LCN_HOLE) {
+					if (size > zsize)
+						size = zsize;
+					if (!zeroes)
+						zeroes = (char*)ntfs_calloc(
+							zsize);
+					if (!zeroes
+					    || (ntfs_attr_pwrite(na, pos, size,
+						zeroes) != size))
+						r = -1;
+				}
+				pos += size;
+			}
+		}
+		free(zeroes);
+			/* allocate beyond the current allocation */
+		newsize = na->data_size;
+		if (!keep_size && (end > newsize))
+			newsize = end;
+		if (!r && (newsize > na->data_size)
+		    && na->ni->vol->usn_journal)
+			ntfs_usn_resize(na, newsize);
+		if (!r
+		    && ((end > na->allocated_size)
+			|| (newsize > na->data_size))) {
+			if (ntfs_non_resident_attr_expand_i(na, newsize,
+						end, HOLES_NO))
+				r = -1;
+			NAttrClearDataAppending(na);
+		}
+	}
+	ntfs_log_leave("Return status %d\n", r);
+	return (r);
+}
+
+/*
+ *		Locate the next data or the next hole in an attribute
+ *
+ *	This is meant for lseek(SEEK_DATA) and lseek(SEEK_HOLE), and it
+ *	only walks through the runlist, without reading the data.
+ *	The end of the data is a hole. As allowed, the compressed and
+ *	encrypted attributes are reported as having no holes, their
+ *	holes within compression blocks do not mean zeroes.
+ *
+ *	Returns the position of the data or hole found,
+ *		-1 if there is none or it failed (as explained in errno,
+ *		ENXIO meaning @pos is beyond the data or there is no
+ *		more data)
+ */
+
+s64 ntfs_attr_seek_data(ntfs_attr *na, s64 pos, BOOL hole)
+{
+	runlist_element *rl;
+	u8 cluster_size_bits;
+	VCN end_vcn;
+	VCN vcn;
+	s64 found;
+
+	if (!na || (pos < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (pos >= na->data_size) {
+		errno = ENXIO;
+		return (-1);
+	}
+	if (!NAttrNonResident(na)
+	    || !NAttrSparse(na)
+	    || (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)))
+		return (hole ? na->data_size : pos);
+	cluster_size_bits = na->ni->vol->cluster_size_bits;
+	vcn = pos >> cluster_size_bits;
+	end_vcn = (na->data_size + na->ni->vol->cluster_size - 1)
+			>> cluster_size_bits;
+	while (vcn < end_vcn) {
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (!rl) {
+			if (errno != ENOENT)
+				return (-1);
+			/* not allocated, assume a final hole */
+			break;
+		}
+		if ((rl->lcn == LCN_HOLE) == hole) {
+			found = rl->vcn << cluster_size_bits;
+			if (found < pos)
+				found = pos;
+			if (found < na->data_size)
+				return (found);
+			break;
+		}
+		vcn = rl->vcn + rl->length;
+	}
+	if (hole)
+		return (na->data_size);
+	errno = ENXIO;
+	return (-1);
+}
+
+/*
+ *		Set the maximum size preallocated beyond the end of
+ *	files being appended to (zero for no preallocation)
+ *
+ *	Not set in ntfs_mount(), the preallocated clusters are only
+ *	released by ntfs_attr_trim_prealloc(), which existing tools
+ *	do not call.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_prealloc_size(ntfs_volume *vol, s64 size)
+{
+	int res;
+
+	res = -1;
+	if (!vol || (size < 0))
+		errno = EINVAL;
+	else {
+		if (size && !vol->prealloc_windows) {
+			vol->prealloc_windows = (struct PREALLOC_WINDOWS*)
+				ntfs_malloc(sizeof(struct PREALLOC_WINDOWS));
+			if (vol->prealloc_windows)
+				vol->prealloc_windows->count = 0;
+		}
+		if (!size) {
+			free(vol->prealloc_windows);
+			vol->prealloc_windows = (struct PREALLOC_WINDOWS*)NULL;
+		}
+		if (vol->prealloc_windows || !size) {
+			vol->prealloc_size = size;
+			res = 0;
+		}
+	}
+	if (res)
+		ntfs_log_error("Failed to set the preallocation size\n");
+	return (res);
+}
+
+/*
+ *		Set the allocation unit for filling the holes of sparse
+ *	files (zero for allocating only the clusters written to)
+ *
+ *	The unit is rounded down to a power of two clusters, and the
+ *	holes are then filled by aligned chunks of this size, within
+ *	the hole, the clusters around the data written being zeroed.
+ *	This keeps the count of runs bounded when sparse files are
+ *	written randomly, at the cost of some space. Compressed files
+ *	are not concerned, they are filled by compression blocks.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_hole_unit(ntfs_volume *vol, s64 size)
+{
+	s64 clusters;
+
+	if (!vol || (size < 0)) {
+		errno = EINVAL;
+		ntfs_log_error("Failed to set the hole allocation unit\n");
+		return (-1);
+	}
+	clusters = size >> vol->cluster_size_bits;
+	while (clusters & (clusters - 1))
+		clusters &= clusters - 1;
+	vol->hole_unit = (clusters > 1 ? clusters : 0);
+	return (0);
+}
+
 /*
  *		Stuff a hole in a compressed file
  *
@@ -6827,6 +8950,91 @@ int ntfs_attr_exist(ntfs_inode *ni, const ATTR_TYPES type, const ntfschar *name,
 	return !ret;
 }
 
+/*
+ *		Get the names of the named data streams of an inode
+ *
+ *	The names are translated to the locale, each one being followed
+ *	by a null char, and they are returned in an allocated buffer
+ *	which the caller has to free. There is no buffer (NULL) when
+ *	there is no named data stream.
+ *
+ *	Returns the total size of names, or -1 if failed (errno set)
+ */
+
+int ntfs_attr_stream_names(ntfs_inode *ni, char **pnames)
+{
+	ntfs_attr_search_ctx *ctx;
+	ATTR_RECORD *a;
+	char *names;
+	char *newnames;
+	char *tmp_name;
+	int tmp_name_len;
+	int size;
+#if CACHE_STREAMS_SIZE
+	struct CACHED_STREAMS item;
+	struct CACHED_STREAMS cached;
+
+	if (ni->vol->streams_cache) {
+		item.mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		if (ntfs_fetch_cache_dup(ni->vol->streams_cache,
+				GENERIC(&item), streams_cache_compare,
+				(struct CACHED_GENERIC*)&cached)) {
+			*pnames = cached.names;
+			return ((int)cached.size);
+		}
+	}
+#endif /* CACHE_STREAMS_SIZE */
+	names = (char*)NULL;
+	size = 0;
+	ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!ctx)
+		return (-1);
+	while ((size >= 0)
+	    && !ntfs_attr_lookup(AT_DATA, NULL, 0, CASE_SENSITIVE,
+				0, NULL, 0, ctx)) {
+		a = ctx->attr;
+			/* list the extents of a stream only once */
+		if (!a->name_length
+		    || (a->non_resident && a->lowest_vcn))
+			continue;
+		tmp_name = (char*)NULL;
+		tmp_name_len = ntfs_ucstombs((ntfschar*)((u8*)a
+					+ le16_to_cpu(a->name_offset)),
+				a->name_length, &tmp_name, 0);
+		if (tmp_name_len >= 0) {
+			newnames = (char*)realloc(names,
+					size + tmp_name_len + 1);
+			if (newnames) {
+				names = newnames;
+				memcpy(&names[size], tmp_name,
+						tmp_name_len + 1);
+				size += tmp_name_len + 1;
+			} else
+				size = -1;
+		} else
+			size = -1;
+		free(tmp_name);
+	}
+	if ((size >= 0) && (errno != ENOENT))
+		size = -1;
+	ntfs_attr_put_search_ctx(ctx);
+	if (size < 0) {
+		free(names);
+		names = (char*)NULL;
+	}
+#if CACHE_STREAMS_SIZE
+	if ((size >= 0) && ni->vol->streams_cache) {
+		item.names = names;
+		item.size = size;
+		ntfs_enter_cache(ni->vol->streams_cache,
+				GENERIC(&item), streams_cache_compare);
+	}
+#endif /* CACHE_STREAMS_SIZE */
+	*pnames = names;
+	return (size);
+}
+
 int ntfs_attr_remove(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name, 
 		     u32 name_len)
 {
@@ -6860,63 +9068,25 @@ int ntfs_attr_remove(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name,
 	return ret;
 }
 
-/* Below macros are 32-bit ready. */
-#define BCX(x) ((x) - (((x) >> 1) & 0x77777777) - \
-		      (((x) >> 2) & 0x33333333) - \
-		      (((x) >> 3) & 0x11111111))
-#define BITCOUNT(x) (((BCX(x) + (BCX(x) >> 4)) & 0x0F0F0F0F) % 255)
-
-static u8 *ntfs_init_lut256(void)
-{
-	int i;
-	u8 *lut;
-	
-	lut = ntfs_malloc(256);
-	if (lut)
-		for(i = 0; i < 256; i++)
-			*(lut + i) = 8 - BITCOUNT(i);
-	return lut;
-}
-
 s64 ntfs_attr_get_free_bits(ntfs_attr *na)
 {
-	u8 *buf, *lut;
+	u8 *buf;
 	s64 br      = 0;
 	s64 total   = 0;
 	s64 nr_free = 0;
 
-	lut = ntfs_init_lut256();
-	if (!lut)
-		return -1;
-	
 	buf = ntfs_malloc(65536);
 	if (!buf)
-		goto out;
+		return -1;
 
 	while (1) {
-		u32 *p;
 		br = ntfs_attr_pread(na, total, 65536, buf);
 		if (br <= 0)
 			break;
 		total += br;
-		p = (u32 *)buf + br / 4 - 1;
-		for (; (u8 *)p >= buf; p--) {
-			nr_free += lut[ *p        & 255] + 
-			           lut[(*p >>  8) & 255] + 
-			           lut[(*p >> 16) & 255] + 
-			           lut[(*p >> 24)      ];
-		}
-		switch (br % 4) {
-			case 3:  nr_free += lut[*(buf + br - 3)];
-			/* FALLTHRU */
-			case 2:  nr_free += lut[*(buf + br - 2)];
-			/* FALLTHRU */
-			case 1:  nr_free += lut[*(buf + br - 1)];
-		}
+		nr_free += ntfs_bit_count_zeroes(buf, br);
 	}
 	free(buf);
-out:
-	free(lut);
 	if (!total || br < 0)
 		return -1;
 	return nr_free;
@@ -44,6 +44,7 @@
 #include "unistr.h"
 #include "logging.h"
 #include "misc.h"
+#include "param.h"
 
 /**
  * ntfs_attrlist_need - check whether inode need attribute list
@@ -219,6 +220,7 @@ int ntfs_attrlist_entry_add(ntfs_inode *ni, ATTR_RECORD *attr)
 
 	/* Set new runlist. */
 	free(ni->attr_list);
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = new_al;
 	ni->attr_list_size = ni->attr_list_size + entry_len;
 	NInoAttrListSetDirty(ni);
@@ -299,6 +301,7 @@ int ntfs_attrlist_entry_rm(ntfs_attr_search_ctx *ctx)
 
 	/* Set new runlist. */
 	free(base_ni->attr_list);
+	ntfs_attrlist_index_free(base_ni);
 	base_ni->attr_list = new_al;
 	base_ni->attr_list_size = new_al_len;
 	NInoAttrListSetDirty(base_ni);
@@ -312,3 +315,201 @@ err_out:
 	errno = err;
 	return -1;
 }
+
+/*
+ *		Indexing of attribute lists
+ *
+ *	The entries of an attribute list are sorted by type, name and
+ *	lowest vcn, so the entries describing the extents of a single
+ *	attribute are contiguous. The offsets of entries are recorded
+ *	for each group of entries having the same type and name, so that
+ *	the entry covering a vcn can be found by a binary search instead
+ *	of comparing the names of all the preceding entries.
+ *
+ *	Only offsets are recorded, and the entries are read from the list
+ *	itself, so that in-place updates of the mft references or of the
+ *	lowest vcns do not invalidate the index. The index has however
+ *	to be freed whenever entries are inserted or removed.
+ */
+
+struct ATTRLIST_INDEX {
+	u32 size;	/* size of the indexed attribute list */
+	int groups;	/* count of groups of entries */
+	int *first;	/* index of first entry in each group, plus a stopper */
+	u32 offset[0];	/* offsets of entries */
+} ;
+
+/*
+ *		Check whether two entries are for the same attribute
+ */
+
+static BOOL attrlist_same_attr(const ATTR_LIST_ENTRY *ale1,
+			const ATTR_LIST_ENTRY *ale2)
+{
+	return ((ale1->type == ale2->type)
+		&& (ale1->name_length == ale2->name_length)
+		&& !memcmp((const u8*)ale1 + ale1->name_offset,
+			(const u8*)ale2 + ale2->name_offset,
+			ale1->name_length*sizeof(ntfschar)));
+}
+
+/*
+ *		Build the index of the attribute list of a base inode
+ *
+ *	Returns the index, or NULL if the list is too short to be worth
+ *	indexing, or is inconsistent, or there is not enough memory.
+ */
+
+static struct ATTRLIST_INDEX *attrlist_index_build(ntfs_inode *ni)
+{
+	struct ATTRLIST_INDEX *index;
+	const ATTR_LIST_ENTRY *ale;
+	const ATTR_LIST_ENTRY *prev;
+	u32 pos;
+	u32 len;
+	int count;
+	int groups;
+	int n;
+	int g;
+
+		/* first pass : count the entries and groups */
+	count = 0;
+	groups = 0;
+	prev = (const ATTR_LIST_ENTRY*)NULL;
+	pos = 0;
+	while (pos < ni->attr_list_size) {
+		ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[pos];
+		if ((pos + offsetof(ATTR_LIST_ENTRY, name))
+					> ni->attr_list_size)
+			return ((struct ATTRLIST_INDEX*)NULL);
+		len = le16_to_cpu(ale->length);
+		if (!len || ((pos + len) > ni->attr_list_size)
+		    || ((ale->name_offset + ale->name_length
+				* sizeof(ntfschar)) > len))
+			return ((struct ATTRLIST_INDEX*)NULL);
+		if (!prev || !attrlist_same_attr(prev, ale))
+			groups++;
+		count++;
+		prev = ale;
+		pos += len;
+	}
+	if (count < ATTRLIST_INDEX_MIN)
+		return ((struct ATTRLIST_INDEX*)NULL);
+	index = (struct ATTRLIST_INDEX*)ntfs_malloc(
+			sizeof(struct ATTRLIST_INDEX)
+			+ count*sizeof(u32) + (groups + 1)*sizeof(int));
+	if (index) {
+			/* second pass : record the offsets */
+		index->size = ni->attr_list_size;
+		index->groups = groups;
+		index->first = (int*)&index->offset[count];
+		prev = (const ATTR_LIST_ENTRY*)NULL;
+		pos = 0;
+		g = 0;
+		for (n=0; n<count; n++) {
+			ale = (const ATTR_LIST_ENTRY*)&ni->attr_list[pos];
+			if (!prev || !attrlist_same_attr(prev, ale))
+				index->first[g++] = n;
+			index->offset[n] = pos;
+			prev = ale;
+			pos += le16_to_cpu(ale->length);
+		}
+		index->first[g] = count;
+	}
+	return (index);
+}
+
+/**
+ * ntfs_attrlist_index_free - discard the index of an attribute list
+ * @ni:		base ntfs inode whose attribute list was changed
+ *
+ * To be called whenever entries are inserted into or removed from the
+ * attribute list, or the list is replaced or freed.
+ */
+void ntfs_attrlist_index_free(ntfs_inode *ni)
+{
+	free(ni->attr_list_index);
+	ni->attr_list_index = (struct ATTRLIST_INDEX*)NULL;
+}
+
+/**
+ * ntfs_attrlist_index_lookup - locate the entry of an attribute extent
+ * @ni:		base ntfs inode with an attribute list
+ * @type:	attribute type
+ * @name:	attribute name, AT_UNNAMED for an unnamed attribute
+ * @name_len:	length of @name in Unicode characters
+ * @ic:		whether to ignore case when comparing names
+ * @lowest_vcn:	vcn of the searched extent
+ *
+ * Find the attribute list entry from which a scan for the extent of the
+ * attribute covering @lowest_vcn has to start, that is the last of the
+ * entries for the attribute with a lowest vcn not greater than
+ * @lowest_vcn, as a linear scan from the start of the list would find.
+ * The index is built on first use.
+ *
+ * Return the entry, or NULL if the scan has to start from the beginning
+ * of the list (short list, attribute not present, or no index).
+ */
+ATTR_LIST_ENTRY *ntfs_attrlist_index_lookup(ntfs_inode *ni, ATTR_TYPES type,
+		const ntfschar *name, u32 name_len, IGNORE_CASE_BOOL ic,
+		VCN lowest_vcn)
+{
+	struct ATTRLIST_INDEX *index;
+	const ATTR_LIST_ENTRY *ale;
+	ntfs_volume *vol;
+	int g;
+	int low;
+	int high;
+	int mid;
+
+	if (!name || !ni->attr_list)
+		return ((ATTR_LIST_ENTRY*)NULL);
+	index = ni->attr_list_index;
+	if (index && (index->size != ni->attr_list_size)) {
+		ntfs_log_error("Stale index of attribute list in inode %lld\n",
+				(long long)ni->mft_no);
+		ntfs_attrlist_index_free(ni);
+		index = (struct ATTRLIST_INDEX*)NULL;
+	}
+	if (!index) {
+		if ((ni->attr_list_size < ATTRLIST_INDEX_MIN
+				* offsetof(ATTR_LIST_ENTRY, name))
+		    || !(index = attrlist_index_build(ni)))
+			return ((ATTR_LIST_ENTRY*)NULL);
+		ni->attr_list_index = index;
+	}
+	vol = ni->vol;
+		/* locate the first group designating the attribute */
+	ale = (const ATTR_LIST_ENTRY*)NULL;
+	for (g=0; (g<index->groups) && !ale; g++) {
+		ale = (const ATTR_LIST_ENTRY*)
+			&ni->attr_list[index->offset[index->first[g]]];
+		if (le32_to_cpu(ale->type) > le32_to_cpu(type))
+			return ((ATTR_LIST_ENTRY*)NULL);
+		if ((ale->type != type)
+		    || ((name == AT_UNNAMED) && ale->name_length)
+		    || ((name != AT_UNNAMED)
+			&& ntfs_names_full_collate(name, name_len,
+				(const ntfschar*)((const u8*)ale
+					+ ale->name_offset),
+				ale->name_length, ic,
+				vol->upcase, vol->upcase_len)))
+			ale = (const ATTR_LIST_ENTRY*)NULL;
+	}
+	if (!ale)
+		return ((ATTR_LIST_ENTRY*)NULL);
+	g--;
+		/* last entry in group with lowest vcn not beyond the target */
+	low = index->first[g];
+	high = index->first[g + 1] - 1;
+	while (low < high) {
+		mid = (low + high + 1) >> 1;
+		ale = (const ATTR_LIST_ENTRY*)
+				&ni->attr_list[index->offset[mid]];
+		if (sle64_to_cpu(ale->lowest_vcn) <= lowest_vcn)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return ((ATTR_LIST_ENTRY*)&ni->attr_list[index->offset[low]]);
+}
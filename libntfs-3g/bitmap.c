@@ -41,6 +41,7 @@
 #include "types.h"
 #include "attrib.h"
 #include "bitmap.h"
+#include "lcnalloc.h"
 #include "debug.h"
 #include "logging.h"
 #include "misc.h"
@@ -100,6 +101,196 @@ char ntfs_bit_get_and_set(u8 *bitmap, const u64 bit, const u8 new_value)
 	return old_bit;
 }
 
+/*
+ *		Scanning fields of bits in memory
+ *
+ *	The fields are processed by 64-bit words where possible. A word
+ *	is loaded as little endian, so that bit n of the word is bit n
+ *	of the field, whatever the endianness of the cpu. The loads go
+ *	through memcpy() as the fields have no specific alignment, and
+ *	no compiler builtin is used, as some of them require a runtime
+ *	support which is not available in UEFI environments.
+ */
+
+static __inline__ u64 ntfs_bit_load64(const u8 *p)
+{
+	u64 word;
+
+	memcpy(&word, p, sizeof(word));
+	return (le64_to_cpu(word));
+}
+
+/*
+ *		Count the bits set in a word
+ */
+
+static __inline__ int ntfs_bit_weight64(u64 word)
+{
+	word -= (word >> 1) & 0x5555555555555555ULL;
+	word = (word & 0x3333333333333333ULL)
+			+ ((word >> 2) & 0x3333333333333333ULL);
+	word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	word += word >> 8;
+	word += word >> 16;
+	word += word >> 32;
+	return ((int)(word & 127));
+}
+
+/*
+ *		Get the position of the lowest bit set in a non-zero word
+ */
+
+static __inline__ int ntfs_bit_lowest64(u64 word)
+{
+	int n;
+
+	n = 0;
+	if (!(word & 0xffffffffULL)) {
+		word >>= 32;
+		n += 32;
+	}
+	if (!(word & 0xffff)) {
+		word >>= 16;
+		n += 16;
+	}
+	if (!(word & 0xff)) {
+		word >>= 8;
+		n += 8;
+	}
+	if (!(word & 0xf)) {
+		word >>= 4;
+		n += 4;
+	}
+	if (!(word & 3)) {
+		word >>= 2;
+		n += 2;
+	}
+	if (!(word & 1))
+		n++;
+	return (n);
+}
+
+/*
+ *		Find the first bit differing from @flip in [@start, @end)
+ *
+ *	Only the bytes containing the bits in the range are accessed.
+ */
+
+static s64 ntfs_bit_find(const u8 *bitmap, s64 start, s64 end, u64 flip)
+{
+	s64 pos;
+	u64 word;
+
+	if (start >= end)
+		return (-1);
+	pos = start & ~7LL;
+	word = (bitmap[pos >> 3] ^ flip) & (0xff << (start & 7)) & 0xff;
+	while (!word) {
+		pos += 8;
+		if (pos >= end)
+			return (-1);
+		if ((pos + 64) <= end) {
+			word = ntfs_bit_load64(&bitmap[pos >> 3]) ^ flip;
+			if (!word)
+				pos += 56;
+		} else
+			word = (bitmap[pos >> 3] ^ flip) & 0xff;
+	}
+	pos += ntfs_bit_lowest64(word);
+	return (pos < end ? pos : -1);
+}
+
+/**
+ * ntfs_bit_find_zero - find the first bit clear in a field of bits
+ * @bitmap:	field of bits
+ * @start:	first bit to examine
+ * @end:	bit after the last one to examine
+ *
+ * Return the position of the first bit clear in [@start, @end),
+ * or -1 if no such bit is found.
+ */
+s64 ntfs_bit_find_zero(const u8 *bitmap, s64 start, s64 end)
+{
+	return (ntfs_bit_find(bitmap, start, end, ~0ULL));
+}
+
+/**
+ * ntfs_bit_find_one - find the first bit set in a field of bits
+ * @bitmap:	field of bits
+ * @start:	first bit to examine
+ * @end:	bit after the last one to examine
+ *
+ * Return the position of the first bit set in [@start, @end),
+ * or -1 if no such bit is found.
+ */
+s64 ntfs_bit_find_one(const u8 *bitmap, s64 start, s64 end)
+{
+	return (ntfs_bit_find(bitmap, start, end, 0ULL));
+}
+
+/**
+ * ntfs_bit_count_zeroes - count the bits clear in a field of bits
+ * @bitmap:	field of bits
+ * @size:	size of the field in bytes
+ *
+ * Return the number of bits clear in the @size bytes of @bitmap.
+ */
+s64 ntfs_bit_count_zeroes(const u8 *bitmap, s64 size)
+{
+	s64 i, ones;
+
+	ones = 0;
+	for (i=0; (i + 8)<=size; i+=8)
+		ones += ntfs_bit_weight64(ntfs_bit_load64(&bitmap[i]));
+	for (; i<size; i++)
+		ones += ntfs_bit_weight64(bitmap[i]);
+	return ((size << 3) - ones);
+}
+
+/**
+ * ntfs_bit_set_range - set a range of bits in a field of bits
+ * @bitmap:	field of bits
+ * @start:	first bit to set
+ * @count:	number of bits to set
+ * @value:	value to set the bits to (0 or 1)
+ *
+ * Set @count bits of @bitmap starting at bit @start to @value.
+ */
+void ntfs_bit_set_range(u8 *bitmap, s64 start, s64 count, int value)
+{
+	s64 end;
+
+	value = (value ? 1 : 0);
+	end = start + count;
+	while ((start & 7) && (start < end))
+		ntfs_bit_set(bitmap, start++, value);
+	if ((end - start) >= 8) {
+		memset(&bitmap[start >> 3], (value ? 0xff : 0),
+				(end - start) >> 3);
+		start += (end - start) & ~7LL;
+	}
+	while (start < end)
+		ntfs_bit_set(bitmap, start++, value);
+}
+
+/*
+ *		Read or write a bitmap, the writing of $Bitmap may be delayed
+ */
+
+static s64 bitmap_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
+{
+	if (na == na->ni->vol->lcnbmp_na)
+		return (ntfs_lcnbmp_pread(na->ni->vol, pos, count, b));
+	return (ntfs_attr_pread(na, pos, count, b));
+}
+
+static s64 bitmap_pwrite(ntfs_attr *na, s64 pos, s64 count, const void *b)
+{
+	if (na == na->ni->vol->lcnbmp_na)
+		return (ntfs_lcnbmp_pwrite(na->ni->vol, pos, count, b));
+	return (ntfs_attr_pwrite(na, pos, count, b));
+}
+
 /**
  * ntfs_bitmap_set_bits_in_run - set a run of bits in a bitmap to a value
  * @na:		attribute containing the bitmap
@@ -147,19 +338,16 @@ static int ntfs_bitmap_set_bits_in_run(ntfs_attr *na, s64 start_bit,
 	/* If there is a first partial byte... */
 	if (bit) {
 		/* read it in... */
-		br = ntfs_attr_pread(na, start_bit >> 3, 1, buf);
+		br = bitmap_pread(na, start_bit >> 3, 1, buf);
 		if (br != 1) {
 			if (br >= 0)
 				errno = EIO;
 			goto free_err_out;
 		}
 		/* and set or clear the appropriate bits in it. */
-		while ((bit & 7) && count--) {
-			if (value)
-				*buf |= 1 << bit++;
-			else
-				*buf &= ~(1 << bit++);
-		}
+		tmp = (count < 8 - bit ? count : 8 - bit);
+		ntfs_bit_set_range(buf, bit, tmp, value);
+		count -= tmp;
 		/* Update @start_bit to the new position. */
 		start_bit = (start_bit + 7) & ~7;
 	}
@@ -184,7 +372,7 @@ static int ntfs_bitmap_set_bits_in_run(ntfs_attr *na, s64 start_bit,
 				lastbyte_buf = buf + lastbyte_pos - 1;
 
 				/* read the byte in... */
-				br = ntfs_attr_pread(na, (start_bit + count) >>
+				br = bitmap_pread(na, (start_bit + count) >>
 						3, 1, lastbyte_buf);
 				if (br != 1) {
 					// FIXME: Eeek! We need rollback! (AIA)
@@ -196,12 +384,8 @@ static int ntfs_bitmap_set_bits_in_run(ntfs_attr *na, s64 start_bit,
 					goto free_err_out;
 				}
 				/* and set/clear the appropriate bits in it. */
-				while (bit && count--) {
-					if (value)
-						*lastbyte_buf |= 1 << --bit;
-					else
-						*lastbyte_buf &= ~(1 << --bit);
-				}
+				ntfs_bit_set_range(lastbyte_buf, 0, bit, value);
+				count -= bit;
 				/* We don't want to come back here... */
 				bit = 0;
 				/* We have a last byte that we have handled. */
@@ -211,7 +395,7 @@ static int ntfs_bitmap_set_bits_in_run(ntfs_attr *na, s64 start_bit,
 
 		/* Write the prepared buffer to disk. */
 		tmp = (start_bit >> 3) - firstbyte;
-		br = ntfs_attr_pwrite(na, tmp, bufsize, buf);
+		br = bitmap_pwrite(na, tmp, bufsize, buf);
 		if (br != bufsize) {
 			// FIXME: Eeek! We need rollback! (AIA)
 			if (br >= 0)
@@ -0,0 +1,1096 @@
+/**
+ * blkcache.c : cache of device blocks
+ *
+ * Copyright (c) 2026 ntfs-3g contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "device.h"
+#include "blkcache.h"
+#include "prefetch.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Cache of device blocks
+ *
+ *	This is mostly useful when there is no kernel cache of the device
+ *	(UEFI driver, device opened for direct I/O), so that the frequently
+ *	used metadata (index blocks, bitmap pages, mft records) are not
+ *	read again on each use.
+ *
+ *	The cache is attached to the device of a volume, and all the
+ *	transfers made through ntfs_pread() and ntfs_pwrite() go through
+ *	it. Writes are only made to the cache (write-back), and the dirty
+ *	blocks are written to the device when evicted, or when the device
+ *	is synced. Clean blocks are evicted in preference to dirty ones.
+ *
+ *	Requests which are too big are not cached, so that streaming
+ *	file data does not flush the cache. They are however kept
+ *	consistent with the cached blocks, and make use of the blocks
+ *	which have been read ahead.
+ *
+ *	As the other caches, the block cache never returns errors related
+ *	to its own management : when there is no memory, or when a dirty
+ *	block cannot be written back, the data is just not cached.
+ *
+ *	The cache is locked against concurrent readers of the volume (see
+ *	ntfs_volume_lock()), with the device transfers of big requests
+ *	and of read-ahead made unlocked, so that they can overlap. The
+ *	data being read may be overwritten meanwhile by a concurrent
+ *	writer, so the blocks read ahead are not inserted when some data
+ *	has been written to the device not through the cached blocks
+ *	during the transfer.
+ */
+
+static void lock_cache(struct BLOCK_CACHE *cache __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&cache->lock);
+#endif
+}
+
+static void unlock_cache(struct BLOCK_CACHE *cache __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&cache->lock);
+#endif
+}
+
+/*
+ *		Read from device, not using the cache
+ */
+
+static s64 raw_pread(struct ntfs_device *dev, s64 pos, s64 count, void *b)
+{
+	s64 br, total;
+
+	for (total = 0; count; count -= br, total += br) {
+		br = dev->d_ops->pread(dev, (char*)b + total, count,
+				pos + total);
+		if (br <= 0)
+			return (total ? total : br);
+	}
+	return (total);
+}
+
+/*
+ *		Write to device, not using the cache
+ */
+
+static s64 raw_pwrite(struct ntfs_device *dev, s64 pos, s64 count,
+			const void *b)
+{
+	s64 written, total;
+
+	for (total = 0; count; count -= written, total += written) {
+		written = dev->d_ops->pwrite(dev, (const char*)b + total,
+				count, pos + total);
+		if (written <= 0)
+			return (total ? total : written);
+	}
+	return (total);
+}
+
+static struct BLOCK_CACHE_SHARD *get_shard(struct BLOCK_CACHE *cache,
+			s64 blknum)
+{
+	return (&cache->shard[blknum % BLOCK_CACHE_SHARDS]);
+}
+
+static int get_hash(s64 blknum)
+{
+	return ((blknum / BLOCK_CACHE_SHARDS) % BLOCK_CACHE_HASH);
+}
+
+/*
+ *		Unlink a block from the LRU list and the hash list
+ */
+
+static void unlink_block(struct BLOCK_CACHE_SHARD *shard,
+			struct BLOCK_CACHED *blk)
+{
+	struct BLOCK_CACHED **pprev;
+
+	if (blk->previous)
+		blk->previous->next = blk->next;
+	else
+		shard->most_recent_entry = blk->next;
+	if (blk->next)
+		blk->next->previous = blk->previous;
+	else
+		shard->oldest_entry = blk->previous;
+	pprev = &shard->first_hash[get_hash(blk->blknum)];
+	while (*pprev && (*pprev != blk))
+		pprev = &(*pprev)->hnext;
+	if (*pprev)
+		*pprev = blk->hnext;
+}
+
+/*
+ *		Link a block as the most recent one
+ */
+
+static void link_block(struct BLOCK_CACHE_SHARD *shard,
+			struct BLOCK_CACHED *blk)
+{
+	int h;
+
+	blk->previous = (struct BLOCK_CACHED*)NULL;
+	blk->next = shard->most_recent_entry;
+	if (shard->most_recent_entry)
+		shard->most_recent_entry->previous = blk;
+	else
+		shard->oldest_entry = blk;
+	shard->most_recent_entry = blk;
+	h = get_hash(blk->blknum);
+	blk->hnext = shard->first_hash[h];
+	shard->first_hash[h] = blk;
+}
+
+/*
+ *		Find a cached block, without changing its LRU position
+ */
+
+static struct BLOCK_CACHED *peek_block(struct BLOCK_CACHE *cache,
+			s64 blknum)
+{
+	struct BLOCK_CACHED *blk;
+
+	blk = get_shard(cache, blknum)->first_hash[get_hash(blknum)];
+	while (blk && (blk->blknum != blknum))
+		blk = blk->hnext;
+	return (blk);
+}
+
+/*
+ *		Write a dirty block back to device
+ *
+ *	Returns zero if successful
+ */
+
+static int write_back(struct ntfs_device *dev, struct BLOCK_CACHE *cache,
+			struct BLOCK_CACHED *blk)
+{
+	struct BLOCK_CACHE_SHARD *shard;
+	s64 written;
+
+	written = raw_pwrite(dev, blk->blknum << cache->blkbits,
+				blk->valid, blk->data);
+	if (written != (s64)blk->valid) {
+		ntfs_log_error("Failed to write back cached block %lld\n",
+				(long long)blk->blknum);
+		return (-1);
+	}
+	blk->dirty = FALSE;
+	shard = get_shard(cache, blk->blknum);
+	shard->dirty_count--;
+	cache->writebacks++;
+	return (0);
+}
+
+/*
+ *		Get a block for inserting new data
+ *
+ *	A new block is allocated if the shard is not full, otherwise
+ *	a clean block near the end of the LRU list is reused, or the
+ *	oldest one if all of them are dirty.
+ *
+ *	Returns the block, unlinked, or NULL if not possible
+ */
+
+static struct BLOCK_CACHED *new_block(struct ntfs_device *dev,
+			struct BLOCK_CACHE *cache, s64 blknum)
+{
+	struct BLOCK_CACHE_SHARD *shard;
+	struct BLOCK_CACHED *blk;
+	int scanned;
+
+	shard = get_shard(cache, blknum);
+	blk = (struct BLOCK_CACHED*)NULL;
+	if (shard->count < shard->max_count) {
+		blk = (struct BLOCK_CACHED*)ntfs_malloc(
+				sizeof(struct BLOCK_CACHED) + cache->blksize);
+		if (blk)
+			shard->count++;
+	}
+	if (!blk && shard->oldest_entry) {
+		blk = shard->oldest_entry;
+		for (scanned=0; blk && blk->dirty
+				&& (scanned < BLOCK_CACHE_SCAN); scanned++)
+			blk = blk->previous;
+		if (!blk || blk->dirty) {
+			blk = shard->oldest_entry;
+			if (write_back(dev, cache, blk))
+				blk = (struct BLOCK_CACHED*)NULL;
+		}
+		if (blk)
+			unlink_block(shard, blk);
+	}
+	if (blk) {
+		blk->blknum = blknum;
+		blk->valid = 0;
+		blk->dirty = FALSE;
+	}
+	return (blk);
+}
+
+/*
+ *		Get a block from the cache, inserting it if needed
+ *
+ *	If @fill is set, a newly inserted block is read from device,
+ *	otherwise the caller is expected to overwrite it fully.
+ *
+ *	Returns the block, or NULL if it could not be cached (errno
+ *	is then set if a read error occurred)
+ */
+
+static struct BLOCK_CACHED *get_block(struct ntfs_device *dev,
+			struct BLOCK_CACHE *cache, s64 blknum, BOOL fill)
+{
+	struct BLOCK_CACHE_SHARD *shard;
+	struct BLOCK_CACHED *blk;
+	s64 br;
+
+	shard = get_shard(cache, blknum);
+	cache->reads++;
+	blk = peek_block(cache, blknum);
+	if (blk) {
+		cache->hits++;
+		if (blk->previous) {
+			unlink_block(shard, blk);
+			link_block(shard, blk);
+		}
+	} else {
+		blk = new_block(dev, cache, blknum);
+		if (blk && fill) {
+			br = raw_pread(dev, blknum << cache->blkbits,
+					cache->blksize, blk->data);
+			if (br < 0) {
+				free(blk);
+				shard->count--;
+				return ((struct BLOCK_CACHED*)NULL);
+			}
+			blk->valid = br;
+		}
+		if (blk)
+			link_block(shard, blk);
+	}
+	return (blk);
+}
+
+/*
+ *		Copy the data written to device into the cached blocks
+ *	which overlap it
+ */
+
+static void update_cached(struct BLOCK_CACHE *cache, s64 pos, s64 count,
+			const void *b)
+{
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	s64 start;
+	s64 from;
+	s64 to;
+
+	cache->bypasses++;
+	for (blknum = pos >> cache->blkbits;
+	    (blknum << cache->blkbits) < pos + count; blknum++) {
+		blk = peek_block(cache, blknum);
+		if (blk) {
+			start = blknum << cache->blkbits;
+			from = max(start, pos);
+			to = min(start + blk->valid, pos + count);
+			if (to > from)
+				memcpy(&blk->data[from - start],
+					(const char*)b + from - pos, to - from);
+		}
+	}
+}
+
+/*
+ *		Copy the dirty cached blocks over the data read from device,
+ *	as they are more recent
+ */
+
+static void overlay_dirty(struct BLOCK_CACHE *cache, s64 pos, s64 count,
+			void *b)
+{
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	s64 start;
+	s64 from;
+	s64 to;
+
+	for (blknum = pos >> cache->blkbits;
+	    (blknum << cache->blkbits) < pos + count; blknum++) {
+		blk = peek_block(cache, blknum);
+		if (blk && blk->dirty) {
+			start = blknum << cache->blkbits;
+			from = max(start, pos);
+			to = min(start + blk->valid, pos + count);
+			if (to > from)
+				memcpy((char*)b + from - pos,
+					&blk->data[from - start], to - from);
+		}
+	}
+}
+
+/*
+ *		Read a big request, not inserting into the cache
+ *
+ *	The blocks which are cached (read ahead or dirty) are copied,
+ *	and the others are read from device, grouping consecutive ones,
+ *	without changing the LRU order. The cache is unlocked while
+ *	reading from device.
+ *
+ *	Returns the count of bytes read, or -1 if there was an error
+ *	and nothing could be read
+ */
+
+static s64 uncached_pread(struct ntfs_device *dev, struct BLOCK_CACHE *cache,
+			s64 pos, s64 count, void *b)
+{
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	s64 total;
+	s64 n;
+	s64 br;
+	u32 ofs;
+
+	total = 0;
+	while (count) {
+		blknum = pos >> cache->blkbits;
+		ofs = pos & (cache->blksize - 1);
+		n = min(count, (s64)(cache->blksize - ofs));
+		blk = peek_block(cache, blknum);
+		if (blk) {
+			cache->reads++;
+			cache->hits++;
+			if (blk->valid <= ofs)
+				break;
+			br = min(n, (s64)(blk->valid - ofs));
+			memcpy(b, &blk->data[ofs], br);
+		} else {
+			while ((n < count)
+			    && !peek_block(cache, (pos + n) >> cache->blkbits))
+				n = min(count, n + cache->blksize);
+			unlock_cache(cache);
+			br = raw_pread(dev, pos, n, b);
+			lock_cache(cache);
+			if (br <= 0)
+				return (total ? total : br);
+		}
+		total += br;
+		if (br < n)
+			break;
+		count -= br;
+		pos += br;
+		b = (char*)b + br;
+	}
+	return (total);
+}
+
+/*
+ *		Get the data at some device position, not copying the
+ *	cached blocks
+ *
+ *	If the block at @pos is cached, *@pdata is set to point to its
+ *	data, which remains valid until the next transfer through the
+ *	cache. Otherwise the data up to the next cached block is read
+ *	into @b, not inserting into the cache, and *@pdata is set to @b.
+ *
+ *	Returns the count of bytes available at *@pdata (at most @count),
+ *	or -1 if there was an error
+ */
+
+s64 ntfs_block_cache_map(struct ntfs_device *dev, s64 pos, s64 count,
+			void *b, void **pdata)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	s64 n;
+	s64 br;
+	u32 ofs;
+
+	cache = dev->d_cache;
+	blknum = pos >> cache->blkbits;
+	ofs = pos & (cache->blksize - 1);
+	n = min(count, (s64)(cache->blksize - ofs));
+	lock_cache(cache);
+	blk = peek_block(cache, blknum);
+	if (blk) {
+		cache->reads++;
+		cache->hits++;
+		*pdata = &blk->data[ofs];
+		br = (blk->valid > ofs ? min(n, (s64)(blk->valid - ofs)) : 0);
+		unlock_cache(cache);
+	} else {
+		while ((n < count)
+		    && !peek_block(cache, (pos + n) >> cache->blkbits))
+			n = min(count, n + cache->blksize);
+		unlock_cache(cache);
+		*pdata = b;
+		br = raw_pread(dev, pos, n, b);
+	}
+		/* not read through ntfs_pread() */
+	if (dev->d_prefetch && (br > 0))
+		ntfs_prefetch_io(dev, pos, br);
+	return (br);
+}
+
+/*
+ *		Read from device through the locked cache
+ */
+
+static s64 block_cache_pread_i(struct ntfs_device *dev, s64 pos,
+			s64 count, void *b)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	s64 total;
+	s64 n;
+	s64 br;
+	u32 ofs;
+
+	cache = dev->d_cache;
+	if (count > BLOCK_CACHE_MAX_REQUEST)
+		return (uncached_pread(dev, cache, pos, count, b));
+	total = 0;
+	while (count) {
+		blknum = pos >> cache->blkbits;
+		ofs = pos & (cache->blksize - 1);
+		n = min(count, (s64)(cache->blksize - ofs));
+		blk = get_block(dev, cache, blknum, TRUE);
+		if (!blk) {
+			br = raw_pread(dev, pos, n, b);
+			if (br <= 0)
+				return (total ? total : br);
+		} else {
+			if (blk->valid <= ofs)
+				break;
+			br = min(n, (s64)(blk->valid - ofs));
+			memcpy(b, &blk->data[ofs], br);
+		}
+		total += br;
+		if (br < n)
+			break;
+		count -= br;
+		pos += br;
+		b = (char*)b + br;
+	}
+	return (total);
+}
+
+/*
+ *		Read from device through the cache
+ *
+ *	Returns the count of bytes read, or -1 if there was an error
+ *	and nothing could be read
+ */
+
+s64 ntfs_block_cache_pread(struct ntfs_device *dev, s64 pos,
+			s64 count, void *b)
+{
+	s64 br;
+
+	lock_cache(dev->d_cache);
+	br = block_cache_pread_i(dev, pos, count, b);
+	unlock_cache(dev->d_cache);
+	return (br);
+}
+
+/*
+ *		Write to device through the locked cache
+ */
+
+static s64 block_cache_pwrite_i(struct ntfs_device *dev, s64 pos,
+			s64 count, const void *b)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHE_SHARD *shard;
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	s64 total;
+	s64 n;
+	s64 bw;
+	u32 ofs;
+
+	cache = dev->d_cache;
+	if (count > BLOCK_CACHE_MAX_REQUEST) {
+		/* Not cached, but update the cached blocks */
+		bw = raw_pwrite(dev, pos, count, b);
+		if (bw > 0)
+			update_cached(cache, pos, bw, b);
+		return (bw);
+	}
+	total = 0;
+	while (count) {
+		blknum = pos >> cache->blkbits;
+		ofs = pos & (cache->blksize - 1);
+		n = min(count, (s64)(cache->blksize - ofs));
+		blk = get_block(dev, cache, blknum,
+				(ofs || (n < cache->blksize)));
+		if (!blk) {
+			cache->bypasses++;
+			bw = raw_pwrite(dev, pos, n, b);
+			if (bw <= 0)
+				return (total ? total : bw);
+		} else {
+			if (ofs > blk->valid)
+				memset(&blk->data[blk->valid], 0,
+					ofs - blk->valid);
+			memcpy(&blk->data[ofs], b, n);
+			if ((ofs + n) > blk->valid)
+				blk->valid = ofs + n;
+			if (!blk->dirty) {
+				blk->dirty = TRUE;
+				shard = get_shard(cache, blknum);
+				shard->dirty_count++;
+			}
+			bw = n;
+		}
+		total += bw;
+		if (bw < n)
+			break;
+		count -= bw;
+		pos += bw;
+		b = (const char*)b + bw;
+	}
+	return (total);
+}
+
+/*
+ *		Write to device through the cache
+ *
+ *	Returns the count of bytes written, or -1 if there was an error
+ *	and nothing could be written
+ */
+
+s64 ntfs_block_cache_pwrite(struct ntfs_device *dev, s64 pos,
+			s64 count, const void *b)
+{
+	s64 bw;
+
+	lock_cache(dev->d_cache);
+	dev->d_cache->changes++;
+	bw = block_cache_pwrite_i(dev, pos, count, b);
+	unlock_cache(dev->d_cache);
+	return (bw);
+}
+
+/*
+ *		Get the number of leading segments of a batch which are
+ *	too big to be cached
+ */
+
+static int uncached_segments(const struct ntfs_io_segment *seg, int nseg)
+{
+	int n;
+
+	for (n=0; (n < nseg) && (seg[n].count > BLOCK_CACHE_MAX_REQUEST); n++)
+		{ }
+	return (n);
+}
+
+/*
+ *		Batched read from device through the cache
+ *
+ *	When the first segments are too big to be cached and the device
+ *	supports batched reads, they are submitted together, and the
+ *	dirty cached blocks are copied over the data read. Otherwise
+ *	only the first segment is read, through the cache.
+ *
+ *	Returns the count of bytes read from the segments taken in order,
+ *	or -1 if there was an error and nothing could be read
+ */
+
+s64 ntfs_block_cache_preadv(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg)
+{
+	struct BLOCK_CACHE *cache;
+	s64 br;
+	s64 n;
+	int i;
+	int nbig;
+
+	cache = dev->d_cache;
+	nbig = uncached_segments(seg, nseg);
+	if ((nbig < 2) || !dev->d_ops->preadv)
+		return (ntfs_block_cache_pread(dev, seg[0].pos,
+				seg[0].count, seg[0].buf));
+	br = dev->d_ops->preadv(dev, seg, nbig);
+	lock_cache(cache);
+	for (i=0, n=br; (i < nbig) && (n > 0); n -= seg[i++].count)
+		overlay_dirty(cache, seg[i].pos, min(n, seg[i].count),
+				seg[i].buf);
+	unlock_cache(cache);
+	return (br);
+}
+
+/*
+ *		Batched write to device through the cache
+ *
+ *	When the first segments are too big to be cached and the device
+ *	supports batched writes, they are submitted together, and the
+ *	cached blocks are updated. Otherwise only the first segment is
+ *	written, through the cache.
+ *
+ *	Returns the count of bytes written from the segments taken in
+ *	order, or -1 if there was an error and nothing could be written
+ */
+
+s64 ntfs_block_cache_pwritev(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg)
+{
+	struct BLOCK_CACHE *cache;
+	s64 bw;
+	s64 n;
+	int i;
+	int nbig;
+
+	cache = dev->d_cache;
+	nbig = uncached_segments(seg, nseg);
+	if ((nbig < 2) || !dev->d_ops->pwritev)
+		return (ntfs_block_cache_pwrite(dev, seg[0].pos,
+				seg[0].count, seg[0].buf));
+	bw = dev->d_ops->pwritev(dev, seg, nbig);
+	lock_cache(cache);
+	cache->changes++;
+	for (i=0, n=bw; (i < nbig) && (n > 0); n -= seg[i++].count)
+		update_cached(cache, seg[i].pos, min(n, seg[i].count),
+				seg[i].buf);
+	unlock_cache(cache);
+	return (bw);
+}
+
+/*
+ *		Read ahead blocks into the cache
+ *
+ *	The blocks which are not cached yet are read, grouping consecutive
+ *	ones into requests of BLOCK_CACHE_MAX_REQUEST bytes at most, and
+ *	inserted as clean blocks.
+ *
+ *	Returns zero if successful, and -1 if there was an error (not a
+ *	fatal one, the blocks are read again when needed)
+ */
+
+int ntfs_block_cache_prefetch(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHED *blk;
+	char *buf;
+	s64 blknum;
+	s64 last;
+	s64 br;
+	s64 n;
+	s64 i;
+	unsigned long bypasses;
+	int res;
+
+	res = 0;
+	cache = dev->d_cache;
+	if (cache && (count > 0)) {
+		buf = (char*)NULL;
+		lock_cache(cache);
+		blknum = pos >> cache->blkbits;
+		last = (pos + count - 1) >> cache->blkbits;
+		while (!res && (blknum <= last)) {
+			if (peek_block(cache, blknum)) {
+				blknum++;
+				continue;
+			}
+			for (n=1; ((n << cache->blkbits)
+					< BLOCK_CACHE_MAX_REQUEST)
+				    && ((blknum + n) <= last)
+				    && !peek_block(cache, blknum + n); n++) { }
+			if (!buf)
+				buf = (char*)ntfs_malloc(
+						BLOCK_CACHE_MAX_REQUEST);
+			bypasses = cache->bypasses;
+			unlock_cache(cache);
+			br = (buf ? raw_pread(dev, blknum << cache->blkbits,
+				n << cache->blkbits, buf) : -1);
+			lock_cache(cache);
+			if (br <= 0)
+				res = -1;
+				/* the data read may be obsolete */
+			if (bypasses != cache->bypasses)
+				br = 0;
+			for (i=0; (br > 0) && ((i << cache->blkbits) < br);
+								i++) {
+				/* may have been inserted meanwhile */
+				if (peek_block(cache, blknum + i))
+					continue;
+				blk = new_block(dev, cache, blknum + i);
+				if (!blk)
+					break;
+				blk->valid = min(br - (i << cache->blkbits),
+						(s64)cache->blksize);
+				memcpy(blk->data, &buf[i << cache->blkbits],
+						blk->valid);
+				link_block(get_shard(cache, blknum + i), blk);
+			}
+			if (br < (n << cache->blkbits))
+				break;
+			blknum += n;
+		}
+		unlock_cache(cache);
+		free(buf);
+	}
+	return (res);
+}
+
+/*
+ *		Zero the cached data of a range about to be zeroed on device
+ *
+ *	The dirty blocks are kept dirty, so that writing them back
+ *	only writes zeroes over the range.
+ */
+
+void ntfs_block_cache_zero(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	s64 start;
+	s64 from;
+	s64 to;
+
+	cache = dev->d_cache;
+	if (cache && (count > 0)) {
+		lock_cache(cache);
+		cache->bypasses++;
+		cache->changes++;
+		for (blknum = pos >> cache->blkbits;
+		    (blknum << cache->blkbits) < pos + count; blknum++) {
+			blk = peek_block(cache, blknum);
+			if (blk) {
+				start = blknum << cache->blkbits;
+				from = max(start, pos);
+				to = min(start + blk->valid, pos + count);
+				if (to > from)
+					memset(&blk->data[from - start], 0,
+						to - from);
+			}
+		}
+		unlock_cache(cache);
+	}
+}
+
+/*
+ *		Check whether some cached block of a range is dirty
+ *
+ *	Data read from the device without the cache may only be used if
+ *	there is no dirty block over it, and if no write was made to the
+ *	cache since it was read, as shown by the count of changes.
+ */
+
+BOOL ntfs_block_cache_dirty(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHED *blk;
+	s64 blknum;
+	BOOL dirty;
+
+	dirty = FALSE;
+	cache = dev->d_cache;
+	if (cache && (count > 0)) {
+		lock_cache(cache);
+		for (blknum = pos >> cache->blkbits;
+		    !dirty && ((blknum << cache->blkbits) < pos + count);
+		    blknum++) {
+			blk = peek_block(cache, blknum);
+			dirty = blk && blk->dirty;
+		}
+		unlock_cache(cache);
+	}
+	return (dirty);
+}
+
+/*
+ *		Write back all the dirty blocks
+ *
+ *	Returns zero if successful, and -1 if some block could not be
+ *	written back (it is kept dirty)
+ */
+
+int ntfs_flush_block_cache(struct ntfs_device *dev)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHE_SHARD *shard;
+	struct BLOCK_CACHED *blk;
+	int res;
+	int i;
+
+	res = 0;
+	cache = dev->d_cache;
+	if (cache) {
+		lock_cache(cache);
+		for (i=0; i<BLOCK_CACHE_SHARDS; i++) {
+			shard = &cache->shard[i];
+			for (blk=shard->oldest_entry;
+			    blk && shard->dirty_count; blk=blk->previous)
+				if (blk->dirty && write_back(dev, cache, blk))
+					res = -1;
+		}
+		unlock_cache(cache);
+		if (res)
+			errno = EIO;
+	}
+	return (res);
+}
+
+/*
+ *		Get the memory used by the cache of a device
+ */
+
+s64 ntfs_block_cache_memory(struct ntfs_device *dev)
+{
+	struct BLOCK_CACHE *cache;
+	s64 blocks;
+	int i;
+
+	blocks = 0;
+	cache = dev->d_cache;
+	if (cache) {
+		lock_cache(cache);
+		for (i=0; i<BLOCK_CACHE_SHARDS; i++)
+			blocks += cache->shard[i].count;
+		unlock_cache(cache);
+		return (sizeof(struct BLOCK_CACHE)
+			+ blocks*(sizeof(struct BLOCK_CACHED)
+				+ cache->blksize));
+	}
+	return (0);
+}
+
+/*
+ *		Release at least @wanted bytes from the cache of a device
+ *
+ *	The oldest blocks of each shard are freed in turn, the dirty
+ *	ones being written back first, and a shard is left alone when
+ *	a block cannot be written back. The shards may grow again later.
+ *
+ *	Returns the count of bytes released
+ */
+
+s64 ntfs_block_cache_shrink(struct ntfs_device *dev, s64 wanted)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHE_SHARD *shard;
+	struct BLOCK_CACHED *blk;
+	BOOL failed[BLOCK_CACHE_SHARDS];
+	BOOL freed;
+	s64 released;
+	int i;
+
+	released = 0;
+	cache = dev->d_cache;
+	if (cache) {
+		for (i=0; i<BLOCK_CACHE_SHARDS; i++)
+			failed[i] = FALSE;
+		lock_cache(cache);
+		do {
+			freed = FALSE;
+			for (i=0; (i<BLOCK_CACHE_SHARDS)
+					&& (released < wanted); i++) {
+				shard = &cache->shard[i];
+				blk = shard->oldest_entry;
+				if (blk && !failed[i] && blk->dirty
+				    && write_back(dev, cache, blk))
+					failed[i] = TRUE;
+				if (blk && !failed[i]) {
+					unlink_block(shard, blk);
+					free(blk);
+					shard->count--;
+					released += sizeof(struct BLOCK_CACHED)
+							+ cache->blksize;
+					freed = TRUE;
+				}
+			}
+		} while (freed && (released < wanted));
+		unlock_cache(cache);
+	}
+	return (released);
+}
+
+/*
+ *		Change the max amount of data cached for the device of a volume
+ *
+ *	When reducing, the oldest blocks of the shards beyond their new
+ *	limit are freed, the dirty ones being written back first.
+ *
+ *	Returns zero if successful, -1 otherwise (some block could not
+ *	be written back, it is released later)
+ */
+
+int ntfs_resize_block_cache(ntfs_volume *vol, s64 size)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHE_SHARD *shard;
+	struct BLOCK_CACHED *blk;
+	s64 count;
+	int res;
+	int i;
+
+	res = 0;
+	cache = vol->dev->d_cache;
+	if (!cache) {
+		errno = EINVAL;
+		return (-1);
+	}
+	count = size/cache->blksize/BLOCK_CACHE_SHARDS;
+	if (count < BLOCK_CACHE_SCAN)
+		count = BLOCK_CACHE_SCAN;
+	lock_cache(cache);
+	cache->capacity = count*BLOCK_CACHE_SHARDS*cache->blksize;
+	for (i=0; i<BLOCK_CACHE_SHARDS; i++) {
+		shard = &cache->shard[i];
+		shard->max_count = count;
+		while (!res && (shard->count > count)
+		    && shard->oldest_entry) {
+			blk = shard->oldest_entry;
+			if (blk->dirty && write_back(vol->dev, cache, blk))
+				res = -1;
+			else {
+				unlink_block(shard, blk);
+				free(blk);
+				shard->count--;
+			}
+		}
+	}
+	unlock_cache(cache);
+	return (res);
+}
+
+/*
+ *		Create a cache for the device of a volume
+ *
+ *	@size is the max amount of cached data. The block size is the
+ *	cluster size, with a limit.
+ *
+ *	Returns zero if successful, -1 otherwise (not a fatal error, the
+ *	device is just not cached)
+ */
+
+int ntfs_create_block_cache(ntfs_volume *vol, s64 size)
+{
+	struct BLOCK_CACHE *cache;
+	struct ntfs_device *dev;
+	s64 count;
+	u32 blksize;
+	int blkbits;
+	int i;
+
+	dev = vol->dev;
+	if (dev->d_cache) {
+		errno = EEXIST;
+		return (-1);
+	}
+	blksize = vol->cluster_size;
+	blkbits = vol->cluster_size_bits;
+	while (blksize > BLOCK_CACHE_MAX_BLOCK) {
+		blksize >>= 1;
+		blkbits--;
+	}
+	count = size/blksize/BLOCK_CACHE_SHARDS;
+	if (count < BLOCK_CACHE_SCAN) {
+		errno = EINVAL;
+		return (-1);
+	}
+	cache = (struct BLOCK_CACHE*)ntfs_malloc(sizeof(struct BLOCK_CACHE));
+	if (!cache)
+		return (-1);
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&cache->lock, (pthread_mutexattr_t*)NULL)) {
+		free(cache);
+		errno = ENOMEM;
+		return (-1);
+	}
+#endif
+	cache->blksize = blksize;
+	cache->blkbits = blkbits;
+	cache->capacity = count*BLOCK_CACHE_SHARDS*blksize;
+	cache->reads = 0;
+	cache->hits = 0;
+	cache->writebacks = 0;
+	cache->bypasses = 0;
+	cache->changes = 0;
+	for (i=0; i<BLOCK_CACHE_SHARDS; i++) {
+		memset(&cache->shard[i], 0, sizeof(struct BLOCK_CACHE_SHARD));
+		cache->shard[i].max_count = count;
+	}
+	dev->d_cache = cache;
+	ntfs_log_debug("Block cache of %lld blocks of %ld bytes\n",
+			(long long)count*BLOCK_CACHE_SHARDS, (long)blksize);
+	return (0);
+}
+
+/*
+ *		Flush and free the cache of the device of a volume
+ *
+ *	Returns zero if successful, -1 if some data could not be written
+ *	back (the cache is freed anyway)
+ */
+
+int ntfs_free_block_cache(ntfs_volume *vol)
+{
+	struct BLOCK_CACHE *cache;
+	struct BLOCK_CACHED *blk;
+	struct BLOCK_CACHED *next;
+	int res;
+	int i;
+
+	res = 0;
+	cache = vol->dev->d_cache;
+	if (cache) {
+		res = ntfs_flush_block_cache(vol->dev);
+		ntfs_log_debug("Block cache : %lu reads, %lu hits,"
+				" %lu writebacks\n", cache->reads,
+				cache->hits, cache->writebacks);
+		for (i=0; i<BLOCK_CACHE_SHARDS; i++)
+			for (blk=cache->shard[i].most_recent_entry; blk;
+						blk=next) {
+				next = blk->next;
+				free(blk);
+			}
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&cache->lock);
+#endif
+		free(cache);
+		vol->dev->d_cache = (struct BLOCK_CACHE*)NULL;
+	}
+	return (res);
+}
@@ -29,12 +29,27 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 
 #include "types.h"
 #include "security.h"
 #include "cache.h"
+#include "blkcache.h"
+#include "inode.h"
+#include "compress.h"
+#include "mft.h"
+#include "index.h"
+#include "reparse.h"
+#include "ea.h"
+#include "attrib.h"
 #include "misc.h"
 #include "logging.h"
+#include "probes.h"
 
 /*
  *		General functions to deal with LRU caches
@@ -54,6 +69,23 @@
  *	searches are used.
  */
 
+/*
+ *		Get the hash index of an entry
+ *
+ *	The hash functions return any non-negative value, which is
+ *	reduced to the size of the hash table, a power of 2 chosen when
+ *	creating the cache.
+ */
+
+static int hashindex(const struct CACHE_HEADER *cache,
+			const struct CACHED_GENERIC *item)
+{
+	int h;
+
+	h = cache->dohash(item);
+	return (h >= 0 ? h & (cache->max_hash - 1) : h);
+}
+
 /*
  *		Enter a new hash index, after a new record has been inserted
  *
@@ -68,7 +100,7 @@ static void inserthashindex(struct CACHE_HEADER *cache,
 	struct HASH_ENTRY *first;
 
 	if (cache->dohash) {
-		h = cache->dohash(current);
+		h = hashindex(cache,current);
 		if ((h >= 0) && (h < cache->max_hash)) {
 			/* get a free link and insert at top of hash list */
 			link = cache->free_hash;
@@ -138,48 +170,125 @@ static void drophashindex(struct CACHE_HEADER *cache,
 }
 
 /*
- *		Fetch an entry from cache
+ *		Locking of concurrent caches
  *
- *	returns the cache entry, or NULL if not available
- *	The returned entry may be modified, but not freed
+ *	A concurrent cache may be searched by several threads at once,
+ *	so a hit must not relink the entry as head of the LRU list.
+ *	Instead a reference bit is set for the entry and the replacement
+ *	is made with the CLOCK algorithm : the referenced entries found
+ *	at the end of the list are given a second chance by moving them
+ *	to the head, and the first unreferenced one is reused.
+ *	Searches only set the reference bits and the statistics (which
+ *	may hence be slightly off), they are done while holding the lock
+ *	shared, updates require it exclusive.
  */
 
-struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
+static void cache_lock(struct CACHE_HEADER *cache, BOOL shared)
+{
+#ifdef HAVE_PTHREAD_H
+	if (cache->concurrent) {
+		if (shared)
+			pthread_rwlock_rdlock(&cache->lock);
+		else
+			pthread_rwlock_wrlock(&cache->lock);
+	}
+#endif
+}
+
+static void cache_unlock(struct CACHE_HEADER *cache)
+{
+#ifdef HAVE_PTHREAD_H
+	if (cache->concurrent)
+		pthread_rwlock_unlock(&cache->lock);
+#endif
+}
+
+/*
+ *		Get the index of an entry in the array of entries
+ */
+
+static int entryindex(const struct CACHE_HEADER *cache,
+			const struct CACHED_GENERIC *current)
+{
+	return (((const char*)current - (const char*)cache->entry)
+			/ (cache->fixed_size + sizeof(struct CACHED_GENERIC)));
+}
+
+/*
+ *		Give a second chance to the referenced entries at the
+ *	end of the LRU list of a concurrent cache, so that the oldest
+ *	entry is an unreferenced one.
+ *
+ *	Every move clears a reference bit, so this terminates.
+ */
+
+static void clocksweep(struct CACHE_HEADER *cache)
+{
+	struct CACHED_GENERIC *current;
+	int i;
+
+	current = cache->oldest_entry;
+	while (current && current->previous
+	    && cache->referenced[i = entryindex(cache, current)]) {
+		cache->referenced[i] = 0;
+		cache->oldest_entry = current->previous;
+		cache->oldest_entry->next = (struct CACHED_GENERIC*)NULL;
+		current->next = cache->most_recent_entry;
+		current->previous = (struct CACHED_GENERIC*)NULL;
+		cache->most_recent_entry->previous = current;
+		cache->most_recent_entry = current;
+		current = cache->oldest_entry;
+	}
+}
+
+/*
+ *		Search an entry and account for the hit
+ *
+ *	The cache must be locked if concurrent (shared is enough)
+ */
+
+static struct CACHED_GENERIC *dofetch(struct CACHE_HEADER *cache,
 		const struct CACHED_GENERIC *wanted, cache_compare compare)
 {
 	struct CACHED_GENERIC *current;
 	struct CACHED_GENERIC *previous;
 	struct HASH_ENTRY *link;
 	int h;
+	int i;
 
 	current = (struct CACHED_GENERIC*)NULL;
-	if (cache) {
-		if (cache->dohash) {
-			/*
-			 * When possible, use the hash table to
-			 * locate the entry if present
-			 */
-			h = cache->dohash(wanted);
-		        link = cache->first_hash[h];
-			while (link && compare(link->entry, wanted))
-				link = link->next;
-			if (link)
-				current = link->entry;
-		}
-		if (!cache->dohash) {
-			/*
-			 * Search sequentially in LRU list if no hash table
-			 * or if hashing has just failed
-			 */
-			current = cache->most_recent_entry;
-			while (current
-				   && compare(current, wanted)) {
-				current = current->next;
-				}
-		}
-		if (current) {
-			previous = current->previous;
-			cache->hits++;
+	if (cache->dohash) {
+		/*
+		 * When possible, use the hash table to
+		 * locate the entry if present
+		 */
+		h = hashindex(cache,wanted);
+	        link = cache->first_hash[h];
+		while (link && compare(link->entry, wanted))
+			link = link->next;
+		if (link)
+			current = link->entry;
+	}
+	if (!cache->dohash) {
+		/*
+		 * Search sequentially in LRU list if no hash table
+		 * or if hashing has just failed
+		 */
+		current = cache->most_recent_entry;
+		while (current
+			   && compare(current, wanted)) {
+			current = current->next;
+			}
+	}
+	if (current) {
+		previous = current->previous;
+		cache->hits++;
+		if (cache->concurrent) {
+			/* just mark as referenced, see clocksweep() */
+			i = entryindex(cache, current);
+			if (!cache->referenced[i])
+				cache->referenced[i] = 1;
+		} else
 			if (previous) {
 			/*
 			 * found and not at head of list, unlink from current
@@ -198,12 +307,111 @@ struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
 				cache->most_recent_entry->previous = current;
 				cache->most_recent_entry = current;
 			}
-		}
-		cache->reads++;
 	}
+	cache->reads++;
+	if (current)
+		NTFS_PROBE1(cache_hit, cache->name);
+	else
+		NTFS_PROBE1(cache_miss, cache->name);
 	return (current);
 }
 
+/*
+ *		Fetch an entry from cache
+ *
+ *	returns the cache entry, or NULL if not available
+ *	The returned entry may be modified, but not freed
+ *
+ *	On a concurrent cache, the returned entry may be reused by
+ *	another thread, ntfs_fetch_cache_copy() should be preferred.
+ */
+
+struct CACHED_GENERIC *ntfs_fetch_cache(struct CACHE_HEADER *cache,
+		const struct CACHED_GENERIC *wanted, cache_compare compare)
+{
+	struct CACHED_GENERIC *current;
+
+	current = (struct CACHED_GENERIC*)NULL;
+	if (cache) {
+		cache_lock(cache, FALSE);
+		current = dofetch(cache, wanted, compare);
+		cache_unlock(cache);
+	}
+	return (current);
+}
+
+/*
+ *		Fetch a copy of an entry from cache
+ *
+ *	The fixed part of the entry is copied to the fields following
+ *	the generic ones in "copy", the variable part is not copied.
+ *	Several threads may fetch from a concurrent cache at once.
+ *
+ *	returns TRUE if the entry was found
+ */
+
+BOOL ntfs_fetch_cache_copy(struct CACHE_HEADER *cache,
+		const struct CACHED_GENERIC *wanted, cache_compare compare,
+		struct CACHED_GENERIC *copy)
+{
+	struct CACHED_GENERIC *current;
+
+	current = (struct CACHED_GENERIC*)NULL;
+	if (cache) {
+		cache_lock(cache, TRUE);
+		current = dofetch(cache, wanted, compare);
+		if (current)
+			memcpy(&((struct CACHED_INODE*)copy)->inum,
+				   &((struct CACHED_INODE*)current)->inum,
+				   cache->fixed_size);
+		cache_unlock(cache);
+	}
+	return (current != (struct CACHED_GENERIC*)NULL);
+}
+
+/*
+ *		Fetch a copy of an entry from cache, with its variable part
+ *
+ *	This is ntfs_fetch_cache_copy() also duplicating the variable part
+ *	into an allocated buffer, to be freed by the caller, so that the
+ *	entry may be reused by another thread meanwhile.
+ *
+ *	returns TRUE if the entry was found and could be duplicated
+ */
+
+BOOL ntfs_fetch_cache_dup(struct CACHE_HEADER *cache,
+		const struct CACHED_GENERIC *wanted, cache_compare compare,
+		struct CACHED_GENERIC *copy)
+{
+	struct CACHED_GENERIC *current;
+	BOOL found;
+
+	found = FALSE;
+	if (cache) {
+		cache_lock(cache, TRUE);
+		current = dofetch(cache, wanted, compare);
+		if (current) {
+			copy->variable = (void*)NULL;
+			copy->varsize = current->varsize;
+			if (current->varsize) {
+				copy->variable = ntfs_malloc(current->varsize);
+				if (copy->variable)
+					memcpy(copy->variable,
+						current->variable,
+						current->varsize);
+			}
+			if (copy->variable || !current->varsize) {
+				memcpy(&((struct CACHED_INODE*)copy)->inum,
+					&((struct CACHED_INODE*)current)->inum,
+					cache->fixed_size);
+				found = TRUE;
+			}
+		}
+		cache_unlock(cache);
+	}
+	return (found);
+}
+
 /*
  *		Enter an inode number into cache
  *	returns the cache entry or NULL if not possible
@@ -220,12 +428,13 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 
 	current = (struct CACHED_GENERIC*)NULL;
 	if (cache) {
+		cache_lock(cache, FALSE);
 		if (cache->dohash) {
 			/*
 			 * When possible, use the hash table to
 			 * find out whether the entry if present
 			 */
-			h = cache->dohash(item);
+			h = hashindex(cache,item);
 		        link = cache->first_hash[h];
 			while (link && compare(link->entry, item))
 				link = link->next;
@@ -265,16 +474,21 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 				} else
 					current->variable = (void*)NULL;
 				current->varsize = item->varsize;
+				cache->held_bytes += item->varsize
+							+ cache->held_size;
 				if (!cache->oldest_entry)
 					cache->oldest_entry = current;
 			} else {
 				/* reusing the oldest entry */
+				if (cache->concurrent)
+					clocksweep(cache);
 				current = cache->oldest_entry;
+				cache->evictions++;
 				before = current->previous;
 				before->next = (struct CACHED_GENERIC*)NULL;
 				if (cache->dohash)
 					drophashindex(cache,current,
-						cache->dohash(current));
+						hashindex(cache,current));
 				if (cache->dofree)
 					cache->dofree(current);
 				cache->oldest_entry = current->previous;
@@ -291,6 +505,8 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 						free(current->variable);
 					current->variable = (void*)NULL;
 				}
+				cache->held_bytes += (s64)item->varsize
+							- (s64)current->varsize;
 				current->varsize = item->varsize;
 			}
 			current->next = cache->most_recent_entry;
@@ -314,16 +530,22 @@ struct CACHED_GENERIC *ntfs_enter_cache(struct CACHE_HEADER *cache,
 					cache->most_recent_entry = current->next;
 					current->next = cache->free_entry;
 					cache->free_entry = current;
+					cache->held_bytes -= item->varsize
+							+ cache->held_size;
 					current = (struct CACHED_GENERIC*)NULL;
 				}
 			} else {
 				current->variable = (void*)NULL;
 				current->varsize = 0;
 			}
+			if (current && cache->concurrent)
+				cache->referenced[entryindex(cache, current)]
+						= 0;
 			if (cache->dohash && current)
 				inserthashindex(cache,current);
 		}
 		cache->writes++;
+		cache_unlock(cache);
 	}
 	return (current);
 }
@@ -357,6 +579,7 @@ static void do_invalidate(struct CACHE_HEADER *cache,
 	cache->free_entry = current;
 	if (current->variable)
 		free(current->variable);
+	cache->held_bytes -= current->varsize + cache->held_size;
 	current->varsize = 0;
    }
 
@@ -386,12 +609,13 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 	current = (struct CACHED_GENERIC*)NULL;
 	count = 0;
 	if (cache) {
+		cache_lock(cache, FALSE);
 		if (!(flags & CACHE_NOHASH) && cache->dohash) {
 			/*
 			 * When possible, use the hash table to
 			 * find out whether the entry if present
 			 */
-			h = cache->dohash(item);
+			h = hashindex(cache,item);
 		        link = cache->first_hash[h];
 			while (link) {
 				if (compare(link->entry, item))
@@ -418,7 +642,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 					next = current->next;
 					if (cache->dohash)
 						drophashindex(cache,current,
-						    cache->dohash(current));
+						    hashindex(cache,current));
 					do_invalidate(cache,current,flags);
 					current = next;
 					count++;
@@ -427,6 +651,7 @@ int ntfs_invalidate_cache(struct CACHE_HEADER *cache,
 				}
 			}
 		}
+		cache_unlock(cache);
 	}
 	return (count);
 }
@@ -438,10 +663,12 @@ int ntfs_remove_cache(struct CACHE_HEADER *cache,
 
 	count = 0;
 	if (cache) {
+		cache_lock(cache, FALSE);
 		if (cache->dohash)
-			drophashindex(cache,item,cache->dohash(item));
+			drophashindex(cache,item,hashindex(cache,item));
 		do_invalidate(cache,item,flags);
 		count++;
+		cache_unlock(cache);
 	}
 	return (count);
 }
@@ -455,12 +682,19 @@ static void ntfs_free_cache(struct CACHE_HEADER *cache)
 	struct CACHED_GENERIC *entry;
 
 	if (cache) {
+		ntfs_log_debug("Cache %s : %lu reads, %lu hits, %lu writes,"
+				" %lu evictions\n", cache->name, cache->reads,
+				cache->hits, cache->writes, cache->evictions);
 		for (entry=cache->most_recent_entry; entry; entry=entry->next) {
 			if (cache->dofree)
 				cache->dofree(entry);
 			if (entry->variable)
 				free(entry->variable);
 		}
+#ifdef HAVE_PTHREAD_H
+		if (cache->concurrent)
+			pthread_rwlock_destroy(&cache->lock);
+#endif
 		free(cache);
 	}
 }
@@ -468,13 +702,16 @@ static void ntfs_free_cache(struct CACHE_HEADER *cache)
 /*
  *		Create a cache
  *
+ *	A concurrent cache may be fetched from by several threads at once
+ *	(see cache_lock())
+ *
  *	Returns the cache header, or NULL if the cache could not be created
  */
 
 static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 			cache_free dofree, cache_hash dohash,
 			int full_item_size,
-			int item_count, int max_hash)
+			int item_count, int max_hash, BOOL concurrent)
 {
 	struct CACHE_HEADER *cache;
 	struct CACHED_GENERIC *pc;
@@ -482,14 +719,33 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 	struct HASH_ENTRY *ph;
 	struct HASH_ENTRY *qh;
 	struct HASH_ENTRY **px;
+	u8 *pr;
 	size_t size;
+	int hash_size;
 	int i;
 
-	size = sizeof(struct CACHE_HEADER) + item_count*full_item_size;
+		/* the hash table size must be a power of 2 */
+	for (hash_size=1; hash_size<max_hash; hash_size<<=1) { }
+	if (max_hash)
+		max_hash = hash_size;
+	size = sizeof(struct CACHE_HEADER)
+			+ (size_t)item_count*full_item_size;
 	if (max_hash)
-		size += item_count*sizeof(struct HASH_ENTRY)
-			 + max_hash*sizeof(struct HASH_ENTRY*);
+		size += (size_t)item_count*sizeof(struct HASH_ENTRY)
+			 + (size_t)max_hash*sizeof(struct HASH_ENTRY*);
+	if (concurrent)
+		size += (size_t)item_count;
 	cache = (struct CACHE_HEADER*)ntfs_malloc(size);
+#ifdef HAVE_PTHREAD_H
+	if (cache && concurrent
+	    && pthread_rwlock_init(&cache->lock,
+				(pthread_rwlockattr_t*)NULL)) {
+		ntfs_log_error("Could not create the lock of cache %s\n",
+				name);
+		free(cache);
+		cache = (struct CACHE_HEADER*)NULL;
+	}
+#endif
 	if (cache) {
 				/* header */
 		cache->name = name;
@@ -505,6 +761,12 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 		cache->reads = 0;
 		cache->writes = 0;
 		cache->hits = 0;
+		cache->evictions = 0;
+		cache->fixed_bytes = size;
+		cache->held_bytes = 0;
+		cache->held_size = 0;
+		cache->refill_cost = 2;
+		cache->concurrent = concurrent;
 		/* chain the data entries, and mark an invalid entry */
 		cache->most_recent_entry = (struct CACHED_GENERIC*)NULL;
 		cache->oldest_entry = (struct CACHED_GENERIC*)NULL;
@@ -541,14 +803,252 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 			cache->first_hash = px;
 			for (i=0; i<max_hash; i++)
 				px[i] = (struct HASH_ENTRY*)NULL;
+			pr = (u8*)&px[max_hash];
 		} else {
 			cache->free_hash = (struct HASH_ENTRY*)NULL;
 			cache->first_hash = (struct HASH_ENTRY**)NULL;
+			pr = ((u8*)pc) + full_item_size;
 		}
+			/* the reference bits follow */
+		if (concurrent) {
+			cache->referenced = pr;
+			memset(cache->referenced, 0, item_count);
+		} else
+			cache->referenced = (u8*)NULL;
+	}
+	return (cache);
+}
+
+/*
+ *		Create one of the LRU caches which may be resized
+ *
+ *	Returns the cache, or NULL if it could not be created
+ */
+
+static struct CACHE_HEADER *create_lru_cache(ntfs_volume *vol,
+			int which, int count)
+{
+	struct CACHE_HEADER *cache;
+
+	cache = (struct CACHE_HEADER*)NULL;
+	switch (which) {
+#if CACHE_INODE_SIZE
+	case NTFS_CACHE_INODE :
+		 /* inode cache */
+		cache = ntfs_create_cache("inode",(cache_free)NULL,
+			ntfs_dir_inode_hash, sizeof(struct CACHED_INODE),
+			count, 2*count, TRUE);
+		break;
+#endif
+#if CACHE_NIDATA_SIZE
+	case NTFS_CACHE_NIDATA :
+		 /* idata cache */
+		cache = ntfs_create_cache("nidata",
+			ntfs_inode_nidata_free, ntfs_inode_nidata_hash,
+			sizeof(struct CACHED_NIDATA),
+			count, 2*count, FALSE);
+		break;
+#endif
+#if CACHE_LOOKUP_SIZE
+	case NTFS_CACHE_LOOKUP :
+		 /* lookup cache */
+		cache = ntfs_create_cache("lookup",
+			(cache_free)NULL, ntfs_dir_lookup_hash,
+			sizeof(struct CACHED_LOOKUP),
+			count, 2*count, TRUE);
+		break;
+#endif
+	case NTFS_CACHE_SECURID :
+		cache = ntfs_create_cache("securid",(cache_free)NULL,
+			ntfs_securid_hash, sizeof(struct CACHED_SECURID),
+			count, 2*count, FALSE);
+		break;
+#if CACHE_LEGACY_SIZE
+	case NTFS_CACHE_LEGACY :
+		cache = ntfs_create_cache("legacy",(cache_free)NULL,
+			ntfs_legacy_hash,
+			sizeof(struct CACHED_PERMISSIONS_LEGACY),
+			count, 2*count, FALSE);
+		break;
+#endif
+#if CACHE_LISTING_SIZE
+	case NTFS_CACHE_LISTING :
+		cache = ntfs_create_cache("listing",(cache_free)NULL,
+			ntfs_dir_listing_hash, sizeof(struct CACHED_LISTING),
+			count, 2*count, FALSE);
+		break;
+#endif
+#if CACHE_SYMLINK_SIZE
+	case NTFS_CACHE_SYMLINK :
+		cache = ntfs_create_cache("symlink",(cache_free)NULL,
+			ntfs_reparse_symlink_hash,
+			sizeof(struct CACHED_SYMLINK),
+			count, 2*count, TRUE);
+		break;
+#endif
+#if CACHE_EA_SIZE
+	case NTFS_CACHE_EA :
+		cache = ntfs_create_cache("ea",(cache_free)NULL,
+			ntfs_ea_hash, sizeof(struct CACHED_EA),
+			count, 2*count, TRUE);
+		break;
+#endif
+#if CACHE_STREAMS_SIZE
+	case NTFS_CACHE_STREAMS :
+		cache = ntfs_create_cache("streams",(cache_free)NULL,
+			ntfs_attr_streams_hash, sizeof(struct CACHED_STREAMS),
+			count, 2*count, TRUE);
+		break;
+#endif
+#if CACHE_STAT_SIZE
+	case NTFS_CACHE_STAT :
+		cache = ntfs_create_cache("stat",(cache_free)NULL,
+			ntfs_inode_stat_hash, sizeof(struct CACHED_STAT),
+			count, 2*count, TRUE);
+		break;
+#endif
+#if CACHE_SECURDESC_SIZE
+	case NTFS_CACHE_SECURDESC :
+		cache = ntfs_create_cache("securdesc",(cache_free)NULL,
+			ntfs_securdesc_hash, sizeof(struct CACHED_SECURDESC),
+			count, 2*count, FALSE);
+		break;
+#endif
+#if CACHE_INHERIT_SIZE
+	case NTFS_CACHE_INHERIT :
+		cache = ntfs_create_cache("inherit",(cache_free)NULL,
+			ntfs_inherit_hash, sizeof(struct CACHED_INHERIT),
+			count, 2*count, FALSE);
+		break;
+#endif
+#if CACHE_SDH_SIZE
+	case NTFS_CACHE_SDH :
+		cache = ntfs_create_cache("sdh",(cache_free)NULL,
+			ntfs_sdh_hash, sizeof(struct CACHED_SDH),
+			count, 2*count, FALSE);
+		break;
+#endif
+#if CACHE_TRAVERSE_SIZE
+	case NTFS_CACHE_TRAVERSE :
+		cache = ntfs_create_cache("traverse",(cache_free)NULL,
+			ntfs_traverse_hash, sizeof(struct CACHED_TRAVERSE),
+			count, 2*count, FALSE);
+		break;
+#endif
+#if CACHE_GROUPS_SIZE
+	case NTFS_CACHE_GROUPS :
+		cache = ntfs_create_cache("groups",(cache_free)NULL,
+			ntfs_groups_hash, sizeof(struct CACHED_GROUPS),
+			count, 2*count, FALSE);
+		break;
+#endif
+	default :
+		break;
+	}
+	if (cache) {
+			/* getting paths and listings again is costly */
+		if ((which == NTFS_CACHE_INODE)
+		    || (which == NTFS_CACHE_LISTING))
+			cache->refill_cost = 4;
+			/* the entries of nidata hold an open inode */
+		if (which == NTFS_CACHE_NIDATA)
+			cache->held_size = sizeof(ntfs_inode)
+						+ vol->mft_record_size;
 	}
 	return (cache);
 }
 
+/*
+ *		Get the location of one of the LRU caches of a volume
+ *
+ *	Returns NULL if this cache is not available
+ */
+
+static struct CACHE_HEADER **lru_cache_slot(ntfs_volume *vol, int which)
+{
+	struct CACHE_HEADER **slot;
+
+	switch (which) {
+#if CACHE_INODE_SIZE
+	case NTFS_CACHE_INODE :
+		slot = &vol->xinode_cache;
+		break;
+#endif
+#if CACHE_NIDATA_SIZE
+	case NTFS_CACHE_NIDATA :
+		slot = &vol->nidata_cache;
+		break;
+#endif
+#if CACHE_LOOKUP_SIZE
+	case NTFS_CACHE_LOOKUP :
+		slot = &vol->lookup_cache;
+		break;
+#endif
+	case NTFS_CACHE_SECURID :
+		slot = &vol->securid_cache;
+		break;
+#if CACHE_LEGACY_SIZE
+	case NTFS_CACHE_LEGACY :
+		slot = &vol->legacy_cache;
+		break;
+#endif
+#if CACHE_LISTING_SIZE
+	case NTFS_CACHE_LISTING :
+		slot = &vol->listing_cache;
+		break;
+#endif
+#if CACHE_SYMLINK_SIZE
+	case NTFS_CACHE_SYMLINK :
+		slot = &vol->symlink_cache;
+		break;
+#endif
+#if CACHE_EA_SIZE
+	case NTFS_CACHE_EA :
+		slot = &vol->ea_cache;
+		break;
+#endif
+#if CACHE_STREAMS_SIZE
+	case NTFS_CACHE_STREAMS :
+		slot = &vol->streams_cache;
+		break;
+#endif
+#if CACHE_STAT_SIZE
+	case NTFS_CACHE_STAT :
+		slot = &vol->stat_cache;
+		break;
+#endif
+#if CACHE_SECURDESC_SIZE
+	case NTFS_CACHE_SECURDESC :
+		slot = &vol->securdesc_cache;
+		break;
+#endif
+#if CACHE_INHERIT_SIZE
+	case NTFS_CACHE_INHERIT :
+		slot = &vol->inherit_cache;
+		break;
+#endif
+#if CACHE_SDH_SIZE
+	case NTFS_CACHE_SDH :
+		slot = &vol->sdh_cache;
+		break;
+#endif
+#if CACHE_TRAVERSE_SIZE
+	case NTFS_CACHE_TRAVERSE :
+		slot = &vol->traverse_cache;
+		break;
+#endif
+#if CACHE_GROUPS_SIZE
+	case NTFS_CACHE_GROUPS :
+		slot = &vol->groups_cache;
+		break;
+#endif
+	default :
+		slot = (struct CACHE_HEADER**)NULL;
+		break;
+	}
+	return (slot);
+}
+
 /*
  *		Create all LRU caches
  *
@@ -559,31 +1059,109 @@ static struct CACHE_HEADER *ntfs_create_cache(const char *name,
 void ntfs_create_lru_caches(ntfs_volume *vol)
 {
 #if CACHE_INODE_SIZE
-		 /* inode cache */
-	vol->xinode_cache = ntfs_create_cache("inode",(cache_free)NULL,
-		ntfs_dir_inode_hash, sizeof(struct CACHED_INODE),
-		CACHE_INODE_SIZE, 2*CACHE_INODE_SIZE);
+	vol->xinode_cache = create_lru_cache(vol, NTFS_CACHE_INODE,
+				CACHE_INODE_SIZE);
 #endif
 #if CACHE_NIDATA_SIZE
-		 /* idata cache */
-	vol->nidata_cache = ntfs_create_cache("nidata",
-		ntfs_inode_nidata_free, ntfs_inode_nidata_hash,
-		sizeof(struct CACHED_NIDATA),
-		CACHE_NIDATA_SIZE, 2*CACHE_NIDATA_SIZE);
+	vol->nidata_cache = create_lru_cache(vol, NTFS_CACHE_NIDATA,
+				CACHE_NIDATA_SIZE);
 #endif
 #if CACHE_LOOKUP_SIZE
-		 /* lookup cache */
-	vol->lookup_cache = ntfs_create_cache("lookup",
-		(cache_free)NULL, ntfs_dir_lookup_hash,
-		sizeof(struct CACHED_LOOKUP),
-		CACHE_LOOKUP_SIZE, 2*CACHE_LOOKUP_SIZE);
+	vol->lookup_cache = create_lru_cache(vol, NTFS_CACHE_LOOKUP,
+				CACHE_LOOKUP_SIZE);
 #endif
-	vol->securid_cache = ntfs_create_cache("securid",(cache_free)NULL,
-		(cache_hash)NULL,sizeof(struct CACHED_SECURID), CACHE_SECURID_SIZE, 0);
+	vol->securid_cache = create_lru_cache(vol, NTFS_CACHE_SECURID,
+				CACHE_SECURID_SIZE);
 #if CACHE_LEGACY_SIZE
-	vol->legacy_cache = ntfs_create_cache("legacy",(cache_free)NULL,
-		(cache_hash)NULL, sizeof(struct CACHED_PERMISSIONS_LEGACY), CACHE_LEGACY_SIZE, 0);
+	vol->legacy_cache = create_lru_cache(vol, NTFS_CACHE_LEGACY,
+				CACHE_LEGACY_SIZE);
+#endif
+#if CACHE_LISTING_SIZE
+	vol->listing_cache = create_lru_cache(vol, NTFS_CACHE_LISTING,
+				CACHE_LISTING_SIZE);
+#endif
+#if CACHE_SYMLINK_SIZE
+	vol->symlink_cache = create_lru_cache(vol, NTFS_CACHE_SYMLINK,
+				CACHE_SYMLINK_SIZE);
+#endif
+#if CACHE_EA_SIZE
+	vol->ea_cache = create_lru_cache(vol, NTFS_CACHE_EA, CACHE_EA_SIZE);
+#endif
+#if CACHE_STREAMS_SIZE
+	vol->streams_cache = create_lru_cache(vol, NTFS_CACHE_STREAMS,
+				CACHE_STREAMS_SIZE);
 #endif
+#if CACHE_STAT_SIZE
+	vol->stat_cache = create_lru_cache(vol, NTFS_CACHE_STAT,
+				CACHE_STAT_SIZE);
+#endif
+#if CACHE_SECURDESC_SIZE
+	vol->securdesc_cache = create_lru_cache(vol, NTFS_CACHE_SECURDESC,
+				CACHE_SECURDESC_SIZE);
+#endif
+#if CACHE_INHERIT_SIZE
+	vol->inherit_cache = create_lru_cache(vol, NTFS_CACHE_INHERIT,
+				CACHE_INHERIT_SIZE);
+#endif
+#if CACHE_SDH_SIZE
+	vol->sdh_cache = create_lru_cache(vol, NTFS_CACHE_SDH,
+				CACHE_SDH_SIZE);
+#endif
+#if CACHE_TRAVERSE_SIZE
+	vol->traverse_cache = create_lru_cache(vol, NTFS_CACHE_TRAVERSE,
+				CACHE_TRAVERSE_SIZE);
+#endif
+#if CACHE_GROUPS_SIZE
+	vol->groups_cache = create_lru_cache(vol, NTFS_CACHE_GROUPS,
+				CACHE_GROUPS_SIZE);
+#endif
+#if CACHE_CBLOCK_SIZE
+		 /* decompressed blocks cache */
+	vol->cblock_cache = ntfs_create_cache("cblock",
+		(cache_free)NULL, ntfs_compressed_cblock_hash,
+		sizeof(struct CACHED_CBLOCK),
+		CACHE_CBLOCK_SIZE, 2*CACHE_CBLOCK_SIZE, FALSE);
+		/* decompressing again is costly */
+	if (vol->cblock_cache)
+		vol->cblock_cache->refill_cost = 4;
+#endif
+}
+
+/*
+ *		Change the number of entries of one of the LRU caches
+ *	Not set in ntfs_mount(), the caches are created with their
+ *	default sizes, and recreated empty with the requested size.
+ *	A zero count suppresses the cache.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_set_cache_size(ntfs_volume *vol, int which, int count)
+{
+	struct CACHE_HEADER **slot;
+	struct CACHE_HEADER *cache;
+	int res;
+
+	res = -1;
+	slot = (vol ? lru_cache_slot(vol, which) : (struct CACHE_HEADER**)NULL);
+	if (!slot)
+		errno = (vol ? EOPNOTSUPP : EINVAL);
+	else {
+		if ((count < 0) || ((count > 0) && (count < 3))
+		    || (count > INT_MAX/64))
+			errno = EINVAL;
+		else {
+			cache = (struct CACHE_HEADER*)NULL;
+			if (count)
+				cache = create_lru_cache(vol, which, count);
+			if (cache || !count) {
+				ntfs_free_cache(*slot);
+				*slot = cache;
+				res = 0;
+			}
+		}
+	}
+	return (res);
 }
 
 /*
@@ -605,4 +1183,374 @@ void ntfs_free_lru_caches(ntfs_volume *vol)
 #if CACHE_LEGACY_SIZE
 	ntfs_free_cache(vol->legacy_cache);
 #endif
+#if CACHE_LISTING_SIZE
+	ntfs_free_cache(vol->listing_cache);
+#endif
+#if CACHE_SYMLINK_SIZE
+	ntfs_free_cache(vol->symlink_cache);
+#endif
+#if CACHE_EA_SIZE
+	ntfs_free_cache(vol->ea_cache);
+#endif
+#if CACHE_STREAMS_SIZE
+	ntfs_free_cache(vol->streams_cache);
+#endif
+#if CACHE_STAT_SIZE
+	ntfs_free_cache(vol->stat_cache);
+#endif
+#if CACHE_SECURDESC_SIZE
+	ntfs_free_cache(vol->securdesc_cache);
+#endif
+#if CACHE_INHERIT_SIZE
+	ntfs_free_cache(vol->inherit_cache);
+#endif
+#if CACHE_SDH_SIZE
+	ntfs_free_cache(vol->sdh_cache);
+#endif
+#if CACHE_TRAVERSE_SIZE
+	ntfs_free_cache(vol->traverse_cache);
+#endif
+#if CACHE_GROUPS_SIZE
+	ntfs_free_cache(vol->groups_cache);
+#endif
+#if CACHE_CBLOCK_SIZE
+	ntfs_free_cache(vol->cblock_cache);
+#endif
+#if CACHE_MFTREC_HASH
+	ntfs_free_cache(vol->mftrec_cache);
+#endif
+#if CACHE_INDEX_HASH
+	ntfs_free_cache(vol->index_cache);
+#endif
+}
+
+/*
+ *		Create the cache of mft records
+ *
+ *	Not created in ntfs_mount(), as its size (in bytes) has to be
+ *	chosen by the application, the memory used by cached records
+ *	being accounted for.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_create_mftrec_cache(ntfs_volume *vol, s64 size)
+{
+#if CACHE_MFTREC_HASH
+	s64 count;
+
+	if (vol->mftrec_cache) {
+		errno = EEXIST;
+		return (-1);
+	}
+	count = size/(vol->mft_record_size + sizeof(struct CACHED_MFTREC)
+				+ sizeof(struct HASH_ENTRY));
+	if (count < 3) {
+		errno = EINVAL;
+		return (-1);
+	}
+		/* keep the cache header size within an int */
+	if (count > INT_MAX/64)
+		count = INT_MAX/64;
+	vol->mftrec_cache = ntfs_create_cache("mftrec", (cache_free)NULL,
+		ntfs_mft_record_hash, sizeof(struct CACHED_MFTREC),
+		count, CACHE_MFTREC_HASH, FALSE);
+	if (!vol->mftrec_cache)
+		return (-1);
+		/* a record is read again by a single device access */
+	vol->mftrec_cache->refill_cost = 1;
+	ntfs_log_debug("Mft record cache of %lld records\n",
+			(long long)count);
+	return (0);
+#else /* CACHE_MFTREC_HASH */
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif /* CACHE_MFTREC_HASH */
+}
+
+/*
+ *		Create the cache of index blocks
+ *
+ *	Not created in ntfs_mount(), as its size (in bytes) has to be
+ *	chosen by the application. The index blocks being generally
+ *	4096 bytes long, the number of entries is derived from this size.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_create_index_cache(ntfs_volume *vol, s64 size)
+{
+#if CACHE_INDEX_HASH
+	s64 count;
+
+	if (vol->index_cache) {
+		errno = EEXIST;
+		return (-1);
+	}
+	count = size/(4096 + sizeof(struct CACHED_INDEX_BLOCK)
+				+ sizeof(struct HASH_ENTRY));
+	if (count < 3) {
+		errno = EINVAL;
+		return (-1);
+	}
+		/* keep the cache header size within an int */
+	if (count > INT_MAX/64)
+		count = INT_MAX/64;
+	vol->index_cache = ntfs_create_cache("index", (cache_free)NULL,
+		ntfs_index_block_hash, sizeof(struct CACHED_INDEX_BLOCK),
+		count, CACHE_INDEX_HASH, FALSE);
+	if (!vol->index_cache)
+		return (-1);
+	vol->index_cache->refill_cost = 1;
+	ntfs_log_debug("Index block cache of %lld blocks\n",
+			(long long)count);
+	return (0);
+#else /* CACHE_INDEX_HASH */
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif /* CACHE_INDEX_HASH */
+}
+
+/*
+ *		Memory budget of the caches of a volume
+ *
+ *	The memory used by the caches of a volume (the LRU caches, the
+ *	caches of mft records, of index blocks and of decompressed
+ *	blocks, and the cache of device blocks) may be limited to a
+ *	budget. When it is exceeded, or on memory pressure, cached data
+ *	are released from the cache where they are estimated to be the
+ *	least valuable, according to the memory they use, the cost of
+ *	getting them again and the proportion of hits in the cache. The
+ *	memory allocated when a cache is created is accounted for, but
+ *	it is only released when the cache is freed.
+ *
+ *	The caches are not trimmed when data are entered, as an entry
+ *	released may designate an inode which has to be closed. Trimming
+ *	has to be requested by the application when nothing else uses
+ *	the volume, for instance between requests (see ntfs_trim_caches()).
+ */
+
+	/* the caches which are not LRU, and the cache of device blocks */
+enum {
+	VOLUME_CACHE_CBLOCK = NTFS_LRU_CACHES,
+	VOLUME_CACHE_MFTREC,
+	VOLUME_CACHE_INDEX,
+	VOLUME_CACHE_BLOCKS,
+	VOLUME_CACHES
+} ;
+
+/*
+ *		Get one of the generic caches of a volume
+ *
+ *	Returns NULL if this cache is not available
+ */
+
+static struct CACHE_HEADER *volume_cache(ntfs_volume *vol, int which)
+{
+	struct CACHE_HEADER **slot;
+	struct CACHE_HEADER *cache;
+
+	cache = (struct CACHE_HEADER*)NULL;
+	switch (which) {
+#if CACHE_CBLOCK_SIZE
+	case VOLUME_CACHE_CBLOCK :
+		cache = vol->cblock_cache;
+		break;
+#endif
+#if CACHE_MFTREC_HASH
+	case VOLUME_CACHE_MFTREC :
+		cache = vol->mftrec_cache;
+		break;
+#endif
+#if CACHE_INDEX_HASH
+	case VOLUME_CACHE_INDEX :
+		cache = vol->index_cache;
+		break;
+#endif
+	default :
+		slot = lru_cache_slot(vol, which);
+		if (slot)
+			cache = *slot;
+		break;
+	}
+	return (cache);
+}
+
+/*
+ *		Get the memory used by the caches of a volume
+ */
+
+s64 ntfs_cache_memory(ntfs_volume *vol)
+{
+	struct CACHE_HEADER *cache;
+	s64 total;
+	int i;
+
+	total = ntfs_block_cache_memory(vol->dev);
+	for (i=0; i<VOLUME_CACHE_BLOCKS; i++) {
+		cache = volume_cache(vol, i);
+		if (cache)
+			total += cache->fixed_bytes + cache->held_bytes;
+	}
+	return (total);
+}
+
+/*
+ *		Set the memory budget of the caches of a volume
+ *
+ *	A zero budget removes the limit. The caches are trimmed on
+ *	the next call to ntfs_trim_caches().
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_set_memory_budget(ntfs_volume *vol, s64 budget)
+{
+	if (!vol || (budget < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	vol->mem_budget = budget;
+	return (0);
+}
+
+/*
+ *		Release the oldest entries of a generic cache
+ *
+ *	Returns the count of bytes released
+ */
+
+static s64 shrink_cache(struct CACHE_HEADER *cache, s64 wanted)
+{
+	struct CACHED_GENERIC *current;
+	s64 released;
+	s64 held;
+
+	released = 0;
+	cache_lock(cache, FALSE);
+	while (cache->oldest_entry && (released < wanted)) {
+		current = cache->oldest_entry;
+		held = cache->held_bytes;
+		if (cache->dohash)
+			drophashindex(cache,current,hashindex(cache,current));
+		do_invalidate(cache,current,CACHE_FREE);
+		cache->evictions++;
+		released += held - cache->held_bytes;
+	}
+	cache_unlock(cache);
+	return (released);
+}
+
+/*
+ *		Estimate the benefit of releasing memory from a cache
+ *
+ *	This is the memory which can be released, divided by the cost
+ *	of getting the data again, and weighted by the proportion of
+ *	misses, so that the caches which hold much data which is cheap
+ *	to get again or seldom used are trimmed first.
+ */
+
+static s64 trim_score(s64 freeable, int cost, unsigned long reads,
+			unsigned long hits)
+{
+	return (freeable*((s64)reads - (s64)hits + 1)
+			/(cost*((s64)reads + 1)));
+}
+
+/*
+ *		Trim the caches of a volume
+ *
+ *	When the memory used by the caches exceeds the budget of the
+ *	volume, or on memory pressure, cached data are released until
+ *	the usage is within the budget, or within CACHE_PRESSURE_PERCENT
+ *	of it (or of the current usage if there is no budget) on memory
+ *	pressure. The spare inodes are released first, then a quarter
+ *	at most of the data of the cache chosen is released at once, so
+ *	that the releases are spread over the caches.
+ *
+ *	This must only be called when nothing else uses the volume,
+ *	as entries in the cache of inodes are closed.
+ *
+ *	Returns the count of bytes released
+ */
+
+s64 ntfs_trim_caches(ntfs_volume *vol, BOOL pressure)
+{
+	struct CACHE_HEADER *cache;
+	struct BLOCK_CACHE *blkcache;
+	s64 used;
+	s64 target;
+	s64 released;
+	s64 freed;
+	s64 score;
+	s64 best;
+	s64 freeable;
+	s64 wanted;
+	s64 most;
+	int victim;
+	int i;
+
+	released = 0;
+	if (vol && (vol->mem_budget || pressure)) {
+		used = ntfs_cache_memory(vol);
+		target = (vol->mem_budget ? vol->mem_budget : used);
+		if (pressure)
+			target = target/100*CACHE_PRESSURE_PERCENT;
+		if (used > target)
+			ntfs_free_spare_inodes(vol);
+		freed = 1;
+		while ((used > target) && freed) {
+				/* choose the cache to trim */
+			victim = -1;
+			best = 0;
+			most = 0;
+			for (i=0; i<VOLUME_CACHE_BLOCKS; i++) {
+				cache = volume_cache(vol, i);
+				if (cache && cache->held_bytes) {
+					score = trim_score(cache->held_bytes,
+						cache->refill_cost,
+						cache->reads, cache->hits);
+					if (score >= best) {
+						best = score;
+						most = cache->held_bytes;
+						victim = i;
+					}
+				}
+			}
+			blkcache = vol->dev->d_cache;
+			if (blkcache) {
+				freeable = ntfs_block_cache_memory(vol->dev)
+						- sizeof(struct BLOCK_CACHE);
+				score = trim_score(freeable, 1,
+					blkcache->reads, blkcache->hits);
+				if (freeable && (score >= best)) {
+					best = score;
+					most = freeable;
+					victim = VOLUME_CACHE_BLOCKS;
+				}
+			}
+				/* release a part of it */
+			freed = 0;
+			if (victim >= 0) {
+				wanted = used - target;
+				if (wanted > most/4)
+					wanted = most/4;
+				if (wanted < CACHE_TRIM_MIN)
+					wanted = CACHE_TRIM_MIN;
+				if (victim == VOLUME_CACHE_BLOCKS)
+					freed = ntfs_block_cache_shrink(
+							vol->dev, wanted);
+				else
+					freed = shrink_cache(
+						volume_cache(vol, victim),
+						wanted);
+			}
+			used -= freed;
+			released += freed;
+		}
+		if (released)
+			ntfs_log_debug("Released %lld bytes from the caches\n",
+					(long long)released);
+	}
+	return (released);
 }
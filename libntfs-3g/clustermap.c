@@ -0,0 +1,522 @@
+/**
+ * clustermap.c - Map of the clusters to the attributes owning them.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "runlist.h"
+#include "mft.h"
+#include "lcnalloc.h"
+#include "volume.h"
+#include "clustermap.h"
+#include "logging.h"
+#include "misc.h"
+
+/*
+ *		The map is built by a single scan of the mft, decoding the
+ *	runlists of the non-resident attributes found in each record in
+ *	use, base or extent. A query is then a dichotomy in the extents
+ *	sorted by their first cluster.
+ *
+ *	The map can be saved to a file, along with a hash of $Bitmap,
+ *	so that it can be reloaded as long as no cluster was allocated
+ *	or freed on the volume.
+ */
+
+#define CLUSTER_MAP_MAGIC "NTFSCMAP"
+#define CLUSTER_MAP_VERSION 1
+#define CLUSTER_MAP_BUFSIZE 65536	/* bytes read from $Bitmap at once */
+#define CLUSTER_MAP_BATCH 1024		/* extents read or written at once */
+
+struct CLUSTER_MAP_HEADER {
+	char magic[8];
+	le32 version;
+	le32 reserved;
+	le64 serial;
+	le64 nr_clusters;
+	le64 bitmap_hash;
+	le64 count;
+} __attribute__((__packed__)) ;
+
+struct CLUSTER_MAP_ENTRY {
+	le64 lcn;
+	le64 length;
+	le64 vcn;
+	le64 mref;
+	le64 record;
+	le32 type;
+	le16 instance;
+	le16 reserved;
+} __attribute__((__packed__)) ;
+
+struct CLUSTER_MAP_BUILD {
+	struct CLUSTER_MAP *map;
+	s64 allocated;		/* extents allocated in the map */
+} ;
+
+/*
+ *		Append an extent to the map being built
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int cluster_map_append(struct CLUSTER_MAP_BUILD *build,
+			const struct CLUSTER_EXTENT *extent)
+{
+	struct CLUSTER_MAP *map = build->map;
+	struct CLUSTER_EXTENT *extents;
+	s64 allocated;
+
+	if (map->count >= build->allocated) {
+		allocated = (build->allocated ? 2*build->allocated : 4096);
+		extents = (struct CLUSTER_EXTENT*)realloc(map->extents,
+				allocated*sizeof(struct CLUSTER_EXTENT));
+		if (!extents) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		map->extents = extents;
+		build->allocated = allocated;
+	}
+	map->extents[map->count++] = *extent;
+	return (0);
+}
+
+/*
+ *		Record the extents of the non-resident attributes of a record
+ */
+
+static int cluster_map_record(ntfs_volume *vol, const MFT_REF mref,
+			MFT_RECORD *mrec, void *data)
+{
+	struct CLUSTER_MAP_BUILD *build = (struct CLUSTER_MAP_BUILD*)data;
+	struct CLUSTER_EXTENT extent;
+	runlist_element *rl;
+	ATTR_RECORD *a;
+	u8 *p, *end;
+	u32 length;
+	int res;
+	int i;
+
+	res = 0;
+	extent.mref = (mrec->base_mft_record
+			? le64_to_cpu(mrec->base_mft_record) : mref);
+	extent.record = MREF(mref);
+	p = (u8*)mrec + le16_to_cpu(mrec->attrs_offset);
+	end = (u8*)mrec + le32_to_cpu(mrec->bytes_in_use);
+	while (!res && ((p + 8) <= end)) {
+		a = (ATTR_RECORD*)p;
+		if (a->type == AT_END)
+			break;
+		length = le32_to_cpu(a->length);
+		if (!length || (length > (u32)(end - p)))
+			break;
+		if (a->non_resident) {
+			rl = ntfs_mapping_pairs_decompress(vol, a, NULL);
+			if (rl) {
+				extent.type = a->type;
+				extent.instance = le16_to_cpu(a->instance);
+				for (i=0; !res && rl[i].length; i++) {
+					if (rl[i].lcn < 0)
+						continue;
+					extent.lcn = rl[i].lcn;
+					extent.length = rl[i].length;
+					extent.vcn = rl[i].vcn;
+					res = cluster_map_append(build, &extent);
+				}
+				free(rl);
+			} else
+				ntfs_log_debug("Bad runlist in record %lld, "
+					"attribute 0x%x\n",
+					(long long)MREF(mref),
+					(int)le32_to_cpu(a->type));
+		}
+		p += length;
+	}
+	return (res);
+}
+
+static int cluster_map_compare(const void *p1, const void *p2)
+{
+	const struct CLUSTER_EXTENT *e1 = (const struct CLUSTER_EXTENT*)p1;
+	const struct CLUSTER_EXTENT *e2 = (const struct CLUSTER_EXTENT*)p2;
+
+	if (e1->lcn != e2->lcn)
+		return (e1->lcn < e2->lcn ? -1 : 1);
+	if (MREF(e1->mref) != MREF(e2->mref))
+		return (MREF(e1->mref) < MREF(e2->mref) ? -1 : 1);
+	return (e1->vcn < e2->vcn ? -1 : (e1->vcn > e2->vcn ? 1 : 0));
+}
+
+/*
+ *		Compute the reach of the sorted extents
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int cluster_map_reach(struct CLUSTER_MAP *map)
+{
+	LCN reach;
+	s64 i;
+
+	map->reach = (LCN*)ntfs_malloc((map->count ? map->count : 1)
+				*sizeof(LCN));
+	if (!map->reach)
+		return (-1);
+	reach = 0;
+	for (i=0; i<map->count; i++) {
+		if ((map->extents[i].lcn + map->extents[i].length) > reach)
+			reach = map->extents[i].lcn + map->extents[i].length;
+		map->reach[i] = reach;
+	}
+	return (0);
+}
+
+/**
+ * ntfs_cluster_map_build - map the clusters of a volume to their owners
+ * @vol:	volume to map
+ * @threads:	number of threads reading the mft, 0 or 1 for none
+ *
+ * All the records in use are scanned once by ntfs_mft_scan(), and the
+ * extents of all the non-resident attributes are sorted by cluster.
+ * The map describes the volume at the time of the call, it is not
+ * updated by later allocations.
+ *
+ * Returns the new map, to be freed by ntfs_cluster_map_free(), or NULL
+ * on error, with errno set to the error code.
+ */
+struct CLUSTER_MAP *ntfs_cluster_map_build(ntfs_volume *vol, int threads)
+{
+	struct CLUSTER_MAP_BUILD build;
+	struct CLUSTER_MAP *map;
+	int res;
+
+	if (!vol) {
+		errno = EINVAL;
+		return ((struct CLUSTER_MAP*)NULL);
+	}
+	map = (struct CLUSTER_MAP*)ntfs_calloc(sizeof(struct CLUSTER_MAP));
+	if (!map)
+		return ((struct CLUSTER_MAP*)NULL);
+	map->nr_clusters = vol->nr_clusters;
+	map->serial = vol->vol_serial;
+	build.map = map;
+	build.allocated = 0;
+	res = ntfs_mft_scan(vol, threads, cluster_map_record, &build);
+	if (!res) {
+		if (map->count)
+			qsort(map->extents, map->count,
+				sizeof(struct CLUSTER_EXTENT),
+				cluster_map_compare);
+		res = cluster_map_reach(map);
+	}
+	if (res) {
+		ntfs_cluster_map_free(map);
+		map = (struct CLUSTER_MAP*)NULL;
+	}
+	return (map);
+}
+
+/**
+ * ntfs_cluster_map_find - find the owners of a range of clusters
+ * @map:	map of the volume
+ * @first:	first cluster of the range
+ * @last:	last cluster of the range (included)
+ * @callback:	function called for each extent overlapping the range
+ * @data:	parameter passed to @callback
+ *
+ * Returns 0 when all the overlapping extents have been passed, the
+ * positive value returned by @callback if it stopped the search, or -1
+ * on error, with errno set to the error code.
+ */
+int ntfs_cluster_map_find(const struct CLUSTER_MAP *map, LCN first, LCN last,
+		ntfs_cluster_map_t callback, void *data)
+{
+	const struct CLUSTER_EXTENT *extent;
+	s64 low, high, mid;
+	int res;
+
+	if (!map || !callback || (first > last)) {
+		errno = EINVAL;
+		return (-1);
+	}
+		/* first extent reaching beyond the first cluster */
+	low = 0;
+	high = map->count;
+	while (low < high) {
+		mid = (low + high) >> 1;
+		if (map->reach[mid] > first)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	res = 0;
+	for (; !res && (low < map->count)
+			&& (map->extents[low].lcn <= last); low++) {
+		extent = &map->extents[low];
+		if ((extent->lcn + extent->length) > first)
+			res = callback(extent, data);
+	}
+	return (res);
+}
+
+/*
+ *		Hash $Bitmap, to check whether a saved map is still valid
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int cluster_map_hash(ntfs_volume *vol, u64 *phash)
+{
+	u8 *buf;
+	u64 hash;
+	s64 size, pos, br;
+	s64 i;
+
+	buf = (u8*)ntfs_malloc(CLUSTER_MAP_BUFSIZE);
+	if (!buf)
+		return (-1);
+	hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	size = (vol->nr_clusters + 7) >> 3;
+	br = 0;
+	for (pos=0; pos<size; pos+=br) {
+		br = ntfs_lcnbmp_pread(vol, pos,
+			(size - pos < CLUSTER_MAP_BUFSIZE
+				? size - pos : CLUSTER_MAP_BUFSIZE), buf);
+		if (br <= 0) {
+			if (!br)
+				errno = EIO;
+			free(buf);
+			return (-1);
+		}
+		for (i=0; i<br; i++) {
+			hash ^= buf[i];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	free(buf);
+	*phash = hash;
+	return (0);
+}
+
+/**
+ * ntfs_cluster_map_save - save a map of a volume to a file
+ * @vol:	volume the map was built from
+ * @map:	map to save
+ * @path:	file to save the map to
+ *
+ * Returns 0 if successful, or -1 on error, with errno set to the error
+ * code and the file removed.
+ */
+int ntfs_cluster_map_save(ntfs_volume *vol, const struct CLUSTER_MAP *map,
+		const char *path)
+{
+	struct CLUSTER_MAP_HEADER header;
+	struct CLUSTER_MAP_ENTRY *entries;
+	const struct CLUSTER_EXTENT *extent;
+	FILE *f;
+	u64 hash;
+	s64 i;
+	int n;
+	int res;
+	int err;
+
+	if (!vol || !map || !path) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (cluster_map_hash(vol, &hash))
+		return (-1);
+	entries = (struct CLUSTER_MAP_ENTRY*)ntfs_malloc(CLUSTER_MAP_BATCH
+				*sizeof(struct CLUSTER_MAP_ENTRY));
+	if (!entries)
+		return (-1);
+	f = fopen(path, "wb");
+	if (!f) {
+		free(entries);
+		return (-1);
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CLUSTER_MAP_MAGIC, sizeof(header.magic));
+	header.version = const_cpu_to_le32(CLUSTER_MAP_VERSION);
+	header.serial = cpu_to_le64(map->serial);
+	header.nr_clusters = cpu_to_le64(map->nr_clusters);
+	header.bitmap_hash = cpu_to_le64(hash);
+	header.count = cpu_to_le64(map->count);
+	res = (fwrite(&header, sizeof(header), 1, f) == 1 ? 0 : -1);
+	for (i=0; !res && (i<map->count); i+=n) {
+		for (n=0; (n<CLUSTER_MAP_BATCH) && ((i + n) < map->count);
+				n++) {
+			extent = &map->extents[i + n];
+			entries[n].lcn = cpu_to_le64(extent->lcn);
+			entries[n].length = cpu_to_le64(extent->length);
+			entries[n].vcn = cpu_to_le64(extent->vcn);
+			entries[n].mref = cpu_to_le64(extent->mref);
+			entries[n].record = cpu_to_le64(extent->record);
+			entries[n].type = extent->type;
+			entries[n].instance = cpu_to_le16(extent->instance);
+			entries[n].reserved = const_cpu_to_le16(0);
+		}
+		if (fwrite(entries, sizeof(struct CLUSTER_MAP_ENTRY), n, f)
+				!= (size_t)n)
+			res = -1;
+	}
+	err = errno;
+	if (fclose(f) && !res) {
+		res = -1;
+		err = errno;
+	}
+	if (res) {
+		unlink(path);
+		errno = err;
+	}
+	free(entries);
+	return (res);
+}
+
+/**
+ * ntfs_cluster_map_load - load the map of a volume from a file
+ * @vol:	volume the map was built from
+ * @path:	file the map was saved to
+ *
+ * The map is only loaded if it was saved for this volume, and no cluster
+ * has been allocated or freed since then.
+ *
+ * Returns the map, to be freed by ntfs_cluster_map_free(), or NULL on
+ * error, with errno set to the error code, ESTALE meaning the map does
+ * not describe the current state of the volume.
+ */
+struct CLUSTER_MAP *ntfs_cluster_map_load(ntfs_volume *vol, const char *path)
+{
+	struct CLUSTER_MAP_HEADER header;
+	struct CLUSTER_MAP_ENTRY *entries;
+	struct CLUSTER_EXTENT *extent;
+	struct CLUSTER_MAP *map;
+	FILE *f;
+	u64 hash;
+	s64 count;
+	s64 i;
+	int n;
+	int res;
+	int err;
+
+	if (!vol || !path) {
+		errno = EINVAL;
+		return ((struct CLUSTER_MAP*)NULL);
+	}
+	f = fopen(path, "rb");
+	if (!f)
+		return ((struct CLUSTER_MAP*)NULL);
+	map = (struct CLUSTER_MAP*)NULL;
+	entries = (struct CLUSTER_MAP_ENTRY*)NULL;
+	res = -1;
+	if (fread(&header, sizeof(header), 1, f) != 1) {
+		errno = ESTALE;
+		goto out;
+	}
+	if (memcmp(header.magic, CLUSTER_MAP_MAGIC, sizeof(header.magic))
+	    || (header.version != const_cpu_to_le32(CLUSTER_MAP_VERSION))
+	    || (le64_to_cpu(header.serial) != vol->vol_serial)
+	    || (sle64_to_cpu(header.nr_clusters) != vol->nr_clusters)) {
+		errno = ESTALE;
+		goto out;
+	}
+	if (cluster_map_hash(vol, &hash))
+		goto out;
+	if (le64_to_cpu(header.bitmap_hash) != hash) {
+		errno = ESTALE;
+		goto out;
+	}
+	count = le64_to_cpu(header.count);
+	entries = (struct CLUSTER_MAP_ENTRY*)ntfs_malloc(CLUSTER_MAP_BATCH
+				*sizeof(struct CLUSTER_MAP_ENTRY));
+	map = (struct CLUSTER_MAP*)ntfs_calloc(sizeof(struct CLUSTER_MAP));
+	if (!entries || !map)
+		goto out;
+	map->nr_clusters = vol->nr_clusters;
+	map->serial = vol->vol_serial;
+	map->extents = (struct CLUSTER_EXTENT*)ntfs_malloc((count ? count : 1)
+				*sizeof(struct CLUSTER_EXTENT));
+	if (!map->extents)
+		goto out;
+	for (i=0; i<count; i+=n) {
+		n = (count - i < CLUSTER_MAP_BATCH
+				? count - i : CLUSTER_MAP_BATCH);
+		if (fread(entries, sizeof(struct CLUSTER_MAP_ENTRY), n, f)
+				!= (size_t)n) {
+			errno = ESTALE;
+			goto out;
+		}
+		for (n=0; (n<CLUSTER_MAP_BATCH) && ((i + n) < count); n++) {
+			extent = &map->extents[i + n];
+			extent->lcn = sle64_to_cpu(entries[n].lcn);
+			extent->length = sle64_to_cpu(entries[n].length);
+			extent->vcn = sle64_to_cpu(entries[n].vcn);
+			extent->mref = le64_to_cpu(entries[n].mref);
+			extent->record = le64_to_cpu(entries[n].record);
+			extent->type = entries[n].type;
+			extent->instance = le16_to_cpu(entries[n].instance);
+		}
+		map->count += n;
+	}
+	res = cluster_map_reach(map);
+out :
+	err = errno;
+	free(entries);
+	fclose(f);
+	if (res) {
+		ntfs_cluster_map_free(map);
+		map = (struct CLUSTER_MAP*)NULL;
+		errno = err;
+	}
+	return (map);
+}
+
+/**
+ * ntfs_cluster_map_free - free a map of the clusters
+ * @map:	map to free, may be NULL
+ */
+void ntfs_cluster_map_free(struct CLUSTER_MAP *map)
+{
+	if (map) {
+		free(map->extents);
+		free(map->reach);
+		free(map);
+	}
+}
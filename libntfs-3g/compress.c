@@ -34,14 +34,26 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "attrib.h"
+#include "cache.h"
 #include "debug.h"
 #include "volume.h"
 #include "types.h"
@@ -51,6 +63,7 @@
 #include "lcnalloc.h"
 #include "logging.h"
 #include "misc.h"
+#include "probes.h"
 
 #undef le16_to_cpup 
 /* the standard le16_to_cpup() crashes for unaligned data on some processors */ 
@@ -71,13 +84,24 @@ typedef enum {
 	NTFS_SB_IS_COMPRESSED	=	0x8000,
 } ntfs_compression_constants;
 
-/* Match length at or above which ntfs_best_match() will stop searching for
- * longer matches.  */
-#define NICE_MATCH_LEN 18
+/* Parameters of the match finder for each compression level :
+ *   - whether the matches are chosen immediately (greedy parsing) or
+ *     after checking for a longer match at next position (lazy parsing),
+ *   - the match length at or above which ntfs_best_match() will stop
+ *     searching for longer matches,
+ *   - the maximum number of potential matches that ntfs_best_match()
+ *     will consider at each position.  */
+struct COMPRESS_LEVEL {
+	BOOL greedy;
+	int nice_len;
+	int max_depth;
+} ;
 
-/* Maximum number of potential matches that ntfs_best_match() will consider at
- * each position.  */
-#define MAX_SEARCH_DEPTH 24
+static const struct COMPRESS_LEVEL compress_levels[] = {
+	{ TRUE, 8, 1 },		/* NTFS_COMPRESS_FAST */
+	{ FALSE, 18, 24 },	/* NTFS_COMPRESS_DEFAULT */
+	{ FALSE, 4098, 256 },	/* NTFS_COMPRESS_BEST */
+} ;
 
 /* log base 2 of the number of entries in the hash table for match-finding.  */
 #define HASH_SHIFT 14
@@ -91,6 +115,8 @@ struct COMPRESS_CONTEXT {
 	int size;
 	int rel;
 	int mxsz;
+	int nice_len;
+	int max_depth;
 	s16 head[1 << HASH_SHIFT];
 	s16 prev[NTFS_SB_SIZE];
 } ;
@@ -138,11 +164,11 @@ static inline unsigned int ntfs_hash(const u8 *p)
  *	Note: for the following reasons, this function is not guaranteed to find
  *	*the* longest match up to pctx->mxsz:
  *
- *	(1) If this function finds a match of NICE_MATCH_LEN bytes or greater,
+ *	(1) If this function finds a match of pctx->nice_len bytes or greater,
  *	    it ends early because a match this long is good enough and it's not
  *	    worth spending more time searching.
  *
- *	(2) If this function considers MAX_SEARCH_DEPTH matches with a single
+ *	(2) If this function considers pctx->max_depth matches with a single
  *	    position, it ends early and returns the longest match found so far.
  *	    This saves a lot of time on degenerate inputs.
  */
@@ -153,8 +179,8 @@ static void ntfs_best_match(struct COMPRESS_CONTEXT *pctx, const int i,
 	const u8 * const strptr = &inbuf[i]; /* String we're matching against */
 	s16 * const prev = pctx->prev;
 	const int max_len = min(pctx->bufsize - i, pctx->mxsz);
-	const int nice_len = min(NICE_MATCH_LEN, max_len);
-	int depth_remaining = MAX_SEARCH_DEPTH;
+	const int nice_len = min(pctx->nice_len, max_len);
+	int depth_remaining = pctx->max_depth;
 	const u8 *best_matchptr = strptr;
 	unsigned int hash;
 	s16 cur_match;
@@ -268,13 +294,15 @@ static void ntfs_skip_position(struct COMPRESS_CONTEXT *pctx, const int i)
  *	Note : two bytes may be output before output buffer overflow
  *	is detected, so a 4100-bytes output buffer must be reserved.
  *
+ *	The match finder is tuned according to @plevel.
+ *
  *	Returns the size of the compressed block, including the
  *			header (minimal size is 2, maximum size is 4098)
  *		0 if an error has been met. 
  */
 
 static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
-				char *outbuf)
+				char *outbuf, const struct COMPRESS_LEVEL *plevel)
 {
 	struct COMPRESS_CONTEXT *pctx;
 	int i; /* current position */
@@ -303,6 +331,8 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 
 	pctx->inbuf = (const unsigned char*)inbuf;
 	pctx->bufsize = bufsize;
+	pctx->nice_len = plevel->nice_len;
+	pctx->max_depth = plevel->max_depth;
 	xout = 2;
 	i = 0;
 	bp = 4;
@@ -318,7 +348,8 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 		/* This implementation uses "lazy" parsing: it always chooses
 		 * the longest match, unless the match at the next position is
 		 * longer.  This is the same strategy used by the high
-		 * compression modes of zlib.  */
+		 * compression modes of zlib.  With "greedy" parsing, the
+		 * match is always chosen, as in the fast modes of zlib.  */
 
 		if (!have_match) {
 			/* Find the longest match at the current position.  But
@@ -341,7 +372,8 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 			bp_cur = bp;
 			offs = pctx->rel;
 
-			if (pctx->size >= NICE_MATCH_LEN) {
+			if ((pctx->size >= pctx->nice_len)
+			    || plevel->greedy) {
 
 				/* Choose long matches immediately.  */
 
@@ -446,8 +478,94 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
 	return (xout);
 }
 
+/*
+ *		Copy 8 or 16 bytes, source and destination must not overlap
+ *	within the bytes copied
+ */
+static inline void ntfs_copy8(u8 *dest, const u8 *src)
+{
+	u64 w;
+
+	memcpy(&w, src, 8);
+	memcpy(dest, &w, 8);
+}
+
+static inline void ntfs_copy16(u8 *dest, const u8 *src)
+{
+#if defined(__SSE2__)
+	_mm_storeu_si128((__m128i*)dest, _mm_loadu_si128((const __m128i*)src));
+#elif defined(__ARM_NEON)
+	vst1q_u8(dest, vld1q_u8(src));
+#else
+	ntfs_copy8(dest, src);
+	ntfs_copy8(dest + 8, src + 8);
+#endif
+}
+
+/*
+ *		Copy a back-reference of a decompressed sub-block
+ *
+ *	The source is @dist bytes before @dest, and overlaps the
+ *	destination when @dist is less than @length, so that the bytes
+ *	from the source are repeated.
+ *
+ *	When there is room enough in the buffer, the copy is done by
+ *	wide chunks which may go up to 15 bytes beyond the end of the
+ *	sequence. These bytes are overwritten later when decoding the
+ *	next tokens, or zeroed when the sub-block or the block is
+ *	shorter, so this is harmless. Short distances are first extended
+ *	to a multiple of the distance which is at least 8 bytes, and
+ *	doubled as the repeated pattern grows.
+ *
+ *	Returns the end of the sequence in the destination
+ */
+static inline u8 *ntfs_copy_phrase(u8 *dest, unsigned int dist,
+			unsigned int length, const u8 *dest_end)
+{
+	const u8 *src;
+	u8 *end;
+	unsigned int ext;
+
+	src = dest - dist;
+	end = dest + length;
+	if ((end + 16) > dest_end) {
+		/* near the end of buffer, copy byte by byte */
+		while (dest < end)
+			*dest++ = *src++;
+	} else if (dist >= 16) {
+		do {
+			ntfs_copy16(dest, src);
+			dest += 16;
+			src += 16;
+		} while (dest < end);
+	} else {
+		ext = dist;
+		if (dist < 8) {
+			/* repeat the pattern up to a distance >= 8 */
+			ext = dist * ((8 + dist - 1)/dist);
+			while (dest < (src + ext)) {
+				*dest = *(dest - dist);
+				dest++;
+			}
+		}
+		do {
+			if (ext < 16) {
+				ntfs_copy8(dest, dest - ext);
+				dest += 8;
+			} else {
+				ntfs_copy16(dest, dest - ext);
+				dest += 16;
+			}
+			/* double the distance when enough has been copied */
+			if ((dest - src) >= (2*ext))
+				ext <<= 1;
+		} while (dest < end);
+	}
+	return (end);
+}
+
 /**
- * ntfs_decompress - decompress a compression block into an array of pages
+ * lznt1_decompress - decompress a compression block into an array of pages
  * @dest:	buffer to which to write the decompressed data
  * @dest_size:	size of buffer @dest in bytes
  * @cb_start:	compression block to decompress
@@ -457,21 +575,24 @@ static unsigned int ntfs_compress_block(const char *inbuf, const int bufsize,
  * buffer @dest.
  *
  * @cb_start is a pointer to the compression block which needs decompressing
- * and @cb_size is the size of @cb_start in bytes (8-64kiB).
+ * and @cb_size is the size of @cb_start in bytes (8-64kiB). The compressed
+ * data is not modified, so that it can be decompressed in place.
+ * Nothing is logged, so that this can be run by processors which
+ * cannot call the environment.
  *
- * Return 0 if success or -EOVERFLOW on error in the compressed stream.
+ * Return 0 if success or -1 on error in the compressed stream (errno set).
  */
-static int ntfs_decompress(u8 *dest, const u32 dest_size,
-		u8 *const cb_start, const u32 cb_size)
+static int lznt1_decompress(u8 *dest, const u32 dest_size,
+		const u8 *const cb_start, const u32 cb_size)
 {
 	/*
 	 * Pointers into the compressed data, i.e. the compression block (cb),
 	 * and the therein contained sub-blocks (sb).
 	 */
-	u8 *cb_end = cb_start + cb_size; /* End of cb. */
-	u8 *cb = cb_start;	/* Current position in cb. */
-	u8 *cb_sb_start = cb;	/* Beginning of the current sb in the cb. */
-	u8 *cb_sb_end;		/* End of current sb / beginning of next sb. */
+	const u8 *cb_end = cb_start + cb_size; /* End of cb. */
+	const u8 *cb = cb_start;	/* Current position in cb. */
+	const u8 *cb_sb_start = cb;	/* Beginning of the current sb in the cb. */
+	const u8 *cb_sb_end;	/* End of current sb / beginning of next sb. */
 	/* Variables for uncompressed data / destination. */
 	u8 *dest_end = dest + dest_size;	/* End of dest buffer. */
 	u8 *dest_sb_start;	/* Start of current sub-block in dest. */
@@ -479,6 +600,7 @@ static int ntfs_decompress(u8 *dest, const u32 dest_size,
 	/* Variables for tag and token parsing. */
 	u8 tag;			/* Current tag. */
 	int token;		/* Loop counter for the eight tokens in tag. */
+	u16 lg;			/* log2 of the position in sb, see below. */
 
 	ntfs_log_trace("Entering, cb_size = 0x%x.\n", (unsigned)cb_size);
 do_next_sb:
@@ -488,9 +610,11 @@ do_next_sb:
 	 * Have we reached the end of the compression block or the end of the
 	 * decompressed data?  The latter can happen for example if the current
 	 * position in the compression block is one byte before its end so the
-	 * first two checks do not detect it.
+	 * first two checks do not detect it. A single byte left cannot hold
+	 * the header of a sub-block, and is not read.
 	 */
-	if (cb == cb_end || !le16_to_cpup((le16*)cb) || dest == dest_end) {
+	if ((cb + 2 > cb_end) || !le16_to_cpup((const le16*)cb)
+	    || dest == dest_end) {
 		if (dest_end > dest)
 			memset(dest, 0, dest_end - dest);
 		ntfs_log_debug("Completed. Returning success (0).\n");
@@ -499,6 +623,7 @@ do_next_sb:
 	/* Setup offset for the current sub-block destination. */
 	dest_sb_start = dest;
 	dest_sb_end = dest + NTFS_SB_SIZE;
+	lg = 0;
 	/* Check that we are still within allowed boundaries. */
 	if (dest_sb_end > dest_end)
 		goto return_overflow;
@@ -507,12 +632,12 @@ do_next_sb:
 		goto return_overflow;
 	/* Setup the current sub-block source pointers and validate range. */
 	cb_sb_start = cb;
-	cb_sb_end = cb_sb_start + (le16_to_cpup((le16*)cb) & NTFS_SB_SIZE_MASK)
+	cb_sb_end = cb_sb_start + (le16_to_cpup((const le16*)cb) & NTFS_SB_SIZE_MASK)
 			+ 3;
 	if (cb_sb_end > cb_end)
 		goto return_overflow;
 	/* Now, we are ready to process the current sub-block (sb). */
-	if (!(le16_to_cpup((le16*)cb) & NTFS_SB_IS_COMPRESSED)) {
+	if (!(le16_to_cpup((const le16*)cb) & NTFS_SB_IS_COMPRESSED)) {
 		ntfs_log_debug("Found uncompressed sub-block.\n");
 		/* This sb is not compressed, just copy it into destination. */
 		/* Advance source position to first data byte. */
@@ -550,10 +675,16 @@ do_next_tag:
 		goto return_overflow;
 	/* Get the next tag and advance to first token. */
 	tag = *cb++;
+	/* Eight symbol tokens, copy them at once when in range. */
+	if (!tag && ((cb + 8) <= cb_sb_end) && ((dest + 8) <= dest_sb_end)) {
+		ntfs_copy8(dest, cb);
+		dest += 8;
+		cb += 8;
+		goto do_next_tag;
+	}
 	/* Parse the eight tokens described by the tag. */
 	for (token = 0; token < 8; token++, tag >>= 1) {
-		u16 lg, pt, length, max_non_overlap;
-		register u16 i;
+		u16 pt, length;
 		u8 *dest_back_addr;
 
 		/* Check if we are done / still in range. */
@@ -565,6 +696,8 @@ do_next_tag:
 			 * We have a symbol token, copy the symbol across, and
 			 * advance the source and destination positions.
 			 */
+			if (dest == dest_sb_end)
+				goto return_overflow;
 			*dest++ = *cb++;
 			/* Continue with the next token. */
 			continue;
@@ -580,13 +713,13 @@ do_next_tag:
 		 * of bytes to copy (l). We use an optimized algorithm in which
 		 * we first calculate log2(current destination position in sb),
 		 * which allows determination of l and p in O(1) rather than
-		 * O(n). We just need an arch-optimized log2() function now.
+		 * O(n). As the position only increases within the sb, the
+		 * log2 is updated from the one of the previous phrase token.
 		 */
-		lg = 0;
-		for (i = dest - dest_sb_start - 1; i >= 0x10; i >>= 1)
+		while ((dest - dest_sb_start - 1) >= (0x10 << lg))
 			lg++;
 		/* Get the phrase token into i. */
-		pt = le16_to_cpup((le16*)cb);
+		pt = le16_to_cpup((const le16*)cb);
 		/*
 		 * Calculate starting position of the byte sequence in
 		 * the destination using the fact that p = (pt >> (12 - lg)) + 1
@@ -600,27 +733,9 @@ do_next_tag:
 		/* Verify destination is in range. */
 		if (dest + length > dest_sb_end)
 			goto return_overflow;
-		/* The number of non-overlapping bytes. */
-		max_non_overlap = dest - dest_back_addr;
-		if (length <= max_non_overlap) {
-			/* The byte sequence doesn't overlap, just copy it. */
-			memcpy(dest, dest_back_addr, length);
-			/* Advance destination pointer. */
-			dest += length;
-		} else {
-			/*
-			 * The byte sequence does overlap, copy non-overlapping
-			 * part and then do a slow byte by byte copy for the
-			 * overlapping part. Also, advance the destination
-			 * pointer.
-			 */
-			memcpy(dest, dest_back_addr, max_non_overlap);
-			dest += max_non_overlap;
-			dest_back_addr += max_non_overlap;
-			length -= max_non_overlap;
-			while (length--)
-				*dest++ = *dest_back_addr++;
-		}
+		/* Copy the sequence, which may overlap the destination. */
+		dest = ntfs_copy_phrase(dest, dest - dest_back_addr, length,
+				dest_end);
 		/* Advance source position and continue with the next token. */
 		cb += 2;
 	}
@@ -628,10 +743,20 @@ do_next_tag:
 	goto do_next_tag;
 return_overflow:
 	errno = EOVERFLOW;
-	ntfs_log_perror("Failed to decompress file");
 	return -1;
 }
 
+static int ntfs_decompress(u8 *dest, const u32 dest_size,
+		const u8 *const cb_start, const u32 cb_size)
+{
+	int res;
+
+	res = lznt1_decompress(dest, dest_size, cb_start, cb_size);
+	if (res)
+		ntfs_log_perror("Failed to decompress file");
+	return (res);
+}
+
 /**
  * ntfs_is_cb_compressed - internal function, do not use
  *
@@ -685,171 +810,940 @@ restart:
 	return FALSE;
 }
 
-/**
- * ntfs_compressed_attr_pread - read from a compressed attribute
- * @na:		ntfs attribute to read from
- * @pos:	byte position in the attribute to begin reading from
- * @count:	number of bytes to read
- * @b:		output data buffer
+/*
+ *		Parallel compression and decompression
  *
- * NOTE:  You probably want to be using attrib.c::ntfs_attr_pread() instead.
+ *	The library is not reentrant, so the compression blocks are read
+ *	by the thread requesting the data, and only their decompression,
+ *	which only uses its buffers, is dispatched to a pool of threads.
+ *	The requesting thread reads the next blocks meanwhile, and the
+ *	decompressed data is assembled in order into the caller's buffer.
+ *	Full blocks are decompressed in place into the caller's buffer,
+ *	only the partial ones at both ends of the read have to be copied.
  *
- * This function will read @count bytes starting at offset @pos from the
- * compressed ntfs attribute @na into the data buffer @b.
+ *	Similarly, when writing, the sub-blocks of a compression block
+ *	are compressed by the pool into separate buffers, and assembled
+ *	in order by the writing thread, which then updates the runlist.
  *
- * On success, return the number of successfully read bytes.  If this number
- * is lower than @count this means that the read reached end of file or that
- * an error was encountered during the read so that the read is partial.
- * 0 means end of file or nothing was read (also return 0 when @count is 0).
+ *	The chunks of system compressed files are also decompressed by
+ *	the pool, by batches.
  *
- * On error and nothing has been read, return -1 with errno set appropriately
- * to the return code of ntfs_pread(), or to EINVAL in case of invalid
- * arguments.
+ *	Without threads, the environment may provide processors which
+ *	can only run code working on memory, such as the application
+ *	processors of UEFI. The decompression jobs are then queued, and
+ *	dispatched all at once to the processors when the first one is
+ *	waited for, errors being logged by the requesting thread.
  */
-s64 ntfs_compressed_attr_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
+
+struct COMPRESS_JOB {
+	struct COMPRESS_JOB *next;	/* next job queued */
+	int (*process)(struct COMPRESS_JOB *job);
+		/* for decompressing */
+	u8 *cb;				/* compressed block */
+	u8 *buf;			/* buffer for a partial block */
+	const u8 *src;			/* compressed data, in cb or in place */
+	u32 cb_size;			/* size of the compressed data */
+	u8 *dest;			/* where to decompress */
+	u32 dest_size;			/* size to decompress */
+	u8 *copy_to;			/* where the data is wanted */
+	u32 copy_ofs;			/* offset of the data wanted */
+	u32 copy_count;			/* size of the data wanted */
+	ntfs_attr *cache_na;		/* attribute to cache the cb for */
+	VCN vcn;			/* first vcn of the cb */
+	void *decoder;			/* state for decoding a chunk */
+		/* for compressing */
+	const char *inbuf;		/* sub-block to compress */
+	int insz;			/* size of sub-block */
+	char *outbuf;			/* where to compress */
+	unsigned int outsz;		/* compressed size, 0 if failed */
+	const struct COMPRESS_LEVEL *plevel;
+	int err;			/* errno if processing failed */
+	BOOL done;
+} ;
+
+static int decompress_job(struct COMPRESS_JOB *job)
 {
-	s64 br, to_read, ofs, total, total2;
-	u64 cb_size_mask;
-	VCN start_vcn, vcn, end_vcn;
-	ntfs_volume *vol;
-	runlist_element *rl;
-	u8 *dest, *cb, *cb_pos, *cb_end;
-	u32 cb_size;
+	return (lznt1_decompress(job->dest, job->dest_size,
+			job->src, job->cb_size));
+}
+
+static int compress_job(struct COMPRESS_JOB *job)
+{
+	job->outsz = ntfs_compress_block(job->inbuf, job->insz,
+				job->outbuf, job->plevel);
+	return (job->outsz ? 0 : -1);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+struct COMPRESS_POOL {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* signalled when a job is queued */
+	pthread_cond_t done;		/* broadcast when a job is done */
+	struct COMPRESS_JOB *first;	/* oldest queued job */
+	struct COMPRESS_JOB *last;	/* latest queued job */
+	BOOL stop;
+	int count;			/* number of threads */
+	pthread_t thread[COMPRESS_MAX_THREADS];
+} ;
+
+static void *compress_worker(void *arg)
+{
+	struct COMPRESS_POOL *pool;
+	struct COMPRESS_JOB *job;
 	int err;
-	ATTR_FLAGS data_flags;
-	FILE_ATTR_FLAGS compression;
-	unsigned int nr_cbs, cb_clusters;
 
-	if (!na || !na->ni) {
-		errno = EINVAL;
-		return -1;
+	pool = (struct COMPRESS_POOL*)arg;
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		job = pool->first;
+		if (job) {
+			pool->first = job->next;
+			if (!pool->first)
+				pool->last = (struct COMPRESS_JOB*)NULL;
+			pthread_mutex_unlock(&pool->lock);
+			err = 0;
+			if (job->process(job) < 0)
+				err = (errno ? errno : EIO);
+			pthread_mutex_lock(&pool->lock);
+			job->err = err;
+			job->done = TRUE;
+			pthread_cond_broadcast(&pool->done);
+		} else
+			pthread_cond_wait(&pool->work, &pool->lock);
 	}
+	pthread_mutex_unlock(&pool->lock);
+	return ((void*)NULL);
+}
 
-	ntfs_log_trace("Entering for inode 0x%llx, attr 0x%x, pos 0x%llx, count 0x%llx.\n",
-			(unsigned long long)na->ni->mft_no, le32_to_cpu(na->type),
-			(long long)pos, (long long)count);
-	data_flags = na->data_flags;
-	compression = na->ni->flags & FILE_ATTR_COMPRESSED;
-	if (!na->ni->vol || !b
-			|| ((data_flags & ATTR_COMPRESSION_MASK)
-				!= ATTR_IS_COMPRESSED)
-			|| pos < 0 || count < 0) {
-		errno = EINVAL;
-		return -1;
-	}
-	/*
-	 * Encrypted attributes are not supported.  We return access denied,
-	 * which is what Windows NT4 does, too.
-	 */
-	if (NAttrEncrypted(na)) {
-		errno = EACCES;
-		return -1;
-	}
-	if (!count)
-		return 0;
-	/* Truncate reads beyond end of attribute. */
-	if (pos + count > na->data_size) {
-		if (pos >= na->data_size) {
-			return 0;
+/*
+ *		Queue a job to the pool
+ */
+
+static void compress_submit(struct COMPRESS_POOL *pool,
+			struct COMPRESS_JOB *job)
+{
+	job->next = (struct COMPRESS_JOB*)NULL;
+	job->done = FALSE;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->last)
+		pool->last->next = job;
+	else
+		pool->first = job;
+	pool->last = job;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void compress_sync(struct COMPRESS_POOL *pool,
+			struct COMPRESS_JOB *job)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void compress_pool_free(struct COMPRESS_POOL *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = TRUE;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i=0; i<pool->count; i++)
+		pthread_join(pool->thread[i], (void**)NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static struct COMPRESS_POOL *compress_pool_alloc(int threads)
+{
+	struct COMPRESS_POOL *pool;
+
+	pool = (struct COMPRESS_POOL*)ntfs_calloc(
+				sizeof(struct COMPRESS_POOL));
+	if (pool) {
+		if (pthread_mutex_init(&pool->lock,
+				(pthread_mutexattr_t*)NULL)) {
+			free(pool);
+			errno = ENOMEM;
+			return ((struct COMPRESS_POOL*)NULL);
 		}
-		count = na->data_size - pos;
-	}
-	/* If it is a resident attribute, simply use ntfs_attr_pread(). */
-	if (!NAttrNonResident(na))
-		return ntfs_attr_pread(na, pos, count, b);
-	total = total2 = 0;
-	/* Zero out reads beyond initialized size. */
-	if (pos + count > na->initialized_size) {
-		if (pos >= na->initialized_size) {
-			memset(b, 0, count);
-			return count;
+		pthread_cond_init(&pool->work, (pthread_condattr_t*)NULL);
+		pthread_cond_init(&pool->done, (pthread_condattr_t*)NULL);
+		while ((pool->count < threads)
+		    && !pthread_create(&pool->thread[pool->count],
+				(pthread_attr_t*)NULL,
+				compress_worker, pool))
+			pool->count++;
+		if (pool->count < 2) {
+			compress_pool_free(pool);
+			pool = (struct COMPRESS_POOL*)NULL;
+			errno = EAGAIN;
 		}
-		total2 = pos + count - na->initialized_size;
-		count -= total2;
-		memset((u8*)b + count, 0, total2);
 	}
-	vol = na->ni->vol;
-	cb_size = na->compression_block_size;
-	cb_size_mask = cb_size - 1UL;
-	cb_clusters = na->compression_block_clusters;
-	
-	/* Need a temporary buffer for each loaded compression block. */
-	cb = (u8*)ntfs_malloc(cb_size);
-	if (!cb)
-		return -1;
-	
-	/* Need a temporary buffer for each uncompressed block. */
-	dest = (u8*)ntfs_malloc(cb_size);
-	if (!dest) {
-		free(cb);
-		return -1;
+	return (pool);
+}
+
+#else /* HAVE_PTHREAD_H */
+
+struct COMPRESS_POOL {
+	const struct NTFS_PROCESSORS *procs;
+	int count;			/* number of processors */
+	int queued;			/* number of jobs queued */
+	struct COMPRESS_JOB *queue[COMPRESS_MAX_THREADS
+				* DECOMPRESS_JOBS_PER_THREAD];
+} ;
+
+/*
+ *		Run a queued job on one of the processors
+ *
+ *	The decoders only set errno on failure, which is always
+ *	an overflow of the compressed data.
+ */
+
+static void compress_processor(void *arg, int index)
+{
+	struct COMPRESS_JOB *job;
+
+	job = ((struct COMPRESS_POOL*)arg)->queue[index];
+	job->err = (job->process(job) < 0 ? EOVERFLOW : 0);
+	job->done = TRUE;
+}
+
+/*
+ *		Dispatch the queued jobs to the processors
+ */
+
+static void compress_dispatch(struct COMPRESS_POOL *pool)
+{
+	const struct NTFS_PROCESSORS *procs;
+
+	procs = pool->procs;
+	if (pool->queued > 1)
+		procs->run(procs->data, compress_processor,
+				pool, pool->queued);
+	else
+		if (pool->queued)
+			compress_processor(pool, 0);
+	pool->queued = 0;
+}
+
+/*
+ *		Queue a job to the processors
+ *
+ *	Compressing allocates memory, so it is done immediately by
+ *	the requesting thread.
+ */
+
+static void compress_submit(struct COMPRESS_POOL *pool,
+			struct COMPRESS_JOB *job)
+{
+	if (job->process == compress_job) {
+		job->err = 0;
+		if (job->process(job) < 0)
+			job->err = (errno ? errno : EIO);
+		job->done = TRUE;
+	} else {
+		job->done = FALSE;
+		if (pool->queued >= (int)(sizeof(pool->queue)
+					/sizeof(pool->queue[0])))
+			compress_dispatch(pool);
+		pool->queue[pool->queued++] = job;
 	}
-	/*
-	 * The first vcn in the first compression block (cb) which we need to
-	 * decompress.
-	 */
-	start_vcn = (pos & ~cb_size_mask) >> vol->cluster_size_bits;
-	/* Offset in the uncompressed cb at which to start reading data. */
-	ofs = pos & cb_size_mask;
-	/*
-	 * The first vcn in the cb after the last cb which we need to
-	 * decompress.
-	 */
-	end_vcn = ((pos + count + cb_size - 1) & ~cb_size_mask) >>
-			vol->cluster_size_bits;
-	/* Number of compression blocks (cbs) in the wanted vcn range. */
-	nr_cbs = (end_vcn - start_vcn) << vol->cluster_size_bits >>
-			na->compression_block_size_bits;
-	cb_end = cb + cb_size;
-do_next_cb:
-	nr_cbs--;
-	cb_pos = cb;
-	vcn = start_vcn;
-	start_vcn += cb_clusters;
+}
 
-	/* Check whether the compression block is sparse. */
-	rl = ntfs_attr_find_vcn(na, vcn);
-	if (!rl || rl->lcn < LCN_HOLE) {
-		free(cb);
-		free(dest);
-		if (total)
-			return total;
-		/* FIXME: Do we want EIO or the error code? (AIA) */
-		errno = EIO;
-		return -1;
+static void compress_sync(struct COMPRESS_POOL *pool,
+			struct COMPRESS_JOB *job)
+{
+	if (!job->done)
+		compress_dispatch(pool);
+}
+
+static void compress_pool_free(struct COMPRESS_POOL *pool)
+{
+	compress_dispatch(pool);
+	free(pool);
+}
+
+static struct COMPRESS_POOL *compress_pool_alloc(
+			const struct NTFS_PROCESSORS *procs)
+{
+	struct COMPRESS_POOL *pool;
+
+	pool = (struct COMPRESS_POOL*)ntfs_calloc(
+				sizeof(struct COMPRESS_POOL));
+	if (pool) {
+		pool->procs = procs;
+		pool->count = (procs->count > COMPRESS_MAX_THREADS
+				? COMPRESS_MAX_THREADS : procs->count);
 	}
-	if (rl->lcn == LCN_HOLE) {
-		/* Sparse cb, zero out destination range overlapping the cb. */
-		ntfs_log_debug("Found sparse compression block.\n");
-		to_read = min(count, cb_size - ofs);
-		memset(b, 0, to_read);
-		ofs = 0;
-		total += to_read;
-		count -= to_read;
-		b = (u8*)b + to_read;
-	} else if (!ntfs_is_cb_compressed(na, rl, vcn, cb_clusters)) {
-		s64 tdata_size, tinitialized_size;
-		/*
-		 * Uncompressed cb, read it straight into the destination range
-		 * overlapping the cb.
-		 */
-		ntfs_log_debug("Found uncompressed compression block.\n");
-		/*
-		 * Read the uncompressed data into the destination buffer.
-		 * NOTE: We cheat a little bit here by marking the attribute as
-		 * not compressed in the ntfs_attr structure so that we can
-		 * read the data by simply using ntfs_attr_pread().  (-8
-		 * NOTE: we have to modify data_size and initialized_size
-		 * temporarily as well...
-		 */
-		to_read = min(count, cb_size - ofs);
-		ofs += vcn << vol->cluster_size_bits;
-		NAttrClearCompressed(na);
-		na->data_flags &= ~ATTR_COMPRESSION_MASK;
-		tdata_size = na->data_size;
-		tinitialized_size = na->initialized_size;
-		na->data_size = na->initialized_size = na->allocated_size;
-		do {
+	return (pool);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Set the compression level used when writing compressed files
+ *	Not set in ntfs_mount(), the default level is used unless
+ *	another one is requested by the application.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_set_compression_level(ntfs_volume *vol, int level)
+{
+	int res;
+
+	res = -1;
+	if (!vol || (level < NTFS_COMPRESS_FAST)
+	    || (level > NTFS_COMPRESS_BEST))
+		errno = EINVAL;
+	else {
+		vol->compression_level = level;
+		res = 0;
+	}
+	if (res)
+		ntfs_log_error("Invalid compression level %d\n", level);
+	return (res);
+}
+
+/*
+ *		Create or delete the pool of compression threads
+ *	Not set in ntfs_mount(), this has to be requested by the
+ *	application. A count of threads less than 2 deletes the pool.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_set_compress_threads(ntfs_volume *vol, int threads)
+{
+	int res;
+
+	res = -1;
+	if (!vol)
+		errno = EINVAL;
+	else {
+#ifdef HAVE_PTHREAD_H
+		if (vol->compress_pool) {
+			compress_pool_free(vol->compress_pool);
+			vol->compress_pool = (struct COMPRESS_POOL*)NULL;
+		}
+		if (threads > COMPRESS_MAX_THREADS)
+			threads = COMPRESS_MAX_THREADS;
+		if (threads > 1)
+			vol->compress_pool = compress_pool_alloc(threads);
+		if (vol->compress_pool || (threads <= 1))
+			res = 0;
+#else
+		if (threads > 1)
+			errno = ENOTSUP;
+		else {
+			if (vol->compress_pool) {
+				compress_pool_free(vol->compress_pool);
+				vol->compress_pool = (struct COMPRESS_POOL*)NULL;
+			}
+			res = 0;
+		}
+#endif
+	}
+	if (res)
+		ntfs_log_perror("Failed to create compression threads");
+	return (res);
+}
+
+/*
+ *		Decompress on processors provided by the environment
+ *	Only available without threads, the processors are described
+ *	by @procs, which must stay valid until the pool is deleted by
+ *	a NULL @procs or a count of processors less than 2.
+ *
+ *	Returns zero if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_set_compress_processors(ntfs_volume *vol,
+			const struct NTFS_PROCESSORS *procs)
+{
+	int res;
+
+	res = -1;
+	if (!vol || (procs && !procs->run))
+		errno = EINVAL;
+	else {
+#ifdef HAVE_PTHREAD_H
+		if (procs && (procs->count > 1))
+			errno = ENOTSUP;
+		else
+			res = ntfs_set_compress_threads(vol, 0);
+#else
+		if (vol->compress_pool) {
+			compress_pool_free(vol->compress_pool);
+			vol->compress_pool = (struct COMPRESS_POOL*)NULL;
+		}
+		if (procs && (procs->count > 1))
+			vol->compress_pool = compress_pool_alloc(procs);
+		if (vol->compress_pool || !procs || (procs->count <= 1))
+			res = 0;
+#endif
+	}
+	if (res)
+		ntfs_log_perror("Failed to set the compression processors");
+	return (res);
+}
+
+#if CACHE_CBLOCK_SIZE
+
+/*
+ *		Cache of decompressed compression blocks
+ *
+ *	Small reads from a compressed file would otherwise read and
+ *	decompress the same compression block again and again. Only the
+ *	blocks partially requested are cached, as the full blocks of big
+ *	reads are not likely to be requested again soon.
+ *
+ *	The blocks are identified by the inode number and the vcn, only
+ *	the unnamed data attribute is cached. All the blocks of an inode
+ *	are invalidated when its data is written or truncated.
+ */
+
+int ntfs_compressed_cblock_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_CBLOCK *cblock;
+
+	cblock = (const struct CACHED_CBLOCK*)item;
+	return ((cblock->inum + (cblock->vcn >> 4)) & INT_MAX);
+}
+
+static int cblock_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_CBLOCK *c;
+	const struct CACHED_CBLOCK *w;
+
+	c = (const struct CACHED_CBLOCK*)cached;
+	w = (const struct CACHED_CBLOCK*)wanted;
+	return ((c->inum != w->inum) || (c->vcn != w->vcn));
+}
+
+static int cblock_cache_inv_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	return (((const struct CACHED_CBLOCK*)cached)->inum
+			!= ((const struct CACHED_CBLOCK*)wanted)->inum);
+}
+
+/*
+ *		Check whether the blocks of an attribute may be cached
+ */
+
+static BOOL cblock_cacheable(ntfs_attr *na)
+{
+	return (na->ni->vol->cblock_cache
+		&& (na->type == AT_DATA) && !na->name_len);
+}
+
+/*
+ *		Get the decompressed data of a compression block from cache
+ *	The attribute must be cacheable
+ *
+ *	Returns the data, or NULL if not cached
+ */
+
+static const u8 *cblock_fetch(ntfs_attr *na, VCN vcn)
+{
+	struct CACHED_CBLOCK item;
+	struct CACHED_CBLOCK *cached;
+	const u8 *data;
+
+	data = (const u8*)NULL;
+	item.inum = na->ni->mft_no;
+	item.vcn = vcn;
+	cached = (struct CACHED_CBLOCK*)ntfs_fetch_cache(
+			na->ni->vol->cblock_cache,
+			GENERIC(&item), cblock_cache_compare);
+	if (cached && (cached->datasize == na->compression_block_size))
+		data = cached->data;
+	return (data);
+}
+
+/*
+ *		Enter the decompressed data of a compression block into cache
+ *	The attribute must be cacheable
+ */
+
+static void cblock_enter(ntfs_attr *na, VCN vcn, const u8 *data)
+{
+	struct CACHED_CBLOCK item;
+
+	item.inum = na->ni->mft_no;
+	item.vcn = vcn;
+	item.data = data;
+	item.datasize = na->compression_block_size;
+	ntfs_enter_cache(na->ni->vol->cblock_cache, GENERIC(&item),
+			cblock_cache_compare);
+}
+
+/*
+ *		Invalidate the cached blocks of an inode
+ */
+
+void ntfs_compressed_invalidate(ntfs_volume *vol, u64 inum)
+{
+	struct CACHED_CBLOCK item;
+
+	if (vol->cblock_cache && vol->cblock_cache->most_recent_entry) {
+		item.inum = inum;
+		item.vcn = 0;
+		item.data = (const u8*)NULL;
+		item.datasize = 0;
+		ntfs_invalidate_cache(vol->cblock_cache, GENERIC(&item),
+				cblock_cache_inv_compare, CACHE_NOHASH);
+	}
+}
+
+#endif /* CACHE_CBLOCK_SIZE */
+
+/*
+ *		Allocate the jobs for decompressing the blocks of a read
+ *
+ *	Returns NULL if the blocks have to be decompressed serially
+ */
+
+static struct COMPRESS_JOB *decompress_jobs_alloc(ntfs_volume *vol,
+			unsigned int nr_cbs, u32 cb_size, int *pcount)
+{
+	struct COMPRESS_JOB *jobs;
+	u8 *buffers;
+	int count;
+	int i;
+
+	jobs = (struct COMPRESS_JOB*)NULL;
+	if (vol->compress_pool && (nr_cbs > 1)) {
+		count = vol->compress_pool->count
+				* DECOMPRESS_JOBS_PER_THREAD;
+		if ((unsigned int)count > nr_cbs)
+			count = nr_cbs;
+		jobs = (struct COMPRESS_JOB*)ntfs_malloc(
+			count*(sizeof(struct COMPRESS_JOB) + 2*cb_size));
+		if (jobs) {
+			buffers = (u8*)&jobs[count];
+			for (i=0; i<count; i++) {
+				jobs[i].process = decompress_job;
+				jobs[i].cb = &buffers[2*i*cb_size];
+				jobs[i].buf = &buffers[(2*i + 1)*cb_size];
+			}
+			*pcount = count;
+		}
+	}
+	return (jobs);
+}
+
+/*
+ *		Wait for the pending jobs up to a given one, oldest first,
+ *	counting the data of the successful ones until one fails
+ *
+ *	Returns zero if all were successful, -1 otherwise (errno set)
+ */
+
+static int decompress_jobs_sync(struct COMPRESS_POOL *pool,
+			struct COMPRESS_JOB *jobs, int count,
+			unsigned int *poldest, unsigned int until, s64 *ptotal)
+{
+	struct COMPRESS_JOB *job;
+	int err;
+
+	err = 0;
+	while (*poldest != until) {
+		job = &jobs[*poldest % count];
+		compress_sync(pool, job);
+		if (!err && job->err)
+			err = job->err;
+		if (!err) {
+			if (job->dest != job->copy_to)
+				memcpy(job->copy_to,
+					&job->dest[job->copy_ofs],
+					job->copy_count);
+#if CACHE_CBLOCK_SIZE
+			if (job->cache_na)
+				cblock_enter(job->cache_na, job->vcn,
+						job->dest);
+#endif
+			*ptotal += job->copy_count;
+		}
+		(*poldest)++;
+	}
+	if (err) {
+		errno = err;
+		ntfs_log_perror("Failed to decompress file");
+	}
+	return (err ? -1 : 0);
+}
+
+/*
+ *		Compress the sub-blocks of a compression block in parallel
+ *
+ *	Each sub-block is compressed into its own buffer, big enough
+ *	for the header and an uncompressed sub-block, as a failure
+ *	is only detected when assembling them.
+ *
+ *	Returns the jobs, all done,
+ *		or NULL if the sub-blocks have to be compressed serially
+ */
+
+static struct COMPRESS_JOB *compress_jobs_run(ntfs_volume *vol,
+			const char *inbuf, u32 insz,
+			const struct COMPRESS_LEVEL *plevel)
+{
+	struct COMPRESS_POOL *pool;
+	struct COMPRESS_JOB *jobs;
+	char *buffers;
+	u32 p;
+	int count;
+	int i;
+
+	jobs = (struct COMPRESS_JOB*)NULL;
+	pool = vol->compress_pool;
+	if (pool && (insz > NTFS_SB_SIZE)) {
+		count = (insz + NTFS_SB_SIZE - 1)/NTFS_SB_SIZE;
+		jobs = (struct COMPRESS_JOB*)ntfs_malloc(count
+			*(sizeof(struct COMPRESS_JOB) + NTFS_SB_SIZE + 4));
+		if (jobs) {
+			buffers = (char*)&jobs[count];
+			for (i=0, p=0; i<count; i++, p+=NTFS_SB_SIZE) {
+				jobs[i].process = compress_job;
+				jobs[i].inbuf = &inbuf[p];
+				jobs[i].insz = ((p + NTFS_SB_SIZE) < insz
+						? NTFS_SB_SIZE : insz - p);
+				jobs[i].outbuf = &buffers[i*(NTFS_SB_SIZE + 4)];
+				jobs[i].plevel = plevel;
+				compress_submit(pool, &jobs[i]);
+			}
+			for (i=0; i<count; i++)
+				compress_sync(pool, &jobs[i]);
+		}
+	}
+	return (jobs);
+}
+
+/*
+ *		Get in place the compressed data of a compression block
+ *
+ *	This is possible when the device can be accessed in place, and
+ *	the allocated clusters of the cb are contiguous, the rest of the
+ *	cb being sparse. The data is then decompressed with no copy.
+ *
+ *	Returns the compressed data, with its size set into *psize,
+ *		or NULL if it has to be read
+ */
+
+static const u8 *compressed_in_place(ntfs_attr *na, VCN vcn,
+			unsigned int cb_clusters, u32 *psize)
+{
+	ntfs_volume *vol;
+	runlist_element *rl;
+	const u8 *data;
+	s64 count;
+
+	data = (const u8*)NULL;
+	vol = na->ni->vol;
+	if (NDevMapped(vol->dev)) {
+		rl = ntfs_attr_find_vcn(na, vcn);
+		if (rl && (rl->lcn >= 0)) {
+			count = rl->vcn + rl->length - vcn;
+			if ((count < (s64)cb_clusters)
+			    && (rl[1].lcn == LCN_HOLE)) {
+				count <<= vol->cluster_size_bits;
+				data = (const u8*)ntfs_pmap(vol->dev,
+					(rl->lcn + vcn - rl->vcn)
+						<< vol->cluster_size_bits,
+					count);
+				*psize = count;
+			}
+		}
+	}
+	return (data);
+}
+
+/*
+ *		Read the raw data of a compressed compression block
+ *
+ *	Returns 0 if successful, -1 otherwise (with errno set)
+ */
+
+static int read_raw_cb(ntfs_attr *na, VCN vcn, u8 *raw, u32 cb_size)
+{
+	s64 tdata_size, tinitialized_size;
+	ATTR_FLAGS data_flags;
+	FILE_ATTR_FLAGS compression;
+	ntfs_volume *vol;
+	u8 *cb_pos, *cb_end;
+	s64 to_read, br;
+	int err;
+
+	vol = na->ni->vol;
+	data_flags = na->data_flags;
+	compression = na->ni->flags & FILE_ATTR_COMPRESSED;
+	cb_pos = raw;
+	cb_end = raw + cb_size;
+	to_read = cb_size;
+	/*
+	 * NOTE: We cheat a little bit here by marking the attribute as
+	 * not compressed in the ntfs_attr structure so that we can
+	 * read the raw, compressed data by simply using
+	 * ntfs_attr_pread().  (-8
+	 * NOTE: We have to modify data_size and initialized_size
+	 * temporarily as well...
+	 */
+	NAttrClearCompressed(na);
+	na->data_flags &= ~ATTR_COMPRESSION_MASK;
+	tdata_size = na->data_size;
+	tinitialized_size = na->initialized_size;
+	na->data_size = na->initialized_size = na->allocated_size;
+	do {
+		br = ntfs_attr_pread(na,
+				(vcn << vol->cluster_size_bits) +
+				(cb_pos - raw), to_read, cb_pos);
+		if (br <= 0) {
+			if (!br) {
+				ntfs_log_error("Failed to read a"
+					" compressed cluster, "
+					" inode %lld offs 0x%llx\n",
+					(long long)na->ni->mft_no,
+					(long long)(vcn << vol->cluster_size_bits));
+				errno = EIO;
+			}
+			err = errno;
+			na->data_size = tdata_size;
+			na->initialized_size = tinitialized_size;
+			na->ni->flags |= compression;
+			na->data_flags = data_flags;
+			errno = err;
+			return (-1);
+		}
+		cb_pos += br;
+		to_read -= br;
+	} while (to_read > 0);
+	na->data_size = tdata_size;
+	na->initialized_size = tinitialized_size;
+	na->ni->flags |= compression;
+	na->data_flags = data_flags;
+	/* Just a precaution. */
+	if (cb_pos + 2 <= cb_end)
+		*(u16*)cb_pos = 0;
+	return (0);
+}
+
+/**
+ * ntfs_compressed_attr_pread - read from a compressed attribute
+ * @na:		ntfs attribute to read from
+ * @pos:	byte position in the attribute to begin reading from
+ * @count:	number of bytes to read
+ * @b:		output data buffer
+ *
+ * NOTE:  You probably want to be using attrib.c::ntfs_attr_pread() instead.
+ *
+ * This function will read @count bytes starting at offset @pos from the
+ * compressed ntfs attribute @na into the data buffer @b.
+ *
+ * On success, return the number of successfully read bytes.  If this number
+ * is lower than @count this means that the read reached end of file or that
+ * an error was encountered during the read so that the read is partial.
+ * 0 means end of file or nothing was read (also return 0 when @count is 0).
+ *
+ * On error and nothing has been read, return -1 with errno set appropriately
+ * to the return code of ntfs_pread(), or to EINVAL in case of invalid
+ * arguments.
+ */
+static s64 ntfs_compressed_attr_pread_i(ntfs_attr *na, s64 pos, s64 count,
+		void *b)
+{
+	s64 br, to_read, ofs, total, total2;
+	u64 cb_size_mask;
+	VCN start_vcn, vcn, end_vcn;
+	ntfs_volume *vol;
+	runlist_element *rl;
+	u8 *dest, *cb;
+	u32 cb_size;
+	int err;
+	ATTR_FLAGS data_flags;
+	FILE_ATTR_FLAGS compression;
+	unsigned int nr_cbs, cb_clusters;
+	struct COMPRESS_POOL *pool;
+	struct COMPRESS_JOB *jobs, *job;
+	unsigned int next, oldest;
+	int njobs;
+	u8 *raw;
+	const u8 *cached;
+	BOOL sparse, plain;
+	BOOL cacheable;
+
+	if (!na || !na->ni) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ntfs_log_trace("Entering for inode 0x%llx, attr 0x%x, pos 0x%llx, count 0x%llx.\n",
+			(unsigned long long)na->ni->mft_no, le32_to_cpu(na->type),
+			(long long)pos, (long long)count);
+	data_flags = na->data_flags;
+	compression = na->ni->flags & FILE_ATTR_COMPRESSED;
+	if (!na->ni->vol || !b
+			|| ((data_flags & ATTR_COMPRESSION_MASK)
+				!= ATTR_IS_COMPRESSED)
+			|| pos < 0 || count < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/*
+	 * Encrypted attributes are not supported.  We return access denied,
+	 * which is what Windows NT4 does, too.
+	 */
+	if (NAttrEncrypted(na)) {
+		errno = EACCES;
+		return -1;
+	}
+	if (!count)
+		return 0;
+	/* Truncate reads beyond end of attribute. */
+	if (pos + count > na->data_size) {
+		if (pos >= na->data_size) {
+			return 0;
+		}
+		count = na->data_size - pos;
+	}
+	/* If it is a resident attribute, simply use ntfs_attr_pread(). */
+	if (!NAttrNonResident(na))
+		return ntfs_attr_pread(na, pos, count, b);
+	total = total2 = 0;
+	/* Zero out reads beyond initialized size. */
+	if (pos + count > na->initialized_size) {
+		if (pos >= na->initialized_size) {
+			memset(b, 0, count);
+			return count;
+		}
+		total2 = pos + count - na->initialized_size;
+		count -= total2;
+		memset((u8*)b + count, 0, total2);
+	}
+	vol = na->ni->vol;
+	cb_size = na->compression_block_size;
+	cb_size_mask = cb_size - 1UL;
+	cb_clusters = na->compression_block_clusters;
+	
+	/* Need a temporary buffer for each loaded compression block. */
+	cb = (u8*)ntfs_malloc(cb_size);
+	if (!cb)
+		return -1;
+	
+	/* Need a temporary buffer for each uncompressed block. */
+	dest = (u8*)ntfs_malloc(cb_size);
+	if (!dest) {
+		free(cb);
+		return -1;
+	}
+	/*
+	 * The first vcn in the first compression block (cb) which we need to
+	 * decompress.
+	 */
+	start_vcn = (pos & ~cb_size_mask) >> vol->cluster_size_bits;
+	/* Offset in the uncompressed cb at which to start reading data. */
+	ofs = pos & cb_size_mask;
+	/*
+	 * The first vcn in the cb after the last cb which we need to
+	 * decompress.
+	 */
+	end_vcn = ((pos + count + cb_size - 1) & ~cb_size_mask) >>
+			vol->cluster_size_bits;
+	/* Number of compression blocks (cbs) in the wanted vcn range. */
+	nr_cbs = (end_vcn - start_vcn) << vol->cluster_size_bits >>
+			na->compression_block_size_bits;
+	/* Cache the cbs partially read, if possible */
+#if CACHE_CBLOCK_SIZE
+	cacheable = cblock_cacheable(na);
+#else
+	cacheable = FALSE;
+#endif
+	/* Decompress in parallel if there are several cbs */
+	pool = vol->compress_pool;
+	njobs = 0;
+	job = (struct COMPRESS_JOB*)NULL;
+	jobs = decompress_jobs_alloc(vol, nr_cbs, cb_size, &njobs);
+	next = oldest = 0;
+do_next_cb:
+	nr_cbs--;
+	vcn = start_vcn;
+	start_vcn += cb_clusters;
+
+	/* Check whether the compression block is sparse. */
+	rl = ntfs_attr_find_vcn(na, vcn);
+	if (!rl || rl->lcn < LCN_HOLE) {
+		/* FIXME: Do we want EIO or the error code? (AIA) */
+		errno = EIO;
+		goto failed;
+	}
+	sparse = (rl->lcn == LCN_HOLE);
+	plain = !sparse && !ntfs_is_cb_compressed(na, rl, vcn, cb_clusters);
+	cached = (const u8*)NULL;
+#if CACHE_CBLOCK_SIZE
+	if (cacheable && !sparse && !plain)
+		cached = cblock_fetch(na, vcn);
+#endif
+	/* Keep the data in order, if the cb is not decompressed */
+	if (jobs && (sparse || plain || cached)) {
+		if (decompress_jobs_sync(pool, jobs, njobs, &oldest,
+				next, &total))
+			goto failed;
+#if CACHE_CBLOCK_SIZE
+		/* the pending cbs may have evicted the cached one */
+		if (cached)
+			cached = cblock_fetch(na, vcn);
+#endif
+	}
+	if (sparse) {
+		/* Sparse cb, zero out destination range overlapping the cb. */
+		ntfs_log_debug("Found sparse compression block.\n");
+		to_read = min(count, cb_size - ofs);
+		memset(b, 0, to_read);
+		ofs = 0;
+		total += to_read;
+		count -= to_read;
+		b = (u8*)b + to_read;
+	} else if (cached) {
+		/* Compressed cb already decompressed, copy from cache. */
+		ntfs_log_debug("Found cached compression block.\n");
+		to_read = min(count, cb_size - ofs);
+		memcpy(b, cached + ofs, to_read);
+		ofs = 0;
+		total += to_read;
+		count -= to_read;
+		b = (u8*)b + to_read;
+	} else if (plain) {
+		s64 tdata_size, tinitialized_size;
+		/*
+		 * Uncompressed cb, read it straight into the destination range
+		 * overlapping the cb.
+		 */
+		ntfs_log_debug("Found uncompressed compression block.\n");
+		/*
+		 * Read the uncompressed data into the destination buffer.
+		 * NOTE: We cheat a little bit here by marking the attribute as
+		 * not compressed in the ntfs_attr structure so that we can
+		 * read the data by simply using ntfs_attr_pread().  (-8
+		 * NOTE: we have to modify data_size and initialized_size
+		 * temporarily as well...
+		 */
+		to_read = min(count, cb_size - ofs);
+		ofs += vcn << vol->cluster_size_bits;
+		NAttrClearCompressed(na);
+		na->data_flags &= ~ATTR_COMPRESSION_MASK;
+		tdata_size = na->data_size;
+		tinitialized_size = na->initialized_size;
+		na->data_size = na->initialized_size = na->allocated_size;
+		do {
 			br = ntfs_attr_pread(na, ofs, to_read, b);
 			if (br <= 0) {
 				if (!br) {
@@ -865,12 +1759,8 @@ do_next_cb:
 				na->initialized_size = tinitialized_size;
 				na->ni->flags |= compression;
 				na->data_flags = data_flags;
-				free(cb);
-				free(dest);
-				if (total)
-					return total;
 				errno = err;
-				return br;
+				goto failed;
 			}
 			total += br;
 			count -= br;
@@ -884,7 +1774,8 @@ do_next_cb:
 		na->data_flags = data_flags;
 		ofs = 0;
 	} else {
-		s64 tdata_size, tinitialized_size;
+		const u8 *src;
+		u32 src_size;
 		u32 decompsz;
 
 		/*
@@ -893,70 +1784,62 @@ do_next_cb:
 		 */
 		ntfs_log_debug("Found compressed compression block.\n");
 		/*
-		 * Read the compressed data into the temporary buffer.
-		 * NOTE: We cheat a little bit here by marking the attribute as
-		 * not compressed in the ntfs_attr structure so that we can
-		 * read the raw, compressed data by simply using
-		 * ntfs_attr_pread().  (-8
-		 * NOTE: We have to modify data_size and initialized_size
-		 * temporarily as well...
+		 * Get the compressed data in place if possible, otherwise
+		 * read it into the temporary buffer.
 		 */
-		to_read = cb_size;
-		NAttrClearCompressed(na);
-		na->data_flags &= ~ATTR_COMPRESSION_MASK;
-		tdata_size = na->data_size;
-		tinitialized_size = na->initialized_size;
-		na->data_size = na->initialized_size = na->allocated_size;
-		do {
-			br = ntfs_attr_pread(na,
-					(vcn << vol->cluster_size_bits) +
-					(cb_pos - cb), to_read, cb_pos);
-			if (br <= 0) {
-				if (!br) {
-					ntfs_log_error("Failed to read a"
-						" compressed cluster, "
-						" inode %lld offs 0x%llx\n",
-						(long long)na->ni->mft_no,
-						(long long)(vcn << vol->cluster_size_bits));
-					errno = EIO;
-				}
-				err = errno;
-				na->data_size = tdata_size;
-				na->initialized_size = tinitialized_size;
-				na->ni->flags |= compression;
-				na->data_flags = data_flags;
-				free(cb);
-				free(dest);
-				if (total)
-					return total;
-				errno = err;
-				return br;
-			}
-			cb_pos += br;
-			to_read -= br;
-		} while (to_read > 0);
-		na->data_size = tdata_size;
-		na->initialized_size = tinitialized_size;
-		na->ni->flags |= compression;
-		na->data_flags = data_flags;
-		/* Just a precaution. */
-		if (cb_pos + 2 <= cb_end)
-			*(u16*)cb_pos = 0;
+		if (jobs) {
+			job = &jobs[next % njobs];
+			/* reuse the buffers of the oldest job */
+			if (((next - oldest) >= (unsigned int)njobs)
+			    && decompress_jobs_sync(pool, jobs, njobs,
+					&oldest, oldest + 1, &total))
+				goto failed;
+			raw = job->cb;
+		} else
+			raw = cb;
+		src = compressed_in_place(na, vcn, cb_clusters, &src_size);
+		if (!src) {
+			if (read_raw_cb(na, vcn, raw, cb_size))
+				goto failed;
+			src = raw;
+			src_size = cb_size;
+		}
 		ntfs_log_debug("Successfully read the compression block.\n");
-		/* Do not decompress beyond the requested block */
+		/*
+		 * Do not decompress beyond the requested block, unless
+		 * the cb is partially requested and can be cached.
+		 */
 		to_read = min(count, cb_size - ofs);
-		decompsz = ((ofs + to_read - 1) | (NTFS_SB_SIZE - 1)) + 1;
-		if (ntfs_decompress(dest, decompsz, cb, cb_size) < 0) {
-			err = errno;
-			free(cb);
-			free(dest);
-			if (total)
-				return total;
-			errno = err;
-			return -1;
+		if (cacheable && (to_read < cb_size))
+			decompsz = cb_size;
+		else
+			decompsz = ((ofs + to_read - 1)
+					| (NTFS_SB_SIZE - 1)) + 1;
+		if (jobs) {
+			/* decompress a full cb in place */
+			job->src = src;
+			job->cb_size = src_size;
+			job->dest = (!ofs && (decompsz == to_read)
+					? (u8*)b : job->buf);
+			job->dest_size = decompsz;
+			job->copy_to = (u8*)b;
+			job->copy_ofs = ofs;
+			job->copy_count = to_read;
+			job->cache_na = (cacheable && (to_read < cb_size)
+					? na : (ntfs_attr*)NULL);
+			job->vcn = vcn;
+			compress_submit(pool, job);
+			next++;
+		} else {
+			if (ntfs_decompress(dest, decompsz, src, src_size) < 0)
+				goto failed;
+			memcpy(b, dest + ofs, to_read);
+#if CACHE_CBLOCK_SIZE
+			if (cacheable && (to_read < cb_size))
+				cblock_enter(na, vcn, dest);
+#endif
+			total += to_read;
 		}
-		memcpy(b, dest + ofs, to_read);
-		total += to_read;
 		count -= to_read;
 		b = (u8*)b + to_read;
 		ofs = 0;
@@ -964,11 +1847,53 @@ do_next_cb:
 	/* Do we have more work to do? */
 	if (nr_cbs)
 		goto do_next_cb;
+	/* Wait for the cbs still being decompressed. */
+	if (jobs) {
+		if (decompress_jobs_sync(pool, jobs, njobs, &oldest,
+				next, &total))
+			goto failed;
+		free(jobs);
+	}
 	/* We no longer need the buffers. */
 	free(cb);
 	free(dest);
 	/* Return number of bytes read. */
 	return total + total2;
+failed:
+	err = errno;
+	if (jobs) {
+		/* the data beyond the failed cb is not counted */
+		decompress_jobs_sync(pool, jobs, njobs, &oldest, next, &total);
+		free(jobs);
+	}
+	free(cb);
+	free(dest);
+	if (total)
+		return total;
+	errno = err;
+	return -1;
+}
+
+/*
+ *		Read from a compressed attribute, see above
+ *
+ *	This only fires the tracepoints around the actual reading.
+ */
+
+s64 ntfs_compressed_attr_pread(ntfs_attr *na, s64 pos, s64 count, void *b)
+{
+	s64 res;
+
+	if (!na || !na->ni) {
+		errno = EINVAL;
+		return -1;
+	}
+	NTFS_PROBE4(compressed_pread_entry, na->ni->mft_no,
+			le32_to_cpu(na->type), pos, count);
+	res = ntfs_compressed_attr_pread_i(na, pos, count, b);
+	NTFS_PROBE3(compressed_pread_return, na->ni->mft_no,
+			le32_to_cpu(na->type), res);
+	return (res);
 }
 
 /*
@@ -980,36 +1905,40 @@ do_next_cb:
 static u32 read_clusters(ntfs_volume *vol, const runlist_element *rl,
 			s64 offs, u32 to_read, char *inbuf)
 {
-	u32 count;
-	int xgot;
+	struct ntfs_io_segment seg[NTFS_MAX_IO_SEGMENTS];
+	s64 count;
+	s64 xgot;
 	u32 got;
-	s64 xpos;
-	BOOL first;
-	char *xinbuf;
+	u32 wanted;
+	int nseg;
 	const runlist_element *xrl;
 
 	got = 0;
 	xrl = rl;
-	xinbuf = inbuf;
-	first = TRUE;
 	do {
-		count = xrl->length << vol->cluster_size_bits;
-		xpos = xrl->lcn << vol->cluster_size_bits;
-		if (first) {
-			count -= offs;
-			xpos += offs;
-		}
-		if ((to_read - got) < count)
-			count = to_read - got;
-		xgot = ntfs_pread(vol->dev, xpos, count, xinbuf);
-		if (xgot == (int)count) {
-			got += count;
-			xpos += count;
-			xinbuf += count;
+		/* gather the runs into a single batched read */
+		nseg = 0;
+		wanted = 0;
+		while ((nseg < NTFS_MAX_IO_SEGMENTS)
+		    && ((got + wanted) < to_read)) {
+			count = xrl->length << vol->cluster_size_bits;
+			seg[nseg].pos = xrl->lcn << vol->cluster_size_bits;
+			if (xrl == rl) {
+				count -= offs;
+				seg[nseg].pos += offs;
+			}
+			if ((to_read - got - wanted) < count)
+				count = to_read - got - wanted;
+			seg[nseg].count = count;
+			seg[nseg].buf = &inbuf[got + wanted];
+			wanted += count;
+			nseg++;
 			xrl++;
 		}
-		first = FALSE;
-	} while ((xgot == (int)count) && (got < to_read));
+		xgot = ntfs_preadv(vol->dev, seg, nseg);
+		if (xgot > 0)
+			got += xgot;
+	} while ((xgot == (s64)wanted) && (got < to_read));
 	return (got);
 }
 
@@ -1022,42 +1951,128 @@ static u32 read_clusters(ntfs_volume *vol, const runlist_element *rl,
 static s32 write_clusters(ntfs_volume *vol, const runlist_element *rl,
 			s64 offs, s32 to_write, const char *outbuf)
 {
-	s32 count;
-	s32 put, xput;
-	s64 xpos;
-	BOOL first;
-	const char *xoutbuf;
+	struct ntfs_io_segment seg[NTFS_MAX_IO_SEGMENTS];
+	s64 count;
+	s64 xput;
+	s32 put;
+	s32 wanted;
+	int nseg;
 	const runlist_element *xrl;
 
 	put = 0;
 	xrl = rl;
-	xoutbuf = outbuf;
-	first = TRUE;
 	do {
-		count = xrl->length << vol->cluster_size_bits;
-		xpos = xrl->lcn << vol->cluster_size_bits;
-		if (first) {
-			count -= offs;
-			xpos += offs;
-		}
-		if ((to_write - put) < count)
-			count = to_write - put;
-		xput = ntfs_pwrite(vol->dev, xpos, count, xoutbuf);
-		if (xput == count) {
-			put += count;
-			xpos += count;
-			xoutbuf += count;
+		/* gather the runs into a single batched write */
+		nseg = 0;
+		wanted = 0;
+		while ((nseg < NTFS_MAX_IO_SEGMENTS)
+		    && ((put + wanted) < to_write)) {
+			count = xrl->length << vol->cluster_size_bits;
+			seg[nseg].pos = xrl->lcn << vol->cluster_size_bits;
+			if (xrl == rl) {
+				count -= offs;
+				seg[nseg].pos += offs;
+			}
+			if ((to_write - put - wanted) < count)
+				count = to_write - put - wanted;
+			seg[nseg].count = count;
+			seg[nseg].buf = (void*)&outbuf[put + wanted];
+			wanted += count;
+			nseg++;
 			xrl++;
 		}
-		first = FALSE;
-	} while ((xput == count) && (put < to_write));
+		xput = ntfs_pwritev(vol->dev, seg, nseg);
+		if (xput > 0)
+			put += xput;
+	} while ((xput == (s64)wanted) && (put < to_write));
 	return (put);
 }
 
 
+/*
+ *		Check whether a compression block looks incompressible
+ *
+ *	LZNT1 only gains from repeated sequences, which are rare in data
+ *	whose bytes are spread evenly over all values, such as already
+ *	compressed or encrypted data (JPEG, ZIP, video...). One byte out
+ *	of COMPRESS_SAMPLE_STEP is sampled, at a varying offset so that
+ *	records of fixed size are not always sampled at the same place,
+ *	and the data is deemed incompressible when two sampled bytes are
+ *	about as rarely equal as in random data (once per 256 pairs).
+ *	Zeroes and data too small to get a significant sample are never
+ *	rejected.
+ */
+
+static BOOL ntfs_incompressible(const char *inbuf, u32 insz)
+{
+	unsigned int count[256];
+	const u8 *p;
+	u32 samples;
+	u64 collisions;
+	u64 pairs;
+	u32 i;
+
+	samples = insz/COMPRESS_SAMPLE_STEP;
+	if (samples < COMPRESS_MIN_SAMPLES)
+		return (FALSE);
+	memset(count, 0, sizeof(count));
+	p = (const u8*)inbuf;
+	for (i=0; i<samples; i++)
+		count[p[i*COMPRESS_SAMPLE_STEP
+				+ (i & (COMPRESS_SAMPLE_STEP - 1))]]++;
+	collisions = 0;
+	for (i=0; i<256; i++)
+		if (count[i] > 1)
+			collisions += (u64)count[i]*(count[i] - 1);
+	pairs = (u64)samples*(samples - 1);
+	return ((collisions*COMPRESS_RANDOM_RATIO) < pairs);
+}
+
+/*
+ *		Record a compression block which could not be compressed
+ *
+ *	After COMPRESS_BACKOFF_FAILS successive failures in a file, the
+ *	next blocks are written uncompressed without trying, their count
+ *	doubling on each new failure, up to COMPRESS_BACKOFF_MAX, so that
+ *	copying media files stops wasting time. A successful compression
+ *	resets the count.
+ */
+
+static void ntfs_comp_failed(ntfs_inode *ni)
+{
+	unsigned int shift;
+
+	if (ni->comp_failures < 0xffff)
+		ni->comp_failures++;
+	if (ni->comp_failures >= COMPRESS_BACKOFF_FAILS) {
+		shift = ni->comp_failures - COMPRESS_BACKOFF_FAILS;
+		if (shift >= 16
+		    || ((1U << shift) >= COMPRESS_BACKOFF_MAX))
+			ni->comp_skipped = COMPRESS_BACKOFF_MAX;
+		else
+			ni->comp_skipped = 1 << shift;
+	}
+}
+
+/*
+ *		Check whether a buffer is only made of zeroes
+ */
+
+static BOOL ntfs_all_zeroes(const char *inbuf, u32 insz)
+{
+	u32 i;
+
+	for (i=0; (i<insz) && !inbuf[i]; i++) { }
+	return (i >= insz);
+}
+
 /*
  *		Compress and write a set of blocks
  *
+ *	Data which looks incompressible, or belongs to a file whose
+ *	previous blocks could not be compressed, is not compressed,
+ *	as if compression had failed, unless it is all zeroes.
+ *
  *	returns the size actually written (rounded to a full cluster)
  *		or 0 if all zeroes (nothing is written)
  *		or -1 if could not compress (nothing is written)
@@ -1068,6 +2083,9 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 			s64 offs, u32 insz, const char *inbuf)
 {
 	ntfs_volume *vol;
+	ntfs_inode *ni;
+	const struct COMPRESS_LEVEL *plevel;
+	struct COMPRESS_JOB *jobs;
 	char *outbuf;
 	char *pbuf;
 	u32 compsz;
@@ -1088,7 +2106,22 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 
 	vol = na->ni->vol;
 	written = -1; /* default return */
+	ni = na->ni;
+	if (ni->comp_skipped && !ntfs_all_zeroes(inbuf, insz)) {
+		ni->comp_skipped--;
+		return (-1);
+	}
+	if (ntfs_incompressible(inbuf, insz)) {
+		ntfs_comp_failed(ni);
+		return (-1);
+	}
 	clsz = 1 << vol->cluster_size_bits;
+	if (vol->compression_level)
+		plevel = &compress_levels[vol->compression_level
+					- NTFS_COMPRESS_FAST];
+	else
+		plevel = &compress_levels[NTFS_COMPRESS_DEFAULT
+					- NTFS_COMPRESS_FAST];
 		/* may need 2 extra bytes per block and 2 more bytes */
 	outbuf = (char*)ntfs_malloc(na->compression_block_size
 			+ 2*(na->compression_block_size/NTFS_SB_SIZE)
@@ -1097,13 +2130,23 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 		fail = FALSE;
 		compsz = 0;
 		allzeroes = TRUE;
+		jobs = compress_jobs_run(vol, inbuf, insz, plevel);
 		for (p=0; (p<insz) && !fail; p+=NTFS_SB_SIZE) {
 			if ((p + NTFS_SB_SIZE) < insz)
 				bsz = NTFS_SB_SIZE;
 			else
 				bsz = insz - p;
 			pbuf = &outbuf[compsz];
-			sz = ntfs_compress_block(&inbuf[p],bsz,pbuf);
+			if (jobs) {
+				/* already compressed, copy if it fits */
+				sz = jobs[p/NTFS_SB_SIZE].outsz;
+				if ((compsz + sz + clsz + 2)
+					 <= na->compression_block_size)
+					memcpy(pbuf, jobs[p/NTFS_SB_SIZE].outbuf,
+						sz);
+			} else
+				sz = ntfs_compress_block(&inbuf[p],bsz,pbuf,
+						plevel);
 			/* fail if all the clusters (or more) are needed */
 			if (!sz || ((compsz + sz + clsz + 2)
 					 > na->compression_block_size))
@@ -1152,6 +2195,11 @@ static s32 ntfs_comp_set(ntfs_attr *na, runlist_element *rl,
 		} else
 			if (!fail)
 				written = 0;
+		if (fail)
+			ntfs_comp_failed(ni);
+		else
+			ni->comp_failures = 0;
+		free(jobs);
 		free(outbuf);
 	}
 	return (written);
@@ -1425,6 +2473,7 @@ static int ntfs_compress_overwr_free(ntfs_attr *na, runlist_element *rl,
 		*++xrl = *frl; /* terminator */
 	na->compressed_size -= freed << vol->cluster_size_bits;
 	}
+	ntfs_attr_rl_changed(na);
 	return (res);
 }
 
@@ -1569,7 +2618,8 @@ static int ntfs_compress_free(ntfs_attr *na, runlist_element *rl,
 		ntfs_log_error("No cluster to free after compression\n");
 		errno = EIO;
 	}
-	NAttrSetRunlistDirty(na);
+	ntfs_attr_rl_dirty(na, *update_from, RUNLIST_DIRTY_END);
+	ntfs_attr_rl_changed(na);
 	return (res);
 }
 
@@ -1649,7 +2699,32 @@ static s32 ntfs_flush(ntfs_attr *na, runlist_element *rl, s64 offs,
 		if (written != rounded)
 			written = -1;
 	}
-	return (written);
+	return (written);
+}
+
+/*
+ *		Check whether a compression block is fully allocated
+ *
+ *	Only the runs already mapped around the one being written to
+ *	are examined, so that the runlist is not reallocated.
+ */
+
+static BOOL cb_allocated(const runlist_element *rl, VCN start_vcn,
+			s64 clusters)
+{
+	while (rl->vcn > start_vcn) {
+		if (rl->lcn < 0)
+			return (FALSE);
+		rl--;
+	}
+	clusters += start_vcn - rl->vcn;
+	while (clusters > 0) {
+		if ((rl->lcn < 0) || !rl->length)
+			return (FALSE);
+		clusters -= rl->length;
+		rl++;
+	}
+	return (TRUE);
 }
 
 /*
@@ -1687,6 +2762,7 @@ s64 ntfs_compressed_pwrite(ntfs_attr *na, runlist_element *wrl, s64 wpos,
 	BOOL done;
 	BOOL compress;
 	BOOL appending;
+	BOOL inplace;
 
 	if (!valid_compressed_run(na,wrl,FALSE,"begin compressed write")) {
 		return (-1);
@@ -1709,6 +2785,9 @@ s64 ntfs_compressed_pwrite(ntfs_attr *na, runlist_element *wrl, s64 wpos,
 		*update_from = wrl->vcn;
 	written = -1; /* default return */
 	vol = na->ni->vol;
+#if CACHE_CBLOCK_SIZE
+	ntfs_compressed_invalidate(vol, na->ni->mft_no);
+#endif
 	compression_length = na->compression_block_clusters;
 	compress = FALSE;
 	done = FALSE;
@@ -1724,9 +2803,22 @@ s64 ntfs_compressed_pwrite(ntfs_attr *na, runlist_element *wrl, s64 wpos,
 		/* determine whether we are appending to file */
 	endwrite = offs + to_write + (wrl->vcn << vol->cluster_size_bits);
 	appending = endwrite >= na->initialized_size;
+		/*
+		 * When overwriting existing data in a compression block
+		 * fully allocated in the current run, the block may be
+		 * left uncompressed, so that the data is written in place
+		 * and nothing has to be read, compressed or reallocated
+		 * when the write reaches the end of the block.
+		 */
+	start_vcn = (wrl->vcn + (offs >> vol->cluster_size_bits))
+			& -compression_length;
+	inplace = NVolUncompressedOverwrites(vol)
+		&& !appending
+		&& (compressed_part < compression_length)
+		&& cb_allocated(wrl, start_vcn, compression_length);
 	if (endwrite >= nextblock) {
 			/* it is time to compress */
-		compress = TRUE;
+		compress = !inplace;
 			/* only process what we can */
 		to_write = rounded = nextblock
 			- (offs + (wrl->vcn << vol->cluster_size_bits));
@@ -1889,6 +2981,9 @@ int ntfs_compressed_close(ntfs_attr *na, runlist_element *wrl, s64 offs,
 	if (wrl->vcn < *update_from)
 		*update_from = wrl->vcn;
 	vol = na->ni->vol;
+#if CACHE_CBLOCK_SIZE
+	ntfs_compressed_invalidate(vol, na->ni->mft_no);
+#endif
 	compression_length = na->compression_block_clusters;
 	done = FALSE;
 		/*
@@ -1944,3 +3039,1058 @@ int ntfs_compressed_close(ntfs_attr *na, runlist_element *wrl, s64 offs,
 		done = FALSE;
 	return (!done);
 }
+
+/*
+ *		Reading the files compressed by the Windows Overlay Filter
+ *
+ *	The files compressed by "compact /exe" (system compressed files)
+ *	are reparse points tagged IO_REPARSE_TAG_WOF. Their data is split
+ *	into chunks of 4K, 8K or 16K compressed by XPRESS with Huffman
+ *	coding, or of 32K compressed by LZX, each chunk being compressed
+ *	independently, and stored in the stream named WofCompressedData.
+ *	The stream begins with a table of the offsets of all the chunks
+ *	but the first one, relative to the end of the table, so that any
+ *	chunk can be located directly. A chunk whose compressed size is
+ *	its uncompressed size is stored uncompressed.
+ *
+ *	Both formats use canonical Huffman codes, read from a stream of
+ *	little endian 16-bit words, most significant bit first. The codes
+ *	are decoded through a table indexed by the next bits, with
+ *	secondary tables for the longest codewords.
+ */
+
+static ntfschar wof_stream_name[] = {
+	const_cpu_to_le16('W'), const_cpu_to_le16('o'),
+	const_cpu_to_le16('f'), const_cpu_to_le16('C'),
+	const_cpu_to_le16('o'), const_cpu_to_le16('m'),
+	const_cpu_to_le16('p'), const_cpu_to_le16('r'),
+	const_cpu_to_le16('e'), const_cpu_to_le16('s'),
+	const_cpu_to_le16('s'), const_cpu_to_le16('e'),
+	const_cpu_to_le16('d'), const_cpu_to_le16('D'),
+	const_cpu_to_le16('a'), const_cpu_to_le16('t'),
+	const_cpu_to_le16('a'), const_cpu_to_le16('\0')
+} ;
+
+#define WOF_SUBTABLE 0x8000	/* entry pointing to a secondary table */
+#define WOF_MAX_CODE_LEN 16	/* longest codeword in both formats */
+#define WOF_MAX_SYMBOLS 512	/* biggest alphabet in both formats */
+
+	/* size of a decoding table, at most a secondary table per symbol */
+#define WOF_TABLE_SIZE(bits, syms, maxlen) \
+		((1 << (bits)) + ((syms) << ((maxlen) - (bits))))
+
+#define XPRESS_NUM_SYMBOLS 512
+#define XPRESS_TABLE_BITS 11
+#define XPRESS_MAX_CODE_LEN 15
+#define XPRESS_MIN_MATCH 3
+
+struct XPRESS_DECODER {
+	u16 table[WOF_TABLE_SIZE(XPRESS_TABLE_BITS, XPRESS_NUM_SYMBOLS,
+					XPRESS_MAX_CODE_LEN)];
+	u8 lens[XPRESS_NUM_SYMBOLS];
+} ;
+
+#define LZX_NUM_CHARS 256
+#define LZX_NUM_LEN_HEADERS 8
+#define LZX_NUM_OFFSET_SLOTS 30	/* for a 32K window */
+#define LZX_MAIN_SYMBOLS (LZX_NUM_CHARS \
+			+ LZX_NUM_LEN_HEADERS*LZX_NUM_OFFSET_SLOTS)
+#define LZX_LEN_SYMBOLS 249
+#define LZX_PRE_SYMBOLS 20
+#define LZX_ALIGNED_SYMBOLS 8
+#define LZX_MAIN_TABLE_BITS 11
+#define LZX_LEN_TABLE_BITS 10
+#define LZX_PRE_TABLE_BITS 8
+#define LZX_ALIGNED_TABLE_BITS 7
+#define LZX_MAX_MAIN_LEN 16
+#define LZX_MAX_PRE_LEN 15
+#define LZX_MAX_ALIGNED_LEN 7
+#define LZX_NUM_PRIMARY_LENS 7
+#define LZX_MIN_MATCH 2
+#define LZX_NUM_RECENT 3
+#define LZX_DEFAULT_BLOCK_SIZE 32768
+#define LZX_E8_FILE_SIZE 12000000	/* translation size for x86 calls */
+
+enum {
+	LZX_BLOCK_VERBATIM = 1,
+	LZX_BLOCK_ALIGNED = 2,
+	LZX_BLOCK_UNCOMPRESSED = 3
+} ;
+
+static const u16 lzx_slot_base[LZX_NUM_OFFSET_SLOTS] = {
+	0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192,
+	256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144,
+	8192, 12288, 16384, 24576
+} ;
+
+static const u8 lzx_extra_bits[LZX_NUM_OFFSET_SLOTS] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+} ;
+
+struct LZX_DECODER {
+	u16 main_table[WOF_TABLE_SIZE(LZX_MAIN_TABLE_BITS,
+					LZX_MAIN_SYMBOLS, LZX_MAX_MAIN_LEN)];
+	u16 len_table[WOF_TABLE_SIZE(LZX_LEN_TABLE_BITS,
+					LZX_LEN_SYMBOLS, LZX_MAX_MAIN_LEN)];
+	u16 pre_table[WOF_TABLE_SIZE(LZX_PRE_TABLE_BITS,
+					LZX_PRE_SYMBOLS, LZX_MAX_PRE_LEN)];
+	u16 aligned_table[WOF_TABLE_SIZE(LZX_ALIGNED_TABLE_BITS,
+				LZX_ALIGNED_SYMBOLS, LZX_MAX_ALIGNED_LEN)];
+	u8 main_lens[LZX_MAIN_SYMBOLS];
+	u8 len_lens[LZX_LEN_SYMBOLS];
+	u8 pre_lens[LZX_PRE_SYMBOLS];
+	u8 aligned_lens[LZX_ALIGNED_SYMBOLS];
+	int main_subbits;
+	int len_subbits;
+	int aligned_subbits;
+} ;
+
+struct WOF_BITSTREAM {
+	u32 bitbuf;		/* next bits, most significant first */
+	unsigned int bitsleft;	/* count of valid bits in bitbuf */
+	BOOL overrun;		/* zeroes were loaded beyond the end */
+	const u8 *next;		/* next input word */
+	const u8 *end;		/* end of input */
+} ;
+
+struct WOF_FILE {
+	s64 size;		/* uncompressed size of the file */
+	s64 nchunks;		/* count of chunks */
+	s64 table_size;		/* size of the chunk table */
+	s64 data_size;		/* size of the chunks after the table */
+	s64 cached;		/* chunk in cache, -1 if none */
+	u32 chunk_size;
+	int chunk_bits;
+	int entry_size;		/* size of the chunk table entries */
+	int batch;		/* chunks read by batch */
+	int decoders;		/* count of decoders */
+	size_t decoder_size;
+	int (*process)(struct COMPRESS_JOB *job);
+	u8 *cache;		/* last chunk partially read */
+	u8 *partial;		/* first chunk partially read */
+	u8 *inbuf;		/* compressed chunks of a batch */
+	u8 *entries;		/* chunk table entries of a batch */
+	s64 *offsets;		/* start of the chunks of a batch */
+	char *state;		/* decoders */
+	struct COMPRESS_JOB *jobs;
+} ;
+
+static inline void wof_init_bits(struct WOF_BITSTREAM *bs,
+			const u8 *in, u32 size)
+{
+	bs->bitbuf = 0;
+	bs->bitsleft = 0;
+	bs->overrun = FALSE;
+	bs->next = in;
+	bs->end = in + size;
+}
+
+/*
+ *		Make sure at least n bits (n <= 16) are available
+ *
+ *	Words are only loaded when needed. Beyond the end of input,
+ *	zeroes are loaded, the decoding being bounded by the output size.
+ */
+
+static inline void wof_ensure_bits(struct WOF_BITSTREAM *bs, unsigned int n)
+{
+	if (bs->bitsleft < n) {
+		if ((bs->end - bs->next) >= 2) {
+			bs->bitbuf |= (u32)(bs->next[0] | (bs->next[1] << 8))
+					<< (16 - bs->bitsleft);
+			bs->next += 2;
+		} else
+			bs->overrun = TRUE;
+		bs->bitsleft += 16;
+	}
+}
+
+static inline u32 wof_pop_bits(struct WOF_BITSTREAM *bs, unsigned int n)
+{
+	u32 v;
+
+	v = (bs->bitbuf >> 1) >> (31 - n);
+	bs->bitbuf <<= n;
+	bs->bitsleft -= n;
+	return (v);
+}
+
+static inline u32 wof_read_bits(struct WOF_BITSTREAM *bs, unsigned int n)
+{
+	wof_ensure_bits(bs, n);
+	return (wof_pop_bits(bs, n));
+}
+
+/*
+ *		Decode a Huffman symbol
+ */
+
+static inline unsigned int wof_decode(struct WOF_BITSTREAM *bs,
+			const u16 *table, unsigned int bits, int subbits)
+{
+	unsigned int entry;
+	unsigned int len;
+
+	wof_ensure_bits(bs, WOF_MAX_CODE_LEN);
+	entry = table[bs->bitbuf >> (32 - bits)];
+	if (entry & WOF_SUBTABLE)
+		entry = table[(entry & ~WOF_SUBTABLE)
+				+ ((bs->bitbuf << bits) >> (32 - subbits))];
+	len = entry & 31;
+	bs->bitbuf <<= len;
+	bs->bitsleft -= len;
+	return (entry >> 5);
+}
+
+/*
+ *		Build the decoding table of a canonical Huffman code
+ *
+ *	An entry is either a symbol shifted by 5 and its codeword length,
+ *	or WOF_SUBTABLE and the index of a secondary table indexed by the
+ *	next bits, all the secondary tables being sized for the longest
+ *	codeword. The entries not used by an incomplete code decode as
+ *	symbol zero and do not consume any bit, so that an empty code
+ *	can be accepted for an alphabet which is not used.
+ *
+ *	Returns the count of bits indexing the secondary tables,
+ *		or -1 if the codeword lengths are not a prefix code
+ */
+
+static int wof_build_table(u16 *table, unsigned int bits,
+			const u8 *lens, unsigned int nsyms,
+			unsigned int maxlen)
+{
+	u16 count[WOF_MAX_CODE_LEN + 1];
+	u16 offs[WOF_MAX_CODE_LEN + 1];
+	u16 sorted[WOF_MAX_SYMBOLS];
+	unsigned int sym, len, longest, subbits;
+	unsigned int code, i, n, k, start, next, prefix;
+	int left;
+	u16 entry;
+
+	memset(count, 0, sizeof(count));
+	for (sym=0; sym<nsyms; sym++) {
+		if (lens[sym] > maxlen)
+			return (-1);
+		count[lens[sym]]++;
+	}
+	left = 1;
+	longest = 0;
+	for (len=1; len<=maxlen; len++) {
+		left = (left << 1) - count[len];
+		if (left < 0)
+			return (-1);
+		if (count[len])
+			longest = len;
+	}
+	memset(table, 0, (1 << bits)*sizeof(u16));
+	offs[1] = 0;
+	for (len=1; len<longest; len++)
+		offs[len + 1] = offs[len] + count[len];
+	for (sym=0; sym<nsyms; sym++)
+		if (lens[sym])
+			sorted[offs[lens[sym]]++] = sym;
+	subbits = (longest > bits ? longest - bits : 0);
+	next = 1 << bits;
+	code = 0;
+	i = 0;
+	for (len=1; len<=longest; len++) {
+		for (n=count[len]; n; n--) {
+			entry = (sorted[i++] << 5) | len;
+			if (len <= bits) {
+				start = code << (bits - len);
+				k = 1 << (bits - len);
+			} else {
+				prefix = code >> (len - bits);
+				if (!(table[prefix] & WOF_SUBTABLE)) {
+					table[prefix] = WOF_SUBTABLE | next;
+					memset(&table[next], 0,
+						(1 << subbits)*sizeof(u16));
+					next += 1 << subbits;
+				}
+				start = (table[prefix] & ~WOF_SUBTABLE)
+					+ ((code & ((1 << (len - bits)) - 1))
+						<< (longest - len));
+				k = 1 << (longest - len);
+			}
+			while (k--)
+				table[start++] = entry;
+			code++;
+		}
+		code <<= 1;
+	}
+	return (subbits);
+}
+
+/*
+ *		Decompress an XPRESS chunk with Huffman coding
+ *
+ *	The chunk begins with the 4-bit codeword lengths of the 512
+ *	symbols : 256 literals, and 256 match headers made of the log2
+ *	of the match offset and of the first four bits of the length.
+ *	Longer lengths are stored as bytes interleaved in the bit stream.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int xpress_decompress(struct XPRESS_DECODER *d, const u8 *in,
+			u32 insize, u8 *out, u32 outsize)
+{
+	struct WOF_BITSTREAM bs;
+	u8 *dest;
+	u8 *out_end;
+	unsigned int sym;
+	unsigned int log2;
+	unsigned int i;
+	u32 length;
+	u32 offset;
+	int subbits;
+
+	if (insize < XPRESS_NUM_SYMBOLS/2)
+		goto overflow;
+	for (i=0; i<XPRESS_NUM_SYMBOLS/2; i++) {
+		d->lens[2*i] = in[i] & 15;
+		d->lens[2*i + 1] = in[i] >> 4;
+	}
+	subbits = wof_build_table(d->table, XPRESS_TABLE_BITS, d->lens,
+				XPRESS_NUM_SYMBOLS, XPRESS_MAX_CODE_LEN);
+	if (subbits < 0)
+		goto overflow;
+	wof_init_bits(&bs, &in[XPRESS_NUM_SYMBOLS/2],
+				insize - XPRESS_NUM_SYMBOLS/2);
+	dest = out;
+	out_end = out + outsize;
+	while (dest < out_end) {
+		sym = wof_decode(&bs, d->table, XPRESS_TABLE_BITS, subbits);
+		if (sym < 256) {
+			*dest++ = sym;
+			continue;
+		}
+		length = sym & 15;
+		log2 = (sym >> 4) & 15;
+			/* the extra bytes follow the words already loaded */
+		wof_ensure_bits(&bs, 16);
+		offset = ((u32)1 << log2) | wof_pop_bits(&bs, log2);
+		if (length == 15) {
+			if (bs.next >= bs.end)
+				goto overflow;
+			length += *bs.next++;
+			if (length == (15 + 255)) {
+				if ((bs.end - bs.next) < 2)
+					goto overflow;
+				length = bs.next[0] | (bs.next[1] << 8);
+				bs.next += 2;
+			}
+		}
+		length += XPRESS_MIN_MATCH;
+		if ((offset > (u32)(dest - out))
+		    || (length > (u32)(out_end - dest)))
+			goto overflow;
+		dest = ntfs_copy_phrase(dest, offset, length, out_end);
+	}
+	return (0);
+overflow :
+	errno = EOVERFLOW;
+	return (-1);
+}
+
+/*
+ *		Read the codeword lengths of a part of an LZX alphabet
+ *
+ *	The lengths are coded as differences from the lengths used in the
+ *	previous block, or as runs, with a pretree code.
+ *
+ *	Returns 0 if successful, -1 if the lengths are not valid
+ */
+
+static int lzx_read_lens(struct LZX_DECODER *d, struct WOF_BITSTREAM *bs,
+			u8 *lens, unsigned int count)
+{
+	u8 *p;
+	u8 *end;
+	unsigned int presym;
+	unsigned int i;
+	u32 run;
+	int subbits;
+	u8 len;
+
+	for (i=0; i<LZX_PRE_SYMBOLS; i++)
+		d->pre_lens[i] = wof_read_bits(bs, 4);
+	subbits = wof_build_table(d->pre_table, LZX_PRE_TABLE_BITS,
+			d->pre_lens, LZX_PRE_SYMBOLS, LZX_MAX_PRE_LEN);
+	if (subbits < 0)
+		return (-1);
+	p = lens;
+	end = lens + count;
+	while (p < end) {
+		presym = wof_decode(bs, d->pre_table,
+					LZX_PRE_TABLE_BITS, subbits);
+		if (presym < 17) {
+			*p = (*p + 17 - presym) % 17;
+			p++;
+		} else {
+			if (presym == 17) {
+				run = 4 + wof_read_bits(bs, 4);
+				len = 0;
+			} else if (presym == 18) {
+				run = 20 + wof_read_bits(bs, 5);
+				len = 0;
+			} else {
+				run = 4 + wof_read_bits(bs, 1);
+				presym = wof_decode(bs, d->pre_table,
+						LZX_PRE_TABLE_BITS, subbits);
+				if (presym > 17)
+					return (-1);
+				len = (*p + 17 - presym) % 17;
+			}
+			if (run > (u32)(end - p))
+				return (-1);
+			memset(p, len, run);
+			p += run;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Read the codes of a verbatim or aligned LZX block
+ *
+ *	Returns 0 if successful, -1 if the codes are not valid
+ */
+
+static int lzx_read_codes(struct LZX_DECODER *d, struct WOF_BITSTREAM *bs,
+			BOOL aligned)
+{
+	unsigned int i;
+
+	if (aligned) {
+		for (i=0; i<LZX_ALIGNED_SYMBOLS; i++)
+			d->aligned_lens[i] = wof_read_bits(bs, 3);
+		d->aligned_subbits = wof_build_table(d->aligned_table,
+				LZX_ALIGNED_TABLE_BITS, d->aligned_lens,
+				LZX_ALIGNED_SYMBOLS, LZX_MAX_ALIGNED_LEN);
+		if (d->aligned_subbits < 0)
+			return (-1);
+	}
+	if (lzx_read_lens(d, bs, d->main_lens, LZX_NUM_CHARS)
+	    || lzx_read_lens(d, bs, &d->main_lens[LZX_NUM_CHARS],
+				LZX_MAIN_SYMBOLS - LZX_NUM_CHARS))
+		return (-1);
+	d->main_subbits = wof_build_table(d->main_table,
+			LZX_MAIN_TABLE_BITS, d->main_lens,
+			LZX_MAIN_SYMBOLS, LZX_MAX_MAIN_LEN);
+	if ((d->main_subbits < 0)
+	    || lzx_read_lens(d, bs, d->len_lens, LZX_LEN_SYMBOLS))
+		return (-1);
+	d->len_subbits = wof_build_table(d->len_table,
+			LZX_LEN_TABLE_BITS, d->len_lens,
+			LZX_LEN_SYMBOLS, LZX_MAX_MAIN_LEN);
+	return (d->len_subbits < 0 ? -1 : 0);
+}
+
+/*
+ *		Decode the matches and literals of an LZX block
+ *
+ *	Returns the end of the block if successful, NULL otherwise
+ */
+
+static u8 *lzx_decode_block(struct LZX_DECODER *d, struct WOF_BITSTREAM *bs,
+			BOOL aligned, u32 *recent, u8 *out, u8 *dest,
+			u8 *block_end, u8 *out_end)
+{
+	unsigned int sym;
+	unsigned int slot;
+	unsigned int extra;
+	u32 length;
+	u32 offset;
+
+	while (dest < block_end) {
+		sym = wof_decode(bs, d->main_table,
+				LZX_MAIN_TABLE_BITS, d->main_subbits);
+		if (sym < LZX_NUM_CHARS) {
+			*dest++ = sym;
+			continue;
+		}
+		sym -= LZX_NUM_CHARS;
+		length = sym & (LZX_NUM_LEN_HEADERS - 1);
+		slot = sym / LZX_NUM_LEN_HEADERS;
+		if (length == LZX_NUM_PRIMARY_LENS)
+			length += wof_decode(bs, d->len_table,
+				LZX_LEN_TABLE_BITS, d->len_subbits);
+		length += LZX_MIN_MATCH;
+		if (slot < LZX_NUM_RECENT) {
+			/* swapped with the most recent one, not an LRU */
+			offset = recent[slot];
+			recent[slot] = recent[0];
+		} else {
+			extra = lzx_extra_bits[slot];
+			offset = lzx_slot_base[slot] - (LZX_NUM_RECENT - 1);
+			if (aligned && (extra >= 3)) {
+				offset += wof_read_bits(bs, extra - 3) << 3;
+				offset += wof_decode(bs, d->aligned_table,
+						LZX_ALIGNED_TABLE_BITS,
+						d->aligned_subbits);
+			} else
+				offset += wof_read_bits(bs, extra);
+			recent[2] = recent[1];
+			recent[1] = recent[0];
+		}
+		recent[0] = offset;
+		if ((length > (u32)(block_end - dest))
+		    || (offset > (u32)(dest - out)))
+			return ((u8*)NULL);
+		dest = ntfs_copy_phrase(dest, offset, length, out_end);
+	}
+	return (dest);
+}
+
+/*
+ *		Undo the translation of the x86 call targets
+ *
+ *	The targets of the E8 (call) instructions were translated from
+ *	relative to absolute before compressing, to make them repeat.
+ *	This is not done for the last ten bytes of a chunk.
+ */
+
+static void lzx_undo_e8(u8 *data, u32 size)
+{
+	u8 *p;
+	u8 *tail;
+	le32 v;
+	s32 target;
+	s32 pos;
+
+	if (size > 10) {
+		p = data;
+		tail = data + size - 10;
+		while ((p < tail)
+		    && (p = (u8*)memchr(p, 0xe8, tail - p))) {
+			pos = p - data;
+			memcpy(&v, p + 1, 4);
+			target = (s32)le32_to_cpu(v);
+			if ((target >= 0) && (target < LZX_E8_FILE_SIZE)) {
+				v = cpu_to_le32((u32)(target - pos));
+				memcpy(p + 1, &v, 4);
+			} else if ((target < 0) && (target >= -pos)) {
+				v = cpu_to_le32((u32)(target
+							+ LZX_E8_FILE_SIZE));
+				memcpy(p + 1, &v, 4);
+			}
+			p += 5;
+		}
+	}
+}
+
+/*
+ *		Decompress an LZX chunk
+ *
+ *	The chunk is made of blocks with verbatim offsets, aligned offsets
+ *	or no compression, the codeword lengths and the recent offsets
+ *	being carried over from a block to the next one. An uncompressed
+ *	block begins at the next 16-bit word, after 1 to 16 bits of
+ *	padding.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int lzx_decompress(struct LZX_DECODER *d, const u8 *in, u32 insize,
+			u8 *out, u32 outsize)
+{
+	struct WOF_BITSTREAM bs;
+	u32 recent[LZX_NUM_RECENT];
+	le32 v;
+	u8 *dest;
+	u8 *out_end;
+	u32 block_size;
+	unsigned int type;
+	int i;
+
+	wof_init_bits(&bs, in, insize);
+	memset(d->main_lens, 0, sizeof(d->main_lens));
+	memset(d->len_lens, 0, sizeof(d->len_lens));
+	for (i=0; i<LZX_NUM_RECENT; i++)
+		recent[i] = 1;
+	dest = out;
+	out_end = out + outsize;
+	while (dest < out_end) {
+		wof_ensure_bits(&bs, 4);
+		type = wof_pop_bits(&bs, 3);
+		if (wof_pop_bits(&bs, 1))
+			block_size = LZX_DEFAULT_BLOCK_SIZE;
+		else
+			block_size = wof_read_bits(&bs, 16);
+		if (!block_size || (block_size > (u32)(out_end - dest)))
+			goto overflow;
+		switch (type) {
+		case LZX_BLOCK_VERBATIM :
+		case LZX_BLOCK_ALIGNED :
+			if (lzx_read_codes(d, &bs,
+					type == LZX_BLOCK_ALIGNED))
+				goto overflow;
+			dest = lzx_decode_block(d, &bs,
+					type == LZX_BLOCK_ALIGNED, recent,
+					out, dest, dest + block_size, out_end);
+			if (!dest)
+				goto overflow;
+			break;
+		case LZX_BLOCK_UNCOMPRESSED :
+				/* skip the padding, unload a word if needed */
+			if (bs.overrun)
+				goto overflow;
+			if (!bs.bitsleft) {
+				if ((bs.end - bs.next) < 2)
+					goto overflow;
+				bs.next += 2;
+			} else if (bs.bitsleft > 16)
+				bs.next -= 2;
+			bs.bitbuf = 0;
+			bs.bitsleft = 0;
+			if ((bs.end - bs.next)
+			    < (4*LZX_NUM_RECENT + (s64)block_size))
+				goto overflow;
+			for (i=0; i<LZX_NUM_RECENT; i++) {
+				memcpy(&v, bs.next, 4);
+				recent[i] = le32_to_cpu(v);
+				bs.next += 4;
+				if (!recent[i])
+					goto overflow;
+			}
+			memcpy(dest, bs.next, block_size);
+			dest += block_size;
+			bs.next += block_size;
+				/* realign to a word */
+			if ((block_size & 1) && (bs.next < bs.end))
+				bs.next++;
+			break;
+		default :
+			goto overflow;
+		}
+	}
+	lzx_undo_e8(out, outsize);
+	return (0);
+overflow :
+	errno = EOVERFLOW;
+	return (-1);
+}
+
+static int wof_xpress_job(struct COMPRESS_JOB *job)
+{
+	return (xpress_decompress((struct XPRESS_DECODER*)job->decoder,
+			job->cb, job->cb_size, job->dest, job->dest_size));
+}
+
+static int wof_lzx_job(struct COMPRESS_JOB *job)
+{
+	return (lzx_decompress((struct LZX_DECODER*)job->decoder,
+			job->cb, job->cb_size, job->dest, job->dest_size));
+}
+
+/*
+ *		Check the reparse data of a system compressed file
+ *
+ *	Returns the log2 of the chunk size if the file can be read,
+ *		-1 otherwise (errno set)
+ */
+
+static int wof_check(const REPARSE_POINT *reparse)
+{
+	const WOF_FILE_REPARSE_DATA *data;
+	int bits;
+
+	bits = -1;
+	if ((reparse->reparse_tag != IO_REPARSE_TAG_WOF)
+	    || (le16_to_cpu(reparse->reparse_data_length)
+				< sizeof(WOF_FILE_REPARSE_DATA))) {
+		errno = EINVAL;
+	} else {
+		data = (const WOF_FILE_REPARSE_DATA*)reparse->reparse_data;
+		if ((data->version == WOF_CURRENT_VERSION)
+		    && (data->provider == WOF_PROVIDER_FILE)
+		    && (data->file_version == WOF_FILE_PROVIDER_VERSION)) {
+			switch (data->algorithm) {
+			case WOF_COMPRESSION_XPRESS4K :
+				bits = 12;
+				break;
+			case WOF_COMPRESSION_XPRESS8K :
+				bits = 13;
+				break;
+			case WOF_COMPRESSION_XPRESS16K :
+				bits = 14;
+				break;
+			case WOF_COMPRESSION_LZX :
+				bits = 15;
+				break;
+			default :
+				break;
+			}
+		}
+		if (bits < 0)
+			errno = EOPNOTSUPP;
+	}
+	return (bits);
+}
+
+/*
+ *		Get the size of a system compressed file
+ *	and the space allocated to its compressed data
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_wof_getsize(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			s64 *size, s64 *allocated)
+{
+	ntfs_attr *na;
+	int res;
+
+	res = -1;
+	if (wof_check(reparse) >= 0) {
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na) {
+			*size = na->data_size;
+			ntfs_attr_close(na);
+			na = ntfs_attr_open(ni, AT_DATA, wof_stream_name,
+					sizeof(wof_stream_name)/sizeof(ntfschar)
+						- 1);
+			if (na) {
+				*allocated = na->allocated_size;
+				ntfs_attr_close(na);
+				res = 0;
+			}
+		}
+	}
+	return (res);
+}
+
+void ntfs_wof_close(struct WOF_FILE *wof)
+{
+	if (wof) {
+		free(wof->cache);
+		free(wof->partial);
+		free(wof->inbuf);
+		free(wof->entries);
+		free(wof->offsets);
+		free(wof->state);
+		free(wof->jobs);
+		free(wof);
+	}
+}
+
+/*
+ *		Prepare for reading a system compressed file
+ *
+ *	The context is not tied to the inode, which may be closed and
+ *	reopened between reads.
+ *
+ *	Returns the context if successful, NULL otherwise (errno set)
+ */
+
+struct WOF_FILE *ntfs_wof_open(ntfs_inode *ni, const REPARSE_POINT *reparse)
+{
+	struct WOF_FILE *wof;
+	ntfs_attr *na;
+	s64 size;
+	s64 stream_size;
+	int bits;
+
+	wof = (struct WOF_FILE*)NULL;
+	bits = wof_check(reparse);
+	if (bits < 0)
+		return (wof);
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (wof);
+	size = na->data_size;
+	ntfs_attr_close(na);
+	na = ntfs_attr_open(ni, AT_DATA, wof_stream_name,
+			sizeof(wof_stream_name)/sizeof(ntfschar) - 1);
+	if (!na)
+		return (wof);
+	stream_size = na->data_size;
+	ntfs_attr_close(na);
+	wof = (struct WOF_FILE*)ntfs_calloc(sizeof(struct WOF_FILE));
+	if (!wof)
+		return (wof);
+	wof->size = size;
+	wof->chunk_bits = bits;
+	wof->chunk_size = (u32)1 << bits;
+	wof->nchunks = (size + wof->chunk_size - 1) >> bits;
+	wof->entry_size = (size > 0xffffffffLL ? 8 : 4);
+	wof->table_size = (wof->nchunks ? wof->nchunks - 1 : 0)
+					* wof->entry_size;
+	wof->data_size = stream_size - wof->table_size;
+	wof->cached = -1;
+	wof->batch = WOF_BATCH_SIZE >> bits;
+		/* with no threads, the chunks are decoded one at a time */
+	wof->decoders = (ni->vol->compress_pool ? wof->batch : 1);
+	if (bits == 15) {
+		wof->decoder_size = sizeof(struct LZX_DECODER);
+		wof->process = wof_lzx_job;
+	} else {
+		wof->decoder_size = sizeof(struct XPRESS_DECODER);
+		wof->process = wof_xpress_job;
+	}
+	if (wof->data_size < 0) {
+		ntfs_log_error("Bad chunk table in system compressed"
+				" inode %lld\n", (long long)ni->mft_no);
+		errno = EIO;
+	} else {
+		wof->cache = (u8*)ntfs_malloc(wof->chunk_size);
+		wof->partial = (u8*)ntfs_malloc(wof->chunk_size);
+		wof->inbuf = (u8*)ntfs_malloc(WOF_BATCH_SIZE);
+		wof->entries = (u8*)ntfs_malloc((wof->batch + 1)*8);
+		wof->offsets = (s64*)ntfs_malloc((wof->batch + 1)
+							*sizeof(s64));
+		wof->state = (char*)ntfs_malloc(wof->decoders
+						*wof->decoder_size);
+		wof->jobs = (struct COMPRESS_JOB*)ntfs_calloc(wof->batch
+					*sizeof(struct COMPRESS_JOB));
+		if (wof->cache && wof->partial && wof->inbuf
+		    && wof->entries && wof->offsets
+		    && wof->state && wof->jobs)
+			return (wof);
+	}
+	ntfs_wof_close(wof);
+	return ((struct WOF_FILE*)NULL);
+}
+
+/*
+ *		Decompress the jobs of a batch
+ *
+ *	When there is a pool of compression threads, there is a decoder
+ *	per job and the jobs are decompressed in parallel.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int wof_run_jobs(ntfs_volume *vol, struct COMPRESS_JOB *jobs,
+			int count)
+{
+	struct COMPRESS_POOL *pool;
+	int err;
+	int i;
+
+	err = 0;
+	pool = vol->compress_pool;
+	if (pool && (count > 1)) {
+		for (i=0; i<count; i++)
+			compress_submit(pool, &jobs[i]);
+		for (i=0; i<count; i++) {
+			compress_sync(pool, &jobs[i]);
+			if (jobs[i].err && !err)
+				err = jobs[i].err;
+		}
+	} else {
+		for (i=0; (i<count) && !err; i++)
+			if (jobs[i].process(&jobs[i]) < 0)
+				err = (errno ? errno : EIO);
+	}
+	if (err)
+		errno = err;
+	return (err ? -1 : 0);
+}
+
+/*
+ *		Read and decompress a batch of chunks
+ *
+ *	The chunks fully requested are decompressed directly into the
+ *	caller's buffer. The last chunk requested is decompressed into
+ *	the cache when it is only partially requested, so that the next
+ *	sequential read can get it from there.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int wof_read_batch(struct WOF_FILE *wof, ntfs_volume *vol,
+			ntfs_attr *na, s64 chunk, int n,
+			s64 pos, s64 count, u8 *b)
+{
+	struct COMPRESS_JOB *job;
+	s64 *offsets;
+	s64 first;
+	s64 last;
+	s64 entries;
+	s64 start;
+	s64 end;
+	s64 c;
+	le64 v64;
+	le32 v32;
+	u32 usize;
+	u32 insize;
+	u8 *dest;
+	u8 *in;
+	int njobs;
+	int k;
+
+		/* locate the chunks from the table */
+	offsets = wof->offsets;
+	first = (chunk ? chunk - 1 : 0);
+	entries = chunk + n - first;
+	if ((first + entries) > (wof->nchunks - 1))
+		entries = wof->nchunks - 1 - first;
+	if ((entries > 0)
+	    && (ntfs_attr_pread(na, first*wof->entry_size,
+				entries*wof->entry_size, wof->entries)
+			!= entries*wof->entry_size))
+		goto ioerror;
+	for (k=0; k<=n; k++) {
+		c = chunk + k;
+		if (!c)
+			offsets[k] = 0;
+		else if (c == wof->nchunks)
+			offsets[k] = wof->data_size;
+		else if (wof->entry_size == 8) {
+			memcpy(&v64, &wof->entries[(c - 1 - first)*8], 8);
+			offsets[k] = le64_to_cpu(v64);
+		} else {
+			memcpy(&v32, &wof->entries[(c - 1 - first)*4], 4);
+			offsets[k] = le32_to_cpu(v32);
+		}
+		if (k) {
+			usize = wof->chunk_size;
+			if ((c << wof->chunk_bits) > wof->size)
+				usize = wof->size
+					- ((c - 1) << wof->chunk_bits);
+			if ((offsets[k] < offsets[k - 1])
+			    || ((offsets[k] - offsets[k - 1]) > usize)
+			    || (offsets[k] > wof->data_size))
+				goto corrupt;
+		}
+	}
+	if (ntfs_attr_pread(na, wof->table_size + offsets[0],
+			offsets[n] - offsets[0], wof->inbuf)
+				!= (offsets[n] - offsets[0]))
+		goto ioerror;
+		/* prepare the jobs, copy the chunks stored uncompressed */
+	last = (pos + count - 1) >> wof->chunk_bits;
+	njobs = 0;
+	for (k=0; k<n; k++) {
+		c = chunk + k;
+		start = c << wof->chunk_bits;
+		end = start + wof->chunk_size;
+		if (end > wof->size)
+			end = wof->size;
+		usize = end - start;
+		in = &wof->inbuf[offsets[k] - offsets[0]];
+		insize = offsets[k + 1] - offsets[k];
+		if ((start >= pos) && (end <= (pos + count)))
+			dest = &b[start - pos];
+		else if (c == last) {
+			dest = wof->cache;
+			wof->cached = -1;
+		} else
+			dest = wof->partial;
+		if (insize == usize)
+			memcpy(dest, in, usize);
+		else {
+			job = &wof->jobs[njobs];
+			job->process = wof->process;
+			job->cb = (u8*)in;
+			job->cb_size = insize;
+			job->dest = dest;
+			job->dest_size = usize;
+			job->decoder = &wof->state[wof->decoder_size
+					* (wof->decoders > 1 ? njobs : 0)];
+			njobs++;
+		}
+	}
+	if (wof_run_jobs(vol, wof->jobs, njobs))
+		goto corrupt;
+		/* copy the partial chunks */
+	for (k=0; k<n; k++) {
+		c = chunk + k;
+		start = c << wof->chunk_bits;
+		end = start + wof->chunk_size;
+		if (end > wof->size)
+			end = wof->size;
+		if ((start < pos) || (end > (pos + count))) {
+			dest = (c == last ? wof->cache : wof->partial);
+			if (c == last)
+				wof->cached = c;
+			if (start < pos) {
+				in = &dest[pos - start];
+				start = pos;
+			} else
+				in = dest;
+			if (end > (pos + count))
+				end = pos + count;
+			memcpy(&b[start - pos], in, end - start);
+		}
+	}
+	return (0);
+corrupt :
+	ntfs_log_error("Corrupt system compressed data in inode %lld\n",
+			(long long)na->ni->mft_no);
+	errno = EIO;
+	return (-1);
+ioerror :
+	if (!errno)
+		errno = EIO;
+	return (-1);
+}
+
+/*
+ *		Read from a system compressed file
+ *
+ *	Returns the count of bytes read, which is less than requested
+ *		only when reaching the end of file, or -1 if there was
+ *		an error (errno set)
+ */
+
+s64 ntfs_wof_pread(struct WOF_FILE *wof, ntfs_inode *ni, s64 pos,
+			s64 count, void *b)
+{
+	ntfs_attr *na;
+	s64 chunk;
+	s64 last;
+	s64 start;
+	s64 end;
+	s64 res;
+	int n;
+
+	if (!wof || !ni || !b || (pos < 0) || (count < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (pos >= wof->size)
+		return (0);
+	if (count > (wof->size - pos))
+		count = wof->size - pos;
+	if (!count)
+		return (0);
+	na = (ntfs_attr*)NULL;
+	res = count;
+	chunk = pos >> wof->chunk_bits;
+	last = (pos + count - 1) >> wof->chunk_bits;
+	while ((res > 0) && (chunk <= last)) {
+		if (chunk == wof->cached) {
+			start = chunk << wof->chunk_bits;
+			end = start + wof->chunk_size;
+			if (start < pos)
+				start = pos;
+			if (end > (pos + count))
+				end = pos + count;
+			memcpy((char*)b + start - pos,
+				&wof->cache[start - (chunk << wof->chunk_bits)],
+				end - start);
+			chunk++;
+		} else {
+			if (!na)
+				na = ntfs_attr_open(ni, AT_DATA,
+					wof_stream_name,
+					sizeof(wof_stream_name)
+						/sizeof(ntfschar) - 1);
+			n = wof->batch;
+			if ((last - chunk + 1) < n)
+				n = last - chunk + 1;
+			if (!na || wof_read_batch(wof, ni->vol, na,
+					chunk, n, pos, count, (u8*)b))
+				res = -1;
+			chunk += n;
+		}
+	}
+	if (na)
+		ntfs_attr_close(na);
+	return (res);
+}
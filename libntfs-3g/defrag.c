@@ -0,0 +1,426 @@
+/**
+ * defrag.c - Relocation of fragmented attributes to contiguous clusters.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "runlist.h"
+#include "mft.h"
+#include "lcnalloc.h"
+#include "device.h"
+#include "volume.h"
+#include "defrag.h"
+#include "logging.h"
+#include "misc.h"
+
+/*
+ *		An attribute is relocated as a whole to the first extent of
+ *	free clusters able to hold all its allocated clusters, outside of
+ *	the mft zone. The holes of sparse and compressed attributes are
+ *	kept, only the allocated runs are gathered.
+ *
+ *	The update is ordered so that the volume is consistent whenever
+ *	it is interrupted : the new clusters are allocated and the data
+ *	is copied and synced, then the mapping pairs are updated and the
+ *	mft record is synced, and only then are the old clusters freed.
+ *	If interrupted before the mft record is written, the new clusters
+ *	are lost until chkdsk is run, and nothing else is changed.
+ */
+
+struct FREE_SEARCH {
+	LCN lcn;		/* first cluster of the current free extent */
+	s64 count;		/* number of clusters in the current extent */
+	s64 needed;		/* number of clusters wanted */
+} ;
+
+/*
+ *		Gather the free extents until one is big enough
+ *
+ *	The extents are split where $Bitmap is read by chunks, so the
+ *	adjacent ones are merged.
+ */
+
+static int free_search(ntfs_volume *vol __attribute__((unused)),
+			LCN lcn, s64 count, void *data)
+{
+	struct FREE_SEARCH *search = (struct FREE_SEARCH*)data;
+
+	if (search->count && (lcn == (search->lcn + search->count)))
+		search->count += count;
+	else {
+		search->lcn = lcn;
+		search->count = count;
+	}
+	return (search->count >= search->needed);
+}
+
+/*
+ *		Search the first free extent before a limit
+ *
+ *	The mft zone is not used.
+ *
+ *	Returns the first cluster of the extent found,
+ *		LCN_ENOENT if none was found,
+ *		or LCN_EIO if there was an error (errno set)
+ */
+
+static LCN find_free_extent(ntfs_volume *vol, s64 needed, LCN limit)
+{
+	struct FREE_SEARCH search;
+	LCN zone_start;
+	LCN zone_end;
+	LCN lcn;
+	int res;
+
+	search.needed = needed;
+	search.count = 0;
+	zone_start = vol->mft_zone_start;
+	zone_end = vol->mft_zone_end;
+	if (zone_start > limit)
+		zone_start = limit;
+	if (zone_end < zone_start)
+		zone_end = zone_start;
+	res = ntfs_cluster_free_extents(vol, 0, zone_start, 0,
+				free_search, &search);
+	if (!res && (zone_end < limit)) {
+		search.count = 0;
+		res = ntfs_cluster_free_extents(vol, zone_end,
+				limit - zone_end, 0, free_search, &search);
+	}
+	if (res < 0)
+		lcn = LCN_EIO;
+	else
+		if (res > 0)
+			lcn = search.lcn;
+		else
+			lcn = LCN_ENOENT;
+	return (lcn);
+}
+
+/*
+ *		Build the runlist of an attribute relocated to a free extent
+ *
+ *	Returns the new runlist, or NULL if there was an error (errno set)
+ */
+
+static runlist_element *relocated_runlist(const runlist_element *rl,
+			LCN lcn)
+{
+	runlist_element *newrl;
+	int count;
+	int i;
+	int j;
+
+	for (count=0; rl[count].length; count++) { }
+	newrl = (runlist_element*)ntfs_malloc((count + 1)
+					* sizeof(runlist_element));
+	if (newrl) {
+		j = 0;
+		for (i=0; i<count; i++) {
+			if ((rl[i].lcn >= 0)
+			    && j
+			    && (newrl[j - 1].lcn >= 0)
+			    && ((newrl[j - 1].lcn + newrl[j - 1].length)
+					== lcn)) {
+				newrl[j - 1].length += rl[i].length;
+			} else {
+				newrl[j] = rl[i];
+				if (rl[i].lcn >= 0)
+					newrl[j].lcn = lcn;
+				j++;
+			}
+			if (rl[i].lcn >= 0)
+				lcn += rl[i].length;
+		}
+		newrl[j] = rl[count];
+	}
+	return (newrl);
+}
+
+/*
+ *		Copy the data of an attribute to its new location
+ *
+ *	The clusters are gathered from the runs into a large buffer,
+ *	written at once to the contiguous destination.
+ *
+ *	Returns 0 if successful, or -1 if there was an error (errno set)
+ */
+
+static int copy_clusters(ntfs_volume *vol, const runlist_element *rl,
+			VCN end_vcn, LCN lcn)
+{
+	char *buf;
+	s64 fill;
+	s64 pos;
+	s64 done;
+	s64 size;
+	s64 chunk;
+	s64 to;
+	int res;
+
+	buf = (char*)ntfs_malloc(DEFRAG_COPY_SIZE);
+	if (!buf)
+		return (-1);
+	res = 0;
+	fill = 0;
+	to = lcn << vol->cluster_size_bits;
+	for ( ; rl->length && (rl->vcn < end_vcn) && !res; rl++) {
+		if (rl->lcn < 0)
+			continue;
+		size = rl->length;
+		if (size > (end_vcn - rl->vcn))
+			size = end_vcn - rl->vcn;
+		size <<= vol->cluster_size_bits;
+		pos = rl->lcn << vol->cluster_size_bits;
+		for (done=0; (done < size) && !res; done+=chunk) {
+			chunk = size - done;
+			if (chunk > (DEFRAG_COPY_SIZE - fill))
+				chunk = DEFRAG_COPY_SIZE - fill;
+			if (ntfs_pread(vol->dev, pos + done, chunk,
+					&buf[fill]) != chunk)
+				res = -1;
+			fill += chunk;
+			if (!res && (fill == DEFRAG_COPY_SIZE)) {
+				if (ntfs_pwrite(vol->dev, to, fill, buf)
+						!= fill)
+					res = -1;
+				to += fill;
+				fill = 0;
+			}
+		}
+	}
+	if (!res && fill && (ntfs_pwrite(vol->dev, to, fill, buf) != fill))
+		res = -1;
+	if (res && !errno)
+		errno = EIO;
+	free(buf);
+	return (res);
+}
+
+/**
+ * ntfs_attr_extent_count - count the extents of a non-resident attribute
+ * @na:		opened ntfs attribute
+ * @first_lcn:	where to return the first cluster allocated, or NULL
+ *
+ * Adjacent runs whose clusters are contiguous make a single extent,
+ * and the holes are not counted.
+ *
+ * Returns the number of extents (zero for a resident attribute),
+ *	or -1 if there was an error (errno set)
+ */
+
+s64 ntfs_attr_extent_count(ntfs_attr *na, LCN *first_lcn)
+{
+	const runlist_element *rl;
+	s64 count;
+	LCN next;
+
+	if (first_lcn)
+		*first_lcn = LCN_HOLE;
+	if (!NAttrNonResident(na))
+		return (0);
+	if (ntfs_attr_rl_expand(na) || ntfs_attr_map_whole_runlist(na))
+		return (-1);
+	count = 0;
+	next = LCN_HOLE;
+	for (rl=na->rl; rl->length; rl++) {
+		if (rl->lcn >= 0) {
+			if (rl->lcn != next)
+				count++;
+			if (first_lcn && (*first_lcn < 0))
+				*first_lcn = rl->lcn;
+			next = rl->lcn + rl->length;
+		}
+	}
+	return (count);
+}
+
+/**
+ * ntfs_attr_relocate - move the clusters of an attribute to a free extent
+ * @na:		opened non-resident ntfs attribute
+ * @limit:	first cluster not to be used by the new location
+ *
+ * The allocated clusters of the attribute are moved to the first free
+ * extent big enough to hold all of them and ending before @limit, so
+ * that with @limit set to the first cluster of the attribute, the
+ * attribute is moved towards the beginning of the volume.
+ * The system files are not relocated.
+ *
+ * Returns 1 if the attribute was moved,
+ *	0 if there was no room for moving it,
+ *	or -1 if there was an error (errno set)
+ */
+
+int ntfs_attr_relocate(ntfs_attr *na, LCN limit)
+{
+	ntfs_volume *vol;
+	runlist_element *oldrl;
+	runlist_element *newrl;
+	runlist *alloc;
+	const runlist_element *rl;
+	VCN end_vcn;
+	s64 clusters;
+	LCN lcn;
+	int err;
+
+	vol = na->ni->vol;
+	if (na->ni->mft_no < FILE_first_user) {
+		errno = EPERM;
+		return (-1);
+	}
+	if (NVolReadOnly(vol)) {
+		errno = EROFS;
+		return (-1);
+	}
+	if (!NAttrNonResident(na))
+		return (0);
+	if (ntfs_attr_rl_expand(na) || ntfs_attr_map_whole_runlist(na))
+		return (-1);
+	clusters = 0;
+	for (rl=na->rl; rl->length; rl++)
+		if (rl->lcn >= 0)
+			clusters += rl->length;
+	if (!clusters)
+		return (0);
+	if (limit > vol->nr_clusters)
+		limit = vol->nr_clusters;
+	lcn = find_free_extent(vol, clusters, limit);
+	if (lcn == LCN_EIO)
+		return (-1);
+	if (lcn < 0)
+		return (0);
+	alloc = ntfs_cluster_alloc(vol, 0, clusters, lcn, DATA_ZONE);
+	if (!alloc)
+		return (errno == ENOSPC ? 0 : -1);
+	if ((alloc[0].lcn != lcn) || (alloc[0].length != clusters)) {
+			/* not allocated where expected, give up */
+		ntfs_cluster_free_from_rl(vol, alloc);
+		free(alloc);
+		return (0);
+	}
+	free(alloc);
+	newrl = relocated_runlist(na->rl, lcn);
+	if (!newrl)
+		goto free_new;
+		/*
+		 * Only the initialized clusters have to be copied, but
+		 * the compressed data may extend beyond the cluster
+		 * holding the end of the initialized data.
+		 */
+	if (NAttrCompressed(na))
+		end_vcn = na->allocated_size >> vol->cluster_size_bits;
+	else
+		end_vcn = (na->initialized_size + vol->cluster_size - 1)
+				>> vol->cluster_size_bits;
+	if (copy_clusters(vol, na->rl, end_vcn, lcn)
+	    || ntfs_device_sync(vol->dev))
+		goto free_new;
+	oldrl = na->rl;
+	na->rl = newrl;
+	ntfs_attr_rl_changed(na);
+	ntfs_attr_rl_dirty(na, 0, RUNLIST_DIRTY_END);
+	if (ntfs_attr_update_mapping_pairs(na, 0)) {
+		err = errno;
+		na->rl = oldrl;
+		ntfs_attr_rl_changed(na);
+		ntfs_attr_rl_dirty(na, 0, RUNLIST_DIRTY_END);
+		if (ntfs_attr_update_mapping_pairs(na, 0)) {
+			ntfs_log_error("Could not restore the runlist of"
+				" inode %lld\n", (long long)na->ni->mft_no);
+				/* the new clusters may be in use */
+			free(newrl);
+			errno = err;
+			return (-1);
+		}
+		errno = err;
+		goto free_new;
+	}
+		/* the old clusters are freed once the record is on disk */
+	if (ntfs_inode_sync(na->ni)
+	    || ntfs_mft_writeback_flush(vol, TRUE)
+	    || ntfs_device_sync(vol->dev)) {
+		ntfs_log_error("Could not sync inode %lld, its old clusters"
+			" are not freed\n", (long long)na->ni->mft_no);
+		free(oldrl);
+		return (-1);
+	}
+	if (ntfs_cluster_free_from_rl(vol, oldrl)) {
+		free(oldrl);
+		return (-1);
+	}
+	free(oldrl);
+	return (1);
+
+free_new :
+	err = errno;
+	if (newrl) {
+		ntfs_cluster_free_from_rl(vol, newrl);
+		free(newrl);
+	} else
+		ntfs_cluster_free_basic(vol, lcn, clusters);
+	errno = err;
+	return (-1);
+}
+
+/**
+ * ntfs_inode_defragment - make the data of a file contiguous
+ * @ni:		opened ntfs inode
+ *
+ * The unnamed data attribute is relocated if it has several extents.
+ *
+ * Returns 0 if successful or the data was already contiguous,
+ *	or -1 if there was an error (errno set, ENOSPC if there was
+ *	no free extent big enough)
+ */
+
+int ntfs_inode_defragment(ntfs_inode *ni)
+{
+	ntfs_attr *na;
+	s64 res;
+
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		return (-1);
+	res = ntfs_attr_extent_count(na, (LCN*)NULL);
+	if (res > 1) {
+		res = ntfs_attr_relocate(na, ni->vol->nr_clusters);
+		if (!res) {
+			errno = ENOSPC;
+			res = -1;
+		}
+	}
+	ntfs_attr_close(na);
+	return (res < 0 ? -1 : 0);
+}
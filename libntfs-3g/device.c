@@ -68,6 +68,9 @@
 #ifdef HAVE_LINUX_HDREG_H
 #include <linux/hdreg.h>
 #endif
+#if defined(__linux__) && !defined(BLKZEROOUT)
+#define BLKZEROOUT _IO(0x12,127)	/* from linux/fs.h */
+#endif
 #ifdef ENABLE_HD
 #include <hd.h>
 #endif
@@ -78,6 +81,10 @@
 #include "device.h"
 #include "logging.h"
 #include "misc.h"
+#include "blkcache.h"
+#include "stats.h"
+#include "trace.h"
+#include "prefetch.h"
 
 #ifndef UEFI_DRIVER
 
@@ -112,6 +119,9 @@
  *
  * Note, @name is copied and can hence be freed after this functions returns.
  *
+ * When the default device operations are requested for a name prefixed by
+ * "mem:" or "mmap:", the memory device operations are used instead.
+ *
  * On success return a pointer to the allocated ntfs device structure and on
  * error return NULL with errno set to the error code returned by ntfs_malloc().
  */
@@ -125,6 +135,14 @@ struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
 		return NULL;
 	}
 
+#ifdef NTFS_DEVICE_MEM_IO_OPS
+	if (((dops == &ntfs_device_default_io_ops)
+#ifdef NTFS_DEVICE_URING_IO_OPS
+	    || (dops == &ntfs_device_uring_io_ops)
+#endif
+	    ) && ntfs_device_mem_name(name))
+		dops = &ntfs_device_mem_io_ops;
+#endif
 	dev = ntfs_malloc(sizeof(struct ntfs_device));
 	if (dev) {
 		if (!(dev->d_name = strdup(name))) {
@@ -138,6 +156,10 @@ struct ntfs_device *ntfs_device_alloc(const char *name, const long state,
 		dev->d_private = priv_data;
 		dev->d_heads = -1;
 		dev->d_sectors_per_track = -1;
+		dev->d_cache = (struct BLOCK_CACHE*)NULL;
+		memset(&dev->d_stats, 0, sizeof(dev->d_stats));
+		dev->d_trace = (struct NTFS_TRACE*)NULL;
+		dev->d_prefetch = (struct NTFS_PREFETCH*)NULL;
 	}
 	return dev;
 }
@@ -181,7 +203,9 @@ int ntfs_device_sync(struct ntfs_device *dev)
 
 	if (NDevDirty(dev)) {
 		dops = dev->d_ops;
-		ret = dops->sync(dev);
+		ret = ntfs_flush_block_cache(dev);
+		if (dops->sync(dev))
+			ret = -1;
 	} else
 		ret = 0;
 	return ret;
@@ -220,6 +244,14 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 	if (!count)
 		return 0;
 	
+	NTFS_STATS_ADD(dev->d_stats.reads, 1);
+	NTFS_STATS_ADD(dev->d_stats.read_bytes, count);
+	if (dev->d_trace)
+		ntfs_trace_io(dev, pos, count, FALSE);
+	if (dev->d_prefetch)
+		ntfs_prefetch_io(dev, pos, count);
+	if (dev->d_cache)
+		return (ntfs_block_cache_pread(dev, pos, count, b));
 	dops = dev->d_ops;
 
 	for (total = 0; count; count -= br, total += br) {
@@ -237,6 +269,140 @@ s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
 	return total;
 }
 
+/**
+ * ntfs_pmap - access in place to the data on a read-only disk
+ * @dev:	device to read from
+ * @pos:	position in device of the data
+ * @count:	number of bytes wanted
+ *
+ * This function gets a pointer to the @count bytes at position @pos of
+ * a device which can be accessed in place, such as a read-only image
+ * file mapped into memory, so that the data does not have to be copied.
+ * The data remains valid until the device is closed, it must not be
+ * modified.
+ *
+ * On success, return a pointer to the data. If the device cannot be
+ * accessed in place, or the data is not fully available, return NULL
+ * and the data has to be read through ntfs_pread().
+ */
+const void *ntfs_pmap(struct ntfs_device *dev, const s64 pos, s64 count)
+{
+	const void *data;
+
+	data = (const void*)NULL;
+	if (NDevMapped(dev) && dev->d_ops->map && (count > 0) && (pos >= 0)) {
+		data = dev->d_ops->map(dev, count, pos);
+		if (data) {
+			NTFS_STATS_ADD(dev->d_stats.reads, 1);
+			NTFS_STATS_ADD(dev->d_stats.read_bytes, count);
+			if (dev->d_trace)
+				ntfs_trace_io(dev, pos, count, FALSE);
+			if (dev->d_prefetch)
+				ntfs_prefetch_io(dev, pos, count);
+		}
+	}
+	return (data);
+}
+
+/**
+ * ntfs_device_zero - zero a range of a device without transferring data
+ * @dev:	device to zero
+ * @pos:	position in device of the range, a multiple of 512
+ * @count:	number of bytes to zero, a multiple of 512
+ *
+ * The range is zeroed by the device itself, by BLKZEROOUT on a Linux
+ * block device, which uses WRITE SAME or WRITE ZEROES when the device
+ * supports them, or by punching a hole when the volume is in a regular
+ * file. The cached blocks overlapping the range are zeroed too.
+ *
+ * When the device cannot zero ranges, it is flagged so that the
+ * next requests fail at once.
+ *
+ * On success return 0. On error return -1 with errno set, and the
+ * caller has to write zeroes to the range.
+ */
+int ntfs_device_zero(struct ntfs_device *dev, s64 pos, s64 count)
+{
+#ifdef BLKZEROOUT
+	u64 range[2];
+#endif
+	int res;
+
+	if ((pos < 0) || (count < 0) || ((pos | count) & 511)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!count)
+		return (0);
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return (-1);
+	}
+	res = -1;
+	errno = EOPNOTSUPP;
+#ifdef BLKZEROOUT
+	if (!NDevNoZeroOut(dev) && dev->d_ops->ioctl) {
+		NTFS_STATS_ADD(dev->d_stats.writes, 1);
+		if (dev->d_trace)
+			ntfs_trace_io(dev, pos, count, TRUE);
+		NDevSetDirty(dev);
+		if (dev->d_cache)
+			ntfs_block_cache_zero(dev, pos, count);
+		range[0] = pos;
+		range[1] = count;
+		res = dev->d_ops->ioctl(dev, BLKZEROOUT, range);
+		if (res && ((errno == ENOTTY) || (errno == EOPNOTSUPP)
+				|| (errno == EINVAL) || (errno == ENOSYS))) {
+			NDevSetNoZeroOut(dev);
+			errno = EOPNOTSUPP;
+		}
+		if (!res && NDevSync(dev) && dev->d_ops->sync(dev))
+			res = -1;
+	}
+#else
+	NDevSetNoZeroOut(dev);
+#endif
+	return (res);
+}
+
+/**
+ * ntfs_device_discard - discard ranges of a device
+ * @dev:	device to discard from
+ * @seg:	ranges to discard, their buffers are not used
+ * @nseg:	number of ranges
+ *
+ * The ranges are discarded by the device itself, by BLKDISCARD on a
+ * Linux block device, or by punching a hole when the volume is in a
+ * regular file, so that the storage can reclaim them. Their content is
+ * undefined afterwards, and the cached blocks are not updated, hence
+ * the ranges must be unused.
+ *
+ * This may be called from another thread than the one accessing the
+ * device, with the data overlapping the ranges already synced.
+ *
+ * On success return 0. On error return -1 with errno set, EOPNOTSUPP
+ * meaning the device cannot discard.
+ */
+int ntfs_device_discard(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	if (!dev || (nseg < 0) || (nseg && !seg)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!nseg)
+		return (0);
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return (-1);
+	}
+	if (!dev->d_ops->discard) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	return (dev->d_ops->discard(dev, seg, nseg));
+}
+
 /**
  * ntfs_pwrite - positioned write to disk
  * @dev:	device to write to
@@ -277,7 +443,18 @@ s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 	
 	dops = dev->d_ops;
 
+	NTFS_STATS_ADD(dev->d_stats.writes, 1);
+	NTFS_STATS_ADD(dev->d_stats.written_bytes, count);
+	if (dev->d_trace)
+		ntfs_trace_io(dev, pos, count, TRUE);
 	NDevSetDirty(dev);
+	if (dev->d_cache) {
+		total = ntfs_block_cache_pwrite(dev, pos, count, b);
+		if (NDevSync(dev) && (total > 0)
+		    && (ntfs_flush_block_cache(dev) || dops->sync(dev)))
+			total--; /* on sync error, return partially written */
+		return (total);
+	}
 	for (total = 0; count; count -= written, total += written) {
 		written = dops->pwrite(dev, (const char*)b + total, count,
 				       pos + total);
@@ -301,6 +478,228 @@ out:
 	return ret;
 }
 
+/*
+ *		Get the number of leading bytes of a batch which can be
+ *	transferred by a single pread() or pwrite(), merging the segments
+ *	which are contiguous both on device and in memory.
+ */
+
+static s64 ntfs_segments_merge(const struct ntfs_io_segment *seg, int nseg)
+{
+	s64 count;
+	int i;
+
+	count = seg[0].count;
+	for (i=1; (i<nseg)
+	    && (seg[i].pos == (seg[0].pos + count))
+	    && ((char*)seg[i].buf == ((char*)seg[0].buf + count)); i++)
+		count += seg[i].count;
+	return (count);
+}
+
+/*
+ *		Skip over the bytes of a batch which have been transferred
+ *
+ *	The first segment still to be transferred is adjusted if it was
+ *	partially transferred, and its index is returned.
+ */
+
+static int ntfs_segments_skip(struct ntfs_io_segment *vec, int first,
+			int nseg, s64 done)
+{
+	while ((first < nseg) && (done >= vec[first].count)) {
+		done -= vec[first].count;
+		first++;
+	}
+	if (done) {
+		vec[first].pos += done;
+		vec[first].count -= done;
+		vec[first].buf = (char*)vec[first].buf + done;
+	}
+	return (first);
+}
+
+/*
+ *		Copy the segments of a batch and check them
+ *
+ *	Returns zero if successful, -1 with errno set otherwise
+ */
+
+static int ntfs_segments_copy(struct ntfs_io_segment *vec,
+			const struct ntfs_io_segment *seg, int nseg)
+{
+	int i;
+
+	if (!seg || (nseg < 0) || (nseg > NTFS_MAX_IO_SEGMENTS)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	for (i=0; i<nseg; i++) {
+		if (!seg[i].buf || (seg[i].count < 0) || (seg[i].pos < 0)) {
+			errno = EINVAL;
+			return (-1);
+		}
+		vec[i] = seg[i];
+	}
+	return (0);
+}
+
+/*
+ *		Count the requests and bytes of a batch
+ *
+ *	When tracing, each segment is recorded as a transfer.
+ */
+
+static void ntfs_segments_count(struct ntfs_device *dev, BOOL write,
+			const struct ntfs_io_segment *vec, int nseg)
+{
+	s64 count;
+	int i;
+
+	count = 0;
+	for (i=0; i<nseg; i++) {
+		count += vec[i].count;
+		if (dev->d_trace && vec[i].count)
+			ntfs_trace_io(dev, vec[i].pos, vec[i].count, write);
+		if (dev->d_prefetch && !write)
+			ntfs_prefetch_io(dev, vec[i].pos, vec[i].count);
+	}
+	if (write) {
+		NTFS_STATS_ADD(dev->d_stats.writes, 1);
+		NTFS_STATS_ADD(dev->d_stats.written_bytes, count);
+	} else {
+		NTFS_STATS_ADD(dev->d_stats.reads, 1);
+		NTFS_STATS_ADD(dev->d_stats.read_bytes, count);
+	}
+}
+
+/**
+ * ntfs_preadv - batched positioned read from disk
+ * @dev:	device to read from
+ * @seg:	segments to read, each with its position, size and buffer
+ * @nseg:	number of segments (at most NTFS_MAX_IO_SEGMENTS)
+ *
+ * This function reads all the segments described in @seg, in a single
+ * device call when the device supports batched reads, otherwise using
+ * one pread() call for each group of segments which are contiguous both
+ * on device and in memory.
+ *
+ * On success, return the number of bytes successfully read from the
+ * segments taken in order. If this number is lower than the total size
+ * of the segments, the read has reached end of file or an error was
+ * encountered so that the read is partial.
+ *
+ * On error and nothing has been read, return -1 with errno set
+ * appropriately to the return code of the device read, or set to
+ * EINVAL in case of invalid arguments.
+ */
+s64 ntfs_preadv(struct ntfs_device *dev, const struct ntfs_io_segment *seg,
+		int nseg)
+{
+	struct ntfs_io_segment vec[NTFS_MAX_IO_SEGMENTS];
+	struct ntfs_device_operations *dops;
+	s64 br, total;
+	int first;
+
+	ntfs_log_trace("nseg %d\n", nseg);
+
+	if (ntfs_segments_copy(vec, seg, nseg))
+		return (-1);
+	dops = dev->d_ops;
+	total = 0;
+	first = ntfs_segments_skip(vec, 0, nseg, 0);
+	if (first < nseg)
+		ntfs_segments_count(dev, FALSE, &vec[first], nseg - first);
+	while (first < nseg) {
+		if (dev->d_cache)
+			br = ntfs_block_cache_preadv(dev, &vec[first],
+				nseg - first);
+		else if (dops->preadv)
+			br = dops->preadv(dev, &vec[first], nseg - first);
+		else
+			br = dops->pread(dev, vec[first].buf,
+				ntfs_segments_merge(&vec[first], nseg - first),
+				vec[first].pos);
+		/* If EOF or error return number of bytes read. */
+		if (br <= 0)
+			return (total ? total : br);
+		total += br;
+		first = ntfs_segments_skip(vec, first, nseg, br);
+	}
+	return (total);
+}
+
+/**
+ * ntfs_pwritev - batched positioned write to disk
+ * @dev:	device to write to
+ * @seg:	segments to write, each with its position, size and buffer
+ * @nseg:	number of segments (at most NTFS_MAX_IO_SEGMENTS)
+ *
+ * This function writes all the segments described in @seg, in a single
+ * device call when the device supports batched writes, otherwise using
+ * one pwrite() call for each group of segments which are contiguous
+ * both on device and in memory.
+ *
+ * On success, return the number of bytes successfully written from the
+ * segments taken in order. If this number is lower than the total size
+ * of the segments, the write has been interrupted or an error was
+ * encountered so that the write is partial.
+ *
+ * On error and nothing has been written, return -1 with errno set
+ * appropriately to the return code of the device write, or set to
+ * EINVAL in case of invalid arguments.
+ */
+s64 ntfs_pwritev(struct ntfs_device *dev, const struct ntfs_io_segment *seg,
+		int nseg)
+{
+	struct ntfs_io_segment vec[NTFS_MAX_IO_SEGMENTS];
+	struct ntfs_device_operations *dops;
+	s64 written, total;
+	int first;
+
+	ntfs_log_trace("nseg %d\n", nseg);
+
+	if (ntfs_segments_copy(vec, seg, nseg))
+		return (-1);
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return (-1);
+	}
+	dops = dev->d_ops;
+	total = 0;
+	first = ntfs_segments_skip(vec, 0, nseg, 0);
+	if (first < nseg) {
+		ntfs_segments_count(dev, TRUE, &vec[first], nseg - first);
+		NDevSetDirty(dev);
+	}
+	while (first < nseg) {
+		if (dev->d_cache)
+			written = ntfs_block_cache_pwritev(dev, &vec[first],
+				nseg - first);
+		else if (dops->pwritev)
+			written = dops->pwritev(dev, &vec[first], nseg - first);
+		else
+			written = dops->pwrite(dev, vec[first].buf,
+				ntfs_segments_merge(&vec[first], nseg - first),
+				vec[first].pos);
+		/*
+		 * If nothing written or error return number of bytes written.
+		 */
+		if (written <= 0) {
+			if (!total)
+				total = written;
+			break;
+		}
+		total += written;
+		first = ntfs_segments_skip(vec, first, nseg, written);
+	}
+	if (NDevSync(dev) && (total > 0)
+	    && (ntfs_flush_block_cache(dev) || dops->sync(dev))) {
+		total--; /* on sync error, return partially written */
+	}
+	return (total);
+}
+
 /**
  * ntfs_mst_pread - multi sector transfer (mst) positioned read
  * @dev:	device to read from
@@ -333,7 +732,7 @@ out:
 s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b)
 {
-	s64 br, i;
+	s64 br;
 
 	if (bksize & (bksize - 1) || bksize % NTFS_BLOCK_SIZE) {
 		errno = EINVAL;
@@ -350,9 +749,7 @@ s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 	 * magic will be detected later on.
 	 */
 	count = br / bksize;
-	for (i = 0; i < count; ++i)
-		ntfs_mst_post_read_fixup((NTFS_RECORD*)
-				((u8*)b + i * bksize), bksize);
+	ntfs_mst_post_read_fixup_many(b, count, bksize, TRUE);
 	/* Finally, return the number of complete blocks read. */
 	return count;
 }
@@ -390,7 +787,7 @@ s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b)
 {
-	s64 written, i;
+	s64 written;
 
 	if (count < 0 || bksize % NTFS_BLOCK_SIZE) {
 		errno = EINVAL;
@@ -398,25 +795,14 @@ s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 	}
 	if (!count)
 		return 0;
-	/* Prepare data for writing. */
-	for (i = 0; i < count; ++i) {
-		int err;
-
-		err = ntfs_mst_pre_write_fixup((NTFS_RECORD*)
-				((u8*)b + i * bksize), bksize);
-		if (err < 0) {
-			/* Abort write at this position. */
-			if (!i)
-				return err;
-			count = i;
-			break;
-		}
-	}
+	/* Prepare data for writing, aborting at a bad block. */
+	count = ntfs_mst_pre_write_fixup_many(b, count, bksize);
+	if (count < 0)
+		return count;
 	/* Write the prepared data. */
 	written = ntfs_pwrite(dev, pos, count * bksize, b);
 	/* Quickly deprotect the data again. */
-	for (i = 0; i < count; ++i)
-		ntfs_mst_post_write_fixup((NTFS_RECORD*)((u8*)b + i * bksize));
+	ntfs_mst_post_write_fixup_many(b, count, bksize);
 	if (written <= 0)
 		return written;
 	/* Finally, return the number of complete blocks written. */
@@ -36,6 +36,9 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
@@ -63,12 +66,16 @@
 #include "lcnalloc.h"
 #include "logging.h"
 #include "cache.h"
+#include "compress.h"
 #include "misc.h"
+#include "device.h"
 #include "security.h"
 #include "reparse.h"
 #include "object_id.h"
 #include "xattrs.h"
 #include "ea.h"
+#include "probes.h"
+#include "usnjrnl.h"
 
 /*
  * The little endian Unicode strings "$I30", "$SII", "$SDH", "$O"
@@ -95,13 +102,15 @@ ntfschar NTFS_INDEX_R[3] = { const_cpu_to_le16('$'), const_cpu_to_le16('R'),
 /*
  *		Pathname hashing
  *
- *	Based on first char and second char (which may be '\0')
+ *	Based on the last component of the path, so that the hash
+ *	spreads over big caches
  */
 
 int ntfs_dir_inode_hash(const struct CACHED_GENERIC *cached)
 {
 	const char *path;
 	const unsigned char *name;
+	unsigned int val;
 
 	path = (const char*)cached->variable;
 	if (!path) {
@@ -111,8 +120,9 @@ int ntfs_dir_inode_hash(const struct CACHED_GENERIC *cached)
 	name = (const unsigned char*)strrchr(path,'/');
 	if (!name)
 		name = (const unsigned char*)path;
-	return (((name[0] << 1) + name[1] + strlen((const char*)name))
-				% (2*CACHE_INODE_SIZE));
+	for (val=0; *name; name++)
+		val = val*31 + *name;
+	return (val & INT_MAX);
 }
 
 /*
@@ -197,6 +207,42 @@ static int lookup_cache_inv_compare(const struct CACHED_GENERIC *cached,
 		    || (MREF(c->inum) != MREF(w->inum)));
 }
 
+/*
+ *		Forget a name of a directory in the lookup cache
+ *
+ *	To be called when the name is being inserted into the directory,
+ *	as a failed lookup of the name may have been recorded.
+ */
+
+static void lookup_cache_forget(ntfs_inode *dir_ni, const ntfschar *uname,
+			int uname_len)
+{
+	struct CACHED_LOOKUP item;
+	ntfs_volume *vol;
+	char *name;
+	char *cached_name;
+
+	vol = dir_ni->vol;
+	name = (char*)NULL;
+	if (vol->lookup_cache
+	    && (ntfs_ucstombs(uname, uname_len, &name, 0) > 0)) {
+		if (!NVolCaseSensitive(vol)) {
+			cached_name = ntfs_uppercase_mbs(name,
+					vol->upcase, vol->upcase_len);
+			free(name);
+			name = cached_name;
+		}
+		if (name) {
+			item.name = name;
+			item.namesize = strlen(name) + 1;
+			item.parent = dir_ni->mft_no;
+			ntfs_invalidate_cache(vol->lookup_cache,
+				GENERIC(&item), lookup_cache_compare, 0);
+			free(name);
+		}
+	}
+}
+
 /*
  *		Lookup hashing
  *
@@ -215,12 +261,48 @@ int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached)
 		ntfs_log_error("Bad lookup cache entry\n");
 		return (-1);
 	}
-	val = (name[0] << 2) + (name[1] << 1) + name[count - 1] + count;
-	return (val % (2*CACHE_LOOKUP_SIZE));
+	val = ((const struct CACHED_LOOKUP*)cached)->parent;
+	while (count--)
+		val = val*31 + *name++;
+	return (val & INT_MAX);
 }
 
 #endif
 
+/*
+ *		Collate a name against a directory entry
+ *	for ntfs_inode_lookup_by_name()
+ *
+ *	When ignoring case, the name is upcased once for the whole lookup.
+ */
+
+struct NAME_LOOKUP {
+	const ntfschar *uname;
+	int uname_len;
+	IGNORE_CASE_BOOL case_sensitivity;
+	ntfs_volume *vol;
+	BOOL upcased;
+	ntfschar upname[NTFS_MAX_NAME_LEN];
+} ;
+
+static int name_lookup_collate(const void *data, const INDEX_ENTRY *ie)
+{
+	const struct NAME_LOOKUP *lookup;
+
+	lookup = (const struct NAME_LOOKUP*)data;
+	if (lookup->upcased)
+		return (ntfs_upcased_names_collate(lookup->upname,
+			lookup->uname_len,
+			(const ntfschar*)&ie->key.file_name.file_name,
+			ie->key.file_name.file_name_length,
+			lookup->vol->upcase, lookup->vol->upcase_len));
+	return (ntfs_names_full_collate(lookup->uname, lookup->uname_len,
+			(const ntfschar*)&ie->key.file_name.file_name,
+			ie->key.file_name.file_name_length,
+			lookup->case_sensitivity,
+			lookup->vol->upcase, lookup->vol->upcase_len));
+}
+
 /**
  * ntfs_inode_lookup_by_name - find an inode in a directory given its name
  * @dir_ni:	ntfs inode of the directory in which to search for the name
@@ -260,7 +342,8 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 	IGNORE_CASE_BOOL case_sensitivity;
 	u8 *index_end;
 	ntfs_attr *ia_na;
-	int eo, rc;
+	struct NAME_LOOKUP lookup;
+	int eo, rc, item;
 	u32 index_block_size;
 	u8 index_vcn_size_bits;
 
@@ -295,59 +378,35 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 		goto put_err_out;
 	}
 	index_end = (u8*)&ir->index + le32_to_cpu(ir->index.index_length);
-	/* The first index entry. */
-	ie = (INDEX_ENTRY*)((u8*)&ir->index +
-			le32_to_cpu(ir->index.entries_offset));
 	/*
-	 * Loop until we exceed valid memory (corruption case) or until we
-	 * reach the last entry.
+	 * Search the name in the root, the name is either found, or we
+	 * get the entry before which we might need to descend into the
+	 * B+tree.
 	 */
-	for (;; ie = (INDEX_ENTRY*)((u8*)ie + le16_to_cpu(ie->length))) {
-		/* Bounds checks. */
-		if ((u8*)ie < (u8*)ctx->mrec || (u8*)ie +
-				sizeof(INDEX_ENTRY_HEADER) > index_end ||
-				(u8*)ie + le16_to_cpu(ie->key_length) >
-				index_end) {
-			ntfs_log_error("Index entry out of bounds in inode %lld"
-				       "\n", (unsigned long long)dir_ni->mft_no);
-			goto put_err_out;
-		}
-		/*
-		 * The last entry cannot contain a name. It can however contain
-		 * a pointer to a child node in the B+tree so we just break out.
-		 */
-		if (ie->ie_flags & INDEX_ENTRY_END)
-			break;
-		
-		if (!le16_to_cpu(ie->length)) {
-			ntfs_log_error("Zero length index entry in inode %lld"
-				       "\n", (unsigned long long)dir_ni->mft_no);
-			goto put_err_out;
-		}
-		/*
-		 * Not a perfect match, need to do full blown collation so we
-		 * know which way in the B+tree we have to go.
-		 */
-		rc = ntfs_names_full_collate(uname, uname_len,
-				(ntfschar*)&ie->key.file_name.file_name,
-				ie->key.file_name.file_name_length,
-				case_sensitivity, vol->upcase, vol->upcase_len);
-		/*
-		 * If uname collates before the name of the current entry, there
-		 * is definitely no such name in this index but we might need to
-		 * descend into the B+tree so we just break out of the loop.
-		 */
-		if (rc == -1)
-			break;
-		/* The names are not equal, continue the search. */
-		if (rc)
-			continue;
-		/*
-		 * Perfect match, this will never happen as the
-		 * ntfs_are_names_equal() call will have gotten a match but we
-		 * still treat it correctly.
-		 */
+	lookup.uname = uname;
+	lookup.uname_len = uname_len;
+	lookup.case_sensitivity = case_sensitivity;
+	lookup.vol = vol;
+	lookup.upcased = (case_sensitivity == IGNORE_CASE)
+			&& (uname_len <= NTFS_MAX_NAME_LEN);
+	if (lookup.upcased) {
+		memcpy(lookup.upname, uname, uname_len*sizeof(ntfschar));
+		ntfs_name_upcase(lookup.upname, uname_len,
+				vol->upcase, vol->upcase_len);
+	}
+	rc = ntfs_ie_search(&ir->index, index_end, name_lookup_collate,
+			&lookup, &ie, &item);
+	if (rc == STATUS_ERROR) {
+		ntfs_log_error("Index entry out of bounds in inode %lld"
+			       "\n", (unsigned long long)dir_ni->mft_no);
+		goto put_err_out;
+	}
+	if (rc == STATUS_OK) {
 		mref = le64_to_cpu(ie->indexed_file);
+		if (ntfs_index_lazy_pending(dir_ni, ie)) {
+			ntfs_attr_put_search_ctx(ctx);
+			goto removed;
+		}
 		ntfs_attr_put_search_ctx(ctx);
 		return mref;
 	}
@@ -394,7 +453,7 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 descend_into_child_node:
 
 	/* Read the index block starting at vcn. */
-	br = ntfs_attr_mst_pread(ia_na, vcn << index_vcn_size_bits, 1,
+	br = ntfs_index_block_read(ia_na, vcn << index_vcn_size_bits,
 			index_block_size, ia);
 	if (br != 1) {
 		if (br != -1)
@@ -431,58 +490,23 @@ descend_into_child_node:
 		goto close_err_out;
 	}
 
-	/* The first index entry. */
-	ie = (INDEX_ENTRY*)((u8*)&ia->index +
-			le32_to_cpu(ia->index.entries_offset));
-	/*
-	 * Iterate similar to above big loop but applied to index buffer, thus
-	 * loop until we exceed valid memory (corruption case) or until we
-	 * reach the last entry.
-	 */
-	for (;; ie = (INDEX_ENTRY*)((u8*)ie + le16_to_cpu(ie->length))) {
-		/* Bounds check. */
-		if ((u8*)ie < (u8*)ia || (u8*)ie +
-				sizeof(INDEX_ENTRY_HEADER) > index_end ||
-				(u8*)ie + le16_to_cpu(ie->key_length) >
-				index_end) {
-			ntfs_log_error("Index entry out of bounds in directory "
-				       "inode %lld.\n", 
-				       (unsigned long long)dir_ni->mft_no);
-			errno = EIO;
-			goto close_err_out;
-		}
-		/*
-		 * The last entry cannot contain a name. It can however contain
-		 * a pointer to a child node in the B+tree so we just break out.
-		 */
-		if (ie->ie_flags & INDEX_ENTRY_END)
-			break;
-		
-		if (!le16_to_cpu(ie->length)) {
-			errno = EIO;
-			ntfs_log_error("Zero length index entry in inode %lld"
-				       "\n", (unsigned long long)dir_ni->mft_no);
-			goto close_err_out;
-		}
-		/*
-		 * Not a perfect match, need to do full blown collation so we
-		 * know which way in the B+tree we have to go.
-		 */
-		rc = ntfs_names_full_collate(uname, uname_len,
-				(ntfschar*)&ie->key.file_name.file_name,
-				ie->key.file_name.file_name_length,
-				case_sensitivity, vol->upcase, vol->upcase_len);
-		/*
-		 * If uname collates before the name of the current entry, there
-		 * is definitely no such name in this index but we might need to
-		 * descend into the B+tree so we just break out of the loop.
-		 */
-		if (rc == -1)
-			break;
-		/* The names are not equal, continue the search. */
-		if (rc)
-			continue;
+	rc = ntfs_ie_search(&ia->index, index_end, name_lookup_collate,
+			&lookup, &ie, &item);
+	if (rc == STATUS_ERROR) {
+		ntfs_log_error("Index entry out of bounds in directory "
+			       "inode %lld.\n",
+			       (unsigned long long)dir_ni->mft_no);
+		errno = EIO;
+		goto close_err_out;
+	}
+	if (rc == STATUS_OK) {
 		mref = le64_to_cpu(ie->indexed_file);
+		if (ntfs_index_lazy_pending(dir_ni, ie)) {
+			free(ia);
+			ntfs_attr_close(ia_na);
+			ntfs_attr_put_search_ctx(ctx);
+			goto removed;
+		}
 		free(ia);
 		ntfs_attr_close(ia_na);
 		ntfs_attr_put_search_ctx(ctx);
@@ -522,6 +546,11 @@ descend_into_child_node:
 	ntfs_log_debug("Entry not found.\n");
 	errno = ENOENT;
 	return -1;
+removed:
+		/* the entry has been deleted, but not removed yet */
+	ntfs_log_debug("Entry removed.\n");
+	errno = ENOENT;
+	return -1;
 put_err_out:
 	eo = EIO;
 	ntfs_log_debug("Corrupt directory. Aborting lookup.\n");
@@ -548,7 +577,7 @@ close_err_out:
 u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 {
 	int uname_len;
-	ntfschar *uname = (ntfschar*)NULL;
+	ntfschar uname[NTFS_MAX_NAME_LEN + 1];
 	u64 inum;
 	char *cached_name;
 	const char *const_name;
@@ -570,30 +599,35 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 
 		if (dir_ni->vol->lookup_cache) {
 			struct CACHED_LOOKUP item;
-			struct CACHED_LOOKUP *cached;
+			struct CACHED_LOOKUP cached;
 
 			item.name = const_name;
 			item.namesize = strlen(const_name) + 1;
 			item.parent = dir_ni->mft_no;
-			cached = (struct CACHED_LOOKUP*)ntfs_fetch_cache(
-					dir_ni->vol->lookup_cache,
-					GENERIC(&item), lookup_cache_compare);
-			if (cached) {
-				inum = cached->inum;
+			if (ntfs_fetch_cache_copy(dir_ni->vol->lookup_cache,
+					GENERIC(&item), lookup_cache_compare,
+					(struct CACHED_GENERIC*)&cached)) {
+				inum = cached.inum;
 				if (inum == (u64)-1)
 					errno = ENOENT;
 			} else {
 				/* Generate unicode name. */
-				uname_len = ntfs_mbstoucs(name, &uname);
+				uname_len = ntfs_mbstoucs_buf(name, uname,
+						NTFS_MAX_NAME_LEN + 1);
 				if (uname_len >= 0) {
 					inum = ntfs_inode_lookup_by_name(dir_ni,
 							uname, uname_len);
 					item.inum = inum;
-				/* enter into cache, even if not found */
-					ntfs_enter_cache(dir_ni->vol->lookup_cache,
+				/*
+				 * enter into cache, even if not found, so
+				 * that failed lookups are not repeated
+				 */
+					if ((inum != (u64)-1)
+					    || (errno == ENOENT))
+						ntfs_enter_cache(
+							dir_ni->vol->lookup_cache,
 							GENERIC(&item),
 							lookup_cache_compare);
-					free(uname);
 				} else
 					inum = (s64)-1;
 			}
@@ -601,11 +635,11 @@ u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name)
 #endif
 			{
 				/* Generate unicode name. */
-			uname_len = ntfs_mbstoucs(cached_name, &uname);
+			uname_len = ntfs_mbstoucs_buf(name, uname,
+						NTFS_MAX_NAME_LEN + 1);
 			if (uname_len >= 0) {
 				inum = ntfs_inode_lookup_by_name(dir_ni,
 						uname, uname_len);
-				free(uname);
 			} else
 				inum = (s64)-1;
 		}
@@ -654,20 +688,11 @@ void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name, u64 inum)
 #endif
 }
 
-/**
- * ntfs_pathname_to_inode - Find the inode which represents the given pathname
- * @vol:       An ntfs volume obtained from ntfs_mount
- * @parent:    A directory inode to begin the search (may be NULL)
- * @pathname:  Pathname to be located
- *
- * Take an ASCII pathname and find the inode that represents it.  The function
- * splits the path and then descends the directory tree.  If @parent is NULL,
- * then the root directory '.' will be used as the base for the search.
- *
- * Return:  inode  Success, the pathname was valid
- *	    NULL   Error, the pathname was invalid, or some other error occurred
+/*
+ *		Find the inode of a pathname, the volume being entered
  */
-ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
+
+static ntfs_inode *pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		const char *pathname)
 {
 	u64 inum;
@@ -675,12 +700,14 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 	char *p, *q;
 	ntfs_inode *ni;
 	ntfs_inode *result = NULL;
-	ntfschar *unicode = NULL;
+	ntfschar unicode[NTFS_MAX_NAME_LEN + 1];
 	char *ascii = NULL;
 #if CACHE_INODE_SIZE
 	struct CACHED_INODE item;
-	struct CACHED_INODE *cached;
+	struct CACHED_INODE found;
+	BOOL cached;
 	char *fullname;
+	int fulllen;
 #endif
 
 	if (!vol || !pathname) {
@@ -709,40 +736,67 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 	if (parent) {
 		ni = parent;
 	} else {
+		ni = (ntfs_inode*)NULL;
 #if CACHE_INODE_SIZE
 			/*
-			 * fetch inode for full path from cache
+			 * fetch inode for full path from cache, or else
+			 * for the longest prefix of the path found in cache,
+			 * so that the directories above need no search.
+			 * The prefix is shortened by replacing its final
+			 * separator by a null, separators are restored then.
 			 */
+		cached = FALSE;
+		q = (char*)NULL;
 		if (*fullname) {
-			item.pathname = fullname;
-			item.varsize = strlen(fullname) + 1;
-			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
-				vol->xinode_cache, GENERIC(&item),
-				inode_cache_compare);
-		} else
-			cached = (struct CACHED_INODE*)NULL;
+			fulllen = strlen(fullname);
+			do {
+				item.pathname = fullname;
+				item.varsize = strlen(fullname) + 1;
+				cached = ntfs_fetch_cache_copy(
+					vol->xinode_cache, GENERIC(&item),
+					inode_cache_compare,
+					(struct CACHED_GENERIC*)&found);
+				if (!cached) {
+					q = strrchr(fullname, PATH_SEP);
+					if (q)
+						*q = '\0';
+				}
+			} while (!cached && q);
+			for (len=0; len<fulllen; len++)
+				if (!fullname[len])
+					fullname[len] = PATH_SEP;
+		}
 		if (cached) {
 			/*
 			 * return opened inode if found in cache
 			 */
-			inum = MREF(cached->inum);
+			inum = MREF(found.inum);
 			ni = ntfs_inode_open(vol, inum);
 			if (!ni) {
 				ntfs_log_debug("Cannot open inode %llu: %s.\n",
 						(unsigned long long)inum, p);
 				err = EIO;
+				goto out;
 			}
-			result = ni;
-			goto out;
+			if (!q) {
+				result = ni;
+				goto out;
+			}
+			/* resume the search after the cached prefix */
+			p = q;
+			while (*p == PATH_SEP)
+				p++;
 		}
 #endif
-		ni = ntfs_inode_open(vol, FILE_root);
 		if (!ni) {
-			ntfs_log_debug("Couldn't open the inode of the root "
-					"directory.\n");
-			err = EIO;
-			result = (ntfs_inode*)NULL;
-			goto out;
+			ni = ntfs_inode_open(vol, FILE_root);
+			if (!ni) {
+				ntfs_log_debug("Couldn't open the inode of the"
+						" root directory.\n");
+				err = EIO;
+				result = (ntfs_inode*)NULL;
+				goto out;
+			}
 		}
 	}
 
@@ -752,56 +806,28 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		if (q != NULL) {
 			*q = '\0';
 		}
+		len = ntfs_mbstoucs_buf(p, unicode, NTFS_MAX_NAME_LEN + 1);
+		if (len < 0) {
+			err = errno;
+			if (err != ENAMETOOLONG)
+				ntfs_log_perror("Could not convert filename"
+					" to Unicode: '%s'", p);
+			goto close;
+		}
+		inum = ntfs_inode_lookup_by_name(ni, unicode, len);
 #if CACHE_INODE_SIZE
 			/*
-			 * fetch inode for partial path from cache
+			 * the partial paths from here are not in cache,
+			 * insert into cache if found
 			 */
-		cached = (struct CACHED_INODE*)NULL;
-		if (!parent) {
+		if (!parent && (inum != (u64) -1)) {
 			item.pathname = fullname;
 			item.varsize = strlen(fullname) + 1;
-			cached = (struct CACHED_INODE*)ntfs_fetch_cache(
-					vol->xinode_cache, GENERIC(&item),
+			item.inum = inum;
+			ntfs_enter_cache(vol->xinode_cache,
+					GENERIC(&item),
 					inode_cache_compare);
-			if (cached) {
-				inum = cached->inum;
-			}
 		}
-			/*
-			 * if not in cache, translate, search, then
-			 * insert into cache if found
-			 */
-		if (!cached) {
-			len = ntfs_mbstoucs(p, &unicode);
-			if (len < 0) {
-				ntfs_log_perror("Could not convert filename to Unicode:"
-					" '%s'", p);
-				err = errno;
-				goto close;
-			} else if (len > NTFS_MAX_NAME_LEN) {
-				err = ENAMETOOLONG;
-				goto close;
-			}
-			inum = ntfs_inode_lookup_by_name(ni, unicode, len);
-			if (!parent && (inum != (u64) -1)) {
-				item.inum = inum;
-				ntfs_enter_cache(vol->xinode_cache,
-						GENERIC(&item),
-						inode_cache_compare);
-			}
-		}
-#else
-		len = ntfs_mbstoucs(p, &unicode);
-		if (len < 0) {
-			ntfs_log_perror("Could not convert filename to Unicode:"
-					" '%s'", p);
-			err = errno;
-			goto close;
-		} else if (len > NTFS_MAX_NAME_LEN) {
-			err = ENAMETOOLONG;
-			goto close;
-		}
-		inum = ntfs_inode_lookup_by_name(ni, unicode, len);
 #endif
 		if (inum == (u64) -1) {
 			ntfs_log_debug("Couldn't find name '%s' in pathname "
@@ -825,9 +851,6 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 			goto close;
 		}
 	
-		free(unicode);
-		unicode = NULL;
-
 		if (q) *q++ = PATH_SEP; /* JPA */
 		p = q;
 		while (p && *p && *p == PATH_SEP)
@@ -842,12 +865,39 @@ close:
 			err = errno;
 out:
 	free(ascii);
-	free(unicode);
 	if (err)
 		errno = err;
 	return result;
 }
 
+/**
+ * ntfs_pathname_to_inode - Find the inode which represents the given pathname
+ * @vol:       An ntfs volume obtained from ntfs_mount
+ * @parent:    A directory inode to begin the search (may be NULL)
+ * @pathname:  Pathname to be located
+ *
+ * Take an ASCII pathname and find the inode that represents it.  The function
+ * splits the path and then descends the directory tree.  If @parent is NULL,
+ * then the root directory '.' will be used as the base for the search.
+ *
+ * Return:  inode  Success, the pathname was valid
+ *	    NULL   Error, the pathname was invalid, or some other error occurred
+ */
+ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
+		const char *pathname)
+{
+	ntfs_inode *ni;
+
+	if (!vol) {
+		errno = EINVAL;
+		return ((ntfs_inode*)NULL);
+	}
+	ntfs_volume_enter(vol);
+	ni = pathname_to_inode(vol, parent, pathname);
+	ntfs_volume_leave(vol);
+	return (ni);
+}
+
 /*
  * The little endian Unicode string ".." for ntfs_readdir().
  */
@@ -951,6 +1001,44 @@ static u32 ntfs_dir_entry_type(ntfs_inode *dir_ni, MFT_REF mref,
 	return (dt_type);
 }
 
+/*
+ *		Prefetch the mft records designated by the entries of an
+ *	index block, as they are likely to be opened by the caller
+ *	(stat() of each entry after readdir()).
+ *
+ *	Only done when the device has a block cache, errors are ignored.
+ */
+
+static void ntfs_prefetch_entries(ntfs_volume *vol, INDEX_ENTRY *ie,
+		const u8 *index_end)
+{
+	MFT_REF *mrefs;
+	int olderrno;
+	int count;
+
+	if (vol->dev->d_cache && ((u8*)ie < index_end)) {
+		mrefs = (MFT_REF*)ntfs_malloc(((index_end - (u8*)ie)
+				/ sizeof(INDEX_ENTRY_HEADER)) * sizeof(MFT_REF));
+		if (mrefs) {
+			olderrno = errno;
+			count = 0;
+			while (((u8*)ie + sizeof(INDEX_ENTRY_HEADER)
+					<= index_end)
+			    && !(ie->ie_flags & INDEX_ENTRY_END)
+			    && le16_to_cpu(ie->length)
+			    && ((u8*)ie + le16_to_cpu(ie->length)
+					<= index_end)) {
+				mrefs[count++] = le64_to_cpu(ie->indexed_file);
+				ie = (INDEX_ENTRY*)((u8*)ie
+						+ le16_to_cpu(ie->length));
+			}
+			ntfs_mft_records_prefetch(vol, mrefs, count);
+			free(mrefs);
+			errno = olderrno;
+		}
+	}
+}
+
 /**
  * ntfs_filldir - ntfs specific filldir method
  * @dir_ni:	ntfs inode of current directory
@@ -963,12 +1051,12 @@ static u32 ntfs_dir_entry_type(ntfs_inode *dir_ni, MFT_REF mref,
  * callback.
  */
 static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos,
-		INDEX_ENTRY *ie, void *dirent, ntfs_filldir_t filldir)
+		INDEX_ENTRY *ie, void *dirent, ntfs_filldir_fn_t filldir)
 {
 	FILE_NAME_ATTR *fn = &ie->key.file_name;
 	unsigned dt_type;
 	BOOL metadata;
-	ntfschar *loname;
+	ntfschar loname[NTFS_MAX_NAME_LEN];
 	int res;
 	MFT_REF mref;
 
@@ -979,6 +1067,9 @@ static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos,
 	/* Skip root directory self reference entry. */
 	if (MREF_LE(ie->indexed_file) == FILE_root)
 		return 0;
+	/* Skip the entries deleted but not removed yet */
+	if (ntfs_index_lazy_pending(dir_ni, ie))
+		return 0;
 	if ((ie->key.file_name.file_attributes
 		     & (FILE_ATTR_REPARSE_POINT | FILE_ATTR_SYSTEM))
 	    && !metadata)
@@ -999,22 +1090,17 @@ static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos,
 			res = filldir(dirent, fn->file_name,
 					fn->file_name_length,
 					fn->file_name_type, *pos,
-					mref, dt_type);
+					mref, dt_type, fn);
 		} else {
-			loname = (ntfschar*)ntfs_malloc(2*fn->file_name_length);
-			if (loname) {
-				memcpy(loname, fn->file_name,
-					2*fn->file_name_length);
-				ntfs_name_locase(loname, fn->file_name_length,
-					dir_ni->vol->locase,
-					dir_ni->vol->upcase_len);
-				res = filldir(dirent, loname,
-					fn->file_name_length,
-					fn->file_name_type, *pos,
-					mref, dt_type);
-				free(loname);
-			} else
-				res = -1;
+			memcpy(loname, fn->file_name,
+				2*fn->file_name_length);
+			ntfs_name_locase(loname, fn->file_name_length,
+				dir_ni->vol->locase,
+				dir_ni->vol->upcase_len);
+			res = filldir(dirent, loname,
+				fn->file_name_length,
+				fn->file_name_type, *pos,
+				mref, dt_type, fn);
 		}
 	} else
 		res = 0;
@@ -1086,6 +1172,26 @@ err_out:
 	return ERR_MREF(-1);
 }
 
+/*
+ *		Context for feeding a filldir callback from ntfs_readdir_fn()
+ */
+
+struct READDIR_COMPAT {
+	void *dirent;
+	ntfs_filldir_t filldir;
+} ;
+
+static int ntfs_filldir_compat(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type, const s64 pos,
+		const MFT_REF mref, const unsigned dt_type,
+		const FILE_NAME_ATTR *fn __attribute__((unused)))
+{
+	struct READDIR_COMPAT *compat = (struct READDIR_COMPAT*)dirent;
+
+	return (compat->filldir(compat->dirent, name, name_len, name_type,
+			pos, mref, dt_type));
+}
+
 /**
  * ntfs_readdir - read the contents of an ntfs directory
  * @dir_ni:	ntfs inode of current directory
@@ -1098,24 +1204,64 @@ err_out:
  * supplied by the caller.
  *
  * Return 0 on success or -1 on error with errno set to the error code.
- * On success, the value at address 'pos' gets updated to the position of the
- * next entry in the directory or -1 if no more entries are available.
- *
- * Note: Index blocks are parsed in ascending vcn order, from which follows
- * that the directory entries are not returned sorted.
+ * See ntfs_readdir_fn() for the meaning of the value at address 'pos'.
  */
 int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		void *dirent, ntfs_filldir_t filldir)
 {
-	s64 i_size, br, ia_pos, bmp_pos, ia_start, ia_offset;
+	struct READDIR_COMPAT compat;
+
+	if (!filldir) {
+		errno = EINVAL;
+		return -1;
+	}
+	compat.dirent = dirent;
+	compat.filldir = filldir;
+	return (ntfs_readdir_fn(dir_ni, pos, &compat, ntfs_filldir_compat));
+}
+
+/*
+ *		Cursor for resuming a listing
+ *
+ *	When the filldir callback stops a listing within an index block,
+ *	the decoded block and the index bitmap are kept with the inode,
+ *	so that the next call at the same position resumes at the entry
+ *	where the listing stopped, instead of reading the block again and
+ *	skipping the entries already listed. The cursor is not used after
+ *	an index of the volume has been updated.
+ *
+ *	The cursor, the index block and the bitmap are allocated at once.
+ */
+
+struct READDIR_CURSOR {
+	s64 pos;		/* position the listing stopped at */
+	s64 bmp_pos;		/* index block being listed */
+	s64 bmp_size;		/* size of the index bitmap */
+	u32 changes;		/* count of index updates when stopped */
+	u32 index_block_size;
+	INDEX_ALLOCATION *ia;	/* the index block being listed */
+	u8 *bmp;		/* the full index bitmap */
+} ;
+
+/*
+ *		Walk through the index of a directory
+ *
+ *	See ntfs_readdir_fn() for the parameters
+ */
+
+static int ntfs_readdir_index(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_fn_t filldir)
+{
+	s64 i_size, br, ia_pos, bmp_pos, bmp_size, ia_start, ia_offset;
 	ntfs_volume *vol;
 	ntfs_attr *ia_na, *bmp_na = NULL;
 	ntfs_attr_search_ctx *ctx = NULL;
-	u8 *index_end, *bmp = NULL;
+	struct READDIR_CURSOR *cursor = NULL;
+	u8 *index_end, *bmp;
 	INDEX_ROOT *ir;
 	INDEX_ENTRY *ie;
-	INDEX_ALLOCATION *ia = NULL;
-	int rc, ir_pos, bmp_buf_size, eo;
+	INDEX_ALLOCATION *ia;
+	int rc, ir_pos, eo;
 	u32 index_block_size;
 	u8 index_block_size_bits, index_vcn_size_bits;
 
@@ -1160,7 +1306,7 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		rc = filldir(dirent, dotdot, 1, FILE_NAME_POSIX, *pos,
 				MK_MREF(dir_ni->mft_no,
 				le16_to_cpu(dir_ni->mrec->sequence_number)),
-				NTFS_DT_DIR);
+				NTFS_DT_DIR, (FILE_NAME_ATTR*)NULL);
 		if (rc < 0)
 			goto err_out;
 		++*pos;
@@ -1177,7 +1323,7 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		if (rc > 0)
 			goto done;
 		rc = filldir(dirent, dotdot, 2, FILE_NAME_POSIX, *pos,
-				parent_mref, NTFS_DT_DIR);
+				parent_mref, NTFS_DT_DIR, (FILE_NAME_ATTR*)NULL);
 		if (rc < 0)
 			goto err_out;
 		++*pos;
@@ -1285,10 +1431,30 @@ skip_index_root:
 	if (!ia_na)
 		goto done;
 
-	/* Allocate a buffer for the current index block. */
-	ia = ntfs_malloc(index_block_size);
-	if (!ia)
-		goto err_out;
+	/* Get the offset into the index allocation attribute. */
+	ia_pos = *pos - vol->mft_record_size;
+
+	cursor = dir_ni->readdir_cursor;
+	if (cursor && (cursor->pos == *pos)
+	    && (cursor->changes == vol->listing_changes)
+	    && (cursor->index_block_size == index_block_size)) {
+		/*
+		 * Resume in the index block where the previous call
+		 * stopped, at the entry designated by *pos.
+		 */
+		dir_ni->readdir_cursor = (struct READDIR_CURSOR*)NULL;
+		ia = cursor->ia;
+		bmp = cursor->bmp;
+		bmp_size = cursor->bmp_size;
+		bmp_pos = cursor->bmp_pos;
+		ia_start = ia_pos & ~(s64)(index_block_size - 1);
+		ia_offset = sle64_to_cpu(ia->index_block_vcn);
+		ia_offset <<= index_vcn_size_bits;
+		index_end = (u8*)&ia->index
+				+ le32_to_cpu(ia->index.index_length);
+		goto resume_index_block;
+	}
+	cursor = (struct READDIR_CURSOR*)NULL;
 
 	bmp_na = ntfs_attr_open(dir_ni, AT_BITMAP, NTFS_INDEX_I30, 4);
 	if (!bmp_na) {
@@ -1296,23 +1462,25 @@ skip_index_root:
 		goto dir_err_out;
 	}
 
-	/* Get the offset into the index allocation attribute. */
-	ia_pos = *pos - vol->mft_record_size;
-
 	bmp_pos = ia_pos >> index_block_size_bits;
-	if (bmp_pos >> 3 >= bmp_na->data_size) {
+	bmp_size = bmp_na->data_size;
+	if (bmp_pos >> 3 >= bmp_size) {
 		ntfs_log_error("Current index position exceeds index bitmap "
 				"size.\n");
 		goto dir_err_out;
 	}
 
-	bmp_buf_size = min(bmp_na->data_size, 4096);
-	bmp = ntfs_malloc(bmp_buf_size);
-	if (!bmp)
+	/* Allocate the current index block and the bitmap with the cursor. */
+	cursor = (struct READDIR_CURSOR*)ntfs_malloc(
+			sizeof(struct READDIR_CURSOR)
+			+ index_block_size + bmp_size);
+	if (!cursor)
 		goto err_out;
+	ia = cursor->ia = (INDEX_ALLOCATION*)&cursor[1];
+	bmp = cursor->bmp = (u8*)ia + index_block_size;
 
-	br = ntfs_attr_pread(bmp_na, 0, bmp_buf_size, bmp);
-	if (br != bmp_buf_size) {
+	br = ntfs_attr_pread(bmp_na, 0, bmp_size, bmp);
+	if (br != bmp_size) {
 		if (br != -1)
 			errno = EIO;
 		ntfs_log_perror("Failed to read from index bitmap attribute\n");
@@ -1324,7 +1492,7 @@ skip_index_root:
 find_next_index_buffer:
 		bmp_pos++;
 		/* If we have reached the end of the bitmap, we are done. */
-		if (bmp_pos >> 3 >= bmp_na->data_size)
+		if (bmp_pos >> 3 >= bmp_size)
 			goto EOD;
 		ia_pos = bmp_pos << index_block_size_bits;
 	}
@@ -1332,7 +1500,7 @@ find_next_index_buffer:
 	ntfs_log_debug("Handling index block 0x%llx.\n", (long long)bmp_pos);
 
 	/* Read the index block starting at bmp_pos. */
-	br = ntfs_attr_mst_pread(ia_na, bmp_pos << index_block_size_bits, 1,
+	br = ntfs_index_block_read(ia_na, bmp_pos << index_block_size_bits,
 			index_block_size, ia);
 	if (br != 1) {
 		if (br != -1)
@@ -1374,6 +1542,9 @@ find_next_index_buffer:
 	ia_offset = sle64_to_cpu(((INDEX_ALLOCATION*)ia)->index_block_vcn);
 	ia_offset <<= index_vcn_size_bits;
 
+	ntfs_prefetch_entries(vol, (INDEX_ENTRY*)((u8*)&ia->index
+			+ le32_to_cpu(ia->index.entries_offset)), index_end);
+
 	/* Calculate the current pos. */
 	*pos = offsetof(INDEX_ALLOCATION, index) +
 		le32_to_cpu(ia->index.entries_offset) +
@@ -1384,6 +1555,7 @@ find_next_index_buffer:
 	 * reach the last entry or until ntfs_filldir tells us it has had
 	 * enough or signals an error (both covered by the rc test).
 	 */
+resume_index_block:
 	for (;; *pos += le16_to_cpu(ie->length)) {
 		/* Use pos to compute the index entry. */
 		ie = (INDEX_ENTRY*)((u8*)ia + *pos - vol->mft_record_size - ia_offset);
@@ -1423,8 +1595,17 @@ EOD:
 	/* We are finished, set *pos to negative. */
 	*pos = -1;
 done:
-	free(ia);
-	free(bmp);
+	if (cursor && (*pos >= 0)) {
+		/* Stopped within an index block, keep it for resuming */
+		cursor->pos = *pos;
+		cursor->bmp_pos = bmp_pos;
+		cursor->bmp_size = bmp_size;
+		cursor->changes = vol->listing_changes;
+		cursor->index_block_size = index_block_size;
+		free(dir_ni->readdir_cursor);
+		dir_ni->readdir_cursor = cursor;
+	} else
+		free(cursor);
 	if (bmp_na)
 		ntfs_attr_close(bmp_na);
 	if (ia_na)
@@ -1438,8 +1619,7 @@ err_out:
 	ntfs_log_trace("failed.\n");
 	if (ctx)
 		ntfs_attr_put_search_ctx(ctx);
-	free(ia);
-	free(bmp);
+	free(cursor);
 	if (bmp_na)
 		ntfs_attr_close(bmp_na);
 	if (ia_na)
@@ -1448,6 +1628,281 @@ err_out:
 	return -1;
 }
 
+#if CACHE_LISTING_SIZE
+
+/*
+ *		Cache of directory listings
+ *
+ *	The entries of a full listing are recorded as they are handed to
+ *	the filldir callback, so that the next listings of the directory
+ *	are replayed without walking through its index. A listing is
+ *	forgotten as soon as the index is modified, including when the
+ *	file name of an entry is updated, and the listing of a directory
+ *	is also forgotten when it gets a new parent.
+ *
+ *	Each record is made of a LISTED_ENTRY, followed by the name
+ *	and the file name attribute, each one aligned to 8 bytes.
+ */
+
+struct LISTED_ENTRY {
+	s64 pos;
+	MFT_REF mref;
+	u16 size;	/* whole record size */
+	u8 dt_type;
+	u8 name_type;
+	u8 name_len;
+	u8 has_fn;	/* a file name attribute follows the name */
+	u16 padding;
+	ntfschar name[0];
+} ;
+
+struct LISTING_RECORDER {
+	void *dirent;
+	ntfs_filldir_fn_t filldir;
+	char *records;
+	size_t size;
+	size_t allocated;
+} ;
+
+#define LISTED_NAME_SIZE(len) \
+	((offsetof(struct LISTED_ENTRY, name) + (len)*sizeof(ntfschar) + 7) & ~7)
+
+static int listing_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_LISTING *c = (const struct CACHED_LISTING*)cached;
+	const struct CACHED_LISTING *w = (const struct CACHED_LISTING*)wanted;
+
+	return (!c->records || (c->mref != w->mref));
+}
+
+/*
+ *		Listing hashing
+ */
+
+int ntfs_dir_listing_hash(const struct CACHED_GENERIC *cached)
+{
+	return ((int)(MREF(((const struct CACHED_LISTING*)cached)->mref)
+			& INT_MAX));
+}
+
+/*
+ *		Forget the listing of a directory
+ *
+ *	To be called whenever the index of the directory is modified.
+ */
+
+void ntfs_dir_listing_forget(ntfs_volume *vol, u64 mref)
+{
+	struct CACHED_LISTING item;
+
+	vol->listing_changes++;
+	if (vol->listing_cache) {
+		item.mref = mref;
+		ntfs_invalidate_cache(vol->listing_cache,
+				GENERIC(&item), listing_cache_compare, 0);
+	}
+}
+
+/*
+ *		Record an entry while feeding the actual filldir callback
+ *
+ *	The recording is abandoned when the listing gets too big.
+ */
+
+static int listing_record(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type, const s64 pos,
+		const MFT_REF mref, const unsigned dt_type,
+		const FILE_NAME_ATTR *fn)
+{
+	struct LISTING_RECORDER *recorder;
+	struct LISTED_ENTRY *entry;
+	char *records;
+	size_t namesize;
+	size_t fnsize;
+	size_t size;
+	int res;
+
+	recorder = (struct LISTING_RECORDER*)dirent;
+	res = recorder->filldir(recorder->dirent, name, name_len, name_type,
+			pos, mref, dt_type, fn);
+	if ((res >= 0) && recorder->records) {
+		namesize = LISTED_NAME_SIZE(name_len);
+		fnsize = (fn ? offsetof(FILE_NAME_ATTR, file_name)
+				+ fn->file_name_length*sizeof(ntfschar) : 0);
+		size = namesize + ((fnsize + 7) & ~7);
+		if ((recorder->size + size) > recorder->allocated) {
+			records = (char*)NULL;
+			if ((2*recorder->allocated) <= LISTING_CACHE_MAX_SIZE)
+				records = (char*)realloc(recorder->records,
+						2*recorder->allocated);
+			if (!records)
+				free(recorder->records);
+			else
+				recorder->allocated *= 2;
+			recorder->records = records;
+		}
+		if (recorder->records) {
+			entry = (struct LISTED_ENTRY*)
+					&recorder->records[recorder->size];
+			entry->pos = pos;
+			entry->mref = mref;
+			entry->size = size;
+			entry->dt_type = dt_type;
+			entry->name_type = name_type;
+			entry->name_len = name_len;
+			entry->has_fn = (fn != (const FILE_NAME_ATTR*)NULL);
+			entry->padding = 0;
+			memcpy(entry->name, name, name_len*sizeof(ntfschar));
+			if (fn)
+				memcpy((char*)entry + namesize, fn, fnsize);
+			recorder->size += size;
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Replay a cached listing
+ *
+ *	Same conditions of return as ntfs_readdir_index()
+ */
+
+static int listing_replay(const char *records, size_t size, s64 *pos,
+		void *dirent, ntfs_filldir_fn_t filldir)
+{
+	const struct LISTED_ENTRY *entry;
+	const FILE_NAME_ATTR *fn;
+	size_t offset;
+	int res;
+
+	res = 0;
+	for (offset=0; offset<size; offset+=entry->size) {
+		entry = (const struct LISTED_ENTRY*)&records[offset];
+		if (res > 0) {
+			/* stopped by filldir, restart from this entry */
+			*pos = entry->pos;
+			return (0);
+		}
+		fn = (const FILE_NAME_ATTR*)NULL;
+		if (entry->has_fn)
+			fn = (const FILE_NAME_ATTR*)((const char*)entry
+					+ LISTED_NAME_SIZE(entry->name_len));
+		res = filldir(dirent, entry->name, entry->name_len,
+				entry->name_type, entry->pos, entry->mref,
+				entry->dt_type, fn);
+		if (res < 0)
+			return (-1);
+	}
+	*pos = -1;
+	return (0);
+}
+
+#endif /* CACHE_LISTING_SIZE */
+
+/**
+ * ntfs_readdir_fn - read the contents of an ntfs directory
+ * @dir_ni:	ntfs inode of current directory
+ * @pos:	current position in directory
+ * @dirent:	context for filldir callback supplied by the caller
+ * @filldir:	filldir callback supplied by the caller
+ *
+ * Parse the index root and the index blocks that are marked in use in the
+ * index bitmap and hand each found directory entry to the @filldir callback
+ * supplied by the caller, together with the file name attribute held in
+ * the index entry. This lets the caller get the times and sizes of the
+ * entries without opening their inodes.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ * On success, the value at address 'pos' gets updated to the position of the
+ * next entry in the directory or -1 if no more entries are available.
+ *
+ * Note: Index blocks are parsed in ascending vcn order, from which follows
+ * that the directory entries are not returned sorted.
+ *
+ * When the listing is started from the beginning, it is replayed from the
+ * cache of listings if the directory has not been modified since it was
+ * last listed.
+ */
+static int ntfs_readdir_listing(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_fn_t filldir)
+{
+#if CACHE_LISTING_SIZE
+	struct LISTING_RECORDER recorder;
+	struct CACHED_LISTING item;
+	struct CACHED_LISTING *cached;
+	ntfs_volume *vol;
+	char *records;
+	size_t size;
+	u32 changes;
+	int res;
+
+	if (dir_ni && pos && !*pos && filldir && dir_ni->vol->listing_cache
+	    && (dir_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+		vol = dir_ni->vol;
+		item.mref = MK_MREF(dir_ni->mft_no,
+				le16_to_cpu(dir_ni->mrec->sequence_number));
+		cached = (struct CACHED_LISTING*)ntfs_fetch_cache(
+				vol->listing_cache, GENERIC(&item),
+				listing_cache_compare);
+		if (cached) {
+			/* filldir may update the cache, use a copy */
+			size = cached->size;
+			records = (char*)ntfs_malloc(size);
+			if (records) {
+				memcpy(records, cached->records, size);
+				res = listing_replay(records, size, pos,
+						dirent, filldir);
+				free(records);
+				return (res);
+			}
+		}
+		recorder.dirent = dirent;
+		recorder.filldir = filldir;
+		recorder.size = 0;
+		recorder.allocated = 4096;
+		recorder.records = (char*)ntfs_malloc(recorder.allocated);
+		changes = vol->listing_changes;
+		res = ntfs_readdir_index(dir_ni, pos, &recorder,
+				listing_record);
+		if (!res && (*pos < 0) && recorder.records
+		    && (changes == vol->listing_changes)) {
+			item.records = recorder.records;
+			item.size = recorder.size;
+			ntfs_enter_cache(vol->listing_cache, GENERIC(&item),
+					listing_cache_compare);
+		}
+		free(recorder.records);
+		return (res);
+	}
+#endif /* CACHE_LISTING_SIZE */
+	return (ntfs_readdir_index(dir_ni, pos, dirent, filldir));
+}
+
+/*
+ *		List a directory, see above
+ *
+ *	This only fires the tracepoints and enters the volume around
+ *	the actual listing.
+ */
+
+int ntfs_readdir_fn(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_fn_t filldir)
+{
+	int res;
+
+	if (!dir_ni || !pos || !filldir) {
+		errno = EINVAL;
+		return -1;
+	}
+	ntfs_volume_enter(dir_ni->vol);
+	NTFS_PROBE2(readdir_entry, dir_ni->mft_no, *pos);
+	res = ntfs_readdir_listing(dir_ni, pos, dirent, filldir);
+	NTFS_PROBE2(readdir_return, dir_ni->mft_no, res);
+	ntfs_volume_leave(dir_ni->vol);
+	return (res);
+}
+
 
 /**
  * __ntfs_create - create object on ntfs volume
@@ -1508,6 +1963,9 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 #if CACHE_NIDATA_SIZE
 	debug_double_inode(ni->mft_no, 1);
 	ntfs_inode_invalidate(dir_ni->vol, ni->mft_no);
+#endif
+#if CACHE_CBLOCK_SIZE
+	ntfs_compressed_invalidate(dir_ni->vol, ni->mft_no);
 #endif
 	special_files = dir_ni->vol->special_files;	
 	/*
@@ -1746,6 +2204,9 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 		goto err_out;
 	}
 	rollback_dir = 1;
+#if CACHE_LOOKUP_SIZE
+	lookup_cache_forget(dir_ni, name, name_len);
+#endif
 	/* Set hard links count and directory flag. */
 	ni->mrec->link_count = const_cpu_to_le16(1);
 	if (S_ISDIR(type))
@@ -1780,6 +2241,9 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 		}
 	}
 	ntfs_inode_mark_dirty(ni);
+	if (dir_ni->vol->usn_journal)
+		ntfs_usn_change(ni, dir_ni, name, name_len,
+				USN_REASON_FILE_CREATE);
 	/* Done! */
 	free(fn);
 	free(si);
@@ -1862,6 +2326,9 @@ int ntfs_check_empty_dir(ntfs_inode *ni)
 	if (!(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY))
 		return 0;
 
+		/* the entries deleted lazily have to be removed first */
+	if (ntfs_index_lazy_apply(ni))
+		return -1;
 	na = ntfs_attr_open(ni, AT_INDEX_ROOT, NTFS_INDEX_I30, 4);
 	if (!na) {
 		errno = EIO;
@@ -2033,7 +2500,8 @@ search:
 	if (ntfs_check_unlinkable_dir(ni, fn) < 0)
 		goto err_out;
 		
-	if (ntfs_index_remove(dir_ni, ni, fn, le32_to_cpu(actx->attr->value_length)))
+	if (ntfs_index_lazy_remove(dir_ni, ni, fn,
+			le32_to_cpu(actx->attr->value_length)))
 		goto err_out;
 	
 	/*
@@ -2059,6 +2527,13 @@ search:
 		ntfs_attr_reinit_search_ctx(actx);
 		goto search;
 	}
+	if (vol->usn_journal) {
+		if (ni->mrec->link_count)
+			ntfs_usn_link(ni, dir_ni, name, name_len, FALSE);
+		else
+			ntfs_usn_change(ni, dir_ni, name, name_len,
+					USN_REASON_FILE_DELETE);
+	}
 	/* TODO: Update object id, quota and securiry indexes if required. */
 	/*
 	 * If hard link count is not equal to zero then we are done. In other
@@ -2117,6 +2592,8 @@ search:
 		 */
 		err = errno;
 	}
+		/* delayed index blocks must not go to freed clusters */
+	ntfs_index_writeback_forget(ni);
 	ntfs_attr_reinit_search_ctx(actx);
 	while (!ntfs_attrs_walk(actx)) {
 		if (actx->attr->non_resident) {
@@ -2269,6 +2746,9 @@ static int ntfs_link_i(ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
 		ntfs_log_perror("Failed to add filename to the index\n");
 		goto err_out;
 	}
+#if CACHE_LOOKUP_SIZE
+	lookup_cache_forget(dir_ni, name, name_len);
+#endif
 	/* Add FILE_NAME attribute to inode. */
 	if (ntfs_attr_add(ni, AT_FILE_NAME, AT_UNNAMED, 0, (u8*)fn, fn_len)) {
 		ntfs_log_error("Failed to add FILE_NAME attribute.\n");
@@ -2281,6 +2761,8 @@ static int ntfs_link_i(ntfs_inode *ni, ntfs_inode *dir_ni, const ntfschar *name,
 	/* Increment hard links count. */
 	ni->mrec->link_count = cpu_to_le16(le16_to_cpu(
 			ni->mrec->link_count) + 1);
+	if (ni->vol->usn_journal)
+		ntfs_usn_link(ni, dir_ni, name, name_len, TRUE);
 	/* Done! */
 	ntfs_inode_mark_dirty(ni);
 	free(fn);
@@ -2902,11 +3384,22 @@ int ntfs_dir_link_cnt(ntfs_inode *ni)
 		 * subdirectories whose name is not DOS-only.
 		 * The directory names are ignored, but "." and ".."
 		 * are taken into account.
+		 * The count is kept along with the inode and updated
+		 * when the index is changed, so the scan is only done
+		 * once while the inode is open or cached.
 		 */
-		pos = 0;
-		err = ntfs_readdir(ni, &pos, &nlink, nlink_increment);
-		if (err)
-			nlink = 0;
+		if (test_nino_flag(ni, KnownNlink))
+			nlink = ni->dir_nlink;
+		else {
+			pos = 0;
+			err = ntfs_readdir(ni, &pos, &nlink, nlink_increment);
+			if (err)
+				nlink = 0;
+			else {
+				ni->dir_nlink = nlink;
+				set_nino_flag(ni, KnownNlink);
+			}
+		}
 	} else {
 		/*
 		 * Non-directory : search for FILE_NAME attributes,
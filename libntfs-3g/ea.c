@@ -43,6 +43,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 #ifdef MAJOR_IN_MKDEV
 #include <sys/mkdev.h>
 #endif
@@ -60,10 +63,61 @@
 #include "misc.h"
 #include "logging.h"
 #include "xattrs.h"
+#include "cache.h"
 
 static const char lxdev[] = "$LXDEV";
 static const char lxmod[] = "$LXMOD";
 
+#if CACHE_EA_SIZE
+
+/*
+ *		Cache of extended attributes
+ *
+ *	The full $EA is kept for the inodes whose EA have been read,
+ *	so that a burst of getxattr or stat on WSL devices does not read
+ *	and allocate it each time. Entries are identified by the inode
+ *	number and sequence number, and dropped when the EA is changed.
+ */
+
+static int ea_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_EA *c = (const struct CACHED_EA*)cached;
+	const struct CACHED_EA *w = (const struct CACHED_EA*)wanted;
+
+	return (!c->ea || (c->mref != w->mref));
+}
+
+#endif /* CACHE_EA_SIZE */
+
+/*
+ *		EA hashing
+ */
+
+int ntfs_ea_hash(const struct CACHED_GENERIC *cached)
+{
+	return ((int)(MREF(((const struct CACHED_EA*)cached)->mref)
+			& INT_MAX));
+}
+
+/*
+ *		Forget the EA of an inode
+ */
+
+static void ea_forget(ntfs_inode *ni)
+{
+#if CACHE_EA_SIZE
+	struct CACHED_EA item;
+
+	if (ni->vol->ea_cache) {
+		item.mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		ntfs_invalidate_cache(ni->vol->ea_cache,
+				GENERIC(&item), ea_cache_compare, 0);
+	}
+#endif /* CACHE_EA_SIZE */
+}
+
 
 /*
  *		Create a needed attribute (EA or EA_INFORMATION)
@@ -151,6 +205,7 @@ static int ntfs_update_ea(ntfs_inode *ni, const char *value, size_t size,
 	int res;
 
 	res = 0;
+	ea_forget(ni);
 	nai = ntfs_attr_open(ni, AT_EA_INFORMATION, AT_UNNAMED, 0);
 	if (nai) {
 		na = ntfs_attr_open(ni, AT_EA, AT_UNNAMED, 0);
@@ -202,6 +257,23 @@ int ntfs_get_ntfs_ea(ntfs_inode *ni, char *value, size_t size)
 	s64 ea_size;
 	void *ea_buf;
 	int res = 0;
+#if CACHE_EA_SIZE
+	struct CACHED_EA item;
+	struct CACHED_EA cached;
+
+	if (ni->vol->ea_cache) {
+		item.mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		if (ntfs_fetch_cache_dup(ni->vol->ea_cache, GENERIC(&item),
+				ea_cache_compare,
+				(struct CACHED_GENERIC*)&cached)) {
+			if (value && (cached.size <= size))
+				memcpy(value, cached.ea, cached.size);
+			free(cached.ea);
+			return ((int)cached.size);
+		}
+	}
+#endif /* CACHE_EA_SIZE */
 
 	if (ntfs_attr_exist(ni, AT_EA, AT_UNNAMED, 0)) {
 		ea_buf = ntfs_attr_readall(ni, AT_EA, (ntfschar*)NULL, 0,
@@ -209,6 +281,14 @@ int ntfs_get_ntfs_ea(ntfs_inode *ni, char *value, size_t size)
 		if (ea_buf) {
 			if (value && (ea_size <= (s64)size))
 				memcpy(value, ea_buf, ea_size);
+#if CACHE_EA_SIZE
+			if (ni->vol->ea_cache && ea_size) {
+				item.ea = ea_buf;
+				item.size = ea_size;
+				ntfs_enter_cache(ni->vol->ea_cache,
+					GENERIC(&item), ea_cache_compare);
+			}
+#endif /* CACHE_EA_SIZE */
 			free(ea_buf);
 			res = ea_size;
 		} else {
@@ -355,6 +435,7 @@ int ntfs_remove_ntfs_ea(ntfs_inode *ni)
 
 	res = 0;
 	if (ni) {
+		ea_forget(ni);
 		/*
 		 * open and delete the EA_INFORMATION and the EA
 		 */
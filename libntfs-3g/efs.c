@@ -44,6 +44,7 @@
 #endif
 
 #include "types.h"
+#include "param.h"
 #include "debug.h"
 #include "attrib.h"
 #include "inode.h"
@@ -428,3 +429,286 @@ err_out:
 		ntfs_attr_put_search_ctx(ctx);
 	return (-1);
 }
+
+/*
+ *		Export a stream of an encrypted file
+ *
+ *	The stream is read by chunks through a single open attribute,
+ *	an encrypted data stream being read as with efs_raw.
+ *
+ *	Returns 0 if successful, or -1 if failed (errno set)
+ */
+
+static int export_stream(ntfs_attr *na, EFS_RAW_TYPES type, s64 size,
+			ntfs_efs_raw_io output, void *param, char *buf)
+{
+	EFS_RAW_RECORD record;
+	ntfschar name[256];
+	s64 pos;
+	s64 got;
+	s64 count;
+	int res;
+
+	record.type = cpu_to_le32(type);
+	record.name_length = cpu_to_le32(na->name_len);
+	record.size = cpu_to_sle64(size);
+	res = output(param, &record, sizeof(record));
+	if (!res && na->name_len) {
+			/* the name of the attribute may not be aligned */
+		memcpy(name, na->name, na->name_len*sizeof(ntfschar));
+		res = output(param, name, na->name_len*sizeof(ntfschar));
+	}
+	for (pos=0; !res && (pos<size); pos+=count) {
+		count = size - pos;
+		if (count > EFS_RAW_CHUNK)
+			count = EFS_RAW_CHUNK;
+		got = ntfs_attr_pread(na, pos, count, buf);
+		if (got != count) {
+			if (got >= 0)
+				errno = EIO;
+			res = -1;
+		} else
+			res = output(param, buf, count);
+	}
+	return (res);
+}
+
+/*
+ *		Export an encrypted file in raw format
+ *
+ *	The $EFS attribute and all the data streams are exported, as
+ *	described in efs.h, without decrypting anything, so that they can
+ *	be imported again by ntfs_efs_import_raw(). This requires the
+ *	volume to be set for raw accesses to encrypted files (efs_raw).
+ *
+ *	Returns 0 if successful, or -1 if failed (errno set)
+ */
+
+int ntfs_efs_export_raw(ntfs_inode *ni, ntfs_efs_raw_io output, void *param)
+{
+	EFS_RAW_HEADER header;
+	EFS_RAW_RECORD record;
+	ntfs_attr_search_ctx *ctx;
+	ntfs_attr *na;
+	ATTR_RECORD *a;
+	char *buf;
+	s64 size;
+	int res;
+
+	if (!(ni->flags & FILE_ATTR_ENCRYPTED)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!ni->vol->efs_raw) {
+		errno = EACCES;
+		return (-1);
+	}
+	buf = (char*)ntfs_malloc(EFS_RAW_CHUNK);
+	if (!buf)
+		return (-1);
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, EFS_RAW_MAGIC);
+	header.version = const_cpu_to_le32(EFS_RAW_VERSION);
+	header.file_attributes = ni->flags;
+	res = output(param, &header, sizeof(header));
+	if (!res) {
+		na = ntfs_attr_open(ni, AT_LOGGED_UTILITY_STREAM,
+				logged_utility_stream_name, 4);
+		if (na) {
+			res = export_stream(na, EFS_RAW_EFSINFO,
+					na->data_size, output, param, buf);
+			ntfs_attr_close(na);
+		} else
+			res = -1;
+	}
+	ctx = (ntfs_attr_search_ctx*)NULL;
+	if (!res && !(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+		ctx = ntfs_attr_get_search_ctx(ni, NULL);
+		if (!ctx)
+			res = -1;
+	}
+	while (!res && ctx
+	    && !ntfs_attr_lookup(AT_DATA, NULL, 0, CASE_SENSITIVE,
+				0, NULL, 0, ctx)) {
+		a = ctx->attr;
+			/* export the extents of a stream only once */
+		if (a->non_resident && a->lowest_vcn)
+			continue;
+		na = ntfs_attr_open(ni, AT_DATA,
+			(ntfschar*)((u8*)a + le16_to_cpu(a->name_offset)),
+			a->name_length);
+		if (na) {
+			size = na->data_size;
+			if (size && !(na->data_flags & ATTR_IS_ENCRYPTED)) {
+				ntfs_log_error("A non empty stream of inode"
+					" %lld is not encrypted\n",
+					(long long)ni->mft_no);
+				errno = EINVAL;
+				res = -1;
+			}
+			if (size)
+				size = ((size + 511) & ~511) + 2;
+			if (!res)
+				res = export_stream(na, EFS_RAW_STREAM,
+					size, output, param, buf);
+			ntfs_attr_close(na);
+		} else
+			res = -1;
+	}
+	if (ctx) {
+		if (!res && (errno != ENOENT))
+			res = -1;
+		ntfs_attr_put_search_ctx(ctx);
+	}
+	if (!res) {
+		memset(&record, 0, sizeof(record));
+		res = output(param, &record, sizeof(record));
+	}
+	free(buf);
+	return (res);
+}
+
+/*
+ *		Import a stream into a file to be encrypted
+ *
+ *	The raw data is written as is, it is fixed up when the $EFS
+ *	attribute is set afterwards.
+ *
+ *	Returns 0 if successful, or -1 if failed (errno set)
+ */
+
+static int import_stream(ntfs_inode *ni, ntfschar *name, int name_len,
+			s64 size, ntfs_efs_raw_io input, void *param,
+			char *buf)
+{
+	ntfs_attr *na;
+	s64 pos;
+	s64 count;
+	int res;
+
+	res = 0;
+		/* a raw encrypted stream ends with the padding count */
+	if ((size < 0) || (size && ((size & 511) != 2))) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (name_len && !ntfs_attr_exist(ni, AT_DATA, name, name_len))
+		res = ntfs_attr_add(ni, AT_DATA, name, name_len,
+				(u8*)NULL, (s64)0);
+	na = (res ? (ntfs_attr*)NULL
+		: ntfs_attr_open(ni, AT_DATA, name, name_len));
+	if (na) {
+		res = ntfs_attr_truncate(na, (s64)0);
+		for (pos=0; !res && (pos<size); pos+=count) {
+			count = size - pos;
+			if (count > EFS_RAW_CHUNK)
+				count = EFS_RAW_CHUNK;
+			res = input(param, buf, count);
+			if (!res
+			    && (ntfs_attr_pwrite(na, pos, count, buf) != count))
+				res = -1;
+		}
+		ntfs_attr_close(na);
+	} else
+		res = -1;
+	return (res);
+}
+
+/*
+ *		Import an encrypted file in raw format
+ *
+ *	The file must not be encrypted or compressed, its data streams
+ *	are replaced by the imported ones, and the $EFS attribute is
+ *	set when the end record is met. A directory only gets its $EFS.
+ *
+ *	Returns 0 if successful, or -1 if failed (errno set)
+ */
+
+int ntfs_efs_import_raw(ntfs_inode *ni, ntfs_efs_raw_io input, void *param)
+{
+	EFS_RAW_HEADER header;
+	EFS_RAW_RECORD record;
+	ntfschar name[256];
+	char *efsinfo;
+	char *buf;
+	BOOL isdir;
+	s64 size;
+	s64 efs_size;
+	u32 name_len;
+	int res;
+
+	if (ni->flags & (FILE_ATTR_ENCRYPTED | FILE_ATTR_COMPRESSED)) {
+		errno = EEXIST;
+		return (-1);
+	}
+	buf = (char*)ntfs_malloc(EFS_RAW_CHUNK);
+	if (!buf)
+		return (-1);
+	isdir = (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) != 0;
+	efsinfo = (char*)NULL;
+	efs_size = 0;
+	res = input(param, &header, sizeof(header));
+	if (!res && (memcmp(header.magic, EFS_RAW_MAGIC, sizeof(header.magic))
+		|| (header.version != const_cpu_to_le32(EFS_RAW_VERSION)))) {
+		errno = EINVAL;
+		res = -1;
+	}
+	do {
+		if (!res)
+			res = input(param, &record, sizeof(record));
+		if (res)
+			break;
+		name_len = le32_to_cpu(record.name_length);
+		size = sle64_to_cpu(record.size);
+		if ((name_len > 255) || (size < 0)) {
+			errno = EINVAL;
+			res = -1;
+		}
+		if (!res && name_len)
+			res = input(param, name, name_len*sizeof(ntfschar));
+		if (res)
+			break;
+		switch (le32_to_cpu(record.type)) {
+		case EFS_RAW_END :
+			break;
+		case EFS_RAW_EFSINFO :
+				/* an attribute of the mft record */
+			if (efsinfo || !size || (size > 65536)) {
+				errno = EINVAL;
+				res = -1;
+			} else {
+				efs_size = size;
+				efsinfo = (char*)ntfs_malloc(size);
+				if (efsinfo)
+					res = input(param, efsinfo, size);
+				else
+					res = -1;
+			}
+			break;
+		case EFS_RAW_STREAM :
+			if (isdir || !efsinfo) {
+				errno = EINVAL;
+				res = -1;
+			} else
+				res = import_stream(ni, name, name_len, size,
+						input, param, buf);
+			break;
+		default :
+			errno = EINVAL;
+			res = -1;
+			break;
+		}
+	} while (!res && (record.type != const_cpu_to_le32(EFS_RAW_END)));
+	if (!res) {
+		if (efsinfo) {
+		/* set the $EFS, which makes the streams encrypted */
+			res = ntfs_set_efs_info(ni, efsinfo, efs_size, 0);
+		} else {
+			errno = EINVAL;
+			res = -1;
+		}
+	}
+	free(efsinfo);
+	free(buf);
+	return (res);
+}
@@ -36,6 +36,12 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 
 #include "attrib.h"
 #include "debug.h"
@@ -47,6 +53,77 @@
 #include "bitmap.h"
 #include "reparse.h"
 #include "misc.h"
+#include "cache.h"
+#include "probes.h"
+
+/*
+ *		Update the Posix link count of a directory
+ *
+ *	A subdirectory being inserted (delta 1) or removed (delta -1)
+ *	is counted the way ntfs_dir_link_cnt() does, short names being
+ *	ignored. When telling whether the entry is listed would require
+ *	more than the entry (reparse points, system or hidden files,
+ *	metadata), the count is recomputed when next needed.
+ */
+
+static void ntfs_index_count_subdir(ntfs_inode *ni, const INDEX_ENTRY *ie,
+			int delta)
+{
+	const FILE_NAME_ATTR *fn;
+
+	fn = &ie->key.file_name;
+	if (fn->file_name_type != FILE_NAME_DOS) {
+		if ((fn->file_attributes & (FILE_ATTR_REPARSE_POINT
+				| FILE_ATTR_SYSTEM | FILE_ATTR_HIDDEN))
+		    || (MREF_LE(ie->indexed_file) < FILE_first_user))
+			clear_nino_flag(ni, KnownNlink);
+		else
+			if (fn->file_attributes & FILE_ATTR_I30_INDEX_PRESENT)
+				ni->dir_nlink += delta;
+	}
+}
+
+/*
+ *		Forget the listings made obsolete by an update of an index
+ *
+ *	The listing of the directory is forgotten, and so is the listing
+ *	of a directory which is being inserted or removed, as its parent
+ *	reference may change. The count of updates also makes obsolete
+ *	the cached symlink targets, which were resolved by looking up
+ *	names in directories, and the index blocks kept for resuming
+ *	the listings in progress.
+ *
+ *	@delta is 1 when @ie is being inserted, -1 when it is being
+ *	removed, and 0 when an existing entry is updated.
+ */
+
+static void ntfs_index_changed(ntfs_index_context *icx,
+			const INDEX_ENTRY *ie, int delta)
+{
+	ntfs_inode *ni;
+
+	ni = icx->ni;
+	if ((icx->name_len == 4)
+	    && !memcmp(icx->name, NTFS_INDEX_I30, 4*sizeof(ntfschar))) {
+		if (ie && delta && !(ie->ie_flags & INDEX_ENTRY_END)
+		    && test_nino_flag(ni, KnownNlink))
+			ntfs_index_count_subdir(ni, ie, delta);
+#if CACHE_LISTING_SIZE
+		ntfs_dir_listing_forget(ni->vol, MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number)));
+		if (ie && !(ie->ie_flags & INDEX_ENTRY_END)
+		    && (ie->key.file_name.file_attributes
+				& FILE_ATTR_I30_INDEX_PRESENT))
+			ntfs_dir_listing_forget(ni->vol,
+					le64_to_cpu(ie->indexed_file));
+#else
+			/* the resolved symlink targets may be outdated */
+		ni->vol->listing_changes++;
+#endif /* CACHE_LISTING_SIZE */
+			/* the size and link count may have changed */
+		ntfs_inode_forget_stat(ni);
+	}
+}
 
 /**
  * ntfs_index_entry_mark_dirty - mark an index entry dirty
@@ -64,6 +141,7 @@
  */
 void ntfs_index_entry_mark_dirty(ntfs_index_context *ictx)
 {
+	ntfs_index_changed(ictx, (INDEX_ENTRY*)NULL, 0);
 	if (ictx->is_in_root)
 		ntfs_inode_mark_dirty(ictx->actx->ntfs_ino);
 	else
@@ -80,14 +158,576 @@ static VCN ntfs_ib_pos_to_vcn(ntfs_index_context *icx, s64 pos)
 	return pos >> icx->vcn_size_bits;
 }
 
+#if CACHE_INDEX_HASH
+
+/*
+ *		Cache of index blocks
+ *
+ *	The index blocks are cached as fixed up, when read and when
+ *	written, so that the upper nodes of a big index have not to be
+ *	read and checked again on each lookup. The key includes the
+ *	sequence number of the inode, so that the blocks of a deleted
+ *	index are never found again, and the blocks which could not be
+ *	written are invalidated, as their state on the device is unknown.
+ */
+
+int ntfs_index_block_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_INDEX_BLOCK *cached;
+
+	cached = (const struct CACHED_INDEX_BLOCK*)item;
+		/* index blocks are generally 4096 bytes long */
+	return ((MREF(cached->mref)*31 + (cached->pos >> 12)) & INT_MAX);
+}
+
+static int index_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_INDEX_BLOCK *c;
+	const struct CACHED_INDEX_BLOCK *w;
+
+	c = (const struct CACHED_INDEX_BLOCK*)cached;
+	w = (const struct CACHED_INDEX_BLOCK*)wanted;
+	return ((c->mref != w->mref)
+		|| (c->pos != w->pos)
+		|| (c->namekey != w->namekey)
+		|| (c->blocksize != w->blocksize));
+}
+
+/*
+ *		Build the key of an index block
+ *
+ *	The names of indexes ($I30, $SII, $SDH, $O, $Q, $R) are short
+ *	enough to be packed into the key, blocks of indexes with longer
+ *	names are not cached.
+ *
+ *	Returns FALSE if the block cannot be cached
+ */
+
+static BOOL index_cache_key(ntfs_attr *na, s64 pos, u32 block_size,
+			struct CACHED_INDEX_BLOCK *item)
+{
+	u64 key;
+	int i;
+
+	if (!na->ni->vol->index_cache || (na->name_len > 4))
+		return (FALSE);
+	key = 0;
+	for (i=0; i<na->name_len; i++)
+		key = (key << 16) | le16_to_cpu(na->name[i]);
+	item->mref = MK_MREF(na->ni->mft_no,
+			le16_to_cpu(na->ni->mrec->sequence_number));
+	item->namekey = key;
+	item->pos = pos;
+	item->ib = (INDEX_BLOCK*)NULL;
+	item->blocksize = block_size;
+	return (TRUE);
+}
+
+/*
+ *		Enter an index block into the cache
+ *	When updating, the block may already be cached, with an older
+ *	content, otherwise the cached one is already up to date.
+ */
+
+static void ib_cache_enter(ntfs_attr *na, s64 pos, u32 block_size,
+			INDEX_BLOCK *ib, BOOL update)
+{
+	struct CACHED_INDEX_BLOCK item;
+	struct CACHED_INDEX_BLOCK *cached;
+	ntfs_volume *vol;
+
+	vol = na->ni->vol;
+	if (index_cache_key(na, pos, block_size, &item)) {
+		if (ntfs_is_indx_record(ib->magic)) {
+			cached = (struct CACHED_INDEX_BLOCK*)NULL;
+			if (update)
+				cached = (struct CACHED_INDEX_BLOCK*)
+					ntfs_fetch_cache(vol->index_cache,
+						GENERIC(&item),
+						index_cache_compare);
+			if (cached)
+				memcpy(cached->ib, ib, block_size);
+			else {
+				item.ib = ib;
+				ntfs_enter_cache(vol->index_cache,
+					GENERIC(&item), index_cache_compare);
+			}
+		} else
+			ntfs_invalidate_cache(vol->index_cache,
+					GENERIC(&item), index_cache_compare, 0);
+	}
+}
+
+/*
+ *		Invalidate a cached index block
+ */
+
+static void ib_cache_invalidate(ntfs_attr *na, s64 pos, u32 block_size)
+{
+	struct CACHED_INDEX_BLOCK item;
+
+	if (index_cache_key(na, pos, block_size, &item))
+		ntfs_invalidate_cache(na->ni->vol->index_cache,
+				GENERIC(&item), index_cache_compare, 0);
+}
+
+#endif /* CACHE_INDEX_HASH */
+
+/*
+ *		Delayed writing of directory index blocks
+ *
+ *	When set up by ntfs_set_index_writeback(), the blocks of the
+ *	directory indexes are not written each time they are modified,
+ *	they are kept in a table of the volume, and the fixups are only
+ *	applied when they are eventually written :
+ *	- when a block which has been dirty for INDEX_WRITEBACK_DELAY
+ *	  seconds is modified again, or when the table is full, the
+ *	  dirty blocks of the directory being modified are written,
+ *	- on request by ntfs_index_writeback_flush(), which has to be
+ *	  called when no inode is open (fsync, end of a request, unmount).
+ *
+ *	The table is searched before the index block cache and the device,
+ *	so that a block is always read in its latest state. The callers
+ *	are expected to serialize their accesses to the library.
+ */
+
+struct DIRTY_INDEX_BLOCK {
+	struct DIRTY_INDEX_BLOCK *next;		/* next more recent block */
+	struct DIRTY_INDEX_BLOCK *previous;	/* next older block */
+	struct DIRTY_INDEX_BLOCK *hnext;	/* next block with same hash */
+	u64 mref;			/* directory, with sequence number */
+	s64 pos;			/* position in index allocation */
+	u32 block_size;
+	time_t dirtied;			/* when first made dirty */
+	char data[0];
+} ;
+
+struct INDEX_WRITEBACK {
+	struct DIRTY_INDEX_BLOCK *oldest;
+	struct DIRTY_INDEX_BLOCK *newest;
+	int count;			/* number of dirty blocks */
+	int max_count;			/* max number of dirty blocks */
+	struct DIRTY_INDEX_BLOCK *first_hash[INDEX_WRITEBACK_HASH];
+} ;
+
+/*
+ *		Check whether the blocks of an index are delayed
+ *	Only directory indexes are, ($I30, which has a 4 char name)
+ */
+
+static BOOL writeback_wanted(ntfs_attr *na)
+{
+	return (na->ni->vol->index_writeback
+		&& (na->name_len == 4)
+		&& !memcmp(na->name, NTFS_INDEX_I30, 4*sizeof(ntfschar)));
+}
+
+static u64 writeback_mref(ntfs_attr *na)
+{
+	return (MK_MREF(na->ni->mft_no,
+			le16_to_cpu(na->ni->mrec->sequence_number)));
+}
+
+static int writeback_hash(u64 mref, s64 pos)
+{
+		/* index blocks are generally 4096 bytes long */
+	return ((MREF(mref)*31 + (pos >> 12)) & (INDEX_WRITEBACK_HASH - 1));
+}
+
+/*
+ *		Locate a dirty block
+ *
+ *	Returns the address of the link to the block in its hash chain,
+ *		the link is NULL if the block is not dirty.
+ */
+
+static struct DIRTY_INDEX_BLOCK **writeback_find(struct INDEX_WRITEBACK *wb,
+			u64 mref, s64 pos)
+{
+	struct DIRTY_INDEX_BLOCK **pdirty;
+
+	pdirty = &wb->first_hash[writeback_hash(mref, pos)];
+	while (*pdirty
+	    && (((*pdirty)->mref != mref) || ((*pdirty)->pos != pos)))
+		pdirty = &(*pdirty)->hnext;
+	return (pdirty);
+}
+
+/*
+ *		Forget about a dirty block
+ */
+
+static void writeback_drop(struct INDEX_WRITEBACK *wb,
+			struct DIRTY_INDEX_BLOCK *dirty)
+{
+	struct DIRTY_INDEX_BLOCK **pdirty;
+
+	pdirty = writeback_find(wb, dirty->mref, dirty->pos);
+	*pdirty = dirty->hnext;
+	if (dirty->previous)
+		dirty->previous->next = dirty->next;
+	else
+		wb->oldest = dirty->next;
+	if (dirty->next)
+		dirty->next->previous = dirty->previous;
+	else
+		wb->newest = dirty->previous;
+	wb->count--;
+	free(dirty);
+}
+
+/*
+ *		Write a dirty block and forget about it
+ *
+ *	The block is dropped even if it could not be written, and it
+ *	is invalidated in the index block cache, as its state on the
+ *	device is then unknown.
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int writeback_write(ntfs_attr *ia_na, struct DIRTY_INDEX_BLOCK *dirty)
+{
+	s64 ret;
+
+	ret = ntfs_attr_mst_pwrite(ia_na, dirty->pos, 1, dirty->block_size,
+				dirty->data);
+#if CACHE_INDEX_HASH
+	if (ret == 1)
+		ib_cache_enter(ia_na, dirty->pos, dirty->block_size,
+				(INDEX_BLOCK*)dirty->data, TRUE);
+	else
+		ib_cache_invalidate(ia_na, dirty->pos, dirty->block_size);
+#endif
+	if (ret != 1)
+		ntfs_log_perror("Failed to write delayed index block %lld, "
+			"inode %llu", (long long)dirty->pos,
+			(unsigned long long)ia_na->ni->mft_no);
+	writeback_drop(ia_na->ni->vol->index_writeback, dirty);
+	return (ret == 1 ? 0 : -1);
+}
+
+/*
+ *		Write all the dirty blocks of a directory
+ *
+ *	Returns 0 if successful, -1 if some block could not be written
+ */
+
+static int writeback_flush_index(ntfs_attr *ia_na)
+{
+	struct INDEX_WRITEBACK *wb;
+	struct DIRTY_INDEX_BLOCK *dirty;
+	struct DIRTY_INDEX_BLOCK *next;
+	u64 mref;
+	int err;
+	int res;
+
+	res = 0;
+	err = 0;
+	wb = ia_na->ni->vol->index_writeback;
+	mref = writeback_mref(ia_na);
+	for (dirty=wb->oldest; dirty; dirty=next) {
+		next = dirty->next;
+		if ((dirty->mref == mref) && writeback_write(ia_na, dirty)) {
+			err = errno;
+			res = -1;
+		}
+	}
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/*
+ *		Delay the writing of a modified index block
+ *
+ *	Returns 1 if the block is delayed or has been written,
+ *		0 if it has to be written by the caller,
+ *		-1 if some block could not be written
+ */
+
+static int writeback_delay(ntfs_attr *ia_na, s64 pos, u32 block_size,
+			INDEX_BLOCK *ib)
+{
+	struct INDEX_WRITEBACK *wb;
+	struct DIRTY_INDEX_BLOCK **pdirty;
+	struct DIRTY_INDEX_BLOCK *dirty;
+	u64 mref;
+	int res;
+
+	wb = ia_na->ni->vol->index_writeback;
+	mref = writeback_mref(ia_na);
+	pdirty = writeback_find(wb, mref, pos);
+	dirty = *pdirty;
+	if (dirty && (dirty->block_size != block_size)) {
+		writeback_drop(wb, dirty);
+		dirty = (struct DIRTY_INDEX_BLOCK*)NULL;
+	}
+	if (dirty) {
+		memcpy(dirty->data, ib, block_size);
+		res = 1;
+			/* kept dirty for too long, write the directory */
+		if (((time((time_t*)NULL) - dirty->dirtied)
+				>= INDEX_WRITEBACK_DELAY)
+		    && writeback_flush_index(ia_na))
+			res = -1;
+	} else {
+		res = 0;
+		if ((wb->count >= wb->max_count)
+		    && writeback_flush_index(ia_na))
+			res = -1;
+		if (!res && (wb->count < wb->max_count)) {
+			dirty = (struct DIRTY_INDEX_BLOCK*)ntfs_malloc(
+				sizeof(struct DIRTY_INDEX_BLOCK) + block_size);
+			if (dirty) {
+				dirty->mref = mref;
+				dirty->pos = pos;
+				dirty->block_size = block_size;
+				dirty->dirtied = time((time_t*)NULL);
+				memcpy(dirty->data, ib, block_size);
+				pdirty = &wb->first_hash[
+						writeback_hash(mref, pos)];
+				dirty->hnext = *pdirty;
+				*pdirty = dirty;
+				dirty->next = (struct DIRTY_INDEX_BLOCK*)NULL;
+				dirty->previous = wb->newest;
+				if (wb->newest)
+					wb->newest->next = dirty;
+				else
+					wb->oldest = dirty;
+				wb->newest = dirty;
+				wb->count++;
+				res = 1;
+			}
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Get the latest state of an index block which has not
+ *	been written yet
+ *
+ *	Returns TRUE if the block was found
+ */
+
+static BOOL writeback_read(ntfs_attr *ia_na, s64 pos, u32 block_size,
+			INDEX_BLOCK *dst)
+{
+	struct DIRTY_INDEX_BLOCK *dirty;
+	BOOL found;
+
+	found = FALSE;
+	if (writeback_wanted(ia_na)) {
+		dirty = *writeback_find(ia_na->ni->vol->index_writeback,
+				writeback_mref(ia_na), pos);
+		if (dirty && (dirty->block_size == block_size)) {
+			memcpy(dst, dirty->data, block_size);
+			found = TRUE;
+		}
+	}
+	return (found);
+}
+
+/**
+ * ntfs_index_writeback_flush - write the delayed index blocks
+ * @vol:	volume
+ * @all:	TRUE if all blocks have to be written, FALSE if only the
+ *		directories which have blocks dirty for too long
+ *
+ * The directories are opened, so this must not be called while an
+ * inode is open.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_writeback_flush(ntfs_volume *vol, BOOL all)
+{
+	struct INDEX_WRITEBACK *wb;
+	struct DIRTY_INDEX_BLOCK *dirty;
+	ntfs_inode *ni;
+	ntfs_attr *ia_na;
+	time_t now;
+	u64 mref;
+	int err;
+	int res;
+
+	res = 0;
+	err = 0;
+	wb = vol->index_writeback;
+	if (wb) {
+		now = time((time_t*)NULL);
+		while (wb->oldest
+		    && (all || ((now - wb->oldest->dirtied)
+					>= INDEX_WRITEBACK_DELAY))) {
+			mref = wb->oldest->mref;
+			ia_na = (ntfs_attr*)NULL;
+			ni = ntfs_inode_open(vol, mref);
+			if (ni)
+				ia_na = ntfs_attr_open(ni, AT_INDEX_ALLOCATION,
+						NTFS_INDEX_I30, 4);
+			if (ia_na) {
+				if (writeback_flush_index(ia_na)) {
+					err = errno;
+					res = -1;
+				}
+				ntfs_attr_close(ia_na);
+			} else {
+				ntfs_log_perror("Could not write the delayed "
+					"index blocks of inode %llu",
+					(unsigned long long)MREF(mref));
+				err = EIO;
+				res = -1;
+				/* the blocks are lost, forget about them */
+				for (dirty=wb->oldest; dirty; ) {
+					if (dirty->mref == mref) {
+						writeback_drop(wb, dirty);
+						dirty = wb->oldest;
+					} else
+						dirty = dirty->next;
+				}
+			}
+			if (ni && ntfs_inode_close(ni)) {
+				err = errno;
+				res = -1;
+			}
+		}
+	}
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/**
+ * ntfs_index_writeback_forget - forget the delayed blocks of a directory
+ * @ni:		directory being deleted
+ *
+ * The index blocks of a deleted directory must not be written
+ * afterwards, as their clusters may have been reallocated.
+ */
+void ntfs_index_writeback_forget(ntfs_inode *ni)
+{
+	struct INDEX_WRITEBACK *wb;
+	struct DIRTY_INDEX_BLOCK *dirty;
+	struct DIRTY_INDEX_BLOCK *next;
+	u64 mref;
+
+	wb = ni->vol->index_writeback;
+	if (wb) {
+		mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		for (dirty=wb->oldest; dirty; dirty=next) {
+			next = dirty->next;
+			if (dirty->mref == mref)
+				writeback_drop(wb, dirty);
+		}
+	}
+}
+
+/*
+ *		Set up the delayed writing of directory index blocks
+ *	Not set in ntfs_mount(), the dirty blocks are limited to
+ *	@size bytes, a zero size writes the dirty blocks and stops
+ *	delaying.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_index_writeback(ntfs_volume *vol, s64 size)
+{
+	struct INDEX_WRITEBACK *wb;
+	int res;
+
+	res = -1;
+	if (!vol || (size < 0))
+		errno = EINVAL;
+	else {
+		res = ntfs_index_writeback_flush(vol, TRUE);
+		if (!size) {
+			free(vol->index_writeback);
+			vol->index_writeback = (struct INDEX_WRITEBACK*)NULL;
+		} else {
+			wb = vol->index_writeback;
+			if (!wb) {
+				wb = (struct INDEX_WRITEBACK*)ntfs_calloc(
+					sizeof(struct INDEX_WRITEBACK));
+				vol->index_writeback = wb;
+			}
+			if (wb)
+				wb->max_count = size/(4096
+					+ sizeof(struct DIRTY_INDEX_BLOCK));
+			else
+				res = -1;
+		}
+	}
+	return (res);
+}
+
+/**
+ * ntfs_index_block_read - read an index block
+ * @ia_na:	opened index allocation attribute
+ * @pos:	position of the block in the attribute
+ * @block_size:	size of the index blocks of the index
+ * @dst:	output buffer
+ *
+ * Read an index block and apply the fixups, as ntfs_attr_mst_pread()
+ * would do for one block, using the cache of index blocks if the
+ * volume has one.
+ *
+ * Return 1 on success, 0 or -1 on error (with errno set if -1).
+ */
+s64 ntfs_index_block_read(ntfs_attr *ia_na, s64 pos, u32 block_size,
+		INDEX_BLOCK *dst)
+{
+	s64 ret;
+#if CACHE_INDEX_HASH
+	struct CACHED_INDEX_BLOCK item;
+	struct CACHED_INDEX_BLOCK *cached;
+#endif
+
+	if (writeback_read(ia_na, pos, block_size, dst))
+		return (1);
+#if CACHE_INDEX_HASH
+	if (index_cache_key(ia_na, pos, block_size, &item)) {
+		cached = (struct CACHED_INDEX_BLOCK*)ntfs_fetch_cache(
+				ia_na->ni->vol->index_cache,
+				GENERIC(&item), index_cache_compare);
+		if (cached) {
+			memcpy(dst, cached->ib, block_size);
+			return (1);
+		}
+	}
+#endif
+	ret = ntfs_attr_mst_pread(ia_na, pos, 1, block_size, (u8*)dst);
+#if CACHE_INDEX_HASH
+	if (ret == 1)
+		ib_cache_enter(ia_na, pos, block_size, dst, FALSE);
+#endif
+	return (ret);
+}
+
 static int ntfs_ib_write(ntfs_index_context *icx, INDEX_BLOCK *ib)
 {
 	s64 ret, vcn = sle64_to_cpu(ib->index_block_vcn);
 	
 	ntfs_log_trace("vcn: %lld\n", (long long)vcn);
 	
-	ret = ntfs_attr_mst_pwrite(icx->ia_na, ntfs_ib_vcn_to_pos(icx, vcn),
+	ret = 0;
+	if (writeback_wanted(icx->ia_na))
+		ret = writeback_delay(icx->ia_na, ntfs_ib_vcn_to_pos(icx, vcn),
+				   icx->block_size, ib);
+	if (!ret)
+		ret = ntfs_attr_mst_pwrite(icx->ia_na,
+				   ntfs_ib_vcn_to_pos(icx, vcn),
 				   1, icx->block_size, ib);
+#if CACHE_INDEX_HASH
+	if (ret == 1)
+		ib_cache_enter(icx->ia_na, ntfs_ib_vcn_to_pos(icx, vcn),
+				icx->block_size, ib, TRUE);
+	else
+		ib_cache_invalidate(icx->ia_na, ntfs_ib_vcn_to_pos(icx, vcn),
+				icx->block_size);
+#endif
 	if (ret != 1) {
 		ntfs_log_perror("Failed to write index block %lld, inode %llu",
 			(long long)vcn, (unsigned long long)icx->ni->mft_no);
@@ -143,6 +783,8 @@ static void ntfs_index_ctx_free(ntfs_index_context *icx)
 {
 	ntfs_log_trace("Entering\n");
 	
+	free(icx->bound);
+	icx->bound = NULL;
 	if (!icx->bad_index && !icx->entry)
 		return;
 
@@ -188,6 +830,7 @@ void ntfs_index_ctx_reinit(ntfs_index_context *icx)
 		.ni = icx->ni,
 		.name = icx->name,
 		.name_len = icx->name_len,
+		.want_bound = icx->want_bound,
 	};
 }
 
@@ -469,107 +1112,376 @@ static INDEX_ROOT *ntfs_ir_lookup2(ntfs_inode *ni, ntfschar *name, u32 len)
 	return ir;
 }
 
-/** 
- * Find a key in the index block.
- * 
- * Return values:
- *   STATUS_OK with errno set to ESUCCESS if we know for sure that the 
- *             entry exists and @ie_out points to this entry.
- *   STATUS_NOT_FOUND with errno set to ENOENT if we know for sure the
- *                    entry doesn't exist and @ie_out is the insertion point.
- *   STATUS_KEEP_SEARCHING if we can't answer the above question and
- *                         @vcn will contain the node index block.
- *   STATUS_ERROR with errno set if on unexpected error during lookup.
+/**
+ * ntfs_ie_search - search a key in an index node
+ * @ih:		header of the index node
+ * @index_end:	end of the entries of the node
+ * @collate:	function collating the key against the key of an entry
+ * @data:	the key and anything needed by @collate
+ * @ie_out:	the entry found
+ * @item:	the position of @ie_out in the node
+ *
+ * The entries of the node are located by chunks of INDEX_SEARCH_CHUNK,
+ * checking their bounds, then the key is searched by dichotomy within
+ * the chunk, so that the collation function is called log2(n) times
+ * instead of n/2 times on average.
+ *
+ * Return STATUS_OK if the key was found, @ie_out being the matching entry,
+ *	STATUS_NOT_FOUND if not, @ie_out being the first entry which
+ *		collates after the key, or the end entry of the node,
+ *	STATUS_ERROR if the node is inconsistent (errno set to EIO)
+ *		or the collation failed (errno set to ERANGE).
  */
-static int ntfs_ie_lookup(const void *key, const int key_len,
-			  ntfs_index_context *icx, INDEX_HEADER *ih,
-			  VCN *vcn, INDEX_ENTRY **ie_out)
+/*
+ *		Collect the next entries of an index node
+ *
+ *	Up to INDEX_SEARCH_CHUNK entries are collected from *@pie, until
+ *	we exceed valid memory (corruption case) or until we reach the
+ *	last entry, which cannot contain a key. *@pie is set to the entry
+ *	following the ones collected.
+ *
+ *	Returns the count of entries collected, or -1 if the node is
+ *	inconsistent (errno set to EIO)
+ */
+
+static int ie_collect(INDEX_HEADER *ih, u8 *index_end,
+		INDEX_ENTRY **pie, INDEX_ENTRY **entries)
 {
 	INDEX_ENTRY *ie;
-	u8 *index_end;
-	int rc, item = 0;
-	 
-	ntfs_log_trace("Entering\n");
-	
-	index_end = ntfs_ie_get_end(ih);
-	
-	/*
-	 * Loop until we exceed valid memory (corruption case) or until we
-	 * reach the last entry.
-	 */
-	for (ie = ntfs_ie_get_first(ih); ; ie = ntfs_ie_get_next(ie)) {
-		/* Bounds checks. */
-		if ((u8 *)ie + sizeof(INDEX_ENTRY_HEADER) > index_end ||
-		    (u8 *)ie + le16_to_cpu(ie->length) > index_end) {
-			errno = ERANGE;
-			ntfs_log_error("Index entry out of bounds in inode "
-				       "%llu.\n",
-				       (unsigned long long)icx->ni->mft_no);
-			return STATUS_ERROR;
-		}
-		/*
-		 * The last entry cannot contain a key.  It can however contain
-		 * a pointer to a child node in the B+tree so we just break out.
-		 */
-		if (ntfs_ie_end(ie))
-			break;
-		/*
-		 * Not a perfect match, need to do full blown collation so we
-		 * know which way in the B+tree we have to go.
-		 */
-		if (!icx->collate) {
-			ntfs_log_error("Collation function not defined\n");
-			errno = EOPNOTSUPP;
-			return STATUS_ERROR;
-		}
-		rc = icx->collate(icx->ni->vol, key, key_len,
-					&ie->key, le16_to_cpu(ie->key_length));
-		if (rc == NTFS_COLLATION_ERROR) {
-			ntfs_log_error("Collation error. Perhaps a filename "
-				       "contains invalid characters?\n");
-			errno = ERANGE;
-			return STATUS_ERROR;
+	int count;
+
+	count = 0;
+	ie = *pie;
+	while (count < INDEX_SEARCH_CHUNK) {
+		if (((u8*)ie < (u8*)ih)
+		    || ((u8*)ie + sizeof(INDEX_ENTRY_HEADER) > index_end)
+		    || ((u8*)ie + le16_to_cpu(ie->length) > index_end)) {
+			errno = EIO;
+			return (-1);
 		}
-		/*
-		 * If @key collates before the key of the current entry, there
-		 * is definitely no such key in this index but we might need to
-		 * descend into the B+tree so we just break out of the loop.
-		 */
-		if (rc == -1)
+		if (ie->ie_flags & INDEX_ENTRY_END)
 			break;
-		
-		if (!rc) {
-			*ie_out = ie;
-			errno = 0;
-			icx->parent_pos[icx->pindex] = item;
-			return STATUS_OK;
+		if ((le16_to_cpu(ie->key_length) + sizeof(INDEX_ENTRY_HEADER))
+			    > le16_to_cpu(ie->length)) {
+			errno = EIO;
+			return (-1);
 		}
-		
-		item++;
-	}
-	/*
-	 * We have finished with this index block without success. Check for the
-	 * presence of a child node and if not present return with errno ENOENT,
-	 * otherwise we will keep searching in another index block.
-	 */
-	if (!(ie->ie_flags & INDEX_ENTRY_NODE)) {
-		ntfs_log_debug("Index entry wasn't found.\n");
-		*ie_out = ie;
-		errno = ENOENT;
-		return STATUS_NOT_FOUND;
+		entries[count++] = ie;
+		ie = ntfs_ie_get_next(ie);
 	}
-	
-	/* Get the starting vcn of the index_block holding the child node. */
-	*vcn = ntfs_ie_get_vcn(ie);
-	if (*vcn < 0) {
-		errno = EINVAL;
-		ntfs_log_perror("Negative vcn in inode %llu",
-			       	(unsigned long long)icx->ni->mft_no);
-		return STATUS_ERROR;
+	*pie = ie;
+	return (count);
+}
+
+/*
+ *	Locate by dichotomy the first entry of entries[low..high-1] which
+ *	does not collate before the key, @CMP setting rc to -1, 0 or 1 as
+ *	the key collates before, equal to or after the key of entries[mid],
+ *	or to NTFS_COLLATION_ERROR.
+ */
+
+#define IE_DICHOTOMY(CMP) \
+	do { \
+		while (!found && (low < high)) { \
+			mid = (low + high) >> 1; \
+			CMP; \
+			if (rc == NTFS_COLLATION_ERROR) { \
+				errno = ERANGE; \
+				return (STATUS_ERROR); \
+			} \
+			if (rc > 0) \
+				low = mid + 1; \
+			else { \
+				high = mid; \
+				found = !rc; \
+			} \
+		} \
+	} while (0)
+
+int ntfs_ie_search(INDEX_HEADER *ih, u8 *index_end,
+		ntfs_ie_collate_t collate, const void *data,
+		INDEX_ENTRY **ie_out, int *item)
+{
+	INDEX_ENTRY *entries[INDEX_SEARCH_CHUNK];
+	INDEX_ENTRY *ie;
+	BOOL found;
+	int base, count, low, high, mid, rc;
+
+	base = 0;
+	ie = ntfs_ie_get_first(ih);
+	do {
+		count = ie_collect(ih, index_end, &ie, entries);
+		if (count < 0)
+			return (STATUS_ERROR);
+			/* locate the first entry not collating before the key */
+		found = FALSE;
+		low = 0;
+		high = count;
+		IE_DICHOTOMY(rc = collate(data, entries[mid]));
+		if (high < count) {
+			*ie_out = entries[high];
+			*item = base + high;
+			return (found ? STATUS_OK : STATUS_NOT_FOUND);
+		}
+		base += count;
+	} while (count == INDEX_SEARCH_CHUNK);
+		/* the key collates after all the entries */
+	*ie_out = ie;
+	*item = base;
+	return (STATUS_NOT_FOUND);
+}
+
+/*
+ *		Compare two integers as a collation does
+ */
+
+#define IE_CMP(k, d) ((k) < (d) ? -1 : ((k) > (d) ? 1 : 0))
+
+/*
+ *		Get the key of an entry as a le32, a pair of le32 or an
+ *		array of le32, checking its length
+ */
+
+#define IE_ULONG(ie) le32_to_cpup((const le32*)&(ie)->key)
+#define IE_HASH(ie) (((u64)le32_to_cpup((const le32*)&(ie)->key) << 32) \
+		| le32_to_cpup((const le32*)&(ie)->key + 1))
+#define IE_KEY_LEN(ie) le16_to_cpu((ie)->key_length)
+
+/*
+ *		Compare a key to the key of an entry as arrays of le32
+ */
+
+static __inline__ int ie_cmp_ulongs(const le32 *key, int key_len,
+			const INDEX_ENTRY *ie)
+{
+	const le32 *p;
+	u32 d1, d2;
+	int n;
+
+	if (IE_KEY_LEN(ie) != key_len)
+		return (NTFS_COLLATION_ERROR);
+	p = (const le32*)&ie->key;
+	n = key_len >> 2;
+	do {
+		d1 = le32_to_cpup(key++);
+		d2 = le32_to_cpup(p++);
+	} while ((d1 == d2) && --n);
+	return (IE_CMP(d1, d2));
+}
+
+/*
+ *		Compare a key to the key of an entry as bytes
+ */
+
+static __inline__ int ie_cmp_binary(const void *key, int key_len,
+			const INDEX_ENTRY *ie)
+{
+	int len;
+	int rc;
+
+	len = IE_KEY_LEN(ie);
+	rc = memcmp(key, &ie->key, (key_len < len ? key_len : len));
+	if (!rc)
+		rc = IE_CMP(key_len, len);
+	return (rc < 0 ? -1 : (rc > 0));
+}
+
+/**
+ * ie_search_fixed - search a key with fixed-size items in an index node
+ * @ih:		header of the index node
+ * @index_end:	end of the entries of the node
+ * @cr:		the collation rule of the index
+ * @key:	the key searched
+ * @key_len:	the length of the key
+ * @ie_out:	the entry found
+ * @item:	the position of @ie_out in the node
+ *
+ * This is the same as ntfs_ie_search() for the indexes whose keys are
+ * integers or arrays of integers, such as $SII, $SDH, $O, $R and $Q,
+ * or are collated as bytes. The key is decoded once and it is compared
+ * inline to the keys of the entries, with no call to a collation
+ * function.
+ *
+ * Returns as ntfs_ie_search(), or STATUS_KEEP_SEARCHING if the
+ * collation rule is not handled here.
+ */
+static int ie_search_fixed(INDEX_HEADER *ih, u8 *index_end,
+		COLLATION_RULES cr, const void *key, int key_len,
+		INDEX_ENTRY **ie_out, int *item)
+{
+	INDEX_ENTRY *entries[INDEX_SEARCH_CHUNK];
+	INDEX_ENTRY *ie;
+	BOOL found;
+	int base, count, low, high, mid, rc;
+	u64 k;
+
+	switch (cr) {
+	case COLLATION_NTOFS_ULONG :
+		if (key_len != 4)
+			return (STATUS_KEEP_SEARCHING);
+		k = le32_to_cpup((const le32*)key);
+		break;
+	case COLLATION_NTOFS_SECURITY_HASH :
+		if (key_len != 8)
+			return (STATUS_KEEP_SEARCHING);
+		k = ((u64)le32_to_cpup((const le32*)key) << 32)
+			| le32_to_cpup((const le32*)key + 1);
+		break;
+	case COLLATION_NTOFS_ULONGS :
+		if ((key_len <= 0) || (key_len & 3))
+			return (STATUS_KEEP_SEARCHING);
+		k = 0;
+		break;
+	case COLLATION_BINARY :
+		k = 0;
+		break;
+	default :
+		return (STATUS_KEEP_SEARCHING);
+	}
+	base = 0;
+	ie = ntfs_ie_get_first(ih);
+	do {
+		count = ie_collect(ih, index_end, &ie, entries);
+		if (count < 0)
+			return (STATUS_ERROR);
+		found = FALSE;
+		low = 0;
+		high = count;
+		switch (cr) {
+		case COLLATION_NTOFS_ULONG :
+			IE_DICHOTOMY(rc = (IE_KEY_LEN(entries[mid]) != 4
+				? NTFS_COLLATION_ERROR
+				: IE_CMP(k, IE_ULONG(entries[mid]))));
+			break;
+		case COLLATION_NTOFS_SECURITY_HASH :
+			IE_DICHOTOMY(rc = (IE_KEY_LEN(entries[mid]) != 8
+				? NTFS_COLLATION_ERROR
+				: IE_CMP(k, IE_HASH(entries[mid]))));
+			break;
+		case COLLATION_NTOFS_ULONGS :
+			IE_DICHOTOMY(rc = ie_cmp_ulongs((const le32*)key,
+					key_len, entries[mid]));
+			break;
+		default :
+			IE_DICHOTOMY(rc = ie_cmp_binary(key, key_len,
+					entries[mid]));
+			break;
+		}
+		if (high < count) {
+			*ie_out = entries[high];
+			*item = base + high;
+			return (found ? STATUS_OK : STATUS_NOT_FOUND);
+		}
+		base += count;
+	} while (count == INDEX_SEARCH_CHUNK);
+		/* the key collates after all the entries */
+	*ie_out = ie;
+	*item = base;
+	return (STATUS_NOT_FOUND);
+}
+
+/*
+ *		Collate a key against an entry for ntfs_ie_lookup()
+ */
+
+struct IE_LOOKUP {
+	ntfs_index_context *icx;
+	const void *key;
+	int key_len;
+} ;
+
+static int ie_lookup_collate(const void *data, const INDEX_ENTRY *ie)
+{
+	const struct IE_LOOKUP *lookup;
+
+	lookup = (const struct IE_LOOKUP*)data;
+	return (lookup->icx->collate(lookup->icx->ni->vol,
+			lookup->key, lookup->key_len,
+			&ie->key, le16_to_cpu(ie->key_length)));
+}
+
+/** 
+ * Find a key in the index block.
+ * 
+ * Return values:
+ *   STATUS_OK with errno set to ESUCCESS if we know for sure that the 
+ *             entry exists and @ie_out points to this entry.
+ *   STATUS_NOT_FOUND with errno set to ENOENT if we know for sure the
+ *                    entry doesn't exist and @ie_out is the insertion point.
+ *   STATUS_KEEP_SEARCHING if we can't answer the above question and
+ *                         @vcn will contain the node index block.
+ *   STATUS_ERROR with errno set if on unexpected error during lookup.
+ */
+static int ntfs_ie_lookup(const void *key, const int key_len,
+			  ntfs_index_context *icx, INDEX_HEADER *ih,
+			  VCN *vcn, INDEX_ENTRY **ie_out)
+{
+	struct IE_LOOKUP lookup;
+	INDEX_ENTRY *ie;
+	u8 *index_end;
+	int rc, item;
+	 
+	ntfs_log_trace("Entering\n");
+	
+	if (!icx->collate) {
+		ntfs_log_error("Collation function not defined\n");
+		errno = EOPNOTSUPP;
+		return STATUS_ERROR;
+	}
+	index_end = ntfs_ie_get_end(ih);
+		/* file names are collated through the upcase table */
+	rc = STATUS_KEEP_SEARCHING;
+	if (icx->collation_rule != COLLATION_FILE_NAME)
+		rc = ie_search_fixed(ih, index_end, icx->collation_rule,
+				key, key_len, &ie, &item);
+	if (rc == STATUS_KEEP_SEARCHING) {
+		lookup.icx = icx;
+		lookup.key = key;
+		lookup.key_len = key_len;
+		rc = ntfs_ie_search(ih, index_end, ie_lookup_collate, &lookup,
+				&ie, &item);
+	}
+	if (rc == STATUS_ERROR) {
+		if (errno == ERANGE)
+			ntfs_log_error("Collation error. Perhaps a filename "
+				       "contains invalid characters?\n");
+		else
+			ntfs_log_error("Index entry out of bounds in inode "
+				       "%llu.\n",
+				       (unsigned long long)icx->ni->mft_no);
+		errno = ERANGE;
+		return STATUS_ERROR;
+	}
+	if (rc == STATUS_OK) {
+		*ie_out = ie;
+		errno = 0;
+		icx->parent_pos[icx->pindex] = item;
+		return STATUS_OK;
+	}
+	/*
+	 * We have finished with this index block without success. Check for the
+	 * presence of a child node and if not present return with errno ENOENT,
+	 * otherwise we will keep searching in another index block.
+	 */
+	if (!(ie->ie_flags & INDEX_ENTRY_NODE)) {
+		ntfs_log_debug("Index entry wasn't found.\n");
+		*ie_out = ie;
+		errno = ENOENT;
+		return STATUS_NOT_FOUND;
+	}
+	
+	/* Get the starting vcn of the index_block holding the child node. */
+	*vcn = ntfs_ie_get_vcn(ie);
+	if (*vcn < 0) {
+		errno = EINVAL;
+		ntfs_log_perror("Negative vcn in inode %llu",
+			       	(unsigned long long)icx->ni->mft_no);
+		return STATUS_ERROR;
 	}
 
 	ntfs_log_trace("Parent entry number %d\n", item);
 	icx->parent_pos[icx->pindex] = item;
+	*ie_out = ie;
 	
 	return STATUS_KEEP_SEARCHING;
 }
@@ -596,7 +1508,7 @@ static int ntfs_ib_read(ntfs_index_context *icx, VCN vcn, INDEX_BLOCK *dst)
 	
 	pos = ntfs_ib_vcn_to_pos(icx, vcn);
 
-	ret = ntfs_attr_mst_pread(icx->ia_na, pos, 1, icx->block_size, (u8 *)dst);
+	ret = ntfs_index_block_read(icx->ia_na, pos, icx->block_size, dst);
 	if (ret != 1) {
 		if (ret == -1)
 			ntfs_log_perror("Failed to read index block");
@@ -623,6 +1535,27 @@ static int ntfs_icx_parent_inc(ntfs_index_context *icx)
 	return STATUS_OK;
 }
 
+/*
+ *		Record the entry bounding the subtree being descended into
+ *
+ *	The upper bound does not change when the last entry of a node
+ *	is followed.
+ */
+
+static int ntfs_icx_set_bound(ntfs_index_context *icx, INDEX_ENTRY *ie)
+{
+	INDEX_ENTRY *bound;
+
+	if (icx->want_bound && !ntfs_ie_end(ie)) {
+		bound = ntfs_ie_dup(ie);
+		if (!bound)
+			return STATUS_ERROR;
+		free(icx->bound);
+		icx->bound = bound;
+	}
+	return STATUS_OK;
+}
+
 static int ntfs_icx_parent_dec(ntfs_index_context *icx)
 {
 	icx->pindex--;
@@ -683,10 +1616,14 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 		return -1;
 	}
 
+	NTFS_PROBE2(index_lookup_entry, ni->mft_no, key_len);
+	free(icx->bound);
+	icx->bound = NULL;
 	ir = ntfs_ir_lookup(ni, icx->name, icx->name_len, &icx->actx);
 	if (!ir) {
 		if (errno == ENOENT)
 			errno = EIO;
+		NTFS_PROBE2(index_lookup_return, ni->mft_no, -1);
 		return -1;
 	}
 	
@@ -704,6 +1641,7 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 		icx->vcn_size_bits = NTFS_BLOCK_SIZE_BITS;
 			/* get the appropriate collation function */
 	icx->collate = ntfs_get_collate_function(ir->collation_rule);
+	icx->collation_rule = ir->collation_rule;
 	if (!icx->collate) {
 		err = errno = EOPNOTSUPP;
 		ntfs_log_perror("Unknown collation rule 0x%x", 
@@ -724,6 +1662,10 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 	
 	icx->ir = ir;
 	
+	if ((ret != STATUS_OK) && ntfs_icx_set_bound(icx, ie)) {
+		err = errno;
+		goto err_out;
+	}
 	if (ret != STATUS_KEEP_SEARCHING) {
 		/* STATUS_OK or STATUS_NOT_FOUND */
 		err = errno;
@@ -759,6 +1701,9 @@ descend_into_child_node:
 		goto err_out;
 	
 	ret = ntfs_ie_lookup(key, key_len, icx, &ib->index, &vcn, &ie);
+	if ((ret != STATUS_OK) && (ret != STATUS_ERROR)
+	    && ntfs_icx_set_bound(icx, ie))
+		ret = STATUS_ERROR;
 	if (ret != STATUS_KEEP_SEARCHING) {
 		err = errno;
 		if (ret == STATUS_ERROR)
@@ -785,6 +1730,7 @@ err_lookup:
 	free(ib);
 	if (!err)
 		err = EIO;
+	NTFS_PROBE2(index_lookup_return, ni->mft_no, -1);
 	errno = err;
 	return -1;
 done:
@@ -792,6 +1738,7 @@ done:
 	icx->data = (u8 *)ie + offsetof(INDEX_ENTRY, key);
 	icx->data_len = le16_to_cpu(ie->key_length);
 	ntfs_log_trace("Done.\n");
+	NTFS_PROBE2(index_lookup_return, ni->mft_no, (err ? -1 : 0));
 	if (err) {
 		errno = err;
 		return -1;
@@ -1502,6 +2449,7 @@ int ntfs_ie_add(ntfs_index_context *icx, INDEX_ENTRY *ie)
 		ntfs_index_ctx_reinit(icx);
 	}
 	
+	ntfs_index_changed(icx, ie, 1);
 	ntfs_ie_insert(ih, ie, icx->entry);
 	ntfs_index_entry_mark_dirty(icx);
 	
@@ -1511,6 +2459,29 @@ err_out:
 	return ret;
 }
 
+/*
+ *		Build the index entry of a filename
+ */
+
+static INDEX_ENTRY *ntfs_ie_build_filename(FILE_NAME_ATTR *fn, MFT_REF mref)
+{
+	INDEX_ENTRY *ie;
+	int fn_size, ie_size;
+
+	fn_size = (fn->file_name_length * sizeof(ntfschar)) +
+			sizeof(FILE_NAME_ATTR);
+	ie_size = (sizeof(INDEX_ENTRY_HEADER) + fn_size + 7) & ~7;
+	
+	ie = ntfs_calloc(ie_size);
+	if (ie) {
+		ie->indexed_file = cpu_to_le64(mref);
+		ie->length 	 = cpu_to_le16(ie_size);
+		ie->key_length 	 = cpu_to_le16(fn_size);
+		memcpy(&ie->key, fn, fn_size);
+	}
+	return (ie);
+}
+
 /**
  * ntfs_index_add_filename - add filename to directory index
  * @ni:		ntfs inode describing directory to which index add filename
@@ -1523,7 +2494,7 @@ int ntfs_index_add_filename(ntfs_inode *ni, FILE_NAME_ATTR *fn, MFT_REF mref)
 {
 	INDEX_ENTRY *ie;
 	ntfs_index_context *icx;
-	int fn_size, ie_size, err, ret = -1;
+	int err, ret = -1;
 
 	ntfs_log_trace("Entering\n");
 	
@@ -1532,20 +2503,13 @@ int ntfs_index_add_filename(ntfs_inode *ni, FILE_NAME_ATTR *fn, MFT_REF mref)
 		errno = EINVAL;
 		return -1;
 	}
+	if (ntfs_index_lazy_apply(ni))
+		return -1;
 	
-	fn_size = (fn->file_name_length * sizeof(ntfschar)) +
-			sizeof(FILE_NAME_ATTR);
-	ie_size = (sizeof(INDEX_ENTRY_HEADER) + fn_size + 7) & ~7;
-	
-	ie = ntfs_calloc(ie_size);
+	ie = ntfs_ie_build_filename(fn, mref);
 	if (!ie)
 		return -1;
 
-	ie->indexed_file = cpu_to_le64(mref);
-	ie->length 	 = cpu_to_le16(ie_size);
-	ie->key_length 	 = cpu_to_le16(fn_size);
-	memcpy(&ie->key, fn, fn_size);
-	
 	icx = ntfs_index_ctx_get(ni, NTFS_INDEX_I30, 4);
 	if (!icx)
 		goto out;
@@ -1559,6 +2523,513 @@ out:
 	return ret;
 }
 
+/*
+ *		Sort index entries in collation order
+ *
+ *	This is a merge sort, the collation needs the volume, which
+ *	qsort() cannot pass. A collation error is taken as an inequality,
+ *	it will be reported when inserting.
+ */
+
+static void ntfs_ie_sort(ntfs_volume *vol, COLLATE collate,
+			INDEX_ENTRY **ies, INDEX_ENTRY **tmp, int count)
+{
+	INDEX_ENTRY **from, **to, **swap;
+	int width, start, mid, end, i, j, k;
+
+	from = ies;
+	to = tmp;
+	for (width=1; width<count; width<<=1) {
+		for (start=0; start<count; start+=2*width) {
+			mid = (start + width < count ? start + width : count);
+			end = (mid + width < count ? mid + width : count);
+			i = start;
+			j = mid;
+			for (k=start; k<end; k++) {
+				if ((i < mid)
+				    && ((j >= end)
+					|| (collate(vol, &from[i]->key,
+					    le16_to_cpu(from[i]->key_length),
+					    &from[j]->key,
+					    le16_to_cpu(from[j]->key_length))
+						<= 0)))
+					to[k] = from[i++];
+				else
+					to[k] = from[j++];
+			}
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from != ies)
+		memcpy(ies, from, count*sizeof(INDEX_ENTRY*));
+}
+
+/*
+ *		Check whether an entry can be inserted just after the
+ *	one which has been inserted previously, without a new lookup
+ *
+ *	This is only done in leaves, when the new key collates after the
+ *	previous one and before the entry bounding the leaf, and when
+ *	there is enough space left.
+ */
+
+static INDEX_HEADER *ntfs_ie_next_place(ntfs_index_context *icx,
+			INDEX_ENTRY *previous, INDEX_ENTRY *ie)
+{
+	ntfs_volume *vol;
+	INDEX_HEADER *ih;
+	int key_len;
+
+	vol = icx->ni->vol;
+	if (icx->is_in_root)
+		ih = &icx->ir->index;
+	else
+		ih = &icx->ib->index;
+	key_len = le16_to_cpu(ie->key_length);
+	if (((ih->ih_flags & NODE_MASK) != LEAF_NODE)
+	    || ((le32_to_cpu(ih->index_length) + le16_to_cpu(ie->length))
+			> le32_to_cpu(ih->allocated_size))
+	    || (icx->collate(vol, &previous->key,
+			le16_to_cpu(previous->key_length),
+			&ie->key, key_len) != -1)
+	    || (icx->bound
+		&& (icx->collate(vol, &ie->key, key_len, &icx->bound->key,
+			le16_to_cpu(icx->bound->key_length)) != -1)))
+		ih = (INDEX_HEADER*)NULL;
+	return (ih);
+}
+
+/**
+ * ntfs_index_add_filenames - add a batch of filenames to a directory index
+ * @ni:		ntfs inode describing directory to which index filenames
+ * @fns:	FILE_NAME attributes to add
+ * @mrefs:	references of the inodes which @fns describe
+ * @count:	number of filenames
+ *
+ * The filenames are sorted in collation order and inserted through a
+ * single index context. As long as the next filename fits into the
+ * leaf where the previous one was inserted, and collates before the
+ * entry bounding this leaf, it is inserted next to the previous one
+ * without a new lookup, and the leaf is only written when insertions
+ * move to another node.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ * On error, the filenames collating before the failing one have been
+ * inserted.
+ */
+int ntfs_index_add_filenames(ntfs_inode *ni, FILE_NAME_ATTR **fns,
+			const MFT_REF *mrefs, int count)
+{
+	INDEX_ENTRY **ies;
+	INDEX_ENTRY *previous;
+	INDEX_HEADER *ih;
+	INDEX_ENTRY *pos;
+	ntfs_index_context *icx;
+	COLLATE collate;
+	int i, built, err, ret = -1;
+
+	ntfs_log_trace("Entering\n");
+	
+	if (!ni || !fns || !mrefs || (count < 0)) {
+		ntfs_log_error("Invalid arguments.\n");
+		errno = EINVAL;
+		return -1;
+	}
+	if (!count)
+		return 0;
+	if (count == 1)
+		return (ntfs_index_add_filename(ni, fns[0], mrefs[0]));
+	if (ntfs_index_lazy_apply(ni))
+		return -1;
+	collate = ntfs_get_collate_function(COLLATION_FILE_NAME);
+	ies = (INDEX_ENTRY**)ntfs_malloc(2*count*sizeof(INDEX_ENTRY*));
+	if (!ies)
+		return -1;
+	for (built=0; built<count; built++) {
+		ies[built] = ntfs_ie_build_filename(fns[built], mrefs[built]);
+		if (!ies[built]) {
+			err = errno;
+			goto free_entries;
+		}
+	}
+	ntfs_ie_sort(ni->vol, collate, ies, &ies[count], count);
+
+	icx = ntfs_index_ctx_get(ni, NTFS_INDEX_I30, 4);
+	if (!icx) {
+		err = errno;
+		goto free_entries;
+	}
+	icx->want_bound = TRUE;
+	ret = 0;
+	previous = (INDEX_ENTRY*)NULL;
+	for (i=0; !ret && (i<count); i++) {
+		ih = (previous ? ntfs_ie_next_place(icx, previous, ies[i])
+				: (INDEX_HEADER*)NULL);
+		if (ih) {
+			pos = ntfs_ie_get_next(icx->entry);
+			ntfs_index_changed(icx, ies[i], 1);
+			ntfs_ie_insert(ih, ies[i], pos);
+			icx->entry = pos;
+			ntfs_index_entry_mark_dirty(icx);
+		} else {
+			if (previous)
+				ntfs_index_ctx_reinit(icx);
+			ret = ntfs_ie_add(icx, ies[i]);
+		}
+		previous = ies[i];
+	}
+	err = errno;
+	ntfs_index_ctx_put(icx);
+free_entries:
+	for (i=0; i<built; i++)
+		free(ies[i]);
+	free(ies);
+	if (ret)
+		errno = err;
+	return ret;
+}
+
+/*
+ *		Build a level of an index being built bottom-up
+ *
+ *	The entries are packed into consecutive nodes filled up to
+ *	fill percent, and the entry following each node but the last
+ *	one is kept out to separate it from the next node. When children
+ *	are defined (a level above the leaves), the entries and the end
+ *	entry of a node point to the children on their left.
+ *
+ *	The nodes are only written when asked to, so that the number of
+ *	blocks needed can be counted beforehand. The separators and the
+ *	vcns of the nodes are returned for building the next level.
+ *
+ *	Returns the number of nodes or -1 if there is an error.
+ */
+
+static int ntfs_ib_build_level(ntfs_index_context *icx, INDEX_ENTRY **ies,
+			const VCN *children, int count, int fill,
+			VCN *next_vcn, INDEX_ENTRY **separators,
+			VCN *vcns, BOOL write)
+{
+	INDEX_BLOCK *ib;
+	INDEX_ENTRY *ie;
+	INDEX_HEADER_FLAGS node_type;
+	u32 room, fill_size, used, extra, end_size, size;
+	int start, end, nodes, i;
+	BOOL ok;
+
+	node_type = (children ? INDEX_NODE : LEAF_NODE);
+	ib = ntfs_ib_alloc(0, icx->block_size, node_type);
+	if (!ib)
+		return (-1);
+	room = le32_to_cpu(ib->index.allocated_size)
+			- le32_to_cpu(ib->index.entries_offset);
+	fill_size = (u64)room*fill/100;
+	extra = (children ? sizeof(VCN) : 0);
+	end_size = sizeof(INDEX_ENTRY_HEADER) + extra;
+	nodes = 0;
+	end = 0;
+	ok = TRUE;
+	while (ok && (end < count)) {
+		start = end;
+		used = end_size + le16_to_cpu(ies[end++]->length) + extra;
+		while ((end < count)
+		    && ((used + le16_to_cpu(ies[end]->length) + extra)
+				<= fill_size)) {
+			used += le16_to_cpu(ies[end]->length) + extra;
+			end++;
+		}
+			/*
+			 * A single entry left over cannot make a node after
+			 * a separator : append it if there is room, or keep
+			 * the last entry of the node as the separator.
+			 */
+		if (end == (count - 1)) {
+			size = le16_to_cpu(ies[end]->length) + extra;
+			if ((used + size) <= room) {
+				used += size;
+				end++;
+			} else {
+				end--;
+				used -= le16_to_cpu(ies[end]->length) + extra;
+			}
+		}
+		if ((end == start) || (used > room)) {
+			errno = ENOSPC;
+			ok = FALSE;
+		}
+		if (ok && write) {
+			free(ib);
+			ib = ntfs_ib_alloc(*next_vcn, icx->block_size,
+					node_type);
+			if (!ib)
+				return (-1);
+			ie = ntfs_ie_get_first(&ib->index);
+			for (i=start; i<end; i++) {
+				memcpy(ie, ies[i], le16_to_cpu(ies[i]->length));
+				if (children) {
+					ie->ie_flags |= INDEX_ENTRY_NODE;
+					ie->length = cpu_to_le16(
+						le16_to_cpu(ie->length)
+							+ sizeof(VCN));
+					ntfs_ie_set_vcn(ie, children[i]);
+				}
+				ie = ntfs_ie_get_next(ie);
+			}
+			ie->length = cpu_to_le16(end_size);
+			ie->ie_flags = INDEX_ENTRY_END;
+			if (children) {
+				ie->ie_flags |= INDEX_ENTRY_NODE;
+				ntfs_ie_set_vcn(ie, children[end]);
+			}
+			ib->index.index_length = cpu_to_le32(used
+				+ le32_to_cpu(ib->index.entries_offset));
+			if (ntfs_ib_write(icx, ib))
+				ok = FALSE;
+		}
+		if (ok) {
+			vcns[nodes++] = *next_vcn;
+			*next_vcn = ntfs_ibm_pos_to_vcn(icx,
+				ntfs_ibm_vcn_to_pos(icx, *next_vcn) + 1);
+			if (end < count)
+				separators[nodes - 1] = ies[end++];
+		}
+	}
+	free(ib);
+	return (ok ? nodes : -1);
+}
+
+/*
+ *		Build all the levels of an index bottom-up
+ *
+ *	The leaves get the vcns from 0 upwards, followed by the nodes of
+ *	each upper level, so that the top node, returned in *top_vcn, is
+ *	the last one. The work space is made of two arrays of count
+ *	entries, and the vcns of two arrays of count + 1 vcns.
+ *
+ *	Returns the number of blocks or -1 if there is an error.
+ */
+
+static s64 ntfs_ib_build_levels(ntfs_index_context *icx, INDEX_ENTRY **ies,
+			INDEX_ENTRY **work, VCN *vcns, int count, int fill,
+			VCN *top_vcn, BOOL write)
+{
+	VCN next_vcn;
+	INDEX_ENTRY **separators;
+	VCN *children;
+	s64 blocks;
+	int nodes;
+
+	separators = &work[count];
+	children = &vcns[count + 1];
+	next_vcn = 0;
+	blocks = 0;
+	nodes = ntfs_ib_build_level(icx, ies, (VCN*)NULL, count, fill,
+				&next_vcn, separators, children, write);
+	while (nodes > 1) {
+		blocks += nodes;
+		memcpy(vcns, children, nodes*sizeof(VCN));
+		memcpy(work, separators, (nodes - 1)*sizeof(INDEX_ENTRY*));
+		nodes = ntfs_ib_build_level(icx, work, vcns, nodes - 1,
+				fill, &next_vcn, separators, children, write);
+	}
+	if (nodes < 1)
+		return (-1);
+	*top_vcn = children[0];
+	return (blocks + 1);
+}
+
+/*
+ *		Mark the first blocks of the index allocation as used
+ */
+
+static int ntfs_ibm_set_first(ntfs_index_context *icx, s64 blocks)
+{
+	ntfs_attr *na;
+	u8 *bmp;
+	s64 size;
+	int ret;
+
+	ret = -1;
+	na = ntfs_attr_open(icx->ni, AT_BITMAP, icx->name, icx->name_len);
+	if (!na) {
+		ntfs_log_perror("Failed to open $BITMAP attribute");
+		return (-1);
+	}
+	size = ((blocks + 63) >> 6) << 3;
+	bmp = (u8*)ntfs_calloc(size);
+	if (bmp) {
+		memset(bmp, 0xff, blocks >> 3);
+		if (blocks & 7)
+			bmp[blocks >> 3] = (1 << (blocks & 7)) - 1;
+		if (((na->data_size >= size) || !ntfs_attr_truncate(na, size))
+		    && (ntfs_attr_pwrite(na, 0, size, bmp) == size))
+			ret = 0;
+		free(bmp);
+	}
+	ntfs_attr_close(na);
+	return (ret);
+}
+
+/**
+ * ntfs_index_build_filenames - build a directory index from filenames
+ * @ni:		ntfs inode describing the directory, with an empty index
+ * @fns:	FILE_NAME attributes to index
+ * @mrefs:	references of the inodes which @fns describe
+ * @count:	number of filenames
+ * @fill:	percentage of the index blocks to fill, 0 for the default
+ *
+ * Instead of inserting the filenames one by one and splitting the
+ * blocks when they get full, the whole index is built bottom-up : the
+ * filenames, sorted in collation order, are packed into leaves filled
+ * up to @fill percent, the entries separating the leaves make the
+ * level above, and so on until a single node is left, which the index
+ * root points to. Each block is written once, in vcn order.
+ *
+ * This is meant for populating a directory which has just been
+ * created, the index must be empty and never have been allocated
+ * blocks. When the filenames fit into a single block, they are simply
+ * inserted, so that a small index remains in the index root.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_build_filenames(ntfs_inode *ni, FILE_NAME_ATTR **fns,
+			const MFT_REF *mrefs, int count, int fill)
+{
+	INDEX_ENTRY **ies;
+	VCN *vcns;
+	ntfs_index_context *icx;
+	ntfs_attr_search_ctx *ctx;
+	INDEX_ROOT *ir;
+	COLLATE collate;
+	VCN top_vcn;
+	s64 blocks;
+	int i, built, err, res, ret = -1;
+
+	ntfs_log_trace("Entering\n");
+	
+	if (!fill)
+		fill = INDEX_BUILD_FILL;
+	if (!ni || !fns || !mrefs || (count < 0)
+	    || (fill < INDEX_BUILD_MIN_FILL) || (fill > 100)) {
+		ntfs_log_error("Invalid arguments.\n");
+		errno = EINVAL;
+		return -1;
+	}
+	if (count < 2)
+		return (ntfs_index_add_filenames(ni, fns, mrefs, count));
+	collate = ntfs_get_collate_function(COLLATION_FILE_NAME);
+	ies = (INDEX_ENTRY**)ntfs_malloc(3*count*sizeof(INDEX_ENTRY*));
+	vcns = (VCN*)ntfs_malloc(2*(count + 1)*sizeof(VCN));
+	err = ENOMEM;
+	built = 0;
+	if (!ies || !vcns)
+		goto free_entries;
+	for (built=0; built<count; built++) {
+		ies[built] = ntfs_ie_build_filename(fns[built], mrefs[built]);
+		if (!ies[built]) {
+			err = errno;
+			goto free_entries;
+		}
+	}
+		/* filenames are usually supplied sorted */
+	for (i=1; (i<count) && (collate(ni->vol, &ies[i-1]->key,
+			le16_to_cpu(ies[i-1]->key_length), &ies[i]->key,
+			le16_to_cpu(ies[i]->key_length)) == -1); i++) { }
+	if (i < count) {
+		ntfs_ie_sort(ni->vol, collate, ies, &ies[count], count);
+		for (i=1; i<count; i++) {
+			if (collate(ni->vol, &ies[i-1]->key,
+					le16_to_cpu(ies[i-1]->key_length),
+					&ies[i]->key,
+					le16_to_cpu(ies[i]->key_length))
+						!= -1) {
+				err = EEXIST;
+				goto free_entries;
+			}
+		}
+	}
+
+	icx = ntfs_index_ctx_get(ni, NTFS_INDEX_I30, 4);
+	if (!icx) {
+		err = errno;
+		goto free_entries;
+	}
+		/* get the index geometry, and check the index is empty */
+	res = ntfs_index_lookup(&ies[0]->key,
+			le16_to_cpu(ies[0]->key_length), icx);
+	err = errno;
+	if (res && (err != ENOENT))
+		goto put_context;
+	if (!res
+	    || !icx->is_in_root
+	    || ((icx->ir->index.ih_flags & NODE_MASK) != SMALL_INDEX)
+	    || !ntfs_ie_end(icx->entry)
+	    || (icx->entry != ntfs_ie_get_first(&icx->ir->index))) {
+		err = ENOTEMPTY;
+		goto put_context;
+	}
+	blocks = ntfs_ib_build_levels(icx, ies, &ies[count], vcns, count,
+				fill, &top_vcn, FALSE);
+	if (blocks < 0) {
+		err = errno;
+		goto put_context;
+	}
+	if (blocks == 1) {
+		ntfs_index_ctx_put(icx);
+		for (i=0; i<built; i++)
+			free(ies[i]);
+		free(ies);
+		free(vcns);
+		return (ntfs_index_add_filenames(ni, fns, mrefs, count));
+	}
+		/* create the allocation, the index root points to vcn 0 */
+	if (ntfs_ir_reparent(icx)) {
+		err = errno;
+		goto put_context;
+	}
+	ntfs_inode_mark_dirty(ni);
+	ntfs_index_ctx_reinit(icx);
+	res = ntfs_index_lookup(&ies[0]->key,
+			le16_to_cpu(ies[0]->key_length), icx);
+	if (!res || (errno != ENOENT)) {
+		err = (res ? errno : EIO);
+		goto put_context;
+	}
+	if (ntfs_attr_truncate(icx->ia_na,
+			blocks*(s64)icx->block_size)
+	    || ntfs_ibm_set_first(icx, blocks)
+	    || (ntfs_ib_build_levels(icx, ies, &ies[count], vcns, count,
+				fill, &top_vcn, TRUE) != blocks)) {
+		err = errno;
+		goto put_context;
+	}
+	ctx = (ntfs_attr_search_ctx*)NULL;
+	ir = ntfs_ir_lookup(ni, icx->name, icx->name_len, &ctx);
+	if (!ir) {
+		err = errno;
+		goto put_context;
+	}
+	ntfs_ie_set_vcn(ntfs_ie_get_first(&ir->index), top_vcn);
+	ntfs_inode_mark_dirty(ctx->ntfs_ino);
+	ntfs_attr_put_search_ctx(ctx);
+	ntfs_index_changed(icx, (INDEX_ENTRY*)NULL, 0);
+	for (i=0; i<count; i++)
+		ntfs_index_changed(icx, ies[i], 1);
+	ret = 0;
+put_context:
+	ntfs_index_ctx_put(icx);
+free_entries:
+	for (i=0; i<built; i++)
+		free(ies[i]);
+	free(ies);
+	free(vcns);
+	if (ret)
+		errno = err;
+	return ret;
+}
+
 static int ntfs_ih_takeout(ntfs_index_context *icx, INDEX_HEADER *ih,
 			   INDEX_ENTRY *ie, INDEX_BLOCK *ib)
 {
@@ -1574,6 +3045,8 @@ static int ntfs_ih_takeout(ntfs_index_context *icx, INDEX_HEADER *ih,
 	if (!ie_roam)
 		return STATUS_ERROR;
 
+		/* the entry is inserted again below */
+	ntfs_index_changed(icx, ie, -1);
 	ntfs_ie_delete(ih, ie);
 
 	if (ntfs_icx_parent_vcn(icx) == VCN_INDEX_ROOT_PARENT) {
@@ -1820,11 +3293,12 @@ int ntfs_index_rm(ntfs_index_context *icx)
 
 	ntfs_log_trace("Entering\n");
 	
-	if (!icx || (icx->is_in_root && !icx->ib) || (!icx->is_in_root && !icx->ir) || ntfs_ie_end(icx->entry)) {
+	if (!icx || (icx->is_in_root && !icx->ir) || (!icx->is_in_root && !icx->ib) || ntfs_ie_end(icx->entry)) {
 		ntfs_log_error("Invalid arguments.\n");
 		errno = EINVAL;
 		goto err_out;
 	}
+	ntfs_index_changed(icx, icx->entry, -1);
 	if (icx->is_in_root)
 		ih = &icx->ir->index;
 	else
@@ -1852,13 +3326,21 @@ int ntfs_index_rm(ntfs_index_context *icx)
 out:
 	return ret;
 err_out:
+		/* the entry may have been removed or not */
+	if (icx && icx->ni)
+		clear_nino_flag(icx->ni, KnownNlink);
 	ret = STATUS_ERROR;
 	goto out;
 }
 
-int ntfs_index_remove(ntfs_inode *dir_ni,
-		ntfs_inode *ni __attribute__((unused)),
-		const void *key, const int keylen)
+/*
+ *		Remove the entry of a filename from a directory index
+ *	When @mref is not zero, the entry found must be the one of
+ *	this inode.
+ */
+
+static int ntfs_index_remove_key(ntfs_inode *dir_ni,
+		const void *key, const int keylen, MFT_REF mref)
 {
 	int ret = STATUS_ERROR;
 	ntfs_index_context *icx;
@@ -1872,6 +3354,10 @@ int ntfs_index_remove(ntfs_inode *dir_ni,
 		if (ntfs_index_lookup(key, keylen, icx))
 			goto err_out;
 
+		if (mref && (le64_to_cpu(icx->entry->indexed_file) != mref)) {
+			errno = EIO;
+			goto err_out;
+		}
 		ret = ntfs_index_rm(icx);
 		if (ret == STATUS_ERROR)
 			goto err_out;
@@ -1892,6 +3378,506 @@ err_out:
 	goto out;
 }
 
+int ntfs_index_remove(ntfs_inode *dir_ni,
+		ntfs_inode *ni __attribute__((unused)),
+		const void *key, const int keylen)
+{
+	return (ntfs_index_remove_key(dir_ni, key, keylen, (MFT_REF)0));
+}
+
+/*
+ *		Lazy removal of directory entries
+ *
+ *	When set up by ntfs_set_index_lazy_delete(), the entries of the
+ *	deleted files are not removed from the directory indexes right
+ *	away, they are recorded in a table of the volume, and skipped
+ *	when looking up names or listing directories. The removals
+ *	recorded for a directory are applied :
+ *	- before an entry is inserted into it, and when checking whether
+ *	  it is empty before deleting it,
+ *	- when the table is full,
+ *	- on request by ntfs_index_lazy_flush(), for the directories
+ *	  which have not been updated for INDEX_LAZY_DELAY seconds, or
+ *	  for all of them (fsync, unmount).
+ *	When all the entries of a directory have been recorded, which is
+ *	what happens when a tree is deleted, the index is emptied at
+ *	once, instead of being reshaped for each entry removed, otherwise
+ *	the entries are removed one by one.
+ *
+ *	The table is only updated by the requests which update the
+ *	volume, though it is checked by the other ones, and it is only
+ *	used on case sensitive volumes, on which a name looked up cannot
+ *	match another entry than the removed one.
+ */
+
+struct LAZY_REMOVAL {
+	struct LAZY_REMOVAL *next;	/* next removal in same directory */
+	struct LAZY_REMOVAL *hnext;	/* next removal with same hash */
+	u64 dir;			/* directory, with sequence number */
+	u64 mref;			/* inode of the entry removed */
+	u8 name_len;
+	ntfschar name[0];
+} ;
+
+struct LAZY_DIRECTORY {
+	struct LAZY_DIRECTORY *next;
+	struct LAZY_REMOVAL *first;
+	u64 mref;			/* directory, with sequence number */
+	int count;			/* number of removals */
+	time_t updated;			/* when the last removal was recorded */
+} ;
+
+struct INDEX_LAZY {
+	struct LAZY_DIRECTORY *dirs;
+	int count;			/* number of removals */
+	int max_count;			/* max number of removals */
+	int hash_mask;
+	struct LAZY_REMOVAL *first_hash[0];
+} ;
+
+static u64 lazy_mref(ntfs_inode *ni)
+{
+	return (MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number)));
+}
+
+static int lazy_hash(const struct INDEX_LAZY *lz, u64 dir, u64 mref)
+{
+	return ((MREF(dir)*31 + MREF(mref)) & lz->hash_mask);
+}
+
+static struct LAZY_DIRECTORY **lazy_find_dir(struct INDEX_LAZY *lz, u64 dir)
+{
+	struct LAZY_DIRECTORY **pdir;
+
+	pdir = &lz->dirs;
+	while (*pdir && ((*pdir)->mref != dir))
+		pdir = &(*pdir)->next;
+	return (pdir);
+}
+
+/*
+ *		Forget about the removals of a directory
+ */
+
+static void lazy_drop_dir(struct INDEX_LAZY *lz, struct LAZY_DIRECTORY *dir)
+{
+	struct LAZY_REMOVAL **prm;
+	struct LAZY_REMOVAL *rm;
+
+	*lazy_find_dir(lz, dir->mref) = dir->next;
+	while (dir->first) {
+		rm = dir->first;
+		prm = &lz->first_hash[lazy_hash(lz, rm->dir, rm->mref)];
+		while (*prm != rm)
+			prm = &(*prm)->hnext;
+		*prm = rm->hnext;
+		dir->first = rm->next;
+		free(rm);
+	}
+	lz->count -= dir->count;
+	free(dir);
+}
+
+/**
+ * ntfs_index_lazy_pending - check whether a directory entry is removed
+ * @dir_ni:	directory
+ * @ie:		entry of the directory index
+ *
+ * Returns TRUE if the removal of the entry has been recorded, but
+ * not applied to the index yet.
+ */
+BOOL ntfs_index_lazy_pending(ntfs_inode *dir_ni, const INDEX_ENTRY *ie)
+{
+	struct INDEX_LAZY *lz;
+	struct LAZY_REMOVAL *rm;
+	const FILE_NAME_ATTR *fn;
+	u64 dir;
+	u64 mref;
+
+	lz = dir_ni->vol->index_lazy;
+	if (!lz || !lz->count)
+		return (FALSE);
+	if (dir_ni->nr_extents == -1)
+		dir_ni = dir_ni->base_ni;
+	dir = lazy_mref(dir_ni);
+	mref = le64_to_cpu(ie->indexed_file);
+	fn = &ie->key.file_name;
+	for (rm=lz->first_hash[lazy_hash(lz, dir, mref)]; rm; rm=rm->hnext)
+		if ((rm->mref == mref)
+		    && (rm->dir == dir)
+		    && (rm->name_len == fn->file_name_length)
+		    && !memcmp(rm->name, fn->file_name,
+				rm->name_len*sizeof(ntfschar)))
+			return (TRUE);
+	return (FALSE);
+}
+
+/**
+ * ntfs_index_lazy_remove - remove a filename from a directory index,
+ *			possibly later
+ * @dir_ni:	directory
+ * @ni:		inode which @fn describes
+ * @fn:		FILE_NAME attribute to remove
+ * @keylen:	size of @fn
+ *
+ * The removal is recorded if the volume has been set up for lazy
+ * removals and the table is not full even after applying the
+ * removals recorded for the directory, otherwise the entry is
+ * removed by ntfs_index_remove().
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_lazy_remove(ntfs_inode *dir_ni, ntfs_inode *ni,
+		FILE_NAME_ATTR *fn, const int keylen)
+{
+	struct INDEX_LAZY *lz;
+	struct LAZY_DIRECTORY **pdir;
+	struct LAZY_DIRECTORY *dir;
+	struct LAZY_REMOVAL **prm;
+	struct LAZY_REMOVAL *rm;
+	ntfs_index_context icx;
+	INDEX_ENTRY *ie;
+	u64 mref;
+
+	lz = dir_ni->vol->index_lazy;
+	if (!lz || !NVolCaseSensitive(dir_ni->vol))
+		return (ntfs_index_remove(dir_ni, ni, fn, keylen));
+	if (dir_ni->nr_extents == -1)
+		dir_ni = dir_ni->base_ni;
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+	if ((lz->count >= lz->max_count) && ntfs_index_lazy_apply(dir_ni))
+		return (-1);
+	mref = lazy_mref(ni);
+	ie = (INDEX_ENTRY*)NULL;
+	rm = (struct LAZY_REMOVAL*)NULL;
+	pdir = lazy_find_dir(lz, lazy_mref(dir_ni));
+	dir = *pdir;
+	if (!dir && (lz->count < lz->max_count)) {
+		dir = (struct LAZY_DIRECTORY*)ntfs_calloc(
+				sizeof(struct LAZY_DIRECTORY));
+		if (dir) {
+			dir->mref = lazy_mref(dir_ni);
+			*pdir = dir;
+		}
+	}
+	if (dir && (lz->count < lz->max_count)) {
+		ie = ntfs_ie_build_filename(fn, mref);
+		rm = (struct LAZY_REMOVAL*)ntfs_malloc(
+				sizeof(struct LAZY_REMOVAL)
+				+ fn->file_name_length*sizeof(ntfschar));
+	}
+	if (!ie || !rm) {
+		free(ie);
+		free(rm);
+		if (dir && !dir->count)
+			lazy_drop_dir(lz, dir);
+		return (ntfs_index_remove(dir_ni, ni, fn, keylen));
+	}
+	rm->dir = dir->mref;
+	rm->mref = mref;
+	rm->name_len = fn->file_name_length;
+	memcpy(rm->name, fn->file_name, rm->name_len*sizeof(ntfschar));
+	rm->next = dir->first;
+	dir->first = rm;
+	prm = &lz->first_hash[lazy_hash(lz, rm->dir, mref)];
+	rm->hnext = *prm;
+	*prm = rm;
+	dir->count++;
+	dir->updated = time((time_t*)NULL);
+	lz->count++;
+		/* the entry is the same for listings and link counts */
+	icx = (ntfs_index_context) {
+		.ni = dir_ni,
+		.name = NTFS_INDEX_I30,
+		.name_len = 4,
+	};
+	ntfs_index_changed(&icx, ie, -1);
+	free(ie);
+	return (0);
+}
+
+/*
+ *		Empty an index at once
+ *
+ *	The index root is made a leaf with no entry, and the index blocks
+ *	are marked unused, but they are kept allocated, as when the last
+ *	block is removed.
+ */
+
+static int ntfs_ir_empty(ntfs_index_context *icx)
+{
+	ntfs_attr_search_ctx *ctx;
+	ntfs_attr *na;
+	INDEX_ROOT *ir;
+	INDEX_ENTRY *ie;
+	u8 *zeroes;
+	s64 size;
+	int length;
+	int ret;
+
+	ret = STATUS_ERROR;
+	ir = ntfs_ir_lookup(icx->ni, icx->name, icx->name_len, &ctx);
+	if (!ir)
+		return STATUS_ERROR;
+	ie = ntfs_ie_get_first(&ir->index);
+	ie->indexed_file = const_cpu_to_le64(0);
+	ie->length = const_cpu_to_le16(sizeof(INDEX_ENTRY_HEADER));
+	ie->key_length = const_cpu_to_le16(0);
+	ie->ie_flags = INDEX_ENTRY_END;
+	length = le32_to_cpu(ir->index.entries_offset)
+			+ sizeof(INDEX_ENTRY_HEADER);
+	ir->index.index_length = cpu_to_le32(length);
+	ir->index.ih_flags &= ~LARGE_INDEX;
+	ntfs_inode_mark_dirty(ctx->ntfs_ino);
+	ntfs_attr_put_search_ctx(ctx);
+	/* Not fatal error */
+	ntfs_ir_truncate(icx, length);
+	ntfs_index_writeback_forget(icx->ni);
+	na = ntfs_attr_open(icx->ni, AT_BITMAP, icx->name, icx->name_len);
+	if (na) {
+		size = na->data_size;
+		zeroes = (u8*)ntfs_calloc(size);
+		if (zeroes) {
+			if (ntfs_attr_pwrite(na, 0, size, zeroes) == size)
+				ret = STATUS_OK;
+			free(zeroes);
+		}
+		ntfs_attr_close(na);
+	}
+	if (ret)
+		ntfs_log_perror("Failed to clear the index bitmap of inode "
+				"%llu", (unsigned long long)icx->ni->mft_no);
+	ntfs_index_changed(icx, (INDEX_ENTRY*)NULL, 0);
+	return (ret);
+}
+
+/*
+ *		Empty a directory index if all its entries are removed
+ *
+ *	The index is walked from its first entry, and it is only emptied
+ *	if all the removals recorded have been met and no other entry.
+ *	A small index is left to the removals one by one.
+ *
+ *	Returns 1 if the index has been emptied,
+ *		0 if the entries have to be removed one by one,
+ *		-1 if the index could not be emptied
+ */
+
+static int lazy_empty_index(ntfs_inode *dir_ni, struct LAZY_DIRECTORY *dir)
+{
+	ntfs_index_context *icx;
+	INDEX_ENTRY *entry;
+	FILE_NAME_ATTR_BASE first;
+	int olderrno;
+	int count;
+	int ret;
+
+	ret = 0;
+	icx = ntfs_index_ctx_get(dir_ni, NTFS_INDEX_I30, 4);
+	if (!icx)
+		return (-1);
+		/* an empty name collates before all the entries */
+	memset(&first, 0, sizeof(first));
+	olderrno = errno;
+	if (!ntfs_index_lookup(&first, sizeof(first), icx)
+	    || (errno != ENOENT)
+	    || !(icx->ir->index.ih_flags & LARGE_INDEX)) {
+		errno = olderrno;
+		ntfs_index_ctx_put(icx);
+		return (0);
+	}
+	errno = olderrno;
+	count = 0;
+	entry = icx->entry;
+	if (entry->ie_flags & INDEX_ENTRY_END)
+		entry = ntfs_index_next(entry, icx);
+	while (entry && ntfs_index_lazy_pending(dir_ni, entry)) {
+		count++;
+		entry = ntfs_index_next(entry, icx);
+	}
+		/* a failed walk does not meet all the removals */
+	if (!entry && (count == dir->count)) {
+		ntfs_index_ctx_reinit(icx);
+		ret = (ntfs_ir_empty(icx) ? -1 : 1);
+	}
+	ntfs_index_ctx_put(icx);
+	return (ret);
+}
+
+/**
+ * ntfs_index_lazy_apply - apply the removals recorded for a directory
+ * @dir_ni:	directory
+ *
+ * This has to be done before inserting an entry into the directory,
+ * and before checking whether it is empty.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_lazy_apply(ntfs_inode *dir_ni)
+{
+	struct INDEX_LAZY *lz;
+	struct LAZY_DIRECTORY *dir;
+	struct LAZY_REMOVAL *rm;
+	struct {
+		FILE_NAME_ATTR_BASE attr;
+		ntfschar file_name[NTFS_MAX_NAME_LEN];
+	} key;
+	BOOL known;
+	int nlink;
+	int err;
+	int res;
+
+	lz = dir_ni->vol->index_lazy;
+	if (!lz || !lz->count)
+		return (0);
+	if (dir_ni->nr_extents == -1)
+		dir_ni = dir_ni->base_ni;
+	dir = *lazy_find_dir(lz, lazy_mref(dir_ni));
+	if (!dir)
+		return (0);
+	err = 0;
+		/* the link count was updated when recording */
+	known = test_nino_flag(dir_ni, KnownNlink);
+	nlink = dir_ni->dir_nlink;
+	res = lazy_empty_index(dir_ni, dir);
+	if (res < 0)
+		err = errno;
+	if (!res) {
+		memset(&key.attr, 0, sizeof(key.attr));
+		for (rm=dir->first; rm; rm=rm->next) {
+			key.attr.file_name_length = rm->name_len;
+			memcpy(key.file_name, rm->name,
+					rm->name_len*sizeof(ntfschar));
+			if (ntfs_index_remove_key(dir_ni, &key,
+					sizeof(key.attr)
+					+ rm->name_len*sizeof(ntfschar),
+					rm->mref)) {
+				ntfs_log_error("Failed to remove an entry "
+					"of inode %lld from directory %lld\n",
+					(long long)MREF(rm->mref),
+					(long long)dir_ni->mft_no);
+				if (!err)
+					err = errno;
+				res = -1;
+			}
+		}
+	}
+	if (known && test_nino_flag(dir_ni, KnownNlink))
+		dir_ni->dir_nlink = nlink;
+	lazy_drop_dir(lz, dir);
+	ntfs_inode_mark_dirty(dir_ni);
+	if (res < 0) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * ntfs_index_lazy_flush - apply the removals recorded
+ * @vol:	volume
+ * @all:	TRUE if all the removals have to be applied, FALSE if only
+ *		those of the directories not updated for some time
+ *
+ * The directories are opened, so this must not be called while an
+ * inode is open.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_lazy_flush(ntfs_volume *vol, BOOL all)
+{
+	struct INDEX_LAZY *lz;
+	struct LAZY_DIRECTORY **pdir;
+	struct LAZY_DIRECTORY *dir;
+	ntfs_inode *ni;
+	time_t now;
+	int err;
+	int res;
+
+	res = 0;
+	err = 0;
+	lz = vol->index_lazy;
+	if (lz) {
+		now = time((time_t*)NULL);
+		pdir = &lz->dirs;
+		while (*pdir) {
+			dir = *pdir;
+			if (!all && ((now - dir->updated) < INDEX_LAZY_DELAY)) {
+				pdir = &dir->next;
+				continue;
+			}
+			ni = ntfs_inode_open(vol, dir->mref);
+			if (!ni || ntfs_index_lazy_apply(ni)) {
+				if (!err)
+					err = errno;
+				res = -1;
+			}
+			if (ni && ntfs_inode_close(ni)) {
+				if (!err)
+					err = errno;
+				res = -1;
+			}
+				/* the entries are lost, forget about them */
+			if (*pdir == dir) {
+				ntfs_log_error("Could not remove the entries "
+					"of directory %lld\n",
+					(long long)MREF(dir->mref));
+				lazy_drop_dir(lz, dir);
+			}
+		}
+	}
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/*
+ *		Set up the lazy removal of directory entries
+ *	Not set in ntfs_mount(), the removals recorded are limited
+ *	to @count, a zero count applies the removals and stops
+ *	recording them.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_index_lazy_delete(ntfs_volume *vol, int count)
+{
+	struct INDEX_LAZY *lz;
+	int hash_size;
+	int res;
+
+	res = -1;
+	if (!vol || (count < 0))
+		errno = EINVAL;
+	else {
+		res = ntfs_index_lazy_flush(vol, TRUE);
+		lz = vol->index_lazy;
+		if (lz) {
+			while (lz->dirs)
+				lazy_drop_dir(lz, lz->dirs);
+			free(lz);
+			vol->index_lazy = (struct INDEX_LAZY*)NULL;
+		}
+		if (count) {
+			hash_size = INDEX_LAZY_MIN_HASH;
+			while ((hash_size < count/4)
+			    && (hash_size < INDEX_LAZY_MAX_HASH))
+				hash_size <<= 1;
+			lz = (struct INDEX_LAZY*)ntfs_calloc(
+				sizeof(struct INDEX_LAZY)
+				+ hash_size*sizeof(struct LAZY_REMOVAL*));
+			if (lz) {
+				lz->max_count = count;
+				lz->hash_mask = hash_size - 1;
+				vol->index_lazy = lz;
+			} else
+				res = -1;
+		}
+	}
+	return (res);
+}
+
 /**
  * ntfs_index_root_get - read the index root of an attribute
  * @ni:		open ntfs inode in which the ntfs attribute resides
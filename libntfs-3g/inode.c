@@ -33,6 +33,9 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -55,6 +58,7 @@
 #include "logging.h"
 #include "misc.h"
 #include "xattrs.h"
+#include "probes.h"
 
 ntfs_inode *ntfs_inode_base(ntfs_inode *ni)
 {
@@ -80,6 +84,166 @@ void ntfs_inode_mark_dirty(ntfs_inode *ni)
 		NInoSetDirty(ni->base_ni);
 }
 
+/*
+ *		Set an inode dirty (as NInoSetDirty())
+ *
+ *	Any update of an inode sets it dirty, which makes its cached
+ *	stat obsolete.
+ */
+
+void ntfs_inode_set_dirty(ntfs_inode *ni)
+{
+	set_nino_flag(ni, Dirty);
+	ntfs_inode_forget_stat(ni);
+}
+
+#if CACHE_STAT_SIZE
+
+/*
+ *		Cache of stats
+ *
+ *	The front ends assemble a stat from the reparse data, the
+ *	security descriptor, the link count and sometimes the WSL
+ *	extended attributes or the Interix data, so the stats of the
+ *	inodes recently queried are kept as computed. They are forgotten
+ *	when the inode is set dirty, which includes its deletion and the
+ *	reuse of its record, and when the index of a directory is updated.
+ *	As a junction or symlink is displayed with the length of its
+ *	resolved target, the stats of reparse points are also obsoleted
+ *	by any directory update, as the cached targets are.
+ *
+ *	A stat is only entered if no inode was updated while it was
+ *	computed, so that a concurrent update is never hidden.
+ */
+
+static int stat_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	return (((const struct CACHED_STAT*)cached)->inum
+			!= ((const struct CACHED_STAT*)wanted)->inum);
+}
+
+#endif /* CACHE_STAT_SIZE */
+
+/*
+ *		Stat hashing
+ */
+
+int ntfs_inode_stat_hash(const struct CACHED_GENERIC *cached)
+{
+	return ((int)(((const struct CACHED_STAT*)cached)->inum & INT_MAX));
+}
+
+/*
+ *		Forget the stat of an inode
+ */
+
+void ntfs_inode_forget_stat(ntfs_inode *ni)
+{
+#if CACHE_STAT_SIZE
+	struct CACHED_STAT item;
+	ntfs_volume *vol;
+
+	vol = ni->vol;
+	vol->stat_changes++;
+	if (vol->stat_cache) {
+		item.inum = ntfs_inode_base(ni)->mft_no;
+		ntfs_invalidate_cache(vol->stat_cache,
+				GENERIC(&item), stat_cache_compare, 0);
+	}
+#endif /* CACHE_STAT_SIZE */
+}
+
+/*
+ *		Get the cached stat of an inode
+ *
+ *	The inode does not have to be opened. When the stat is not
+ *	cached, the count of invalidations to be passed to
+ *	ntfs_inode_enter_stat() is returned through @pchanges, it has
+ *	to be got before computing the stat.
+ *
+ *	Returns TRUE if the stat was found
+ */
+
+BOOL ntfs_inode_fetch_stat(ntfs_volume *vol, u64 inum,
+			struct stat *stbuf, u32 *pchanges)
+{
+	BOOL found;
+#if CACHE_STAT_SIZE
+	struct CACHED_STAT item;
+	struct CACHED_STAT cached;
+#endif /* CACHE_STAT_SIZE */
+
+	found = FALSE;
+#if CACHE_STAT_SIZE
+	*pchanges = vol->stat_changes;
+	if (vol->stat_cache) {
+		item.inum = MREF(inum);
+		if (ntfs_fetch_cache_copy(vol->stat_cache, GENERIC(&item),
+				stat_cache_compare,
+				(struct CACHED_GENERIC*)&cached)) {
+			if (!cached.reparse
+			    || (cached.changes == vol->listing_changes)) {
+				memcpy(stbuf, &cached.stbuf,
+						sizeof(struct stat));
+				found = TRUE;
+			} else
+				ntfs_invalidate_cache(vol->stat_cache,
+					GENERIC(&item), stat_cache_compare, 0);
+		}
+	}
+#else
+	*pchanges = 0;
+#endif /* CACHE_STAT_SIZE */
+	return (found);
+}
+
+/*
+ *		Keep the stat computed for an inode
+ *
+ *	@changes is the count returned by ntfs_inode_fetch_stat() before
+ *	the stat was computed, the stat is not kept if it has changed.
+ */
+
+void ntfs_inode_enter_stat(ntfs_inode *ni, const struct stat *stbuf,
+			u32 changes)
+{
+#if CACHE_STAT_SIZE
+	struct CACHED_STAT item;
+	ntfs_volume *vol;
+
+	vol = ni->vol;
+	if (vol->stat_cache && (changes == vol->stat_changes)) {
+		item.unused = (void*)NULL;
+		item.unusedsize = 0;
+		item.inum = ni->mft_no;
+		item.reparse = (ni->flags & FILE_ATTR_REPARSE_POINT) != 0;
+		item.changes = vol->listing_changes;
+		memcpy(&item.stbuf, stbuf, sizeof(struct stat));
+		ntfs_enter_cache(vol->stat_cache, GENERIC(&item),
+				stat_cache_compare);
+	}
+#endif /* CACHE_STAT_SIZE */
+}
+
+/*
+ *		Allocation of inodes
+ *
+ *	The buffer for the mft record of an inode is allocated along with
+ *	the inode, and the inodes released are kept with their buffer for
+ *	being reused, up to SPARE_INODES per volume, chained through their
+ *	base_ni. Opening an inode thus usually needs no allocation.
+ *	A record buffer set by the caller, such as for a new record, is
+ *	still freed when the inode is released.
+ */
+
+#define INODE_ALLOC_SIZE ((sizeof(ntfs_inode) + 7) & ~(size_t)7)
+
+static MFT_RECORD *inode_record_buffer(ntfs_inode *ni)
+{
+	return ((MFT_RECORD*)((char*)ni + INODE_ALLOC_SIZE));
+}
+
 /**
  * __ntfs_inode_allocate - Create and initialise an NTFS inode object
  * @vol:
@@ -92,7 +256,14 @@ static ntfs_inode *__ntfs_inode_allocate(ntfs_volume *vol)
 {
 	ntfs_inode *ni;
 
-	ni = (ntfs_inode*)ntfs_calloc(sizeof(ntfs_inode));
+	ni = vol->spare_inodes;
+	if (ni) {
+		vol->spare_inodes = ni->base_ni;
+		vol->spare_inode_count--;
+		memset(ni, 0, sizeof(ntfs_inode));
+	} else
+		ni = (ntfs_inode*)ntfs_calloc(INODE_ALLOC_SIZE
+					+ vol->mft_record_size);
 	if (ni)
 		ni->vol = vol;
 	return ni;
@@ -111,6 +282,10 @@ ntfs_inode *ntfs_inode_allocate(ntfs_volume *vol)
 	return __ntfs_inode_allocate(vol);
 }
 
+#if CACHE_NIDATA_SIZE
+static void delayed_forget(ntfs_inode *ni);
+#endif
+
 /**
  * __ntfs_inode_release - Destroy an NTFS inode object
  * @ni:
@@ -121,16 +296,50 @@ ntfs_inode *ntfs_inode_allocate(ntfs_volume *vol)
  */
 static void __ntfs_inode_release(ntfs_inode *ni)
 {
+	ntfs_volume *vol;
+
+#if CACHE_NIDATA_SIZE
+	if (NInoDelayed(ni))
+		delayed_forget(ni);
+#endif
 	if (NInoDirty(ni))
 		ntfs_log_error("Releasing dirty inode %lld!\n", 
 			       (long long)ni->mft_no);
 	if (NInoAttrList(ni) && ni->attr_list)
 		free(ni->attr_list);
-	free(ni->mrec);
-	free(ni);
+	ntfs_attrlist_index_free(ni);
+	free(ni->attr_offsets);
+	free(ni->readdir_cursor);
+	if (ni->mrec != inode_record_buffer(ni))
+		free(ni->mrec);
+	vol = ni->vol;
+	if (vol->spare_inode_count < SPARE_INODES) {
+		ni->base_ni = vol->spare_inodes;
+		vol->spare_inodes = ni;
+		vol->spare_inode_count++;
+	} else
+		free(ni);
 	return;
 }
 
+/*
+ *		Free the inodes kept for reuse
+ *
+ *	To be called when unmounting, after all the inodes are released.
+ */
+
+void ntfs_free_spare_inodes(ntfs_volume *vol)
+{
+	ntfs_inode *ni;
+
+	while (vol->spare_inodes) {
+		ni = vol->spare_inodes;
+		vol->spare_inodes = ni->base_ni;
+		free(ni);
+	}
+	vol->spare_inode_count = 0;
+}
+
 /**
  * ntfs_inode_open - open an inode ready for access
  * @vol:	volume to get the inode from
@@ -171,6 +380,7 @@ static ntfs_inode *ntfs_inode_real_open(ntfs_volume *vol, const MFT_REF mref)
 	ni = __ntfs_inode_allocate(vol);
 	if (!ni)
 		goto out;
+	ni->mrec = inode_record_buffer(ni);
 	if (ntfs_file_record_read(vol, mref, &ni->mrec, NULL))
 		goto err_out;
 	if (!(ni->mrec->flags & MFT_RECORD_IN_USE)) {
@@ -413,8 +623,7 @@ void ntfs_inode_nidata_free(const struct CACHED_GENERIC *cached)
 
 int ntfs_inode_nidata_hash(const struct CACHED_GENERIC *item)
 {
-	return (((const struct CACHED_NIDATA*)item)->inum
-			% (2*CACHE_NIDATA_SIZE));
+	return (((const struct CACHED_NIDATA*)item)->inum & INT_MAX);
 }
 
 /*
@@ -446,7 +655,344 @@ void ntfs_inode_invalidate(ntfs_volume *vol, const MFT_REF mref)
 				GENERIC(&item),idata_cache_compare,CACHE_FREE);
 }
 
+
+/*
+ *		Delayed writing of inodes
+ *
+ *	When set up by ntfs_set_inode_writeback(), the modified inodes
+ *	are not synced when closed, they are kept in a table of the
+ *	volume, and handed over again by ntfs_inode_open(), so that the
+ *	updates made by successive requests are only written once :
+ *	- when the table is full, the inode being closed is synced,
+ *	- on request by ntfs_inode_writeback_flush(), for all inodes or
+ *	  for those dirty for INODE_WRITEBACK_DELAY seconds, which has
+ *	  to be called when no inode is open (fsync, end of a request,
+ *	  unmount). They are then written in mft order.
+ *
+ *	An inode handed over is marked busy until it is closed. If it is
+ *	opened again meanwhile by a concurrent reader, it is synced first,
+ *	so that the copy read from the device is up to date.
+ *	The callers are expected to serialize their accesses to the library.
+ */
+
+struct DELAYED_INODE {
+	struct DELAYED_INODE *next;		/* next more recent inode */
+	struct DELAYED_INODE *previous;		/* next older inode */
+	struct DELAYED_INODE *hnext;		/* next inode with same hash */
+	ntfs_inode *ni;
+	time_t dirtied;				/* when first delayed */
+	BOOL busy;				/* handed over, not closed */
+} ;
+
+struct INODE_WRITEBACK {
+	struct DELAYED_INODE *oldest;
+	struct DELAYED_INODE *newest;
+	int count;			/* number of delayed inodes */
+	int max_count;			/* max number of delayed inodes */
+	struct DELAYED_INODE *first_hash[INODE_WRITEBACK_HASH];
+} ;
+
+/*
+ *		Locate a delayed inode
+ *
+ *	Returns the address of the link to the inode in its hash chain,
+ *		the link is NULL if the inode is not delayed.
+ */
+
+static struct DELAYED_INODE **delayed_find(struct INODE_WRITEBACK *wb,
+			u64 inum)
+{
+	struct DELAYED_INODE **link;
+
+	link = &wb->first_hash[inum & (INODE_WRITEBACK_HASH - 1)];
+	while (*link && ((*link)->ni->mft_no != inum))
+		link = &(*link)->hnext;
+	return (link);
+}
+
+static int delayed_insert(struct INODE_WRITEBACK *wb, ntfs_inode *ni)
+{
+	struct DELAYED_INODE *delayed;
+	struct DELAYED_INODE **link;
+
+	delayed = (struct DELAYED_INODE*)ntfs_malloc(
+				sizeof(struct DELAYED_INODE));
+	if (!delayed)
+		return (-1);
+	link = &wb->first_hash[ni->mft_no & (INODE_WRITEBACK_HASH - 1)];
+	delayed->hnext = *link;
+	*link = delayed;
+	delayed->ni = ni;
+	delayed->dirtied = time((time_t*)NULL);
+	delayed->busy = FALSE;
+	delayed->next = (struct DELAYED_INODE*)NULL;
+	delayed->previous = wb->newest;
+	if (wb->newest)
+		wb->newest->next = delayed;
+	else
+		wb->oldest = delayed;
+	wb->newest = delayed;
+	wb->count++;
+	NInoSetDelayed(ni);
+	return (0);
+}
+
+static void delayed_drop(struct INODE_WRITEBACK *wb,
+			struct DELAYED_INODE **link)
+{
+	struct DELAYED_INODE *delayed;
+
+	delayed = *link;
+	*link = delayed->hnext;
+	if (delayed->next)
+		delayed->next->previous = delayed->previous;
+	else
+		wb->newest = delayed->previous;
+	if (delayed->previous)
+		delayed->previous->next = delayed->next;
+	else
+		wb->oldest = delayed->next;
+	wb->count--;
+	NInoClearDelayed(delayed->ni);
+	free(delayed);
+}
+
+/*
+ *		Forget about an inode being released
+ */
+
+static void delayed_forget(ntfs_inode *ni)
+{
+	struct INODE_WRITEBACK *wb;
+	struct DELAYED_INODE **link;
+
+	wb = ni->vol->inode_writeback;
+	if (wb) {
+		link = delayed_find(wb, ni->mft_no);
+		if (*link && ((*link)->ni == ni))
+			delayed_drop(wb, link);
+	}
+	NInoClearDelayed(ni);
+}
+
+/*
+ *		Hand over a delayed inode to ntfs_inode_open()
+ *
+ *	Returns the inode, or NULL if it is not delayed
+ */
+
+static ntfs_inode *delayed_open(struct INODE_WRITEBACK *wb, u64 inum)
+{
+	struct DELAYED_INODE *delayed;
+	ntfs_inode *ni;
+
+	ni = (ntfs_inode*)NULL;
+	delayed = *delayed_find(wb, inum);
+	if (delayed) {
+		if (delayed->busy) {
+			/* a concurrent reader has it, make the device current */
+			if (ntfs_inode_sync(delayed->ni))
+				ntfs_log_perror("Failed to sync delayed inode %lld",
+						(long long)inum);
+		} else {
+			delayed->busy = TRUE;
+			ni = delayed->ni;
+		}
+	}
+	return (ni);
+}
+
+/*
+ *		Take an inode being closed
+ *
+ *	Returns TRUE if the inode is kept delayed, FALSE if it has to be
+ *		closed as usual, having been synced if there was another
+ *		copy of it delayed.
+ */
+
+static BOOL delayed_close(struct INODE_WRITEBACK *wb, ntfs_inode *ni,
+			BOOL dirty)
+{
+	struct DELAYED_INODE **link;
+	BOOL kept;
+
+	kept = FALSE;
+	link = delayed_find(wb, ni->mft_no);
+	if (*link) {
+		if ((*link)->ni == ni) {
+			if (dirty) {
+				(*link)->busy = FALSE;
+				kept = TRUE;
+			} else
+				delayed_drop(wb, link);
+		}
+	} else
+		if (dirty
+		    && (wb->count < wb->max_count)
+		    && !delayed_insert(wb, ni)) {
+			/* a copy left over by a concurrent reader is stale */
+			ntfs_inode_invalidate(ni->vol, ni->mft_no);
+			kept = TRUE;
+		}
+	return (kept);
+}
+
+static int delayed_compare(const void *p1, const void *p2)
+{
+	u64 inum1 = *(const u64*)p1;
+	u64 inum2 = *(const u64*)p2;
+
+	return ((inum1 > inum2) - (inum1 < inum2));
+}
+
+/**
+ * ntfs_inode_writeback_flush - write the delayed inodes
+ * @vol:	volume
+ * @all:	TRUE if all inodes have to be written, FALSE if only the
+ *		ones which have been dirty for too long
+ *
+ * The inodes are written in mft order, and then kept in the inode
+ * cache. Syncing them updates the parent directories, so this must not
+ * be called while an inode is open.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_inode_writeback_flush(ntfs_volume *vol, BOOL all)
+{
+	struct INODE_WRITEBACK *wb;
+	struct DELAYED_INODE *delayed;
+	struct DELAYED_INODE **link;
+	ntfs_inode *ni;
+	u64 *batch;
+	time_t now;
+	int count;
+	int done;
+	int res;
+	int i;
+
+	res = 0;
+	wb = vol->inode_writeback;
+	if (!wb || !wb->oldest)
+		return (0);
+	batch = (u64*)ntfs_malloc(wb->max_count*sizeof(u64));
+	if (!batch)
+		return (-1);
+	do {
+		/* the list is ordered by age, collect the old ones */
+		now = time((time_t*)NULL);
+		count = 0;
+		for (delayed=wb->oldest; delayed
+		    && (all || ((now - delayed->dirtied)
+					>= INODE_WRITEBACK_DELAY));
+		    delayed=delayed->next) {
+			if (!delayed->busy)
+				batch[count++] = delayed->ni->mft_no;
+		}
+		qsort(batch, count, sizeof(u64), delayed_compare);
+		done = 0;
+		for (i=0; (i<count) && !res; i++) {
+			/* a previous sync may have handed it over */
+			link = delayed_find(wb, batch[i]);
+			if (*link && !(*link)->busy) {
+				ni = (*link)->ni;
+				delayed_drop(wb, link);
+				if (ntfs_inode_sync(ni)) {
+					ntfs_log_perror("Failed to write "
+						"delayed inode %lld",
+						(long long)ni->mft_no);
+					/* retry later */
+					delayed_insert(wb, ni);
+					res = -1;
+				} else
+					res = ntfs_inode_close(ni);
+				done++;
+			}
+		}
+		/* the parent directories may have been delayed meanwhile */
+	} while (all && !res && done && wb->oldest);
+	free(batch);
+	return (res);
+}
+
+/*
+ *		Check whether the writing of an inode is delayed
+ *
+ *	The sizes and times recorded in the parent directories of
+ *	a delayed inode may not be up to date.
+ */
+
+BOOL ntfs_inode_writeback_pending(ntfs_volume *vol, u64 inum)
+{
+	return (vol->inode_writeback
+		&& *delayed_find(vol->inode_writeback, inum));
+}
+
+#else
+
+int ntfs_inode_writeback_flush(ntfs_volume *vol __attribute__((unused)),
+			BOOL all __attribute__((unused)))
+{
+	return (0);
+}
+
+BOOL ntfs_inode_writeback_pending(ntfs_volume *vol __attribute__((unused)),
+			u64 inum __attribute__((unused)))
+{
+	return (FALSE);
+}
+
+#endif
+
+/*
+ *		Set up the delayed writing of inodes
+ *	Not set in ntfs_mount(), up to @count inodes are delayed, a zero
+ *	count writes the delayed inodes and stops delaying.
+ *	This needs the inode cache.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_inode_writeback(ntfs_volume *vol, int count)
+{
+	int res;
+
+	res = -1;
+	if (!vol || (count < 0))
+		errno = EINVAL;
+	else {
+		res = ntfs_inode_writeback_flush(vol, TRUE);
+#if CACHE_NIDATA_SIZE
+		if (!count || !vol->nidata_cache) {
+			if (vol->inode_writeback && !vol->inode_writeback->count) {
+				free(vol->inode_writeback);
+				vol->inode_writeback
+					= (struct INODE_WRITEBACK*)NULL;
+			}
+			if (count) {
+				errno = EOPNOTSUPP;
+				res = -1;
+			}
+		} else
+			if (!res) {
+				if (!vol->inode_writeback)
+					vol->inode_writeback =
+						(struct INODE_WRITEBACK*)
+						ntfs_calloc(sizeof(
+						struct INODE_WRITEBACK));
+				if (vol->inode_writeback)
+					vol->inode_writeback->max_count = count;
+				else
+					res = -1;
+			}
+#else
+		if (count) {
+			errno = EOPNOTSUPP;
+			res = -1;
+		}
 #endif
+	}
+	return (res);
+}
 
 #ifdef DEBUG_DOUBLE_INODE
 
@@ -493,36 +1039,40 @@ void debug_double_inode(u64 inum, int add)
 #endif /* DEBUG_DOUBLE_INODE */
 
 /*
- *		Open an inode
- *
- *	When possible, an entry recorded in the cache is reused
- *
- *	**NEVER REOPEN** an inode, this can lead to a duplicated
- * 	cache entry (hard to detect), and to an obsolete one being
- *	reused. System files are however protected from being cached.
+ *		Open an inode, the volume being entered
  */
 
-ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
+static ntfs_inode *inode_open(ntfs_volume *vol, const MFT_REF mref)
 {
 	ntfs_inode *ni;
 #if CACHE_NIDATA_SIZE
 	struct CACHED_NIDATA item;
 	struct CACHED_NIDATA *cached;
+#endif
 
+	NTFS_PROBE1(inode_open_entry, MREF(mref));
+#if CACHE_NIDATA_SIZE
 		/* fetch idata from cache */
 	item.inum = MREF(mref);
 	debug_double_inode(item.inum, 1);
 	item.pathname = (const char*)NULL;
 	item.varsize = 0;
-	cached = (struct CACHED_NIDATA*)ntfs_fetch_cache(vol->nidata_cache,
+		/* a delayed inode is more recent than the device */
+	ni = (vol->inode_writeback
+		? delayed_open(vol->inode_writeback, item.inum)
+		: (ntfs_inode*)NULL);
+	if (!ni) {
+		cached = (struct CACHED_NIDATA*)ntfs_fetch_cache(
+				vol->nidata_cache,
 				GENERIC(&item),idata_cache_compare);
-	if (cached) {
-		ni = cached->ni;
-		/* do not keep open entries in cache */
-		ntfs_remove_cache(vol->nidata_cache,
-				(struct CACHED_GENERIC*)cached,0);
-	} else {
-		ni = ntfs_inode_real_open(vol, mref);
+		if (cached) {
+			ni = cached->ni;
+			/* do not keep open entries in cache */
+			ntfs_remove_cache(vol->nidata_cache,
+					(struct CACHED_GENERIC*)cached,0);
+		} else {
+			ni = ntfs_inode_real_open(vol, mref);
+		}
 	}
 	if (!ni) {
 		debug_double_inode(item.inum, 0);
@@ -530,25 +1080,41 @@ ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
 #else
 	ni = ntfs_inode_real_open(vol, mref);
 #endif
+	NTFS_PROBE2(inode_open_return, MREF(mref), ni);
 	return (ni);
 }
 
 /*
- *		Close an inode entry
+ *		Open an inode
  *
- *	If cacheing is in use, the entry is synced and kept available
- *	in cache for further use.
+ *	When possible, an entry recorded in the cache is reused
  *
- *	System files (inode < 16 or having the IS_4 flag) are protected
- *	against being cached.
+ *	**NEVER REOPEN** an inode, this can lead to a duplicated
+ * 	cache entry (hard to detect), and to an obsolete one being
+ *	reused. System files are however protected from being cached.
  */
 
-int ntfs_inode_close(ntfs_inode *ni)
+ntfs_inode *ntfs_inode_open(ntfs_volume *vol, const MFT_REF mref)
+{
+	ntfs_inode *ni;
+
+	ntfs_volume_enter(vol);
+	ni = inode_open(vol, mref);
+	ntfs_volume_leave(vol);
+	return (ni);
+}
+
+/*
+ *		Close an inode, the volume being entered
+ */
+
+static int inode_close(ntfs_inode *ni)
 {
 	int res;
 #if CACHE_NIDATA_SIZE
 	BOOL dirty;
 	struct CACHED_NIDATA item;
+	struct CACHED_NIDATA *cached;
 
 	if (ni) {
 		debug_double_inode(ni->mft_no, 0);
@@ -559,6 +1125,11 @@ int ntfs_inode_close(ntfs_inode *ni)
 				&& !(ni->mrec->flags & MFT_RECORD_IS_4)))) {
 			/* If we have dirty metadata, write it out. */
 			dirty = NInoDirty(ni) || NInoAttrListDirty(ni);
+				/* unless writing it out can be delayed */
+			if (ni->vol->inode_writeback
+			    && delayed_close(ni->vol->inode_writeback,
+						ni, dirty))
+				return (0);
 			if (dirty) {
 				res = ntfs_inode_sync(ni);
 					/* do a real close if sync failed */
@@ -574,8 +1145,18 @@ int ntfs_inode_close(ntfs_inode *ni)
 				item.pathname = (const char*)NULL;
 				item.varsize = 0;
 				debug_cached_inode(ni);
-				ntfs_enter_cache(ni->vol->nidata_cache,
+				cached = (struct CACHED_NIDATA*)ntfs_enter_cache(
+					ni->vol->nidata_cache,
 					GENERIC(&item), idata_cache_compare);
+				/*
+				 * The inode may have been opened twice by
+				 * concurrent readers, the copy closed last
+				 * matches what has been written.
+				 */
+				if (cached && (cached->ni != ni)) {
+					ntfs_inode_real_close(cached->ni);
+					cached->ni = ni;
+				}
 			}
 		} else {
 			/* cache not ready or system file, really close */
@@ -589,6 +1170,31 @@ int ntfs_inode_close(ntfs_inode *ni)
 	return (res);
 }
 
+/*
+ *		Close an inode entry
+ *
+ *	If cacheing is in use, the entry is synced and kept available
+ *	in cache for further use.
+ *
+ *	System files (inode < 16 or having the IS_4 flag) are protected
+ *	against being cached.
+ */
+
+int ntfs_inode_close(ntfs_inode *ni)
+{
+	ntfs_volume *vol;
+	int res;
+
+	if (ni && ni->vol) {
+		vol = ni->vol;
+		ntfs_volume_enter(vol);
+		res = inode_close(ni);
+		ntfs_volume_leave(vol);
+	} else
+		res = inode_close(ni);
+	return (res);
+}
+
 /**
  * ntfs_extent_inode_open - load an extent inode and attach it to its base
  * @base_ni:	base ntfs inode
@@ -622,6 +1228,7 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	ntfs_volume *vol;
 	ntfs_inode *ni = NULL;
 	ntfs_inode **extent_nis;
+	BOOL mapped;
 	int i;
 
 	if (!base_ni) {
@@ -653,7 +1260,12 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 			    && ((rl->vcn + rl->length) <= extent_vcn))
 				rl++;
 		}
-		if (!rl || (rl->lcn < 0)) {
+		mapped = rl && (rl->lcn >= 0);
+			/* the runlist may only be a window of a compact one */
+		if (!mapped && vol->mft_na->crl)
+			mapped = ntfs_rl_compact_vcn_to_lcn(vol->mft_na->crl,
+					extent_vcn) >= 0;
+		if (!mapped) {
 			ntfs_log_error("MFT is corrupt, cannot read"
 				" its unmapped extent record %lld\n",
 					(long long)mft_no);
@@ -691,6 +1303,7 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const leMFT_REF mref)
 	ni = __ntfs_inode_allocate(base_ni->vol);
 	if (!ni)
 		goto out;
+	ni->mrec = inode_record_buffer(ni);
 	if (ntfs_file_record_read(base_ni->vol, le64_to_cpu(mref), &ni->mrec, NULL))
 		goto err_out;
 	ni->mft_no = mft_no;
@@ -769,6 +1382,65 @@ int ntfs_inode_attach_all_extents(ntfs_inode *ni)
 	return 0;
 }
 
+/**
+ * ntfs_inode_attach_next_extent - attach one more extent to an inode
+ * @ni:		opened ntfs inode
+ * @pos:	position in the attribute list to resume from, initially 0
+ *
+ * Attach the next extent listed in the attribute list from @pos, which
+ * is not attached yet, so that the callers looking for an extent with
+ * some property only read the extent records until one is found.
+ * The position is updated for the next call, the attribute list may
+ * be modified between calls, at worst causing some extents to be
+ * revisited or skipped.
+ *
+ * Return 1 if an extent was attached, 0 if there is none left to attach,
+ * or -1 on error with errno set to the error code.
+ */
+int ntfs_inode_attach_next_extent(ntfs_inode *ni, u32 *pos)
+{
+	ATTR_LIST_ENTRY *ale;
+	u64 mft_no;
+	int i;
+
+	if (!ni || !pos) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ni->nr_extents == -1)
+		ni = ni->base_ni;
+	if (!NInoAttrList(ni))
+		return 0;
+	if (!ni->attr_list) {
+		ntfs_log_trace("Corrupt in-memory struct.\n");
+		errno = EINVAL;
+		return -1;
+	}
+	while ((*pos + offsetof(ATTR_LIST_ENTRY, name)) <= ni->attr_list_size) {
+		ale = (ATTR_LIST_ENTRY *)(ni->attr_list + *pos);
+		if (!ale->length) {
+			errno = EIO;
+			return -1;
+		}
+		*pos += le16_to_cpu(ale->length);
+		mft_no = MREF_LE(ale->mft_reference);
+		if (mft_no != ni->mft_no) {
+			for (i=0; (i<ni->nr_extents)
+				&& (ni->extent_nis[i]->mft_no != mft_no); i++) { }
+			if (i >= ni->nr_extents) {
+				if (!ntfs_extent_inode_open(ni,
+						ale->mft_reference)) {
+					ntfs_log_trace("Couldn't attach extent "
+							"inode.\n");
+					return -1;
+				}
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
 /**
  * ntfs_inode_sync_standard_information - update standard information attribute
  * @ni:		ntfs inode to update standard information
@@ -823,6 +1495,33 @@ static int ntfs_inode_sync_standard_information(ntfs_inode *ni)
 	return 0;
 }
 
+/*
+ *		Check whether the copy of a file name in an index has to
+ *	be written after being updated
+ *
+ *	Only the duplicated fields are compared, and the access time
+ *	is allowed to lag by up to FN_ATIME_DELAY seconds.
+ */
+
+static BOOL fn_changed(const FILE_NAME_ATTR *fnold, const FILE_NAME_ATTR *fnx)
+{
+	s64 lag;
+
+	lag = sle64_to_cpu(fnx->last_access_time)
+			- sle64_to_cpu(fnold->last_access_time);
+	return ((fnold->file_attributes != fnx->file_attributes)
+		|| (fnold->allocated_size != fnx->allocated_size)
+		|| (fnold->data_size != fnx->data_size)
+		|| (fnold->reparse_point_tag != fnx->reparse_point_tag)
+		|| (fnold->creation_time != fnx->creation_time)
+		|| (fnold->last_data_change_time
+				!= fnx->last_data_change_time)
+		|| (fnold->last_mft_change_time
+				!= fnx->last_mft_change_time)
+		|| (lag < 0)
+		|| (lag >= (s64)FN_ATIME_DELAY*10000000));
+}
+
 /**
  * ntfs_inode_sync_file_name - update FILE_NAME attributes
  * @ni:		ntfs inode to update FILE_NAME attributes
@@ -838,6 +1537,7 @@ static int ntfs_inode_sync_file_name(ntfs_inode *ni, ntfs_inode *dir_ni)
 	ntfs_inode *index_ni;
 	FILE_NAME_ATTR *fn;
 	FILE_NAME_ATTR *fnx;
+	FILE_NAME_ATTR fnold;
 	REPARSE_POINT *rpp;
 	le32 reparse_tag;
 	int err = 0;
@@ -913,6 +1613,7 @@ static int ntfs_inode_sync_file_name(ntfs_inode *ni, ntfs_inode *dir_ni)
 		}
 		/* Update flags and file size. */
 		fnx = (FILE_NAME_ATTR *)ictx->data;
+		memcpy(&fnold, fnx, sizeof(FILE_NAME_ATTR));
 		fnx->file_attributes =
 				(fnx->file_attributes & ~FILE_ATTR_VALID_FLAGS) |
 				(ni->flags & FILE_ATTR_VALID_FLAGS);
@@ -927,7 +1628,10 @@ static int ntfs_inode_sync_file_name(ntfs_inode *ni, ntfs_inode *dir_ni)
 			 * attribute update implied the unnamed data to be
 			 * made non-resident
 			 */
-			fn->allocated_size = fnx->allocated_size;
+			if (fn->allocated_size != fnx->allocated_size) {
+				fn->allocated_size = fnx->allocated_size;
+				ntfs_inode_mark_dirty(ctx->ntfs_ino);
+			}
 		}
 			/* update or clear the reparse tag in the index */
 		fnx->reparse_point_tag = reparse_tag;
@@ -942,7 +1646,9 @@ static int ntfs_inode_sync_file_name(ntfs_inode *ni, ntfs_inode *dir_ni)
 			fnx->last_mft_change_time = fn->last_mft_change_time;
 			fnx->last_access_time = fn->last_access_time;
 		}
-		ntfs_index_entry_mark_dirty(ictx);
+			/* do not write the block if nothing visible changed */
+		if (fn_changed(&fnold, fnx))
+			ntfs_index_entry_mark_dirty(ictx);
 		ntfs_index_ctx_put(ictx);
 		if ((ni != index_ni) && !dir_ni
 		    && ntfs_inode_close(index_ni) && !err)
@@ -1230,6 +1936,7 @@ int ntfs_inode_add_attrlist(ntfs_inode *ni)
 	}
 
 	/* Set in-memory attribute list. */
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = al;
 	ni->attr_list_size = al_len;
 	NInoSetAttrList(ni);
@@ -1276,6 +1983,7 @@ int ntfs_inode_add_attrlist(ntfs_inode *ni)
 
 remove_attrlist_record:
 	/* Prevent ntfs_attr_recorm_rm from freeing attribute list. */
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = NULL;
 	NInoClearAttrList(ni);
 	/* Remove $ATTRIBUTE_LIST record. */
@@ -1314,6 +2022,7 @@ rollback:
 		ale = (ATTR_LIST_ENTRY*)((u8*)ale + le16_to_cpu(ale->length));
 	}
 	/* Remove in-memory attribute list. */
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = NULL;
 	ni->attr_list_size = 0;
 	NInoClearAttrList(ni);
@@ -1435,6 +2144,15 @@ void ntfs_inode_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 		return;
 
 	now = ntfs_current_time();
+		/*
+		 * The access time in the directories may lag, so that
+		 * reading a file does not have to update its parent
+		 * directory each time.
+		 */
+	if ((mask != NTFS_UPDATE_ATIME)
+	    || ((sle64_to_cpu(now) - sle64_to_cpu(ni->last_access_time))
+			>= (s64)FN_ATIME_DELAY*10000000))
+		NInoFileNameSetDirty(ni);
 	if (mask & NTFS_UPDATE_ATIME)
 		ni->last_access_time = now;
 	if (mask & NTFS_UPDATE_MTIME)
@@ -1442,7 +2160,6 @@ void ntfs_inode_update_times(ntfs_inode *ni, ntfs_time_update_flags mask)
 	if (mask & NTFS_UPDATE_CTIME)
 		ni->last_mft_change_time = now;
 	
-	NInoFileNameSetDirty(ni);
 	NInoSetDirty(ni);
 }
 
@@ -79,12 +79,14 @@
 #include "layout.h"
 #include "volume.h"
 #include "index.h"
+#include "lcnalloc.h"
 #include "logging.h"
 #include "ntfstime.h"
 #include "unistr.h"
 #include "dir.h"
 #include "security.h"
 #include "ioctl.h"
+#include "defrag.h"
 #include "misc.h"
 
 #if defined(FITRIM) && defined(BLKDISCARD)
@@ -248,23 +250,62 @@ static inline u64 align_down(ntfs_volume *vol, u64 count, u64 granularity)
 	return (aligned >> vol->cluster_size_bits);
 }
 
-#define FSTRIM_BUFSIZ 4096
+#define FSTRIM_SPAN 1048576 /* clusters trimmed with the volume locked */
+
+/*
+ *		State of a trimming, passed to the free extent walker
+ */
+
+struct FSTRIM_STATE {
+	u64 granularity;
+	s64 minlen;	/* in clusters */
+	u64 trimmed;
+	int err;
+} ;
+
+/* Trim an extent of free clusters, compatible with the granularity. */
+static int fstrim_extent(ntfs_volume *vol, LCN lcn, s64 count, void *data)
+{
+	struct FSTRIM_STATE *state = (struct FSTRIM_STATE*)data;
+	LCN aligned_lcn;
+	u64 aligned_count;
+
+	aligned_lcn = align_up(vol, lcn, state->granularity);
+	if (aligned_lcn >= lcn + count)
+		aligned_count = 0;
+	else
+		aligned_count = align_down(vol, lcn + count - aligned_lcn,
+				state->granularity);
+	if (aligned_count && ((s64)aligned_count >= state->minlen)) {
+		state->err = fstrim_clusters(vol, aligned_lcn, aligned_count);
+		if (state->err)
+			return (1);
+		state->trimmed += aligned_count << vol->cluster_size_bits;
+	}
+	return (0);
+}
 
 /* Trim the filesystem.
  *
  * Free blocks between 'start' and 'start+len-1' (both byte offsets)
  * are found and TRIM requests are sent to the block device.  'minlen'
  * is the minimum continguous free range to discard.
+ *
+ * When the volume is in a regular file, the device punches holes
+ * instead, with no limits on the size of the ranges.
+ *
+ * $Bitmap is walked by spans of FSTRIM_SPAN clusters, and when 'yield'
+ * is set, the caller holding the volume locked for an update, the lock
+ * is released between the spans so that the other requests are not
+ * delayed until the whole volume is trimmed.
  */
-static int fstrim(ntfs_volume *vol, void *data, u64 *trimmed)
+static int fstrim(ntfs_volume *vol, u64 start, u64 len, u64 minlen,
+			u64 *trimmed, BOOL yield)
 {
-	struct fstrim_range *range = data;
-	u64 start = range->start;
-	u64 len = range->len;
-	u64 minlen = range->minlen;
 	u64 discard_alignment, discard_granularity, discard_max_bytes;
-	u8 *buf = NULL;
-	LCN start_buf;
+	struct FSTRIM_STATE state;
+	LCN first, last, span;
+	s64 max_count;
 	int ret;
 
 	ntfs_log_debug("fstrim: start=%llu len=%llu minlen=%llu\n",
@@ -274,121 +315,99 @@ static int fstrim(ntfs_volume *vol, void *data, u64 *trimmed)
 
 	*trimmed = 0;
 
-	/* Fail if user tries to use the fstrim -o/-l/-m options.
-	 * XXX We could fix these limitations in future.
-	 */
-	if (start != 0 || len != (uint64_t)-1) {
-		ntfs_log_error("fstrim: setting start or length is not supported\n");
-		return -EINVAL;
-	}
-	if (minlen > vol->cluster_size) {
-		ntfs_log_error("fstrim: minlen > cluster size is not supported\n");
-		return -EINVAL;
-	}
-
-	/* Only block devices are supported.  It would be possible to
-	 * support backing files (ie. without using loop) but the
-	 * ioctls used to punch holes in files are completely
-	 * different.
-	 */
-	if (!NDevBlock(vol->dev)) {
-		ntfs_log_error("fstrim: not supported for non-block-device\n");
-		return -EOPNOTSUPP;
-	}
+	if (NDevBlock(vol->dev)) {
+		ret = fstrim_limits(vol, &discard_alignment,
+				&discard_granularity, &discard_max_bytes);
+		if (ret)
+			return ret;
+		if (discard_alignment != 0) {
+			ntfs_log_error("fstrim: backing device is not aligned for discards\n");
+			return -EOPNOTSUPP;
+		}
 
-	ret = fstrim_limits(vol, &discard_alignment,
-			&discard_granularity, &discard_max_bytes);
-	if (ret)
-		return ret;
-	if (discard_alignment != 0) {
-		ntfs_log_error("fstrim: backing device is not aligned for discards\n");
-		return -EOPNOTSUPP;
+		if (discard_max_bytes == 0) {
+			ntfs_log_error("fstrim: backing device does not support discard (discard_max_bytes == 0)\n");
+			return -EOPNOTSUPP;
+		}
+	} else {
+		discard_granularity = vol->cluster_size;
+		discard_max_bytes = 0;
 	}
-
-	if (discard_max_bytes == 0) {
-		ntfs_log_error("fstrim: backing device does not support discard (discard_max_bytes == 0)\n");
-		return -EOPNOTSUPP;
+	if (discard_granularity < vol->cluster_size)
+		discard_granularity = vol->cluster_size;
+
+	/* Only the clusters fully inside the range are trimmed. */
+	first = (start + vol->cluster_size - 1) >> vol->cluster_size_bits;
+	if (len > (u64)vol->nr_clusters << vol->cluster_size_bits)
+		last = vol->nr_clusters;
+	else {
+		last = (start + len) >> vol->cluster_size_bits;
+		if (last > vol->nr_clusters)
+			last = vol->nr_clusters;
 	}
+	if (first >= last)
+		return 0;
 
 	/* Sync the device before doing anything. */
 	ret = ntfs_device_sync(vol->dev);
 	if (ret)
 		return ret;
 
-	/* Read through the bitmap. */
-	buf = ntfs_malloc(FSTRIM_BUFSIZ);
-	if (buf == NULL)
+	/* Trim the free extents in large as possible blocks, but
+	 * not larger than discard_max_bytes, and compatible
+	 * with the supported trim granularity.
+	 */
+	max_count = discard_max_bytes >> vol->cluster_size_bits;
+	if (discard_max_bytes && !max_count)
+		max_count = 1;
+	state.granularity = discard_granularity;
+	state.minlen = (minlen + vol->cluster_size - 1)
+				>> vol->cluster_size_bits;
+	state.trimmed = 0;
+	state.err = 0;
+	ret = 0;
+	for (; (first < last) && !ret && !state.err; first += span) {
+		span = last - first;
+		if (span > FSTRIM_SPAN)
+			span = FSTRIM_SPAN;
+		if (yield && (first + span < last)) {
+			ret = ntfs_cluster_free_extents(vol, first, span,
+					max_count, fstrim_extent, &state);
+			ntfs_volume_unlock(vol, FALSE);
+			ntfs_volume_lock(vol, FALSE);
+		} else
+			ret = ntfs_cluster_free_extents(vol, first, span,
+					max_count, fstrim_extent, &state);
+	}
+	*trimmed = state.trimmed;
+	if (ret < 0)
 		return -errno;
-	for (start_buf = 0; start_buf < vol->nr_clusters;
-	     start_buf += FSTRIM_BUFSIZ * 8) {
-		s64 count;
-		s64 br;
-		LCN end_buf, start_lcn;
-
-		/* start_buf is LCN of first cluster in the current buffer.
-		 * end_buf is LCN of last cluster + 1 in the current buffer.
-		 */
-		end_buf = start_buf + FSTRIM_BUFSIZ*8;
-		if (end_buf > vol->nr_clusters)
-			end_buf = vol->nr_clusters;
-		count = (end_buf - start_buf) / 8;
-
-		br = ntfs_attr_pread(vol->lcnbmp_na, start_buf/8, count, buf);
-		if (br != count) {
-			if (br >= 0)
-				ret = -EIO;
-			else
-				ret = -errno;
-			goto free_out;
-		}
+	return state.err;
+}
 
-		/* Trim the clusters in large as possible blocks, but
-		 * not larger than discard_max_bytes, and compatible
-		 * with the supported trim granularity.
-		 */
-		for (start_lcn = start_buf; start_lcn < end_buf; ++start_lcn) {
-			if (!ntfs_bit_get(buf, start_lcn-start_buf)) {
-				LCN end_lcn;
-				LCN aligned_lcn;
-				u64 aligned_count;
-
-				/* Cluster 'start_lcn' is not in use,
-				 * find end of this run.
-				 */
-				end_lcn = start_lcn+1;
-				while (end_lcn < end_buf &&
-					(u64) (end_lcn-start_lcn) << vol->cluster_size_bits
-					  < discard_max_bytes &&
-					!ntfs_bit_get(buf, end_lcn-start_buf))
-					end_lcn++;
-				aligned_lcn = align_up(vol, start_lcn,
-						discard_granularity);
-				if (aligned_lcn >= end_lcn)
-					aligned_count = 0;
-				else {
-					aligned_count = 
-						align_down(vol,
-							end_lcn - aligned_lcn,
-							discard_granularity);
-				}
-				if (aligned_count) {
-					ret = fstrim_clusters(vol,
-						aligned_lcn, aligned_count);
-					if (ret)
-						goto free_out;
-
-					*trimmed += aligned_count
-						<< vol->cluster_size_bits;
-				}
-				start_lcn = end_lcn-1;
-			}
-		}
-	}
+/**
+ * ntfs_volume_trim - trim the free clusters of a mounted volume
+ * @vol:	ntfs volume
+ * @range:	range to trim, as defined for FITRIM, the length is
+ *		updated to the number of bytes trimmed
+ *
+ * This is FITRIM for a volume shared by threads : the caller has to
+ * hold the volume locked for an update, and the lock is released
+ * between the spans of clusters while trimming a large volume.
+ *
+ * Returns 0 if successful, or a negative error code.
+ */
+int ntfs_volume_trim(ntfs_volume *vol, struct fstrim_range *range)
+{
+	u64 trimmed;
+	int ret;
 
-	ret = 0;
-free_out:
-	free(buf);
-	return ret;
+	if (!vol || !range)
+		return -EINVAL;
+	ret = fstrim(vol, range->start, range->len, range->minlen,
+			&trimmed, TRUE);
+	range->len = trimmed;
+	return (ret);
 }
 
 #endif /* FITRIM && BLKDISCARD */
@@ -408,12 +427,22 @@ int ntfs_ioctl(ntfs_inode *ni, unsigned long cmd,
 			u64 trimmed;
 			struct fstrim_range *range = (struct fstrim_range*)data;
 
-			ret = fstrim(ni->vol, data, &trimmed);
+			ret = fstrim(ni->vol, range->start, range->len,
+					range->minlen, &trimmed, FALSE);
 			range->len = trimmed;
 		}
 		break;
 #elif !defined(UEFI_DRIVER)
 #warning Trimming not supported : FITRIM or BLKDISCARD not defined
+#endif
+#ifdef NTFS_IOC_DEFRAG
+	case NTFS_IOC_DEFRAG:
+		if (!ni)
+			ret = -EINVAL;
+		else
+			if (ntfs_inode_defragment(ni))
+				ret = -errno;
+		break;
 #endif
 	default :
 		ret = -EINVAL;
@@ -32,19 +32,30 @@
 #ifdef HAVE_STDIO_H
 #include <stdio.h>
 #endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <time.h>
 
 #include "types.h"
 #include "attrib.h"
 #include "bitmap.h"
 #include "debug.h"
+#include "device.h"
 #include "runlist.h"
 #include "volume.h"
 #include "lcnalloc.h"
 #include "logging.h"
 #include "misc.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
 
 /*
  * Plenty possibilities for big optimizations all over in the cluster
@@ -54,6 +65,8 @@
  */
 #define NTFS_LCNALLOC_BSIZE 4096
 #define NTFS_LCNALLOC_SKIP  NTFS_LCNALLOC_BSIZE
+#define NTFS_FREE_EXTENTS_BSIZE 65536 /* bytes of $Bitmap read at once */
+#define NTFS_LCNFREE_BSIZE 65536 /* max bytes of $Bitmap cleared at once */
 
 enum {
 	ZONE_MFT = 1,
@@ -112,212 +125,1245 @@ static void update_full_status(ntfs_volume *vol, LCN lcn)
 			}
 		}
 }
- 
-static s64 max_empty_bit_range(unsigned char *buf, int size)
+
+
+/*
+ *		Summary of free clusters
+ *
+ *	The number of free clusters is counted for each chunk of
+ *	NTFS_LCNALLOC_BSIZE bytes of $Bitmap, so that the allocator can
+ *	skip the chunks which are full without reading them. The summary
+ *	is built when first allocating, and kept up to date when
+ *	allocating and freeing clusters.
+ *
+ *	Changes to $Bitmap made outside of this file are not accounted,
+ *	so the summary is only a hint : when the allocator gets no space
+ *	after skipping chunks, the summary is built again and the
+ *	allocation is retried.
+ */
+
+static void lcn_summary_build(ntfs_volume *vol)
 {
-	int i, j, run = 0;
-	int max_range = 0;
-	s64 start_pos = -1;
-	
-	ntfs_log_trace("Entering\n");
-	
-	i = 0;
-	while (i < size) {
-		switch (*buf) {
-		case 0 :
-			do {
-				buf++;
-				run += 8;
-				i++;
-			} while ((i < size) && !*buf);
-			break;
-		case 255 :
-			if (run > max_range) {
-				max_range = run;
-				start_pos = (s64)i * 8 - run;
-			}
-			run = 0;
-			do {
-				buf++;
-				i++;
-			} while ((i < size) && (*buf == 255));
-			break;
-		default :
-			for (j = 0; j < 8; j++) {
-			
-				int bit = *buf & (1 << j);
-		
-				if (bit) {
-					if (run > max_range) {
-						max_range = run;
-						start_pos = (s64)i * 8 + (j - run);
-					}
-					run = 0;
-				} else 
-					run++;
-			}
-			i++;
-			buf++;
-		
+	u16 *summary;
+	u8 *buf;
+	s64 chunks, chunk, br;
+	int i, bytes;
+
+	chunks = (vol->lcnbmp_na->data_size + NTFS_LCNALLOC_BSIZE - 1)
+			/ NTFS_LCNALLOC_BSIZE;
+	if (chunks <= 0)
+		return;
+	summary = (u16*)ntfs_malloc(chunks*sizeof(u16));
+	buf = (u8*)ntfs_malloc(LCN_SUMMARY_READ_SIZE);
+	if (!summary || !buf) {
+		free(summary);
+		free(buf);
+		return;
+	}
+	chunk = 0;
+	do {
+		br = ntfs_lcnbmp_pread(vol,
+				chunk*NTFS_LCNALLOC_BSIZE,
+				LCN_SUMMARY_READ_SIZE, buf);
+		for (i=0; (i<br) && (chunk<chunks); i+=NTFS_LCNALLOC_BSIZE) {
+			bytes = br - i;
+			if (bytes > NTFS_LCNALLOC_BSIZE)
+				bytes = NTFS_LCNALLOC_BSIZE;
+			summary[chunk++] = ntfs_bit_count_zeroes(&buf[i], bytes);
 		}
+	} while ((br == LCN_SUMMARY_READ_SIZE) && (chunk < chunks));
+	free(buf);
+	if ((br < 0) || (chunk < chunks)) {
+		ntfs_log_perror("Could not summarize the free clusters");
+		free(summary);
+	} else {
+		vol->lcn_summary = summary;
+		vol->lcn_summary_chunks = chunks;
 	}
-	
-	if (run > max_range)
-		start_pos = (s64)i * 8 - run;
-	
-	return start_pos;
 }
 
-static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b, 
-			    u8 *writeback)
+/*
+ *		Forget the summary of free clusters
+ */
+
+static void lcn_summary_free(ntfs_volume *vol)
 {
-	s64 written;
-	
-	ntfs_log_trace("Entering\n");
-	
-	if (!*writeback)
-		return 0;
-	
-	*writeback = 0;
-	
-	written = ntfs_attr_pwrite(vol->lcnbmp_na, pos, size, b);
-	if (written != size) {
-		if (!written)
-			errno = EIO;
-		ntfs_log_perror("Bitmap write error (%lld, %lld)",
-				(long long)pos, (long long)size);
-		return -1;
+	free(vol->lcn_summary);
+	vol->lcn_summary = (u16*)NULL;
+	vol->lcn_summary_chunks = 0;
+}
+
+/*
+ *		Account for clusters allocated or freed
+ */
+
+static void lcn_summary_update(ntfs_volume *vol, LCN lcn, s64 count,
+			BOOL freed)
+{
+	s64 chunk, chunk_clusters, n;
+	u16 *p;
+
+	if (!vol->lcn_summary)
+		return;
+	chunk_clusters = (s64)NTFS_LCNALLOC_BSIZE << 3;
+	chunk = lcn / chunk_clusters;
+	while ((count > 0) && (chunk < vol->lcn_summary_chunks)) {
+		n = (chunk + 1)*chunk_clusters - lcn;
+		if (n > count)
+			n = count;
+		p = &vol->lcn_summary[chunk];
+		if (freed)
+			*p = ((*p + n) < chunk_clusters ? *p + n : chunk_clusters);
+		else
+			*p = (*p > n ? *p - n : 0);
+		lcn += n;
+		count -= n;
+		chunk++;
 	}
+}
 
-	return 0;
+/*
+ *		Check whether the summary shows a span of $Bitmap is full
+ *
+ *	The span starts at byte pos and is NTFS_LCNALLOC_BSIZE long.
+ */
+
+static BOOL lcn_summary_full(ntfs_volume *vol, s64 pos)
+{
+	s64 chunk;
+
+	if (!vol->lcn_summary)
+		return (FALSE);
+	chunk = pos / NTFS_LCNALLOC_BSIZE;
+	if ((chunk >= vol->lcn_summary_chunks)
+	    || vol->lcn_summary[chunk])
+		return (FALSE);
+	chunk = (pos + NTFS_LCNALLOC_BSIZE - 1) / NTFS_LCNALLOC_BSIZE;
+	return ((chunk >= vol->lcn_summary_chunks)
+		|| !vol->lcn_summary[chunk]);
 }
+ 
+/*
+ *		Allocation streams
+ *
+ *	The callers ask to allocate from the cluster following the last
+ *	one allocated to the attribute being extended, so the files being
+ *	extended at the same time are identified by this goal. The goals
+ *	of the recent streams are recorded with the number of clusters
+ *	they got, and the allocations falling back to the zone positions
+ *	are not started in the room left for the other streams to grow,
+ *	so that files copied in parallel are not interleaved.
+ */
 
-/**
- * ntfs_cluster_alloc - allocate clusters on an ntfs volume
- * @vol:	mounted ntfs volume on which to allocate the clusters
- * @start_vcn:	vcn to use for the first allocated cluster
- * @count:	number of clusters to allocate
- * @start_lcn:	starting lcn at which to allocate the clusters (or -1 if none)
- * @zone:	zone from which to allocate the clusters
+struct LCN_STREAM {
+	LCN next;		/* goal of the next allocation */
+	s64 streak;		/* clusters allocated, zero if unused */
+	u32 stamp;		/* time of the last allocation */
+} ;
+
+struct LCN_STREAMS {
+	u32 stamp;
+	struct LCN_STREAM stream[LCN_MAX_STREAMS];
+} ;
+
+/*
+ *		Find the stream an allocation goal belongs to
  *
- * Allocate @count clusters preferably starting at cluster @start_lcn or at the
- * current allocator position if @start_lcn is -1, on the mounted ntfs volume
- * @vol. @zone is either DATA_ZONE for allocation of normal clusters and
- * MFT_ZONE for allocation of clusters for the master file table, i.e. the
- * $MFT/$DATA attribute.
+ *	Returns NULL if the goal does not extend a recent stream
+ */
+
+static struct LCN_STREAM *lcn_stream_find(ntfs_volume *vol, LCN goal)
+{
+	struct LCN_STREAMS *ls;
+	struct LCN_STREAM *found;
+	int i;
+
+	found = (struct LCN_STREAM*)NULL;
+	ls = vol->lcn_streams;
+	if (ls && (goal >= 0)) {
+		for (i=0; (i<LCN_MAX_STREAMS) && !found; i++)
+			if (ls->stream[i].streak
+			    && (ls->stream[i].next == goal))
+				found = &ls->stream[i];
+	}
+	return (found);
+}
+
+/*
+ *		Record the new goal of a stream after an allocation
  *
- * On success return a runlist describing the allocated cluster(s).
+ *	If the allocation did not extend a stream, the oldest stream
+ *	is replaced. Failing to record is not an error.
+ */
+
+static void lcn_stream_update(ntfs_volume *vol, struct LCN_STREAM *stream,
+			LCN next, s64 count)
+{
+	struct LCN_STREAMS *ls;
+	int i;
+
+	ls = vol->lcn_streams;
+	if (!ls) {
+		ls = (struct LCN_STREAMS*)ntfs_calloc(
+					sizeof(struct LCN_STREAMS));
+		vol->lcn_streams = ls;
+	}
+	if (ls) {
+		if (!stream) {
+			stream = &ls->stream[0];
+			for (i=1; (i<LCN_MAX_STREAMS) && stream->streak; i++)
+				if (!ls->stream[i].streak
+				    || ((u32)(ls->stamp - ls->stream[i].stamp)
+					> (u32)(ls->stamp - stream->stamp)))
+					stream = &ls->stream[i];
+			stream->streak = 0;
+		}
+		stream->next = next;
+		stream->streak += count;
+		stream->stamp = ++ls->stamp;
+	}
+}
+
+/*
+ *		Move a starting position out of the room of other streams
  *
- * On error return NULL with errno set to the error code.
+ *	The position is kept if it would have to be moved beyond @end.
+ */
+
+static LCN lcn_stream_avoid(ntfs_volume *vol, const struct LCN_STREAM *self,
+			LCN pos, LCN end)
+{
+	const struct LCN_STREAMS *ls;
+	const struct LCN_STREAM *stream;
+	LCN newpos;
+	s64 room;
+	BOOL moved;
+	int i;
+
+	newpos = pos;
+	ls = vol->lcn_streams;
+	if (ls) {
+		do {
+			moved = FALSE;
+			for (i=0; i<LCN_MAX_STREAMS; i++) {
+				stream = &ls->stream[i];
+				room = stream->streak;
+				if (room < NTFS_LCNALLOC_SKIP)
+					room = NTFS_LCNALLOC_SKIP;
+				if (room > LCN_STREAM_ROOM_MAX)
+					room = LCN_STREAM_ROOM_MAX;
+				if ((stream != self) && stream->streak
+				    && (newpos >= stream->next)
+				    && (newpos < (stream->next + room))) {
+					newpos = stream->next + room;
+					moved = TRUE;
+				}
+			}
+		} while (moved && (newpos < end));
+	}
+	return (newpos < end ? newpos : pos);
+}
+
+/*
+ *		Counting the free clusters
  *
- * Notes on the allocation algorithm
- * =================================
+ *	Counting the free clusters of a big volume means reading the whole
+ *	$Bitmap, which delays the mount. When requested, the count is
+ *	first estimated from a few samples of $Bitmap, and the exact count
+ *	is then made by a thread, which reads $Bitmap through a copy of
+ *	its runlist (it is never relocated or resized while mounted).
  *
- * There are two data zones. First is the area between the end of the mft zone
- * and the end of the volume, and second is the area between the start of the
- * volume and the start of the mft zone. On unmodified/standard NTFS 1.x
- * volumes, the second data zone doesn't exist due to the mft zone being
- * expanded to cover the start of the volume in order to reserve space for the
- * mft bitmap attribute.
+ *	The thread counts slices of $Bitmap under a lock, which is also
+ *	held by the allocations and frees of clusters. The changes made
+ *	within the part already counted are accounted for in the count,
+ *	the other ones will be seen by the thread later, the delayed pages
+ *	of $Bitmap being laid over what it reads. Meanwhile the
+ *	estimate is kept up to date as usual, and it is replaced by the
+ *	count when the thread is done.
+ */
+
+struct LCN_COUNT {
+	runlist_element *rl;		/* copy of the runlist of $Bitmap */
+	s64 size;			/* bytes of $Bitmap to count */
+	s64 initialized;		/* bytes of $Bitmap initialized */
+	s64 scanned;			/* bytes of $Bitmap counted */
+	s64 counted;			/* free clusters in the counted part */
+	BOOL started;			/* counting thread started */
+	BOOL done;			/* free clusters counted */
+#ifdef HAVE_PTHREAD_H
+	BOOL stop;			/* counting thread has to stop */
+	pthread_mutex_t lock;
+	pthread_t thread;
+#endif
+} ;
+
+static void lcn_count_lock(const ntfs_volume *vol __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	if (vol && vol->lcn_count && vol->lcn_count->started)
+		pthread_mutex_lock(&vol->lcn_count->lock);
+#endif
+}
+
+static void lcn_count_unlock(const ntfs_volume *vol __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	if (vol && vol->lcn_count && vol->lcn_count->started)
+		pthread_mutex_unlock(&vol->lcn_count->lock);
+#endif
+}
+
+/*
+ *		Account for clusters allocated or freed in the counted part
  *
- * The complexity stems from the need of implementing the mft vs data zoned 
- * approach and from the fact that we have access to the lcn bitmap via up to 
- * NTFS_LCNALLOC_BSIZE bytes at a time, so we need to cope with crossing over 
- * boundaries of two buffers. Further, the fact that the allocator allows for 
- * caller supplied hints as to the location of where allocation should begin 
- * and the fact that the allocator keeps track of where in the data zones the 
- * next natural allocation should occur, contribute to the complexity of the 
- * function. But it should all be worthwhile, because this allocator: 
- *   1) implements MFT zone reservation
- *   2) causes reduction in fragmentation. 
- * The code is not optimized for speed.
+ *	Must be called with the lock held
  */
-runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
-		LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone)
+
+static void lcn_count_update(ntfs_volume *vol, LCN lcn, s64 count,
+			BOOL freed)
 {
-	LCN zone_start, zone_end;  /* current search range */
-	LCN last_read_pos, lcn;
-	LCN bmp_pos;		/* current bit position inside the bitmap */
-	LCN prev_lcn = 0, prev_run_len = 0;
-	s64 clusters, br;
-	runlist *rl = NULL, *trl;
-	u8 *buf, *byte, bit, writeback;
-	u8 pass = 1; 	/* 1: inside zone;  2: start of zone */
-	u8 search_zone; /* 4: data2 (start) 1: mft (middle) 2: data1 (end) */
-	u8 done_zones = 0;
-	u8 has_guess, used_zone_pos;
-	int err = 0, rlpos, rlsize, buf_size;
+	struct LCN_COUNT *lc;
+	s64 limit;
 
-	ntfs_log_enter("Entering with count = 0x%llx, start_lcn = 0x%llx, "
-		       "zone = %s_ZONE.\n", (long long)count, (long long)
-		       start_lcn, zone == MFT_ZONE ? "MFT" : "DATA");
-	
-	if (!vol || count < 0 || start_lcn < -1 || !vol->lcnbmp_na ||
-			(s8)zone < FIRST_ZONE || zone > LAST_ZONE) {
-		errno = EINVAL;
-		ntfs_log_perror("%s: vcn: %lld, count: %lld, lcn: %lld", 
-				__FUNCTION__, (long long)start_vcn, 
-				(long long)count, (long long)start_lcn);
-		goto out;
+	lc = vol->lcn_count;
+	if (lc && !lc->done) {
+		limit = lc->scanned << 3;
+		if (lcn < limit) {
+			if (count > (limit - lcn))
+				count = limit - lcn;
+			lc->counted += (freed ? count : -count);
+		}
 	}
+}
 
-	/* Return empty runlist if @count == 0 */
-	if (!count) {
-		rl = ntfs_malloc(0x1000);
-		if (rl) {
-			rl[0].vcn = start_vcn;
-			rl[0].lcn = LCN_RL_NOT_MAPPED;
-			rl[0].length = 0;
+#ifdef HAVE_PTHREAD_H
+
+static void lcn_writeback_overlay(const ntfs_volume *vol, s64 pos,
+			s64 count, u8 *buf);
+
+/*
+ *		Read a part of $Bitmap through the copy of its runlist
+ *
+ *	The part beyond the initialized size reads as zeroes, as
+ *	when reading through the attribute.
+ */
+
+static s64 lcn_count_read(ntfs_volume *vol, struct LCN_COUNT *lc,
+			s64 pos, s64 count, u8 *buf)
+{
+	struct NTFS_TRACE_TAG tag;
+	runlist_element *rl;
+	s64 ofs, n, br, total;
+	VCN vcn;
+
+	if (count > (lc->size - pos))
+		count = lc->size - pos;
+	ntfs_trace_enter(vol->dev, &tag, NTFS_TRACE_BITMAP, FILE_Bitmap,
+			le32_to_cpu(AT_DATA));
+	total = 0;
+	rl = lc->rl;
+	while (total < count) {
+		n = count - total;
+		if ((pos + total) >= lc->initialized) {
+			memset(&buf[total], 0, n);
+			total += n;
+			continue;
 		}
-		goto out;
+		if (n > (lc->initialized - pos - total))
+			n = lc->initialized - pos - total;
+		vcn = (pos + total) >> vol->cluster_size_bits;
+		while (rl->length && ((rl->vcn + rl->length) <= vcn))
+			rl++;
+		if (!rl->length || (rl->vcn > vcn)) {
+			ntfs_trace_leave(&tag);
+			errno = EIO;
+			return (-1);
+		}
+		ofs = (pos + total) - (rl->vcn << vol->cluster_size_bits);
+		if (n > ((rl->length << vol->cluster_size_bits) - ofs))
+			n = (rl->length << vol->cluster_size_bits) - ofs;
+		if (rl->lcn < 0)
+			memset(&buf[total], 0, n);
+		else {
+			br = ntfs_pread(vol->dev,
+				(rl->lcn << vol->cluster_size_bits) + ofs,
+				n, &buf[total]);
+			if (br != n) {
+				ntfs_trace_leave(&tag);
+				if (br >= 0)
+					errno = EIO;
+				return (-1);
+			}
+		}
+		total += n;
 	}
+	ntfs_trace_leave(&tag);
+	return (total);
+}
 
-	buf = ntfs_malloc(NTFS_LCNALLOC_BSIZE);
-	if (!buf)
-		goto out;
-	/*
-	 * If no @start_lcn was requested, use the current zone
-	 * position otherwise use the requested @start_lcn.
-	 */
-	has_guess = 1;
-	zone_start = start_lcn;
-	
-	if (zone_start < 0) {
-		if (zone == DATA_ZONE)
-			zone_start = vol->data1_zone_pos;
-		else
-			zone_start = vol->mft_zone_pos;
-		has_guess = 0;
+static void *lcn_count_thread(void *arg)
+{
+	ntfs_volume *vol;
+	struct LCN_COUNT *lc;
+	u8 *buf;
+	s64 br;
+	BOOL stop;
+
+	vol = (ntfs_volume*)arg;
+	lc = vol->lcn_count;
+	buf = (u8*)ntfs_malloc(LCN_COUNT_SLICE);
+	stop = !buf;
+	while (!stop) {
+		pthread_mutex_lock(&lc->lock);
+		br = 0;
+		if (!lc->stop) {
+			br = lcn_count_read(vol, lc, lc->scanned,
+					LCN_COUNT_SLICE, buf);
+			if (br > 0) {
+				lcn_writeback_overlay(vol, lc->scanned,
+					br, buf);
+				lc->counted += ntfs_bit_count_zeroes(buf, br);
+				lc->scanned += br;
+			}
+			if (br < 0)
+				ntfs_log_perror("Failed to count the free"
+					" clusters");
+			if (lc->scanned >= lc->size) {
+				vol->free_clusters = lc->counted;
+				lc->done = TRUE;
+				ntfs_log_debug("Counted %lld free clusters\n",
+					(long long)lc->counted);
+			}
+		}
+		stop = lc->stop || lc->done || (br <= 0);
+		pthread_mutex_unlock(&lc->lock);
 	}
-	
-	used_zone_pos = has_guess ? 0 : 1;
-	
-	if (!zone_start || zone_start == vol->mft_zone_start ||
-			zone_start == vol->mft_zone_end)
-		pass = 2;
-		
-	if (zone_start < vol->mft_zone_start) {
-		zone_end = vol->mft_zone_start;
-		search_zone = ZONE_DATA2;
-	} else if (zone_start < vol->mft_zone_end) {
-		zone_end = vol->mft_zone_end;
-		search_zone = ZONE_MFT;
+	free(buf);
+	return ((void*)NULL);
+}
+
+/*
+ *		Allocate the context of a background count
+ *
+ *	Returns NULL if the count cannot be made in the background
+ */
+
+static struct LCN_COUNT *lcn_count_alloc(ntfs_volume *vol)
+{
+	struct LCN_COUNT *lc;
+	runlist_element *rl;
+	int n;
+
+	if (ntfs_attr_map_whole_runlist(vol->lcnbmp_na))
+		return ((struct LCN_COUNT*)NULL);
+	for (n=0; vol->lcnbmp_na->rl[n].length; n++) { }
+	rl = (runlist_element*)ntfs_malloc((n + 1)*sizeof(runlist_element));
+	lc = (struct LCN_COUNT*)ntfs_malloc(sizeof(struct LCN_COUNT));
+	if (rl && lc && !pthread_mutex_init(&lc->lock,
+				(pthread_mutexattr_t*)NULL)) {
+		memcpy(rl, vol->lcnbmp_na->rl, (n + 1)*sizeof(runlist_element));
+		lc->rl = rl;
+		lc->size = vol->lcnbmp_na->data_size;
+		lc->initialized = vol->lcnbmp_na->initialized_size;
+		lc->scanned = 0;
+		lc->counted = 0;
+		lc->started = FALSE;
+		lc->done = FALSE;
+		lc->stop = FALSE;
 	} else {
-		zone_end = vol->nr_clusters;
-		search_zone = ZONE_DATA1;
+		free(rl);
+		free(lc);
+		lc = (struct LCN_COUNT*)NULL;
 	}
-	
-	bmp_pos = zone_start;
+	return (lc);
+}
 
-	/* Loop until all clusters are allocated. */
-	clusters = count;
-	rlpos = rlsize = 0;
-	while (1) {
-			/* check whether we have exhausted the current zone */
-		if (search_zone & vol->full_zones)
+#else /* HAVE_PTHREAD_H */
+
+static struct LCN_COUNT *lcn_count_alloc(ntfs_volume *vol
+			__attribute__((unused)))
+{
+	return ((struct LCN_COUNT*)NULL);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Estimate the free clusters from samples of $Bitmap
+ *
+ *	Returns the estimate, or -1 if $Bitmap could not be read
+ */
+
+static s64 lcn_count_estimate(ntfs_volume *vol)
+{
+	ntfs_attr *na;
+	u8 *buf;
+	s64 zeroes, bytes, br, pos;
+	int i;
+
+	na = vol->lcnbmp_na;
+	buf = (u8*)ntfs_malloc(LCN_COUNT_SAMPLE_SIZE);
+	if (!buf)
+		return (-1);
+	zeroes = 0;
+	bytes = 0;
+	br = 0;
+	for (i=0; (i<LCN_COUNT_SAMPLES) && (br >= 0); i++) {
+		pos = (na->data_size / LCN_COUNT_SAMPLES)*i;
+		br = ntfs_lcnbmp_pread(vol, pos, LCN_COUNT_SAMPLE_SIZE, buf);
+		if (br > 0) {
+			zeroes += ntfs_bit_count_zeroes(buf, br);
+			bytes += br;
+		}
+	}
+	free(buf);
+	if ((br < 0) || !bytes)
+		return (-1);
+	return (zeroes*(na->data_size/bytes)
+		+ (zeroes*(na->data_size%bytes))/bytes);
+}
+
+/**
+ * ntfs_cluster_count_stop - stop counting the free clusters
+ * @vol:	ntfs volume
+ *
+ * Stop the counting thread and discard the count if it was not done,
+ * the estimate is then kept in @vol->free_clusters.
+ */
+void ntfs_cluster_count_stop(ntfs_volume *vol)
+{
+	struct LCN_COUNT *lc;
+
+	lc = vol->lcn_count;
+	if (lc) {
+#ifdef HAVE_PTHREAD_H
+		if (lc->started) {
+			pthread_mutex_lock(&lc->lock);
+			lc->stop = TRUE;
+			pthread_mutex_unlock(&lc->lock);
+			pthread_join(lc->thread, (void**)NULL);
+			lc->started = FALSE;
+		}
+		pthread_mutex_destroy(&lc->lock);
+#endif
+		free(lc->rl);
+		free(lc);
+		vol->lcn_count = (struct LCN_COUNT*)NULL;
+	}
+}
+
+/**
+ * ntfs_cluster_count_pending - check whether the free clusters are estimated
+ * @vol:	ntfs volume
+ *
+ * Return TRUE if @vol->free_clusters is an estimate, the background count
+ * not being done yet, and FALSE if it is the exact count.
+ */
+BOOL ntfs_cluster_count_pending(ntfs_volume *vol)
+{
+	struct LCN_COUNT *lc;
+	BOOL pending;
+
+	pending = FALSE;
+	lc = vol->lcn_count;
+	if (lc) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&lc->lock);
+		pending = !lc->done;
+		pthread_mutex_unlock(&lc->lock);
+#else
+		pending = !lc->done;
+#endif
+	}
+	return (pending);
+}
+
+/**
+ * ntfs_cluster_count_free - count the free clusters of a volume
+ * @vol:	ntfs volume
+ * @background:	TRUE if the count may be completed in the background
+ *
+ * Set @vol->free_clusters to the number of free clusters.
+ *
+ * When @background is set and $Bitmap is at least LCN_COUNT_BACKGROUND_MIN
+ * bytes, only an estimate is set, and the exact count is left to a thread
+ * started by ntfs_cluster_count_start(). Not set in ntfs_mount().
+ *
+ * On success return 0 and on error return -1 with errno set to the error code.
+ */
+int ntfs_cluster_count_free(ntfs_volume *vol, BOOL background)
+{
+	struct LCN_COUNT *lc;
+	s64 free_clusters;
+
+	if (!vol || !vol->lcnbmp_na) {
+		errno = EINVAL;
+		return (-1);
+	}
+	ntfs_cluster_count_stop(vol);
+		/* the count is made from the device */
+	if (ntfs_lcnbmp_flush(vol, TRUE))
+		return (-1);
+	lc = (struct LCN_COUNT*)NULL;
+	if (background && NAttrNonResident(vol->lcnbmp_na)
+	    && (vol->lcnbmp_na->data_size >= LCN_COUNT_BACKGROUND_MIN))
+		lc = lcn_count_alloc(vol);
+	if (lc) {
+		free_clusters = lcn_count_estimate(vol);
+		if (free_clusters >= 0) {
+			vol->lcn_count = lc;
+			ntfs_log_debug("Estimated %lld free clusters\n",
+					(long long)free_clusters);
+		} else
+			ntfs_cluster_count_stop(vol);
+	} else
+		free_clusters = ntfs_attr_get_free_bits(vol->lcnbmp_na);
+	if (free_clusters < 0) {
+		ntfs_log_perror("Failed to read NTFS $Bitmap");
+		return (-1);
+	}
+	vol->free_clusters = free_clusters;
+	return (0);
+}
+
+/**
+ * ntfs_cluster_count_start - start the background count of free clusters
+ * @vol:	ntfs volume
+ *
+ * Start the thread counting the free clusters, when an estimate was set
+ * by ntfs_cluster_count_free(). If the thread cannot be started, the
+ * count is made before returning.
+ *
+ * On success return 0 and on error return -1 with errno set to the error code.
+ */
+int ntfs_cluster_count_start(ntfs_volume *vol)
+{
+	struct LCN_COUNT *lc;
+
+	if (!vol) {
+		errno = EINVAL;
+		return (-1);
+	}
+	lc = vol->lcn_count;
+	if (!lc || lc->started || lc->done)
+		return (0);
+#ifdef HAVE_PTHREAD_H
+	lc->started = TRUE;
+	if (!pthread_create(&lc->thread, (pthread_attr_t*)NULL,
+				lcn_count_thread, (void*)vol))
+		return (0);
+	lc->started = FALSE;
+#endif
+	ntfs_log_perror("Could not count the free clusters in the background");
+	return (ntfs_cluster_count_free(vol, FALSE));
+}
+
+/*
+ *		Delayed writing of $Bitmap
+ *
+ *	When set up by ntfs_set_lcnbmp_writeback(), the changes to $Bitmap
+ *	are not written each time clusters are allocated or freed, the
+ *	modified pages of NTFS_LCNALLOC_BSIZE bytes are kept in a table
+ *	sorted by position, and the adjacent ones are written together :
+ *	- before an mft record is written, the pages which show clusters
+ *	  as allocated, so that a record never designates clusters which
+ *	  are free on the device,
+ *	- when the table is full, or when a page has been dirty for
+ *	  LCN_WRITEBACK_DELAY seconds and $Bitmap is modified again,
+ *	- on request by ntfs_lcnbmp_flush() (fsync, end of a request,
+ *	  unmount).
+ *	The clusters freed may thus still be shown allocated on the device
+ *	for a while, which only wastes them if the volume is not unmounted
+ *	properly.
+ *
+ *	The pages are laid over whatever is read from $Bitmap through
+ *	ntfs_lcnbmp_pread(), and by the thread counting the free clusters.
+ *	They are modified and written with the count lock held.
+ */
+
+struct LCN_DIRTY_PAGE {
+	s64 pos;			/* position in $Bitmap */
+	s64 size;			/* bytes, less than a page at the end */
+	BOOL allocated;			/* some bits were set */
+	u8 data[NTFS_LCNALLOC_BSIZE];
+} ;
+
+struct LCN_WRITEBACK {
+	int count;			/* number of dirty pages */
+	int max_count;			/* max number of dirty pages */
+	int allocated;			/* number of pages with bits set */
+	time_t oldest;			/* when the oldest page was dirtied */
+	struct LCN_DIRTY_PAGE *pages[0];	/* sorted by position */
+} ;
+
+/*
+ *		Locate the first dirty page at or after a position
+ *
+ *	Returns the index of the page in the table, or the count of
+ *		pages if there is none
+ */
+
+static int lcn_writeback_find(const struct LCN_WRITEBACK *wb, s64 pos)
+{
+	int low, high, mid;
+
+	pos &= ~(s64)(NTFS_LCNALLOC_BSIZE - 1);
+	low = 0;
+	high = wb->count;
+	while (low < high) {
+		mid = (low + high) >> 1;
+		if (wb->pages[mid]->pos < pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return (low);
+}
+
+/*
+ *		Lay the dirty pages over a part of $Bitmap just read
+ */
+
+static void lcn_writeback_overlay(const ntfs_volume *vol, s64 pos,
+			s64 count, u8 *buf)
+{
+	const struct LCN_WRITEBACK *wb;
+	const struct LCN_DIRTY_PAGE *page;
+	s64 start, end;
+	int i;
+
+	wb = vol->lcn_writeback;
+	if (wb && wb->count) {
+		for (i=lcn_writeback_find(wb, pos);
+		    (i < wb->count) && (wb->pages[i]->pos < (pos + count));
+		    i++) {
+			page = wb->pages[i];
+			start = (page->pos > pos ? page->pos : pos);
+			end = page->pos + page->size;
+			if (end > (pos + count))
+				end = pos + count;
+			if (start < end)
+				memcpy(&buf[start - pos],
+					&page->data[start - page->pos],
+					end - start);
+		}
+	}
+}
+
+/*
+ *		Write the dirty pages, adjacent ones being written together
+ *
+ *	When @all is FALSE, only the runs of adjacent pages which show
+ *	some clusters as allocated are written. The pages which could
+ *	not be written are kept in the table.
+ *
+ *	Must be called with the count lock held.
+ *
+ *	Returns 0 if successful, -1 if some page could not be written
+ */
+
+static int lcn_writeback_write(const ntfs_volume *vol, BOOL all)
+{
+	struct LCN_WRITEBACK *wb;
+	struct LCN_DIRTY_PAGE *page;
+	u8 *buf;
+	s64 pos, size, written;
+	int first, last, maxrun, kept, i;
+	int err, res;
+	BOOL wanted;
+
+	res = 0;
+	err = 0;
+	wb = vol->lcn_writeback;
+	buf = (u8*)NULL;
+	if (wb->count > 1)
+		buf = (u8*)ntfs_malloc(LCN_WRITEBACK_RUN*NTFS_LCNALLOC_BSIZE);
+		/* without a buffer, pages are written one at a time */
+	maxrun = (buf ? LCN_WRITEBACK_RUN : 1);
+	kept = 0;
+	for (first=0; first<wb->count; first=last+1) {
+		last = first;
+		wanted = all || wb->pages[first]->allocated;
+		while (((last + 1) < wb->count)
+		    && ((last + 1 - first) < maxrun)
+		    && (wb->pages[last + 1]->pos
+			== (wb->pages[last]->pos + wb->pages[last]->size))) {
+			last++;
+			if (wb->pages[last]->allocated)
+				wanted = TRUE;
+		}
+		written = 0;
+		size = -1;
+		if (wanted) {
+			pos = wb->pages[first]->pos;
+			if (first == last) {
+				size = wb->pages[first]->size;
+				written = ntfs_attr_pwrite(vol->lcnbmp_na,
+					pos, size, wb->pages[first]->data);
+			} else {
+				size = 0;
+				for (i=first; i<=last; i++) {
+					memcpy(&buf[size], wb->pages[i]->data,
+						wb->pages[i]->size);
+					size += wb->pages[i]->size;
+				}
+				written = ntfs_attr_pwrite(vol->lcnbmp_na,
+					pos, size, buf);
+			}
+			if (written != size) {
+				if (written >= 0)
+					errno = EIO;
+				err = errno;
+				res = -1;
+				ntfs_log_perror("Failed to write the delayed "
+					"$Bitmap (%lld, %lld)",
+					(long long)pos, (long long)size);
+			}
+		}
+		for (i=first; i<=last; i++) {
+			page = wb->pages[i];
+			if (written == size) {
+				if (page->allocated)
+					wb->allocated--;
+				free(page);
+			} else
+				wb->pages[kept++] = page;
+		}
+	}
+	wb->count = kept;
+	free(buf);
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/*
+ *		Get the dirty page at a position, creating it if needed
+ *
+ *	Returns the page, or NULL if it cannot be delayed
+ */
+
+static struct LCN_DIRTY_PAGE *lcn_writeback_page(const ntfs_volume *vol,
+			s64 pos)
+{
+	struct LCN_WRITEBACK *wb;
+	struct LCN_DIRTY_PAGE *page;
+	s64 size;
+	int i;
+
+	wb = vol->lcn_writeback;
+	i = lcn_writeback_find(wb, pos);
+	if ((i < wb->count) && (wb->pages[i]->pos == pos))
+		return (wb->pages[i]);
+	if ((wb->count >= wb->max_count)
+	    && (lcn_writeback_write(vol, TRUE)
+		|| (wb->count >= wb->max_count)))
+		return ((struct LCN_DIRTY_PAGE*)NULL);
+	page = (struct LCN_DIRTY_PAGE*)ntfs_malloc(
+				sizeof(struct LCN_DIRTY_PAGE));
+	if (page) {
+		size = vol->lcnbmp_na->data_size - pos;
+		if (size > NTFS_LCNALLOC_BSIZE)
+			size = NTFS_LCNALLOC_BSIZE;
+		if (ntfs_attr_pread(vol->lcnbmp_na, pos, size, page->data)
+				!= size) {
+			free(page);
+			return ((struct LCN_DIRTY_PAGE*)NULL);
+		}
+		page->pos = pos;
+		page->size = size;
+		page->allocated = FALSE;
+		i = lcn_writeback_find(wb, pos);
+		memmove(&wb->pages[i + 1], &wb->pages[i],
+			(wb->count - i)*sizeof(struct LCN_DIRTY_PAGE*));
+		wb->pages[i] = page;
+		if (!wb->count++)
+			wb->oldest = time((time_t*)NULL);
+	}
+	return (page);
+}
+
+/**
+ * ntfs_lcnbmp_pread - read from $Bitmap
+ * @vol:	ntfs volume
+ * @pos:	byte position in $Bitmap
+ * @count:	number of bytes to read
+ * @b:		output buffer
+ *
+ * Read from $Bitmap, as ntfs_attr_pread() would do, getting the latest
+ * state of the pages whose writing is delayed.
+ *
+ * Return the number of bytes read, or -1 on error with errno set.
+ */
+s64 ntfs_lcnbmp_pread(const ntfs_volume *vol, s64 pos, s64 count, void *b)
+{
+	s64 br;
+
+	br = ntfs_attr_pread(vol->lcnbmp_na, pos, count, b);
+	if (br > 0)
+		lcn_writeback_overlay(vol, pos, br, (u8*)b);
+	return (br);
+}
+
+/**
+ * ntfs_lcnbmp_pwrite - write to $Bitmap
+ * @vol:	ntfs volume
+ * @pos:	byte position in $Bitmap
+ * @count:	number of bytes to write
+ * @b:		data to write
+ *
+ * Write to $Bitmap, as ntfs_attr_pwrite() would do, the writing being
+ * delayed if set up. This must be called with the count lock held,
+ * as the allocations and frees of clusters do.
+ *
+ * Return the number of bytes written, or -1 on error with errno set.
+ */
+s64 ntfs_lcnbmp_pwrite(const ntfs_volume *vol, s64 pos, s64 count,
+			const void *b)
+{
+	struct LCN_WRITEBACK *wb;
+	struct LCN_DIRTY_PAGE *page;
+	const u8 *src;
+	s64 cur, ofs, n, bw, total;
+	s64 i;
+
+	wb = vol->lcn_writeback;
+	if (!wb || (pos < 0) || (count < 0))
+		return (ntfs_attr_pwrite(vol->lcnbmp_na, pos, count, b));
+	if (count > (vol->lcnbmp_na->data_size - pos))
+		count = vol->lcnbmp_na->data_size - pos;
+	src = (const u8*)b;
+	total = 0;
+	while (total < count) {
+		cur = pos + total;
+		ofs = cur & (NTFS_LCNALLOC_BSIZE - 1);
+		n = NTFS_LCNALLOC_BSIZE - ofs;
+		if (n > (count - total))
+			n = count - total;
+		page = lcn_writeback_page(vol, cur - ofs);
+		if (page) {
+			if (!page->allocated) {
+				for (i=0; (i<n) && !(src[total + i]
+					    & ~page->data[ofs + i]); i++) { }
+				if (i < n) {
+					page->allocated = TRUE;
+					wb->allocated++;
+				}
+			}
+			memcpy(&page->data[ofs], &src[total], n);
+		} else {
+				/* no dirty page here, write through */
+			bw = ntfs_attr_pwrite(vol->lcnbmp_na, cur, n,
+					&src[total]);
+			if (bw != n)
+				return (total ? total : bw);
+		}
+		total += n;
+	}
+	if (wb->count
+	    && ((time((time_t*)NULL) - wb->oldest) >= LCN_WRITEBACK_DELAY)
+	    && lcn_writeback_write(vol, TRUE))
+		return (-1);
+	return (total);
+}
+
+/**
+ * ntfs_lcnbmp_flush - write the delayed pages of $Bitmap
+ * @vol:	ntfs volume
+ * @all:	TRUE if all pages have to be written, FALSE if only
+ *		when some page has been dirty for too long
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_lcnbmp_flush(ntfs_volume *vol, BOOL all)
+{
+	struct LCN_WRITEBACK *wb;
+	int res;
+
+	res = 0;
+	wb = vol->lcn_writeback;
+	if (wb && wb->count
+	    && (all || ((time((time_t*)NULL) - wb->oldest)
+				>= LCN_WRITEBACK_DELAY))) {
+		lcn_count_lock(vol);
+		res = lcn_writeback_write(vol, TRUE);
+		lcn_count_unlock(vol);
+	}
+	return (res);
+}
+
+/**
+ * ntfs_lcnbmp_flush_allocated - write the pages of $Bitmap showing
+ *		allocated clusters
+ * @vol:	ntfs volume
+ *
+ * This has to be called before writing an mft record, which may
+ * designate clusters whose allocation is still delayed.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_lcnbmp_flush_allocated(const ntfs_volume *vol)
+{
+	struct LCN_WRITEBACK *wb;
+	int res;
+
+	res = 0;
+	wb = vol->lcn_writeback;
+	if (wb && wb->allocated) {
+		lcn_count_lock(vol);
+		res = lcn_writeback_write(vol, FALSE);
+		lcn_count_unlock(vol);
+	}
+	return (res);
+}
+
+/*
+ *		Set up the delayed writing of $Bitmap
+ *	Not set in ntfs_mount(), the dirty pages are limited to
+ *	@size bytes, a zero size writes the dirty pages and stops
+ *	delaying.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_lcnbmp_writeback(ntfs_volume *vol, s64 size)
+{
+	struct LCN_WRITEBACK *wb;
+	int max_count;
+	int i;
+	int res;
+
+	res = -1;
+	if (!vol || !vol->lcnbmp_na || (size < 0))
+		errno = EINVAL;
+	else {
+		res = ntfs_lcnbmp_flush(vol, TRUE);
+		wb = vol->lcn_writeback;
+		if (wb && (!size || !res)) {
+				/* pages which could not be written are lost */
+			for (i=0; i<wb->count; i++)
+				free(wb->pages[i]);
+			free(wb);
+			vol->lcn_writeback = (struct LCN_WRITEBACK*)NULL;
+		}
+		max_count = size/sizeof(struct LCN_DIRTY_PAGE);
+		if (size && !res && max_count) {
+			wb = (struct LCN_WRITEBACK*)ntfs_calloc(
+				sizeof(struct LCN_WRITEBACK)
+				+ max_count*sizeof(struct LCN_DIRTY_PAGE*));
+			if (wb)
+				wb->max_count = max_count;
+			else
+				res = -1;
+			vol->lcn_writeback = wb;
+		}
+	}
+	return (res);
+}
+
+static s64 max_empty_bit_range(unsigned char *buf, int size)
+{
+	s64 pos, end, bits;
+	s64 max_range = 0;
+	s64 start_pos = -1;
+	
+	ntfs_log_trace("Entering\n");
+	
+	/* Keep the first of the longest runs of free bits */
+	bits = (s64)size << 3;
+	pos = ntfs_bit_find_zero(buf, 0, bits);
+	while (pos >= 0) {
+		end = ntfs_bit_find_one(buf, pos, bits);
+		if (end < 0)
+			end = bits;
+		if ((end - pos) > max_range) {
+			max_range = end - pos;
+			start_pos = pos;
+		}
+		pos = ntfs_bit_find_zero(buf, end, bits);
+	}
+	
+	return start_pos;
+}
+
+static int lcn_free_from_rl(ntfs_volume *vol, runlist *rl);
+static BOOL lcn_discard_pending(const ntfs_volume *vol);
+static int lcn_discard_drain(ntfs_volume *vol);
+
+static int bitmap_writeback(ntfs_volume *vol, s64 pos, s64 size, void *b, 
+			    u8 *writeback)
+{
+	s64 written;
+	
+	ntfs_log_trace("Entering\n");
+	
+	if (!*writeback)
+		return 0;
+	
+	*writeback = 0;
+	
+	written = ntfs_lcnbmp_pwrite(vol, pos, size, b);
+	if (written != size) {
+		if (!written)
+			errno = EIO;
+		ntfs_log_perror("Bitmap write error (%lld, %lld)",
+				(long long)pos, (long long)size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * ntfs_cluster_alloc_zones - search the zones for clusters to allocate
+ * @vol:	mounted ntfs volume on which to allocate the clusters
+ * @start_vcn:	vcn to use for the first allocated cluster
+ * @count:	number of clusters to allocate
+ * @start_lcn:	starting lcn at which to allocate the clusters (or -1 if none)
+ * @zone:	zone from which to allocate the clusters
+ * @skipped:	set when chunks of $Bitmap were skipped from the summary
+ *
+ * Allocate @count clusters preferably starting at cluster @start_lcn or at the
+ * current allocator position if @start_lcn is -1, on the mounted ntfs volume
+ * @vol. @zone is either DATA_ZONE for allocation of normal clusters and
+ * MFT_ZONE for allocation of clusters for the master file table, i.e. the
+ * $MFT/$DATA attribute.
+ *
+ * On success return a runlist describing the allocated cluster(s).
+ *
+ * On error return NULL with errno set to the error code.
+ *
+ * Notes on the allocation algorithm
+ * =================================
+ *
+ * There are two data zones. First is the area between the end of the mft zone
+ * and the end of the volume, and second is the area between the start of the
+ * volume and the start of the mft zone. On unmodified/standard NTFS 1.x
+ * volumes, the second data zone doesn't exist due to the mft zone being
+ * expanded to cover the start of the volume in order to reserve space for the
+ * mft bitmap attribute.
+ *
+ * The complexity stems from the need of implementing the mft vs data zoned 
+ * approach and from the fact that we have access to the lcn bitmap via up to 
+ * NTFS_LCNALLOC_BSIZE bytes at a time, so we need to cope with crossing over 
+ * boundaries of two buffers. Further, the fact that the allocator allows for 
+ * caller supplied hints as to the location of where allocation should begin 
+ * and the fact that the allocator keeps track of where in the data zones the 
+ * next natural allocation should occur, contribute to the complexity of the 
+ * function. But it should all be worthwhile, because this allocator: 
+ *   1) implements MFT zone reservation
+ *   2) causes reduction in fragmentation. 
+ * The code is not optimized for speed.
+ */
+static runlist *ntfs_cluster_alloc_zones(ntfs_volume *vol, VCN start_vcn,
+		s64 count, LCN start_lcn,
+		const NTFS_CLUSTER_ALLOCATION_ZONES zone, BOOL *skipped)
+{
+	LCN zone_start, zone_end;  /* current search range */
+	LCN last_read_pos, lcn;
+	LCN bmp_pos;		/* current bit position inside the bitmap */
+	LCN prev_lcn = 0, prev_run_len = 0;
+	s64 clusters, br;
+	runlist *rl = NULL, *trl;
+	u8 *buf, *byte, bit, writeback;
+	u8 pass = 1; 	/* 1: inside zone;  2: start of zone */
+	u8 search_zone; /* 4: data2 (start) 1: mft (middle) 2: data1 (end) */
+	u8 done_zones = 0;
+	u8 has_guess, used_zone_pos;
+	int err = 0, rlpos, rlsize, buf_size;
+	struct LCN_STREAM *stream;
+
+	ntfs_log_enter("Entering with count = 0x%llx, start_lcn = 0x%llx, "
+		       "zone = %s_ZONE.\n", (long long)count, (long long)
+		       start_lcn, zone == MFT_ZONE ? "MFT" : "DATA");
+	
+	if (!vol || count < 0 || start_lcn < -1 || !vol->lcnbmp_na ||
+			(s8)zone < FIRST_ZONE || zone > LAST_ZONE) {
+		errno = EINVAL;
+		ntfs_log_perror("%s: vcn: %lld, count: %lld, lcn: %lld", 
+				__FUNCTION__, (long long)start_vcn, 
+				(long long)count, (long long)start_lcn);
+		goto out;
+	}
+
+	/* Return empty runlist if @count == 0 */
+	if (!count) {
+		rl = ntfs_malloc(0x1000);
+		if (rl) {
+			rl[0].vcn = start_vcn;
+			rl[0].lcn = LCN_RL_NOT_MAPPED;
+			rl[0].length = 0;
+		}
+		goto out;
+	}
+
+	buf = ntfs_malloc(NTFS_LCNALLOC_BSIZE);
+	if (!buf)
+		goto out;
+	if (!vol->lcn_summary)
+		lcn_summary_build(vol);
+	stream = (zone == DATA_ZONE ? lcn_stream_find(vol, start_lcn)
+				: (struct LCN_STREAM*)NULL);
+	/*
+	 * If no @start_lcn was requested, use the current zone
+	 * position otherwise use the requested @start_lcn.
+	 */
+	has_guess = 1;
+	zone_start = start_lcn;
+	
+	if (zone_start < 0) {
+		if (zone == DATA_ZONE)
+			zone_start = lcn_stream_avoid(vol, stream,
+					vol->data1_zone_pos, vol->nr_clusters);
+		else
+			zone_start = vol->mft_zone_pos;
+		has_guess = 0;
+	}
+	
+	used_zone_pos = has_guess ? 0 : 1;
+	
+	if (!zone_start || zone_start == vol->mft_zone_start ||
+			zone_start == vol->mft_zone_end)
+		pass = 2;
+		
+	if (zone_start < vol->mft_zone_start) {
+		zone_end = vol->mft_zone_start;
+		search_zone = ZONE_DATA2;
+	} else if (zone_start < vol->mft_zone_end) {
+		zone_end = vol->mft_zone_end;
+		search_zone = ZONE_MFT;
+	} else {
+		zone_end = vol->nr_clusters;
+		search_zone = ZONE_DATA1;
+	}
+	
+	bmp_pos = zone_start;
+
+	/* Loop until all clusters are allocated. */
+	clusters = count;
+	rlpos = rlsize = 0;
+	while (1) {
+			/* check whether we have exhausted the current zone */
+		if (search_zone & vol->full_zones)
 			goto zone_pass_done;
 		last_read_pos = bmp_pos >> 3;
-		br = ntfs_attr_pread(vol->lcnbmp_na, last_read_pos, 
+		if (lcn_summary_full(vol, last_read_pos)) {
+			/* same outcome as reading a chunk with no free bit */
+			br = vol->lcnbmp_na->data_size - last_read_pos;
+			if (br > NTFS_LCNALLOC_BSIZE)
+				br = NTFS_LCNALLOC_BSIZE;
+			if (br <= 0)
+				goto zone_pass_done;
+			if (vol->stats)
+				vol->stats->lcn_skipped += br;
+			buf_size = (int)br << 3;
+			bmp_pos &= ~7;
+			writeback = 0;
+			has_guess = 0;
+			*skipped = TRUE;
+			goto chunk_done;
+		}
+		br = ntfs_lcnbmp_pread(vol, last_read_pos,
 				     NTFS_LCNALLOC_BSIZE, buf);
 		if (br <= 0) {
 			if (!br)
@@ -330,6 +1376,8 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 		 * We might have read less than NTFS_LCNALLOC_BSIZE bytes
 		 * if we are close to the end of the attribute.
 		 */
+		if (vol->stats)
+			vol->stats->lcn_scanned += br;
 		buf_size = (int)br << 3;
 		lcn = bmp_pos & 7;
 		bmp_pos &= ~7;
@@ -368,7 +1416,10 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 			/* Allocate the bitmap bit. */
 			*byte |= bit;
 			writeback = 1;
-			if (vol->free_clusters <= 0) 
+			lcn_summary_update(vol, lcn + bmp_pos, 1, FALSE);
+			lcn_count_update(vol, lcn + bmp_pos, 1, FALSE);
+			if ((vol->free_clusters <= 0)
+			    && !NVolFreeSpaceUncounted(vol))
 				ntfs_log_error("Non-positive free clusters "
 					       "(%lld)!\n",
 						(long long)vol->free_clusters);
@@ -396,186 +1447,918 @@ runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
 					ntfs_log_debug("Start_vcn: %lld\n", 
 						       (long long)start_vcn);
 				}
-				
-				rl[rlpos].lcn = prev_lcn = lcn + bmp_pos;
-				rl[rlpos].length = prev_run_len = 1;
-				rlpos++;
+				
+				rl[rlpos].lcn = prev_lcn = lcn + bmp_pos;
+				rl[rlpos].length = prev_run_len = 1;
+				rlpos++;
+			}
+			
+			ntfs_log_debug("RUN:   %-16lld %-16lld %-16lld\n", 
+				       (long long)rl[rlpos - 1].vcn, 
+				       (long long)rl[rlpos - 1].lcn, 
+				       (long long)rl[rlpos - 1].length);
+			/* Done? */
+			if (!--clusters) {
+				if (used_zone_pos)
+					ntfs_cluster_update_zone_pos(vol, 
+						search_zone, lcn + bmp_pos + 1 +
+							NTFS_LCNALLOC_SKIP);
+				goto done_ret;
+			}
+			
+			lcn++;
+		}
+		
+chunk_done:
+		if (bitmap_writeback(vol, last_read_pos, br, buf, &writeback)) {
+			err = errno;
+			goto err_ret;
+		}
+		
+		if (!used_zone_pos) {
+			
+			used_zone_pos = 1;
+			
+			if (search_zone == ZONE_MFT)
+				zone_start = vol->mft_zone_pos;
+			else if (search_zone == ZONE_DATA1)
+				zone_start = lcn_stream_avoid(vol, stream,
+					vol->data1_zone_pos, vol->nr_clusters);
+			else
+				zone_start = lcn_stream_avoid(vol, stream,
+					vol->data2_zone_pos,
+					vol->mft_zone_start);
+			
+			if (!zone_start || zone_start == vol->mft_zone_start ||
+					zone_start == vol->mft_zone_end)
+				pass = 2;
+			bmp_pos = zone_start;
+		} else
+			bmp_pos += buf_size;
+		
+		if (bmp_pos < zone_end)
+			continue;
+
+zone_pass_done:
+		ntfs_log_trace("Finished current zone pass(%i).\n", pass);
+		if (pass == 1) {
+			pass = 2;
+			zone_end = zone_start;
+			
+			if (search_zone == ZONE_MFT)
+				zone_start = vol->mft_zone_start;
+			else if (search_zone == ZONE_DATA1)
+				zone_start = vol->mft_zone_end;
+			else
+				zone_start = 0;
+			
+			/* Sanity check. */
+			if (zone_end < zone_start)
+				zone_end = zone_start;
+			
+			bmp_pos = zone_start;
+			
+			continue;
+		} 
+		/* pass == 2 */
+done_zones_check:
+		done_zones |= search_zone;
+		vol->full_zones |= search_zone;
+		if (done_zones < (ZONE_MFT + ZONE_DATA1 + ZONE_DATA2)) {
+			ntfs_log_trace("Switching zone.\n");
+			pass = 1;
+			if (rlpos) {
+				LCN tc = rl[rlpos - 1].lcn + 
+				      rl[rlpos - 1].length + NTFS_LCNALLOC_SKIP;
+				
+				if (used_zone_pos)
+					ntfs_cluster_update_zone_pos(vol, 
+						search_zone, tc);
+			}
+			
+			switch (search_zone) {
+			case ZONE_MFT:
+				ntfs_log_trace("Zone switch: mft -> data1\n");
+switch_to_data1_zone:		search_zone = ZONE_DATA1;
+				zone_start = vol->data1_zone_pos;
+				zone_end = vol->nr_clusters;
+				if (zone_start == vol->mft_zone_end)
+					pass = 2;
+				break;
+			case ZONE_DATA1:
+				ntfs_log_trace("Zone switch: data1 -> data2\n");
+				search_zone = ZONE_DATA2;
+				zone_start = vol->data2_zone_pos;
+				zone_end = vol->mft_zone_start;
+				if (!zone_start)
+					pass = 2;
+				break;
+			case ZONE_DATA2:
+				if (!(done_zones & ZONE_DATA1)) {
+					ntfs_log_trace("data2 -> data1\n");
+					goto switch_to_data1_zone;
+				}
+				ntfs_log_trace("Zone switch: data2 -> mft\n");
+				search_zone = ZONE_MFT;
+				zone_start = vol->mft_zone_pos;
+				zone_end = vol->mft_zone_end;
+				if (zone_start == vol->mft_zone_start)
+					pass = 2;
+				break;
 			}
 			
-			ntfs_log_debug("RUN:   %-16lld %-16lld %-16lld\n", 
-				       (long long)rl[rlpos - 1].vcn, 
-				       (long long)rl[rlpos - 1].lcn, 
-				       (long long)rl[rlpos - 1].length);
-			/* Done? */
-			if (!--clusters) {
-				if (used_zone_pos)
-					ntfs_cluster_update_zone_pos(vol, 
-						search_zone, lcn + bmp_pos + 1 +
-							NTFS_LCNALLOC_SKIP);
-				goto done_ret;
+			bmp_pos = zone_start;
+			
+			if (zone_start == zone_end) {
+				ntfs_log_trace("Empty zone, skipped.\n");
+				goto done_zones_check;
 			}
 			
-			lcn++;
+			continue;
 		}
 		
-		if (bitmap_writeback(vol, last_read_pos, br, buf, &writeback)) {
-			err = errno;
-			goto err_ret;
+		ntfs_log_trace("All zones are finished, no space on device.\n");
+		err = ENOSPC;
+		goto err_ret;
+	}
+done_ret:
+	ntfs_log_debug("At done_ret.\n");
+	/* Add runlist terminator element. */
+	rl[rlpos].vcn = rl[rlpos - 1].vcn + rl[rlpos - 1].length;
+	rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
+	rl[rlpos].length = 0;
+	if (bitmap_writeback(vol, last_read_pos, br, buf, &writeback)) {
+		err = errno;
+		goto err_ret;
+	}
+	if (zone == DATA_ZONE)
+		lcn_stream_update(vol, stream,
+			rl[rlpos - 1].lcn + rl[rlpos - 1].length, count);
+done_err_ret:
+	free(buf);
+	if (err) {
+		errno = err;
+		ntfs_log_perror("Failed to allocate clusters");
+		rl = NULL;
+	}
+out:	
+	ntfs_log_leave("\n");
+	return rl;
+
+wb_err_ret:
+	ntfs_log_trace("At wb_err_ret.\n");
+	if (bitmap_writeback(vol, last_read_pos, br, buf, &writeback))
+		err = errno;
+err_ret:
+	ntfs_log_trace("At err_ret.\n");
+	if (rl) {
+		/* Add runlist terminator element. */
+		rl[rlpos].vcn = rl[rlpos - 1].vcn + rl[rlpos - 1].length;
+		rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
+		rl[rlpos].length = 0;
+		ntfs_debug_runlist_dump(rl);
+		lcn_free_from_rl(vol, rl);
+		free(rl);
+		rl = NULL;
+	}
+	goto done_err_ret;
+}
+
+/**
+ * ntfs_cluster_alloc - allocate clusters on an ntfs volume
+ * @vol:	mounted ntfs volume on which to allocate the clusters
+ * @start_vcn:	vcn to use for the first allocated cluster
+ * @count:	number of clusters to allocate
+ * @start_lcn:	starting lcn at which to allocate the clusters (or -1 if none)
+ * @zone:	zone from which to allocate the clusters
+ *
+ * See ntfs_cluster_alloc_zones() for the allocation algorithm. When no
+ * space was found after skipping chunks of $Bitmap shown full by the
+ * summary of free clusters, the summary may be stale, so it is built
+ * again and the allocation is retried. Likewise, when the clusters
+ * freed are waiting for being discarded, they are released and the
+ * allocation is retried.
+ *
+ * On success return a runlist describing the allocated cluster(s).
+ *
+ * On error return NULL with errno set to the error code.
+ */
+runlist *ntfs_cluster_alloc(ntfs_volume *vol, VCN start_vcn, s64 count,
+		LCN start_lcn, const NTFS_CLUSTER_ALLOCATION_ZONES zone)
+{
+	runlist *rl;
+	BOOL skipped;
+	u8 full_zones;
+
+	NTFS_PROBE3(cluster_alloc_entry, count, start_lcn, zone);
+	lcn_count_lock(vol);
+	skipped = FALSE;
+	full_zones = (vol ? vol->full_zones : 0);
+	if (vol && vol->stats) {
+		vol->stats->lcn_allocs++;
+		vol->stats->lcn_clusters += count;
+	}
+	rl = ntfs_cluster_alloc_zones(vol, start_vcn, count, start_lcn,
+				zone, &skipped);
+	if (!rl && (errno == ENOSPC) && skipped) {
+		ntfs_log_debug("Retrying the allocation from the bitmap\n");
+		lcn_summary_free(vol);
+		vol->full_zones = full_zones;
+		skipped = FALSE;
+		rl = ntfs_cluster_alloc_zones(vol, start_vcn, count,
+				start_lcn, zone, &skipped);
+	}
+	if (!rl && (errno == ENOSPC) && lcn_discard_pending(vol)) {
+		ntfs_log_debug("Retrying the allocation without discarding\n");
+		if (!lcn_discard_drain(vol)) {
+			rl = ntfs_cluster_alloc_zones(vol, start_vcn, count,
+					start_lcn, zone, &skipped);
+		} else
+			errno = ENOSPC;
+	}
+	lcn_count_unlock(vol);
+	NTFS_PROBE2(cluster_alloc_return, count, rl);
+	return (rl);
+}
+
+/*
+ *		Batched freeing of clusters
+ *
+ *	The runs to free are collected, sorted and coalesced, then
+ *	$Bitmap is cleared in a single pass, each span of at most
+ *	NTFS_LCNFREE_BSIZE bytes being read and written once for all
+ *	the runs it contains, instead of once per run. This matters
+ *	when freeing huge fragmented files, whose runs are scattered
+ *	all over the volume.
+ */
+
+struct LCN_FREE_RUN {
+	LCN lcn;
+	s64 length;
+} ;
+
+struct LCN_FREE_LIST {
+	struct LCN_FREE_RUN *runs;
+	int count;
+	int allocated;
+} ;
+
+static int lcn_free_add(struct LCN_FREE_LIST *list, LCN lcn, s64 length)
+{
+	struct LCN_FREE_RUN *runs;
+	int allocated;
+
+	if (list->count >= list->allocated) {
+		allocated = (list->allocated ? 2*list->allocated : 64);
+		runs = (struct LCN_FREE_RUN*)realloc(list->runs,
+				allocated*sizeof(struct LCN_FREE_RUN));
+		if (!runs) {
+			errno = ENOMEM;
+			return (-1);
 		}
-		
-		if (!used_zone_pos) {
-			
-			used_zone_pos = 1;
-			
-			if (search_zone == ZONE_MFT)
-				zone_start = vol->mft_zone_pos;
-			else if (search_zone == ZONE_DATA1)
-				zone_start = vol->data1_zone_pos;
+		list->runs = runs;
+		list->allocated = allocated;
+	}
+	list->runs[list->count].lcn = lcn;
+	list->runs[list->count].length = length;
+	list->count++;
+	return (0);
+}
+
+static int lcn_free_compare(const void *p1, const void *p2)
+{
+	const struct LCN_FREE_RUN *r1 = (const struct LCN_FREE_RUN*)p1;
+	const struct LCN_FREE_RUN *r2 = (const struct LCN_FREE_RUN*)p2;
+
+	return (r1->lcn < r2->lcn ? -1 : (r1->lcn > r2->lcn ? 1 : 0));
+}
+
+/*
+ *		Sort the runs and coalesce the adjacent or overlapping ones
+ *
+ *	Returns the new count of runs
+ */
+
+static int lcn_free_merge(struct LCN_FREE_RUN *runs, int count)
+{
+	int i, n;
+
+	if (count > 1)
+		qsort(runs, count, sizeof(struct LCN_FREE_RUN),
+				lcn_free_compare);
+	n = 0;
+	for (i=0; i<count; i++) {
+		if (n && (runs[i].lcn <= runs[n - 1].lcn + runs[n - 1].length)) {
+			if ((runs[i].lcn + runs[i].length)
+			    > (runs[n - 1].lcn + runs[n - 1].length))
+				runs[n - 1].length = runs[i].lcn
+					+ runs[i].length - runs[n - 1].lcn;
+		} else
+			runs[n++] = runs[i];
+	}
+	return (n);
+}
+
+/*
+ *		Clear the collected runs in $Bitmap, with the count lock held
+ *
+ *	The number of clusters actually freed is returned in *freed,
+ *	even when an error occurs, and added to the free count.
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int lcn_clear_runs(ntfs_volume *vol, struct LCN_FREE_LIST *list,
+			s64 *freed)
+{
+	struct LCN_FREE_RUN *runs;
+	u8 *buf;
+	s64 pos, end, last, size, br;
+	LCN first, start, stop;
+	int count, i, j;
+	int ret;
+
+	*freed = 0;
+	count = lcn_free_merge(list->runs, list->count);
+	if (!count)
+		return (0);
+	buf = (u8*)ntfs_malloc(NTFS_LCNFREE_BSIZE);
+	if (!buf)
+		return (-1);
+	runs = list->runs;
+	size = vol->lcnbmp_na->data_size;
+	ret = 0;
+	i = 0;
+	first = runs[0].lcn; /* first cluster still to free */
+	while ((i < count) && !ret) {
+		pos = first >> 3;
+		end = pos + NTFS_LCNFREE_BSIZE;
+		last = pos;
+		for (j=i; (j<count) && ((runs[j].lcn >> 3) < end); j++) {
+			last = (runs[j].lcn + runs[j].length + 7) >> 3;
+			if (last > end)
+				last = end;
+		}
+		if (last > size) {
+			errno = EIO;
+			ntfs_log_perror("Cluster deallocation beyond the end "
+					"of $Bitmap (%lld)",
+					(long long)(size << 3));
+			ret = -1;
+			break;
+		}
+		br = ntfs_lcnbmp_pread(vol, pos, last - pos, buf);
+		if (br != last - pos) {
+			if (br >= 0)
+				errno = EIO;
+			ntfs_log_perror("Failed to read $Bitmap");
+			ret = -1;
+			break;
+		}
+		for (j=i; (j<count) && (runs[j].lcn < (last << 3)); j++) {
+			start = (runs[j].lcn > first ? runs[j].lcn : first);
+			stop = runs[j].lcn + runs[j].length;
+			if (stop > (last << 3))
+				stop = last << 3;
+			ntfs_bit_set_range(buf, start - (pos << 3),
+					stop - start, 0);
+		}
+		br = ntfs_lcnbmp_pwrite(vol, pos, last - pos, buf);
+		if (br != last - pos) {
+			if (br >= 0)
+				errno = EIO;
+			ntfs_log_perror("Cluster deallocation failed "
+					"(%lld, %lld)",
+					(long long)(pos << 3),
+					(long long)((last - pos) << 3));
+			ret = -1;
+			break;
+		}
+		for (; (i<count) && (runs[i].lcn < (last << 3)); ) {
+			start = (runs[i].lcn > first ? runs[i].lcn : first);
+			stop = runs[i].lcn + runs[i].length;
+			if (stop > (last << 3))
+				stop = last << 3;
+			update_full_status(vol, start);
+			lcn_summary_update(vol, start, stop - start, TRUE);
+			lcn_count_update(vol, start, stop - start, TRUE);
+			*freed += stop - start;
+			first = stop;
+			if (stop == (runs[i].lcn + runs[i].length))
+				i++;
 			else
-				zone_start = vol->data2_zone_pos;
-			
-			if (!zone_start || zone_start == vol->mft_zone_start ||
-					zone_start == vol->mft_zone_end)
-				pass = 2;
-			bmp_pos = zone_start;
+				break;
+		}
+		if ((i < count) && (first < runs[i].lcn))
+			first = runs[i].lcn;
+	}
+	free(buf);
+	vol->free_clusters += *freed;
+	if (vol->free_clusters > vol->nr_clusters)
+		ntfs_log_error("Too many free clusters (%lld > %lld)!",
+			       (long long)vol->free_clusters,
+			       (long long)vol->nr_clusters);
+	return (ret);
+}
+
+/*
+ *		Online discard of the freed clusters
+ *
+ *	When set, the runs freed are not cleared in $Bitmap, so that they
+ *	cannot be allocated again, and they are queued instead, the
+ *	adjacent ones being coalesced. Every LCN_DISCARD_DELAY seconds,
+ *	the runs queued during the previous period are sorted, merged and
+ *	passed to a thread which discards them by batches, and the runs
+ *	queued during the current period take their place. The metadata
+ *	showing the runs freed, delayed for less than LCN_DISCARD_DELAY
+ *	seconds, has thus been written, and the device is synced before
+ *	the runs are passed, so that discarding them is safe even if the
+ *	volume is not unmounted cleanly.
+ *
+ *	The runs are cleared in $Bitmap and counted as free when their
+ *	discard is complete, or at once if the allocation of clusters
+ *	fails, or if the device cannot discard. Only the thread accesses
+ *	the runs being discarded, until it clears the flag "discarding".
+ */
+
+struct LCN_DISCARD {
+	struct LCN_FREE_LIST queued;	/* runs freed in the current period */
+	struct LCN_FREE_LIST aging;	/* runs freed in the previous period */
+	struct LCN_FREE_LIST busy;	/* runs passed to the thread */
+	time_t period;			/* start of the current period */
+	s64 pending;			/* clusters freed, not released */
+	BOOL active;			/* freed runs are queued */
+	BOOL unsupported;		/* the device cannot discard */
+	BOOL discarding;		/* busy runs not discarded yet */
+#ifdef HAVE_PTHREAD_H
+	BOOL started;			/* discarding thread started */
+	BOOL stop;			/* discarding thread has to stop */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+#endif
+} ;
+
+static void lcn_discard_lock(struct LCN_DISCARD *ld __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	if (ld->started)
+		pthread_mutex_lock(&ld->lock);
+#endif
+}
+
+static void lcn_discard_unlock(struct LCN_DISCARD *ld
+			__attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	if (ld->started)
+		pthread_mutex_unlock(&ld->lock);
+#endif
+}
+
+/*
+ *		Queue a run freed, coalescing it with the last one
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int lcn_discard_queue(struct LCN_DISCARD *ld, LCN lcn, s64 length)
+{
+	struct LCN_FREE_RUN *last;
+
+	if (ld->queued.count) {
+		last = &ld->queued.runs[ld->queued.count - 1];
+		if ((last->lcn + last->length) == lcn) {
+			last->length += length;
+			ld->pending += length;
+			return (0);
+		}
+	}
+	if (lcn_free_add(&ld->queued, lcn, length))
+		return (-1);
+	ld->pending += length;
+	return (0);
+}
+
+/*
+ *		Discard the busy runs
+ *
+ *	The ranges are passed to the device LCN_DISCARD_BATCH at a time.
+ *	Errors other than the device not supporting discards are only
+ *	logged, as the runs are released anyway.
+ *
+ *	Returns TRUE if the device cannot discard
+ */
+
+static BOOL lcn_discard_runs(ntfs_volume *vol, struct LCN_DISCARD *ld)
+{
+	struct ntfs_io_segment seg[LCN_DISCARD_BATCH];
+	int i, n;
+	BOOL failed;
+	BOOL unsupported;
+
+	failed = FALSE;
+	unsupported = FALSE;
+	for (i=0; (i<ld->busy.count) && !unsupported; i+=n) {
+		for (n=0; (n<LCN_DISCARD_BATCH)
+				&& ((i + n)<ld->busy.count); n++) {
+			seg[n].pos = ld->busy.runs[i + n].lcn
+					<< vol->cluster_size_bits;
+			seg[n].count = ld->busy.runs[i + n].length
+					<< vol->cluster_size_bits;
+			seg[n].buf = (void*)NULL;
+		}
+		if (ntfs_device_discard(vol->dev, seg, n)) {
+			if ((errno == EOPNOTSUPP) || (errno == ENOTTY)
+			    || (errno == EINVAL) || (errno == ENOSYS)) {
+				ntfs_log_error("The device cannot discard the"
+					" freed clusters\n");
+				unsupported = TRUE;
+			} else
+				if (!failed) {
+					ntfs_log_perror("Failed to discard the"
+						" freed clusters");
+					failed = TRUE;
+				}
+		}
+	}
+	return (unsupported);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *lcn_discard_thread(void *arg)
+{
+	ntfs_volume *vol;
+	struct LCN_DISCARD *ld;
+	BOOL unsupported;
+	BOOL stop;
+
+	vol = (ntfs_volume*)arg;
+	ld = vol->lcn_discard;
+	stop = FALSE;
+	pthread_mutex_lock(&ld->lock);
+	while (!stop) {
+		while (!ld->discarding && !ld->stop)
+			pthread_cond_wait(&ld->cond, &ld->lock);
+		if (ld->discarding) {
+			pthread_mutex_unlock(&ld->lock);
+			unsupported = lcn_discard_runs(vol, ld);
+			pthread_mutex_lock(&ld->lock);
+			if (unsupported)
+				ld->unsupported = TRUE;
+			ld->discarding = FALSE;
+			pthread_cond_broadcast(&ld->cond);
 		} else
-			bmp_pos += buf_size;
-		
-		if (bmp_pos < zone_end)
-			continue;
+			stop = TRUE;
+	}
+	pthread_mutex_unlock(&ld->lock);
+	return ((void*)NULL);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Wait until the busy runs are discarded
+ */
+
+static void lcn_discard_wait(struct LCN_DISCARD *ld __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	if (ld->started) {
+		pthread_mutex_lock(&ld->lock);
+		while (ld->discarding)
+			pthread_cond_wait(&ld->cond, &ld->lock);
+		pthread_mutex_unlock(&ld->lock);
+	}
+#endif
+}
+
+/*
+ *		Clear runs in $Bitmap, with the count lock held
+ *
+ *	The list is emptied, the runs which could not be cleared being
+ *	lost, and left allocated.
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int lcn_discard_release(ntfs_volume *vol, struct LCN_FREE_LIST *list)
+{
+	struct LCN_DISCARD *ld;
+	s64 freed;
+	int i;
+	int res;
+
+	ld = vol->lcn_discard;
+	for (i=0; i<list->count; i++)
+		ld->pending -= list->runs[i].length;
+	res = lcn_clear_runs(vol, list, &freed);
+	free(list->runs);
+	list->runs = (struct LCN_FREE_RUN*)NULL;
+	list->count = 0;
+	list->allocated = 0;
+	return (res);
+}
+
+/*
+ *		Release the busy runs once discarded, with the count lock held
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int lcn_discard_done(ntfs_volume *vol)
+{
+	struct LCN_DISCARD *ld;
+	struct LCN_FREE_LIST list;
+	BOOL unsupported;
+	int res;
+
+	ld = vol->lcn_discard;
+	list.count = 0;
+	lcn_discard_lock(ld);
+	if (!ld->discarding && ld->busy.count) {
+		list = ld->busy;
+		ld->busy.runs = (struct LCN_FREE_RUN*)NULL;
+		ld->busy.count = 0;
+		ld->busy.allocated = 0;
+	}
+	unsupported = ld->unsupported;
+	lcn_discard_unlock(ld);
+	res = 0;
+	if (list.count && lcn_discard_release(vol, &list))
+		res = -1;
+		/* stop queueing, and release what was queued */
+	if (unsupported && ld->active) {
+		ld->active = FALSE;
+		if (lcn_discard_release(vol, &ld->aging))
+			res = -1;
+		if (lcn_discard_release(vol, &ld->queued))
+			res = -1;
+	}
+	return (res);
+}
+
+/*
+ *		Pass the aging runs to the thread, with the count lock held
+ *
+ *	Without a thread, the runs are discarded before returning.
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
 
-zone_pass_done:
-		ntfs_log_trace("Finished current zone pass(%i).\n", pass);
-		if (pass == 1) {
-			pass = 2;
-			zone_end = zone_start;
-			
-			if (search_zone == ZONE_MFT)
-				zone_start = vol->mft_zone_start;
-			else if (search_zone == ZONE_DATA1)
-				zone_start = vol->mft_zone_end;
+static int lcn_discard_submit(ntfs_volume *vol)
+{
+	struct LCN_DISCARD *ld;
+	int res;
+
+	ld = vol->lcn_discard;
+	res = 0;
+	ld->aging.count = lcn_free_merge(ld->aging.runs, ld->aging.count);
+	if (ld->aging.count) {
+			/* the metadata must be on the device first */
+		res = ntfs_device_sync(vol->dev);
+		if (!res) {
+			lcn_discard_lock(ld);
+			ld->busy = ld->aging;
+			ld->discarding = TRUE;
+#ifdef HAVE_PTHREAD_H
+			if (ld->started)
+				pthread_cond_signal(&ld->cond);
 			else
-				zone_start = 0;
-			
-			/* Sanity check. */
-			if (zone_end < zone_start)
-				zone_end = zone_start;
-			
-			bmp_pos = zone_start;
-			
-			continue;
-		} 
-		/* pass == 2 */
-done_zones_check:
-		done_zones |= search_zone;
-		vol->full_zones |= search_zone;
-		if (done_zones < (ZONE_MFT + ZONE_DATA1 + ZONE_DATA2)) {
-			ntfs_log_trace("Switching zone.\n");
-			pass = 1;
-			if (rlpos) {
-				LCN tc = rl[rlpos - 1].lcn + 
-				      rl[rlpos - 1].length + NTFS_LCNALLOC_SKIP;
-				
-				if (used_zone_pos)
-					ntfs_cluster_update_zone_pos(vol, 
-						search_zone, tc);
-			}
-			
-			switch (search_zone) {
-			case ZONE_MFT:
-				ntfs_log_trace("Zone switch: mft -> data1\n");
-switch_to_data1_zone:		search_zone = ZONE_DATA1;
-				zone_start = vol->data1_zone_pos;
-				zone_end = vol->nr_clusters;
-				if (zone_start == vol->mft_zone_end)
-					pass = 2;
-				break;
-			case ZONE_DATA1:
-				ntfs_log_trace("Zone switch: data1 -> data2\n");
-				search_zone = ZONE_DATA2;
-				zone_start = vol->data2_zone_pos;
-				zone_end = vol->mft_zone_start;
-				if (!zone_start)
-					pass = 2;
-				break;
-			case ZONE_DATA2:
-				if (!(done_zones & ZONE_DATA1)) {
-					ntfs_log_trace("data2 -> data1\n");
-					goto switch_to_data1_zone;
-				}
-				ntfs_log_trace("Zone switch: data2 -> mft\n");
-				search_zone = ZONE_MFT;
-				zone_start = vol->mft_zone_pos;
-				zone_end = vol->mft_zone_end;
-				if (zone_start == vol->mft_zone_start)
-					pass = 2;
-				break;
-			}
-			
-			bmp_pos = zone_start;
-			
-			if (zone_start == zone_end) {
-				ntfs_log_trace("Empty zone, skipped.\n");
-				goto done_zones_check;
+#endif
+			{
+				if (lcn_discard_runs(vol, ld))
+					ld->unsupported = TRUE;
+				ld->discarding = FALSE;
 			}
-			
-			continue;
+			lcn_discard_unlock(ld);
+			ld->aging.runs = (struct LCN_FREE_RUN*)NULL;
+			ld->aging.count = 0;
+			ld->aging.allocated = 0;
 		}
-		
-		ntfs_log_trace("All zones are finished, no space on device.\n");
-		err = ENOSPC;
-		goto err_ret;
-	}
-done_ret:
-	ntfs_log_debug("At done_ret.\n");
-	/* Add runlist terminator element. */
-	rl[rlpos].vcn = rl[rlpos - 1].vcn + rl[rlpos - 1].length;
-	rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
-	rl[rlpos].length = 0;
-	if (bitmap_writeback(vol, last_read_pos, br, buf, &writeback)) {
-		err = errno;
-		goto err_ret;
 	}
-done_err_ret:
-	free(buf);
-	if (err) {
-		errno = err;
-		ntfs_log_perror("Failed to allocate clusters");
-		rl = NULL;
+	return (res);
+}
+
+/*
+ *		Start a period, the runs queued becoming aging
+ */
+
+static void lcn_discard_rotate(struct LCN_DISCARD *ld, time_t now)
+{
+	free(ld->aging.runs);
+	ld->aging = ld->queued;
+	ld->queued.runs = (struct LCN_FREE_RUN*)NULL;
+	ld->queued.count = 0;
+	ld->queued.allocated = 0;
+	ld->period = now;
+}
+
+/*
+ *		Check whether freed clusters are waiting for being released
+ */
+
+static BOOL lcn_discard_pending(const ntfs_volume *vol)
+{
+	return (vol && vol->lcn_discard && vol->lcn_discard->pending);
+}
+
+/*
+ *		Release all the pending runs, with the count lock held
+ *
+ *	This is used when clusters could not be allocated, the runs not
+ *	passed to the thread are released without being discarded.
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int lcn_discard_drain(ntfs_volume *vol)
+{
+	struct LCN_DISCARD *ld;
+	int res;
+
+	ld = vol->lcn_discard;
+	lcn_discard_wait(ld);
+	res = lcn_discard_done(vol);
+	if (lcn_discard_release(vol, &ld->aging))
+		res = -1;
+	if (lcn_discard_release(vol, &ld->queued))
+		res = -1;
+	return (res);
+}
+
+/*
+ *		Free the collected runs, with the count lock held
+ *
+ *	When discarding, the runs are queued and they are returned as
+ *	freed, though they are only counted as free when released.
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int lcn_free_runs(ntfs_volume *vol, struct LCN_FREE_LIST *list,
+			s64 *freed)
+{
+	int count;
+	int i;
+
+	if (!vol->lcn_discard || !vol->lcn_discard->active)
+		return (lcn_clear_runs(vol, list, freed));
+	*freed = 0;
+	count = lcn_free_merge(list->runs, list->count);
+	for (i=0; i<count; i++) {
+		if (lcn_discard_queue(vol->lcn_discard,
+				list->runs[i].lcn, list->runs[i].length))
+			return (-1);
+		*freed += list->runs[i].length;
 	}
-out:	
-	ntfs_log_leave("\n");
-	return rl;
+	return (0);
+}
 
-wb_err_ret:
-	ntfs_log_trace("At wb_err_ret.\n");
-	if (bitmap_writeback(vol, last_read_pos, br, buf, &writeback))
-		err = errno;
-err_ret:
-	ntfs_log_trace("At err_ret.\n");
-	if (rl) {
-		/* Add runlist terminator element. */
-		rl[rlpos].vcn = rl[rlpos - 1].vcn + rl[rlpos - 1].length;
-		rl[rlpos].lcn = LCN_RL_NOT_MAPPED;
-		rl[rlpos].length = 0;
-		ntfs_debug_runlist_dump(rl);
-		ntfs_cluster_free_from_rl(vol, rl);
-		free(rl);
-		rl = NULL;
+/**
+ * ntfs_cluster_discard_flush - discard the freed clusters
+ * @vol:	ntfs volume
+ * @all:	TRUE if all the freed clusters have to be discarded, FALSE
+ *		if only those freed for long enough
+ *
+ * The runs discarded are released, then, when the current period is
+ * over, the runs freed during the previous one are passed to the
+ * discarding thread. When @all is set, all the runs freed are discarded
+ * and released before returning, so that the metadata showing them
+ * freed has to be written first.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_cluster_discard_flush(ntfs_volume *vol, BOOL all)
+{
+	struct LCN_DISCARD *ld;
+	time_t now;
+	int res;
+	int i;
+
+	ld = (vol ? vol->lcn_discard : (struct LCN_DISCARD*)NULL);
+	if (!ld)
+		return (0);
+	res = 0;
+	lcn_count_lock(vol);
+	if (all)
+		lcn_discard_wait(ld);
+	if (lcn_discard_done(vol))
+		res = -1;
+	now = time((time_t*)NULL);
+	if (all) {
+			/* the aging runs first, then the queued ones */
+		for (i=0; (i<2) && !res; i++) {
+			if (lcn_discard_submit(vol))
+				res = -1;
+			lcn_discard_wait(ld);
+			if (lcn_discard_done(vol))
+				res = -1;
+			if (!res)
+				lcn_discard_rotate(ld, now);
+		}
+	} else {
+		if ((now >= (ld->period + LCN_DISCARD_DELAY))
+		    && !ld->busy.count) {
+			if (lcn_discard_submit(vol))
+				res = -1;
+			if (!ld->aging.count)
+				lcn_discard_rotate(ld, now);
+		}
 	}
-	goto done_err_ret;
+	lcn_count_unlock(vol);
+	return (res);
 }
 
 /**
- * ntfs_cluster_free_from_rl - free clusters from runlist
- * @vol:	mounted ntfs volume on which to free the clusters
- * @rl:		runlist from which deallocate clusters
+ * ntfs_set_cluster_discard - set or stop discarding the freed clusters
+ * @vol:	ntfs volume, mounted read-write
+ * @on:		TRUE to discard the clusters freed from now on
  *
- * On success return 0 and on error return -1 with errno set to the error code.
+ * Not set in ntfs_mount(). When stopping, the clusters freed are
+ * discarded and released first.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
  */
-int ntfs_cluster_free_from_rl(ntfs_volume *vol, runlist *rl)
+int ntfs_set_cluster_discard(ntfs_volume *vol, BOOL on)
 {
-	s64 nr_freed = 0;
+	struct LCN_DISCARD *ld;
+	int res;
+
+	res = 0;
+	if (!vol || !vol->lcnbmp_na) {
+		errno = EINVAL;
+		res = -1;
+	} else {
+		ld = vol->lcn_discard;
+		if (ld && !on) {
+			res = ntfs_cluster_discard_flush(vol, TRUE);
+			lcn_count_lock(vol);
+				/* runs which could not be released are lost */
+			lcn_discard_drain(vol);
+			lcn_count_unlock(vol);
+#ifdef HAVE_PTHREAD_H
+			if (ld->started) {
+				pthread_mutex_lock(&ld->lock);
+				ld->stop = TRUE;
+				pthread_cond_signal(&ld->cond);
+				pthread_mutex_unlock(&ld->lock);
+				pthread_join(ld->thread, (void**)NULL);
+				ld->started = FALSE;
+				pthread_cond_destroy(&ld->cond);
+				pthread_mutex_destroy(&ld->lock);
+			}
+#endif
+			free(ld);
+			vol->lcn_discard = (struct LCN_DISCARD*)NULL;
+		}
+		if (!ld && on) {
+			if (NVolReadOnly(vol)) {
+				errno = EROFS;
+				return (-1);
+			}
+			ld = (struct LCN_DISCARD*)ntfs_calloc(
+					sizeof(struct LCN_DISCARD));
+			if (!ld)
+				return (-1);
+			ld->period = time((time_t*)NULL);
+			ld->active = TRUE;
+			vol->lcn_discard = ld;
+#ifdef HAVE_PTHREAD_H
+			if (!pthread_mutex_init(&ld->lock,
+					(pthread_mutexattr_t*)NULL)) {
+				if (!pthread_cond_init(&ld->cond,
+					(pthread_condattr_t*)NULL)) {
+					ld->started = !pthread_create(
+						&ld->thread,
+						(pthread_attr_t*)NULL,
+						lcn_discard_thread,
+						(void*)vol);
+					if (!ld->started)
+						pthread_cond_destroy(
+							&ld->cond);
+				}
+				if (!ld->started)
+					pthread_mutex_destroy(&ld->lock);
+			}
+			if (!ld->started)
+				ntfs_log_error("Could not discard in the"
+					" background\n");
+#endif
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Free clusters from a runlist, with the count lock held
+ */
+
+static int lcn_free_from_rl(ntfs_volume *vol, runlist *rl)
+{
+	struct LCN_FREE_LIST list;
+	s64 nr_freed;
 	int ret = -1;
 
 	ntfs_log_trace("Entering.\n");
@@ -585,35 +2368,41 @@ int ntfs_cluster_free_from_rl(ntfs_volume *vol, runlist *rl)
 		errno = EINVAL;
 		return -1;
 	}
+	list.runs = (struct LCN_FREE_RUN*)NULL;
+	list.count = 0;
+	list.allocated = 0;
 	for (; rl->length; rl++) {
 
 		ntfs_log_trace("Dealloc lcn 0x%llx, len 0x%llx.\n",
 			       (long long)rl->lcn, (long long)rl->length);
 
-		if (rl->lcn >= 0) { 
-			update_full_status(vol,rl->lcn);
-			if (ntfs_bitmap_clear_run(vol->lcnbmp_na, rl->lcn, 
-						  rl->length)) {
-				ntfs_log_perror("Cluster deallocation failed "
-					       "(%lld, %lld)",
-						(long long)rl->lcn, 
-						(long long)rl->length);
-				goto out;
-			}
-			nr_freed += rl->length ; 
-		}
+		if ((rl->lcn >= 0)
+		    && lcn_free_add(&list, rl->lcn, rl->length))
+			goto out;
 	}
-
-	ret = 0;
+	ret = lcn_free_runs(vol, &list, &nr_freed);
 out:
-	vol->free_clusters += nr_freed; 
-	if (vol->free_clusters > vol->nr_clusters)
-		ntfs_log_error("Too many free clusters (%lld > %lld)!",
-			       (long long)vol->free_clusters, 
-			       (long long)vol->nr_clusters);
+	free(list.runs);
 	return ret;
 }
 
+/**
+ * ntfs_cluster_free_from_rl - free clusters from runlist
+ * @vol:	mounted ntfs volume on which to free the clusters
+ * @rl:		runlist from which deallocate clusters
+ *
+ * On success return 0 and on error return -1 with errno set to the error code.
+ */
+int ntfs_cluster_free_from_rl(ntfs_volume *vol, runlist *rl)
+{
+	int ret;
+
+	lcn_count_lock(vol);
+	ret = lcn_free_from_rl(vol, rl);
+	lcn_count_unlock(vol);
+	return (ret);
+}
+
 /*
  *		Basic cluster run free
  *	Returns 0 if successful
@@ -628,7 +2417,11 @@ int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count)
 	ntfs_log_trace("Dealloc lcn 0x%llx, len 0x%llx.\n",
 			       (long long)lcn, (long long)count);
 
-	if (lcn >= 0) { 
+	lcn_count_lock(vol);
+	if ((lcn >= 0) && vol->lcn_discard && vol->lcn_discard->active) {
+		if (lcn_discard_queue(vol->lcn_discard, lcn, count))
+			goto out;
+	} else if (lcn >= 0) { 
 		update_full_status(vol,lcn);
 		if (ntfs_bitmap_clear_run(vol->lcnbmp_na, lcn, 
 						  count)) {
@@ -639,6 +2432,8 @@ int ntfs_cluster_free_basic(ntfs_volume *vol, s64 lcn, s64 count)
 				goto out;
 		}
 		nr_freed += count; 
+		lcn_summary_update(vol, lcn, count, TRUE);
+		lcn_count_update(vol, lcn, count, TRUE);
 	}
 	ret = 0;
 out:
@@ -647,6 +2442,7 @@ out:
 		ntfs_log_error("Too many free clusters (%lld > %lld)!",
 			       (long long)vol->free_clusters, 
 			       (long long)vol->nr_clusters);
+	lcn_count_unlock(vol);
 	return ret;
 }
 
@@ -668,6 +2464,7 @@ out:
  */
 int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 {
+	struct LCN_FREE_LIST list;
 	runlist *rl;
 	s64 delta, to_free, nr_freed = 0;
 	int ret = -1;
@@ -683,6 +2480,12 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 		       "vcn 0x%llx.\n", (unsigned long long)na->ni->mft_no,
 		       le32_to_cpu(na->type), (long long)count, (long long)start_vcn);
 
+	list.runs = (struct LCN_FREE_RUN*)NULL;
+	list.count = 0;
+	list.allocated = 0;
+	lcn_count_lock(vol);
+	if (ntfs_attr_rl_expand(na))
+		goto leave;
 	rl = ntfs_attr_find_vcn(na, start_vcn);
 	if (!rl) {
 		if (errno == ENOENT)
@@ -705,14 +2508,9 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 	if (count >= 0 && to_free > count)
 		to_free = count;
 
-	if (rl->lcn != LCN_HOLE) {
-		/* Do the actual freeing of the clusters in this run. */
-		update_full_status(vol,rl->lcn + delta);
-		if (ntfs_bitmap_clear_run(vol->lcnbmp_na, rl->lcn + delta,
-					  to_free))
-			goto leave;
-		nr_freed = to_free;
-	} 
+	if ((rl->lcn != LCN_HOLE)
+	    && lcn_free_add(&list, rl->lcn + delta, to_free))
+		goto leave;
 
 	/* Go to the next run and adjust the number of clusters left to free. */
 	++rl;
@@ -721,17 +2519,17 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 
 	/*
 	 * Loop over the remaining runs, using @count as a capping value, and
-	 * free them.
+	 * collect them, so that they are all freed in a single pass
+	 * over $Bitmap.
 	 */
 	for (; rl->length && count != 0; ++rl) {
 		// FIXME: Need to try ntfs_attr_map_runlist() for attribute
 		//	  list support! (AIA)
 		if (rl->lcn < 0 && rl->lcn != LCN_HOLE) {
-			// FIXME: Eeek! We need rollback! (AIA)
 			errno = EIO;
 			ntfs_log_perror("%s: Invalid lcn (%lli)", 
 					__FUNCTION__, (long long)rl->lcn);
-			goto out;
+			goto leave;
 		}
 
 		/* The number of clusters in this run that need freeing. */
@@ -739,17 +2537,9 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 		if (count >= 0 && to_free > count)
 			to_free = count;
 
-		if (rl->lcn != LCN_HOLE) {
-			update_full_status(vol,rl->lcn);
-			if (ntfs_bitmap_clear_run(vol->lcnbmp_na, rl->lcn,
-					to_free)) {
-				// FIXME: Eeek! We need rollback! (AIA)
-				ntfs_log_perror("%s: Clearing bitmap run failed",
-						__FUNCTION__);
-				goto out;
-			}
-			nr_freed += to_free;
-		}
+		if ((rl->lcn != LCN_HOLE)
+		    && lcn_free_add(&list, rl->lcn, to_free))
+			goto leave;
 
 		if (count >= 0)
 			count -= to_free;
@@ -760,17 +2550,154 @@ int ntfs_cluster_free(ntfs_volume *vol, ntfs_attr *na, VCN start_vcn, s64 count)
 		errno = EIO;
 		ntfs_log_perror("%s: count still not zero (%lld)", __FUNCTION__,
 			       (long long)count);
-		goto out;
+		goto leave;
 	}
 
+	if (lcn_free_runs(vol, &list, &nr_freed)) {
+		// FIXME: Eeek! We need rollback! (AIA)
+		ntfs_log_perror("%s: Clearing bitmap run failed",
+				__FUNCTION__);
+		goto leave;
+	}
 	ret = nr_freed;
-out:
-	vol->free_clusters += nr_freed ; 
-	if (vol->free_clusters > vol->nr_clusters)
-		ntfs_log_error("Too many free clusters (%lld > %lld)!",
-			       (long long)vol->free_clusters, 
-			       (long long)vol->nr_clusters);
 leave:	
+	lcn_count_unlock(vol);
+	free(list.runs);
 	ntfs_log_leave("\n");
 	return ret;
 }
+
+/*
+ *		Pass an extent of free clusters, clipped to [first, last)
+ *	and split to at most max_count
+ */
+
+static int free_extent_pass(ntfs_volume *vol, LCN lcn, s64 count,
+		LCN first, LCN last, s64 max_count,
+		ntfs_free_extent_t callback, void *data)
+{
+	s64 len;
+	int res;
+
+	if (lcn < first) {
+		count -= first - lcn;
+		lcn = first;
+	}
+	if (lcn + count > last)
+		count = last - lcn;
+	res = 0;
+	while ((count > 0) && !res) {
+		len = count;
+		if (max_count && (len > max_count))
+			len = max_count;
+		res = callback(vol, lcn, len, data);
+		lcn += len;
+		count -= len;
+	}
+	return (res);
+}
+
+/**
+ * ntfs_cluster_free_extents - pass the extents of free clusters to a callback
+ * @vol:	ntfs volume
+ * @start:	first cluster to consider
+ * @count:	number of clusters to consider from @start
+ * @max_count:	max number of clusters in an extent, zero for no limit
+ * @callback:	function called for each extent
+ * @data:	parameter passed to @callback
+ *
+ * $Bitmap is read by chunks of NTFS_FREE_EXTENTS_BSIZE bytes, with the
+ * bytes all set or all clear being checked at once, and the runs of free
+ * clusters in each chunk are passed in order to @callback, split so that
+ * they do not exceed @max_count.
+ *
+ * Each chunk is read and its extents are passed with the allocation lock
+ * held, so that the clusters passed cannot be allocated meanwhile, and the
+ * runs are cut at the chunk boundaries, where the lock is released. Hence
+ * the callback must not allocate or free clusters.
+ *
+ * Returns 0 when all the free clusters have been passed, the positive
+ * value returned by @callback if it stopped the walk, or -1 on error,
+ * with errno set to the error code.
+ */
+int ntfs_cluster_free_extents(ntfs_volume *vol, LCN start, s64 count,
+		s64 max_count, ntfs_free_extent_t callback, void *data)
+{
+	u8 *buf;
+	s64 pos;
+	s64 end;
+	s64 br;
+	s64 i;
+	LCN lcn;
+	LCN first;
+	LCN last;
+	LCN run;
+	int bit;
+	int res;
+
+	if (!vol || !vol->lcnbmp_na || !callback || (max_count < 0)
+	    || (start < 0) || (count < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	buf = (u8*)ntfs_malloc(NTFS_FREE_EXTENTS_BSIZE);
+	if (!buf)
+		return (-1);
+	res = 0;
+	first = start;
+	last = (count > vol->nr_clusters - start
+			? vol->nr_clusters : start + count);
+	end = (last + 7) >> 3;
+	for (pos = first >> 3; (pos < end) && !res; pos += br) {
+		br = end - pos;
+		if (br > NTFS_FREE_EXTENTS_BSIZE)
+			br = NTFS_FREE_EXTENTS_BSIZE;
+		lcn_count_lock(vol);
+		br = ntfs_lcnbmp_pread(vol, pos, br, buf);
+		if (br <= 0) {
+			lcn_count_unlock(vol);
+			if (!br)
+				errno = EIO;
+			ntfs_log_perror("Failed to read $Bitmap");
+			res = -1;
+			break;
+		}
+		run = -1;	/* first cluster of the current free run */
+		for (i = 0; (i < br) && !res; i++) {
+			lcn = (pos + i) << 3;
+			if (buf[i] == 0xff) {
+				if (run >= 0) {
+					res = free_extent_pass(vol, run,
+						lcn - run, first, last,
+						max_count, callback, data);
+					run = -1;
+				}
+			} else if (!buf[i]) {
+				if (run < 0)
+					run = lcn;
+			} else {
+				for (bit = 0; (bit < 8) && !res; bit++) {
+					if (buf[i] & (1 << bit)) {
+						if (run >= 0) {
+							res = free_extent_pass(
+								vol, run,
+								lcn + bit - run,
+								first, last,
+								max_count,
+								callback, data);
+							run = -1;
+						}
+					} else if (run < 0)
+						run = lcn + bit;
+				}
+			}
+		}
+		if (!res && (run >= 0))
+			res = free_extent_pass(vol, run,
+					((pos + br) << 3) - run, first, last,
+					max_count, callback, data);
+		lcn_count_unlock(vol);
+	}
+	free(buf);
+	return (res);
+}
@@ -43,6 +43,12 @@
 #include "logging.h"
 #include "misc.h"
 
+/*
+ * Size cleared at the beginning of $LogFile when emptying it : two restart
+ * pages of the biggest page size in use (64K)
+ */
+#define LOGFILE_RESET_HEAD 131072
+
 /**
  * ntfs_check_restart_page_header - check the page header for consistency
  * @rp:		restart page header to check
@@ -700,13 +706,19 @@ BOOL ntfs_is_logfile_clean(ntfs_attr *log_na, RESTART_PAGE_HEADER *rp)
  * Empty the contents of the $LogFile journal @na and return 0 on success and
  * -1 on error.
  *
+ * Only the restart pages and the blocks probed by ntfs_check_logfile() are
+ * filled with 0xff : with no valid restart page, the log records beyond
+ * cannot be reached, the log is seen as empty and Windows reinitializes it
+ * on next mount. This avoids rewriting the whole journal, which may be
+ * several tens of megabytes.
+ *
  * This function assumes that the $LogFile journal has already been consistency
  * checked by a call to ntfs_check_logfile() and that ntfs_is_logfile_clean()
  * has been used to ensure that the $LogFile is clean.
  */
 int ntfs_empty_logfile(ntfs_attr *na)
 {
-	s64 pos, count;
+	s64 pos, count, size;
 	char buf[NTFS_BUF_SIZE];
 
 	ntfs_log_trace("Entering.\n");
@@ -722,11 +734,22 @@ int ntfs_empty_logfile(ntfs_attr *na)
 
 	memset(buf, -1, NTFS_BUF_SIZE);
 
+	/*
+	 * Fully clear the two restart pages, for the biggest page size,
+	 * then the first block of every location where ntfs_check_logfile()
+	 * looks for a restart page.
+	 */
+	size = na->data_size;
 	pos = 0;
-	while ((count = na->data_size - pos) > 0) {
+	while ((count = size - pos) > 0) {
 		
-		if (count > NTFS_BUF_SIZE)
-			count = NTFS_BUF_SIZE;
+		if (pos < LOGFILE_RESET_HEAD) {
+			if (count > NTFS_BUF_SIZE)
+				count = NTFS_BUF_SIZE;
+		} else {
+			if (count > NTFS_BLOCK_SIZE)
+				count = NTFS_BLOCK_SIZE;
+		}
 
 		count = ntfs_attr_pwrite(na, pos, count, buf);
 		if (count <= 0) {
@@ -735,7 +758,10 @@ int ntfs_empty_logfile(ntfs_attr *na)
 				errno = EIO;
 			return -1;
 		}
-		pos += count;
+		if (pos < LOGFILE_RESET_HEAD)
+			pos += count;
+		else
+			pos <<= 1;
 	}
 
 	NVolSetLogFileEmpty(na->ni->vol);
@@ -101,6 +101,30 @@ static struct ntfs_logging ntfs_log = {
 #endif
 };
 
+/*
+ *		The levels which are actually logged, cleared when messages
+ *	go to the null handler, so that the logging macros can skip the
+ *	formatting of arguments and the call to ntfs_log_redirect().
+ */
+u32 ntfs_log_active_levels =
+#ifdef ENABLE_DEBUG
+	NTFS_LOG_LEVEL_DEBUG | NTFS_LOG_LEVEL_TRACE | NTFS_LOG_LEVEL_ENTER |
+	NTFS_LOG_LEVEL_LEAVE |
+	NTFS_LOG_LEVEL_INFO | NTFS_LOG_LEVEL_QUIET | NTFS_LOG_LEVEL_WARNING |
+	NTFS_LOG_LEVEL_ERROR | NTFS_LOG_LEVEL_PERROR | NTFS_LOG_LEVEL_CRITICAL |
+	NTFS_LOG_LEVEL_PROGRESS;
+#else
+	0;
+#endif
+
+static void ntfs_log_update_active(void)
+{
+	if (ntfs_log.handler == ntfs_log_handler_null)
+		ntfs_log_active_levels = 0;
+	else
+		ntfs_log_active_levels = ntfs_log.levels;
+}
+
 
 /**
  * ntfs_log_get_levels - Get a list of the current logging levels
@@ -128,6 +152,7 @@ u32 ntfs_log_set_levels(u32 levels)
 	u32 old;
 	old = ntfs_log.levels;
 	ntfs_log.levels |= levels;
+	ntfs_log_update_active();
 	return old;
 }
 
@@ -145,6 +170,7 @@ u32 ntfs_log_clear_levels(u32 levels)
 	u32 old;
 	old = ntfs_log.levels;
 	ntfs_log.levels &= (~levels);
+	ntfs_log_update_active();
 	return old;
 }
 
@@ -302,6 +328,7 @@ void ntfs_log_set_handler(ntfs_log_handler *handler)
 #endif
 	} else
 		ntfs_log.handler = ntfs_log_handler_null;
+	ntfs_log_update_active();
 }
 
 /**
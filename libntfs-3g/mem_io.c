@@ -0,0 +1,712 @@
+/**
+ * mem_io.c - Memory based disk io functions, for testing and benchmarking.
+ *
+ * Copyright (c) 2026 ntfs-3g contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *	These device operations serve a volume from memory, so that the
+ *	processing costs of the library can be measured without the noise
+ *	of a real device. They are selected by prefixing the name of an
+ *	image file by "mem:" or "mmap:", with optional settings :
+ *
+ *		mem[,latency=US][,stats]:FILE
+ *		mmap[,latency=US][,stats]:FILE
+ *
+ *	With "mem:" the whole image is read into memory when the device
+ *	is opened, and the changes are discarded when it is closed, so
+ *	that each run starts from the same state. With "mmap:" the image
+ *	is mapped, and the changes are written back to the file.
+ *
+ *	latency=US delays each transfer by US microseconds, a batched
+ *	transfer being delayed once. stats logs the count of transfers
+ *	when the device is closed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "types.h"
+#include "device.h"
+#include "stats.h"
+#include "logging.h"
+#include "misc.h"
+
+#ifdef NTFS_DEVICE_MEM_IO_OPS
+
+#define DEV_MEM(dev) ((struct ntfs_mem_private*)dev->d_private)
+
+#define MEM_SECTOR_SIZE 512	/* sector size reported */
+
+struct ntfs_mem_private {
+	char *buf;		/* the image, copied or mapped */
+	s64 size;		/* size of the image */
+	s64 pos;		/* position for read() and write() */
+	u32 latency;		/* microseconds added to each transfer */
+	BOOL mapped;		/* the image is mapped, not copied */
+	BOOL stats;		/* log the counters on closing */
+	u64 reads;
+	u64 read_bytes;
+	u64 writes;
+	u64 written_bytes;
+	u64 syncs;
+} ;
+
+/*
+ *		Parse the prefix of a device name
+ *
+ *	Returns the length of the prefix, including the final ':',
+ *		or zero if the name has no valid memory device prefix
+ */
+
+static int mem_parse(const char *name, BOOL *mapped, u32 *latency,
+			BOOL *stats)
+{
+	const char *p;
+	char *end;
+	unsigned long value;
+	int len;
+
+	if (!strncmp(name, "mem", 3)) {
+		*mapped = FALSE;
+		p = &name[3];
+	} else
+		if (!strncmp(name, "mmap", 4)) {
+			*mapped = TRUE;
+			p = &name[4];
+		} else
+			return (0);
+	*latency = 0;
+	*stats = FALSE;
+	while (*p == ',') {
+		p++;
+		len = strcspn(p, ",:");
+		if ((len == 5) && !strncmp(p, "stats", 5))
+			*stats = TRUE;
+		else
+			if (!strncmp(p, "latency=", 8)) {
+				value = strtoul(&p[8], &end, 10);
+				if ((end != &p[len]) || (end == &p[8])
+				    || (value > 10000000))
+					return (0);
+				*latency = value;
+			} else
+				return (0);
+		p += len;
+	}
+	if ((*p != ':') || !p[1])
+		return (0);
+	return (p - name + 1);
+}
+
+/**
+ * ntfs_device_mem_name - Check whether a name designates a memory device
+ * @name:	name of the device
+ *
+ * Returns the length of the prefix, so that the name of the backing
+ *	file starts just after it, or zero if the name has no valid
+ *	"mem:" or "mmap:" prefix
+ */
+int ntfs_device_mem_name(const char *name)
+{
+	BOOL mapped;
+	BOOL stats;
+	u32 latency;
+
+	return (name ? mem_parse(name, &mapped, &latency, &stats) : 0);
+}
+
+/*
+ *		Wait for the injected latency
+ */
+
+static void mem_delay(struct ntfs_mem_private *mem)
+{
+#ifdef HAVE_TIME_H
+	struct timespec ts;
+
+	if (mem->latency) {
+		ts.tv_sec = mem->latency/1000000;
+		ts.tv_nsec = (mem->latency%1000000)*1000;
+		while (nanosleep(&ts, &ts) && (errno == EINTR)) { }
+	}
+#endif
+}
+
+/*
+ *		Get the count of bytes which can be transferred at a position
+ *
+ *	Returns 0 beyond the end of the image, -1 for a bad position
+ */
+
+static s64 mem_available(struct ntfs_mem_private *mem, s64 count, s64 pos)
+{
+	if ((pos < 0) || (count < 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (pos >= mem->size)
+		return (0);
+	return (count < (mem->size - pos) ? count : mem->size - pos);
+}
+
+/**
+ * ntfs_device_mem_io_open - Load or map the image of a device
+ * @dev:	device to open
+ * @flags:	open flags, O_RDWR for writing
+ *
+ * Returns 0 if successful, -1 with errno set otherwise
+ */
+static int ntfs_device_mem_io_open(struct ntfs_device *dev, int flags)
+{
+	struct ntfs_mem_private *mem;
+	struct stat sbuf;
+	const char *path;
+	s64 done;
+	s64 br;
+	int prefix;
+	int err;
+	int fd;
+
+	if (NDevOpen(dev)) {
+		errno = EBUSY;
+		return -1;
+	}
+	mem = (struct ntfs_mem_private*)ntfs_calloc(
+			sizeof(struct ntfs_mem_private));
+	if (!mem)
+		return -1;
+	prefix = mem_parse(dev->d_name, &mem->mapped, &mem->latency,
+			&mem->stats);
+	if (!prefix) {
+		free(mem);
+		errno = EINVAL;
+		return -1;
+	}
+	path = &dev->d_name[prefix];
+	if ((flags & O_RDWR) != O_RDWR)
+		NDevSetReadOnly(dev);
+	fd = open(path, (mem->mapped && !NDevReadOnly(dev)
+				? O_RDWR : O_RDONLY));
+	if (fd < 0) {
+		err = errno;
+		ntfs_log_perror("Failed to open '%s'", path);
+		goto err_free;
+	}
+	if (fstat(fd, &sbuf)) {
+		err = errno;
+		goto err_close;
+	}
+	if (S_ISBLK(sbuf.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &mem->size)) {
+			err = errno;
+			goto err_close;
+		}
+	} else
+		mem->size = sbuf.st_size;
+	if (mem->size <= 0) {
+		err = EINVAL;
+		goto err_close;
+	}
+	if (mem->mapped) {
+		mem->buf = (char*)mmap((void*)NULL, mem->size,
+				(NDevReadOnly(dev) ? PROT_READ
+					: PROT_READ | PROT_WRITE),
+				MAP_SHARED, fd, 0);
+		if (mem->buf == (char*)MAP_FAILED) {
+			err = errno;
+			ntfs_log_perror("Failed to map '%s'", path);
+			goto err_close;
+		}
+	} else {
+		mem->buf = (char*)ntfs_malloc(mem->size);
+		if (!mem->buf) {
+			err = errno;
+			goto err_close;
+		}
+		for (done=0; done<mem->size; done+=br) {
+			br = pread(fd, &mem->buf[done], mem->size - done, done);
+			if (br <= 0) {
+				err = (br ? errno : EIO);
+				ntfs_log_perror("Failed to load '%s'", path);
+				free(mem->buf);
+				goto err_close;
+			}
+		}
+	}
+	if (close(fd)) {
+		err = errno;
+		if (mem->mapped)
+			munmap(mem->buf, mem->size);
+		else
+			free(mem->buf);
+		goto err_free;
+	}
+	dev->d_private = mem;
+	if (NDevReadOnly(dev))
+		NDevSetMapped(dev);
+	NDevSetOpen(dev);
+	return 0;
+err_close:
+	close(fd);
+err_free:
+	free(mem);
+	NDevClearReadOnly(dev);
+	errno = err;
+	return -1;
+}
+
+/**
+ * ntfs_device_mem_io_close - Release the image of a device
+ * @dev:	device to close
+ *
+ * The changes are written back to a mapped image, and discarded
+ * from a loaded one.
+ *
+ * Returns 0 if successful, -1 with errno set otherwise
+ */
+static int ntfs_device_mem_io_close(struct ntfs_device *dev)
+{
+	struct ntfs_mem_private *mem;
+	int res;
+
+	if (!NDevOpen(dev)) {
+		errno = EBADF;
+		ntfs_log_perror("Device %s is not open", dev->d_name);
+		return -1;
+	}
+	mem = DEV_MEM(dev);
+	res = 0;
+	if (mem->stats)
+		ntfs_log_info("%s : %llu reads (%llu bytes), %llu writes"
+			" (%llu bytes), %llu syncs\n", dev->d_name,
+			(unsigned long long)mem->reads,
+			(unsigned long long)mem->read_bytes,
+			(unsigned long long)mem->writes,
+			(unsigned long long)mem->written_bytes,
+			(unsigned long long)mem->syncs);
+	if (mem->mapped) {
+		if (NDevDirty(dev) && msync(mem->buf, mem->size, MS_SYNC)) {
+			ntfs_log_perror("Failed to sync device %s",
+					dev->d_name);
+			res = -1;
+		}
+		if (munmap(mem->buf, mem->size))
+			res = -1;
+	} else
+		free(mem->buf);
+	free(mem);
+	dev->d_private = NULL;
+	NDevClearMapped(dev);
+	NDevClearOpen(dev);
+	return res;
+}
+
+/**
+ * ntfs_device_mem_io_seek - Seek to a place on the device
+ * @dev:	device to seek on
+ * @offset:	offset of the position
+ * @whence:	SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * Returns the new position, or -1 with errno set
+ */
+static s64 ntfs_device_mem_io_seek(struct ntfs_device *dev, s64 offset,
+		int whence)
+{
+	struct ntfs_mem_private *mem;
+	s64 pos;
+
+	mem = DEV_MEM(dev);
+	switch (whence) {
+	case SEEK_SET :
+		pos = offset;
+		break;
+	case SEEK_CUR :
+		pos = mem->pos + offset;
+		break;
+	case SEEK_END :
+		pos = mem->size + offset;
+		break;
+	default :
+		pos = -1;
+		break;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	mem->pos = pos;
+	return pos;
+}
+
+/**
+ * ntfs_device_mem_io_pread - Perform a positioned read from the device
+ * @dev:	device to read from
+ * @buf:	buffer to read into
+ * @count:	number of bytes to read
+ * @offset:	position on the device
+ *
+ * Returns the number of bytes read, 0 beyond the end of the device,
+ *	or -1 with errno set
+ */
+static s64 ntfs_device_mem_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	struct ntfs_mem_private *mem;
+	s64 br;
+
+	mem = DEV_MEM(dev);
+	br = mem_available(mem, count, offset);
+	if (br > 0) {
+		mem_delay(mem);
+		memcpy(buf, &mem->buf[offset], br);
+		NTFS_STATS_ADD(mem->reads, 1);
+		NTFS_STATS_ADD(mem->read_bytes, br);
+	}
+	return br;
+}
+
+/**
+ * ntfs_device_mem_io_pwrite - Perform a positioned write to the device
+ * @dev:	device to write to
+ * @buf:	data to write
+ * @count:	number of bytes to write
+ * @offset:	position on the device
+ *
+ * Returns the number of bytes written, or -1 with errno set (ENOSPC
+ *	beyond the end of the device)
+ */
+static s64 ntfs_device_mem_io_pwrite(struct ntfs_device *dev,
+		const void *buf, s64 count, s64 offset)
+{
+	struct ntfs_mem_private *mem;
+	s64 bw;
+
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	mem = DEV_MEM(dev);
+	bw = mem_available(mem, count, offset);
+	if (!bw && count) {
+		errno = ENOSPC;
+		bw = -1;
+	}
+	if (bw > 0) {
+		NDevSetDirty(dev);
+		mem_delay(mem);
+		memcpy(&mem->buf[offset], buf, bw);
+		NTFS_STATS_ADD(mem->writes, 1);
+		NTFS_STATS_ADD(mem->written_bytes, bw);
+	}
+	return bw;
+}
+
+/**
+ * ntfs_device_mem_io_read - Read from the device, from the current location
+ * @dev:	device to read from
+ * @buf:	buffer to read into
+ * @count:	number of bytes to read
+ *
+ * Returns the number of bytes read, or -1 with errno set
+ */
+static s64 ntfs_device_mem_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	s64 br;
+
+	br = ntfs_device_mem_io_pread(dev, buf, count, DEV_MEM(dev)->pos);
+	if (br > 0)
+		DEV_MEM(dev)->pos += br;
+	return br;
+}
+
+/**
+ * ntfs_device_mem_io_write - Write to the device, at the current location
+ * @dev:	device to write to
+ * @buf:	data to write
+ * @count:	number of bytes to write
+ *
+ * Returns the number of bytes written, or -1 with errno set
+ */
+static s64 ntfs_device_mem_io_write(struct ntfs_device *dev, const void *buf,
+		s64 count)
+{
+	s64 bw;
+
+	bw = ntfs_device_mem_io_pwrite(dev, buf, count, DEV_MEM(dev)->pos);
+	if (bw > 0)
+		DEV_MEM(dev)->pos += bw;
+	return bw;
+}
+
+/**
+ * ntfs_device_mem_io_preadv - Perform a batched read from the device
+ * @dev:	device to read from
+ * @seg:	segments to read
+ * @nseg:	number of segments
+ *
+ * All the segments are read at once, with a single delay, stopping
+ * at the end of the device.
+ *
+ * Returns the number of bytes read, or -1 if an error occurred.
+ */
+static s64 ntfs_device_mem_io_preadv(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	struct ntfs_mem_private *mem;
+	s64 total;
+	s64 br;
+	int i;
+
+	mem = DEV_MEM(dev);
+	mem_delay(mem);
+	total = 0;
+	for (i=0; i<nseg; i++) {
+		br = mem_available(mem, seg[i].count, seg[i].pos);
+		if (br < 0)
+			return (total ? total : -1);
+		if (br > 0)
+			memcpy(seg[i].buf, &mem->buf[seg[i].pos], br);
+		total += br;
+		if (br < seg[i].count)
+			break;
+	}
+	NTFS_STATS_ADD(mem->reads, 1);
+	NTFS_STATS_ADD(mem->read_bytes, total);
+	return total;
+}
+
+/**
+ * ntfs_device_mem_io_pwritev - Perform a batched write to the device
+ * @dev:	device to write to
+ * @seg:	segments to write
+ * @nseg:	number of segments
+ *
+ * Returns the number of bytes written, or -1 if an error occurred.
+ */
+static s64 ntfs_device_mem_io_pwritev(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	struct ntfs_mem_private *mem;
+	s64 total;
+	s64 bw;
+	int i;
+
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	mem = DEV_MEM(dev);
+	NDevSetDirty(dev);
+	mem_delay(mem);
+	total = 0;
+	for (i=0; i<nseg; i++) {
+		bw = mem_available(mem, seg[i].count, seg[i].pos);
+		if (bw < 0)
+			return (total ? total : -1);
+		if (bw > 0)
+			memcpy(&mem->buf[seg[i].pos], seg[i].buf, bw);
+		total += bw;
+		if (bw < seg[i].count)
+			break;
+	}
+	if (!total && nseg) {
+		errno = ENOSPC;
+		return -1;
+	}
+	NTFS_STATS_ADD(mem->writes, 1);
+	NTFS_STATS_ADD(mem->written_bytes, total);
+	return total;
+}
+
+/**
+ * ntfs_device_mem_io_map - Access in place to a read-only image
+ * @dev:	device to read from
+ * @count:	number of bytes wanted
+ * @offset:	position on the device
+ *
+ * Only called for read-only devices, which are flagged as mapped.
+ *
+ * Returns a pointer into the image, or NULL if the data is beyond
+ *	its end
+ */
+static const void *ntfs_device_mem_io_map(struct ntfs_device *dev,
+		s64 count, s64 offset)
+{
+	struct ntfs_mem_private *mem;
+
+	mem = DEV_MEM(dev);
+	if (offset > (mem->size - count))
+		return ((const void*)NULL);
+	mem_delay(mem);
+	NTFS_STATS_ADD(mem->reads, 1);
+	NTFS_STATS_ADD(mem->read_bytes, count);
+	return (&mem->buf[offset]);
+}
+
+/**
+ * ntfs_device_mem_io_sync - Flush the changes of a mapped image
+ * @dev:	device to sync
+ *
+ * Returns 0 if successful, -1 with errno set otherwise
+ */
+static int ntfs_device_mem_io_sync(struct ntfs_device *dev)
+{
+	struct ntfs_mem_private *mem;
+	int res;
+
+	res = 0;
+	mem = DEV_MEM(dev);
+	if (!NDevReadOnly(dev)) {
+		NTFS_STATS_ADD(mem->syncs, 1);
+		if (mem->mapped && msync(mem->buf, mem->size, MS_SYNC)) {
+			ntfs_log_perror("Failed to sync device %s",
+					dev->d_name);
+			res = -1;
+		} else
+			NDevClearDirty(dev);
+	}
+	return res;
+}
+
+/**
+ * ntfs_device_mem_io_stat - Get information about the device
+ * @dev:	device to describe
+ * @buf:	the description, as for a regular file
+ *
+ * Returns 0
+ */
+static int ntfs_device_mem_io_stat(struct ntfs_device *dev, struct stat *buf)
+{
+	memset(buf, 0, sizeof(struct stat));
+	buf->st_mode = S_IFREG | (NDevReadOnly(dev) ? 0444 : 0644);
+	buf->st_size = DEV_MEM(dev)->size;
+	buf->st_blksize = MEM_SECTOR_SIZE;
+	buf->st_blocks = DEV_MEM(dev)->size/512;
+	return 0;
+}
+
+/**
+ * ntfs_device_mem_io_ioctl - Perform an ioctl on the device
+ * @dev:	device
+ * @request:	the ioctl
+ * @argp:	argument of the ioctl
+ *
+ * Only the size requests, and zeroing out or discarding ranges, are
+ * supported.
+ *
+ * Returns 0 if successful, -1 with errno set otherwise
+ */
+static int ntfs_device_mem_io_ioctl(struct ntfs_device *dev,
+		unsigned long request, void *argp)
+{
+	struct ntfs_mem_private *mem;
+	u64 *range;
+
+	mem = DEV_MEM(dev);
+	switch (request) {
+#ifdef BLKGETSIZE64
+	case BLKGETSIZE64 :
+		*(u64*)argp = mem->size;
+		return 0;
+#endif
+#ifdef BLKSSZGET
+	case BLKSSZGET :
+		*(int*)argp = MEM_SECTOR_SIZE;
+		return 0;
+#endif
+#if defined(BLKDISCARD) && defined(BLKZEROOUT)
+	case BLKDISCARD :
+	case BLKZEROOUT :
+		range = (u64*)argp;
+		if (NDevReadOnly(dev)) {
+			errno = EROFS;
+			return -1;
+		}
+		if ((range[0] > (u64)mem->size)
+		    || (range[1] > ((u64)mem->size - range[0]))) {
+			errno = EINVAL;
+			return -1;
+		}
+		NDevSetDirty(dev);
+		memset(&mem->buf[range[0]], 0, range[1]);
+		return 0;
+#endif
+	default :
+		(void)range;
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+/**
+ * Device operations for working with images in memory.
+ */
+struct ntfs_device_operations ntfs_device_mem_io_ops = {
+	.open		= ntfs_device_mem_io_open,
+	.close		= ntfs_device_mem_io_close,
+	.seek		= ntfs_device_mem_io_seek,
+	.read		= ntfs_device_mem_io_read,
+	.write		= ntfs_device_mem_io_write,
+	.pread		= ntfs_device_mem_io_pread,
+	.pwrite		= ntfs_device_mem_io_pwrite,
+	.preadv		= ntfs_device_mem_io_preadv,
+	.pwritev	= ntfs_device_mem_io_pwritev,
+	.map		= ntfs_device_mem_io_map,
+	.sync		= ntfs_device_mem_io_sync,
+	.stat		= ntfs_device_mem_io_stat,
+	.ioctl		= ntfs_device_mem_io_ioctl,
+};
+
+#endif /* NTFS_DEVICE_MEM_IO_OPS */
@@ -42,6 +42,9 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include <time.h>
 
 #include "compat.h"
@@ -56,7 +59,469 @@
 #include "lcnalloc.h"
 #include "mft.h"
 #include "logging.h"
+#include "mst.h"
+#include "blkcache.h"
 #include "misc.h"
+#include "param.h"
+#include "cache.h"
+#include "stats.h"
+#include "probes.h"
+
+#if CACHE_MFTREC_HASH
+
+/*
+ *		Cache of mft records
+ *
+ *	The records are cached as fixed up, when read and when written,
+ *	so that an inode which is no longer open can be reopened without
+ *	reading its records again. Only the records having the FILE magic
+ *	are cached, and the records which could not be written are
+ *	invalidated, as their state on the device is unknown.
+ */
+
+int ntfs_mft_record_hash(const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_MFTREC*)item)->inum & INT_MAX);
+}
+
+static int mftrec_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	return (((const struct CACHED_MFTREC*)cached)->inum
+			!= ((const struct CACHED_MFTREC*)wanted)->inum);
+}
+
+/*
+ *		Get a record from the cache
+ *
+ *	Returns TRUE if found
+ */
+
+static BOOL mftrec_fetch(const ntfs_volume *vol, VCN m, MFT_RECORD *b)
+{
+	struct CACHED_MFTREC item;
+	struct CACHED_MFTREC *cached;
+
+	item.inum = m;
+	cached = (struct CACHED_MFTREC*)ntfs_fetch_cache(vol->mftrec_cache,
+				GENERIC(&item), mftrec_cache_compare);
+	if (cached)
+		memcpy(b, cached->mrec, vol->mft_record_size);
+	return (cached != (struct CACHED_MFTREC*)NULL);
+}
+
+/*
+ *		Enter records into the cache
+ *	When updating, the records may already be cached, with an older
+ *	content, otherwise the cached ones are already up to date.
+ */
+
+static void mftrec_enter(const ntfs_volume *vol, VCN m, s64 count,
+			MFT_RECORD *b, BOOL update)
+{
+	struct CACHED_MFTREC item;
+	struct CACHED_MFTREC *cached;
+	MFT_RECORD *mrec;
+	s64 i;
+
+	for (i=0; i<count; i++) {
+		mrec = (MFT_RECORD*)((char*)b
+				+ (i << vol->mft_record_size_bits));
+		item.inum = m + i;
+		item.mrec = mrec;
+		item.recsize = vol->mft_record_size;
+		if (ntfs_is_file_record(mrec->magic)) {
+			cached = (struct CACHED_MFTREC*)NULL;
+			if (update)
+				cached = (struct CACHED_MFTREC*)
+					ntfs_fetch_cache(vol->mftrec_cache,
+						GENERIC(&item),
+						mftrec_cache_compare);
+			if (cached)
+				memcpy(cached->mrec, mrec,
+						vol->mft_record_size);
+			else
+				ntfs_enter_cache(vol->mftrec_cache,
+					GENERIC(&item), mftrec_cache_compare);
+		} else
+			ntfs_invalidate_cache(vol->mftrec_cache,
+					GENERIC(&item), mftrec_cache_compare, 0);
+	}
+}
+
+/*
+ *		Invalidate cached records
+ */
+
+static void mftrec_invalidate(const ntfs_volume *vol, VCN m, s64 count)
+{
+	struct CACHED_MFTREC item;
+	s64 i;
+
+	item.mrec = (MFT_RECORD*)NULL;
+	item.recsize = 0;
+	for (i=0; i<count; i++) {
+		item.inum = m + i;
+		ntfs_invalidate_cache(vol->mftrec_cache, GENERIC(&item),
+				mftrec_cache_compare, 0);
+	}
+}
+
+#endif /* CACHE_MFTREC_HASH */
+
+/*
+ *		Grouped writing of mft records
+ *
+ *	Between ntfs_mft_batch_begin() and ntfs_mft_batch_end(), the mft
+ *	records beyond those mirrored in $MFTMirr are not written one at
+ *	a time : they are protected as they would be for writing, kept in
+ *	a table sorted by record number, and the runs of adjacent records
+ *	are written together when the batch ends, when the table is full,
+ *	or before one of them has to be read from the device.
+ *	This is meant for writing many records at once, such as when
+ *	flushing the delayed inodes. The callers are expected to serialize
+ *	their accesses to the library.
+ *
+ *	When set up by ntfs_set_mft_writeback(), the table is kept between
+ *	batches, so that the records updated by successive requests are
+ *	written once, in order. The pending records are then written
+ *	- when the table is full,
+ *	- when the oldest one has been pending for MFT_WRITEBACK_DELAY
+ *	  seconds, checked when adding records and when flushing,
+ *	- on request by ntfs_mft_writeback_flush() (fsync, unmount).
+ */
+
+struct MFT_BATCH_ENTRY {
+	VCN inum;
+	int slot;			/* place of the record in the table */
+} ;
+
+struct MFT_BATCH {
+	int count;			/* number of records */
+	int max_count;			/* records kept before writing */
+	BOOL kept;			/* kept between batches */
+	time_t dirtied;			/* when the oldest record was added */
+	struct MFT_BATCH_ENTRY *entries; /* sorted */
+	char *records;			/* protected records, by slot */
+	char *run;			/* buffer for writing a run */
+} ;
+
+/*
+ *		Locate the first batched record at or after a record number
+ *
+ *	Returns the index of the entry, or the count of entries if
+ *		there is none
+ */
+
+static int mft_batch_find(const struct MFT_BATCH *batch, VCN inum)
+{
+	int low, high, mid;
+
+	low = 0;
+	high = batch->count;
+	while (low < high) {
+		mid = (low + high) >> 1;
+		if (batch->entries[mid].inum < inum)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return (low);
+}
+
+/*
+ *		Write the batched records, adjacent ones being written together
+ *	by runs of at most MFT_BATCH_RECORDS records.
+ *
+ *	The records are dropped even if they could not be written, and
+ *	they are invalidated in the mft record cache, as their state on
+ *	the device is then unknown.
+ *
+ *	Returns 0 if successful, -1 if some record could not be written
+ */
+
+static int mft_batch_write(const ntfs_volume *vol)
+{
+	struct MFT_BATCH *batch;
+	s64 size, written;
+	int first, last, i;
+	int bits;
+	int err, res;
+
+	res = 0;
+	err = 0;
+	batch = vol->mft_batch;
+	bits = vol->mft_record_size_bits;
+	for (first=0; first<batch->count; first=last+1) {
+		last = first;
+		while (((last + 1) < batch->count)
+		    && ((last + 1 - first) < MFT_BATCH_RECORDS)
+		    && (batch->entries[last + 1].inum
+				== (batch->entries[last].inum + 1)))
+			last++;
+		for (i=first; i<=last; i++)
+			memcpy(&batch->run[(i - first) << bits],
+				&batch->records[batch->entries[i].slot << bits],
+				vol->mft_record_size);
+		size = (s64)(last - first + 1) << bits;
+		written = ntfs_attr_pwrite(vol->mft_na,
+				batch->entries[first].inum << bits,
+				size, batch->run);
+		if (written != size) {
+			if (written >= 0)
+				errno = EIO;
+			err = errno;
+			res = -1;
+			ntfs_log_perror("Failed to write mft records %lld-%lld",
+				(long long)batch->entries[first].inum,
+				(long long)batch->entries[last].inum);
+#if CACHE_MFTREC_HASH
+			if (vol->mftrec_cache)
+				mftrec_invalidate(vol,
+					batch->entries[first].inum,
+					last - first + 1);
+#endif
+		}
+	}
+	batch->count = 0;
+	batch->dirtied = 0;
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/*
+ *		Write the batched records before reading some of them
+ *
+ *	Returns 0 if successful, -1 if some record could not be written
+ */
+
+static int mft_batch_read(const ntfs_volume *vol, VCN inum, s64 count)
+{
+	struct MFT_BATCH *batch;
+	int i;
+
+	batch = vol->mft_batch;
+	i = mft_batch_find(batch, inum);
+	if ((i < batch->count) && (batch->entries[i].inum < (inum + count)))
+		return (mft_batch_write(vol));
+	return (0);
+}
+
+/*
+ *		Add records to the batch
+ *
+ *	As when writing them, the records are protected and deprotected,
+ *	which updates their update sequence number.
+ *	When the table is kept between batches, it is written when its
+ *	oldest record has been pending for too long.
+ *
+ *	Returns the number of records added, or -1 if none could be
+ *		or the records kept for too long could not be written
+ */
+
+static s64 mft_batch_add(const ntfs_volume *vol, VCN inum, s64 count,
+			MFT_RECORD *b)
+{
+	struct MFT_BATCH *batch;
+	NTFS_RECORD *rec;
+	char *dst;
+	int bits;
+	int slot;
+	s64 done;
+	int i;
+
+	batch = vol->mft_batch;
+	bits = vol->mft_record_size_bits;
+	for (done=0; done<count; done++) {
+		rec = (NTFS_RECORD*)((char*)b + (done << bits));
+		if (ntfs_mst_pre_write_fixup(rec, vol->mft_record_size))
+			break;
+		i = mft_batch_find(batch, inum + done);
+		if ((i < batch->count)
+		    && (batch->entries[i].inum == (inum + done)))
+			slot = batch->entries[i].slot;
+		else {
+			if ((batch->count >= batch->max_count)
+			    && mft_batch_write(vol)) {
+				ntfs_mst_post_write_fixup(rec);
+				break;
+			}
+			if (!batch->count)
+				batch->dirtied = time((time_t*)NULL);
+			i = mft_batch_find(batch, inum + done);
+			memmove(&batch->entries[i + 1], &batch->entries[i],
+				(batch->count - i)
+					*sizeof(struct MFT_BATCH_ENTRY));
+			slot = batch->count++;
+			batch->entries[i].inum = inum + done;
+			batch->entries[i].slot = slot;
+		}
+		dst = &batch->records[slot << bits];
+		memcpy(dst, rec, vol->mft_record_size);
+		ntfs_mst_post_write_fixup(rec);
+	}
+		/* kept pending for too long, write them */
+	if (done && batch->kept
+	    && ((time((time_t*)NULL) - batch->dirtied)
+			>= MFT_WRITEBACK_DELAY)
+	    && mft_batch_write(vol))
+		done = 0;
+	return (done ? done : -1);
+}
+
+/*
+ *		Allocate a table of batched records
+ *
+ *	Returns the table, or NULL if it could not be allocated
+ */
+
+static struct MFT_BATCH *mft_batch_alloc(const ntfs_volume *vol,
+			int max_count, BOOL kept)
+{
+	struct MFT_BATCH *batch;
+
+	batch = (struct MFT_BATCH*)ntfs_malloc(sizeof(struct MFT_BATCH));
+	if (batch) {
+		batch->count = 0;
+		batch->max_count = max_count;
+		batch->kept = kept;
+		batch->dirtied = 0;
+		batch->entries = (struct MFT_BATCH_ENTRY*)ntfs_malloc(
+				max_count*sizeof(struct MFT_BATCH_ENTRY));
+		batch->records = (char*)ntfs_malloc((size_t)max_count
+					<< vol->mft_record_size_bits);
+		batch->run = (char*)ntfs_malloc((size_t)MFT_BATCH_RECORDS
+					<< vol->mft_record_size_bits);
+		if (!batch->entries || !batch->records || !batch->run) {
+			free(batch->entries);
+			free(batch->records);
+			free(batch->run);
+			free(batch);
+			batch = (struct MFT_BATCH*)NULL;
+		}
+	}
+	return (batch);
+}
+
+static void mft_batch_free(struct MFT_BATCH *batch)
+{
+	free(batch->entries);
+	free(batch->records);
+	free(batch->run);
+	free(batch);
+}
+
+/**
+ * ntfs_mft_batch_begin - start grouping the writes of mft records
+ * @vol:	volume
+ *
+ * The records written until ntfs_mft_batch_end() is called are kept
+ * in memory, and written in order of record numbers.
+ *
+ * Return 0 on success or -1 on error, with errno set to the error code,
+ * the records being then written as usual.
+ */
+int ntfs_mft_batch_begin(ntfs_volume *vol)
+{
+	struct MFT_BATCH *batch;
+
+	if (!vol || !vol->mft_na) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (vol->mft_batch)
+		return (0);
+	batch = mft_batch_alloc(vol, MFT_BATCH_RECORDS, FALSE);
+	if (!batch)
+		return (-1);
+	vol->mft_batch = batch;
+	return (0);
+}
+
+/**
+ * ntfs_mft_batch_end - write the grouped mft records
+ * @vol:	volume
+ *
+ * When the write-back of mft records is set up, the records are left
+ * pending, to be written by ntfs_mft_writeback_flush().
+ *
+ * Return 0 on success or -1 on error, with errno set to the error code.
+ */
+int ntfs_mft_batch_end(ntfs_volume *vol)
+{
+	struct MFT_BATCH *batch;
+	int res;
+
+	res = 0;
+	batch = vol->mft_batch;
+	if (batch && !batch->kept) {
+		res = mft_batch_write(vol);
+		vol->mft_batch = (struct MFT_BATCH*)NULL;
+		mft_batch_free(batch);
+	}
+	return (res);
+}
+
+/**
+ * ntfs_mft_writeback_flush - write the pending mft records
+ * @vol:	volume
+ * @all:	TRUE if all records have to be written, FALSE if only
+ *		when the oldest one has been pending for too long
+ *
+ * Return 0 on success or -1 on error, with errno set to the error code.
+ */
+int ntfs_mft_writeback_flush(ntfs_volume *vol, BOOL all)
+{
+	struct MFT_BATCH *batch;
+	int res;
+
+	res = 0;
+	batch = vol->mft_batch;
+	if (batch && batch->kept && batch->count
+	    && (all || ((time((time_t*)NULL) - batch->dirtied)
+				>= MFT_WRITEBACK_DELAY)))
+		res = mft_batch_write(vol);
+	return (res);
+}
+
+/*
+ *		Set up the write-back of mft records
+ *	Not set in ntfs_mount(), the pending records are limited to
+ *	@count, a zero count writes the pending records and stops
+ *	delaying.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_mft_writeback(ntfs_volume *vol, int count)
+{
+	struct MFT_BATCH *batch;
+	int res;
+
+	res = -1;
+	if (!vol || !vol->mft_na || (count < 0))
+		errno = EINVAL;
+	else {
+		res = 0;
+		batch = vol->mft_batch;
+		if (batch) {
+			res = mft_batch_write(vol);
+			vol->mft_batch = (struct MFT_BATCH*)NULL;
+			mft_batch_free(batch);
+		}
+		if (count) {
+			batch = mft_batch_alloc(vol, count, TRUE);
+			if (batch)
+				vol->mft_batch = batch;
+			else
+				res = -1;
+		}
+	}
+	return (res);
+}
+
+static int mft_freed_read(ntfs_volume *vol, VCN m, s64 count);
 
 /**
  * ntfs_mft_records_read - read records from the mft from disk
@@ -104,6 +569,16 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+	/* The freed records kept must be read as free */
+	if (vol->mft_free_cache && mft_freed_read((ntfs_volume*)vol, m, count))
+		return -1;
+#if CACHE_MFTREC_HASH
+	if ((count == 1) && vol->mftrec_cache && mftrec_fetch(vol, m, b))
+		return 0;
+#endif
+	/* The device must be up to date with the grouped writes */
+	if (vol->mft_batch && mft_batch_read(vol, m, count))
+		return -1;
 	br = ntfs_attr_mst_pread(vol->mft_na, m << vol->mft_record_size_bits,
 			count, vol->mft_record_size, b);
 	if (br != count) {
@@ -114,9 +589,108 @@ int ntfs_mft_records_read(const ntfs_volume *vol, const MFT_REF mref,
 				(long long)br);
 		return -1;
 	}
+#if CACHE_MFTREC_HASH
+	if (vol->mftrec_cache)
+		mftrec_enter(vol, m, count, b, FALSE);
+#endif
 	return 0;
 }
 
+/*
+ *		Read a range of mft records into the block cache
+ */
+
+static int mft_prefetch_span(ntfs_volume *vol, s64 first, s64 count)
+{
+	runlist_element *rl;
+	VCN vcn;
+	VCN endvcn;
+	s64 n;
+	int err;
+
+	err = 0;
+	vcn = (first << vol->mft_record_size_bits) >> vol->cluster_size_bits;
+	endvcn = (((first + count) << vol->mft_record_size_bits)
+			+ vol->cluster_size - 1) >> vol->cluster_size_bits;
+	while (!err && (vcn < endvcn)) {
+		rl = ntfs_attr_find_vcn(vol->mft_na, vcn);
+		if (!rl || (rl->lcn < 0) || (rl->length <= 0)) {
+			errno = EIO;
+			err = -1;
+		} else {
+			n = min(rl->length - (vcn - rl->vcn), endvcn - vcn);
+			err = ntfs_block_cache_prefetch(vol->dev,
+					(rl->lcn + vcn - rl->vcn)
+						<< vol->cluster_size_bits,
+					n << vol->cluster_size_bits);
+			vcn += n;
+		}
+	}
+	return (err);
+}
+
+static int mft_prefetch_compare(const void *p1, const void *p2)
+{
+	s64 m1 = *(const s64*)p1;
+	s64 m2 = *(const s64*)p2;
+
+	return (m1 < m2 ? -1 : (m1 > m2 ? 1 : 0));
+}
+
+/**
+ * ntfs_mft_records_prefetch - read mft records ahead of their use
+ * @vol:	volume the records belong to
+ * @mrefs:	mft references of the records (sequence numbers ignored)
+ * @count:	number of references
+ *
+ * Read the records designated by @mrefs into the block cache of the
+ * volume, so that opening them afterwards does not require device reads.
+ * The records are sorted, and the neighbouring ones are read together,
+ * the gaps up to MFT_PREFETCH_GAP records being read too, which is
+ * cheaper than issuing separate reads.
+ *
+ * Nothing is done when the volume has no block cache.
+ *
+ * Return 0 on success or -1 on error, with errno set to the error code.
+ * Errors are not fatal, the records are just read again when needed.
+ */
+int ntfs_mft_records_prefetch(ntfs_volume *vol, const MFT_REF *mrefs,
+		int count)
+{
+	s64 *list;
+	s64 nr_records;
+	s64 first;
+	s64 last;
+	int res;
+	int n;
+	int i;
+
+	if (!vol || !vol->mft_na || (count < 0) || (count && !mrefs)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!vol->dev->d_cache || !count)
+		return 0;
+	list = (s64*)ntfs_malloc(count*sizeof(s64));
+	if (!list)
+		return -1;
+	nr_records = vol->mft_na->initialized_size >> vol->mft_record_size_bits;
+	n = 0;
+	for (i=0; i<count; i++)
+		if ((s64)MREF(mrefs[i]) < nr_records)
+			list[n++] = MREF(mrefs[i]);
+	qsort(list, n, sizeof(s64), mft_prefetch_compare);
+	res = 0;
+	for (i=0; (i<n) && !res; ) {
+		first = last = list[i];
+		while ((++i < n) && ((list[i] - last) <= MFT_PREFETCH_GAP + 1))
+			last = list[i];
+		res = mft_prefetch_span(vol, first, last - first + 1);
+	}
+	free(list);
+	return res;
+}
+
 /**
  * ntfs_mft_records_write - write mft records to disk
  * @vol:	volume to write to
@@ -164,6 +738,13 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+	/* A deferred comparison of $MFTMirr must be done before writing */
+	if (NVolMftMirrUnchecked(vol)
+	    && ntfs_volume_check_mftmirr((ntfs_volume*)vol))
+		return -1;
+	/* The clusters designated by the records must be shown allocated */
+	if (ntfs_lcnbmp_flush_allocated(vol))
+		return -1;
 	if (m < vol->mftmirr_size) {
 		if (!vol->mftmirr_na) {
 			errno = EINVAL;
@@ -177,8 +758,12 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 			return -1;
 		memcpy(bmirr, b, cnt * vol->mft_record_size);
 	}
-	bw = ntfs_attr_mst_pwrite(vol->mft_na, m << vol->mft_record_size_bits,
-			count, vol->mft_record_size, b);
+	if (vol->mft_batch && (m >= vol->mftmirr_size))
+		bw = mft_batch_add(vol, m, count, b);
+	else
+		bw = ntfs_attr_mst_pwrite(vol->mft_na,
+				m << vol->mft_record_size_bits,
+				count, vol->mft_record_size, b);
 	if (bw != count) {
 		if (bw != -1)
 			errno = EIO;
@@ -189,6 +774,14 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 			ntfs_log_perror("Error writing $Mft record(s)");
 		res = errno;
 	}
+#if CACHE_MFTREC_HASH
+	if (vol->mftrec_cache) {
+		if (bw == count)
+			mftrec_enter(vol, m, count, b, TRUE);
+		else
+			mftrec_invalidate(vol, m, count);
+	}
+#endif
 	if (bmirr && bw > 0) {
 		if (bw < cnt)
 			cnt = bw;
@@ -293,7 +886,9 @@ int ntfs_file_record_read(const ntfs_volume *vol, const MFT_REF mref,
 		m = ntfs_malloc(vol->mft_record_size);
 		if (!m)
 			return -1;
-	}
+	} else
+		/* the attributes of a record read again may have moved */
+		ntfs_attr_layout_changed();
 	if (ntfs_mft_record_read(vol, mref, m))
 		goto err_out;
 
@@ -434,19 +1029,6 @@ out:
 
 static const char *es = "  Leaving inconsistent metadata.  Run chkdsk.";
 
-/**
- * ntfs_ffz - Find the first unset (zero) bit in a word
- * @word:
- *
- * Description...
- *
- * Returns:
- */
-static inline unsigned int ntfs_ffz(unsigned int word)
-{
-	return ffs(~word) - 1;
-}
-
 static int ntfs_is_mft(ntfs_inode *ni)
 {
 	if (ni && ni->mft_no == FILE_MFT)
@@ -481,9 +1063,9 @@ static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
 {
 	s64 pass_end, ll, data_pos, pass_start, ofs, bit;
 	ntfs_attr *mftbmp_na;
-	u8 *buf, *byte;
+	u8 *buf;
 	unsigned int size;
-	u8 pass, b;
+	u8 pass;
 	int ret = -1;
 
 	ntfs_log_enter("Entering\n");
@@ -527,10 +1109,6 @@ static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
 			"pass_end 0x%llx, data_pos 0x%llx.\n", pass,
 			(long long)pass_start, (long long)pass_end,
 			(long long)data_pos);
-#ifdef ENABLE_DEBUG
-	byte = NULL;
-	b = 0;
-#endif
 	/* Loop until a free mft record is found. */
 	for (; pass <= 2; size = PAGE_SIZE) {
 		/* Cap size to pass_end. */
@@ -544,44 +1122,38 @@ static int ntfs_mft_bitmap_find_free_rec(ntfs_volume *vol, ntfs_inode *base_ni)
 			free(buf);
 			goto leave;
 		}
+		if (vol->stats)
+			vol->stats->mft_scanned += ll;
 		ntfs_log_debug("Read 0x%llx bytes.\n", (long long)ll);
 		/* If we read at least one byte, search @buf for a zero bit. */
 		if (ll) {
 			size = ll << 3;
 			bit = data_pos & 7;
 			data_pos &= ~7ull;
-			ntfs_log_debug("Before inner for loop: size 0x%x, "
-					"data_pos 0x%llx, bit 0x%llx, "
-					"*byte 0x%hhx, b %u.\n", size,
-					(long long)data_pos, (long long)bit,
-					(u8) (byte ? *byte : -1), b);
-			for (; bit < size && data_pos + bit < pass_end;
-					bit &= ~7ull, bit += 8) {
-				/* 
-				 * If we're extending $MFT and running out of the first
-				 * mft record (base record) then give up searching since
-				 * no guarantee that the found record will be accessible.
-				 */
-				if (ntfs_is_mft(base_ni) && bit > 400)
-					goto out;
-				
-				byte = buf + (bit >> 3);
-				if (*byte == 0xff)
-					continue;
-				
-				/* Note: ffz() result must be zero based. */
-				b = ntfs_ffz((unsigned long)*byte);
-				if (b < 8 && b >= (bit & 7)) {
-					free(buf);
-					ret = data_pos + (bit & ~7ull) + b;
-					goto leave;
-				}
+			ntfs_log_debug("Before bitmap scan: size 0x%x, "
+					"data_pos 0x%llx, bit 0x%llx.\n", size,
+					(long long)data_pos, (long long)bit);
+			/*
+			 * If we're extending $MFT and running out of the first
+			 * mft record (base record) then give up searching since
+			 * no guarantee that the found record will be accessible.
+			 */
+			ll = pass_end - data_pos;
+			if (ll > size)
+				ll = size;
+			if (ntfs_is_mft(base_ni) && (ll > 408))
+				ll = 408;
+			bit = ntfs_bit_find_zero(buf, bit, ll);
+			if (bit >= 0) {
+				free(buf);
+				ret = data_pos + bit;
+				goto leave;
 			}
-			ntfs_log_debug("After inner for loop: size 0x%x, "
-					"data_pos 0x%llx, bit 0x%llx, "
-					"*byte 0x%hhx, b %u.\n", size,
-					(long long)data_pos, (long long)bit,
-					(u8) (byte ? *byte : -1), b);
+			if (ntfs_is_mft(base_ni) && (ll == 408))
+				goto out;
+			ntfs_log_debug("After bitmap scan: size 0x%x, "
+					"data_pos 0x%llx.\n", size,
+					(long long)data_pos);
 			data_pos += size;
 			/*
 			 * If the end of the pass has not been reached yet,
@@ -615,6 +1187,359 @@ leave:
 	return ret;
 }
 
+/*
+ *		Cache of free mft records
+ *
+ *	Instead of searching $MFT/$Bitmap for each record allocated, the
+ *	searches collect up to MFT_FREE_CACHE_SIZE free records at once,
+ *	in the order the allocator would have found them. A record is
+ *	dropped from the cache whenever it gets allocated by another way
+ *	(extent records, records for $MFT), so that the cache only holds
+ *	records which are free. The records freed meanwhile are only seen
+ *	by the next search, as they would after the allocator position.
+ *
+ *	The cache also detects bursts of creations, when at least
+ *	MFT_BURST_RECORDS base records are allocated within a second,
+ *	so that $MFT is then extended and formatted in bigger steps.
+ *
+ *	Besides, the records freed recently are neither written nor
+ *	cleared in $MFT/$Bitmap, their freed image is kept after the
+ *	cache, and the next allocations reuse them first, so that a file
+ *	created in place of a deleted one costs a single write of its
+ *	record. A freed record is written as free, and cleared in the
+ *	bitmap, when it has been kept for MFT_FREED_DELAY seconds, when
+ *	room is needed, when the delayed metadata is flushed, and before
+ *	it has to be read from the device.
+ */
+
+struct MFT_FREE_CACHE {
+	int count;			/* number of records in the cache */
+	int next;			/* index of the next record to use */
+	time_t burst_time;		/* second of the recent allocations */
+	int burst_count;		/* records allocated in that second */
+	BOOL bursting;			/* burst in the previous second */
+	s64 rec[MFT_FREE_CACHE_SIZE];	/* free records */
+	int freed_count;		/* freed records kept */
+	s64 freed[MFT_FREED_RECORDS];	/* freed records, oldest first */
+	time_t freed_time[MFT_FREED_RECORDS]; /* when they were freed */
+		/* followed by the images of the freed records */
+} ;
+
+/*
+ *		Get the cache of free records, allocating it if needed
+ */
+
+static struct MFT_FREE_CACHE *mft_free_cache_open(ntfs_volume *vol)
+{
+	if (!vol->mft_free_cache)
+		vol->mft_free_cache = (struct MFT_FREE_CACHE*)ntfs_calloc(
+				sizeof(struct MFT_FREE_CACHE)
+				+ ((size_t)MFT_FREED_RECORDS
+					<< vol->mft_record_size_bits));
+	return (vol->mft_free_cache);
+}
+
+/*
+ *		Get the image of a freed record
+ */
+
+static MFT_RECORD *mft_freed_image(const ntfs_volume *vol,
+			struct MFT_FREE_CACHE *fc, int i)
+{
+	return ((MFT_RECORD*)((char*)&fc[1]
+			+ ((size_t)i << vol->mft_record_size_bits)));
+}
+
+/*
+ *		Forget about a freed record
+ */
+
+static void mft_freed_remove(const ntfs_volume *vol,
+			struct MFT_FREE_CACHE *fc, int i)
+{
+	int n;
+
+	n = fc->freed_count - i - 1;
+	if (n > 0) {
+		memmove(&fc->freed[i], &fc->freed[i + 1], n*sizeof(s64));
+		memmove(&fc->freed_time[i], &fc->freed_time[i + 1],
+				n*sizeof(time_t));
+		memmove(mft_freed_image(vol, fc, i),
+				mft_freed_image(vol, fc, i + 1),
+				(size_t)n << vol->mft_record_size_bits);
+	}
+	fc->freed_count--;
+}
+
+/*
+ *		Write a freed record and clear it in $MFT/$Bitmap
+ *
+ *	The record is forgotten even if it could not be written, it is
+ *	then left allocated.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int mft_freed_write(ntfs_volume *vol, struct MFT_FREE_CACHE *fc, int i)
+{
+	s64 mft_no;
+	int res;
+
+	res = 0;
+	mft_no = fc->freed[i];
+	if (ntfs_mft_record_write(vol, mft_no, mft_freed_image(vol, fc, i))
+	    || ntfs_bitmap_clear_bit(vol->mftbmp_na, mft_no)) {
+		ntfs_log_perror("Failed to free mft record %lld",
+				(long long)mft_no);
+		vol->free_mft_records--;
+		res = -1;
+	}
+	mft_freed_remove(vol, fc, i);
+	return (res);
+}
+
+/*
+ *		Keep the record of an inode being freed
+ *
+ *	Returns 0 if successful, -1 if the record has to be written now
+ */
+
+static int mft_freed_add(ntfs_volume *vol, ntfs_inode *ni)
+{
+	struct MFT_FREE_CACHE *fc;
+	time_t now;
+	int i;
+
+	fc = mft_free_cache_open(vol);
+	if (!fc)
+		return (-1);
+	now = time((time_t*)NULL);
+	while (fc->freed_count
+	    && ((fc->freed_count >= MFT_FREED_RECORDS)
+		|| ((now - fc->freed_time[0]) >= MFT_FREED_DELAY)))
+		if (mft_freed_write(vol, fc, 0))
+			return (-1);
+	i = fc->freed_count++;
+	fc->freed[i] = ni->mft_no;
+	fc->freed_time[i] = now;
+	memcpy(mft_freed_image(vol, fc, i), ni->mrec, vol->mft_record_size);
+	return (0);
+}
+
+/*
+ *		Cancel the freeing of a record which has been kept
+ */
+
+static void mft_freed_cancel(ntfs_volume *vol, s64 mft_no)
+{
+	struct MFT_FREE_CACHE *fc;
+	int i;
+
+	fc = vol->mft_free_cache;
+	for (i=fc->freed_count-1; (i>=0) && (fc->freed[i] != mft_no); i--) { }
+	if (i >= 0)
+		mft_freed_remove(vol, fc, i);
+}
+
+/*
+ *		Write the freed records about to be read from the device
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int mft_freed_read(ntfs_volume *vol, VCN m, s64 count)
+{
+	struct MFT_FREE_CACHE *fc;
+	int res;
+	int i;
+
+	res = 0;
+	fc = vol->mft_free_cache;
+	for (i=fc->freed_count-1; i>=0; i--)
+		if ((fc->freed[i] >= m) && (fc->freed[i] < (m + count))
+		    && mft_freed_write(vol, fc, i))
+			res = -1;
+	return (res);
+}
+
+/**
+ * ntfs_mft_freed_flush - write the freed mft records kept for reuse
+ * @vol:	volume
+ * @all:	TRUE if all the records have to be written, FALSE if only
+ *		the ones kept for too long
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_mft_freed_flush(ntfs_volume *vol, BOOL all)
+{
+	struct MFT_FREE_CACHE *fc;
+	time_t now;
+	int err;
+	int res;
+
+	res = 0;
+	err = 0;
+	fc = vol->mft_free_cache;
+	if (fc && fc->freed_count) {
+		now = time((time_t*)NULL);
+		while (fc->freed_count
+		    && (all || ((now - fc->freed_time[0]) >= MFT_FREED_DELAY)))
+			if (mft_freed_write(vol, fc, 0) && !res) {
+				err = errno;
+				res = -1;
+			}
+	}
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/*
+ *		Collect the free records in a part of $MFT/$Bitmap
+ *
+ *	Returns 0 if successful, -1 if $MFT/$Bitmap could not be read
+ */
+
+static int mft_free_cache_collect(ntfs_volume *vol, struct MFT_FREE_CACHE *fc,
+			s64 start, s64 end, u8 *buf)
+{
+	s64 pos, br, bit, limit;
+
+	pos = start & ~7LL;
+	bit = start & 7;
+	while ((pos < end) && (fc->count < MFT_FREE_CACHE_SIZE)) {
+		limit = ((end + 7) >> 3) - (pos >> 3);
+		if (limit > PAGE_SIZE)
+			limit = PAGE_SIZE;
+		br = ntfs_attr_pread(vol->mftbmp_na, pos >> 3, limit, buf);
+		if (br < 0) {
+			ntfs_log_perror("Failed to read $MFT bitmap");
+			return (-1);
+		}
+		if (vol->stats)
+			vol->stats->mft_scanned += br;
+		if (!br)
+			break;
+		limit = br << 3;
+		if (limit > (end - pos))
+			limit = end - pos;
+		while ((fc->count < MFT_FREE_CACHE_SIZE)
+		    && ((bit = ntfs_bit_find_zero(buf, bit, limit)) >= 0))
+			fc->rec[fc->count++] = pos + bit++;
+		pos += br << 3;
+		bit = 0;
+	}
+	return (0);
+}
+
+/*
+ *		Get a free record for a base inode
+ *
+ *	Returns the record number, or -1 with errno set (ENOSPC if there
+ *		is no free record in the currently initialized bitmap)
+ */
+
+static s64 mft_free_cache_get(ntfs_volume *vol)
+{
+	struct MFT_FREE_CACHE *fc;
+	s64 pass_end, ll, data_pos;
+	u8 *buf;
+	int err;
+
+	fc = mft_free_cache_open(vol);
+	if (!fc)
+		return (ntfs_mft_bitmap_find_free_rec(vol, (ntfs_inode*)NULL));
+	if (fc->next >= fc->count) {
+		fc->count = fc->next = 0;
+		pass_end = vol->mft_na->allocated_size
+				>> vol->mft_record_size_bits;
+		ll = vol->mftbmp_na->initialized_size << 3;
+		if (pass_end > ll)
+			pass_end = ll;
+		data_pos = vol->mft_data_pos;
+		if ((data_pos < RESERVED_MFT_RECORDS) || (data_pos >= pass_end))
+			data_pos = RESERVED_MFT_RECORDS;
+		buf = (u8*)ntfs_malloc(PAGE_SIZE);
+		if (!buf)
+			return (-1);
+		if (mft_free_cache_collect(vol, fc, data_pos, pass_end, buf)
+		    || mft_free_cache_collect(vol, fc, RESERVED_MFT_RECORDS,
+				data_pos, buf)) {
+			err = errno;
+			free(buf);
+			fc->count = 0;
+			errno = err;
+			return (-1);
+		}
+		free(buf);
+		ntfs_log_debug("Found %d free mft records from %lld\n",
+				fc->count, (long long)data_pos);
+	}
+	if (fc->next >= fc->count) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	return (fc->rec[fc->next++]);
+}
+
+/*
+ *		Drop a record which has been allocated from the cache
+ */
+
+static void mft_free_cache_drop(ntfs_volume *vol, s64 bit)
+{
+	struct MFT_FREE_CACHE *fc;
+	int i;
+
+	fc = vol->mft_free_cache;
+	if (fc) {
+		for (i=fc->next; (i<fc->count) && (fc->rec[i] != bit); i++) { }
+		if (i < fc->count) {
+			memmove(&fc->rec[i], &fc->rec[i + 1],
+				(fc->count - i - 1)*sizeof(s64));
+			fc->count--;
+		}
+	}
+}
+
+/*
+ *		Account for the allocation of a base record
+ *
+ *	A burst goes on while the threshold is reached in each second.
+ */
+
+static void mft_burst_update(ntfs_volume *vol)
+{
+	struct MFT_FREE_CACHE *fc;
+	time_t now;
+
+	fc = vol->mft_free_cache;
+	if (fc) {
+		now = time((time_t*)NULL);
+		if (now != fc->burst_time) {
+			fc->bursting = (now == (fc->burst_time + 1))
+				&& (fc->burst_count >= MFT_BURST_RECORDS);
+			fc->burst_time = now;
+			fc->burst_count = 0;
+		}
+		if (fc->burst_count < MFT_BURST_RECORDS)
+			fc->burst_count++;
+	}
+}
+
+/*
+ *		Check whether base records are being allocated in a burst
+ */
+
+static BOOL mft_burst(const ntfs_volume *vol)
+{
+	const struct MFT_FREE_CACHE *fc;
+
+	fc = vol->mft_free_cache;
+	return (fc && (fc->bursting
+			|| (fc->burst_count >= MFT_BURST_RECORDS)));
+}
+
 static int ntfs_mft_attr_extend(ntfs_attr *na)
 {
 	int ret = STATUS_ERROR;
@@ -660,6 +1585,8 @@ static int ntfs_mft_bitmap_extend_allocation_i(ntfs_volume *vol)
 	BOOL update_mp = FALSE;
 
 	mftbmp_na = vol->mftbmp_na;
+	if (ntfs_attr_rl_expand(mftbmp_na))
+		return STATUS_ERROR;
 	/*
 	 * Determine the last lcn of the mft bitmap.  The allocated size of the
 	 * mft bitmap cannot be zero so we are ok to do this.
@@ -694,6 +1621,7 @@ static int ntfs_mft_bitmap_extend_allocation_i(ntfs_volume *vol)
 		return STATUS_ERROR;
 	}
 	mftbmp_na->rl = rl;
+	ntfs_attr_rl_changed(mftbmp_na);
 	ntfs_log_debug("Adding one run to mft bitmap.\n");
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -810,12 +1738,10 @@ undo_alloc:
 	lcn = rl->lcn;
 	rl->lcn = rl[1].lcn;
 	rl->length = 0;
+	ntfs_attr_rl_changed(mftbmp_na);
 	
-	/* FIXME: use an ntfs_cluster_free_* function */
-	if (ntfs_bitmap_clear_bit(vol->lcnbmp_na, lcn))
+	if (ntfs_cluster_free_basic(vol, lcn, 1))
 		ntfs_log_error("Failed to free cluster.%s\n", es);
-	else
-		vol->free_clusters++;
 	if (mp_rebuilt) {
 		if (ntfs_mapping_pairs_build(vol, (u8*)a +
 				le16_to_cpu(a->mapping_pairs_offset),
@@ -969,7 +1895,7 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 {
 	LCN lcn;
 	VCN old_last_vcn;
-	s64 min_nr, nr, ll = 0; /* silence compiler warning */
+	s64 min_nr, std_nr, nr, step, ll = 0; /* silence compiler warning */
 	ntfs_attr *mft_na;
 	runlist_element *rl, *rl2;
 	ntfs_attr_search_ctx *ctx;
@@ -984,6 +1910,8 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 	ntfs_log_enter("Extending mft data allocation.\n");
 	
 	mft_na = vol->mft_na;
+	if (ntfs_attr_rl_expand(mft_na))
+		goto out;
 	/*
 	 * Determine the preferred allocation location, i.e. the last lcn of
 	 * the mft data attribute.  The allocated size of the mft data
@@ -1007,11 +1935,26 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 	if (!min_nr)
 		min_nr = 1;
 	/* Want to allocate 16 mft records worth of clusters. */
-	nr = (s64)vol->mft_record_size << 4 >> vol->cluster_size_bits;
-	if (!nr)
-		nr = min_nr;
+	std_nr = (s64)vol->mft_record_size << 4 >> vol->cluster_size_bits;
+	if (!std_nr)
+		std_nr = min_nr;
+	nr = std_nr;
 	
 	old_last_vcn = rl[1].vcn;
+	/*
+	 * When creating many files, extend to the next multiple of
+	 * MFT_BURST_EXTEND records (a power of 2, as are the record and
+	 * cluster sizes).
+	 */
+	if (mft_burst(vol)) {
+		step = (s64)MFT_BURST_EXTEND << vol->mft_record_size_bits
+				>> vol->cluster_size_bits;
+		if (step > nr) {
+			nr = step - (old_last_vcn & (step - 1));
+			if (nr < std_nr)
+				nr += step;
+		}
+	}
 	do {
 		rl2 = ntfs_cluster_alloc(vol, old_last_vcn, nr, lcn, MFT_ZONE);
 		if (rl2)
@@ -1023,10 +1966,10 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 		}
 		/*
 		 * There is not enough space to do the allocation, but there
-		 * might be enough space to do a minimal allocation so try that
-		 * before failing.
+		 * might be enough space to do a smaller allocation, then a
+		 * minimal one, so try that before failing.
 		 */
-		nr = min_nr;
+		nr = (nr > std_nr ? std_nr : min_nr);
 		ntfs_log_debug("Retrying mft data allocation with minimal cluster "
 				"count %lli.\n", (long long)nr);
 	} while (1);
@@ -1046,6 +1989,7 @@ static int ntfs_mft_data_extend_allocation(ntfs_volume *vol)
 		goto out;
 	}
 	mft_na->rl = rl;
+	ntfs_attr_rl_changed(mft_na);
 	
 	/* Find the last run in the new runlist. */
 	for (; rl[1].length; rl++)
@@ -1167,6 +2111,7 @@ undo_alloc:
 	if (ntfs_rl_truncate(&mft_na->rl, old_last_vcn))
 		ntfs_log_error("Failed to truncate mft data attribute "
 				"runlist.%s\n", es);
+	ntfs_attr_rl_changed(mft_na);
 	if (mp_rebuilt) {
 		if (ntfs_mapping_pairs_build(vol, (u8*)a +
 				le16_to_cpu(a->mapping_pairs_offset),
@@ -1190,11 +2135,51 @@ undo_alloc:
 }
 
 
+/*
+ *		Format consecutive mft records and write them at once
+ *
+ *	The records are not batched, the initialized part of $MFT has to
+ *	be on the device before its new size is recorded.
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int ntfs_mft_records_format(const ntfs_volume *vol, s64 first,
+			s64 count)
+{
+	char *buf;
+	s64 i;
+	int ret;
+
+	ret = -1;
+	buf = (char*)ntfs_calloc(count << vol->mft_record_size_bits);
+	if (buf) {
+		for (i=0; (i<count) && !ntfs_mft_record_layout(vol, first + i,
+				(MFT_RECORD*)&buf[i << vol->mft_record_size_bits]);
+				i++) { }
+		if (i == count) {
+			if (vol->mft_batch && (first >= vol->mftmirr_size)) {
+				if (ntfs_attr_mst_pwrite(vol->mft_na,
+					first << vol->mft_record_size_bits,
+					count, vol->mft_record_size, buf)
+						== count)
+					ret = 0;
+			} else
+				if (!ntfs_mft_records_write(vol, first, count,
+						(MFT_RECORD*)buf))
+					ret = 0;
+		}
+		free(buf);
+	}
+	return (ret);
+}
+
 static int ntfs_mft_record_init(ntfs_volume *vol, s64 size)
 {
 	int ret = -1;
 	ntfs_attr *mft_na;
 	s64 old_data_initialized, old_data_size;
+	s64 target, ahead, limit;
 	ntfs_attr_search_ctx *ctx;
 	
 	ntfs_log_enter("Entering\n");
@@ -1236,13 +2221,35 @@ static int ntfs_mft_record_init(ntfs_volume *vol, s64 size)
 	 * needed by ntfs_mft_record_format().  We will update the attribute
 	 * record itself in one fell swoop later on.
 	 */
-	while (size > mft_na->initialized_size) {
+	/*
+	 * When creating many files, format up to MFT_BURST_FORMAT records
+	 * ahead, as far as they are allocated and covered by the mft bitmap.
+	 */
+	target = size;
+	if (mft_burst(vol)) {
+		ahead = (s64)MFT_BURST_FORMAT << vol->mft_record_size_bits;
+		target = (size + ahead - 1) & ~(ahead - 1);
+		limit = vol->mftbmp_na->initialized_size << 3
+				<< vol->mft_record_size_bits;
+		if (limit > mft_na->allocated_size)
+			limit = mft_na->allocated_size;
+		if (target > limit)
+			target = limit;
+		if (target < size)
+			target = size;
+	}
+	while (target > mft_na->initialized_size) {
 		s64 ll2 = mft_na->initialized_size >> vol->mft_record_size_bits;
-		mft_na->initialized_size += vol->mft_record_size;
+		s64 cnt = (target - mft_na->initialized_size)
+				>> vol->mft_record_size_bits;
+		if (cnt > MFT_BURST_FORMAT)
+			cnt = MFT_BURST_FORMAT;
+		mft_na->initialized_size += cnt << vol->mft_record_size_bits;
 		if (mft_na->initialized_size > mft_na->data_size)
 			mft_na->data_size = mft_na->initialized_size;
-		ntfs_log_debug("Initializing mft record 0x%llx.\n", (long long)ll2);
-		if (ntfs_mft_record_format(vol, ll2) < 0) {
+		ntfs_log_debug("Initializing mft records 0x%llx-0x%llx.\n",
+				(long long)ll2, (long long)(ll2 + cnt - 1));
+		if (ntfs_mft_records_format(vol, ll2, cnt) < 0) {
 			ntfs_log_perror("Failed to format mft record");
 			goto undo_data_init;
 		}
@@ -1436,6 +2443,7 @@ found_free_rec:
 		ntfs_log_error("Failed to allocate bit in mft bitmap #2\n");
 		goto err_out;
 	}
+	mft_free_cache_drop(vol, bit);
 	
 	ll = (bit + 1) << vol->mft_record_size_bits;
 	if (ll > mft_na->initialized_size)
@@ -1536,6 +2544,8 @@ found_free_rec:
 	ntfs_log_error("allocated %sinode %lld\n",
 			base_ni ? "extent " : "", (long long)bit);
 out:
+	if (ni && vol->stats)
+		vol->stats->mft_allocs++;
 	ntfs_log_leave("\n");	
 	return ni;
 
@@ -1639,8 +2649,10 @@ ntfs_inode *ntfs_mft_record_alloc(ntfs_volume *vol, ntfs_inode *base_ni)
 {
 	s64 ll, bit;
 	ntfs_attr *mft_na, *mftbmp_na;
+	struct MFT_FREE_CACHE *fc;
 	MFT_RECORD *m;
 	ntfs_inode *ni = NULL;
+	int freed;
 	int err;
 	u32 usa_ofs;
 	le16 seq_no, usn;
@@ -1652,6 +2664,8 @@ ntfs_inode *ntfs_mft_record_alloc(ntfs_volume *vol, ntfs_inode *base_ni)
 			       (long long)base_ni->mft_no);
 	else
 		ntfs_log_enter("Entering (allocating a base mft record)\n");
+	NTFS_PROBE1(mft_record_alloc_entry,
+			(base_ni ? (long long)base_ni->mft_no : -1LL));
 	if (!vol || !vol->mft_na || !vol->mftbmp_na) {
 		errno = EINVAL;
 		goto out;
@@ -1664,8 +2678,30 @@ ntfs_inode *ntfs_mft_record_alloc(ntfs_volume *vol, ntfs_inode *base_ni)
 
 	mft_na = vol->mft_na;
 	mftbmp_na = vol->mftbmp_na;
+	if (!base_ni)
+		mft_burst_update(vol);
 retry:	
-	bit = ntfs_mft_bitmap_find_free_rec(vol, base_ni);
+	/*
+	 * Reuse the latest record freed and kept, it is still allocated
+	 * in the mft bitmap, and its freed image is known.
+	 */
+	fc = vol->mft_free_cache;
+	freed = (fc ? fc->freed_count - 1 : -1);
+	if (freed >= 0) {
+		bit = fc->freed[freed];
+		m = ntfs_malloc(vol->mft_record_size);
+		if (!m)
+			goto err_out;
+		memcpy(m, mft_freed_image(vol, fc, freed),
+				vol->mft_record_size);
+		ntfs_log_debug("reusing freed record at %lld\n",
+				(long long)bit);
+		goto found_freed_rec;
+	}
+	if (base_ni)
+		bit = ntfs_mft_bitmap_find_free_rec(vol, base_ni);
+	else
+		bit = mft_free_cache_get(vol);
 	if (bit >= 0) {
 		ntfs_log_debug("found free record (#1) at %lld\n",
 				(long long)bit);
@@ -1741,6 +2777,7 @@ found_free_rec:
 		ntfs_log_error("Failed to allocate bit in mft bitmap.\n");
 		goto err_out;
 	}
+	mft_free_cache_drop(vol, bit);
 	
 	/* The mft bitmap is now uptodate.  Deal with mft data attribute now. */
 	ll = (bit + 1) << vol->mft_record_size_bits;
@@ -1781,6 +2818,7 @@ found_free_rec:
 		free(m);
 		goto retry;
 	}
+found_freed_rec:
 	seq_no = m->sequence_number;
 		/*
 		 * As ntfs_mft_record_read() returns what has been read
@@ -1847,6 +2885,11 @@ found_free_rec:
 		}
 		base_ni->extent_nis[base_ni->nr_extents++] = ni;
 	}
+	if (freed >= 0) {
+		mft_freed_remove(vol, fc, freed);
+		if (vol->stats)
+			vol->stats->mft_reused++;
+	}
 	/* Make sure the allocated inode is written out to disk later. */
 	ntfs_inode_mark_dirty(ni);
 	/* Initialize time, allocated and data size in ntfs_inode struct. */
@@ -1856,19 +2899,24 @@ found_free_rec:
 			ni->last_mft_change_time =
 			ni->last_access_time = ntfs_current_time();
 	/* Update the default mft allocation position if it was used. */
-	if (!base_ni)
+	if (!base_ni && (freed < 0))
 		vol->mft_data_pos = bit + 1;
 	/* Return the opened, allocated inode of the allocated mft record. */
 	ntfs_log_debug("allocated %sinode 0x%llx.\n",
 			base_ni ? "extent " : "", (long long)bit);
 	vol->free_mft_records--; 
 out:
+	if (ni && vol->stats)
+		vol->stats->mft_allocs++;
+	NTFS_PROBE1(mft_record_alloc_return,
+			(ni ? (long long)ni->mft_no : -1LL));
 	ntfs_log_leave("\n");	
 	return ni;
 
 undo_mftbmp_alloc:
 	err = errno;
-	if (ntfs_bitmap_clear_bit(mftbmp_na, bit))
+	/* a freed record being reused is still kept */
+	if ((freed < 0) && ntfs_bitmap_clear_bit(mftbmp_na, bit))
 		ntfs_log_error("Failed to clear bit in mft bitmap.%s\n", es);
 	errno = err;
 err_out:
@@ -1895,6 +2943,7 @@ int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni)
 	int err;
 	u16 seq_no;
 	le16 old_seq_no;
+	BOOL kept;
 
 	ntfs_log_trace("Entering for inode 0x%llx.\n", (long long) ni->mft_no);
 
@@ -1918,19 +2967,32 @@ int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni)
 		seq_no++;
 	ni->mrec->sequence_number = cpu_to_le16(seq_no);
 
-	/* Set the inode dirty and write it out. */
-	ntfs_inode_mark_dirty(ni);
-	if (ntfs_inode_sync(ni)) {
-		err = errno;
-		goto sync_rollback;
-	}
+	/*
+	 * Keep the freed record for being reused, its writing can then
+	 * be merged with the formatting of the new record.
+	 */
+	kept = (ni->nr_extents <= 0) && !mft_freed_add(vol, ni);
+	if (kept)
+		NInoClearDirty(ni);
+	else {
+		/* Set the inode dirty and write it out. */
+		ntfs_inode_mark_dirty(ni);
+		if (ntfs_inode_sync(ni)) {
+			err = errno;
+			goto sync_rollback;
+		}
 
-	/* Clear the bit in the $MFT/$BITMAP corresponding to this record. */
-	if (ntfs_bitmap_clear_bit(vol->mftbmp_na, mft_no)) {
-		err = errno;
-		// FIXME: If ntfs_bitmap_clear_run() guarantees rollback on
-		//	  error, this could be changed to goto sync_rollback;
-		goto bitmap_rollback;
+		/*
+		 * Clear the bit in the $MFT/$BITMAP corresponding to
+		 * this record.
+		 */
+		if (ntfs_bitmap_clear_bit(vol->mftbmp_na, mft_no)) {
+			err = errno;
+			// FIXME: If ntfs_bitmap_clear_run() guarantees
+			//	  rollback on error, this could be changed
+			//	  to goto sync_rollback;
+			goto bitmap_rollback;
+		}
 	}
 
 	/* Throw away the now freed inode. */
@@ -1943,12 +3005,18 @@ int ntfs_mft_record_free(ntfs_volume *vol, ntfs_inode *ni)
 		return 0;
 	}
 	err = errno;
+	if (kept) {
+		mft_freed_cancel(vol, mft_no);
+		goto sync_rollback;
+	}
 
 	/* Rollback what we did... */
 bitmap_rollback:
 	if (ntfs_bitmap_set_bit(vol->mftbmp_na, mft_no))
 		ntfs_log_debug("Eeek! Rollback failed in ntfs_mft_record_free().  "
 				"Leaving inconsistent metadata!\n");
+	else
+		mft_free_cache_drop(vol, mft_no);
 sync_rollback:
 	ni->mrec->flags |= MFT_RECORD_IN_USE;
 	ni->mrec->sequence_number = old_seq_no;
@@ -1981,3 +3049,408 @@ int ntfs_mft_usn_dec(MFT_RECORD *mrec)
 	return 0;
 }
 
+
+/*
+ *		Scanning all the records of the MFT
+ *
+ *	Walking over all the files of a volume by opening the inodes one
+ *	at a time reads each record separately, free ones included. The
+ *	scanner reads the MFT by big batches, skipping the ranges which
+ *	are free according to $MFT/$Bitmap. As the library is not
+ *	reentrant, the reading and the callbacks are done by the calling
+ *	thread, and only the fixups, which only use the buffers, are
+ *	applied by the other threads : the fixups of a batch are applied
+ *	while the next batch is being read and the records of the batch
+ *	are being passed to the callback.
+ */
+
+enum {
+	MFT_SCAN_FREE,			/* record not in use */
+	MFT_SCAN_FIXED,			/* record fixed up or not a FILE */
+	MFT_SCAN_BAD			/* incomplete multi sector transfer */
+} ;
+
+struct MFT_SCAN_BATCH {
+	u8 *buf;			/* records read */
+	u8 *bitmap;			/* $MFT/$Bitmap bits of the records */
+	u8 *status;			/* MFT_SCAN_* status of each record */
+	s64 first;			/* first record of the batch */
+	s32 count;			/* number of records in the batch */
+	s32 low;			/* first record in use */
+	s32 high;			/* last record in use + 1 */
+	s32 next;			/* next record to fix up */
+	s32 busy;			/* slices being fixed up */
+} ;
+
+struct MFT_SCAN {
+	ntfs_volume *vol;
+	struct MFT_SCAN_BATCH batch[2];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* signalled when a batch is posted */
+	pthread_cond_t done;		/* broadcast when a batch is fixed up */
+	struct MFT_SCAN_BATCH *current;	/* batch being fixed up */
+	BOOL stop;
+	int count;			/* number of threads */
+	pthread_t thread[MFT_SCAN_MAX_THREADS];
+#endif
+} ;
+
+/*
+ *		Apply the fixups to a slice of a batch
+ */
+
+static void mft_scan_fixup(const ntfs_volume *vol,
+			struct MFT_SCAN_BATCH *b, s32 start, s32 end)
+{
+	MFT_RECORD *m;
+	s32 i;
+
+	for (i=start; i<end; i++) {
+		if (!(b->bitmap[i >> 3] & (1 << (i & 7))))
+			b->status[i] = MFT_SCAN_FREE;
+		else {
+			m = (MFT_RECORD*)&b->buf[(size_t)i
+						<< vol->mft_record_size_bits];
+			if (ntfs_is_file_record(m->magic)
+			    && ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)m,
+					vol->mft_record_size, FALSE))
+				b->status[i] = MFT_SCAN_BAD;
+			else
+				b->status[i] = MFT_SCAN_FIXED;
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ *		Get the next slice of a batch to fix up
+ *	Must be called with the lock held
+ */
+
+static BOOL mft_scan_claim(struct MFT_SCAN_BATCH *b, s32 *start, s32 *end)
+{
+	BOOL claimed;
+
+	claimed = b && (b->next < b->high);
+	if (claimed) {
+		*start = b->next;
+		*end = b->next + MFT_SCAN_SLICE;
+		if (*end > b->high)
+			*end = b->high;
+		b->next = *end;
+		b->busy++;
+	}
+	return (claimed);
+}
+
+static void *mft_scan_worker(void *arg)
+{
+	struct MFT_SCAN *scan;
+	struct MFT_SCAN_BATCH *b;
+	s32 start, end;
+
+	scan = (struct MFT_SCAN*)arg;
+	pthread_mutex_lock(&scan->lock);
+	while (!scan->stop) {
+		b = scan->current;
+		if (mft_scan_claim(b, &start, &end)) {
+			pthread_mutex_unlock(&scan->lock);
+			mft_scan_fixup(scan->vol, b, start, end);
+			pthread_mutex_lock(&scan->lock);
+			if (!--b->busy && (b->next >= b->high))
+				pthread_cond_broadcast(&scan->done);
+		} else
+			pthread_cond_wait(&scan->work, &scan->lock);
+	}
+	pthread_mutex_unlock(&scan->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Hand a batch over to the threads
+ */
+
+static void mft_scan_post(struct MFT_SCAN *scan, struct MFT_SCAN_BATCH *b)
+{
+	pthread_mutex_lock(&scan->lock);
+	b->next = b->low;
+	b->busy = 0;
+	scan->current = b;
+	pthread_cond_broadcast(&scan->work);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ *		Wait for a batch to be fixed up, helping the threads
+ */
+
+static void mft_scan_sync(struct MFT_SCAN *scan, struct MFT_SCAN_BATCH *b)
+{
+	s32 start, end;
+
+	pthread_mutex_lock(&scan->lock);
+	while (b->busy || (b->next < b->high)) {
+		if (mft_scan_claim(b, &start, &end)) {
+			pthread_mutex_unlock(&scan->lock);
+			mft_scan_fixup(scan->vol, b, start, end);
+			pthread_mutex_lock(&scan->lock);
+			b->busy--;
+		} else
+			pthread_cond_wait(&scan->done, &scan->lock);
+	}
+	scan->current = (struct MFT_SCAN_BATCH*)NULL;
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static void mft_scan_stop(struct MFT_SCAN *scan)
+{
+	int i;
+
+	pthread_mutex_lock(&scan->lock);
+	scan->stop = TRUE;
+	pthread_cond_broadcast(&scan->work);
+	pthread_mutex_unlock(&scan->lock);
+	for (i=0; i<scan->count; i++)
+		pthread_join(scan->thread[i], (void**)NULL);
+	pthread_cond_destroy(&scan->done);
+	pthread_cond_destroy(&scan->work);
+	pthread_mutex_destroy(&scan->lock);
+}
+
+static int mft_scan_start(struct MFT_SCAN *scan, int threads)
+{
+	if (pthread_mutex_init(&scan->lock, (pthread_mutexattr_t*)NULL)) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	pthread_cond_init(&scan->work, (pthread_condattr_t*)NULL);
+	pthread_cond_init(&scan->done, (pthread_condattr_t*)NULL);
+	if (threads > MFT_SCAN_MAX_THREADS)
+		threads = MFT_SCAN_MAX_THREADS;
+		/* a single thread would only compete with the caller */
+	while ((threads > 1) && (scan->count < threads)
+	    && !pthread_create(&scan->thread[scan->count],
+				(pthread_attr_t*)NULL,
+				mft_scan_worker, scan))
+		scan->count++;
+	return (0);
+}
+
+#else /* HAVE_PTHREAD_H */
+
+/*
+ *		Without threads, the fixups are applied when waiting
+ */
+
+static void mft_scan_post(struct MFT_SCAN *scan __attribute__((unused)),
+			struct MFT_SCAN_BATCH *b __attribute__((unused)))
+{
+}
+
+static void mft_scan_sync(struct MFT_SCAN *scan, struct MFT_SCAN_BATCH *b)
+{
+	mft_scan_fixup(scan->vol, b, b->low, b->high);
+}
+
+static void mft_scan_stop(struct MFT_SCAN *scan __attribute__((unused)))
+{
+}
+
+static int mft_scan_start(struct MFT_SCAN *scan __attribute__((unused)),
+			int threads __attribute__((unused)))
+{
+	return (0);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Read a batch of records, only the range in use is read
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int mft_scan_read(ntfs_volume *vol, struct MFT_SCAN_BATCH *b,
+			s64 first, s32 count)
+{
+	s64 br;
+	s64 size;
+	s32 bytes;
+	s32 i;
+
+	b->first = first;
+	b->count = count;
+	b->low = b->high = 0;
+	bytes = (count + 7) >> 3;
+	br = ntfs_attr_pread(vol->mftbmp_na, first >> 3, bytes, b->bitmap);
+	if (br < 0) {
+		ntfs_log_perror("Failed to read $MFT/$Bitmap");
+		return (-1);
+	}
+	if (br < bytes)
+		memset(&b->bitmap[br], 0, bytes - br);
+	if (count & 7)
+		b->bitmap[bytes - 1] &= (1 << (count & 7)) - 1;
+	for (i=0; (i<bytes) && !b->bitmap[i]; i++) { }
+	if (i < bytes) {
+		b->low = i << 3;
+		while (!(b->bitmap[i] & (1 << (b->low & 7))))
+			b->low++;
+		for (i=bytes-1; !b->bitmap[i]; i--) { }
+		b->high = (i << 3) + 8;
+		while (!(b->bitmap[i] & (1 << ((b->high - 1) & 7))))
+			b->high--;
+		size = (s64)(b->high - b->low) << vol->mft_record_size_bits;
+		br = ntfs_attr_pread(vol->mft_na,
+			(first + b->low) << vol->mft_record_size_bits, size,
+			&b->buf[(size_t)b->low << vol->mft_record_size_bits]);
+		if (br != size) {
+			if (br >= 0)
+				errno = EIO;
+			ntfs_log_perror("Failed to read of MFT, mft=%lld "
+				"count=%lld", (long long)(first + b->low),
+				(long long)(b->high - b->low));
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Pass the valid records in use of a batch to the callback
+ */
+
+static int mft_scan_callbacks(ntfs_volume *vol, struct MFT_SCAN_BATCH *b,
+			ntfs_mft_scan_t callback, void *data)
+{
+	MFT_RECORD *m;
+	s64 mft_no;
+	s32 i;
+	int res;
+
+	res = 0;
+	for (i=b->low; (i<b->high) && !res; i++) {
+		if (b->status[i] == MFT_SCAN_FREE)
+			continue;
+		mft_no = b->first + i;
+		m = (MFT_RECORD*)&b->buf[(size_t)i << vol->mft_record_size_bits];
+		if (b->status[i] == MFT_SCAN_BAD) {
+			if (!NVolNoFixupWarn(vol))
+				ntfs_log_error("Record %lld has an incomplete "
+					"multi sector transfer\n",
+					(long long)mft_no);
+			continue;
+		}
+		if (ntfs_mft_record_check(vol, mft_no, m)
+		    || !(m->flags & MFT_RECORD_IN_USE))
+			continue;
+		res = callback(vol, MK_MREF(mft_no,
+				le16_to_cpu(m->sequence_number)), m, data);
+	}
+	return (res);
+}
+
+/**
+ * ntfs_mft_scan - pass all the mft records in use to a callback
+ * @vol:	volume to scan
+ * @threads:	number of threads applying the fixups, 0 or 1 for none
+ * @callback:	function called for each record
+ * @data:	parameter passed to @callback
+ *
+ * The mft is read sequentially by batches of MFT_SCAN_RECORDS records,
+ * skipping the records which are free in $MFT/$Bitmap, and the valid
+ * records flagged in use are passed in order to @callback. Corrupt records
+ * are skipped, like ntfs_file_record_read() would reject them. Extent
+ * records are passed too, they have a non-zero base_mft_record.
+ *
+ * Returns 0 when all the records have been scanned, the positive value
+ * returned by @callback if it stopped the scan, or -1 on error, with errno
+ * set to the error code.
+ */
+int ntfs_mft_scan(ntfs_volume *vol, int threads,
+		ntfs_mft_scan_t callback, void *data)
+{
+	struct MFT_SCAN *scan;
+	struct MFT_SCAN_BATCH *b;
+	struct MFT_SCAN_BATCH *nb;
+	s64 nr_records;
+	s64 first;
+	s64 next;
+	size_t bufsize;
+	int res;
+	int err;
+	int i;
+
+	if (!vol || !vol->mft_na || !vol->mftbmp_na || !callback) {
+		errno = EINVAL;
+		return (-1);
+	}
+	/* the freed records kept must be seen free, the others written */
+	if (ntfs_mft_freed_flush(vol, TRUE)
+	    || (vol->mft_batch && mft_batch_write(vol)))
+		return (-1);
+	scan = (struct MFT_SCAN*)ntfs_calloc(sizeof(struct MFT_SCAN));
+	if (!scan)
+		return (-1);
+	scan->vol = vol;
+	res = 0;
+	bufsize = (size_t)MFT_SCAN_RECORDS << vol->mft_record_size_bits;
+	for (i=0; (i<2) && !res; i++) {
+		b = &scan->batch[i];
+		b->buf = (u8*)ntfs_malloc(bufsize);
+		b->bitmap = (u8*)ntfs_malloc(MFT_SCAN_RECORDS >> 3);
+		b->status = (u8*)ntfs_malloc(MFT_SCAN_RECORDS);
+		if (!b->buf || !b->bitmap || !b->status)
+			res = -1;
+	}
+	if (!res && !mft_scan_start(scan, threads)) {
+		nr_records = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+		b = &scan->batch[0];
+		nb = &scan->batch[1];
+		first = 0;
+		if (nr_records > 0) {
+			res = mft_scan_read(vol, b, 0,
+				(nr_records < MFT_SCAN_RECORDS
+					? nr_records : MFT_SCAN_RECORDS));
+			if (!res)
+				mft_scan_post(scan, b);
+		}
+		err = errno;
+		while (!res && (first < nr_records)) {
+			next = first + b->count;
+			if (next < nr_records) {
+				res = mft_scan_read(vol, nb, next,
+					(nr_records - next < MFT_SCAN_RECORDS
+					? nr_records - next : MFT_SCAN_RECORDS));
+				err = errno;
+			}
+			mft_scan_sync(scan, b);
+			if (!res) {
+				if (next < nr_records)
+					mft_scan_post(scan, nb);
+				res = mft_scan_callbacks(vol, b,
+						callback, data);
+				err = errno;
+				if (res && (next < nr_records))
+					mft_scan_sync(scan, nb);
+			}
+			nb = b;
+			b = &scan->batch[b == &scan->batch[0] ? 1 : 0];
+			first = next;
+		}
+		mft_scan_stop(scan);
+		if (res < 0)
+			errno = err;
+	} else
+		res = -1;
+	for (i=0; i<2; i++) {
+		free(scan->batch[i].buf);
+		free(scan->batch[i].bitmap);
+		free(scan->batch[i].status);
+	}
+	free(scan);
+	return (res);
+}
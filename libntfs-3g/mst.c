@@ -46,35 +46,29 @@ is_valid_record(u32 size, u16 usa_ofs, u16 usa_count)
 		usa_ofs + ((u32)usa_count * 2) <= NTFS_BLOCK_SIZE - 2;
 }
 
-/**
- * ntfs_mst_post_read_fixup - deprotect multi sector transfer protected data
- * @b:		pointer to the data to deprotect
- * @size:	size in bytes of @b
- *
- * Perform the necessary post read multi sector transfer fixups and detect the
- * presence of incomplete multi sector transfers. - In that case, overwrite the
- * magic of the ntfs record header being processed with "BAAD" (in memory only!)
- * and abort processing.
+/*
+ *		Check and deprotect a record of a validated size
  *
- * Return 0 on success and -1 on error, with errno set to the error code. The
- * following error codes are defined:
- *	EINVAL	Invalid arguments or invalid NTFS record in buffer @b.
- *	EIO	Multi sector transfer error was detected. Magic of the NTFS
- *		record in @b will have been set to "BAAD".
+ *	This is the common part of the single and batched fixups. The
+ *	sectors are compared to the usn with no early exit, so that the
+ *	loop has no branch, and the bad sector is only searched for when
+ *	a transfer was found incomplete.
  */
-int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
-					BOOL warn)
-{
-	u16 usa_ofs, usa_count, usn;
-	u16 *usa_pos, *data_pos;
 
-	ntfs_log_trace("Entering\n");
+static int post_read_fixup(NTFS_RECORD *b, const u32 size, BOOL warn)
+{
+	u16 usa_ofs, usa_count, usn, diff;
+	const u16 *usa_pos;
+	u16 *data_pos;
+	u32 sectors;
+	u32 i;
 
-	/* Setup the variables. */
 	usa_ofs = le16_to_cpu(b->usa_ofs);
 	usa_count = le16_to_cpu(b->usa_count);
-
-	if (!is_valid_record(size, usa_ofs, usa_count)) {
+	sectors = size / NTFS_BLOCK_SIZE;
+	if ((usa_ofs & 1)
+	    || (usa_count != sectors + 1)
+	    || (usa_ofs + ((u32)usa_count * 2) > NTFS_BLOCK_SIZE - 2)) {
 		errno = EINVAL;
 		if (warn) {
 			ntfs_log_perror("%s: magic: 0x%08lx  size: %ld "
@@ -87,7 +81,7 @@ int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 		return -1;
 	}
 	/* Position of usn in update sequence array. */
-	usa_pos = (u16*)b + usa_ofs/sizeof(u16);
+	usa_pos = (const u16*)b + usa_ofs/sizeof(u16);
 	/*
 	 * The update sequence number which has to be equal to each of the
 	 * u16 values before they are fixed up. Note no need to care for
@@ -95,7 +89,7 @@ int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 	 * structures which means the data is consistent. - If it is
 	 * consistency the wrong endianness it doesn't make any difference.
 	 */
-	usn = *usa_pos;
+	usn = *usa_pos++;
 	/*
 	 * Position in protected data of first u16 that needs fixing up.
 	 */
@@ -103,39 +97,68 @@ int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 	/*
 	 * Check for incomplete multi sector transfer(s).
 	 */
-	while (--usa_count) {
-		if (*data_pos != usn) {
-			/*
-			 * Incomplete multi sector transfer detected! )-:
-			 * Set the magic to "BAAD" and return failure.
-			 * Note that magic_BAAD is already converted to le32.
-			 */
-			errno = EIO;
-			ntfs_log_perror("Incomplete multi-sector transfer: "
-				"magic: 0x%08x  size: %d  usa_ofs: %d  usa_count:"
-				" %d  data: %d  usn: %d", le32_to_cpu(*(le32 *)b), size,
-				usa_ofs, usa_count, *data_pos, usn);
-			b->magic = magic_BAAD;
-			return -1;
-		}
-		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
-	}
-	/* Re-setup the variables. */
-	usa_count = le16_to_cpu(b->usa_count);
-	data_pos = (u16*)b + NTFS_BLOCK_SIZE/sizeof(u16) - 1;
-	/* Fixup all sectors. */
-	while (--usa_count) {
+	diff = 0;
+	for (i=0; i<sectors; i++)
+		diff |= data_pos[i*(NTFS_BLOCK_SIZE/sizeof(u16))] ^ usn;
+	if (diff) {
+		for (i=0; data_pos[i*(NTFS_BLOCK_SIZE/sizeof(u16))] == usn;
+					i++) { }
 		/*
-		 * Increment position in usa and restore original data from
-		 * the usa into the data buffer.
+		 * Incomplete multi sector transfer detected! )-:
+		 * Set the magic to "BAAD" and return failure.
+		 * Note that magic_BAAD is already converted to le32.
 		 */
-		*data_pos = *(++usa_pos);
-		/* Increment position in data as well. */
-		data_pos += NTFS_BLOCK_SIZE/sizeof(u16);
+		errno = EIO;
+		ntfs_log_perror("Incomplete multi-sector transfer: "
+			"magic: 0x%08x  size: %d  usa_ofs: %d  usa_count:"
+			" %d  data: %d  usn: %d", le32_to_cpu(*(le32 *)b), size,
+			usa_ofs, (int)(sectors - i),
+			data_pos[i*(NTFS_BLOCK_SIZE/sizeof(u16))], usn);
+		b->magic = magic_BAAD;
+		return -1;
 	}
+	/* Fixup all sectors. */
+	for (i=0; i<sectors; i++)
+		data_pos[i*(NTFS_BLOCK_SIZE/sizeof(u16))] = usa_pos[i];
 	return 0;
 }
 
+/**
+ * ntfs_mst_post_read_fixup - deprotect multi sector transfer protected data
+ * @b:		pointer to the data to deprotect
+ * @size:	size in bytes of @b
+ *
+ * Perform the necessary post read multi sector transfer fixups and detect the
+ * presence of incomplete multi sector transfers. - In that case, overwrite the
+ * magic of the ntfs record header being processed with "BAAD" (in memory only!)
+ * and abort processing.
+ *
+ * Return 0 on success and -1 on error, with errno set to the error code. The
+ * following error codes are defined:
+ *	EINVAL	Invalid arguments or invalid NTFS record in buffer @b.
+ *	EIO	Multi sector transfer error was detected. Magic of the NTFS
+ *		record in @b will have been set to "BAAD".
+ */
+int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
+					BOOL warn)
+{
+	ntfs_log_trace("Entering\n");
+
+	if (size % NTFS_BLOCK_SIZE) {
+		errno = EINVAL;
+		if (warn) {
+			ntfs_log_perror("%s: magic: 0x%08lx  size: %ld "
+					"  usa_ofs: %d  usa_count: %u",
+					 __FUNCTION__,
+					(long)le32_to_cpu(*(le32 *)b),
+					(long)size, (int)le16_to_cpu(b->usa_ofs),
+					(unsigned int)le16_to_cpu(b->usa_count));
+		}
+		return -1;
+	}
+	return (post_read_fixup(b, size, warn));
+}
+
 /*
  *		Deprotect multi sector transfer protected data
  *	with a warning if an error is found.
@@ -146,6 +169,40 @@ int ntfs_mst_post_read_fixup(NTFS_RECORD *b, const u32 size)
 	return (ntfs_mst_post_read_fixup_warn(b,size,TRUE));
 }
 
+/*
+ *		Protect a validated record
+ */
+
+static void pre_write_fixup(NTFS_RECORD *b, u16 usa_ofs, u16 usa_count)
+{
+	le16 *usa_pos, *data_pos;
+	le16 le_usn;
+	u16 usn;
+	u32 i;
+
+	/* Position of usn in update sequence array. */
+	usa_pos = (le16*)((u8*)b + usa_ofs);
+	/*
+	 * Cyclically increment the update sequence number
+	 * (skipping 0 and -1, i.e. 0xffff).
+	 */
+	usn = le16_to_cpup(usa_pos) + 1;
+	if (usn == 0xffff || !usn)
+		usn = 1;
+	le_usn = cpu_to_le16(usn);
+	*usa_pos++ = le_usn;
+	/* Position in data of first le16 that needs fixing up. */
+	data_pos = (le16*)b + NTFS_BLOCK_SIZE/sizeof(le16) - 1;
+	/*
+	 * Save the original data from the data buffer into the usa
+	 * and apply the fixup to data, for all sectors.
+	 */
+	for (i=0; i<(u32)usa_count - 1; i++) {
+		usa_pos[i] = data_pos[i*(NTFS_BLOCK_SIZE/sizeof(le16))];
+		data_pos[i*(NTFS_BLOCK_SIZE/sizeof(le16))] = le_usn;
+	}
+}
+
 /**
  * ntfs_mst_pre_write_fixup - apply multi sector transfer protection
  * @b:		pointer to the data to protect
@@ -168,9 +225,7 @@ int ntfs_mst_post_read_fixup(NTFS_RECORD *b, const u32 size)
  */
 int ntfs_mst_pre_write_fixup(NTFS_RECORD *b, const u32 size)
 {
-	u16 usa_ofs, usa_count, usn;
-	le16 le_usn;
-	le16 *usa_pos, *data_pos;
+	u16 usa_ofs, usa_count;
 
 	ntfs_log_trace("Entering\n");
 
@@ -190,34 +245,95 @@ int ntfs_mst_pre_write_fixup(NTFS_RECORD *b, const u32 size)
 		ntfs_log_perror("%s", __FUNCTION__);
 		return -1;
 	}
-	/* Position of usn in update sequence array. */
-	usa_pos = (le16*)((u8*)b + usa_ofs);
-	/*
-	 * Cyclically increment the update sequence number
-	 * (skipping 0 and -1, i.e. 0xffff).
-	 */
-	usn = le16_to_cpup(usa_pos) + 1;
-	if (usn == 0xffff || !usn)
-		usn = 1;
-	le_usn = cpu_to_le16(usn);
-	*usa_pos = le_usn;
-	/* Position in data of first le16 that needs fixing up. */
-	data_pos = (le16*)b + NTFS_BLOCK_SIZE/sizeof(le16) - 1;
-	/* Fixup all sectors. */
-	while (--usa_count) {
-		/*
-		 * Increment the position in the usa and save the
-		 * original data from the data buffer into the usa.
-		 */
-		*(++usa_pos) = *data_pos;
-		/* Apply fixup to data. */
-		*data_pos = le_usn;
-		/* Increment position in data as well. */
-		data_pos += NTFS_BLOCK_SIZE/sizeof(le16);
-	}
+	pre_write_fixup(b, usa_ofs, usa_count);
 	return 0;
 }
 
+/*
+ *		Deprotect multi sector transfer protected records
+ *
+ *	This is the batched version of ntfs_mst_post_read_fixup_warn()
+ *	for @count consecutive records of @size bytes, such as a chunk
+ *	of the MFT or several index blocks. All the records are fixed
+ *	up even if some of them are bad, so that the "BAAD" magic can be
+ *	detected later.
+ *
+ *	Returns 0 if all the records could be fixed up, or -1 with errno
+ *	set by the last failed fixup.
+ */
+
+int ntfs_mst_post_read_fixup_many(void *b, s64 count, const u32 size,
+			BOOL warn)
+{
+	u8 *rec;
+	int err;
+	int res;
+
+	ntfs_log_trace("Entering for %lld records\n", (long long)count);
+	if (size % NTFS_BLOCK_SIZE) {
+		errno = EINVAL;
+		if (warn)
+			ntfs_log_perror("%s: size: %ld", __FUNCTION__,
+					(long)size);
+		return -1;
+	}
+	res = 0;
+	err = 0;
+	for (rec=(u8*)b; count>0; rec+=size, count--) {
+		if (post_read_fixup((NTFS_RECORD*)rec, size, warn)) {
+			err = errno;
+			res = -1;
+		}
+	}
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/*
+ *		Apply multi sector transfer protection to records
+ *
+ *	This is the batched version of ntfs_mst_pre_write_fixup() for
+ *	@count consecutive records of @size bytes, stopping at the first
+ *	record which cannot be protected.
+ *
+ *	Returns the number of records protected, or -1 if the first one
+ *	could not be protected. errno is set to EINVAL when some record
+ *	could not be protected.
+ */
+
+s64 ntfs_mst_pre_write_fixup_many(void *b, s64 count, const u32 size)
+{
+	NTFS_RECORD *rec;
+	u16 usa_ofs, usa_count;
+	s64 done;
+
+	ntfs_log_trace("Entering for %lld records\n", (long long)count);
+	done = 0;
+	if (b && !(size % NTFS_BLOCK_SIZE)) {
+		rec = (NTFS_RECORD*)b;
+		while (done < count) {
+			usa_ofs = le16_to_cpu(rec->usa_ofs);
+			usa_count = le16_to_cpu(rec->usa_count);
+			if (ntfs_is_baad_record(rec->magic)
+			    || ntfs_is_hole_record(rec->magic)
+			    || !is_valid_record(size, usa_ofs, usa_count))
+				break;
+			pre_write_fixup(rec, usa_ofs, usa_count);
+			rec = (NTFS_RECORD*)((u8*)rec + size);
+			done++;
+		}
+	}
+	if (done < count) {
+		errno = EINVAL;
+		if (!done) {
+			ntfs_log_perror("%s", __FUNCTION__);
+			done = -1;
+		}
+	}
+	return (done);
+}
+
 /**
  * ntfs_mst_post_write_fixup - deprotect multi sector transfer protected data
  * @b:		pointer to the data to deprotect
@@ -255,3 +371,18 @@ void ntfs_mst_post_write_fixup(NTFS_RECORD *b)
 	}
 }
 
+/*
+ *		Deprotect records after they have been written
+ *
+ *	This is the batched version of ntfs_mst_post_write_fixup(), for
+ *	@count consecutive records of @size bytes protected by
+ *	ntfs_mst_pre_write_fixup_many().
+ */
+
+void ntfs_mst_post_write_fixup_many(void *b, s64 count, const u32 size)
+{
+	u8 *rec;
+
+	for (rec=(u8*)b; count>0; rec+=size, count--)
+		ntfs_mst_post_write_fixup((NTFS_RECORD*)rec);
+}
@@ -178,10 +178,13 @@ static int set_object_id_index(ntfs_inode *ni, ntfs_index_context *xo,
 /*
  *		Open the $Extend/$ObjId file and its index
  *
+ *	They are opened on first use and kept open until the volume is
+ *	released, as for $Extend/$Reparse.
+ *
  *	Return the index context if opened
  *		or NULL if an error occurred (errno tells why)
  *
- *	The index has to be freed and inode closed when not needed any more.
+ *	The index has to be released when not needed any more.
  */
 
 static ntfs_index_context *open_object_id_index(ntfs_volume *vol)
@@ -191,25 +194,63 @@ static ntfs_index_context *open_object_id_index(ntfs_volume *vol)
 	ntfs_inode *dir_ni;
 	ntfs_index_context *xo;
 
-		/* do not use path_name_to inode - could reopen root */
-	dir_ni = ntfs_inode_open(vol, FILE_Extend);
-	ni = (ntfs_inode*)NULL;
-	if (dir_ni) {
-		inum = ntfs_inode_lookup_by_mbsname(dir_ni,"$ObjId");
-		if (inum != (u64)-1)
-			ni = ntfs_inode_open(vol, inum);
-		ntfs_inode_close(dir_ni);
-	}
-	if (ni) {
-		xo = ntfs_index_ctx_get(ni, objid_index_name, 2);
-		if (!xo) {
-			ntfs_inode_close(ni);
+	xo = vol->objid_xo;
+	if (!xo) {
+			/* do not use path_name_to inode - could reopen root */
+		dir_ni = ntfs_inode_open(vol, FILE_Extend);
+		ni = (ntfs_inode*)NULL;
+		if (dir_ni) {
+			inum = ntfs_inode_lookup_by_mbsname(dir_ni,"$ObjId");
+			if (inum != (u64)-1)
+				ni = ntfs_inode_open(vol, inum);
+			ntfs_inode_close(dir_ni);
 		}
-	} else
-		xo = (ntfs_index_context*)NULL;
+		if (ni) {
+			xo = ntfs_index_ctx_get(ni, objid_index_name, 2);
+			if (xo) {
+				vol->objid_ni = ni;
+				vol->objid_xo = xo;
+			} else
+				ntfs_inode_close(ni);
+		}
+	}
 	return (xo);
 }
 
+/*
+ *		Release the index after an update
+ *
+ *	The index context is made ready for the next lookup, the index
+ *	root is written when the metadata of the volume is flushed.
+ */
+
+static void release_object_id_index(ntfs_index_context *xo)
+{
+	ntfs_index_entry_mark_dirty(xo);
+	NInoSetDirty(xo->ni);
+	ntfs_index_ctx_reinit(xo);
+}
+
+/*
+ *		Close the $Extend/$ObjId file and its index
+ *
+ *	Returns 0, or -1 if the index could not be written (errno set)
+ */
+
+int ntfs_close_object_id_index(ntfs_volume *vol)
+{
+	int res;
+
+	res = 0;
+	if (vol->objid_xo) {
+		ntfs_index_ctx_put(vol->objid_xo);
+		res = ntfs_inode_close(vol->objid_ni);
+		vol->objid_xo = (ntfs_index_context*)NULL;
+		vol->objid_ni = (ntfs_inode*)NULL;
+	}
+	return (res);
+}
+
 
 /*
  *		Merge object_id data stored in the index into
@@ -226,7 +267,6 @@ static int merge_index_data(ntfs_inode *ni,
 	OBJECT_ID_INDEX_KEY key;
 	struct OBJECT_ID_INDEX *entry;
 	ntfs_index_context *xo;
-	ntfs_inode *xoni;
 	int res;
 
 	res = -1;
@@ -252,9 +292,7 @@ static int merge_index_data(ntfs_inode *ni,
 				res = 0;
 			}
 		}
-		xoni = xo->ni;
-		ntfs_index_ctx_put(xo);
-		ntfs_inode_close(xoni);
+		ntfs_index_ctx_reinit(xo);
 	}
 	return (res);
 }
@@ -427,7 +465,6 @@ static int add_object_id(ntfs_inode *ni, int flags)
 int ntfs_delete_object_id_index(ntfs_inode *ni)
 {
 	ntfs_index_context *xo;
-	ntfs_inode *xoni;
 	ntfs_attr *na;
 	OBJECT_ID_ATTR old_attr;
 	int res;
@@ -443,11 +480,7 @@ int ntfs_delete_object_id_index(ntfs_inode *ni)
 		if (xo) {
 			if (remove_object_id_index(na,xo,&old_attr) < 0)
 				res = -1;
-			xoni = xo->ni;
-			ntfs_index_entry_mark_dirty(xo);
-			NInoSetDirty(xoni);
-			ntfs_index_ctx_put(xo);
-			ntfs_inode_close(xoni);
+			release_object_id_index(xo);
 		}
 		ntfs_attr_close(na);
 	}
@@ -522,7 +555,6 @@ int ntfs_set_ntfs_object_id(ntfs_inode *ni,
 			const char *value, size_t size, int flags)
 {
 	OBJECT_ID_INDEX_KEY key;
-	ntfs_inode *xoni;
 	ntfs_index_context *xo;
 	int res;
 
@@ -549,11 +581,7 @@ int ntfs_set_ntfs_object_id(ntfs_inode *ni,
 				res = -1;
 				errno = EEXIST;
 			}
-			xoni = xo->ni;
-			ntfs_index_entry_mark_dirty(xo);
-			NInoSetDirty(xoni);
-			ntfs_index_ctx_put(xo);
-			ntfs_inode_close(xoni);
+			release_object_id_index(xo);
 		} else {
 			res = -1;
 		}
@@ -575,7 +603,6 @@ int ntfs_remove_ntfs_object_id(ntfs_inode *ni)
 	int res;
 	int olderrno;
 	ntfs_attr *na;
-	ntfs_inode *xoni;
 	ntfs_index_context *xo;
 	int oldsize;
 	OBJECT_ID_ATTR old_attr;
@@ -615,11 +642,7 @@ int ntfs_remove_ntfs_object_id(ntfs_inode *ni)
 					}
 				}
 
-				xoni = xo->ni;
-				ntfs_index_entry_mark_dirty(xo);
-				NInoSetDirty(xoni);
-				ntfs_index_ctx_put(xo);
-				ntfs_inode_close(xoni);
+				release_object_id_index(xo);
 			}
 			olderrno = errno;
 			ntfs_attr_close(na);
@@ -0,0 +1,478 @@
+/**
+ * prefetch.c - Prefetching the data read after mounting a volume.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <time.h>
+
+#include "types.h"
+#include "endians.h"
+#include "volume.h"
+#include "device.h"
+#include "blkcache.h"
+#include "prefetch.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Prefetching the data read after mounting
+ *
+ *	Booting or starting an application reads the same files in the
+ *	same order each time. When set up by ntfs_prefetch_start(), the
+ *	device ranges read through ntfs_pread() and its variants during
+ *	the first PREFETCH_RECORD_TIME seconds are recorded, and saved
+ *	into a sidecar file when unmounting. This covers the mft records,
+ *	the index blocks and the file data, whatever the files they
+ *	belong to.
+ *
+ *	When the same volume is mounted again, the ranges saved are read
+ *	in the order of their positions on the device, and in the
+ *	background when threads are available, into the block cache if
+ *	there is one, or otherwise into the cache of the device kept by
+ *	the system. As the data is only read, and is checked by the block
+ *	cache against concurrent writes, a stale file leads to useless
+ *	reads, never to inconsistencies. The file is keyed by the serial
+ *	number and size of the volume.
+ */
+
+#define PREFETCH_MAGIC "NTFS3GPF"
+#define PREFETCH_VERSION 1
+
+struct PREFETCH_HEADER {	/* as stored in the sidecar file */
+	char magic[8];
+	le32 version;
+	le32 count;		/* ranges following */
+	le64 serial;
+	le64 nr_clusters;
+} ;
+
+struct PREFETCH_RECORD {	/* as stored in the sidecar file */
+	le64 pos;
+	le64 count;
+} ;
+
+struct PREFETCH_RANGE {
+	s64 pos;
+	s64 count;
+} ;
+
+struct NTFS_PREFETCH {
+	char *path;		/* sidecar file */
+	u64 serial;
+	s64 nr_clusters;
+	time_t until;		/* end of recording */
+	int recorded;		/* ranges recorded */
+	int replayed;		/* ranges to replay */
+	struct PREFETCH_RANGE *replay;
+	struct ntfs_device *dev;
+	BOOL started;		/* replaying thread started */
+#ifdef HAVE_PTHREAD_H
+	BOOL stop;		/* replaying thread has to stop */
+	pthread_mutex_t lock;
+	pthread_t thread;
+#endif
+	struct PREFETCH_RANGE ranges[PREFETCH_MAX_RANGES];
+} ;
+
+static void prefetch_lock(struct NTFS_PREFETCH *pf __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&pf->lock);
+#endif
+}
+
+static void prefetch_unlock(struct NTFS_PREFETCH *pf __attribute__((unused)))
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&pf->lock);
+#endif
+}
+
+static BOOL prefetch_stopped(struct NTFS_PREFETCH *pf __attribute__((unused)))
+{
+	BOOL stop;
+
+	stop = FALSE;
+#ifdef HAVE_PTHREAD_H
+	prefetch_lock(pf);
+	stop = pf->stop;
+	prefetch_unlock(pf);
+#endif
+	return (stop);
+}
+
+static int range_compare(const void *p1, const void *p2)
+{
+	const struct PREFETCH_RANGE *r1 = (const struct PREFETCH_RANGE*)p1;
+	const struct PREFETCH_RANGE *r2 = (const struct PREFETCH_RANGE*)p2;
+
+	return ((r1->pos > r2->pos) - (r1->pos < r2->pos));
+}
+
+/*
+ *		Sort ranges by position, and merge the close ones
+ *
+ *	Returns the new count of ranges
+ */
+
+static int merge_ranges(struct PREFETCH_RANGE *ranges, int count)
+{
+	int i;
+	int n;
+
+	n = 0;
+	if (count > 0) {
+		qsort(ranges, count, sizeof(struct PREFETCH_RANGE),
+				range_compare);
+		for (i=1; i<count; i++) {
+			if (ranges[i].pos <= (ranges[n].pos + ranges[n].count
+						+ PREFETCH_MERGE_GAP)) {
+				if ((ranges[i].pos + ranges[i].count)
+				    > (ranges[n].pos + ranges[n].count))
+					ranges[n].count = ranges[i].pos
+						+ ranges[i].count
+						- ranges[n].pos;
+			} else
+				ranges[++n] = ranges[i];
+		}
+		n++;
+	}
+	return (n);
+}
+
+/*
+ *		Record a range read from the device
+ */
+
+void ntfs_prefetch_io(struct ntfs_device *dev, s64 pos, s64 count)
+{
+	struct NTFS_PREFETCH *pf;
+	struct PREFETCH_RANGE *last;
+
+	pf = dev->d_prefetch;
+	if (pf && (count > 0)) {
+		prefetch_lock(pf);
+		if (pf->until && (time((time_t*)NULL) > pf->until))
+			pf->until = 0;
+		if (pf->until) {
+			last = (pf->recorded
+				? &pf->ranges[pf->recorded - 1]
+				: (struct PREFETCH_RANGE*)NULL);
+			if (last && (pos == (last->pos + last->count)))
+				last->count += count;
+			else
+				if (pf->recorded < PREFETCH_MAX_RANGES) {
+					last = &pf->ranges[pf->recorded++];
+					last->pos = pos;
+					last->count = count;
+				} else
+					pf->until = 0;
+		}
+		prefetch_unlock(pf);
+	}
+}
+
+/*
+ *		Read the ranges saved by the previous mount
+ *
+ *	Returns NULL if there are none, or they are for another volume
+ */
+
+static struct PREFETCH_RANGE *load_ranges(struct NTFS_PREFETCH *pf,
+			int *pcount)
+{
+	struct PREFETCH_HEADER header;
+	struct PREFETCH_RECORD rec;
+	struct PREFETCH_RANGE *ranges;
+	FILE *f;
+	int count;
+	int i;
+
+	ranges = (struct PREFETCH_RANGE*)NULL;
+	*pcount = 0;
+	i = 0;
+	f = fopen(pf->path, "rb");
+	if (f) {
+		count = 0;
+		if ((fread(&header, sizeof(header), 1, f) == 1)
+		    && !memcmp(header.magic, PREFETCH_MAGIC,
+					sizeof(header.magic))
+		    && (header.version == const_cpu_to_le32(PREFETCH_VERSION))
+		    && (le64_to_cpu(header.serial) == pf->serial)
+		    && ((s64)le64_to_cpu(header.nr_clusters)
+					== pf->nr_clusters)) {
+			count = le32_to_cpu(header.count);
+			if ((count < 0) || (count > PREFETCH_MAX_RANGES))
+				count = 0;
+		}
+		if (count)
+			ranges = (struct PREFETCH_RANGE*)ntfs_malloc(
+				count*sizeof(struct PREFETCH_RANGE));
+		for (i=0; ranges && (i<count); i++) {
+			if (fread(&rec, sizeof(rec), 1, f) != 1)
+				break;
+			ranges[i].pos = le64_to_cpu(rec.pos);
+			ranges[i].count = le64_to_cpu(rec.count);
+			if ((ranges[i].pos < 0) || (ranges[i].count <= 0))
+				break;
+		}
+		fclose(f);
+		if (ranges && (i < count)) {
+			ntfs_log_info("Ignoring the damaged prefetch file %s\n",
+					pf->path);
+			free(ranges);
+			ranges = (struct PREFETCH_RANGE*)NULL;
+		} else
+			*pcount = count;
+	}
+	return (ranges);
+}
+
+/*
+ *		Save the ranges recorded, when unmounting
+ *
+ *	Failing is not an error.
+ */
+
+static void save_ranges(struct NTFS_PREFETCH *pf)
+{
+	struct PREFETCH_HEADER header;
+	struct PREFETCH_RECORD rec;
+	char *tmp;
+	FILE *f;
+	BOOL ok;
+	int count;
+	int i;
+
+	count = merge_ranges(pf->ranges, pf->recorded);
+	if (!count)
+		return;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PREFETCH_MAGIC, sizeof(header.magic));
+	header.version = const_cpu_to_le32(PREFETCH_VERSION);
+	header.count = cpu_to_le32(count);
+	header.serial = cpu_to_le64(pf->serial);
+	header.nr_clusters = cpu_to_le64(pf->nr_clusters);
+		/* write to a temporary file, then rename */
+	tmp = (char*)ntfs_malloc(strlen(pf->path) + 5);
+	if (tmp) {
+		strcpy(tmp, pf->path);
+		strcat(tmp, ".tmp");
+		f = fopen(tmp, "wb");
+		ok = FALSE;
+		if (f) {
+			ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+			for (i=0; ok && (i<count); i++) {
+				rec.pos = cpu_to_le64(pf->ranges[i].pos);
+				rec.count = cpu_to_le64(pf->ranges[i].count);
+				ok = (fwrite(&rec, sizeof(rec), 1, f) == 1);
+			}
+			if (fclose(f))
+				ok = FALSE;
+			if (ok && rename(tmp, pf->path))
+				ok = FALSE;
+			if (!ok)
+				unlink(tmp);
+		}
+		if (!ok)
+			ntfs_log_perror("Could not save the prefetch file %s",
+					pf->path);
+		free(tmp);
+	}
+}
+
+/*
+ *		Read again the ranges saved
+ *
+ *	The data is read into the block cache, up to half its capacity,
+ *	or, if the device is not opened for direct I/O, read and dropped
+ *	so that the system keeps it, up to PREFETCH_MAX_BYTES.
+ *	Errors just stop prefetching.
+ */
+
+static void replay_ranges(struct NTFS_PREFETCH *pf)
+{
+	struct ntfs_device *dev;
+	struct PREFETCH_RANGE *range;
+	char *buf;
+	s64 limit;
+	s64 total;
+	s64 pos;
+	s64 n;
+	int i;
+
+	dev = pf->dev;
+	buf = (char*)NULL;
+	if (dev->d_cache)
+		limit = dev->d_cache->capacity/2;
+	else
+		if (!NDevDirect(dev))
+			limit = PREFETCH_MAX_BYTES;
+		else
+			limit = 0;
+	total = 0;
+	for (i=0; (i<pf->replayed) && (total < limit)
+			&& !prefetch_stopped(pf); i++) {
+		range = &pf->replay[i];
+		n = min(range->count, limit - total);
+		if (dev->d_cache) {
+			if (ntfs_block_cache_prefetch(dev, range->pos, n))
+				break;
+		} else {
+			if (!buf)
+				buf = (char*)ntfs_malloc(PREFETCH_CHUNK);
+			if (!buf)
+				break;
+			for (pos=range->pos; pos<(range->pos + n);
+						pos+=PREFETCH_CHUNK)
+				if (dev->d_ops->pread(dev, buf,
+					    min(PREFETCH_CHUNK,
+						range->pos + n - pos),
+					    pos) <= 0)
+					break;
+			if (pos < (range->pos + n))
+				break;
+		}
+		total += n;
+	}
+	free(buf);
+	ntfs_log_debug("Prefetched %lld bytes in %d ranges\n",
+			(long long)total, i);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *prefetch_thread(void *arg)
+{
+	replay_ranges((struct NTFS_PREFETCH*)arg);
+	return ((void*)NULL);
+}
+
+#endif
+
+/**
+ * ntfs_prefetch_start - prefetch what was read after the previous mount
+ * @vol:	ntfs volume just mounted
+ * @path:	sidecar file holding the ranges read
+ *
+ * Read again the ranges of the device which were read after the
+ * previous mount of the same volume, in the background if threads are
+ * available, and record the ranges read from now on, to be saved
+ * in @path by ntfs_prefetch_stop(). Not set in ntfs_mount(), as it
+ * has to be started after the daemon has detached.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_prefetch_start(ntfs_volume *vol, const char *path)
+{
+	struct NTFS_PREFETCH *pf;
+
+	if (!vol || !path || vol->dev->d_prefetch) {
+		errno = EINVAL;
+		return (-1);
+	}
+	pf = (struct NTFS_PREFETCH*)ntfs_malloc(sizeof(struct NTFS_PREFETCH));
+	if (!pf)
+		return (-1);
+	pf->path = strdup(path);
+	if (!pf->path) {
+		free(pf);
+		errno = ENOMEM;
+		return (-1);
+	}
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&pf->lock, (pthread_mutexattr_t*)NULL)) {
+		free(pf->path);
+		free(pf);
+		errno = ENOMEM;
+		return (-1);
+	}
+	pf->stop = FALSE;
+#endif
+	pf->serial = vol->vol_serial;
+	pf->nr_clusters = vol->nr_clusters;
+	pf->dev = vol->dev;
+	pf->recorded = 0;
+	pf->started = FALSE;
+	pf->replay = load_ranges(pf, &pf->replayed);
+	pf->until = time((time_t*)NULL) + PREFETCH_RECORD_TIME;
+	vol->dev->d_prefetch = pf;
+	if (pf->replay) {
+#ifdef HAVE_PTHREAD_H
+		pf->started = !pthread_create(&pf->thread,
+				(pthread_attr_t*)NULL, prefetch_thread,
+				(void*)pf);
+#endif
+		if (!pf->started)
+			replay_ranges(pf);
+	}
+	return (0);
+}
+
+/**
+ * ntfs_prefetch_stop - stop prefetching and save the ranges read
+ * @vol:	ntfs volume
+ *
+ * Stop the prefetching thread, and save the ranges read since
+ * ntfs_prefetch_start() for the next mount.
+ */
+void ntfs_prefetch_stop(ntfs_volume *vol)
+{
+	struct NTFS_PREFETCH *pf;
+
+	pf = (vol->dev ? vol->dev->d_prefetch : (struct NTFS_PREFETCH*)NULL);
+	if (pf) {
+#ifdef HAVE_PTHREAD_H
+		if (pf->started) {
+			prefetch_lock(pf);
+			pf->stop = TRUE;
+			prefetch_unlock(pf);
+			pthread_join(pf->thread, (void**)NULL);
+		}
+#endif
+		vol->dev->d_prefetch = (struct NTFS_PREFETCH*)NULL;
+		save_ranges(pf);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&pf->lock);
+#endif
+		free(pf->replay);
+		free(pf->path);
+		free(pf);
+	}
+}
@@ -60,6 +60,7 @@
 #include "reparse.h"
 #include "xattrs.h"
 #include "ea.h"
+#include "cache.h"
 
 struct MOUNT_POINT_REPARSE_DATA {      /* reparse data for junctions */
 	le16	subst_name_offset;
@@ -784,7 +785,7 @@ static char *ntfs_get_rellink(ntfs_inode *ni, ntfschar *junction, int count)
  *			symbolic link or directory junction
  */
 
-char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point)
+static char *make_symlink(ntfs_inode *ni, const char *mnt_point)
 {
 	s64 attr_size = 0;
 	char *target;
@@ -901,6 +902,109 @@ char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point)
 	return (target);
 }
 
+#if CACHE_SYMLINK_SIZE
+
+/*
+ *		Cache of symlink targets
+ *
+ *	Resolving the target of a junction or an absolute symlink implies
+ *	looking up each component of the target path, so the resolved
+ *	targets are kept, and reused until the reparse data of the symlink
+ *	or any directory is changed. They are identified by the inode
+ *	number and sequence number of the symlink, and the mount point
+ *	is assumed not to change while the volume is mounted.
+ */
+
+static int symlink_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	const struct CACHED_SYMLINK *c = (const struct CACHED_SYMLINK*)cached;
+	const struct CACHED_SYMLINK *w = (const struct CACHED_SYMLINK*)wanted;
+
+	return (!c->target || (c->mref != w->mref));
+}
+
+#endif /* CACHE_SYMLINK_SIZE */
+
+/*
+ *		Symlink hashing
+ */
+
+int ntfs_reparse_symlink_hash(const struct CACHED_GENERIC *cached)
+{
+	return ((int)(MREF(((const struct CACHED_SYMLINK*)cached)->mref)
+			& INT_MAX));
+}
+
+/*
+ *		Forget the target of a symlink
+ *
+ *	To be called whenever the reparse data of the inode is changed.
+ */
+
+void ntfs_reparse_symlink_forget(ntfs_inode *ni)
+{
+#if CACHE_SYMLINK_SIZE
+	struct CACHED_SYMLINK item;
+
+	if (ni->vol->symlink_cache) {
+		item.mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		ntfs_invalidate_cache(ni->vol->symlink_cache,
+				GENERIC(&item), symlink_cache_compare, 0);
+	}
+#endif /* CACHE_SYMLINK_SIZE */
+}
+
+/*
+ *		Get the target for a junction point or symbolic link,
+ *	see make_symlink() above
+ *
+ *	The target is taken from the cache if it has been resolved since
+ *	the last change of a directory. The returned target has to be
+ *	freed by the caller in all cases.
+ */
+
+char *ntfs_make_symlink(ntfs_inode *ni, const char *mnt_point)
+{
+	char *target;
+#if CACHE_SYMLINK_SIZE
+	struct CACHED_SYMLINK item;
+	struct CACHED_SYMLINK cached;
+	ntfs_volume *vol;
+	u32 changes;
+
+	vol = ni->vol;
+	if (vol->symlink_cache) {
+		item.mref = MK_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+		changes = vol->listing_changes;
+		if (ntfs_fetch_cache_dup(vol->symlink_cache, GENERIC(&item),
+				symlink_cache_compare,
+				(struct CACHED_GENERIC*)&cached)) {
+			if (cached.changes == changes)
+				return ((char*)cached.target);
+			free((char*)cached.target);
+				/* stale entries are not replaced */
+			ntfs_invalidate_cache(vol->symlink_cache,
+				GENERIC(&item), symlink_cache_compare, 0);
+		}
+		target = make_symlink(ni, mnt_point);
+		if (target && (changes == vol->listing_changes)) {
+			item.target = target;
+			item.size = strlen(target) + 1;
+			item.changes = changes;
+			ntfs_enter_cache(vol->symlink_cache, GENERIC(&item),
+					symlink_cache_compare);
+		}
+	} else
+		target = make_symlink(ni, mnt_point);
+#else /* CACHE_SYMLINK_SIZE */
+	target = make_symlink(ni, mnt_point);
+#endif /* CACHE_SYMLINK_SIZE */
+	return (target);
+}
+
 /*
  *		Check whether a reparse point looks like a junction point
  *	or a symbolic link.
@@ -1013,10 +1117,14 @@ static int remove_reparse_index(ntfs_attr *na, ntfs_index_context *xr,
 /*
  *		Open the $Extend/$Reparse file and its index
  *
+ *	They are opened on first use and kept open until the volume is
+ *	released, so that creating many reparse points does not require
+ *	looking up $Reparse in $Extend and opening it for each of them.
+ *
  *	Return the index context if opened
  *		or NULL if an error occurred (errno tells why)
  *
- *	The index has to be freed and inode closed when not needed any more.
+ *	The index has to be released when not needed any more.
  */
 
 static ntfs_index_context *open_reparse_index(ntfs_volume *vol)
@@ -1026,25 +1134,64 @@ static ntfs_index_context *open_reparse_index(ntfs_volume *vol)
 	ntfs_inode *dir_ni;
 	ntfs_index_context *xr;
 
-		/* do not use path_name_to inode - could reopen root */
-	dir_ni = ntfs_inode_open(vol, FILE_Extend);
-	ni = (ntfs_inode*)NULL;
-	if (dir_ni) {
-		inum = ntfs_inode_lookup_by_mbsname(dir_ni,"$Reparse");
-		if (inum != (u64)-1)
-			ni = ntfs_inode_open(vol, inum);
-		ntfs_inode_close(dir_ni);
-	}
-	if (ni) {
-		xr = ntfs_index_ctx_get(ni, reparse_index_name, 2);
-		if (!xr) {
-			ntfs_inode_close(ni);
+	xr = vol->reparse_xr;
+	if (!xr) {
+			/* do not use path_name_to inode - could reopen root */
+		dir_ni = ntfs_inode_open(vol, FILE_Extend);
+		ni = (ntfs_inode*)NULL;
+		if (dir_ni) {
+			inum = ntfs_inode_lookup_by_mbsname(dir_ni,"$Reparse");
+			if (inum != (u64)-1)
+				ni = ntfs_inode_open(vol, inum);
+			ntfs_inode_close(dir_ni);
 		}
-	} else
-		xr = (ntfs_index_context*)NULL;
+		if (ni) {
+			xr = ntfs_index_ctx_get(ni, reparse_index_name, 2);
+			if (xr) {
+				vol->reparse_ni = ni;
+				vol->reparse_xr = xr;
+			} else
+				ntfs_inode_close(ni);
+		}
+	}
 	return (xr);
 }
 
+/*
+ *		Release the index after an update
+ *
+ *	The modified index block is written, and the index context is
+ *	made ready for the next lookup. The index root is written when
+ *	the metadata of the volume is flushed.
+ */
+
+static void release_reparse_index(ntfs_index_context *xr)
+{
+	ntfs_index_entry_mark_dirty(xr);
+	NInoSetDirty(xr->ni);
+	ntfs_index_ctx_reinit(xr);
+}
+
+/*
+ *		Close the $Extend/$Reparse file and its index
+ *
+ *	Returns 0, or -1 if the index could not be written (errno set)
+ */
+
+int ntfs_close_reparse_index(ntfs_volume *vol)
+{
+	int res;
+
+	res = 0;
+	if (vol->reparse_xr) {
+		ntfs_index_ctx_put(vol->reparse_xr);
+		res = ntfs_inode_close(vol->reparse_ni);
+		vol->reparse_xr = (ntfs_index_context*)NULL;
+		vol->reparse_ni = (ntfs_inode*)NULL;
+	}
+	return (res);
+}
+
 
 /*
  *		Update the reparse data and index
@@ -1105,6 +1252,7 @@ static int update_reparse_data(ntfs_inode *ni, ntfs_index_context *xr,
 		}
 		ntfs_attr_close(na);
 		NInoSetDirty(ni);
+		ntfs_reparse_symlink_forget(ni);
 	} else
 		res = -1;
 	return (res);
@@ -1121,7 +1269,6 @@ static int update_reparse_data(ntfs_inode *ni, ntfs_index_context *xr,
 int ntfs_delete_reparse_index(ntfs_inode *ni)
 {
 	ntfs_index_context *xr;
-	ntfs_inode *xrni;
 	ntfs_attr *na;
 	le32 reparse_tag;
 	int res;
@@ -1137,11 +1284,7 @@ int ntfs_delete_reparse_index(ntfs_inode *ni)
 		if (xr) {
 			if (remove_reparse_index(na,xr,&reparse_tag) < 0)
 				res = -1;
-			xrni = xr->ni;
-			ntfs_index_entry_mark_dirty(xr);
-			NInoSetDirty(xrni);
-			ntfs_index_ctx_put(xr);
-			ntfs_inode_close(xrni);
+			release_reparse_index(xr);
 		}
 		ntfs_attr_close(na);
 	}
@@ -1195,7 +1338,6 @@ int ntfs_set_ntfs_reparse_data(ntfs_inode *ni,
 {
 	int res;
 	u8 dummy;
-	ntfs_inode *xrni;
 	ntfs_index_context *xr;
 
 	res = 0;
@@ -1244,11 +1386,7 @@ int ntfs_set_ntfs_reparse_data(ntfs_inode *ni,
 					/* update value and index */
 				res = update_reparse_data(ni,xr,value,size);
 			}
-			xrni = xr->ni;
-			ntfs_index_entry_mark_dirty(xr);
-			NInoSetDirty(xrni);
-			ntfs_index_ctx_put(xr);
-			ntfs_inode_close(xrni);
+			release_reparse_index(xr);
 		} else {
 			res = -1;
 		}
@@ -1270,7 +1408,6 @@ int ntfs_remove_ntfs_reparse_data(ntfs_inode *ni)
 	int res;
 	int olderrno;
 	ntfs_attr *na;
-	ntfs_inode *xrni;
 	ntfs_index_context *xr;
 	le32 reparse_tag;
 
@@ -1310,11 +1447,7 @@ int ntfs_remove_ntfs_reparse_data(ntfs_inode *ni)
 						" Possible corruption.\n");
 					}
 				}
-				xrni = xr->ni;
-				ntfs_index_entry_mark_dirty(xr);
-				NInoSetDirty(xrni);
-				ntfs_index_ctx_put(xr);
-				ntfs_inode_close(xrni);
+				release_reparse_index(xr);
 			}
 			olderrno = errno;
 			ntfs_attr_close(na);
@@ -1326,6 +1459,7 @@ int ntfs_remove_ntfs_reparse_data(ntfs_inode *ni)
 			res = -1;
 		}
 		NInoSetDirty(ni);
+		ntfs_reparse_symlink_forget(ni);
 	} else {
 		errno = EINVAL;
 		res = -1;
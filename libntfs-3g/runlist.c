@@ -753,6 +753,110 @@ runlist_element *ntfs_runlists_merge(runlist_element *drl,
 	return rl;
 }
 
+/*
+ *		Merge a runlist appended to another one
+ *
+ *	This is the common case of allocating clusters for appending to
+ *	a file : @srl either begins where @drl ends, or it fills a part
+ *	of the hole ending @drl. The merging is then done in place, only
+ *	the last runs of @drl being examined, and no run is moved. Other
+ *	cases are left to ntfs_runlists_merge().
+ *
+ *	@pcount is the count of runs in @drl (excluding the terminator),
+ *	as known by the caller, and it is updated if still known after
+ *	merging, otherwise it is set to -1.
+ *
+ *	As for ntfs_runlists_merge(), both runlists are deallocated on
+ *	success, and they are left unchanged on error.
+ *
+ *	Returns the merged runlist
+ *		or NULL if failed (with errno set)
+ */
+
+runlist_element *ntfs_runlists_merge_tail(runlist_element *drl,
+			int *pcount, runlist_element *srl)
+{
+	runlist_element *rl;
+	runlist_element term;
+	VCN start, end;
+	s64 left;
+	BOOL fill;
+	int ssize;
+	int count;
+	int pos;
+	int i;
+
+	count = *pcount;
+	if (!drl || !srl || (count <= 0) || drl[count].length)
+		goto general;
+		/* Sizing of the source, which must be fully mapped */
+	for (ssize=0; srl[ssize].length; ssize++)
+		if (srl[ssize].lcn < LCN_HOLE)
+			goto general;
+	if (!ssize)
+		goto general;
+	start = srl[0].vcn;
+	end = srl[ssize].vcn;
+	term = drl[count];
+	if (start == term.vcn)
+		fill = FALSE;
+	else {
+		/* Only allocated clusters will fill the final hole */
+		rl = &drl[count - 1];
+		if ((rl->lcn != LCN_HOLE)
+		    || (start < rl->vcn) || (end > term.vcn))
+			goto general;
+		for (i=0; i<ssize; i++)
+			if (srl[i].lcn < 0)
+				goto general;
+		fill = TRUE;
+	}
+		/* Worst case : the hole is split */
+	rl = ntfs_rl_realloc(drl, count + 1, count + ssize + 2);
+	if (!rl)
+		return ((runlist_element*)NULL);
+	drl = rl;
+	/*
+	 * We are guaranteed to succeed from here so can start modifying the
+	 * original runlists.
+	 */
+	pos = count;
+	left = 0;
+	if (fill) {
+		left = term.vcn - end;
+		if (start == drl[count - 1].vcn)
+			pos--;
+		else
+			drl[count - 1].length = start - drl[count - 1].vcn;
+	}
+	i = 0;
+	if (pos && ntfs_rl_are_mergeable(&drl[pos - 1], srl)) {
+		drl[pos - 1].length += srl[0].length;
+		i++;
+	}
+	ntfs_rl_mc(drl, pos, srl, i, ssize - i);
+	pos += ssize - i;
+	if (left) {
+		drl[pos].vcn = end;
+		drl[pos].lcn = LCN_HOLE;
+		drl[pos].length = left;
+		pos++;
+	}
+		/* Same terminator as set by ntfs_runlists_merge() */
+	drl[pos].vcn = end + left;
+	if ((srl[ssize].lcn == LCN_ENOENT) && !left)
+		drl[pos].lcn = LCN_ENOENT;
+	else
+		drl[pos].lcn = term.lcn;
+	drl[pos].length = 0;
+	free(srl);
+	*pcount = pos;
+	return (drl);
+general :
+	*pcount = -1;
+	return (ntfs_runlists_merge(drl, srl));
+}
+
 /**
  * ntfs_mapping_pairs_decompress - convert mapping pairs array to runlist
  * @vol:	ntfs volume on which the attribute resides
@@ -1101,7 +1205,9 @@ LCN ntfs_rl_vcn_to_lcn(const runlist_element *rl, const VCN vcn)
 s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		const s64 pos, s64 count, void *b)
 {
-	s64 bytes_read, to_read, ofs, total;
+	struct ntfs_io_segment seg[NTFS_MAX_IO_SEGMENTS];
+	s64 bytes_read, to_read, ofs, total, pending;
+	int nseg;
 	int err = EIO;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
@@ -1119,41 +1225,52 @@ s64 ntfs_rl_pread(const ntfs_volume *vol, const runlist_element *rl,
 		ofs += (rl->length << vol->cluster_size_bits);
 	/* Offset in the run at which to begin reading. */
 	ofs = pos - ofs;
-	for (total = 0LL; count; rl++, ofs = 0) {
-		if (!rl->length)
-			goto rl_err_out;
-		if (rl->lcn < (LCN)0) {
-			if (rl->lcn != (LCN)LCN_HOLE)
-				goto rl_err_out;
-			/* It is a hole. Just fill buffer @b with zeroes. */
+	for (total = 0LL; count; ) {
+		/*
+		 * Gather the consecutive real lcns, so that they are read
+		 * from the volume by a single batched device call.
+		 */
+		for (nseg = 0, pending = 0; count && rl->length
+				&& (rl->lcn >= 0) && (nseg < NTFS_MAX_IO_SEGMENTS);
+				rl++, ofs = 0, nseg++) {
 			to_read = min(count, (rl->length <<
 					vol->cluster_size_bits) - ofs);
-			memset(b, 0, to_read);
-			/* Update counters and proceed with next run. */
-			total += to_read;
+			seg[nseg].pos = (rl->lcn << vol->cluster_size_bits)
+					+ ofs;
+			seg[nseg].count = to_read;
+			seg[nseg].buf = b;
+			pending += to_read;
 			count -= to_read;
 			b = (u8*)b + to_read;
-			continue;
 		}
-		/* It is a real lcn, read it from the volume. */
-		to_read = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		bytes_read = ntfs_pread(vol->dev, (rl->lcn <<
-				vol->cluster_size_bits) + ofs, to_read, b);
-		/* If everything ok, update progress counters and continue. */
-		if (bytes_read > 0) {
-			total += bytes_read;
-			count -= bytes_read;
-			b = (u8*)b + bytes_read;
-			continue;
+		if (nseg) {
+			do {
+				bytes_read = ntfs_preadv(vol->dev, seg, nseg);
+				/* If the syscall was interrupted, try again. */
+			} while (bytes_read == (s64)-1 && errno == EINTR);
+			/* If everything ok, update progress counter. */
+			if (bytes_read > 0)
+				total += bytes_read;
+			if (bytes_read == pending)
+				continue;
+			if (bytes_read == (s64)-1)
+				err = errno;
+			goto rl_err_out;
 		}
-		/* If the syscall was interrupted, try again. */
-		if (bytes_read == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (bytes_read == (s64)-1)
-			err = errno;
-		goto rl_err_out;
+		if (!rl->length)
+			goto rl_err_out;
+		if (rl->lcn != (LCN)LCN_HOLE)
+			goto rl_err_out;
+		/* It is a hole. Just fill buffer @b with zeroes. */
+		to_read = min(count, (rl->length <<
+				vol->cluster_size_bits) - ofs);
+		memset(b, 0, to_read);
+		/* Update counters and proceed with next run. */
+		total += to_read;
+		count -= to_read;
+		b = (u8*)b + to_read;
+		rl++;
+		ofs = 0;
 	}
 	/* Finally, return the number of bytes read. */
 	return total;
@@ -1190,7 +1307,9 @@ rl_err_out:
 s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 		s64 ofs, const s64 pos, s64 count, void *b)
 {
-	s64 written, to_write, total = 0;
+	struct ntfs_io_segment seg[NTFS_MAX_IO_SEGMENTS];
+	s64 written, to_write, pending, total = 0;
+	int nseg;
 	int err = EIO;
 
 	if (!vol || !rl || pos < 0 || count < 0) {
@@ -1210,45 +1329,54 @@ s64 ntfs_rl_pwrite(const ntfs_volume *vol, const runlist_element *rl,
 	}
 	/* Offset in the run at which to begin writing. */
 	ofs = pos - ofs;
-	for (total = 0LL; count; rl++, ofs = 0) {
-		if (!rl->length)
-			goto rl_err_out;
-		if (rl->lcn < (LCN)0) {
-
-			if (rl->lcn != (LCN)LCN_HOLE)
-				goto rl_err_out;
-			
+	for (total = 0LL; count; ) {
+		/*
+		 * Gather the consecutive real lcns, so that they are written
+		 * to the volume by a single batched device call.
+		 */
+		for (nseg = 0, pending = 0; count && rl->length
+				&& (rl->lcn >= 0) && (nseg < NTFS_MAX_IO_SEGMENTS);
+				rl++, ofs = 0, nseg++) {
 			to_write = min(count, (rl->length <<
-					       vol->cluster_size_bits) - ofs);
-			
-			total += to_write;
+					vol->cluster_size_bits) - ofs);
+			seg[nseg].pos = (rl->lcn << vol->cluster_size_bits)
+					+ ofs;
+			seg[nseg].count = to_write;
+			seg[nseg].buf = b;
+			pending += to_write;
 			count -= to_write;
 			b = (u8*)b + to_write;
-			continue;
 		}
-		/* It is a real lcn, write it to the volume. */
-		to_write = min(count, (rl->length << vol->cluster_size_bits) -
-				ofs);
-retry:
-		if (!NVolReadOnly(vol))
-			written = ntfs_pwrite(vol->dev, (rl->lcn <<
-					vol->cluster_size_bits) + ofs,
-					to_write, b);
-		else
-			written = to_write;
-		/* If everything ok, update progress counters and continue. */
-		if (written > 0) {
-			total += written;
-			count -= written;
-			b = (u8*)b + written;
-			continue;
+		if (nseg) {
+			do {
+				if (!NVolReadOnly(vol))
+					written = ntfs_pwritev(vol->dev,
+							seg, nseg);
+				else
+					written = pending;
+				/* If the syscall was interrupted, try again. */
+			} while (written == (s64)-1 && errno == EINTR);
+			/* If everything ok, update progress counter. */
+			if (written > 0)
+				total += written;
+			if (written == pending)
+				continue;
+			if (written == (s64)-1)
+				err = errno;
+			goto rl_err_out;
 		}
-		/* If the syscall was interrupted, try again. */
-		if (written == (s64)-1 && errno == EINTR)
-			goto retry;
-		if (written == (s64)-1)
-			err = errno;
-		goto rl_err_out;
+		if (!rl->length)
+			goto rl_err_out;
+		if (rl->lcn != (LCN)LCN_HOLE)
+			goto rl_err_out;
+		/* It is a hole, skip the matching data in @b. */
+		to_write = min(count, (rl->length <<
+				       vol->cluster_size_bits) - ofs);
+		total += to_write;
+		count -= to_write;
+		b = (u8*)b + to_write;
+		rl++;
+		ofs = 0;
 	}
 out:
 	return total;
@@ -1292,32 +1420,30 @@ int ntfs_get_nr_significant_bytes(const s64 n)
 }
 
 /**
- * ntfs_get_size_for_mapping_pairs - get bytes needed for mapping pairs array
+ * ntfs_get_size_for_mapping_pairs_range - get bytes needed for a mapping pairs
+ *	array restricted to a range of vcns
  * @vol:	ntfs volume (needed for the ntfs version)
  * @rl:		runlist for which to determine the size of the mapping pairs
  * @start_vcn:	vcn at which to start the mapping pairs array
+ * @last_vcn:	last vcn to include in the mapping pairs array, -1 for all
+ * @max_size:	size beyond which the counting may stop
  *
- * Walk the runlist @rl and calculate the size in bytes of the mapping pairs
- * array corresponding to the runlist @rl, starting at vcn @start_vcn.  This
- * for example allows us to allocate a buffer of the right size when building
- * the mapping pairs array.
+ * Same as ntfs_get_size_for_mapping_pairs(), except that the mapping pairs
+ * stop after @last_vcn, the run containing it being cut there.
  *
- * If @rl is NULL, just return 1 (for the single terminator byte).
- *
- * Return the calculated size in bytes on success.  On error, return -1 with
- * errno set to the error code.  The following error codes are defined:
- *	EINVAL	- Run list contains unmapped elements. Make sure to only pass
- *		  fully mapped runlists to this function.
- *		- @start_vcn is invalid.
- *	EIO	- The runlist is corrupt.
+ * @rl does not have to be the beginning of the runlist, it can be any
+ * element up to the one containing @start_vcn.
  */
-int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
-		const runlist_element *rl, const VCN start_vcn, int max_size)
+int ntfs_get_size_for_mapping_pairs_range(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn,
+		const VCN last_vcn, int max_size)
 {
 	LCN prev_lcn;
+	s64 length;
+	BOOL the_end;
 	int rls;
 
-	if (start_vcn < 0) {
+	if ((start_vcn < 0) || ((last_vcn >= 0) && (last_vcn < start_vcn))) {
 		ntfs_log_trace("start_vcn %lld (should be >= 0)\n",
 				(long long) start_vcn);
 		errno = EINVAL;
@@ -1341,6 +1467,7 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		goto errno_set;
 	}
 	prev_lcn = 0;
+	the_end = FALSE;
 	/* Always need the terminating zero byte. */
 	rls = 1;
 	/* Do the first partial run if present. */
@@ -1351,8 +1478,13 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
 		delta = start_vcn - rl->vcn;
+		length = rl->length - delta;
+		if ((last_vcn >= 0) && (rl[1].vcn > last_vcn)) {
+			length = last_vcn + 1 - start_vcn;
+			the_end = TRUE;
+		}
 		/* Header byte + length. */
-		rls += 1 + ntfs_get_nr_significant_bytes(rl->length - delta);
+		rls += 1 + ntfs_get_nr_significant_bytes(length);
 		/*
 		 * If the logical cluster number (lcn) denotes a hole and we
 		 * are on NTFS 3.0+, we don't store it at all, i.e. we need
@@ -1371,11 +1503,16 @@ int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
 		rl++;
 	}
 	/* Do the full runs. */
-	for (; rl->length && (rls <= max_size); rl++) {
+	for (; !the_end && rl->length && (rls <= max_size); rl++) {
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
+		length = rl->length;
+		if ((last_vcn >= 0) && (rl[1].vcn > last_vcn)) {
+			length = last_vcn + 1 - rl->vcn;
+			the_end = TRUE;
+		}
 		/* Header byte + length. */
-		rls += 1 + ntfs_get_nr_significant_bytes(rl->length);
+		rls += 1 + ntfs_get_nr_significant_bytes(length);
 		/*
 		 * If the logical cluster number (lcn) denotes a hole and we
 		 * are on NTFS 3.0+, we don't store it at all, i.e. we need
@@ -1402,6 +1539,33 @@ errno_set:
 	goto out;
 }
 
+/**
+ * ntfs_get_size_for_mapping_pairs - get bytes needed for mapping pairs array
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @rl:		runlist for which to determine the size of the mapping pairs
+ * @start_vcn:	vcn at which to start the mapping pairs array
+ *
+ * Walk the runlist @rl and calculate the size in bytes of the mapping pairs
+ * array corresponding to the runlist @rl, starting at vcn @start_vcn.  This
+ * for example allows us to allocate a buffer of the right size when building
+ * the mapping pairs array.
+ *
+ * If @rl is NULL, just return 1 (for the single terminator byte).
+ *
+ * Return the calculated size in bytes on success.  On error, return -1 with
+ * errno set to the error code.  The following error codes are defined:
+ *	EINVAL	- Run list contains unmapped elements. Make sure to only pass
+ *		  fully mapped runlists to this function.
+ *		- @start_vcn is invalid.
+ *	EIO	- The runlist is corrupt.
+ */
+int ntfs_get_size_for_mapping_pairs(const ntfs_volume *vol,
+		const runlist_element *rl, const VCN start_vcn, int max_size)
+{
+	return (ntfs_get_size_for_mapping_pairs_range(vol, rl, start_vcn,
+			-1, max_size));
+}
+
 /**
  * ntfs_write_significant_bytes - write the significant bytes of a number
  * @dst:	destination buffer to write to
@@ -1477,19 +1641,51 @@ err_out:
 int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		const int dst_len, const runlist_element *rl,
 		const VCN start_vcn, runlist_element const **stop_rl)
+{
+	return (ntfs_mapping_pairs_build_range(vol, dst, dst_len, rl,
+			start_vcn, -1, stop_rl, (VCN*)NULL));
+}
+
+/**
+ * ntfs_mapping_pairs_build_range - build the mapping pairs array for a range
+ *	of vcns
+ * @vol:	ntfs volume (needed for the ntfs version)
+ * @dst:	destination buffer to which to write the mapping pairs array
+ * @dst_len:	size of destination buffer @dst in bytes
+ * @rl:		runlist for which to build the mapping pairs array
+ * @start_vcn:	vcn at which to start the mapping pairs array
+ * @last_vcn:	last vcn to include in the mapping pairs array, -1 for all
+ * @stop_rl:	runlist element containing the first vcn not included
+ * @stop_vcn:	first vcn not included, may be NULL
+ *
+ * Same as ntfs_mapping_pairs_build(), except that the mapping pairs stop
+ * after @last_vcn, the run containing it being cut there, and that the
+ * first vcn not included may then be inside *@stop_rl.
+ *
+ * @rl does not have to be the beginning of the runlist, it can be any
+ * element up to the one containing @start_vcn.
+ */
+int ntfs_mapping_pairs_build_range(const ntfs_volume *vol, u8 *dst,
+		const int dst_len, const runlist_element *rl,
+		const VCN start_vcn, const VCN last_vcn,
+		runlist_element const **stop_rl, VCN *stop_vcn)
 {
 	LCN prev_lcn;
+	s64 length;
 	u8 *dst_max, *dst_next;
 	s8 len_len, lcn_len;
+	BOOL the_end;
 	int ret = 0;
 
-	if (start_vcn < 0)
+	if ((start_vcn < 0) || ((last_vcn >= 0) && (last_vcn < start_vcn)))
 		goto val_err;
 	if (!rl) {
 		if (start_vcn)
 			goto val_err;
 		if (stop_rl)
 			*stop_rl = rl;
+		if (stop_vcn)
+			*stop_vcn = 0;
 		if (dst_len < 1)
 			goto nospc_err;
 		goto ok;
@@ -1505,6 +1701,7 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 	 */
 	dst_max = dst + dst_len - 1;
 	prev_lcn = 0;
+	the_end = FALSE;
 	/* Do the first partial run if present. */
 	if (start_vcn > rl->vcn) {
 		s64 delta;
@@ -1513,9 +1710,14 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
 		delta = start_vcn - rl->vcn;
+		length = rl->length - delta;
+		if ((last_vcn >= 0) && (rl[1].vcn > last_vcn)) {
+			length = last_vcn + 1 - start_vcn;
+			the_end = TRUE;
+		}
 		/* Write length. */
 		len_len = ntfs_write_significant_bytes(dst + 1, dst_max,
-				rl->length - delta);
+				length);
 		if (len_len < 0)
 			goto size_err;
 		/*
@@ -1549,12 +1751,17 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		rl++;
 	}
 	/* Do the full runs. */
-	for (; rl->length; rl++) {
+	for (; !the_end && rl->length; rl++) {
 		if (rl->length < 0 || rl->lcn < LCN_HOLE)
 			goto err_out;
+		length = rl->length;
+		if ((last_vcn >= 0) && (rl[1].vcn > last_vcn)) {
+			length = last_vcn + 1 - rl->vcn;
+			the_end = TRUE;
+		}
 		/* Write length. */
 		len_len = ntfs_write_significant_bytes(dst + 1, dst_max,
-				rl->length);
+				length);
 		if (len_len < 0)
 			goto size_err;
 		/*
@@ -1583,7 +1790,15 @@ int ntfs_mapping_pairs_build(const ntfs_volume *vol, u8 *dst,
 		/* Position at next mapping pairs array element. */
 		dst += 1 + len_len + lcn_len;
 	}
-	/* Set stop vcn. */
+	/* Set stop vcn, the last run may have been cut. */
+	if (the_end) {
+		if (rl[-1].vcn + rl[-1].length > last_vcn + 1)
+			rl--;
+		if (stop_vcn)
+			*stop_vcn = last_vcn + 1;
+	} else
+		if (stop_vcn)
+			*stop_vcn = rl->vcn;
 	if (stop_rl)
 		*stop_rl = rl;
 ok:	
@@ -1595,6 +1810,8 @@ size_err:
 	/* Set stop vcn. */
 	if (stop_rl)
 		*stop_rl = rl;
+	if (stop_vcn)
+		*stop_vcn = (rl->vcn > start_vcn ? rl->vcn : start_vcn);
 	/* Add terminator byte. */
 	*dst = 0;
 nospc_err:
@@ -1755,8 +1972,312 @@ s64 ntfs_rl_get_compressed_size(ntfs_volume *vol, runlist *rl)
 	return ret << vol->cluster_size_bits;
 }
 
+/*
+ *		Compact runlists
+ *
+ *	A run is encoded as the length and a code for the lcn, both as
+ *	little-endian base-128 numbers. Codes below RL_COMPACT_SPECIAL
+ *	are for the negative special lcns (holes, ...), the others are
+ *	the zigzag encoded difference to the previous real lcn.
+ */
+
+#define RL_COMPACT_SPECIAL 8
+#define RL_COMPACT_MAX_RUN 20	/* max bytes for encoding a run */
+
+static u8 *ntfs_rl_compact_put(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return (p);
+}
+
+static const u8 *ntfs_rl_compact_get(const u8 *p, u64 *pv)
+{
+	u64 v;
+	int shift;
+
+	v = 0;
+	shift = 0;
+	while (*p & 0x80) {
+		v |= (u64)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	v |= (u64)*p++ << shift;
+	*pv = v;
+	return (p);
+}
+
+/**
+ * ntfs_rl_compact_alloc - allocate an empty compact runlist
+ *
+ * Return the compact runlist, or NULL with errno set on error.
+ */
+struct RUNLIST_COMPACT *ntfs_rl_compact_alloc(void)
+{
+	struct RUNLIST_COMPACT *crl;
+
+	crl = (struct RUNLIST_COMPACT*)
+			ntfs_calloc(sizeof(struct RUNLIST_COMPACT));
+	if (crl)
+		crl->end_lcn = LCN_ENOENT;
+	return (crl);
+}
+
+/**
+ * ntfs_rl_compact_append - append runs to a compact runlist
+ * @crl:	compact runlist to append to
+ * @rl:		runlist fragment, as decompressed from an extent
+ *
+ * Unmapped runs are ignored, the others must start where the compact
+ * runlist ends. The terminator of @rl is not appended, the caller
+ * has to set end_lcn when the runlist is complete.
+ *
+ * Return 0 if successful, or -1 with errno set on error.
+ */
+int ntfs_rl_compact_append(struct RUNLIST_COMPACT *crl,
+		const runlist_element *rl)
+{
+	struct RUNLIST_SKIP *skip;
+	u8 *data;
+	u8 *p;
+	u64 code;
+	s64 delta;
+	int blk;
+
+	for (; rl->length; rl++) {
+		if (rl->lcn == LCN_RL_NOT_MAPPED)
+			continue;
+		if ((rl->vcn != crl->end_vcn)
+		    || (rl->length < 0)
+		    || (rl->lcn < -RL_COMPACT_SPECIAL)) {
+			errno = EIO;
+			return (-1);
+		}
+		if (!(crl->count % RUNLIST_COMPACT_BLOCK)) {
+			blk = crl->count / RUNLIST_COMPACT_BLOCK;
+			if (blk >= crl->max_blocks) {
+				skip = (struct RUNLIST_SKIP*)realloc(crl->skip,
+					2*(blk + 8)*sizeof(struct RUNLIST_SKIP));
+				if (!skip) {
+					errno = ENOMEM;
+					return (-1);
+				}
+				crl->skip = skip;
+				crl->max_blocks = 2*(blk + 8);
+			}
+			crl->skip[blk].vcn = rl->vcn;
+			crl->skip[blk].lcn = crl->last_lcn;
+			crl->skip[blk].offset = crl->size;
+		}
+		if ((crl->size + RL_COMPACT_MAX_RUN) > crl->allocated) {
+			data = (u8*)realloc(crl->data,
+					2*crl->allocated + 4096);
+			if (!data) {
+				errno = ENOMEM;
+				return (-1);
+			}
+			crl->data = data;
+			crl->allocated = 2*crl->allocated + 4096;
+		}
+		p = ntfs_rl_compact_put(crl->data + crl->size, rl->length);
+		if (rl->lcn < 0)
+			code = -rl->lcn - 1;
+		else {
+			delta = rl->lcn - crl->last_lcn;
+			if (delta < 0)
+				code = ((u64)-delta << 1) - 1;
+			else
+				code = (u64)delta << 1;
+			code += RL_COMPACT_SPECIAL;
+			crl->last_lcn = rl->lcn;
+		}
+		p = ntfs_rl_compact_put(p, code);
+		crl->size = p - crl->data;
+		crl->end_vcn += rl->length;
+		crl->count++;
+	}
+	return (0);
+}
+
+/*
+ *		Locate the group of runs containing a vcn
+ *
+ *	Returns the index of the group, the vcn may be beyond the end.
+ */
+
+static int ntfs_rl_compact_group(const struct RUNLIST_COMPACT *crl, VCN vcn)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = (crl->count - 1) / RUNLIST_COMPACT_BLOCK;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1)/2;
+		if (crl->skip[mid].vcn <= vcn)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (lo);
+}
+
+/**
+ * ntfs_rl_compact_decode - decode a part of a compact runlist
+ * @crl:	compact runlist
+ * @vcn:	vcn which must be within the decoded part
+ * @max_runs:	approximate count of runs to decode, all if <= 0
+ *
+ * The result is a usual partial runlist, beginning with an unmapped
+ * run when not decoded from the start, and ending with an unmapped
+ * terminator when not decoded to the end. Starting one group before
+ * the one containing @vcn leaves some room for going backwards.
+ *
+ * Return the runlist, or NULL with errno set on error.
+ */
+runlist_element *ntfs_rl_compact_decode(const struct RUNLIST_COMPACT *crl,
+		VCN vcn, int max_runs)
+{
+	runlist_element *rl;
+	const u8 *p;
+	u64 v;
+	VCN cur;
+	LCN lcn;
+	int blocks, first, last, target;
+	int n, i, k;
+
+	blocks = (crl->count + RUNLIST_COMPACT_BLOCK - 1)
+			/ RUNLIST_COMPACT_BLOCK;
+	first = 0;
+	last = blocks;
+	if ((max_runs > 0) && blocks) {
+		target = ntfs_rl_compact_group(crl, vcn);
+		first = (target ? target - 1 : 0);
+		last = first + (max_runs + RUNLIST_COMPACT_BLOCK - 1)
+				/ RUNLIST_COMPACT_BLOCK;
+		if (last <= target)
+			last = target + 1;
+		if (last > blocks)
+			last = blocks;
+	}
+	if (last == blocks)
+		n = crl->count - first*RUNLIST_COMPACT_BLOCK;
+	else
+		n = (last - first)*RUNLIST_COMPACT_BLOCK;
+		/* room for a leading gap and the terminator */
+	rl = (runlist_element*)ntfs_malloc(((n + 2)*sizeof(runlist_element)
+				+ 0xfff) & ~0xfff);
+	if (!rl)
+		return ((runlist_element*)NULL);
+	k = 0;
+	cur = crl->end_vcn;
+	if (n) {
+		cur = crl->skip[first].vcn;
+		lcn = crl->skip[first].lcn;
+		p = crl->data + crl->skip[first].offset;
+		if (cur) {
+			rl[0].vcn = 0;
+			rl[0].lcn = LCN_RL_NOT_MAPPED;
+			rl[0].length = cur;
+			k = 1;
+		}
+		for (i=0; i<n; i++) {
+			p = ntfs_rl_compact_get(p, &v);
+			rl[k].vcn = cur;
+			rl[k].length = v;
+			cur += v;
+			p = ntfs_rl_compact_get(p, &v);
+			if (v < RL_COMPACT_SPECIAL)
+				rl[k].lcn = -(LCN)v - 1;
+			else {
+				v -= RL_COMPACT_SPECIAL;
+				if (v & 1)
+					lcn -= (LCN)((v + 1) >> 1);
+				else
+					lcn += (LCN)(v >> 1);
+				rl[k].lcn = lcn;
+			}
+			k++;
+		}
+	}
+	rl[k].vcn = cur;
+	rl[k].length = 0;
+	rl[k].lcn = (last == blocks ? crl->end_lcn : LCN_RL_NOT_MAPPED);
+	return (rl);
+}
+
+/**
+ * ntfs_rl_compact_vcn_to_lcn - convert a vcn using a compact runlist
+ * @crl:	compact runlist
+ * @vcn:	vcn to convert
+ *
+ * Only the group of runs containing @vcn is decoded.
+ *
+ * Return the lcn, or a negative special lcn as ntfs_rl_vcn_to_lcn().
+ */
+LCN ntfs_rl_compact_vcn_to_lcn(const struct RUNLIST_COMPACT *crl, VCN vcn)
+{
+	const u8 *p;
+	u64 v;
+	VCN cur;
+	VCN start;
+	LCN lcn;
+	LCN run_lcn;
+	int blk, i, n;
+
+	if (vcn < 0)
+		return (LCN_EINVAL);
+	if (vcn >= crl->end_vcn)
+		return (crl->end_lcn);
+	blk = ntfs_rl_compact_group(crl, vcn);
+	n = crl->count - blk*RUNLIST_COMPACT_BLOCK;
+	if (n > RUNLIST_COMPACT_BLOCK)
+		n = RUNLIST_COMPACT_BLOCK;
+	cur = crl->skip[blk].vcn;
+	lcn = crl->skip[blk].lcn;
+	p = crl->data + crl->skip[blk].offset;
+	for (i=0; i<n; i++) {
+		p = ntfs_rl_compact_get(p, &v);
+		start = cur;
+		cur += v;
+		p = ntfs_rl_compact_get(p, &v);
+		if (v < RL_COMPACT_SPECIAL)
+			run_lcn = -(LCN)v - 1;
+		else {
+			v -= RL_COMPACT_SPECIAL;
+			if (v & 1)
+				lcn -= (LCN)((v + 1) >> 1);
+			else
+				lcn += (LCN)(v >> 1);
+			run_lcn = lcn;
+		}
+		if (vcn < cur)
+			return (run_lcn >= 0 ? run_lcn + vcn - start : run_lcn);
+	}
+	return (LCN_ENOENT);
+}
+
+/**
+ * ntfs_rl_compact_free - free a compact runlist
+ * @crl:	compact runlist, may be NULL
+ */
+void ntfs_rl_compact_free(struct RUNLIST_COMPACT *crl)
+{
+	if (crl) {
+		free(crl->skip);
+		free(crl->data);
+		free(crl);
+	}
+}
+
 
 #ifdef NTFS_TEST
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
 /**
  * test_rl_helper
  */
@@ -2155,6 +2676,98 @@ out:
 	free(attr3);
 }
 
+/**
+ * test_rl_bench_append - Runlist test: Append runs one at a time
+ * @count:	number of runs to append
+ * @tail:	use ntfs_runlists_merge_tail() instead of ntfs_runlists_merge()
+ * @secs:	where to store the time spent merging
+ *
+ * Build a runlist of @count non contiguous runs, as fragmented files
+ * being extended by streaming writers get, alternately appending runs
+ * and filling a part of the hole at the end of the runlist.
+ *
+ * Returns: the built runlist, NULL if failed
+ */
+static runlist_element * test_rl_bench_append(int count, BOOL tail,
+		double *secs)
+{
+	runlist_element *drl;
+	runlist_element *srl;
+	clock_t start;
+	VCN end;
+	int runs;
+	int i;
+
+	/* runlists are reallocated by blocks of 4KiB */
+	drl = ntfs_malloc(0x1000);
+	if (!drl)
+		return NULL;
+	MKRL(drl+0, 0, 1000, 1)
+	MKRL(drl+1, 1, LCN_ENOENT, 0)
+	runs = 1;
+	end = 1;
+	start = clock();
+	for (i = 1; drl && (i < count); i++) {
+		srl = calloc(3, sizeof(runlist_element));
+		if (!srl)
+			break;
+		if (i & 1) {
+			/* append one cluster and a hole, as when expanding */
+			MKRL(srl+0, end, 1000 + 2*i, 1)
+			MKRL(srl+1, end + 1, LCN_HOLE, 2)
+			MKRL(srl+2, end + 3, LCN_ENOENT, 0)
+			end += 3;
+		} else {
+			/* fill the beginning of the hole, as when writing */
+			MKRL(srl+0, end - 2, 1000 + 2*i, 1)
+			MKRL(srl+1, end - 1, LCN_RL_NOT_MAPPED, 0)
+		}
+		if (tail) {
+			drl = ntfs_runlists_merge_tail(drl, &runs, srl);
+			if (runs < 0)
+				printf("Bench: the fast path was not used at %d\n",
+					i);
+		} else
+			drl = ntfs_runlists_merge(drl, srl);
+	}
+	*secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+	return drl;
+}
+
+/**
+ * test_rl_bench - Runlist test: Compare the merge fast path with the general one
+ * @arg:	number of runs to append
+ *
+ * Both ways of merging must produce the same runlist.
+ */
+static void test_rl_bench(const char *arg)
+{
+	runlist_element *rl1;
+	runlist_element *rl2;
+	double secs1, secs2;
+	int count;
+	int i;
+
+	count = atoi(arg);
+	if (count < 2) {
+		printf("Bench: bad run count '%s'\n", arg);
+		return;
+	}
+	rl1 = test_rl_bench_append(count, FALSE, &secs1);
+	rl2 = test_rl_bench_append(count, TRUE, &secs2);
+	if (rl1 && rl2) {
+		for (i = 0; rl1[i].length
+			&& !memcmp(&rl1[i], &rl2[i], sizeof(*rl1)); i++) ;
+		if (memcmp(&rl1[i], &rl2[i], sizeof(*rl1)))
+			printf("Bench: the runlists differ at run %d\n", i);
+		printf("%d runs merged in %.3fs, in %.3fs with the fast path\n",
+			i, secs1, secs2);
+	} else
+		printf("Bench: merge failed\n");
+	free(rl1);
+	free(rl2);
+}
+
 /**
  * test_rl_main - Runlist test: Program start (main)
  * @argc:
@@ -2169,8 +2782,9 @@ int test_rl_main(int argc, char *argv[])
 	if      ((argc == 2) && (strcmp(argv[1], "zero") == 0)) test_rl_zero();
 	else if ((argc == 3) && (strcmp(argv[1], "frag") == 0)) test_rl_frag(argv[2]);
 	else if ((argc == 4) && (strcmp(argv[1], "pure") == 0)) test_rl_pure(argv[2], argv[3]);
+	else if ((argc == 3) && (strcmp(argv[1], "bench") == 0)) test_rl_bench(argv[2]);
 	else
-		printf("rl [zero|frag|pure] {args}\n");
+		printf("rl [zero|frag|pure|bench] {args}\n");
 
 	return 0;
 }
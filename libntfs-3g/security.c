@@ -35,6 +35,12 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -67,6 +73,7 @@
 #include "cache.h"
 #include "misc.h"
 #include "xattrs.h"
+#include "usnjrnl.h"
 
 /*
  *	JPA NTFS constants or structs
@@ -395,14 +402,25 @@ void ntfs_generate_guid(NTFS_GUID *guid)
  * indexes.  In all three cases it forms part of the SDS_ENTRY_HEADER
  * structure.
  *
+ * Each step depends on the previous one, so the words cannot be hashed
+ * in parallel, only four of them are processed per loop.
+ *
  * Return the calculated security hash in little endian.
  */
 le32 ntfs_security_hash(const SECURITY_DESCRIPTOR_RELATIVE *sd, const u32 len)
 {
 	const le32 *pos = (const le32*)sd;
 	const le32 *end = pos + (len >> 2);
+	const le32 *end4 = pos + ((len >> 2) & ~3);
 	u32 hash = 0;
 
+	while (pos < end4) {
+		hash = le32_to_cpup(pos) + ntfs_rol32(hash, 3);
+		hash = le32_to_cpup(pos + 1) + ntfs_rol32(hash, 3);
+		hash = le32_to_cpup(pos + 2) + ntfs_rol32(hash, 3);
+		hash = le32_to_cpup(pos + 3) + ntfs_rol32(hash, 3);
+		pos += 4;
+	}
 	while (pos < end) {
 		hash = le32_to_cpup(pos) + ntfs_rol32(hash, 3);
 		pos++;
@@ -812,6 +830,25 @@ static le32 entersecurityattr(ntfs_volume *vol,
 	return (securid);
 }
 
+/*
+ *		Open $Secure if its opening was deferred when mounting
+ *
+ *	Returns 0 if $Secure is open or not used,
+ *		-1 with errno set if it could not be opened
+ */
+
+static int open_deferred_secure(ntfs_volume *vol)
+{
+	int res;
+
+	res = 0;
+	if (NVolSecureDeferred(vol)) {
+		NVolClearSecureDeferred(vol);
+		res = ntfs_open_secure(vol);
+	}
+	return (res);
+}
+
 /*
  *		Find a matching security descriptor in $Secure,
  *	if none, allocate a new id and write the descriptor to storage
@@ -821,9 +858,45 @@ static le32 entersecurityattr(ntfs_volume *vol,
  *	needed while fuse is not multithreaded
  */
 
+#if CACHE_SDH_SIZE
+
+static int sdh_compare(const struct CACHED_SDH *cached,
+			const struct CACHED_SDH *item)
+{
+	return ((cached->hash != item->hash)
+		|| (cached->attrsz != item->attrsz)
+		|| memcmp(cached->securattr, item->securattr, item->attrsz));
+}
+
+/*
+ *		Remember the securid of a descriptor found or entered
+ *	into $Secure, so that it does not have to be searched again
+ *	in $SDH and compared to the one in $SDS when used again.
+ */
+
+static void enter_sdh_cache(ntfs_volume *vol,
+			const SECURITY_DESCRIPTOR_RELATIVE *attr, s64 attrsz,
+			le32 hash, le32 securid)
+{
+	struct CACHED_SDH item;
+
+	item.securattr = (char*)attr;
+	item.attrsz = attrsz;
+	item.hash = hash;
+	item.securid = securid;
+	ntfs_enter_cache(vol->sdh_cache, GENERIC(&item),
+				(cache_compare)sdh_compare);
+}
+
+#endif /* CACHE_SDH_SIZE */
+
 static le32 setsecurityattr(ntfs_volume *vol,
 			const SECURITY_DESCRIPTOR_RELATIVE *attr, s64 attrsz)
 {
+#if CACHE_SDH_SIZE
+	struct CACHED_SDH wanted;
+	const struct CACHED_SDH *cached;
+#endif
 	struct SDH *psdh;	/* this is an image of index (le) */
 	union {
 		struct {
@@ -850,6 +923,17 @@ static le32 setsecurityattr(ntfs_volume *vol,
 	oldattr = (char*)NULL;
 	securid = const_cpu_to_le32(0);
 	res = 0;
+#if CACHE_SDH_SIZE
+	wanted.securattr = (char*)attr;
+	wanted.attrsz = attrsz;
+	wanted.hash = hash;
+	cached = (const struct CACHED_SDH*)ntfs_fetch_cache(vol->sdh_cache,
+			GENERIC(&wanted), (cache_compare)sdh_compare);
+	if (cached)
+		return (cached->securid);
+#endif
+	if (open_deferred_secure(vol))
+		return (securid);
 	xsdh = vol->secure_xsdh;
 	if (vol->secure_ni && xsdh && !vol->secure_reentry++) {
 		ntfs_index_ctx_reinit(xsdh);
@@ -928,6 +1012,11 @@ static le32 setsecurityattr(ntfs_volume *vol,
 						attr, attrsz, hash);
 				}
 			}
+#if CACHE_SDH_SIZE
+			if (securid)
+				enter_sdh_cache(vol, attr, attrsz,
+						hash, securid);
+#endif
 		}
 	}
 	if (--vol->secure_reentry)
@@ -953,6 +1042,8 @@ static int update_secur_descr(ntfs_volume *vol,
 	ntfs_attr *na;
 
 	newattrsz = ntfs_attr_size(newattr);
+	if (open_deferred_secure(vol))
+		return (-1);
 
 #if !FORCE_FORMAT_v1x
 	if ((vol->major_ver < 3) || !vol->secure_ni) {
@@ -1046,6 +1137,9 @@ static int update_secur_descr(ntfs_volume *vol,
 
 	/* mark node as dirty */
 	NInoSetDirty(ni);
+	if (!res && vol->usn_journal)
+		ntfs_usn_change(ni, (ntfs_inode*)NULL, (ntfschar*)NULL, 0,
+				USN_REASON_SECURITY_CHANGE);
 	return (res);
 }
 
@@ -1158,6 +1252,78 @@ static BOOL staticgroupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid
 	return (ingroup);
 }
 
+#if CACHE_GROUPS_SIZE
+
+int ntfs_groups_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_GROUPS *cached;
+
+	cached = (const struct CACHED_GROUPS*)item;
+	return ((cached->tid*7 + cached->uid) & INT_MAX);
+}
+
+static int groups_compare(const struct CACHED_GROUPS *cached,
+			const struct CACHED_GROUPS *item)
+{
+	return ((cached->tid != item->tid)
+		|| (cached->uid != item->uid));
+}
+
+/*
+ *		Check group membership from the groups of the requesting
+ *	thread recently read from /proc
+ *
+ *	Returns TRUE if the groups were found in the cache, and then
+ *		*ismember tells whether gid is one of them
+ */
+
+static BOOL cached_groupmember(struct SECURITY_CONTEXT *scx, uid_t uid,
+			gid_t gid, BOOL *ismember)
+{
+	struct CACHED_GROUPS item;
+	const struct CACHED_GROUPS *cached;
+	int grcnt;
+	BOOL found;
+
+	found = FALSE;
+	item.tid = scx->tid;
+	item.uid = uid;
+	item.groups = (gid_t*)NULL;
+	item.grsize = 0;
+	cached = (const struct CACHED_GROUPS*)ntfs_fetch_cache(
+			scx->vol->groups_cache, GENERIC(&item),
+			(cache_compare)groups_compare);
+	if (cached
+	    && ((time((time_t*)NULL) - cached->read)
+			<= GROUPS_CACHE_TIMEOUT)) {
+		grcnt = cached->grsize/sizeof(gid_t);
+		while ((--grcnt >= 0) && (cached->groups[grcnt] != gid)) { }
+		*ismember = (grcnt >= 0);
+		found = TRUE;
+	}
+	return (found);
+}
+
+/*
+ *		Record the groups of the requesting thread
+ */
+
+static void enter_groups(struct SECURITY_CONTEXT *scx, uid_t uid,
+			gid_t *groups, int grcnt)
+{
+	struct CACHED_GROUPS item;
+
+	item.tid = scx->tid;
+	item.uid = uid;
+	item.groups = groups;
+	item.grsize = grcnt*sizeof(gid_t);
+	item.read = time((time_t*)NULL);
+	ntfs_enter_cache(scx->vol->groups_cache, GENERIC(&item),
+			(cache_compare)groups_compare);
+}
+
+#endif /* CACHE_GROUPS_SIZE */
+
 #if defined(__sun) && defined (__SVR4)
 
 /*
@@ -1266,6 +1432,9 @@ static BOOL groupmember(struct SECURITY_CONTEXT* scx, uid_t uid, gid_t gid)
  * The following implementation gets the group list from
  *   /proc/$TID/task/$TID/status which apparently exists and
  * contains the same data.
+ *
+ * The whole list is parsed, so that it can be kept for a short time
+ * and used again for the next checks requested by the same thread.
  */
 
 static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
@@ -1273,10 +1442,12 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 	static char key[] = "\nGroups:";
 	char buf[BUFSZ+1];
 	char filename[64];
+	gid_t groups[GROUPS_CACHE_MAX];
 	enum { INKEY, INSEP, INNUM, INEND } state;
 	int fd;
 	char c;
 	int matched;
+	int grcnt;
 	BOOL ismember;
 	int got;
 	char *p;
@@ -1285,8 +1456,12 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 
 	if (scx->vol->secure_flags & (1 << SECURITY_STATICGRPS))
 		ismember = staticgroupmember(scx, uid, gid);
+#if CACHE_GROUPS_SIZE
+	else if (cached_groupmember(scx, uid, gid, &ismember)) { }
+#endif
 	else {
 		ismember = FALSE; /* default return */
+		grcnt = 0;
 		tid = scx->tid;
 		sprintf(filename,"/proc/%u/task/%u/status",tid,tid);
 		fd = open(filename,O_RDONLY);
@@ -1333,7 +1508,11 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 					if ((c >= '0') && (c <= '9'))
 						grp = grp*10 + c - '0';
 					else {
-						ismember = (grp == gid);
+						if (grp == gid)
+							ismember = TRUE;
+						if (grcnt < GROUPS_CACHE_MAX)
+							groups[grcnt] = grp;
+						grcnt++;
 						if ((c != ' ') && (c != '\t'))
 							state = INEND;
 						else
@@ -1342,10 +1521,15 @@ static BOOL groupmember(struct SECURITY_CONTEXT *scx, uid_t uid, gid_t gid)
 				default :
 					break;
 				}
-			} while (!ismember && c && (state != INEND));
+			} while (c && (state != INEND));
 		close(fd);
 		if (!c)
 			ntfs_log_error("No group record found in %s\n",filename);
+#if CACHE_GROUPS_SIZE
+		else
+			if (grcnt <= GROUPS_CACHE_MAX)
+				enter_groups(scx, uid, groups, grcnt);
+#endif
 		} else
 			ntfs_log_error("Could not open %s\n",filename);
 	}
@@ -1531,6 +1715,78 @@ static int leg_compare(const struct CACHED_PERMISSIONS_LEGACY *cached,
 	return (cached->mft_no != item->mft_no);
 }
 
+/*
+ *		Hash values for the securid and legacy caches
+ *	The Posix descriptors are not hashed, entries only differing
+ *	by their descriptors are left to compare()
+ */
+
+int ntfs_securid_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_SECURID *cached;
+
+	cached = (const struct CACHED_SECURID*)item;
+	return ((cached->uid*31 + cached->gid*7 + cached->dmode) & INT_MAX);
+}
+
+int ntfs_legacy_hash(const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_PERMISSIONS_LEGACY*)item)->mft_no
+			& INT_MAX);
+}
+
+#if CACHE_SECURDESC_SIZE
+
+static int securdesc_compare(const struct CACHED_SECURDESC *cached,
+			const struct CACHED_SECURDESC *item)
+{
+	return (cached->securid != item->securid);
+}
+
+int ntfs_securdesc_hash(const struct CACHED_GENERIC *item)
+{
+	return (le32_to_cpu(((const struct CACHED_SECURDESC*)item)->securid)
+			& INT_MAX);
+}
+
+#endif /* CACHE_SECURDESC_SIZE */
+
+#if CACHE_INHERIT_SIZE
+
+int ntfs_inherit_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_INHERIT *cached;
+
+	cached = (const struct CACHED_INHERIT*)item;
+	return ((le32_to_cpu(cached->parentid)*31 + cached->uid*7
+			+ cached->gid*3 + cached->fordir) & INT_MAX);
+}
+
+#endif /* CACHE_INHERIT_SIZE */
+
+#if CACHE_SDH_SIZE
+
+int ntfs_sdh_hash(const struct CACHED_GENERIC *item)
+{
+	return (le32_to_cpu(((const struct CACHED_SDH*)item)->hash)
+			& INT_MAX);
+}
+
+#endif /* CACHE_SDH_SIZE */
+
+#if CACHE_TRAVERSE_SIZE
+
+int ntfs_traverse_hash(const struct CACHED_GENERIC *item)
+{
+	const struct CACHED_TRAVERSE *cached;
+
+	cached = (const struct CACHED_TRAVERSE*)item;
+	return ((le32_to_cpu(cached->securid)*31 + cached->uid*7
+			+ cached->tid) & INT_MAX);
+}
+
+#endif /* CACHE_TRAVERSE_SIZE */
+
 /*
  *	Resize permission cache table
  *	do not call unless resizing is needed
@@ -1809,10 +2065,20 @@ static struct CACHED_PERMISSIONS *fetch_cache(struct SECURITY_CONTEXT *scx,
 
 /*
  *	Retrieve a security attribute from $Secure
+ *
+ *	The descriptors recently retrieved are kept in a cache, as the
+ *	same few descriptors are generally shared by most files, and
+ *	the descriptor designated by a security_id never changes, so
+ *	the cached ones never have to be invalidated. A copy is returned
+ *	in all cases.
  */
 
 static char *retrievesecurityattr(ntfs_volume *vol, SII_INDEX_KEY id)
 {
+#if CACHE_SECURDESC_SIZE
+	struct CACHED_SECURDESC item;
+	struct CACHED_SECURDESC *cached;
+#endif
 	struct SII *psii;
 	union {
 		struct {
@@ -1830,6 +2096,22 @@ static char *retrievesecurityattr(ntfs_volume *vol, SII_INDEX_KEY id)
 	char *securattr;
 
 	securattr = (char*)NULL;
+#if CACHE_SECURDESC_SIZE
+	item.securid = id.security_id;
+	item.securattr = (char*)NULL;
+	item.attrsz = 0;
+	cached = (struct CACHED_SECURDESC*)ntfs_fetch_cache(
+			vol->securdesc_cache, GENERIC(&item),
+			(cache_compare)securdesc_compare);
+	if (cached && cached->securattr) {
+		securattr = (char*)ntfs_malloc(cached->attrsz);
+		if (securattr)
+			memcpy(securattr, cached->securattr, cached->attrsz);
+		return (securattr);
+	}
+#endif
+	if (open_deferred_secure(vol))
+		return (securattr);
 	ni = vol->secure_ni;
 	xsii = vol->secure_xsii;
 	if (ni && xsii) {
@@ -1860,6 +2142,15 @@ static char *retrievesecurityattr(ntfs_volume *vol, SII_INDEX_KEY id)
 					free(securattr);
 					securattr = (char*)NULL;
 				}
+#if CACHE_SECURDESC_SIZE
+				else {
+					item.securattr = securattr;
+					item.attrsz = size;
+					ntfs_enter_cache(vol->securdesc_cache,
+						GENERIC(&item),
+						(cache_compare)securdesc_compare);
+				}
+#endif
 			}
 		} else
 			if (errno != ENOENT)
@@ -1897,6 +2188,9 @@ static char *getsecurityattr(ntfs_volume *vol, ntfs_inode *ni)
 		 * with a default security descriptor inserted in an
 		 * attribute
 		 */
+	if (test_nino_flag(ni, v3_Extensions)
+	    && ni->security_id && open_deferred_secure(vol))
+		return ((char*)NULL);
 	if (test_nino_flag(ni, v3_Extensions)
 	    && vol->secure_ni && ni->security_id) {
 			/* get v3.x descriptor in $Secure */
@@ -2932,6 +3226,10 @@ int ntfs_set_owner_mode(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 		if (cached) {
 			ni->security_id = cached->securid;
 			NInoSetDirty(ni);
+			if (scx->vol->usn_journal)
+				ntfs_usn_change(ni, (ntfs_inode*)NULL,
+					(ntfschar*)NULL, 0,
+					USN_REASON_SECURITY_CHANGE);
 				/* adjust Windows read-only flag */
 			if (!isdir) {
 				if (mode & S_IWUSR)
@@ -3455,6 +3753,65 @@ int ntfs_sd_add_everyone(ntfs_inode *ni)
  *	This is used for Posix ACL and checking creation of DOS file names
  */
 
+#if CACHE_TRAVERSE_SIZE
+
+static int traverse_compare(const struct CACHED_TRAVERSE *cached,
+			const struct CACHED_TRAVERSE *item)
+{
+	return ((cached->securid != item->securid)
+		|| (cached->uid != item->uid)
+		|| (cached->gid != item->gid)
+		|| (cached->tid != item->tid));
+}
+
+/*
+ *		Check whether a directory was recently found searchable
+ *	by the same thread, or record it as searchable
+ *
+ *	Only directories having a security_id are recorded, changing
+ *	their ownership or permissions implies changing their security_id,
+ *	so the entries never have to be invalidated. They however expire
+ *	as the groups of the thread may change.
+ */
+
+static BOOL traverse_cache(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
+			BOOL enter)
+{
+	struct CACHED_TRAVERSE item;
+	const struct CACHED_TRAVERSE *cached;
+	BOOL found;
+
+	found = FALSE;
+	if (scx->vol->traverse_cache
+	    && (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+	    && test_nino_flag(ni, v3_Extensions)
+	    && ni->security_id) {
+		item.securid = ni->security_id;
+		item.uid = scx->uid;
+		item.gid = scx->gid;
+		item.tid = scx->tid;
+		item.variable = (void*)NULL;
+		item.varsize = 0;
+		if (enter) {
+			item.granted = time((time_t*)NULL);
+			ntfs_enter_cache(scx->vol->traverse_cache,
+				GENERIC(&item),
+				(cache_compare)traverse_compare);
+		} else {
+			cached = (const struct CACHED_TRAVERSE*)
+				ntfs_fetch_cache(scx->vol->traverse_cache,
+					GENERIC(&item),
+					(cache_compare)traverse_compare);
+			found = cached
+				&& ((time((time_t*)NULL) - cached->granted)
+					<= TRAVERSE_CACHE_TIMEOUT);
+		}
+	}
+	return (found);
+}
+
+#endif /* CACHE_TRAVERSE_SIZE */
+
 int ntfs_allowed_access(struct SECURITY_CONTEXT *scx,
 		ntfs_inode *ni,
 		int accesstype) /* access type required (S_Ixxx values) */
@@ -3474,6 +3831,11 @@ int ntfs_allowed_access(struct SECURITY_CONTEXT *scx,
 		&& (!(accesstype & S_IEXEC)
 		    || (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY))))
 		allow = 1;
+#if CACHE_TRAVERSE_SIZE
+	else if ((accesstype == S_IEXEC)
+		    && traverse_cache(scx, ni, FALSE))
+		allow = 1;
+#endif
 	else {
 		perm = ntfs_get_perm(scx, ni, accesstype);
 		if (perm >= 0) {
@@ -3523,6 +3885,11 @@ int ntfs_allowed_access(struct SECURITY_CONTEXT *scx,
 			}
 			if (!allow)
 				errno = res;
+#if CACHE_TRAVERSE_SIZE
+			else
+				if (accesstype == S_IEXEC)
+					traverse_cache(scx, ni, TRUE);
+#endif
 		} else
 			allow = 0;
 	}
@@ -4045,10 +4412,27 @@ static le32 build_inherited_id(struct SECURITY_CONTEXT *scx,
  *	Returns the inherited id, or zero if not possible (eg on NTFS 1.x)
  */
 
+#if CACHE_INHERIT_SIZE
+
+static int inherit_compare(const struct CACHED_INHERIT *cached,
+			const struct CACHED_INHERIT *item)
+{
+	return ((cached->parentid != item->parentid)
+		|| (cached->uid != item->uid)
+		|| (cached->gid != item->gid)
+		|| (cached->fordir != item->fordir));
+}
+
+#endif /* CACHE_INHERIT_SIZE */
+
 le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 			ntfs_inode *dir_ni, BOOL fordir)
 {
 	struct CACHED_PERMISSIONS *cached;
+#if CACHE_INHERIT_SIZE
+	struct CACHED_INHERIT item;
+	const struct CACHED_INHERIT *inherited;
+#endif
 	char *parentattr;
 	le32 securid;
 
@@ -4065,6 +4449,26 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 		    && (cached->uid == scx->uid) && (cached->gid == scx->gid))
 			securid = (fordir ? cached->inh_dirid
 					: cached->inh_fileid);
+#if CACHE_INHERIT_SIZE
+		/*
+		 * Otherwise try the cache of inherited ids, which does
+		 * not depend on the owner of the parent directory
+		 */
+		item.parentid = dir_ni->security_id;
+		item.uid = scx->uid;
+		item.gid = scx->gid;
+		item.fordir = fordir;
+		item.variable = (void*)NULL;
+		item.varsize = 0;
+		if (!securid) {
+			inherited = (const struct CACHED_INHERIT*)
+				ntfs_fetch_cache(scx->vol->inherit_cache,
+					GENERIC(&item),
+					(cache_compare)inherit_compare);
+			if (inherited)
+				securid = inherited->securid;
+		}
+#endif
 	}
 		/*
 		 * Not cached or not available in cache, compute it all
@@ -4080,6 +4484,16 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 			 * Store the result into cache for further use
 			 * if the current process owns the parent directory
 			 */
+#if CACHE_INHERIT_SIZE
+			if (securid
+			    && test_nino_flag(dir_ni, v3_Extensions)
+			    && dir_ni->security_id) {
+				item.securid = securid;
+				ntfs_enter_cache(scx->vol->inherit_cache,
+					GENERIC(&item),
+					(cache_compare)inherit_compare);
+			}
+#endif
 			if (securid) {
 				cached = fetch_cache(scx, dir_ni);
 				if (cached
@@ -4097,48 +4511,96 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 }
 
 /*
- *		Link a group to a member of group
+ *		Name of a mapped user, for linking groups to their members
+ */
+
+struct USER_NAME {
+	char *name;
+	struct MAPPING *usermapping;
+} ;
+
+static int user_name_compare(const void *p1, const void *p2)
+{
+	return (strcmp(((const struct USER_NAME*)p1)->name,
+			((const struct USER_NAME*)p2)->name));
+}
+
+/*
+ *		Add a group to the groups of a mapped user
  *
  *	Returns 0 if OK, -1 (and errno set) if error
  */
 
-static int link_single_group(struct MAPPING *usermapping, struct passwd *user,
-			gid_t gid)
+static int add_member_group(struct MAPPING *usermapping, gid_t gid)
 {
-	struct group *group;
-	char **grmem;
 	int grcnt;
 	gid_t *groups;
 	int res;
 
+	res = 0;
+	grcnt = usermapping->grcnt;
+	groups = usermapping->groups;
+		/* a member may be listed twice */
+	if (!grcnt || (groups[grcnt - 1] != gid)) {
+		if (!grcnt)
+			groups = (gid_t*)malloc(sizeof(gid_t));
+		else
+			groups = (gid_t*)realloc(groups,
+				(grcnt+1)*sizeof(gid_t));
+		if (groups) {
+			groups[grcnt++] = gid;
+			usermapping->grcnt = grcnt;
+			usermapping->groups = groups;
+		} else {
+			res = -1;
+			errno = ENOMEM;
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Link a group to the mapped users which are members of it
+ *
+ *	The names of the mapped users are sorted, so that each member
+ *	of the group is searched for once.
+ *
+ *	Returns 0 if OK, -1 (and errno set) if error
+ */
+
+static int link_single_group(struct USER_NAME *names, int count, gid_t gid)
+{
+	struct group *group;
+	struct USER_NAME key;
+	struct USER_NAME *found;
+	char **grmem;
+	int res;
+
 	res = 0;
 	group = getgrgid(gid);
 	if (group && group->gr_mem) {
-		grcnt = usermapping->grcnt;
-		groups = usermapping->groups;
-		grmem = group->gr_mem;
-		while (*grmem && strcmp(user->pw_name, *grmem))
-			grmem++;
-		if (*grmem) {
-			if (!grcnt)
-				groups = (gid_t*)malloc(sizeof(gid_t));
-			else
-				groups = (gid_t*)realloc(groups,
-					(grcnt+1)*sizeof(gid_t));
-			if (groups)
-				groups[grcnt++]	= gid;
-			else {
-				res = -1;
-				errno = ENOMEM;
+		for (grmem=group->gr_mem; *grmem && !res; grmem++) {
+			key.name = *grmem;
+			found = (struct USER_NAME*)bsearch(&key, names, count,
+					sizeof(struct USER_NAME),
+					user_name_compare);
+			if (found) {
+				/* several usids may be mapped to a user */
+				while ((found > names)
+				    && !strcmp(found[-1].name, *grmem))
+					found--;
+				while ((found < &names[count])
+				    && !strcmp(found->name, *grmem) && !res) {
+					res = add_member_group(
+						found->usermapping, gid);
+					found++;
+				}
 			}
 		}
-		usermapping->grcnt = grcnt;
-		usermapping->groups = groups;
 	}
 	return (res);
 }
 
-
 /*
  *		Statically link group to users
  *	This is based on groups defined in /etc/group and does not take
@@ -4155,28 +4617,50 @@ static int link_group_members(struct SECURITY_CONTEXT *scx)
 {
 	struct MAPPING *usermapping;
 	struct MAPPING *groupmapping;
+	struct USER_NAME *names;
 	struct passwd *user;
+	int count;
 	int res;
+	int i;
 
 	res = 0;
+	count = 0;
+	for (usermapping=scx->mapping[MAPUSERS]; usermapping;
+			usermapping=usermapping->next)
+		count++;
+	names = (struct USER_NAME*)ntfs_malloc(count*sizeof(struct USER_NAME));
+	if (!names)
+		return (-1);
+	count = 0;
 	for (usermapping=scx->mapping[MAPUSERS]; usermapping && !res;
 			usermapping=usermapping->next) {
 		usermapping->grcnt = 0;
 		usermapping->groups = (gid_t*)NULL;
 		user = getpwuid(usermapping->xid);
 		if (user && user->pw_name) {
-			for (groupmapping=scx->mapping[MAPGROUPS];
-					groupmapping && !res;
-					groupmapping=groupmapping->next) {
-				if (link_single_group(usermapping, user,
-				    groupmapping->xid))
-					res = -1;
-				}
-			if (!res && link_single_group(usermapping,
-					 user, (gid_t)0))
+			names[count].name = strdup(user->pw_name);
+			if (names[count].name)
+				names[count++].usermapping = usermapping;
+			else {
+				errno = ENOMEM;
 				res = -1;
+			}
 		}
 	}
+	if (!res && count) {
+		qsort(names, count, sizeof(struct USER_NAME),
+				user_name_compare);
+		for (groupmapping=scx->mapping[MAPGROUPS];
+				groupmapping && !res;
+				groupmapping=groupmapping->next)
+			res = link_single_group(names, count,
+					groupmapping->xid);
+		if (!res)
+			res = link_single_group(names, count, (gid_t)0);
+	}
+	for (i=0; i<count; i++)
+		free(names[i].name);
+	free(names);
 	return (res);
 }
 
@@ -4205,9 +4689,11 @@ static int ntfs_do_default_mapping(struct SECURITY_CONTEXT *scx,
 			if (groupmapping) {
 				usermapping->sid = sid;
 				usermapping->xid = uid;
+				usermapping->index = (struct MAPPING_INDEX*)NULL;
 				usermapping->next = (struct MAPPING*)NULL;
 				groupmapping->sid = sid;
 				groupmapping->xid = gid;
+				groupmapping->index = (struct MAPPING_INDEX*)NULL;
 				groupmapping->next = (struct MAPPING*)NULL;
 				scx->mapping[MAPUSERS] = usermapping;
 				scx->mapping[MAPGROUPS] = groupmapping;
@@ -5154,6 +5640,7 @@ int ntfs_read_sds(struct SECURITY_API *scapi,
 
 	got = -1; /* default return */
 	if (scapi && (scapi->magic == MAGIC_API)) {
+		open_deferred_secure(scapi->security.vol);
 		if (scapi->security.vol->secure_ni)
 			got = ntfs_attr_data_read(scapi->security.vol->secure_ni,
 				STREAM_SDS, 4, buf, size, offset);
@@ -5180,6 +5667,7 @@ INDEX_ENTRY *ntfs_read_sii(struct SECURITY_API *scapi,
 
 	ret = (INDEX_ENTRY*)NULL; /* default return */
 	if (scapi && (scapi->magic == MAGIC_API)) {
+		open_deferred_secure(scapi->security.vol);
 		xsii = scapi->security.vol->secure_xsii;
 		if (xsii) {
 			if (!entry) {
@@ -5216,6 +5704,7 @@ INDEX_ENTRY *ntfs_read_sdh(struct SECURITY_API *scapi,
 
 	ret = (INDEX_ENTRY*)NULL; /* default return */
 	if (scapi && (scapi->magic == MAGIC_API)) {
+		open_deferred_secure(scapi->security.vol);
 		xsdh = scapi->security.vol->secure_xsdh;
 		if (xsdh) {
 			if (!entry) {
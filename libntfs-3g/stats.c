@@ -0,0 +1,394 @@
+/**
+ * stats.c - Performance counters of a volume.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDARG_H
+#include <stdarg.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+#endif
+
+#include "types.h"
+#include "volume.h"
+#include "device.h"
+#include "cache.h"
+#include "blkcache.h"
+#include "stats.h"
+#include "misc.h"
+
+/*
+ *		Performance counters
+ *
+ *	The device counters are always updated, by ntfs_pread() and
+ *	similar functions. When set up by ntfs_set_stats(), the counters
+ *	of the allocators and the latencies of the requests recorded by
+ *	the drivers are kept too. These are reported, with the counters
+ *	of the caches, by ntfs_stats_report(), as a text meant for humans.
+ */
+
+struct STATS_TEXT {
+	char *buf;
+	size_t size;
+	size_t len;
+} ;
+
+/*
+ *		Append to the report, only counting the size when
+ *	there is no room left
+ */
+
+static void stats_printf(struct STATS_TEXT *text, const char *format, ...)
+		__attribute__((format(printf, 2, 3)));
+
+static void stats_printf(struct STATS_TEXT *text, const char *format, ...)
+{
+	va_list ap;
+	char *p;
+	size_t room;
+	int n;
+
+	if (text->len < text->size) {
+		p = &text->buf[text->len];
+		room = text->size - text->len;
+	} else {
+		p = (char*)NULL;
+		room = 0;
+	}
+	va_start(ap, format);
+	n = vsnprintf(p, room, format, ap);
+	va_end(ap);
+	if (n > 0)
+		text->len += n;
+}
+
+static int stats_percent(unsigned long part, unsigned long total)
+{
+	return (total ? (int)((part*100.0)/total) : 0);
+}
+
+static void stats_cache(struct STATS_TEXT *text,
+			const struct CACHE_HEADER *cache)
+{
+	if (cache)
+		stats_printf(text, "cache %s : %lu reads, %lu hits (%d%%),"
+			" %lu writes, %lu evictions\n",
+			cache->name, cache->reads, cache->hits,
+			stats_percent(cache->hits, cache->reads),
+			cache->writes, cache->evictions);
+}
+
+/*
+ *		Get the list of the caches of a volume
+ *
+ *	Returns the number of caches, some of them may be NULL
+ */
+
+static int stats_caches(ntfs_volume *vol, struct CACHE_HEADER **caches)
+{
+	int n;
+
+	n = 0;
+#if CACHE_INODE_SIZE
+	caches[n++] = vol->xinode_cache;
+#endif
+#if CACHE_NIDATA_SIZE
+	caches[n++] = vol->nidata_cache;
+#endif
+#if CACHE_LOOKUP_SIZE
+	caches[n++] = vol->lookup_cache;
+#endif
+#if CACHE_SECURID_SIZE
+	caches[n++] = vol->securid_cache;
+#endif
+#if CACHE_LEGACY_SIZE
+	caches[n++] = vol->legacy_cache;
+#endif
+#if CACHE_SECURDESC_SIZE
+	caches[n++] = vol->securdesc_cache;
+#endif
+#if CACHE_INHERIT_SIZE
+	caches[n++] = vol->inherit_cache;
+#endif
+#if CACHE_SDH_SIZE
+	caches[n++] = vol->sdh_cache;
+#endif
+#if CACHE_TRAVERSE_SIZE
+	caches[n++] = vol->traverse_cache;
+#endif
+#if CACHE_GROUPS_SIZE
+	caches[n++] = vol->groups_cache;
+#endif
+#if CACHE_LISTING_SIZE
+	caches[n++] = vol->listing_cache;
+#endif
+#if CACHE_SYMLINK_SIZE
+	caches[n++] = vol->symlink_cache;
+#endif
+#if CACHE_EA_SIZE
+	caches[n++] = vol->ea_cache;
+#endif
+#if CACHE_STREAMS_SIZE
+	caches[n++] = vol->streams_cache;
+#endif
+#if CACHE_STAT_SIZE
+	caches[n++] = vol->stat_cache;
+#endif
+#if CACHE_CBLOCK_SIZE
+	caches[n++] = vol->cblock_cache;
+#endif
+#if CACHE_MFTREC_HASH
+	caches[n++] = vol->mftrec_cache;
+#endif
+#if CACHE_INDEX_HASH
+	caches[n++] = vol->index_cache;
+#endif
+	return (n);
+}
+
+#define STATS_MAX_CACHES 24
+
+/*
+ *		Start or stop keeping the counters of a volume
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_stats(ntfs_volume *vol, BOOL on)
+{
+	int res;
+
+	res = 0;
+	if (!vol) {
+		errno = EINVAL;
+		res = -1;
+	} else {
+		if (on && !vol->stats) {
+			vol->stats = (struct NTFS_STATS*)ntfs_calloc(
+					sizeof(struct NTFS_STATS));
+			if (!vol->stats)
+				res = -1;
+		}
+		if (!on && vol->stats) {
+			free(vol->stats);
+			vol->stats = (struct NTFS_STATS*)NULL;
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Reset all the counters of a volume
+ */
+
+void ntfs_stats_reset(ntfs_volume *vol)
+{
+	struct CACHE_HEADER *caches[STATS_MAX_CACHES];
+	struct NTFS_OP_STATS *ops;
+	struct BLOCK_CACHE *bc;
+	int n;
+	int i;
+
+	memset(&vol->dev->d_stats, 0, sizeof(vol->dev->d_stats));
+	bc = vol->dev->d_cache;
+	if (bc) {
+		bc->reads = 0;
+		bc->hits = 0;
+		bc->writebacks = 0;
+	}
+	n = stats_caches(vol, caches);
+	for (i=0; i<n; i++)
+		if (caches[i]) {
+			caches[i]->reads = 0;
+			caches[i]->hits = 0;
+			caches[i]->writes = 0;
+			caches[i]->evictions = 0;
+		}
+	if (vol->stats) {
+		vol->stats->lcn_allocs = 0;
+		vol->stats->lcn_clusters = 0;
+		vol->stats->lcn_scanned = 0;
+		vol->stats->lcn_skipped = 0;
+		vol->stats->mft_allocs = 0;
+		vol->stats->mft_reused = 0;
+		vol->stats->mft_scanned = 0;
+		for (i=0; i<NTFS_STATS_OPS; i++) {
+			ops = &vol->stats->ops[i];
+			ops->count = 0;
+			ops->total_us = 0;
+			ops->max_us = 0;
+			memset(ops->buckets, 0, sizeof(ops->buckets));
+		}
+	}
+}
+
+/*
+ *		Get a monotonic clock in microseconds
+ */
+
+u64 ntfs_stats_clock(void)
+{
+	u64 now;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		now = (u64)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+	else
+		now = (u64)time((time_t*)NULL)*1000000;
+#else
+#ifdef HAVE_GETTIMEOFDAY
+	struct timeval tv;
+
+	if (!gettimeofday(&tv, (struct timezone*)NULL))
+		now = (u64)tv.tv_sec*1000000 + tv.tv_usec;
+	else
+#endif
+		now = (u64)time((time_t*)NULL)*1000000;
+#endif
+	return (now);
+}
+
+/*
+ *		Record the latency of a request
+ *
+ *	@op is the request code, @name a constant string designating it.
+ *	This may be called concurrently by several threads.
+ */
+
+void ntfs_stats_record_op(ntfs_volume *vol, int op, const char *name,
+			u64 usecs)
+{
+	struct NTFS_OP_STATS *ops;
+	int b;
+
+	if (vol && vol->stats && (op >= 0) && (op < NTFS_STATS_OPS)) {
+		ops = &vol->stats->ops[op];
+		ops->name = name;
+		for (b=0; (b < (NTFS_STATS_BUCKETS - 1))
+			&& (usecs >= ((u64)1 << b)); b++) { }
+		NTFS_STATS_ADD(ops->count, 1);
+		NTFS_STATS_ADD(ops->total_us, usecs);
+		NTFS_STATS_ADD(ops->buckets[b], 1);
+			/* may be missed when racing, this is only a hint */
+		if (usecs > ops->max_us)
+			ops->max_us = usecs;
+	}
+}
+
+/*
+ *		Report the counters of a volume
+ *
+ *	The report is truncated to @size bytes, including the final
+ *	null character.
+ *
+ *	Returns the full size of the report, not including the final
+ *	null character, as snprintf() does.
+ */
+
+int ntfs_stats_report(ntfs_volume *vol, char *buf, size_t size)
+{
+	struct CACHE_HEADER *caches[STATS_MAX_CACHES];
+	const struct ntfs_device_stats *ds;
+	const struct BLOCK_CACHE *bc;
+	const struct NTFS_STATS *st;
+	const struct NTFS_OP_STATS *ops;
+	struct STATS_TEXT text;
+	int n;
+	int i;
+	int b;
+
+	text.buf = buf;
+	text.size = (buf ? size : 0);
+	text.len = 0;
+	if (text.size)
+		buf[0] = '\0';
+	ds = &vol->dev->d_stats;
+	stats_printf(&text, "device reads : %llu requests, %llu bytes\n",
+			(unsigned long long)ds->reads,
+			(unsigned long long)ds->read_bytes);
+	stats_printf(&text, "device writes : %llu requests, %llu bytes\n",
+			(unsigned long long)ds->writes,
+			(unsigned long long)ds->written_bytes);
+	bc = vol->dev->d_cache;
+	if (bc)
+		stats_printf(&text, "block cache : %lu reads, %lu hits (%d%%),"
+			" %lu writebacks\n", bc->reads, bc->hits,
+			stats_percent(bc->hits, bc->reads), bc->writebacks);
+	n = stats_caches(vol, caches);
+	for (i=0; i<n; i++)
+		stats_cache(&text, caches[i]);
+	st = vol->stats;
+	if (st) {
+		stats_printf(&text, "cluster allocations : %llu calls,"
+			" %llu clusters, %llu bitmap bytes scanned,"
+			" %llu skipped\n",
+			(unsigned long long)st->lcn_allocs,
+			(unsigned long long)st->lcn_clusters,
+			(unsigned long long)st->lcn_scanned,
+			(unsigned long long)st->lcn_skipped);
+		stats_printf(&text, "mft record allocations : %llu records,"
+			" %llu reused, %llu bitmap bytes scanned\n",
+			(unsigned long long)st->mft_allocs,
+			(unsigned long long)st->mft_reused,
+			(unsigned long long)st->mft_scanned);
+		for (i=0; i<NTFS_STATS_OPS; i++) {
+			ops = &st->ops[i];
+			if (!ops->count)
+				continue;
+			stats_printf(&text, "request %s : %llu calls,"
+				" %llu us average, %llu us max\n ",
+				(ops->name ? ops->name : "?"),
+				(unsigned long long)ops->count,
+				(unsigned long long)(ops->total_us
+							/ ops->count),
+				(unsigned long long)ops->max_us);
+			for (b=0; b<NTFS_STATS_BUCKETS; b++)
+				if (ops->buckets[b])
+					stats_printf(&text, " %s%llu us:%llu",
+						(b < (NTFS_STATS_BUCKETS - 1)
+							? "<" : ">="),
+						(unsigned long long)1 << (b
+						    < (NTFS_STATS_BUCKETS - 1)
+							? b : b - 1),
+						(unsigned long long)
+							ops->buckets[b]);
+			stats_printf(&text, "\n");
+		}
+	}
+	return ((int)text.len);
+}
@@ -0,0 +1,430 @@
+/**
+ * trace.c - Tracing of the device transfers of a volume.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "volume.h"
+#include "device.h"
+#include "stats.h"
+#include "trace.h"
+#include "misc.h"
+
+/*
+ *		Tracing of the device transfers
+ *
+ *	When set up by ntfs_set_trace(), each transfer requested through
+ *	ntfs_pread(), ntfs_pwrite() and their batched variants is recorded
+ *	into a ring, with the origin declared by the calling thread. The
+ *	attribute readers and writers declare the attribute they access,
+ *	and the drivers declare the user request being served, so that
+ *	the transfers can be related to the requests which caused them.
+ *
+ *	The records are fetched, and removed, by ntfs_trace_fetch(). When
+ *	they are not fetched soon enough, the oldest ones are overwritten
+ *	and counted as lost.
+ */
+
+struct NTFS_TRACE {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+	u64 next;		/* records ever put into the ring */
+	u64 first;		/* oldest record not fetched */
+	u64 requests;		/* user requests declared */
+	u64 lost;		/* records lost since last fetch */
+	u32 size;		/* capacity of the ring */
+	struct NTFS_TRACE_RECORD records[1];
+} ;
+
+/*
+ *		State of a thread issuing transfers
+ */
+
+struct TRACE_THREAD {
+	u64 request;
+	u16 opcode;
+	struct NTFS_TRACE_TAG tag;
+} ;
+
+#ifdef HAVE_PTHREAD_H
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static BOOL trace_key_ok = FALSE;
+
+static void trace_key_create(void)
+{
+	trace_key_ok = !pthread_key_create(&trace_key, free);
+}
+
+/*
+ *		Get the state of the current thread, allocating it
+ *	on first use
+ *
+ *	Returns NULL if there is not enough memory, the transfers are
+ *	then recorded without attribution.
+ */
+
+static struct TRACE_THREAD *trace_thread(void)
+{
+	struct TRACE_THREAD *thread;
+
+	thread = (struct TRACE_THREAD*)NULL;
+	if (!pthread_once(&trace_once, trace_key_create) && trace_key_ok) {
+		thread = (struct TRACE_THREAD*)pthread_getspecific(trace_key);
+		if (!thread) {
+			thread = (struct TRACE_THREAD*)ntfs_calloc(
+					sizeof(struct TRACE_THREAD));
+			if (thread && pthread_setspecific(trace_key, thread)) {
+				free(thread);
+				thread = (struct TRACE_THREAD*)NULL;
+			}
+		}
+	}
+	return (thread);
+}
+
+static void trace_lock(struct NTFS_TRACE *trace)
+{
+	pthread_mutex_lock(&trace->lock);
+}
+
+static void trace_unlock(struct NTFS_TRACE *trace)
+{
+	pthread_mutex_unlock(&trace->lock);
+}
+
+#else
+
+static struct TRACE_THREAD trace_single;
+
+static struct TRACE_THREAD *trace_thread(void)
+{
+	return (&trace_single);
+}
+
+static void trace_lock(struct NTFS_TRACE *trace __attribute__((unused)))
+{
+}
+
+static void trace_unlock(struct NTFS_TRACE *trace __attribute__((unused)))
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Start or stop tracing the transfers of a volume
+ *
+ *	@records is the capacity of the ring, tracing is stopped and the
+ *	records not fetched are discarded when it is zero.
+ *
+ *	Returns 0 if successful
+ *		-1 if failed, with errno set
+ */
+
+int ntfs_set_trace(ntfs_volume *vol, int records)
+{
+	struct ntfs_device *dev;
+	struct NTFS_TRACE *trace;
+	int res;
+
+	res = -1;
+	if (!vol || !vol->dev || (records < 0)) {
+		errno = EINVAL;
+		return (res);
+	}
+	dev = vol->dev;
+	if (dev->d_trace) {
+		trace = dev->d_trace;
+		dev->d_trace = (struct NTFS_TRACE*)NULL;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&trace->lock);
+#endif
+		free(trace);
+	}
+	if (records) {
+		if (records > NTFS_TRACE_MAX_RECORDS)
+			records = NTFS_TRACE_MAX_RECORDS;
+		trace = (struct NTFS_TRACE*)ntfs_calloc(
+				sizeof(struct NTFS_TRACE)
+				+ (records - 1)*sizeof(struct NTFS_TRACE_RECORD));
+		if (trace) {
+			trace->size = records;
+#ifdef HAVE_PTHREAD_H
+			if (pthread_mutex_init(&trace->lock,
+					(pthread_mutexattr_t*)NULL)) {
+				free(trace);
+				errno = ENOMEM;
+			} else
+#endif
+			{
+				dev->d_trace = trace;
+				res = 0;
+			}
+		}
+	} else
+		res = 0;
+	return (res);
+}
+
+/*
+ *		Declare the user request served by the current thread
+ *
+ *	The request gets a new identifier, recorded with the transfers
+ *	until ntfs_trace_request_end() is called.
+ */
+
+void ntfs_trace_request(struct ntfs_device *dev, int opcode)
+{
+	struct NTFS_TRACE *trace;
+	struct TRACE_THREAD *thread;
+
+	trace = dev->d_trace;
+	if (trace) {
+		thread = trace_thread();
+		if (thread) {
+			trace_lock(trace);
+			thread->request = ++trace->requests;
+			trace_unlock(trace);
+			thread->opcode = opcode;
+		}
+	}
+}
+
+void ntfs_trace_request_end(struct ntfs_device *dev)
+{
+	struct TRACE_THREAD *thread;
+
+	if (dev->d_trace) {
+		thread = trace_thread();
+		if (thread) {
+			thread->request = 0;
+			thread->opcode = 0;
+		}
+	}
+}
+
+/*
+ *		Declare the origin of the next transfers of the current
+ *	thread, the previous one being saved into @saved
+ */
+
+void ntfs_trace_enter(struct ntfs_device *dev, struct NTFS_TRACE_TAG *saved,
+			int origin, u64 inode, u32 type)
+{
+	struct TRACE_THREAD *thread;
+
+	saved->set = FALSE;
+	if (dev->d_trace) {
+		thread = trace_thread();
+		if (thread) {
+			*saved = thread->tag;
+			saved->set = TRUE;
+			thread->tag.origin = origin;
+			thread->tag.inode = inode;
+			thread->tag.type = type;
+		}
+	}
+}
+
+/*
+ *		Declare the transfers to an attribute
+ *
+ *	The transfers to $MFT are attributed to the first record
+ *	at @pos, the other ones to the inode of the attribute.
+ */
+
+void ntfs_trace_enter_attr(ntfs_attr *na, s64 pos,
+			struct NTFS_TRACE_TAG *saved)
+{
+	ntfs_volume *vol;
+	u64 inode;
+	int origin;
+
+	vol = na->ni->vol;
+	saved->set = FALSE;
+	if (vol->dev->d_trace) {
+		inode = na->ni->mft_no;
+		switch (inode) {
+		case FILE_MFT :
+		case FILE_MFTMirr :
+			origin = NTFS_TRACE_MFT;
+			if (na->type == AT_DATA)
+				inode = pos >> vol->mft_record_size_bits;
+			break;
+		case FILE_Bitmap :
+			origin = NTFS_TRACE_BITMAP;
+			break;
+		case FILE_LogFile :
+			origin = NTFS_TRACE_LOGFILE;
+			break;
+		default :
+			if (na->type == AT_INDEX_ALLOCATION)
+				origin = NTFS_TRACE_INDEX;
+			else if (NAttrCompressed(na))
+				origin = NTFS_TRACE_COMPRESSED;
+			else
+				origin = NTFS_TRACE_DATA;
+			break;
+		}
+		ntfs_trace_enter(vol->dev, saved, origin, inode,
+				le32_to_cpu(na->type));
+	}
+}
+
+/*
+ *		Restore the origin saved by ntfs_trace_enter()
+ */
+
+void ntfs_trace_leave(const struct NTFS_TRACE_TAG *saved)
+{
+	struct TRACE_THREAD *thread;
+
+	if (saved->set) {
+		thread = trace_thread();
+		if (thread) {
+			thread->tag = *saved;
+			thread->tag.set = FALSE;
+		}
+	}
+}
+
+/*
+ *		Record a device transfer
+ */
+
+void ntfs_trace_io(struct ntfs_device *dev, s64 pos, s64 count, BOOL write)
+{
+	struct NTFS_TRACE *trace;
+	struct NTFS_TRACE_RECORD *rec;
+	struct TRACE_THREAD *thread;
+	u64 now;
+
+	trace = dev->d_trace;
+	if (trace) {
+		thread = trace_thread();
+		now = ntfs_stats_clock();
+		trace_lock(trace);
+		if ((trace->next - trace->first) >= trace->size) {
+			trace->first++;
+			trace->lost++;
+		}
+		rec = &trace->records[trace->next % trace->size];
+		trace->next++;
+		rec->time = now;
+		rec->pos = pos;
+		rec->count = (count > 0xffffffffLL ? 0xffffffff : count);
+		rec->flags = (write ? NTFS_TRACE_WRITE : 0);
+		rec->reserved = 0;
+		if (thread) {
+			rec->request = thread->request;
+			rec->opcode = thread->opcode;
+			rec->origin = thread->tag.origin;
+			rec->inode = thread->tag.inode;
+			rec->type = thread->tag.type;
+		} else {
+			rec->request = 0;
+			rec->opcode = 0;
+			rec->origin = NTFS_TRACE_OTHER;
+			rec->inode = 0;
+			rec->type = 0;
+		}
+		trace_unlock(trace);
+	}
+}
+
+/*
+ *		Fetch the oldest records of a volume
+ *
+ *	The records are copied into @buf after a header, as many as
+ *	fit into @size bytes, and removed from the ring. When @buf is
+ *	NULL, the size needed for fetching all the records is returned,
+ *	up to @size, without removing them.
+ *
+ *	Returns the size of the data fetched, or needed,
+ *		-1 if failed, with errno set
+ */
+
+int ntfs_trace_fetch(ntfs_volume *vol, char *buf, size_t size)
+{
+	struct NTFS_TRACE *trace;
+	struct NTFS_TRACE_HEADER header;
+	u64 count;
+	u64 fit;
+	u64 i;
+	int res;
+
+	trace = vol->dev->d_trace;
+	if (!trace) {
+		errno = ENODATA;
+		return (-1);
+	}
+	if (size < sizeof(struct NTFS_TRACE_HEADER)) {
+		errno = ERANGE;
+		return (-1);
+	}
+	fit = (size - sizeof(struct NTFS_TRACE_HEADER))
+			/ sizeof(struct NTFS_TRACE_RECORD);
+	trace_lock(trace);
+	count = trace->next - trace->first;
+	if (count > fit)
+		count = fit;
+	res = sizeof(struct NTFS_TRACE_HEADER)
+			+ count*sizeof(struct NTFS_TRACE_RECORD);
+	if (buf) {
+		header.magic = NTFS_TRACE_MAGIC;
+		header.version = NTFS_TRACE_VERSION;
+		header.record_size = sizeof(struct NTFS_TRACE_RECORD);
+		header.count = count;
+		header.lost = (trace->lost > 0xffffffffLL
+					? 0xffffffff : trace->lost);
+		memcpy(buf, &header, sizeof(header));
+		buf += sizeof(header);
+		for (i=0; i<count; i++) {
+			memcpy(buf, &trace->records[(trace->first + i)
+						% trace->size],
+				sizeof(struct NTFS_TRACE_RECORD));
+			buf += sizeof(struct NTFS_TRACE_RECORD);
+		}
+		trace->first += count;
+		trace->lost = 0;
+	}
+	trace_unlock(trace);
+	return (res);
+}
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 
 #include "compat.h"
+#include "param.h"
 #include "logging.h"
 #include "uefi_support.h"
 
@@ -89,54 +90,245 @@ int ffs(int i)
 
 /*
  * Memory allocation calls that hook into the standard UEFI
- * allocation ones. Note that, in order to be able to use
- * UEFI's ReallocatePool(), we must keep track of the allocated
- * size, which we store as a size_t before the effective payload.
+ * allocation ones.
+ *
+ * The library makes many short-lived small allocations, for which the
+ * firmware pool allocator is slow and fragments easily, so these are
+ * carved out of slabs of a few pages, each slab holding blocks of
+ * a single power of two size. The larger allocations still go to the
+ * pool. Each block is preceded by a header which designates the slab
+ * it belongs to, or records the capacity of a pool block with the low
+ * bit set, so that realloc() can grow a block in place when it is
+ * large enough.
  */
+
+typedef union {
+	struct SLAB* slab;	/* slab of a small block */
+	UINT64 size;		/* (capacity << 1) | 1 for a pool block */
+} BLOCK_HEADER;
+
+struct SLAB {
+	struct SLAB* next;	/* next slab with free blocks in the class */
+	struct SLAB* prev;
+	void* free;		/* chain of free blocks */
+	UINTN used;
+	UINTN blocks;
+	UINTN class;
+};
+
+#define SLAB_CLASSES (UEFI_SLAB_MAX_SHIFT - UEFI_SLAB_MIN_SHIFT + 1)
+#define SLAB_BYTES (UEFI_SLAB_PAGES * EFI_PAGE_SIZE)
+#define SLAB_OFFSET ((sizeof(struct SLAB) + 15) & ~(size_t)15)
+
+static struct SLAB* free_slabs[SLAB_CLASSES];
+
+static size_t slab_block_size(UINTN class)
+{
+	return (size_t)1 << (class + UEFI_SLAB_MIN_SHIFT);
+}
+
+/* Get the class of the blocks of a size, or -1 if too big */
+static int slab_class(size_t size)
+{
+	int class = 0;
+
+	if (size > slab_block_size(SLAB_CLASSES - 1) - sizeof(BLOCK_HEADER))
+		return -1;
+	while (size > slab_block_size(class) - sizeof(BLOCK_HEADER))
+		class++;
+	return class;
+}
+
+static void slab_unlink(struct SLAB* slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		free_slabs[slab->class] = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+}
+
+static void slab_link(struct SLAB* slab)
+{
+	slab->prev = NULL;
+	slab->next = free_slabs[slab->class];
+	if (slab->next)
+		slab->next->prev = slab;
+	free_slabs[slab->class] = slab;
+}
+
+static struct SLAB* slab_create(int class)
+{
+	EFI_PHYSICAL_ADDRESS addr;
+	struct SLAB* slab;
+	char* block;
+	size_t bsize;
+	UINTN i;
+
+	if (gBS->AllocatePages(AllocateAnyPages, EfiBootServicesData,
+			UEFI_SLAB_PAGES, &addr) != EFI_SUCCESS)
+		return NULL;
+	slab = (struct SLAB*)(UINTN)addr;
+	bsize = slab_block_size(class);
+	slab->class = class;
+	slab->used = 0;
+	slab->blocks = (SLAB_BYTES - SLAB_OFFSET) / bsize;
+	slab->free = NULL;
+	block = (char*)slab + SLAB_OFFSET + slab->blocks * bsize;
+	for (i = 0; i < slab->blocks; i++) {
+		block -= bsize;
+		*(void**)block = slab->free;
+		slab->free = block;
+	}
+	slab_link(slab);
+	return slab;
+}
+
+static void* slab_alloc(int class)
+{
+	struct SLAB* slab = free_slabs[class];
+	BLOCK_HEADER* hdr;
+
+	if (slab == NULL) {
+		slab = slab_create(class);
+		if (slab == NULL)
+			return NULL;
+	}
+	hdr = (BLOCK_HEADER*)slab->free;
+	slab->free = *(void**)hdr;
+	if (++slab->used == slab->blocks)
+		slab_unlink(slab);
+	hdr->slab = slab;
+	return &hdr[1];
+}
+
+static void slab_free(BLOCK_HEADER* hdr)
+{
+	struct SLAB* slab = hdr->slab;
+
+	if (slab->used-- == slab->blocks)
+		slab_link(slab);
+	*(void**)hdr = slab->free;
+	slab->free = hdr;
+	/* Release an empty slab, unless it is the last one of its class */
+	if (!slab->used && (slab->prev || slab->next)) {
+		slab_unlink(slab);
+		gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)slab,
+			UEFI_SLAB_PAGES);
+	}
+}
+
+static void* pool_alloc(size_t size)
+{
+	BLOCK_HEADER* hdr;
+
+	if (size > (size_t)-1 - sizeof(BLOCK_HEADER))
+		return NULL;
+	hdr = AllocatePool(size + sizeof(BLOCK_HEADER));
+	if (hdr == NULL)
+		return NULL;
+	hdr->size = ((UINT64)size << 1) | 1;
+	return &hdr[1];
+}
+
 void* malloc(size_t size)
 {
-	/* Keep track of the allocated size for realloc */
-	size_t* ptr = AllocatePool(size + sizeof(size_t));
+	int class = slab_class(size);
+	void* ptr;
+
+	ptr = (class >= 0 ? slab_alloc(class) : pool_alloc(size));
 	if (ptr == NULL)
-		return NULL;
-	ptr[0] = size;
-	return &ptr[1];
+		errno = ENOMEM;
+	return ptr;
 }
 
 void* calloc(size_t nmemb, size_t size)
 {
-	/* Keep track of the allocated size for realloc */
-	size_t* ptr = AllocateZeroPool(size * nmemb + sizeof(size_t));
-	if (ptr == NULL)
+	void* ptr;
+
+	if (size && nmemb > (size_t)-1 / size) {
+		errno = ENOMEM;
 		return NULL;
-	ptr[0] = size;
-	return &ptr[1];
+	}
+	ptr = malloc(nmemb * size);
+	if (ptr != NULL)
+		ZeroMem(ptr, nmemb * size);
+	return ptr;
 }
 
-/* NB: As opposed to libc's realloc(), this realloc() always frees the old pointer */
+/*
+ * Blocks which are large enough are reused in place, other ones are
+ * moved to a bigger block, with some slack so that a block which keeps
+ * growing (such as a runlist) does not have to be moved every time.
+ * As with libc's realloc(), the old block is kept on failure.
+ */
 void* realloc(void* p, size_t new_size)
 {
-	size_t* ptr = (size_t*)p;
+	BLOCK_HEADER* hdr = (BLOCK_HEADER*)p;
+	size_t old_size, alloc_size;
+	void* ptr;
 
-	if (ptr == NULL)
+	if (hdr == NULL)
 		return malloc(new_size);
-	/* Access the previous size, which was stored in malloc/calloc */
-	ptr = &ptr[-1];
-#ifdef __MAKEWITH_GNUEFI
-	ptr = ReallocatePool(ptr, (UINTN)*ptr, (UINTN)(new_size + sizeof(size_t)));
-#else
-	ptr = ReallocatePool((UINTN)*ptr, (UINTN)(new_size + sizeof(size_t)), ptr);
-#endif
-	if (ptr != NULL)
-		*ptr++ = new_size;
+	hdr = &hdr[-1];
+	if (hdr->size & 1)
+		old_size = (size_t)(hdr->size >> 1);
+	else
+		old_size = slab_block_size(hdr->slab->class)
+				- sizeof(BLOCK_HEADER);
+	if (new_size <= old_size)
+		return p;
+	alloc_size = new_size;
+	if (old_size + old_size / 2 > alloc_size
+	    && slab_class(old_size + old_size / 2) < 0)
+		alloc_size = old_size + old_size / 2;
+	ptr = malloc(alloc_size);
+	if (ptr == NULL)
+		return NULL;
+	CopyMem(ptr, p, old_size);
+	free(p);
 	return ptr;
 }
 
 void free(void* p)
 {
-	size_t* ptr = (size_t*)p;
-	if (p != NULL)
-		FreePool(&ptr[-1]);
+	BLOCK_HEADER* hdr = (BLOCK_HEADER*)p;
+
+	if (hdr == NULL)
+		return;
+	hdr = &hdr[-1];
+	if (hdr->size & 1)
+		FreePool(hdr);
+	else
+		slab_free(hdr);
+}
+
+/*
+ * Release the empty slabs kept for the next allocations, which
+ * should be done when the driver is unloaded.
+ */
+int malloc_trim(size_t pad)
+{
+	struct SLAB* slab;
+	struct SLAB* next;
+	int released = 0;
+	UINTN class;
+
+	(void)pad;
+	for (class = 0; class < SLAB_CLASSES; class++) {
+		for (slab = free_slabs[class]; slab; slab = next) {
+			next = slab->next;
+			if (!slab->used) {
+				slab_unlink(slab);
+				gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)slab,
+					UEFI_SLAB_PAGES);
+				released = 1;
+			}
+		}
+	}
+	return released;
 }
 
 /*
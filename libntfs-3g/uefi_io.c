@@ -29,6 +29,72 @@
 #include "unistr.h"
 #include "uefi_support.h"
 
+/**
+ * ntfs_device_uefi_io_free_pool - Release the events of the DiskIo2
+ * and BlockIo2 tokens
+ */
+static void ntfs_device_uefi_io_free_pool(EFI_FS* FileSystem)
+{
+	int i;
+
+	for (i = 0; i < DISKIO2_POOL_SIZE; i++) {
+		if (FileSystem->DiskIo2Pool[i].Event != NULL)
+			gBS->CloseEvent(FileSystem->DiskIo2Pool[i].Event);
+		FileSystem->DiskIo2Pool[i].Event = NULL;
+		if (FileSystem->BlockIo2Pool[i].Event != NULL)
+			gBS->CloseEvent(FileSystem->BlockIo2Pool[i].Event);
+		FileSystem->BlockIo2Pool[i].Event = NULL;
+	}
+}
+
+/**
+ * ntfs_device_uefi_io_create_pool - Create the events of the DiskIo2 tokens
+ * used for submitting several requests concurrently. If DiskIo2 is not
+ * available, or there are not enough events, the requests are blocking.
+ */
+static void ntfs_device_uefi_io_create_pool(EFI_FS* FileSystem)
+{
+	EFI_STATUS Status = EFI_SUCCESS;
+	int i;
+
+	ZeroMem(FileSystem->DiskIo2Pool, sizeof(FileSystem->DiskIo2Pool));
+	ZeroMem(FileSystem->BlockIo2Pool, sizeof(FileSystem->BlockIo2Pool));
+	if (FileSystem->DiskIo2 == NULL)
+		return;
+	for (i = 0; i < DISKIO2_POOL_SIZE && !EFI_ERROR(Status); i++)
+		Status = gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL,
+			&FileSystem->DiskIo2Pool[i].Event);
+	/* The direct reads run concurrently too when BlockIo2 is available */
+	for (i = 0; i < DISKIO2_POOL_SIZE && !EFI_ERROR(Status)
+			&& FileSystem->BlockIo2 != NULL; i++)
+		Status = gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL,
+			&FileSystem->BlockIo2Pool[i].Event);
+	if (EFI_ERROR(Status)) {
+		ntfs_log_info("Could not create DiskIo2 events: %r\n", Status);
+		ntfs_device_uefi_io_free_pool(FileSystem);
+	}
+}
+
+/**
+ * ntfs_device_uefi_io_direct - Check whether a read can be issued directly
+ * through BlockIo, so that DiskIo does not bounce it through a buffer of
+ * its own. This is the case for large reads of whole blocks into buffers
+ * aligned as required by the device.
+ */
+static BOOLEAN ntfs_device_uefi_io_direct(EFI_FS* FileSystem, const void* buf,
+		s64 count, s64 offset)
+{
+	EFI_BLOCK_IO_MEDIA* Media = FileSystem->BlockIo->Media;
+
+	if (count < BLOCKIO_DIRECT_MIN || Media->BlockSize == 0)
+		return FALSE;
+	if ((offset % Media->BlockSize) != 0 || (count % Media->BlockSize) != 0)
+		return FALSE;
+	if (Media->IoAlign > 1 && ((UINTN)buf & (Media->IoAlign - 1)) != 0)
+		return FALSE;
+	return (UINT64)((offset + count) / Media->BlockSize) <= Media->LastBlock + 1;
+}
+
 /**
  * ntfs_device_uefi_io_open: For UEFI drivers, there isn't much to
  * do in terms of initializing a device, because by the time we get
@@ -69,6 +135,7 @@ static int ntfs_device_uefi_io_open(struct ntfs_device *dev, int flags)
 
 	FileSystem->Offset = 0;
 	dev->d_private = FileSystem;
+	ntfs_device_uefi_io_create_pool(FileSystem);
 	if (FileSystem->BlockIo->Media->ReadOnly || (flags & O_RDWR) != O_RDWR)
 		NDevSetReadOnly(dev);
 	NDevSetOpen(dev);
@@ -116,6 +183,7 @@ static int ntfs_device_uefi_io_close(struct ntfs_device *dev)
 			return -1;
 		}
 
+	ntfs_device_uefi_io_free_pool((EFI_FS*)dev->d_private);
 	NDevClearOpen(dev);
 
 	return 0;
@@ -178,8 +246,16 @@ static s64 ntfs_device_uefi_io_pread(struct ntfs_device *dev, void *buf,
 
 	Media = FileSystem->BlockIo->Media;
 
-	/* Prefer DiskIo2 when available */
-	if (FileSystem->DiskIo2 != NULL)
+	/* Read whole aligned blocks directly, else prefer DiskIo2 when available */
+	if (ntfs_device_uefi_io_direct(FileSystem, buf, count, offset)) {
+		if (FileSystem->BlockIo2 != NULL)
+			Status = FileSystem->BlockIo2->ReadBlocksEx(FileSystem->BlockIo2,
+				Media->MediaId, offset / Media->BlockSize,
+				&(FileSystem->BlockIo2Token), (UINTN)count, buf);
+		else
+			Status = FileSystem->BlockIo->ReadBlocks(FileSystem->BlockIo,
+				Media->MediaId, offset / Media->BlockSize, (UINTN)count, buf);
+	} else if (FileSystem->DiskIo2 != NULL)
 		Status = FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2, Media->MediaId,
 			offset, &(FileSystem->DiskIo2Token), count, buf);
 	else
@@ -236,6 +312,123 @@ static s64 ntfs_device_uefi_io_pwrite(struct ntfs_device *dev, const void *buf,
 	return count;
 }
 
+/**
+ * ntfs_device_uefi_io_transfer - Perform a batch of positioned reads or
+ * writes, submitting them all through DiskIo2 before waiting for their
+ * completion, so that the device can process them concurrently. The
+ * reads of whole aligned blocks are submitted through BlockIo2 instead.
+ *
+ * Returns the count of bytes transferred from the segments taken in order.
+ * The completion is polled with CheckEvent(), as WaitForEvent() is not
+ * allowed above TPL_APPLICATION.
+ */
+static s64 ntfs_device_uefi_io_transfer(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg, BOOL write)
+{
+	EFI_STATUS Status = EFI_SUCCESS;
+	EFI_FS* FileSystem = (EFI_FS*)dev->d_private;
+	EFI_DISK_IO2_TOKEN* Token;
+	EFI_BLOCK_IO2_TOKEN* BlockToken;
+	EFI_BLOCK_IO_MEDIA* Media;
+	EFI_EVENT Event;
+	EFI_STATUS TransactionStatus;
+	BOOLEAN Direct[DISKIO2_POOL_SIZE];
+	BOOLEAN Failed = FALSE;
+	s64 total = 0;
+	int i, n;
+
+	FS_ASSERT(FileSystem != NULL);
+
+	/* Blocking requests if there is no pool */
+	if (FileSystem->DiskIo2Pool[0].Event == NULL)
+		return write ? ntfs_device_uefi_io_pwrite(dev, seg[0].buf,
+				seg[0].count, seg[0].pos)
+			: ntfs_device_uefi_io_pread(dev, seg[0].buf,
+				seg[0].count, seg[0].pos);
+
+	if (write) {
+		if (NDevReadOnly(dev) || FileSystem->BlockIo->Media->ReadOnly) {
+			errno = EROFS;
+			return -1;
+		}
+		NDevSetDirty(dev);
+	}
+
+	Media = FileSystem->BlockIo->Media;
+	n = (nseg < DISKIO2_POOL_SIZE) ? nseg : DISKIO2_POOL_SIZE;
+	for (i = 0; i < n && !EFI_ERROR(Status); i++) {
+		Direct[i] = !write && FileSystem->BlockIo2Pool[i].Event != NULL
+			&& ntfs_device_uefi_io_direct(FileSystem, seg[i].buf,
+				seg[i].count, seg[i].pos);
+		if (Direct[i]) {
+			BlockToken = &FileSystem->BlockIo2Pool[i];
+			BlockToken->TransactionStatus = EFI_NOT_READY;
+			Status = FileSystem->BlockIo2->ReadBlocksEx(FileSystem->BlockIo2,
+				Media->MediaId, seg[i].pos / Media->BlockSize,
+				BlockToken, (UINTN)seg[i].count, seg[i].buf);
+			continue;
+		}
+		Token = &FileSystem->DiskIo2Pool[i];
+		Token->TransactionStatus = EFI_NOT_READY;
+		if (write)
+			Status = FileSystem->DiskIo2->WriteDiskEx(FileSystem->DiskIo2,
+				Media->MediaId, seg[i].pos, Token, seg[i].count, seg[i].buf);
+		else
+			Status = FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2,
+				Media->MediaId, seg[i].pos, Token, seg[i].count, seg[i].buf);
+	}
+	/* Only the requests which were accepted will complete */
+	if (EFI_ERROR(Status))
+		i--;
+	n = i;
+
+	/* Wait for all the submitted requests, the buffers are in use */
+	for (i = 0; i < n; i++) {
+		if (Direct[i])
+			Event = FileSystem->BlockIo2Pool[i].Event;
+		else
+			Event = FileSystem->DiskIo2Pool[i].Event;
+		while (gBS->CheckEvent(Event) == EFI_NOT_READY)
+			;
+		if (Direct[i])
+			TransactionStatus = FileSystem->BlockIo2Pool[i].TransactionStatus;
+		else
+			TransactionStatus = FileSystem->DiskIo2Pool[i].TransactionStatus;
+		if (EFI_ERROR(TransactionStatus)) {
+			if (!Failed)
+				Status = TransactionStatus;
+			Failed = TRUE;
+		} else if (!Failed)
+			total += seg[i].count;
+	}
+
+	if ((Failed || EFI_ERROR(Status)) && !total) {
+		ntfs_log_perror("Failed to %s data at address %08llx: %r\n",
+			write ? "write" : "read", seg[0].pos, Status);
+		errno = EIO;
+		return -1;
+	}
+	return total;
+}
+
+/**
+ * ntfs_device_uefi_io_preadv - Perform a batch of positioned reads
+ */
+static s64 ntfs_device_uefi_io_preadv(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	return ntfs_device_uefi_io_transfer(dev, seg, nseg, FALSE);
+}
+
+/**
+ * ntfs_device_uefi_io_pwritev - Perform a batch of positioned writes
+ */
+static s64 ntfs_device_uefi_io_pwritev(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	return ntfs_device_uefi_io_transfer(dev, seg, nseg, TRUE);
+}
+
 /**
  * ntfs_device_uefi_io_read - Read from the device, from the current location
  */
@@ -307,6 +500,8 @@ struct ntfs_device_operations ntfs_device_uefi_io_ops = {
 	.write		= ntfs_device_uefi_io_write,
 	.pread		= ntfs_device_uefi_io_pread,
 	.pwrite		= ntfs_device_uefi_io_pwrite,
+	.preadv		= ntfs_device_uefi_io_preadv,
+	.pwritev	= ntfs_device_uefi_io_pwritev,
 	.sync		= ntfs_device_uefi_io_sync,
 	.stat		= ntfs_device_uefi_io_stat,
 	.ioctl		= ntfs_device_uefi_io_ioctl,
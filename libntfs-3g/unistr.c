@@ -45,6 +45,9 @@
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #if defined(__APPLE__) || defined(__DARWIN__)
 #ifdef ENABLE_NFCONV
@@ -243,6 +246,50 @@ int ntfs_names_full_collate(const ntfschar *name1, const u32 name1_len,
 	return 0;
 }
 
+/**
+ * ntfs_upcased_names_collate() collate an upcased name to a Unicode name
+ *
+ * @upname:	first Unicode name, already upcased
+ * @upname_len:	length of first Unicode name
+ * @name:	second Unicode name to compare
+ * @name_len:	length of second Unicode name to compare
+ * @upcase:	upcase table
+ * @upcase_len:	upcase table size
+ *
+ * This is ntfs_names_full_collate() with IGNORE_CASE, for a name which
+ * is compared to many others, such as the key of a lookup : it is
+ * upcased once beforehand, and only the second name has to be upcased
+ * on each comparison.
+ *
+ * Returns:
+ *  -1 if the first name collates before the second one,
+ *   0 if the names match, or
+ *   1 if the second name collates before the first one
+ */
+int ntfs_upcased_names_collate(const ntfschar *upname, const u32 upname_len,
+		const ntfschar *name, const u32 name_len,
+		const ntfschar *upcase, const u32 upcase_len)
+{
+	u32 cnt;
+	u16 u1, u2;
+
+	cnt = min(upname_len, name_len);
+	while (cnt) {
+		u1 = le16_to_cpu(*upname++);
+		u2 = le16_to_cpu(*name++);
+		if (u2 < upcase_len)
+			u2 = le16_to_cpu(upcase[u2]);
+		if (u1 != u2)
+			return (u1 < u2 ? -1 : 1);
+		cnt--;
+	}
+	if (upname_len < name_len)
+		return -1;
+	if (upname_len > name_len)
+		return 1;
+	return 0;
+}
+
 /**
  * ntfs_ucsncmp - compare two little endian Unicode strings
  * @s1:		first string
@@ -458,6 +505,35 @@ void ntfs_file_value_upcase(FILE_NAME_ATTR *file_name_attr,
    Jean-Pierre Andre made it compliant with RFC3629/RFC2781.
 */
  
+/*
+ *		Count the leading ASCII characters of a UTF-16LE string
+ *
+ *	Four characters are checked at once, the count stops at the first
+ *	character which is not ASCII or null, or at @ins_len. A null
+ *	16-bit unit is detected in a word the same way whatever the
+ *	endianness.
+ */
+
+static int utf16_ascii_length(const ntfschar *ins, const int ins_len)
+{
+	u64 w;
+	int i;
+
+	i = 0;
+	while ((i + 4) <= ins_len) {
+		memcpy(&w, &ins[i], sizeof(w));
+		if ((w & const_cpu_to_le64(0xff80ff80ff80ff80ULL))
+		    || ((w - 0x0001000100010001ULL) & ~w
+				& 0x8000800080008000ULL))
+			break;
+		i += 4;
+	}
+	while ((i < ins_len) && ins[i]
+	    && !(ins[i] & const_cpu_to_le16(0xff80)))
+		i++;
+	return (i);
+}
+
 /* 
  * Return the number of bytes in UTF-8 needed (without the terminating null) to
  * store the given UTF-16LE string.
@@ -572,6 +648,29 @@ static int ntfs_utf16_to_utf8(const ntfschar *ins, const int ins_len,
 		outs_len = PATH_MAX;
 	}
 
+		/*
+		 * When there are only ASCII characters, the size is known
+		 * and the conversion is a plain copy.
+		 */
+	size = utf16_ascii_length(ins, ins_len);
+	if ((size == ins_len) || !ins[size]) {
+		if (size > (outs_len - 1)) {
+			errno = ENAMETOOLONG;
+			goto out;
+		}
+		if (!*outs) {
+			*outs = ntfs_malloc(size + 1);
+			if (!*outs)
+				goto out;
+		}
+		t = *outs;
+		for (i = 0; i < size; i++)
+			t[i] = le16_to_cpu(ins[i]);
+		t[size] = '\0';
+		ret = size;
+		goto out;
+	}
+
 	/* The size *with* the terminating null is limited to @outs_len,
 	 * so the size *without* the terminating null is limited to one less. */
 	size = utf16_to_utf8_size(ins, ins_len, outs_len - 1);
@@ -669,7 +768,7 @@ static int ntfs_utf16_to_utf8(const ntfschar *ins, const int ins_len,
 				// We need to copy new_outs into the fixed outs buffer.
 				memset(*outs, 0, original_outs_len);
 				strncpy(*outs, new_outs, original_outs_len-1);
-				t = *outs + original_outs_len;
+				t = *outs + strlen(*outs);
 				free(new_outs);
 			}
 		}
@@ -813,10 +912,12 @@ fail:
  * @ins:	input multibyte string buffer
  * @outs:	on return contains the (allocated) output utf16 string
  * @outs_len:	length of output buffer in utf16 characters
+ *		(ignored if *@outs is NULL)
  * 
  * Return -1 with errno set.
  */
-static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
+static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs,
+			int outs_len)
 {
 #if defined(__APPLE__) || defined(__DARWIN__)
 #ifdef ENABLE_NFCONV
@@ -835,16 +936,40 @@ static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
 	u32 wc;
 	BOOL allocated = FALSE;
 	ntfschar *outpos;
-	int shorts, ret = -1;
+	int shorts, i, ret = -1;
+
+		/* only ASCII characters : the size is known */
+	for (shorts = 0; ins[shorts] && !(ins[shorts] & 0x80); shorts++) { }
+	if (!ins[shorts]) {
+		if ((shorts >= PATH_MAX)
+		    || (*outs && (shorts >= outs_len))) {
+			errno = ENAMETOOLONG;
+			goto out;
+		}
+		if (!*outs) {
+			*outs = ntfs_malloc((shorts + 1) * sizeof(ntfschar));
+			if (!*outs)
+				goto out;
+		}
+		outpos = *outs;
+		for (i = 0; i <= shorts; i++)
+			outpos[i] = cpu_to_le16((unsigned char)ins[i]);
+		ret = shorts;
+		goto out;
+	}
 
 	shorts = utf8_to_utf16_size(ins);
 	if (shorts < 0)
-		goto fail;
+		goto out;
+	if (*outs && (shorts >= outs_len)) {
+		errno = ENAMETOOLONG;
+		goto out;
+	}
 
 	if (!*outs) {
 		*outs = ntfs_malloc((shorts + 1) * sizeof(ntfschar));
 		if (!*outs)
-			goto fail;
+			goto out;
 		allocated = TRUE;
 	}
 
@@ -854,7 +979,7 @@ static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
 		int m  = utf8_to_unicode(&wc, t);
 		if (m <= 0) {
 			if (m < 0)
-				goto fail;
+				goto out;
 			*outpos++ = const_cpu_to_le16(0);
 			break;
 		}
@@ -869,7 +994,7 @@ static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
 	}
 	
 	ret = --outpos - *outs;
-fail:
+out:
 #if defined(__APPLE__) || defined(__DARWIN__)
 #ifdef ENABLE_NFCONV
 	if(new_ins != NULL)
@@ -1057,7 +1182,7 @@ int ntfs_mbstoucs(const char *ins, ntfschar **outs)
 	}
 	
 	if (use_utf8)
-		return ntfs_utf8_to_utf16(ins, outs);
+		return ntfs_utf8_to_utf16(ins, outs, PATH_MAX);
 
 #ifndef FORCE_UTF8
 #ifdef MB_CUR_MAX
@@ -1158,6 +1283,50 @@ err_out:
 	return -1;
 }
 
+/**
+ * ntfs_mbstoucs_buf - convert a multibyte string into a caller buffer
+ * @ins:	input multibyte string buffer
+ * @outs:	output Unicode string buffer
+ * @outs_len:	length of output buffer in Unicode characters
+ *
+ * Same as ntfs_mbstoucs(), except that the Unicode string is written
+ * into a buffer supplied by the caller, which avoids allocating one
+ * for each name on frequent conversions. The buffer must have room
+ * for the terminating Unicode NULL character.
+ *
+ * On success the function returns the number of Unicode characters
+ * written to @outs (>= 0), not counting the terminating NULL.
+ *
+ * On error, -1 is returned, and errno is set to the error code, as
+ * for ntfs_mbstoucs(). On ENAMETOOLONG, the buffer is too small for
+ * the input string.
+ */
+int ntfs_mbstoucs_buf(const char *ins, ntfschar *outs, int outs_len)
+{
+	ntfschar *ucs;
+	int len;
+
+	if (!ins || !outs || (outs_len <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (use_utf8)
+		return (ntfs_utf8_to_utf16(ins, &outs, outs_len));
+		/* not a frequent case, get the name converted and copy it */
+	ucs = (ntfschar*)NULL;
+	len = ntfs_mbstoucs(ins, &ucs);
+	if (len >= 0) {
+		if (len < outs_len)
+			memcpy(outs, ucs, (len + 1)*sizeof(ntfschar));
+		else {
+			errno = ENAMETOOLONG;
+			len = -1;
+		}
+		free(ucs);
+	}
+	return (len);
+}
+
 /*
  *		Turn a UTF8 name uppercase
  *
@@ -1440,6 +1609,237 @@ ntfschar *ntfs_locase_table_build(const ntfschar *uc, u32 uc_cnt)
 	return (lc);
 }
 
+/*
+ *		Sharing of upcase and locase tables
+ *
+ *	Most volumes have the same upcase table, so a single copy is kept
+ *	for all the mounted volumes having the same table, along with the
+ *	locase table derived from it when needed. The default table is
+ *	only built once, and a table read from a volume is first compared
+ *	by hash, then by contents, to the ones already shared.
+ *
+ *	The shared tables must never be modified.
+ */
+
+struct SHARED_UPCASE {
+	struct SHARED_UPCASE *next;
+	ntfschar *upcase;
+	ntfschar *locase;	/* built on first request, or NULL */
+	u32 upcase_len;
+	u32 hash;
+	int refs;		/* count of volumes using the table */
+	BOOL is_default;
+} ;
+
+static struct SHARED_UPCASE *shared_upcase_list;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t shared_upcase_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void shared_upcase_lock_get(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&shared_upcase_lock);
+#endif
+}
+
+static void shared_upcase_lock_put(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&shared_upcase_lock);
+#endif
+}
+
+/*
+ *		Compute the hash of an upcase table (FNV-1a)
+ */
+
+static u32 upcase_hash(const ntfschar *upcase, u32 upcase_len)
+{
+	const u8 *p;
+	u32 hash;
+	u32 i;
+
+	p = (const u8*)upcase;
+	hash = 2166136261U;
+	for (i=0; i<2*upcase_len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+	return (hash);
+}
+
+/*
+ *		Locate a shared table, to be called under the lock
+ */
+
+static struct SHARED_UPCASE *shared_upcase_find(const ntfschar *upcase)
+{
+	struct SHARED_UPCASE *item;
+
+	item = shared_upcase_list;
+	while (item && (item->upcase != upcase))
+		item = item->next;
+	return (item);
+}
+
+/*
+ *		Register a table, to be called under the lock
+ *
+ *	Returns the new entry, or NULL if there is not enough memory
+ */
+
+static struct SHARED_UPCASE *shared_upcase_add(ntfschar *upcase,
+		u32 upcase_len, u32 hash, BOOL is_default)
+{
+	struct SHARED_UPCASE *item;
+
+	item = (struct SHARED_UPCASE*)ntfs_malloc(
+				sizeof(struct SHARED_UPCASE));
+	if (item) {
+		item->upcase = upcase;
+		item->locase = (ntfschar*)NULL;
+		item->upcase_len = upcase_len;
+		item->hash = hash;
+		item->refs = 1;
+		item->is_default = is_default;
+		item->next = shared_upcase_list;
+		shared_upcase_list = item;
+	}
+	return (item);
+}
+
+/*
+ *		Get the shared default upcase table, building it if needed
+ *
+ *	Returns the table, to be released by ntfs_upcase_unshare(),
+ *		or NULL if there is not enough memory
+ */
+
+ntfschar *ntfs_upcase_default(u32 *upcase_len)
+{
+	struct SHARED_UPCASE *item;
+	ntfschar *upcase;
+	u32 len;
+
+	upcase = (ntfschar*)NULL;
+	shared_upcase_lock_get();
+	item = shared_upcase_list;
+	while (item && !item->is_default)
+		item = item->next;
+	if (item) {
+		item->refs++;
+		upcase = item->upcase;
+		*upcase_len = item->upcase_len;
+	} else {
+		len = ntfs_upcase_build_default(&upcase);
+		if (len) {
+			if (!shared_upcase_add(upcase, len,
+					upcase_hash(upcase, len), TRUE)) {
+				free(upcase);
+				upcase = (ntfschar*)NULL;
+			} else
+				*upcase_len = len;
+		}
+	}
+	shared_upcase_lock_put();
+	return (upcase);
+}
+
+/*
+ *		Share an upcase table read from a volume
+ *
+ *	The table must have been allocated by the caller, who transfers
+ *	its ownership. If the same table is already shared, the one
+ *	received is freed. If the table cannot be registered, it is
+ *	returned unshared, which is not an error.
+ *
+ *	Returns the table to use, to be released by ntfs_upcase_unshare()
+ */
+
+ntfschar *ntfs_upcase_share(ntfschar *upcase, u32 upcase_len)
+{
+	struct SHARED_UPCASE *item;
+	u32 hash;
+
+	hash = upcase_hash(upcase, upcase_len);
+	shared_upcase_lock_get();
+	item = shared_upcase_list;
+	while (item && ((item->hash != hash)
+			|| (item->upcase_len != upcase_len)
+			|| memcmp(item->upcase, upcase,
+				upcase_len*sizeof(ntfschar))))
+		item = item->next;
+	if (item) {
+		item->refs++;
+		free(upcase);
+		upcase = item->upcase;
+	} else
+		shared_upcase_add(upcase, upcase_len, hash, FALSE);
+	shared_upcase_lock_put();
+	return (upcase);
+}
+
+/*
+ *		Get the locase table matching an upcase table
+ *
+ *	The locase table of a shared upcase table is built once and
+ *	shared too, otherwise a private one is built.
+ *
+ *	Returns the table, to be released along with the upcase table,
+ *		or NULL if there is not enough memory
+ */
+
+ntfschar *ntfs_locase_share(const ntfschar *upcase, u32 upcase_len)
+{
+	struct SHARED_UPCASE *item;
+	ntfschar *locase;
+
+	shared_upcase_lock_get();
+	item = shared_upcase_find(upcase);
+	if (item) {
+		if (!item->locase)
+			item->locase = ntfs_locase_table_build(upcase,
+						upcase_len);
+		locase = item->locase;
+	} else
+		locase = ntfs_locase_table_build(upcase, upcase_len);
+	shared_upcase_lock_put();
+	return (locase);
+}
+
+/*
+ *		Release an upcase table and its locase table
+ *
+ *	A shared table is freed when no more volume uses it, and a
+ *	private one is freed immediately.
+ */
+
+void ntfs_upcase_unshare(ntfschar *upcase, ntfschar *locase)
+{
+	struct SHARED_UPCASE *item;
+	struct SHARED_UPCASE **pitem;
+
+	shared_upcase_lock_get();
+	pitem = &shared_upcase_list;
+	while (*pitem && ((*pitem)->upcase != upcase))
+		pitem = &(*pitem)->next;
+	item = *pitem;
+	if (item) {
+		if (locase && (locase != item->locase))
+			free(locase);
+		if (!--item->refs) {
+			*pitem = item->next;
+			free(item->locase);
+			free(item->upcase);
+			free(item);
+		}
+	} else {
+		free(locase);
+		free(upcase);
+	}
+	shared_upcase_lock_put();
+}
+
 /**
  * ntfs_str2ucs - convert a string to a valid NTFS file name
  * @s:		input string
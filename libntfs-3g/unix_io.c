@@ -50,12 +50,21 @@
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_LINUX_FD_H
 #include <linux/fd.h>
 #endif
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "mst.h"
@@ -63,8 +72,32 @@
 #include "device.h"
 #include "logging.h"
 #include "misc.h"
+#include "param.h"
 
-#define DEV_FD(dev)	(*(int *)dev->d_private)
+#define DEV_FD(dev)	(((struct ntfs_unix_private*)dev->d_private)->fd)
+#define DEV_DIRECT(dev)	(((struct ntfs_unix_private*)dev->d_private)->direct)
+#define DEV_MAP(dev)	(((struct ntfs_unix_private*)dev->d_private)->map)
+#define DEV_MAP_SIZE(dev) (((struct ntfs_unix_private*)dev->d_private)->map_size)
+
+#define DIRECT_BOUNCE_SIZE 65536 /* size of a direct I/O bounce buffer */
+#define DIRECT_BOUNCE_POOL 4 /* max number of bounce buffers kept */
+#define DIRECT_DEFAULT_ALIGN 4096 /* alignment when the sector size is unknown */
+
+/*
+ *	State of a device opened for direct I/O (bypassing the cache)
+ *
+ *	Transfers whose buffer, size or position are not aligned to the
+ *	sector size are made through an aligned bounce buffer.
+ */
+
+struct unix_direct_io {
+	u32 align;		/* required alignment, a power of two */
+	int count;		/* number of buffers in the pool */
+	char *pool[DIRECT_BOUNCE_POOL];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;	/* the pool is shared by concurrent readers */
+#endif
+} ;
 
 /* Define to nothing if not present on this system. */
 #ifndef O_EXCL
@@ -99,12 +132,294 @@ static int ntfs_fsync(int fildes)
 		 */
 		ret = fsync(fildes);
 	}
+#else
+#ifdef HAVE_FDATASYNC
+		/* the times of the device or image file do not matter */
+	ret = fdatasync(fildes);
 #else
 	ret = fsync(fildes);
+#endif
 #endif
 	return ret;
 }
 
+/*
+ *		Get a bounce buffer for direct I/O
+ *
+ *	Returns NULL if there is not enough memory
+ */
+
+static char *direct_get_bounce(struct unix_direct_io *direct)
+{
+	void *p;
+
+	p = (void*)NULL;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&direct->lock);
+#endif
+	if (direct->count)
+		p = direct->pool[--direct->count];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&direct->lock);
+#endif
+	if (!p) {
+		if (posix_memalign(&p, direct->align, DIRECT_BOUNCE_SIZE)) {
+			errno = ENOMEM;
+			p = (void*)NULL;
+		}
+	}
+	return ((char*)p);
+}
+
+/*
+ *		Return a bounce buffer to the pool
+ */
+
+static void direct_put_bounce(struct unix_direct_io *direct, char *p)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&direct->lock);
+#endif
+	if (direct->count < DIRECT_BOUNCE_POOL) {
+		direct->pool[direct->count++] = p;
+		p = (char*)NULL;
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&direct->lock);
+#endif
+	free(p);
+}
+
+static void direct_free(struct unix_direct_io *direct)
+{
+	while (direct->count)
+		free(direct->pool[--direct->count]);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&direct->lock);
+#endif
+	free(direct);
+}
+
+/*
+ *		Set up direct I/O for an opened device
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+static int direct_init(struct ntfs_device *dev)
+{
+	struct unix_direct_io *direct;
+	int sectsize;
+
+	direct = (struct unix_direct_io*)ntfs_malloc(
+				sizeof(struct unix_direct_io));
+	if (!direct)
+		return (-1);
+	direct->count = 0;
+	direct->align = DIRECT_DEFAULT_ALIGN;
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&direct->lock, (pthread_mutexattr_t*)NULL)) {
+		free(direct);
+		errno = ENOMEM;
+		return (-1);
+	}
+#endif
+#ifdef BLKSSZGET
+	if (NDevBlock(dev)
+	    && !ioctl(DEV_FD(dev), BLKSSZGET, &sectsize)
+	    && (sectsize >= NTFS_BLOCK_SIZE)
+	    && (sectsize <= DIRECT_BOUNCE_SIZE)
+	    && !(sectsize & (sectsize - 1)))
+		direct->align = sectsize;
+#endif
+	DEV_DIRECT(dev) = direct;
+	return (0);
+}
+
+static BOOL direct_aligned(struct unix_direct_io *direct, const void *buf,
+			s64 count, s64 pos)
+{
+	u32 mask;
+
+	mask = direct->align - 1;
+	return (!(((unsigned long)buf | count | pos) & mask));
+}
+
+/*
+ *		Read from a device opened for direct I/O
+ *
+ *	When not aligned, the read is made through a bounce buffer, so
+ *	it may be partial, the caller has to loop.
+ *
+ *	Returns the number of bytes read, or -1 if there was an error
+ */
+
+static s64 direct_pread(struct ntfs_device *dev, void *buf,
+			s64 count, s64 pos)
+{
+	struct unix_direct_io *direct;
+	char *bounce;
+	s64 start;
+	s64 skip;
+	s64 len;
+	s64 br;
+	int err;
+
+	direct = DEV_DIRECT(dev);
+	if (direct_aligned(direct, buf, count, pos))
+		return (pread(DEV_FD(dev), buf, count, pos));
+	bounce = direct_get_bounce(direct);
+	if (!bounce)
+		return (-1);
+	start = pos & ~(s64)(direct->align - 1);
+	skip = pos - start;
+	len = (skip + count + direct->align - 1)
+			& ~(s64)(direct->align - 1);
+	if (len > DIRECT_BOUNCE_SIZE)
+		len = DIRECT_BOUNCE_SIZE;
+	br = pread(DEV_FD(dev), bounce, len, start);
+	err = errno;
+	if (br > skip) {
+		br -= skip;
+		if (br > count)
+			br = count;
+		memcpy(buf, &bounce[skip], br);
+	} else
+		if (br > 0)
+			br = 0;
+	direct_put_bounce(direct, bounce);
+	errno = err;
+	return (br);
+}
+
+/*
+ *		Write to a device opened for direct I/O
+ *
+ *	When not aligned, the partial sectors at both ends are read,
+ *	merged with the data and rewritten. The write may be partial,
+ *	the caller has to loop.
+ *
+ *	Returns the number of bytes written, or -1 if there was an error
+ */
+
+static s64 direct_pwrite(struct ntfs_device *dev, const void *buf,
+			s64 count, s64 pos)
+{
+	struct unix_direct_io *direct;
+	char *bounce;
+	s64 start;
+	s64 skip;
+	s64 len;
+	s64 size;
+	s64 last;
+	s64 br;
+	s64 bw;
+	int err;
+
+	direct = DEV_DIRECT(dev);
+	if (direct_aligned(direct, buf, count, pos))
+		return (pwrite(DEV_FD(dev), buf, count, pos));
+	bounce = direct_get_bounce(direct);
+	if (!bounce)
+		return (-1);
+	start = pos & ~(s64)(direct->align - 1);
+	skip = pos - start;
+	len = (skip + count + direct->align - 1)
+			& ~(s64)(direct->align - 1);
+	if (len > DIRECT_BOUNCE_SIZE)
+		len = DIRECT_BOUNCE_SIZE;
+	size = len - skip;
+	if (size > count)
+		size = count;
+	bw = 0;
+		/* Get the original contents of the first partial sector */
+	if (skip) {
+		br = pread(DEV_FD(dev), bounce, direct->align, start);
+		if (br < 0)
+			bw = -1;
+		else
+			if (br < direct->align)
+				memset(&bounce[br], 0, direct->align - br);
+	}
+		/* Same for the last one, if not already read */
+	last = len - direct->align;
+	if (!bw && ((skip + size) & (direct->align - 1))
+	    && (!skip || last)) {
+		br = pread(DEV_FD(dev), &bounce[last], direct->align,
+				start + last);
+		if (br < 0)
+			bw = -1;
+		else
+			if (br < direct->align)
+				memset(&bounce[last + br], 0,
+					direct->align - br);
+	}
+	if (!bw) {
+		memcpy(&bounce[skip], buf, size);
+		bw = pwrite(DEV_FD(dev), bounce, len, start);
+		if (bw > skip) {
+			bw -= skip;
+			if (bw > size)
+				bw = size;
+		} else
+			if (bw > 0)
+				bw = 0;
+	}
+	err = errno;
+	direct_put_bounce(direct, bounce);
+	errno = err;
+	return (bw);
+}
+
+#if MMAP_READONLY && defined(HAVE_SYS_MMAN_H)
+
+/*
+ *		Map a read-only image file into memory
+ *
+ *	The reads are then copied from the mapping, and the data can be
+ *	used in place through ntfs_pmap(). Failing to map is not an error,
+ *	the file is just read normally.
+ */
+
+static void map_image(struct ntfs_device *dev)
+{
+	struct stat sbuf;
+	void *map;
+
+	if (!fstat(DEV_FD(dev), &sbuf)
+	    && S_ISREG(sbuf.st_mode)
+	    && (sbuf.st_size > 0)
+	    && ((s64)(size_t)sbuf.st_size == (s64)sbuf.st_size)) {
+		map = mmap((void*)NULL, sbuf.st_size, PROT_READ, MAP_SHARED,
+				DEV_FD(dev), 0);
+		if (map != MAP_FAILED) {
+			DEV_MAP(dev) = (char*)map;
+			DEV_MAP_SIZE(dev) = sbuf.st_size;
+			NDevSetMapped(dev);
+		} else
+			ntfs_log_debug("Could not map '%s'\n", dev->d_name);
+	}
+}
+
+#endif /* MMAP_READONLY && defined(HAVE_SYS_MMAN_H) */
+
+/*
+ *		Read from the mapping of an image file
+ *
+ *	Returns the count of bytes read, 0 beyond the end of the file
+ */
+
+static s64 map_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	if (offset >= DEV_MAP_SIZE(dev))
+		return (0);
+	if (count > (DEV_MAP_SIZE(dev) - offset))
+		count = DEV_MAP_SIZE(dev) - offset;
+	memcpy(buf, &DEV_MAP(dev)[offset], count);
+	return (count);
+}
+
 /**
  * ntfs_device_unix_io_open - Open a device and lock it exclusively
  * @dev:
@@ -131,17 +446,39 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 	if (S_ISBLK(sbuf.st_mode))
 		NDevSetBlock(dev);
 	
-	dev->d_private = ntfs_malloc(sizeof(int));
+	dev->d_private = ntfs_malloc(sizeof(struct ntfs_unix_private));
 	if (!dev->d_private)
 		return -1;
+	DEV_DIRECT(dev) = (struct unix_direct_io*)NULL;
+	DEV_MAP(dev) = (char*)NULL;
+	DEV_MAP_SIZE(dev) = 0;
 	/*
 	 * Open file for exclusive access if mounting r/w.
 	 * Fuseblk takes care about block devices.
 	 */ 
 	if (!NDevBlock(dev) && (flags & O_RDWR) == O_RDWR)
 		flags |= O_EXCL;
-	*(int*)dev->d_private = open(dev->d_name, flags);
-	if (*(int*)dev->d_private == -1) {
+#ifdef O_DIRECT
+	if (NDevDirect(dev)) {
+		DEV_FD(dev) = open(dev->d_name, flags | O_DIRECT);
+			/* direct I/O may not be supported, open normally */
+		if ((DEV_FD(dev) == -1) && (errno == EINVAL)) {
+			ntfs_log_info("Direct I/O is not supported on '%s'\n",
+					dev->d_name);
+			NDevClearDirect(dev);
+		}
+	}
+	if (!NDevDirect(dev))
+		DEV_FD(dev) = open(dev->d_name, flags);
+#else
+	if (NDevDirect(dev)) {
+		ntfs_log_info("Direct I/O is not supported on '%s'\n",
+				dev->d_name);
+		NDevClearDirect(dev);
+	}
+	DEV_FD(dev) = open(dev->d_name, flags);
+#endif
+	if (DEV_FD(dev) == -1) {
 		err = errno;
 			/* if permission error and rw, retry read-only */
 		if ((err == EACCES) && ((flags & O_RDWR) == O_RDWR))
@@ -182,6 +519,16 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
 			ntfs_log_perror("Failed to close '%s'", dev->d_name);
 		goto err_out;
 	}
+	if (NDevDirect(dev) && direct_init(dev)) {
+		err = errno;
+		if (close(DEV_FD(dev)))
+			ntfs_log_perror("Failed to close '%s'", dev->d_name);
+		goto err_out;
+	}
+#if MMAP_READONLY && defined(HAVE_SYS_MMAN_H)
+	if (NDevReadOnly(dev) && !NDevBlock(dev) && !NDevDirect(dev))
+		map_image(dev);
+#endif
 	
 	NDevSetOpen(dev);
 	return 0;
@@ -221,11 +568,20 @@ static int ntfs_device_unix_io_close(struct ntfs_device *dev)
 	flk.l_start = flk.l_len = 0LL;
 	if (fcntl(DEV_FD(dev), F_SETLK, &flk))
 		ntfs_log_perror("Could not unlock %s", dev->d_name);
+#ifdef HAVE_SYS_MMAN_H
+	if (DEV_MAP(dev)) {
+		munmap(DEV_MAP(dev), DEV_MAP_SIZE(dev));
+		DEV_MAP(dev) = (char*)NULL;
+		NDevClearMapped(dev);
+	}
+#endif
 	if (close(DEV_FD(dev))) {
 		ntfs_log_perror("Failed to close device %s", dev->d_name);
 		return -1;
 	}
 	NDevClearOpen(dev);
+	if (DEV_DIRECT(dev))
+		direct_free(DEV_DIRECT(dev));
 	free(dev->d_private);
 	dev->d_private = NULL;
 	return 0;
@@ -260,6 +616,18 @@ static s64 ntfs_device_unix_io_seek(struct ntfs_device *dev, s64 offset,
 static s64 ntfs_device_unix_io_read(struct ntfs_device *dev, void *buf,
 		s64 count)
 {
+	s64 pos;
+	s64 br;
+
+	if (DEV_DIRECT(dev)) {
+		pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+		if (pos < 0)
+			return -1;
+		br = direct_pread(dev, buf, count, pos);
+		if ((br > 0) && (lseek(DEV_FD(dev), pos + br, SEEK_SET) < 0))
+			return -1;
+		return br;
+	}
 	return read(DEV_FD(dev), buf, count);
 }
 
@@ -281,6 +649,18 @@ static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf,
 		return -1;
 	}
 	NDevSetDirty(dev);
+	if (DEV_DIRECT(dev)) {
+		s64 pos;
+		s64 bw;
+
+		pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+		if (pos < 0)
+			return -1;
+		bw = direct_pwrite(dev, buf, count, pos);
+		if ((bw > 0) && (lseek(DEV_FD(dev), pos + bw, SEEK_SET) < 0))
+			return -1;
+		return bw;
+	}
 	return write(DEV_FD(dev), buf, count);
 }
 
@@ -298,6 +678,10 @@ static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf,
 static s64 ntfs_device_unix_io_pread(struct ntfs_device *dev, void *buf,
 		s64 count, s64 offset)
 {
+	if (DEV_MAP(dev))
+		return map_pread(dev, buf, count, offset);
+	if (DEV_DIRECT(dev))
+		return direct_pread(dev, buf, count, offset);
 	return pread(DEV_FD(dev), buf, count, offset);
 }
 
@@ -320,9 +704,123 @@ static s64 ntfs_device_unix_io_pwrite(struct ntfs_device *dev, const void *buf,
 		return -1;
 	}
 	NDevSetDirty(dev);
+	if (DEV_DIRECT(dev))
+		return direct_pwrite(dev, buf, count, offset);
 	return pwrite(DEV_FD(dev), buf, count, offset);
 }
 
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+
+/*
+ *		Build the iovec for the leading segments of a batch which
+ *	are contiguous on device, so that they can be transferred by a
+ *	single system call.
+ *
+ *	Returns the number of iovec entries
+ */
+
+static int ntfs_device_unix_io_iovec(struct iovec *iov,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	s64 pos;
+	int i;
+
+	pos = seg[0].pos;
+	for (i=0; (i<nseg) && (seg[i].pos == pos); i++) {
+		iov[i].iov_base = seg[i].buf;
+		iov[i].iov_len = seg[i].count;
+		pos += seg[i].count;
+	}
+	return (i);
+}
+
+/**
+ * ntfs_device_unix_io_preadv - Perform a batched read from the device
+ * @dev:	device to read from
+ * @seg:	segments to read
+ * @nseg:	number of segments
+ *
+ * Only the leading segments which are contiguous on device are read,
+ * ntfs_preadv() calls again for the next ones. All the segments are
+ * copied at once from a mapped image.
+ *
+ * Returns the number of bytes read, or -1 if an error occurred.
+ */
+static s64 ntfs_device_unix_io_preadv(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	struct iovec iov[NTFS_MAX_IO_SEGMENTS];
+	s64 total;
+	s64 br;
+	int cnt;
+	int i;
+
+	if (DEV_MAP(dev)) {
+		total = 0;
+		for (i=0; i<nseg; i++) {
+			br = map_pread(dev, seg[i].buf, seg[i].count,
+					seg[i].pos);
+			total += br;
+			if (br < seg[i].count)
+				break;
+		}
+		return (total);
+	}
+		/* unaligned segments cannot be read directly */
+	if (DEV_DIRECT(dev))
+		return direct_pread(dev, seg[0].buf, seg[0].count, seg[0].pos);
+	cnt = ntfs_device_unix_io_iovec(iov, seg, nseg);
+	return preadv(DEV_FD(dev), iov, cnt, seg[0].pos);
+}
+
+/**
+ * ntfs_device_unix_io_pwritev - Perform a batched write to the device
+ * @dev:	device to write to
+ * @seg:	segments to write
+ * @nseg:	number of segments
+ *
+ * Only the leading segments which are contiguous on device are written,
+ * ntfs_pwritev() calls again for the next ones.
+ *
+ * Returns the number of bytes written, or -1 if an error occurred.
+ */
+static s64 ntfs_device_unix_io_pwritev(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	struct iovec iov[NTFS_MAX_IO_SEGMENTS];
+	int cnt;
+
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+	NDevSetDirty(dev);
+	if (DEV_DIRECT(dev))
+		return direct_pwrite(dev, seg[0].buf, seg[0].count,
+				seg[0].pos);
+	cnt = ntfs_device_unix_io_iovec(iov, seg, nseg);
+	return pwritev(DEV_FD(dev), iov, cnt, seg[0].pos);
+}
+
+#endif /* defined(HAVE_PREADV) && defined(HAVE_PWRITEV) */
+
+/**
+ * ntfs_device_unix_io_map - Access in place to a mapped read-only image
+ * @dev:	device to read from
+ * @count:	number of bytes wanted
+ * @offset:	position of the data
+ *
+ * Returns a pointer into the mapping, or NULL if the image is not
+ * mapped or the data is beyond its end.
+ */
+static const void *ntfs_device_unix_io_map(struct ntfs_device *dev,
+		s64 count, s64 offset)
+{
+	if (!DEV_MAP(dev) || (offset > (DEV_MAP_SIZE(dev) - count)))
+		return ((const void*)NULL);
+	return (&DEV_MAP(dev)[offset]);
+}
+
 /**
  * ntfs_device_unix_io_sync - Flush any buffered changes to the device
  * @dev:
@@ -366,15 +864,70 @@ static int ntfs_device_unix_io_stat(struct ntfs_device *dev, struct stat *buf)
  * @argp:
  *
  * Description...
+ * BLKDISCARD and BLKZEROOUT are emulated on regular files.
  *
  * Returns:
  */
 static int ntfs_device_unix_io_ioctl(struct ntfs_device *dev,
 		unsigned long request, void *argp)
 {
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(BLKDISCARD) \
+		&& defined(BLKZEROOUT)
+	u64 *range;
+
+		/*
+		 * Discarding or zeroing out a range of a regular file
+		 * is done by punching a hole, which reads back as zeroes.
+		 */
+	if (!NDevBlock(dev)
+	    && ((request == BLKDISCARD) || (request == BLKZEROOUT))) {
+		range = (u64*)argp;
+		return (fallocate(DEV_FD(dev),
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				range[0], range[1]));
+	}
+#endif
 	return ioctl(DEV_FD(dev), request, argp);
 }
 
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(BLKDISCARD)
+
+/**
+ * ntfs_device_unix_io_discard - Discard ranges of the device
+ * @dev:	device to discard from
+ * @seg:	ranges to discard
+ * @nseg:	number of ranges
+ *
+ * The ranges of a block device are discarded by BLKDISCARD, and a hole
+ * is punched for those of a regular file. Only the file descriptor is
+ * used, so that this can be called from another thread.
+ *
+ * Returns 0 if all the ranges have been discarded, or -1 if an error
+ * occurred.
+ */
+static int ntfs_device_unix_io_discard(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	u64 range[2];
+	int res;
+	int i;
+
+	res = 0;
+	for (i=0; (i<nseg) && !res; i++) {
+		if (NDevBlock(dev)) {
+			range[0] = seg[i].pos;
+			range[1] = seg[i].count;
+			res = ioctl(DEV_FD(dev), BLKDISCARD, range);
+		} else
+			res = fallocate(DEV_FD(dev),
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				seg[i].pos, seg[i].count);
+	}
+	return (res);
+}
+
+#endif /* defined(FALLOC_FL_PUNCH_HOLE) && defined(BLKDISCARD) */
+
 /**
  * Device operations for working with unix style devices and files.
  */
@@ -386,6 +939,14 @@ struct ntfs_device_operations ntfs_device_unix_io_ops = {
 	.write		= ntfs_device_unix_io_write,
 	.pread		= ntfs_device_unix_io_pread,
 	.pwrite		= ntfs_device_unix_io_pwrite,
+#if defined(HAVE_PREADV) && defined(HAVE_PWRITEV)
+	.preadv		= ntfs_device_unix_io_preadv,
+	.pwritev	= ntfs_device_unix_io_pwritev,
+#endif
+	.map		= ntfs_device_unix_io_map,
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(BLKDISCARD)
+	.discard	= ntfs_device_unix_io_discard,
+#endif
 	.sync		= ntfs_device_unix_io_sync,
 	.stat		= ntfs_device_unix_io_stat,
 	.ioctl		= ntfs_device_unix_io_ioctl,
@@ -0,0 +1,529 @@
+/**
+ * uring_io.c - io_uring based disk io functions for Linux.
+ *
+ * Copyright (c) 2026 ntfs-3g contributors
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *	These device operations are the unix ones, except that batched
+ *	transfers are submitted as a single io_uring submission queue
+ *	batch, so that the device sees all the segments at once.
+ *
+ *	When io_uring is not available, either at build time or at run
+ *	time (old kernel, disabled by security policy), the batched
+ *	transfers fall back to the unix ones.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "types.h"
+#include "device.h"
+#include "logging.h"
+#include "misc.h"
+
+#ifdef NTFS_DEVICE_URING_IO_OPS
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) \
+		&& defined(__NR_io_uring_enter)
+#define URING_SUPPORTED 1
+#endif
+
+#ifdef URING_SUPPORTED
+
+/*
+ *	The private data starts with the unix one, so that the unix
+ *	device operations can be used on the same device.
+ */
+
+struct uring_private {
+	struct ntfs_unix_private base; /* must be first, used by unix_io.c */
+	int ring_fd;		/* -1 if io_uring is not available */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	struct iovec iov[NTFS_MAX_IO_SEGMENTS];
+	s64 res[NTFS_MAX_IO_SEGMENTS];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;	/* the ring is shared by concurrent readers */
+#endif
+} ;
+
+#define DEV_URING(dev)	((struct uring_private*)(dev)->d_private)
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+			unsigned int min_complete, unsigned int flags)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0));
+}
+
+/*
+ *		Release the ring
+ */
+
+static void uring_release(struct uring_private *priv)
+{
+	if (priv->sqes)
+		munmap(priv->sqes, priv->sqes_size);
+	if (priv->cq_ring && (priv->cq_ring != priv->sq_ring))
+		munmap(priv->cq_ring, priv->cq_ring_size);
+	if (priv->sq_ring)
+		munmap(priv->sq_ring, priv->sq_ring_size);
+	if (priv->ring_fd >= 0)
+		close(priv->ring_fd);
+	priv->sqes = (struct io_uring_sqe*)NULL;
+	priv->sq_ring = priv->cq_ring = (void*)NULL;
+	priv->ring_fd = -1;
+}
+
+/*
+ *		Create the ring and map its queues
+ *
+ *	Returns zero if successful, -1 otherwise (then io_uring is not
+ *	used and the unix batched transfers are used instead)
+ */
+
+static int uring_init(struct uring_private *priv)
+{
+	struct io_uring_params params;
+	char *sq;
+	char *cq;
+
+	priv->sqes = (struct io_uring_sqe*)NULL;
+	priv->sq_ring = priv->cq_ring = (void*)NULL;
+	memset(&params, 0, sizeof(params));
+	priv->ring_fd = uring_setup(NTFS_MAX_IO_SEGMENTS, &params);
+	if (priv->ring_fd < 0)
+		return (-1);
+	priv->sq_ring_size = params.sq_off.array
+			+ params.sq_entries*sizeof(unsigned int);
+	priv->cq_ring_size = params.cq_off.cqes
+			+ params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (priv->cq_ring_size > priv->sq_ring_size)
+			priv->sq_ring_size = priv->cq_ring_size;
+		priv->cq_ring_size = priv->sq_ring_size;
+	}
+	priv->sq_ring = mmap((void*)NULL, priv->sq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			priv->ring_fd, IORING_OFF_SQ_RING);
+	if (priv->sq_ring == MAP_FAILED) {
+		priv->sq_ring = (void*)NULL;
+		goto err;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		priv->cq_ring = priv->sq_ring;
+	else {
+		priv->cq_ring = mmap((void*)NULL, priv->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			priv->ring_fd, IORING_OFF_CQ_RING);
+		if (priv->cq_ring == MAP_FAILED) {
+			priv->cq_ring = (void*)NULL;
+			goto err;
+		}
+	}
+	priv->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+	priv->sqes = (struct io_uring_sqe*)mmap((void*)NULL, priv->sqes_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			priv->ring_fd, IORING_OFF_SQES);
+	if (priv->sqes == MAP_FAILED) {
+		priv->sqes = (struct io_uring_sqe*)NULL;
+		goto err;
+	}
+	sq = (char*)priv->sq_ring;
+	cq = (char*)priv->cq_ring;
+	priv->sq_head = (unsigned int*)(sq + params.sq_off.head);
+	priv->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+	priv->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+	priv->sq_array = (unsigned int*)(sq + params.sq_off.array);
+	priv->cq_head = (unsigned int*)(cq + params.cq_off.head);
+	priv->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+	priv->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+	priv->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return (0);
+err :
+	uring_release(priv);
+	return (-1);
+}
+
+/*
+ *		Submit a batch of segments and wait for all completions
+ *
+ *	Returns the number of bytes transferred from the segments taken
+ *	in order, or -1 if nothing could be transferred.
+ */
+
+static s64 uring_transfer_i(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg, u8 opcode)
+{
+	struct uring_private *priv;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int tail;
+	unsigned int head;
+	unsigned int idx;
+	int pending;
+	int submit;
+	int err;
+	int r;
+	int i;
+	s64 total;
+
+	priv = DEV_URING(dev);
+	tail = *priv->sq_tail;
+	for (i=0; i<nseg; i++) {
+		priv->iov[i].iov_base = seg[i].buf;
+		priv->iov[i].iov_len = seg[i].count;
+		priv->res[i] = -EIO;
+		idx = tail & *priv->sq_mask;
+		sqe = &priv->sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = opcode;
+		sqe->fd = priv->base.fd;
+		sqe->off = seg[i].pos;
+		sqe->addr = (unsigned long)&priv->iov[i];
+		sqe->len = 1;
+		sqe->user_data = i;
+		priv->sq_array[idx] = idx;
+		tail++;
+	}
+	/* Make the entries visible before the tail update */
+	__atomic_store_n(priv->sq_tail, tail, __ATOMIC_RELEASE);
+	pending = nseg;
+	submit = nseg;
+	err = 0;
+	while (pending) {
+		r = uring_enter(priv->ring_fd, submit, pending,
+				IORING_ENTER_GETEVENTS);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+		submit -= (r < submit ? r : submit);
+		head = *priv->cq_head;
+		while (head != __atomic_load_n(priv->cq_tail,
+					__ATOMIC_ACQUIRE)) {
+			cqe = &priv->cqes[head & *priv->cq_mask];
+			if (cqe->user_data < (u64)nseg)
+				priv->res[cqe->user_data] = cqe->res;
+			head++;
+			pending--;
+		}
+		__atomic_store_n(priv->cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (pending) {
+		/*
+		 * The ring is in an unknown state, stop using it
+		 * for subsequent transfers.
+		 */
+		ntfs_log_error("io_uring failed on %s, disabling it\n",
+				dev->d_name);
+		uring_release(priv);
+		errno = err;
+		return (-1);
+	}
+	total = 0;
+	for (i=0; i<nseg; i++) {
+		if (priv->res[i] < 0) {
+			if (!total) {
+				errno = -priv->res[i];
+				total = -1;
+			}
+			break;
+		}
+		total += priv->res[i];
+		if (priv->res[i] < seg[i].count)
+			break;
+	}
+	return (total);
+}
+
+/*
+ *		Transfer a batch of segments, the ring being locked
+ *	against concurrent readers
+ */
+
+static s64 uring_transfer(struct ntfs_device *dev,
+			const struct ntfs_io_segment *seg, int nseg, u8 opcode)
+{
+	s64 total;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&DEV_URING(dev)->lock);
+#endif
+	total = uring_transfer_i(dev, seg, nseg, opcode);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&DEV_URING(dev)->lock);
+#endif
+	return (total);
+}
+
+#endif /* URING_SUPPORTED */
+
+/**
+ * ntfs_device_uring_io_open - Open a device and set up its ring
+ * @dev:	device to open
+ * @flags:	open flags
+ *
+ * The device is opened as a unix device, then a ring is created for
+ * it. Failing to create the ring is not an error, io_uring is just not
+ * used for this device.
+ *
+ * Returns zero if successful, -1 with errno set otherwise.
+ */
+static int ntfs_device_uring_io_open(struct ntfs_device *dev, int flags)
+{
+#ifdef URING_SUPPORTED
+	struct uring_private *priv;
+	int err;
+
+	if (ntfs_device_unix_io_ops.open(dev, flags))
+		return (-1);
+	priv = (struct uring_private*)realloc(dev->d_private,
+			sizeof(struct uring_private));
+	if (!priv) {
+		err = errno;
+		ntfs_device_unix_io_ops.close(dev);
+		errno = err;
+		return (-1);
+	}
+	dev->d_private = priv;
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&priv->lock, (pthread_mutexattr_t*)NULL)) {
+		ntfs_device_unix_io_ops.close(dev);
+		errno = ENOMEM;
+		return (-1);
+	}
+#endif
+	if (uring_init(priv))
+		ntfs_log_info("io_uring is not available on %s, "
+				"using plain device I/O\n", dev->d_name);
+	return (0);
+#else
+	ntfs_log_info("io_uring is not supported, using plain device I/O\n");
+	return (ntfs_device_unix_io_ops.open(dev, flags));
+#endif
+}
+
+/**
+ * ntfs_device_uring_io_close - Close the device, releasing its ring
+ * @dev:	device to close
+ *
+ * Returns zero if successful, -1 with errno set otherwise.
+ */
+static int ntfs_device_uring_io_close(struct ntfs_device *dev)
+{
+#ifdef URING_SUPPORTED
+	if (NDevOpen(dev) && dev->d_private) {
+		uring_release(DEV_URING(dev));
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&DEV_URING(dev)->lock);
+#endif
+	}
+#endif
+	return (ntfs_device_unix_io_ops.close(dev));
+}
+
+/**
+ * ntfs_device_uring_io_preadv - Perform a batched read from the device
+ * @dev:	device to read from
+ * @seg:	segments to read
+ * @nseg:	number of segments
+ *
+ * All the segments are submitted at once, whatever their location.
+ *
+ * Returns the number of bytes read, or -1 if an error occurred.
+ */
+static s64 ntfs_device_uring_io_preadv(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+#ifdef URING_SUPPORTED
+		/*
+		 * Direct I/O needs the alignment fix-ups from unix_io.c,
+		 * and a mapped image is read with no system call.
+		 */
+	if ((DEV_URING(dev)->ring_fd >= 0) && !DEV_URING(dev)->base.direct
+	    && !DEV_URING(dev)->base.map)
+		return (uring_transfer(dev, seg, nseg, IORING_OP_READV));
+#endif
+	if (ntfs_device_unix_io_ops.preadv)
+		return (ntfs_device_unix_io_ops.preadv(dev, seg, nseg));
+	return (ntfs_device_unix_io_ops.pread(dev, seg[0].buf,
+					seg[0].count, seg[0].pos));
+}
+
+/**
+ * ntfs_device_uring_io_pwritev - Perform a batched write to the device
+ * @dev:	device to write to
+ * @seg:	segments to write
+ * @nseg:	number of segments
+ *
+ * All the segments are submitted at once, whatever their location.
+ *
+ * Returns the number of bytes written, or -1 if an error occurred.
+ */
+static s64 ntfs_device_uring_io_pwritev(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	if (NDevReadOnly(dev)) {
+		errno = EROFS;
+		return -1;
+	}
+#ifdef URING_SUPPORTED
+	if ((DEV_URING(dev)->ring_fd >= 0) && !DEV_URING(dev)->base.direct) {
+		NDevSetDirty(dev);
+		return (uring_transfer(dev, seg, nseg, IORING_OP_WRITEV));
+	}
+#endif
+	if (ntfs_device_unix_io_ops.pwritev)
+		return (ntfs_device_unix_io_ops.pwritev(dev, seg, nseg));
+	return (ntfs_device_unix_io_ops.pwrite(dev, seg[0].buf,
+					seg[0].count, seg[0].pos));
+}
+
+static s64 ntfs_device_uring_io_seek(struct ntfs_device *dev, s64 offset,
+		int whence)
+{
+	return (ntfs_device_unix_io_ops.seek(dev, offset, whence));
+}
+
+static s64 ntfs_device_uring_io_read(struct ntfs_device *dev, void *buf,
+		s64 count)
+{
+	return (ntfs_device_unix_io_ops.read(dev, buf, count));
+}
+
+static s64 ntfs_device_uring_io_write(struct ntfs_device *dev,
+		const void *buf, s64 count)
+{
+	return (ntfs_device_unix_io_ops.write(dev, buf, count));
+}
+
+static s64 ntfs_device_uring_io_pread(struct ntfs_device *dev, void *buf,
+		s64 count, s64 offset)
+{
+	return (ntfs_device_unix_io_ops.pread(dev, buf, count, offset));
+}
+
+static s64 ntfs_device_uring_io_pwrite(struct ntfs_device *dev,
+		const void *buf, s64 count, s64 offset)
+{
+	return (ntfs_device_unix_io_ops.pwrite(dev, buf, count, offset));
+}
+
+static const void *ntfs_device_uring_io_map(struct ntfs_device *dev,
+		s64 count, s64 offset)
+{
+	return (ntfs_device_unix_io_ops.map(dev, count, offset));
+}
+
+static int ntfs_device_uring_io_discard(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	if (!ntfs_device_unix_io_ops.discard) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	return (ntfs_device_unix_io_ops.discard(dev, seg, nseg));
+}
+
+static int ntfs_device_uring_io_sync(struct ntfs_device *dev)
+{
+	return (ntfs_device_unix_io_ops.sync(dev));
+}
+
+static int ntfs_device_uring_io_stat(struct ntfs_device *dev,
+		struct stat *buf)
+{
+	return (ntfs_device_unix_io_ops.stat(dev, buf));
+}
+
+static int ntfs_device_uring_io_ioctl(struct ntfs_device *dev,
+		unsigned long request, void *argp)
+{
+	return (ntfs_device_unix_io_ops.ioctl(dev, request, argp));
+}
+
+/**
+ * Device operations for submitting batched transfers through io_uring.
+ */
+struct ntfs_device_operations ntfs_device_uring_io_ops = {
+	.open		= ntfs_device_uring_io_open,
+	.close		= ntfs_device_uring_io_close,
+	.seek		= ntfs_device_uring_io_seek,
+	.read		= ntfs_device_uring_io_read,
+	.write		= ntfs_device_uring_io_write,
+	.pread		= ntfs_device_uring_io_pread,
+	.pwrite		= ntfs_device_uring_io_pwrite,
+	.preadv		= ntfs_device_uring_io_preadv,
+	.pwritev	= ntfs_device_uring_io_pwritev,
+	.map		= ntfs_device_uring_io_map,
+	.discard	= ntfs_device_uring_io_discard,
+	.sync		= ntfs_device_uring_io_sync,
+	.stat		= ntfs_device_uring_io_stat,
+	.ioctl		= ntfs_device_uring_io_ioctl,
+};
+
+#endif /* NTFS_DEVICE_URING_IO_OPS */
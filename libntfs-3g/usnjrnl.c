@@ -0,0 +1,1012 @@
+/**
+ * usnjrnl.c - Maintenance of the change journal $Extend/$UsnJrnl.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "param.h"
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "inode.h"
+#include "attrib.h"
+#include "runlist.h"
+#include "lcnalloc.h"
+#include "dir.h"
+#include "ntfstime.h"
+#include "usnjrnl.h"
+#include "misc.h"
+#include "logging.h"
+
+/*
+ *		Maintenance of the change journal
+ *
+ *	When the volume has a change journal $Extend/$UsnJrnl, it is
+ *	opened when the volume is mounted read-write and kept open, and
+ *	the changes made through the library to the user files are
+ *	recorded in it, so that an application can get the files changed
+ *	since a given usn without scanning the volume.
+ *
+ *	The mutation paths only build the records in memory, and they
+ *	are appended to $J by batches when the metadata is flushed, so
+ *	that the journal is written sequentially, a few pages at once.
+ *	As Windows does, the reasons of the changes to a file are
+ *	accumulated in the records until the file is closed, but here a
+ *	file is only closed, with a record for USN_REASON_CLOSE, when
+ *	the records are appended or when too many files have been
+ *	changed, and a change only gets a new record when it brings a new
+ *	reason, or a new name. A rename made as a link followed by an
+ *	unlink is recorded as a new name, then as an old name.
+ *
+ *	When $J grows beyond the maximum size plus the allocation delta,
+ *	the clusters of its oldest records are freed, leaving a hole.
+ */
+
+#define USN_PENDING_HASH 256	/* buckets of the files being changed */
+#define USN_READ_SIZE 65536	/* bytes of $J read at once */
+
+#define USN_NAME_REASONS (USN_REASON_FILE_CREATE \
+			| USN_REASON_FILE_DELETE \
+			| USN_REASON_RENAME_OLD_NAME \
+			| USN_REASON_RENAME_NEW_NAME \
+			| USN_REASON_HARD_LINK_CHANGE)
+
+/*
+ *	A file changed since it was last closed
+ */
+
+struct USN_PENDING {
+	struct USN_PENDING *next;	/* next in the hash bucket */
+	u64 inum;
+	leMFT_REF file_ref;
+	leMFT_REF parent_ref;
+	le32 reasons;			/* reasons accumulated */
+	le32 security_id;
+	le32 attributes;
+	int name_len;
+	ntfschar name[NTFS_MAX_NAME_LEN];
+};
+
+struct USN_JOURNAL {
+	ntfs_inode *ni;			/* $Extend/$UsnJrnl */
+	ntfs_attr *na;			/* its stream $J */
+	u64 inum;
+	u64 journal_id;
+	s64 lowest_valid_usn;
+	s64 max_size;
+	s64 delta;
+	s64 first_usn;			/* first record kept in $J */
+	s64 next_usn;			/* usn of the next record */
+	u64 renaming;			/* inode being renamed, or zero */
+	char *buf;			/* records not appended yet */
+	u32 count;
+	u32 allocated;
+	time_t oldest;			/* when the first one was built */
+	int pending_count;
+	struct USN_PENDING *pending[USN_PENDING_HASH];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;		/* for concurrent overwrites */
+#endif
+};
+
+static ntfschar usn_jrnl_name[] = {
+	const_cpu_to_le16('$'), const_cpu_to_le16('U'),
+	const_cpu_to_le16('s'), const_cpu_to_le16('n'),
+	const_cpu_to_le16('J'), const_cpu_to_le16('r'),
+	const_cpu_to_le16('n'), const_cpu_to_le16('l')
+};
+
+static ntfschar usn_j_name[] = {
+	const_cpu_to_le16('$'), const_cpu_to_le16('J')
+};
+
+static ntfschar usn_max_name[] = {
+	const_cpu_to_le16('$'), const_cpu_to_le16('M'),
+	const_cpu_to_le16('a'), const_cpu_to_le16('x')
+};
+
+static void usn_lock(struct USN_JOURNAL *j)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&j->lock);
+#endif
+}
+
+static void usn_unlock(struct USN_JOURNAL *j)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&j->lock);
+#endif
+}
+
+/*
+ *		Get the usn of the first record kept in $J
+ *
+ *	This is the end of the hole left by freeing the oldest records.
+ */
+
+static s64 usn_first_kept(ntfs_attr *na)
+{
+	runlist_element *rl;
+	s64 first;
+
+	first = 0;
+	if (NAttrNonResident(na)) {
+		if (ntfs_attr_map_whole_runlist(na))
+			return (-1);
+		rl = na->rl;
+		while (rl->length && (rl->lcn == LCN_HOLE))
+			rl++;
+		first = rl->vcn << na->ni->vol->cluster_size_bits;
+		if (first > na->data_size)
+			first = na->data_size;
+	}
+	return (first);
+}
+
+/*
+ *		Set up the journal from its inode
+ *
+ *	The inode is kept open, or closed if it is not a valid journal.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int usn_setup(ntfs_volume *vol, ntfs_inode *ni)
+{
+	struct USN_JOURNAL *j;
+	USN_JOURNAL_MAX max;
+	ntfs_attr *na;
+	int err;
+
+	j = (struct USN_JOURNAL*)NULL;
+	na = ntfs_attr_open(ni, AT_DATA, usn_max_name, 4);
+	if (na) {
+		if (ntfs_attr_pread(na, 0, sizeof(max), &max) == sizeof(max))
+			j = (struct USN_JOURNAL*)ntfs_calloc(
+					sizeof(struct USN_JOURNAL));
+		else
+			errno = EIO;
+		ntfs_attr_close(na);
+	}
+	if (j) {
+		j->na = ntfs_attr_open(ni, AT_DATA, usn_j_name, 2);
+		if (j->na)
+			j->first_usn = usn_first_kept(j->na);
+		if (j->na && (j->first_usn >= 0)
+#ifdef HAVE_PTHREAD_H
+		    && !pthread_mutex_init(&j->lock,
+				(pthread_mutexattr_t*)NULL)
+#endif
+			) {
+			j->ni = ni;
+			j->inum = ni->mft_no;
+			j->journal_id = le64_to_cpu(max.usn_journal_id);
+			j->lowest_valid_usn
+				= sle64_to_cpu(max.lowest_valid_usn);
+			j->max_size = sle64_to_cpu(max.maximum_size);
+			j->delta = sle64_to_cpu(max.allocation_delta);
+			j->next_usn = (j->na->data_size + 7) & ~(s64)7;
+			vol->usn_journal = j;
+		} else {
+			err = errno;
+			if (j->na)
+				ntfs_attr_close(j->na);
+			free(j);
+			j = (struct USN_JOURNAL*)NULL;
+			errno = err;
+		}
+	}
+	if (!j) {
+		err = errno;
+		ntfs_inode_close(ni);
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Open the change journal if the volume has one
+ *
+ *	The journal is ignored when Windows was deleting it.
+ *
+ *	Returns 0 if opened or if there is no journal,
+ *		-1 if it could not be opened (errno set)
+ */
+
+int ntfs_usn_open(ntfs_volume *vol)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	u64 inum;
+
+	if (vol->usn_journal || (vol->major_ver < 3)
+	    || (vol->flags & VOLUME_DELETE_USN_UNDERWAY))
+		return (0);
+		/* do not use path_name_to inode - could reopen root */
+	dir_ni = ntfs_inode_open(vol, FILE_Extend);
+	if (!dir_ni)
+		return (-1);
+	inum = ntfs_inode_lookup_by_mbsname(dir_ni, "$UsnJrnl");
+	ntfs_inode_close(dir_ni);
+	if (inum == (u64)-1)
+		return (errno == ENOENT ? 0 : -1);
+	ni = ntfs_inode_open(vol, MREF(inum));
+	if (!ni)
+		return (-1);
+	return (usn_setup(vol, ni));
+}
+
+/*
+ *		Get the file attributes recorded for an inode
+ */
+
+static le32 usn_attributes(ntfs_inode *ni)
+{
+	le32 attributes;
+
+	attributes = ni->flags & ~FILE_ATTR_I30_INDEX_PRESENT;
+	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		attributes |= FILE_ATTR_DIRECTORY;
+	return (attributes);
+}
+
+/*
+ *		Get a name of an inode from its FILE_NAME attributes
+ *
+ *	A Win32 or Posix name is preferred to a DOS one.
+ */
+
+static void usn_lookup_name(ntfs_inode *ni, struct USN_PENDING *p)
+{
+	ntfs_attr_search_ctx *ctx;
+	FILE_NAME_ATTR *fn;
+	BOOL found;
+
+	p->name_len = 0;
+	ctx = ntfs_attr_get_search_ctx(ni, (MFT_RECORD*)NULL);
+	if (ctx) {
+		found = FALSE;
+		while (!found && !ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED,
+				0, CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+			fn = (FILE_NAME_ATTR*)((u8*)ctx->attr
+				+ le16_to_cpu(ctx->attr->value_offset));
+			if (!p->name_len
+			    || (fn->file_name_type != FILE_NAME_DOS)) {
+				p->name_len = fn->file_name_length;
+				memcpy(p->name, fn->file_name,
+					p->name_len*sizeof(ntfschar));
+				p->parent_ref = fn->parent_directory;
+				found = fn->file_name_type != FILE_NAME_DOS;
+			}
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+}
+
+/*
+ *		Build a record in the buffer of records to append
+ *
+ *	A record which would cross a page is moved to the next page,
+ *	the end of the current page being filled with zeroes.
+ *
+ *	Returns the usn of the record, or -1 if there is no memory
+ */
+
+static s64 usn_build(struct USN_JOURNAL *j, const struct USN_PENDING *p,
+			le32 reasons, const ntfschar *name, int name_len,
+			leMFT_REF parent_ref)
+{
+	USN_RECORD *rec;
+	char *newbuf;
+	u32 size;
+	u32 room;
+	u32 pad;
+	u32 needed;
+	s64 usn;
+
+	size = (sizeof(USN_RECORD) + name_len*sizeof(ntfschar) + 7) & ~7;
+	room = USN_PAGE_SIZE - (j->next_usn & (USN_PAGE_SIZE - 1));
+	pad = (size > room ? room : 0);
+	needed = j->count + pad + size;
+	if (needed > j->allocated) {
+		if (needed < 2*j->allocated)
+			needed = 2*j->allocated;
+		if (needed < USN_BATCH_SIZE)
+			needed = USN_BATCH_SIZE;
+		newbuf = (char*)realloc(j->buf, needed);
+		if (!newbuf) {
+			ntfs_log_error("No memory for a change journal"
+					" record\n");
+			return (-1);
+		}
+		j->buf = newbuf;
+		j->allocated = needed;
+	}
+	if (!j->count)
+		j->oldest = time((time_t*)NULL);
+	memset(&j->buf[j->count], 0, pad + size);
+	j->count += pad;
+	j->next_usn += pad;
+	usn = j->next_usn;
+	rec = (USN_RECORD*)&j->buf[j->count];
+	rec->record_length = cpu_to_le32(size);
+	rec->major_version = const_cpu_to_le16(2);
+	rec->minor_version = const_cpu_to_le16(0);
+	rec->file_reference_number = p->file_ref;
+	rec->parent_file_reference_number = parent_ref;
+	rec->usn = cpu_to_sle64(usn);
+	rec->time_stamp = ntfs_current_time();
+	rec->reason = reasons;
+	rec->source_info = const_cpu_to_le32(0);
+	rec->security_id = p->security_id;
+	rec->file_attributes = p->attributes;
+	rec->file_name_length = cpu_to_le16(name_len*sizeof(ntfschar));
+	rec->file_name_offset = cpu_to_le16(sizeof(USN_RECORD));
+	memcpy(rec->file_name, name, name_len*sizeof(ntfschar));
+	j->count += size;
+	j->next_usn += size;
+	return (usn);
+}
+
+/*
+ *		Close a file which was changed
+ *
+ *	A record for USN_REASON_CLOSE is built with the reasons
+ *	accumulated, and the file is forgotten.
+ */
+
+static void usn_close_pending(struct USN_JOURNAL *j, struct USN_PENDING *p)
+{
+	usn_build(j, p, p->reasons | USN_REASON_CLOSE,
+			p->name, p->name_len, p->parent_ref);
+	free(p);
+	j->pending_count--;
+}
+
+static void usn_close_all(struct USN_JOURNAL *j)
+{
+	struct USN_PENDING *p;
+	int i;
+
+	for (i=0; (i<USN_PENDING_HASH) && j->pending_count; i++) {
+		while (j->pending[i]) {
+			p = j->pending[i];
+			j->pending[i] = p->next;
+			usn_close_pending(j, p);
+		}
+	}
+}
+
+/*
+ *		Get the entry of a file being changed, creating it if needed
+ *
+ *	When too many files are being changed, they are closed first.
+ */
+
+static struct USN_PENDING *usn_get_pending(struct USN_JOURNAL *j,
+			ntfs_inode *ni)
+{
+	struct USN_PENDING *p;
+	int h;
+
+	h = ni->mft_no % USN_PENDING_HASH;
+	p = j->pending[h];
+	while (p && (p->inum != ni->mft_no))
+		p = p->next;
+	if (!p) {
+		if (j->pending_count >= USN_PENDING_FILES)
+			usn_close_all(j);
+		p = (struct USN_PENDING*)ntfs_malloc(
+				sizeof(struct USN_PENDING));
+		if (p) {
+			p->inum = ni->mft_no;
+			p->file_ref = MK_LE_MREF(ni->mft_no,
+				le16_to_cpu(ni->mrec->sequence_number));
+			p->parent_ref = const_cpu_to_le64(0);
+			p->reasons = const_cpu_to_le32(0);
+			p->name_len = -1;
+			p->next = j->pending[h];
+			j->pending[h] = p;
+			j->pending_count++;
+		}
+	}
+	return (p);
+}
+
+static void usn_forget_pending(struct USN_JOURNAL *j, struct USN_PENDING *p)
+{
+	struct USN_PENDING **pp;
+
+	pp = &j->pending[p->inum % USN_PENDING_HASH];
+	while (*pp != p)
+		pp = &(*pp)->next;
+	*pp = p->next;
+	free(p);
+	j->pending_count--;
+}
+
+/*
+ *		Record a change to an inode
+ *
+ *	When @name is given, it is the name in @dir_ni concerned by the
+ *	change, otherwise the current name of the inode is recorded.
+ *	The changes to the system files and to the journal are not
+ *	recorded. The new usn of the inode is only written with the
+ *	inode, which the caller has to mark dirty.
+ */
+
+static void usn_record(ntfs_inode *ni, ntfs_inode *dir_ni,
+			const ntfschar *name, int name_len, le32 reason)
+{
+	struct USN_JOURNAL *j;
+	struct USN_PENDING *p;
+	leMFT_REF parent_ref;
+	le32 reasons;
+	s64 usn;
+
+	j = ni->vol->usn_journal;
+	if (!j || (ni->mft_no < FILE_first_user) || (ni->mft_no == j->inum))
+		return;
+	usn_lock(j);
+	p = usn_get_pending(j, ni);
+	if (p && (((reason & ~p->reasons) != const_cpu_to_le32(0))
+			|| (reason & USN_NAME_REASONS))) {
+		p->security_id = ni->security_id;
+		p->attributes = usn_attributes(ni);
+		if (!(name && dir_ni) && (p->name_len < 0))
+			usn_lookup_name(ni, p);
+		if (name && dir_ni)
+			parent_ref = MK_LE_MREF(dir_ni->mft_no,
+				le16_to_cpu(dir_ni->mrec->sequence_number));
+		else {
+			name = p->name;
+			name_len = p->name_len;
+			parent_ref = p->parent_ref;
+		}
+			/* the old name is not kept in the reasons */
+		reasons = p->reasons | reason;
+		if (!(reason & USN_REASON_RENAME_OLD_NAME))
+			p->reasons = reasons;
+		usn = usn_build(j, p, reasons, name, name_len, parent_ref);
+		if (usn >= 0)
+			ni->usn = cpu_to_le64(usn);
+		if (reason & USN_REASON_FILE_DELETE)
+			usn_forget_pending(j, p);
+		else {
+			if (reason & (USN_REASON_RENAME_OLD_NAME
+					| USN_REASON_HARD_LINK_CHANGE))
+				usn_lookup_name(ni, p);
+			else if (name != p->name) {
+				memcpy(p->name, name,
+					name_len*sizeof(ntfschar));
+				p->name_len = name_len;
+				p->parent_ref = parent_ref;
+			}
+		}
+	}
+	usn_unlock(j);
+}
+
+/*
+ *		Record a change to an inode, other than to its data
+ *
+ *	A deletion also closes the file.
+ */
+
+void ntfs_usn_change(ntfs_inode *ni, ntfs_inode *dir_ni,
+			const ntfschar *name, int name_len, le32 reason)
+{
+	if (reason & USN_REASON_FILE_DELETE)
+		reason |= USN_REASON_CLOSE;
+	usn_record(ni, dir_ni, name, name_len, reason);
+}
+
+/*
+ *		Record a link added to or removed from an inode
+ *
+ *	The links of an inode being renamed are recorded as its new
+ *	name and its old name.
+ */
+
+void ntfs_usn_link(ntfs_inode *ni, ntfs_inode *dir_ni,
+			const ntfschar *name, int name_len, BOOL added)
+{
+	struct USN_JOURNAL *j;
+	le32 reason;
+
+	j = ni->vol->usn_journal;
+	if (j) {
+		if (j->renaming == ni->mft_no)
+			reason = (added ? USN_REASON_RENAME_NEW_NAME
+					: USN_REASON_RENAME_OLD_NAME);
+		else
+			reason = USN_REASON_HARD_LINK_CHANGE;
+		ntfs_usn_change(ni, dir_ni, name, name_len, reason);
+	}
+}
+
+/*
+ *		Designate the inode whose links are changed by a rename
+ *
+ *	To be called with zero when the rename is over.
+ */
+
+void ntfs_usn_renaming(ntfs_volume *vol, u64 inum)
+{
+	if (vol->usn_journal)
+		vol->usn_journal->renaming = inum;
+}
+
+/*
+ *		Record a write to a data stream
+ */
+
+void ntfs_usn_write(ntfs_attr *na, s64 pos, s64 count)
+{
+	le32 reason;
+
+	if ((na->type == AT_DATA) && count) {
+		reason = const_cpu_to_le32(0);
+		if (pos < na->data_size)
+			reason |= (na->name_len
+					? USN_REASON_NAMED_DATA_OVERWRITE
+					: USN_REASON_DATA_OVERWRITE);
+		if ((pos + count) > na->data_size)
+			reason |= (na->name_len
+					? USN_REASON_NAMED_DATA_EXTEND
+					: USN_REASON_DATA_EXTEND);
+		usn_record(na->ni, (ntfs_inode*)NULL, (ntfschar*)NULL, 0,
+				reason);
+	}
+}
+
+/*
+ *		Record a change of the size of a data stream
+ */
+
+void ntfs_usn_resize(ntfs_attr *na, s64 newsize)
+{
+	le32 reason;
+
+	if ((na->type == AT_DATA) && (newsize != na->data_size)) {
+		if (newsize < na->data_size)
+			reason = (na->name_len
+					? USN_REASON_NAMED_DATA_TRUNCATION
+					: USN_REASON_DATA_TRUNCATION);
+		else
+			reason = (na->name_len
+					? USN_REASON_NAMED_DATA_EXTEND
+					: USN_REASON_DATA_EXTEND);
+		usn_record(na->ni, (ntfs_inode*)NULL, (ntfschar*)NULL, 0,
+				reason);
+	}
+}
+
+/*
+ *		Free the clusters of the oldest records
+ *
+ *	The beginning of $J up to @new_first, a cluster boundary, is
+ *	turned into a hole, and the clusters are freed once the new
+ *	mapping is written.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int usn_free_oldest(struct USN_JOURNAL *j, s64 new_first)
+{
+	ntfs_volume *vol;
+	ntfs_attr *na;
+	runlist_element *rl;
+	runlist_element *oldrl;
+	runlist_element *newrl;
+	runlist_element *headrl;
+	VCN vcn;
+	int count;
+	int head;
+	int i;
+	int k;
+
+	na = j->na;
+	vol = na->ni->vol;
+	vcn = new_first >> vol->cluster_size_bits;
+	if (ntfs_attr_map_whole_runlist(na) || ntfs_attr_rl_expand(na))
+		return (-1);
+	oldrl = na->rl;
+	for (count=0; oldrl[count].length; count++) { }
+	k = 0;
+	while (oldrl[k].length && ((oldrl[k].vcn + oldrl[k].length) <= vcn))
+		k++;
+	if (!oldrl[k].length) {
+		errno = EIO;
+		return (-1);
+	}
+		/* the new runlist : a hole, then the runs kept */
+	newrl = (runlist_element*)ntfs_malloc((count - k + 3)
+					* sizeof(runlist_element));
+	headrl = (runlist_element*)ntfs_malloc((k + 2)
+					* sizeof(runlist_element));
+	if (!newrl || !headrl) {
+		free(newrl);
+		free(headrl);
+		return (-1);
+	}
+	newrl[0].vcn = 0;
+	newrl[0].lcn = LCN_HOLE;
+	newrl[0].length = vcn;
+	i = 1;
+	if (oldrl[k].vcn < vcn) {
+		newrl[1].vcn = vcn;
+		newrl[1].lcn = (oldrl[k].lcn >= 0
+				? oldrl[k].lcn + vcn - oldrl[k].vcn
+				: oldrl[k].lcn);
+		newrl[1].length = oldrl[k].vcn + oldrl[k].length - vcn;
+		i = 2;
+		k++;
+	}
+	memcpy(&newrl[i], &oldrl[k], (count - k + 1)
+				* sizeof(runlist_element));
+	if ((i > 1) && (newrl[1].lcn == LCN_HOLE)) {
+		newrl[0].length += newrl[1].length;
+		memmove(&newrl[1], &newrl[2], (count - k + 1)
+				* sizeof(runlist_element));
+	}
+		/* the runs freed */
+	head = 0;
+	for (rl=oldrl; rl->vcn < vcn; rl++) {
+		headrl[head] = *rl;
+		if ((rl->vcn + rl->length) > vcn)
+			headrl[head].length = vcn - rl->vcn;
+		head++;
+	}
+	headrl[head].vcn = vcn;
+	headrl[head].lcn = LCN_ENOENT;
+	headrl[head].length = 0;
+	na->rl = newrl;
+	ntfs_attr_rl_changed(na);
+	ntfs_attr_rl_dirty(na, 0, RUNLIST_DIRTY_END);
+	if (ntfs_attr_update_mapping_pairs(na, 0)) {
+		na->rl = oldrl;
+		ntfs_attr_rl_changed(na);
+		ntfs_attr_rl_dirty(na, 0, RUNLIST_DIRTY_END);
+		free(newrl);
+		free(headrl);
+		return (-1);
+	}
+	free(oldrl);
+	if (ntfs_cluster_free_from_rl(vol, headrl))
+		ntfs_log_error("Could not free the oldest clusters of"
+				" the change journal\n");
+	free(headrl);
+	return (0);
+}
+
+/*
+ *		Append the records built to $J
+ *
+ *	The files changed are closed first, and when the journal has
+ *	outgrown its maximum size, its oldest records are freed.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int usn_append(struct USN_JOURNAL *j)
+{
+	ntfs_volume *vol;
+	s64 pos;
+	s64 new_first;
+	s64 align;
+	int res;
+
+	res = 0;
+	usn_close_all(j);
+	pos = j->next_usn - j->count;
+	if (ntfs_attr_pwrite(j->na, pos, j->count, j->buf) != j->count) {
+		ntfs_log_perror("Could not append to the change journal");
+		res = -1;
+			/* forget the records, the next ones are beyond */
+	}
+	j->count = 0;
+	vol = j->na->ni->vol;
+	if (!res && (j->max_size > 0)
+	    && ((j->next_usn - j->first_usn) > (j->max_size + j->delta))) {
+		align = (vol->cluster_size > USN_PAGE_SIZE
+				? vol->cluster_size : USN_PAGE_SIZE);
+		new_first = (j->next_usn - j->max_size) & -align;
+		if ((new_first > j->first_usn)
+		    && !usn_free_oldest(j, new_first))
+			j->first_usn = new_first;
+	}
+	if (NInoDirty(j->ni) && ntfs_inode_sync(j->ni))
+		res = -1;
+	return (res);
+}
+
+/*
+ *		Append the records built, if it is time to do so
+ *
+ *	Unless @all is set, the records are only appended when enough of
+ *	them have been gathered, or when they have waited too long.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_usn_flush(ntfs_volume *vol, BOOL all)
+{
+	struct USN_JOURNAL *j;
+	int res;
+
+	res = 0;
+	j = vol->usn_journal;
+	if (j) {
+		usn_lock(j);
+		if (j->count
+		    && (all || (j->count >= USN_BATCH_SIZE)
+			|| ((time((time_t*)NULL) - j->oldest)
+					>= USN_WRITEBACK_DELAY)))
+			res = usn_append(j);
+		usn_unlock(j);
+	}
+	return (res);
+}
+
+/*
+ *		Close the change journal
+ *
+ *	The records built are appended first.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_usn_close(ntfs_volume *vol)
+{
+	struct USN_JOURNAL *j;
+	int res;
+
+	res = 0;
+	j = vol->usn_journal;
+	if (j) {
+		if (!NVolReadOnly(vol))
+			res = ntfs_usn_flush(vol, TRUE);
+		vol->usn_journal = (struct USN_JOURNAL*)NULL;
+		ntfs_attr_close(j->na);
+		if (ntfs_inode_close(j->ni))
+			res = -1;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&j->lock);
+#endif
+		free(j->buf);
+		free(j);
+	}
+	return (res);
+}
+
+/*
+ *		Create a change journal
+ *
+ *	$Extend/$UsnJrnl is created with an empty stream $J and the
+ *	stream $Max, and it is opened, so that the next changes are
+ *	recorded. A zero @max_size or @delta selects the default.
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+int ntfs_usn_create(ntfs_volume *vol, s64 max_size, s64 delta)
+{
+	USN_JOURNAL_MAX max;
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	u64 inum;
+	int err;
+	int res;
+
+	if ((vol->major_ver < 3) || NVolReadOnly(vol)
+	    || (max_size < 0) || (delta < 0)) {
+		errno = ((vol->major_ver < 3) ? EOPNOTSUPP
+				: (NVolReadOnly(vol) ? EROFS : EINVAL));
+		return (-1);
+	}
+	dir_ni = ntfs_inode_open(vol, FILE_Extend);
+	if (!dir_ni)
+		return (-1);
+	res = -1;
+	inum = ntfs_inode_lookup_by_mbsname(dir_ni, "$UsnJrnl");
+	if (inum != (u64)-1)
+		errno = EEXIST;
+	else
+		if (errno == ENOENT) {
+			ni = ntfs_create(dir_ni, const_cpu_to_le32(0),
+					usn_jrnl_name, 8, S_IFREG);
+			if (ni) {
+				max.maximum_size = cpu_to_sle64(max_size
+					? max_size : USN_DEFAULT_MAX_SIZE);
+				max.allocation_delta = cpu_to_sle64(delta
+					? delta : USN_DEFAULT_DELTA);
+				max.usn_journal_id = cpu_to_le64(
+					sle64_to_cpu(ntfs_current_time()));
+				max.lowest_valid_usn = cpu_to_sle64(0);
+				if (!ntfs_attr_remove(ni, AT_DATA,
+						AT_UNNAMED, 0)
+				    && !ntfs_attr_add(ni, AT_DATA,
+						usn_max_name, 4,
+						(u8*)&max, sizeof(max))
+				    && !ntfs_attr_add(ni, AT_DATA,
+						usn_j_name, 2, (u8*)NULL, 0)) {
+					ni->flags |= FILE_ATTR_HIDDEN
+							| FILE_ATTR_SYSTEM;
+					ntfs_inode_mark_dirty(ni);
+					NInoFileNameSetDirty(ni);
+					res = usn_setup(vol, ni);
+				} else {
+					err = errno;
+					ntfs_inode_close(ni);
+					errno = err;
+				}
+			}
+		}
+	err = errno;
+	ntfs_inode_close(dir_ni);
+	errno = err;
+	return (res);
+}
+
+/*
+ *		Get the state of the change journal
+ *
+ *	Returns 0 if successful,
+ *		-1 if there is no change journal (errno is ENOENT)
+ *			or it could not be read (errno set)
+ */
+
+int ntfs_usn_get_info(ntfs_volume *vol, struct NTFS_USN_INFO *info)
+{
+	struct USN_JOURNAL *j;
+
+	if (ntfs_usn_open(vol))
+		return (-1);
+	j = vol->usn_journal;
+	if (!j) {
+		errno = ENOENT;
+		return (-1);
+	}
+	usn_lock(j);
+	info->journal_id = j->journal_id;
+	info->first_usn = j->first_usn;
+	info->next_usn = j->next_usn;
+	info->lowest_valid_usn = j->lowest_valid_usn;
+	info->max_size = j->max_size;
+	info->allocation_delta = j->delta;
+	usn_unlock(j);
+	return (0);
+}
+
+/*
+ *		Check whether a record in a page of $J is valid
+ */
+
+static BOOL usn_valid_record(const USN_RECORD *rec, u32 room)
+{
+	u32 length;
+
+	length = le32_to_cpu(rec->record_length);
+	return ((length >= sizeof(USN_RECORD))
+		&& (length <= room)
+		&& !(length & 7)
+		&& ((u32)le16_to_cpu(rec->file_name_offset)
+			+ le16_to_cpu(rec->file_name_length) <= length));
+}
+
+/*
+ *		Read the records of the changes since a usn
+ *
+ *	The records from @from on are passed to @filler, only the ones of
+ *	version 2 being passed. On a read-write volume, the records not
+ *	appended yet are appended first, which closes the files changed.
+ *	A zero @from designates the first record kept.
+ *
+ *	Returns the usn of the next record, to be used for the next read,
+ *		or -1 if there is no journal (errno is ENOENT), if the
+ *		records from @from have been freed (errno is ERANGE)
+ *		or if the journal could not be read (errno set)
+ */
+
+s64 ntfs_usn_read(ntfs_volume *vol, s64 from,
+			ntfs_usn_filler filler, void *data)
+{
+	struct USN_JOURNAL *j;
+	const USN_RECORD *rec;
+	char *buf;
+	s64 pos;
+	s64 start;
+	s64 size;
+	s64 got;
+	u32 off;
+	u32 room;
+	BOOL stop;
+
+	if (ntfs_usn_open(vol)
+	    || (!NVolReadOnly(vol) && ntfs_usn_flush(vol, TRUE)))
+		return (-1);
+	j = vol->usn_journal;
+	if (!j) {
+		errno = ENOENT;
+		return (-1);
+	}
+	if (!from)
+		from = j->first_usn;
+	if ((from < j->first_usn) || (from > j->next_usn) || (from & 7)) {
+		errno = ((from & 7) || (from > j->next_usn) ? EINVAL : ERANGE);
+		return (-1);
+	}
+	buf = (char*)ntfs_malloc(USN_READ_SIZE);
+	if (!buf)
+		return (-1);
+	pos = from;
+	stop = FALSE;
+	while (!stop && (pos < j->next_usn)) {
+		start = pos & -(s64)USN_PAGE_SIZE;
+		size = j->next_usn - start;
+		if (size > USN_READ_SIZE)
+			size = USN_READ_SIZE;
+		got = ntfs_attr_pread(j->na, start, size, buf);
+		if (got != size) {
+			if (got >= 0)
+				errno = EIO;
+			pos = -1;
+			break;
+		}
+		while (!stop && (pos < (start + size))) {
+			off = pos - start;
+			room = USN_PAGE_SIZE - (off & (USN_PAGE_SIZE - 1));
+			if (room > (start + size - pos))
+				room = start + size - pos;
+			rec = (const USN_RECORD*)&buf[off];
+			if ((room < sizeof(USN_RECORD))
+			    || !usn_valid_record(rec, room)) {
+					/* skip the end of the page */
+				pos += room;
+			} else {
+				if (rec->major_version
+						== const_cpu_to_le16(2))
+					stop = filler(data, rec) != 0;
+				pos += le32_to_cpu(rec->record_length);
+			}
+		}
+	}
+	free(buf);
+	return (pos);
+}
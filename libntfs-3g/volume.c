@@ -53,6 +53,9 @@
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #if defined(__sun) && defined (__SVR4)
 #include <sys/mnttab.h>
@@ -68,13 +71,22 @@
 #include "debug.h"
 #include "inode.h"
 #include "runlist.h"
+#include "lcnalloc.h"
 #include "logfile.h"
 #include "dir.h"
+#include "index.h"
+#include "trace.h"
+#include "prefetch.h"
 #include "logging.h"
+#include "blkcache.h"
+#include "compress.h"
 #include "cache.h"
 #include "realpath.h"
 #include "misc.h"
 #include "security.h"
+#include "reparse.h"
+#include "object_id.h"
+#include "usnjrnl.h"
 
 const char *ntfs_home = 
 "News, support and information:  http://tuxera.com\n";
@@ -161,6 +173,9 @@ static void ntfs_error_set(int *err)
 		*err = errno;
 }
 
+static void snapshot_save(ntfs_volume *vol);
+static void attrdef_unshare(ATTR_DEF *attrdef);
+
 /**
  * __ntfs_volume_release - Destroy an NTFS volume object
  * @v:
@@ -173,8 +188,31 @@ static int __ntfs_volume_release(ntfs_volume *v)
 {
 	int err = 0;
 
+	if (v->snapshot)
+		snapshot_save(v);
+	ntfs_cluster_count_stop(v);
+	ntfs_prefetch_stop(v);
+		/* the last records of changes are appended first */
+	if (ntfs_usn_close(v))
+		ntfs_error_set(&err);
+		/* syncing the inodes updates the indexes */
+	if (ntfs_volume_flush_metadata(v, TRUE)
+	    || ntfs_set_inode_writeback(v, 0))
+		ntfs_error_set(&err);
+	if (ntfs_set_index_lazy_delete(v, 0)
+	    || ntfs_set_index_writeback(v, 0))
+		ntfs_error_set(&err);
+	if (ntfs_set_prealloc_size(v, 0))
+		ntfs_error_set(&err);
 	if (ntfs_close_secure(v))
 		ntfs_error_set(&err);
+	if (ntfs_close_reparse_index(v)
+	    || ntfs_close_object_id_index(v))
+		ntfs_error_set(&err);
+	if (v->lcn_discard && ntfs_set_cluster_discard(v, FALSE))
+		ntfs_error_set(&err);
+	if (v->lcnbmp_na && ntfs_set_lcnbmp_writeback(v, 0))
+		ntfs_error_set(&err);
 
 	if (ntfs_inode_free(&v->vol_ni))
 		ntfs_error_set(&err);
@@ -187,6 +225,11 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	ntfs_attr_free(&v->lcnbmp_na);
 	if (ntfs_inode_free(&v->lcnbmp_ni))
 		ntfs_error_set(&err);
+	if (v->mft_na && ntfs_set_mft_writeback(v, 0))
+		ntfs_error_set(&err);
+	free(v->lcn_summary);
+	free(v->lcn_streams);
+	free(v->mft_free_cache);
 	
 	if (v->mft_ni && NInoDirty(v->mft_ni))
 		ntfs_inode_sync(v->mft_ni);
@@ -204,6 +247,8 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	if (v->dev) {
 		struct ntfs_device *dev = v->dev;
 
+		if (ntfs_free_block_cache(v))
+			ntfs_error_set(&err);
 		if (dev->d_ops->sync(dev))
 			ntfs_error_set(&err);
 		if (dev->d_ops->close(dev))
@@ -211,10 +256,16 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	}
 
 	ntfs_free_lru_caches(v);
+	ntfs_free_spare_inodes(v);
+	ntfs_set_concurrent(v, FALSE);
+	ntfs_set_compress_threads(v, 0);
+	if (v->dev)
+		ntfs_set_trace(v, 0);
 	free(v->vol_name);
-	free(v->upcase);
-	if (v->locase) free(v->locase);
-	free(v->attrdef);
+	free(v->stats);
+	if (v->upcase)
+		ntfs_upcase_unshare(v->upcase, v->locase);
+	attrdef_unshare(v->attrdef);
 	free(v);
 
 	errno = err;
@@ -361,6 +412,7 @@ mft_has_no_attr_list:
 			goto error_exit;
 		}
 		vol->mft_na->rl = nrl;
+		ntfs_attr_rl_changed(vol->mft_na);
 
 		/* Get the lowest vcn for the next extent. */
 		highest_vcn = sle64_to_cpu(a->highest_vcn);
@@ -505,9 +557,9 @@ ntfs_volume *ntfs_volume_startup(struct ntfs_device *dev,
 	if (!vol)
 		goto error_exit;
 	
-	/* Create the default upcase table. */
-	vol->upcase_len = ntfs_upcase_build_default(&vol->upcase);
-	if (!vol->upcase_len || !vol->upcase)
+	/* Get the default upcase table, shared with other volumes. */
+	vol->upcase = ntfs_upcase_default(&vol->upcase_len);
+	if (!vol->upcase)
 		goto error_exit;
 
 	/* Default with no locase table and case sensitive file names */
@@ -897,74 +949,54 @@ static int fix_txf_data(ntfs_volume *vol)
 }
 
 /**
- * ntfs_device_mount - open ntfs volume
- * @dev:	device to open
- * @flags:	optional mount flags
- *
- * This function mounts an ntfs volume. @dev should describe the device which
- * to mount as the ntfs volume.
- *
- * @flags is an optional second parameter. The same flags are used as for
- * the mount system call (man 2 mount). Currently only the following flag
- * is implemented:
- *	NTFS_MNT_RDONLY	- mount volume read-only
+ * ntfs_volume_check_mftmirr - compare $MFTMirr to $MFT
+ * @vol:	ntfs volume to check
  *
- * The function opens the device @dev and verifies that it contains a valid
- * bootsector. Then, it allocates an ntfs_volume structure and initializes
- * some of the values inside the structure from the information stored in the
- * bootsector. It proceeds to load the necessary system files and completes
- * setting up the structure.
+ * Check the records of the system files in $MFT and $MFTMirr, and that the
+ * mirror matches. This is done when mounting, unless the check has been
+ * deferred by NTFS_MNT_DEFER_LOADS, in which case it is done before the
+ * first mft record is written, so that a corrupted $MFT cannot be
+ * propagated to its mirror.
  *
- * Return the allocated volume structure on success and NULL on error with
- * errno set to the error code.
+ * Return 0 on success and -1 on error with errno set to the error code.
  */
-ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
+int ntfs_volume_check_mftmirr(ntfs_volume *vol)
 {
 	s64 l;
-	ntfs_volume *vol;
-	u8 *m = NULL, *m2 = NULL;
-	ntfs_attr_search_ctx *ctx = NULL;
-	ntfs_inode *ni = NULL;
-	ntfs_attr *na = NULL;
-	ATTR_RECORD *a;
-	VOLUME_INFORMATION *vinf;
-	ntfschar *vname;
+	u8 *m, *m2;
 	u32 record_size;
-	int i, j, eo;
-	unsigned int k;
-	u32 u;
-	BOOL need_fallback_ro;
-
-	need_fallback_ro = FALSE;
-	vol = ntfs_volume_startup(dev, flags);
-	if (!vol)
-		return NULL;
+	int i;
+	int err;
 
-	/* Load data from $MFT and $MFTMirr and compare the contents. */
+	err = 0;
 	m  = ntfs_malloc(vol->mftmirr_size << vol->mft_record_size_bits);
 	m2 = ntfs_malloc(vol->mftmirr_size << vol->mft_record_size_bits);
-	if (!m || !m2)
-		goto error_exit;
+	if (!m || !m2) {
+		err = ENOMEM;
+		goto out;
+	}
 
 	l = ntfs_attr_mst_pread(vol->mft_na, 0, vol->mftmirr_size,
 			vol->mft_record_size, m);
 	if (l != vol->mftmirr_size) {
-		if (l == -1)
+		if (l == -1) {
+			err = errno;
 			ntfs_log_perror("Failed to read $MFT");
-		else {
+		} else {
 			ntfs_log_error("Failed to read $MFT, unexpected length "
 				       "(%lld != %d).\n", (long long)l,
 				       vol->mftmirr_size);
-			errno = EIO;
+			err = EIO;
 		}
-		goto error_exit;
+		goto out;
 	}
 	l = ntfs_attr_mst_pread(vol->mftmirr_na, 0, vol->mftmirr_size,
 			vol->mft_record_size, m2);
 	if (l != vol->mftmirr_size) {
 		if (l == -1) {
+			err = errno;
 			ntfs_log_perror("Failed to read $MFTMirr");
-			goto error_exit;
+			goto out;
 		}
 		vol->mftmirr_size = l;
 	}
@@ -990,12 +1022,14 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 				ntfs_log_error("$MFT error: Incomplete multi "
 					       "sector transfer detected in "
 					       "'%s'.\n", s);
-				goto io_error_exit;
+				err = EIO;
+				goto out;
 			}
 			if (!ntfs_is_mft_record(mrec->magic)) {
 				ntfs_log_error("$MFT error: Invalid mft "
 						"record for '%s'.\n", s);
-				goto io_error_exit;
+				err = EIO;
+				goto out;
 			}
 		}
 		mrec2 = (MFT_RECORD*)(m2 + i * vol->mft_record_size);
@@ -1004,12 +1038,14 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 				ntfs_log_error("$MFTMirr error: Incomplete "
 						"multi sector transfer "
 						"detected in '%s'.\n", s);
-				goto io_error_exit;
+				err = EIO;
+				goto out;
 			}
 			if (!ntfs_is_mft_record(mrec2->magic)) {
 				ntfs_log_error("$MFTMirr error: Invalid mft "
 						"record for '%s'.\n", s);
-				goto io_error_exit;
+				err = EIO;
+				goto out;
 			}
 		}
 		record_size = ntfs_mft_record_get_data_size(mrec);
@@ -1018,118 +1054,520 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 		    || memcmp(mrec, mrec2, record_size)) {
 			ntfs_log_error("$MFTMirr does not match $MFT (record "
 				       "%d).\n", i);
-			goto io_error_exit;
+			err = EIO;
+			goto out;
 		}
 	}
-
+	NVolClearMftMirrUnchecked(vol);
+out:
 	free(m2);
 	free(m);
-	m = m2 = NULL;
+	errno = err;
+	return (err ? -1 : 0);
+}
 
-	/* Now load the bitmap from $Bitmap. */
-	ntfs_log_debug("Loading $Bitmap...\n");
-	vol->lcnbmp_ni = ntfs_inode_open(vol, FILE_Bitmap);
-	if (!vol->lcnbmp_ni) {
-		ntfs_log_perror("Failed to open inode FILE_Bitmap");
-		goto error_exit;
-	}
-	
-	vol->lcnbmp_na = ntfs_attr_open(vol->lcnbmp_ni, AT_DATA, AT_UNNAMED, 0);
-	if (!vol->lcnbmp_na) {
-		ntfs_log_perror("Failed to open ntfs attribute");
-		goto error_exit;
+/*
+ *		Sharing of the attribute definitions
+ *
+ *	Most volumes have the same $AttrDef, so a single copy of the
+ *	table is kept for all the mounted volumes having the same one,
+ *	compared by size and contents. A table which is not registered
+ *	(not enough memory, or set by the application) is private to
+ *	its volume.
+ *
+ *	The shared tables must never be modified.
+ */
+
+struct SHARED_ATTRDEF {
+	struct SHARED_ATTRDEF *next;
+	ATTR_DEF *attrdef;
+	s64 attrdef_len;
+	int refs;		/* count of volumes using the table */
+} ;
+
+static struct SHARED_ATTRDEF *shared_attrdef_list;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t shared_attrdef_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ *		Share a table of attribute definitions read from a volume
+ *
+ *	The ownership of the table is transferred. If the same table is
+ *	already shared, the one received is freed.
+ *
+ *	Returns the table to use, to be released by attrdef_unshare()
+ */
+
+static ATTR_DEF *attrdef_share(ATTR_DEF *attrdef, s64 attrdef_len)
+{
+	struct SHARED_ATTRDEF *item;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&shared_attrdef_lock);
+#endif
+	item = shared_attrdef_list;
+	while (item && ((item->attrdef_len != attrdef_len)
+			|| memcmp(item->attrdef, attrdef, attrdef_len)))
+		item = item->next;
+	if (item) {
+		item->refs++;
+		free(attrdef);
+		attrdef = item->attrdef;
+	} else {
+		item = (struct SHARED_ATTRDEF*)ntfs_malloc(
+					sizeof(struct SHARED_ATTRDEF));
+		if (item) {
+			item->attrdef = attrdef;
+			item->attrdef_len = attrdef_len;
+			item->refs = 1;
+			item->next = shared_attrdef_list;
+			shared_attrdef_list = item;
+		}
 	}
-	
-	if (vol->lcnbmp_na->data_size > vol->lcnbmp_na->allocated_size) {
-		ntfs_log_error("Corrupt cluster map size (%lld > %lld)\n",
-				(long long)vol->lcnbmp_na->data_size, 
-				(long long)vol->lcnbmp_na->allocated_size);
-		goto io_error_exit;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&shared_attrdef_lock);
+#endif
+	return (attrdef);
+}
+
+/*
+ *		Release a table of attribute definitions
+ *
+ *	A shared table is freed when no more volume uses it, and a
+ *	private one is freed immediately.
+ */
+
+static void attrdef_unshare(ATTR_DEF *attrdef)
+{
+	struct SHARED_ATTRDEF *item;
+	struct SHARED_ATTRDEF **pitem;
+
+	if (attrdef) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&shared_attrdef_lock);
+#endif
+		pitem = &shared_attrdef_list;
+		while (*pitem && ((*pitem)->attrdef != attrdef))
+			pitem = &(*pitem)->next;
+		item = *pitem;
+		if (item) {
+			if (!--item->refs) {
+				*pitem = item->next;
+				free(item->attrdef);
+				free(item);
+			}
+		} else
+			free(attrdef);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&shared_attrdef_lock);
+#endif
 	}
+}
 
-	/* Now load the upcase table from $UpCase. */
-	ntfs_log_debug("Loading $UpCase...\n");
-	ni = ntfs_inode_open(vol, FILE_UpCase);
+/**
+ * ntfs_volume_load_attrdef - load the attribute definitions from $AttrDef
+ * @vol:	ntfs volume whose $AttrDef to load
+ *
+ * This is done when mounting, unless deferred by NTFS_MNT_DEFER_LOADS, in
+ * which case this is done when an attribute definition is first needed.
+ * A single attempt is made.
+ *
+ * Return 0 on success and -1 on error with errno set to the error code.
+ */
+int ntfs_volume_load_attrdef(ntfs_volume *vol)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	s64 l;
+	int err;
+
+	NVolClearAttrDefDeferred(vol);
+	err = 0;
+	ntfs_log_debug("Loading $AttrDef...\n");
+	ni = ntfs_inode_open(vol, FILE_AttrDef);
 	if (!ni) {
-		ntfs_log_perror("Failed to open inode FILE_UpCase");
-		goto error_exit;
+		ntfs_log_perror("Failed to open $AttrDef");
+		return -1;
 	}
-	/* Get an ntfs attribute for $UpCase/$DATA. */
+	/* Get an ntfs attribute for $AttrDef/$DATA. */
 	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
 	if (!na) {
+		err = errno;
 		ntfs_log_perror("Failed to open ntfs attribute");
-		goto error_exit;
+		goto out;
 	}
-	/*
-	 * Note: Normally, the upcase table has a length equal to 65536
-	 * 2-byte Unicode characters but allow for different cases, so no
-	 * checks done. Just check we don't overflow 32-bits worth of Unicode
-	 * characters.
-	 */
-	if (na->data_size & ~0x1ffffffffULL) {
-		ntfs_log_error("Error: Upcase table is too big (max 32-bit "
-				"allowed).\n");
-		errno = EINVAL;
-		goto error_exit;
+	/* Check we don't overflow 32-bits. */
+	if (na->data_size > 0xffffffffLL) {
+		ntfs_log_error("Attribute definition table is too big (max "
+			       "32-bit allowed).\n");
+		err = EINVAL;
+		goto out;
 	}
-	if (vol->upcase_len != na->data_size >> 1) {
-		vol->upcase_len = na->data_size >> 1;
-		/* Throw away default table. */
-		free(vol->upcase);
-		vol->upcase = ntfs_malloc(na->data_size);
-		if (!vol->upcase)
-			goto error_exit;
+	vol->attrdef = ntfs_malloc(na->data_size);
+	if (!vol->attrdef) {
+		err = ENOMEM;
+		goto out;
 	}
 	/* Read in the $DATA attribute value into the buffer. */
-	l = ntfs_attr_pread(na, 0, na->data_size, vol->upcase);
+	l = ntfs_attr_pread(na, 0, na->data_size, vol->attrdef);
 	if (l != na->data_size) {
-		ntfs_log_error("Failed to read $UpCase, unexpected length "
+		ntfs_log_error("Failed to read $AttrDef, unexpected length "
 			       "(%lld != %lld).\n", (long long)l,
 			       (long long)na->data_size);
-		errno = EIO;
-		goto error_exit;
-	}
-	/* Done with the $UpCase mft record. */
-	ntfs_attr_close(na);
-	if (ntfs_inode_close(ni)) {
-		ntfs_log_perror("Failed to close $UpCase");
-		goto error_exit;
+		free(vol->attrdef);
+		vol->attrdef = (ATTR_DEF*)NULL;
+		err = EIO;
+		goto out;
 	}
-	/* Consistency check of $UpCase, restricted to plain ASCII chars */
-	k = 0x20;
-	while ((k < vol->upcase_len)
-	    && (k < 0x7f)
-	    && (le16_to_cpu(vol->upcase[k])
-			== ((k < 'a') || (k > 'z') ? k : k + 'A' - 'a')))
-		k++;
-	if (k < 0x7f) {
-		ntfs_log_error("Corrupted file $UpCase\n");
-		goto io_error_exit;
+	vol->attrdef_len = na->data_size;
+	/* Use the same table as other volumes if possible */
+	vol->attrdef = attrdef_share(vol->attrdef, vol->attrdef_len);
+out:
+	/* Done with the $AttrDef mft record. */
+	if (na)
+		ntfs_attr_close(na);
+	if (ntfs_inode_close(ni) && !err) {
+		err = errno;
+		ntfs_log_perror("Failed to close $AttrDef");
 	}
+	errno = err;
+	return (err ? -1 : 0);
+}
 
-	/*
-	 * Now load $Volume and set the version information and flags in the
-	 * vol structure accordingly.
-	 */
-	ntfs_log_debug("Loading $Volume...\n");
-	vol->vol_ni = ntfs_inode_open(vol, FILE_Volume);
-	if (!vol->vol_ni) {
-		ntfs_log_perror("Failed to open inode FILE_Volume");
-		goto error_exit;
+#ifdef HAVE_PTHREAD_H
+
+/*
+ *	Locks for concurrent accesses to a volume
+ *
+ *	Requests which only read are made under the shared lock, others
+ *	under the exclusive lock. The library is not reentrant, so readers
+ *	are still serialized by the state lock, which they only release
+ *	while transferring the data of an attribute flagged as
+ *	ConcurrentRead, the only moment when several readers proceed.
+ *
+ *	When a volume is mounted read-only with NTFS_MNT_CONCURRENT, the
+ *	locking is implicit : the entry points used for reading files
+ *	take the state lock themselves, so that they may be called
+ *	from several threads. The state lock is recursive, as these entry
+ *	points call one another, and it is only released while
+ *	transferring data for a thread which entered the library once.
+ *
+ *	The entry points are ntfs_pathname_to_inode(), ntfs_inode_open(),
+ *	ntfs_inode_close(), ntfs_attr_open(), ntfs_attr_pread() and
+ *	ntfs_readdir() and the functions using only them, such as
+ *	ntfs_attr_readall(). An inode or an attribute must only be used
+ *	by the thread which opened it, and errors are still reported
+ *	through errno, which is thread-local. The data of plain
+ *	non-resident attributes is read in parallel, other requests are
+ *	serialized.
+ *
+ *	The device flushes requested by concurrent syncs are shared
+ *	(see ntfs_volume_sync()), the sync lock only protects the
+ *	tickets and is never held while taking another lock.
+ */
+
+struct ntfs_volume_locks {
+	pthread_rwlock_t access;	/* shared by readers */
+	pthread_mutex_t state;		/* held by the reader using the library */
+	int depth;			/* times the state lock is held */
+	BOOL implicit;			/* locked by the entry points */
+	pthread_mutex_t sync;		/* protects the sync tickets */
+	pthread_cond_t synced;		/* signaled when a flush completes */
+	u64 sync_ticket;		/* last ticket delivered */
+	u64 synced_ticket;		/* last ticket flushed to the device */
+	BOOL syncing;			/* a device flush is in progress */
+} ;
+
+/*
+ *		Allocate the locks of a volume
+ *
+ *	Returns NULL if there is not enough memory
+ */
+
+static struct ntfs_volume_locks *volume_locks_alloc(BOOL implicit)
+{
+	struct ntfs_volume_locks *locks;
+	pthread_mutexattr_t attr;
+
+	locks = (struct ntfs_volume_locks*)ntfs_malloc(
+				sizeof(struct ntfs_volume_locks));
+	if (locks) {
+		locks->depth = 0;
+		locks->implicit = implicit;
+		locks->sync_ticket = 0;
+		locks->synced_ticket = 0;
+		locks->syncing = FALSE;
+		if (pthread_rwlock_init(&locks->access,
+				(pthread_rwlockattr_t*)NULL)) {
+			free(locks);
+			locks = (struct ntfs_volume_locks*)NULL;
+		} else {
+			if (pthread_mutexattr_init(&attr)
+			    || pthread_mutexattr_settype(&attr,
+					PTHREAD_MUTEX_RECURSIVE)
+			    || pthread_mutex_init(&locks->state, &attr)) {
+				pthread_rwlock_destroy(&locks->access);
+				free(locks);
+				locks = (struct ntfs_volume_locks*)NULL;
+			} else
+				if (pthread_mutex_init(&locks->sync,
+					(pthread_mutexattr_t*)NULL)
+				    || pthread_cond_init(&locks->synced,
+					(pthread_condattr_t*)NULL)) {
+					pthread_mutex_destroy(&locks->sync);
+					pthread_mutex_destroy(&locks->state);
+					pthread_rwlock_destroy(&locks->access);
+					free(locks);
+					locks = (struct ntfs_volume_locks*)NULL;
+				}
+			pthread_mutexattr_destroy(&attr);
+		}
+		if (!locks)
+			errno = ENOMEM;
 	}
-	/* Get a search context for the $Volume/$VOLUME_INFORMATION lookup. */
-	ctx = ntfs_attr_get_search_ctx(vol->vol_ni, NULL);
-	if (!ctx)
-		goto error_exit;
+	return (locks);
+}
 
-	/* Find the $VOLUME_INFORMATION attribute. */
-	if (ntfs_attr_lookup(AT_VOLUME_INFORMATION, AT_UNNAMED, 0, 0, 0, NULL,
-			0, ctx)) {
-		ntfs_log_perror("$VOLUME_INFORMATION attribute not found in "
-				"$Volume");
-		goto error_exit;
+static void state_lock(struct ntfs_volume_locks *locks)
+{
+	pthread_mutex_lock(&locks->state);
+	locks->depth++;
+}
+
+static void state_unlock(struct ntfs_volume_locks *locks)
+{
+	locks->depth--;
+	pthread_mutex_unlock(&locks->state);
+}
+
+static void volume_locks_free(struct ntfs_volume_locks *locks)
+{
+	pthread_rwlock_destroy(&locks->access);
+	pthread_mutex_destroy(&locks->state);
+	pthread_cond_destroy(&locks->synced);
+	pthread_mutex_destroy(&locks->sync);
+	free(locks);
+}
+
+/*
+ *		Wait until the data written before getting a ticket is
+ *	flushed to the device
+ *
+ *	When no flush is in progress, the caller flushes the device for
+ *	all the tickets delivered so far, otherwise it waits for the
+ *	flush in progress to complete, and the next flush is shared
+ *	by all the callers which arrived meanwhile. When a flush fails,
+ *	the callers waiting for it try again.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+static int locks_sync_wait(struct ntfs_volume_locks *locks,
+			struct ntfs_device *dev, u64 ticket)
+{
+	u64 target;
+	int err;
+	int res;
+
+	res = 0;
+	err = 0;
+	pthread_mutex_lock(&locks->sync);
+	while (!res && (locks->synced_ticket < ticket)) {
+		if (locks->syncing)
+			pthread_cond_wait(&locks->synced, &locks->sync);
+		else {
+			locks->syncing = TRUE;
+			target = locks->sync_ticket;
+			pthread_mutex_unlock(&locks->sync);
+			res = dev->d_ops->sync(dev);
+			if (res)
+				err = errno;
+			pthread_mutex_lock(&locks->sync);
+			locks->syncing = FALSE;
+			if (!res)
+				locks->synced_ticket = target;
+			pthread_cond_broadcast(&locks->synced);
+		}
 	}
-	a = ctx->attr;
+	pthread_mutex_unlock(&locks->sync);
+	if (res)
+		errno = err;
+	return (res);
+}
+
+#endif
+
+/**
+ * ntfs_device_mount - open ntfs volume
+ * @dev:	device to open
+ * @flags:	optional mount flags
+ *
+ * This function mounts an ntfs volume. @dev should describe the device which
+ * to mount as the ntfs volume.
+ *
+ * @flags is an optional second parameter. The same flags are used as for
+ * the mount system call (man 2 mount). Currently only the following flag
+ * is implemented:
+ *	NTFS_MNT_RDONLY	- mount volume read-only
+ *
+ * With NTFS_MNT_DEFER_LOADS, the comparison of $MFTMirr to $MFT, the loading
+ * of $AttrDef and the opening of $Secure are deferred until first needed.
+ *
+ * The function opens the device @dev and verifies that it contains a valid
+ * bootsector. Then, it allocates an ntfs_volume structure and initializes
+ * some of the values inside the structure from the information stored in the
+ * bootsector. It proceeds to load the necessary system files and completes
+ * setting up the structure.
+ *
+ * Return the allocated volume structure on success and NULL on error with
+ * errno set to the error code.
+ */
+ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
+{
+	s64 l;
+	ntfs_volume *vol;
+	ntfs_attr_search_ctx *ctx = NULL;
+	ntfs_inode *ni = NULL;
+	ntfs_attr *na = NULL;
+	ntfschar *uc = NULL;
+	u32 uc_len;
+	ATTR_RECORD *a;
+	VOLUME_INFORMATION *vinf;
+	ntfschar *vname;
+	int j, eo;
+	unsigned int k;
+	u32 u;
+	BOOL need_fallback_ro;
+
+	need_fallback_ro = FALSE;
+		/* concurrent readers are only supported read-only */
+	if ((flags & NTFS_MNT_CONCURRENT) && !(flags & NTFS_MNT_RDONLY)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	vol = ntfs_volume_startup(dev, flags);
+	if (!vol)
+		return NULL;
+
+	/*
+	 * Compare $MFTMirr to $MFT, unless deferred until the first
+	 * mft record is written.
+	 */
+	if (flags & NTFS_MNT_DEFER_LOADS)
+		NVolSetMftMirrUnchecked(vol);
+	else
+		if (ntfs_volume_check_mftmirr(vol))
+			goto error_exit;
+
+	/* Now load the bitmap from $Bitmap. */
+	ntfs_log_debug("Loading $Bitmap...\n");
+	vol->lcnbmp_ni = ntfs_inode_open(vol, FILE_Bitmap);
+	if (!vol->lcnbmp_ni) {
+		ntfs_log_perror("Failed to open inode FILE_Bitmap");
+		goto error_exit;
+	}
+	
+	vol->lcnbmp_na = ntfs_attr_open(vol->lcnbmp_ni, AT_DATA, AT_UNNAMED, 0);
+	if (!vol->lcnbmp_na) {
+		ntfs_log_perror("Failed to open ntfs attribute");
+		goto error_exit;
+	}
+	
+	if (vol->lcnbmp_na->data_size > vol->lcnbmp_na->allocated_size) {
+		ntfs_log_error("Corrupt cluster map size (%lld > %lld)\n",
+				(long long)vol->lcnbmp_na->data_size, 
+				(long long)vol->lcnbmp_na->allocated_size);
+		goto io_error_exit;
+	}
+
+	/* Now load the upcase table from $UpCase. */
+	ntfs_log_debug("Loading $UpCase...\n");
+	ni = ntfs_inode_open(vol, FILE_UpCase);
+	if (!ni) {
+		ntfs_log_perror("Failed to open inode FILE_UpCase");
+		goto error_exit;
+	}
+	/* Get an ntfs attribute for $UpCase/$DATA. */
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na) {
+		ntfs_log_perror("Failed to open ntfs attribute");
+		goto error_exit;
+	}
+	/*
+	 * Note: Normally, the upcase table has a length equal to 65536
+	 * 2-byte Unicode characters but allow for different cases, so no
+	 * checks done. Just check we don't overflow 32-bits worth of Unicode
+	 * characters.
+	 */
+	if (na->data_size & ~0x1ffffffffULL) {
+		ntfs_log_error("Error: Upcase table is too big (max 32-bit "
+				"allowed).\n");
+		errno = EINVAL;
+		goto error_exit;
+	}
+	uc_len = na->data_size >> 1;
+	uc = (ntfschar*)ntfs_malloc(na->data_size);
+	if (!uc)
+		goto error_exit;
+	/* Read in the $DATA attribute value into the buffer. */
+	l = ntfs_attr_pread(na, 0, na->data_size, uc);
+	if (l != na->data_size) {
+		ntfs_log_error("Failed to read $UpCase, unexpected length "
+			       "(%lld != %lld).\n", (long long)l,
+			       (long long)na->data_size);
+		errno = EIO;
+		goto error_exit;
+	}
+	/* Done with the $UpCase mft record. */
+	ntfs_attr_close(na);
+	na = NULL;
+	if (ntfs_inode_close(ni)) {
+		ntfs_log_perror("Failed to close $UpCase");
+		goto error_exit;
+	}
+	/* Consistency check of $UpCase, restricted to plain ASCII chars */
+	k = 0x20;
+	while ((k < uc_len)
+	    && (k < 0x7f)
+	    && (le16_to_cpu(uc[k])
+			== ((k < 'a') || (k > 'z') ? k : k + 'A' - 'a')))
+		k++;
+	if (k < 0x7f) {
+		ntfs_log_error("Corrupted file $UpCase\n");
+		goto io_error_exit;
+	}
+	/* Replace the default table, sharing the one read if possible */
+	uc = ntfs_upcase_share(uc, uc_len);
+	ntfs_upcase_unshare(vol->upcase, (ntfschar*)NULL);
+	vol->upcase = uc;
+	vol->upcase_len = uc_len;
+	uc = (ntfschar*)NULL;
+
+	/*
+	 * Now load $Volume and set the version information and flags in the
+	 * vol structure accordingly.
+	 */
+	ntfs_log_debug("Loading $Volume...\n");
+	vol->vol_ni = ntfs_inode_open(vol, FILE_Volume);
+	if (!vol->vol_ni) {
+		ntfs_log_perror("Failed to open inode FILE_Volume");
+		goto error_exit;
+	}
+	/* Get a search context for the $Volume/$VOLUME_INFORMATION lookup. */
+	ctx = ntfs_attr_get_search_ctx(vol->vol_ni, NULL);
+	if (!ctx)
+		goto error_exit;
+
+	/* Find the $VOLUME_INFORMATION attribute. */
+	if (ntfs_attr_lookup(AT_VOLUME_INFORMATION, AT_UNNAMED, 0, 0, 0, NULL,
+			0, ctx)) {
+		ntfs_log_perror("$VOLUME_INFORMATION attribute not found in "
+				"$Volume");
+		goto error_exit;
+	}
+	a = ctx->attr;
 	/* Has to be resident. */
 	if (a->non_resident) {
 		ntfs_log_error("Attribute $VOLUME_INFORMATION must be "
@@ -1210,51 +1648,20 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 	}
 	ntfs_attr_put_search_ctx(ctx);
 	ctx = NULL;
-	/* Now load the attribute definitions from $AttrDef. */
-	ntfs_log_debug("Loading $AttrDef...\n");
-	ni = ntfs_inode_open(vol, FILE_AttrDef);
-	if (!ni) {
-		ntfs_log_perror("Failed to open $AttrDef");
-		goto error_exit;
-	}
-	/* Get an ntfs attribute for $AttrDef/$DATA. */
-	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
-	if (!na) {
-		ntfs_log_perror("Failed to open ntfs attribute");
-		goto error_exit;
-	}
-	/* Check we don't overflow 32-bits. */
-	if (na->data_size > 0xffffffffLL) {
-		ntfs_log_error("Attribute definition table is too big (max "
-			       "32-bit allowed).\n");
-		errno = EINVAL;
-		goto error_exit;
-	}
-	vol->attrdef_len = na->data_size;
-	vol->attrdef = ntfs_malloc(na->data_size);
-	if (!vol->attrdef)
-		goto error_exit;
-	/* Read in the $DATA attribute value into the buffer. */
-	l = ntfs_attr_pread(na, 0, na->data_size, vol->attrdef);
-	if (l != na->data_size) {
-		ntfs_log_error("Failed to read $AttrDef, unexpected length "
-			       "(%lld != %lld).\n", (long long)l,
-			       (long long)na->data_size);
-		errno = EIO;
-		goto error_exit;
-	}
-	/* Done with the $AttrDef mft record. */
-	ntfs_attr_close(na);
-	na = NULL;
-	if (ntfs_inode_close(ni)) {
-		ntfs_log_perror("Failed to close $AttrDef");
-		goto error_exit;
+	/*
+	 * Now load the attribute definitions from $AttrDef and open
+	 * $Secure, unless deferred until first used.
+	 */
+	if (flags & NTFS_MNT_DEFER_LOADS) {
+		NVolSetAttrDefDeferred(vol);
+		NVolSetSecureDeferred(vol);
+	} else {
+		if (ntfs_volume_load_attrdef(vol))
+			goto error_exit;
+		if (ntfs_open_secure(vol))
+			goto error_exit;
 	}
 
-	/* Open $Secure. */
-	if (ntfs_open_secure(vol))
-		goto error_exit;
-
 	/*
 	 * Check for dirty logfile and hibernated Windows.
 	 * We care only about read-write mounts.
@@ -1285,12 +1692,26 @@ ntfs_volume *ntfs_device_mount(struct ntfs_device *dev, ntfs_mount_flags flags)
 		if (!(flags & NTFS_MNT_RDONLY) && !need_fallback_ro) {
 			if (fix_txf_data(vol))
 				goto error_exit;
+				/* not maintaining the journal is not fatal */
+			if (ntfs_usn_open(vol))
+				ntfs_log_perror("Could not open the change "
+					"journal, changes will not be recorded");
 		}
 	}
 	if (need_fallback_ro) {
 		NVolSetReadOnly(vol);
 		ntfs_log_error("%s", fallback_readonly_msg);
 	}
+	if (flags & NTFS_MNT_CONCURRENT) {
+#ifdef HAVE_PTHREAD_H
+		vol->locks = volume_locks_alloc(TRUE);
+		if (!vol->locks)
+			goto error_exit;
+#else
+		errno = ENOTSUP;
+		goto error_exit;
+#endif
+	}
 
 	return vol;
 io_error_exit:
@@ -1301,8 +1722,7 @@ error_exit:
 		ntfs_attr_put_search_ctx(ctx);
 	if (na)
 		ntfs_attr_close(na);
-	free(m);
-	free(m2);
+	free(uc);
 	__ntfs_volume_release(vol);
 	errno = eo;
 	return NULL;
@@ -1348,7 +1768,8 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
 
 	res = -1;
 	if (vol && vol->upcase) {
-		vol->locase = ntfs_locase_table_build(vol->upcase,
+		if (!vol->locase)
+			vol->locase = ntfs_locase_share(vol->upcase,
 					vol->upcase_len);
 		if (vol->locase) {
 			NVolClearCaseSensitive(vol);
@@ -1360,6 +1781,327 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
 	return (res);
 }
 
+/*
+ *		Set compacting of the runlists of big attributes
+ *	Not set in ntfs_mount() to avoid breaking existing tools.
+ *	The runlist of $MFT, mapped when mounting, is compacted now
+ *	if it is big enough.
+ */
+
+int ntfs_set_compact_runlists(ntfs_volume *vol, BOOL compact)
+{
+	runlist_element *rl;
+	int count;
+	int res;
+
+	res = -1;
+	if (vol) {
+		NVolClearCompactRunlists(vol);
+		if (compact) {
+			NVolSetCompactRunlists(vol);
+			rl = (vol->mft_na ? vol->mft_na->rl : NULL);
+			if (rl) {
+				for (count=0; rl[count].length; count++) { }
+				if ((count > RUNLIST_COMPACT_THRESHOLD)
+				    && ntfs_attr_rl_compact(vol->mft_na, 0))
+					ntfs_log_perror("Could not compact"
+						" the runlist of $MFT");
+			}
+		}
+		res = 0;
+	}
+	if (res)
+		ntfs_log_error("Failed to set runlist compacting\n");
+	return (res);
+}
+
+/*
+ *		Set or clear concurrent accesses to a volume
+ *	Not set in ntfs_mount(), this has to be requested by a
+ *	multithreaded application, before starting its threads.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+int ntfs_set_concurrent(ntfs_volume *vol, BOOL concurrent)
+{
+	int res;
+
+	res = -1;
+	if (!vol)
+		errno = EINVAL;
+	else {
+#ifdef HAVE_PTHREAD_H
+		if (vol->locks) {
+			volume_locks_free(vol->locks);
+			vol->locks = (struct ntfs_volume_locks*)NULL;
+		}
+		if (concurrent)
+			vol->locks = volume_locks_alloc(FALSE);
+		if (vol->locks || !concurrent)
+			res = 0;
+#else
+		if (concurrent)
+			errno = ENOTSUP;
+		else
+			res = 0;
+#endif
+	}
+	if (res)
+		ntfs_log_error("Failed to set concurrent accesses\n");
+	return (res);
+}
+
+/**
+ * ntfs_volume_flush_metadata - write the delayed metadata
+ * @vol:	volume
+ * @all:	TRUE if all the delayed metadata has to be written, FALSE
+ *		if only what has been delayed for too long
+ *
+ * The directory entries removed lazily are removed first, then the
+ * records of changes gathered are appended to the change journal,
+ * when it is time to. The indexes of $Reparse and $ObjId, which
+ * are kept open, are synced next. The delayed inodes are written next, their records being grouped
+ * and written in mft order, with the freed mft records kept for reuse
+ * and the mft records pending for write-back,
+ * then the delayed index blocks, which syncing the inodes may have
+ * updated. The clusters freed for long enough are then discarded, and
+ * the pages of $Bitmap, showing them free once discarded, are written.
+ * This must not be called while an inode is open.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_volume_flush_metadata(ntfs_volume *vol, BOOL all)
+{
+	int err;
+	int res;
+
+	res = 0;
+	err = 0;
+	if (ntfs_index_lazy_flush(vol, all)) {
+		err = errno;
+		res = -1;
+	}
+	if (ntfs_usn_flush(vol, all) && !res) {
+		err = errno;
+		res = -1;
+	}
+		/* the global indexes kept open have their root in memory */
+	if ((vol->reparse_ni && NInoDirty(vol->reparse_ni)
+		&& ntfs_inode_sync(vol->reparse_ni))
+	    || (vol->objid_ni && NInoDirty(vol->objid_ni)
+		&& ntfs_inode_sync(vol->objid_ni))) {
+		err = errno;
+		res = -1;
+	}
+	if (vol->inode_writeback) {
+			/* when failing, records are written one at a time */
+		ntfs_mft_batch_begin(vol);
+		if (ntfs_inode_writeback_flush(vol, all)) {
+			err = errno;
+			res = -1;
+		}
+		if (ntfs_mft_freed_flush(vol, all) && !res) {
+			err = errno;
+			res = -1;
+		}
+		if (ntfs_mft_batch_end(vol) && !res) {
+			err = errno;
+			res = -1;
+		}
+	} else
+		if (ntfs_mft_freed_flush(vol, all) && !res) {
+			err = errno;
+			res = -1;
+		}
+	if (ntfs_mft_writeback_flush(vol, all) && !res) {
+		err = errno;
+		res = -1;
+	}
+	if (ntfs_index_writeback_flush(vol, all) && !res) {
+		err = errno;
+		res = -1;
+	}
+	if (ntfs_cluster_discard_flush(vol, all) && !res) {
+		err = errno;
+		res = -1;
+	}
+	if (ntfs_lcnbmp_flush(vol, all) && !res) {
+		err = errno;
+		res = -1;
+	}
+	if (res)
+		errno = err;
+	return (res);
+}
+
+/**
+ * ntfs_volume_sync - write the delayed metadata and flush the device
+ * @vol:	volume
+ *
+ * When concurrent accesses have been set, this has to be called with
+ * the exclusive lock held. The metadata and the cached blocks are
+ * written under the lock, then the lock is released while flushing
+ * the device, so that concurrent syncs share a single flush, and it
+ * is taken again before returning.
+ * This must not be called while an inode is open.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_volume_sync(ntfs_volume *vol)
+{
+	struct ntfs_device *dev;
+	int res;
+#ifdef HAVE_PTHREAD_H
+	struct ntfs_volume_locks *locks;
+	u64 ticket;
+	int err;
+#endif
+
+	dev = vol->dev;
+	res = ntfs_volume_flush_metadata(vol, TRUE);
+#ifdef HAVE_PTHREAD_H
+	locks = vol->locks;
+	if (!res && locks && !locks->implicit) {
+		res = ntfs_flush_block_cache(dev);
+		if (!res && NDevDirty(dev)) {
+			pthread_mutex_lock(&locks->sync);
+			ticket = ++locks->sync_ticket;
+			pthread_mutex_unlock(&locks->sync);
+			ntfs_volume_unlock(vol, FALSE);
+			res = locks_sync_wait(locks, dev, ticket);
+			err = errno;
+			ntfs_volume_lock(vol, FALSE);
+				/*
+				 * The flush may have cleared the dirty state
+				 * of writes made meanwhile, which will have
+				 * to be flushed by the next sync.
+				 */
+			NDevSetDirty(dev);
+			if (res) {
+				ntfs_log_perror("Failed to sync device %s",
+						dev->d_name);
+				errno = err;
+			}
+		}
+	} else
+#endif
+		if (!res)
+			res = ntfs_device_sync(dev);
+	return (res);
+}
+
+/*
+ *		Lock a volume before a request
+ *
+ *	A shared lock is for requests which do not update the volume,
+ *	they may overlap with other shared requests while transferring
+ *	data. An exclusive lock is for requests which update the volume.
+ *	Nothing is done if concurrent accesses have not been set.
+ */
+
+void ntfs_volume_lock(ntfs_volume *vol, BOOL shared)
+{
+#ifdef HAVE_PTHREAD_H
+	if (vol->locks) {
+		if (shared) {
+			pthread_rwlock_rdlock(&vol->locks->access);
+			state_lock(vol->locks);
+		} else
+			pthread_rwlock_wrlock(&vol->locks->access);
+	}
+#endif
+}
+
+/*
+ *		Unlock a volume after a request
+ */
+
+void ntfs_volume_unlock(ntfs_volume *vol, BOOL shared)
+{
+#ifdef HAVE_PTHREAD_H
+	if (vol->locks) {
+		if (shared)
+			state_unlock(vol->locks);
+		pthread_rwlock_unlock(&vol->locks->access);
+	}
+#endif
+}
+
+/*
+ *		Enter the library through an entry point
+ *
+ *	When the locking is implicit, the state lock is taken, and it
+ *	may already be held by the calling thread. Nothing is done
+ *	otherwise.
+ *
+ *	Returns TRUE if the calling thread has just entered the library
+ *		with implicit locking, FALSE otherwise
+ */
+
+BOOL ntfs_volume_enter(ntfs_volume *vol)
+{
+	BOOL outer;
+
+	outer = FALSE;
+#ifdef HAVE_PTHREAD_H
+	if (vol->locks && vol->locks->implicit) {
+		state_lock(vol->locks);
+		outer = (vol->locks->depth == 1);
+	}
+#endif
+	return (outer);
+}
+
+/*
+ *		Leave the library through an entry point
+ */
+
+void ntfs_volume_leave(ntfs_volume *vol)
+{
+#ifdef HAVE_PTHREAD_H
+	if (vol->locks && vol->locks->implicit)
+		state_unlock(vol->locks);
+#endif
+}
+
+/*
+ *		Let other readers use the library while transferring data
+ *
+ *	Only to be called by a reader holding the shared lock, and only
+ *	around transfers which do not use the state of the volume.
+ *	When the library was entered several times, the callers may
+ *	rely on the state, and the lock is kept.
+ *
+ *	Returns TRUE if the lock was released
+ */
+
+BOOL ntfs_volume_transfer_begin(ntfs_volume *vol)
+{
+	BOOL released;
+
+	released = FALSE;
+#ifdef HAVE_PTHREAD_H
+	if (vol->locks && (vol->locks->depth == 1)) {
+		state_unlock(vol->locks);
+		released = TRUE;
+	}
+#endif
+	return (released);
+}
+
+/*
+ *		Get back to the library after transferring data
+ */
+
+void ntfs_volume_transfer_end(ntfs_volume *vol, BOOL released)
+{
+#ifdef HAVE_PTHREAD_H
+	if (released)
+		state_lock(vol->locks);
+#endif
+}
+
 /**
  * ntfs_mount - open ntfs volume
  * @name:	name of device/file to open
@@ -1372,6 +2114,9 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
  * the mount system call (man 2 mount). Currently only the following flags
  * is implemented:
  *	NTFS_MNT_RDONLY	- mount volume read-only
+ *	NTFS_MNT_CONCURRENT - read files from several threads (read-only)
+ *	NTFS_MNT_URING	- submit batched transfers through io_uring
+ *	NTFS_MNT_DIRECT_IO - access the device bypassing its cache
  *
  * The function opens the device or file @name and verifies that it contains a
  * valid bootsector. Then, it allocates an ntfs_volume structure and initializes
@@ -1390,12 +2135,20 @@ ntfs_volume *ntfs_mount(const char *name __attribute__((unused)),
 {
 #ifndef NO_NTFS_DEVICE_DEFAULT_IO_OPS
 	struct ntfs_device *dev;
+	struct ntfs_device_operations *dops;
 	ntfs_volume *vol;
 
+	dops = &ntfs_device_default_io_ops;
+#ifdef NTFS_DEVICE_URING_IO_OPS
+	if (flags & NTFS_MNT_URING)
+		dops = &ntfs_device_uring_io_ops;
+#endif
 	/* Allocate an ntfs_device structure. */
-	dev = ntfs_device_alloc(name, 0, &ntfs_device_default_io_ops, NULL);
+	dev = ntfs_device_alloc(name, 0, dops, NULL);
 	if (!dev)
 		return NULL;
+	if (flags & NTFS_MNT_DIRECT_IO)
+		NDevSetDirect(dev);
 	/* Call ntfs_device_mount() to do the actual mount. */
 	vol = ntfs_device_mount(dev, flags);
 	if (!vol) {
@@ -1851,6 +2604,10 @@ int ntfs_set_locale(void)
 
 /*
  *		Feed the counts of free clusters and free mft records
+ *
+ *	The counts may be deferred by setting NV_FreeSpaceUncounted
+ *	after mounting, they are then only maintained when this is
+ *	called, on the first request for the free space.
  */
 
 int ntfs_volume_get_free_space(ntfs_volume *vol)
@@ -1859,10 +2616,7 @@ int ntfs_volume_get_free_space(ntfs_volume *vol)
 	int ret;
 
 	ret = -1; /* default return */
-	vol->free_clusters = ntfs_attr_get_free_bits(vol->lcnbmp_na);
-	if (vol->free_clusters < 0) {
-		ntfs_log_perror("Failed to read NTFS $Bitmap");
-	} else {
+	if (!ntfs_cluster_count_free(vol, FALSE)) {
 		na = vol->mftbmp_na;
 		vol->free_mft_records = ntfs_attr_get_free_bits(na);
 
@@ -1871,12 +2625,312 @@ int ntfs_volume_get_free_space(ntfs_volume *vol)
 
 		if (vol->free_mft_records < 0)
 			ntfs_log_perror("Failed to calculate free MFT records");
-		else
+		else {
+			NVolClearFreeSpaceUncounted(vol);
 			ret = 0;
+		}
 	}
 	return (ret);
 }
 
+/*
+ *		Snapshot of the mount-time metadata
+ *
+ *	When a volume is mounted read-only, the counts of free clusters
+ *	and free mft records, which need full scans of the bitmaps, can
+ *	be saved at unmount time into a sidecar file, and used again when
+ *	the same volume is mounted again unchanged.
+ *
+ *	The snapshot is keyed by the serial number and size of the volume
+ *	and by a hash of the raw records of the system files, of the
+ *	restart area of $LogFile and of the size of the change journal.
+ *	Any read-write mount by ntfs-3g or Windows updates at least the
+ *	record of $Volume or the restart area, so that the snapshot is
+ *	then discarded. A read-write mount also deletes the snapshot file
+ *	when it is declared.
+ */
+
+#define SNAPSHOT_MAGIC "NTFS3GSN"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_LOGFILE_SIZE 8192	/* bytes of $LogFile hashed */
+
+struct SNAPSHOT_RECORD {	/* as stored in the sidecar file */
+	char magic[8];
+	le32 version;
+	le32 key[2];
+	le32 reserved;
+	le64 serial;
+	le64 nr_clusters;
+	le64 free_clusters;
+	le64 free_mft_records;
+} ;
+
+struct MOUNT_SNAPSHOT {
+	char *path;
+	u32 key[2];
+	BOOL applied;	/* the counts were taken from the snapshot */
+} ;
+
+static const ntfschar usn_j_stream[] = {
+	const_cpu_to_le16('$'), const_cpu_to_le16('J')
+} ;
+
+/*
+ *		Hash a buffer into the key (two FNV-1a hashes)
+ */
+
+static void snapshot_hash(u32 key[2], const void *buf, size_t size)
+{
+	const u8 *p;
+	size_t i;
+
+	p = (const u8*)buf;
+	for (i=0; i<size; i++) {
+		key[0] = (key[0] ^ p[i]) * 16777619U;
+		key[1] = (key[1] ^ p[i] ^ 0x5a) * 16777619U;
+	}
+}
+
+/*
+ *		Hash the start of the unnamed data of a system file
+ *
+ *	Returns 0 if successful, -1 if the data could not be read
+ */
+
+static int snapshot_hash_data(ntfs_volume *vol, u32 key[2], u64 inum,
+			s64 size)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	u8 *buf;
+	s64 got;
+	int res;
+
+	res = -1;
+	ni = ntfs_inode_open(vol, inum);
+	if (ni) {
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na) {
+			if (size > na->data_size)
+				size = na->data_size;
+			buf = (u8*)ntfs_malloc(size ? size : 1);
+			if (buf) {
+				got = ntfs_attr_pread(na, 0, size, buf);
+				if (got == size) {
+					snapshot_hash(key, buf, size);
+					res = 0;
+				}
+				free(buf);
+			}
+			ntfs_attr_close(na);
+		}
+		ntfs_inode_close(ni);
+	}
+	return (res);
+}
+
+/*
+ *		Compute the key identifying the current state of a volume
+ *
+ *	Returns 0 if successful, -1 if some metadata could not be read
+ */
+
+static int snapshot_key(ntfs_volume *vol, u32 key[2])
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	u8 *buf;
+	s64 size;
+	le64 sizes[2];
+	u64 inum;
+	int res;
+
+	res = -1;
+	key[0] = 2166136261U;
+	key[1] = 2166136261U;
+	sizes[0] = cpu_to_le64(vol->vol_serial);
+	sizes[1] = cpu_to_le64(vol->nr_clusters);
+	snapshot_hash(key, sizes, sizeof(sizes));
+		/* the raw records of the system files */
+	size = (s64)FILE_first_user << vol->mft_record_size_bits;
+	buf = (u8*)ntfs_malloc(size);
+	if (buf) {
+		if (ntfs_attr_pread(vol->mft_na, 0, size, buf) == size) {
+			snapshot_hash(key, buf, size);
+			res = 0;
+		}
+		free(buf);
+	}
+		/* the restart area of $LogFile */
+	if (!res)
+		res = snapshot_hash_data(vol, key, FILE_LogFile,
+					SNAPSHOT_LOGFILE_SIZE);
+		/* the size of the change journal, if any */
+	if (!res && (vol->major_ver >= 3)) {
+		dir_ni = ntfs_inode_open(vol, FILE_Extend);
+		ni = (ntfs_inode*)NULL;
+		if (dir_ni) {
+			inum = ntfs_inode_lookup_by_mbsname(dir_ni,
+					"$UsnJrnl");
+			if (inum != (u64)-1)
+				ni = ntfs_inode_open(vol, inum);
+			ntfs_inode_close(dir_ni);
+		}
+		if (ni) {
+			na = ntfs_attr_open(ni, AT_DATA,
+					(ntfschar*)usn_j_stream, 2);
+			if (na) {
+				sizes[0] = cpu_to_le64(na->data_size);
+				sizes[1] = cpu_to_le64(na->initialized_size);
+				snapshot_hash(key, sizes, sizeof(sizes));
+				ntfs_attr_close(na);
+			}
+			ntfs_inode_close(ni);
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Save the snapshot when unmounting
+ *
+ *	Only done for a read-only mount whose counts were not taken from
+ *	the snapshot and are exact. Failing is not an error.
+ */
+
+static void snapshot_save(ntfs_volume *vol)
+{
+	struct MOUNT_SNAPSHOT *snap;
+	struct SNAPSHOT_RECORD rec;
+	char *tmp;
+	FILE *f;
+	BOOL ok;
+
+	snap = vol->snapshot;
+	if (!snap->applied && NVolReadOnly(vol)
+	    && !NVolFreeSpaceUncounted(vol)
+	    && (vol->free_clusters >= 0) && (vol->free_mft_records >= 0)
+	    && !ntfs_cluster_count_pending(vol)) {
+		memset(&rec, 0, sizeof(rec));
+		memcpy(rec.magic, SNAPSHOT_MAGIC, sizeof(rec.magic));
+		rec.version = const_cpu_to_le32(SNAPSHOT_VERSION);
+		rec.key[0] = cpu_to_le32(snap->key[0]);
+		rec.key[1] = cpu_to_le32(snap->key[1]);
+		rec.serial = cpu_to_le64(vol->vol_serial);
+		rec.nr_clusters = cpu_to_le64(vol->nr_clusters);
+		rec.free_clusters = cpu_to_le64(vol->free_clusters);
+		rec.free_mft_records = cpu_to_le64(vol->free_mft_records);
+			/* write to a temporary file, then rename */
+		tmp = (char*)ntfs_malloc(strlen(snap->path) + 5);
+		if (tmp) {
+			strcpy(tmp, snap->path);
+			strcat(tmp, ".tmp");
+			f = fopen(tmp, "wb");
+			ok = FALSE;
+			if (f) {
+				ok = (fwrite(&rec, sizeof(rec), 1, f) == 1);
+				if (fclose(f))
+					ok = FALSE;
+				if (ok && rename(tmp, snap->path))
+					ok = FALSE;
+				if (!ok)
+					unlink(tmp);
+			}
+			if (!ok)
+				ntfs_log_perror("Could not save the snapshot"
+						" to %s", snap->path);
+			free(tmp);
+		}
+	}
+	free(snap->path);
+	free(snap);
+	vol->snapshot = (struct MOUNT_SNAPSHOT*)NULL;
+}
+
+/**
+ * ntfs_volume_snapshot_load - use a snapshot of the mount-time metadata
+ * @vol:	ntfs volume just mounted
+ * @path:	path of the sidecar file holding the snapshot
+ *
+ * For a read-only mount, set the counts of free clusters and free mft
+ * records from the snapshot if it matches the current state of the
+ * volume, otherwise discard it, and save a new snapshot when unmounting.
+ * For a read-write mount, just discard the snapshot. Not set in
+ * ntfs_mount().
+ *
+ * Return 1 if the counts were set from the snapshot, 0 if they have to
+ * be computed, and -1 on error with errno set to the error code.
+ */
+int ntfs_volume_snapshot_load(ntfs_volume *vol, const char *path)
+{
+	struct MOUNT_SNAPSHOT *snap;
+	struct SNAPSHOT_RECORD rec;
+	FILE *f;
+	BOOL valid;
+	int res;
+
+	if (!vol || !path || vol->snapshot) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (!NVolReadOnly(vol)) {
+		if (unlink(path) && (errno != ENOENT)) {
+			ntfs_log_perror("Could not discard the snapshot %s",
+					path);
+			return (-1);
+		}
+		return (0);
+	}
+	snap = (struct MOUNT_SNAPSHOT*)ntfs_malloc(
+				sizeof(struct MOUNT_SNAPSHOT));
+	if (!snap)
+		return (-1);
+	snap->path = strdup(path);
+	snap->applied = FALSE;
+	if (!snap->path || snapshot_key(vol, snap->key)) {
+		if (snap->path)
+			ntfs_log_perror("Could not identify the volume state");
+		free(snap->path);
+		free(snap);
+		return (-1);
+	}
+	vol->snapshot = snap;
+	res = 0;
+	f = fopen(path, "rb");
+	if (f) {
+		valid = (fread(&rec, sizeof(rec), 1, f) == 1)
+			&& !memcmp(rec.magic, SNAPSHOT_MAGIC,
+					sizeof(rec.magic))
+			&& (rec.version == const_cpu_to_le32(SNAPSHOT_VERSION))
+			&& (le32_to_cpu(rec.key[0]) == snap->key[0])
+			&& (le32_to_cpu(rec.key[1]) == snap->key[1])
+			&& (le64_to_cpu(rec.serial) == vol->vol_serial)
+			&& ((s64)le64_to_cpu(rec.nr_clusters)
+					== vol->nr_clusters)
+			&& ((s64)le64_to_cpu(rec.free_clusters) >= 0)
+			&& ((s64)le64_to_cpu(rec.free_clusters)
+					<= vol->nr_clusters)
+			&& ((s64)le64_to_cpu(rec.free_mft_records) >= 0);
+		fclose(f);
+		if (valid) {
+			vol->free_clusters =
+					(s64)le64_to_cpu(rec.free_clusters);
+			vol->free_mft_records =
+					(s64)le64_to_cpu(rec.free_mft_records);
+			snap->applied = TRUE;
+			res = 1;
+			ntfs_log_debug("Free space set from snapshot %s\n",
+					path);
+		} else {
+			ntfs_log_info("Discarding the outdated snapshot"
+					" %s\n", path);
+			unlink(path);
+		}
+	}
+	return (res);
+}
+
 /**
  * ntfs_volume_rename - change the current label on a volume
  * @vol:	volume to change the label on
@@ -83,6 +83,7 @@ typedef struct ntfs_volume ntfs_volume;
 #include "types.h"
 #include "device.h"
 #include "misc.h"
+#include "param.h"
 
 #define cpu_to_le16(x) (x)
 #define const_cpu_to_le16(x) (x)
@@ -96,6 +97,12 @@ typedef struct ntfs_volume ntfs_volume;
 #define NTFS_BLOCK_SIZE_BITS	9
 #endif
 
+#if WIN32_OVERLAPPED_IO
+#define WIN32_OPEN_FLAGS FILE_FLAG_OVERLAPPED
+#else
+#define WIN32_OPEN_FLAGS 0
+#endif
+
 #ifndef INVALID_SET_FILE_POINTER
 #define INVALID_SET_FILE_POINTER ((DWORD)-1)
 #endif
@@ -290,6 +297,9 @@ typedef struct {
 	DWORD geo_sectors, geo_heads;
 	HANDLE vol_handle;
 	BOOL ntdll;
+	HANDLE event[NTFS_MAX_IO_SEGMENTS];	/* for overlapped requests */
+	BYTE *bounce[WIN32_BOUNCE_BUFFERS];	/* bounce buffers kept */
+	int bounce_count;
 } win32_fd;
 
 /**
@@ -467,6 +477,35 @@ static __inline__ int ntfs_device_unix_status_flags_to_win32(int flags)
 }
 
 
+/*
+ *		Send a control code to a device
+ *
+ *	This is DeviceIoControl() waiting for the completion, as needed
+ *	when the handle was opened for overlapped i/o.
+ */
+
+static BOOL ntfs_device_win32_io_control(HANDLE handle, DWORD code,
+		LPVOID inbuf, DWORD insize, LPVOID outbuf, DWORD outsize,
+		LPDWORD returned)
+{
+	OVERLAPPED ov;
+	DWORD err;
+	BOOL ok;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!ov.hEvent)
+		return (FALSE);
+	ok = DeviceIoControl(handle, code, inbuf, insize, outbuf, outsize,
+			NULL, &ov);
+	if (ok || (GetLastError() == ERROR_IO_PENDING))
+		ok = GetOverlappedResult(handle, &ov, returned, TRUE);
+	err = GetLastError();
+	CloseHandle(ov.hEvent);
+	SetLastError(err);
+	return (ok);
+}
+
 /**
  * ntfs_device_win32_simple_open_file - just open a file via win32 API
  * @filename:	name of the file to open
@@ -486,7 +525,7 @@ static int ntfs_device_win32_simple_open_file(const char *filename,
 			ntfs_device_unix_status_flags_to_win32(flags),
 			locking ? 0 : (FILE_SHARE_WRITE | FILE_SHARE_READ),
 			NULL, (flags & O_CREAT ? OPEN_ALWAYS : OPEN_EXISTING),
-			0, NULL);
+			WIN32_OPEN_FLAGS, NULL);
 	if (*handle == INVALID_HANDLE_VALUE) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("CreateFile(%s) failed.\n", filename);
@@ -509,8 +548,7 @@ static int ntfs_device_win32_lock(HANDLE handle)
 {
 	DWORD i;
 
-	if (!DeviceIoControl(handle, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &i,
-			NULL)) {
+	if (!ntfs_device_win32_io_control(handle, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't lock volume.\n");
 		return -1;
@@ -530,8 +568,7 @@ static int ntfs_device_win32_unlock(HANDLE handle)
 {
 	DWORD i;
 
-	if (!DeviceIoControl(handle, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &i,
-			NULL)) {
+	if (!ntfs_device_win32_io_control(handle, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't unlock volume.\n");
 		return -1;
@@ -573,8 +610,8 @@ static int ntfs_device_win32_dismount(HANDLE handle)
 {
 	DWORD i;
 
-	if (!DeviceIoControl(handle, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0,
-			&i, NULL)) {
+	if (!ntfs_device_win32_io_control(handle, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0,
+			&i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't dismount volume.\n");
 		return -1;
@@ -623,8 +660,8 @@ static s64 ntfs_device_win32_getdisklength(HANDLE handle)
 	GET_LENGTH_INFORMATION buf;
 	DWORD i;
 
-	if (!DeviceIoControl(handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &buf,
-			sizeof(buf), &i, NULL)) {
+	if (!ntfs_device_win32_io_control(handle, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &buf,
+			sizeof(buf), &i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't get disk length.\n");
 		return -1;
@@ -655,8 +692,8 @@ static s64 ntfs_device_win32_getntfssize(HANDLE handle)
 	DWORD i;
 	NTFS_VOLUME_DATA_BUFFER buf;
 
-	if (!DeviceIoControl(handle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &buf,
-			sizeof(buf), &i, NULL)) {
+	if (!ntfs_device_win32_io_control(handle, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &buf,
+			sizeof(buf), &i)) {
 		errno = ntfs_w32error_to_errno(GetLastError());
 		ntfs_log_trace("Couldn't get NTFS volume length.\n");
 		return -1;
@@ -693,8 +730,8 @@ static int ntfs_device_win32_getgeo(HANDLE handle, win32_fd *fd)
 	BYTE b[sizeof(DISK_GEOMETRY) + sizeof(DISK_PARTITION_INFO) +
 			sizeof(DISK_DETECTION_INFO) + 512];
 
-	rvl = DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL,
-			0, &b, sizeof(b), &i, NULL);
+	rvl = ntfs_device_win32_io_control(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL,
+			0, &b, sizeof(b), &i);
 	if (rvl) {
 		ntfs_log_debug("GET_DRIVE_GEOMETRY_EX detected.\n");
 		DISK_DETECTION_INFO *ddi = (PDISK_DETECTION_INFO)
@@ -723,8 +760,8 @@ static int ntfs_device_win32_getgeo(HANDLE handle, win32_fd *fd)
 		}
 	} else
 		fd->geo_heads = -1;
-	rvl = DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
-			&b, sizeof(b), &i, NULL);
+	rvl = ntfs_device_win32_io_control(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+			&b, sizeof(b), &i);
 	if (rvl) {
 		ntfs_log_debug("GET_DRIVE_GEOMETRY detected.\n");
 		fd->geo_cylinders = ((DISK_GEOMETRY*)&b)->Cylinders.QuadPart;
@@ -810,9 +847,9 @@ static __inline__ int ntfs_device_win32_open_file(char *filename, win32_fd *fd,
 		DWORD bytes;
 
 		/* try making sparse (but ignore errors) */
-		DeviceIoControl(handle, FSCTL_SET_SPARSE,
+		ntfs_device_win32_io_control(handle, FSCTL_SET_SPARSE,
 				(void*)NULL, 0, (void*)NULL, 0,
-				&bytes, (LPOVERLAPPED)NULL);
+				&bytes);
 	}
 	/* fill fd */
 	fd->handle = handle;
@@ -1001,17 +1038,17 @@ static HANDLE ntfs_device_win32_open_volume_for_partition(unsigned int drive_id,
 		handle = CreateFile(vol_name,
 				ntfs_device_unix_status_flags_to_win32(flags),
 				FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
-				OPEN_EXISTING, 0, NULL);
+				OPEN_EXISTING, WIN32_OPEN_FLAGS, NULL);
 		if (handle != INVALID_HANDLE_VALUE) {
 			DWORD bytesReturned;
 #define EXTENTS_SIZE sizeof(VOLUME_DISK_EXTENTS) + 9 * sizeof(DISK_EXTENT)
 			char extents[EXTENTS_SIZE];
 
 			/* Check physical locations. */
-			if (DeviceIoControl(handle,
+			if (ntfs_device_win32_io_control(handle,
 					IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS,
 					NULL, 0, extents, EXTENTS_SIZE,
-					&bytesReturned, NULL)) {
+					&bytesReturned)) {
 				if (((VOLUME_DISK_EXTENTS *)extents)->
 						NumberOfDiskExtents == 1) {
 					DISK_EXTENT *extent = &((
@@ -1077,8 +1114,8 @@ static BOOL ntfs_device_win32_find_partition(HANDLE handle, DWORD partition_id,
 			errno = ENOMEM;
 			return FALSE;
 		}
-		if (DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_LAYOUT, NULL,
-				0, (BYTE*)drive_layout, buf_size, &i, NULL))
+		if (ntfs_device_win32_io_control(handle, IOCTL_DISK_GET_DRIVE_LAYOUT, NULL,
+				0, (BYTE*)drive_layout, buf_size, &i))
 			break;
 		err = GetLastError();
 		free(drive_layout);
@@ -1191,6 +1228,84 @@ static int ntfs_device_win32_open_partition(int drive_id,
 	}
 }
 
+/*
+ *		Create the events signalling the completion of the requests
+ *
+ *	Returns 0 if successful, or -1 with errno set
+ */
+
+static int ntfs_device_win32_create_events(win32_fd *fd)
+{
+	int i;
+
+	for (i=0; i<NTFS_MAX_IO_SEGMENTS; i++) {
+		fd->event[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (!fd->event[i]) {
+			errno = ntfs_w32error_to_errno(GetLastError());
+			while (--i >= 0)
+				CloseHandle(fd->event[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *		Free the resources needed for transfers
+ */
+
+static void ntfs_device_win32_free_transfers(win32_fd *fd)
+{
+	int i;
+
+	if (!fd->ntdll)
+		for (i=0; i<NTFS_MAX_IO_SEGMENTS; i++)
+			CloseHandle(fd->event[i]);
+	while (fd->bounce_count > 0)
+		VirtualFree(fd->bounce[--fd->bounce_count], 0, MEM_RELEASE);
+}
+
+/*
+ *		Get an aligned bounce buffer of at least @size bytes
+ *
+ *	Buffers up to WIN32_BOUNCE_SIZE are taken from the ones kept,
+ *	bigger ones are allocated for a single use.
+ *
+ *	Returns the buffer, or NULL with errno set
+ */
+
+static BYTE *ntfs_device_win32_get_bounce(win32_fd *fd, s64 size)
+{
+	BYTE *buf;
+
+	if ((size <= WIN32_BOUNCE_SIZE) && fd->bounce_count)
+		buf = fd->bounce[--fd->bounce_count];
+	else {
+		if (size < WIN32_BOUNCE_SIZE)
+			size = WIN32_BOUNCE_SIZE;
+		buf = (BYTE *)VirtualAlloc(NULL, size, MEM_COMMIT,
+				PAGE_READWRITE);
+		if (!buf) {
+			errno = ntfs_w32error_to_errno(GetLastError());
+			ntfs_log_trace("VirtualAlloc failed.\n");
+		}
+	}
+	return (buf);
+}
+
+/*
+ *		Release a bounce buffer of @size bytes, keeping it if possible
+ */
+
+static void ntfs_device_win32_put_bounce(win32_fd *fd, BYTE *buf, s64 size)
+{
+	if ((size <= WIN32_BOUNCE_SIZE)
+	    && (fd->bounce_count < WIN32_BOUNCE_BUFFERS))
+		fd->bounce[fd->bounce_count++] = buf;
+	else
+		VirtualFree(buf, 0, MEM_RELEASE);
+}
+
 /**
  * ntfs_device_win32_open - open a device
  * @dev:	a pointer to the NTFS_DEVICE to open
@@ -1216,6 +1331,7 @@ static int ntfs_device_win32_open(struct ntfs_device *dev, int flags)
 		return -1;
 	}
 	ntfs_device_win32_init_imports();
+	memset(&fd, 0, sizeof(fd));
 	numparams = sscanf(dev->d_name, "/dev/hd%c%u", &drive_char, &part);
 	if (!numparams
 	    && (dev->d_name[1] == ':')
@@ -1255,6 +1371,12 @@ static int ntfs_device_win32_open(struct ntfs_device *dev, int flags)
 		return err;
 	ntfs_log_debug("win32_open(%s) -> %p, offset 0x%llx.\n", dev->d_name,
 			dev, fd.part_start);
+	if (!fd.ntdll && ntfs_device_win32_create_events(&fd)) {
+		if (fd.vol_handle != INVALID_HANDLE_VALUE)
+			CloseHandle(fd.vol_handle);
+		CloseHandle(fd.handle);
+		return -1;
+	}
 	/* Setup our read-only flag. */
 	if ((flags & O_RDWR) != O_RDWR)
 		NDevSetReadOnly(dev);
@@ -1383,15 +1505,23 @@ static s64 ntfs_device_win32_pio(win32_fd *fd, const s64 pos,
 			errno = ntfs_ntstatus_to_errno(res);
 		}
 	} else {
-		if (!fnSetFilePointerEx(handle, li, NULL, FILE_BEGIN)) {
-			errno = ntfs_w32error_to_errno(GetLastError());
-			ntfs_log_trace("SetFilePointer failed.\n");
-			return -1;
-		}
+		OVERLAPPED ov;
+
+			/* the position is passed, the handle may be overlapped */
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = li.LowPart;
+		ov.OffsetHigh = li.HighPart;
+		ov.hEvent = fd->event[0];
 		if (wbuf)
-			res = WriteFile(handle, wbuf, count, &bt, NULL);
+			res = WriteFile(handle, wbuf, count, NULL, &ov);
 		else
-			res = ReadFile(handle, rbuf, count, &bt, NULL);
+			res = ReadFile(handle, rbuf, count, NULL, &ov);
+		if (res || (GetLastError() == ERROR_IO_PENDING))
+			res = GetOverlappedResult(handle, &ov, &bt, TRUE);
+		if (!res && (GetLastError() == ERROR_HANDLE_EOF)) {
+			bt = 0;
+			res = TRUE;
+		}
 		bytes = bt;
 		if (!res) {
 			errno = ntfs_w32error_to_errno(GetLastError());
@@ -1445,6 +1575,7 @@ static s64 ntfs_device_win32_read(struct ntfs_device *dev, void *b, s64 count)
 	s64 old_pos, to_read, i, br = 0;
 	win32_fd *fd = (win32_fd *)dev->d_private;
 	BYTE *alignedbuffer;
+	s64 alloc_size;
 	int old_ofs, ofs;
 
 	old_pos = fd->pos;
@@ -1461,17 +1592,14 @@ static s64 ntfs_device_win32_read(struct ntfs_device *dev, void *b, s64 count)
 			"ofs = %i, to_read = 0x%llx.\n", fd, b,
 			(long long)count, (long long)old_pos, ofs,
 			(long long)to_read);
+	alloc_size = to_read;
 	if (!((unsigned long)b & (fd->geo_sector_size - 1)) && !old_ofs &&
 			!(count & (fd->geo_sector_size - 1)))
 		alignedbuffer = b;
 	else {
-		alignedbuffer = (BYTE *)VirtualAlloc(NULL, to_read, MEM_COMMIT,
-				PAGE_READWRITE);
-		if (!alignedbuffer) {
-			errno = ntfs_w32error_to_errno(GetLastError());
-			ntfs_log_trace("VirtualAlloc failed for read.\n");
+		alignedbuffer = ntfs_device_win32_get_bounce(fd, to_read);
+		if (!alignedbuffer)
 			return -1;
-		}
 	}
 	if (fd->vol_handle != INVALID_HANDLE_VALUE && old_pos < fd->geo_size) {
 		s64 vol_to_read = fd->geo_size - old_pos;
@@ -1511,12 +1639,12 @@ static s64 ntfs_device_win32_read(struct ntfs_device *dev, void *b, s64 count)
 read_partial:
 	if (alignedbuffer != b) {
 		memcpy((void*)b, alignedbuffer + old_ofs, br);
-		VirtualFree(alignedbuffer, 0, MEM_RELEASE);
+		ntfs_device_win32_put_bounce(fd, alignedbuffer, alloc_size);
 	}
 	return br;
 read_error:
 	if (alignedbuffer != b)
-		VirtualFree(alignedbuffer, 0, MEM_RELEASE);
+		ntfs_device_win32_put_bounce(fd, alignedbuffer, alloc_size);
 	return -1;
 }
 
@@ -1550,6 +1678,7 @@ static int ntfs_device_win32_close(struct ntfs_device *dev)
 		rvl = NtClose(fd->handle) == STATUS_SUCCESS;
 	} else
 		rvl = CloseHandle(fd->handle);
+	ntfs_device_win32_free_transfers(fd);
 	NDevClearOpen(dev);
 	free(fd);
 	if (!rvl) {
@@ -1639,6 +1768,7 @@ static s64 ntfs_device_win32_write(struct ntfs_device *dev, const void *b,
 	win32_fd *fd = (win32_fd *)dev->d_private;
 	const BYTE *alignedbuffer;
 	BYTE *readbuffer;
+	s64 alloc_size;
 	int old_ofs, ofs;
 
 	old_pos = fd->pos;
@@ -1664,19 +1794,17 @@ static s64 ntfs_device_win32_write(struct ntfs_device *dev, const void *b,
 		return 0;
 	NDevSetDirty(dev);
 	readbuffer = (BYTE*)NULL;
+	alloc_size = 0;
 	if (!((unsigned long)b & (fd->geo_sector_size - 1)) && !old_ofs &&
 			!(count & (fd->geo_sector_size - 1)))
 		alignedbuffer = (const BYTE *)b;
 	else {
 		s64 end;
 
-		readbuffer = (BYTE *)VirtualAlloc(NULL, to_write,
-				MEM_COMMIT, PAGE_READWRITE);
-		if (!readbuffer) {
-			errno = ntfs_w32error_to_errno(GetLastError());
-			ntfs_log_trace("VirtualAlloc failed for write.\n");
+		alloc_size = to_write;
+		readbuffer = ntfs_device_win32_get_bounce(fd, alloc_size);
+		if (!readbuffer)
 			return -1;
-		}
 		/* Read first sector if start of write not sector aligned. */
 		if (ofs) {
 			i = ntfs_device_win32_pread_simple(fd,
@@ -1748,7 +1876,7 @@ static s64 ntfs_device_win32_write(struct ntfs_device *dev, const void *b,
 	fd->pos = old_pos + bw;
 write_partial:
 	if (readbuffer)
-		VirtualFree(readbuffer, 0, MEM_RELEASE);
+		ntfs_device_win32_put_bounce(fd, readbuffer, alloc_size);
 	return bw;
 write_error:
 	bw = -1;
@@ -1836,8 +1964,8 @@ static __inline__ int ntfs_win32_blksszget(struct ntfs_device *dev,int *argp)
 	DWORD bytesReturned;
 	DISK_GEOMETRY dg;
 
-	if (DeviceIoControl(fd->handle, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
-			&dg, sizeof(DISK_GEOMETRY), &bytesReturned, NULL)) {
+	if (ntfs_device_win32_io_control(fd->handle, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+			&dg, sizeof(DISK_GEOMETRY), &bytesReturned)) {
 		/* success */
 		*argp = dg.BytesPerSector;
 		return 0;
@@ -1942,6 +2070,134 @@ static s64 ntfs_device_win32_pwrite(struct ntfs_device *dev, const void *b,
 	return (put);
 }
 
+/*
+ *		Batched transfer, as overlapped requests
+ *
+ *	The segments which are sector aligned in memory and on device,
+ *	and do not span both volume and disk extents, are all submitted
+ *	before waiting for completions in order, so that the device can
+ *	work on several of them. When the first segment does not qualify,
+ *	it is transferred alone through the bounce buffers, and the
+ *	following ones are submitted by the next call from ntfs_preadv()
+ *	or ntfs_pwritev().
+ *
+ *	Returns the number of bytes transferred from the segments taken in
+ *	order, or -1 if nothing could be transferred (errno set).
+ */
+
+static s64 ntfs_device_win32_pvio(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg, BOOL write)
+{
+	OVERLAPPED ov[NTFS_MAX_IO_SEGMENTS];
+	HANDLE handle[NTFS_MAX_IO_SEGMENTS];
+	LARGE_INTEGER li;
+	win32_fd *fd;
+	s64 total;
+	s64 mask;
+	DWORD bt;
+	BOOL res;
+	BOOL done;
+	int err;
+	int n;
+	int i;
+
+	fd = (win32_fd*)dev->d_private;
+	mask = fd->geo_sector_size - 1;
+	n = 0;
+	if (!fd->ntdll) {
+		while ((n < nseg)
+		    && !((seg[n].pos | seg[n].count
+				| (s64)(ULONG_PTR)seg[n].buf) & mask)
+		    && (seg[n].count <= 0x80000000)
+		    && (write || seg[n].pos)
+		    && ((fd->vol_handle == INVALID_HANDLE_VALUE)
+			|| (seg[n].pos >= fd->geo_size)
+			|| ((seg[n].pos + seg[n].count) <= fd->geo_size)))
+			n++;
+	}
+	if (!n) {
+		if (write)
+			return (ntfs_device_win32_pwrite(dev, seg[0].buf,
+					seg[0].count, seg[0].pos));
+		else
+			return (ntfs_device_win32_pread(dev, seg[0].buf,
+					seg[0].count, seg[0].pos));
+	}
+	if (write) {
+		if (NDevReadOnly(dev)) {
+			errno = EROFS;
+			return -1;
+		}
+		NDevSetDirty(dev);
+	}
+		/* submit all the requests */
+	err = 0;
+	for (i=0; i<n; i++) {
+		li.QuadPart = seg[i].pos;
+		if ((fd->vol_handle != INVALID_HANDLE_VALUE)
+		    && (seg[i].pos < fd->geo_size))
+			handle[i] = fd->vol_handle;
+		else {
+			handle[i] = fd->handle;
+			li.QuadPart += fd->part_start;
+		}
+		memset(&ov[i], 0, sizeof(OVERLAPPED));
+		ov[i].Offset = li.LowPart;
+		ov[i].OffsetHigh = li.HighPart;
+		ov[i].hEvent = fd->event[i];
+		if (write)
+			res = WriteFile(handle[i], seg[i].buf, seg[i].count,
+					NULL, &ov[i]);
+		else
+			res = ReadFile(handle[i], seg[i].buf, seg[i].count,
+					NULL, &ov[i]);
+		if (!res && (GetLastError() != ERROR_IO_PENDING)) {
+			if (GetLastError() != ERROR_HANDLE_EOF)
+				err = ntfs_w32error_to_errno(GetLastError());
+			n = i;
+			break;
+		}
+	}
+		/*
+		 * Wait for all the submitted requests, as the buffers
+		 * must not be released while being accessed, but only
+		 * count the bytes up to the first incomplete one.
+		 */
+	total = 0;
+	done = FALSE;
+	for (i=0; i<n; i++) {
+		res = GetOverlappedResult(handle[i], &ov[i], &bt, TRUE);
+		if (!res && (GetLastError() == ERROR_HANDLE_EOF)) {
+			bt = 0;
+			res = TRUE;
+		}
+		if (!res && !err)
+			err = ntfs_w32error_to_errno(GetLastError());
+		if (!done) {
+			if (res)
+				total += bt;
+			done = !res || (bt != seg[i].count);
+		}
+	}
+	if (!total && err) {
+		errno = err;
+		total = -1;
+	}
+	return (total);
+}
+
+static s64 ntfs_device_win32_preadv(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	return (ntfs_device_win32_pvio(dev, seg, nseg, FALSE));
+}
+
+static s64 ntfs_device_win32_pwritev(struct ntfs_device *dev,
+		const struct ntfs_io_segment *seg, int nseg)
+{
+	return (ntfs_device_win32_pvio(dev, seg, nseg, TRUE));
+}
+
 struct ntfs_device_operations ntfs_device_win32_io_ops = {
 	.open		= ntfs_device_win32_open,
 	.close		= ntfs_device_win32_close,
@@ -1950,6 +2206,8 @@ struct ntfs_device_operations ntfs_device_win32_io_ops = {
 	.write		= ntfs_device_win32_write,
 	.pread		= ntfs_device_win32_pread,
 	.pwrite		= ntfs_device_win32_pwrite,
+	.preadv		= ntfs_device_win32_preadv,
+	.pwritev	= ntfs_device_win32_pwritev,
 	.sync		= ntfs_device_win32_sync,
 	.stat		= ntfs_device_win32_stat,
 	.ioctl		= ntfs_device_win32_ioctl
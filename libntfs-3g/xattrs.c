@@ -57,6 +57,8 @@
 #include "misc.h"
 #include "logging.h"
 #include "xattrs.h"
+#include "stats.h"
+#include "trace.h"
 
 #if POSIXACLS
 #if __BYTE_ORDER == __BIG_ENDIAN
@@ -95,6 +97,8 @@ static const char nf_ns_xattr_crtime_be[] = "system.ntfs_crtime_be";
 static const char nf_ns_xattr_ea[] = "system.ntfs_ea";
 static const char nf_ns_xattr_posix_access[] = "system.posix_acl_access";
 static const char nf_ns_xattr_posix_default[] = "system.posix_acl_default";
+static const char nf_ns_xattr_stats[] = "system.ntfs_stats";
+static const char nf_ns_xattr_trace[] = "system.ntfs_trace";
 
 static const char nf_ns_alt_xattr_efsinfo[] = "user.ntfs.efsinfo";
 
@@ -118,9 +122,26 @@ static struct XATTRNAME nf_ns_xattr_names[] = {
 	{ XATTR_NTFS_EA, nf_ns_xattr_ea },
 	{ XATTR_POSIX_ACC, nf_ns_xattr_posix_access },
 	{ XATTR_POSIX_DEF, nf_ns_xattr_posix_default },
+	{ XATTR_NTFS_STATS, nf_ns_xattr_stats },
+	{ XATTR_NTFS_TRACE, nf_ns_xattr_trace },
 	{ XATTR_UNMAPPED, (char*)NULL } /* terminator */
 };
 
+/*
+ *	Perfect hash of the names above, after "system.", see
+ *	system_xattr_name(). The slots designate the entries in
+ *	nf_ns_xattr_names[], and the table has to be computed again
+ *	if a name is added.
+ */
+
+#define SYSTEM_XATTR_PREFIX_LTH 7 /* strlen("system.") */
+#define SYSTEM_XATTR_HASH(s,l) (((l) + 4*(u8)(s)[6] + (u8)(s)[(l) - 1]) & 31)
+
+static const signed char nf_ns_xattr_hash[32] = {
+	0, 7, -1, 2, -1, -1, 4, 12, -1, 13, -1, -1, 11, 14, 6, -1,
+	-1, -1, -1, 3, -1, -1, 8, 15, 9, -1, 5, 10, -1, 1, -1, -1
+} ;
+
 /*
  *		Make an integer big-endian
  *
@@ -194,6 +215,33 @@ int cpu_to_le_acl(const struct POSIX_ACL *acl, size_t size,
 #endif
 #endif
 
+/*
+ *		Find a name in the system namespace
+ *
+ *	Returns the entry in nf_ns_xattr_names[], or NULL if not found
+ */
+
+static const struct XATTRNAME *system_xattr_name(const char *name)
+{
+	const struct XATTRNAME *p;
+	const char *suffix;
+	size_t lth;
+	int k;
+
+	p = (const struct XATTRNAME*)NULL;
+	if (!strncmp(name, "system.", SYSTEM_XATTR_PREFIX_LTH)) {
+		suffix = &name[SYSTEM_XATTR_PREFIX_LTH];
+		lth = strlen(suffix);
+			/* all the names have at least seven chars */
+		if (lth >= 7) {
+			k = nf_ns_xattr_hash[SYSTEM_XATTR_HASH(suffix, lth)];
+			if ((k >= 0) && !strcmp(nf_ns_xattr_names[k].name, name))
+				p = &nf_ns_xattr_names[k];
+		}
+	}
+	return (p);
+}
+
 /*
  *		Determine whether an extended attribute is mapped to
  *	internal data (original name in system namespace, or renamed)
@@ -202,18 +250,16 @@ int cpu_to_le_acl(const struct POSIX_ACL *acl, size_t size,
 enum SYSTEMXATTRS ntfs_xattr_system_type(const char *name,
 			ntfs_volume *vol)
 {
-	struct XATTRNAME *p;
+	const struct XATTRNAME *p;
 	enum SYSTEMXATTRS ret;
 #ifdef XATTR_MAPPINGS
 	const struct XATTRMAPPING *q;
 #endif /* XATTR_MAPPINGS */
 
-	p = nf_ns_xattr_names;
-	while (p->name && strcmp(p->name,name))
-		p++;
-	ret = p->xattr;
+	p = system_xattr_name(name);
+	ret = (p ? p->xattr : XATTR_UNMAPPED);
 #ifdef XATTR_MAPPINGS
-	if (!p->name && vol && vol->xattr_mapping) {
+	if (!p && vol && vol->xattr_mapping) {
 		q = vol->xattr_mapping;
 		while (q && strcmp(q->name,name))
 			q = q->next;
@@ -221,7 +267,7 @@ enum SYSTEMXATTRS ntfs_xattr_system_type(const char *name,
 			ret = q->xattr;
 	}
 #else /* XATTR_MAPPINGS */
-	if (!p->name
+	if (!p
 	    && vol
 	    && vol->efs_raw
 	    && !strcmp(nf_ns_alt_xattr_efsinfo,name))
@@ -470,6 +516,73 @@ void ntfs_xattr_free_mapping(struct XATTRMAPPING *mapping)
 
 #endif /* XATTR_MAPPINGS */
 
+/*
+ *		Get the performance counters of the volume, as a text
+ *	only available on the root directory
+ *
+ *	When only the size is requested, some room is added for the
+ *	growth of the counters until they are actually fetched.
+ *
+ *	Returns the size of the text, or negative with errno set
+ */
+
+static int ntfs_get_ntfs_stats(ntfs_inode *ni, char *value, size_t size)
+{
+	int res;
+
+	if (ni->mft_no != FILE_root) {
+		errno = ENODATA;
+		res = -errno;
+	} else {
+		if (value && size) {
+			res = ntfs_stats_report(ni->vol, value, size);
+				/* the report needs room for a final null */
+			if (res >= (int)size) {
+				errno = ERANGE;
+				res = -errno;
+			}
+		} else
+			res = ntfs_stats_report(ni->vol, (char*)NULL, 0)
+					+ NTFS_STATS_REPORT_SLACK;
+	}
+	return (res);
+}
+
+/*
+ *		Fetch the trace of device transfers of the volume
+ *	only available to root on the root directory
+ *
+ *	The records fetched are removed from the trace, so that
+ *	repeated fetches get the subsequent transfers.
+ *
+ *	Returns the size of the records, or negative with errno set
+ */
+
+static int ntfs_get_ntfs_trace(struct SECURITY_CONTEXT *scx,
+			ntfs_inode *ni, char *value, size_t size)
+{
+	int res;
+
+	if (ni->mft_no != FILE_root) {
+		errno = ENODATA;
+		res = -errno;
+	} else if (scx->uid) {
+		errno = EACCES;
+		res = -errno;
+	} else {
+		if (size > NTFS_TRACE_FETCH_MAX)
+			size = NTFS_TRACE_FETCH_MAX;
+		if (value && size)
+			res = ntfs_trace_fetch(ni->vol, value, size);
+		else
+			res = ntfs_trace_fetch(ni->vol, (char*)NULL,
+					NTFS_TRACE_FETCH_MAX);
+		if (res < 0)
+			res = -errno;
+	}
+	return (res);
+}
+
 /*
  *		Get an NTFS attribute into an extended attribute
  *
@@ -591,6 +704,12 @@ int ntfs_xattr_system_getxattr(struct SECURITY_CONTEXT *scx,
 	case XATTR_NTFS_EA :
 		res = ntfs_get_ntfs_ea(ni, value, size);
 		break;
+	case XATTR_NTFS_STATS :
+		res = ntfs_get_ntfs_stats(ni, value, size);
+		break;
+	case XATTR_NTFS_TRACE :
+		res = ntfs_get_ntfs_trace(scx, ni, value, size);
+		break;
 	default :
 		errno = EOPNOTSUPP;
 		res = -errno;
@@ -733,6 +852,16 @@ int ntfs_xattr_system_setxattr(struct SECURITY_CONTEXT *scx,
 	case XATTR_NTFS_EA :
 		res = ntfs_set_ntfs_ea(ni, value, size, flags);
 		break;
+	case XATTR_NTFS_STATS :
+			/* setting any value resets the counters */
+		if (ni->mft_no == FILE_root) {
+			ntfs_stats_reset(ni->vol);
+			res = 0;
+		} else {
+			errno = EPERM;
+			res = -errno;
+		}
+		break;
 	default :
 		errno = EOPNOTSUPP;
 		res = -errno;
@@ -761,6 +890,8 @@ int ntfs_xattr_system_removexattr(struct SECURITY_CONTEXT *scx,
 	case XATTR_NTFS_TIMES_BE :
 	case XATTR_NTFS_CRTIME :
 	case XATTR_NTFS_CRTIME_BE :
+	case XATTR_NTFS_STATS :
+	case XATTR_NTFS_TRACE :
 		res = -EPERM;
 		break;
 #if POSIXACLS
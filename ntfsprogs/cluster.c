@@ -33,8 +33,15 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "cluster.h"
+#include "clustermap.h"
 #include "utils.h"
 #include "logging.h"
 
@@ -130,3 +137,167 @@ done:
 	return result;
 }
 
+
+/*
+ *		Searching through a map of the clusters
+ */
+
+struct cluster_map_search {
+	ntfs_volume *vol;
+	cluster_cb *cb;
+	void *data;
+	ntfs_inode *inode;	/* the last inode found */
+	u64 *inodes;		/* the inodes found */
+	s64 count;
+	s64 allocated;
+	BOOL failed;
+};
+
+static int cluster_map_match(const struct CLUSTER_EXTENT *extent, void *data)
+{
+	struct cluster_map_search *search = data;
+	ntfs_attr_search_ctx *a_ctx;
+	runlist_element run;
+	ATTR_RECORD *rec;
+	u64 *inodes;
+	int res;
+
+	if (!search->inode || (search->inode->mft_no != MREF(extent->mref))) {
+		if (search->inode)
+			ntfs_inode_close(search->inode);
+		search->inode = ntfs_inode_open(search->vol,
+					MREF(extent->mref));
+		if (!search->inode) {
+			ntfs_log_perror("Couldn't open inode %llu",
+				(unsigned long long)MREF(extent->mref));
+			search->failed = TRUE;
+			return -1;
+		}
+	}
+
+	a_ctx = ntfs_attr_get_search_ctx(search->inode, NULL);
+	if (!a_ctx) {
+		search->failed = TRUE;
+		return -1;
+	}
+	while ((rec = find_attribute(AT_UNUSED, a_ctx))) {
+		if ((a_ctx->ntfs_ino->mft_no == extent->record)
+		    && (le16_to_cpu(rec->instance) == extent->instance))
+			break;
+	}
+	res = 0;
+	if (rec) {
+		run.vcn = extent->vcn;
+		run.lcn = extent->lcn;
+		run.length = extent->length;
+		res = (*search->cb)(search->inode, rec, &run, search->data);
+	} else
+		ntfs_log_error("Couldn't find attribute 0x%02x of inode %llu\n",
+				(int)le32_to_cpu(extent->type),
+				(unsigned long long)MREF(extent->mref));
+	ntfs_attr_put_search_ctx(a_ctx);
+
+	if (search->count >= search->allocated) {
+		search->allocated = 2*search->allocated + 64;
+		inodes = realloc(search->inodes,
+				search->allocated*sizeof(u64));
+		if (!inodes) {
+			ntfs_log_error("Couldn't allocate memory\n");
+			search->failed = TRUE;
+			return -1;
+		}
+		search->inodes = inodes;
+	}
+	search->inodes[search->count++] = MREF(extent->mref);
+	return res;
+}
+
+static int cluster_compare_inodes(const void *p1, const void *p2)
+{
+	u64 i1 = *(const u64*)p1;
+	u64 i2 = *(const u64*)p2;
+
+	return (i1 < i2 ? -1 : (i1 > i2 ? 1 : 0));
+}
+
+/**
+ * cluster_find_mapped - Same as cluster_find(), through a map of the clusters
+ *
+ * The matching runs are passed in the order of the clusters, rather than
+ * in the order of the inodes.
+ */
+int cluster_find_mapped(ntfs_volume *vol, const struct CLUSTER_MAP *map,
+		LCN c_begin, LCN c_end, cluster_cb *cb, void *data)
+{
+	struct cluster_map_search search;
+	s64 count, i;
+	int res;
+
+	if (!vol || !map || !cb)
+		return -1;
+
+	memset(&search, 0, sizeof(search));
+	search.vol = vol;
+	search.cb = cb;
+	search.data = data;
+	res = ntfs_cluster_map_find(map, c_begin, c_end,
+			cluster_map_match, &search);
+	if (search.inode)
+		ntfs_inode_close(search.inode);
+	if (!search.failed && (res > 0))
+		res = 1;
+	else if (!search.failed) {
+		count = 0;
+		if (search.count) {
+			qsort(search.inodes, search.count, sizeof(u64),
+					cluster_compare_inodes);
+			count = 1;
+			for (i = 1; i < search.count; i++)
+				if (search.inodes[i] != search.inodes[i - 1])
+					count++;
+		}
+		if (count > 1)
+			ntfs_log_info("* %lld inodes found\n",(long long)count);
+		else
+			ntfs_log_info("* %s inode found\n", (count ? "one" : "no"));
+		res = 0;
+	} else
+		res = -1;
+	free(search.inodes);
+	return res;
+}
+
+/**
+ * cluster_get_map - Get a map of the clusters of a volume
+ *
+ * The map is loaded from @path when it was saved there for the current
+ * state of the volume.  Otherwise it is built by a scan of the MFT, and
+ * saved to @path, if any.
+ */
+struct CLUSTER_MAP *cluster_get_map(ntfs_volume *vol, const char *path)
+{
+	struct CLUSTER_MAP *map;
+	int threads;
+
+	if (path) {
+		map = ntfs_cluster_map_load(vol, path);
+		if (map)
+			return map;
+		if ((errno != ENOENT) && (errno != ESTALE))
+			ntfs_log_perror("Couldn't load the cluster map '%s'",
+					path);
+	}
+#ifdef HAVE_UNISTD_H
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	threads = 0;
+#endif
+	map = ntfs_cluster_map_build(vol, threads);
+	if (!map) {
+		ntfs_log_perror("Couldn't map the clusters");
+		return NULL;
+	}
+	if (path && ntfs_cluster_map_save(vol, map, path))
+		ntfs_log_perror("Couldn't save the cluster map '%s'", path);
+	return map;
+}
@@ -35,5 +35,11 @@ typedef int (cluster_cb)(ntfs_inode *ino, ATTR_RECORD *attr, runlist_element *ru
 
 int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void *data);
 
+struct CLUSTER_MAP;
+
+int cluster_find_mapped(ntfs_volume *vol, const struct CLUSTER_MAP *map,
+		LCN c_begin, LCN c_end, cluster_cb *cb, void *data);
+struct CLUSTER_MAP *cluster_get_map(ntfs_volume *vol, const char *path);
+
 #endif /* _CLUSTER_H_ */
 
@@ -71,6 +71,13 @@
 #ifdef ENABLE_UUID
 #include <uuid/uuid.h>
 #endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#include <dirent.h>
 
 
 #ifdef HAVE_GETOPT_H
@@ -205,6 +212,10 @@ static long long	   g_num_bad_blocks	  = 0;		/* Number of bad clusters */
 static long long	  *g_bad_blocks		  = NULL;	/* Array of bad clusters */
 
 static struct BITMAP_ALLOCATION *g_allocation	  = NULL;	/* Head of cluster allocations */
+static BOOL		   g_zeroed		  = FALSE;	/* The device is known to read as zeroes */
+
+#define ZERO_BATCH_SIZE 1048576 /* bytes zeroed in a single write */
+#define POPULATE_BUFFER_SIZE 1048576 /* bytes copied at once when populating */
 
 /**
  * struct mkntfs_options
@@ -213,6 +224,7 @@ static struct mkntfs_options {
 	char *dev_name;			/* Name of the device, or file, to use */
 	BOOL enable_compression;	/* -C, enables compression of all files on the volume by default. */
 	BOOL quick_format;		/* -f or -Q, fast format, don't zero the volume first. */
+	BOOL discard;			/* -D, discard or zero out the device first. */
 	BOOL force;			/* -F, force fs creation. */
 	long heads;			/* -H, number of heads on device */
 	BOOL disable_indexing;		/* -I, disables indexing of file contents on the volume by default. */
@@ -226,6 +238,7 @@ static struct mkntfs_options {
 	long cluster_size;		/* -c, format with this cluster-size */
 	BOOL with_uuid;			/* -U, request setting an uuid */
 	char *label;			/* -L, volume label */
+	char *populate;			/* --populate, directory to copy */
 } opts;
 
 
@@ -247,10 +260,12 @@ static void mkntfs_usage(void)
 "Basic options:\n"
 "    -f, --fast                      Perform a quick format\n"
 "    -Q, --quick                     Perform a quick format\n"
+"    -D, --discard                   Discard the device before formatting\n"
 "    -L, --label STRING              Set the volume label\n"
 "    -C, --enable-compression        Enable compression on the volume\n"
 "    -I, --no-indexing               Disable indexing on the volume\n"
 "    -n, --no-action                 Do not write to disk\n"
+"        --populate DIR              Copy the tree DIR into the volume\n"
 "\n"
 "Advanced options:\n"
 "    -c, --cluster-size BYTES        Specify the cluster size for the volume\n"
@@ -593,10 +608,11 @@ static void mkntfs_init_options(struct mkntfs_options *opts2)
  */
 static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *opts2)
 {
-	static const char *sopt = "-c:CfFhH:IlL:np:qQs:S:TUvVz:";
+	static const char *sopt = "-c:CDfFhH:IlL:np:qQs:S:TUvVz:";
 	static const struct option lopt[] = {
 		{ "cluster-size",	required_argument,	NULL, 'c' },
 		{ "debug",		no_argument,		NULL, 'Z' },
+		{ "discard",		no_argument,		NULL, 'D' },
 		{ "enable-compression",	no_argument,		NULL, 'C' },
 		{ "fast",		no_argument,		NULL, 'f' },
 		{ "force",		no_argument,		NULL, 'F' },
@@ -608,6 +624,7 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 		{ "no-action",		no_argument,		NULL, 'n' },
 		{ "no-indexing",	no_argument,		NULL, 'I' },
 		{ "partition-start",	required_argument,	NULL, 'p' },
+		{ "populate",		required_argument,	NULL, 'P' },
 		{ "quick",		no_argument,		NULL, 'Q' },
 		{ "quiet",		no_argument,		NULL, 'q' },
 		{ "sector-size",	required_argument,	NULL, 's' },
@@ -651,6 +668,9 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 					&opts2->cluster_size))
 				err++;
 			break;
+		case 'D':
+			opts2->discard = TRUE;
+			break;
 		case 'F':
 			opts2->force = TRUE;
 			break;
@@ -683,6 +703,9 @@ static int mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *o
 		case 'n':
 			opts2->no_action = TRUE;
 			break;
+		case 'P':	/* not proposed as a short option */
+			opts2->populate = optarg;
+			break;
 		case 'p':
 			if (!mkntfs_parse_llong(optarg, "partition start",
 						&opts2->part_start_sect))
@@ -835,6 +858,16 @@ static long long mkntfs_write(struct ntfs_device *dev,
 	return total;
 }
 
+/**
+ *		Check whether a buffer only contains zeroes
+ *
+ * mkntfs_is_zero
+ */
+static BOOL mkntfs_is_zero(const u8 *buf, s64 length)
+{
+	return (!length || (!buf[0] && !memcmp(buf, buf + 1, length - 1)));
+}
+
 /**
  *		Build and write a part of the global bitmap
  *	without overflowing from the allocated buffer
@@ -852,6 +885,13 @@ static s64 mkntfs_bitmap_write(struct ntfs_device *dev,
 		partial_length = g_dynamic_buf_size;
 		/* create a partial bitmap section, and write it */
 	bitmap_build(g_dynamic_buf,offset << 3,partial_length << 3);
+		/* no need to write zeroes over a zeroed device */
+	if (g_zeroed && mkntfs_is_zero(g_dynamic_buf, partial_length)) {
+		if (dev->d_ops->seek(dev, partial_length, SEEK_CUR)
+				== (off_t)-1)
+			return (-1);
+		return (partial_length);
+	}
 	written = dev->d_ops->write(dev, g_dynamic_buf, partial_length);
 	return (written);
 }
@@ -966,7 +1006,7 @@ static s64 ntfs_rlwrite(struct ntfs_device *dev, const runlist *rl,
 			return total;
 		}
 	}
-	if (delta) {
+	if (delta && !g_zeroed) {
 		int eo;
 		char *b = ntfs_calloc(delta);
 		if (!b)
@@ -4149,6 +4189,10 @@ static BOOL mkntfs_initialize_rl_bad(void)
 
 /**
  * mkntfs_fill_device_with_zeroes -
+ *
+ * The zeroes are written by batches of ZERO_BATCH_SIZE bytes, a batch
+ * which fails being written again cluster by cluster so as to locate
+ * the bad clusters.
  */
 static BOOL mkntfs_fill_device_with_zeroes(void)
 {
@@ -4159,33 +4203,63 @@ static BOOL mkntfs_fill_device_with_zeroes(void)
 	int i;
 	ssize_t bw;
 	unsigned long long position;
+	unsigned long long next;
+	unsigned long long batch;
+	unsigned long long count;
 	float progress_inc = (float)g_vol->nr_clusters / 100;
 	u64 volume_size;
+	u8 *zeroes;
 
 	volume_size = g_vol->nr_clusters << g_vol->cluster_size_bits;
+	batch = ZERO_BATCH_SIZE >> g_vol->cluster_size_bits;
+	if (!batch)
+		batch = 1;
+	zeroes = ntfs_calloc(batch << g_vol->cluster_size_bits);
+	if (!zeroes)
+		return FALSE;
 
 	ntfs_log_progress("Initializing device with zeroes:   0%%");
+	next = 0;
 	for (position = 0; position < (unsigned long long)g_vol->nr_clusters;
-			position++) {
-		if (!(position % (int)(progress_inc+1))) {
+			position += count) {
+		if (position >= next) {
 			ntfs_log_progress("\b\b\b\b%3.0f%%", position /
 					progress_inc);
+			next = position + (int)(progress_inc+1);
 		}
-		bw = mkntfs_write(g_vol->dev, g_buf, g_vol->cluster_size);
+		count = g_vol->nr_clusters - position;
+		if (count > batch)
+			count = batch;
+		if (count > 1) {
+			bw = mkntfs_write(g_vol->dev, zeroes,
+				count << g_vol->cluster_size_bits);
+			if (bw == (ssize_t)(count << g_vol->cluster_size_bits))
+				continue;
+			/* Retry the batch cluster by cluster. */
+			g_vol->dev->d_ops->seek(g_vol->dev,
+					(off_t)position * g_vol->cluster_size,
+					SEEK_SET);
+		}
+		count = 1;
+		bw = mkntfs_write(g_vol->dev, zeroes, g_vol->cluster_size);
 		if (bw != (ssize_t)g_vol->cluster_size) {
 			if (bw != -1 || errno != EIO) {
 				ntfs_log_error("This should not happen.\n");
+				free(zeroes);
 				return FALSE;
 			}
 			if (!position) {
 				ntfs_log_error("Error: Cluster zero is bad. "
 					"Cannot create NTFS file "
 					"system.\n");
+				free(zeroes);
 				return FALSE;
 			}
 			/* Add the baddie to our bad blocks list. */
-			if (!append_to_bad_blocks(position))
+			if (!append_to_bad_blocks(position)) {
+				free(zeroes);
 				return FALSE;
+			}
 			ntfs_log_quiet("\nFound bad cluster (%lld). Adding to "
 				"list of bad blocks.\nInitializing "
 				"device with zeroes: %3.0f%%", position,
@@ -4196,6 +4270,7 @@ static BOOL mkntfs_fill_device_with_zeroes(void)
 					g_vol->cluster_size, SEEK_SET);
 		}
 	}
+	free(zeroes);
 	ntfs_log_progress("\b\b\b\b100%%");
 	position = (volume_size & (g_vol->cluster_size - 1)) /
 			opts.sector_size;
@@ -4220,6 +4295,70 @@ static BOOL mkntfs_fill_device_with_zeroes(void)
 	return TRUE;
 }
 
+/**
+ * mkntfs_discard_device - discard or zero out the device before formatting
+ *
+ * A block device is zeroed out by BLKZEROOUT, which thin provisioned devices
+ * implement by unmapping the blocks, or only discarded for a quick format.
+ * A hole is punched over the volume in a regular file.  When the device is
+ * known to read as zeroes afterwards, neither the device is filled with
+ * zeroes, nor are the zeroes of the metadata written.
+ *
+ * Failing to discard is not an error, the formatting then goes on as usual.
+ */
+static BOOL mkntfs_discard_device(void)
+{
+	struct stat sbuf;
+	u64 range[2];
+#ifdef FALLOC_FL_PUNCH_HOLE
+	int fd;
+#endif
+
+	range[0] = 0;
+	range[1] = (opts.num_sectors + 1) * opts.sector_size;
+	if (g_vol->dev->d_ops->stat(g_vol->dev, &sbuf)) {
+		ntfs_log_perror("Error getting information about %s",
+				g_vol->dev->d_name);
+		return FALSE;
+	}
+	if (S_ISBLK(sbuf.st_mode)) {
+#ifdef BLKZEROOUT
+		if (!opts.quick_format
+		    && !g_vol->dev->d_ops->ioctl(g_vol->dev,
+					BLKZEROOUT, range)) {
+			ntfs_log_verbose("Zeroed out the device.\n");
+			g_zeroed = TRUE;
+			return TRUE;
+		}
+#endif
+#ifdef BLKDISCARD
+		if (!g_vol->dev->d_ops->ioctl(g_vol->dev, BLKDISCARD, range)) {
+			ntfs_log_verbose("Discarded the device.\n");
+			return TRUE;
+		}
+#endif
+	} else if (S_ISREG(sbuf.st_mode)) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+		fd = open(opts.dev_name, O_WRONLY);
+		if (fd != -1) {
+			if (!fallocate(fd,
+				    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				    range[0], range[1])) {
+				close(fd);
+				ntfs_log_verbose("Punched a hole over the "
+						"volume.\n");
+				g_zeroed = TRUE;
+				return TRUE;
+			}
+			close(fd);
+		}
+#endif
+	}
+	ntfs_log_warning("Could not discard %s, formatting anyway.\n",
+			g_vol->dev->d_name);
+	return TRUE;
+}
+
 /**
  * mkntfs_sync_index_record
  *
@@ -4671,10 +4810,10 @@ static BOOL mkntfs_create_root_structures(void)
 				1);
 		if ((u32)(1 << -bs->clusters_per_mft_record) !=
 				g_vol->mft_record_size) {
-			free(bs);
 			ntfs_log_error("BUG: calculated clusters_per_mft_record"
 					" is wrong (= 0x%x)\n",
 					bs->clusters_per_mft_record);
+			free(bs);
 			return FALSE;
 		}
 	}
@@ -4688,11 +4827,11 @@ static BOOL mkntfs_create_root_structures(void)
 		bs->clusters_per_index_record = -g_vol->indx_record_size_bits;
 		if ((1 << -bs->clusters_per_index_record) !=
 				(s32)g_vol->indx_record_size) {
-			free(bs);
 			ntfs_log_error("BUG: calculated "
 					"clusters_per_index_record is wrong "
 					"(= 0x%x)\n",
 					bs->clusters_per_index_record);
+			free(bs);
 			return FALSE;
 		}
 	}
@@ -4959,6 +5098,313 @@ static BOOL mkntfs_create_root_structures(void)
 	return TRUE;
 }
 
+/*
+ *		Populating the new volume from a directory tree
+ *
+ *	Once the volume is created, it is mounted through the library and
+ *	the tree is copied into it without going through a mount point.
+ *	The entries of each directory are inserted in sorted order, and
+ *	the clusters of each file are allocated at once before its data
+ *	is written, so that the files are laid out contiguously in the
+ *	order of the walk. Hard links to a file already copied are made
+ *	as links to the copy.
+ */
+
+struct POPULATED {
+	dev_t dev;
+	ino_t ino;
+	u64 inum;
+} ;
+
+static struct POPULATED *g_populated = NULL;	/* files with hard links */
+static int g_populated_count = 0;
+static char *g_populate_buf = NULL;
+
+static int mkntfs_name_compare(const void *p1, const void *p2)
+{
+	return (strcmp(*(char* const*)p1, *(char* const*)p2));
+}
+
+/*
+ *		Set the times of an inode from the host file
+ */
+static void mkntfs_populate_times(ntfs_inode *ni, const struct stat *st)
+{
+	struct timespec ts;
+
+	ts.tv_nsec = 0;
+	ts.tv_sec = st->st_atime;
+	ni->last_access_time = timespec2ntfs(ts);
+	ts.tv_sec = st->st_mtime;
+	ni->last_data_change_time = timespec2ntfs(ts);
+	ni->creation_time = ni->last_data_change_time;
+	ts.tv_sec = st->st_ctime;
+	ni->last_mft_change_time = timespec2ntfs(ts);
+	ntfs_inode_mark_dirty(ni);
+}
+
+/*
+ *		Copy the data of a host file into an inode
+ */
+static BOOL mkntfs_populate_data(ntfs_inode *ni, const char *path,
+			const struct stat *st)
+{
+	ntfs_attr *na;
+	s64 pos;
+	ssize_t got;
+	BOOL ok;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		ntfs_log_perror("Could not open %s", path);
+		return FALSE;
+	}
+	ok = FALSE;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		ntfs_log_perror("Could not open the data of %s", path);
+		/* allocate all the clusters at once */
+	else if ((st->st_size > (s64)ni->vol->mft_record_size)
+	    && ntfs_attr_fallocate(na, 0, st->st_size, FALSE))
+		ntfs_log_perror("Could not allocate %lld bytes for %s",
+				(long long)st->st_size, path);
+	else {
+		ok = TRUE;
+		pos = 0;
+		while (ok && ((got = read(fd, g_populate_buf,
+				POPULATE_BUFFER_SIZE)) > 0)) {
+			if (ntfs_attr_pwrite(na, pos, got, g_populate_buf)
+					!= got) {
+				ntfs_log_perror("Could not write %s", path);
+				ok = FALSE;
+			}
+			pos += got;
+		}
+		if (ok && got) {
+			ntfs_log_perror("Could not read %s", path);
+			ok = FALSE;
+		}
+	}
+	if (na)
+		ntfs_attr_close(na);
+	close(fd);
+	return ok;
+}
+
+static BOOL mkntfs_populate_dir(ntfs_inode *dir_ni, const char *dirpath);
+
+/*
+ *		Copy a host entry into a directory
+ */
+static BOOL mkntfs_populate_entry(ntfs_inode *dir_ni, const char *path,
+			const char *name)
+{
+	struct POPULATED *linked;
+	struct stat st;
+	ntfs_inode *ni;
+	ntfschar *uname;
+	int ulen;
+	int i;
+	BOOL ok;
+#ifndef HAVE_WINDOWS_H
+	ntfschar *utarget;
+	char *target;
+	int tlen;
+#endif
+
+	uname = NULL;
+	ulen = ntfs_mbstoucs(name, &uname);
+	if ((ulen <= 0) || (ulen > NTFS_MAX_NAME_LEN)) {
+		ntfs_log_error("Bad file name %s\n", path);
+		free(uname);
+		return FALSE;
+	}
+	ok = FALSE;
+	ni = NULL;
+#ifdef HAVE_WINDOWS_H
+	if (stat(path, &st)) {
+#else
+	if (lstat(path, &st)) {
+#endif
+		ntfs_log_perror("Could not get information about %s", path);
+	} else if (S_ISDIR(st.st_mode)) {
+		ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname, ulen,
+				S_IFDIR);
+		if (ni)
+			ok = mkntfs_populate_dir(ni, path);
+	} else if (S_ISREG(st.st_mode)) {
+		linked = NULL;
+		for (i = 0; (st.st_nlink > 1) && (i < g_populated_count)
+				&& !linked; i++)
+			if ((g_populated[i].dev == st.st_dev)
+			    && (g_populated[i].ino == st.st_ino))
+				linked = &g_populated[i];
+		if (linked) {
+			ni = ntfs_inode_open(dir_ni->vol, linked->inum);
+			if (ni && ntfs_link(ni, dir_ni, uname, ulen))
+				ntfs_log_perror("Could not link %s", path);
+			else
+				ok = (ni != NULL);
+		} else {
+			ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname,
+					ulen, S_IFREG);
+			if (ni)
+				ok = mkntfs_populate_data(ni, path, &st);
+			if (ok && (st.st_nlink > 1)) {
+				linked = (struct POPULATED*)realloc(
+					g_populated, (g_populated_count + 1)
+						* sizeof(struct POPULATED));
+				if (linked) {
+					g_populated = linked;
+					linked += g_populated_count++;
+					linked->dev = st.st_dev;
+					linked->ino = st.st_ino;
+					linked->inum = ni->mft_no;
+				}
+			}
+		}
+#ifndef HAVE_WINDOWS_H
+	} else if (S_ISLNK(st.st_mode)) {
+		target = (char*)ntfs_malloc(st.st_size + 1);
+		if (target
+		    && (readlink(path, target, st.st_size + 1) == st.st_size)) {
+			target[st.st_size] = 0;
+			utarget = NULL;
+			tlen = ntfs_mbstoucs(target, &utarget);
+			if (tlen > 0)
+				ni = ntfs_create_symlink(dir_ni,
+					const_cpu_to_le32(0), uname, ulen,
+					utarget, tlen);
+			free(utarget);
+			ok = (ni != NULL);
+		} else
+			ntfs_log_perror("Could not read the link %s", path);
+		free(target);
+#endif
+	} else {
+		ntfs_log_warning("Skipping %s, unsupported file type\n",
+				path);
+		ok = TRUE;
+	}
+	if (ni) {
+		mkntfs_populate_times(ni, &st);
+		if (ntfs_inode_close_in_dir(ni, dir_ni))
+			ok = FALSE;
+	} else if (!ok)
+		ntfs_log_perror("Could not create %s", path);
+	free(uname);
+	return ok;
+}
+
+/*
+ *		Copy the entries of a host directory, in sorted order
+ */
+static BOOL mkntfs_populate_dir(ntfs_inode *dir_ni, const char *dirpath)
+{
+	struct dirent *de;
+	DIR *dir;
+	char **names;
+	char **more;
+	char *path;
+	int count;
+	int allocated;
+	int i;
+	BOOL ok;
+
+	dir = opendir(dirpath);
+	if (!dir) {
+		ntfs_log_perror("Could not open directory %s", dirpath);
+		return FALSE;
+	}
+	ok = TRUE;
+	names = NULL;
+	count = allocated = 0;
+	while (ok && (de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (count >= allocated) {
+			allocated = (allocated ? 2 * allocated : 64);
+			more = (char**)realloc(names,
+					allocated * sizeof(char*));
+			if (!more) {
+				ok = FALSE;
+				break;
+			}
+			names = more;
+		}
+		names[count] = strdup(de->d_name);
+		if (names[count])
+			count++;
+		else
+			ok = FALSE;
+	}
+	closedir(dir);
+	if (count)
+		qsort(names, count, sizeof(char*), mkntfs_name_compare);
+	for (i = 0; ok && (i < count); i++) {
+		path = (char*)ntfs_malloc(strlen(dirpath)
+					+ strlen(names[i]) + 2);
+		if (!path) {
+			ok = FALSE;
+			break;
+		}
+		sprintf(path, "%s/%s", dirpath, names[i]);
+		ntfs_log_verbose("Copying %s\n", path);
+		ok = mkntfs_populate_entry(dir_ni, path, names[i]);
+		free(path);
+	}
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	return ok;
+}
+
+/**
+ * mkntfs_populate - copy a directory tree into the new volume
+ */
+static BOOL mkntfs_populate(const char *dirpath)
+{
+	ntfs_volume *vol;
+	ntfs_inode *root;
+	struct stat st;
+	BOOL ok;
+
+	ntfs_log_quiet("Populating the volume from %s.\n", dirpath);
+	if (stat(dirpath, &st) || !S_ISDIR(st.st_mode)) {
+		ntfs_log_error("%s is not a directory.\n", dirpath);
+		return FALSE;
+	}
+	g_populate_buf = (char*)ntfs_malloc(POPULATE_BUFFER_SIZE);
+	if (!g_populate_buf)
+		return FALSE;
+	ok = FALSE;
+	vol = ntfs_mount(opts.dev_name, NTFS_MNT_NONE);
+	if (!vol || ntfs_volume_get_free_space(vol))
+		ntfs_log_perror("Could not mount the new volume");
+	if (vol) {
+		root = ntfs_inode_open(vol, FILE_root);
+		if (!root)
+			ntfs_log_perror("Could not open the root directory");
+		else {
+			ok = mkntfs_populate_dir(root, dirpath);
+			mkntfs_populate_times(root, &st);
+			if (ntfs_inode_close(root))
+				ok = FALSE;
+		}
+		if (ntfs_umount(vol, FALSE))
+			ok = FALSE;
+	}
+	free(g_populate_buf);
+	g_populate_buf = NULL;
+	free(g_populated);
+	g_populated = NULL;
+	g_populated_count = 0;
+	if (!ok)
+		ntfs_log_error("Populating the volume failed.\n");
+	return ok;
+}
+
 /**
  * mkntfs_redirect
  */
@@ -5048,8 +5494,11 @@ static int mkntfs_redirect(struct mkntfs_options *opts2)
 	/* Create runlist for $BadClus, $DATA named stream $Bad. */
 	if (!mkntfs_initialize_rl_bad())
 		goto done;
+	/* Discard the device if requested, it may then read as 0s. */
+	if (opts.discard && !opts.no_action && !mkntfs_discard_device())
+		goto done;
 	/* If not quick format, fill the device with 0s. */
-	if (!opts.quick_format) {
+	if (!opts.quick_format && !g_zeroed) {
 		if (!mkntfs_fill_device_with_zeroes())
 			goto done;
 	}
@@ -5157,11 +5606,16 @@ static int mkntfs_redirect(struct mkntfs_options *opts2)
 		ntfs_log_error("Syncing device. FAILED");
 		goto done;
 	}
-	ntfs_log_quiet("mkntfs completed successfully. Have a nice day.\n");
 	result = 0;
 done:
 	ntfs_attr_put_search_ctx(ctx);
 	mkntfs_cleanup();	/* Device is unlocked and closed here */
+	if (!result && opts.populate && !opts.no_action
+	    && !mkntfs_populate(opts.populate))
+		result = 1;
+	if (!result)
+		ntfs_log_quiet("mkntfs completed successfully. "
+				"Have a nice day.\n");
 	return result;
 }
 
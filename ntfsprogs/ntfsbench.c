@@ -0,0 +1,1263 @@
+/**
+ * ntfsbench - Part of the Linux-NTFS project.
+ *
+ * This utility measures the speed of the library routines which are
+ * the most used when accessing a volume : mst fixups, name conversions,
+ * runlist encoding and lookups, directory indexes, cluster allocation
+ * and compression. It is meant to be run on a file-backed volume
+ * created by mkntfs, so that changes to the library can be compared.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_STDDEF_H
+#include <stddef.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "dir.h"
+#include "index.h"
+#include "mst.h"
+#include "runlist.h"
+#include "lcnalloc.h"
+#include "compress.h"
+#include "security.h"
+#include "unistr.h"
+#include "stats.h"
+#include "utils.h"
+#include "misc.h"
+#include "logging.h"
+
+#define BENCH_DIR "ntfsbench.tmp"	/* created in the root directory */
+#define BENCH_COUNT 4096	/* default items per bench */
+#define BENCH_REPEAT 10		/* default passes over in-memory items */
+#define BENCH_SIZE 16		/* default MB of compressed data */
+#define BENCH_CHUNK 65536	/* bytes per compressed transfer */
+#define BENCH_MST_RECORDS 16	/* mft records used for fixups */
+
+static const char *EXEC_NAME = "ntfsbench";
+
+enum {
+	BENCH_MST = 1,
+	BENCH_UNICODE = 2,
+	BENCH_RUNLIST = 4,
+	BENCH_FINDVCN = 8,
+	BENCH_INDEX = 16,
+	BENCH_ALLOC = 32,
+	BENCH_COMPRESS = 64,
+	BENCH_ALL = 127
+} ;
+
+static const struct {
+	const char *name;
+	int bit;
+} bench_names[] = {
+	{ "mst", BENCH_MST },
+	{ "unicode", BENCH_UNICODE },
+	{ "runlist", BENCH_RUNLIST },
+	{ "findvcn", BENCH_FINDVCN },
+	{ "index", BENCH_INDEX },
+	{ "alloc", BENCH_ALLOC },
+	{ "compress", BENCH_COMPRESS },
+	{ "all", BENCH_ALL },
+} ;
+
+#define BENCH_NAMES (int)(sizeof(bench_names)/sizeof(bench_names[0]))
+
+static struct options {
+	char		*device;	/* Device/File to work with */
+	int		 benches;	/* BENCH_* to run */
+	int		 count;		/* Items per bench */
+	int		 repeat;	/* Passes over in-memory items */
+	int		 size;		/* MB of compressed data */
+	int		 force;		/* Override common sense */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+} opts;
+
+static u64 bench_seed = 0x9e3779b97f4a7c15ULL;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Measure the speed of the "
+			"library on a volume.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device\n"
+		"    -b, --bench LIST     Run the benches in LIST, separated "
+			"by commas,\n"
+		"                         among mst, unicode, runlist, "
+			"findvcn, index,\n"
+		"                         alloc and compress (default all)\n"
+		"    -n, --count NUM      Use NUM items per bench "
+			"(default %d)\n"
+		"    -r, --repeat NUM     Pass NUM times over in-memory items "
+			"(default %d)\n"
+		"    -s, --size MB        Compress MB megabytes (default %d)\n"
+		"\n"
+		"    -f, --force          Use less caution\n"
+		"    -q, --quiet          Less output\n"
+		"    -v, --verbose        More output\n"
+		"    -V, --version        Version information\n"
+		"    -h, --help           Print this help\n\n",
+		EXEC_NAME, BENCH_COUNT, BENCH_REPEAT, BENCH_SIZE);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/*
+ *		Parse a list of bench names
+ *
+ *	Returns the BENCH_* bits, or 0 if a name is unknown
+ */
+
+static int parse_benches(const char *list)
+{
+	const char *p;
+	int benches;
+	int len;
+	int i;
+
+	benches = 0;
+	p = list;
+	do {
+		len = strcspn(p, ",");
+		for (i=0; (i<BENCH_NAMES)
+			&& ((len != (int)strlen(bench_names[i].name))
+				|| strncmp(p, bench_names[i].name, len)); i++) { }
+		if (i >= BENCH_NAMES) {
+			ntfs_log_error("Unknown bench '%.*s'.\n", len, p);
+			return (0);
+		}
+		benches |= bench_names[i].bit;
+		p += len;
+	} while (*p++);
+	return (benches);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  0 Done, the program has to stop
+ *	    1 Error, one or more problems
+ *	   -1 Success, go on
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-b:fhn:qr:s:vV";
+	static const struct option lopt[] = {
+		{ "bench",	required_argument,	NULL, 'b' },
+		{ "count",	required_argument,	NULL, 'n' },
+		{ "force",	no_argument,		NULL, 'f' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "repeat",	required_argument,	NULL, 'r' },
+		{ "size",	required_argument,	NULL, 's' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "version",	no_argument,		NULL, 'V' },
+		{ NULL,		0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	char *end = NULL;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	opts.benches = BENCH_ALL;
+	opts.count = BENCH_COUNT;
+	opts.repeat = BENCH_REPEAT;
+	opts.size = BENCH_SIZE;
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.device) {
+				opts.device = argv[optind-1];
+			} else {
+				opts.device = NULL;
+				err++;
+			}
+			break;
+		case 'b':
+			opts.benches = parse_benches(optarg);
+			if (!opts.benches)
+				err++;
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'n':
+			opts.count = strtol(optarg, &end, 0);
+			if ((end && *end) || (opts.count < 2)
+			    || (opts.count > 1000000))
+				err++;
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 'r':
+			opts.repeat = strtol(optarg, &end, 0);
+			if ((end && *end) || (opts.repeat <= 0))
+				err++;
+			break;
+		case 's':
+			opts.size = strtol(optarg, &end, 0);
+			if ((end && *end) || (opts.size <= 0)
+			    || (opts.size > 4096))
+				err++;
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		case 'V':
+			ver++;
+			break;
+		default:
+			if ((optopt == 'b') || (optopt == 'n')
+			    || (optopt == 'r') || (optopt == 's'))
+				ntfs_log_error("Option '%s' requires an "
+					"argument.\n", argv[optind-1]);
+			else
+				ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind-1]);
+			err++;
+			break;
+		}
+	}
+
+	if (!help && !ver) {
+		if (opts.device == NULL) {
+			if (argc > 1)
+				ntfs_log_error("You must specify exactly one "
+					"device.\n");
+			err++;
+		}
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose"
+				" at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+		/* tri-state 0 : done, 1 : error, -1 : proceed */
+	return (err ? 1 : (help || ver ? 0 : -1));
+}
+
+/*
+ *		Pseudo-random numbers, the same for each run
+ */
+
+static u64 bench_random(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return (bench_seed);
+}
+
+/*
+ *		Print the result of a measurement
+ *
+ *	@elapsed is in microseconds, @bytes may be zero when the
+ *	throughput is not meaningful.
+ */
+
+static void report(const char *bench, const char *what, u64 ops,
+			u64 bytes, u64 elapsed)
+{
+	double seconds;
+
+	seconds = (elapsed ? elapsed : 1)/1000000.0;
+	if (bytes)
+		ntfs_log_info("%-8s %-20s %10llu ops %9.3f s %12.0f ops/s"
+			" %9.1f MB/s\n", bench, what,
+			(unsigned long long)ops, elapsed/1000000.0,
+			ops/seconds, bytes/seconds/1048576.0);
+	else
+		ntfs_log_info("%-8s %-20s %10llu ops %9.3f s %12.0f ops/s\n",
+			bench, what, (unsigned long long)ops,
+			elapsed/1000000.0, ops/seconds);
+}
+
+/*
+ *		Create an inode in a directory
+ *
+ *	Returns the inode, or NULL if failed
+ */
+
+static ntfs_inode *bench_create(ntfs_inode *dir_ni, const char *name,
+			mode_t type)
+{
+	ntfs_inode *ni;
+	ntfschar *uname;
+	int ulen;
+
+	ni = (ntfs_inode*)NULL;
+	uname = (ntfschar*)NULL;
+	ulen = ntfs_mbstoucs(name, &uname);
+	if (ulen > 0) {
+		ni = ntfs_create(dir_ni, const_cpu_to_le32(0), uname, ulen,
+				type);
+		if (!ni)
+			ntfs_log_perror("Could not create %s", name);
+	} else
+		ntfs_log_perror("Bad name %s", name);
+	free(uname);
+	return (ni);
+}
+
+/*
+ *		Create an inode in a directory, and close both of them
+ *
+ *	Returns the inode number, or zero if failed
+ */
+
+static u64 bench_make(ntfs_volume *vol, u64 dir_inum, const char *name,
+			mode_t type)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	u64 inum;
+
+	inum = 0;
+	dir_ni = ntfs_inode_open(vol, dir_inum);
+	if (dir_ni) {
+		ni = bench_create(dir_ni, name, type);
+		if (ni) {
+			inum = ni->mft_no;
+			if (ntfs_inode_close_in_dir(ni, dir_ni))
+				inum = 0;
+		}
+		if (ntfs_inode_close(dir_ni))
+			inum = 0;
+	}
+	return (inum);
+}
+
+/*
+ *		Delete an inode from a directory
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int bench_delete(ntfs_volume *vol, u64 dir_inum, u64 inum,
+			const char *name)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfschar *uname;
+	int ulen;
+	int res;
+
+	res = -1;
+	uname = (ntfschar*)NULL;
+	ulen = ntfs_mbstoucs(name, &uname);
+	if (ulen > 0) {
+		dir_ni = ntfs_inode_open(vol, dir_inum);
+		ni = ntfs_inode_open(vol, inum);
+		if (dir_ni && ni) {
+			/* ntfs_delete() closes both inodes */
+			res = ntfs_delete(vol, (const char*)NULL, ni, dir_ni,
+					uname, ulen);
+		} else {
+			if (dir_ni)
+				ntfs_inode_close(dir_ni);
+			if (ni)
+				ntfs_inode_close(ni);
+		}
+		if (res)
+			ntfs_log_perror("Could not delete %s", name);
+	}
+	free(uname);
+	return (res);
+}
+
+/*
+ *		Apply the mst fixups to copies of mft records
+ */
+
+static int bench_mst(ntfs_volume *vol)
+{
+	char *raw;
+	char *work;
+	u32 size;
+	u64 start;
+	u64 read_time;
+	u64 write_time;
+	u64 ops;
+	int records;
+	int err;
+	int i;
+	int j;
+
+	err = 1;
+	size = vol->mft_record_size;
+	raw = (char*)ntfs_malloc(BENCH_MST_RECORDS*size);
+	work = (char*)ntfs_malloc(size);
+	if (raw && work) {
+		records = 0;
+		for (i=0; i<BENCH_MST_RECORDS; i++) {
+			if ((ntfs_attr_pread(vol->mft_na, (s64)i*size, size,
+					&raw[records*size]) == size)
+			    && ntfs_is_file_record(((MFT_RECORD*)
+					&raw[records*size])->magic))
+				records++;
+		}
+		if (records) {
+			err = 0;
+			ops = 0;
+			read_time = 0;
+			write_time = 0;
+			for (i=0; (i<opts.repeat) && !err; i++) {
+				for (j=0; (j<opts.count) && !err; j++) {
+					memcpy(work, &raw[(j % records)*size],
+							size);
+					start = ntfs_stats_clock();
+					if (ntfs_mst_post_read_fixup(
+							(NTFS_RECORD*)work,
+							size))
+						err = 1;
+					read_time += ntfs_stats_clock()
+							- start;
+					start = ntfs_stats_clock();
+					if (ntfs_mst_pre_write_fixup(
+							(NTFS_RECORD*)work,
+							size))
+						err = 1;
+					ntfs_mst_post_write_fixup(
+							(NTFS_RECORD*)work);
+					write_time += ntfs_stats_clock()
+							- start;
+					ops++;
+				}
+			}
+			if (err)
+				ntfs_log_error("Bad fixups in mft record\n");
+			else {
+				report("mst", "post_read_fixup", ops, 0,
+					read_time);
+				report("mst", "pre+post_write_fixup", ops, 0,
+					write_time);
+			}
+		} else
+			ntfs_log_error("Could not read the mft records\n");
+	}
+	free(raw);
+	free(work);
+	return (err);
+}
+
+/*
+ *		Convert names to Unicode and back
+ *
+ *	Half of the names are plain ASCII, the other half have accented
+ *	and non-latin characters.
+ */
+
+static int bench_unicode(void)
+{
+	char **names;
+	ntfschar **unames;
+	int *ulens;
+	char *back;
+	u64 start;
+	u64 to_time;
+	u64 from_time;
+	u64 ops;
+	u64 bytes;
+	int err;
+	int i;
+	int j;
+
+	err = 1;
+	names = (char**)ntfs_calloc(opts.count*sizeof(char*));
+	unames = (ntfschar**)ntfs_calloc(opts.count*sizeof(ntfschar*));
+	ulens = (int*)ntfs_calloc(opts.count*sizeof(int));
+	if (names && unames && ulens) {
+		err = 0;
+		bytes = 0;
+		for (j=0; (j<opts.count) && !err; j++) {
+			names[j] = (char*)ntfs_malloc(64);
+			if (!names[j])
+				err = 1;
+			else {
+				if (j & 1)
+					snprintf(names[j], 64,
+						"R\xc3\xa9sum\xc3\xa9 "
+						"\xce\xb1\xce\xb2\xce\xb3 "
+						"\xe6\x96\x87\xe4\xbb\xb6-%06d",
+						j);
+				else
+					snprintf(names[j], 64,
+						"Document-%06d.txt", j);
+				bytes += strlen(names[j]);
+			}
+		}
+		ops = 0;
+		to_time = 0;
+		from_time = 0;
+		for (i=0; (i<opts.repeat) && !err; i++) {
+			start = ntfs_stats_clock();
+			for (j=0; (j<opts.count) && !err; j++) {
+				ulens[j] = ntfs_mbstoucs(names[j], &unames[j]);
+				if (ulens[j] <= 0)
+					err = 1;
+			}
+			to_time += ntfs_stats_clock() - start;
+			start = ntfs_stats_clock();
+			for (j=0; (j<opts.count) && !err; j++) {
+				back = (char*)NULL;
+				if ((ntfs_ucstombs(unames[j], ulens[j],
+						&back, 0) <= 0)
+				    || strcmp(back, names[j]))
+					err = 1;
+				free(back);
+			}
+			from_time += ntfs_stats_clock() - start;
+			for (j=0; j<opts.count; j++) {
+				free(unames[j]);
+				unames[j] = (ntfschar*)NULL;
+			}
+			ops += opts.count;
+		}
+		if (err)
+			ntfs_log_perror("Could not convert names");
+		else {
+			report("unicode", "mbstoucs", ops,
+				bytes*opts.repeat, to_time);
+			report("unicode", "ucstombs", ops,
+				bytes*opts.repeat, from_time);
+		}
+		for (j=0; j<opts.count; j++)
+			free(names[j]);
+	}
+	free(names);
+	free(unames);
+	free(ulens);
+	return (err);
+}
+
+/*
+ *		Encode and decode the mapping pairs of a runlist
+ *
+ *	The runlist has allocated runs of various lengths anywhere on
+ *	the volume, and some holes.
+ */
+
+static int bench_runlist(ntfs_volume *vol)
+{
+	runlist_element *rl;
+	runlist_element *drl;
+	ATTR_RECORD *attr;
+	u64 start;
+	u64 build_time;
+	u64 decompress_time;
+	VCN vcn;
+	int mpofs;
+	int mpsize;
+	int err;
+	int i;
+	int j;
+
+	err = 1;
+	attr = (ATTR_RECORD*)NULL;
+	rl = (runlist_element*)ntfs_malloc((opts.count + 1)
+				*sizeof(runlist_element));
+	if (rl) {
+		vcn = 0;
+		for (j=0; j<opts.count; j++) {
+			rl[j].vcn = vcn;
+			rl[j].length = 1 + bench_random() % 16;
+			if ((j % 4) == 3)
+				rl[j].lcn = LCN_HOLE;
+			else
+				rl[j].lcn = bench_random()
+					% (vol->nr_clusters - rl[j].length);
+			vcn += rl[j].length;
+		}
+			/* merge contiguous runs, as the decoder would do */
+		for (j=1; j<opts.count; j++)
+			if ((rl[j].lcn >= 0)
+			    && (rl[j-1].lcn >= 0)
+			    && (rl[j].lcn == rl[j-1].lcn + rl[j-1].length))
+				rl[j].lcn++;
+		rl[opts.count].vcn = vcn;
+		rl[opts.count].length = 0;
+		rl[opts.count].lcn = LCN_ENOENT;
+		mpofs = offsetof(ATTR_RECORD, compressed_size);
+		mpsize = ntfs_get_size_for_mapping_pairs(vol, rl, 0, INT_MAX);
+		if (mpsize > 0)
+			attr = (ATTR_RECORD*)ntfs_calloc(
+					(mpofs + mpsize + 7) & ~7);
+	}
+	if (attr) {
+		attr->type = AT_DATA;
+		attr->length = cpu_to_le32((mpofs + mpsize + 7) & ~7);
+		attr->non_resident = 1;
+		attr->lowest_vcn = const_cpu_to_sle64(0);
+		attr->highest_vcn = cpu_to_sle64(vcn - 1);
+		attr->mapping_pairs_offset = cpu_to_le16(mpofs);
+		attr->allocated_size = cpu_to_sle64(vcn
+					<< vol->cluster_size_bits);
+		err = 0;
+		build_time = 0;
+		decompress_time = 0;
+		for (i=0; (i<opts.repeat) && !err; i++) {
+			start = ntfs_stats_clock();
+			if ((ntfs_get_size_for_mapping_pairs(vol, rl, 0,
+					INT_MAX) != mpsize)
+			    || ntfs_mapping_pairs_build(vol, (u8*)attr + mpofs,
+					mpsize, rl, 0,
+					(const runlist_element**)NULL))
+				err = 1;
+			build_time += ntfs_stats_clock() - start;
+			start = ntfs_stats_clock();
+			drl = err ? (runlist_element*)NULL
+				: ntfs_mapping_pairs_decompress(vol, attr,
+					(runlist_element*)NULL);
+			decompress_time += ntfs_stats_clock() - start;
+			if (!drl)
+				err = 1;
+			else {
+				for (j=0; (j<=opts.count) && !err; j++)
+					if ((drl[j].vcn != rl[j].vcn)
+					    || (drl[j].length != rl[j].length)
+					    || (drl[j].lcn != rl[j].lcn))
+						err = 1;
+				free(drl);
+			}
+		}
+		if (err)
+			ntfs_log_error("Runlist not decoded as encoded\n");
+		else {
+			report("runlist", "mapping_pairs_build",
+				(u64)opts.repeat*opts.count,
+				(u64)opts.repeat*mpsize, build_time);
+			report("runlist", "mapping_pairs_decomp",
+				(u64)opts.repeat*opts.count,
+				(u64)opts.repeat*mpsize, decompress_time);
+		}
+	} else
+		ntfs_log_perror("Could not build the runlist");
+	free(attr);
+	free(rl);
+	return (err);
+}
+
+/*
+ *		Look up vcns in the runlist of a fragmented file
+ *
+ *	The file is made of single clusters separated by holes, so
+ *	that its runlist spreads over several mft records.
+ */
+
+static int bench_findvcn(ntfs_volume *vol, u64 bench_inum)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	runlist_element *rl;
+	char *cluster;
+	u64 inum;
+	u64 start;
+	u64 map_time;
+	u64 random_time;
+	u64 ops;
+	s64 runs;
+	VCN vcn;
+	int err;
+	int i;
+	int j;
+
+	err = 1;
+	inum = 0;
+	cluster = (char*)ntfs_calloc(vol->cluster_size);
+	if (cluster)
+		inum = bench_make(vol, bench_inum, "fragmented", S_IFREG);
+	ni = (inum ? ntfs_inode_open(vol, inum) : (ntfs_inode*)NULL);
+	if (ni) {
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na) {
+			err = 0;
+			for (j=0; (j<opts.count) && !err; j++) {
+				memset(cluster, j | 1, vol->cluster_size);
+				if (ntfs_attr_pwrite(na,
+						(s64)2*j*vol->cluster_size,
+						vol->cluster_size, cluster)
+						!= vol->cluster_size)
+					err = 1;
+			}
+			ntfs_attr_close(na);
+		}
+		if (ntfs_inode_close(ni))
+			err = 1;
+		if (err)
+			ntfs_log_perror("Could not write the fragmented file");
+	}
+	ni = (err ? (ntfs_inode*)NULL : ntfs_inode_open(vol, inum));
+	na = (ni ? ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0)
+			: (ntfs_attr*)NULL);
+	if (na) {
+		start = ntfs_stats_clock();
+		if (ntfs_attr_map_whole_runlist(na))
+			err = 1;
+		map_time = ntfs_stats_clock() - start;
+		runs = 0;
+		for (rl=na->rl; rl && rl->length; rl++)
+			runs++;
+		ops = 0;
+		random_time = 0;
+		for (i=0; (i<opts.repeat) && !err; i++) {
+			start = ntfs_stats_clock();
+			for (j=0; (j<opts.count) && !err; j++) {
+				vcn = bench_random() % (2*opts.count - 1);
+				rl = ntfs_attr_find_vcn(na, vcn);
+				if (!rl || (rl->vcn > vcn)
+				    || ((rl->vcn + rl->length) <= vcn)
+				    || ((rl->lcn == LCN_HOLE) != (vcn & 1)))
+					err = 1;
+			}
+			random_time += ntfs_stats_clock() - start;
+			ops += opts.count;
+		}
+		if (err)
+			ntfs_log_perror("Bad runlist lookup");
+		else {
+			report("findvcn", "map_whole_runlist", runs, 0,
+				map_time);
+			report("findvcn", "find_vcn_random", ops, 0,
+				random_time);
+		}
+		ntfs_attr_close(na);
+	} else
+		if (!err)
+			err = 1;
+	if (ni && ntfs_inode_close(ni))
+		err = 1;
+	if (inum && bench_delete(vol, bench_inum, inum, "fragmented"))
+		err = 1;
+	free(cluster);
+	return (err);
+}
+
+/*
+ *		Insert, look up and delete names in a big directory
+ */
+
+static int bench_index(ntfs_volume *vol, u64 bench_inum)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfs_index_context *icx;
+	FILE_NAME_ATTR *key;
+	ntfschar uname[NTFS_MAX_NAME_LEN];
+	u64 *inums;
+	u64 dir_inum;
+	u64 start;
+	u64 create_time;
+	u64 lookup_time;
+	u64 delete_time;
+	u64 ops;
+	char name[32];
+	int created;
+	int ulen;
+	int err;
+	int i;
+	int j;
+
+	err = 1;
+	created = 0;
+	dir_inum = 0;
+	inums = (u64*)ntfs_calloc(opts.count*sizeof(u64));
+	key = (FILE_NAME_ATTR*)ntfs_calloc(sizeof(FILE_NAME_ATTR)
+				+ NTFS_MAX_NAME_LEN*sizeof(ntfschar));
+	if (inums && key)
+		dir_inum = bench_make(vol, bench_inum, "index", S_IFDIR);
+	dir_ni = (dir_inum ? ntfs_inode_open(vol, dir_inum)
+			: (ntfs_inode*)NULL);
+	if (dir_ni) {
+		err = 0;
+			/* names are inserted in no particular order */
+		start = ntfs_stats_clock();
+		while ((created < opts.count) && !err) {
+			snprintf(name, sizeof(name), "file-%08x",
+				(unsigned int)((created*2654435761U)
+						^ 0x5bd1e995));
+			ni = bench_create(dir_ni, name, S_IFREG);
+			if (ni) {
+				inums[created++] = ni->mft_no;
+				if (ntfs_inode_close_in_dir(ni, dir_ni))
+					err = 1;
+			} else
+				err = 1;
+		}
+		create_time = ntfs_stats_clock() - start;
+		ops = 0;
+		lookup_time = 0;
+		icx = (err ? (ntfs_index_context*)NULL
+			: ntfs_index_ctx_get(dir_ni, NTFS_INDEX_I30, 4));
+		if (icx) {
+			for (i=0; (i<opts.repeat) && !err; i++) {
+				for (j=0; (j<opts.count) && !err; j++) {
+					snprintf(name, sizeof(name),
+						"file-%08x",
+						(unsigned int)(((bench_random()
+							% opts.count)
+							*2654435761U)
+							^ 0x5bd1e995));
+					ulen = ntfs_mbstoucs_buf(name, uname,
+							NTFS_MAX_NAME_LEN);
+					if (ulen > 0)
+						memcpy(key->file_name, uname,
+							ulen*sizeof(ntfschar));
+					key->file_name_length = ulen;
+					start = ntfs_stats_clock();
+					if ((ulen <= 0)
+					    || ntfs_index_lookup(key,
+						sizeof(FILE_NAME_ATTR)
+						+ ulen*sizeof(ntfschar), icx))
+						err = 1;
+					ntfs_index_ctx_reinit(icx);
+					lookup_time += ntfs_stats_clock()
+							- start;
+				}
+				ops += opts.count;
+			}
+			ntfs_index_ctx_put(icx);
+			if (err)
+				ntfs_log_perror("Could not find %s", name);
+		} else
+			err = 1;
+		if (ntfs_inode_close(dir_ni))
+			err = 1;
+		if (!err) {
+			report("index", "create", opts.count, 0, create_time);
+			report("index", "index_lookup", ops, 0, lookup_time);
+		}
+	}
+	delete_time = ntfs_stats_clock();
+	for (j=0; j<created; j++) {
+		snprintf(name, sizeof(name), "file-%08x",
+			(unsigned int)((j*2654435761U) ^ 0x5bd1e995));
+		if (bench_delete(vol, dir_inum, inums[j], name))
+			err = 1;
+	}
+	delete_time = ntfs_stats_clock() - delete_time;
+	if (!err)
+		report("index", "delete", created, 0, delete_time);
+	if (dir_inum && bench_delete(vol, bench_inum, dir_inum, "index"))
+		err = 1;
+	free(key);
+	free(inums);
+	return (err);
+}
+
+/*
+ *		Allocate clusters in a fragmented bitmap
+ *
+ *	Single clusters are allocated, and every other one is freed
+ *	before allocating runs of clusters which have to gather the
+ *	free ones.
+ */
+
+static int bench_alloc(ntfs_volume *vol)
+{
+	runlist **singles;
+	runlist **runs;
+	u64 start;
+	u64 single_time;
+	u64 run_time;
+	u64 free_time;
+	s64 fragments;
+	int nruns;
+	int err;
+	int j;
+
+	err = 1;
+	nruns = opts.count/8;
+	singles = (runlist**)ntfs_calloc(opts.count*sizeof(runlist*));
+	runs = (runlist**)ntfs_calloc((nruns + 1)*sizeof(runlist*));
+	if (singles && runs) {
+		if (vol->free_clusters < 2*opts.count)
+			ntfs_log_error("Not enough free clusters\n");
+		else
+			err = 0;
+		start = ntfs_stats_clock();
+		for (j=0; (j<opts.count) && !err; j++) {
+			singles[j] = ntfs_cluster_alloc(vol, 0, 1, -1,
+					DATA_ZONE);
+			if (!singles[j])
+				err = 1;
+		}
+		single_time = ntfs_stats_clock() - start;
+		for (j=0; (j<opts.count) && !err; j+=2) {
+			if (ntfs_cluster_free_from_rl(vol, singles[j]))
+				err = 1;
+			free(singles[j]);
+			singles[j] = (runlist*)NULL;
+		}
+		fragments = 0;
+		start = ntfs_stats_clock();
+		for (j=0; (j<nruns) && !err; j++) {
+			runs[j] = ntfs_cluster_alloc(vol, 0, 4, -1, DATA_ZONE);
+			if (!runs[j])
+				err = 1;
+		}
+		run_time = ntfs_stats_clock() - start;
+		for (j=0; (j<nruns) && runs[j]; j++)
+			fragments += (runs[j][1].length ? 2 : 1);
+		start = ntfs_stats_clock();
+		for (j=0; j<nruns; j++)
+			if (runs[j]) {
+				if (ntfs_cluster_free_from_rl(vol, runs[j]))
+					err = 1;
+				free(runs[j]);
+			}
+		for (j=0; j<opts.count; j++)
+			if (singles[j]) {
+				if (ntfs_cluster_free_from_rl(vol, singles[j]))
+					err = 1;
+				free(singles[j]);
+			}
+		free_time = ntfs_stats_clock() - start;
+		if (err)
+			ntfs_log_perror("Could not allocate clusters");
+		else {
+			report("alloc", "cluster_alloc_single", opts.count, 0,
+				single_time);
+			report("alloc", "cluster_alloc_4", nruns, 0, run_time);
+			report("alloc", "cluster_free", nruns + opts.count/2,
+				0, free_time);
+			if (opts.verbose)
+				ntfs_log_verbose("At least %lld runs of 4 were"
+					" fragmented\n", (long long)fragments
+						- nruns);
+		}
+	}
+	free(singles);
+	free(runs);
+	return (err);
+}
+
+/*
+ *		Generate compressible data
+ *
+ *	The data looks like a text of random words, so that it compresses
+ *	to about a third of its size. It only depends on its position.
+ */
+
+static void fill_text(char *buf, int size, s64 pos)
+{
+	static const char *words[] = {
+		"the ", "volume ", "cluster ", "of ", "index ", "attribute ",
+		"record ", "and ", "runlist ", "to ", "compression ", "a ",
+		"bitmap ", "in ", "file ", "directory "
+	} ;
+	u64 seed;
+	const char *w;
+	int i;
+
+	seed = pos*0x9e3779b97f4a7c15ULL + 1;
+	i = 0;
+	while (i < size) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		for (w=words[seed % 16]; *w && (i < size); w++)
+			buf[i++] = *w;
+	}
+}
+
+/*
+ *		Write and read back a compressed file
+ */
+
+static int bench_compress(ntfs_volume *vol, u64 bench_inum)
+{
+	static const char *dir_name = "compressed";
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	char *buf;
+	char *check;
+	u64 dir_inum;
+	u64 inum;
+	u64 start;
+	u64 write_time;
+	u64 read_time;
+	s64 size;
+	s64 pos;
+	s64 compressed;
+	le32 attrib;
+	int err;
+
+	err = 1;
+	inum = 0;
+	dir_inum = 0;
+	read_time = 0;
+	compressed = 0;
+	size = (s64)opts.size << 20;
+	buf = (char*)ntfs_malloc(BENCH_CHUNK);
+	check = (char*)ntfs_malloc(BENCH_CHUNK);
+	if (buf && check)
+		dir_inum = bench_make(vol, bench_inum, dir_name, S_IFDIR);
+	dir_ni = (dir_inum ? ntfs_inode_open(vol, dir_inum)
+			: (ntfs_inode*)NULL);
+	if (!dir_ni)
+		goto out;
+	attrib = dir_ni->flags | FILE_ATTR_COMPRESSED;
+	ni = (ntfs_set_ntfs_attrib(dir_ni, (const char*)&attrib,
+				sizeof(attrib), 0)
+			? (ntfs_inode*)NULL
+			: bench_create(dir_ni, "data", S_IFREG));
+	if (ni) {
+		inum = ni->mft_no;
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na && !(na->data_flags & ATTR_COMPRESSION_MASK)) {
+			ntfs_log_error("Compression is not possible on"
+				" this volume\n");
+			ntfs_attr_close(na);
+			na = (ntfs_attr*)NULL;
+		}
+		if (na) {
+			err = 0;
+			write_time = 0;
+			for (pos=0; (pos<size) && !err; pos+=BENCH_CHUNK) {
+				fill_text(buf, BENCH_CHUNK, pos);
+				start = ntfs_stats_clock();
+				if (ntfs_attr_pwrite(na, pos, BENCH_CHUNK, buf)
+						!= BENCH_CHUNK)
+					err = 1;
+				write_time += ntfs_stats_clock() - start;
+			}
+			start = ntfs_stats_clock();
+			if (ntfs_attr_pclose(na))
+				err = 1;
+			write_time += ntfs_stats_clock() - start;
+			compressed = na->compressed_size;
+			ntfs_attr_close(na);
+			if (err)
+				ntfs_log_perror("Could not write compressed"
+					" data");
+			else
+				report("compress", "compressed_write",
+					size/BENCH_CHUNK, size, write_time);
+		}
+		if (ntfs_inode_close_in_dir(ni, dir_ni))
+			err = 1;
+	}
+	if (ntfs_inode_close(dir_ni))
+		err = 1;
+	if (err)
+		goto out;
+#if CACHE_CBLOCK_SIZE
+		/* make sure the blocks are decompressed again */
+	ntfs_compressed_invalidate(vol, inum);
+#endif
+	ni = ntfs_inode_open(vol, inum);
+	na = (ni ? ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0)
+			: (ntfs_attr*)NULL);
+	if (na) {
+		for (pos=0; (pos<size) && !err; pos+=BENCH_CHUNK) {
+			start = ntfs_stats_clock();
+			if (ntfs_attr_pread(na, pos, BENCH_CHUNK, buf)
+					!= BENCH_CHUNK)
+				err = 1;
+			read_time += ntfs_stats_clock() - start;
+			fill_text(check, BENCH_CHUNK, pos);
+			if (!err && memcmp(buf, check, BENCH_CHUNK)) {
+				ntfs_log_error("Bad data read back at %lld\n",
+					(long long)pos);
+				err = 1;
+			}
+		}
+		ntfs_attr_close(na);
+	} else
+		err = 1;
+	if (ni && ntfs_inode_close(ni))
+		err = 1;
+	if (!err) {
+		report("compress", "compressed_read",
+			size/BENCH_CHUNK, size, read_time);
+		if (!opts.quiet)
+			ntfs_log_info("compress %lld bytes stored into %lld\n",
+				(long long)size, (long long)compressed);
+	}
+out:
+	if (inum && bench_delete(vol, dir_inum, inum, "data"))
+		err = 1;
+	if (dir_inum
+	    && bench_delete(vol, bench_inum, dir_inum, dir_name))
+		err = 1;
+	free(buf);
+	free(check);
+	return (err);
+}
+
+/*
+ *		Run the benches which need a directory of their own
+ */
+
+static int run_in_directory(ntfs_volume *vol)
+{
+	ntfs_inode *root_ni;
+	ntfs_inode *ni;
+	u64 bench_inum;
+	int err;
+
+	err = 1;
+	root_ni = ntfs_inode_open(vol, FILE_root);
+	if (!root_ni) {
+		ntfs_log_perror("Could not open the root directory");
+		return (err);
+	}
+	ni = ntfs_pathname_to_inode(vol, root_ni, BENCH_DIR);
+	if (ni) {
+		ntfs_log_error("%s already exists, please remove it\n",
+			BENCH_DIR);
+		ntfs_inode_close(ni);
+		ntfs_inode_close(root_ni);
+		return (err);
+	}
+	if (ntfs_inode_close(root_ni))
+		return (err);
+	bench_inum = bench_make(vol, FILE_root, BENCH_DIR, S_IFDIR);
+	if (!bench_inum)
+		return (err);
+	err = 0;
+	if (opts.benches & BENCH_FINDVCN)
+		err |= bench_findvcn(vol, bench_inum);
+	if (opts.benches & BENCH_INDEX)
+		err |= bench_index(vol, bench_inum);
+	if (opts.benches & BENCH_COMPRESS)
+		err |= bench_compress(vol, bench_inum);
+	if (bench_delete(vol, FILE_root, bench_inum, BENCH_DIR))
+		err = 1;
+	return (err);
+}
+
+/**
+ * main - Begin here
+ *
+ * Start from here.
+ *
+ * Return:  0  Success, the benches were run
+ *	    1  Error, something went wrong
+ */
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	unsigned long flags;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_outerr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+
+	flags = (opts.force ? NTFS_MNT_RECOVER : 0);
+	vol = utils_mount_volume(opts.device, flags);
+	if (!vol)
+		return (1);
+
+	res = 0;
+	if ((vol->flags & VOLUME_IS_DIRTY) && !opts.force) {
+		ntfs_log_error("The volume is dirty, use --force to run"
+			" anyway.\n");
+		res = 1;
+	}
+	NVolSetCompression(vol); /* allow compression */
+	if (!res && ntfs_volume_get_free_space(vol)) {
+		ntfs_log_perror("Could not get the free space");
+		res = 1;
+	}
+	if (!res && (opts.benches & BENCH_MST))
+		res |= bench_mst(vol);
+	if (!res && (opts.benches & BENCH_UNICODE))
+		res |= bench_unicode();
+	if (!res && (opts.benches & BENCH_RUNLIST))
+		res |= bench_runlist(vol);
+	if (!res && (opts.benches & BENCH_ALLOC))
+		res |= bench_alloc(vol);
+	if (!res && (opts.benches
+			& (BENCH_FINDVCN | BENCH_INDEX | BENCH_COMPRESS)))
+		res |= run_in_directory(vol);
+
+	if (ntfs_umount(vol, FALSE)) {
+		ntfs_log_perror("Could not unmount the volume");
+		res = 1;
+	}
+	return (res);
+}
@@ -49,6 +49,8 @@
 /* #include "version.h" */
 #include "utils.h"
 
+#define CAT_BUFSIZE 1048576 /* size of reads from the device */
+
 static const char *EXEC_NAME = "ntfscat";
 static struct options opts;
 
@@ -328,13 +330,63 @@ static int index_get_size(ntfs_inode *inode)
 	return le32_to_cpu(iroot->index_block_size);
 }
 
+/**
+ * cat_extents - output an attribute by reading its extents directly
+ *
+ * The plain extents are read from the device by big chunks, the holes
+ * are output as zeroes and the other extents as decoded by the library.
+ *
+ * Return:  0  Success
+ *	    -1 Error, which has been reported
+ */
+static int cat_extents(ntfs_volume *vol, ntfs_attr *attr, char *buffer)
+{
+	ntfs_attr_extent_ctx *ctx;
+	const char *data;
+	s64 done, count;
+	int res;
+
+	ctx = ntfs_attr_get_extent_ctx(attr, CAT_BUFSIZE);
+	if (!ctx) {
+		ntfs_log_perror("ERROR: Couldn't read file");
+		return -1;
+	}
+	while ((res = ntfs_attr_next_extent(ctx)) > 0) {
+		for (done = 0; done < ctx->length; done += count) {
+			count = min(ctx->length - done, CAT_BUFSIZE);
+			data = buffer;
+			if (ctx->flags & NTFS_EXTENT_DECODED)
+				data = ctx->data + done;
+			else if (ctx->flags & NTFS_EXTENT_HOLE)
+				memset(buffer, 0, count);
+			else if (ntfs_pread(vol->dev, ctx->device_offset + done,
+					count, buffer) != count) {
+				res = -1;
+				break;
+			}
+			if (fwrite(data, 1, count, stdout) != (size_t)count) {
+				ntfs_log_perror("ERROR: Couldn't output all "
+						"data!");
+				res = -2;
+				break;
+			}
+		}
+		if (res < 0)
+			break;
+	}
+	if (res == -1)
+		ntfs_log_perror("ERROR: Couldn't read file");
+	ntfs_attr_put_extent_ctx(ctx);
+	return (res < 0 ? -1 : 0);
+}
+
 /**
  * cat
  */
 static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 		ntfschar *name, int namelen)
 {
-	const int bufsize = 4096;
+	const int bufsize = CAT_BUFSIZE;
 	char *buffer;
 	ntfs_attr *attr;
 	s64 bytes_read, written;
@@ -360,6 +412,13 @@ static int cat(ntfs_volume *vol, ntfs_inode *inode, ATTR_TYPES type,
 	else
 		block_size = 0;
 
+	if (opts.raw || !block_size) {
+		cat_extents(vol, attr, buffer);
+		ntfs_attr_close(attr);
+		free(buffer);
+		return 0;
+	}
+
 	offset = 0;
 	for (;;) {
 		if (!opts.raw && block_size > 0) {
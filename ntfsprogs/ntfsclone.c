@@ -64,6 +64,15 @@
 #ifdef HAVE_SYS_MOUNT_H
 #include <sys/mount.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(ENABLE_ZLIB) && defined(HAVE_PTHREAD_H)
+#include <zlib.h>
+#define COMPRESSED_IMAGES 1
+#else
+#define COMPRESSED_IMAGES 0
+#endif
 
 /*
  * FIXME: ntfsclone do bad things about endians handling. Fix it and remove
@@ -163,6 +172,11 @@ static struct {
 	int preserve_timestamps;
 	int full_logfile;
 	int restore_image;
+	int compress;		/* compression level of image */
+	int threads;		/* threads for compressing the image */
+	char *base;		/* base of differential image */
+	char *store;		/* directory of the chunk store */
+	char *rescue_map;	/* map of the clusters to rescue */
 	char *output;
 	char *volume;
 #ifndef NO_STATFS
@@ -243,6 +257,36 @@ static BOOL image_is_host_endian = FALSE;
 #define NTFSCLONE_IMG_VER_MAJOR	10
 #define NTFSCLONE_IMG_VER_MINOR	1
 
+/*
+ * Compressed images are not readable by older versions, hence
+ * the major version 11, only used when the image is compressed.
+ */
+#define NTFSCLONE_IMG_VER_MAJOR_COMPRESSED	11
+#define NTFSCLONE_IMG_VER_MINOR_COMPRESSED	0
+
+#define IMAGE_INDEX_MAGIC "\0ntfsclone-index"
+#define IMAGE_CHUNK_SIZE 1048576 /* bytes compressed together in image */
+#define IMAGE_MAX_THREADS 64 /* max threads compressing the image */
+#define IMAGE_HASH_SIZE 262144 /* bytes of clusters hashed together */
+
+/*
+ * Differential images can only be restored over their base image,
+ * hence another major version.
+ */
+#define NTFSCLONE_IMG_VER_MAJOR_DELTA	12
+#define NTFSCLONE_IMG_VER_MINOR_DELTA	0
+
+/*
+ * Images in a chunk store only hold a manifest of the chunks.
+ */
+#define NTFSCLONE_IMG_VER_MAJOR_STORE	13
+#define NTFSCLONE_IMG_VER_MINOR_STORE	0
+
+#define STORE_CHUNK_SIZE 262144 /* bytes of clusters in a stored chunk */
+#define STORE_KEY_SIZE 16 /* bytes in the key of a stored chunk */
+
+enum { STORE_SKIP, STORE_CHUNK } ;
+
 enum { CMD_GAP, CMD_NEXT } ;
 
 /* All values are in little endian. */
@@ -258,7 +302,104 @@ static struct image_hdr {
 	le32 offset_to_image_data;	/* From start of image_hdr. */
 } __attribute__((__packed__)) image_hdr;
 
+struct store_hdr {
+	le32 chunk_clusters;	/* clusters per stored chunk */
+	le32 reserved;
+} __attribute__((__packed__));
+
+static struct store_hdr store_hdr;
+
 static int compare_bitmaps(struct bitmap *a, BOOL copy);
+static void lseek_to_cluster(s64 lcn);
+static s64 lseek_out(int fd, s64 pos, int mode);
+static int output_is_blkdev(const char *name);
+static void check_output_device(s64 input_size);
+#if COMPRESSED_IMAGES
+
+/*
+ *		Compressed images
+ *
+ *	In a compressed image (format 11.0), the stream of commands and
+ *	clusters of the special image format is split into chunks of
+ *	IMAGE_CHUNK_SIZE bytes, each of them compressed independently
+ *	by zlib. The chunks are followed by an empty chunk, by the
+ *	file offsets of all the chunks and by a trailer locating them,
+ *	so that a seekable image can be decompressed in any order.
+ *
+ *	Chunks are compressed and decompressed by a pool of threads,
+ *	using a ring of slots which are output and consumed in order.
+ *
+ *	The index is preceded by a table of hashes of the clusters in
+ *	use, one for each range of IMAGE_HASH_SIZE bytes, so that a
+ *	differential image (format 12.0) can later be made against the
+ *	image by storing only the ranges which have changed. The header
+ *	of a differential image is followed by a delta_hdr identifying
+ *	the base image by a hash of its table.
+ */
+
+struct chunk_hdr {
+	le32 raw_size;		/* size of data, zero for the final chunk */
+	le32 stored_size;	/* same as raw_size if not compressed */
+} __attribute__((__packed__));
+
+struct index_trailer {
+	le64 nr_chunks;
+	le64 index_offset;	/* from start of image */
+	le64 nr_hashes;
+	le64 hash_offset;	/* from start of image */
+	le32 hash_clusters;	/* clusters per hashed range */
+	le32 reserved;
+	char magic[IMAGE_MAGIC_SIZE];
+} __attribute__((__packed__));
+
+struct delta_hdr {
+	le64 base_check;	/* hash of the table of the base image */
+	le64 reserved;
+} __attribute__((__packed__));
+
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_BUSY, SLOT_DONE } ;
+
+struct chunk_slot {
+	char *raw;
+	char *stored;
+	u32 raw_size;
+	u32 stored_size;
+	s64 number;
+	int state;
+	BOOL failed;
+} ;
+
+static struct {
+	BOOL active;
+	BOOL quit;
+	BOOL indexed;		/* restoring from the index */
+	BOOL end;		/* the final chunk has been met */
+	int nr_slots;
+	int nr_threads;
+	struct chunk_slot *slots;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	s64 current;		/* chunk being filled or consumed */
+	s64 next_chunk;		/* next chunk to process by threads */
+	u32 pos;		/* position within current chunk */
+	s64 out_bytes;		/* bytes output so far */
+	s64 nr_chunks;
+	le64 *index;
+} zimage;
+
+static struct {
+	u64 *table;		/* hashes of ranges of clusters */
+	s64 count;
+	u32 clusters;		/* clusters per range */
+} image_hashes;
+
+static struct delta_hdr delta_hdr;
+
+static int zimage_write(const void *buf, int count);
+static int zimage_read(void *buf, int count);
+
+#endif /* COMPRESSED_IMAGES */
 
 #define NTFSCLONE_IMG_HEADER_SIZE_OLD	\
 		(offsetof(struct image_hdr, offset_to_image_data))
@@ -275,9 +416,64 @@ static int compare_bitmaps(struct bitmap *a, BOOL copy);
 
 #define rounded_up_division(a, b) (((a) + (b - 1)) / (b))
 
+#define CLONE_EXTENT_SIZE 4194304 /* max bytes copied at once when cloning */
+#define CLONE_CHUNK_SIZE 65536 /* max bytes of a single cluster copied at once */
+#define FANOUT_MAX_TARGETS 32 /* max outputs restored in a single pass */
+#define FANOUT_BUFFERS 8 /* extents buffered for the slowest output */
+#define RESCUE_SKIP_MIN 16 /* clusters skipped after a bad one */
+#define RESCUE_SKIP_MAX 65536 /* max clusters skipped at once */
+#define RESCUE_MAP_INTERVAL 65536 /* clusters copied between map updates */
+
 #define read_all(f, p, n)  io_all((f), (p), (n), 0)
 #define write_all(f, p, n) io_all((f), (p), (n), 1)
 
+/*
+ *		Restoring an image to several outputs in a single pass
+ *
+ *	The image is read and decoded once, and the consecutive clusters
+ *	are gathered into extents of up to CLONE_EXTENT_SIZE bytes, which
+ *	are written by a thread for each output. At most FANOUT_BUFFERS
+ *	extents are buffered, so that reading the image waits for the
+ *	slowest output. The boot sectors are extents of their own, so
+ *	that each output gets its own new serial number. An output which
+ *	fails is dropped, and the other ones are restored.
+ */
+
+struct fanout_extent {
+	char *buff;
+	s64 pos;		/* position in outputs */
+	s64 size;		/* bytes in extent */
+	u64 lcn;		/* first cluster */
+	BOOL boot;		/* a boot sector getting a new serial */
+	int users;		/* outputs which have not written it */
+} ;
+
+struct fanout_target {
+	const char *name;
+	int fd;
+	int blkdev;		/* output is a block device */
+	le64 serial;		/* new serial number */
+	u16 bytes_per_sector;	/* from the boot sector */
+	char *boot;		/* boot sector with the serial set */
+	int err;		/* errno of the first failure */
+#ifdef HAVE_PTHREAD_H
+	pthread_t thread;
+#endif
+} ;
+
+static struct {
+	int count;		/* number of outputs */
+	struct fanout_target target[FANOUT_MAX_TARGETS];
+	struct fanout_extent extent[FANOUT_BUFFERS];
+	u64 published;		/* extents ready to be written */
+#ifdef HAVE_PTHREAD_H
+	BOOL threaded;
+	BOOL quit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} fanout;
+
 __attribute__((format(printf, 1, 2)))
 static void Printf(const char *fmt, ...)
 {
@@ -358,9 +554,16 @@ static void usage(int ret)
 		"\n"
 		"    -o, --output FILE      Clone NTFS to the non-existent FILE\n"
 		"    -O, --overwrite FILE   Clone NTFS to FILE, overwriting if exists\n"
+		"                           (several outputs when restoring an image)\n"
 		"    -s, --save-image       Save to the special image format\n"
 		"    -r, --restore-image    Restore from the special image format\n"
+#if COMPRESSED_IMAGES
+		"    -z, --compress[=LEVEL] Compress the saved image (LEVEL 1-9)\n"
+		"        --threads NUM      Threads for (de)compressing the image\n"
+		"        --base IMAGE       Save or restore a differential image\n"
+#endif
 		"        --rescue           Continue after disk read errors\n"
+		"        --rescue-map FILE  Record the rescue in FILE for resuming\n"
 		"    -m, --metadata         Clone *only* metadata (for NTFS experts)\n"
 		"    -n, --no-action        Test restoring, without outputting anything\n"
 		"        --ignore-fs-check  Ignore the filesystem check result\n"
@@ -400,7 +603,7 @@ static void version(void)
 
 static void parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-dfhmno:O:qrstV";
+	static const char *sopt = "-dfhmno:O:qrstVz::";
 	static const struct option lopt[] = {
 #ifdef ENABLE_DEBUG
 		{ "debug",	      no_argument,	 NULL, 'd' },
@@ -415,16 +618,23 @@ static void parse_options(int argc, char **argv)
 		{ "restore-image",    no_argument,	 NULL, 'r' },
 		{ "ignore-fs-check",  no_argument,	 NULL, 'C' },
 		{ "rescue",           no_argument,	 NULL, 'R' },
+		{ "rescue-map",       required_argument, NULL, 'M' },
 		{ "new-serial",       no_argument,	 NULL, 'I' },
 		{ "new-half-serial",  no_argument,	 NULL, 'i' },
 		{ "full-logfile",     no_argument,	 NULL, 'l' },
 		{ "save-image",	      no_argument,	 NULL, 's' },
 		{ "preserve-timestamps",   no_argument,  NULL, 't' },
 		{ "version",	      no_argument,	 NULL, 'V' },
+		{ "compress",	      optional_argument, NULL, 'z' },
+		{ "threads",	      required_argument, NULL, 'T' },
+		{ "base",	      required_argument, NULL, 'B' },
+		{ "store",	      required_argument, NULL, 'S' },
 		{ NULL, 0, NULL, 0 }
 	};
 
 	int c;
+	int i;
+	char *end;
 
 	memset(&opt, 0, sizeof(opt));
 
@@ -467,9 +677,11 @@ static void parse_options(int argc, char **argv)
 			opt.overwrite++;
 			/* FALLTHRU */
 		case 'o':
-			if (opt.output)
+			if (fanout.count >= FANOUT_MAX_TARGETS)
 				usage(1);
-			opt.output = optarg;
+			if (!opt.output)
+				opt.output = optarg;
+			fanout.target[fanout.count++].name = optarg;
 			break;
 		case 'r':
 			opt.restore_image++;
@@ -480,6 +692,10 @@ static void parse_options(int argc, char **argv)
 		case 'R':
 			opt.rescue++;
 			break;
+		case 'M':	/* not proposed as a short option */
+			opt.rescue_map = optarg;
+			opt.rescue++;
+			break;
 		case 's':
 			opt.save_image++;
 			break;
@@ -489,6 +705,27 @@ static void parse_options(int argc, char **argv)
 		case 'V':
 			version();
 			break;
+		case 'z':
+			opt.compress = 1;
+			if (optarg) {
+				opt.compress = strtol(optarg, &end, 10);
+				if (*end || (opt.compress < 1)
+				    || (opt.compress > 9))
+					usage(1);
+			}
+			break;
+		case 'B':	/* not proposed as a short option */
+			opt.base = optarg;
+			break;
+		case 'S':	/* not proposed as a short option */
+			opt.store = optarg;
+			break;
+		case 'T':	/* not proposed as a short option */
+			opt.threads = strtol(optarg, &end, 10);
+			if (*end || (opt.threads < 1)
+			    || (opt.threads > IMAGE_MAX_THREADS))
+				usage(1);
+			break;
 		default:
 			err_printf("Unknown option '%s'.\n", argv[optind-1]);
 			usage(1);
@@ -536,46 +773,71 @@ static void parse_options(int argc, char **argv)
 	if (opt.no_action && !opt.restore_image)
 		err_exit("A restoring test requires the restore option!\n");
 
+	if (opt.base && !opt.save_image && !opt.restore_image)
+		err_exit("A base image is only used for saving or restoring "
+			 "a differential image!\n");
+
+	if (opt.base && opt.restore_image && opt.std_out)
+		err_exit("A differential image cannot be restored to "
+			 "stdout!\n");
+
+	if (opt.base && opt.save_image && !opt.compress)
+		opt.compress = 1;
+
+	if (opt.compress && !opt.save_image)
+		err_exit("Only full images can be compressed!\n");
+
+	if (opt.store && !opt.save_image && !opt.restore_image)
+		err_exit("A chunk store is only used for saving or restoring "
+			 "an image!\n");
+
+	if (opt.store && (opt.compress || opt.base))
+		err_exit("An image in a chunk store cannot be compressed "
+			 "or differential!\n");
+
+	if (opt.rescue_map
+	    && (opt.std_out || opt.save_image || opt.restore_image
+		|| opt.metadata || opt.base || opt.store))
+		err_exit("A rescue map can only be used when cloning to "
+			 "a device or a file!\n");
+
+	if (opt.rescue_map && opt.new_serial)
+		err_exit("A new serial number cannot be set when using "
+			 "a rescue map!\n");
+
+#if COMPRESSED_IMAGES
+	if (!opt.threads) {
+		opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (opt.threads < 1)
+			opt.threads = 1;
+		if (opt.threads > IMAGE_MAX_THREADS)
+			opt.threads = IMAGE_MAX_THREADS;
+	}
+#else
+	if (opt.compress || opt.threads || opt.base)
+		err_exit("Compressed images are not supported by this "
+			 "build of ntfsclone\n");
+#endif
+
 	if (opt.no_action && opt.output)
 		err_exit("A restoring test requires not defining any output!\n");
 
-	if (!opt.no_action && !opt.std_out) {
-		struct stat st;
-#ifdef HAVE_WINDOWS_H
-		BOOL blkdev = opt.output[0] && (opt.output[1] == ':')
-					&& !opt.output[2];
+	if ((fanout.count > 1)
+	    && (!opt.restore_image || opt.std_out || opt.base || opt.store))
+		err_exit("Several outputs can only be used when restoring "
+			 "a full image to devices or files!\n");
 
-		if (!blkdev && (stat(opt.output, &st) == -1)) {
-#else
-		if (stat(opt.output, &st) == -1) {
+#ifdef HAVE_WINDOWS_H
+	if (fanout.count > 1)
+		err_exit("Restoring to several outputs is not supported "
+			 "on Windows\n");
 #endif
-			if (errno != ENOENT)
-				perr_exit("Couldn't access '%s'", opt.output);
-		} else {
-			if (!opt.overwrite)
-				err_exit("Output file '%s' already exists.\n"
-					 "Use option --overwrite if you want to"
-					 " replace its content.\n", opt.output);
 
-#ifdef HAVE_WINDOWS_H
-			if (blkdev) {
-#else
-			if (S_ISBLK(st.st_mode)) {
-#endif
-				opt.blkdev_out = 1;
-				if (opt.metadata && !opt.force)
-					err_exit("Cloning only metadata to a "
-					     "block device does not usually "
-					     "make sense, aborting...\n"
-					     "If you were instructed to do "
-					     "this by a developer and/or are "
-					     "sure that this is what you want "
-					     "to do, run this utility again "
-					     "but this time add the force "
-					     "option, i.e. add '--force' to "
-					     "the command line arguments.");
-			}
-		}
+	if (!opt.no_action && !opt.std_out) {
+		for (i=1; i<fanout.count; i++)
+			fanout.target[i].blkdev
+				= output_is_blkdev(fanout.target[i].name);
+		opt.blkdev_out = output_is_blkdev(opt.output);
 	}
 
 	/*
@@ -591,18 +853,78 @@ static void parse_options(int argc, char **argv)
 	}
 }
 
+/*
+ *		Check an output file, which must not exist unless
+ *	overwriting
+ *
+ *	Returns 1 if it is a block device, 0 otherwise
+ */
+
+static int output_is_blkdev(const char *name)
+{
+	struct stat st;
+	int blkdev_out;
+#ifdef HAVE_WINDOWS_H
+	BOOL blkdev = name[0] && (name[1] == ':') && !name[2];
+#endif
+
+	blkdev_out = 0;
+#ifdef HAVE_WINDOWS_H
+	if (!blkdev && (stat(name, &st) == -1)) {
+#else
+	if (stat(name, &st) == -1) {
+#endif
+		if (errno != ENOENT)
+			perr_exit("Couldn't access '%s'", name);
+	} else {
+		if (!opt.overwrite)
+			err_exit("Output file '%s' already exists.\n"
+				 "Use option --overwrite if you want to"
+				 " replace its content.\n", name);
+
+#ifdef HAVE_WINDOWS_H
+		if (blkdev) {
+#else
+		if (S_ISBLK(st.st_mode)) {
+#endif
+			blkdev_out = 1;
+			if (opt.metadata && !opt.force)
+				err_exit("Cloning only metadata to a "
+				     "block device does not usually "
+				     "make sense, aborting...\n"
+				     "If you were instructed to do "
+				     "this by a developer and/or are "
+				     "sure that this is what you want "
+				     "to do, run this utility again "
+				     "but this time add the force "
+				     "option, i.e. add '--force' to "
+				     "the command line arguments.");
+		}
+	}
+	return (blkdev_out);
+}
+
 /*
  * Initialize the random number generator with the current
- * time, and generate a 64-bit random number for the serial
- * number
+ * time on first use, and generate a 64-bit random number
+ * for a serial number
  */
-static void generate_serial_number(void) {
+static le64 random_serial_number(void)
+{
+	static BOOL seeded = FALSE;
 	u64 sn;
 
 		/* different values for parallel processes */
-	srandom(time((time_t*)NULL) ^ (getpid() << 16));
+	if (!seeded) {
+		srandom(time((time_t*)NULL) ^ (getpid() << 16));
+		seeded = TRUE;
+	}
 	sn = ((u64)random() << 32) | ((u64)random() & 0xffffffff);
-	volume_serial_number = cpu_to_le64(sn);
+	return (cpu_to_le64(sn));
+}
+
+static void generate_serial_number(void) {
+	volume_serial_number = random_serial_number();
 }
 
 static void progress_init(struct progress_bar *p, u64 start, u64 stop, int res)
@@ -678,6 +1000,11 @@ static int io_all(void *fd, void *buf, int count, int do_write)
 			if (opt.no_action) {
 				i = count;
 			} else {
+#if COMPRESSED_IMAGES
+				if (opt.save_image && zimage.active)
+					i = zimage_write(buf, count);
+				else
+#endif
 				if (opt.save_image || opt.metadata_image)
 					i = fwrite(buf, 1, count, stream_out);
 #ifdef HAVE_WINDOWS_H
@@ -688,7 +1015,12 @@ static int io_all(void *fd, void *buf, int count, int do_write)
 				else
 					i = write(*(int *)fd, buf, count);
 			}
-		} else if (opt.restore_image)
+		}
+#if COMPRESSED_IMAGES
+		else if (opt.restore_image && zimage.active)
+			i = zimage_read(buf, count);
+#endif
+		else if (opt.restore_image)
 			i = read(*(int *)fd, buf, count);
 		else
 			i = dev->d_ops->read(dev, buf, count);
@@ -706,9 +1038,19 @@ static int io_all(void *fd, void *buf, int count, int do_write)
 }
 
 
-static void rescue_sector(void *fd, u32 bytes_per_sector, off_t pos, void *buff)
+static void mark_bad_sectors(char *buff, u32 bytes_per_sector, s64 size)
 {
 	const char badsector_magic[] = "BadSectoR";
+	s64 i;
+
+	for (i=0; i<size; i+=bytes_per_sector) {
+		memset(&buff[i], '?', bytes_per_sector);
+		memmove(&buff[i], badsector_magic, sizeof(badsector_magic));
+	}
+}
+
+static int rescue_sector(void *fd, u32 bytes_per_sector, off_t pos, void *buff)
+{
 	struct ntfs_device *dev = fd;
 
 	if (opt.restore_image) {
@@ -723,9 +1065,10 @@ static void rescue_sector(void *fd, u32 bytes_per_sector, off_t pos, void *buff)
 	if (read_all(fd, buff, bytes_per_sector) == -1) {
 		Printf("WARNING: Can't read sector at %llu, lost data.\n",
 			(unsigned long long)pos);
-		memset(buff, '?', bytes_per_sector);
-		memmove(buff, badsector_magic, sizeof(badsector_magic));
+		mark_bad_sectors(buff, bytes_per_sector, bytes_per_sector);
+		return (-1);
 	}
+	return (0);
 }
 
 /*
@@ -755,182 +1098,1278 @@ static void read_rescue(void *fd, char *buff, u32 csize, u32 bytes_per_sector,
 	}
 }
 
-static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
+/*
+ *		Report a write failure
+ */
+
+static void write_failed(void)
 {
-	char *buff;
-	/* vol is NULL if opt.restore_image is set */
-	s32 csize = le32_to_cpu(image_hdr.cluster_size);
-	BOOL backup_bootsector;
-	void *fd = (void *)&fd_in;
-	off_t rescue_pos;
-	NTFS_BOOT_SECTOR *bs;
-	le64 mask;
-	static u16 bytes_per_sector = NTFS_SECTOR_SIZE;
+#ifndef NO_STATFS
+	int err = errno;
+	perr_printf("Write failed");
+	if (err == EIO && opt.stfs.f_type == 0x517b)
+		Printf("Apparently you tried to clone to a remote "
+		       "Windows computer but they don't\nhave "
+		       "efficient sparse file handling by default. "
+		       "Please try a different method.\n");
+	exit(1);
+#else
+	perr_printf("Write failed");
+#endif
+}
 
-	if (!opt.restore_image) {
-		csize = vol->cluster_size;
-		bytes_per_sector = vol->sector_size;
-		fd = vol->dev;
-	}
+#if COMPRESSED_IMAGES
 
-	rescue_pos = (off_t)(rescue_lcn * csize);
-	buff = (char*)ntfs_malloc(csize);
-	if (!buff)
-		err_exit("Not enough memory");
+/*
+ *		Compressing and decompressing image chunks
+ */
 
-		/* possible partial cluster holding the backup boot sector */
-	backup_bootsector = (lcn + 1)*csize >= full_device_size;
-	if (backup_bootsector) {
-		csize = full_device_size - lcn*csize;
-		if (csize < 0) {
-			err_exit("Corrupted input, copy aborted");
-		}
+static void zimage_output(const void *buf, size_t count)
+{
+	if (fwrite(buf, 1, count, stream_out) != count)
+		write_failed();
+	zimage.out_bytes += count;
+}
+
+static void *compress_worker(void *unused __attribute__((unused)))
+{
+	struct chunk_slot *slot;
+	uLongf size;
+
+	pthread_mutex_lock(&zimage.lock);
+	while (!zimage.quit) {
+		slot = &zimage.slots[zimage.next_chunk % zimage.nr_slots];
+		if ((slot->state == SLOT_QUEUED)
+		    && (slot->number == zimage.next_chunk)) {
+			zimage.next_chunk++;
+			slot->state = SLOT_BUSY;
+			pthread_mutex_unlock(&zimage.lock);
+			size = compressBound(IMAGE_CHUNK_SIZE);
+			if ((compress2((Bytef*)slot->stored, &size,
+					(Bytef*)slot->raw, slot->raw_size,
+					opt.compress) != Z_OK)
+			    || (size >= slot->raw_size)) {
+				/* store uncompressible data as is */
+				memcpy(slot->stored, slot->raw,
+						slot->raw_size);
+				size = slot->raw_size;
+			}
+			slot->stored_size = size;
+			pthread_mutex_lock(&zimage.lock);
+			slot->state = SLOT_DONE;
+			pthread_cond_broadcast(&zimage.cond);
+		} else
+			pthread_cond_wait(&zimage.cond, &zimage.lock);
 	}
+	pthread_mutex_unlock(&zimage.lock);
+	return ((void*)NULL);
+}
 
-// need reading when not about to write ?
-	if (read_all(fd, buff, csize) == -1) {
+/*
+ *		Allocate the slots and start the threads
+ */
 
-		if (errno != EIO) {
-			if (!errno && opt.restore_image)
-				err_exit("Short image file...\n");
-			else
-				perr_exit("read_all");
-		}
-		else if (rescue){
-			s32 i;
-			for (i = 0; i < csize; i += bytes_per_sector)
-				rescue_sector(fd, bytes_per_sector,
-						rescue_pos + i, buff + i);
-		} else {
-			Printf("%s", bad_sectors_warning_msg);
-			err_exit("Disk is faulty, can't make full backup!");
-		}
-	}
+static void zimage_start(void *(*worker)(void*))
+{
+	int i;
 
-		/* Set the new serial number if requested */
-	if (opt.new_serial
-	    && !opt.save_image
-	    && (!lcn || backup_bootsector)) {
-			/*
-			 * For updating the backup boot sector, we need to
-			 * know the sector size, but this is not recorded
-			 * in the image header, so we collect it on the fly
-			 * while reading the first boot sector.
-			 */
-		if (!lcn) {
-			bs = (NTFS_BOOT_SECTOR*)buff;
-			bytes_per_sector = le16_to_cpu(bs->bpb.bytes_per_sector);
-			if ((bytes_per_sector > csize)
-			    || (bytes_per_sector < NTFS_SECTOR_SIZE))
-				bytes_per_sector = NTFS_SECTOR_SIZE;
-		} else
-			bs = (NTFS_BOOT_SECTOR*)(buff
-						+ csize - bytes_per_sector);
-		if (opt.new_serial & 2)
-			bs->volume_serial_number = volume_serial_number;
-		else {
-			mask = const_cpu_to_le64(~0x0ffffffffULL);
-			bs->volume_serial_number
-			    = (volume_serial_number & mask)
-				| (bs->volume_serial_number & ~mask);
-		}
-			/* Show the new full serial after merging */
-		if (!lcn)
-			Printf("New serial number      : 0x%llx\n",
-				(long long)le64_to_cpu(
-						bs->volume_serial_number));
+	zimage.nr_threads = opt.threads;
+	zimage.nr_slots = 2*opt.threads;
+	zimage.slots = (struct chunk_slot*)ntfs_calloc(zimage.nr_slots
+					* sizeof(struct chunk_slot));
+	zimage.threads = (pthread_t*)ntfs_calloc(zimage.nr_threads
+					* sizeof(pthread_t));
+	if (!zimage.slots || !zimage.threads)
+		err_exit("Not enough memory");
+	for (i=0; i<zimage.nr_slots; i++) {
+		zimage.slots[i].raw = (char*)ntfs_malloc(IMAGE_CHUNK_SIZE);
+		zimage.slots[i].stored = (char*)ntfs_malloc(
+					compressBound(IMAGE_CHUNK_SIZE));
+		if (!zimage.slots[i].raw || !zimage.slots[i].stored)
+			err_exit("Not enough memory");
+		zimage.slots[i].number = -1;
 	}
+	zimage.quit = FALSE;
+	zimage.current = 0;
+	zimage.next_chunk = 0;
+	zimage.pos = 0;
+	if (pthread_mutex_init(&zimage.lock, NULL)
+	    || pthread_cond_init(&zimage.cond, NULL))
+		err_exit("Could not initialize the threads");
+	for (i=0; i<zimage.nr_threads; i++)
+		if (pthread_create(&zimage.threads[i], NULL, worker, NULL))
+			err_exit("Could not start the threads");
+	zimage.active = TRUE;
+}
 
-	if (opt.save_image || (opt.metadata_image && wipe)) {
-		char cmd = CMD_NEXT;
-		if (write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
-			perr_exit("write_all");
-	}
+static void zimage_stop(void)
+{
+	int i;
 
-	if ((!opt.metadata_image || wipe)
-	    && (write_all(&fd_out, buff, csize) == -1)) {
-#ifndef NO_STATFS
-		int err = errno;
-		perr_printf("Write failed");
-		if (err == EIO && opt.stfs.f_type == 0x517b)
-			Printf("Apparently you tried to clone to a remote "
-			       "Windows computer but they don't\nhave "
-			       "efficient sparse file handling by default. "
-			       "Please try a different method.\n");
-		exit(1);
-#else
-		perr_printf("Write failed");
-#endif
+	pthread_mutex_lock(&zimage.lock);
+	zimage.quit = TRUE;
+	pthread_cond_broadcast(&zimage.cond);
+	pthread_mutex_unlock(&zimage.lock);
+	for (i=0; i<zimage.nr_threads; i++)
+		pthread_join(zimage.threads[i], NULL);
+	pthread_cond_destroy(&zimage.cond);
+	pthread_mutex_destroy(&zimage.lock);
+	for (i=0; i<zimage.nr_slots; i++) {
+		free(zimage.slots[i].raw);
+		free(zimage.slots[i].stored);
 	}
-	free(buff);
+	free(zimage.slots);
+	free(zimage.threads);
+	free(zimage.index);
+	zimage.index = (le64*)NULL;
+	zimage.active = FALSE;
 }
 
-static s64 lseek_out(int fd, s64 pos, int mode)
-{
-	s64 ret;
+/*
+ *		Output a compressed chunk, waiting for it to be ready
+ *
+ *	Must be called with the lock held
+ */
 
-	if (dev_out)
-		ret = (dev_out->d_ops->seek)(dev_out, pos, mode);
-	else
-		ret = lseek(fd, pos, mode);
-	return (ret);
+static void zimage_output_chunk(struct chunk_slot *slot)
+{
+	struct chunk_hdr hdr;
+	le64 *index;
+
+	while (slot->state != SLOT_DONE)
+		pthread_cond_wait(&zimage.cond, &zimage.lock);
+	if (!(slot->number & 1023)) {
+		index = (le64*)realloc(zimage.index,
+				(slot->number + 1024)*sizeof(le64));
+		if (!index)
+			err_exit("Not enough memory");
+		zimage.index = index;
+	}
+	zimage.index[slot->number] = cpu_to_le64(zimage.out_bytes);
+	hdr.raw_size = cpu_to_le32(slot->raw_size);
+	hdr.stored_size = cpu_to_le32(slot->stored_size);
+	zimage_output(&hdr, sizeof(hdr));
+	zimage_output(slot->stored, slot->stored_size);
+	zimage.nr_chunks = slot->number + 1;
+	slot->state = SLOT_FREE;
 }
 
-static void lseek_to_cluster(s64 lcn)
+/*
+ *		Queue the current chunk for compression
+ */
+
+static void zimage_queue_chunk(void)
 {
-	off_t pos;
+	struct chunk_slot *slot;
+
+	pthread_mutex_lock(&zimage.lock);
+	slot = &zimage.slots[zimage.current % zimage.nr_slots];
+	slot->raw_size = zimage.pos;
+	slot->number = zimage.current;
+	slot->state = SLOT_QUEUED;
+	pthread_cond_broadcast(&zimage.cond);
+	zimage.current++;
+	zimage.pos = 0;
+		/* output the chunk previously held by the next slot */
+	slot = &zimage.slots[zimage.current % zimage.nr_slots];
+	if (slot->state != SLOT_FREE)
+		zimage_output_chunk(slot);
+	pthread_mutex_unlock(&zimage.lock);
+}
 
-	pos = (off_t)(lcn * vol->cluster_size);
+static int zimage_write(const void *buf, int count)
+{
+	struct chunk_slot *slot;
+	int n;
+
+	slot = &zimage.slots[zimage.current % zimage.nr_slots];
+	n = IMAGE_CHUNK_SIZE - zimage.pos;
+	if (n > count)
+		n = count;
+	memcpy(&slot->raw[zimage.pos], buf, n);
+	zimage.pos += n;
+	if (zimage.pos >= IMAGE_CHUNK_SIZE)
+		zimage_queue_chunk();
+	return (n);
+}
 
-	if (vol->dev->d_ops->seek(vol->dev, pos, SEEK_SET) == (off_t)-1)
-		perr_exit("lseek input");
+/*
+ *		Hash some data, as little endian 64-bit words
+ */
 
-	if (opt.std_out || opt.save_image || opt.metadata_image)
-		return;
+static u64 hash_data(u64 h, const void *buf, u32 size)
+{
+	const le64 *p;
+	u32 i;
 
-	if (lseek_out(fd_out, pos, SEEK_SET) == (off_t)-1)
-			perr_exit("lseek output");
+	p = (const le64*)buf;
+	for (i=0; i<(size >> 3); i++) {
+		h = (h ^ le64_to_cpu(p[i])) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	return (h);
 }
 
-static void gap_to_cluster(s64 gap)
-{
-	sle64 count;
-	char buf[1 + sizeof(count)];
+/*
+ *		Merge a cluster into the hash of its range
+ *
+ *	Clusters must be merged in increasing order, and the partial
+ *	cluster holding the backup boot sector is ignored. A cluster may
+ *	be merged by parts of a multiple of 8 bytes, in increasing order
+ *	of their offset @ofs in the cluster.
+ */
 
-	if (gap) {
-		count = cpu_to_sle64(gap);
-		buf[0] = CMD_GAP;
-		memcpy(&buf[1], &count, sizeof(count));
-		if (write_all(&fd_out, buf, sizeof(buf)) == -1)
-			perr_exit("write_all");
+static void hash_cluster(s64 lcn, u32 ofs, const char *buf, u32 size)
+{
+	u64 *ph;
+
+	if (image_hashes.table
+	    && (lcn < sle64_to_cpu(image_hdr.nr_clusters))) {
+		ph = &image_hashes.table[lcn / image_hashes.clusters];
+		if (!ofs)
+			*ph ^= lcn * 0x9e3779b97f4a7c15ULL;
+		*ph = hash_data(*ph, buf, size);
 	}
 }
 
-static void image_skip_clusters(s64 count)
+/*
+ *		Start compressing an image, the header has been output
+ */
+
+static void start_image_compression(void)
 {
-	if (opt.save_image && count > 0) {
-		sle64 count_buf;
-		char buff[1 + sizeof(count)];
+	zimage.out_bytes = le32_to_cpu(image_hdr.offset_to_image_data);
+	zimage.nr_chunks = 0;
+	image_hashes.clusters = IMAGE_HASH_SIZE/vol->cluster_size;
+	if (!image_hashes.clusters)
+		image_hashes.clusters = 1;
+	image_hashes.count = vol->nr_clusters/image_hashes.clusters + 1;
+	image_hashes.table = (u64*)ntfs_calloc(image_hashes.count
+					* sizeof(u64));
+	if (!image_hashes.table)
+		err_exit("Not enough memory");
+	zimage_start(compress_worker);
+}
 
-		buff[0] = CMD_GAP;
-		count_buf = cpu_to_sle64(count);
-		memcpy(buff + 1, &count_buf, sizeof(count_buf));
+/*
+ *		Output the pending chunks, the final chunk and the index
+ */
 
-		if (write_all(&fd_out, buff, sizeof(buff)) == -1)
-			perr_exit("write_all");
+static void finish_image_compression(void)
+{
+	struct chunk_slot *slot;
+	struct chunk_hdr hdr;
+	struct index_trailer trailer;
+	s64 k;
+
+	if (zimage.pos)
+		zimage_queue_chunk();
+	pthread_mutex_lock(&zimage.lock);
+	for (k=zimage.current - zimage.nr_slots; k<zimage.current; k++) {
+		slot = &zimage.slots[(k + zimage.nr_slots) % zimage.nr_slots];
+		if ((k >= 0) && (slot->state != SLOT_FREE))
+			zimage_output_chunk(slot);
 	}
+	pthread_mutex_unlock(&zimage.lock);
+	hdr.raw_size = const_cpu_to_le32(0);
+	hdr.stored_size = const_cpu_to_le32(0);
+	zimage_output(&hdr, sizeof(hdr));
+	for (k=0; k<image_hashes.count; k++)
+		*(le64*)&image_hashes.table[k]
+			= cpu_to_le64(image_hashes.table[k]);
+	trailer.nr_hashes = cpu_to_le64(image_hashes.count);
+	trailer.hash_offset = cpu_to_le64(zimage.out_bytes);
+	trailer.hash_clusters = cpu_to_le32(image_hashes.clusters);
+	trailer.reserved = const_cpu_to_le32(0);
+	zimage_output(image_hashes.table, image_hashes.count*sizeof(u64));
+	free(image_hashes.table);
+	image_hashes.table = (u64*)NULL;
+	trailer.nr_chunks = cpu_to_le64(zimage.nr_chunks);
+	trailer.index_offset = cpu_to_le64(zimage.out_bytes);
+	memcpy(trailer.magic, IMAGE_INDEX_MAGIC, IMAGE_MAGIC_SIZE);
+	if (zimage.nr_chunks)
+		zimage_output(zimage.index, zimage.nr_chunks*sizeof(le64));
+	zimage_output(&trailer, sizeof(trailer));
+	zimage_stop();
 }
 
-static void write_image_hdr(void)
+static int zimage_pread(int fd, void *buf, int count, s64 pos)
 {
-	char alignment[IMAGE_HDR_ALIGN];
+	int n;
 
-	if (opt.save_image || opt.metadata_image) {
-		int alignsize = le32_to_cpu(image_hdr.offset_to_image_data)
+	while (count > 0) {
+		n = pread(fd, buf, count, pos);
+		if ((n < 0) && (errno != EINTR))
+			return (-1);
+		if (!n) {
+			errno = EIO;
+			return (-1);
+		}
+		if (n > 0) {
+			count -= n;
+			pos += n;
+			buf = (char*)buf + n;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Read the table of hashes of a base image
+ *
+ *	Returns the table, and the hash of the table which identifies
+ *	the base image.
+ */
+
+static u64 *read_base_hashes(const char *name, struct image_hdr *hdr,
+			u64 *check, s64 *count, u32 *clusters)
+{
+	struct index_trailer trailer;
+	struct stat st;
+	u64 *table;
+	s64 offset;
+	s64 i;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		perr_exit("Could not open base image '%s'", name);
+	if (fstat(fd, &st)
+	    || !S_ISREG(st.st_mode)
+	    || (st.st_size < (off_t)(sizeof(*hdr) + sizeof(trailer)))
+	    || zimage_pread(fd, hdr, sizeof(*hdr), 0)
+	    || memcmp(hdr->magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE)
+	    || (hdr->major_ver != NTFSCLONE_IMG_VER_MAJOR_COMPRESSED)
+	    || zimage_pread(fd, &trailer, sizeof(trailer),
+				st.st_size - sizeof(trailer))
+	    || memcmp(trailer.magic, IMAGE_INDEX_MAGIC, IMAGE_MAGIC_SIZE))
+		err_exit("The base image '%s' is not a compressed image\n",
+				name);
+	*count = le64_to_cpu(trailer.nr_hashes);
+	*clusters = le32_to_cpu(trailer.hash_clusters);
+	offset = le64_to_cpu(trailer.hash_offset);
+	if ((*count <= 0)
+	    || (offset < 0)
+	    || ((offset + *count*(s64)sizeof(le64))
+			!= (s64)le64_to_cpu(trailer.index_offset)))
+		err_exit("The base image '%s' has a bad hash table\n", name);
+	table = (u64*)ntfs_malloc(*count*sizeof(u64));
+	if (!table)
+		err_exit("Not enough memory");
+	if (zimage_pread(fd, table, *count*sizeof(u64), offset))
+		perr_exit("Could not read base image '%s'", name);
+	close(fd);
+	*check = hash_data(0, table, *count*sizeof(u64));
+	for (i=0; i<*count; i++)
+		table[i] = le64_to_cpu(*(le64*)&table[i]);
+	return (table);
+}
+
+static int zimage_sread(void *buf, int count)
+{
+	int n;
+
+	while (count > 0) {
+		n = read(fd_in, buf, count);
+		if ((n < 0) && (errno != EINTR))
+			return (-1);
+		if (!n) {
+			errno = EIO;
+			return (-1);
+		}
+		if (n > 0) {
+			count -= n;
+			buf = (char*)buf + n;
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Fetch a chunk from the image
+ *
+ *	When the index is not available, the chunks are read in
+ *	sequence, which requires the lock to be held.
+ */
+
+static BOOL zimage_fetch(struct chunk_slot *slot)
+{
+	struct chunk_hdr hdr;
+	s64 offset;
+	BOOL ok;
+
+	if (zimage.indexed) {
+		offset = le64_to_cpu(zimage.index[slot->number]);
+		ok = !zimage_pread(fd_in, &hdr, sizeof(hdr), offset);
+	} else {
+		offset = 0;
+		ok = !zimage_sread(&hdr, sizeof(hdr));
+	}
+	if (ok) {
+		slot->raw_size = le32_to_cpu(hdr.raw_size);
+		slot->stored_size = le32_to_cpu(hdr.stored_size);
+		ok = (slot->raw_size <= IMAGE_CHUNK_SIZE)
+			&& (slot->stored_size
+				<= compressBound(IMAGE_CHUNK_SIZE));
+	}
+	if (ok) {
+		if (zimage.indexed)
+			ok = !zimage_pread(fd_in, slot->stored,
+					slot->stored_size,
+					offset + sizeof(hdr));
+		else
+			ok = !zimage_sread(slot->stored, slot->stored_size);
+	}
+	return (ok);
+}
+
+static void *decompress_worker(void *unused __attribute__((unused)))
+{
+	struct chunk_slot *slot;
+	BOOL ok;
+	uLongf size;
+
+	pthread_mutex_lock(&zimage.lock);
+	while (!zimage.quit) {
+		slot = &zimage.slots[zimage.next_chunk % zimage.nr_slots];
+		if (!zimage.end
+		    && (slot->state == SLOT_FREE)
+		    && (!zimage.indexed
+			|| (zimage.next_chunk < zimage.nr_chunks))) {
+			slot->number = zimage.next_chunk++;
+			slot->state = SLOT_BUSY;
+			if (zimage.indexed) {
+				pthread_mutex_unlock(&zimage.lock);
+				ok = zimage_fetch(slot);
+			} else {
+				ok = zimage_fetch(slot);
+				if (!ok || !slot->raw_size)
+					zimage.end = TRUE;
+				pthread_mutex_unlock(&zimage.lock);
+			}
+			if (ok && (slot->stored_size != slot->raw_size)) {
+				size = slot->raw_size;
+				ok = (uncompress((Bytef*)slot->raw, &size,
+					(Bytef*)slot->stored,
+					slot->stored_size) == Z_OK)
+				    && (size == slot->raw_size);
+			} else
+				if (ok)
+					memcpy(slot->raw, slot->stored,
+						slot->raw_size);
+			slot->failed = !ok;
+			pthread_mutex_lock(&zimage.lock);
+			slot->state = SLOT_DONE;
+			pthread_cond_broadcast(&zimage.cond);
+		} else
+			pthread_cond_wait(&zimage.cond, &zimage.lock);
+	}
+	pthread_mutex_unlock(&zimage.lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Get the index of a compressed image, if it is seekable
+ */
+
+static void zimage_get_index(void)
+{
+	struct stat st;
+	struct index_trailer trailer;
+	s64 offset;
+	s64 count;
+
+	zimage.indexed = FALSE;
+	if (!fstat(fd_in, &st)
+	    && S_ISREG(st.st_mode)
+	    && (st.st_size >= (off_t)sizeof(trailer))
+	    && !zimage_pread(fd_in, &trailer, sizeof(trailer),
+				st.st_size - sizeof(trailer))
+	    && !memcmp(trailer.magic, IMAGE_INDEX_MAGIC, IMAGE_MAGIC_SIZE)) {
+		count = le64_to_cpu(trailer.nr_chunks);
+		offset = le64_to_cpu(trailer.index_offset);
+		if ((count >= 0)
+		    && (offset >= 0)
+		    && ((offset + count*(s64)sizeof(le64) + (s64)sizeof(trailer))
+				== st.st_size)) {
+			zimage.index = (le64*)ntfs_malloc(
+					(count + 1)*sizeof(le64));
+			if (zimage.index
+			    && !zimage_pread(fd_in, zimage.index,
+					count*sizeof(le64), offset)) {
+				zimage.nr_chunks = count;
+				zimage.indexed = TRUE;
+			}
+		}
+	}
+}
+
+/*
+ *		Start decompressing an image, the header has been read
+ */
+
+static void start_image_decompression(void)
+{
+	zimage.end = FALSE;
+	zimage.nr_chunks = 0;
+	zimage_get_index();
+	zimage_start(decompress_worker);
+}
+
+static int zimage_read(void *buf, int count)
+{
+	struct chunk_slot *slot;
+	int n;
+
+	if (zimage.indexed && (zimage.current >= zimage.nr_chunks))
+		return (0);
+	slot = &zimage.slots[zimage.current % zimage.nr_slots];
+	pthread_mutex_lock(&zimage.lock);
+	while ((slot->state != SLOT_DONE)
+			|| (slot->number != zimage.current))
+		pthread_cond_wait(&zimage.cond, &zimage.lock);
+	pthread_mutex_unlock(&zimage.lock);
+	if (slot->failed)
+		err_exit("Corrupted or truncated compressed image\n");
+	n = slot->raw_size - zimage.pos;
+	if (n > count)
+		n = count;
+	memcpy(buf, &slot->raw[zimage.pos], n);
+	zimage.pos += n;
+	if (zimage.pos >= slot->raw_size) {
+		if (slot->raw_size) {
+			pthread_mutex_lock(&zimage.lock);
+			slot->state = SLOT_FREE;
+			zimage.current++;
+			zimage.pos = 0;
+			pthread_cond_broadcast(&zimage.cond);
+			pthread_mutex_unlock(&zimage.lock);
+		}
+	}
+	return (n);
+}
+
+#endif /* COMPRESSED_IMAGES */
+
+/*
+ *		Set the new serial number into a boot sector
+ *
+ *	This is either the first cluster, or the partial cluster
+ *	holding the backup boot sector at its end.
+ */
+
+static le64 apply_new_serial(char *buff, s32 csize, u64 lcn,
+			u16 *bytes_per_sector, le64 serial)
+{
+	NTFS_BOOT_SECTOR *bs;
+	le64 mask;
+
+		/*
+		 * For updating the backup boot sector, we need to
+		 * know the sector size, but this is not recorded
+		 * in the image header, so we collect it on the fly
+		 * while reading the first boot sector.
+		 */
+	if (!lcn) {
+		bs = (NTFS_BOOT_SECTOR*)buff;
+		*bytes_per_sector = le16_to_cpu(bs->bpb.bytes_per_sector);
+		if ((*bytes_per_sector > csize)
+		    || (*bytes_per_sector < NTFS_SECTOR_SIZE))
+			*bytes_per_sector = NTFS_SECTOR_SIZE;
+	} else
+		bs = (NTFS_BOOT_SECTOR*)(buff
+					+ csize - *bytes_per_sector);
+	if (opt.new_serial & 2)
+		bs->volume_serial_number = serial;
+	else {
+		mask = const_cpu_to_le64(~0x0ffffffffULL);
+		bs->volume_serial_number
+		    = (serial & mask)
+			| (bs->volume_serial_number & ~mask);
+	}
+	return (bs->volume_serial_number);
+}
+
+static void set_new_serial(char *buff, s32 csize, u64 lcn,
+			u16 *bytes_per_sector)
+{
+	le64 serial;
+
+	serial = apply_new_serial(buff, csize, lcn, bytes_per_sector,
+				volume_serial_number);
+		/* Show the new full serial after merging */
+	if (!lcn)
+		Printf("New serial number      : 0x%llx\n",
+			(long long)le64_to_cpu(serial));
+}
+
+/*
+ *		Copy a single cluster
+ *
+ *	The cluster is copied by parts of up to CLONE_CHUNK_SIZE bytes
+ *	through a buffer allocated once, so that big clusters (up to
+ *	2MB) are neither allocated nor transferred at once.
+ */
+
+static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
+{
+	static char *buff = (char*)NULL;
+	/* vol is NULL if opt.restore_image is set */
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	BOOL backup_bootsector;
+	void *fd = (void *)&fd_in;
+	off_t rescue_pos;
+	static u16 bytes_per_sector = NTFS_SECTOR_SIZE;
+	s32 done;
+	s32 size;
+
+	if (!opt.restore_image) {
+		csize = vol->cluster_size;
+		bytes_per_sector = vol->sector_size;
+		fd = vol->dev;
+	}
+
+	rescue_pos = (off_t)(rescue_lcn * csize);
+	if (!buff) {
+		buff = (char*)ntfs_malloc(CLONE_CHUNK_SIZE);
+		if (!buff)
+			err_exit("Not enough memory");
+	}
+
+		/* possible partial cluster holding the backup boot sector */
+	backup_bootsector = (lcn + 1)*csize >= full_device_size;
+	if (backup_bootsector) {
+		csize = full_device_size - lcn*csize;
+		if (csize < 0) {
+			err_exit("Corrupted input, copy aborted");
+		}
+	}
+
+	if (opt.save_image || (opt.metadata_image && wipe)) {
+		char cmd = CMD_NEXT;
+		if (write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
+			perr_exit("write_all");
+	}
+
+	for (done = 0; done < csize; done += size) {
+		size = csize - done;
+		if (size > CLONE_CHUNK_SIZE)
+			size = CLONE_CHUNK_SIZE;
+// need reading when not about to write ?
+		if (read_all(fd, buff, size) == -1) {
+
+			if (errno != EIO) {
+				if (!errno && opt.restore_image)
+					err_exit("Short image file...\n");
+				else
+					perr_exit("read_all");
+			}
+			else if (rescue){
+				s32 i;
+				for (i = 0; i < size; i += bytes_per_sector)
+					rescue_sector(fd, bytes_per_sector,
+						rescue_pos + done + i, buff + i);
+			} else {
+				Printf("%s", bad_sectors_warning_msg);
+				err_exit("Disk is faulty, can't make full backup!");
+			}
+		}
+#if COMPRESSED_IMAGES
+		if (opt.save_image)
+			hash_cluster(lcn, done, buff, size);
+#endif
+
+			/*
+			 * Set the new serial number if requested, the boot
+			 * sector is in the first part of cluster 0, and the
+			 * backup one ends the last part of the last cluster.
+			 */
+		if (opt.new_serial
+		    && !opt.save_image
+		    && (!lcn ? !done
+			: (backup_bootsector && ((done + size) == csize))))
+			set_new_serial(buff, size, lcn, &bytes_per_sector);
+
+		if ((!opt.metadata_image || wipe)
+		    && (write_all(&fd_out, buff, size) == -1))
+			write_failed();
+	}
+}
+
+/*
+ *		Copying extents of used clusters when cloning
+ *
+ *	Consecutive used clusters are read and written by extents of
+ *	up to CLONE_EXTENT_SIZE bytes. When threads are available,
+ *	an extent is written by a writer thread while the next one
+ *	is being read, two buffers being used alternately.
+ *	Before any other output (gaps, single clusters) the pending
+ *	extent must be flushed by flush_extent().
+ */
+
+static struct {
+	char *buff[2];		/* alternate buffers */
+	int current;		/* buffer to read into */
+	char *pending;		/* buffer waiting to be written */
+	s64 count;		/* clusters in pending buffer */
+#ifdef HAVE_PTHREAD_H
+	BOOL threaded;
+	BOOL quit;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} extents;
+
+static void write_extent(const char *buff, s64 count)
+{
+	u32 csize = vol->cluster_size;
+	char cmd = CMD_NEXT;
+	s64 i;
+
+	if (opt.save_image) {
+		for (i=0; i<count; i++)
+			if ((write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
+			    || (write_all(&fd_out, (void*)&buff[i*csize],
+						csize) == -1))
+				write_failed();
+	} else
+		if (write_all(&fd_out, (void*)buff, count*csize) == -1)
+			write_failed();
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *extent_writer(void *unused __attribute__((unused)))
+{
+	pthread_mutex_lock(&extents.lock);
+	while (!extents.quit || extents.pending) {
+		if (extents.pending) {
+			pthread_mutex_unlock(&extents.lock);
+			write_extent(extents.pending, extents.count);
+			pthread_mutex_lock(&extents.lock);
+			extents.pending = (char*)NULL;
+			pthread_cond_broadcast(&extents.cond);
+		} else
+			pthread_cond_wait(&extents.cond, &extents.lock);
+	}
+	pthread_mutex_unlock(&extents.lock);
+	return ((void*)NULL);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Wait until the pending extent has been written
+ */
+
+static void flush_extent(void)
+{
+#ifdef HAVE_PTHREAD_H
+	if (extents.threaded) {
+		pthread_mutex_lock(&extents.lock);
+		while (extents.pending)
+			pthread_cond_wait(&extents.cond, &extents.lock);
+		pthread_mutex_unlock(&extents.lock);
+	}
+#endif
+}
+
+static void queue_extent(char *buff, s64 count)
+{
+#ifdef HAVE_PTHREAD_H
+	if (extents.threaded) {
+		pthread_mutex_lock(&extents.lock);
+		while (extents.pending)
+			pthread_cond_wait(&extents.cond, &extents.lock);
+		extents.pending = buff;
+		extents.count = count;
+		pthread_cond_broadcast(&extents.cond);
+		pthread_mutex_unlock(&extents.lock);
+	} else
+		write_extent(buff, count);
+#else
+	write_extent(buff, count);
+#endif
+}
+
+static void start_extents(void)
+{
+	extents.buff[0] = (char*)ntfs_malloc(CLONE_EXTENT_SIZE);
+	extents.buff[1] = (char*)ntfs_malloc(CLONE_EXTENT_SIZE);
+	if (!extents.buff[0] || !extents.buff[1])
+		err_exit("Not enough memory");
+	extents.current = 0;
+	extents.pending = (char*)NULL;
+#ifdef HAVE_PTHREAD_H
+	extents.quit = FALSE;
+	extents.threaded = !opt.no_action
+		&& !pthread_mutex_init(&extents.lock, NULL)
+		&& !pthread_cond_init(&extents.cond, NULL)
+		&& !pthread_create(&extents.thread, NULL,
+					extent_writer, NULL);
+#endif
+}
+
+static void stop_extents(void)
+{
+#ifdef HAVE_PTHREAD_H
+	if (extents.threaded) {
+		pthread_mutex_lock(&extents.lock);
+		extents.quit = TRUE;
+		pthread_cond_broadcast(&extents.cond);
+		pthread_mutex_unlock(&extents.lock);
+		pthread_join(extents.thread, NULL);
+		pthread_cond_destroy(&extents.cond);
+		pthread_mutex_destroy(&extents.lock);
+		extents.threaded = FALSE;
+	}
+#endif
+	free(extents.buff[0]);
+	free(extents.buff[1]);
+}
+
+/*
+ *		Rescuing the used clusters of a failing device
+ *
+ *	When an extent cannot be read, it is bisected until the bad
+ *	clusters are isolated. When cloning to a device or a file, the
+ *	clusters following a bad one are skipped, and the count skipped
+ *	doubles for each new bad cluster until a read succeeds, so that
+ *	a bad zone is crossed quickly. The bad and skipped clusters are
+ *	retried one at a time once all the other ones have been copied,
+ *	and then sector by sector. When the output is sequential, the
+ *	sectors of a bad cluster have to be rescued at once.
+ *
+ *	The clusters still to retry and the progress of the copy may be
+ *	recorded in a map file, so that an interrupted rescue can be
+ *	resumed, and the bad sectors retried by a later run.
+ */
+
+#define RESCUE_BAD '-'		/* cluster could not be read */
+#define RESCUE_SKIPPED '?'	/* cluster not tried yet */
+
+static const char rescue_map_magic[] = "# ntfsclone rescue map\n";
+
+struct rescue_zone {
+	s64 lcn;
+	s64 count;
+	char state;
+};
+
+static struct {
+	struct rescue_zone *zone;
+	int count;
+	int allocated;
+	s64 reached;		/* clusters below have been examined */
+	s64 saved;		/* value of reached in the saved map */
+	s64 skip;		/* clusters to skip after the next bad one */
+	s64 skip_end;		/* end of the clusters being skipped */
+	BOOL retry;		/* the output can be updated later */
+	BOOL changed;		/* zones changed since the map was saved */
+} rescue;
+
+static void rescue_record(s64 lcn, s64 count, char state)
+{
+	struct rescue_zone *zone;
+
+	rescue.changed = TRUE;
+	if (rescue.count) {
+		zone = &rescue.zone[rescue.count - 1];
+		if ((zone->state == state)
+		    && ((zone->lcn + zone->count) == lcn)) {
+			zone->count += count;
+			return;
+		}
+	}
+	if (rescue.count >= rescue.allocated) {
+		rescue.allocated += 64;
+		zone = (struct rescue_zone*)realloc(rescue.zone,
+			rescue.allocated*sizeof(struct rescue_zone));
+		if (!zone)
+			err_exit("Not enough memory");
+		rescue.zone = zone;
+	}
+	zone = &rescue.zone[rescue.count++];
+	zone->lcn = lcn;
+	zone->count = count;
+	zone->state = state;
+}
+
+static s64 rescue_pending(void)
+{
+	s64 count;
+	int i;
+
+	count = 0;
+	for (i=0; i<rescue.count; i++)
+		count += rescue.zone[i].count;
+	return (count);
+}
+
+/*
+ *		Read an extent which could not be read at once
+ *
+ *	The unreadable clusters are marked as bad sectors in the buffer,
+ *	and the input position is undefined on return.
+ */
+
+static void rescue_extent(s64 lcn, s64 count, char *buff)
+{
+	u32 csize = vol->cluster_size;
+	u32 bytes_per_sector = vol->sector_size;
+	s64 half;
+	s64 skipped;
+	u32 i;
+
+	if (lcn < rescue.skip_end) {
+		skipped = rescue.skip_end - lcn;
+		if (skipped > count)
+			skipped = count;
+		mark_bad_sectors(buff, bytes_per_sector, skipped*csize);
+		rescue_record(lcn, skipped, RESCUE_SKIPPED);
+		lcn += skipped;
+		count -= skipped;
+		buff += skipped*csize;
+	}
+	if (count <= 0)
+		return;
+	if (vol->dev->d_ops->seek(vol->dev, lcn*csize, SEEK_SET)
+			== (off_t)-1)
+		perr_exit("seek input");
+	if (read_all(vol->dev, buff, count*csize) != -1)
+		rescue.skip = RESCUE_SKIP_MIN;
+	else {
+		if (errno != EIO)
+			perr_exit("read_all");
+		if (count > 1) {
+			half = count >> 1;
+			rescue_extent(lcn, half, buff);
+			rescue_extent(lcn + half, count - half,
+					buff + half*csize);
+		} else
+			if (rescue.retry) {
+				mark_bad_sectors(buff, bytes_per_sector, csize);
+				rescue_record(lcn, 1, RESCUE_BAD);
+				rescue.skip_end = lcn + 1 + rescue.skip;
+				if (rescue.skip < RESCUE_SKIP_MAX)
+					rescue.skip <<= 1;
+			} else {
+				for (i=0; i<csize; i+=bytes_per_sector)
+					rescue_sector(vol->dev,
+						bytes_per_sector,
+						lcn*csize + i, buff + i);
+			}
+	}
+}
+
+static void save_rescue_map(void)
+{
+	char *temp;
+	FILE *f;
+	int i;
+
+	temp = (char*)ntfs_malloc(strlen(opt.rescue_map) + 5);
+	if (!temp)
+		err_exit("Not enough memory");
+	sprintf(temp, "%s.tmp", opt.rescue_map);
+	f = fopen(temp, "w");
+	if (!f)
+		perr_exit("Opening file '%s' failed", temp);
+	fprintf(f, "%s", rescue_map_magic);
+	fprintf(f, "volume 0x%016llx %lld %lu\n",
+		(unsigned long long)vol->vol_serial,
+		(long long)vol->nr_clusters,
+		(unsigned long)vol->cluster_size);
+	fprintf(f, "reached %lld\n", (long long)rescue.reached);
+	for (i=0; i<rescue.count; i++)
+		fprintf(f, "%lld %lld %c\n", (long long)rescue.zone[i].lcn,
+			(long long)rescue.zone[i].count, rescue.zone[i].state);
+	if (fflush(f) || fsync(fileno(f)) || fclose(f))
+		perr_exit("Writing file '%s' failed", temp);
+#ifdef HAVE_WINDOWS_H
+	unlink(opt.rescue_map);
+#endif
+	if (rename(temp, opt.rescue_map))
+		perr_exit("Renaming file '%s' failed", temp);
+	free(temp);
+	rescue.saved = rescue.reached;
+	rescue.changed = FALSE;
+}
+
+/*
+ *		Load the map of a rescue to resume
+ *
+ *	Returns TRUE if the map exists, and then the output file must
+ *	not be truncated.
+ */
+
+static BOOL load_rescue_map(void)
+{
+	char line[80];
+	unsigned long long serial;
+	unsigned long csize;
+	long long lcn;
+	long long count;
+	char state;
+	BOOL ok;
+	FILE *f;
+
+	f = fopen(opt.rescue_map, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			perr_exit("Opening file '%s' failed", opt.rescue_map);
+		return (FALSE);
+	}
+	ok = fgets(line, sizeof(line), f)
+		&& !strcmp(line, rescue_map_magic)
+		&& fgets(line, sizeof(line), f)
+		&& (sscanf(line, "volume %llx %lld %lu",
+				&serial, &count, &csize) == 3)
+		&& fgets(line, sizeof(line), f)
+		&& (sscanf(line, "reached %lld", &lcn) == 1);
+	if (ok && ((serial != vol->vol_serial)
+		    || (count != vol->nr_clusters)
+		    || (csize != vol->cluster_size)))
+		err_exit("The rescue map '%s' was not made for this "
+			"volume\n", opt.rescue_map);
+	rescue.reached = lcn;
+	while (ok && fgets(line, sizeof(line), f)) {
+		if ((sscanf(line, "%lld %lld %c", &lcn, &count, &state) != 3)
+		    || (lcn < (rescue.count ? rescue.zone[rescue.count - 1].lcn
+				+ rescue.zone[rescue.count - 1].count : 0))
+		    || (count <= 0)
+		    || ((lcn + count) > rescue.reached)
+		    || ((state != RESCUE_BAD) && (state != RESCUE_SKIPPED)))
+			ok = FALSE;
+		else
+			rescue_record(lcn, count, state);
+	}
+	fclose(f);
+	if (!ok || (rescue.reached < 0))
+		err_exit("The rescue map '%s' is damaged\n", opt.rescue_map);
+	rescue.saved = rescue.reached;
+	rescue.changed = FALSE;
+	Printf("Resuming the rescue at cluster %lld, %lld clusters "
+		"to retry\n", (long long)rescue.reached,
+		(long long)rescue_pending());
+	return (TRUE);
+}
+
+/*
+ *		Record the progress of the rescue if needed
+ *
+ *	The clusters below @next must have been copied to the output
+ *	before the map is updated.
+ */
+
+static void rescue_checkpoint(s64 next, BOOL force)
+{
+	if (force || rescue.changed
+	    || ((next - rescue.saved) >= RESCUE_MAP_INTERVAL)) {
+		flush_extent();
+		if (fsync(fd_out) && (errno != EINVAL))
+			perr_exit("fsync");
+		rescue.reached = next;
+		save_rescue_map();
+	}
+}
+
+/*
+ *		Retry the clusters which could not be copied
+ *
+ *	The clusters are read one at a time, and then sector by sector,
+ *	the clusters still having bad sectors being recorded again.
+ */
+
+static void retry_rescue(void)
+{
+	struct rescue_zone *zone;
+	u32 csize = vol->cluster_size;
+	u32 bytes_per_sector = vol->sector_size;
+	char *buff;
+	s64 lcn;
+	u32 i;
+	int count;
+	int k;
+	BOOL lost;
+
+	if (!rescue.count)
+		return;
+	Printf("Retrying %lld clusters which could not be read ...\n",
+		(long long)rescue_pending());
+	buff = (char*)ntfs_malloc(csize);
+	if (!buff)
+		err_exit("Not enough memory");
+	zone = rescue.zone;
+	count = rescue.count;
+	rescue.zone = (struct rescue_zone*)NULL;
+	rescue.count = 0;
+	rescue.allocated = 0;
+	rescue.changed = TRUE;
+	for (k=0; k<count; k++) {
+		for (lcn=zone[k].lcn; lcn<(zone[k].lcn + zone[k].count);
+				lcn++) {
+			if (vol->dev->d_ops->seek(vol->dev, lcn*csize,
+					SEEK_SET) == (off_t)-1)
+				perr_exit("seek input");
+			if (read_all(vol->dev, buff, csize) == -1) {
+				if (errno != EIO)
+					perr_exit("read_all");
+				lost = FALSE;
+				for (i=0; i<csize; i+=bytes_per_sector)
+					if (rescue_sector(vol->dev,
+						bytes_per_sector,
+						lcn*csize + i, buff + i))
+						lost = TRUE;
+				if (lost)
+					rescue_record(lcn, 1, RESCUE_BAD);
+			}
+			if (lseek_out(fd_out, lcn*csize, SEEK_SET)
+					== (off_t)-1)
+				perr_exit("lseek output");
+			if (write_all(&fd_out, buff, csize) == -1)
+				write_failed();
+		}
+	}
+	free(zone);
+	free(buff);
+	if (rescue.count)
+		Printf("%lld clusters could not be fully rescued\n",
+			(long long)rescue_pending());
+}
+
+/*
+ *		Copy an extent of used clusters
+ *
+ *	The input is expected to be positioned at the first cluster.
+ *	If the extent cannot be read and rescuing was not requested,
+ *	its clusters are copied one at a time to report the failure.
+ */
+
+static void copy_extent(u64 lcn, s64 count)
+{
+	char *buff;
+	BOOL failed;
+	s64 i;
+
+	buff = extents.buff[extents.current];
+	failed = FALSE;
+	if ((s64)lcn < rescue.skip_end)
+		failed = TRUE;
+	else
+		if (read_all(vol->dev, buff, count*vol->cluster_size) == -1) {
+			if (errno != EIO)
+				perr_exit("read_all");
+			failed = TRUE;
+		}
+	if (failed && !opt.rescue) {
+		flush_extent();
+		for (i=0; i<count; i++) {
+			lseek_to_cluster(lcn + i);
+			copy_cluster(opt.rescue, lcn + i, lcn + i);
+		}
+	} else {
+		if (failed) {
+			rescue_extent(lcn, count, buff);
+			if (vol->dev->d_ops->seek(vol->dev,
+				(lcn + count)*vol->cluster_size, SEEK_SET)
+					== (off_t)-1)
+				perr_exit("seek input");
+		}
+#if COMPRESSED_IMAGES
+		for (i=0; i<count; i++)
+			hash_cluster(lcn + i, 0, &buff[i*vol->cluster_size],
+						vol->cluster_size);
+#endif
+		queue_extent(buff, count);
+		extents.current ^= 1;
+	}
+}
+
+static s64 lseek_out(int fd, s64 pos, int mode)
+{
+	s64 ret;
+
+	if (dev_out)
+		ret = (dev_out->d_ops->seek)(dev_out, pos, mode);
+	else
+		ret = lseek(fd, pos, mode);
+	return (ret);
+}
+
+static void lseek_to_cluster(s64 lcn)
+{
+	off_t pos;
+
+	pos = (off_t)(lcn * vol->cluster_size);
+
+	if (vol->dev->d_ops->seek(vol->dev, pos, SEEK_SET) == (off_t)-1)
+		perr_exit("lseek input");
+
+	if (opt.std_out || opt.save_image || opt.metadata_image)
+		return;
+
+	if (lseek_out(fd_out, pos, SEEK_SET) == (off_t)-1)
+			perr_exit("lseek output");
+}
+
+static void gap_to_cluster(s64 gap)
+{
+	sle64 count;
+	char buf[1 + sizeof(count)];
+
+	if (gap) {
+		count = cpu_to_sle64(gap);
+		buf[0] = CMD_GAP;
+		memcpy(&buf[1], &count, sizeof(count));
+		if (write_all(&fd_out, buf, sizeof(buf)) == -1)
+			perr_exit("write_all");
+	}
+}
+
+static void image_skip_clusters(s64 count)
+{
+	if (opt.save_image && count > 0) {
+		sle64 count_buf;
+		char buff[1 + sizeof(count)];
+
+		buff[0] = CMD_GAP;
+		count_buf = cpu_to_sle64(count);
+		memcpy(buff + 1, &count_buf, sizeof(count_buf));
+
+		if (write_all(&fd_out, buff, sizeof(buff)) == -1)
+			perr_exit("write_all");
+	}
+}
+
+static void write_image_hdr(void)
+{
+	char alignment[IMAGE_HDR_ALIGN];
+
+	if (opt.save_image || opt.metadata_image) {
+		int alignsize = le32_to_cpu(image_hdr.offset_to_image_data)
 				- sizeof(image_hdr);
 		memset(alignment,0,IMAGE_HDR_ALIGN);
+#if COMPRESSED_IMAGES
+		if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DELTA) {
+			alignsize -= sizeof(delta_hdr);
+			if (write_all(&fd_out, &image_hdr, sizeof(image_hdr))
+			    || write_all(&fd_out, &delta_hdr,
+						sizeof(delta_hdr)))
+				perr_exit("write_all");
+		} else
+#endif
+		if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_STORE) {
+			alignsize -= sizeof(store_hdr);
+			if (write_all(&fd_out, &image_hdr, sizeof(image_hdr))
+			    || write_all(&fd_out, &store_hdr,
+						sizeof(store_hdr)))
+				perr_exit("write_all");
+		} else
+		if (write_all(&fd_out, &image_hdr, sizeof(image_hdr)))
+			perr_exit("write_all");
 		if ((alignsize < 0)
-			|| write_all(&fd_out, &image_hdr, sizeof(image_hdr))
 			|| write_all(&fd_out, alignment, alignsize))
 			perr_exit("write_all");
 	}
@@ -939,8 +2378,11 @@ static void write_image_hdr(void)
 static void clone_ntfs(u64 nr_clusters, int more_use)
 {
 	u64 cl, last_cl;  /* current and last used cluster */
+	s64 start;
 	void *buf;
 	u32 csize = vol->cluster_size;
+	s64 max_count = CLONE_EXTENT_SIZE/csize;
+	s64 count;
 	u64 p_counter = 0;
 	char alignment[IMAGE_HDR_ALIGN];
 	struct progress_bar progress;
@@ -953,9 +2395,19 @@ static void clone_ntfs(u64 nr_clusters, int more_use)
 	if (opt.new_serial)
 		generate_serial_number();
 
-	buf = ntfs_calloc(csize);
+	if (max_count < 1)
+		max_count = 1;
+	buf = ntfs_calloc(max_count*csize);
 	if (!buf)
 		perr_exit("clone_ntfs");
+	start_extents();
+	rescue.retry = opt.rescue && !opt.std_out && !opt.save_image;
+	rescue.skip = RESCUE_SKIP_MIN;
+		/* the clusters below the resuming point have been copied */
+	start = rescue.reached;
+	for (cl=0; (cl<(u64)start) && (cl<=(u64)vol->nr_clusters); cl++)
+		if (ntfs_bit_get(lcn_bitmap.bm, cl))
+			p_counter++;
 
 	progress_init(&progress, p_counter, nr_clusters, 100);
 
@@ -967,72 +2419,408 @@ static void clone_ntfs(u64 nr_clusters, int more_use)
 			|| write_all(&fd_out, &image_hdr, sizeof(image_hdr))
 			|| write_all(&fd_out, alignment, alignsize))
 			perr_exit("write_all");
+#if COMPRESSED_IMAGES
+		if (opt.compress)
+			start_image_compression();
+#endif
 	}
 
-		/* save suspicious clusters if required */
-	if (more_use && opt.ignore_fs_check) {
-		compare_bitmaps(&lcn_bitmap, TRUE);
+		/* save suspicious clusters if required */
+	if (more_use && opt.ignore_fs_check) {
+		compare_bitmaps(&lcn_bitmap, TRUE);
+	}
+		/*
+		 * Examine up to the alternate boot sector, coalescing
+		 * used clusters into extents, except the boot sectors
+		 * which may have to be updated.
+		 */
+	for (last_cl = cl = start; cl <= (u64)vol->nr_clusters; cl += count) {
+		count = 1;
+		if (ntfs_bit_get(lcn_bitmap.bm, cl)) {
+			if (cl && ((cl + 1)*csize < full_device_size)) {
+				while ((count < max_count)
+				    && ((cl + count) <= (u64)vol->nr_clusters)
+				    && ntfs_bit_get(lcn_bitmap.bm, cl + count)
+				    && ((cl + count + 1)*csize
+						< full_device_size))
+					count++;
+			}
+			p_counter += count;
+			progress_update(&progress, p_counter);
+				/* no need to seek within a long run */
+			if (!cl || (cl != (last_cl + 1))) {
+				flush_extent();
+				lseek_to_cluster(cl);
+				image_skip_clusters(cl - last_cl - 1);
+			}
+			if ((count > 1)
+			    || (opt.rescue && cl
+				&& ((cl + 1)*csize < full_device_size)))
+				copy_extent(cl, count);
+			else {
+				flush_extent();
+				copy_cluster(opt.rescue, cl, cl);
+			}
+			last_cl = cl + count - 1;
+			if (opt.rescue_map)
+				rescue_checkpoint(cl + count, FALSE);
+			continue;
+		}
+
+		if (opt.std_out && !opt.save_image) {
+			while ((count < max_count)
+			    && ((cl + count) <= (u64)vol->nr_clusters)
+			    && !ntfs_bit_get(lcn_bitmap.bm, cl + count))
+				count++;
+			p_counter += count;
+			progress_update(&progress, p_counter);
+			flush_extent();
+			if (write_all(&fd_out, buf, count*csize) == -1)
+				perr_exit("write_all");
+		}
+	}
+	flush_extent();
+	stop_extents();
+	image_skip_clusters(cl - last_cl - 1);
+#if COMPRESSED_IMAGES
+	if (opt.compress)
+		finish_image_compression();
+#endif
+	if (rescue.retry) {
+		if (opt.rescue_map)
+			rescue_checkpoint(vol->nr_clusters + 1, TRUE);
+		retry_rescue();
+		if (opt.rescue_map)
+			rescue_checkpoint(vol->nr_clusters + 1, TRUE);
+	}
+	free(buf);
+}
+
+static void write_empty_clusters(s32 csize, s64 count,
+				 struct progress_bar *progress, u64 *p_counter)
+{
+	s64 i;
+	char *buff;
+
+	buff = (char*)ntfs_malloc(csize);
+	if (!buff)
+		err_exit("Not enough memory");
+
+	memset(buff, 0, csize);
+
+	for (i = 0; i < count; i++) {
+		if (write_all(&fd_out, buff, csize) == -1)
+			perr_exit("write_all");
+		progress_update(progress, ++(*p_counter));
+	}
+	free(buff);
+}
+
+static void restore_image(void)
+{
+	s64 pos = 0, count;
+	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	char cmd;
+	u64 p_counter = 0;
+	struct progress_bar progress;
+
+	Printf("Restoring NTFS from image ...\n");
+
+	progress_init(&progress, p_counter, opt.std_out ?
+		      (u64)sle64_to_cpu(image_hdr.nr_clusters) + 1 :
+		      le64_to_cpu(image_hdr.inuse) + 1,
+		      100);
+
+		/* a single serial number when restoring over a base */
+	if (opt.new_serial && !volume_serial_number)
+		generate_serial_number();
+
+		/* Restore up to the alternate boot sector */
+	while (pos <= sle64_to_cpu(image_hdr.nr_clusters)) {
+		if (read_all(&fd_in, &cmd, sizeof(cmd)) == -1) {
+			if (pos == sle64_to_cpu(image_hdr.nr_clusters)) {
+				/* alternate boot sector no present in old images */
+				Printf("Warning : no alternate boot"
+						" sector in image\n");
+				break;
+			} else
+				perr_exit("read_all");
+		}
+
+		if (cmd == CMD_GAP) {
+			if (!image_is_host_endian) {
+				sle64 lecount;
+
+				/* little endian image, on any computer */
+				if (read_all(&fd_in, &lecount,
+						sizeof(lecount)) == -1)
+					perr_exit("read_all");
+				count = sle64_to_cpu(lecount);
+			} else {
+				/* big endian image on big endian computer */
+				if (read_all(&fd_in, &count,
+						sizeof(count)) == -1)
+					perr_exit("read_all");
+			}
+			if (!count)
+				err_exit("Bad offset at input location 0x%llx\n",
+					(long long)tellin(fd_in) - 9);
+			if (opt.std_out) {
+				if ((!p_counter && count) || (count < 0))
+					err_exit("Cannot restore a metadata"
+						" image to stdout\n");
+				else
+					write_empty_clusters(csize, count,
+						     &progress, &p_counter);
+			} else {
+				if (((pos + count) < 0)
+				   || ((pos + count)
+					> sle64_to_cpu(image_hdr.nr_clusters)))
+					err_exit("restore_image: corrupt image "
+						"at input offset %lld\n",
+						(long long)tellin(fd_in) - 9);
+				else {
+					if (!opt.no_action
+					    && (lseek_out(fd_out, count * csize,
+							SEEK_CUR) == (off_t)-1))
+						perr_exit("restore_image: lseek");
+				}
+			}
+			pos += count;
+		} else if (cmd == CMD_NEXT) {
+			copy_cluster(0, 0, pos);
+			pos++;
+			progress_update(&progress, ++p_counter);
+		} else
+			err_exit("Invalid command code %d at input offset 0x%llx\n",
+					cmd, (long long)tellin(fd_in) - 1);
+	}
+#if COMPRESSED_IMAGES
+	if (zimage.active)
+		zimage_stop();
+#endif
+}
+
+/*
+ *		Write an extent to an output of a fan-out restoring
+ */
+
+static void fanout_write(struct fanout_target *target,
+			const struct fanout_extent *extent)
+{
+	const char *buff;
+	s64 done;
+	ssize_t ret;
+	le64 serial;
+
+	if (target->err)
+		return;
+	buff = extent->buff;
+	if (extent->boot) {
+		memcpy(target->boot, extent->buff, extent->size);
+		serial = apply_new_serial(target->boot, extent->size,
+				extent->lcn, &target->bytes_per_sector,
+				target->serial);
+		if (!extent->lcn)
+			Printf("New serial number of %s : 0x%llx\n",
+				target->name,
+				(long long)le64_to_cpu(serial));
+		buff = target->boot;
+	}
+	for (done=0; (done<extent->size) && !target->err; done+=ret) {
+		ret = pwrite(target->fd, &buff[done], extent->size - done,
+				extent->pos + done);
+		if (ret <= 0) {
+			if (ret && ((errno == EINTR) || (errno == EAGAIN)))
+				ret = 0;
+			else
+				target->err = (errno ? errno : EIO);
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *fanout_writer(void *arg)
+{
+	struct fanout_target *target;
+	struct fanout_extent *extent;
+	u64 next;
+
+	target = (struct fanout_target*)arg;
+	next = 0;
+	pthread_mutex_lock(&fanout.lock);
+	while (!fanout.quit || (next < fanout.published)) {
+		if (next < fanout.published) {
+			extent = &fanout.extent[next % FANOUT_BUFFERS];
+			pthread_mutex_unlock(&fanout.lock);
+			fanout_write(target, extent);
+			pthread_mutex_lock(&fanout.lock);
+			if (!--extent->users)
+				pthread_cond_broadcast(&fanout.cond);
+			next++;
+		} else
+			pthread_cond_wait(&fanout.cond, &fanout.lock);
+	}
+	pthread_mutex_unlock(&fanout.lock);
+	if (!target->err && fsync(target->fd) && (errno != EINVAL))
+		target->err = errno;
+	return ((void*)NULL);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Get the next extent to fill, once all the outputs
+ *	have written its previous contents
+ */
+
+static struct fanout_extent *fanout_get_extent(u64 lcn, s32 csize, BOOL boot)
+{
+	struct fanout_extent *extent;
+
+	extent = &fanout.extent[fanout.published % FANOUT_BUFFERS];
+#ifdef HAVE_PTHREAD_H
+	if (fanout.threaded) {
+		pthread_mutex_lock(&fanout.lock);
+		while (extent->users)
+			pthread_cond_wait(&fanout.cond, &fanout.lock);
+		pthread_mutex_unlock(&fanout.lock);
 	}
-		/* Examine up to the alternate boot sector */
-	for (last_cl = cl = 0; cl <= (u64)vol->nr_clusters; cl++) {
+#endif
+	extent->pos = lcn*csize;
+	extent->lcn = lcn;
+	extent->size = 0;
+	extent->boot = boot;
+	return (extent);
+}
 
-		if (ntfs_bit_get(lcn_bitmap.bm, cl)) {
-			progress_update(&progress, ++p_counter);
-			lseek_to_cluster(cl);
-			image_skip_clusters(cl - last_cl - 1);
+/*
+ *		Hand an extent over to the outputs
+ */
 
-			copy_cluster(opt.rescue, cl, cl);
-			last_cl = cl;
-			continue;
-		}
+static void fanout_put_extent(struct fanout_extent *extent)
+{
+	int i;
 
-		if (opt.std_out && !opt.save_image) {
-			progress_update(&progress, ++p_counter);
-			if (write_all(&fd_out, buf, csize) == -1)
-				perr_exit("write_all");
-		}
+#ifdef HAVE_PTHREAD_H
+	if (fanout.threaded) {
+		pthread_mutex_lock(&fanout.lock);
+		extent->users = fanout.count;
+		fanout.published++;
+		pthread_cond_broadcast(&fanout.cond);
+		pthread_mutex_unlock(&fanout.lock);
+		return;
 	}
-	image_skip_clusters(cl - last_cl - 1);
-	free(buf);
+#endif
+	for (i=0; i<fanout.count; i++)
+		fanout_write(&fanout.target[i], extent);
+	fanout.published++;
 }
 
-static void write_empty_clusters(s32 csize, s64 count,
-				 struct progress_bar *progress, u64 *p_counter)
+static void start_fanout(s32 csize)
 {
-	s64 i;
-	char *buff;
+	struct fanout_target *target;
+	int i;
 
-	buff = (char*)ntfs_malloc(csize);
-	if (!buff)
-		err_exit("Not enough memory");
+	for (i=0; i<FANOUT_BUFFERS; i++) {
+		fanout.extent[i].buff = (char*)ntfs_malloc(CLONE_EXTENT_SIZE);
+		if (!fanout.extent[i].buff)
+			err_exit("Not enough memory");
+	}
+	for (i=0; i<fanout.count; i++) {
+		target = &fanout.target[i];
+		target->bytes_per_sector = NTFS_SECTOR_SIZE;
+		target->boot = (char*)ntfs_malloc(csize);
+		if (!target->boot)
+			err_exit("Not enough memory");
+		if (opt.new_serial)
+			target->serial = random_serial_number();
+	}
+#ifdef HAVE_PTHREAD_H
+	fanout.quit = FALSE;
+	fanout.threaded = !pthread_mutex_init(&fanout.lock, NULL)
+			&& !pthread_cond_init(&fanout.cond, NULL);
+	for (i=0; fanout.threaded && (i<fanout.count); i++)
+		if (pthread_create(&fanout.target[i].thread, NULL,
+				fanout_writer, &fanout.target[i]))
+			err_exit("Could not start the writer for %s\n",
+				fanout.target[i].name);
+#endif
+}
 
-	memset(buff, 0, csize);
+/*
+ *		Wait for the outputs to be written and synced
+ *
+ *	Returns the number of outputs which failed
+ */
 
-	for (i = 0; i < count; i++) {
-		if (write_all(&fd_out, buff, csize) == -1)
-			perr_exit("write_all");
-		progress_update(progress, ++(*p_counter));
+static int stop_fanout(void)
+{
+	struct fanout_target *target;
+	int failed;
+	int i;
+
+	Printf("Syncing ...\n");
+#ifdef HAVE_PTHREAD_H
+	if (fanout.threaded) {
+		pthread_mutex_lock(&fanout.lock);
+		fanout.quit = TRUE;
+		pthread_cond_broadcast(&fanout.cond);
+		pthread_mutex_unlock(&fanout.lock);
+		for (i=0; i<fanout.count; i++)
+			pthread_join(fanout.target[i].thread, NULL);
+		pthread_cond_destroy(&fanout.cond);
+		pthread_mutex_destroy(&fanout.lock);
+		fanout.threaded = FALSE;
+	} else
+#endif
+		for (i=0; i<fanout.count; i++) {
+			target = &fanout.target[i];
+			if (!target->err && fsync(target->fd)
+			    && (errno != EINVAL))
+				target->err = errno;
+		}
+	failed = 0;
+	for (i=0; i<fanout.count; i++) {
+		target = &fanout.target[i];
+		if (target->err) {
+			err_printf("Restoring to %s failed : %s\n",
+				target->name, strerror(target->err));
+			failed++;
+		}
+		free(target->boot);
 	}
-	free(buff);
+	for (i=0; i<FANOUT_BUFFERS; i++)
+		free(fanout.extent[i].buff);
+	return (failed);
 }
 
-static void restore_image(void)
+/*
+ *		Restore an image to several outputs
+ *
+ *	Same as restore_image(), the image being read once for all
+ *	the outputs. The new serial numbers are different.
+ */
+
+static void restore_fanout(void)
 {
+	struct fanout_extent *extent;
 	s64 pos = 0, count;
 	s32 csize = le32_to_cpu(image_hdr.cluster_size);
+	s32 size;
 	char cmd;
 	u64 p_counter = 0;
 	struct progress_bar progress;
+	BOOL backup_bootsector;
+	BOOL boot;
 
-	Printf("Restoring NTFS from image ...\n");
-
-	progress_init(&progress, p_counter, opt.std_out ?
-		      (u64)sle64_to_cpu(image_hdr.nr_clusters) + 1 :
-		      le64_to_cpu(image_hdr.inuse) + 1,
-		      100);
+	Printf("Restoring NTFS from image to %d outputs ...\n", fanout.count);
 
-	if (opt.new_serial)
-		generate_serial_number();
+	progress_init(&progress, p_counter,
+		      le64_to_cpu(image_hdr.inuse) + 1, 100);
+	start_fanout(csize);
+	extent = (struct fanout_extent*)NULL;
 
 		/* Restore up to the alternate boot sector */
 	while (pos <= sle64_to_cpu(image_hdr.nr_clusters)) {
@@ -1061,39 +2849,93 @@ static void restore_image(void)
 						sizeof(count)) == -1)
 					perr_exit("read_all");
 			}
-			if (!count)
-				err_exit("Bad offset at input location 0x%llx\n",
+			if (!count
+			    || ((pos + count) < 0)
+			    || ((pos + count)
+				> sle64_to_cpu(image_hdr.nr_clusters)))
+				err_exit("restore_image: corrupt image "
+					"at input offset %lld\n",
 					(long long)tellin(fd_in) - 9);
-			if (opt.std_out) {
-				if ((!p_counter && count) || (count < 0))
-					err_exit("Cannot restore a metadata"
-						" image to stdout\n");
-				else
-					write_empty_clusters(csize, count,
-						     &progress, &p_counter);
-			} else {
-				if (((pos + count) < 0)
-				   || ((pos + count)
-					> sle64_to_cpu(image_hdr.nr_clusters)))
-					err_exit("restore_image: corrupt image "
-						"at input offset %lld\n",
-						(long long)tellin(fd_in) - 9);
-				else {
-					if (!opt.no_action
-					    && (lseek_out(fd_out, count * csize,
-							SEEK_CUR) == (off_t)-1))
-						perr_exit("restore_image: lseek");
-				}
-			}
 			pos += count;
 		} else if (cmd == CMD_NEXT) {
-			copy_cluster(0, 0, pos);
+				/* possible partial cluster holding the backup boot sector */
+			backup_bootsector = (u64)(pos + 1)*csize
+						>= full_device_size;
+			size = csize;
+			if (backup_bootsector) {
+				size = full_device_size - pos*csize;
+				if (size <= 0)
+					err_exit("Corrupted input, copy aborted");
+			}
+			boot = opt.new_serial && (!pos || backup_bootsector);
+			if (extent
+			    && (boot || extent->boot
+				|| ((extent->pos + extent->size) != pos*csize)
+				|| ((extent->size + size) > CLONE_EXTENT_SIZE))) {
+				fanout_put_extent(extent);
+				extent = (struct fanout_extent*)NULL;
+			}
+			if (!extent)
+				extent = fanout_get_extent(pos, csize, boot);
+			if (read_all(&fd_in, &extent->buff[extent->size],
+					size) == -1) {
+				if (!errno)
+					err_exit("Short image file...\n");
+				perr_exit("read_all");
+			}
+			extent->size += size;
 			pos++;
 			progress_update(&progress, ++p_counter);
 		} else
 			err_exit("Invalid command code %d at input offset 0x%llx\n",
 					cmd, (long long)tellin(fd_in) - 1);
 	}
+	if (extent)
+		fanout_put_extent(extent);
+#if COMPRESSED_IMAGES
+	if (zimage.active)
+		zimage_stop();
+#endif
+	if (stop_fanout())
+		exit(1);
+}
+
+/*
+ *		Open the outputs after the first one, which is already open
+ */
+
+static void open_fanout(s64 ntfs_size)
+{
+	struct fanout_target *target;
+	const char *output;
+	int blkdev_out;
+	int flags;
+	int i;
+
+	output = opt.output;
+	blkdev_out = opt.blkdev_out;
+	fanout.target[0].fd = fd_out;
+	fanout.target[0].blkdev = opt.blkdev_out;
+	for (i=1; i<fanout.count; i++) {
+		target = &fanout.target[i];
+		flags = O_RDWR | O_BINARY;
+		if (!target->blkdev) {
+			flags |= O_CREAT | O_TRUNC;
+			if (!opt.overwrite)
+				flags |= O_EXCL;
+		}
+		target->fd = open(target->name, flags, S_IRUSR | S_IWUSR);
+		if (target->fd == -1)
+			perr_exit("Opening file '%s' failed", target->name);
+			/* the checks apply to the current output */
+		opt.output = (char*)target->name;
+		opt.blkdev_out = target->blkdev;
+		fd_out = target->fd;
+		check_output_device(ntfs_size);
+	}
+	opt.output = (char*)output;
+	opt.blkdev_out = blkdev_out;
+	fd_out = fanout.target[0].fd;
 }
 
 static void wipe_index_entry_timestams(INDEX_ENTRY *e)
@@ -2376,9 +4218,9 @@ static void set_filesize(s64 filesize)
 	}
 }
 
-static s64 open_image(void)
+static s64 open_image(const char *name)
 {
-	if (strcmp(opt.volume, "-") == 0) {
+	if (strcmp(name, "-") == 0) {
 		if ((fd_in = fileno(stdin)) == -1)
 			perr_exit("fileno for stdin failed");
 #ifdef HAVE_WINDOWS_H
@@ -2386,7 +4228,7 @@ static s64 open_image(void)
 			perr_exit("setting binary stdin failed");
 #endif
 	} else {
-		if ((fd_in = open(opt.volume, O_RDONLY | O_BINARY)) == -1)
+		if ((fd_in = open(name, O_RDONLY | O_BINARY)) == -1)
 			perr_exit("failed to open image");
 	}
 	if (read_all(&fd_in, &image_hdr, NTFSCLONE_IMG_HEADER_SIZE_OLD) == -1)
@@ -2420,7 +4262,13 @@ static s64 open_image(void)
 		le32 offset_to_image_data;
 		int delta;
 
-		if (image_hdr.major_ver > NTFSCLONE_IMG_VER_MAJOR)
+		if ((image_hdr.major_ver > NTFSCLONE_IMG_VER_MAJOR)
+		    && (image_hdr.major_ver != NTFSCLONE_IMG_VER_MAJOR_STORE)
+		    && (!COMPRESSED_IMAGES
+			|| ((image_hdr.major_ver
+				!= NTFSCLONE_IMG_VER_MAJOR_COMPRESSED)
+			    && (image_hdr.major_ver
+				!= NTFSCLONE_IMG_VER_MAJOR_DELTA))))
 			err_exit("Do not know how to handle image format "
 					"version %d.%d.  Please obtain a "
 					"newer version of ntfsclone.\n",
@@ -2441,6 +4289,22 @@ static s64 open_image(void)
 		delta = le32_to_cpu(offset_to_image_data)
 				- (NTFSCLONE_IMG_HEADER_SIZE_OLD +
 				sizeof(image_hdr.offset_to_image_data));
+#if COMPRESSED_IMAGES
+		if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DELTA) {
+			if ((delta < (int)sizeof(delta_hdr))
+			    || (read_all(&fd_in, &delta_hdr,
+						sizeof(delta_hdr)) == -1))
+				err_exit("Bad differential image header\n");
+			delta -= sizeof(delta_hdr);
+		}
+#endif
+		if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_STORE) {
+			if ((delta < (int)sizeof(store_hdr))
+			    || (read_all(&fd_in, &store_hdr,
+						sizeof(store_hdr)) == -1))
+				err_exit("Bad chunk store image header\n");
+			delta -= sizeof(store_hdr);
+		}
 		if (delta > 0) {
 			char *dummy_buf;
 
@@ -2451,10 +4315,475 @@ static s64 open_image(void)
 				perr_exit("read_all");
 			free(dummy_buf);
 		}
+#if COMPRESSED_IMAGES
+		if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_COMPRESSED)
+			start_image_decompression();
+#endif
 	}
 	return le64_to_cpu(image_hdr.device_size);
 }
 
+#if COMPRESSED_IMAGES
+
+/*
+ *		Save a differential image
+ *
+ *	The used clusters are read and hashed by ranges, and only the
+ *	ranges whose hash differs from the one recorded in the base
+ *	image are stored, the unchanged ones being stored as gaps.
+ *	The backup boot sector is always stored.
+ */
+
+static void clone_delta(int more_use)
+{
+	struct image_hdr base;
+	struct progress_bar progress;
+	u64 *base_table;
+	u64 check;
+	s64 base_count;
+	u32 base_clusters;
+	u32 csize = vol->cluster_size;
+	char cmd = CMD_NEXT;
+	char *buff;
+	s64 nr_clusters = vol->nr_clusters;
+	s64 first, last, lcn, next, i, r;
+	s64 last_cl;
+	s64 stored = 0;
+
+	Printf("Saving NTFS to differential image ...\n");
+
+	base_table = read_base_hashes(opt.base, &base, &check,
+				&base_count, &base_clusters);
+	delta_hdr.base_check = cpu_to_le64(check);
+	delta_hdr.reserved = const_cpu_to_le64(0);
+	write_image_hdr();
+	start_image_compression();
+	if ((le32_to_cpu(base.cluster_size) != csize)
+	    || (sle64_to_cpu(base.nr_clusters) != nr_clusters)
+	    || (le64_to_cpu(base.device_size)
+			!= le64_to_cpu(image_hdr.device_size))
+	    || (base_count != image_hashes.count)
+	    || (base_clusters != image_hashes.clusters))
+		err_exit("The base image is not an image of this volume\n");
+	buff = (char*)ntfs_malloc(image_hashes.clusters*csize);
+	if (!buff)
+		err_exit("Not enough memory");
+
+		/* save suspicious clusters if required */
+	if (more_use && opt.ignore_fs_check)
+		compare_bitmaps(&lcn_bitmap, TRUE);
+
+	progress_init(&progress, 0, image_hashes.count, 100);
+	last_cl = -1;
+	for (r=0; r<image_hashes.count; r++) {
+		first = r*image_hashes.clusters;
+		last = first + image_hashes.clusters;
+		if (last > nr_clusters)
+			last = nr_clusters;
+			/* read and hash the used clusters of the range */
+		for (lcn=first; lcn<last; lcn=next) {
+			next = lcn + 1;
+			if (!ntfs_bit_get(lcn_bitmap.bm, lcn))
+				continue;
+			while ((next < last)
+			    && ntfs_bit_get(lcn_bitmap.bm, next))
+				next++;
+			lseek_to_cluster(lcn);
+			if (read_all(vol->dev, &buff[(lcn - first)*csize],
+					(next - lcn)*csize) == -1) {
+				if (errno != EIO)
+					perr_exit("read_all");
+				for (i=lcn; i<next; i++) {
+					lseek_to_cluster(i);
+					read_rescue(vol->dev,
+						&buff[(i - first)*csize],
+						csize, vol->sector_size, i);
+				}
+			}
+			for (i=lcn; i<next; i++)
+				hash_cluster(i, 0, &buff[(i - first)*csize],
+						csize);
+		}
+		progress_update(&progress, r + 1);
+		if (image_hashes.table[r] == base_table[r])
+			continue;
+			/* the range has changed, store its used clusters */
+		for (lcn=first; lcn<last; lcn++) {
+			if (ntfs_bit_get(lcn_bitmap.bm, lcn)) {
+				image_skip_clusters(lcn - last_cl - 1);
+				if ((write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
+				    || (write_all(&fd_out,
+					&buff[(lcn - first)*csize],
+					csize) == -1))
+					write_failed();
+				last_cl = lcn;
+				stored++;
+			}
+		}
+	}
+	lseek_to_cluster(nr_clusters);
+	image_skip_clusters(nr_clusters - last_cl - 1);
+	copy_cluster(opt.rescue, nr_clusters, nr_clusters);
+	finish_image_compression();
+	Printf("Changed clusters stored: %lld\n", (long long)stored);
+	free(buff);
+	free(base_table);
+}
+
+/*
+ *		Restore a differential image over its base image
+ */
+
+static void restore_delta(void)
+{
+	struct image_hdr base;
+	struct image_hdr delta_image;
+	u64 *table;
+	u64 check;
+	s64 count;
+	u32 clusters;
+	int delta_fd;
+
+	table = read_base_hashes(opt.base, &base, &check, &count, &clusters);
+	free(table);
+	if ((le64_to_cpu(delta_hdr.base_check) != check)
+	    || (base.cluster_size != image_hdr.cluster_size)
+	    || (base.nr_clusters != image_hdr.nr_clusters)
+	    || (base.device_size != image_hdr.device_size))
+		err_exit("The image was not made against the base image "
+				"'%s'\n", opt.base);
+	delta_fd = fd_in;
+	delta_image = image_hdr;
+	open_image(opt.base);
+	restore_image();
+	close(fd_in);
+	fd_in = delta_fd;
+	image_hdr = delta_image;
+	if (!opt.no_action && (lseek_out(fd_out, 0, SEEK_SET) == (off_t)-1))
+		perr_exit("lseek output");
+	start_image_decompression();
+	restore_image();
+}
+
+#endif /* COMPRESSED_IMAGES */
+
+/*
+ *		Images in a chunk store
+ *
+ *	With --store, the used clusters are saved by ranges of
+ *	STORE_CHUNK_SIZE bytes into files of a chunk store named after
+ *	a hash of their contents, so that images of similar volumes
+ *	share the files of the chunks they have in common. The unused
+ *	clusters of a range are zeroed before hashing.
+ *	The image itself (format 13.0) is a manifest, listing for each
+ *	range the key of its chunk and a bitmap of its used clusters.
+ *	The partial cluster holding the backup boot sector is stored
+ *	at the end of the manifest.
+ */
+
+static void store_key(const char *buf, u32 size, u64 key[2])
+{
+	const le64 *p;
+	u64 a, b, w;
+	u32 i;
+
+	a = size;
+	b = ~(u64)size;
+	p = (const le64*)buf;
+	for (i=0; i<(size >> 3); i++) {
+		w = le64_to_cpu(p[i]);
+		a = (a ^ w) * 0x100000001b3ULL;
+		a ^= a >> 29;
+		b = (b ^ w) * 0x9e3779b97f4a7c15ULL;
+		b ^= b >> 32;
+	}
+	key[0] = a;
+	key[1] = b;
+}
+
+static char *store_path(const u8 *key, BOOL mkdirs)
+{
+	char *path;
+	int len;
+	int i;
+
+	len = strlen(opt.store);
+	path = (char*)ntfs_malloc(len + 4 + 2*STORE_KEY_SIZE + 1);
+	if (!path)
+		err_exit("Not enough memory");
+	sprintf(path, "%s/%02x", opt.store, key[0]);
+	if (mkdirs
+#ifdef HAVE_WINDOWS_H
+	    && mkdir(path)
+#else
+	    && mkdir(path, 0755)
+#endif
+	    && (errno != EEXIST))
+		perr_exit("Could not create directory '%s'", path);
+	len += 3;
+	path[len++] = '/';
+	for (i=0; i<STORE_KEY_SIZE; i++)
+		len += sprintf(&path[len], "%02x", key[i]);
+	return (path);
+}
+
+/*
+ *		Store a chunk, unless it is already present
+ *
+ *	The chunk is written to a temporary file which is renamed,
+ *	so that several images can be saved at the same time. The
+ *	chunk is not written through write_all(), which would append
+ *	it to the image.
+ */
+
+static BOOL store_chunk(const u8 *key, const char *buf, u32 size)
+{
+	struct stat st;
+	char *path;
+	char *temp;
+	BOOL added;
+	FILE *f;
+
+	added = FALSE;
+	path = store_path(key, TRUE);
+	if (stat(path, &st) || (st.st_size != size)) {
+		temp = (char*)ntfs_malloc(strlen(path) + 20);
+		if (!temp)
+			err_exit("Not enough memory");
+		sprintf(temp, "%s.%d", path, (int)getpid());
+		f = fopen(temp, BINWMODE);
+		if (!f
+		    || (fwrite(buf, 1, size, f) != size)
+		    || fclose(f)
+		    || rename(temp, path))
+			perr_exit("Could not store chunk '%s'", path);
+		free(temp);
+		added = TRUE;
+	}
+	free(path);
+	return (added);
+}
+
+static void load_chunk(const u8 *key, char *buf, u32 size)
+{
+	char *path;
+	int fd;
+
+	path = store_path(key, FALSE);
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1)
+		perr_exit("Could not open chunk '%s'", path);
+	if ((read(fd, buf, size) != (ssize_t)size)
+	    || (read(fd, buf, 1) != 0))
+		err_exit("Bad chunk '%s'\n", path);
+	close(fd);
+	free(path);
+}
+
+/*
+ *		Save an image into the chunk store
+ */
+
+static void clone_store(int more_use)
+{
+	struct progress_bar progress;
+	u32 csize = vol->cluster_size;
+	u32 clusters;
+	u32 size;
+	s64 nr_clusters = vol->nr_clusters;
+	s64 nr_chunks, r, first, last, lcn, next, i;
+	s64 added = 0;
+	s64 shared = 0;
+	u64 key[2];
+	u8 rawkey[STORE_KEY_SIZE];
+	char *buff;
+	u8 *bitmap;
+	le32 lesize;
+	char cmd;
+
+	Printf("Saving NTFS to chunk store ...\n");
+
+#ifdef HAVE_WINDOWS_H
+	if (mkdir(opt.store) && (errno != EEXIST))
+#else
+	if (mkdir(opt.store, 0755) && (errno != EEXIST))
+#endif
+		perr_exit("Could not create directory '%s'", opt.store);
+	clusters = le32_to_cpu(store_hdr.chunk_clusters);
+	nr_chunks = (nr_clusters + clusters - 1)/clusters;
+	buff = (char*)ntfs_malloc(clusters*csize);
+	bitmap = (u8*)ntfs_malloc((clusters + 7) >> 3);
+	if (!buff || !bitmap)
+		err_exit("Not enough memory");
+	write_image_hdr();
+
+		/* save suspicious clusters if required */
+	if (more_use && opt.ignore_fs_check)
+		compare_bitmaps(&lcn_bitmap, TRUE);
+
+	progress_init(&progress, 0, nr_chunks, 100);
+	for (r=0; r<nr_chunks; r++) {
+		first = r*clusters;
+		last = first + clusters;
+		if (last > nr_clusters)
+			last = nr_clusters;
+		memset(buff, 0, clusters*csize);
+		memset(bitmap, 0, (clusters + 7) >> 3);
+			/* read the used clusters of the range */
+		for (lcn=first; lcn<last; lcn=next) {
+			next = lcn + 1;
+			if (!ntfs_bit_get(lcn_bitmap.bm, lcn))
+				continue;
+			while ((next < last)
+			    && ntfs_bit_get(lcn_bitmap.bm, next))
+				next++;
+			lseek_to_cluster(lcn);
+			if (read_all(vol->dev, &buff[(lcn - first)*csize],
+					(next - lcn)*csize) == -1) {
+				if (errno != EIO)
+					perr_exit("read_all");
+				for (i=lcn; i<next; i++) {
+					lseek_to_cluster(i);
+					read_rescue(vol->dev,
+						&buff[(i - first)*csize],
+						csize, vol->sector_size, i);
+				}
+			}
+			for (i=lcn; i<next; i++)
+				ntfs_bit_set(bitmap, i - first, 1);
+		}
+		progress_update(&progress, r + 1);
+		for (i=0; (i<((clusters + 7) >> 3)) && !bitmap[i]; i++) { }
+		if (i >= ((clusters + 7) >> 3)) {
+			cmd = STORE_SKIP;
+			if (write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
+				write_failed();
+			continue;
+		}
+		store_key(buff, clusters*csize, key);
+		for (i=0; i<8; i++) {
+			rawkey[i] = key[0] >> (8*i);
+			rawkey[8 + i] = key[1] >> (8*i);
+		}
+		if (store_chunk(rawkey, buff, clusters*csize))
+			added++;
+		else
+			shared++;
+		cmd = STORE_CHUNK;
+		if ((write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
+		    || (write_all(&fd_out, rawkey, STORE_KEY_SIZE) == -1)
+		    || (write_all(&fd_out, bitmap, (clusters + 7) >> 3) == -1))
+			write_failed();
+	}
+		/* the backup boot sector, possibly in a partial cluster */
+	size = full_device_size - nr_clusters*csize;
+	if (size > csize)
+		size = csize;
+	lseek_to_cluster(nr_clusters);
+	read_rescue(vol->dev, buff, size, vol->sector_size, nr_clusters);
+	lesize = cpu_to_le32(size);
+	if ((write_all(&fd_out, &lesize, sizeof(lesize)) == -1)
+	    || (write_all(&fd_out, buff, size) == -1))
+		write_failed();
+	Printf("New chunks stored      : %lld\n", (long long)added);
+	Printf("Chunks already stored  : %lld\n", (long long)shared);
+	free(bitmap);
+	free(buff);
+}
+
+/*
+ *		Restore an image from the chunk store
+ */
+
+static void restore_store(void)
+{
+	struct progress_bar progress;
+	u32 csize = le32_to_cpu(image_hdr.cluster_size);
+	u32 clusters;
+	u32 size;
+	s64 nr_clusters = sle64_to_cpu(image_hdr.nr_clusters);
+	s64 nr_chunks, r, first, last, lcn, next;
+	u8 rawkey[STORE_KEY_SIZE];
+	char *buff;
+	u8 *bitmap;
+	le32 lesize;
+	char cmd;
+	u16 bytes_per_sector = NTFS_SECTOR_SIZE;
+
+	Printf("Restoring NTFS from chunk store ...\n");
+
+	clusters = le32_to_cpu(store_hdr.chunk_clusters);
+	if (!clusters || (clusters > STORE_CHUNK_SIZE/NTFS_SECTOR_SIZE))
+		err_exit("Bad chunk size in image\n");
+	nr_chunks = (nr_clusters + clusters - 1)/clusters;
+	buff = (char*)ntfs_malloc(clusters*csize);
+	bitmap = (u8*)ntfs_malloc((clusters + 7) >> 3);
+	if (!buff || !bitmap)
+		err_exit("Not enough memory");
+	if (opt.new_serial)
+		generate_serial_number();
+	progress_init(&progress, 0, nr_chunks, 100);
+	for (r=0; r<nr_chunks; r++) {
+		first = r*clusters;
+		last = first + clusters;
+		if (last > nr_clusters)
+			last = nr_clusters;
+		if (read_all(&fd_in, &cmd, sizeof(cmd)) == -1)
+			perr_exit("read_all");
+		if (cmd == STORE_CHUNK) {
+			if ((read_all(&fd_in, rawkey, STORE_KEY_SIZE) == -1)
+			    || (read_all(&fd_in, bitmap,
+					(clusters + 7) >> 3) == -1))
+				perr_exit("read_all");
+			load_chunk(rawkey, buff, clusters*csize);
+		} else if (cmd == STORE_SKIP) {
+			memset(buff, 0, clusters*csize);
+			memset(bitmap, 0, (clusters + 7) >> 3);
+		} else
+			err_exit("Invalid command code %d at input offset "
+				"0x%llx\n", cmd, (long long)tellin(fd_in) - 1);
+		if (!r && (cmd == STORE_CHUNK) && opt.new_serial)
+			set_new_serial(buff, csize, 0, &bytes_per_sector);
+		progress_update(&progress, r + 1);
+		if (opt.no_action)
+			continue;
+		if (opt.std_out) {
+			if (write_all(&fd_out, buff,
+					(last - first)*csize) == -1)
+				write_failed();
+			continue;
+		}
+			/* only write the used clusters */
+		for (lcn=first; lcn<last; lcn=next) {
+			next = lcn + 1;
+			if (!ntfs_bit_get(bitmap, lcn - first))
+				continue;
+			while ((next < last)
+			    && ntfs_bit_get(bitmap, next - first))
+				next++;
+			if ((lseek_out(fd_out, lcn*csize, SEEK_SET)
+						== (off_t)-1)
+			    || (write_all(&fd_out, &buff[(lcn - first)*csize],
+					(next - lcn)*csize) == -1))
+				write_failed();
+		}
+	}
+	if ((read_all(&fd_in, &lesize, sizeof(lesize)) == -1)
+	    || ((size = le32_to_cpu(lesize)) > csize)
+	    || (read_all(&fd_in, buff, size) == -1))
+		err_exit("Short image file...\n");
+	if (opt.new_serial)
+		set_new_serial(buff, size, nr_clusters, &bytes_per_sector);
+	if (!opt.no_action
+	    && ((!opt.std_out
+		&& (lseek_out(fd_out, nr_clusters*csize, SEEK_SET)
+						== (off_t)-1))
+		|| (write_all(&fd_out, buff, size) == -1)))
+		write_failed();
+	free(bitmap);
+	free(buff);
+}
+
 static s64 open_volume(void)
 {
 	s64 device_size;
@@ -2478,14 +4807,33 @@ static s64 open_volume(void)
 
 static void initialise_image_hdr(s64 device_size, s64 inuse)
 {
+	u32 hdrsize = sizeof(image_hdr);
+
 	memcpy(image_hdr.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE);
-	image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR;
-	image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR;
+	if (opt.base) {
+		image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR_DELTA;
+		image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR_DELTA;
+		hdrsize += sizeof(struct delta_hdr);
+	} else if (opt.store) {
+		image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR_STORE;
+		image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR_STORE;
+		hdrsize += sizeof(struct store_hdr);
+		store_hdr.chunk_clusters = cpu_to_le32(STORE_CHUNK_SIZE
+				> vol->cluster_size
+				? STORE_CHUNK_SIZE/vol->cluster_size : 1);
+		store_hdr.reserved = const_cpu_to_le32(0);
+	} else if (opt.compress) {
+		image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR_COMPRESSED;
+		image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR_COMPRESSED;
+	} else {
+		image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR;
+		image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR;
+	}
 	image_hdr.cluster_size = cpu_to_le32(vol->cluster_size);
 	image_hdr.device_size = cpu_to_le64(device_size);
 	image_hdr.nr_clusters = cpu_to_sle64(vol->nr_clusters);
 	image_hdr.inuse = cpu_to_le64(inuse);
-	image_hdr.offset_to_image_data = cpu_to_le32((sizeof(image_hdr)
+	image_hdr.offset_to_image_data = cpu_to_le32((hdrsize
 			 + IMAGE_HDR_ALIGN - 1) & -IMAGE_HDR_ALIGN);
 }
 
@@ -2590,6 +4938,7 @@ int main(int argc, char **argv)
 	ntfs_walk_clusters_ctx image;
 	s64 device_size;        /* input device size in bytes */
 	s64 ntfs_size;
+	BOOL resumed = FALSE;
 	unsigned int wiped_total = 0;
 
 	/* make sure the layout of header is not affected by alignments */
@@ -2608,12 +4957,24 @@ int main(int argc, char **argv)
 	utils_set_locale();
 
 	if (opt.restore_image) {
-		device_size = open_image();
+		device_size = open_image(opt.volume);
+		if ((image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DELTA)
+		    != (opt.base != (char*)NULL))
+			err_exit(opt.base ? "The image is not a differential "
+				"image\n" : "A differential image can only "
+				"be restored over its base image (--base)\n");
+		if ((image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_STORE)
+		    != (opt.store != (char*)NULL))
+			err_exit(opt.store ? "The image is not in a chunk "
+				"store\n" : "The image can only be restored "
+				"from its chunk store (--store)\n");
 		ntfs_size = sle64_to_cpu(image_hdr.nr_clusters) *
 				le32_to_cpu(image_hdr.cluster_size);
 	} else {
 		device_size = open_volume();
 		ntfs_size = vol->nr_clusters * vol->cluster_size;
+		if (opt.rescue_map)
+			resumed = load_rescue_map();
 	}
 	// FIXME: This needs to be the cluster size...
 	ntfs_size += 512; /* add backup boot sector */
@@ -2633,9 +4994,13 @@ int main(int argc, char **argv)
 
 		fd_out = 0;
 		if (!opt.blkdev_out) {
-			flags |= O_CREAT | O_TRUNC;
-			if (!opt.overwrite)
-				flags |= O_EXCL;
+			flags |= O_CREAT;
+				/* a rescue is resumed over its output */
+			if (!resumed) {
+				flags |= O_TRUNC;
+				if (!opt.overwrite)
+					flags |= O_EXCL;
+			}
 		}
 
 		if (opt.save_image || opt.metadata_image) {
@@ -2663,13 +5028,29 @@ int main(int argc, char **argv)
 #endif
 		}
 
-		if (!opt.save_image && !opt.metadata_image && !opt.no_action)
+			/* the file of a resumed rescue already has its size */
+		if (!opt.save_image && !opt.metadata_image && !opt.no_action
+		    && (!resumed || opt.blkdev_out))
 			check_output_device(ntfs_size);
+		if (fanout.count > 1)
+			open_fanout(ntfs_size);
 	}
 
 	if (opt.restore_image) {
 		print_image_info();
-		restore_image();
+#if COMPRESSED_IMAGES
+		if (opt.base)
+			restore_delta();
+		else
+#endif
+		if (opt.store)
+			restore_store();
+		else
+			if (fanout.count > 1) {
+				restore_fanout();
+				exit(0);
+			} else
+				restore_image();
 		if (!opt.no_action)
 			fsync_clone(fd_out);
 		exit(0);
@@ -2697,7 +5078,15 @@ int main(int argc, char **argv)
 			nr_clusters_to_save = vol->nr_clusters;
 		nr_clusters_to_save++; /* account for the backup boot sector */
 
-		clone_ntfs(nr_clusters_to_save, image.more_use);
+#if COMPRESSED_IMAGES
+		if (opt.base)
+			clone_delta(image.more_use);
+		else
+#endif
+		if (opt.store)
+			clone_store(image.more_use);
+		else
+			clone_ntfs(nr_clusters_to_save, image.more_use);
 		fsync_clone(fd_out);
 		if (opt.save_image)
 			fclose(stream_out);
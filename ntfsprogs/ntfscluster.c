@@ -49,6 +49,7 @@
 #include "debug.h"
 #include "dir.h"
 #include "cluster.h"
+#include "clustermap.h"
 /* #include "version.h" */
 #include "logging.h"
 
@@ -88,6 +89,7 @@ static void usage(void)
 		"    -s, --sector RANGE   Look for objects in this range of sectors\n"
 		"    -I, --inode NUM      Show information about this inode\n"
 		"    -F, --filename NAME  Show information about this file\n"
+		"    -m, --map FILE       Search through the cluster map kept in FILE\n"
 	/*	"    -l, --last           Find the last file on the volume\n" */
 		"\n"
 		"    -f, --force          Use less caution\n"
@@ -110,7 +112,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-c:F:fh?I:ilqs:vV";
+	static const char *sopt = "-c:F:fh?I:ilm:qs:vV";
 	static const struct option lopt[] = {
 		{ "cluster",	required_argument,	NULL, 'c' },
 		{ "filename",	required_argument,	NULL, 'F' },
@@ -119,6 +121,7 @@ static int parse_options(int argc, char **argv)
 		{ "info",	no_argument,		NULL, 'i' },
 		{ "inode",	required_argument,	NULL, 'I' },
 		{ "last",	no_argument,		NULL, 'l' },
+		{ "map",	required_argument,	NULL, 'm' },
 		{ "quiet",	no_argument,		NULL, 'q' },
 		{ "sector",	required_argument,	NULL, 's' },
 		{ "verbose",	no_argument,		NULL, 'v' },
@@ -193,6 +196,12 @@ static int parse_options(int argc, char **argv)
 			else
 				opts.action = act_error;
 			break;
+		case 'm':
+			if (!opts.map)
+				opts.map = optarg;
+			else
+				err++;
+			break;
 		case 'q':
 			opts.quiet++;
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
@@ -219,7 +228,7 @@ static int parse_options(int argc, char **argv)
 			}
 			/* fall through */
 		default:
-			if ((optopt == 'c') || (optopt == 's'))
+			if ((optopt == 'c') || (optopt == 'm') || (optopt == 's'))
 				ntfs_log_error("Option '%s' requires an argument.\n", argv[optind-1]);
 			else
 				ntfs_log_error("Unknown option '%s'.\n", argv[optind-1]);
@@ -483,6 +492,7 @@ int main(int argc, char *argv[])
 {
 	ntfs_volume *vol;
 	ntfs_inode *ino = NULL;
+	struct CLUSTER_MAP *map = NULL;
 	struct match m;
 	int res;
 	int result = 1;
@@ -503,6 +513,16 @@ int main(int argc, char *argv[])
 	if (!vol)
 		return 1;
 
+	if (opts.map && ((opts.action == act_sector)
+			|| (opts.action == act_cluster)
+			|| (opts.action == act_last))) {
+		map = cluster_get_map(vol, opts.map);
+		if (!map) {
+			ntfs_umount(vol, FALSE);
+			return 1;
+		}
+	}
+
 	switch (opts.action) {
 		case act_sector:
 			if (opts.range_begin == opts.range_end)
@@ -513,7 +533,10 @@ int main(int argc, char *argv[])
 			/* Convert to clusters */
 			opts.range_begin >>= (vol->cluster_size_bits - vol->sector_size_bits);
 			opts.range_end   >>= (vol->cluster_size_bits - vol->sector_size_bits);
-			result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			if (map)
+				result = cluster_find_mapped(vol, map, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			else
+				result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
 			break;
 		case act_cluster:
 			if (opts.range_begin == opts.range_end)
@@ -521,7 +544,10 @@ int main(int argc, char *argv[])
 						(unsigned long long)opts.range_begin);
 			else
 				ntfs_log_quiet("Searching for cluster range %llu-%llu\n", (unsigned long long)opts.range_begin, (unsigned long long)opts.range_end);
-			result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			if (map)
+				result = cluster_find_mapped(vol, map, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			else
+				result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
 			break;
 		case act_file:
 #ifdef HAVE_WINDOWS_H
@@ -551,7 +577,15 @@ int main(int argc, char *argv[])
 		case act_last:
 			memset(&m, 0, sizeof(m));
 			m.lcn = -1;
-			result = cluster_find(vol, 0, LONG_MAX, (cluster_cb*)&find_last, &m);
+			if (map) {
+				/* only the last cluster in use matters */
+				if (map->count)
+					result = cluster_find_mapped(vol, map,
+						map->reach[map->count - 1] - 1,
+						map->reach[map->count - 1] - 1,
+						(cluster_cb*)&find_last, &m);
+			} else
+				result = cluster_find(vol, 0, LONG_MAX, (cluster_cb*)&find_last, &m);
 			if (m.lcn >= 0) {
 				ino = ntfs_inode_open(vol, m.inum);
 				if (ino) {
@@ -573,6 +607,7 @@ int main(int argc, char *argv[])
 			break;
 	}
 
+	ntfs_cluster_map_free(map);
 	ntfs_umount(vol, FALSE);
 	return result;
 }
@@ -48,6 +48,7 @@ struct options {
 	u64		 inode;		/* Inode to examine */
 	s64		 range_begin;	/* Look for objects in this range */
 	s64		 range_end;
+	char		*map;		/* File keeping the cluster map */
 };
 
 struct match {
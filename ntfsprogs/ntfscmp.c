@@ -32,6 +32,9 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "mst.h"
 #include "support.h"
@@ -60,10 +63,32 @@ static struct {
 	int debug;
 	int show_progress;
 	int verbose;
+	int fast;
+	int threads;
 	char *vol1;
 	char *vol2;
 } opt;
 
+#define CMP_BUFFER_SIZE 1048576 /* bytes read at once from each volume */
+#define CMP_RANGE_RECORDS 1024 /* mft records compared by a worker at once */
+#define CMP_MAX_THREADS 16 /* max threads, each mounting both volumes */
+
+/*
+ *	The state of a comparing thread : where the differences are
+ *	reported and the buffers the data is read into.
+ */
+struct CMP_CONTEXT {
+	FILE *out;
+	u8 *buf1;
+	u8 *buf2;
+} ;
+
+static struct CMP_CONTEXT main_context;
+#ifdef HAVE_PTHREAD_H
+static pthread_key_t context_key;
+static BOOL context_key_set = FALSE;
+#endif
+
 
 #define NTFS_PROGBAR		0x0001
 #define NTFS_PROGBAR_SUPPRESS	0x0002
@@ -81,20 +106,51 @@ struct progress_bar {
 #define PERR_PREFIX  ERR_PREFIX "(%d): "
 #define NERR_PREFIX  ERR_PREFIX ": "
 
+static struct CMP_CONTEXT *context(void)
+{
+	struct CMP_CONTEXT *ctx = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	if (context_key_set)
+		ctx = (struct CMP_CONTEXT*)pthread_getspecific(context_key);
+#endif
+	if (!ctx) {
+		ctx = &main_context;
+		if (!ctx->out)
+			ctx->out = stdout;
+	}
+	return ctx;
+}
+
+/*
+ * Report to the output of the current thread, which is merged into
+ * stdout in inode order when several threads are comparing.
+ */
+__attribute__((format(printf, 1, 2)))
+static void cmp_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(context()->out, fmt, ap);
+	va_end(ap);
+}
+
 __attribute__((format(printf, 2, 3)))
 static void perr_printf(int newline, const char *fmt, ...)
 {
 	va_list ap;
 	int eo = errno;
+	FILE *out = context()->out;
 
-	fprintf(stdout, PERR_PREFIX, eo);
+	fprintf(out, PERR_PREFIX, eo);
 	va_start(ap, fmt);
-	vfprintf(stdout, fmt, ap);
+	vfprintf(out, fmt, ap);
 	va_end(ap);
-	fprintf(stdout, ": %s", strerror(eo));
+	fprintf(out, ": %s", strerror(eo));
 	if (newline)
-		fprintf(stdout, "\n");
-	fflush(stdout);
+		fprintf(out, "\n");
+	fflush(out);
 	fflush(stderr);
 }
 
@@ -105,12 +161,13 @@ __attribute__((format(printf, 1, 2)))
 static void err_printf(const char *fmt, ...)
 {
 	va_list ap;
+	FILE *out = context()->out;
 
-	fprintf(stdout, NERR_PREFIX);
+	fprintf(out, NERR_PREFIX);
 	va_start(ap, fmt);
-	vfprintf(stdout, fmt, ap);
+	vfprintf(out, fmt, ap);
 	va_end(ap);
-	fflush(stdout);
+	fflush(out);
 	fflush(stderr);
 }
 
@@ -170,7 +227,11 @@ static void usage(void)
 	printf("\nUsage: %s [OPTIONS] DEVICE1 DEVICE2\n"
 		"    Compare two NTFS volumes and tell the differences.\n"
 		"\n"
+		"    -f, --fast             Compare the raw clusters of identical runlists\n"
 		"    -P, --no-progress-bar  Don't show progress bar\n"
+#ifdef HAVE_PTHREAD_H
+		"    -t, --threads NUM      Compare with NUM threads, 0 for all cpus\n"
+#endif
 		"    -v, --verbose          More output\n"
 		"    -h, --help             Display this help\n"
 #ifdef ENABLE_DEBUG
@@ -184,21 +245,27 @@ static void usage(void)
 
 static void parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-dhPv";
+	static const char *sopt = "-dfhPt:v";
 	static const struct option lopt[] = {
 #ifdef ENABLE_DEBUG
 		{ "debug",		no_argument,	NULL, 'd' },
 #endif
+		{ "fast",		no_argument,	NULL, 'f' },
 		{ "help",		no_argument,	NULL, 'h' },
 		{ "no-progress-bar",	no_argument,	NULL, 'P' },
+#ifdef HAVE_PTHREAD_H
+		{ "threads",		required_argument,	NULL, 't' },
+#endif
 		{ "verbose",		no_argument,	NULL, 'v' },
 		{ NULL, 0, NULL, 0 }
 	};
 
 	int c;
+	char *end;
 
 	memset(&opt, 0, sizeof(opt));
 	opt.show_progress = 1;
+	opt.threads = 1;
 
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
@@ -220,9 +287,28 @@ static void parse_options(int argc, char **argv)
 		case 'h':
 		case '?':
 			usage();
+		case 'f':
+			opt.fast++;
+			break;
 		case 'P':
 			opt.show_progress = 0;
 			break;
+#ifdef HAVE_PTHREAD_H
+		case 't':
+			opt.threads = strtol(optarg, &end, 10);
+			if (*end || (opt.threads < 0)) {
+				err_printf("Bad number of threads '%s'.\n",
+						optarg);
+				usage();
+			}
+			if (!opt.threads)
+				opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+			if (opt.threads < 1)
+				opt.threads = 1;
+			if (opt.threads > CMP_MAX_THREADS)
+				opt.threads = CMP_MAX_THREADS;
+			break;
+#endif
 		case 'v':
 			opt.verbose++;
 			break;
@@ -384,7 +470,7 @@ static ntfs_inode *base_inode(ntfs_attr_search_ctx *ctx)
 
 static void print_inode(u64 inum)
 {
-	printf("Inode %llu ", (unsigned long long)inum);
+	cmp_printf("Inode %llu ", (unsigned long long)inum);
 }
 
 static void print_inode_ni(ntfs_inode *ni)
@@ -394,13 +480,13 @@ static void print_inode_ni(ntfs_inode *ni)
 
 static void print_attribute_type(ATTR_TYPES atype)
 {
-	printf("attribute 0x%x", le32_to_cpu(atype));
+	cmp_printf("attribute 0x%x", le32_to_cpu(atype));
 }
 
 static void print_attribute_name(char *name)
 {
 	if (name)
-		printf(":%s", name);
+		cmp_printf(":%s", name);
 }
 
 #define	GET_ATTR_NAME(a) \
@@ -431,7 +517,7 @@ static char *get_attr_name(u64 mft_no,
 		perr_print("ntfs_ucstombs");
 		print_inode(mft_no);
 		print_attribute_type(atype);
-		puts("");
+		cmp_printf("\n");
 		exit(1);
 
 	} else if (name_len > 0)
@@ -458,7 +544,7 @@ static void print_attribute(ATTR_TYPES atype, char *name)
 {
 	print_attribute_type(atype);
 	print_attribute_name(name);
-	printf(" ");
+	cmp_printf(" ");
 }
 
 static void print_na(ntfs_attr *na)
@@ -487,7 +573,7 @@ static void print_ctx(ntfs_attr_search_ctx *ctx)
 static void print_differ(ntfs_attr *na)
 {
 	print_na(na);
-	printf("content:   DIFFER\n");
+	cmp_printf("content:   DIFFER\n");
 }
 
 static int cmp_buffer(u8 *buf1, u8 *buf2, long long int size, ntfs_attr *na)
@@ -601,29 +687,29 @@ static void cmp_attribute_data(ntfs_attr *na1, ntfs_attr *na2)
 {
 	s64 pos;
 	s64 count1 = 0, count2;
-	u8  buf1[NTFS_BUF_SIZE];
-	u8  buf2[NTFS_BUF_SIZE];
+	u8  *buf1 = context()->buf1;
+	u8  *buf2 = context()->buf2;
 
 	for (pos = 0; pos <= na1->data_size; pos += count1) {
 
-		count1 = ntfs_attr_pread(na1, pos, NTFS_BUF_SIZE, buf1);
-		count2 = ntfs_attr_pread(na2, pos, NTFS_BUF_SIZE, buf2);
+		count1 = ntfs_attr_pread(na1, pos, CMP_BUFFER_SIZE, buf1);
+		count2 = ntfs_attr_pread(na2, pos, CMP_BUFFER_SIZE, buf2);
 
 		if (count1 != count2) {
 			print_na(na1);
-			printf("abrupt length:   %lld  !=  %lld ",
+			cmp_printf("abrupt length:   %lld  !=  %lld ",
 				(long long)na1->data_size,
 				(long long)na2->data_size);
-			printf("(count: %lld  !=  %lld)",
+			cmp_printf("(count: %lld  !=  %lld)",
 				(long long)count1, (long long)count2);
-			puts("");
+			cmp_printf("\n");
 			return;
 		}
 
 		if (count1 == -1) {
 			err_printf("%s read error: ", __FUNCTION__);
 			print_na(na1);
-			printf("len = %lld, pos = %lld\n",
+			cmp_printf("len = %lld, pos = %lld\n",
 				(long long)na1->data_size, (long long)pos);
 			exit(1);
 		}
@@ -635,7 +721,7 @@ static void cmp_attribute_data(ntfs_attr *na1, ntfs_attr *na2)
 
 			err_printf("%s read error before EOF: ", __FUNCTION__);
 			print_na(na1);
-			printf("%lld  !=  %lld\n", (long long)pos + count1,
+			cmp_printf("%lld  !=  %lld\n", (long long)pos + count1,
 					(long long)na1->data_size);
 			exit(1);
 		}
@@ -651,6 +737,78 @@ static void cmp_attribute_data(ntfs_attr *na1, ntfs_attr *na2)
 	exit(1);
 }
 
+/*
+ * Check whether two attributes are mapped by identical runlists, so
+ * that their contents can be compared by extents of raw clusters.
+ */
+static BOOL same_runlists(ntfs_attr *na1, ntfs_attr *na2)
+{
+	runlist_element *rl1, *rl2;
+
+	if ((na1->ni->vol->cluster_size != na2->ni->vol->cluster_size)
+	    || (na1->allocated_size != na2->allocated_size)
+	    || (na1->initialized_size != na2->initialized_size)
+	    || NAttrCompressed(na1) || NAttrCompressed(na2)
+	    || NAttrEncrypted(na1) != NAttrEncrypted(na2)
+	    || ntfs_attr_map_whole_runlist(na1)
+	    || ntfs_attr_map_whole_runlist(na2))
+		return FALSE;
+
+	for (rl1 = na1->rl, rl2 = na2->rl; rl1->length && rl2->length;
+			rl1++, rl2++)
+		if ((rl1->vcn != rl2->vcn) || (rl1->lcn != rl2->lcn)
+		    || (rl1->length != rl2->length))
+			return FALSE;
+
+	return (!rl1->length && !rl2->length);
+}
+
+/*
+ * Compare the allocated extents of two attributes having identical
+ * runlists, reading large chunks of raw clusters from both devices
+ * up to the initialized size, beyond which both read as zeroes.
+ */
+static void cmp_attribute_extents(ntfs_attr *na1, ntfs_attr *na2)
+{
+	runlist_element *rl;
+	u8 *buf1 = context()->buf1;
+	u8 *buf2 = context()->buf2;
+	ntfs_volume *vol1 = na1->ni->vol;
+	ntfs_volume *vol2 = na2->ni->vol;
+	s64 pos, end, count, offs;
+
+	for (rl = na1->rl; rl->length; rl++) {
+		if (rl->lcn < 0)
+			continue;
+
+		offs = (rl->lcn - rl->vcn) << vol1->cluster_size_bits;
+		pos = rl->vcn << vol1->cluster_size_bits;
+		end = (rl->vcn + rl->length) << vol1->cluster_size_bits;
+		if (end > na1->initialized_size)
+			end = na1->initialized_size;
+
+		for (; pos < end; pos += count) {
+
+			count = end - pos;
+			if (count > CMP_BUFFER_SIZE)
+				count = CMP_BUFFER_SIZE;
+			if ((ntfs_pread(vol1->dev, offs + pos, count, buf1)
+					!= count)
+			    || (ntfs_pread(vol2->dev, offs + pos, count, buf2)
+					!= count)) {
+				err_printf("%s read error: ", __FUNCTION__);
+				print_na(na1);
+				cmp_printf("lcn = %lld, pos = %lld\n",
+					(long long)rl->lcn, (long long)pos);
+				exit(1);
+			}
+
+			if (cmp_buffer(buf1, buf2, count, na1))
+				return;
+		}
+	}
+}
+
 static int cmp_attribute_header(ATTR_RECORD *a1, ATTR_RECORD *a2)
 {
 	u32 header_size = offsetof(ATTR_RECORD, resident_end);
@@ -674,10 +832,12 @@ static void cmp_attribute(ntfs_attr_search_ctx *ctx1,
 	ATTR_RECORD *a1 = ctx1->attr;
 	ATTR_RECORD *a2 = ctx2->attr;
 	ntfs_attr *na1, *na2;
+	int same_header;
 
-	if (cmp_attribute_header(a1, a2)) {
+	same_header = !cmp_attribute_header(a1, a2);
+	if (!same_header) {
 		print_ctx(ctx1);
-		printf("header:    DIFFER\n");
+		cmp_printf("header:    DIFFER\n");
 	}
 
 	na1 = ntfs_attr_open(base_inode(ctx1), a1->type, GET_ATTR_NAME(a1));
@@ -685,7 +845,7 @@ static void cmp_attribute(ntfs_attr_search_ctx *ctx1,
 
 	if ((!na1 && na2) || (na1 && !na2)) {
 		print_ctx(ctx1);
-		printf("open:   %s  !=  %s\n", pret2str(na1), pret2str(na2));
+		cmp_printf("open:   %s  !=  %s\n", pret2str(na1), pret2str(na2));
 		goto close_attribs;
 	}
 
@@ -694,7 +854,7 @@ static void cmp_attribute(ntfs_attr_search_ctx *ctx1,
 
 	if (na1->data_size != na2->data_size) {
 		print_na(na1);
-		printf("length:   %lld  !=  %lld\n",
+		cmp_printf("length:   %lld  !=  %lld\n",
 			(long long)na1->data_size, (long long)na2->data_size);
 		goto close_attribs;
 	}
@@ -709,6 +869,9 @@ static void cmp_attribute(ntfs_attr_search_ctx *ctx1,
 
 	if (na1->type == AT_INDEX_ALLOCATION)
 		cmp_index_allocation(na1, na2);
+	else if (opt.fast && same_header && a1->non_resident
+			&& same_runlists(na1, na2))
+		cmp_attribute_extents(na1, na2);
 	else
 		cmp_attribute_data(na1, na2);
 
@@ -722,10 +885,10 @@ static void vprint_attribute(ATTR_TYPES atype, char  *name)
 	if (!opt.verbose)
 		return;
 
-	printf("0x%x", le32_to_cpu(atype));
+	cmp_printf("0x%x", le32_to_cpu(atype));
 	if (name)
-		printf(":%s", name);
-	printf(" ");
+		cmp_printf(":%s", name);
+	cmp_printf(" ");
 }
 
 static void print_attributes(ntfs_inode *ni,
@@ -737,11 +900,11 @@ static void print_attributes(ntfs_inode *ni,
 	if (!opt.verbose)
 		return;
 
-	printf("Walking inode %llu attributes: ",
+	cmp_printf("Walking inode %llu attributes: ",
 			(unsigned long long)inumber(ni));
 	vprint_attribute(atype1, name1);
 	vprint_attribute(atype2, name2);
-	printf("\n");
+	cmp_printf("\n");
 }
 
 static int new_name(ntfs_attr_search_ctx *ctx, char *prev_name)
@@ -779,7 +942,7 @@ static int new_attribute(ntfs_attr_search_ctx *ctx,
 	if (opt.verbose) {
 		print_inode(base_inode(ctx)->mft_no);
 		print_attribute_ctx(ctx);
-		printf("record %llu lowest_vcn %lld:    SKIPPED\n",
+		cmp_printf("record %llu lowest_vcn %lld:    SKIPPED\n",
 			(unsigned long long)ctx->ntfs_ino->mft_no,
 			(long long)sle64_to_cpu(ctx->attr->lowest_vcn));
 	}
@@ -857,8 +1020,8 @@ static int cmp_attributes(ntfs_inode *ni1, ntfs_inode *ni2)
 		if (ret1 && ret2) {
 			if (errno1 != errno2) {
 				print_inode_ni(ni1);
-				printf("attribute walk (errno):   %d  !=  %d\n",
-				       errno1, errno2);
+				cmp_printf("attribute walk (errno):   "
+					"%d  !=  %d\n", errno1, errno2);
 			}
 			break;
 		}
@@ -866,7 +1029,8 @@ static int cmp_attributes(ntfs_inode *ni1, ntfs_inode *ni2)
 		if (ret2 || le32_to_cpu(atype1) < le32_to_cpu(atype2)) {
 			if (new_attribute(ctx1, prev_atype, prev_name)) {
 				print_ctx(ctx1);
-				printf("presence:   EXISTS   !=   MISSING\n");
+				cmp_printf("presence:   "
+					"EXISTS   !=   MISSING\n");
 				set_prev(&prev_name, &prev_atype, name1,
 						atype1);
 			}
@@ -874,7 +1038,8 @@ static int cmp_attributes(ntfs_inode *ni1, ntfs_inode *ni2)
 		} else if (ret1 || le32_to_cpu(atype1) > le32_to_cpu(atype2)) {
 			if (new_attribute(ctx2, prev_atype, prev_name)) {
 				print_ctx(ctx2);
-				printf("presence:   MISSING  !=  EXISTS \n");
+				cmp_printf("presence:   "
+					"MISSING  !=  EXISTS \n");
 				set_prev(&prev_name, &prev_atype, name2, atype2);
 			}
 
@@ -894,14 +1059,269 @@ out:
 	return ret;
 }
 
-static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
+static int cmp_inode(ntfs_volume *vol1, ntfs_volume *vol2, u64 inode)
 {
-	u64 inode;
 	int ret1, ret2;
 	ntfs_inode *ni1, *ni2;
+
+	ret1 = inode_open(vol1, (MFT_REF)inode, &ni1);
+	ret2 = inode_open(vol2, (MFT_REF)inode, &ni2);
+
+	if (ret1 != ret2) {
+		print_inode(inode);
+		cmp_printf("open:   %s  !=  %s\n",
+		       err2string(ret1), err2string(ret2));
+		goto close_inodes;
+	}
+
+	if (ret1 != NTFSCMP_OK)
+		goto close_inodes;
+
+	if (cmp_attributes(ni1, ni2) != 0) {
+		inode_close(ni1);
+		inode_close(ni2);
+		return -1;
+	}
+close_inodes:
+	if (inode_close(ni1) != 0)
+		return -1;
+	if (inode_close(ni2) != 0)
+		return -1;
+	return 0;
+}
+
+static void setup_context(struct CMP_CONTEXT *ctx)
+{
+	ctx->out = stdout;
+	ctx->buf1 = ntfs_malloc(CMP_BUFFER_SIZE);
+	ctx->buf2 = ntfs_malloc(CMP_BUFFER_SIZE);
+	if (!ctx->buf1 || !ctx->buf2)
+		perr_exit("Failed to allocate the comparison buffers");
+}
+
+static void free_context(struct CMP_CONTEXT *ctx)
+{
+	free(ctx->buf1);
+	free(ctx->buf2);
+	ctx->buf1 = ctx->buf2 = NULL;
+}
+
+static ntfs_volume *mount_volume(const char *volume);
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ *		Comparing with several threads
+ *
+ *	The mft is split into ranges of CMP_RANGE_RECORDS records, which
+ *	are compared by the workers, each of them having mounted both
+ *	volumes on its own, as the library does not share a volume between
+ *	threads. The differences in a range are reported into a temporary
+ *	file, which is copied to stdout in the order of the ranges, so that
+ *	the output is the same as when comparing with a single thread.
+ */
+
+enum { CMP_SLOT_FREE, CMP_SLOT_BUSY, CMP_SLOT_DONE } ;
+
+struct CMP_SLOT {
+	u64 first;
+	FILE *out;
+	int state;
+	int ret;
+} ;
+
+struct CMP_POOL;
+
+struct CMP_WORKER {
+	struct CMP_POOL *pool;
+	ntfs_volume *vol1;
+	ntfs_volume *vol2;
+	struct CMP_CONTEXT context;
+	pthread_t thread;
+} ;
+
+struct CMP_POOL {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct CMP_WORKER workers[CMP_MAX_THREADS];
+	struct CMP_SLOT slots[2*CMP_MAX_THREADS];
+	int nr_workers;
+	int nr_slots;
+	u64 nr_records;
+	u64 next;
+	BOOL abort;
+} ;
+
+static void *cmp_worker(void *arg)
+{
+	struct CMP_WORKER *w = (struct CMP_WORKER*)arg;
+	struct CMP_POOL *pool = w->pool;
+	struct CMP_SLOT *slot;
+	u64 inode, end;
+	int ret;
+
+	pthread_setspecific(context_key, &w->context);
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->abort && (pool->next < pool->nr_records)) {
+		slot = &pool->slots[(pool->next / CMP_RANGE_RECORDS)
+						% pool->nr_slots];
+		if (slot->state != CMP_SLOT_FREE) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		slot->state = CMP_SLOT_BUSY;
+		slot->first = pool->next;
+		pool->next += CMP_RANGE_RECORDS;
+		pthread_mutex_unlock(&pool->lock);
+
+		end = slot->first + CMP_RANGE_RECORDS;
+		if (end > pool->nr_records)
+			end = pool->nr_records;
+		ret = -1;
+		w->context.out = stdout;
+		slot->out = tmpfile();
+		if (!slot->out)
+			perr_println("Failed to create a temporary file");
+		else {
+			w->context.out = slot->out;
+			ret = 0;
+			for (inode = slot->first; (inode < end) && !ret;
+					inode++)
+				ret = cmp_inode(w->vol1, w->vol2, inode);
+			fflush(slot->out);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		slot->ret = ret;
+		slot->state = CMP_SLOT_DONE;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void copy_output(FILE *out)
+{
+	char buf[NTFS_BUF_SIZE];
+	size_t count;
+
+	rewind(out);
+	while ((count = fread(buf, 1, sizeof(buf), out)) > 0)
+		fwrite(buf, 1, count, stdout);
+	fflush(stdout);
+}
+
+static int cmp_inodes_parallel(ntfs_volume *vol1, ntfs_volume *vol2,
+			u64 nr_mft_records, struct progress_bar *progress)
+{
+	struct CMP_POOL *pool;
+	struct CMP_WORKER *w;
+	struct CMP_SLOT *slot;
+	u64 first, inode, end;
+	int ret = 0;
+	int i;
+
+	pool = ntfs_calloc(sizeof(struct CMP_POOL));
+	if (!pool)
+		perr_exit("Failed to allocate the threads");
+	if (!context_key_set) {
+		if (pthread_key_create(&context_key, NULL))
+			perr_exit("Failed to create the thread key");
+		context_key_set = TRUE;
+	}
+	if (pthread_mutex_init(&pool->lock, NULL)
+	    || pthread_cond_init(&pool->cond, NULL))
+		perr_exit("Failed to initialize the threads");
+	pool->nr_records = nr_mft_records;
+	pool->nr_slots = 2*opt.threads;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < opt.threads; i++) {
+		w = &pool->workers[i];
+		w->pool = pool;
+		if (i) {
+			w->vol1 = mount_volume(opt.vol1);
+			w->vol2 = mount_volume(opt.vol2);
+		} else {
+			w->vol1 = vol1;
+			w->vol2 = vol2;
+		}
+		setup_context(&w->context);
+		if (pthread_create(&w->thread, NULL, cmp_worker, w)) {
+			perr_println("Failed to create a thread");
+			if (i) {
+				ntfs_umount(w->vol1, FALSE);
+				ntfs_umount(w->vol2, FALSE);
+			}
+			free_context(&w->context);
+			break;
+		}
+		pool->nr_workers++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (!pool->nr_workers)
+		exit(1);
+
+	for (first = 0; (first < nr_mft_records) && !ret;
+			first += CMP_RANGE_RECORDS) {
+		slot = &pool->slots[(first / CMP_RANGE_RECORDS)
+						% pool->nr_slots];
+		pthread_mutex_lock(&pool->lock);
+		while (slot->state != CMP_SLOT_DONE)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (slot->out) {
+			copy_output(slot->out);
+			fclose(slot->out);
+			slot->out = NULL;
+		}
+		ret = slot->ret;
+		end = first + CMP_RANGE_RECORDS;
+		if (end > nr_mft_records)
+			end = nr_mft_records;
+		for (inode = first; (inode < end) && !ret; inode++)
+			progress_update(progress, inode);
+
+		pthread_mutex_lock(&pool->lock);
+		slot->state = CMP_SLOT_FREE;
+		if (ret)
+			pool->abort = TRUE;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->abort = TRUE;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_workers; i++) {
+		w = &pool->workers[i];
+		pthread_join(w->thread, NULL);
+		if (i) {
+			ntfs_umount(w->vol1, FALSE);
+			ntfs_umount(w->vol2, FALSE);
+		}
+		free_context(&w->context);
+	}
+	for (i = 0; i < pool->nr_slots; i++)
+		if (pool->slots[i].out)
+			fclose(pool->slots[i].out);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return ret;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
+{
+	u64 inode;
 	struct progress_bar progress;
 	int pb_flags = 0;	/* progress bar flags */
 	u64 nr_mft_records, nr_mft_records2;
+	int ret = 0;
 
 	if (opt.show_progress)
 		pb_flags |= NTFS_PROGBAR;
@@ -911,7 +1331,7 @@ static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 
 	if (nr_mft_records != nr_mft_records2) {
 
-		printf("Number of mft records:   %lld  !=  %lld\n",
+		cmp_printf("Number of mft records:   %lld  !=  %lld\n",
 		       (long long)nr_mft_records, (long long)nr_mft_records2);
 
 		if (nr_mft_records > nr_mft_records2)
@@ -921,35 +1341,19 @@ static int cmp_inodes(ntfs_volume *vol1, ntfs_volume *vol2)
 	progress_init(&progress, 0, nr_mft_records - 1, pb_flags);
 	progress_update(&progress, 0);
 
-	for (inode = 0; inode < nr_mft_records; inode++) {
-
-		ret1 = inode_open(vol1, (MFT_REF)inode, &ni1);
-		ret2 = inode_open(vol2, (MFT_REF)inode, &ni2);
-
-		if (ret1 != ret2) {
-			print_inode(inode);
-			printf("open:   %s  !=  %s\n",
-			       err2string(ret1), err2string(ret2));
-			goto close_inodes;
-		}
-
-		if (ret1 != NTFSCMP_OK)
-			goto close_inodes;
-
-		if (cmp_attributes(ni1, ni2) != 0) {
-			inode_close(ni1);
-			inode_close(ni2);
-			return -1;
-		}
-close_inodes:
-		if (inode_close(ni1) != 0)
-			return -1;
-		if (inode_close(ni2) != 0)
-			return -1;
-
-		progress_update(&progress, inode);
+#ifdef HAVE_PTHREAD_H
+	if (opt.threads > 1)
+		return cmp_inodes_parallel(vol1, vol2, nr_mft_records,
+					&progress);
+#endif
+	setup_context(&main_context);
+	for (inode = 0; (inode < nr_mft_records) && !ret; inode++) {
+		ret = cmp_inode(vol1, vol2, inode);
+		if (!ret)
+			progress_update(&progress, inode);
 	}
-	return 0;
+	free_context(&main_context);
+	return ret;
 }
 
 static ntfs_volume *mount_volume(const char *volume)
@@ -48,9 +48,14 @@
 #ifdef HAVE_LIBGEN_H
 #include <libgen.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <dirent.h>
 
 #include "types.h"
 #include "attrib.h"
+#include "compress.h"
 #include "utils.h"
 #include "volume.h"
 #include "dir.h"
@@ -70,10 +75,13 @@ struct options {
 	int		 quiet;		/* Less output */
 	int		 verbose;	/* Extra output */
 	int		 minfragments;	/* Do minimal fragmentation */
+	int		 stream;	/* Write big chunks to the clusters */
+	int		 recursive;	/* Copy a directory tree */
 	int		 timestamp;	/* Copy the modification time */
 	int		 noaction;	/* Do not write to disk */
 	ATTR_TYPES	 attribute;	/* Write to this attribute. */
 	int		 inode;		/* Treat dest_file as inode number. */
+	int		 level;		/* Compression level, 0 for default */
 };
 
 struct ALLOC_CONTEXT {
@@ -91,6 +99,35 @@ struct ALLOC_CONTEXT {
 
 enum STEP { STEP_ERR, STEP_ZERO, STEP_ONE } ;
 
+#define COPY_CHUNK 4194304 /* bytes read and written at once by --stream */
+#define COPY_BUFFERS 3 /* chunks read ahead of the writes */
+
+enum CHUNK_STATE { CHUNK_FREE, CHUNK_FULL } ;
+
+/*
+ *		The chunks read ahead of the writes, in a ring
+ *
+ *	With threads, the source is read by a thread of its own while
+ *	the previous chunks are being written.
+ */
+
+struct COPY_READER {
+	FILE *in;
+	char *buf[COPY_BUFFERS];
+	s64 count[COPY_BUFFERS];
+	enum CHUNK_STATE state[COPY_BUFFERS];
+	s32 chunk;		/* size of the chunks */
+	int next_read;
+	int next_write;
+	BOOL stop;		/* the writer does not want more chunks */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	BOOL started;
+#endif
+} ;
+
 static const char *EXEC_NAME = "ntfscp";
 static struct options opts;
 static volatile sig_atomic_t caught_terminate = 0;
@@ -124,6 +161,8 @@ static void usage(void)
 {
 	ntfs_log_info("\nUsage: %s [options] device src_file dest_file\n\n"
 		"    -a, --attribute NUM   Write to this attribute\n"
+		"    -c, --compression-level NUM\n"
+		"                          Compression level, 1 (fast) to 3 (best)\n"
 		"    -i, --inode           Treat dest_file as inode number\n"
 		"    -f, --force           Use less caution\n"
 		"    -h, --help            Print this help\n"
@@ -131,6 +170,8 @@ static void usage(void)
 		"    -N, --attr-name NAME  Write to attribute with this name\n"
 		"    -n, --no-action       Do not write to disk\n"
 		"    -q, --quiet           Less output\n"
+		"    -R, --recursive       Copy a directory and its contents\n"
+		"    -s, --stream          Preallocate and write big chunks\n"
 		"    -t, --timestamp       Copy the modification time\n"
 		"    -V, --version         Version information\n"
 		"    -v, --verbose         More output\n\n",
@@ -149,9 +190,10 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-a:ifh?mN:no:qtVv";
+	static const char *sopt = "-a:c:ifh?mN:no:qRstVv";
 	static const struct option lopt[] = {
 		{ "attribute",	required_argument,	NULL, 'a' },
+		{ "compression-level", required_argument, NULL, 'c' },
 		{ "inode",	no_argument,		NULL, 'i' },
 		{ "force",	no_argument,		NULL, 'f' },
 		{ "help",	no_argument,		NULL, 'h' },
@@ -159,6 +201,8 @@ static int parse_options(int argc, char **argv)
 		{ "attr-name",	required_argument,	NULL, 'N' },
 		{ "no-action",	no_argument,		NULL, 'n' },
 		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "recursive",	no_argument,		NULL, 'R' },
+		{ "stream",	no_argument,		NULL, 's' },
 		{ "timestamp",	no_argument,		NULL, 't' },
 		{ "version",	no_argument,		NULL, 'V' },
 		{ "verbose",	no_argument,		NULL, 'v' },
@@ -178,6 +222,7 @@ static int parse_options(int argc, char **argv)
 	opts.dest_file = NULL;
 	opts.attr_name = NULL;
 	opts.inode = 0;
+	opts.level = 0;
 	opts.attribute = AT_DATA;
 	opts.timestamp = 0;
 
@@ -213,6 +258,14 @@ static int parse_options(int argc, char **argv)
 			} else
 				opts.attribute = (ATTR_TYPES)cpu_to_le32(attr);
 			break;
+		case 'c':
+			opts.level = strtol(optarg, &s, 0);
+			if (*s || (opts.level < NTFS_COMPRESS_FAST)
+			    || (opts.level > NTFS_COMPRESS_BEST)) {
+				ntfs_log_error("Invalid compression level.\n");
+				err++;
+			}
+			break;
 		case 'i':
 			opts.inode++;
 			break;
@@ -240,6 +293,13 @@ static int parse_options(int argc, char **argv)
 			opts.quiet++;
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
 			break;
+		case 'R':
+			opts.recursive++;
+			break;
+		case 's':
+			opts.stream++;
+			opts.minfragments++;
+			break;
 		case 't':
 			opts.timestamp++;
 			break;
@@ -298,6 +358,13 @@ static int parse_options(int argc, char **argv)
 					" with unname data attribute.\n");
 			err++;
 		}
+		if (opts.recursive && (opts.inode || opts.attr_name
+				|| (opts.attribute != AT_DATA))) {
+			ntfs_log_error("Copying recursively is only possible"
+					" to unnamed data attributes of files"
+					" designated by name.\n");
+			err++;
+		}
 	}
 
 	if (ver)
@@ -797,15 +864,358 @@ static int preallocate(ntfs_attr *na, s64 new_size)
 	return (err);
 }
 
+/*
+ *		Read the next chunk of the source
+ *
+ *	Returns the count of bytes read, 0 at end of file
+ *		or -1 if there was an error
+ */
+
+static s64 read_chunk(struct COPY_READER *rd, char *buf)
+{
+	s64 br;
+
+	br = fread(buf, 1, rd->chunk, rd->in);
+	if (!br && !feof(rd->in)) {
+		ntfs_log_perror("ERROR: fread failed");
+		br = -1;
+	}
+	return (br);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ *		Read the source into the free chunks, ahead of the writes
+ */
+
+static void *reader_thread(void *arg)
+{
+	struct COPY_READER *rd = (struct COPY_READER*)arg;
+	s64 br;
+	int k;
+
+	br = 1;
+	pthread_mutex_lock(&rd->lock);
+	while (!rd->stop && (br > 0)) {
+		k = rd->next_read;
+		if (rd->state[k] != CHUNK_FREE) {
+			pthread_cond_wait(&rd->cond, &rd->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&rd->lock);
+		br = read_chunk(rd, rd->buf[k]);
+		pthread_mutex_lock(&rd->lock);
+		rd->count[k] = br;
+		rd->state[k] = CHUNK_FULL;
+		rd->next_read = (k + 1) % COPY_BUFFERS;
+		pthread_cond_broadcast(&rd->cond);
+	}
+	pthread_mutex_unlock(&rd->lock);
+	return ((void*)NULL);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Start reading the source
+ *
+ *	The read ahead is only done when a thread can be used, otherwise
+ *	the chunks are read when they are requested.
+ *
+ *	Returns 0 if successful
+ *		-1 otherwise, with errno set accordingly
+ */
+
+static int reader_start(struct COPY_READER *rd, FILE *in, s32 chunk)
+{
+	int err;
+	int k;
+
+	err = 0;
+	memset(rd, 0, sizeof(struct COPY_READER));
+	rd->in = in;
+	rd->chunk = chunk;
+	for (k=0; (k<COPY_BUFFERS) && !err; k++) {
+		rd->buf[k] = (char*)ntfs_malloc(chunk);
+		rd->state[k] = CHUNK_FREE;
+		if (!rd->buf[k])
+			err = -1;
+	}
+#ifdef HAVE_PTHREAD_H
+	if (!err) {
+		pthread_mutex_init(&rd->lock, (pthread_mutexattr_t*)NULL);
+		pthread_cond_init(&rd->cond, (pthread_condattr_t*)NULL);
+		rd->started = !pthread_create(&rd->thread,
+				(pthread_attr_t*)NULL, reader_thread, rd);
+	}
+#endif
+	if (err) {
+		for (k=0; k<COPY_BUFFERS; k++)
+			free(rd->buf[k]);
+	}
+	return (err);
+}
+
+/*
+ *		Get the next chunk of the source
+ *
+ *	The chunk must be released by reader_release() before getting
+ *	the next one.
+ *
+ *	Returns the count of bytes in the chunk, 0 at end of file
+ *		or -1 if there was an error
+ */
+
+static s64 reader_get(struct COPY_READER *rd, char **pbuf)
+{
+	s64 br;
+	int k;
+
+	k = rd->next_write;
+	*pbuf = rd->buf[k];
+#ifdef HAVE_PTHREAD_H
+	if (rd->started) {
+		pthread_mutex_lock(&rd->lock);
+		while (rd->state[k] != CHUNK_FULL)
+			pthread_cond_wait(&rd->cond, &rd->lock);
+		br = rd->count[k];
+		pthread_mutex_unlock(&rd->lock);
+	} else
+#endif
+		br = read_chunk(rd, rd->buf[k]);
+	return (br);
+}
+
+/*
+ *		Release the chunk got by reader_get(), so that it can be
+ *	filled again
+ */
+
+static void reader_release(struct COPY_READER *rd)
+{
+	int k;
+
+	k = rd->next_write;
+	rd->next_write = (k + 1) % COPY_BUFFERS;
+#ifdef HAVE_PTHREAD_H
+	if (rd->started) {
+		pthread_mutex_lock(&rd->lock);
+		rd->state[k] = CHUNK_FREE;
+		pthread_cond_broadcast(&rd->cond);
+		pthread_mutex_unlock(&rd->lock);
+	}
+#endif
+}
+
+/*
+ *		Stop reading the source and free the chunks
+ */
+
+static void reader_stop(struct COPY_READER *rd)
+{
+	int k;
+
+#ifdef HAVE_PTHREAD_H
+	if (rd->started) {
+		pthread_mutex_lock(&rd->lock);
+		rd->stop = TRUE;
+		pthread_cond_broadcast(&rd->cond);
+		pthread_mutex_unlock(&rd->lock);
+		pthread_join(rd->thread, (void**)NULL);
+	}
+	pthread_cond_destroy(&rd->cond);
+	pthread_mutex_destroy(&rd->lock);
+#endif
+	for (k=0; k<COPY_BUFFERS; k++)
+		free(rd->buf[k]);
+}
+
+/*
+ *		Write a chunk straight to the clusters allocated to an
+ *	attribute
+ *
+ *	The position and count are multiples of the cluster size.
+ *
+ *	Returns 0 if successful
+ *		-1 otherwise, with errno set accordingly
+ */
+
+static int write_runs(ntfs_volume *vol, const runlist_element *rl,
+			s64 pos, s64 count, const char *buf)
+{
+	s64 inrun;
+	s64 n;
+	int err;
+
+	err = 0;
+	while ((count > 0) && !err) {
+		while (rl->length
+		    && (((rl->vcn + rl->length) << vol->cluster_size_bits)
+				<= pos))
+			rl++;
+		if (!rl->length || (rl->lcn < 0)) {
+			errno = EIO;
+			err = -1;
+		} else {
+			inrun = ((rl->vcn + rl->length)
+					<< vol->cluster_size_bits) - pos;
+			n = (count < inrun ? count : inrun);
+			if (ntfs_pwrite(vol->dev, (rl->lcn
+					<< vol->cluster_size_bits)
+				+ pos - (rl->vcn << vol->cluster_size_bits),
+					n, buf) != n)
+				err = -1;
+			pos += n;
+			buf += n;
+			count -= n;
+		}
+	}
+	return (err);
+}
+
+/*
+ *		Record the initialized size once the data has been written
+ *
+ *	Returns 0 if successful
+ *		-1 otherwise, with errno set accordingly
+ */
+
+static int set_initialized(ntfs_attr *na)
+{
+	ntfs_attr_search_ctx *ctx;
+	int err;
+
+	err = -1;
+	ctx = ntfs_attr_get_search_ctx(na->ni, NULL);
+	if (ctx) {
+		if (!ntfs_attr_lookup(opts.attribute, na->name, na->name_len,
+				CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+			na->initialized_size = na->data_size;
+			ctx->attr->initialized_size =
+					cpu_to_sle64(na->initialized_size);
+			ntfs_inode_mark_dirty(ctx->ntfs_ino);
+			if ((opts.attribute == AT_DATA) && !na->name_len)
+				NInoFileNameSetDirty(na->ni);
+			err = 0;
+		}
+		ntfs_attr_put_search_ctx(ctx);
+	}
+	return (err);
+}
+
+/*
+ *		Check whether an attribute can be streamed to
+ *
+ *	The clusters must have been allocated by preallocate(), and the
+ *	data must not need any transformation.
+ */
+
+static BOOL can_stream(ntfs_attr *na)
+{
+	const runlist_element *rl;
+	s64 clusters;
+	BOOL ok;
+
+	ok = NAttrNonResident(na)
+		&& !(na->data_flags & (ATTR_COMPRESSION_MASK
+					| ATTR_IS_ENCRYPTED))
+		&& na->rl
+		&& !na->initialized_size;
+	if (ok) {
+		clusters = 0;
+		for (rl=na->rl; rl->length && ok; rl++) {
+			if ((rl->lcn < 0) || (rl->vcn != clusters))
+				ok = FALSE;
+			clusters += rl->length;
+		}
+		if (clusters != ((na->data_size + na->ni->vol->cluster_size
+					- 1) >> na->ni->vol->cluster_size_bits))
+			ok = FALSE;
+	}
+	return (ok);
+}
+
+/*
+ *		Copy the source straight to the clusters of an attribute
+ *
+ *	The source is read by big chunks ahead of the writes, which are
+ *	done to the device, bypassing the attribute, and the initialized
+ *	size is only set when all the data has been written. The end of
+ *	the last cluster is filled with zeroes.
+ *
+ *	Returns 0 if successful
+ *		-1 otherwise, with errno set accordingly
+ */
+
+static int stream_data(ntfs_attr *na, FILE *in)
+{
+	struct COPY_READER rd;
+	ntfs_volume *vol;
+	char *buf;
+	s64 offset;
+	s64 br;
+	s64 len;
+	s32 chunk;
+	int err;
+
+	err = 0;
+	vol = na->ni->vol;
+	chunk = (COPY_CHUNK > vol->cluster_size ? COPY_CHUNK
+						: vol->cluster_size);
+	if (reader_start(&rd, in, chunk)) {
+		ntfs_log_perror("ERROR: Couldn't allocate the chunks");
+		return (-1);
+	}
+	ntfs_log_verbose("Streaming by chunks of %ld bytes.\n", (long)chunk);
+	offset = 0;
+	br = 0;
+	while (!err && ((br = reader_get(&rd, &buf)) > 0)) {
+		if (caught_terminate) {
+			ntfs_log_error("SIGTERM or SIGINT received.  "
+					"Aborting write.\n");
+			err = -1;
+			break;
+		}
+			/* ignore what was appended since the file was sized */
+		if (br > (na->data_size - offset))
+			br = na->data_size - offset;
+		len = (br + vol->cluster_size - 1) & -vol->cluster_size;
+		if (len > br)
+			memset(buf + br, 0, len - br);
+		if (!opts.noaction
+		    && write_runs(vol, na->rl, offset, len, buf)) {
+			ntfs_log_perror("ERROR: Couldn't write to the device");
+			err = -1;
+		}
+		offset += br;
+		reader_release(&rd);
+		if (offset >= na->data_size)
+			break;
+	}
+	if (br < 0)
+		err = -1;
+	reader_stop(&rd);
+	if (!err && (offset < na->data_size)) {
+		ntfs_log_error("ERROR: The source file was truncated.\n");
+		err = -1;
+	}
+	if (!err && !opts.noaction && set_initialized(na)) {
+		ntfs_log_perror("ERROR: Couldn't set the initialized size");
+		err = -1;
+	}
+	return (err);
+}
+
 /**
- * Create a regular file under the given directory inode
+ * Create a regular file or a directory under the given directory inode
  *
  * It is a wrapper function to ntfs_create(...)
  *
  * Return:  the created file inode
  */
 static ntfs_inode *ntfs_new_file(ntfs_inode *dir_ni,
-			  const char *filename)
+			  const char *filename, mode_t type)
 {
 	ntfschar *ufilename;
 	/* inode to the file that is being created */
@@ -820,11 +1230,368 @@ static ntfs_inode *ntfs_new_file(ntfs_inode *dir_ni,
 					filename);
 		return NULL;
 	}
-	ni = ntfs_create(dir_ni, const_cpu_to_le32(0), ufilename, ufilename_len, S_IFREG);
+	ni = ntfs_create(dir_ni, const_cpu_to_le32(0), ufilename, ufilename_len, type);
 	free(ufilename);
 	return ni;
 }
 
+/*
+ *		Copy an opened source to an attribute of an inode
+ *
+ *	Returns 0 if successful, even if the copy was interrupted
+ *		-1 if the attribute could not be set up
+ */
+
+static int copy_file(ntfs_inode *out, FILE *in, s64 new_size)
+{
+	struct stat st;
+	ntfs_attr *na;
+	int result = -1;
+	u64 offset;
+	char *buf;
+	s64 br, bw;
+	ntfschar *attr_name;
+	int attr_name_len = 0;
+	BOOL minfragments;
+
+	minfragments = opts.minfragments;
+	attr_name = ntfs_str2ucs(opts.attr_name, &attr_name_len);
+	if (!attr_name) {
+		ntfs_log_perror("ERROR: Failed to parse attribute name '%s'",
+				opts.attr_name);
+		return (-1);
+	}
+
+	na = ntfs_attr_open(out, opts.attribute, attr_name, attr_name_len);
+	if (!na) {
+		if (errno != ENOENT) {
+			ntfs_log_perror("ERROR: Couldn't open attribute");
+			goto free_name;
+		}
+		/* Requested attribute isn't present, add it. */
+		if (ntfs_attr_add(out, opts.attribute, attr_name,
+				attr_name_len, NULL, 0)) {
+			ntfs_log_perror("ERROR: Couldn't add attribute");
+			goto free_name;
+		}
+		na = ntfs_attr_open(out, opts.attribute, attr_name,
+				attr_name_len);
+		if (!na) {
+			ntfs_log_perror("ERROR: Couldn't open just added "
+					"attribute");
+			goto free_name;
+		}
+	}
+
+	ntfs_log_verbose("Old file size: %lld\n", (long long)na->data_size);
+	if (minfragments && NAttrCompressed(na)) {
+		ntfs_log_info("Warning : Cannot avoid fragmentation"
+				" of a compressed attribute\n");
+		minfragments = FALSE;
+		}
+	if (na->data_size && minfragments) {
+		if (ntfs_attr_truncate(na, 0)) {
+			ntfs_log_perror(
+				"ERROR: Couldn't truncate existing attribute");
+			goto close_attr;
+		}
+	}
+	if (na->data_size != new_size) {
+		if (minfragments) {
+			/*
+			 * Do a standard truncate() to check whether the
+			 * attribute has to be made non-resident.
+			 * If still resident, preallocation is not needed.
+			 */
+			if (ntfs_attr_truncate(na, new_size)) {
+				ntfs_log_perror(
+					"ERROR: Couldn't resize attribute");
+				goto close_attr;
+			}
+			if (NAttrNonResident(na)
+			   && preallocate(na, new_size)) {
+				ntfs_log_perror(
+				    "ERROR: Couldn't preallocate attribute");
+				goto close_attr;
+			}
+		} else {
+			if (ntfs_attr_truncate_solid(na, new_size)) {
+				ntfs_log_perror(
+					"ERROR: Couldn't resize attribute");
+				goto close_attr;
+			}
+		}
+	}
+
+	if (opts.stream && minfragments && can_stream(na)) {
+		ntfs_log_verbose("Starting write.\n");
+		stream_data(na, in);
+		ntfs_log_verbose("Syncing.\n");
+		result = 0;
+		goto close_attr;
+	}
+
+	buf = malloc(NTFS_BUF_SIZE);
+	if (!buf) {
+		ntfs_log_perror("ERROR: malloc failed");
+		goto close_attr;
+	}
+
+	ntfs_log_verbose("Starting write.\n");
+	offset = 0;
+	while (!feof(in)) {
+		if (caught_terminate) {
+			ntfs_log_error("SIGTERM or SIGINT received.  "
+					"Aborting write.\n");
+			break;
+		}
+		br = fread(buf, 1, NTFS_BUF_SIZE, in);
+		if (!br) {
+			if (!feof(in)) ntfs_log_perror("ERROR: fread failed");
+			break;
+		}
+		bw = ntfs_attr_pwrite(na, offset, br, buf);
+		if (bw != br) {
+			ntfs_log_perror("ERROR: ntfs_attr_pwrite failed");
+			break;
+		}
+		offset += bw;
+	}
+	if ((na->data_flags & ATTR_COMPRESSION_MASK)
+	    && ntfs_attr_pclose(na))
+		ntfs_log_perror("ERROR: ntfs_attr_pclose failed");
+	ntfs_log_verbose("Syncing.\n");
+	result = 0;
+	free(buf);
+close_attr:
+	ntfs_attr_close(na);
+	if (opts.timestamp) {
+		if (!fstat(fileno(in),&st)) {
+			s64 change_time = st.st_mtime*10000000LL
+					+ NTFS_TIME_OFFSET;
+			out->last_data_change_time = cpu_to_sle64(change_time);
+			ntfs_inode_update_times(out, 0);
+		} else {
+			ntfs_log_error("Failed to get the time stamp.\n");
+		}
+	}
+free_name:
+	ntfs_ucsfree(attr_name);
+	return (result);
+}
+
+/*
+ *		Get a sub-directory, creating it if it does not exist
+ *
+ *	Returns the inode of the sub-directory
+ *		or NULL if there was an error, which has been reported
+ */
+
+static ntfs_inode *get_subdir(ntfs_inode *dir_ni, const char *name)
+{
+	ntfs_inode *ni;
+
+	ni = ntfs_pathname_to_inode(dir_ni->vol, dir_ni, name);
+	if (ni) {
+		if (!(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+			ntfs_log_error("The file '%s' already exists and is"
+					" not a directory.\n", name);
+			ntfs_inode_close(ni);
+			ni = (ntfs_inode*)NULL;
+		}
+	} else {
+		ntfs_log_verbose("Creating a new directory '%s'\n", name);
+		ni = ntfs_new_file(dir_ni, name, S_IFDIR);
+		if (!ni)
+			ntfs_log_perror("ERROR: Failed to create the "
+					"directory '%s'", name);
+	}
+	return (ni);
+}
+
+/*
+ *		Copy the contents of a directory into a directory of
+ *	the volume
+ *
+ *	Existing files are overwritten and existing directories are
+ *	merged. Only regular files and directories are copied.
+ *	The directory is kept open while its entries are copied, so they
+ *	have to be closed within it.
+ *
+ *	Returns 0 if successful
+ *		-1 if there was an error, which has been reported
+ */
+
+static int copy_tree(ntfs_inode *dir_ni, const char *path)
+{
+	struct stat st;
+	struct dirent *entry;
+	DIR *dir;
+	FILE *in;
+	ntfs_inode *ni;
+	char *child;
+	int err;
+
+	dir = opendir(path);
+	if (!dir) {
+		ntfs_log_perror("ERROR: Couldn't open directory '%s'", path);
+		return (-1);
+	}
+	err = 0;
+	while (!err && !caught_terminate && (entry = readdir(dir))) {
+		if (!strcmp(entry->d_name, ".")
+		    || !strcmp(entry->d_name, ".."))
+			continue;
+		child = (char*)malloc(strlen(path)
+					+ strlen(entry->d_name) + 2);
+		if (!child) {
+			ntfs_log_perror("ERROR: malloc failed");
+			err = -1;
+			break;
+		}
+		sprintf(child, "%s/%s", path, entry->d_name);
+#ifdef HAVE_WINDOWS_H
+		if (stat(child, &st)) {
+#else
+		if (lstat(child, &st)) {
+#endif
+			ntfs_log_perror("ERROR: Couldn't stat '%s'", child);
+			err = -1;
+		} else if (S_ISDIR(st.st_mode)) {
+			ni = get_subdir(dir_ni, entry->d_name);
+			if (ni) {
+				err = copy_tree(ni, child);
+				if (ntfs_inode_close_in_dir(ni, dir_ni))
+					err = -1;
+			} else
+				err = -1;
+		} else if (S_ISREG(st.st_mode)) {
+			ntfs_log_verbose("Copying '%s'\n", child);
+			ni = ntfs_pathname_to_inode(dir_ni->vol, dir_ni,
+					entry->d_name);
+			if (ni && (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+				ntfs_log_error("The directory '%s' already "
+					"exists, cannot copy '%s'.\n",
+					entry->d_name, child);
+				ntfs_inode_close(ni);
+				ni = (ntfs_inode*)NULL;
+				err = -1;
+			} else if (!ni) {
+				ni = ntfs_new_file(dir_ni, entry->d_name,
+						S_IFREG);
+				if (!ni) {
+					ntfs_log_perror("ERROR: Failed to "
+						"create '%s'", entry->d_name);
+					err = -1;
+				}
+			}
+			if (ni) {
+				in = fopen(child, "r");
+				if (in) {
+					if (copy_file(ni, in, st.st_size))
+						err = -1;
+					fclose(in);
+				} else {
+					ntfs_log_perror("ERROR: Couldn't open "
+						"'%s'", child);
+					err = -1;
+				}
+				if (ntfs_inode_close_in_dir(ni, dir_ni)) {
+					ntfs_log_error("Sync failed. "
+						"Run chkdsk.\n");
+					err = -1;
+				}
+			}
+		} else
+			ntfs_log_info("Skipping '%s', which is not a regular"
+					" file or a directory\n", child);
+		free(child);
+	}
+	closedir(dir);
+	return (err);
+}
+
+/*
+ *		Copy a source directory to the volume
+ *
+ *	If the destination is an existing directory, the source directory
+ *	is copied into it, otherwise the destination is created as a
+ *	directory in its parent.
+ *
+ *	Returns 0 if successful
+ *		-1 if there was an error, which has been reported
+ */
+
+static int copy_dir(ntfs_volume *vol, const char *dest)
+{
+	ntfs_inode *out;
+	ntfs_inode *dir_ni;
+	char *parent_dirname;
+	char *dirname_last_whack;
+	const char *name;
+	int err;
+
+	err = -1;
+	dir_ni = (ntfs_inode*)NULL;
+	out = ntfs_pathname_to_inode(vol, NULL, dest);
+	if (out) {
+		if (out->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+			dir_ni = get_subdir(out, basename(opts.src_file));
+		else
+			ntfs_log_error("The file '%s' already exists and is"
+					" not a directory.\n", dest);
+		ntfs_inode_close(out);
+	} else {
+		parent_dirname = strdup(dest);
+		if (!parent_dirname) {
+			ntfs_log_perror("strdup() failed");
+			return (-1);
+		}
+		dirname_last_whack = strrchr(parent_dirname, '/');
+		if (dirname_last_whack) {
+			if (dirname_last_whack == parent_dirname)
+				dirname_last_whack[1] = 0;
+			else
+				*dirname_last_whack = 0;
+			out = ntfs_pathname_to_inode(vol, NULL,
+					parent_dirname);
+		} else
+			out = ntfs_inode_open(vol, FILE_root);
+		if (out) {
+			name = (dirname_last_whack ? dest
+					+ (dirname_last_whack - parent_dirname)
+					+ 1 : dest);
+			if (!*name)
+				ntfs_log_error("Invalid destination '%s'.\n",
+					dest);
+			else if (out->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+				dir_ni = get_subdir(out, name);
+			else
+				ntfs_log_error("The file '%s' already exists "
+					"and is not a directory.\n",
+					parent_dirname);
+			ntfs_inode_close(out);
+		} else
+			ntfs_log_perror("ERROR: Couldn't open '%s'",
+					parent_dirname);
+		free(parent_dirname);
+	}
+	if (dir_ni) {
+		err = copy_tree(dir_ni, opts.src_file);
+		while (ntfs_inode_close(dir_ni) && !opts.noaction) {
+			if (errno != EBUSY) {
+				ntfs_log_error("Sync failed. Run chkdsk.\n");
+				err = -1;
+				break;
+			}
+			ntfs_log_error("Device busy.  Will retry sync in 3 "
+					"seconds.\n");
+			sleep(3);
+		}
+	}
+	return (err);
+}
+
 /**
  * main - Begin here
  *
@@ -836,19 +1603,13 @@ static ntfs_inode *ntfs_new_file(ntfs_inode *dir_ni,
 int main(int argc, char *argv[])
 {
 	FILE *in;
-	struct stat st;
 	ntfs_volume *vol;
 	ntfs_inode *out;
-	ntfs_attr *na;
 	int flags = 0;
 	int res;
 	int result = 1;
 	s64 new_size;
-	u64 offset;
-	char *buf;
-	s64 br, bw;
-	ntfschar *attr_name;
-	int attr_name_len = 0;
+	BOOL isdir;
 #ifdef HAVE_WINDOWS_H
 	char *unix_name;
 #endif
@@ -887,6 +1648,8 @@ int main(int argc, char *argv[])
 		goto umount;
 
 	NVolSetCompression(vol); /* allow compression */
+	if (opts.level && ntfs_set_compression_level(vol, opts.level))
+		goto umount;
 	if (ntfs_volume_get_free_space(vol)) {
 		ntfs_log_perror("ERROR: couldn't get free space");
 		goto umount;
@@ -899,6 +1662,24 @@ int main(int argc, char *argv[])
 			goto umount;
 		}
 		new_size = fst.st_size;
+		isdir = S_ISDIR(fst.st_mode);
+	}
+	if (isdir) {
+		if (!opts.recursive) {
+			ntfs_log_error("ERROR: '%s' is a directory, use "
+					"--recursive to copy it.\n",
+					opts.src_file);
+			goto umount;
+		}
+#ifdef HAVE_WINDOWS_H
+		unix_name = ntfs_utils_unix_path(opts.dest_file);
+		if (unix_name && !copy_dir(vol, unix_name))
+			result = 0;
+#else
+		if (!copy_dir(vol, opts.dest_file))
+			result = 0;
+#endif
+		goto umount;
 	}
 	ntfs_log_verbose("New file size: %lld\n", (long long)new_size);
 
@@ -974,7 +1755,7 @@ int main(int argc, char *argv[])
 			}
 			ntfs_log_verbose("Creating a new file '%s' under '%s'"
 					 "\n", filename, parent_dirname);
-			ni = ntfs_new_file(dir_ni, filename);
+			ni = ntfs_new_file(dir_ni, filename, S_IFREG);
 			ntfs_inode_close(dir_ni);
 			if (!ni) {
 				ntfs_log_perror("Failed to create '%s' under "
@@ -1035,7 +1816,7 @@ int main(int argc, char *argv[])
 		} else {
 			ntfs_log_verbose("Creating a new file '%s' under "
 					"'%s'\n", filename, opts.dest_file);
-			ni = ntfs_new_file(dir_ni, filename);
+			ni = ntfs_new_file(dir_ni, filename, S_IFREG);
 			ntfs_inode_close(dir_ni);
 			if (!ni) {
 				ntfs_log_perror("ERROR: Failed to create the "
@@ -1049,119 +1830,8 @@ int main(int argc, char *argv[])
 		free(overwrite_filename);
 	}
 
-	attr_name = ntfs_str2ucs(opts.attr_name, &attr_name_len);
-	if (!attr_name) {
-		ntfs_log_perror("ERROR: Failed to parse attribute name '%s'",
-				opts.attr_name);
-		goto close_dst;
-	}
-
-	na = ntfs_attr_open(out, opts.attribute, attr_name, attr_name_len);
-	if (!na) {
-		if (errno != ENOENT) {
-			ntfs_log_perror("ERROR: Couldn't open attribute");
-			goto close_dst;
-		}
-		/* Requested attribute isn't present, add it. */
-		if (ntfs_attr_add(out, opts.attribute, attr_name,
-				attr_name_len, NULL, 0)) {
-			ntfs_log_perror("ERROR: Couldn't add attribute");
-			goto close_dst;
-		}
-		na = ntfs_attr_open(out, opts.attribute, attr_name,
-				attr_name_len);
-		if (!na) {
-			ntfs_log_perror("ERROR: Couldn't open just added "
-					"attribute");
-			goto close_dst;
-		}
-	}
-
-	ntfs_log_verbose("Old file size: %lld\n", (long long)na->data_size);
-	if (opts.minfragments && NAttrCompressed(na)) {
-		ntfs_log_info("Warning : Cannot avoid fragmentation"
-				" of a compressed attribute\n");
-		opts.minfragments = 0;
-		}
-	if (na->data_size && opts.minfragments) {
-		if (ntfs_attr_truncate(na, 0)) {
-			ntfs_log_perror(
-				"ERROR: Couldn't truncate existing attribute");
-			goto close_attr;
-		}
-	}
-	if (na->data_size != new_size) {
-		if (opts.minfragments) {
-			/*
-			 * Do a standard truncate() to check whether the
-			 * attribute has to be made non-resident.
-			 * If still resident, preallocation is not needed.
-			 */
-			if (ntfs_attr_truncate(na, new_size)) {
-				ntfs_log_perror(
-					"ERROR: Couldn't resize attribute");
-				goto close_attr;
-			}
-			if (NAttrNonResident(na)
-			   && preallocate(na, new_size)) {
-				ntfs_log_perror(
-				    "ERROR: Couldn't preallocate attribute");
-				goto close_attr;
-			}
-		} else {
-			if (ntfs_attr_truncate_solid(na, new_size)) {
-				ntfs_log_perror(
-					"ERROR: Couldn't resize attribute");
-				goto close_attr;
-			}
-		}
-	}
-
-	buf = malloc(NTFS_BUF_SIZE);
-	if (!buf) {
-		ntfs_log_perror("ERROR: malloc failed");
-		goto close_attr;
-	}
-
-	ntfs_log_verbose("Starting write.\n");
-	offset = 0;
-	while (!feof(in)) {
-		if (caught_terminate) {
-			ntfs_log_error("SIGTERM or SIGINT received.  "
-					"Aborting write.\n");
-			break;
-		}
-		br = fread(buf, 1, NTFS_BUF_SIZE, in);
-		if (!br) {
-			if (!feof(in)) ntfs_log_perror("ERROR: fread failed");
-			break;
-		}
-		bw = ntfs_attr_pwrite(na, offset, br, buf);
-		if (bw != br) {
-			ntfs_log_perror("ERROR: ntfs_attr_pwrite failed");
-			break;
-		}
-		offset += bw;
-	}
-	if ((na->data_flags & ATTR_COMPRESSION_MASK)
-	    && ntfs_attr_pclose(na))
-		ntfs_log_perror("ERROR: ntfs_attr_pclose failed");
-	ntfs_log_verbose("Syncing.\n");
-	result = 0;
-	free(buf);
-close_attr:
-	ntfs_attr_close(na);
-	if (opts.timestamp) {
-		if (!fstat(fileno(in),&st)) {
-			s64 change_time = st.st_mtime*10000000LL
-					+ NTFS_TIME_OFFSET;
-			out->last_data_change_time = cpu_to_sle64(change_time);
-			ntfs_inode_update_times(out, 0);
-		} else {
-			ntfs_log_error("Failed to get the time stamp.\n");
-		}
-	}
-close_dst:
+	if (!copy_file(out, in, new_size))
+		result = 0;
 	while (ntfs_inode_close(out) && !opts.noaction) {
 		if (errno != EBUSY) {
 			ntfs_log_error("Sync failed. Run chkdsk.\n");
@@ -54,6 +54,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include <gcrypt.h>
 #include <gnutls/pkcs12.h>
 
@@ -71,6 +74,10 @@ typedef gcry_sexp_t ntfs_rsa_private_key;
 
 #define NTFS_SHA1_THUMBPRINT_SIZE 0x14
 
+#define DECRYPT_CHUNK_SIZE 65536 /* bytes read and decrypted at once */
+#define DECRYPT_MAX_THREADS 16 /* max threads decrypting */
+#define DECRYPT_CHUNKS_PER_THREAD 2 /* chunks in flight per thread */
+
 #define NTFS_CRED_TYPE_CERT_THUMBPRINT const_cpu_to_le32(3)
 
 #define NTFS_EFS_CERT_PURPOSE_OID_DDF "1.3.6.1.4.1.311.10.3.4" /* decryption */
@@ -132,6 +139,7 @@ struct options {
 	int quiet;		/* Less output */
 	int verbose;		/* Extra output */
 	int encrypt;		/* Encrypt */
+	int threads;		/* Threads decrypting */
 };
 
 static const char *EXEC_NAME = "ntfsdecrypt";
@@ -175,6 +183,9 @@ static void usage(void)
 	       "    -f  --force             Use less caution\n"
 	       "    -h  --help              Print this help\n"
 	       "    -q  --quiet             Less output\n"
+#ifdef HAVE_PTHREAD_H
+	       "    -t  --threads num       Decrypt with num threads, 0 for all cpus\n"
+#endif
 	       "    -V  --version           Version information\n"
 	       "    -v  --verbose           More output\n\n",
 	       EXEC_NAME);
@@ -192,7 +203,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char **argv)
 {
-	static const char *sopt = "-fh?ei:k:qVv";
+	static const char *sopt = "-fh?ei:k:qt:Vv";
 	static const struct option lopt[] = {
 		{"encrypt", no_argument, NULL, 'e'},
 		{"force", no_argument, NULL, 'f'},
@@ -200,6 +211,7 @@ static int parse_options(int argc, char **argv)
 		{"inode", required_argument, NULL, 'i'},
 		{"keyfile", required_argument, NULL, 'k'},
 		{"quiet", no_argument, NULL, 'q'},
+		{"threads", required_argument, NULL, 't'},
 		{"version", no_argument, NULL, 'V'},
 		{"verbose", no_argument, NULL, 'v'},
 		{NULL, 0, NULL, 0}
@@ -209,10 +221,12 @@ static int parse_options(int argc, char **argv)
 	int err = 0;
 	int ver = 0;
 	int help = 0;
+	char *end;
 
 	opterr = 0;		/* We'll handle the errors, thank you. */
 
 	opts.inode = -1;
+	opts.threads = 0;
 
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
@@ -259,6 +273,16 @@ static int parse_options(int argc, char **argv)
 			opts.quiet++;
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
 			break;
+#ifdef HAVE_PTHREAD_H
+		case 't':
+			opts.threads = strtol(optarg, &end, 10);
+			if (*end || (opts.threads < 0)) {
+				ntfs_log_error("Bad number of threads '%s'.\n",
+						optarg);
+				err++;
+			}
+			break;
+#endif
 		case 'V':
 			ver++;
 			break;
@@ -299,6 +323,14 @@ static int parse_options(int argc, char **argv)
 				"at the same time.\n");
 			err++;
 		}
+#ifdef HAVE_PTHREAD_H
+		if (!opts.threads)
+			opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (opts.threads < 1)
+			opts.threads = 1;
+		if (opts.threads > DECRYPT_MAX_THREADS)
+			opts.threads = DECRYPT_MAX_THREADS;
 	}
 
 	if (ver)
@@ -1157,6 +1189,40 @@ static void ntfs_fek_release(ntfs_fek *fek)
 	free(fek);
 }
 
+/**
+ * ntfs_fek_clone - Get another instance of a file encryption key
+ * @fek:	The file encryption key to duplicate
+ *
+ * The cipher handles and the DESX context are stateful, so each thread
+ * decrypting needs its own instance of the key.
+ */
+static ntfs_fek *ntfs_fek_clone(ntfs_fek *fek)
+{
+	u8 fek_buf[16 + 32];
+	ntfs_fek *clone;
+	u32 key_size;
+
+	switch (fek->alg_id) {
+	case CALG_DESX:
+		key_size = 16;
+		break;
+	case CALG_3DES:
+		key_size = 24;
+		break;
+	default:
+		key_size = 32;
+		break;
+	}
+	memset(fek_buf, 0, 16);
+	*(le32*)fek_buf = cpu_to_le32(key_size);
+	*(le32*)(fek_buf + 8) = fek->alg_id;
+	memcpy(fek_buf + 16, fek->key_data, key_size);
+	clone = ntfs_fek_import_from_raw(fek_buf, 16 + key_size);
+	/* Destroy the copy of the key. */
+	memset(fek_buf, 0, sizeof(fek_buf));
+	return clone;
+}
+
 /**
  * ntfs_df_array_fek_get
  */
@@ -1356,6 +1422,282 @@ static int ntfs_fek_encrypt_sector(ntfs_fek *fek, u8 *data, const u64 offset)
 	return 512;
 }
 
+/*
+ *		Decrypting a file by chunks of sectors
+ *
+ *	The chunks are read in sequence by a single thread, as the library
+ *	is not reentrant, decrypted by a pool of threads, each of them
+ *	having its own instance of the key, and output in sequence by the
+ *	main thread. The sectors being decrypted independently, libgcrypt
+ *	is fed with full sectors, and it selects by itself the hardware
+ *	acceleration of AES (AES-NI, ARMv8 crypto) available.
+ */
+
+enum { CHUNK_FREE, CHUNK_READ, CHUNK_DECRYPTING, CHUNK_DONE } ;
+
+struct DECRYPT_CHUNK {
+	u8 *buffer;
+	s64 offset;		/* position in the stream */
+	s64 size;		/* bytes read */
+	int state;		/* CHUNK_* */
+} ;
+
+struct DECRYPT_PIPE {
+	ntfs_attr *attr;
+	s64 total;		/* size of the stream */
+	s64 read_count;		/* chunks read */
+	s64 decrypt_count;	/* chunks taken for decryption */
+	s64 write_count;	/* chunks output */
+	s64 chunk_count;	/* chunks in the file, -1 until all read */
+	int slots;		/* count of chunk buffers */
+	BOOL failed;
+	struct DECRYPT_CHUNK *chunk;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t changed;	/* broadcast on each change of state */
+	pthread_t reader;
+	int workers;		/* number of threads decrypting */
+	pthread_t worker[DECRYPT_MAX_THREADS];
+	ntfs_fek *fek[DECRYPT_MAX_THREADS];
+#endif
+} ;
+
+/*
+ *		Read the next chunk
+ *
+ *	Returns the bytes read, 0 at end, or -1 if failed
+ */
+
+static s64 read_chunk(struct DECRYPT_PIPE *pipe, struct DECRYPT_CHUNK *chunk,
+			s64 offset)
+{
+	s64 count;
+
+	count = pipe->total - offset;
+	if (count > DECRYPT_CHUNK_SIZE)
+		count = DECRYPT_CHUNK_SIZE;
+	/* we need full sectors, reading past the end of the stream */
+	count = (count + 511) & ~511;
+	chunk->offset = offset;
+	chunk->size = 0;
+	if (count > 0) {
+		chunk->size = ntfs_attr_pread(pipe->attr, offset, count,
+						chunk->buffer);
+		if (chunk->size < 0)
+			ntfs_log_perror("ERROR: Couldn't read file");
+		else
+			if (chunk->size & 511)
+				memset(&chunk->buffer[chunk->size], 0,
+					512 - (chunk->size & 511));
+	}
+	return (chunk->size);
+}
+
+static int decrypt_chunk(ntfs_fek *fek, struct DECRYPT_CHUNK *chunk)
+{
+	s64 pos;
+
+	for (pos=0; pos<chunk->size; pos+=512) {
+		if (ntfs_fek_decrypt_sector(fek, &chunk->buffer[pos],
+				chunk->offset + pos) < 512) {
+			ntfs_log_perror("ERROR: Couldn't decrypt all data!");
+			ntfs_log_error("%lld/%lld\n",
+				(long long)(chunk->offset + pos),
+				(long long)chunk->size);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static int write_chunk(struct DECRYPT_PIPE *pipe, struct DECRYPT_CHUNK *chunk)
+{
+	s64 count;
+
+	count = chunk->size;
+	if (count > (pipe->total - chunk->offset))
+		count = pipe->total - chunk->offset;
+	if ((s64)fwrite(chunk->buffer, 1, count, stdout) != count) {
+		ntfs_log_perror("ERROR: Couldn't output all data!");
+		return (-1);
+	}
+	return (0);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *decrypt_reader(void *arg)
+{
+	struct DECRYPT_PIPE *pipe;
+	struct DECRYPT_CHUNK *chunk;
+	s64 offset;
+	s64 size;
+
+	pipe = (struct DECRYPT_PIPE*)arg;
+	offset = 0;
+	pthread_mutex_lock(&pipe->lock);
+	while (!pipe->failed && (pipe->chunk_count < 0)) {
+		chunk = &pipe->chunk[pipe->read_count % pipe->slots];
+		if (chunk->state == CHUNK_FREE) {
+			pthread_mutex_unlock(&pipe->lock);
+			size = read_chunk(pipe, chunk, offset);
+			pthread_mutex_lock(&pipe->lock);
+			if (size < 0)
+				pipe->failed = TRUE;
+			else if (!size)
+				pipe->chunk_count = pipe->read_count;
+			else {
+				offset += size;
+				chunk->state = CHUNK_READ;
+				pipe->read_count++;
+			}
+			pthread_cond_broadcast(&pipe->changed);
+		} else
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return ((void*)NULL);
+}
+
+static void *decrypt_worker(void *arg)
+{
+	struct DECRYPT_PIPE *pipe;
+	struct DECRYPT_CHUNK *chunk;
+	ntfs_fek *fek;
+	int err;
+
+	pipe = (struct DECRYPT_PIPE*)arg;
+	pthread_mutex_lock(&pipe->lock);
+	/* get the key of this thread */
+	fek = pipe->fek[pipe->workers++];
+	pthread_cond_broadcast(&pipe->changed);
+	while (!pipe->failed
+	    && ((pipe->chunk_count < 0)
+		|| (pipe->decrypt_count < pipe->chunk_count))) {
+		if (pipe->decrypt_count < pipe->read_count) {
+			chunk = &pipe->chunk[pipe->decrypt_count
+						% pipe->slots];
+			chunk->state = CHUNK_DECRYPTING;
+			pipe->decrypt_count++;
+			pthread_mutex_unlock(&pipe->lock);
+			err = decrypt_chunk(fek, chunk);
+			pthread_mutex_lock(&pipe->lock);
+			if (err)
+				pipe->failed = TRUE;
+			else
+				chunk->state = CHUNK_DONE;
+			pthread_cond_broadcast(&pipe->changed);
+		} else
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Decrypt with a reader thread and a pool of threads
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int decrypt_threaded(struct DECRYPT_PIPE *pipe, ntfs_fek *fek,
+			int threads)
+{
+	struct DECRYPT_CHUNK *chunk;
+	BOOL reading;
+	int count;
+	int err;
+	int i;
+
+	err = 0;
+	if (pthread_mutex_init(&pipe->lock, (pthread_mutexattr_t*)NULL))
+		return (-1);
+	pthread_cond_init(&pipe->changed, (pthread_condattr_t*)NULL);
+	/* the first thread uses the original key */
+	pipe->fek[0] = fek;
+	for (count=1; (count<threads)
+			&& (pipe->fek[count] = ntfs_fek_clone(fek)); count++) { }
+	pipe->workers = 0;
+	i = 0;
+	while ((i < count)
+	    && !pthread_create(&pipe->worker[i], (pthread_attr_t*)NULL,
+				decrypt_worker, pipe))
+		i++;
+	reading = i
+		&& !pthread_create(&pipe->reader, (pthread_attr_t*)NULL,
+				decrypt_reader, pipe);
+	pthread_mutex_lock(&pipe->lock);
+	if (!reading)
+		pipe->failed = TRUE;
+	while (!pipe->failed
+	    && ((pipe->chunk_count < 0)
+		|| (pipe->write_count < pipe->chunk_count))) {
+		chunk = &pipe->chunk[pipe->write_count % pipe->slots];
+		if ((pipe->write_count < pipe->decrypt_count)
+		    && (chunk->state == CHUNK_DONE)) {
+			pthread_mutex_unlock(&pipe->lock);
+			err = write_chunk(pipe, chunk);
+			pthread_mutex_lock(&pipe->lock);
+			if (err)
+				pipe->failed = TRUE;
+			else {
+				chunk->state = CHUNK_FREE;
+				pipe->write_count++;
+			}
+			pthread_cond_broadcast(&pipe->changed);
+		} else
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+	}
+	/* waiting for all threads to be started, so they find their key */
+	while (pipe->workers < i)
+		pthread_cond_wait(&pipe->changed, &pipe->lock);
+	err = (pipe->failed ? -1 : 0);
+	pipe->failed = TRUE;
+	pthread_cond_broadcast(&pipe->changed);
+	pthread_mutex_unlock(&pipe->lock);
+	if (reading)
+		pthread_join(pipe->reader, (void**)NULL);
+	while (i > 0)
+		pthread_join(pipe->worker[--i], (void**)NULL);
+	while (count > 1)
+		ntfs_fek_release(pipe->fek[--count]);
+	pthread_cond_destroy(&pipe->changed);
+	pthread_mutex_destroy(&pipe->lock);
+	return (err);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Decrypt with a single thread
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int decrypt_serial(struct DECRYPT_PIPE *pipe, ntfs_fek *fek)
+{
+	struct DECRYPT_CHUNK *chunk;
+	s64 offset;
+	s64 size;
+	int err;
+
+	err = 0;
+	offset = 0;
+	chunk = pipe->chunk;
+	do {
+		size = read_chunk(pipe, chunk, offset);
+		if (size < 0)
+			err = -1;
+		else if (size) {
+			err = decrypt_chunk(fek, chunk);
+			if (!err)
+				err = write_chunk(pipe, chunk);
+			offset += size;
+		}
+	} while (!err && size);
+	return (err);
+}
+
 /**
  * ntfs_cat_decrypt - Decrypt the contents of an encrypted file to stdout.
  * @inode:	An encrypted file's inode structure, as obtained by
@@ -1364,23 +1706,38 @@ static int ntfs_fek_encrypt_sector(ntfs_fek *fek, u8 *data, const u64 offset)
  */
 static int ntfs_cat_decrypt(ntfs_inode *inode, ntfs_fek *fek)
 {
-	int bufsize = 512;
-	unsigned char *buffer;
+	struct DECRYPT_PIPE pipe;
+	u8 *buffers;
 	ntfs_attr *attr;
-	s64 bytes_read, written, offset, total;
 	s64 old_data_size, old_initialized_size;
+	int threads;
 	int i;
 
-	buffer = malloc(bufsize);
-	if (!buffer)
-		return 1;
 	attr = ntfs_attr_open(inode, AT_DATA, NULL, 0);
 	if (!attr) {
 		ntfs_log_error("Cannot cat a directory.\n");
-		free(buffer);
 		return 1;
 	}
-	total = attr->data_size;
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.attr = attr;
+	pipe.total = attr->data_size;
+	pipe.chunk_count = -1;
+	threads = opts.threads;
+	/* no need for threads if the file fits into a single chunk */
+	if (pipe.total <= DECRYPT_CHUNK_SIZE)
+		threads = 1;
+	pipe.slots = (threads > 1 ? threads*DECRYPT_CHUNKS_PER_THREAD : 1);
+	pipe.chunk = (struct DECRYPT_CHUNK*)ntfs_calloc(pipe.slots
+				*sizeof(struct DECRYPT_CHUNK));
+	buffers = (u8*)ntfs_malloc((s64)pipe.slots*DECRYPT_CHUNK_SIZE);
+	if (!pipe.chunk || !buffers) {
+		free(pipe.chunk);
+		free(buffers);
+		ntfs_attr_close(attr);
+		return 1;
+	}
+	for (i=0; i<pipe.slots; i++)
+		pipe.chunk[i].buffer = &buffers[(s64)i*DECRYPT_CHUNK_SIZE];
 
 	// hack: make sure attr will not be commited to disk if you use this.
 	// clear the encrypted bit, otherwise the library won't allow reading.
@@ -1390,38 +1747,19 @@ static int ntfs_cat_decrypt(ntfs_inode *inode, ntfs_fek *fek)
 	old_initialized_size = attr->initialized_size;
 	attr->data_size = attr->initialized_size = attr->allocated_size;
 
-	offset = 0;
-	while (total > 0) {
-		bytes_read = ntfs_attr_pread(attr, offset, 512, buffer);
-		if (bytes_read == -1) {
-			ntfs_log_perror("ERROR: Couldn't read file");
-			break;
-		}
-		if (!bytes_read)
-			break;
-		if ((i = ntfs_fek_decrypt_sector(fek, buffer, offset)) <
-				bytes_read) {
-			ntfs_log_perror("ERROR: Couldn't decrypt all data!");
-			ntfs_log_error("%u/%lld/%lld/%lld\n", i,
-				(long long)bytes_read, (long long)offset,
-				(long long)total);
-			break;
-		}
-		if (bytes_read > total)
-			bytes_read = total;
-		written = fwrite(buffer, 1, bytes_read, stdout);
-		if (written != bytes_read) {
-			ntfs_log_perror("ERROR: Couldn't output all data!");
-			break;
-		}
-		offset += bytes_read;
-		total -= bytes_read;
-	}
+#ifdef HAVE_PTHREAD_H
+	if (threads > 1)
+		decrypt_threaded(&pipe, fek, threads);
+	else
+#endif
+		decrypt_serial(&pipe, fek);
+
 	attr->data_size = old_data_size;
 	attr->initialized_size = old_initialized_size;
 	NAttrSetEncrypted(attr);
 	ntfs_attr_close(attr);
-	free(buffer);
+	free(buffers);
+	free(pipe.chunk);
 	return 0;
 }
 
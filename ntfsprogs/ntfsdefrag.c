@@ -0,0 +1,621 @@
+/**
+ * ntfsdefrag - Part of the Linux-NTFS project.
+ *
+ * This utility relocates the data of the fragmented files of an unmounted
+ * NTFS volume to contiguous clusters, and optionally moves the files
+ * towards the beginning of the volume and out of the mft zone, so that
+ * the free space is consolidated.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "dir.h"
+#include "volume.h"
+#include "unistr.h"
+#include "defrag.h"
+#include "utils.h"
+#include "misc.h"
+#include "logging.h"
+
+#define DEFAULT_EXTENTS 2	/* relocate the files having this many extents */
+
+/*
+ *		A data stream to be moved when consolidating the free space
+ */
+
+struct CANDIDATE {
+	u64 mft_no;
+	ntfschar *name;		/* stream name, NULL for the unnamed one */
+	u32 name_len;
+	LCN lcn;		/* first cluster allocated */
+} ;
+
+static const char *EXEC_NAME = "ntfsdefrag";
+
+static struct options {
+	char		*device;	/* Device/File to work with */
+	char		**paths;	/* Files to defragment */
+	int		 npaths;	/* Count of files to defragment */
+	long		 extents;	/* Minimal count of extents to relocate */
+	int		 compact;	/* Consolidate the free space */
+	int		 noaction;	/* Only report the fragmented files */
+	int		 force;		/* Override common sense */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+} opts;
+
+static struct CANDIDATE *candidates;
+static u64 candidate_count;
+static u64 candidate_max;
+static u64 fragmented_count;
+static u64 relocated_count;
+static u64 compacted_count;
+static u64 noroom_count;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Defragment the files of an "
+			"NTFS volume.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device [path ...]\n"
+		"    -e, --extents NUM    Relocate the files having at least "
+			"NUM extents\n"
+		"                         (default %d)\n"
+		"    -c, --compact        Move the files towards the beginning"
+			" of the volume\n"
+		"                         and out of the mft zone\n"
+		"    -n, --no-action      Only list the fragmented files\n"
+		"\n"
+		"    -f, --force          Use less caution\n"
+		"    -q, --quiet          Less output\n"
+		"    -v, --verbose        More output\n"
+		"    -V, --version        Version information\n"
+		"    -h, --help           Print this help\n\n",
+		EXEC_NAME, DEFAULT_EXTENTS);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  0 Done, the program has to stop
+ *	    1 Error, one or more problems
+ *	   -1 Success, go on
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-ce:fhnqvV";
+	static const struct option lopt[] = {
+		{ "compact",	no_argument,		NULL, 'c' },
+		{ "extents",	required_argument,	NULL, 'e' },
+		{ "force",	no_argument,		NULL, 'f' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "no-action",	no_argument,		NULL, 'n' },
+		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "version",	no_argument,		NULL, 'V' },
+		{ NULL,		0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	char *end;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	opts.extents = DEFAULT_EXTENTS;
+	opts.paths = (char**)ntfs_malloc(argc*sizeof(char*));
+	if (!opts.paths)
+		return (1);
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.device)
+				opts.device = argv[optind-1];
+			else
+				opts.paths[opts.npaths++] = argv[optind-1];
+			break;
+		case 'c':
+			opts.compact++;
+			break;
+		case 'e':
+			opts.extents = strtol(optarg, &end, 10);
+			if (*end || (opts.extents < 2)) {
+				ntfs_log_error("Bad count of extents '%s'.\n",
+					optarg);
+				err++;
+			}
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'n':
+			opts.noaction++;
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		case 'V':
+			ver++;
+			break;
+		default:
+			if (optopt == 'e')
+				ntfs_log_error("Option '%s' requires an "
+					"argument.\n", argv[optind-1]);
+			else
+				ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind-1]);
+			err++;
+			break;
+		}
+	}
+
+	if (!help && !ver) {
+		if (opts.device == NULL) {
+			if (argc > 1)
+				ntfs_log_error("You must specify a device.\n");
+			err++;
+		}
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose"
+				" at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+		/* tri-state 0 : done, 1 : error, -1 : proceed */
+	return (err ? 1 : (help || ver ? 0 : -1));
+}
+
+/*
+ *		Print the name of a stream being processed
+ *
+ *	The fragmented streams are always listed when nothing is done.
+ */
+
+static void report(ntfs_inode *ni, const ntfschar *name, u32 name_len,
+			const char *what, s64 extents)
+{
+	char path[MAX_PATH];
+	char *stream;
+
+	if (utils_inode_get_name(ni, path, sizeof(path)) <= 0)
+		snprintf(path, sizeof(path), "inode %lld",
+				(long long)ni->mft_no);
+	stream = (char*)NULL;
+	if (name_len && (ntfs_ucstombs(name, name_len, &stream, 0) < 0))
+		stream = (char*)NULL;
+	if (opts.noaction)
+		ntfs_log_info("%s%s%s : %lld extents, %s\n", path,
+			(stream ? ":" : ""), (stream ? stream : ""),
+			(long long)extents, what);
+	else
+		ntfs_log_verbose("%s%s%s : %lld extents, %s\n", path,
+			(stream ? ":" : ""), (stream ? stream : ""),
+			(long long)extents, what);
+	free(stream);
+}
+
+/*
+ *		Record a stream to be moved when consolidating
+ *
+ *	Returns 0 if successful, or -1 if there was an error (errno set)
+ */
+
+static int add_candidate(ntfs_attr *na, LCN lcn)
+{
+	struct CANDIDATE *more;
+	struct CANDIDATE *cand;
+
+	if (candidate_count >= candidate_max) {
+		candidate_max = (candidate_max ? 2*candidate_max : 256);
+		more = (struct CANDIDATE*)realloc(candidates,
+				candidate_max*sizeof(struct CANDIDATE));
+		if (!more) {
+			ntfs_log_perror("Could not record the files");
+			return (-1);
+		}
+		candidates = more;
+	}
+	cand = &candidates[candidate_count];
+	cand->mft_no = na->ni->mft_no;
+	cand->name_len = na->name_len;
+	cand->name = (ntfschar*)NULL;
+	if (na->name_len) {
+		cand->name = ntfs_ucsndup(na->name, na->name_len);
+		if (!cand->name)
+			return (-1);
+	}
+	cand->lcn = lcn;
+	candidate_count++;
+	return (0);
+}
+
+/*
+ *		Defragment a data stream
+ *
+ *	Returns 0 if successful, or -1 if there was an error (errno set)
+ */
+
+static int defrag_stream(ntfs_inode *ni, ntfschar *name, u32 name_len)
+{
+	ntfs_volume *vol;
+	ntfs_attr *na;
+	s64 extents;
+	LCN lcn;
+	int res;
+
+	vol = ni->vol;
+	na = ntfs_attr_open(ni, AT_DATA, name, name_len);
+	if (!na) {
+		ntfs_log_perror("Could not open the data of inode %lld",
+				(long long)ni->mft_no);
+		return (-1);
+	}
+	res = 0;
+	extents = ntfs_attr_extent_count(na, &lcn);
+	if (extents < 0)
+		res = -1;
+	if (!res && (extents >= opts.extents)) {
+		fragmented_count++;
+		if (opts.noaction)
+			report(ni, name, name_len, "fragmented", extents);
+		else {
+			res = ntfs_attr_relocate(na, vol->nr_clusters);
+			if (res > 0) {
+				relocated_count++;
+				report(ni, name, name_len, "relocated",
+						extents);
+				res = ntfs_attr_extent_count(na, &lcn) < 0;
+			} else
+				if (!res) {
+					noroom_count++;
+					report(ni, name, name_len,
+						"no room to relocate",
+						extents);
+				}
+		}
+	}
+	if (!res && extents && opts.compact && !opts.noaction)
+		res = add_candidate(na, lcn);
+	if (res < 0)
+		ntfs_log_perror("Could not defragment inode %lld",
+				(long long)ni->mft_no);
+	ntfs_attr_close(na);
+	return (res ? -1 : 0);
+}
+
+/*
+ *		Defragment all the data streams of an inode
+ *
+ *	Returns 0 if successful, or -1 if there was an error
+ */
+
+static int defrag_inode(ntfs_inode *ni)
+{
+	ntfs_attr_search_ctx *ctx;
+	ATTR_RECORD *a;
+	ntfschar **names;
+	ntfschar **more_names;
+	u32 *lengths;
+	u32 *more_lengths;
+	int count;
+	int max;
+	int res;
+	int i;
+
+	ctx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (!ctx)
+		return (-1);
+		/* collect the stream names, the records may move */
+	res = 0;
+	count = 0;
+	max = 0;
+	names = (ntfschar**)NULL;
+	lengths = (u32*)NULL;
+	while (!res && !ntfs_attr_lookup(AT_DATA, NULL, 0,
+			CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+		a = ctx->attr;
+		if (!a->non_resident || a->lowest_vcn)
+			continue;
+		if (count >= max) {
+			max += 8;
+			more_names = (ntfschar**)realloc(names,
+					max*sizeof(ntfschar*));
+			if (more_names)
+				names = more_names;
+			more_lengths = (u32*)realloc(lengths,
+					max*sizeof(u32));
+			if (more_lengths)
+				lengths = more_lengths;
+			if (!more_names || !more_lengths) {
+				res = -1;
+				break;
+			}
+		}
+		lengths[count] = a->name_length;
+		names[count] = (ntfschar*)NULL;
+		if (a->name_length) {
+			names[count] = ntfs_ucsndup(ntfs_attr_get_name(a),
+					a->name_length);
+			if (!names[count])
+				res = -1;
+		}
+		count++;
+	}
+	ntfs_attr_put_search_ctx(ctx);
+	for (i=0; (i<count) && !res; i++)
+		res = defrag_stream(ni, (names[i] ? names[i] : AT_UNNAMED),
+				lengths[i]);
+	for (i=0; i<count; i++)
+		free(names[i]);
+	free(names);
+	free(lengths);
+	return (res);
+}
+
+/*
+ *		Check whether a stream has clusters in the mft zone
+ */
+
+static BOOL in_mft_zone(ntfs_attr *na)
+{
+	const runlist_element *rl;
+	ntfs_volume *vol;
+	BOOL found;
+
+	vol = na->ni->vol;
+	found = FALSE;
+	for (rl=na->rl; rl && rl->length && !found; rl++)
+		found = (rl->lcn >= 0)
+			&& (rl->lcn < vol->mft_zone_end)
+			&& ((rl->lcn + rl->length) > vol->mft_zone_start);
+	return (found);
+}
+
+static int compare_candidates(const void *p1, const void *p2)
+{
+	const struct CANDIDATE *c1 = (const struct CANDIDATE*)p1;
+	const struct CANDIDATE *c2 = (const struct CANDIDATE*)p2;
+
+	return (c1->lcn < c2->lcn ? -1 : (c1->lcn > c2->lcn ? 1 : 0));
+}
+
+/*
+ *		Consolidate the free space
+ *
+ *	The streams are examined in the order of their first cluster,
+ *	and moved to the first free extent before it which can hold
+ *	them, so that the free space gathers towards the end of the
+ *	volume. The streams within the mft zone are moved out of it.
+ *
+ *	Returns 0 if successful, or -1 if there was an error
+ */
+
+static int compact_volume(ntfs_volume *vol)
+{
+	struct CANDIDATE *cand;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	s64 extents;
+	LCN lcn;
+	u64 i;
+	int res;
+
+	qsort(candidates, candidate_count, sizeof(struct CANDIDATE),
+			compare_candidates);
+	res = 0;
+	for (i=0; (i<candidate_count) && !res; i++) {
+		cand = &candidates[i];
+		ni = ntfs_inode_open(vol, cand->mft_no);
+		if (!ni) {
+			res = -1;
+			break;
+		}
+		na = ntfs_attr_open(ni, AT_DATA,
+				(cand->name ? cand->name : AT_UNNAMED),
+				cand->name_len);
+		extents = (na ? ntfs_attr_extent_count(na, &lcn) : -1);
+		if (extents >= 0) {
+			res = ntfs_attr_relocate(na,
+				(in_mft_zone(na) ? vol->nr_clusters : lcn));
+			if (res > 0) {
+				compacted_count++;
+				report(ni, cand->name, cand->name_len,
+						"moved", extents);
+				res = 0;
+			}
+		} else
+			res = -1;
+		if (res)
+			ntfs_log_perror("Could not move inode %lld",
+					(long long)cand->mft_no);
+		if (na)
+			ntfs_attr_close(na);
+		if (ntfs_inode_close(ni))
+			res = -1;
+	}
+	return (res);
+}
+
+/*
+ *		Defragment the files designated by their paths
+ */
+
+static int defrag_paths(ntfs_volume *vol)
+{
+	ntfs_inode *ni;
+	int res;
+	int i;
+
+	res = 0;
+	for (i=0; (i<opts.npaths) && !res; i++) {
+		ni = ntfs_pathname_to_inode(vol, NULL, opts.paths[i]);
+		if (!ni) {
+			ntfs_log_perror("Could not open '%s'", opts.paths[i]);
+			res = -1;
+		} else {
+			res = defrag_inode(ni);
+			if (ntfs_inode_close(ni))
+				res = -1;
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Defragment all the files of the volume
+ *
+ *	The system files are not relocated.
+ */
+
+static int defrag_volume(ntfs_volume *vol)
+{
+	ntfs_inode *ni;
+	s64 nr_mft_records;
+	s64 mft_no;
+	int res;
+
+	res = 0;
+	nr_mft_records = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+	for (mft_no=FILE_first_user; (mft_no<nr_mft_records) && !res;
+			mft_no++) {
+		if (utils_mftrec_in_use(vol, (MFT_REF)mft_no) <= 0)
+			continue;
+		ni = ntfs_inode_open(vol, (MFT_REF)mft_no);
+		if (!ni)
+			continue;
+		if (!ni->mrec->base_mft_record)
+			res = defrag_inode(ni);
+		if (ntfs_inode_close(ni))
+			res = -1;
+	}
+	return (res);
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	unsigned long flags;
+	u64 i;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_outerr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+
+	flags = (opts.noaction ? NTFS_MNT_RDONLY : 0)
+		| (opts.force ? NTFS_MNT_RECOVER : 0);
+	vol = utils_mount_volume(opts.device, flags);
+	if (!vol)
+		return (1);
+
+	if (!opts.noaction && ntfs_volume_get_free_space(vol)) {
+		ntfs_log_perror("Could not get the free space");
+		res = -1;
+	} else {
+		if (opts.npaths)
+			res = defrag_paths(vol);
+		else
+			res = defrag_volume(vol);
+		if (!res && opts.compact && !opts.noaction)
+			res = compact_volume(vol);
+	}
+	if (!opts.quiet) {
+		if (opts.noaction)
+			ntfs_log_info("%llu fragmented stream(s)\n",
+				(unsigned long long)fragmented_count);
+		else
+			ntfs_log_info("%llu fragmented stream(s), %llu"
+				" relocated, %llu without room, %llu moved\n",
+				(unsigned long long)fragmented_count,
+				(unsigned long long)relocated_count,
+				(unsigned long long)noroom_count,
+				(unsigned long long)compacted_count);
+	}
+
+	if (ntfs_umount(vol, FALSE)) {
+		ntfs_log_perror("Could not unmount the volume");
+		res = -1;
+	}
+	for (i=0; i<candidate_count; i++)
+		free(candidates[i].name);
+	free(candidates);
+	free(opts.paths);
+	return (res ? 1 : 0);
+}
@@ -0,0 +1,561 @@
+/**
+ * ntfsefsraw - Part of the Linux-NTFS project.
+ *
+ * This utility exports encrypted files from an unmounted volume as a
+ * stream of raw encrypted data, without decrypting anything, and
+ * imports such a stream back into a volume, so that encrypted files
+ * can be backed up and restored in bulk.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "dir.h"
+#include "efs.h"
+#include "unistr.h"
+#include "utils.h"
+#include "misc.h"
+#include "logging.h"
+
+#define ARCHIVE_MAGIC "EFSA"	/* heading each file in an archive */
+#define ARCHIVE_DIRECTORY 1	/* the file is a directory */
+#define ARCHIVE_MAX_PATH 4096	/* longest path accepted */
+
+/*
+ *	The archive is a sequence of files, each of them made of an
+ *	entry header, the path of the file in the volume (in the locale,
+ *	not terminated) and the raw export of the file (see efs.h).
+ */
+
+typedef struct {
+	char magic[4];
+	le32 flags;		/* ARCHIVE_* */
+	le32 path_length;	/* bytes following the header */
+} __attribute__((__packed__)) ARCHIVE_ENTRY;
+
+static const char *EXEC_NAME = "ntfsefsraw";
+
+static struct options {
+	char		*device;	/* Device/File to work with */
+	char		*file;		/* Archive, instead of stdin/stdout */
+	char		**paths;	/* Files to export */
+	int		 npaths;	/* Count of files to export */
+	int		 export;	/* Export files */
+	int		 import;	/* Import an archive */
+	int		 recursive;	/* Export directory contents */
+	int		 force;		/* Override common sense */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+} opts;
+
+static FILE *archive;
+static int file_count;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Export and import encrypted "
+			"files in raw format.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s -x [options] device path ...\n"
+		"       %s -i [options] device\n"
+		"    -x, --export         Export the encrypted files in the "
+			"paths\n"
+		"    -i, --import         Import the files from an archive\n"
+		"    -r, --recursive      Export the encrypted files in "
+			"directories\n"
+		"    -a, --archive FILE   Write or read the archive FILE "
+			"(default stdout\n"
+		"                         or stdin)\n"
+		"\n"
+		"    -f, --force          Use less caution\n"
+		"    -q, --quiet          Less output\n"
+		"    -v, --verbose        More output\n"
+		"    -V, --version        Version information\n"
+		"    -h, --help           Print this help\n\n",
+		EXEC_NAME, EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  0 Done, the program has to stop
+ *	    1 Error, one or more problems
+ *	   -1 Success, go on
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-a:fhiqrvVx";
+	static const struct option lopt[] = {
+		{ "archive",	required_argument,	NULL, 'a' },
+		{ "export",	no_argument,		NULL, 'x' },
+		{ "force",	no_argument,		NULL, 'f' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "import",	no_argument,		NULL, 'i' },
+		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "recursive",	no_argument,		NULL, 'r' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "version",	no_argument,		NULL, 'V' },
+		{ NULL,		0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	opts.paths = (char**)ntfs_malloc(argc*sizeof(char*));
+	if (!opts.paths)
+		return (1);
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.device)
+				opts.device = argv[optind-1];
+			else
+				opts.paths[opts.npaths++] = argv[optind-1];
+			break;
+		case 'a':
+			opts.file = optarg;
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'i':
+			opts.import++;
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 'r':
+			opts.recursive++;
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		case 'V':
+			ver++;
+			break;
+		case 'x':
+			opts.export++;
+			break;
+		default:
+			if (optopt == 'a')
+				ntfs_log_error("Option '%s' requires an "
+					"argument.\n", argv[optind-1]);
+			else
+				ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind-1]);
+			err++;
+			break;
+		}
+	}
+
+	if (!help && !ver) {
+		if (opts.device == NULL) {
+			if (argc > 1)
+				ntfs_log_error("You must specify a device.\n");
+			err++;
+		}
+		if (!opts.export == !opts.import) {
+			ntfs_log_error("You must specify either --export"
+				" or --import.\n");
+			err++;
+		}
+		if (opts.export && !opts.npaths) {
+			ntfs_log_error("You must specify the files to"
+				" export.\n");
+			err++;
+		}
+		if (opts.import && opts.npaths) {
+			ntfs_log_error("The files to import are designated"
+				" by the archive.\n");
+			err++;
+		}
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose"
+				" at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+		/* tri-state 0 : done, 1 : error, -1 : proceed */
+	return (err ? 1 : (help || ver ? 0 : -1));
+}
+
+/*
+ *		Transfers to and from the archive
+ */
+
+static int archive_write(void *param __attribute__((unused)),
+			void *buf, size_t size)
+{
+	if (fwrite(buf, 1, size, archive) != size) {
+		if (!errno)
+			errno = EIO;
+		return (-1);
+	}
+	return (0);
+}
+
+static int archive_read(void *param __attribute__((unused)),
+			void *buf, size_t size)
+{
+	if (fread(buf, 1, size, archive) != size) {
+		errno = (ferror(archive) ? EIO : ENODATA);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Names found in a directory, to be exported afterwards
+ */
+
+struct NAMES {
+	char **names;
+	int count;
+	int size;
+	int err;
+} ;
+
+static int collect_name(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type,
+		const s64 pos __attribute__((unused)), const MFT_REF mref,
+		const unsigned dt_type __attribute__((unused)))
+{
+	struct NAMES *list;
+	char **names;
+	char *filename;
+
+	list = (struct NAMES*)dirent;
+	if ((name_type == FILE_NAME_DOS)
+	    || (MREF(mref) < FILE_first_user))
+		return (0);
+	filename = (char*)NULL;
+	if (ntfs_ucstombs(name, name_len, &filename, 0) < 0) {
+		list->err = errno;
+		return (-1);
+	}
+	if (!strcmp(filename, ".") || !strcmp(filename, "..")) {
+		free(filename);
+		return (0);
+	}
+	if (list->count >= list->size) {
+		names = (char**)realloc(list->names,
+				(list->size + 64)*sizeof(char*));
+		if (!names) {
+			free(filename);
+			list->err = ENOMEM;
+			return (-1);
+		}
+		list->names = names;
+		list->size += 64;
+	}
+	list->names[list->count++] = filename;
+	return (0);
+}
+
+/*
+ *		Export a file, and the files in a directory if recursive
+ *
+ *	Returns 0 if successful, or 1 if some file could not be exported
+ */
+
+static int export_path(ntfs_volume *vol, const char *path)
+{
+	ARCHIVE_ENTRY entry;
+	struct NAMES list;
+	ntfs_inode *ni;
+	char *child;
+	BOOL isdir;
+	s64 pos;
+	int res;
+	int i;
+
+	ni = ntfs_pathname_to_inode(vol, NULL, path);
+	if (!ni) {
+		ntfs_log_perror("Could not open '%s'", path);
+		return (1);
+	}
+	res = 0;
+	isdir = (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) != 0;
+	if (ni->flags & FILE_ATTR_ENCRYPTED) {
+		memcpy(entry.magic, ARCHIVE_MAGIC, sizeof(entry.magic));
+		entry.flags = cpu_to_le32(isdir ? ARCHIVE_DIRECTORY : 0);
+		entry.path_length = cpu_to_le32(strlen(path));
+		if (archive_write(NULL, &entry, sizeof(entry))
+		    || archive_write(NULL, (void*)path, strlen(path))
+		    || ntfs_efs_export_raw(ni, archive_write, NULL)) {
+			ntfs_log_perror("Could not export '%s'", path);
+			res = 1;
+		} else {
+			ntfs_log_verbose("Exported '%s'\n", path);
+			file_count++;
+		}
+	} else
+		if (!isdir || !opts.recursive)
+			ntfs_log_warning("'%s' is not encrypted\n", path);
+	list.names = (char**)NULL;
+	list.count = list.size = list.err = 0;
+	if (!res && isdir && opts.recursive) {
+		pos = 0;
+		if (ntfs_readdir(ni, &pos, &list, collect_name)) {
+			ntfs_log_error("Could not list '%s' : %s\n", path,
+				strerror(list.err ? list.err : errno));
+			res = 1;
+		}
+	}
+	ntfs_inode_close(ni);
+	for (i=0; i<list.count; i++) {
+		child = (char*)ntfs_malloc(strlen(path)
+				+ strlen(list.names[i]) + 2);
+		if (child) {
+			strcpy(child, path);
+			if (strcmp(path, "/"))
+				strcat(child, "/");
+			strcat(child, list.names[i]);
+			res |= export_path(vol, child);
+			free(child);
+		} else
+			res = 1;
+		free(list.names[i]);
+	}
+	free(list.names);
+	return (res);
+}
+
+/*
+ *		Open the file to import, creating it if needed
+ *
+ *	Missing parent directories are created as plain directories,
+ *	they get encrypted later if they were exported too.
+ */
+
+static ntfs_inode *open_imported(ntfs_volume *vol, char *path, BOOL isdir)
+{
+	ntfs_inode *ni;
+	ntfs_inode *dir_ni;
+	ntfschar *uname;
+	char *name;
+	int uname_len;
+
+	ni = ntfs_pathname_to_inode(vol, NULL, path);
+	if (!ni && (errno == ENOENT)) {
+		name = strrchr(path, '/');
+		if (name && (name != path)) {
+			*name = 0;
+			dir_ni = open_imported(vol, path, TRUE);
+			*name++ = '/';
+		} else {
+			dir_ni = ntfs_pathname_to_inode(vol, NULL, "/");
+			name = (name ? name + 1 : path);
+		}
+		if (dir_ni) {
+			uname = (ntfschar*)NULL;
+			uname_len = ntfs_mbstoucs(name, &uname);
+			if (uname_len > 0)
+				ni = ntfs_create(dir_ni, const_cpu_to_le32(0),
+					uname, uname_len,
+					(isdir ? S_IFDIR : S_IFREG));
+			free(uname);
+			if (ntfs_inode_close(dir_ni) && ni) {
+				ntfs_inode_close(ni);
+				ni = (ntfs_inode*)NULL;
+			}
+		}
+	}
+	return (ni);
+}
+
+/*
+ *		Import all the files in the archive
+ *
+ *	Returns 0 if successful, or 1 if some file could not be imported
+ */
+
+static int import_archive(ntfs_volume *vol)
+{
+	ARCHIVE_ENTRY entry;
+	ntfs_inode *ni;
+	char *path;
+	BOOL isdir;
+	u32 path_length;
+	int res;
+
+	res = 0;
+	path = (char*)ntfs_malloc(ARCHIVE_MAX_PATH + 1);
+	if (!path)
+		return (1);
+	while (fread(&entry, 1, sizeof(entry), archive) == sizeof(entry)) {
+		path_length = le32_to_cpu(entry.path_length);
+		if (memcmp(entry.magic, ARCHIVE_MAGIC, sizeof(entry.magic))
+		    || !path_length || (path_length > ARCHIVE_MAX_PATH)
+		    || archive_read(NULL, path, path_length)) {
+			ntfs_log_error("Bad archive\n");
+			res = 1;
+			break;
+		}
+		path[path_length] = 0;
+		isdir = (entry.flags & const_cpu_to_le32(ARCHIVE_DIRECTORY))
+				!= const_cpu_to_le32(0);
+		ni = open_imported(vol, path, isdir);
+		if (!ni) {
+			ntfs_log_perror("Could not create '%s'", path);
+			res = 1;
+			break;
+		}
+		if (ntfs_efs_import_raw(ni, archive_read, NULL)) {
+			ntfs_log_perror("Could not import '%s'", path);
+			ntfs_inode_close(ni);
+			res = 1;
+			break;
+		}
+		if (ntfs_inode_close(ni)) {
+			ntfs_log_perror("Could not close '%s'", path);
+			res = 1;
+			break;
+		}
+		ntfs_log_verbose("Imported '%s'\n", path);
+		file_count++;
+	}
+	if (ferror(archive)) {
+		ntfs_log_perror("Could not read the archive");
+		res = 1;
+	}
+	free(path);
+	return (res);
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	unsigned long flags;
+	int res;
+	int i;
+
+		/* keep stdout for the archive */
+	ntfs_log_set_handler(ntfs_log_handler_stderr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+
+	if (opts.file)
+		archive = fopen(opts.file, (opts.export ? "wb" : "rb"));
+	else
+		archive = (opts.export ? stdout : stdin);
+	if (!archive) {
+		ntfs_log_perror("Could not open '%s'", opts.file);
+		return (1);
+	}
+
+	flags = (opts.export ? NTFS_MNT_RDONLY : 0)
+		| (opts.force ? NTFS_MNT_RECOVER : 0);
+	vol = utils_mount_volume(opts.device, flags);
+	if (!vol)
+		return (1);
+		/* raw accesses to the encrypted data */
+	vol->efs_raw = TRUE;
+
+	res = 0;
+	if (opts.export) {
+		for (i=0; i<opts.npaths; i++)
+			res |= export_path(vol, opts.paths[i]);
+		if (fflush(archive)) {
+			ntfs_log_perror("Could not write the archive");
+			res = 1;
+		}
+	} else {
+		if (ntfs_volume_get_free_space(vol)) {
+			ntfs_log_perror("Could not get the free space");
+			res = 1;
+		} else
+			res = import_archive(vol);
+	}
+	if (!opts.quiet)
+		ntfs_log_info("%d file(s) %s\n", file_count,
+			(opts.export ? "exported" : "imported"));
+
+	if (ntfs_umount(vol, FALSE)) {
+		ntfs_log_perror("Could not unmount the volume");
+		res = 1;
+	}
+	if (opts.file && fclose(archive)) {
+		ntfs_log_perror("Could not close the archive");
+		res = 1;
+	}
+	free(opts.paths);
+	return (res);
+}
@@ -727,7 +727,7 @@ static int fix_upcase(ntfs_volume *vol)
 		}
 	} else {
 			/* accept the upcase table read from $UpCase */
-		free(vol->upcase);
+		ntfs_upcase_unshare(vol->upcase, (ntfschar*)NULL);
 		vol->upcase = upcase;
 		vol->upcase_len = upcase_len;
 		res = 0;
@@ -66,6 +66,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "types.h"
 #include "mft.h"
@@ -93,6 +96,9 @@ static struct options {
 	int	 force;		/* Override common sense */
 	int	 notime;	/* Don't report timestamps at all */
 	int	 mft;		/* Dump information about the volume as well */
+	const char *export;	/* Export the mft to this file */
+	int	 binary;	/* Export as binary records */
+	int	 threads;	/* Threads for scanning the mft */
 } opts;
 
 struct RUNCOUNT {
@@ -137,6 +143,9 @@ static void usage(void)
 		"    -F, --file FILE  Display information about this file (absolute path)\n"
 		"    -m, --mft        Dump information about the volume\n"
 		"    -t, --notime     Don't report timestamps\n"
+		"    -x, --export FILE  Export all the files to FILE (- for stdout)\n"
+		"    -b, --binary     Export as binary records instead of CSV\n"
+		"    -j, --threads NUM  Scan the mft with NUM threads\n"
 		"\n"
 		"    -f, --force      Use less caution\n"
 		"    -q, --quiet      Less output\n"
@@ -159,7 +168,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char *argv[])
 {
-	static const char *sopt = "-:dfhi:F:mqtTvV";
+	static const char *sopt = "-:bdfhi:F:j:mqtTvVx:";
 	static const struct option lopt[] = {
 		{ "force",	 no_argument,		NULL, 'f' },
 		{ "help",	 no_argument,		NULL, 'h' },
@@ -170,6 +179,9 @@ static int parse_options(int argc, char *argv[])
 		{ "version",	 no_argument,		NULL, 'V' },
 		{ "notime",	 no_argument,		NULL, 'T' },
 		{ "mft",	 no_argument,		NULL, 'm' },
+		{ "export",	 required_argument,	NULL, 'x' },
+		{ "binary",	 no_argument,		NULL, 'b' },
+		{ "threads",	 required_argument,	NULL, 'j' },
 		{ NULL,		 0,			NULL,  0  }
 	};
 
@@ -178,11 +190,13 @@ static int parse_options(int argc, char *argv[])
 	int ver  = 0;
 	int help = 0;
 	int levels = 0;
+	char *end;
 
 	opterr = 0; /* We'll handle the errors, thank you. */
 
 	opts.inode = -1;
 	opts.filename = NULL;
+	opts.threads = -1;
 
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
@@ -237,6 +251,23 @@ static int parse_options(int argc, char *argv[])
 		case 'm':
 			opts.mft++;
 			break;
+		case 'x':
+			if (!opts.export)
+				opts.export = optarg;
+			else
+				err++;
+			break;
+		case 'b':
+			opts.binary++;
+			break;
+		case 'j':
+			opts.threads = strtol(optarg, &end, 10);
+			if (*end || (opts.threads < 0)) {
+				ntfs_log_error("Bad thread count '%s'.\n",
+						optarg);
+				err++;
+			}
+			break;
 		case '?':
 			if (optopt=='?') {
 				help++;
@@ -277,7 +308,8 @@ static int parse_options(int argc, char *argv[])
 			err++;
 		}
 
-		if (opts.inode == -1 && !opts.filename && !opts.mft) {
+		if (opts.inode == -1 && !opts.filename && !opts.mft
+		    && !opts.export) {
 			if (argc > 1)
 				ntfs_log_error("You must specify an inode to "
 					"learn about.\n");
@@ -297,6 +329,19 @@ static int parse_options(int argc, char *argv[])
 			err++;
 		}
 
+		if (opts.export
+		    && ((opts.inode != -1) || opts.filename || opts.mft)) {
+			ntfs_log_error("You may not specify --export with "
+				"--inode, --file or --mft.\n");
+			err++;
+		}
+
+		if ((opts.binary || (opts.threads >= 0)) && !opts.export) {
+			ntfs_log_error("Options --binary and --threads "
+				"require --export.\n");
+			err++;
+		}
+
 	}
 
 	if (ver)
@@ -2439,6 +2484,462 @@ static void ntfs_dump_file_attributes(ntfs_inode *inode)
 	ntfs_inode_close(inode);
 }
 
+/*
+ *		Bulk export of the files
+ *
+ *	The mft is scanned with ntfs_mft_scan(), and a compact record is
+ *	output for each base record in use, streamed in the order of the
+ *	mft, either as a CSV line or as a binary record. The record is
+ *	decoded from the copy read ahead by the scanner, and an inode is
+ *	only opened when its attributes are spread over several records.
+ *
+ *	The binary format is a header made of the magic "NTFSMFTX", a
+ *	le32 version and the le32 size of the fixed part of the records,
+ *	followed by the records, each made of a struct EXPORT_RECORD and
+ *	of the UTF-8 name and short name it designates.
+ */
+
+#define EXPORT_MAGIC "NTFSMFTX"
+#define EXPORT_VERSION 1
+#define EXPORT_BUFFER_SIZE 1048576	/* output buffered before writing */
+#define EXPORT_SHORT_NAME 12		/* max length of a short name */
+
+	/* flags of an exported file */
+#define EXPORT_DIRECTORY 1	/* is a directory */
+#define EXPORT_STREAMS 2	/* has named data streams */
+#define EXPORT_ATTRLIST 4	/* has an attribute list */
+#define EXPORT_REPARSE 8	/* has a reparse point */
+#define EXPORT_EA 16		/* has extended attributes */
+
+struct EXPORT_RECORD {
+	leMFT_REF mref;		/* reference of the file */
+	leMFT_REF parent;	/* reference of the parent of the name */
+	sle64 data_size;	/* size of the unnamed data */
+	sle64 allocated_size;	/* allocated size of the unnamed data */
+	sle64 creation_time;	/* times from the standard information */
+	sle64 last_data_change_time;
+	sle64 last_mft_change_time;
+	sle64 last_access_time;
+	le32 file_attributes;
+	le32 security_id;
+	le32 extents;		/* fragments of the unnamed data */
+	le16 flags;		/* EXPORT_* flags */
+	le16 links;		/* count of hard links */
+	le16 name_length;	/* bytes of the UTF-8 name */
+	le16 short_name_length;	/* bytes of the UTF-8 short name */
+} __attribute__((__packed__));
+
+struct EXPORT_FILE {
+	MFT_REF parent;
+	s64 data_size;
+	s64 allocated_size;
+	s64 times[4];
+	s64 next_lcn;
+	u32 file_attributes;
+	u32 security_id;
+	u32 extents;
+	u16 flags;
+	u16 links;
+	int name_len;
+	int short_name_len;
+	ntfschar name[NTFS_MAX_NAME_LEN];
+	ntfschar short_name[EXPORT_SHORT_NAME];
+} ;
+
+struct EXPORT_STATE {
+	FILE *out;
+	struct EXPORT_FILE file;
+	s64 files;
+	s64 fallbacks;
+} ;
+
+/*
+ *		Count the fragments in the mapping pairs of an attribute
+ *
+ *	A run which is contiguous to the previous allocated one, possibly
+ *	in a previous extent of the attribute, is not counted, as for the
+ *	fragments shown by ntfs_dump_attribute_header().
+ */
+
+static u32 export_extents(const ATTR_RECORD *a, s64 *next_lcn)
+{
+	const u8 *p;
+	const u8 *end;
+	s64 length;
+	s64 delta;
+	s64 lcn;
+	u32 extents;
+	int lsz;
+	int osz;
+	int i;
+
+	extents = 0;
+	lcn = 0;
+	p = (const u8*)a + le16_to_cpu(a->mapping_pairs_offset);
+	end = (const u8*)a + le32_to_cpu(a->length);
+	while ((p < end) && *p) {
+		lsz = *p & 15;
+		osz = (*p >> 4) & 15;
+		if (!lsz || (lsz > 8) || (osz > 8) || ((p + 1 + lsz + osz) > end))
+			break;
+		if (osz) {
+			length = 0;
+			for (i=lsz; i>0; i--)
+				length = (length << 8) | p[i];
+			delta = (s8)p[lsz + osz];
+			for (i=lsz+osz-1; i>lsz; i--)
+				delta = (delta << 8) | p[i];
+			lcn += delta;
+			if (lcn != *next_lcn)
+				extents++;
+			*next_lcn = lcn + length;
+		}
+		p += 1 + lsz + osz;
+	}
+	return (extents);
+}
+
+/*
+ *		Accumulate the properties of an attribute of a file
+ */
+
+static void export_attr(struct EXPORT_FILE *ef, const ATTR_RECORD *a)
+{
+	const STANDARD_INFORMATION *si;
+	const FILE_NAME_ATTR *fn;
+	u32 vlen;
+
+	vlen = le32_to_cpu(a->value_length);
+	if (!a->non_resident
+	    && ((le16_to_cpu(a->value_offset) + vlen)
+			> le32_to_cpu(a->length)))
+		return;
+	switch (a->type) {
+	case AT_STANDARD_INFORMATION :
+		if (a->non_resident
+		    || (vlen < offsetof(STANDARD_INFORMATION, reserved12)))
+			break;
+		si = (const STANDARD_INFORMATION*)((const char*)a
+					+ le16_to_cpu(a->value_offset));
+		ef->times[0] = sle64_to_cpu(si->creation_time);
+		ef->times[1] = sle64_to_cpu(si->last_data_change_time);
+		ef->times[2] = sle64_to_cpu(si->last_mft_change_time);
+		ef->times[3] = sle64_to_cpu(si->last_access_time);
+		ef->file_attributes = le32_to_cpu(si->file_attributes);
+		if (vlen >= (offsetof(STANDARD_INFORMATION, security_id) + 4))
+			ef->security_id = le32_to_cpu(si->security_id);
+		break;
+	case AT_FILE_NAME :
+		if (a->non_resident || (vlen < sizeof(FILE_NAME_ATTR)))
+			break;
+		fn = (const FILE_NAME_ATTR*)((const char*)a
+					+ le16_to_cpu(a->value_offset));
+		if ((sizeof(FILE_NAME_ATTR)
+				+ fn->file_name_length*sizeof(ntfschar)) > vlen)
+			break;
+		if (fn->file_name_type == FILE_NAME_DOS) {
+			if (fn->file_name_length <= EXPORT_SHORT_NAME) {
+				memcpy(ef->short_name, fn->file_name,
+					fn->file_name_length*sizeof(ntfschar));
+				ef->short_name_len = fn->file_name_length;
+			}
+		} else {
+			if (!ef->links++) {
+				memcpy(ef->name, fn->file_name,
+					fn->file_name_length*sizeof(ntfschar));
+				ef->name_len = fn->file_name_length;
+				ef->parent = le64_to_cpu(fn->parent_directory);
+			}
+		}
+		break;
+	case AT_DATA :
+		if (a->name_length) {
+			ef->flags |= EXPORT_STREAMS;
+			break;
+		}
+		if (!a->non_resident)
+			ef->data_size = ef->allocated_size = vlen;
+		else {
+			if (!a->lowest_vcn) {
+				ef->data_size = sle64_to_cpu(a->data_size);
+				ef->allocated_size =
+					sle64_to_cpu(a->allocated_size);
+			}
+			ef->extents += export_extents(a, &ef->next_lcn);
+		}
+		break;
+	case AT_ATTRIBUTE_LIST :
+		ef->flags |= EXPORT_ATTRLIST;
+		break;
+	case AT_REPARSE_POINT :
+		ef->flags |= EXPORT_REPARSE;
+		break;
+	case AT_EA :
+		ef->flags |= EXPORT_EA;
+		break;
+	default :
+		break;
+	}
+}
+
+/*
+ *		Accumulate the properties from the attributes in a record
+ *
+ *	Returns TRUE if the record has an attribute list
+ */
+
+static BOOL export_record(struct EXPORT_FILE *ef, ntfs_volume *vol,
+			const MFT_RECORD *mrec)
+{
+	const ATTR_RECORD *a;
+	u32 inuse;
+	u32 length;
+	u32 offs;
+
+	inuse = le32_to_cpu(mrec->bytes_in_use);
+	if (inuse > vol->mft_record_size)
+		inuse = vol->mft_record_size;
+	offs = le16_to_cpu(mrec->attrs_offset);
+	while ((offs + offsetof(ATTR_RECORD, name_length)) <= inuse) {
+		a = (const ATTR_RECORD*)((const char*)mrec + offs);
+		length = le32_to_cpu(a->length);
+		if ((a->type == AT_END)
+		    || (length < offsetof(ATTR_RECORD, resident_end))
+		    || ((offs + length) > inuse))
+			break;
+		export_attr(ef, a);
+		offs += length;
+	}
+	return ((ef->flags & EXPORT_ATTRLIST) != 0);
+}
+
+/*
+ *		Accumulate the properties of a file whose attributes are
+ *	spread over several records, by walking its attribute list
+ *
+ *	Returns 0 if successful, -1 otherwise (errno set)
+ */
+
+static int export_inode(struct EXPORT_FILE *ef, ntfs_volume *vol,
+			const MFT_REF mref)
+{
+	ntfs_attr_search_ctx *ctx;
+	ntfs_inode *ni;
+	u16 flags;
+	int res;
+
+	res = -1;
+	ni = ntfs_inode_open(vol, mref);
+	if (ni) {
+		ctx = ntfs_attr_get_search_ctx(ni, NULL);
+		if (ctx) {
+			flags = ef->flags & EXPORT_DIRECTORY;
+			memset(ef, 0, sizeof(struct EXPORT_FILE));
+			ef->flags = flags;
+			ef->next_lcn = LCN_HOLE;
+			while (!ntfs_attr_lookup(AT_UNUSED, NULL, 0,
+					CASE_SENSITIVE, 0, NULL, 0, ctx))
+				export_attr(ef, ctx->attr);
+			if (errno == ENOENT)
+				res = 0;
+			ntfs_attr_put_search_ctx(ctx);
+		}
+		ntfs_inode_close(ni);
+	}
+	return (res);
+}
+
+/*
+ *		Convert a name to UTF-8, an empty name on error
+ */
+
+static char *export_name(const ntfschar *name, int len)
+{
+	char *s;
+
+	s = (char*)NULL;
+	if (len && (ntfs_ucstombs(name, len, &s, 0) < 0))
+		s = (char*)NULL;
+	return (s);
+}
+
+/*
+ *		Output a name as a CSV field, quoted
+ */
+
+static void export_csv_name(FILE *out, const char *s)
+{
+	putc('"', out);
+	if (s) {
+		while (*s) {
+			if (*s == '"')
+				putc('"', out);
+			putc(*s++, out);
+		}
+	}
+	putc('"', out);
+}
+
+/*
+ *		Output the record of a file
+ */
+
+static void export_output(FILE *out, const MFT_REF mref,
+			const struct EXPORT_FILE *ef)
+{
+	struct EXPORT_RECORD rec;
+	char *name;
+	char *short_name;
+	int i;
+
+	name = export_name(ef->name, ef->name_len);
+	short_name = export_name(ef->short_name, ef->short_name_len);
+	if (opts.binary) {
+		rec.mref = cpu_to_le64(mref);
+		rec.parent = cpu_to_le64(ef->parent);
+		rec.data_size = cpu_to_sle64(ef->data_size);
+		rec.allocated_size = cpu_to_sle64(ef->allocated_size);
+		rec.creation_time = cpu_to_sle64(ef->times[0]);
+		rec.last_data_change_time = cpu_to_sle64(ef->times[1]);
+		rec.last_mft_change_time = cpu_to_sle64(ef->times[2]);
+		rec.last_access_time = cpu_to_sle64(ef->times[3]);
+		rec.file_attributes = cpu_to_le32(ef->file_attributes);
+		rec.security_id = cpu_to_le32(ef->security_id);
+		rec.extents = cpu_to_le32(ef->extents);
+		rec.flags = cpu_to_le16(ef->flags);
+		rec.links = cpu_to_le16(ef->links);
+		rec.name_length = cpu_to_le16(name ? strlen(name) : 0);
+		rec.short_name_length = cpu_to_le16(short_name
+					? strlen(short_name) : 0);
+		fwrite(&rec, sizeof(rec), 1, out);
+		if (name)
+			fwrite(name, strlen(name), 1, out);
+		if (short_name)
+			fwrite(short_name, strlen(short_name), 1, out);
+	} else {
+		fprintf(out, "%lld,%d,%lld,%d,0x%x,0x%x,%lu,%d,%lld,%lld,%lu",
+			(long long)MREF(mref), (int)MSEQNO(mref),
+			(long long)MREF(ef->parent), (int)MSEQNO(ef->parent),
+			(int)ef->flags, (int)ef->file_attributes,
+			(unsigned long)ef->security_id, (int)ef->links,
+			(long long)ef->data_size,
+			(long long)ef->allocated_size,
+			(unsigned long)ef->extents);
+		for (i=0; i<4; i++)
+			fprintf(out, ",%lld", (long long)ef->times[i]);
+		putc(',', out);
+		export_csv_name(out, name);
+		putc(',', out);
+		export_csv_name(out, short_name);
+		putc('\n', out);
+	}
+	free(name);
+	free(short_name);
+}
+
+/*
+ *		Export a record provided by the mft scanner
+ */
+
+static int export_file(ntfs_volume *vol, const MFT_REF mref,
+		MFT_RECORD *mrec, void *data)
+{
+	struct EXPORT_STATE *state;
+	struct EXPORT_FILE *ef;
+
+	state = (struct EXPORT_STATE*)data;
+	if (!(mrec->flags & MFT_RECORD_IN_USE) || mrec->base_mft_record)
+		return (0);
+	ef = &state->file;
+	memset(ef, 0, offsetof(struct EXPORT_FILE, name));
+	ef->next_lcn = LCN_HOLE;
+	if (mrec->flags & MFT_RECORD_IS_DIRECTORY)
+		ef->flags |= EXPORT_DIRECTORY;
+	if (export_record(ef, vol, mrec)) {
+		state->fallbacks++;
+		if (export_inode(ef, vol, mref)) {
+			ntfs_log_perror("Could not read inode %lld",
+					(long long)MREF(mref));
+			return (0);
+		}
+	}
+	export_output(state->out, mref, ef);
+	state->files++;
+	return (ferror(state->out) ? -1 : 0);
+}
+
+/*
+ *		Export all the files
+ *
+ *	Returns 0 if successful, -1 otherwise
+ */
+
+static int ntfs_export_mft(ntfs_volume *vol)
+{
+	struct EXPORT_STATE *state;
+	struct EXPORT_RECORD rec;
+	char *buffer;
+	le32 header[2];
+	BOOL tostdout;
+	int threads;
+	int res;
+
+	res = -1;
+	tostdout = !strcmp(opts.export, "-");
+	state = (struct EXPORT_STATE*)ntfs_malloc(sizeof(struct EXPORT_STATE));
+	buffer = (char*)ntfs_malloc(EXPORT_BUFFER_SIZE);
+	if (!state || !buffer)
+		goto out;
+	state->files = 0;
+	state->fallbacks = 0;
+		/* a stream of our own, for a buffer of our own */
+	if (tostdout) {
+		fflush(stdout);
+		state->out = fdopen(dup(STDOUT_FILENO), "w");
+	} else
+		state->out = fopen(opts.export, "w");
+	if (!state->out) {
+		ntfs_log_perror("Could not open '%s'", opts.export);
+		goto out;
+	}
+	setvbuf(state->out, buffer, _IOFBF, EXPORT_BUFFER_SIZE);
+	if (opts.binary) {
+		header[0] = const_cpu_to_le32(EXPORT_VERSION);
+		header[1] = cpu_to_le32(sizeof(rec));
+		fwrite(EXPORT_MAGIC, 8, 1, state->out);
+		fwrite(header, sizeof(header), 1, state->out);
+	} else
+		fprintf(state->out, "mft,seq,parent,parent_seq,flags,"
+			"attributes,security_id,links,data_size,"
+			"allocated_size,extents,created,modified,"
+			"mft_modified,accessed,name,short_name\n");
+	threads = opts.threads;
+	if (threads < 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads < 1)
+			threads = 1;
+	}
+	if (ntfs_mft_scan(vol, threads, export_file, state) < 0)
+		ntfs_log_perror("Could not export the mft");
+	else
+		res = 0;
+	if (fflush(state->out) || ferror(state->out)) {
+		ntfs_log_perror("Could not write '%s'", opts.export);
+		res = -1;
+	}
+	if (fclose(state->out)) {
+		ntfs_log_perror("Could not close '%s'", opts.export);
+		res = -1;
+	}
+	if (!res && !tostdout && !opts.quiet)
+		printf("%lld files exported, %lld with an attribute list\n",
+			(long long)state->files, (long long)state->fallbacks);
+out :
+	free(state);
+	free(buffer);
+	return (res);
+}
+
 /**
  * main() - Begin here
  *
@@ -2461,6 +2962,7 @@ int main(int argc, char **argv)
 		printf("Failed to parse command line options\n");
 	if (res >= 0)
 		exit(res);
+	res = 0;
 
 	utils_set_locale();
 
@@ -2478,6 +2980,9 @@ int main(int argc, char **argv)
 	if (opts.mft)
 		ntfs_dump_volume(vol);
 
+	if (opts.export && ntfs_export_mft(vol))
+		res = 1;
+
 	if ((opts.inode != -1) || opts.filename) {
 		ntfs_inode *inode;
 		/* obtain the inode */
@@ -2518,6 +3023,6 @@ int main(int argc, char **argv)
 	}
 
 	ntfs_umount(vol, FALSE);
-	return 0;
+	return (res ? 1 : 0);
 }
 
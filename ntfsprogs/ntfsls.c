@@ -41,6 +41,15 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_STDARG_H
+#include <stdarg.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "types.h"
 #include "mft.h"
@@ -117,11 +126,38 @@ static struct options {
 	int inode;
 	int classify;
 	int recursive;
+	int threads;
+	int unordered;
 	const char *path;
 } opts;
 
+#define LS_MAX_THREADS 16 /* max threads, each mounting the volume */
+
+/**
+ * ls_job - a directory to be listed by a thread
+ * @next:	the next job in the queue, or in the list of listed jobs
+ * @children:	its sub-directories, in the order they were listed
+ * @sibling:	the next sub-directory of the same parent
+ * @path:	the relative path printed as a header
+ * @out:	the listing, printed by the main thread
+ */
+struct ls_job {
+	struct ls_job *next;
+	struct ls_job *children;
+	struct ls_job *last_child;
+	struct ls_job *sibling;
+	char *path;
+	MFT_REF mref;
+	BOOL root;
+	BOOL done;
+	char *out;
+	size_t size;
+	size_t allocated;
+};
+
 typedef struct {
 	ntfs_volume *vol;
+	struct ls_job *job;	/* the job being listed by a thread, if any */
 } ntfsls_dirent;
 
 static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
@@ -169,6 +205,8 @@ static void usage(void)
 		"    -q, --quiet          Less output\n"
 		"    -R, --recursive      Recursively list subdirectories\n"
 		"    -s, --system         Display system files\n"
+		"    -t, --threads NUM    List recursively with NUM threads, 0 for all cpus\n"
+		"    -u, --unordered      Print the directories as they are listed\n"
 		"    -V, --version        Display version information\n"
 		"    -v, --verbose        More output\n"
 		"    -x, --dos            Use short (DOS 8.3) names\n"
@@ -191,7 +229,7 @@ static void usage(void)
  */
 static int parse_options(int argc, char *argv[])
 {
-	static const char *sopt = "-aFfh?ilp:qRsVvx";
+	static const char *sopt = "-aFfh?ilp:qRst:uVvx";
 	static const struct option lopt[] = {
 		{ "all",	 no_argument,		NULL, 'a' },
 		{ "classify",	 no_argument,		NULL, 'F' },
@@ -203,6 +241,8 @@ static int parse_options(int argc, char *argv[])
 		{ "recursive",	 no_argument,		NULL, 'R' },
 		{ "quiet",	 no_argument,		NULL, 'q' },
 		{ "system",	 no_argument,		NULL, 's' },
+		{ "threads",	 required_argument,	NULL, 't' },
+		{ "unordered",	 no_argument,		NULL, 'u' },
 		{ "version",	 no_argument,		NULL, 'V' },
 		{ "verbose",	 no_argument,		NULL, 'v' },
 		{ "dos",	 no_argument,		NULL, 'x' },
@@ -214,12 +254,14 @@ static int parse_options(int argc, char *argv[])
 	int ver  = 0;
 	int help = 0;
 	int levels = 0;
+	char *end = NULL;
 
 	opterr = 0; /* We'll handle the errors, thank you. */
 
 	memset(&opts, 0, sizeof(opts));
 	opts.device = NULL;
 	opts.path = "/";
+	opts.threads = 1;
 
 	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
 		switch (c) {
@@ -276,6 +318,25 @@ static int parse_options(int argc, char *argv[])
 		case 'R':
 			opts.recursive++;
 			break;
+		case 't':
+			opts.threads = strtol(optarg, &end, 10);
+			if (*end || (opts.threads < 0)) {
+				ntfs_log_error("Bad number of threads '%s'.\n",
+						optarg);
+				err++;
+			}
+#ifdef HAVE_UNISTD_H
+			if (!opts.threads)
+				opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+			if (opts.threads < 1)
+				opts.threads = 1;
+			if (opts.threads > LS_MAX_THREADS)
+				opts.threads = LS_MAX_THREADS;
+			break;
+		case 'u':
+			opts.unordered++;
+			break;
 		default:
 			ntfs_log_error("Unknown option '%s'.\n", argv[optind - 1]);
 			err++;
@@ -482,6 +543,341 @@ static int readdir_recursive(ntfs_inode * ni, s64 * pos, ntfsls_dirent * dirent)
 	return result;
 }
 
+/**
+ * ls_printf - print a line of a listing
+ * @dirent:	context of the listing
+ *
+ * When a thread lists a directory, the line is appended to the output of
+ * its job, which is printed later by the main thread.
+ */
+static void ls_printf(ntfsls_dirent *dirent, const char *fmt, ...)
+{
+	struct ls_job *job;
+	va_list ap;
+	va_list aq;
+	size_t allocated;
+	char *out;
+	int n;
+
+	va_start(ap, fmt);
+	job = dirent->job;
+	if (!job) {
+		vprintf(fmt, ap);
+	} else {
+		va_copy(aq, ap);
+		n = vsnprintf((char *)NULL, 0, fmt, aq);
+		va_end(aq);
+		if ((n > 0) && ((job->size + n) >= job->allocated)) {
+			allocated = 2*job->allocated + n + 4096;
+			out = realloc(job->out, allocated);
+			if (out) {
+				job->out = out;
+				job->allocated = allocated;
+			}
+		}
+		if ((n > 0) && ((job->size + n) < job->allocated)) {
+			vsnprintf(job->out + job->size, n + 1, fmt, ap);
+			job->size += n;
+		}
+	}
+	va_end(ap);
+}
+
+/**
+ * ls_add_child - record a sub-directory of the directory being listed
+ * @job:	the job listing the parent directory
+ * @name:	the name of the sub-directory, as printed
+ * @mref:	its inode
+ *
+ * The header of the sub-directory is built the same way as by
+ * readdir_recursive(), so that the outputs are the same.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int ls_add_child(struct ls_job *job, const char *name, MFT_REF mref)
+{
+	struct ls_job *child;
+	BOOL sep;
+
+	child = (struct ls_job *)calloc(1, sizeof(struct ls_job));
+	if (child) {
+		if (job->root)
+			sep = *job->path != PATH_SEP;
+		else
+			sep = !opts.classify;
+		child->path = (char *)malloc(strlen(job->path)
+						+ strlen(name) + 2);
+		if (child->path) {
+			sprintf(child->path, "%s%s%s", job->path,
+					(sep ? "/" : ""), name);
+			child->mref = mref;
+			if (job->last_child)
+				job->last_child->sibling = child;
+			else
+				job->children = child;
+			job->last_child = child;
+		} else {
+			free(child);
+			child = (struct ls_job *)NULL;
+		}
+	}
+	if (!child)
+		ntfs_log_error("Failed to allocate for subdir.\n");
+	return (child ? 0 : -1);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ *		Parallel recursive listing
+ *
+ *	Each directory is a job, which a thread lists into a buffer,
+ *	recording its sub-directories as new jobs. The pending jobs are
+ *	kept in a stack shared by all the threads, so that the threads
+ *	do not run out of work as long as some directories are left,
+ *	and the first sub-directories of a directory are listed first,
+ *	which is the order they are printed in.
+ *
+ *	Each thread has its own volume, mounted read-only, so that
+ *	the library state is never shared.
+ *
+ *	By default the main thread prints the directories in the same
+ *	order as readdir_recursive() as soon as they are listed, which
+ *	may hold listed directories in memory until the previous ones
+ *	are printed. With --unordered, they are printed as soon as
+ *	they are listed.
+ */
+
+struct ls_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct ls_job *queue;	/* the jobs waiting for a thread */
+	struct ls_job *listed;	/* the listed jobs, with --unordered */
+	struct ls_job **listed_tail;
+	long pending;		/* the jobs not listed yet */
+} ;
+
+struct ls_worker {
+	struct ls_pool *pool;
+	ntfs_volume *vol;
+	pthread_t thread;
+	BOOL started;
+} ;
+
+/**
+ * ls_list_job - list a directory into the output of a job
+ */
+static void ls_list_job(ntfs_volume *vol, struct ls_job *job)
+{
+	ntfsls_dirent dirent;
+	ntfs_inode *ni;
+	s64 pos;
+
+	memset(&dirent, 0, sizeof(dirent));
+	dirent.vol = vol;
+	dirent.job = job;
+	if (job->root)
+		ls_printf(&dirent, "%s:\n", job->path);
+	else
+		ls_printf(&dirent, "\n%s:\n", job->path);
+	ni = ntfs_inode_open(vol, job->mref);
+	if (ni) {
+		pos = 0;
+		if (ntfs_readdir(ni, &pos, &dirent,
+				(ntfs_filldir_t) list_dir_entry))
+			ntfs_log_error("Failed to list %s\n", job->path);
+		ntfs_inode_close(ni);
+	} else
+		ntfs_log_error("ntfsls::ls_list_job(): cannot open "
+				"directory %s.\n", job->path);
+}
+
+/**
+ * ls_worker - take jobs from the pool until all the directories are listed
+ */
+static void *ls_worker(void *arg)
+{
+	struct ls_worker *worker = (struct ls_worker *)arg;
+	struct ls_pool *pool = worker->pool;
+	struct ls_job *job;
+	struct ls_job *child;
+	struct ls_job *queue;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending) {
+		job = pool->queue;
+		if (!job) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		pool->queue = job->next;
+		job->next = (struct ls_job *)NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		ls_list_job(worker->vol, job);
+
+		pthread_mutex_lock(&pool->lock);
+		/* queue the children in front, the first one on top */
+		queue = (struct ls_job *)NULL;
+		for (child=job->children; child; child=child->sibling) {
+			child->next = queue;
+			queue = child;
+			pool->pending++;
+		}
+		while (queue) {
+			child = queue;
+			queue = child->next;
+			child->next = pool->queue;
+			pool->queue = child;
+		}
+		job->done = TRUE;
+		if (opts.unordered) {
+			*pool->listed_tail = job;
+			pool->listed_tail = &job->next;
+		}
+		pool->pending--;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ((void *)NULL);
+}
+
+/**
+ * ls_print_job - print a listed job and free it
+ */
+static void ls_print_job(struct ls_job *job)
+{
+	if (job->size)
+		fwrite(job->out, 1, job->size, stdout);
+	free(job->out);
+	free(job->path);
+	free(job);
+}
+
+/**
+ * ls_print_tree - print the directories in the order of readdir_recursive()
+ */
+static void ls_print_tree(struct ls_pool *pool, struct ls_job *job)
+{
+	struct ls_job *child;
+	struct ls_job *next;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	/* the children are known now, and no thread uses this job */
+	child = job->children;
+	job->children = (struct ls_job *)NULL;
+	ls_print_job(job);
+	while (child) {
+		next = child->sibling;
+		ls_print_tree(pool, child);
+		child = next;
+	}
+}
+
+/**
+ * readdir_parallel - list a directory and its sub-directories with threads
+ * @vol:	the volume, used by the first thread
+ * @ni:		ntfs inode of the directory to list
+ *
+ * The other threads mount their own volume. If some of them cannot, the
+ * listing goes on with the threads available.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int readdir_parallel(ntfs_volume *vol, ntfs_inode *ni)
+{
+	struct ls_worker workers[LS_MAX_THREADS];
+	struct ls_pool pool;
+	struct ls_job *job;
+	struct ls_job *next;
+	struct ls_job *root;
+	int started;
+	int i;
+
+	root = (struct ls_job *)calloc(1, sizeof(struct ls_job));
+	if (root)
+		root->path = strdup(opts.path);
+	if (!root || !root->path) {
+		free(root);
+		ntfs_log_error("Failed to allocate for the listing.\n");
+		return (-1);
+	}
+	root->root = TRUE;
+	root->mref = MK_MREF(ni->mft_no,
+			le16_to_cpu(ni->mrec->sequence_number));
+
+	pthread_mutex_init(&pool.lock, (pthread_mutexattr_t *)NULL);
+	pthread_cond_init(&pool.cond, (pthread_condattr_t *)NULL);
+	pool.queue = root;
+	pool.listed = (struct ls_job *)NULL;
+	pool.listed_tail = &pool.listed;
+	pool.pending = 1;
+
+	started = 0;
+	for (i=0; i<opts.threads; i++) {
+		workers[i].pool = &pool;
+		workers[i].started = FALSE;
+		if (i)
+			workers[i].vol = ntfs_mount(opts.device,
+					NTFS_MNT_RDONLY
+					| (opts.force ? NTFS_MNT_RECOVER : 0));
+		else
+			workers[i].vol = vol;
+		if (workers[i].vol
+		    && !pthread_create(&workers[i].thread,
+				(pthread_attr_t *)NULL, ls_worker,
+				&workers[i])) {
+			workers[i].started = TRUE;
+			started++;
+		} else {
+			if (i && workers[i].vol)
+				ntfs_umount(workers[i].vol, FALSE);
+			workers[i].vol = (ntfs_volume *)NULL;
+		}
+	}
+	if (started) {
+		if (opts.unordered) {
+			pthread_mutex_lock(&pool.lock);
+			while (pool.pending || pool.listed) {
+				if (!pool.listed) {
+					pthread_cond_wait(&pool.cond,
+							&pool.lock);
+					continue;
+				}
+				job = pool.listed;
+				pool.listed = (struct ls_job *)NULL;
+				pool.listed_tail = &pool.listed;
+				pthread_mutex_unlock(&pool.lock);
+				while (job) {
+					next = job->next;
+					ls_print_job(job);
+					job = next;
+				}
+				pthread_mutex_lock(&pool.lock);
+			}
+			pthread_mutex_unlock(&pool.lock);
+		} else
+			ls_print_tree(&pool, root);
+	} else {
+		ntfs_log_error("Failed to start the threads.\n");
+		ls_print_job(root);
+	}
+	for (i=0; i<opts.threads; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, (void **)NULL);
+		if (i && workers[i].vol)
+			ntfs_umount(workers[i].vol, FALSE);
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	return (started ? 0 : -1);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
 /**
  * list_dir_entry
  *
@@ -496,6 +892,7 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 	int result = 0;
 
 	struct dir *dir = NULL;
+	BOOL subdir = FALSE;
 
 	filename = calloc(1, MAX_PATH);
 	if (!filename)
@@ -523,7 +920,10 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 	if (dt_type == NTFS_DT_DIR && opts.recursive
 	    && strcmp(filename, ".") && strcmp(filename, "./")
 	    && strcmp(filename, "..") && strcmp(filename, "../"))
-	{
+		subdir = TRUE;
+
+	/* a thread only records the sub-directories to list them later */
+	if (subdir && !dirent->job) {
 		dir = (struct dir *)calloc(1, sizeof(struct dir));
 
 		if (!dir) {
@@ -539,9 +939,9 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 
 	if (!opts.lng) {
 		if (!opts.inode)
-			printf("%s\n", filename);
+			ls_printf(dirent, "%s\n", filename);
 		else
-			printf("%7llu %s\n", (unsigned long long)MREF(mref),
+			ls_printf(dirent, "%7llu %s\n", (unsigned long long)MREF(mref),
 					filename);
 		result = 0;
 	} else {
@@ -586,13 +986,13 @@ static int list_dir_entry(ntfsls_dirent * dirent, const ntfschar * name,
 		}
 
 		if (opts.inode)
-			printf("%7llu    %8lld %s %s\n",
+			ls_printf(dirent, "%7llu    %8lld %s %s\n",
 					(unsigned long long)MREF(mref),
 					(long long)filesize, t_buf + 4,
 					filename);
 		else
-			printf("%8lld %s %s\n", (long long)filesize, t_buf + 4,
-					filename);
+			ls_printf(dirent, "%8lld %s %s\n", (long long)filesize,
+					t_buf + 4, filename);
 
 		if (dir) {
 			dir->ni = ni;
@@ -617,6 +1017,9 @@ release:
 			dir = NULL;
 		}
 	}
+	if (subdir && dirent->job && !result
+	    && ls_add_child(dirent->job, filename, mref))
+		result = -1;
 
 free:
 	free(filename);
@@ -672,6 +1075,11 @@ int main(int argc, char **argv)
 	memset(&dirent, 0, sizeof(dirent));
 	dirent.vol = vol;
 	if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
+#ifdef HAVE_PTHREAD_H
+		if (opts.recursive && (opts.threads > 1))
+			readdir_parallel(vol, ni);
+		else
+#endif
 		if (opts.recursive)
 			readdir_recursive(ni, &pos, &dirent);
 		else
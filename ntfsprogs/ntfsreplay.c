@@ -0,0 +1,1298 @@
+/**
+ * ntfsreplay - Part of the Linux-NTFS project.
+ *
+ * This utility replays on an unmounted volume the requests recorded by
+ * lowntfs-3g with the option optrace, and reports the device transfers,
+ * the cache hit rates, the latencies and the fragmentation which result,
+ * so that the cache and allocation settings can be compared offline on
+ * copies of a volume.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "attrib.h"
+#include "inode.h"
+#include "dir.h"
+#include "index.h"
+#include "mft.h"
+#include "lcnalloc.h"
+#include "cache.h"
+#include "blkcache.h"
+#include "unistr.h"
+#include "stats.h"
+#include "utils.h"
+#include "misc.h"
+#include "logging.h"
+
+#define REPLAY_LINE 16384	/* max size of a line of the trace */
+#define REPLAY_FIELDS 6		/* max fields in a line */
+#define REPLAY_HASH 4096	/* buckets for the inode numbers */
+#define REPLAY_MAX_IO 0x1000000	/* max bytes read or written at once */
+#define REPLAY_BITMAP_CHUNK 65536 /* bytes of $Bitmap read at once */
+#define REPLAY_KEEP_SIZE 1	/* FALLOC_FL_KEEP_SIZE in fallocate mode */
+
+static const char *EXEC_NAME = "ntfsreplay";
+
+enum {
+	REPLAY_LOOKUP,
+	REPLAY_GETATTR,
+	REPLAY_SETATTR,
+	REPLAY_TRUNCATE,
+	REPLAY_OPEN,
+	REPLAY_RELEASE,
+	REPLAY_READ,
+	REPLAY_WRITE,
+	REPLAY_READDIR,
+	REPLAY_READDIRPLUS,
+	REPLAY_CREATE,
+	REPLAY_MKDIR,
+	REPLAY_SYMLINK,
+	REPLAY_LINK,
+	REPLAY_UNLINK,
+	REPLAY_RMDIR,
+	REPLAY_RENAME,
+	REPLAY_FSYNC,
+	REPLAY_FALLOCATE,
+	REPLAY_STATFS,
+	REPLAY_OPS
+} ;
+
+	/* names as recorded by lowntfs-3g, and count of arguments */
+static const struct {
+	const char *name;
+	int args;
+} replay_ops[REPLAY_OPS] = {
+	[REPLAY_LOOKUP] = { "lookup", 2 },
+	[REPLAY_GETATTR] = { "getattr", 1 },
+	[REPLAY_SETATTR] = { "setattr", 1 },
+	[REPLAY_TRUNCATE] = { "truncate", 2 },
+	[REPLAY_OPEN] = { "open", 2 },
+	[REPLAY_RELEASE] = { "release", 1 },
+	[REPLAY_READ] = { "read", 3 },
+	[REPLAY_WRITE] = { "write", 3 },
+	[REPLAY_READDIR] = { "readdir", 3 },
+	[REPLAY_READDIRPLUS] = { "readdirplus", 3 },
+	[REPLAY_CREATE] = { "create", 4 },
+	[REPLAY_MKDIR] = { "mkdir", 3 },
+	[REPLAY_SYMLINK] = { "symlink", 4 },
+	[REPLAY_LINK] = { "link", 3 },
+	[REPLAY_UNLINK] = { "unlink", 2 },
+	[REPLAY_RMDIR] = { "rmdir", 2 },
+	[REPLAY_RENAME] = { "rename", 4 },
+	[REPLAY_FSYNC] = { "fsync", 1 },
+	[REPLAY_FALLOCATE] = { "fallocate", 4 },
+	[REPLAY_STATFS] = { "statfs", 0 },
+} ;
+
+	/* settings with the names of the mount options */
+enum {
+	SET_BLOCK_CACHE,
+	SET_RECORD_CACHE,
+	SET_INDEX_CACHE,
+	SET_INDEX_WRITEBACK,
+	SET_LAZY_DELETE,
+	SET_PREALLOC,
+	SET_HOLE_UNIT,
+	SET_BITMAP_WRITEBACK,
+	SET_MFT_WRITEBACK,
+	SET_INODE_WRITEBACK,
+	SET_LRU_CACHE		/* followed by the NTFS_CACHE_* */
+} ;
+
+static const struct {
+	const char *name;
+	int which;
+} replay_settings[] = {
+	{ "block_cache", SET_BLOCK_CACHE },
+	{ "record_cache", SET_RECORD_CACHE },
+	{ "index_cache", SET_INDEX_CACHE },
+	{ "index_writeback", SET_INDEX_WRITEBACK },
+	{ "lazy_delete", SET_LAZY_DELETE },
+	{ "prealloc", SET_PREALLOC },
+	{ "hole_unit", SET_HOLE_UNIT },
+	{ "bitmap_writeback", SET_BITMAP_WRITEBACK },
+	{ "mft_writeback", SET_MFT_WRITEBACK },
+	{ "inode_writeback", SET_INODE_WRITEBACK },
+	{ "inode_cache", SET_LRU_CACHE + NTFS_CACHE_INODE },
+	{ "nidata_cache", SET_LRU_CACHE + NTFS_CACHE_NIDATA },
+	{ "lookup_cache", SET_LRU_CACHE + NTFS_CACHE_LOOKUP },
+	{ "securid_cache", SET_LRU_CACHE + NTFS_CACHE_SECURID },
+	{ "legacy_cache", SET_LRU_CACHE + NTFS_CACHE_LEGACY },
+	{ "listing_cache", SET_LRU_CACHE + NTFS_CACHE_LISTING },
+	{ "symlink_cache", SET_LRU_CACHE + NTFS_CACHE_SYMLINK },
+	{ "ea_cache", SET_LRU_CACHE + NTFS_CACHE_EA },
+	{ "streams_cache", SET_LRU_CACHE + NTFS_CACHE_STREAMS },
+	{ "stat_cache", SET_LRU_CACHE + NTFS_CACHE_STAT },
+	{ "securdesc_cache", SET_LRU_CACHE + NTFS_CACHE_SECURDESC },
+	{ "inherit_cache", SET_LRU_CACHE + NTFS_CACHE_INHERIT },
+	{ "sdh_cache", SET_LRU_CACHE + NTFS_CACHE_SDH },
+	{ "traverse_cache", SET_LRU_CACHE + NTFS_CACHE_TRAVERSE },
+	{ "groups_cache", SET_LRU_CACHE + NTFS_CACHE_GROUPS },
+} ;
+
+#define REPLAY_SETTINGS (int)(sizeof(replay_settings)/sizeof(replay_settings[0]))
+
+/*
+ *		Inode of the trace, with its number on the replayed volume
+ *
+ *	The files existing before the trace have the same number on the
+ *	copy of the volume, the created ones may get a different one.
+ */
+
+struct REPLAY_INODE {
+	struct REPLAY_INODE *next;
+	u64 recorded;		/* mft number in the trace */
+	u64 replayed;		/* mft number on the volume */
+	BOOL written;		/* written since opened */
+	BOOL allocated;		/* data written or allocated by the replay */
+} ;
+
+static struct options {
+	char		*device;	/* Device/File to work with */
+	char		*trace;		/* Trace recorded by lowntfs-3g */
+	long		 settings[SET_LRU_CACHE + NTFS_LRU_CACHES];
+	int		 force;		/* Override common sense */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+} opts;
+
+static struct REPLAY_INODE *replay_inodes[REPLAY_HASH];
+static u64 replay_done[REPLAY_OPS];
+static u64 replay_failed[REPLAY_OPS];
+static u64 replay_ignored;
+static char *replay_buf;
+static s64 replay_bufsize;
+static u64 replay_seed = 0x9e3779b97f4a7c15ULL;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Replay a trace of requests "
+			"on a volume.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device trace\n"
+		"    -o, --options LIST   Apply the settings in LIST, "
+			"separated by commas,\n"
+		"                         such as block_cache=16 or "
+			"prealloc=4\n"
+		"\n"
+		"    -f, --force          Use less caution\n"
+		"    -q, --quiet          Less output\n"
+		"    -v, --verbose        More output\n"
+		"    -V, --version        Version information\n"
+		"    -h, --help           Print this help\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/*
+ *		Parse a list of settings
+ *
+ *	Returns 0 if successful, -1 if a setting is unknown or has
+ *	no valid value
+ */
+
+static int parse_settings(char *list)
+{
+	char *next;
+	char *value;
+	char *end;
+	long num;
+	int i;
+
+	do {
+		next = strchr(list, ',');
+		if (next)
+			*next++ = '\0';
+		value = strchr(list, '=');
+		if (!value) {
+			ntfs_log_error("Setting '%s' requires a value.\n",
+					list);
+			return (-1);
+		}
+		*value++ = '\0';
+		for (i=0; (i<REPLAY_SETTINGS)
+			&& strcmp(list, replay_settings[i].name); i++) { }
+		if (i >= REPLAY_SETTINGS) {
+			ntfs_log_error("Unknown setting '%s'.\n", list);
+			return (-1);
+		}
+		num = strtol(value, &end, 0);
+		if (*end || (num < 0) || (num > INT_MAX)) {
+			ntfs_log_error("Bad value '%s' for %s.\n", value,
+					list);
+			return (-1);
+		}
+		opts.settings[replay_settings[i].which] = num;
+		list = next;
+	} while (list);
+	return (0);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  0 Done, the program has to stop
+ *	    1 Error, one or more problems
+ *	   -1 Success, go on
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-fho:qvV";
+	static const struct option lopt[] = {
+		{ "force",	no_argument,		NULL, 'f' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "options",	required_argument,	NULL, 'o' },
+		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "version",	no_argument,		NULL, 'V' },
+		{ NULL,		0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	int i;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	for (i=0; i<(SET_LRU_CACHE + NTFS_LRU_CACHES); i++)
+		opts.settings[i] = -1;
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.device) {
+				opts.device = argv[optind-1];
+			} else if (!opts.trace) {
+				opts.trace = argv[optind-1];
+			} else {
+				ntfs_log_error("You must specify exactly one "
+					"device and one trace.\n");
+				err++;
+			}
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'o':
+			if (parse_settings(optarg))
+				err++;
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		case 'V':
+			ver++;
+			break;
+		default:
+			if (optopt == 'o')
+				ntfs_log_error("Option '%s' requires an "
+					"argument.\n", argv[optind-1]);
+			else
+				ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind-1]);
+			err++;
+			break;
+		}
+	}
+
+	if (!help && !ver) {
+		if (!opts.device || !opts.trace) {
+			if (argc > 1)
+				ntfs_log_error("You must specify a device "
+					"and a trace.\n");
+			err++;
+		}
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose"
+				" at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+		/* tri-state 0 : done, 1 : error, -1 : proceed */
+	return (err ? 1 : (help || ver ? 0 : -1));
+}
+
+/*
+ *		Apply the settings to the volume, as lowntfs-3g does
+ *	for the same mount options
+ */
+
+static void apply_settings(ntfs_volume *vol)
+{
+	const long *set;
+	int i;
+
+	set = opts.settings;
+	if ((set[SET_BLOCK_CACHE] > 0)
+	    && ntfs_create_block_cache(vol, (s64)set[SET_BLOCK_CACHE] << 20))
+		ntfs_log_perror("Could not create the block cache");
+	if ((set[SET_RECORD_CACHE] > 0)
+	    && ntfs_create_mftrec_cache(vol,
+				(s64)set[SET_RECORD_CACHE] << 20))
+		ntfs_log_perror("Could not create the mft record cache");
+	if ((set[SET_INDEX_CACHE] > 0)
+	    && ntfs_create_index_cache(vol, (s64)set[SET_INDEX_CACHE] << 20))
+		ntfs_log_perror("Could not create the index block cache");
+	if ((set[SET_INDEX_WRITEBACK] > 0)
+	    && ntfs_set_index_writeback(vol,
+				(s64)set[SET_INDEX_WRITEBACK] << 20))
+		ntfs_log_perror("Could not delay the index block writes");
+	if ((set[SET_LAZY_DELETE] > 0)
+	    && ntfs_set_index_lazy_delete(vol, set[SET_LAZY_DELETE]))
+		ntfs_log_perror("Could not remove the directory entries lazily");
+	if ((set[SET_PREALLOC] > 0)
+	    && ntfs_set_prealloc_size(vol, (s64)set[SET_PREALLOC] << 20))
+		ntfs_log_perror("Could not set the preallocation size");
+	if ((set[SET_HOLE_UNIT] > 0)
+	    && ntfs_set_hole_unit(vol, (s64)set[SET_HOLE_UNIT] << 10))
+		ntfs_log_perror("Could not set the hole allocation unit");
+	if ((set[SET_BITMAP_WRITEBACK] > 0)
+	    && ntfs_set_lcnbmp_writeback(vol,
+				(s64)set[SET_BITMAP_WRITEBACK] << 20))
+		ntfs_log_perror("Could not delay the $Bitmap writes");
+	if ((set[SET_MFT_WRITEBACK] > 0)
+	    && ntfs_set_mft_writeback(vol, set[SET_MFT_WRITEBACK]))
+		ntfs_log_perror("Could not delay the mft record writes");
+	for (i=0; i<NTFS_LRU_CACHES; i++)
+		if ((set[SET_LRU_CACHE + i] >= 0)
+		    && ntfs_set_cache_size(vol, i, set[SET_LRU_CACHE + i]))
+			ntfs_log_perror("Could not resize a cache");
+		/* after resizing the inode cache which it relies on */
+	if ((set[SET_INODE_WRITEBACK] > 0)
+	    && ntfs_set_inode_writeback(vol, set[SET_INODE_WRITEBACK]))
+		ntfs_log_perror("Could not delay the inode writes");
+}
+
+/*
+ *		Get the replay state of a recorded inode
+ *
+ *	Returns the state, or NULL if it is not known and not to be
+ *	created, or there is no more memory
+ */
+
+static struct REPLAY_INODE *get_inode(u64 recorded, BOOL create)
+{
+	struct REPLAY_INODE *item;
+	int h;
+
+	h = recorded % REPLAY_HASH;
+	for (item=replay_inodes[h]; item && (item->recorded != recorded);
+			item=item->next) { }
+	if (!item && create) {
+		item = (struct REPLAY_INODE*)ntfs_malloc(
+					sizeof(struct REPLAY_INODE));
+		if (item) {
+			item->recorded = recorded;
+			item->replayed = recorded;
+			item->written = FALSE;
+			item->allocated = FALSE;
+			item->next = replay_inodes[h];
+			replay_inodes[h] = item;
+		}
+	}
+	return (item);
+}
+
+/*
+ *		Get the replayed number of a recorded inode
+ */
+
+static u64 replayed_inum(u64 recorded)
+{
+	struct REPLAY_INODE *item;
+
+	item = get_inode(recorded, FALSE);
+	return (item ? item->replayed : recorded);
+}
+
+/*
+ *		Open the replayed inode for a recorded one
+ */
+
+static ntfs_inode *open_inode(ntfs_volume *vol, u64 recorded)
+{
+	return (ntfs_inode_open(vol, replayed_inum(recorded)));
+}
+
+/*
+ *		Decode a name which had its special characters encoded
+ *	as %xx, in place
+ */
+
+static void decode_name(char *name)
+{
+	char *p;
+	char *q;
+	unsigned int c;
+
+	p = q = name;
+	while (*p) {
+		if ((p[0] == '%') && p[1] && p[2]
+		    && (sscanf(&p[1], "%2x", &c) == 1)) {
+			*q++ = c;
+			p += 3;
+		} else
+			*q++ = *p++;
+	}
+	*q = '\0';
+}
+
+/*
+ *		Get a buffer of @size bytes for reading or writing
+ *
+ *	The data written is pseudo-random, so that it is not compressible.
+ */
+
+static char *get_buffer(s64 size)
+{
+	char *newbuf;
+	u64 *p;
+	s64 i;
+
+	if (size > replay_bufsize) {
+		size = (size + 7) & ~7;
+		newbuf = (char*)realloc(replay_buf, size);
+		if (!newbuf)
+			return ((char*)NULL);
+		p = (u64*)newbuf;
+		for (i=replay_bufsize >> 3; i<(size >> 3); i++) {
+			replay_seed ^= replay_seed << 13;
+			replay_seed ^= replay_seed >> 7;
+			replay_seed ^= replay_seed << 17;
+			p[i] = replay_seed;
+		}
+		replay_buf = newbuf;
+		replay_bufsize = size;
+	}
+	return (replay_buf);
+}
+
+/*
+ *		Look up a name in a directory
+ *
+ *	Returns the mft number, or zero if failed
+ */
+
+static u64 find_name(ntfs_volume *vol, u64 dir, const char *name)
+{
+	ntfs_inode *dir_ni;
+	u64 iref;
+
+	iref = (u64)-1;
+	dir_ni = open_inode(vol, dir);
+	if (dir_ni) {
+		iref = ntfs_inode_lookup_by_mbsname(dir_ni, name);
+		if (ntfs_inode_close(dir_ni))
+			iref = (u64)-1;
+	}
+	return ((iref == (u64)-1) || (MREF(iref) <= 1) ? 0 : MREF(iref));
+}
+
+/*
+ *		Delete a name from a directory
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int delete_name(ntfs_volume *vol, u64 dir, const char *name,
+			u64 inum)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfschar *uname;
+	int ulen;
+	int res;
+
+	res = -1;
+	uname = (ntfschar*)NULL;
+	ulen = ntfs_mbstoucs(name, &uname);
+	if (ulen > 0) {
+		dir_ni = open_inode(vol, dir);
+		ni = ntfs_inode_open(vol, inum);
+		if (dir_ni && ni) {
+			/* ntfs_delete() closes both inodes */
+			res = ntfs_delete(vol, (const char*)NULL, ni, dir_ni,
+					uname, ulen);
+		} else {
+			if (dir_ni)
+				ntfs_inode_close(dir_ni);
+			if (ni)
+				ntfs_inode_close(ni);
+		}
+	}
+	free(uname);
+	return (res);
+}
+
+/*
+ *		Add a name to an inode
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int link_name(ntfs_volume *vol, u64 inum, u64 dir, const char *name)
+{
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfschar *uname;
+	int ulen;
+	int res;
+
+	res = -1;
+	uname = (ntfschar*)NULL;
+	ulen = ntfs_mbstoucs(name, &uname);
+	if (ulen > 0) {
+		ni = ntfs_inode_open(vol, inum);
+		if (ni) {
+			dir_ni = open_inode(vol, dir);
+			if (dir_ni) {
+				res = ntfs_link(ni, dir_ni, uname, ulen);
+				if (ntfs_inode_close(dir_ni))
+					res = -1;
+			}
+			if (!res)
+				ntfs_inode_update_times(ni, NTFS_UPDATE_CTIME);
+			if (ntfs_inode_close(ni))
+				res = -1;
+		}
+	}
+	free(uname);
+	return (res);
+}
+
+/*
+ *		Create an inode, and record its replayed number
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int create_inode(ntfs_volume *vol, u64 dir, const char *name,
+			mode_t type, const char *target, u64 recorded)
+{
+	struct REPLAY_INODE *item;
+	ntfs_inode *dir_ni;
+	ntfs_inode *ni;
+	ntfschar *uname;
+	ntfschar *utarget;
+	int ulen;
+	int tlen;
+	int res;
+
+	res = -1;
+	uname = (ntfschar*)NULL;
+	utarget = (ntfschar*)NULL;
+	ulen = ntfs_mbstoucs(name, &uname);
+	tlen = (target ? ntfs_mbstoucs(target, &utarget) : 0);
+	dir_ni = open_inode(vol, dir);
+	if ((ulen > 0) && (tlen >= 0) && dir_ni) {
+		switch (type) {
+		case S_IFLNK :
+			ni = ntfs_create_symlink(dir_ni,
+					const_cpu_to_le32(0),
+					uname, ulen, utarget, tlen);
+			break;
+		case S_IFCHR :
+		case S_IFBLK :
+			ni = ntfs_create_device(dir_ni, const_cpu_to_le32(0),
+					uname, ulen, type, 0);
+			break;
+		default :
+			ni = ntfs_create(dir_ni, const_cpu_to_le32(0),
+					uname, ulen, type);
+			break;
+		}
+		if (ni) {
+			res = 0;
+			if (recorded) {
+				item = get_inode(recorded, TRUE);
+				if (item)
+					item->replayed = ni->mft_no;
+				else
+					res = -1;
+			}
+			if (ntfs_inode_close_in_dir(ni, dir_ni))
+				res = -1;
+		}
+	}
+	if (dir_ni && ntfs_inode_close(dir_ni))
+		res = -1;
+	free(uname);
+	free(utarget);
+	return (res);
+}
+
+/*
+ *		Access the unnamed data of a recorded inode
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int access_data(ntfs_volume *vol, int op, u64 recorded,
+			s64 pos, s64 count, int mode)
+{
+	struct REPLAY_INODE *item;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	char *buf;
+	int res;
+
+	res = -1;
+	buf = (char*)NULL;
+	if ((op == REPLAY_READ) || (op == REPLAY_WRITE)) {
+		buf = get_buffer(count < REPLAY_MAX_IO ? count
+						: REPLAY_MAX_IO);
+		if (!buf)
+			goto out;
+	}
+	item = get_inode(recorded, TRUE);
+	if (!item)
+		goto out;
+	ni = open_inode(vol, recorded);
+	if (!ni)
+		goto out;
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na)
+		goto close;
+	res = 0;
+	switch (op) {
+	case REPLAY_READ :
+		if (count > (na->data_size - pos))
+			count = na->data_size - pos;
+		if (count > REPLAY_MAX_IO)
+			count = REPLAY_MAX_IO;
+		if ((count > 0)
+		    && (ntfs_attr_pread(na, pos, count, buf) < 0))
+			res = -1;
+		break;
+	case REPLAY_WRITE :
+		while ((count > 0) && !res) {
+			s64 chunk;
+			s64 written;
+
+			chunk = (count < REPLAY_MAX_IO ? count
+							: REPLAY_MAX_IO);
+			written = ntfs_attr_pwrite(na, pos, chunk, buf);
+			if (written <= 0)
+				res = -1;
+			pos += written;
+			count -= written;
+		}
+		ntfs_inode_update_times(ni, NTFS_UPDATE_MCTIME);
+		item->written = TRUE;
+		item->allocated = TRUE;
+		break;
+	case REPLAY_TRUNCATE :
+		res = ntfs_attr_truncate(na, pos);
+		ntfs_inode_update_times(ni, NTFS_UPDATE_MCTIME);
+		item->allocated = TRUE;
+		break;
+	case REPLAY_FALLOCATE :
+		res = ntfs_attr_fallocate(na, pos, count,
+					(mode & REPLAY_KEEP_SIZE) != 0);
+		if (!res && !(mode & REPLAY_KEEP_SIZE))
+			ntfs_inode_update_times(ni, NTFS_UPDATE_MCTIME);
+		item->allocated = TRUE;
+		break;
+	case REPLAY_RELEASE :
+		/* the preallocation is released when closing */
+		if (item->written && vol->prealloc_size)
+			res = ntfs_attr_trim_prealloc(na);
+		item->written = FALSE;
+		break;
+	default :
+		break;
+	}
+	ntfs_attr_close(na);
+close :
+	if (ntfs_inode_close(ni))
+		res = -1;
+out :
+	return (res);
+}
+
+/*
+ *		Open an inode for getting its attributes
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int stat_inode(ntfs_volume *vol, u64 inum, BOOL update)
+{
+	ntfs_inode *ni;
+	int res;
+
+	res = -1;
+	ni = ntfs_inode_open(vol, inum);
+	if (ni) {
+		res = 0;
+		if (update)
+			ntfs_inode_update_times(ni, NTFS_UPDATE_CTIME);
+		if (ntfs_inode_close(ni))
+			res = -1;
+	}
+	return (res);
+}
+
+struct REPLAY_LISTING {
+	ntfs_volume *vol;
+	BOOL plus;
+} ;
+
+static int replay_filldir(void *dirent,
+			const ntfschar *name __attribute__((unused)),
+			const int name_len __attribute__((unused)),
+			const int name_type,
+			const s64 pos __attribute__((unused)),
+			const MFT_REF mref,
+			const unsigned dt_type __attribute__((unused)))
+{
+	struct REPLAY_LISTING *listing;
+
+	listing = (struct REPLAY_LISTING*)dirent;
+		/* the entries are looked up for readdirplus */
+	if (listing->plus && (name_type != FILE_NAME_DOS)
+	    && (MREF(mref) >= FILE_first_user))
+		stat_inode(listing->vol, MREF(mref), FALSE);
+	return (0);
+}
+
+/*
+ *		List a directory
+ *
+ *	The full directory is read when listing from the beginning, and is
+ *	then served from a buffer, as lowntfs-3g does.
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int list_dir(ntfs_volume *vol, u64 recorded, s64 off, BOOL plus)
+{
+	struct REPLAY_LISTING listing;
+	ntfs_inode *ni;
+	s64 pos;
+	int res;
+
+	res = 0;
+	if (!off) {
+		res = -1;
+		ni = open_inode(vol, recorded);
+		if (ni) {
+			listing.vol = vol;
+			listing.plus = plus;
+			pos = 0;
+			res = ntfs_readdir(ni, &pos, &listing,
+					replay_filldir);
+			if (ntfs_inode_close(ni))
+				res = -1;
+		}
+	}
+	return (res);
+}
+
+/*
+ *		Rename a file, replacing the target if any
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int rename_name(ntfs_volume *vol, u64 dir, const char *name,
+			u64 newdir, const char *newname)
+{
+	u64 inum;
+	u64 target;
+	int res;
+
+	res = -1;
+	inum = find_name(vol, dir, name);
+	if (inum) {
+		target = find_name(vol, newdir, newname);
+		if (target == inum)
+			res = 0;
+		else
+			if ((!target
+			    || !delete_name(vol, newdir, newname, target))
+			    && !link_name(vol, inum, newdir, newname))
+				res = delete_name(vol, dir, name, inum);
+	}
+	return (res);
+}
+
+/*
+ *		Replay a request
+ *
+ *	Returns 0 if successful, -1 if failed
+ */
+
+static int replay_request(ntfs_volume *vol, int op, char *field[])
+{
+	struct REPLAY_INODE *item;
+	u64 inum;
+	int res;
+
+	res = 0;
+	switch (op) {
+	case REPLAY_LOOKUP :
+		decode_name(field[2]);
+		inum = find_name(vol, strtoull(field[1], NULL, 10), field[2]);
+		res = (inum ? stat_inode(vol, inum, FALSE) : -1);
+		break;
+	case REPLAY_GETATTR :
+	case REPLAY_SETATTR :
+		inum = replayed_inum(strtoull(field[1], NULL, 10));
+		res = stat_inode(vol, inum, op == REPLAY_SETATTR);
+		break;
+	case REPLAY_OPEN :
+		item = get_inode(strtoull(field[1], NULL, 10), TRUE);
+		if (item)
+			item->written = FALSE;
+		/* fall through */
+	case REPLAY_RELEASE :
+		res = access_data(vol, op, strtoull(field[1], NULL, 10),
+				0, 0, 0);
+		break;
+	case REPLAY_READ :
+	case REPLAY_WRITE :
+		res = access_data(vol, op, strtoull(field[1], NULL, 10),
+				strtoll(field[2], NULL, 10),
+				strtoll(field[3], NULL, 10), 0);
+		break;
+	case REPLAY_TRUNCATE :
+		res = access_data(vol, op, strtoull(field[1], NULL, 10),
+				strtoll(field[2], NULL, 10), 0, 0);
+		break;
+	case REPLAY_FALLOCATE :
+		res = access_data(vol, op, strtoull(field[1], NULL, 10),
+				strtoll(field[3], NULL, 10),
+				strtoll(field[4], NULL, 10),
+				strtol(field[2], NULL, 8));
+		break;
+	case REPLAY_READDIR :
+	case REPLAY_READDIRPLUS :
+		res = list_dir(vol, strtoull(field[1], NULL, 10),
+				strtoll(field[2], NULL, 10),
+				op == REPLAY_READDIRPLUS);
+		break;
+	case REPLAY_CREATE :
+		decode_name(field[2]);
+		res = create_inode(vol, strtoull(field[1], NULL, 10),
+				field[2], strtol(field[3], NULL, 8)
+					& S_IFMT,
+				(const char*)NULL,
+				strtoull(field[4], NULL, 10));
+		break;
+	case REPLAY_MKDIR :
+		decode_name(field[2]);
+		res = create_inode(vol, strtoull(field[1], NULL, 10),
+				field[2], S_IFDIR, (const char*)NULL,
+				strtoull(field[3], NULL, 10));
+		break;
+	case REPLAY_SYMLINK :
+		decode_name(field[2]);
+		decode_name(field[3]);
+		res = create_inode(vol, strtoull(field[1], NULL, 10),
+				field[2], S_IFLNK, field[3],
+				strtoull(field[4], NULL, 10));
+		break;
+	case REPLAY_LINK :
+		decode_name(field[3]);
+		inum = replayed_inum(strtoull(field[1], NULL, 10));
+		res = link_name(vol, inum, strtoull(field[2], NULL, 10),
+				field[3]);
+		break;
+	case REPLAY_UNLINK :
+	case REPLAY_RMDIR :
+		decode_name(field[2]);
+		inum = find_name(vol, strtoull(field[1], NULL, 10), field[2]);
+		res = (inum ? delete_name(vol, strtoull(field[1], NULL, 10),
+				field[2], inum) : -1);
+		break;
+	case REPLAY_RENAME :
+		decode_name(field[2]);
+		decode_name(field[4]);
+		res = rename_name(vol, strtoull(field[1], NULL, 10), field[2],
+				strtoull(field[3], NULL, 10), field[4]);
+		break;
+	case REPLAY_FSYNC :
+		res = ntfs_volume_sync(vol);
+		break;
+	case REPLAY_STATFS :
+	default :
+		break;
+	}
+	return (res);
+}
+
+/*
+ *		Replay the requests of the trace
+ *
+ *	The requests which fail, usually because they also failed when
+ *	they were recorded, are counted but do not stop the replay.
+ *
+ *	Returns 0 if successful, -1 if the trace could not be read
+ */
+
+static int replay_trace(ntfs_volume *vol, FILE *fin)
+{
+	char line[REPLAY_LINE];
+	char *field[REPLAY_FIELDS];
+	unsigned long lineno;
+	u64 start;
+	int fields;
+	char *p;
+	int op;
+	int res;
+
+	lineno = 0;
+	while (fgets(line, REPLAY_LINE, fin)) {
+		lineno++;
+		p = strchr(line, '\n');
+		if (!p) {
+			ntfs_log_error("Line %lu of the trace is too long\n",
+					lineno);
+			errno = EINVAL;
+			return (-1);
+		}
+		*p = '\0';
+		if (!line[0] || (line[0] == '#'))
+			continue;
+		fields = 0;
+		p = line;
+		do {
+			field[fields++] = p;
+			p = strchr(p, ' ');
+			if (p)
+				*p++ = '\0';
+		} while (p && (fields < REPLAY_FIELDS));
+		for (op=0; (op<REPLAY_OPS)
+			&& strcmp(field[0], replay_ops[op].name); op++) { }
+		if ((op >= REPLAY_OPS) || p
+		    || ((fields - 1) != replay_ops[op].args)) {
+			ntfs_log_verbose("Line %lu : ignoring '%s'\n",
+					lineno, field[0]);
+			replay_ignored++;
+			continue;
+		}
+		start = ntfs_stats_clock();
+		res = replay_request(vol, op, field);
+		ntfs_stats_record_op(vol, op, replay_ops[op].name,
+				ntfs_stats_clock() - start);
+		if (res) {
+			ntfs_log_verbose("Line %lu : %s failed : %s\n",
+					lineno, replay_ops[op].name,
+					strerror(errno));
+			replay_failed[op]++;
+		} else
+			replay_done[op]++;
+	}
+	return (ferror(fin) ? -1 : 0);
+}
+
+/*
+ *		Count the extents of the unnamed data of an inode
+ *
+ *	Adjacent runs are counted as a single extent.
+ *
+ *	Returns the count, zero for resident data or if failed
+ */
+
+static int count_extents(ntfs_volume *vol, u64 inum)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	runlist_element *rl;
+	LCN next;
+	int count;
+
+	count = 0;
+	ni = ntfs_inode_open(vol, inum);
+	if (ni) {
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na) {
+			if (NAttrNonResident(na)
+			    && !ntfs_attr_map_whole_runlist(na)) {
+				next = LCN_HOLE;
+				for (rl=na->rl; rl->length; rl++)
+					if (rl->lcn >= 0) {
+						if (rl->lcn != next)
+							count++;
+						next = rl->lcn + rl->length;
+					}
+			}
+			ntfs_attr_close(na);
+		}
+		ntfs_inode_close(ni);
+	}
+	return (count);
+}
+
+/*
+ *		Report the fragmentation of the files allocated by the
+ *	replay, and of the free space
+ */
+
+static int report_fragmentation(ntfs_volume *vol)
+{
+	struct REPLAY_INODE *item;
+	u8 *bm;
+	u64 files;
+	u64 fragmented;
+	u64 extents;
+	s64 free_runs;
+	s64 free_clusters;
+	s64 largest;
+	s64 run;
+	s64 lcn;
+	s64 pos;
+	s64 got;
+	s64 i;
+	int count;
+	int h;
+
+	files = fragmented = extents = 0;
+	for (h=0; h<REPLAY_HASH; h++)
+		for (item=replay_inodes[h]; item; item=item->next)
+			if (item->allocated) {
+				count = count_extents(vol, item->replayed);
+				if (count) {
+					files++;
+					extents += count;
+					if (count > 1)
+						fragmented++;
+				}
+			}
+	ntfs_log_info("files allocated : %llu, %llu extents,"
+		" %llu fragmented\n", (unsigned long long)files,
+		(unsigned long long)extents, (unsigned long long)fragmented);
+
+	bm = (u8*)ntfs_malloc(REPLAY_BITMAP_CHUNK);
+	if (!bm)
+		return (-1);
+	free_runs = free_clusters = largest = run = 0;
+	lcn = 0;
+	for (pos=0; lcn<vol->nr_clusters; pos+=got) {
+		got = ntfs_attr_pread(vol->lcnbmp_na, pos,
+				REPLAY_BITMAP_CHUNK, bm);
+		if (got <= 0) {
+			ntfs_log_perror("Could not read $Bitmap");
+			free(bm);
+			return (-1);
+		}
+		for (i=0; (i<(got << 3)) && (lcn<vol->nr_clusters);
+				i++, lcn++) {
+			if (bm[i >> 3] & (1 << (i & 7))) {
+				if (run > largest)
+					largest = run;
+				run = 0;
+			} else {
+				if (!run)
+					free_runs++;
+				run++;
+				free_clusters++;
+			}
+		}
+	}
+	if (run > largest)
+		largest = run;
+	free(bm);
+	ntfs_log_info("free space : %lld clusters in %lld extents,"
+		" largest %lld clusters\n", (long long)free_clusters,
+		(long long)free_runs, (long long)largest);
+	return (0);
+}
+
+/*
+ *		Report the counters of the replay
+ */
+
+static void report(ntfs_volume *vol, u64 elapsed)
+{
+	char *text;
+	u64 done;
+	u64 failed;
+	int size;
+	int op;
+
+	done = failed = 0;
+	for (op=0; op<REPLAY_OPS; op++) {
+		done += replay_done[op];
+		failed += replay_failed[op];
+	}
+	ntfs_log_info("%llu requests replayed in %.3f s, %llu failed,"
+		" %llu lines ignored\n", (unsigned long long)done,
+		elapsed/1000000.0, (unsigned long long)failed,
+		(unsigned long long)replay_ignored);
+	for (op=0; op<REPLAY_OPS; op++)
+		if (replay_failed[op])
+			ntfs_log_info("request %s : %llu failed\n",
+				replay_ops[op].name,
+				(unsigned long long)replay_failed[op]);
+	size = ntfs_stats_report(vol, (char*)NULL, 0);
+	text = (char*)ntfs_malloc(size + 1);
+	if (text) {
+		ntfs_stats_report(vol, text, size + 1);
+		ntfs_log_info("%s", text);
+		free(text);
+	}
+}
+
+/**
+ * main - Begin here
+ *
+ * Start from here.
+ *
+ * Return:  0  Success, the trace was replayed
+ *	    1  Error, something went wrong
+ */
+int main(int argc, char *argv[])
+{
+	struct REPLAY_INODE *item;
+	ntfs_volume *vol;
+	unsigned long flags;
+	FILE *fin;
+	u64 start;
+	int res;
+	int h;
+
+	ntfs_log_set_handler(ntfs_log_handler_outerr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+
+	fin = fopen(opts.trace, "r");
+	if (!fin) {
+		ntfs_log_perror("Could not open the trace %s", opts.trace);
+		return (1);
+	}
+	flags = (opts.force ? NTFS_MNT_RECOVER : 0);
+	vol = utils_mount_volume(opts.device, flags);
+	if (!vol) {
+		fclose(fin);
+		return (1);
+	}
+
+	res = 0;
+	if ((vol->flags & VOLUME_IS_DIRTY) && !opts.force) {
+		ntfs_log_error("The volume is dirty, use --force to replay"
+			" anyway.\n");
+		res = 1;
+	}
+	if (!res && ntfs_volume_get_free_space(vol)) {
+		ntfs_log_perror("Could not get the free space");
+		res = 1;
+	}
+	if (!res && ntfs_set_stats(vol, TRUE)) {
+		ntfs_log_perror("Could not keep the statistics");
+		res = 1;
+	}
+	if (!res) {
+		apply_settings(vol);
+			/* only count the transfers caused by the trace */
+		ntfs_stats_reset(vol);
+		start = ntfs_stats_clock();
+		if (replay_trace(vol, fin)) {
+			ntfs_log_perror("Could not read the trace");
+			res = 1;
+		}
+			/* the delayed writes are part of the replay */
+		if (ntfs_volume_sync(vol)) {
+			ntfs_log_perror("Could not sync the volume");
+			res = 1;
+		}
+		if (!opts.quiet) {
+			report(vol, ntfs_stats_clock() - start);
+			if (report_fragmentation(vol))
+				res = 1;
+		}
+	}
+	fclose(fin);
+	for (h=0; h<REPLAY_HASH; h++)
+		while (replay_inodes[h]) {
+			item = replay_inodes[h];
+			replay_inodes[h] = item->next;
+			free(item);
+		}
+	free(replay_buf);
+
+	if (ntfs_umount(vol, FALSE)) {
+		ntfs_log_perror("Could not unmount the volume");
+		res = 1;
+	}
+	return (res);
+}
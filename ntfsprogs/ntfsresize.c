@@ -58,6 +58,9 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "param.h"
 #include "debug.h"
@@ -78,6 +81,9 @@
 
 #define BAN_NEW_TEXT 1	/* Respect the ban on new messages */
 #define CLEAN_EXIT 0	/* traditionnally volume is not closed, there must be a reason */
+#define CHECK_RECORDS 256 /* records checked at once by a thread */
+#define CHECK_MAX_THREADS 4 /* max threads checking, each with a bitmap */
+#define RELOCATE_EXTENT_SIZE 4194304 /* max bytes relocated at once */
 
 static const char *EXEC_NAME = "ntfsresize";
 
@@ -191,8 +197,21 @@ struct DELAYED {
 	runlist *head_rl;
 } ;
 
+			/* runs whose relocation has been planned */
+struct PLANNED {
+	s64 src_lcn;
+	s64 length;
+	runlist *rl;		/* destination, NULL once used */
+} ;
+
+			/* free extents, for best-fit allocations */
+struct FREE_EXTENT {
+	s64 lcn;
+	s64 length;
+} ;
+
 typedef struct {
-	ntfs_inode *ni;		     /* inode being processed */
+	s64 inode;		     /* inode being processed */
 	ntfs_attr_search_ctx *ctx;   /* inode attribute being processed */
 	s64 inuse;		     /* num of clusters in use */
 	int multi_ref;		     /* num of clusters referenced many times */
@@ -215,10 +234,13 @@ typedef struct {
 	s64 mftmir_old;		     /* $MFTMirr AT_DATA's old LCN */
 	int dirty_inode;	     /* some inode data got relocated */
 	int shrink;		     /* shrink = 1, enlarge = 0 */
+	int fast_grow;		     /* enlarge without a full check */
 	s64 badclusters;	     /* num of physically dead clusters */
 	VCN mft_highest_vcn;	     /* used for relocating the $MFT */
 	runlist_element *new_mft_start; /* new first run for $MFT:$DATA */
 	struct DELAYED *delayed_runlists; /* runlists to process later */
+	struct PLANNED *plan;	     /* planned relocations, by source LCN */
+	s64 nr_planned;
 	struct progress_bar progress;
 	struct bitmap lcn_bitmap;
 	/* Temporary statistics until all case is supported */
@@ -833,7 +855,7 @@ static void build_lcn_usage_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 	struct bitmap *lcn_bitmap = &fsck->lcn_bitmap;
 
 	a = fsck->ctx->attr;
-	inode = fsck->ni->mft_no;
+	inode = fsck->inode;
 
 	if (!a->non_resident)
 		return;
@@ -908,10 +930,13 @@ static ntfs_attr_search_ctx *attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mre
  *
  * For a given MFT Record, iterate through all its attributes.  Any non-resident
  * data runs will be marked in lcn_bitmap.
+ *
+ * The records are walked individually, so the attributes in extent records
+ * are accounted when the extent record itself is met.
  */
-static int walk_attributes(ntfs_volume *vol, ntfsck_t *fsck)
+static int walk_attributes(ntfs_volume *vol, ntfsck_t *fsck, MFT_RECORD *mrec)
 {
-	if (!(fsck->ctx = attr_get_search_ctx(fsck->ni, NULL)))
+	if (!(fsck->ctx = attr_get_search_ctx(NULL, mrec)))
 		return -1;
 
 	while (!ntfs_attrs_walk(fsck->ctx)) {
@@ -1048,18 +1073,252 @@ static int inode_close(ntfs_inode *ni)
 	return 0;
 }
 
+/*
+ *		Checking the records in parallel
+ *
+ *	The records delivered by the MFT scanner are copied into batches
+ *	of CHECK_RECORDS records, which are handed over to a pool of
+ *	threads. Each thread decodes the runlists into its own bitmap
+ *	and counters, and the bitmaps are merged at the end, a cluster
+ *	set in several bitmaps being referenced multiple times.
+ */
+
+enum { BATCH_FREE, BATCH_FULL, BATCH_BUSY } ;
+
+struct CHECK_BATCH {
+	u8 *records;
+	s64 *inodes;
+	int count;
+	int state;
+} ;
+
+struct CHECK_POOL {
+	ntfs_volume *vol;
+	ntfsck_t *fsck;		/* the global check */
+	struct progress_bar progress;
+	s64 last_inode;		/* last record shown in progress */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[CHECK_MAX_THREADS];
+	ntfsck_t workers[CHECK_MAX_THREADS];
+	struct CHECK_BATCH batches[2*CHECK_MAX_THREADS];
+	int nr_threads;
+	int nr_batches;
+	int current;		/* batch being filled */
+	BOOL quit;
+#endif
+} ;
+
+static void check_record(ntfs_volume *vol, ntfsck_t *fsck,
+			s64 inode, MFT_RECORD *mrec)
+{
+	fsck->inode = inode;
+	if (walk_attributes(vol, fsck, mrec))
+		exit(1);
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *check_worker(void *arg)
+{
+	struct CHECK_POOL *pool = (struct CHECK_POOL*)arg;
+	struct CHECK_BATCH *batch;
+	ntfs_volume *vol = pool->vol;
+	ntfsck_t *fsck;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+		/* get the private check of this thread */
+	for (i=0; !pthread_equal(pool->threads[i], pthread_self()); i++) { }
+	fsck = &pool->workers[i];
+	while (1) {
+		batch = (struct CHECK_BATCH*)NULL;
+		for (i=0; (i<pool->nr_batches) && !batch; i++)
+			if (pool->batches[i].state == BATCH_FULL)
+				batch = &pool->batches[i];
+		if (batch) {
+			batch->state = BATCH_BUSY;
+			pthread_mutex_unlock(&pool->lock);
+			for (i=0; i<batch->count; i++)
+				check_record(vol, fsck, batch->inodes[i],
+					(MFT_RECORD*)&batch->records[i
+						<< vol->mft_record_size_bits]);
+			pthread_mutex_lock(&pool->lock);
+			batch->count = 0;
+			batch->state = BATCH_FREE;
+			pthread_cond_broadcast(&pool->cond);
+		} else {
+			if (pool->quit)
+				break;
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Start the threads, each with its own bitmap
+ *
+ *	Returns the number of threads started, 0 when checking
+ *	within the calling thread.
+ */
+
+static int start_check_pool(struct CHECK_POOL *pool, int threads)
+{
+	struct CHECK_BATCH *batch;
+	size_t size;
+	int i;
+
+	pool->nr_threads = 0;
+	pool->nr_batches = 0;
+	pool->current = 0;
+	pool->quit = FALSE;
+	if (threads > CHECK_MAX_THREADS)
+		threads = CHECK_MAX_THREADS;
+	if ((threads < 2)
+	    || pthread_mutex_init(&pool->lock, NULL))
+		return (0);
+	if (pthread_cond_init(&pool->cond, NULL)) {
+		pthread_mutex_destroy(&pool->lock);
+		return (0);
+	}
+	size = (size_t)CHECK_RECORDS << pool->vol->mft_record_size_bits;
+	for (i=0; i<2*threads; i++) {
+		batch = &pool->batches[i];
+		batch->records = (u8*)ntfs_malloc(size);
+		batch->inodes = (s64*)ntfs_malloc(CHECK_RECORDS*sizeof(s64));
+		if (!batch->records || !batch->inodes)
+			perr_exit("ntfs_malloc");
+		batch->count = 0;
+		batch->state = BATCH_FREE;
+		pool->nr_batches++;
+	}
+	pthread_mutex_lock(&pool->lock);
+	for (i=0; i<threads; i++) {
+		memset(&pool->workers[i], 0, sizeof(ntfsck_t));
+		pool->workers[i].lcn_bitmap.size = pool->fsck->lcn_bitmap.size;
+		pool->workers[i].lcn_bitmap.bm =
+				ntfs_calloc(pool->fsck->lcn_bitmap.size);
+		if (!pool->workers[i].lcn_bitmap.bm
+		    || pthread_create(&pool->threads[i], NULL,
+					check_worker, pool))
+			break;
+		pool->nr_threads++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (!pool->nr_threads)
+		perr_exit("Could not start the checking threads");
+	return (pool->nr_threads);
+}
+
+static void post_check_batch(struct CHECK_POOL *pool)
+{
+	struct CHECK_BATCH *batch;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->batches[pool->current].state = BATCH_FULL;
+	pthread_cond_broadcast(&pool->cond);
+	pool->current = (pool->current + 1) % pool->nr_batches;
+	batch = &pool->batches[pool->current];
+	while (batch->state != BATCH_FREE)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ *		Stop the threads and merge their checks into the global one
+ */
+
+static void stop_check_pool(struct CHECK_POOL *pool)
+{
+	ntfsck_t *fsck = pool->fsck;
+	ntfsck_t *worker;
+	s64 pos;
+	s64 k;
+	u8 both;
+	int i;
+
+	if (pool->batches[pool->current].count)
+		post_check_batch(pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = TRUE;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i=0; i<pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	for (i=0; i<pool->nr_threads; i++) {
+		worker = &pool->workers[i];
+		for (pos=0; pos<fsck->lcn_bitmap.size; pos++) {
+			both = fsck->lcn_bitmap.bm[pos]
+					& worker->lcn_bitmap.bm[pos];
+			for (k=8*pos; both; k++, both >>= 1) {
+				if (!(both & 1))
+					continue;
+				if (++fsck->multi_ref <= 10 || opt.verbose)
+					printf("Cluster %lld is referenced "
+					       "multiple times!\n",
+					       (long long)k);
+			}
+			fsck->lcn_bitmap.bm[pos] |= worker->lcn_bitmap.bm[pos];
+		}
+		fsck->inuse += worker->inuse;
+		fsck->multi_ref += worker->multi_ref;
+		fsck->outsider += worker->outsider;
+		free(worker->lcn_bitmap.bm);
+	}
+	for (i=0; i<pool->nr_batches; i++) {
+		free(pool->batches[i].records);
+		free(pool->batches[i].inodes);
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+static int check_scanned_record(ntfs_volume *vol, const MFT_REF mref,
+			MFT_RECORD *mrec, void *data)
+{
+	struct CHECK_POOL *pool = (struct CHECK_POOL*)data;
+#ifdef HAVE_PTHREAD_H
+	struct CHECK_BATCH *batch;
+#endif
+
+	pool->last_inode = MREF(mref);
+        if (!opt.infombonly)
+		progress_update(&pool->progress, MREF(mref));
+#ifdef HAVE_PTHREAD_H
+	if (pool->nr_threads) {
+		batch = &pool->batches[pool->current];
+		memcpy(&batch->records[batch->count
+					<< vol->mft_record_size_bits],
+				mrec, vol->mft_record_size);
+		batch->inodes[batch->count] = MREF(mref);
+		if (++batch->count >= CHECK_RECORDS)
+			post_check_batch(pool);
+	} else
+		check_record(vol, pool->fsck, MREF(mref), mrec);
+#else
+	check_record(vol, pool->fsck, MREF(mref), mrec);
+#endif
+	return (0);
+}
+
 /**
- * walk_inodes
+ * build_allocation_bitmap
  *
  * Read each record in the MFT, skipping the unused ones, and build up a bitmap
  * from all the non-resident attributes.
  */
 static int build_allocation_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 {
-	s64 nr_mft_records, inode = 0;
-	ntfs_inode *ni;
-	struct progress_bar progress;
+	s64 nr_mft_records;
+	struct CHECK_POOL pool;
 	int pb_flags = 0;	/* progress bar flags */
+	int threads;
+	int res;
 
 	/* WARNING: don't modify the text, external tools grep for it */
         if (!opt.infombonly)
@@ -1071,35 +1330,26 @@ static int build_allocation_bitmap(ntfs_volume *vol, ntfsck_t *fsck)
 	nr_mft_records = vol->mft_na->initialized_size >>
 			vol->mft_record_size_bits;
 
-	progress_init(&progress, inode, nr_mft_records - 1, pb_flags);
-
-	for (; inode < nr_mft_records; inode++) {
-        	if (!opt.infombonly)
-			progress_update(&progress, inode);
-
-		if ((ni = ntfs_inode_open(vol, (MFT_REF)inode)) == NULL) {
-			/* FIXME: continue only if it make sense, e.g.
-			   MFT record not in use based on $MFT bitmap */
-			if (errno == EIO || errno == ENOENT)
-				continue;
-			perr_printf("Reading inode %lld failed",
-					(long long)inode);
-			return -1;
-		}
-
-		if (ni->mrec->base_mft_record)
-			goto close_inode;
-
-		fsck->ni = ni;
-		if (walk_attributes(vol, fsck) != 0) {
-			inode_close(ni);
-			return -1;
-		}
-close_inode:
-		if (inode_close(ni) != 0)
-			return -1;
-	}
-	return 0;
+	progress_init(&pool.progress, 0, nr_mft_records - 1, pb_flags);
+	pool.vol = vol;
+	pool.fsck = fsck;
+	pool.last_inode = -1;
+#ifdef HAVE_PTHREAD_H
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	start_check_pool(&pool, threads);
+#else
+	threads = 0;
+#endif
+	res = ntfs_mft_scan(vol, threads, check_scanned_record, &pool);
+	if (res < 0)
+		perr_printf("Scanning the MFT failed");
+#ifdef HAVE_PTHREAD_H
+	if (pool.nr_threads)
+		stop_check_pool(&pool);
+#endif
+        if (!opt.infombonly && (pool.last_inode != nr_mft_records - 1))
+		progress_update(&pool.progress, nr_mft_records - 1);
+	return (res < 0 ? -1 : 0);
 }
 
 static void build_resize_constraints(ntfs_resize_t *resize)
@@ -1889,40 +2139,212 @@ static void lseek_to_cluster(ntfs_volume *vol, s64 lcn)
 		perr_exit("seek failed to position %lld", (long long)lcn);
 }
 
-static void copy_clusters(ntfs_resize_t *resize, s64 dest, s64 src, s64 len)
-{
-	s64 i;
-	char *buff;
-	ntfs_volume *vol = resize->vol;
-
-	buff = (char*)ntfs_malloc(vol->cluster_size);
-	if (!buff)
-		perr_exit("ntfs_malloc");
+/*
+ *		Relocating clusters by extents
+ *
+ *	The clusters of a run are moved by extents of up to
+ *	RELOCATE_EXTENT_SIZE bytes, using positioned reads and writes.
+ *	When threads are available, an extent is written by a writer
+ *	thread while the next one is being read, two buffers being
+ *	used alternately.
+ *
+ *	When the source and destination overlap, the extents are
+ *	processed in an order such that an extent being written never
+ *	overwrites clusters which have still to be read.
+ */
 
-	for (i = 0; i < len; i++) {
+static struct {
+	char *buff[2];		/* alternate buffers */
+	int current;		/* buffer to read into */
+	char *pending;		/* buffer waiting to be written */
+	s64 lcn;		/* destination of pending buffer */
+	s64 count;		/* clusters in pending buffer */
+#ifdef HAVE_PTHREAD_H
+	BOOL threaded;
+	BOOL quit;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+} extents;
 
-		lseek_to_cluster(vol, src + i);
+static void read_extent(ntfs_volume *vol, char *buff, s64 lcn, s64 count)
+{
+	s64 pos, size, done;
 
-		if (read_all(vol->dev, buff, vol->cluster_size) == -1) {
+	if (NDevReadOnly(vol->dev))
+		return;
+	pos = lcn*vol->cluster_size;
+	size = count*vol->cluster_size;
+	while (size > 0) {
+		done = vol->dev->d_ops->pread(vol->dev, buff, size, pos);
+		if (!done)
+			err_exit("Unexpected end of file!\n");
+		if (done < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
 			perr_printf("Failed to read from the disk");
 			if (errno == EIO)
 				printf("%s", bad_sectors_warning_msg);
 			exit(1);
 		}
+		buff += done;
+		pos += done;
+		size -= done;
+	}
+}
 
-		lseek_to_cluster(vol, dest + i);
+static void write_extent(ntfs_volume *vol, const char *buff,
+			s64 lcn, s64 count)
+{
+	s64 pos, size, done;
 
-		if (write_all(vol->dev, buff, vol->cluster_size) == -1) {
+	if (NDevReadOnly(vol->dev))
+		return;
+	pos = lcn*vol->cluster_size;
+	size = count*vol->cluster_size;
+	while (size > 0) {
+		done = vol->dev->d_ops->pwrite(vol->dev, buff, size, pos);
+		if (done <= 0) {
+			if ((done < 0) && (errno == EAGAIN || errno == EINTR))
+				continue;
 			perr_printf("Failed to write to the disk");
 			if (errno == EIO)
 				printf("%s", bad_sectors_warning_msg);
 			exit(1);
 		}
+		buff += done;
+		pos += done;
+		size -= done;
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *extent_writer(void *arg)
+{
+	ntfs_volume *vol = (ntfs_volume*)arg;
+
+	pthread_mutex_lock(&extents.lock);
+	while (!extents.quit || extents.pending) {
+		if (extents.pending) {
+			pthread_mutex_unlock(&extents.lock);
+			write_extent(vol, extents.pending,
+					extents.lcn, extents.count);
+			pthread_mutex_lock(&extents.lock);
+			extents.pending = (char*)NULL;
+			pthread_cond_broadcast(&extents.cond);
+		} else
+			pthread_cond_wait(&extents.cond, &extents.lock);
+	}
+	pthread_mutex_unlock(&extents.lock);
+	return ((void*)NULL);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Wait until the pending extent has been written
+ */
+
+static void flush_extent(void)
+{
+#ifdef HAVE_PTHREAD_H
+	if (extents.threaded) {
+		pthread_mutex_lock(&extents.lock);
+		while (extents.pending)
+			pthread_cond_wait(&extents.cond, &extents.lock);
+		pthread_mutex_unlock(&extents.lock);
+	}
+#endif
+}
+
+static void queue_extent(ntfs_volume *vol, char *buff, s64 lcn, s64 count)
+{
+#ifdef HAVE_PTHREAD_H
+	if (extents.threaded) {
+		pthread_mutex_lock(&extents.lock);
+		while (extents.pending)
+			pthread_cond_wait(&extents.cond, &extents.lock);
+		extents.pending = buff;
+		extents.lcn = lcn;
+		extents.count = count;
+		pthread_cond_broadcast(&extents.cond);
+		pthread_mutex_unlock(&extents.lock);
+	} else
+		write_extent(vol, buff, lcn, count);
+#else
+	write_extent(vol, buff, lcn, count);
+#endif
+}
+
+static void start_extents(ntfs_volume *vol)
+{
+	extents.buff[0] = (char*)ntfs_malloc(RELOCATE_EXTENT_SIZE);
+	extents.buff[1] = (char*)ntfs_malloc(RELOCATE_EXTENT_SIZE);
+	if (!extents.buff[0] || !extents.buff[1])
+		perr_exit("ntfs_malloc");
+	extents.current = 0;
+	extents.pending = (char*)NULL;
+#ifdef HAVE_PTHREAD_H
+	extents.quit = FALSE;
+	extents.threaded = !NDevReadOnly(vol->dev)
+		&& !pthread_mutex_init(&extents.lock, NULL)
+		&& !pthread_cond_init(&extents.cond, NULL)
+		&& !pthread_create(&extents.thread, NULL,
+					extent_writer, vol);
+#endif
+}
 
-		resize->relocations++;
+static void stop_extents(void)
+{
+#ifdef HAVE_PTHREAD_H
+	if (extents.threaded) {
+		pthread_mutex_lock(&extents.lock);
+		extents.quit = TRUE;
+		pthread_cond_broadcast(&extents.cond);
+		pthread_mutex_unlock(&extents.lock);
+		pthread_join(extents.thread, NULL);
+		pthread_cond_destroy(&extents.cond);
+		pthread_mutex_destroy(&extents.lock);
+		extents.threaded = FALSE;
+	}
+#endif
+	free(extents.buff[0]);
+	free(extents.buff[1]);
+	extents.buff[0] = extents.buff[1] = (char*)NULL;
+}
+
+static void copy_clusters(ntfs_resize_t *resize, s64 dest, s64 src, s64 len)
+{
+	ntfs_volume *vol = resize->vol;
+	s64 max_count;
+	s64 count;
+	s64 done;
+	s64 offs;
+	BOOL backwards;
+	char *buff;
+
+	if (!extents.buff[0])
+		start_extents(vol);
+	max_count = RELOCATE_EXTENT_SIZE/vol->cluster_size;
+	if (!max_count)
+		max_count = 1;
+		/* a higher overlapping destination is copied from the end */
+	backwards = (dest > src) && (dest < src + len);
+	for (done=0; done<len; done+=count) {
+		count = len - done;
+		if (count > max_count)
+			count = max_count;
+		offs = (backwards ? len - done - count : done);
+		buff = extents.buff[extents.current];
+		read_extent(vol, buff, src + offs, count);
+		queue_extent(vol, buff, dest + offs, count);
+		extents.current ^= 1;
+		resize->relocations += count;
 		progress_update(&resize->progress, resize->relocations);
 	}
-	free(buff);
+	flush_extent();
 }
 
 static void relocate_clusters(ntfs_resize_t *r, runlist *dest_rl, s64 src_lcn)
@@ -2005,12 +2427,15 @@ static void rl_insert_at_run(runlist **rl, int run, runlist *ins)
 //	(*rl + run)->lcn = ins->lcn;
 }
 
+static runlist *take_planned_run(ntfs_resize_t *resize, s64 lcn, s64 length);
+
 static void relocate_run(ntfs_resize_t *resize, runlist **rl, int run)
 {
 	s64 lcn, lcn_length;
 	s64 new_vol_size;	/* (last LCN on the volume) + 1 */
 	runlist *relocate_rl;	/* relocate runlist to relocate_rl */
 	int hint;
+	BOOL planned;
 
 	lcn = (*rl + run)->lcn;
 	lcn_length = (*rl + run)->length;
@@ -2025,11 +2450,15 @@ static void relocate_run(ntfs_resize_t *resize, runlist **rl, int run)
 	}
 
 	hint = (resize->mref == FILE_MFTMirr) ? 1 : 0;
+	planned = FALSE;
 	if ((resize->mref == FILE_MFT)
 	    && (resize->ctx->attr->type == AT_DATA)
 	    && !run
 	    && resize->new_mft_start) {
 		relocate_rl = resize->new_mft_start;
+	} else if ((relocate_rl = take_planned_run(resize,
+						lcn, lcn_length))) {
+		planned = TRUE;
 	} else
 		if (!(relocate_rl = alloc_cluster(&resize->lcn_bitmap,
 					lcn_length, new_vol_size, hint)))
@@ -2046,7 +2475,9 @@ static void relocate_run(ntfs_resize_t *resize, runlist **rl, int run)
 			 (unsigned long long)lcn,
 			 (unsigned long long)relocate_rl->lcn);
 
-	relocate_clusters(resize, relocate_rl, lcn);
+		/* planned runs have already been copied */
+	if (!planned)
+		relocate_clusters(resize, relocate_rl, lcn);
 	rl_insert_at_run(rl, run, relocate_rl);
 
 	/* We don't release old clusters in the bitmap, that area isn't
@@ -2242,6 +2673,307 @@ static void relocate_inode(ntfs_resize_t *resize, MFT_REF mref, int do_mftdata)
 	}
 }
 
+/*
+ *		Planning the relocations
+ *
+ *	Before relocating, all the runs to be moved, except those of
+ *	$MFT:$DATA and $MFTMirr which need a special processing, are
+ *	collected and sorted by source LCN. Their destinations are
+ *	allocated from an index of the free extents by best fit, and
+ *	their clusters are copied in a single sweep over the volume.
+ *	The runlists are then updated in inode order, the copy being
+ *	skipped for the planned runs.
+ */
+
+static int free_extent_compare(const void *p1, const void *p2)
+{
+	const struct FREE_EXTENT *e1 = (const struct FREE_EXTENT*)p1;
+	const struct FREE_EXTENT *e2 = (const struct FREE_EXTENT*)p2;
+
+	if (e1->length != e2->length)
+		return (e1->length < e2->length ? -1 : 1);
+	return (e1->lcn < e2->lcn ? -1 : (e1->lcn > e2->lcn));
+}
+
+static int planned_compare(const void *p1, const void *p2)
+{
+	const struct PLANNED *r1 = (const struct PLANNED*)p1;
+	const struct PLANNED *r2 = (const struct PLANNED*)p2;
+
+	return (r1->src_lcn < r2->src_lcn ? -1 : (r1->src_lcn > r2->src_lcn));
+}
+
+/*
+ *		Build the index of free extents below the new end,
+ *	sorted by increasing length
+ */
+
+static struct FREE_EXTENT *get_free_extents(ntfs_resize_t *resize,
+			s64 *pcount)
+{
+	struct FREE_EXTENT *extents;
+	s64 count, allocated;
+	s64 lcn, start;
+
+	extents = (struct FREE_EXTENT*)NULL;
+	count = allocated = 0;
+	for (lcn=0; lcn<resize->new_volume_size; lcn++) {
+		if (ntfs_bit_get(resize->lcn_bitmap.bm, lcn))
+			continue;
+		start = lcn;
+		while ((lcn < resize->new_volume_size)
+		    && !ntfs_bit_get(resize->lcn_bitmap.bm, lcn))
+			lcn++;
+		if (count >= allocated) {
+			allocated = (allocated ? 2*allocated : 256);
+			extents = (struct FREE_EXTENT*)realloc(extents,
+				allocated*sizeof(struct FREE_EXTENT));
+			if (!extents)
+				perr_exit("realloc");
+		}
+		extents[count].lcn = start;
+		extents[count].length = lcn - start;
+		count++;
+	}
+	if (count)
+		qsort(extents, count, sizeof(struct FREE_EXTENT),
+				free_extent_compare);
+	*pcount = count;
+	return (extents);
+}
+
+/*
+ *		Allocate clusters from the smallest free extent which
+ *	is long enough, or from the longest ones when none is.
+ */
+
+static runlist *alloc_best_fit(ntfs_resize_t *resize,
+			struct FREE_EXTENT *extents, s64 *pcount, s64 items)
+{
+	struct FREE_EXTENT ext;
+	runlist *rl;
+	s64 count = *pcount;
+	s64 lo, hi, mid, k;
+	s64 vcn = 0;
+	s64 length;
+	int runs = 0;
+
+	rl = (runlist*)NULL;
+	while (items > 0) {
+		if (!count) {
+			free(rl);
+			errno = ENOSPC;
+			return ((runlist*)NULL);
+		}
+			/* first extent at least as long as needed */
+		lo = 0;
+		hi = count;
+		while (lo < hi) {
+			mid = (lo + hi)/2;
+			if (extents[mid].length < items)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		k = (lo < count ? lo : count - 1);
+		length = extents[k].length;
+		if (length > items)
+			length = items;
+		rl = (runlist*)realloc(rl, (runs + 2)*sizeof(runlist_element));
+		if (!rl)
+			perr_exit("realloc");
+		rl_set(rl + runs, vcn, extents[k].lcn, length);
+		set_bitmap_range(&resize->lcn_bitmap, extents[k].lcn,
+						length, 1);
+		vcn += length;
+		items -= length;
+		runs++;
+			/* shrink the extent and keep the index sorted */
+		ext.lcn = extents[k].lcn + length;
+		ext.length = extents[k].length - length;
+		memmove(&extents[k], &extents[k + 1],
+			(count - k - 1)*sizeof(struct FREE_EXTENT));
+		count--;
+		if (ext.length) {
+			lo = 0;
+			hi = k;
+			while (lo < hi) {
+				mid = (lo + hi)/2;
+				if (free_extent_compare(&extents[mid], &ext) < 0)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			memmove(&extents[lo + 1], &extents[lo],
+				(count - lo)*sizeof(struct FREE_EXTENT));
+			extents[lo] = ext;
+			count++;
+		}
+	}
+	rl_set(rl + runs, vcn, -1LL, 0LL);
+	*pcount = count;
+	return (rl);
+}
+
+/*
+ *		Collect the runs of a record which are to be moved
+ */
+
+static void collect_planned_runs(ntfs_resize_t *resize, s64 *allocated)
+{
+	ATTR_RECORD *a;
+	runlist *rl;
+	leMFT_REF lemref;
+	MFT_REF base_mref;
+	s64 lcn, end;
+	int ret;
+	int i;
+
+	if (!(resize->ctx = attr_get_search_ctx(NULL, resize->mrec)))
+		exit(1);
+	lemref = resize->mrec->base_mft_record;
+	base_mref = (lemref ? MREF(le64_to_cpu(lemref)) : resize->mref);
+	while (!ntfs_attrs_walk(resize->ctx)) {
+		a = resize->ctx->attr;
+		if (a->type == AT_END)
+			break;
+		if (!a->non_resident
+		    || is_mftdata(resize)
+		    || (base_mref == FILE_MFTMirr))
+			continue;
+			/* same exclusions as relocate_attributes() */
+		ret = ntfs_inode_badclus_bad(resize->mref, a);
+		if (ret == -1)
+			perr_exit("Bad sector list check failed");
+		if (ret == 1)
+			continue;
+		if ((resize->mref == FILE_Bitmap) && (a->type == AT_DATA))
+			continue;
+		if ((base_mref == FILE_BadClus) && (a->type == AT_DATA))
+			continue;
+		if (!(rl = ntfs_mapping_pairs_decompress(resize->vol, a, NULL)))
+			perr_exit("ntfs_decompress_mapping_pairs");
+		for (i=0; rl[i].length; i++) {
+			lcn = rl[i].lcn;
+			end = lcn + rl[i].length;
+			if ((lcn < 0) || (end <= resize->new_volume_size))
+				continue;
+			if (lcn < resize->new_volume_size)
+				lcn = resize->new_volume_size;
+			if (resize->nr_planned >= *allocated) {
+				*allocated = (*allocated ? 2*(*allocated) : 256);
+				resize->plan = (struct PLANNED*)realloc(
+					resize->plan,
+					*allocated*sizeof(struct PLANNED));
+				if (!resize->plan)
+					perr_exit("realloc");
+			}
+			resize->plan[resize->nr_planned].src_lcn = lcn;
+			resize->plan[resize->nr_planned].length = end - lcn;
+			resize->plan[resize->nr_planned].rl = (runlist*)NULL;
+			resize->nr_planned++;
+		}
+		free(rl);
+	}
+	ntfs_attr_put_search_ctx(resize->ctx);
+}
+
+/*
+ *		Plan the relocations and copy the planned runs
+ *
+ *	When the destinations cannot all be allocated, the unplanned
+ *	runs are relocated the usual way.
+ */
+
+static void plan_relocations(ntfs_resize_t *resize, s64 nr_mft_records)
+{
+	struct FREE_EXTENT *extents;
+	struct PLANNED *planned;
+	runlist *rl;
+	MFT_REF mref;
+	s64 nr_extents;
+	s64 allocated;
+	s64 src;
+	s64 i;
+
+	resize->plan = (struct PLANNED*)NULL;
+	resize->nr_planned = 0;
+	allocated = 0;
+	for (mref = 0; mref < (MFT_REF)nr_mft_records; mref++) {
+		if (ntfs_file_record_read(resize->vol, mref,
+				&resize->mrec, NULL)) {
+			if (errno == EIO || errno == ENOENT)
+				continue;
+			perr_exit("ntfs_file_record_record");
+		}
+		if (!(resize->mrec->flags & MFT_RECORD_IN_USE))
+			continue;
+		resize->mref = mref;
+		collect_planned_runs(resize, &allocated);
+	}
+	if (!resize->nr_planned)
+		return;
+	qsort(resize->plan, resize->nr_planned, sizeof(struct PLANNED),
+			planned_compare);
+
+	extents = get_free_extents(resize, &nr_extents);
+	for (i=0; i<resize->nr_planned; i++) {
+		planned = &resize->plan[i];
+		planned->rl = alloc_best_fit(resize, extents, &nr_extents,
+						planned->length);
+		if (!planned->rl)
+			break;
+	}
+	free(extents);
+	ntfs_log_verbose("Planned relocations : %lld of %lld runs\n",
+			(long long)i, (long long)resize->nr_planned);
+
+		/* copy in a single sweep by increasing source LCN */
+	for (i=0; i<resize->nr_planned; i++) {
+		planned = &resize->plan[i];
+		src = planned->src_lcn;
+		for (rl=planned->rl; rl && rl->length; rl++) {
+			copy_clusters(resize, rl->lcn, src, rl->length);
+			src += rl->length;
+		}
+	}
+}
+
+/*
+ *		Get the planned destination of a run, if any
+ */
+
+static runlist *take_planned_run(ntfs_resize_t *resize, s64 lcn, s64 length)
+{
+	struct PLANNED key;
+	struct PLANNED *planned;
+	runlist *rl;
+
+	rl = (runlist*)NULL;
+	if (resize->nr_planned) {
+		key.src_lcn = lcn;
+		planned = (struct PLANNED*)bsearch(&key, resize->plan,
+				resize->nr_planned, sizeof(struct PLANNED),
+				planned_compare);
+		if (planned && (planned->length == length)) {
+			rl = planned->rl;
+			planned->rl = (runlist*)NULL;
+		}
+	}
+	return (rl);
+}
+
+static void free_plan(ntfs_resize_t *resize)
+{
+	s64 i;
+
+	for (i=0; i<resize->nr_planned; i++)
+		free(resize->plan[i].rl);
+	free(resize->plan);
+	resize->plan = (struct PLANNED*)NULL;
+	resize->nr_planned = 0;
+}
+
 static void relocate_inodes(ntfs_resize_t *resize)
 {
 	s64 nr_mft_records;
@@ -2313,6 +3045,8 @@ static void relocate_inodes(ntfs_resize_t *resize)
 		resize->mirr_from = MIRR_NEWMFT;
 	}
 
+	plan_relocations(resize, nr_mft_records);
+
 	for (mref = 0; mref < (MFT_REF)nr_mft_records; mref++)
 		relocate_inode(resize, mref, 0);
 
@@ -2330,6 +3064,8 @@ static void relocate_inodes(ntfs_resize_t *resize)
 				 "Please report!\n", (long long)highest_vcn);
 	}
 done:
+	stop_extents();
+	free_plan(resize);
 	free(resize->mrec);
 }
 
@@ -2481,8 +3217,21 @@ static void realloc_bitmap_data_attr(ntfs_resize_t *resize,
 	for (i = vol->nr_clusters; i < new_size; i++)
 		ntfs_bit_set(bm->bm, i, 0);
 
-	if (!(*rl = alloc_cluster(bm, nr_bm_clusters, new_size, 0)))
-		perr_exit("Couldn't allocate $Bitmap clusters");
+		/*
+		 * When the allocations have not been checked, the added
+		 * clusters are the only ones known to be free.
+		 */
+	if (resize->fast_grow
+	    && ((new_size - vol->nr_clusters) >= nr_bm_clusters)) {
+		*rl = (runlist*)ntfs_malloc(2*sizeof(runlist_element));
+		if (!*rl)
+			perr_exit("ntfs_malloc");
+		rl_set(*rl, 0LL, vol->nr_clusters, nr_bm_clusters);
+		rl_set(*rl + 1, nr_bm_clusters, -1LL, 0LL);
+		set_bitmap_range(bm, vol->nr_clusters, nr_bm_clusters, 1);
+	} else
+		if (!(*rl = alloc_cluster(bm, nr_bm_clusters, new_size, 0)))
+			perr_exit("Couldn't allocate $Bitmap clusters");
 }
 
 static void realloc_lcn_bitmap(ntfs_resize_t *resize, s64 bm_bsize)
@@ -2764,6 +3513,9 @@ static void update_bootsector(ntfs_resize_t *r)
 	if (vol->dev->d_ops->read(vol->dev, bs, bs_size) == -1)
 		perr_exit("read() error");
 
+	if (!ntfs_boot_sector_is_ntfs(bs))
+		err_exit("The boot sector is not valid\n");
+
 	if (bs->bpb.sectors_per_cluster > 128)
 		bs->number_of_sectors = cpu_to_sle64(r->new_volume_size
 				<< (256 - bs->bpb.sectors_per_cluster));
@@ -2790,6 +3542,7 @@ static void update_bootsector(ntfs_resize_t *r)
 				      r->mftmir_rl.length);
 			break;
 		}
+		stop_extents();
 		if (r->mftmir_old)
 			bs->mftmirr_lcn = cpu_to_sle64(r->mftmir_rl.lcn);
 		r->progress.flags &= ~NTFS_PROGBAR_SUPPRESS;
@@ -3067,6 +3820,70 @@ static void check_cluster_allocation(ntfs_volume *vol, ntfsck_t *fsck)
 	compare_bitmaps(vol, &fsck->lcn_bitmap);
 }
 
+/*
+ *		Get the cluster allocation from $Bitmap
+ *
+ *	This is used instead of check_cluster_allocation() when enlarging,
+ *	as walking through all the inodes takes long on big volumes. Only
+ *	the structures updated are checked : the runlist of $Bitmap must
+ *	be allocated within the volume, and the new location of $Bitmap
+ *	is preferably taken from the added clusters.
+ */
+static void load_cluster_allocation(ntfs_volume *vol, ntfsck_t *fsck)
+{
+	struct bitmap *bm = &fsck->lcn_bitmap;
+	runlist *rl;
+	s64 count;
+	s64 pos;
+	s64 lcn;
+	int bit;
+
+	memset(fsck, 0, sizeof(ntfsck_t));
+
+	if (!opt.infombonly)
+		printf("Accounting clusters ...\n");
+
+	if (setup_lcn_bitmap(bm, vol->nr_clusters) != 0)
+		perr_exit("Failed to setup allocation bitmap");
+	count = ntfs_attr_pread(vol->lcnbmp_na, 0, bm->size, bm->bm);
+	if (count != bm->size) {
+		if (count == -1)
+			perr_exit("Couldn't get $Bitmap $DATA");
+		err_exit("$Bitmap size is smaller than expected"
+			 " (%lld != %lld)\n",
+			 (long long)bm->size, (long long)count);
+	}
+	bitmap_file_data_fixup(vol->nr_clusters, bm);
+
+	for (pos = 0; pos < (vol->nr_clusters >> 3); pos++) {
+		if (bm->bm[pos] == 0xff)
+			fsck->inuse += 8;
+		else
+			for (bit = 0; bit < 8; bit++)
+				if (bm->bm[pos] & (1 << bit))
+					fsck->inuse++;
+	}
+	for (lcn = pos << 3; lcn < vol->nr_clusters; lcn++)
+		if (ntfs_bit_get(bm->bm, lcn))
+			fsck->inuse++;
+
+	if (ntfs_attr_map_whole_runlist(vol->lcnbmp_na))
+		perr_exit("Failed to map the runlist of $Bitmap");
+	for (rl = vol->lcnbmp_na->rl; rl->length; rl++) {
+		if (rl->lcn < 0)
+			continue;
+		if ((rl->lcn + rl->length) > vol->nr_clusters)
+			err_exit("$Bitmap is located outside of the "
+				 "volume\n%s", corrupt_volume_msg);
+		for (lcn = rl->lcn; lcn < (rl->lcn + rl->length); lcn++)
+			if (!ntfs_bit_get(bm->bm, lcn))
+				err_exit("Cluster accounting failed at %lld "
+					 "(0x%llx) in $Bitmap\n%s",
+					 (long long)lcn, (long long)lcn,
+					 corrupt_volume_msg);
+	}
+}
+
 /*
  *		Following are functions to expand an NTFS file system
  *	to the beginning of a partition. The old metadata can be
@@ -4636,7 +5453,16 @@ int main(int argc, char **argv)
 	resize.badclusters = check_bad_sectors(vol);
 
 	NVolSetNoFixupWarn(vol);
-	check_cluster_allocation(vol, &fsck);
+		/*
+		 * When enlarging, no cluster has to be relocated, and
+		 * the full check of allocations and the collection of
+		 * constraints can be skipped.
+		 */
+	resize.fast_grow = !resize.shrink && !opt.info && !opt.infombonly;
+	if (resize.fast_grow)
+		load_cluster_allocation(vol, &fsck);
+	else
+		check_cluster_allocation(vol, &fsck);
 
 	print_disk_usage(vol, fsck.inuse);
 
@@ -4644,9 +5470,11 @@ int main(int argc, char **argv)
 	resize.lcn_bitmap = fsck.lcn_bitmap;
 	resize.mirr_from = MIRR_OLD;
 
-	set_resize_constraints(&resize);
-	set_disk_usage_constraint(&resize);
-	check_resize_constraints(&resize);
+	if (!resize.fast_grow) {
+		set_resize_constraints(&resize);
+		set_disk_usage_constraint(&resize);
+		check_resize_constraints(&resize);
+	}
 
 	if (opt.info || opt.infombonly) {
 		advise_on_resize(&resize);
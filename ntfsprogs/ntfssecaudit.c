@@ -292,6 +292,9 @@
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif /* HAVE_SYS_STAT_H */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #else /* HAVE_SETXATTR */
@@ -355,6 +358,7 @@ typedef enum { CMD_AUDIT, CMD_BACKUP, CMD_HEX, CMD_HELP, CMD_SET,
 
 #define MAXSECURID 262144
 #define SECBLKSZ 8
+#define SDSBULKSZ 0x400000 /* chunk of $SDS read by the parallel audit */
 #define MAPDIR ".NTFS-3G"
 #define MAPFILE "UserMapping"
 
@@ -473,6 +477,39 @@ struct SECURITY_DATA {
         unsigned int flags:4;
 } ;
 
+/*
+ *		Structures for the parallel audit
+ *
+ *	The entries of a chunk of $SDS are collected, their descriptors
+ *	are checked by several threads, and the results are then reported
+ *	serially in the order of the entries.
+ */
+
+struct SDS_CHECK {
+	BOOL descrok;	/* ntfs_valid_descr() has succeeded */
+	u32 comphash;	/* hash computed when descrok */
+} ;
+
+struct SDS_ENTRY {
+	const char *attr; /* header followed by descriptor */
+	unsigned int offset; /* offset in $SDS */
+	unsigned int entrysz;
+	unsigned int size; /* bytes available beyond the header */
+	BOOL second;
+	struct SDS_CHECK check;
+} ;
+
+struct SDS_SLICE {
+	struct SDS_ENTRY *entries;
+	int count;
+} ;
+
+struct FILE_AUDIT {
+	s64 files;	/* base records having a security key */
+	s64 untagged;	/* base records with no security key */
+	int errcnt;
+} ;
+
 /*
  *		  Global constants
  */
@@ -546,6 +583,7 @@ BOOL opt_e;	/* restore extra (currently windows attribs) */
 BOOL opt_r;	/* recursively apply to subdirectories */
 BOOL opt_u;	/* user mapping proposal */
 int opt_v;  /* verbose or very verbose*/
+int opt_j;  /* threads for the parallel audit, 0 if not parallel */
 CMDS cmd; /* command to process */
 struct SECURITY_DATA *securdata[(MAXSECURID + (1 << SECBLKSZ) - 1)/(1 << SECBLKSZ)];
 unsigned int errors; /* number of severe errors */
@@ -1832,9 +1870,11 @@ static int do_default_mapping(struct MAPPING *mapping[],
 			if (groupmapping) {
 				usermapping->sid = sid;
 				usermapping->xid = 0;
+				usermapping->index = (struct MAPPING_INDEX*)NULL;
 				usermapping->next = (struct MAPPING*)NULL;
 				groupmapping->sid = sid;
 				groupmapping->xid = 0;
+				groupmapping->index = (struct MAPPING_INDEX*)NULL;
 				groupmapping->next = (struct MAPPING*)NULL;
 				mapping[MAPUSERS] = usermapping;
 				mapping[MAPGROUPS] = groupmapping;
@@ -4857,7 +4897,7 @@ static BOOL mapproposal(const char *volume, const char *name)
 
 static BOOL valid_sds(const char *attr, unsigned int offset,
 		unsigned int entrysz, unsigned int size, u32 prevkey,
-		BOOL second)
+		BOOL second, const struct SDS_CHECK *check)
 {
 	BOOL unsane;
 	u32 comphash;
@@ -4878,13 +4918,18 @@ static BOOL valid_sds(const char *attr, unsigned int offset,
 				(long)ntfs_attr_size(&attr[20]) + 20);
 			warnings++;
 		}
-		if (!unsane && !ntfs_valid_descr((const char*)&attr[20],size)) {
+		if (!unsane && !(check ? check->descrok
+			    : ntfs_valid_descr((const char*)&attr[20],size))) {
 			printf("** General sanity check has failed\n");
 			unsane = TRUE;
 			errors++;
 		}
 		if (!unsane) {
-			comphash = hash((const le32*)&attr[20],entrysz-20);
+			if (check)
+				comphash = check->comphash;
+			else
+				comphash = hash((const le32*)&attr[20],
+						entrysz-20);
 			if ((u32)get4l(attr,0) == comphash) {
 				if (opt_v >= 2)
 					printf("Hash	 0x%08lx (correct)\n",
@@ -4929,6 +4974,9 @@ static BOOL valid_sds(const char *attr, unsigned int offset,
 /*
  *		Check whether a SDS entry is consistent with other known data
  *	and store current data for subsequent checks
+ *
+ *	The entry must have been checked by valid_sds(), so that its
+ *	recorded hash is the computed one.
  */
 
 static int consist_sds(const char *attr, unsigned int offset,
@@ -4941,6 +4989,7 @@ static int consist_sds(const char *attr, unsigned int offset,
 
 	errcnt = 0;
 	key = get4l(attr,4);
+	comphash = get4l(attr,0);
 	if ((key > 0) && (key < MAXSECURID)) {
 		printf("Valid entry at 0x%lx for key 0x%lx\n",
 			(long)offset,(long)key);
@@ -4948,7 +4997,6 @@ static int consist_sds(const char *attr, unsigned int offset,
 			newblock(key);
 		if (securdata[key >> SECBLKSZ]) {
 			psecurdata = &securdata[key >> SECBLKSZ][key & ((1 << SECBLKSZ) - 1)];
-			comphash = hash((const le32*)&attr[20],entrysz-20);
 			if (psecurdata->flags & INSDS1) {
 				if (psecurdata->hash != comphash) {
 					printf("** Different hash values : $SDS-1 0x%08lx $SDS-2 0x%08lx\n",
@@ -4990,6 +5038,27 @@ static int consist_sds(const char *attr, unsigned int offset,
 }
 
 
+/*
+ *		Display the descriptor of a SDS entry
+ */
+
+static void show_sds_descr(const char *attr)
+{
+	BOOL isdir;
+	int mode;
+
+	isdir = guess_dir(&attr[20]);
+	printf("Assuming %s descriptor\n",(isdir ? "directory" : "file"));
+	showheader(&attr[20],0);
+	showusid(&attr[20],0);
+	showgsid(&attr[20],0);
+	showdacl(&attr[20],isdir,0);
+	showsacl(&attr[20],isdir,0);
+	showownership(&attr[20]);
+	mode = linux_permissions(&attr[20],isdir);
+	printf("Interpreted Unix mode 0%03o\n",mode);
+}
+
 /*
  *		       Auditing of $SDS
  */
@@ -4997,7 +5066,6 @@ static int consist_sds(const char *attr, unsigned int offset,
 static int audit_sds(BOOL second)
 {
 	static char attr[MAXATTRSZ + 20];
-	BOOL isdir;
 	BOOL done;
 	BOOL unsane;
 	u32 prevkey;
@@ -5008,7 +5076,6 @@ static int audit_sds(BOOL second)
 	unsigned int offset;
 	int count;
 	int deleted;
-	int mode;
 
 	if (second)
 		printf("\nAuditing $SDS-2\n");
@@ -5058,7 +5125,8 @@ static int audit_sds(BOOL second)
 				}
 
 				unsane = !valid_sds(attr,offset,entrysz,
-					size,prevkey,second);
+					size,prevkey,second,
+					(const struct SDS_CHECK*)NULL);
 				if (!unsane) {
 					if (!get4l(attr,0) && !get4l(attr,4))
 						deleted++;
@@ -5066,19 +5134,8 @@ static int audit_sds(BOOL second)
 						count++;
 					errcnt += consist_sds(attr,offset,
 						entrysz, second);
-					if (opt_v >= 2) {
-						isdir = guess_dir(&attr[20]);
-						printf("Assuming %s descriptor\n",(isdir ? "directory" : "file"));
-						showheader(&attr[20],0);
-						showusid(&attr[20],0);
-						showgsid(&attr[20],0);
-						showdacl(&attr[20],isdir,0);
-						showsacl(&attr[20],isdir,0);
-						showownership(&attr[20]);
-						mode = linux_permissions(
-						    &attr[20],isdir);
-						printf("Interpreted Unix mode 0%03o\n",mode);
-					}
+					if (opt_v >= 2)
+						show_sds_descr(attr);
 					prevkey = get4l(attr,4);
 				}
 				if (!unsane) {
@@ -5117,6 +5174,280 @@ static int audit_sds(BOOL second)
 	return (errcnt);
 }
 
+/*
+ *		Check the descriptor of a SDS entry for the parallel audit
+ *
+ *	This is the costly part of valid_sds(), it does not display
+ *	anything and can be run in parallel threads.
+ */
+
+static void check_sds_entry(struct SDS_ENTRY *pentry)
+{
+	const char *attr;
+
+	attr = pentry->attr;
+	pentry->check.descrok = FALSE;
+	pentry->check.comphash = 0;
+	if ((get4l(attr,0) || get4l(attr,4))
+	    && ((ntfs_attr_size(&attr[20]) + 20) <= pentry->entrysz)
+	    && ntfs_valid_descr((const char*)&attr[20],pentry->size)) {
+		pentry->check.descrok = TRUE;
+		pentry->check.comphash = hash((const le32*)&attr[20],
+						pentry->entrysz - 20);
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *check_sds_slice(void *arg)
+{
+	struct SDS_SLICE *slice;
+	int i;
+
+	slice = (struct SDS_SLICE*)arg;
+	for (i=0; i<slice->count; i++)
+		check_sds_entry(&slice->entries[i]);
+	return ((void*)NULL);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ *		Check the descriptors of a set of SDS entries
+ *
+ *	The entries are split into contiguous slices, one per thread,
+ *	the first slice being checked by the current thread.
+ */
+
+static void check_sds_entries(struct SDS_ENTRY *entries, int count)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_t thread[MFT_SCAN_MAX_THREADS];
+	struct SDS_SLICE slice[MFT_SCAN_MAX_THREADS];
+	BOOL started[MFT_SCAN_MAX_THREADS];
+	int threads;
+	int per;
+	int i;
+
+	threads = (opt_j < count ? opt_j : count);
+	if (threads > 0)
+		per = (count + threads - 1)/threads;
+	else
+		per = 0;
+	for (i=0; i<threads; i++) {
+		slice[i].entries = &entries[i*per];
+		slice[i].count = (count - i*per < per ? count - i*per : per);
+		if (slice[i].count < 0)
+			slice[i].count = 0;
+		started[i] = FALSE;
+	}
+	for (i=1; i<threads; i++) {
+		started[i] = !pthread_create(&thread[i], (pthread_attr_t*)NULL,
+					check_sds_slice, &slice[i]);
+		if (!started[i]) /* fall back to checking here */
+			check_sds_slice(&slice[i]);
+	}
+	if (threads > 0)
+		check_sds_slice(&slice[0]);
+	for (i=1; i<threads; i++)
+		if (started[i])
+			pthread_join(thread[i], (void**)NULL);
+#else /* HAVE_PTHREAD_H */
+	int i;
+
+	for (i=0; i<count; i++)
+		check_sds_entry(&entries[i]);
+#endif /* HAVE_PTHREAD_H */
+}
+
+/*
+ *		Collect the entries of a 256K block of $SDS
+ *
+ *	The entries are appended to the table, and the count of entries
+ *	in the table is returned. When a bad entry size is met, the
+ *	collection is stopped for the current stream.
+ */
+
+static int collect_sds_block(struct SDS_ENTRY *entries, int count,
+		const char *buf, unsigned int offset, int avail,
+		BOOL second, BOOL *done, int *errcnt)
+{
+	struct SDS_ENTRY *pentry;
+	unsigned int entrysz;
+	unsigned int entryalsz;
+	int pos;
+
+	pos = 0;
+	while (!*done && ((avail - pos) >= 20) && get4l(&buf[pos],16)) {
+		entrysz = get4l(&buf[pos],16);
+		entryalsz = ((entrysz - 1) | 15) + 1;
+		if ((entrysz < 20) || (entryalsz > (MAXATTRSZ + 20))) {
+			printf("** Bad security attribute size (%ld bytes) at 0x%lx in $SDS-%d - stopping\n",
+				(long)entrysz,(long)(offset + pos),
+				(second ? 2 : 1));
+			(*errcnt)++;
+			errors++;
+			*done = TRUE;
+		} else
+			if ((avail - pos - 20) < (int)(entrysz - 20))
+				*done = TRUE;
+			else {
+				pentry = &entries[count++];
+				pentry->attr = &buf[pos];
+				pentry->offset = offset + pos;
+				pentry->entrysz = entrysz;
+				if ((avail - pos - 20) < (int)entryalsz)
+					pentry->size = avail - pos - 20;
+				else
+					pentry->size = entryalsz;
+				pentry->second = second;
+				pos += entryalsz;
+			}
+	}
+	return (count);
+}
+
+/*
+ *		Auditing of $SDS-1 and $SDS-2 in parallel
+ *
+ *	$SDS is read by big chunks, the descriptors in a chunk are
+ *	checked by several threads, then the entries are reported as
+ *	by audit_sds(). A chunk holds whole pairs of a 256K block of
+ *	$SDS-1 followed by its mirror in $SDS-2, so that an entry of
+ *	$SDS-1 is always registered before its mirror.
+ */
+
+static int audit_sds_parallel(void)
+{
+	struct SDS_ENTRY *entries;
+	struct SDS_ENTRY *pentry;
+	char *buf;
+	BOOL stopped[2];
+	BOOL failed[2];
+	BOOL ended;
+	BOOL unsane;
+	u32 prevkey[2];
+	int errcnt[2];
+	int count[2];
+	int deleted[2];
+	unsigned int offset;
+	int nr_entries;
+	int got;
+	int pair;
+	int avail;
+	int s;
+	int i;
+
+	printf("\nAuditing $SDS-1 and $SDS-2 with %d threads\n",opt_j);
+	for (s=0; s<2; s++) {
+		stopped[s] = FALSE;
+		failed[s] = FALSE;
+		prevkey[s] = 0;
+		errcnt[s] = 0;
+		count[s] = 0;
+		deleted[s] = 0;
+	}
+	buf = (char*)malloc(SDSBULKSZ);
+	entries = (struct SDS_ENTRY*)malloc((SDSBULKSZ/32)
+					*sizeof(struct SDS_ENTRY));
+	if (!buf || !entries) {
+		printf("** Could not allocate memory for auditing $SDS\n");
+		errors++;
+		errcnt[0]++;
+	}
+	offset = 0;
+	got = 0;
+	ended = !buf || !entries;
+	if (!ended) {
+		got = ntfs_read_sds(ntfs_context,buf,SDSBULKSZ,offset);
+		if (got < 20) {
+			if ((got < 0) && (errno == ENOTSUP))
+				printf("** There is no $SDS in this volume\n");
+			else {
+				printf("** Could not open $SDS, size %d\n",got);
+				errors++;
+				errcnt[0]++;
+			}
+			ended = TRUE;
+		}
+	}
+	while (!ended) {
+		if (opt_v)
+			printf("\nAt offset 0x%lx got %lu bytes\n",
+					(long)offset,(long)got);
+		nr_entries = 0;
+		for (pair=0; pair<got; pair+=0x80000) {
+			avail = (got - pair < 0x40000 ? got - pair : 0x40000);
+			nr_entries = collect_sds_block(entries,nr_entries,
+					&buf[pair],offset + pair,avail,
+					FALSE,&stopped[0],&errcnt[0]);
+			avail = got - pair - 0x40000;
+			if (avail > 0x40000)
+				avail = 0x40000;
+			if (avail > 0)
+				nr_entries = collect_sds_block(entries,
+					nr_entries,&buf[pair + 0x40000],
+					offset + pair + 0x40000,avail,
+					TRUE,&stopped[1],&errcnt[1]);
+		}
+		check_sds_entries(entries,nr_entries);
+		for (i=0; i<nr_entries; i++) {
+			pentry = &entries[i];
+			s = (pentry->second ? 1 : 0);
+			if (failed[s])
+				continue;
+			if (opt_v) {
+				printf("\nAt offset 0x%lx entry size %d bytes\n",
+					(long)pentry->offset,pentry->entrysz);
+				hexdump(&pentry->attr[20],pentry->size,8);
+			}
+			unsane = !valid_sds(pentry->attr,pentry->offset,
+				pentry->entrysz,pentry->size,prevkey[s],
+				pentry->second,&pentry->check);
+			if (!unsane) {
+				if (!get4l(pentry->attr,0)
+				    && !get4l(pentry->attr,4))
+					deleted[s]++;
+				else
+					count[s]++;
+				errcnt[s] += consist_sds(pentry->attr,
+					pentry->offset,pentry->entrysz,
+					pentry->second);
+				if (opt_v >= 2)
+					show_sds_descr(pentry->attr);
+				prevkey[s] = get4l(pentry->attr,4);
+			} else {
+				printf("** Sanity check failed in $SDS-%d - stopping there\n",
+					s + 1);
+				errcnt[s]++;
+				errors++;
+				failed[s] = TRUE;
+				stopped[s] = TRUE;
+			}
+		}
+		offset += got;
+		if ((got < SDSBULKSZ) || (stopped[0] && stopped[1]))
+			ended = TRUE;
+		else {
+			got = ntfs_read_sds(ntfs_context,buf,SDSBULKSZ,offset);
+			if (got <= 0) {
+				if (opt_v)
+					printf("Assuming end of $SDS, got %d bytes\n",got);
+				ended = TRUE;
+			}
+		}
+	}
+	for (s=0; s<2; s++)
+		if (count[s] || deleted[s] || errcnt[s]) {
+			printf("%d valid and %d deleted entries in $SDS-%d\n",
+				count[s],deleted[s],s + 1);
+			printf("%d errors in $SDS-%d\n",errcnt[s],s + 1);
+		}
+	free(entries);
+	free(buf);
+	return (errcnt[0] + errcnt[1]);
+}
+
 /*
  *		Check whether a SII entry is sane
  */
@@ -5533,6 +5864,114 @@ static void audit_summary(void)
 	}
 }
 
+/*
+ *		Check the security key of a file for the parallel audit
+ *
+ *	Called by the mft scanner for each record in use. The key found
+ *	in the standard information is joined to the keys collected from
+ *	the security data, with no index lookup.
+ */
+
+static int audit_file_record(ntfs_volume *vol, const MFT_REF mref,
+		MFT_RECORD *mrec, void *data)
+{
+	struct FILE_AUDIT *faudit;
+	struct SECURITY_DATA *psecurdata;
+	const STANDARD_INFORMATION *si;
+	const ATTR_RECORD *a;
+	const ATTR_RECORD *found;
+	u32 inuse;
+	u32 length;
+	u32 offs;
+	u32 key;
+
+	faudit = (struct FILE_AUDIT*)data;
+	if (!(mrec->flags & MFT_RECORD_IN_USE) || mrec->base_mft_record)
+		return (0);
+	inuse = le32_to_cpu(mrec->bytes_in_use);
+	if (inuse > vol->mft_record_size)
+		inuse = vol->mft_record_size;
+	found = (const ATTR_RECORD*)NULL;
+	offs = le16_to_cpu(mrec->attrs_offset);
+	while (!found && ((offs + 8) <= inuse)) {
+		a = (const ATTR_RECORD*)((const char*)mrec + offs);
+		length = le32_to_cpu(a->length);
+		if ((a->type == AT_END) || !length || ((offs + length) > inuse))
+			break;
+		if ((a->type == AT_STANDARD_INFORMATION) && !a->non_resident)
+			found = a;
+		offs += length;
+	}
+	if (!found
+	    || ((le16_to_cpu(found->value_offset)
+			+ le32_to_cpu(found->value_length))
+			> le32_to_cpu(found->length))
+	    || (le32_to_cpu(found->value_length)
+		< (offsetof(STANDARD_INFORMATION, security_id) + 4))) {
+		faudit->untagged++;
+		return (0);
+	}
+	si = (const STANDARD_INFORMATION*)((const char*)found
+					+ le16_to_cpu(found->value_offset));
+	key = le32_to_cpu(si->security_id);
+	if (!key) {
+		if (opt_v)
+			printf("Inode %lld : no key\n",
+				(long long)MREF(mref));
+		faudit->untagged++;
+	} else {
+		faudit->files++;
+		if (key >= MAXSECURID) {
+			printf("** Inode %lld : key 0x%lx out of range\n",
+				(long long)MREF(mref),(long)key);
+			faudit->errcnt++;
+			errors++;
+		} else {
+			if (!securdata[key >> SECBLKSZ])
+				newblock(key);
+			if (securdata[key >> SECBLKSZ]) {
+				psecurdata = &securdata[key >> SECBLKSZ]
+					[key & ((1 << SECBLKSZ) - 1)];
+				if (!(psecurdata->flags & INSDS1)) {
+					printf("** Inode %lld : key 0x%lx not in $SDS\n",
+						(long long)MREF(mref),
+						(long)key);
+					faudit->errcnt++;
+					errors++;
+				}
+				if (psecurdata->filecount < 0xffff)
+					psecurdata->filecount++;
+			}
+		}
+	}
+	return (0);
+}
+
+/*
+ *		Check the security keys of all files for the parallel audit
+ */
+
+static int audit_files(void)
+{
+	struct FILE_AUDIT faudit;
+
+	printf("\nAuditing the security keys of files\n");
+	faudit.files = 0;
+	faudit.untagged = 0;
+	faudit.errcnt = 0;
+	if (ntfs_mft_scan(ntfs_context->security.vol, opt_j,
+			audit_file_record, &faudit) < 0) {
+		printf("** Could not scan the mft : %s\n",strerror(errno));
+		faudit.errcnt++;
+		errors++;
+	}
+	printf("%lld files with a key and %lld files with no key\n",
+		(long long)faudit.files,(long long)faudit.untagged);
+	if (faudit.errcnt)
+		printf("%d errors in security keys of files\n",faudit.errcnt);
+	return (faudit.errcnt);
+}
+
 /*
  *		       Auditing
  */
@@ -5544,11 +5983,18 @@ static BOOL audit(const char *volume)
 	err = FALSE;
 	if (!getuid() && open_security_api()) {
 		if (open_volume(volume,NTFS_MNT_RDONLY)) {
-			if (audit_sds(FALSE)) err = TRUE;
-			if (audit_sds(TRUE)) err = TRUE;
+			if (opt_j) {
+				if (audit_sds_parallel()) err = TRUE;
+			} else {
+				if (audit_sds(FALSE)) err = TRUE;
+				if (audit_sds(TRUE)) err = TRUE;
+			}
 			if (audit_sii()) err = TRUE;
 			if (audit_sdh()) err = TRUE;
-			if (opt_r) recurseshow("/");
+			if (opt_j) {
+				if (audit_files()) err = TRUE;
+			} else
+				if (opt_r) recurseshow("/");
 
 			audit_summary();
 			close_volume(volume);
@@ -5994,6 +6440,8 @@ static void usage(void)
 	fprintf(stderr,"	display security descriptors within file\n");
 	fprintf(stderr,"   ntfssecaudit -a[rv] volume\n");
 	fprintf(stderr,"	audit the volume\n");
+	fprintf(stderr,"   ntfssecaudit -a[rv] -j threads volume\n");
+	fprintf(stderr,"	audit the volume and the keys of all files in parallel\n");
 	fprintf(stderr,"   ntfssecaudit [-v] volume file\n");
 	fprintf(stderr,"	display the security parameters of file\n");
 	fprintf(stderr,"   ntfssecaudit -r[v] volume directory\n");
@@ -6123,13 +6571,14 @@ static BOOL splitarg(char **split, const char *arg)
 
 static int parse_options(int argc, char *argv[])
 {
-	static const char *sopt = "-abehHrstuvV";
+	static const char *sopt = "-abehHj:rstuvV";
 	static const struct option lopt[] = {
 		{ "audit",	 no_argument,		NULL, 'a' },
 		{ "backup",	 no_argument,		NULL, 'b' },
 		{ "extra",	 no_argument,		NULL, 'e' },
 		{ "help",	 no_argument,		NULL, 'H' },
 		{ "hexdecode",	 no_argument,		NULL, 'h' },
+		{ "threads",	 required_argument,	NULL, 'j' },
 		{ "recurse",	 no_argument,		NULL, 'r' },
 		{ "set",	 no_argument,		NULL, 's' },
 		{ "test",	 no_argument,		NULL, 't' },
@@ -6144,6 +6593,7 @@ static int parse_options(int argc, char *argv[])
 	int ver = 0;
 	int help = 0;
 	int xarg = 0;
+	char *end;
 	CMDS prevcmd;
 
 	opterr = 0; /* We'll handle the errors, thank you. */
@@ -6151,6 +6601,7 @@ static int parse_options(int argc, char *argv[])
 	opt_e = FALSE;
 	opt_r = FALSE;
 	opt_v = 0;
+	opt_j = 0;
 	cmd = CMD_NONE;
 	prevcmd = CMD_NONE;
 
@@ -6178,6 +6629,23 @@ static int parse_options(int argc, char *argv[])
 		case 'H':
 			help++;
 			break;
+		case 'j':
+			opt_j = strtol(optarg, &end, 10);
+			if (*end || (opt_j < 0)) {
+				fprintf(stderr,"Bad number of threads %s\n",
+						optarg);
+				err++;
+			} else {
+#ifdef HAVE_UNISTD_H
+				if (!opt_j)
+					opt_j = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+				if (opt_j < 1)
+					opt_j = 1;
+				if (opt_j > MFT_SCAN_MAX_THREADS)
+					opt_j = MFT_SCAN_MAX_THREADS;
+			}
+			break;
 		case 'r':
 			opt_r = TRUE;
 			break;
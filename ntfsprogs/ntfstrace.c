@@ -0,0 +1,786 @@
+/**
+ * ntfstrace - Part of the Linux-NTFS project.
+ *
+ * This utility fetches the trace of device transfers kept by a mounted
+ * ntfs-3g file system, and summarizes it by origin, user request and
+ * inode.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+#include "types.h"
+#include "trace.h"
+#include "utils.h"
+#include "logging.h"
+
+#define TRACE_XATTR "system.ntfs_trace"
+#define TRACE_INTERVAL 200	/* default ms between fetches */
+#define TRACE_TOP 10		/* default count of inodes shown */
+#define TRACE_HASH_MIN 1024	/* initial entries of aggregates */
+
+static const char *EXEC_NAME = "ntfstrace";
+
+static struct options {
+	char		*mountpoint;	/* Mounted file system traced */
+	char		*input;		/* File of records previously saved */
+	char		*output;	/* File to save the records into */
+	int		 interval;	/* Milliseconds between fetches */
+	int		 duration;	/* Seconds of tracing, 0 until ^C */
+	int		 top;		/* Inodes shown */
+	int		 dump;		/* Print each record */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+} opts;
+
+/*
+ *		Totals of transfers
+ */
+
+struct TOTALS {
+	u64 reads;
+	u64 read_bytes;
+	u64 writes;
+	u64 written_bytes;
+} ;
+
+/*
+ *		Transfers aggregated by a key
+ *
+ *	For an inode, key is the inode number and sub the origin and
+ *	attribute type. For a request, key is the request identifier
+ *	and sub the request code.
+ */
+
+struct AGGREGATE {
+	u64 key;
+	u64 sub;
+	BOOL used;
+	struct TOTALS totals;
+} ;
+
+struct AGGREGATES {
+	struct AGGREGATE *table;
+	u64 size;
+	u64 count;
+} ;
+
+static struct TOTALS origin_totals[NTFS_TRACE_ORIGINS];
+static struct AGGREGATES inodes;
+static struct AGGREGATES requests;
+static u64 records_seen;
+static u64 records_lost;
+static u64 unrequested_bytes;
+static u64 first_time;
+static u64 last_time;
+static volatile BOOL stop_tracing = FALSE;
+
+static const char *origin_names[NTFS_TRACE_ORIGINS] = {
+	"other", "mft", "index", "bitmap", "logfile", "data", "compressed"
+} ;
+
+/*
+ *	Request codes of the FUSE kernel protocol
+ */
+
+static const char *opcode_names[] = {
+	[1] = "lookup", [2] = "forget", [3] = "getattr", [4] = "setattr",
+	[5] = "readlink", [6] = "symlink", [8] = "mknod", [9] = "mkdir",
+	[10] = "unlink", [11] = "rmdir", [12] = "rename", [13] = "link",
+	[14] = "open", [15] = "read", [16] = "write", [17] = "statfs",
+	[18] = "release", [20] = "fsync", [21] = "setxattr",
+	[22] = "getxattr", [23] = "listxattr", [24] = "removexattr",
+	[25] = "flush", [26] = "init", [27] = "opendir", [28] = "readdir",
+	[29] = "releasedir", [30] = "fsyncdir", [31] = "getlk",
+	[32] = "setlk", [33] = "setlkw", [34] = "access", [35] = "create",
+	[36] = "interrupt", [37] = "bmap", [38] = "destroy", [39] = "ioctl",
+	[42] = "batch_forget", [43] = "fallocate", [44] = "readdirplus",
+	[46] = "lseek", [47] = "copy_file_range",
+} ;
+
+#define MAX_OPCODES (int)(sizeof(opcode_names)/sizeof(const char*))
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Summarize the device transfers "
+			"of a mounted file system.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] mountpoint\n"
+		"       %s [options] --read FILE\n\n"
+		"    -t, --time SECONDS   Trace for SECONDS, default until "
+			"interrupted\n"
+		"    -i, --interval MS    Fetch the trace every MS "
+			"milliseconds (default %d)\n"
+		"    -w, --write FILE     Save the records into FILE\n"
+		"    -r, --read FILE      Summarize the records saved in FILE\n"
+		"    -d, --dump           Print each record\n"
+		"    -n, --top NUM        Show the NUM busiest inodes "
+			"(default %d)\n"
+		"\n"
+		"    -q, --quiet          Less output\n"
+		"    -v, --verbose        More output\n"
+		"    -V, --version        Version information\n"
+		"    -h, --help           Print this help\n\n",
+		EXEC_NAME, EXEC_NAME, TRACE_INTERVAL, TRACE_TOP);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  0 Done, the program has to stop
+ *	    1 Error, one or more problems
+ *	   -1 Success, go on
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-dhi:n:qr:t:vVw:";
+	static const struct option lopt[] = {
+		{ "dump",	no_argument,		NULL, 'd' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "interval",	required_argument,	NULL, 'i' },
+		{ "top",	required_argument,	NULL, 'n' },
+		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "read",	required_argument,	NULL, 'r' },
+		{ "time",	required_argument,	NULL, 't' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "version",	no_argument,		NULL, 'V' },
+		{ "write",	required_argument,	NULL, 'w' },
+		{ NULL,		0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	char *end = NULL;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	opts.interval = TRACE_INTERVAL;
+	opts.top = TRACE_TOP;
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.mountpoint) {
+				opts.mountpoint = argv[optind-1];
+			} else {
+				ntfs_log_error("You must specify exactly one "
+					"mount point.\n");
+				err++;
+			}
+			break;
+		case 'd':
+			opts.dump++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'i':
+			opts.interval = strtol(optarg, &end, 0);
+			if ((end && *end) || (opts.interval <= 0))
+				err++;
+			break;
+		case 'n':
+			opts.top = strtol(optarg, &end, 0);
+			if ((end && *end) || (opts.top < 0))
+				err++;
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 'r':
+			opts.input = optarg;
+			break;
+		case 't':
+			opts.duration = strtol(optarg, &end, 0);
+			if ((end && *end) || (opts.duration < 0))
+				err++;
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		case 'V':
+			ver++;
+			break;
+		case 'w':
+			opts.output = optarg;
+			break;
+		default:
+			if ((optopt == 'i') || (optopt == 'n')
+			    || (optopt == 'r') || (optopt == 't')
+			    || (optopt == 'w'))
+				ntfs_log_error("Option '%s' requires an "
+					"argument.\n", argv[optind-1]);
+			else
+				ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind-1]);
+			err++;
+			break;
+		}
+	}
+
+	if (!help && !ver) {
+		if (!opts.mountpoint == !opts.input) {
+			ntfs_log_error("You must specify either a mount point"
+				" or a file to read.\n");
+			err++;
+		}
+		if (opts.input && opts.output) {
+			ntfs_log_error("You may not use --read and --write"
+				" at the same time.\n");
+			err++;
+		}
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose"
+				" at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+		/* tri-state 0 : done, 1 : error, -1 : proceed */
+	return (err ? 1 : (help || ver ? 0 : -1));
+}
+
+/*
+ *		Find or insert the aggregate of a key
+ *
+ *	Returns NULL if there is not enough memory
+ */
+
+static struct TOTALS *aggregate(struct AGGREGATES *aggr, u64 key, u64 sub)
+{
+	struct TOTALS *totals;
+	struct AGGREGATE *old;
+	struct AGGREGATE *p;
+	u64 oldsize;
+	u64 h;
+	u64 i;
+
+	if ((aggr->count + 1)*2 > aggr->size) {
+		old = aggr->table;
+		oldsize = aggr->size;
+		aggr->size = (oldsize ? oldsize*2 : TRACE_HASH_MIN);
+		aggr->table = (struct AGGREGATE*)calloc(aggr->size,
+					sizeof(struct AGGREGATE));
+		if (!aggr->table) {
+			aggr->table = old;
+			aggr->size = oldsize;
+			return ((struct TOTALS*)NULL);
+		}
+		aggr->count = 0;
+		for (i=0; i<oldsize; i++)
+			if (old[i].used) {
+				/* cannot fail, the table is big enough */
+				totals = aggregate(aggr, old[i].key,
+						old[i].sub);
+				*totals = old[i].totals;
+			}
+		free(old);
+	}
+	h = (key*0x9e3779b97f4a7c15ULL + sub) & (aggr->size - 1);
+	while (aggr->table[h].used
+	    && ((aggr->table[h].key != key) || (aggr->table[h].sub != sub)))
+		h = (h + 1) & (aggr->size - 1);
+	p = &aggr->table[h];
+	if (!p->used) {
+		p->used = TRUE;
+		p->key = key;
+		p->sub = sub;
+		aggr->count++;
+	}
+	return (&p->totals);
+}
+
+static void add_totals(struct TOTALS *totals,
+			const struct NTFS_TRACE_RECORD *rec)
+{
+	if (rec->flags & NTFS_TRACE_WRITE) {
+		totals->writes++;
+		totals->written_bytes += rec->count;
+	} else {
+		totals->reads++;
+		totals->read_bytes += rec->count;
+	}
+}
+
+static const char *opcode_name(unsigned int opcode)
+{
+	const char *name;
+
+	name = (const char*)NULL;
+	if (opcode < (unsigned int)MAX_OPCODES)
+		name = opcode_names[opcode];
+	return (name ? name : "?");
+}
+
+static const char *origin_name(unsigned int origin)
+{
+	return (origin < NTFS_TRACE_ORIGINS ? origin_names[origin] : "?");
+}
+
+/*
+ *		Account a record
+ */
+
+static int account(const struct NTFS_TRACE_RECORD *rec)
+{
+	struct TOTALS *totals;
+	int err;
+
+	err = 0;
+	if (!records_seen)
+		first_time = rec->time;
+	last_time = rec->time;
+	records_seen++;
+	if (opts.dump)
+		printf("%llu.%06llu %-5s %-10s inode %-8llu type 0x%-3x "
+			"pos 0x%-10llx count %-7lu request %llu %s\n",
+			(unsigned long long)(rec->time / 1000000),
+			(unsigned long long)(rec->time % 1000000),
+			(rec->flags & NTFS_TRACE_WRITE ? "write" : "read"),
+			origin_name(rec->origin),
+			(unsigned long long)rec->inode,
+			(unsigned int)rec->type,
+			(long long)rec->pos, (unsigned long)rec->count,
+			(unsigned long long)rec->request,
+			(rec->request ? opcode_name(rec->opcode) : "-"));
+	if (rec->origin < NTFS_TRACE_ORIGINS)
+		add_totals(&origin_totals[rec->origin], rec);
+	totals = aggregate(&inodes, rec->inode,
+			((u64)rec->type << 8) | rec->origin);
+	if (totals)
+		add_totals(totals, rec);
+	else
+		err = -1;
+	if (rec->request) {
+		totals = aggregate(&requests, rec->request, rec->opcode);
+		if (totals)
+			add_totals(totals, rec);
+		else
+			err = -1;
+	} else
+		unrequested_bytes += rec->count;
+	return (err);
+}
+
+/*
+ *		Get the size of a block of records from its header
+ *
+ *	Returns the size of the block,
+ *		0 if the header is not complete
+ *		-1 if the header is not valid
+ */
+
+static int block_size(const char *buf, int size)
+{
+	struct NTFS_TRACE_HEADER header;
+	int used;
+
+	used = 0;
+	if (size >= (int)sizeof(header)) {
+		memcpy(&header, buf, sizeof(header));
+		if ((header.magic != NTFS_TRACE_MAGIC)
+		    || (header.version != NTFS_TRACE_VERSION)
+		    || (header.record_size
+				!= sizeof(struct NTFS_TRACE_RECORD))
+		    || (header.count > ((NTFS_TRACE_FETCH_MAX
+				- sizeof(header))
+				/ sizeof(struct NTFS_TRACE_RECORD)))) {
+			ntfs_log_error("Unsupported trace format\n");
+			used = -1;
+		} else
+			used = sizeof(header) + header.count
+					*sizeof(struct NTFS_TRACE_RECORD);
+	}
+	return (used);
+}
+
+/*
+ *		Account a block of records fetched
+ *
+ *	Returns the size of the block, or -1 if it is not valid
+ */
+
+static int account_block(const char *buf, int size)
+{
+	struct NTFS_TRACE_HEADER header;
+	struct NTFS_TRACE_RECORD rec;
+	u32 i;
+	int used;
+
+	used = block_size(buf, size);
+	if (!used || (used > size)) {
+		ntfs_log_error("Truncated trace records\n");
+		used = -1;
+	}
+	if (used < 0)
+		return (-1);
+	memcpy(&header, buf, sizeof(header));
+	records_lost += header.lost;
+	if (header.lost && opts.dump)
+		printf("... %lu records lost\n", (unsigned long)header.lost);
+	for (i=0; i<header.count; i++) {
+		memcpy(&rec, &buf[sizeof(header) + i*sizeof(rec)],
+				sizeof(rec));
+		if (account(&rec)) {
+			ntfs_log_error("Not enough memory for aggregating\n");
+			return (-1);
+		}
+	}
+	return (used);
+}
+
+#ifdef HAVE_SETXATTR
+
+static void interrupted(int sig __attribute__((unused)))
+{
+	stop_tracing = TRUE;
+}
+
+/*
+ *		Fetch the records from a mounted file system until
+ *	interrupted or for the requested time
+ */
+
+static int trace_mounted(FILE *out)
+{
+	char *buf;
+	ssize_t got;
+	long elapsed;
+	int err;
+
+	err = 0;
+	buf = (char*)malloc(NTFS_TRACE_FETCH_MAX);
+	if (!buf) {
+		ntfs_log_error("Not enough memory\n");
+		return (1);
+	}
+	signal(SIGINT, interrupted);
+	signal(SIGTERM, interrupted);
+	elapsed = 0;
+	do {
+		got = getxattr(opts.mountpoint, TRACE_XATTR, buf,
+				NTFS_TRACE_FETCH_MAX);
+		if (got < 0) {
+			if (errno == ENODATA)
+				ntfs_log_error("%s is not the root of a file"
+					" system mounted with option trace\n",
+					opts.mountpoint);
+			else
+				ntfs_log_perror("Could not fetch the trace"
+					" of %s", opts.mountpoint);
+			err = 1;
+		} else {
+			if (out && (fwrite(buf, got, 1, out) != 1)) {
+				ntfs_log_perror("Could not save the records");
+				err = 1;
+			}
+			if (account_block(buf, got) < 0)
+				err = 1;
+			/* wait only when the trace has been drained */
+			if ((got < (NTFS_TRACE_FETCH_MAX
+					- (ssize_t)sizeof(struct NTFS_TRACE_RECORD)))
+			    && !stop_tracing) {
+				usleep(opts.interval*1000);
+				elapsed += opts.interval;
+			}
+		}
+	} while (!err && !stop_tracing
+		&& (!opts.duration || (elapsed < opts.duration*1000L)));
+	free(buf);
+	return (err);
+}
+
+#endif /* HAVE_SETXATTR */
+
+/*
+ *		Account the records saved in a file
+ */
+
+static int trace_saved(void)
+{
+	FILE *in;
+	char *buf;
+	size_t got;
+	size_t kept;
+	int used;
+	int err;
+
+	err = 0;
+	in = fopen(opts.input, "rb");
+	if (!in) {
+		ntfs_log_perror("Could not open %s", opts.input);
+		return (1);
+	}
+	buf = (char*)malloc(NTFS_TRACE_FETCH_MAX);
+	if (!buf) {
+		ntfs_log_error("Not enough memory\n");
+		fclose(in);
+		return (1);
+	}
+	kept = 0;
+	do {
+		got = fread(&buf[kept], 1, NTFS_TRACE_FETCH_MAX - kept, in);
+		kept += got;
+		used = block_size(buf, kept);
+			/* account the complete blocks */
+		while (!err && (used > 0) && (used <= (int)kept)) {
+			if (account_block(buf, used) < 0)
+				err = 1;
+			else {
+				kept -= used;
+				memmove(buf, &buf[used], kept);
+				used = block_size(buf, kept);
+			}
+		}
+		if (used < 0)
+			err = 1;
+	} while (!err && got);
+	if (!err && kept) {
+		ntfs_log_error("Truncated trace in %s\n", opts.input);
+		err = 1;
+	}
+	free(buf);
+	fclose(in);
+	return (err);
+}
+
+static int compare_bytes(const void *p1, const void *p2)
+{
+	const struct AGGREGATE *a1 = (const struct AGGREGATE*)p1;
+	const struct AGGREGATE *a2 = (const struct AGGREGATE*)p2;
+	u64 b1, b2;
+
+	b1 = a1->totals.read_bytes + a1->totals.written_bytes;
+	b2 = a2->totals.read_bytes + a2->totals.written_bytes;
+	return (b1 < b2 ? 1 : (b1 > b2 ? -1 : 0));
+}
+
+/*
+ *		Compact the used entries of aggregates
+ *
+ *	Returns the number of entries, they are no longer hashed
+ */
+
+static u64 compact(struct AGGREGATES *aggr)
+{
+	u64 i, n;
+
+	n = 0;
+	for (i=0; i<aggr->size; i++)
+		if (aggr->table[i].used)
+			aggr->table[n++] = aggr->table[i];
+	return (n);
+}
+
+static void print_totals(const char *name, const struct TOTALS *totals)
+{
+	printf("%-16s %10llu reads %12llu bytes %10llu writes %12llu bytes\n",
+		name,
+		(unsigned long long)totals->reads,
+		(unsigned long long)totals->read_bytes,
+		(unsigned long long)totals->writes,
+		(unsigned long long)totals->written_bytes);
+}
+
+/*
+ *		Print the summary of the records accounted
+ */
+
+static void report(void)
+{
+	struct TOTALS ops[MAX_OPCODES];
+	u64 opcount[MAX_OPCODES];
+	struct TOTALS all;
+	struct AGGREGATE *p;
+	char name[40];
+	u64 bytes;
+	u64 n;
+	u64 i;
+	int k;
+
+	memset(&all, 0, sizeof(all));
+	printf("%llu transfers over %llu.%03llu seconds, %llu lost\n\n",
+		(unsigned long long)records_seen,
+		(unsigned long long)((last_time - first_time) / 1000000),
+		(unsigned long long)((last_time - first_time) / 1000 % 1000),
+		(unsigned long long)records_lost);
+	printf("By origin\n");
+	for (k=0; k<NTFS_TRACE_ORIGINS; k++) {
+		if (origin_totals[k].reads || origin_totals[k].writes)
+			print_totals(origin_names[k], &origin_totals[k]);
+		all.reads += origin_totals[k].reads;
+		all.read_bytes += origin_totals[k].read_bytes;
+		all.writes += origin_totals[k].writes;
+		all.written_bytes += origin_totals[k].written_bytes;
+	}
+	print_totals("total", &all);
+
+	memset(ops, 0, sizeof(ops));
+	memset(opcount, 0, sizeof(opcount));
+	n = (requests.table ? compact(&requests) : 0);
+	for (i=0; i<n; i++) {
+		p = &requests.table[i];
+		if (p->sub < (u64)MAX_OPCODES) {
+			opcount[p->sub]++;
+			ops[p->sub].reads += p->totals.reads;
+			ops[p->sub].read_bytes += p->totals.read_bytes;
+			ops[p->sub].writes += p->totals.writes;
+			ops[p->sub].written_bytes += p->totals.written_bytes;
+		}
+	}
+	printf("\nBy request, for the %llu requests with transfers\n",
+			(unsigned long long)n);
+	for (k=0; k<MAX_OPCODES; k++)
+		if (opcount[k]) {
+			bytes = ops[k].read_bytes + ops[k].written_bytes;
+			snprintf(name, sizeof(name), "%s", opcode_name(k));
+			print_totals(name, &ops[k]);
+			printf("%16s %10llu requests, %llu bytes and %llu.%02llu"
+				" transfers per request\n", "",
+				(unsigned long long)opcount[k],
+				(unsigned long long)(bytes / opcount[k]),
+				(unsigned long long)((ops[k].reads
+					+ ops[k].writes) / opcount[k]),
+				(unsigned long long)((ops[k].reads
+					+ ops[k].writes) * 100 / opcount[k]
+					% 100));
+		}
+	if (unrequested_bytes)
+		printf("%-16s %10s %llu bytes\n", "no request", "",
+			(unsigned long long)unrequested_bytes);
+
+	if (opts.top && inodes.table) {
+		n = compact(&inodes);
+		qsort(inodes.table, n, sizeof(struct AGGREGATE),
+				compare_bytes);
+		printf("\nBusiest inodes\n");
+		for (i=0; (i<n) && (i<(u64)opts.top); i++) {
+			p = &inodes.table[i];
+			snprintf(name, sizeof(name), "%llu %s 0x%x",
+				(unsigned long long)p->key,
+				origin_name(p->sub & 255),
+				(unsigned int)(p->sub >> 8));
+			print_totals(name, &p->totals);
+		}
+	}
+}
+
+/**
+ * main - Begin here
+ *
+ * Start from here.
+ *
+ * Return:  0  Success, the trace was summarized
+ *	    1  Error, something went wrong
+ */
+int main(int argc, char *argv[])
+{
+	FILE *out;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_outerr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+
+	out = (FILE*)NULL;
+	if (opts.output) {
+		out = fopen(opts.output, "wb");
+		if (!out) {
+			ntfs_log_perror("Could not create %s", opts.output);
+			return (1);
+		}
+	}
+	if (opts.input)
+		res = trace_saved();
+	else {
+#ifdef HAVE_SETXATTR
+		res = trace_mounted(out);
+#else
+		ntfs_log_error("Extended attributes are not supported,"
+			" only saved records can be read\n");
+		res = 1;
+#endif
+	}
+	if (out && fclose(out)) {
+		ntfs_log_perror("Could not save the records");
+		res = 1;
+	}
+	if (!opts.quiet)
+		report();
+	free(inodes.table);
+	free(requests.table);
+	return (res);
+}
@@ -72,6 +72,9 @@
 #ifdef HAVE_REGEX_H
 #include <regex.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #if !defined(REG_NOERROR) || (REG_NOERROR != 0)
 #define REG_NOERROR 0
@@ -119,6 +122,8 @@ static short	with_regex;			/* Flag  Regular expression available */
 static short	avoid_duplicate_printing;	/* Flag  No duplicate printing of file infos */
 static range	*ranges;			/* Array containing all Inode-Ranges for undelete */
 static long	nr_entries;			/* Number of range entries */
+static u8	*lcn_bitmap;			/* $Bitmap, while building an index */
+static s64	lcn_bitmap_size;		/* and its size */
 
 #ifdef HAVE_WINDOWS_H
 /*
@@ -412,6 +417,7 @@ static void usage(void)
 		"    -C, --case             Case sensitive matching\n"
 		"    -S, --size RANGE       Match files of this size\n"
 		"    -t, --time SINCE       Last referenced since this time\n"
+		"    -x, --index FILE       Scan through an index of the deleted files\n"
 		"\n"
 		"    -u, --undelete         Undelete mode\n"
 		"    -i, --inodes RANGE     Recover these inodes\n"
@@ -603,7 +609,7 @@ static int parse_time(const char *value, time_t *since)
  */
 static int parse_options(int argc, char *argv[])
 {
-	static const char *sopt = "-b:Cc:d:fh?i:m:o:OPp:sS:t:TuqvV";
+	static const char *sopt = "-b:Cc:d:fh?i:m:o:OPp:sS:t:TuqvVx:";
 	static const struct option lopt[] = {
 		{ "byte",	 required_argument,	NULL, 'b' },
 		{ "case",	 no_argument,		NULL, 'C' },
@@ -611,6 +617,7 @@ static int parse_options(int argc, char *argv[])
 		{ "destination", required_argument,	NULL, 'd' },
 		{ "force",	 no_argument,		NULL, 'f' },
 		{ "help",	 no_argument,		NULL, 'h' },
+		{ "index",	 required_argument,	NULL, 'x' },
 		{ "inodes",	 required_argument,	NULL, 'i' },
 		//{ "interactive", no_argument,		NULL, 'I' },
 		{ "match",	 required_argument,	NULL, 'm' },
@@ -786,12 +793,18 @@ static int parse_options(int argc, char *argv[])
 		case 'V':
 			ver++;
 			break;
+		case 'x':
+			if (!opts.index)
+				opts.index = optarg;
+			else
+				err++;
+			break;
 		default:
 			if (((optopt == 'b') || (optopt == 'c') ||
 			     (optopt == 'd') || (optopt == 'm') ||
 			     (optopt == 'o') || (optopt == 'p') ||
 			     (optopt == 'S') || (optopt == 't') ||
-			     (optopt == 'u')) && (!optarg)) {
+			     (optopt == 'u') || (optopt == 'x')) && (!optarg)) {
 				ntfs_log_error("Option '%s' requires an argument.\n", argv[optind-1]);
 			} else {
 				ntfs_log_error("Unknown option '%s'.\n", argv[optind-1]);
@@ -851,6 +864,10 @@ static int parse_options(int argc, char *argv[])
 				ntfs_log_error("Copy can only be used with --output and --destination.\n");
 				err++;
 			}
+			if (opts.index) {
+				ntfs_log_error("The --index option doesn't make sense with --copy\n");
+				err++;
+			}
 			break;
 		default:
 			ntfs_log_error("You can only select one of Scan, Undelete or Copy.\n");
@@ -1144,7 +1161,7 @@ static struct filename *rescue_name(MFT_RECORD *mft, ntfs_attr_search_ctx *ctx)
  * Return:  n  The number of $FILENAME attributes found
  *	   -1  Error
  */
-static int get_filenames(struct ufile *file, ntfs_volume* vol)
+static int get_filenames(struct ufile *file, ntfs_volume* vol, BOOL parents)
 {
 	ATTR_RECORD *rec;
 	FILE_NAME_ATTR *attr;
@@ -1192,11 +1209,10 @@ static int get_filenames(struct ufile *file, ntfs_volume* vol)
 		}
 
 		name->parent_name = NULL;
+		name->parent_mref = attr->parent_directory;
 
-		if (opts.parent) {
-			name->parent_mref = attr->parent_directory;
+		if (parents)
 			get_parent_name(name, vol);
-		}
 
 		if (name->name_space < space) {
 			file->pref_name = name->name;
@@ -1326,6 +1342,47 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
 	return count;
 }
 
+/**
+ * parse_record - Gather the information from an MFT record
+ * @file:     The file object, with the raw record in file->mft
+ * @vol:      An ntfs volume obtained from ntfs_mount
+ * @parents:  Also look for the names of the parent directories
+ *
+ * Only the parent names require reading from the volume, so when @parents
+ * is not set, several records may be parsed concurrently.
+ *
+ * Return:  none
+ */
+static void parse_record(struct ufile *file, ntfs_volume *vol, BOOL parents)
+{
+	ATTR_RECORD *attr10, *attr20, *attr90;
+
+	attr10 = find_first_attribute(AT_STANDARD_INFORMATION,	file->mft);
+	attr20 = find_first_attribute(AT_ATTRIBUTE_LIST,	file->mft);
+	attr90 = find_first_attribute(AT_INDEX_ROOT,		file->mft);
+
+	ntfs_log_debug("Attributes present: %s %s %s.\n", attr10?"0x10":"",
+			attr20?"0x20":"", attr90?"0x90":"");
+
+	if (attr10) {
+		STANDARD_INFORMATION *si;
+		si = (STANDARD_INFORMATION *) ((char *) attr10 + le16_to_cpu(attr10->value_offset));
+		file->date = ntfs2timespec(si->last_data_change_time).tv_sec;
+	}
+
+	if (attr20 || !attr10)
+		file->attr_list = 1;
+	if (attr90)
+		file->directory = 1;
+
+	if (get_filenames(file, vol, parents) < 0) {
+		ntfs_log_error("ERROR: Couldn't get filenames.\n");
+	}
+	if (get_data(file, vol) < 0) {
+		ntfs_log_error("ERROR: Couldn't get data streams.\n");
+	}
+}
+
 /**
  * read_record - Read an MFT record into memory
  * @vol:     An ntfs volume obtained from ntfs_mount
@@ -1339,7 +1396,6 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
  */
 static struct ufile * read_record(ntfs_volume *vol, long long record)
 {
-	ATTR_RECORD *attr10, *attr20, *attr90;
 	struct ufile *file;
 	ntfs_attr *mft;
 	u32 log_levels;
@@ -1383,36 +1439,35 @@ static struct ufile * read_record(ntfs_volume *vol, long long record)
 
 	/* disable errors logging, while examining suspicious records */
 	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
-	attr10 = find_first_attribute(AT_STANDARD_INFORMATION,	file->mft);
-	attr20 = find_first_attribute(AT_ATTRIBUTE_LIST,	file->mft);
-	attr90 = find_first_attribute(AT_INDEX_ROOT,		file->mft);
-
-	ntfs_log_debug("Attributes present: %s %s %s.\n", attr10?"0x10":"",
-			attr20?"0x20":"", attr90?"0x90":"");
-
-	if (attr10) {
-		STANDARD_INFORMATION *si;
-		si = (STANDARD_INFORMATION *) ((char *) attr10 + le16_to_cpu(attr10->value_offset));
-		file->date = ntfs2timespec(si->last_data_change_time).tv_sec;
-	}
-
-	if (attr20 || !attr10)
-		file->attr_list = 1;
-	if (attr90)
-		file->directory = 1;
-
-	if (get_filenames(file, vol) < 0) {
-		ntfs_log_error("ERROR: Couldn't get filenames.\n");
-	}
-	if (get_data(file, vol) < 0) {
-		ntfs_log_error("ERROR: Couldn't get data streams.\n");
-	}
+	parse_record(file, vol, opts.parent);
 	/* restore errors logging */
 	ntfs_log_set_levels(log_levels);
 
 	return file;
 }
 
+/**
+ * cluster_in_use - Determine if a cluster is in use
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ * @lcn:  The Logical Cluster Number to test
+ *
+ * While building an index, the whole of $Bitmap is held in memory, so that
+ * several records can be examined concurrently.  Otherwise the cluster is
+ * tested by reading the relevant part of $Bitmap.
+ *
+ * Return:  1  Cluster is in use
+ *	    0  Cluster is free space
+ *	   -1  Error occurred
+ */
+static int cluster_in_use(ntfs_volume *vol, long long lcn)
+{
+	if (!lcn_bitmap)
+		return (utils_cluster_in_use(vol, lcn));
+	if ((lcn < 0) || ((lcn >> 3) >= lcn_bitmap_size))
+		return (1);
+	return ((lcn_bitmap[lcn >> 3] >> (lcn & 7)) & 1);
+}
+
 /**
  * calc_percentage - Calculate how much of the file is recoverable
  * @file:  The file object to work with
@@ -1521,7 +1576,7 @@ static int calc_percentage(struct ufile *file, ntfs_volume *vol)
 			end   = rl[i].lcn + rl[i].length;
 
 			for (j = start; j < end; j++) {
-				if (utils_cluster_in_use(vol, j))
+				if (cluster_in_use(vol, j))
 					clusters_inuse++;
 				else
 					clusters_free++;
@@ -1662,40 +1717,23 @@ static void dump_record(struct ufile *file)
 }
 
 /**
- * list_record - Print a one line summary of the file
- * @file:  The file to work with
- *
- * Print a one line description of a file.
- *
- *   Inode    Flags  %age     Date  Time        Size  Filename
- *
- * The output will contain the file's inode number (MFT Record), some flags,
- * the percentage of the file that is recoverable, the last modification date,
- * the size and the filename.
- *
- * The flags are F/D = File/Directory, N/R = Data is (Non-)Resident,
- * C = Compressed, E = Encrypted, ! = Metadata may span multiple records.
- *
- * N.B.  The file size is stored in many forms in several attributes.   This
- *       display the largest it finds.
- *
- * N.B.  If the filename is missing, or couldn't be converted to the current
- *       locale, "<none>" will be displayed.
+ * list_flags - Gather what the one line summary shows about a file
+ * @file:      The file to work with
+ * @flags:     Receives the four flag characters
+ * @psize:     Receives the largest size of the data streams
+ * @ppercent:  Receives the recoverable percentage of the unnamed stream
  *
  * Return:  none
  */
-static void list_record(struct ufile *file)
+static void list_flags(struct ufile *file, char *flags, long long *psize,
+			int *ppercent)
 {
-	char buffer[20];
 	struct ntfs_list_head *item;
-	const char *name = NULL;
 	long long size = 0;
 	int percent = 0;
 
 	char flagd = '.', flagr = '.', flagc = '.', flagx = '.';
 
-	strftime(buffer, sizeof(buffer), "%F %R", localtime(&file->date));
-
 	if (file->attr_list)
 		flagx = '!';
 
@@ -1724,13 +1762,56 @@ static void list_record(struct ufile *file)
 		size = max(size, d->size_init);
 	}
 
+	flags[0] = flagd;
+	flags[1] = flagr;
+	flags[2] = flagc;
+	flags[3] = flagx;
+	*psize = size;
+	*ppercent = percent;
+}
+
+/**
+ * list_record - Print a one line summary of the file
+ * @file:  The file to work with
+ *
+ * Print a one line description of a file.
+ *
+ *   Inode    Flags  %age     Date  Time        Size  Filename
+ *
+ * The output will contain the file's inode number (MFT Record), some flags,
+ * the percentage of the file that is recoverable, the last modification date,
+ * the size and the filename.
+ *
+ * The flags are F/D = File/Directory, N/R = Data is (Non-)Resident,
+ * C = Compressed, E = Encrypted, ! = Metadata may span multiple records.
+ *
+ * N.B.  The file size is stored in many forms in several attributes.   This
+ *       display the largest it finds.
+ *
+ * N.B.  If the filename is missing, or couldn't be converted to the current
+ *       locale, "<none>" will be displayed.
+ *
+ * Return:  none
+ */
+static void list_record(struct ufile *file)
+{
+	char buffer[20];
+	char flags[4];
+	const char *name = NULL;
+	long long size;
+	int percent;
+
+	strftime(buffer, sizeof(buffer), "%F %R", localtime(&file->date));
+
+	list_flags(file, flags, &size, &percent);
+
 	if (file->pref_name)
 		name = file->pref_name;
 	else
 		name = NONE;
 
 	ntfs_log_quiet("%-8lld %c%c%c%c   %3d%%  %s %9lld  %s\n",
-		file->inode, flagd, flagr, flagc, flagx,
+		file->inode, flags[0], flags[1], flags[2], flags[3],
 		percent, buffer, size, name);
 
 }
@@ -2202,6 +2283,807 @@ free:
 	return result;
 }
 
+/*
+ *		Indexing the deleted records
+ *
+ *	A single pass over the MFT records an entry for each deleted record
+ *	into an index file, so that the later scans and undeletions by name
+ *	only read the index, and the records which are actually selected.
+ *
+ *	The records are read from the MFT by large batches, and parsed by
+ *	a pool of threads when possible. As the library cannot be used by
+ *	several threads, the parsing only makes use of the raw records and
+ *	of an in-memory copy of $Bitmap, and the parent names, which require
+ *	reading other records, are not indexed.
+ *
+ *	Each batch of records gets its encoded entries, which are written
+ *	to the index in the order the batches were read.
+ */
+
+#define INDEX_VERSION 1
+#define INDEX_BATCH_RECORDS 1024	/* records read at once */
+#define INDEX_MAX_THREADS 16
+#define INDEX_NO_NAME 0xff
+
+static const char INDEX_MAGIC[] = "NTFSUNDX";
+
+enum { BATCH_FREE, BATCH_FULL, BATCH_BUSY, BATCH_DONE } ;
+
+struct INDEX_BATCH {
+	u8 *records;		/* raw records, from the first one */
+	s64 first;		/* first record in the buffer */
+	s64 inodes[INDEX_BATCH_RECORDS];	/* deleted records to index */
+	int count;
+	int state;
+	u8 *out;		/* encoded entries */
+	size_t out_size;
+	size_t out_alloc;
+	s64 nr_entries;
+	BOOL failed;
+} ;
+
+struct INDEX_POOL {
+	ntfs_volume *vol;
+	FILE *fout;
+	s64 nr_entries;		/* entries written */
+	BOOL failed;
+	struct INDEX_BATCH batches[2*INDEX_MAX_THREADS];
+	int nr_batches;
+	int current;		/* batch being filled */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t threads[INDEX_MAX_THREADS];
+	int nr_threads;
+	BOOL quit;
+#endif
+} ;
+
+/**
+ * compile_match - Compile the regex for matching the filenames
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ * @re:   The regular expression object to set up
+ *
+ * Return:  0  Success
+ *	   -1  Error
+ */
+static int compile_match(ntfs_volume *vol, regex_t *re)
+{
+	int flags = REG_NOSUB;
+
+	if (!opts.match_case)
+		flags |= REG_ICASE;
+	if (regcomp(re, opts.match, flags)) {
+		ntfs_log_error("ERROR: Couldn't create a regex.\n");
+		return -1;
+	}
+#ifndef HAVE_REGEX_H
+	re->upcase = vol->upcase;
+	re->upcase_len = vol->upcase_len;
+#else
+	(void)vol;
+#endif
+	return 0;
+}
+
+/**
+ * index_state - Get the state of the volume an index is valid for
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ * @hdr:  The index header to fill in
+ *
+ * An index is only valid for the volume it was built from, and as long as
+ * no MFT record was allocated or freed, which is checked by a hash of
+ * $MFT/$BITMAP.
+ *
+ * Return:  0  Success
+ *	   -1  Error
+ */
+static int index_state(ntfs_volume *vol, struct undel_index_header *hdr)
+{
+	const int BUFSIZE = 8192;
+	ntfs_attr *attr;
+	char *buffer;
+	u64 hash;
+	s64 pos, size;
+	int i;
+
+	attr = ntfs_attr_open(vol->mft_ni, AT_BITMAP, AT_UNNAMED, 0);
+	if (!attr) {
+		ntfs_log_perror("ERROR: Couldn't open $MFT/$BITMAP");
+		return -1;
+	}
+	buffer = malloc(BUFSIZE);
+	if (!buffer) {
+		ntfs_log_error("ERROR: Couldn't allocate memory in index_state()\n");
+		ntfs_attr_close(attr);
+		return -1;
+	}
+	hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	size = 0;
+	for (pos = 0; pos < attr->initialized_size; pos += size) {
+		size = ntfs_attr_pread(attr, pos,
+			min(attr->initialized_size - pos, BUFSIZE), buffer);
+		if (size <= 0)
+			break;
+		for (i = 0; i < size; i++) {
+			hash ^= (u8)buffer[i];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	free(buffer);
+	ntfs_attr_close(attr);
+	if (size < 0) {
+		ntfs_log_perror("ERROR: Couldn't read $MFT/$BITMAP");
+		return -1;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->version = const_cpu_to_le32(INDEX_VERSION);
+	hdr->mft_record_size = cpu_to_le32(vol->mft_record_size);
+	hdr->volume_serial = cpu_to_le64(vol->vol_serial);
+	hdr->nr_mft_records = cpu_to_le64(vol->mft_na->initialized_size >>
+			vol->mft_record_size_bits);
+	hdr->mft_bitmap_hash = cpu_to_le64(hash);
+	return 0;
+}
+
+/**
+ * index_append - Append some data to the entries encoded for a batch
+ * @batch:  The batch being indexed
+ * @data:   The data to append
+ * @size:   Its size
+ *
+ * Return:  none, an allocation failure is recorded in the batch
+ */
+static void index_append(struct INDEX_BATCH *batch, const void *data,
+			size_t size)
+{
+	u8 *out;
+	size_t alloc;
+
+	if (batch->failed)
+		return;
+	if ((batch->out_size + size) > batch->out_alloc) {
+		alloc = 2*batch->out_alloc + size + 4096;
+		out = realloc(batch->out, alloc);
+		if (!out) {
+			ntfs_log_error("ERROR: Couldn't allocate memory in "
+					"index_append()\n");
+			batch->failed = TRUE;
+			return;
+		}
+		batch->out = out;
+		batch->out_alloc = alloc;
+	}
+	memcpy(&batch->out[batch->out_size], data, size);
+	batch->out_size += size;
+}
+
+/**
+ * index_record - Encode the index entry of a deleted record
+ * @vol:    An ntfs volume obtained from ntfs_mount
+ * @batch:  The batch being indexed
+ * @inode:  The record number
+ * @mrec:   The raw record
+ *
+ * Return:  none, an allocation failure is recorded in the batch
+ */
+static void index_record(ntfs_volume *vol, struct INDEX_BATCH *batch,
+			s64 inode, MFT_RECORD *mrec)
+{
+	struct undel_index_entry entry;
+	struct ntfs_list_head *item;
+	struct filename *f;
+	struct ufile *file;
+	long long size;
+	int percent;
+	u8 len;
+	int n;
+
+	file = calloc(1, sizeof(*file));
+	if (!file) {
+		ntfs_log_error("ERROR: Couldn't allocate memory in "
+				"index_record()\n");
+		batch->failed = TRUE;
+		return;
+	}
+	NTFS_INIT_LIST_HEAD(&file->name);
+	NTFS_INIT_LIST_HEAD(&file->data);
+	file->inode = inode;
+	file->mft = mrec;
+	parse_record(file, vol, FALSE);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.inode = cpu_to_le64(inode);
+	entry.date = cpu_to_sle64(file->date);
+	entry.max_size = cpu_to_sle64(file->max_size);
+	entry.percent = calc_percentage(file, vol);
+	list_flags(file, entry.flags, &size, &percent);
+	entry.size = cpu_to_sle64(size);
+	entry.data_percent = percent;
+	entry.pref_name = INDEX_NO_NAME;
+	n = 0;
+	ntfs_list_for_each(item, &file->name) {
+		f = ntfs_list_entry(item, struct filename, list);
+		if (n == INDEX_NO_NAME)
+			break;
+		if (file->pref_name && (f->name == file->pref_name)) {
+			entry.pref_name = n;
+			entry.parent_mref = f->parent_mref;
+		}
+		n++;
+	}
+	entry.nr_names = n;
+	index_append(batch, &entry, sizeof(entry));
+
+	n = 0;
+	ntfs_list_for_each(item, &file->name) {
+		f = ntfs_list_entry(item, struct filename, list);
+		if (n++ == INDEX_NO_NAME)
+			break;
+		len = f->uname_len;
+		index_append(batch, &len, 1);
+		index_append(batch, f->uname, len*sizeof(ntfschar));
+	}
+	batch->nr_entries++;
+
+	file->mft = NULL;	/* owned by the batch */
+	free_file(file);
+}
+
+/**
+ * index_batch - Encode the index entries of a batch of deleted records
+ * @vol:    An ntfs volume obtained from ntfs_mount
+ * @batch:  The batch to index
+ *
+ * Return:  none
+ */
+static void index_batch(ntfs_volume *vol, struct INDEX_BATCH *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->count; i++)
+		index_record(vol, batch, batch->inodes[i],
+			(MFT_RECORD*)&batch->records[(batch->inodes[i]
+				- batch->first) << vol->mft_record_size_bits]);
+}
+
+/**
+ * flush_batch - Write the index entries of a batch
+ * @pool:   The indexing pool
+ * @batch:  The batch which was indexed
+ *
+ * Return:  none, a failure is recorded in the pool
+ */
+static void flush_batch(struct INDEX_POOL *pool, struct INDEX_BATCH *batch)
+{
+	if (batch->failed)
+		pool->failed = TRUE;
+	else if (batch->out_size && (fwrite(batch->out, batch->out_size, 1,
+				pool->fout) != 1)) {
+		ntfs_log_perror("ERROR: Couldn't write to the index");
+		pool->failed = TRUE;
+	}
+	pool->nr_entries += batch->nr_entries;
+	batch->out_size = 0;
+	batch->nr_entries = 0;
+	batch->count = 0;
+	batch->failed = FALSE;
+	batch->state = BATCH_FREE;
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static void *index_worker(void *arg)
+{
+	struct INDEX_POOL *pool = (struct INDEX_POOL*)arg;
+	struct INDEX_BATCH *batch;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		batch = (struct INDEX_BATCH*)NULL;
+		for (i = 0; (i < pool->nr_batches) && !batch; i++)
+			if (pool->batches[i].state == BATCH_FULL)
+				batch = &pool->batches[i];
+		if (batch) {
+			batch->state = BATCH_BUSY;
+			pthread_mutex_unlock(&pool->lock);
+			index_batch(pool->vol, batch);
+			pthread_mutex_lock(&pool->lock);
+			batch->state = BATCH_DONE;
+			pthread_cond_broadcast(&pool->cond);
+		} else {
+			if (pool->quit)
+				break;
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Start the threads parsing the records
+ *
+ *	Returns the number of threads started, 0 when parsing within
+ *	the calling thread.
+ */
+
+static int start_index_pool(struct INDEX_POOL *pool, int threads)
+{
+	int i;
+
+	pool->nr_threads = 0;
+	pool->quit = FALSE;
+	if (threads > INDEX_MAX_THREADS)
+		threads = INDEX_MAX_THREADS;
+	if ((threads < 2)
+	    || pthread_mutex_init(&pool->lock, NULL))
+		return (0);
+	if (pthread_cond_init(&pool->cond, NULL)) {
+		pthread_mutex_destroy(&pool->lock);
+		return (0);
+	}
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+					index_worker, pool))
+			break;
+		pool->nr_threads++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (!pool->nr_threads) {
+		pthread_cond_destroy(&pool->cond);
+		pthread_mutex_destroy(&pool->lock);
+	}
+	return (pool->nr_threads);
+}
+
+/*
+ *		Hand over the current batch to the threads, and get the
+ *	next one, after writing the entries it was last used for.
+ */
+
+static void post_index_batch(struct INDEX_POOL *pool)
+{
+	struct INDEX_BATCH *batch;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->batches[pool->current].state = BATCH_FULL;
+	pthread_cond_broadcast(&pool->cond);
+	pool->current = (pool->current + 1) % pool->nr_batches;
+	batch = &pool->batches[pool->current];
+	while ((batch->state != BATCH_FREE) && (batch->state != BATCH_DONE))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	if (batch->state == BATCH_DONE)
+		flush_batch(pool, batch);
+}
+
+/*
+ *		Stop the threads and write the pending entries
+ */
+
+static void stop_index_pool(struct INDEX_POOL *pool)
+{
+	struct INDEX_BATCH *batch;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = TRUE;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+		/* the oldest batches follow the one being filled */
+	for (i = 1; i <= pool->nr_batches; i++) {
+		batch = &pool->batches[(pool->current + i) % pool->nr_batches];
+		if (batch->state == BATCH_DONE)
+			flush_batch(pool, batch);
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/**
+ * load_lcn_bitmap - Get a copy of $Bitmap into memory
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ *
+ * Return:  0  Success
+ *	   -1  Error, the clusters will be checked by reading $Bitmap
+ */
+static int load_lcn_bitmap(ntfs_volume *vol)
+{
+	ntfs_attr *attr;
+	s64 size;
+
+	attr = ntfs_attr_open(vol->lcnbmp_ni, AT_DATA, AT_UNNAMED, 0);
+	if (!attr) {
+		ntfs_log_perror("Couldn't open $Bitmap");
+		return -1;
+	}
+	size = (vol->nr_clusters + 7) >> 3;
+	lcn_bitmap = malloc(size);
+	if (lcn_bitmap) {
+			/* beyond a short read, the clusters are in use */
+		memset(lcn_bitmap, 0xff, size);
+		if (ntfs_attr_pread(attr, 0, min(size,
+				attr->initialized_size), lcn_bitmap) < 0) {
+			ntfs_log_perror("Couldn't read $Bitmap");
+			free(lcn_bitmap);
+			lcn_bitmap = NULL;
+		} else
+			lcn_bitmap_size = size;
+	}
+	ntfs_attr_close(attr);
+	return (lcn_bitmap ? 0 : -1);
+}
+
+/**
+ * build_index - Record all the deleted records into an index file
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ * @hdr:  The header of the index, describing the volume
+ *
+ * Read the MFT by batches of records, and encode an entry for each record
+ * which is free in $MFT/$BITMAP.
+ *
+ * Return:  0  Success
+ *	   -1  Error, the index file is removed
+ */
+static int build_index(ntfs_volume *vol, struct undel_index_header *hdr)
+{
+	struct INDEX_POOL pool;
+	struct INDEX_BATCH *batch;
+	u8 bits[INDEX_BATCH_RECORDS/8];
+	ntfs_attr *mft, *bmp;
+	s64 nr_mft_records;
+	s64 first, count, got, i;
+	u32 log_levels;
+	int threads;
+	int err;
+
+	nr_mft_records = le64_to_cpu(hdr->nr_mft_records);
+	memset(&pool, 0, sizeof(pool));
+	pool.vol = vol;
+	pool.fout = fopen(opts.index, "wb");
+	if (!pool.fout) {
+		ntfs_log_perror("ERROR: Couldn't create the index '%s'",
+				opts.index);
+		return -1;
+	}
+	if (fwrite(hdr, sizeof(*hdr), 1, pool.fout) != 1)
+		pool.failed = TRUE;
+
+	mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
+	bmp = ntfs_attr_open(vol->mft_ni, AT_BITMAP, AT_UNNAMED, 0);
+	if (!mft || !bmp) {
+		ntfs_log_perror("ERROR: Couldn't open $MFT");
+		pool.failed = TRUE;
+	}
+
+	threads = 0;
+	if (!load_lcn_bitmap(vol)) {
+#ifdef HAVE_PTHREAD_H
+		threads = start_index_pool(&pool,
+					sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+	}
+	pool.nr_batches = (threads ? 2*threads : 1);
+	for (i = 0; i < pool.nr_batches; i++) {
+		pool.batches[i].records = malloc((size_t)INDEX_BATCH_RECORDS
+					<< vol->mft_record_size_bits);
+		if (!pool.batches[i].records) {
+			ntfs_log_error("ERROR: Couldn't allocate memory in "
+					"build_index()\n");
+			pool.failed = TRUE;
+		}
+	}
+
+	NVolSetNoFixupWarn(vol);
+	/* disable errors logging, while examining suspicious records */
+	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
+	for (first = 0; !pool.failed && (first < nr_mft_records);
+			first += INDEX_BATCH_RECORDS) {
+		count = min(nr_mft_records - first, INDEX_BATCH_RECORDS);
+			/* records beyond $MFT/$BITMAP are not scanned */
+		got = ntfs_attr_pread(bmp, first >> 3, (count + 7) >> 3, bits);
+		if (got <= 0)
+			break;
+		count = min(count, got << 3);
+		batch = &pool.batches[pool.current];
+		batch->first = first;
+		batch->count = 0;
+		for (i = 0; i < count; i++)
+			if (!(bits[i >> 3] & (1 << (i & 7))))
+				batch->inodes[batch->count++] = first + i;
+		if (!batch->count)
+			continue;
+		got = ntfs_attr_mst_pread(mft, first << vol->mft_record_size_bits,
+				batch->inodes[batch->count - 1] - first + 1,
+				vol->mft_record_size, batch->records);
+		while (batch->count
+		    && (batch->inodes[batch->count - 1] - first >= got)) {
+			batch->count--;
+			ntfs_log_error("Couldn't read MFT Record %lld.\n",
+					(long long)batch->inodes[batch->count]);
+		}
+#ifdef HAVE_PTHREAD_H
+		if (threads) {
+			post_index_batch(&pool);
+			continue;
+		}
+#endif
+		index_batch(vol, batch);
+		flush_batch(&pool, batch);
+	}
+	/* restore errors logging */
+	ntfs_log_set_levels(log_levels);
+#ifdef HAVE_PTHREAD_H
+	if (threads)
+		stop_index_pool(&pool);
+#endif
+	NVolClearNoFixupWarn(vol);
+
+	for (i = 0; i < pool.nr_batches; i++) {
+		free(pool.batches[i].records);
+		free(pool.batches[i].out);
+	}
+	free(lcn_bitmap);
+	lcn_bitmap = NULL;
+	if (bmp)
+		ntfs_attr_close(bmp);
+	if (mft)
+		ntfs_attr_close(mft);
+
+	hdr->nr_entries = cpu_to_le64(pool.nr_entries);
+	if (!pool.failed
+	    && (fseek(pool.fout, 0, SEEK_SET)
+		|| (fwrite(hdr, sizeof(*hdr), 1, pool.fout) != 1))) {
+		ntfs_log_perror("ERROR: Couldn't write to the index");
+		pool.failed = TRUE;
+	}
+	err = fclose(pool.fout);
+	if (pool.failed || err) {
+		unlink(opts.index);
+		return -1;
+	}
+	ntfs_log_verbose("Indexed %lld deleted records from %lld.\n",
+			(long long)pool.nr_entries, (long long)nr_mft_records);
+	return 0;
+}
+
+/**
+ * index_name_match - Does an index entry have a name matching a regex
+ * @re:        The regular expression object
+ * @names:     The filenames of the entry
+ * @lengths:   The lengths of the filenames
+ * @nr_names:  The number of filenames
+ *
+ * Return:  1  There is a matching filename.
+ *	    0  There is no match.
+ */
+static int index_name_match(regex_t *re, ntfschar **names, const u8 *lengths,
+			int nr_names)
+{
+	int result;
+	int i;
+#ifdef HAVE_REGEX_H
+	char *name;
+#endif
+
+	for (i = 0; i < nr_names; i++) {
+#ifdef HAVE_REGEX_H
+		name = NULL;
+		if (ntfs_ucstombs(names[i], lengths[i], &name, 0) < 0)
+			continue;
+		result = regexec(re, name, 0, NULL, 0);
+		free(name);
+#else
+		result = regexec(re, names[i], lengths[i], NULL, 0);
+#endif
+		if (result < 0) {
+			ntfs_log_perror("Couldn't compare filename with regex");
+			return 0;
+		} else if (result == REG_NOERROR)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * list_entry - Print a one line summary of an index entry
+ * @entry:  The index entry
+ * @name:   Its preferred filename, or NULL
+ *
+ * The output is the same as list_record() for the indexed record.
+ *
+ * Return:  none
+ */
+static void list_entry(const struct undel_index_entry *entry, const char *name)
+{
+	char buffer[20];
+	time_t date;
+
+	date = sle64_to_cpu(entry->date);
+	strftime(buffer, sizeof(buffer), "%F %R", localtime(&date));
+
+	ntfs_log_quiet("%-8lld %c%c%c%c   %3d%%  %s %9lld  %s\n",
+		(long long)le64_to_cpu(entry->inode), entry->flags[0],
+		entry->flags[1], entry->flags[2], entry->flags[3],
+		entry->data_percent, buffer,
+		(long long)sle64_to_cpu(entry->size), (name ? name : NONE));
+}
+
+/**
+ * query_index - Search an index for files that could be undeleted
+ * @vol:         An ntfs volume obtained from ntfs_mount
+ * @fin:         The index file, positioned after its header
+ * @nr_entries:  The number of entries in the index
+ *
+ * Apply the filters of scan_disk() to the index entries.  Only the records
+ * which are listed verbosely or undeleted are read from the volume.
+ *
+ * Return:  -1  Error, something went wrong
+ *	     n  Success, the number of recoverable files
+ */
+static int query_index(ntfs_volume *vol, FILE *fin, s64 nr_entries)
+{
+	struct undel_index_entry entry;
+	ntfschar *names[INDEX_NO_NAME];
+	u8 lengths[INDEX_NO_NAME];
+	ntfschar *buffer;
+	struct ufile *file;
+	char *name;
+	time_t date;
+	s64 max_size;
+	s64 n;
+	int results = 0;
+	int percent;
+	int i;
+	BOOL ok;
+	regex_t re;
+
+	buffer = malloc(INDEX_NO_NAME*256*sizeof(ntfschar));
+	if (!buffer) {
+		ntfs_log_error("ERROR: Couldn't allocate memory in query_index()\n");
+		return -1;
+	}
+	for (i = 0; i < INDEX_NO_NAME; i++)
+		names[i] = &buffer[i*256];
+
+	if (opts.match && compile_match(vol, &re)) {
+		free(buffer);
+		return -1;
+	}
+
+	ntfs_log_quiet("Inode    Flags  %%age     Date    Time       Size  Filename\n");
+	ntfs_log_quiet("-----------------------------------------------------------------------\n");
+	ok = TRUE;
+	for (n = 0; ok && (n < nr_entries); n++) {
+		ok = fread(&entry, sizeof(entry), 1, fin) == 1;
+		for (i = 0; ok && (i < entry.nr_names); i++)
+			ok = (fread(&lengths[i], 1, 1, fin) == 1)
+				&& (!lengths[i]
+				    || (fread(names[i], lengths[i]
+					*sizeof(ntfschar), 1, fin) == 1));
+		if (!ok) {
+			ntfs_log_error("ERROR: The index '%s' is truncated.\n",
+					opts.index);
+			results = -1;
+			break;
+		}
+
+		date = sle64_to_cpu(entry.date);
+		max_size = sle64_to_cpu(entry.max_size);
+		if ((opts.since > 0) && (date <= opts.since))
+			continue;
+		if (opts.match && !index_name_match(&re, names, lengths,
+					entry.nr_names))
+			continue;
+		if (opts.size_begin && (opts.size_begin > max_size))
+			continue;
+		if (opts.size_end && (opts.size_end < max_size))
+			continue;
+
+		percent = entry.percent;
+		if ((opts.percent == -1) || (percent >= opts.percent)) {
+			if (opts.verbose) {
+				file = read_record(vol,
+						le64_to_cpu(entry.inode));
+				if (file) {
+					calc_percentage(file, vol);
+					dump_record(file);
+					free_file(file);
+				}
+			} else {
+				name = NULL;
+				if ((entry.pref_name < entry.nr_names)
+				    && (ntfs_ucstombs(names[entry.pref_name],
+						lengths[entry.pref_name],
+						&name, 0) < 0))
+					name = NULL;
+				list_entry(&entry, name);
+				free(name);
+			}
+
+			/* Was -u specified with no inode
+			   so undelete file by regex */
+			if (opts.mode == MODE_UNDELETE) {
+				if  (!undelete_file(vol,
+						le64_to_cpu(entry.inode)))
+					ntfs_log_verbose("ERROR: Failed to undelete "
+						  "inode %lli\n!",
+						  (long long)le64_to_cpu(entry.inode));
+				ntfs_log_info("\n");
+			}
+		}
+		if (((opts.percent == -1) && (percent > 0)) ||
+		    ((opts.percent > 0)  && (percent >= opts.percent))) {
+			results++;
+		}
+	}
+	if (results >= 0)
+		ntfs_log_quiet("\nFiles with potentially recoverable content: %d\n",
+			results);
+	if (opts.match)
+		regfree(&re);
+	free(buffer);
+	return results;
+}
+
+/**
+ * scan_index - Search the index of the deleted files
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ *
+ * The index is built when it does not exist, or when it was built from
+ * another volume, or before records were allocated or freed.
+ *
+ * Return:  -1  Error, something went wrong
+ *	     n  Success, the number of recoverable files
+ */
+static int scan_index(ntfs_volume *vol)
+{
+	struct undel_index_header state;
+	struct undel_index_header hdr;
+	FILE *fin;
+	int results;
+
+	if (index_state(vol, &state))
+		return -1;
+	fin = fopen(opts.index, "rb");
+	if (!fin
+	    || (fread(&hdr, sizeof(hdr), 1, fin) != 1)
+	    || memcmp(hdr.magic, state.magic, sizeof(hdr.magic))
+	    || (hdr.version != state.version)
+	    || (hdr.mft_record_size != state.mft_record_size)
+	    || (hdr.volume_serial != state.volume_serial)
+	    || (hdr.nr_mft_records != state.nr_mft_records)
+	    || (hdr.mft_bitmap_hash != state.mft_bitmap_hash)) {
+		if (fin) {
+			fclose(fin);
+			ntfs_log_verbose("The index '%s' is stale, rebuilding "
+					"it.\n", opts.index);
+		}
+		if (build_index(vol, &state))
+			return -1;
+		fin = fopen(opts.index, "rb");
+		if (!fin || (fread(&hdr, sizeof(hdr), 1, fin) != 1)) {
+			ntfs_log_perror("ERROR: Couldn't read the index '%s'",
+					opts.index);
+			if (fin)
+				fclose(fin);
+			return -1;
+		}
+	}
+	results = query_index(vol, fin, le64_to_cpu(hdr.nr_entries));
+	fclose(fin);
+	return results;
+}
+
 /**
  * scan_disk - Search an NTFS volume for files that could be undeleted
  * @vol:  An ntfs volume obtained from ntfs_mount
@@ -2232,6 +3114,9 @@ static int scan_disk(ntfs_volume *vol)
 	if (!vol)
 		return -1;
 
+	if (opts.index)
+		return scan_index(vol);
+
 	attr = ntfs_attr_open(vol->mft_ni, AT_BITMAP, AT_UNNAMED, 0);
 	if (!attr) {
 		ntfs_log_perror("ERROR: Couldn't open $MFT/$BITMAP");
@@ -2247,20 +3132,8 @@ static int scan_disk(ntfs_volume *vol)
 		goto out;
 	}
 
-	if (opts.match) {
-		int flags = REG_NOSUB;
-
-		if (!opts.match_case)
-			flags |= REG_ICASE;
-		if (regcomp(&re, opts.match, flags)) {
-			ntfs_log_error("ERROR: Couldn't create a regex.\n");
-			goto out;
-		}
-#ifndef HAVE_REGEX_H
-		re->upcase = vol->upcase;
-		re->upcase_len = vol->upcase_len;
-#endif
-	}
+	if (opts.match && compile_match(vol, &re))
+		goto out;
 
 	nr_mft_records = vol->mft_na->initialized_size >>
 			vol->mft_record_size_bits;
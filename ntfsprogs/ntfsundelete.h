@@ -59,6 +59,7 @@ struct options {
 	s64		 mft_begin;	/* Range for mft copy */
 	s64		 mft_end;
 	char		 fillbyte;	/* Use for unrecoverable sections */
+	char		*index;		/* Index of the deleted records */
 };
 
 struct filename {
@@ -108,5 +109,34 @@ struct ufile {
 	MFT_RECORD	*mft;		/* Raw MFT record */
 };
 
+/*
+ * The index file holds a header, followed by one entry for each deleted
+ * record, in record order.  Each entry is followed by its filenames, each
+ * stored as one byte for the length and the unicode name itself.
+ * All the values are little endian.
+ */
+struct undel_index_header {
+	char		 magic[8];	/* "NTFSUNDX" */
+	le32		 version;	/* Layout of the index */
+	le32		 mft_record_size;
+	le64		 volume_serial;	/* Volume the index was built from */
+	le64		 nr_mft_records;
+	le64		 mft_bitmap_hash; /* Hash of $MFT/$BITMAP when built */
+	le64		 nr_entries;	/* Number of deleted records indexed */
+} __attribute__((__packed__));
+
+struct undel_index_entry {
+	le64		 inode;		/* MFT record number */
+	le64		 parent_mref;	/* Parent of the preferred filename */
+	sle64		 date;		/* Last modification date/time */
+	sle64		 max_size;	/* Largest size we find */
+	sle64		 size;		/* Size shown in the list */
+	char		 flags[4];	/* Flags shown in the list */
+	s8		 percent;	/* Amount potentially recoverable */
+	s8		 data_percent;	/*	  shown in the list */
+	u8		 nr_names;	/* Number of filenames following */
+	u8		 pref_name;	/* Preferred filename, or 0xff */
+} __attribute__((__packed__));
+
 #endif /* _NTFSUNDELETE_H_ */
 
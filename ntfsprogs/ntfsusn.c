@@ -0,0 +1,436 @@
+/**
+ * ntfsusn - Part of the Linux-NTFS project.
+ *
+ * This utility shows the state of the change journal of an NTFS volume,
+ * lists the changes recorded since a given usn, so that the files changed
+ * can be processed without scanning the volume, or creates a journal.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the Linux-NTFS
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+#include "unistr.h"
+#include "ntfstime.h"
+#include "usnjrnl.h"
+#include "utils.h"
+#include "misc.h"
+#include "logging.h"
+
+static const char *EXEC_NAME = "ntfsusn";
+
+	/* names of the reasons, as listed */
+static const struct {
+	le32 reason;
+	const char *name;
+} usn_reasons[] = {
+	{ USN_REASON_DATA_OVERWRITE, "overwrite" },
+	{ USN_REASON_DATA_EXTEND, "extend" },
+	{ USN_REASON_DATA_TRUNCATION, "truncation" },
+	{ USN_REASON_NAMED_DATA_OVERWRITE, "stream-overwrite" },
+	{ USN_REASON_NAMED_DATA_EXTEND, "stream-extend" },
+	{ USN_REASON_NAMED_DATA_TRUNCATION, "stream-truncation" },
+	{ USN_REASON_FILE_CREATE, "create" },
+	{ USN_REASON_FILE_DELETE, "delete" },
+	{ USN_REASON_EA_CHANGE, "ea" },
+	{ USN_REASON_SECURITY_CHANGE, "security" },
+	{ USN_REASON_RENAME_OLD_NAME, "old-name" },
+	{ USN_REASON_RENAME_NEW_NAME, "new-name" },
+	{ USN_REASON_INDEXABLE_CHANGE, "indexable" },
+	{ USN_REASON_BASIC_INFO_CHANGE, "basic-info" },
+	{ USN_REASON_HARD_LINK_CHANGE, "hard-link" },
+	{ USN_REASON_COMPRESSION_CHANGE, "compression" },
+	{ USN_REASON_ENCRYPTION_CHANGE, "encryption" },
+	{ USN_REASON_OBJECT_ID_CHANGE, "object-id" },
+	{ USN_REASON_REPARSE_POINT_CHANGE, "reparse" },
+	{ USN_REASON_STREAM_CHANGE, "stream" },
+	{ USN_REASON_CLOSE, "close" },
+} ;
+
+#define USN_REASONS (int)(sizeof(usn_reasons)/sizeof(usn_reasons[0]))
+
+static struct options {
+	char		*device;	/* Device/File to work with */
+	s64		 since;		/* List the changes from this usn */
+	s64		 max_size;	/* Size of a new journal */
+	s64		 delta;		/* Bytes freed at once */
+	int		 list;		/* List the changes */
+	int		 create;	/* Create a journal */
+	int		 force;		/* Override common sense */
+	int		 quiet;		/* Less output */
+	int		 verbose;	/* Extra output */
+} opts;
+
+static u64 listed;
+
+/**
+ * version - Print version information about the program
+ *
+ * Print a copyright statement and a brief description of the program.
+ *
+ * Return:  none
+ */
+static void version(void)
+{
+	ntfs_log_info("\n%s v%s (libntfs-3g) - Show the changes recorded "
+			"in the change journal.\n\n", EXEC_NAME, VERSION);
+	ntfs_log_info("\n%s\n%s%s\n", ntfs_gpl, ntfs_bugs, ntfs_home);
+}
+
+/**
+ * usage - Print a list of the parameters to the program
+ *
+ * Print a list of the parameters and options for the program.
+ *
+ * Return:  none
+ */
+static void usage(void)
+{
+	ntfs_log_info("\nUsage: %s [options] device\n"
+		"    -s, --since USN      List the changes since USN, "
+			"0 for all the\n"
+		"                         changes kept\n"
+		"    -c, --create         Create a change journal\n"
+		"    -m, --max-size MB    Megabytes of changes kept by a "
+			"new journal\n"
+		"    -d, --delta MB       Megabytes of changes freed at once "
+			"by a new journal\n"
+		"\n"
+		"    -f, --force          Use less caution\n"
+		"    -q, --quiet          Less output\n"
+		"    -v, --verbose        More output\n"
+		"    -V, --version        Version information\n"
+		"    -h, --help           Print this help\n\n",
+		EXEC_NAME);
+	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
+}
+
+/*
+ *		Get a non-negative number from an option
+ *
+ *	Returns the number, or -1 if it is not valid
+ */
+
+static s64 get_number(const char *arg)
+{
+	char *end;
+	s64 num;
+
+	num = strtoll(arg, &end, 0);
+	if (*end || (num < 0)) {
+		ntfs_log_error("Invalid number '%s'.\n", arg);
+		num = -1;
+	}
+	return (num);
+}
+
+/**
+ * parse_options - Read and validate the programs command line
+ *
+ * Read the command line, verify the syntax and parse the options.
+ *
+ * Return:  0 Done, the program has to stop
+ *	    1 Error, one or more problems
+ *	   -1 Success, go on
+ */
+static int parse_options(int argc, char **argv)
+{
+	static const char *sopt = "-cd:fhm:qs:vV";
+	static const struct option lopt[] = {
+		{ "create",	no_argument,		NULL, 'c' },
+		{ "delta",	required_argument,	NULL, 'd' },
+		{ "force",	no_argument,		NULL, 'f' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "max-size",	required_argument,	NULL, 'm' },
+		{ "quiet",	no_argument,		NULL, 'q' },
+		{ "since",	required_argument,	NULL, 's' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "version",	no_argument,		NULL, 'V' },
+		{ NULL,		0,			NULL, 0   }
+	};
+
+	int c = -1;
+	int err  = 0;
+	int ver  = 0;
+	int help = 0;
+	s64 num;
+
+	opterr = 0; /* We'll handle the errors, thank you. */
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* A non-option argument */
+			if (!opts.device) {
+				opts.device = argv[optind-1];
+			} else {
+				ntfs_log_error("You must specify exactly one "
+					"device.\n");
+				err++;
+			}
+			break;
+		case 'c':
+			opts.create++;
+			break;
+		case 'd':
+		case 'm':
+			num = get_number(optarg);
+			if ((num < 0) || (num > 0x100000)) {
+				err++;
+			} else {
+				if (c == 'd')
+					opts.delta = num << 20;
+				else
+					opts.max_size = num << 20;
+			}
+			break;
+		case 'f':
+			opts.force++;
+			break;
+		case 'h':
+			help++;
+			break;
+		case 'q':
+			opts.quiet++;
+			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
+			break;
+		case 's':
+			opts.since = get_number(optarg);
+			if (opts.since < 0)
+				err++;
+			opts.list++;
+			break;
+		case 'v':
+			opts.verbose++;
+			ntfs_log_set_levels(NTFS_LOG_LEVEL_VERBOSE);
+			break;
+		case 'V':
+			ver++;
+			break;
+		default:
+			if ((optopt == 'd') || (optopt == 'm')
+			    || (optopt == 's'))
+				ntfs_log_error("Option '%s' requires an "
+					"argument.\n", argv[optind-1]);
+			else
+				ntfs_log_error("Unknown option '%s'.\n",
+					argv[optind-1]);
+			err++;
+			break;
+		}
+	}
+
+	if (!help && !ver) {
+		if (!opts.device) {
+			if (argc > 1)
+				ntfs_log_error("You must specify a device.\n");
+			err++;
+		}
+		if (opts.create && opts.list) {
+			ntfs_log_error("You may not use --create and --since"
+				" at the same time.\n");
+			err++;
+		}
+		if (!opts.create && (opts.max_size || opts.delta)) {
+			ntfs_log_error("The sizes are only meaningful with"
+				" --create.\n");
+			err++;
+		}
+		if (opts.quiet && opts.verbose) {
+			ntfs_log_error("You may not use --quiet and --verbose"
+				" at the same time.\n");
+			err++;
+		}
+	}
+
+	if (ver)
+		version();
+	if (help || err)
+		usage();
+
+		/* tri-state 0 : done, 1 : error, -1 : proceed */
+	return (err ? 1 : (help || ver ? 0 : -1));
+}
+
+/*
+ *		List a record of the journal
+ *
+ *	The usn, the time, the reasons, the file and the directory are
+ *	listed, followed by the name.
+ */
+
+static int list_record(void *data __attribute__((unused)),
+			const USN_RECORD *rec)
+{
+	struct timespec ts;
+	struct tm *tm;
+	char stamp[32];
+	char *name;
+	const char *sep;
+	int i;
+
+	name = (char*)NULL;
+	if (ntfs_ucstombs((const ntfschar*)((const char*)rec
+			+ le16_to_cpu(rec->file_name_offset)),
+			le16_to_cpu(rec->file_name_length)/sizeof(ntfschar),
+			&name, 0) < 0)
+		name = (char*)NULL;
+	ts = ntfs2timespec(rec->time_stamp);
+	tm = localtime(&ts.tv_sec);
+	if (!tm || !strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", tm))
+		strcpy(stamp, "-");
+	printf("%lld %s ", (long long)sle64_to_cpu(rec->usn), stamp);
+	sep = "";
+	for (i=0; i<USN_REASONS; i++)
+		if (rec->reason & usn_reasons[i].reason) {
+			printf("%s%s", sep, usn_reasons[i].name);
+			sep = "|";
+		}
+	printf(" %lld %lld %s\n",
+		(long long)MREF_LE(rec->file_reference_number),
+		(long long)MREF_LE(rec->parent_file_reference_number),
+		(name ? name : "?"));
+	free(name);
+	listed++;
+	return (0);
+}
+
+/*
+ *		Show the state of the journal
+ */
+
+static int show_info(ntfs_volume *vol)
+{
+	struct NTFS_USN_INFO info;
+
+	if (ntfs_usn_get_info(vol, &info)) {
+		if (errno == ENOENT)
+			ntfs_log_error("The volume has no change journal.\n");
+		else
+			ntfs_log_perror("Could not read the change journal");
+		return (1);
+	}
+	ntfs_log_info("Journal id            : 0x%llx\n",
+			(long long)info.journal_id);
+	ntfs_log_info("First usn kept        : %lld\n",
+			(long long)info.first_usn);
+	ntfs_log_info("Next usn              : %lld\n",
+			(long long)info.next_usn);
+	ntfs_log_info("Lowest valid usn      : %lld\n",
+			(long long)info.lowest_valid_usn);
+	ntfs_log_info("Maximum size          : %lld\n",
+			(long long)info.max_size);
+	ntfs_log_info("Allocation delta      : %lld\n",
+			(long long)info.allocation_delta);
+	return (0);
+}
+
+/*
+ *		List the changes since the usn requested
+ *
+ *	The usn to request for the next changes is shown last.
+ */
+
+static int list_changes(ntfs_volume *vol)
+{
+	s64 next;
+
+	next = ntfs_usn_read(vol, opts.since, list_record, (void*)NULL);
+	if (next < 0) {
+		if (errno == ENOENT)
+			ntfs_log_error("The volume has no change journal.\n");
+		else if (errno == ERANGE)
+			ntfs_log_error("The changes since usn %lld are not "
+				"kept any more, the volume has to be "
+				"scanned.\n", (long long)opts.since);
+		else
+			ntfs_log_perror("Could not read the change journal");
+		return (1);
+	}
+	ntfs_log_verbose("%llu records listed\n", (unsigned long long)listed);
+	ntfs_log_info("Next usn : %lld\n", (long long)next);
+	return (0);
+}
+
+int main(int argc, char *argv[])
+{
+	ntfs_volume *vol;
+	unsigned long flags;
+	int res;
+
+	ntfs_log_set_handler(ntfs_log_handler_outerr);
+
+	res = parse_options(argc, argv);
+	if (res >= 0)
+		return (res);
+
+	utils_set_locale();
+
+	flags = (opts.create ? 0 : NTFS_MNT_RDONLY);
+	if (opts.force)
+		flags |= NTFS_MNT_RECOVER;
+	vol = utils_mount_volume(opts.device, flags);
+	if (!vol)
+		return (1);
+
+	if (opts.create) {
+		if (ntfs_volume_get_free_space(vol)) {
+			ntfs_log_perror("Could not get the free space");
+			res = 1;
+		} else if (ntfs_usn_create(vol, opts.max_size, opts.delta)) {
+			if (errno == EEXIST)
+				ntfs_log_error("The volume already has a "
+					"change journal.\n");
+			else
+				ntfs_log_perror("Could not create the change "
+					"journal");
+			res = 1;
+		} else
+			res = show_info(vol);
+	} else {
+		if (opts.list)
+			res = list_changes(vol);
+		else
+			res = show_info(vol);
+	}
+
+	if (ntfs_umount(vol, FALSE)) {
+		ntfs_log_perror("Could not unmount the volume");
+		res = 1;
+	}
+	return (res);
+}
@@ -56,6 +56,9 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
 #include "ntfswipe.h"
 #include "types.h"
@@ -68,6 +71,9 @@
 #include "logging.h"
 #include "list.h"
 #include "mft.h"
+#include "lcnalloc.h"
+
+#define WIPE_BUFFER_SIZE 4194304 /* bytes written at once when discarding */
 
 static const char *EXEC_NAME = "ntfswipe";
 static struct options opts;
@@ -173,6 +179,7 @@ static void usage(void)
 		"    -t       --tails       Wipe file tails\n"
 		"    -u       --unused      Wipe unused clusters\n"
 		"    -U       --unused-fast Wipe unused clusters (fast)\n"
+		"    -D       --discard     Wipe unused clusters (discard)\n"
 		"    -s       --undel       Wipe undelete data\n"
 		"\n"
 		"    -a       --all         Wipe all unused space\n"
@@ -266,12 +273,13 @@ static int parse_list(char *list, int **result)
  */
 static int parse_options(int argc, char *argv[])
 {
-	static const char *sopt = "-ab:c:dfh?ilmnpqtuUvVs";
+	static const char *sopt = "-ab:c:dDfh?ilmnpqtuUvVs";
 	static struct option lopt[] = {
 		{ "all",	no_argument,		NULL, 'a' },
 		{ "bytes",	required_argument,	NULL, 'b' },
 		{ "count",	required_argument,	NULL, 'c' },
 		{ "directory",	no_argument,		NULL, 'd' },
+		{ "discard",	no_argument,		NULL, 'D' },
 		{ "force",	no_argument,		NULL, 'f' },
 		{ "help",	no_argument,		NULL, 'h' },
 		{ "info",	no_argument,		NULL, 'i' },
@@ -345,6 +353,9 @@ static int parse_options(int argc, char *argv[])
 		case 'd':
 			opts.directory++;
 			break;
+		case 'D':
+			opts.discard++;
+			break;
 		case 'f':
 			opts.force++;
 			break;
@@ -455,7 +466,7 @@ static int parse_options(int argc, char *argv[])
 
 		if (!opts.directory && !opts.logfile && !opts.mft &&
 		    !opts.pagefile && !opts.tails && !opts.unused &&
-		    !opts.unused_fast && !opts.undel) {
+		    !opts.unused_fast && !opts.discard && !opts.undel) {
 			opts.info = 1;
 		}
 	}
@@ -638,6 +649,122 @@ free:
 	return total;
 }
 
+/*
+ *		State of a wiping by discarding
+ */
+
+struct DISCARD_STATE {
+	int byte;
+	enum action act;
+	BOOL zeroout;
+	u8 *buffer;
+	s64 total;
+	s64 zeroed;
+} ;
+
+/*
+ *		Wipe an extent of free clusters
+ *
+ *	The extent is zeroed out by the device when possible, which on a
+ *	regular file punches a hole, otherwise it is overwritten by large
+ *	aligned chunks.
+ */
+static int wipe_free_extent(ntfs_volume *vol, LCN lcn, s64 count, void *data)
+{
+	struct DISCARD_STATE *state = (struct DISCARD_STATE*)data;
+	u64 range[2];
+	s64 pos, end, len;
+
+	pos = lcn << vol->cluster_size_bits;
+	end = (lcn + count) << vol->cluster_size_bits;
+	state->total += end - pos;
+	if (state->act != act_wipe)
+		return 0;
+
+	if (state->zeroout) {
+		range[0] = pos;
+		range[1] = end - pos;
+#ifdef BLKZEROOUT
+		if (!vol->dev->d_ops->ioctl(vol->dev, BLKZEROOUT, range)) {
+			state->zeroed += end - pos;
+			return 0;
+		}
+#else
+		errno = EOPNOTSUPP;
+#endif
+		ntfs_log_verbose("Could not zero out the clusters (%s),"
+				" writing them instead\n", strerror(errno));
+		state->zeroout = FALSE;
+	}
+
+	if (!state->buffer) {
+		state->buffer = (u8*)malloc(WIPE_BUFFER_SIZE);
+		if (!state->buffer) {
+			ntfs_log_error("malloc failed\n");
+			return -1;
+		}
+		memset(state->buffer, state->byte, WIPE_BUFFER_SIZE);
+	}
+	for (; pos < end; pos += len) {
+		len = (pos | (WIPE_BUFFER_SIZE - 1)) + 1 - pos;
+		if (len > end - pos)
+			len = end - pos;
+		if (ntfs_pwrite(vol->dev, pos, len, state->buffer) != len) {
+			ntfs_log_error("Write failed at cluster %lld\n",
+				(long long)(pos >> vol->cluster_size_bits));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * wipe_unused_discard - Wipe unused clusters by extents
+ * @vol:   An ntfs volume obtained from ntfs_mount
+ * @byte:  Overwrite with this value
+ * @act:   Wipe, test or info
+ *
+ * Walk $Bitmap by extents of free clusters and, when wiping with zeroes,
+ * have the device zero them out, which on SSDs and thin provisioned
+ * devices releases the space instead of writing it. When this is not
+ * possible, or for other values, the extents are overwritten using
+ * large buffers.
+ *
+ * Return: >0  Success, the clusters were wiped
+ *          0  Nothing to wipe
+ *         -1  Error, something went wrong
+ */
+static s64 wipe_unused_discard(ntfs_volume *vol, int byte, enum action act)
+{
+	struct DISCARD_STATE state;
+	int res;
+
+	if (!vol || (byte < 0))
+		return -1;
+
+	state.byte = byte;
+	state.act = act;
+	state.zeroout = !byte;
+	state.buffer = NULL;
+	state.total = 0;
+	state.zeroed = 0;
+	if ((act == act_wipe) && ntfs_device_sync(vol->dev)) {
+		ntfs_log_perror("Could not sync the device");
+		return -1;
+	}
+	res = ntfs_cluster_free_extents(vol, 0, vol->nr_clusters, 0,
+			wipe_free_extent, &state);
+	free(state.buffer);
+	if (res)
+		return -1;
+
+	ntfs_log_quiet("wipe_unused_discard 0x%02x, %lld bytes,"
+			" %lld of them zeroed out by the device\n",
+			byte, (long long)state.total,
+			(long long)state.zeroed);
+	return state.total;
+}
+
 /**
  * wipe_compressed_attribute - Wipe compressed $DATA attribute
  * @vol:	An ntfs volume obtained from ntfs_mount
@@ -2109,6 +2236,8 @@ static void print_summary(void)
 		ntfs_log_quiet("\tunused disk space\n");
 	if (opts.unused_fast)
 		ntfs_log_quiet("\tunused disk space (fast)\n");
+	if (opts.discard)
+		ntfs_log_quiet("\tunused disk space (discard)\n");
 	if (opts.tails)
 		ntfs_log_quiet("\tfile tails\n");
 	if (opts.mft)
@@ -2252,8 +2381,11 @@ int main(int argc, char *argv[])
 					total += wiped;
 			}
 
-			if (opts.unused || opts.unused_fast) {
-				if (opts.unused_fast)
+			if (opts.unused || opts.unused_fast || opts.discard) {
+				if (opts.discard)
+					wiped = wipe_unused_discard(vol, byte,
+								act);
+				else if (opts.unused_fast)
 					wiped = wipe_unused_fast(vol, byte,
 								act);
 				else
@@ -48,6 +48,7 @@ struct options {
 	int	 tails;		/* Wipe file tails */
 	int	 unused;	/* Wipe unused clusters */
 	int	 unused_fast;	/* Wipe unused clusters (fast) */
+	int	 discard;	/* Wipe unused clusters (discard) */
 	int	 undel;		/* Wipe undelete data */
 };
 
@@ -75,9 +75,23 @@ struct STORE {
 	struct STORE *upper;
 	struct STORE *lower;
 	LCN lcn;
+	BOOL dirty;	/* to be written to the device */
+	BOOL updated;	/* was modified by some action */
 	char data[1];
 } ;
 
+/*
+ *		A run of consecutive clusters to be read or written at once
+ */
+
+struct STORE_RUN {
+	LCN lcn;
+	int count;
+	char *buf;
+} ;
+
+#define STORE_BATCH 64 /* max clusters read or written at once */
+
 #define dump hexdump
 
 struct STORE *cluster_door = (struct STORE*)NULL;
@@ -155,6 +169,8 @@ static struct STORE *getclusterentry(LCN lcn, BOOL create)
 			newone->upper = (struct STORE*)NULL;
 			newone->lower = (struct STORE*)NULL;
 			newone->lcn = lcn;
+			newone->dirty = FALSE;
+			newone->updated = FALSE;
 			*current = newone;
 		}
 	}
@@ -168,7 +184,7 @@ void freeclusterentry(struct STORE *entry)
 			freeclusterentry(cluster_door);
 		cluster_door = (struct STORE*)NULL;
 	} else {
-		if (optv)
+		if (optv && entry->updated)
 			printf("* cluster 0x%llx %s updated\n",
 					(long long)entry->lcn,
 					(optn ? "would be" : "was"));
@@ -180,6 +196,230 @@ void freeclusterentry(struct STORE *entry)
 	}
 }
 
+/*
+ *		Insert an entry into the store
+ *
+ *	The entry must not be present already.
+ */
+
+static void insertclusterentry(struct STORE *entry)
+{
+	struct STORE **current;
+
+	current = &cluster_door;
+	while (*current) {
+		if (entry->lcn > (*current)->lcn)
+			current = &(*current)->upper;
+		else
+			current = &(*current)->lower;
+	}
+	entry->upper = (struct STORE*)NULL;
+	entry->lower = (struct STORE*)NULL;
+	*current = entry;
+}
+
+/*
+ *		Insert a sorted set of entries, keeping the tree balanced
+ */
+
+static void insert_sorted(struct STORE **entries, int count)
+{
+	int middle;
+
+	if (count > 0) {
+		middle = count >> 1;
+		insertclusterentry(entries[middle]);
+		insert_sorted(entries, middle);
+		insert_sorted(&entries[middle + 1], count - middle - 1);
+	}
+}
+
+static int compare_lcns(const void *p1, const void *p2)
+{
+	LCN lcn1 = *(const LCN*)p1;
+	LCN lcn2 = *(const LCN*)p2;
+
+	return (lcn1 < lcn2 ? -1 : (lcn1 > lcn2 ? 1 : 0));
+}
+
+/*
+ *		Read the clusters of a set of actions into the store
+ *
+ *	The clusters the actions will read are collected and read in
+ *	lcn order, grouping consecutive ones, so that the actions
+ *	acting on the same record only need a single read in the end,
+ *	and the device is read nearly sequentially.
+ *
+ *	The clusters which cannot be read are left out, and they will
+ *	be read again, and reported, by the action needing them.
+ *
+ *	Returns 0 if successful, or 1 if there was not enough memory,
+ *	in which case the actions read the clusters themselves.
+ */
+
+static int prefetch_clusters(ntfs_volume *vol,
+			const struct ACTION_RECORD *firstaction, BOOL redoing)
+{
+	const struct ACTION_RECORD *action;
+	struct STORE **entries;
+	struct STORE *entry;
+	char *buf;
+	LCN *lcns;
+	LCN lcn;
+	int count;
+	int total;
+	int stored;
+	int run;
+	int i, j;
+	int err;
+
+	err = 0;
+	total = 0;
+	for (action=firstaction; action; action=action->next)
+		total += le16_to_cpu(action->record.lcns_to_follow);
+	if (!total)
+		return (0);
+	lcns = (LCN*)malloc(total*sizeof(LCN));
+	entries = (struct STORE**)malloc(total*sizeof(struct STORE*));
+	buf = (char*)malloc(STORE_BATCH*clustersz);
+	if (lcns && entries && buf) {
+		count = 0;
+		for (action=firstaction; action; action=action->next) {
+			if ((optc && !within_lcn_range(&action->record))
+			    || (redoing && !(action->flags & ACTION_TO_REDO)))
+				continue;
+			for (i=0; i<le16_to_cpu(action->record.lcns_to_follow);
+					i++) {
+				lcn = sle64_to_cpu(action->record.lcn_list[i]);
+				if ((lcn >= 0) && !getclusterentry(lcn, FALSE))
+					lcns[count++] = lcn;
+			}
+		}
+		qsort(lcns, count, sizeof(LCN), compare_lcns);
+		stored = 0;
+		for (i=0; i<count; i+=run) {
+				/* group consecutive clusters */
+			run = 1;
+			while (((i + run) < count) && (run < STORE_BATCH)
+			    && (lcns[i + run] <= (lcns[i + run - 1] + 1)))
+				run++;
+			if (ntfs_pread(vol->dev, lcns[i] << clusterbits,
+					(lcns[i + run - 1] - lcns[i] + 1)
+						*clustersz, buf)
+			    != (lcns[i + run - 1] - lcns[i] + 1)*clustersz)
+				continue;
+			for (j=0; j<run; j++) {
+				if (stored
+				    && (entries[stored - 1]->lcn
+						== lcns[i + j]))
+					continue; /* duplicate */
+				entry = (struct STORE*)malloc(
+						sizeof(struct STORE)
+							+ clustersz);
+				if (!entry)
+					break;
+				entry->lcn = lcns[i + j];
+				entry->dirty = FALSE;
+				entry->updated = FALSE;
+				memcpy(entry->data, buf
+					+ (lcns[i + j] - lcns[i])*clustersz,
+					clustersz);
+				entries[stored++] = entry;
+			}
+		}
+		insert_sorted(entries, stored);
+		if (optv)
+			printf("* %d clusters read ahead\n", stored);
+	} else
+		err = 1;
+	free(buf);
+	free(entries);
+	free(lcns);
+	return (err);
+}
+
+/*
+ *		Write a run of clusters from the store
+ */
+
+static int write_run(ntfs_volume *vol, struct STORE_RUN *run)
+{
+	int err;
+
+	err = 0;
+	if (run->count) {
+		if (ntfs_pwrite(vol->dev, run->lcn << clusterbits,
+				run->count*clustersz, run->buf)
+		    != run->count*clustersz) {
+			printf("** Could not write clusters 0x%llx-0x%llx\n",
+				(long long)run->lcn,
+				(long long)(run->lcn + run->count - 1));
+			err = 1;
+		}
+		run->count = 0;
+	}
+	return (err);
+}
+
+/*
+ *		Gather the modified clusters of the store in lcn order
+ */
+
+static int flush_entry(ntfs_volume *vol, struct STORE *entry,
+			struct STORE_RUN *run)
+{
+	int err;
+
+	err = 0;
+	if (entry->lower)
+		err = flush_entry(vol, entry->lower, run);
+	if (!err && entry->dirty) {
+		if (run->count && ((entry->lcn != (run->lcn + run->count))
+				|| (run->count >= STORE_BATCH)))
+			err = write_run(vol, run);
+		if (!run->count)
+			run->lcn = entry->lcn;
+		memcpy(run->buf + run->count*clustersz, entry->data,
+				clustersz);
+		run->count++;
+		entry->dirty = FALSE;
+	}
+	if (!err && entry->upper)
+		err = flush_entry(vol, entry->upper, run);
+	return (err);
+}
+
+/*
+ *		Write the modified clusters of the store to the device
+ *
+ *	The clusters are written in lcn order, grouping consecutive ones.
+ *	They are kept in the store, as later actions may need them.
+ *
+ *	Returns 0 if successful, 1 if there was an error
+ */
+
+static int flush_store(ntfs_volume *vol)
+{
+	struct STORE_RUN run;
+	int err;
+
+	err = 0;
+	if (cluster_door && !optn) {
+		run.count = 0;
+		run.buf = (char*)malloc(STORE_BATCH*clustersz);
+		if (run.buf) {
+			err = flush_entry(vol, cluster_door, &run);
+			if (write_run(vol, &run))
+				err = 1;
+			free(run.buf);
+		} else {
+			printf("** Not enough memory to write the clusters\n");
+			err = 1;
+		}
+	}
+	return (err);
+}
+
 /*
  *		Check whether an attribute type is a valid one
  */
@@ -418,7 +658,7 @@ static int sanity_indx(ntfs_volume *vol, const char *buffer)
  *		Allocate a buffer and read a full set of raw clusters
  *
  *	Do not use for accessing $LogFile.
- *	With option -n reading is first attempted from the memory store
+ *	Reading is first attempted from the memory store
  */
 
 static char *read_raw(ntfs_volume *vol, const LOG_RECORD *logr)
@@ -444,17 +684,15 @@ static char *read_raw(ntfs_volume *vol, const LOG_RECORD *logr)
 			store = (struct STORE*)NULL;
 			lcn = sle64_to_cpu(logr->lcn_list[i]);
 			target = buffer + clustersz*i;
-			if (optn) {
-				store = getclusterentry(lcn, FALSE);
-				if (store) {
-					memcpy(target, store->data, clustersz);
+			store = getclusterentry(lcn, FALSE);
+			if (store) {
+				memcpy(target, store->data, clustersz);
 				if (optv)
 					printf("== lcn 0x%llx from store\n",
 							(long long)lcn);
 				if ((optv > 1) && optc
 				    && within_lcn_range(logr))
 					dump(store->data, clustersz);
-				}
 			}
 			if (!store
 			   && (ntfs_pread(vol->dev, lcn << clusterbits,
@@ -486,7 +724,8 @@ static char *read_raw(ntfs_volume *vol, const LOG_RECORD *logr)
  *		Write a full set of raw clusters
  *
  *	Do not use for accessing $LogFile.
- *	With option -n a copy of the buffer is kept in memory for later use.
+ *	The clusters are kept in memory for later use, and without option -n
+ *	they are written to the device by flush_store().
  */
 
 static int write_raw(ntfs_volume *vol, const LOG_RECORD *logr,
@@ -510,6 +749,7 @@ static int write_raw(ntfs_volume *vol, const LOG_RECORD *logr,
 			store = getclusterentry(lcn, TRUE);
 			if (store) {
 				memcpy(store->data, source, clustersz);
+				store->updated = TRUE;
 				if (optv)
 					printf("== lcn 0x%llx to store\n",
 							(long long)lcn);
@@ -529,7 +769,13 @@ static int write_raw(ntfs_volume *vol, const LOG_RECORD *logr,
 				printf("== lcn 0x%llx to device\n",
 							(long long)lcn);
 			source = buffer + clustersz*i;
-			if (ntfs_pwrite(vol->dev, lcn << clusterbits,
+				/* defer to flush_store(), unless no memory */
+			store = getclusterentry(lcn, TRUE);
+			if (store) {
+				memcpy(store->data, source, clustersz);
+				store->updated = TRUE;
+				store->dirty = TRUE;
+			} else if (ntfs_pwrite(vol->dev, lcn << clusterbits,
         	       			clustersz, source) != clustersz) {
 				printf("** Could not write cluster 0x%llx\n",
 						(long long)lcn);
@@ -4497,6 +4743,10 @@ printf("** %s (action %d) not acting on INDX\n",actionname(rop),(int)action->num
  *
  *	Currently we can only redo the last undone transaction,
  *	otherwise the attribute table would be out of phase.
+ *
+ *	The actions are played in order, as they may depend on
+ *	each other, but the clusters they act on are read ahead and
+ *	the modified ones are written back in lcn order at the end.
  */
 
 int play_redos(ntfs_volume *vol, const struct ACTION_RECORD *firstaction)
@@ -4505,6 +4755,7 @@ int play_redos(ntfs_volume *vol, const struct ACTION_RECORD *firstaction)
 	int err;
 
 	err = 0;
+	prefetch_clusters(vol, firstaction, TRUE);
 	action = firstaction;
 	while (action && !err) {
 			/* Only committed actions should be redone */
@@ -4514,6 +4765,8 @@ int play_redos(ntfs_volume *vol, const struct ACTION_RECORD *firstaction)
 		if (!err)
 			action = action->next;
 	}
+	if (flush_store(vol))
+		err = 1;
 	return (err);
 }
 
@@ -4883,6 +5136,8 @@ printf("index lsn 0x%llx is %s than action %d lsn 0x%llx\n",
  *	For structured record, a check is made on the lsn to only
  *	try to undo the actions which were executed. This implies
  *	identifying actions on a structured record.
+ *	As for redos, the clusters are read ahead and written back
+ *	at the end.
  *
  *	Returns 0 if successful
  */
@@ -4893,6 +5148,9 @@ int play_undos(ntfs_volume *vol, const struct ACTION_RECORD *lastaction)
 	int err;
 
 	err = 0;
+	for (action=lastaction; action && action->prev; action=action->prev)
+		;
+	prefetch_clusters(vol, action, FALSE);
 	action = lastaction;
 	while (action && !err) {
 		if (!optc || within_lcn_range(&action->record))
@@ -4900,5 +5158,7 @@ int play_undos(ntfs_volume *vol, const struct ACTION_RECORD *lastaction)
 		if (!err)
 			action = action->prev;
 	}
+	if (flush_store(vol))
+		err = 1;
 	return (err);
 }
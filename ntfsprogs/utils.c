@@ -208,6 +208,9 @@ int utils_valid_device(const char *name, int force)
 {
 	unsigned long mnt_flags = 0;
 	struct stat st;
+#ifdef NTFS_DEVICE_MEM_IO_OPS
+	int prefix;
+#endif
 
 #if defined(HAVE_WINDOWS_H) | defined(__CYGWIN32__) 
 	/* FIXME: This doesn't work for Cygwin, so just return success. */
@@ -217,6 +220,12 @@ int utils_valid_device(const char *name, int force)
 		errno = EINVAL;
 		return 0;
 	}
+#ifdef NTFS_DEVICE_MEM_IO_OPS
+	/* A memory device is checked through its backing file */
+	prefix = ntfs_device_mem_name(name);
+	if (prefix)
+		name += prefix;
+#endif
 
 	if (stat(name, &st) == -1) {
 		if (errno == ENOENT)
@@ -29,6 +29,9 @@
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
+#ifdef FUSE_INTERNAL
+#include <fuse_kernel.h>
+#endif
 
 #if !defined(FUSE_VERSION) || (FUSE_VERSION < 26)
 #error "***********************************************************"
@@ -56,6 +59,9 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_STDARG_H
+#include <stdarg.h>
+#endif
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
@@ -80,12 +86,20 @@
 #include <sys/sysmacros.h>
 #endif
 
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
 #if defined(__APPLE__) || defined(__DARWIN__)
 #include <sys/dirent.h>
 #elif defined(__sun) && defined (__SVR4)
 #include <sys/param.h>
 #endif /* defined(__APPLE__) || defined(__DARWIN__), ... */
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #ifndef FUSE_CAP_POSIX_ACL  /* until defined in <fuse/fuse_common.h> */
 #define FUSE_CAP_POSIX_ACL (1 << 18)
 #endif /* FUSE_CAP_POSIX_ACL */
@@ -109,7 +123,15 @@
 #include "xattrs.h"
 #include "misc.h"
 #include "ioctl.h"
+#include "blkcache.h"
+#include "cache.h"
+#include "compress.h"
+#include "lcnalloc.h"
 #include "plugin.h"
+#include "stats.h"
+#include "trace.h"
+#include "prefetch.h"
+#include "usnjrnl.h"
 
 #include "ntfs-3g_common.h"
 
@@ -130,12 +152,12 @@
 #endif
 
 #if !CACHEING
-#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 0.0)
-#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 0.0)
+#define DEFAULT_ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 0.0)
+#define DEFAULT_ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 0.0)
 #else
 #if defined(__sun) && defined (__SVR4)
-#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
-#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
+#define DEFAULT_ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
+#define DEFAULT_ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
 #else /* defined(__sun) && defined (__SVR4) */
 	/*
 	 * FUSE cacheing is only usable with basic permissions
@@ -145,17 +167,37 @@
 #warning "Fuse cacheing is only usable with basic permissions checked by kernel"
 #endif
 #if KERNELACLS
-#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
-#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
+#define DEFAULT_ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
+#define DEFAULT_ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : 10.0)
 #else /* KERNELACLS */
-#define ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : \
+#define DEFAULT_ATTR_TIMEOUT (ctx->ro ? TIMEOUT_RO : \
 	(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 10.0 : 0.0))
-#define ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : \
+#define DEFAULT_ENTRY_TIMEOUT (ctx->ro ? TIMEOUT_RO : \
 	(ctx->vol->secure_flags & (1 << SECURITY_DEFAULT) ? 10.0 : 0.0))
 #endif /* KERNELACLS */
 #endif /* defined(__sun) && defined (__SVR4) */
 #endif /* !CACHEING */
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+	/*
+	 * Longer timeouts may be requested when the attributes can be
+	 * cached, the kernel being notified of the changes it cannot see
+	 */
+#define ATTR_TIMEOUT (ctx->attr_timeout && (DEFAULT_ATTR_TIMEOUT > 0.0) \
+		? (double)ctx->attr_timeout : DEFAULT_ATTR_TIMEOUT)
+#define ENTRY_TIMEOUT (ctx->entry_timeout && (DEFAULT_ENTRY_TIMEOUT > 0.0) \
+		? (double)ctx->entry_timeout : DEFAULT_ENTRY_TIMEOUT)
+#else
+#define ATTR_TIMEOUT DEFAULT_ATTR_TIMEOUT
+#define ENTRY_TIMEOUT DEFAULT_ENTRY_TIMEOUT
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
 #define GHOSTLTH 40 /* max length of a ghost file name - see ghostformat */
+#define MAX_THREADS 64 /* max number of threads serving requests */
+#define MAX_PAGES 4096 /* max pages in a request */
+#define KERNEL_MAX_PAGES 256 /* pages in a request for older kernels */
+#define LOOKUP_BUCKETS 1024 /* initial hash buckets of lookup counts */
+#define OPEN_BUCKETS 256 /* initial hash buckets of open files */
+#define COPY_CHUNK_SIZE 1048576 /* bytes read at once by copy_file_range */
+#define COPY_MAX_SIZE 67108864 /* max bytes copied by a copy_file_range */
 
 		/* sometimes the kernel cannot check access */
 #define ntfs_real_allowed_access(scx, ni, type) ntfs_allowed_access(scx, ni, type)
@@ -209,6 +251,8 @@ typedef struct fill_context {
 	fuse_req_t req;
 	fuse_ino_t ino;
 	BOOL filled;
+	BOOL plus;	/* list built for readdirplus */
+	struct SECURITY_CONTEXT *scx; /* while building for readdirplus */
 } ntfs_fuse_fill_context_t;
 
 struct open_file {
@@ -218,17 +262,38 @@ struct open_file {
 	fuse_ino_t ino;
 	fuse_ino_t parent;
 	int state;
+	struct ntfs_readahead ra;
+	ntfs_attr *na;	/* data attribute kept open, or NULL */
+	BOOL busy;	/* data attribute in use by a request */
 #ifndef DISABLE_PLUGINS
 	struct fuse_file_info fi;
 #endif /* DISABLE_PLUGINS */
 } ;
 
+	/* The open files, hashed by inode number */
+static struct {
+	struct open_file **buckets;
+	unsigned int size;
+	unsigned int count;
+} open_files;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_open_files() pthread_mutex_lock(&open_files_lock)
+#define unlock_open_files() pthread_mutex_unlock(&open_files_lock)
+#else
+#define lock_open_files()
+#define unlock_open_files()
+#endif
+
 enum {
 	CLOSE_GHOST = 1,
 	CLOSE_COMPRESSED = 2,
 	CLOSE_ENCRYPTED = 4,
 	CLOSE_DMTIME = 8,
-	CLOSE_REPARSE = 16
+	CLOSE_REPARSE = 16,
+	CLOSE_PREALLOC = 32,
+	CLOSE_ARCHIVE = 64
 };
 
 enum RM_TYPES {
@@ -237,6 +302,31 @@ enum RM_TYPES {
 	RM_ANY,
 } ;
 
+#if CACHE_NIDATA_SIZE
+
+struct LOOKUP_COUNT {
+	struct LOOKUP_COUNT *next;
+	fuse_ino_t ino;
+	u64 nlookup;
+} ;
+
+static struct {
+	struct LOOKUP_COUNT **buckets;
+	unsigned int size;
+	unsigned int count;
+} lookups;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t lookups_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock_lookups() pthread_mutex_lock(&lookups_lock)
+#define unlock_lookups() pthread_mutex_unlock(&lookups_lock)
+#else
+#define lock_lookups()
+#define unlock_lookups()
+#endif
+
+#endif /* CACHE_NIDATA_SIZE */
+
 static struct ntfs_options opts;
 
 const char *EXEC_NAME = "lowntfs-3g";
@@ -244,6 +334,7 @@ const char *EXEC_NAME = "lowntfs-3g";
 static ntfs_fuse_context_t *ctx;
 static u32 ntfs_sequence;
 static const char ghostformat[] = ".ghost-ntfs-3g-%020llu";
+static FILE *optrace_file;	/* trace of requests for ntfsreplay */
 
 static const char *usage_msg = 
 "\n"
@@ -372,6 +463,23 @@ static BOOL ntfs_fuse_fill_security_context(fuse_req_t req,
 	return (ctx->security.mapping[MAPUSERS] != (struct MAPPING*)NULL);
 }
 
+/*
+ *	Get a security context for getting the attributes of files
+ *
+ *	When there is no user mapping, all files have the same owner,
+ *	group and permissions, and nothing has to be known about the
+ *	requester, so the context filled when mounting is used.
+ */
+
+static struct SECURITY_CONTEXT *ntfs_fuse_stat_context(fuse_req_t req,
+			struct SECURITY_CONTEXT *scx)
+{
+	if (!ctx->security.mapping[MAPUSERS])
+		return (&ctx->security);
+	ntfs_fuse_fill_security_context(req, scx);
+	return (scx);
+}
+
 static u64 ntfs_fuse_inode_lookup(fuse_ino_t parent, const char *name)
 {
 	u64 ino = (u64)-1;
@@ -441,6 +549,70 @@ static int ntfs_allowed_dir_access(struct SECURITY_CONTEXT *scx,
 
 #endif /* !KERNELPERMS | (POSIXACLS & !KERNELACLS) */
 
+#define OPTRACE_LINE 1024	/* max size of a line of the operation trace */
+
+/*
+ *		Record a request into the operation trace
+ *
+ *	The line is made of the request name followed by the arguments
+ *	described by @args : 'i' for an inode number, 'n' for a name,
+ *	'd' for a signed number and 'o' for a mode. Inodes are recorded
+ *	as mft numbers, and the spaces, control characters and '%' in
+ *	names are encoded as %xx, so that ntfsreplay can split the line.
+ *
+ *	The line is written by a single call, so that the lines of
+ *	concurrent requests do not get mixed.
+ */
+
+static void ntfs_fuse_optrace(const char *op, const char *args, ...)
+{
+	char line[OPTRACE_LINE];
+	const unsigned char *name;
+	va_list ap;
+	size_t lth;
+	u64 ino;
+
+	va_start(ap, args);
+	lth = snprintf(line, OPTRACE_LINE, "%s", op);
+	while (*args && (lth < (OPTRACE_LINE - 8))) {
+		switch (*args++) {
+		case 'i' :
+			ino = va_arg(ap, u64);
+			lth += snprintf(&line[lth], OPTRACE_LINE - lth,
+				" %lld", (long long)INODE(ino));
+			break;
+		case 'd' :
+			lth += snprintf(&line[lth], OPTRACE_LINE - lth,
+				" %lld", (long long)va_arg(ap, s64));
+			break;
+		case 'o' :
+			lth += snprintf(&line[lth], OPTRACE_LINE - lth,
+				" %o", (unsigned int)va_arg(ap, int));
+			break;
+		case 'n' :
+			name = va_arg(ap, const unsigned char*);
+			line[lth++] = ' ';
+			while (*name && (lth < (OPTRACE_LINE - 8))) {
+				if ((*name <= ' ') || (*name == '%')
+				    || (*name == 0x7f))
+					lth += sprintf(&line[lth], "%%%02x",
+							*name);
+				else
+					line[lth++] = *name;
+				name++;
+			}
+			break;
+		default :
+			break;
+		}
+	}
+	va_end(ap);
+	if (lth > (OPTRACE_LINE - 2))
+		lth = OPTRACE_LINE - 2;
+	line[lth++] = '\n';
+	fwrite(line, 1, lth, optrace_file);
+}
+
 /**
  * ntfs_fuse_statfs - return information about mounted NTFS volume
  * @path:	ignored (but fuse requires it)
@@ -467,6 +639,8 @@ static void ntfs_fuse_statfs(fuse_req_t req,
 	int delta_bits;
 	ntfs_volume *vol;
 
+	if (optrace_file)
+		ntfs_fuse_optrace("statfs", "");
 	vol = ctx->vol;
 	if (vol) {
 	/* 
@@ -640,6 +814,31 @@ static void ntfs_init(void *userdata __attribute__((unused)),
 #ifdef FUSE_CAP_IOCTL_DIR
 	conn->want |= FUSE_CAP_IOCTL_DIR;
 #endif /* defined(FUSE_CAP_IOCTL_DIR) */
+#ifdef FUSE_CAP_READDIRPLUS
+	if (ctx->readdirplus)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+#endif /* defined(FUSE_CAP_READDIRPLUS) */
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+		/*
+		 * With the writeback cache, the kernel keeps the size and
+		 * mtime of the files being written to, and sends them
+		 * through setattr when flushing, so a getattr issued
+		 * meanwhile may return stale values which are ignored.
+		 */
+	if (ctx->writeback_cache)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif /* defined(FUSE_CAP_WRITEBACK_CACHE) */
+#ifdef FUSE_CAP_PARALLEL_DIROPS
+		/* the directory updates are serialized by the volume lock */
+	if (ctx->threads > 1)
+		conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+#endif /* defined(FUSE_CAP_PARALLEL_DIROPS) */
+#ifdef FUSE_CAP_MAX_PAGES
+	if (ctx->max_pages) {
+		conn->want |= FUSE_CAP_MAX_PAGES;
+		conn->max_pages = ctx->max_pages;
+	}
+#endif /* defined(FUSE_CAP_MAX_PAGES) */
 }
 
 #ifndef DISABLE_PLUGINS
@@ -744,13 +943,61 @@ static void apply_umask(struct stat *stbuf)
 
 #endif /* DISABLE_PLUGINS */
 
+/*
+ *		Set the times of a stat buffer from NTFS times
+ */
+
+static void ntfs_fuse_settimes(struct stat *stbuf, ntfs_time atime,
+			ntfs_time ctime, ntfs_time mtime)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
+	stbuf->st_atimespec = ntfs2timespec(atime);
+	stbuf->st_ctimespec = ntfs2timespec(ctime);
+	stbuf->st_mtimespec = ntfs2timespec(mtime);
+#elif defined(HAVE_STRUCT_STAT_ST_ATIM)
+	stbuf->st_atim = ntfs2timespec(atime);
+	stbuf->st_ctim = ntfs2timespec(ctime);
+	stbuf->st_mtim = ntfs2timespec(mtime);
+#elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
+	{
+	struct timespec ts;
+
+	ts = ntfs2timespec(atime);
+	stbuf->st_atime = ts.tv_sec;
+	stbuf->st_atimensec = ts.tv_nsec;
+	ts = ntfs2timespec(ctime);
+	stbuf->st_ctime = ts.tv_sec;
+	stbuf->st_ctimensec = ts.tv_nsec;
+	ts = ntfs2timespec(mtime);
+	stbuf->st_mtime = ts.tv_sec;
+	stbuf->st_mtimensec = ts.tv_nsec;
+	}
+#else
+#warning "No known way to set nanoseconds in struct stat !"
+	{
+	struct timespec ts;
+
+	ts = ntfs2timespec(atime);
+	stbuf->st_atime = ts.tv_sec;
+	ts = ntfs2timespec(ctime);
+	stbuf->st_ctime = ts.tv_sec;
+	ts = ntfs2timespec(mtime);
+	stbuf->st_mtime = ts.tv_sec;
+	}
+#endif
+}
+
 static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 				ntfs_inode *ni, struct stat *stbuf)
 {
 	int res = 0;
 	ntfs_attr *na;
 	BOOL withusermapping;
+	u32 changes;
 
+		/* the stat does not depend on the caller */
+	if (ntfs_inode_fetch_stat(ctx->vol, ni->mft_no, stbuf, &changes))
+		return (0);
 	memset(stbuf, 0, sizeof(struct stat));
 	withusermapping = (scx->mapping[MAPUSERS] != (struct MAPPING*)NULL);
 	stbuf->st_nlink = le16_to_cpu(ni->mrec->link_count);
@@ -940,41 +1187,10 @@ ok:
 		stbuf->st_mode |= 0777;
 nodata :
 	stbuf->st_ino = ni->mft_no;
-#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
-	stbuf->st_atimespec = ntfs2timespec(ni->last_access_time);
-	stbuf->st_ctimespec = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_mtimespec = ntfs2timespec(ni->last_data_change_time);
-#elif defined(HAVE_STRUCT_STAT_ST_ATIM)
-	stbuf->st_atim = ntfs2timespec(ni->last_access_time);
-	stbuf->st_ctim = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_mtim = ntfs2timespec(ni->last_data_change_time);
-#elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
-	{
-	struct timespec ts;
-
-	ts = ntfs2timespec(ni->last_access_time);
-	stbuf->st_atime = ts.tv_sec;
-	stbuf->st_atimensec = ts.tv_nsec;
-	ts = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_ctime = ts.tv_sec;
-	stbuf->st_ctimensec = ts.tv_nsec;
-	ts = ntfs2timespec(ni->last_data_change_time);
-	stbuf->st_mtime = ts.tv_sec;
-	stbuf->st_mtimensec = ts.tv_nsec;
-	}
-#else
-#warning "No known way to set nanoseconds in struct stat !"
-	{
-	struct timespec ts;
-
-	ts = ntfs2timespec(ni->last_access_time);
-	stbuf->st_atime = ts.tv_sec;
-	ts = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_ctime = ts.tv_sec;
-	ts = ntfs2timespec(ni->last_data_change_time);
-	stbuf->st_mtime = ts.tv_sec;
-	}
-#endif
+	ntfs_fuse_settimes(stbuf, ni->last_access_time,
+			ni->last_mft_change_time, ni->last_data_change_time);
+	if (!res)
+		ntfs_inode_enter_stat(ni, stbuf, changes);
 exit:
 	return (res);
 }
@@ -987,12 +1203,14 @@ static void ntfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 	struct stat stbuf;
 	struct SECURITY_CONTEXT security;
 
+	if (optrace_file)
+		ntfs_fuse_optrace("getattr", "i", (u64)ino);
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (!ni)
 		res = -errno;
 	else {
-		ntfs_fuse_fill_security_context(req, &security);
-		res = ntfs_fuse_getstat(&security, ni, &stbuf);
+		res = ntfs_fuse_getstat(ntfs_fuse_stat_context(req, &security),
+					ni, &stbuf);
 		if (ntfs_inode_close(ni))
 			set_fuse_error(&res);
 	}
@@ -1023,30 +1241,233 @@ static __inline__ BOOL ntfs_fuse_fillstat(struct SECURITY_CONTEXT *scx,
 	return (ok);
 }
 
+#if CACHE_NIDATA_SIZE
+
+/*
+ *		Count the lookups of an inode by the kernel
+ *
+ *	The kernel holds an inode for as many lookups as were replied
+ *	with it, and forgets them when evicting it from its own cache.
+ *	The inodes still held stay in the idata cache, the forgotten ones
+ *	are released so that they do not evict the held ones.
+ *	Failing to count is not an error, the inode is then only released
+ *	earlier.
+ */
+
+static void ntfs_fuse_count_lookup(fuse_ino_t ino)
+{
+	struct LOOKUP_COUNT **newbuckets;
+	struct LOOKUP_COUNT *item;
+	struct LOOKUP_COUNT *next;
+	unsigned int newsize;
+	unsigned int h;
+	unsigned int i;
+
+	if (!ino || (ino == FUSE_ROOT_ID))
+		return;
+	lock_lookups();
+	if (lookups.count >= 2*lookups.size) {
+			/* keep the chains short, start or double the table */
+		newsize = (lookups.size ? 2*lookups.size : LOOKUP_BUCKETS);
+		newbuckets = (struct LOOKUP_COUNT**)
+				ntfs_malloc(newsize*sizeof(struct LOOKUP_COUNT*));
+		if (newbuckets) {
+			memset(newbuckets, 0,
+				newsize*sizeof(struct LOOKUP_COUNT*));
+			for (i=0; i<lookups.size; i++) {
+				for (item=lookups.buckets[i]; item; item=next) {
+					next = item->next;
+					h = item->ino % newsize;
+					item->next = newbuckets[h];
+					newbuckets[h] = item;
+				}
+			}
+			free(lookups.buckets);
+			lookups.buckets = newbuckets;
+			lookups.size = newsize;
+		}
+	}
+	if (lookups.size) {
+		h = ino % lookups.size;
+		item = lookups.buckets[h];
+		while (item && (item->ino != ino))
+			item = item->next;
+		if (item)
+			item->nlookup++;
+		else {
+			item = (struct LOOKUP_COUNT*)
+				ntfs_malloc(sizeof(struct LOOKUP_COUNT));
+			if (item) {
+				item->ino = ino;
+				item->nlookup = 1;
+				item->next = lookups.buckets[h];
+				lookups.buckets[h] = item;
+				lookups.count++;
+			}
+		}
+	}
+	unlock_lookups();
+}
+
+/*
+ *		Forget lookups of an inode
+ *
+ *	Returns TRUE if the kernel does not hold the inode any more
+ */
+
+static BOOL ntfs_fuse_forget_lookups(fuse_ino_t ino, u64 nlookup)
+{
+	struct LOOKUP_COUNT **pitem;
+	struct LOOKUP_COUNT *item;
+	BOOL forgotten;
+
+	forgotten = TRUE;
+	lock_lookups();
+	if (lookups.size) {
+		pitem = &lookups.buckets[ino % lookups.size];
+		while (*pitem && ((*pitem)->ino != ino))
+			pitem = &(*pitem)->next;
+		item = *pitem;
+		if (item) {
+			if (item->nlookup > nlookup) {
+				item->nlookup -= nlookup;
+				forgotten = FALSE;
+			} else {
+				*pitem = item->next;
+				free(item);
+				lookups.count--;
+			}
+		}
+	}
+	unlock_lookups();
+	return (forgotten);
+}
+
+static void ntfs_fuse_free_lookups(void)
+{
+	struct LOOKUP_COUNT *item;
+	unsigned int i;
+
+	for (i=0; i<lookups.size; i++) {
+		while ((item = lookups.buckets[i])) {
+			lookups.buckets[i] = item->next;
+			free(item);
+		}
+	}
+	free(lookups.buckets);
+	lookups.buckets = (struct LOOKUP_COUNT**)NULL;
+	lookups.size = 0;
+	lookups.count = 0;
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+
+/*
+ *		Count the lookups implied by a readdirplus reply
+ *
+ *	Each entry but "." and ".." counts as a lookup, unless it was
+ *	replied with no inode.
+ */
+
+static void ntfs_fuse_count_direntplus(const char *buf, size_t size)
+{
+	const struct fuse_direntplus *dp;
+	size_t pos;
+
+	pos = 0;
+	while ((pos + FUSE_NAME_OFFSET_DIRENTPLUS) <= size) {
+		dp = (const struct fuse_direntplus*)&buf[pos];
+		if (dp->entry_out.nodeid
+		    && ((dp->dirent.name[0] != '.')
+			|| ((dp->dirent.namelen != 1)
+			    && ((dp->dirent.namelen != 2)
+				|| (dp->dirent.name[1] != '.')))))
+			ntfs_fuse_count_lookup(dp->entry_out.nodeid);
+		pos += FUSE_DIRENTPLUS_SIZE(dp);
+	}
+}
+
+#endif /* FUSE_CAP_READDIRPLUS */
+
+/*
+ *		Reply an entry, counting it as a lookup
+ */
+
+static void ntfs_fuse_reply_entry(fuse_req_t req,
+			const struct fuse_entry_param *entry)
+{
+	ntfs_fuse_count_lookup(entry->ino);
+		/* not counted by the kernel if the request was aborted */
+	if (fuse_reply_entry(req, entry) && entry->ino)
+		ntfs_fuse_forget_lookups(entry->ino, 1);
+}
+
+static void ntfs_fuse_reply_create(fuse_req_t req,
+			const struct fuse_entry_param *entry,
+			const struct fuse_file_info *fi)
+{
+	ntfs_fuse_count_lookup(entry->ino);
+	if (fuse_reply_create(req, entry, fi) && entry->ino)
+		ntfs_fuse_forget_lookups(entry->ino, 1);
+}
+
+static void ntfs_fuse_forget(fuse_req_t req, fuse_ino_t ino,
+			unsigned long nlookup)
+{
+	if (ntfs_fuse_forget_lookups(ino, nlookup))
+		ntfs_inode_invalidate(ctx->vol, INODE(ino));
+	fuse_reply_none(req);
+}
+
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+
+static void ntfs_fuse_forget_multi(fuse_req_t req, size_t count,
+			struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i=0; i<count; i++)
+		if (ntfs_fuse_forget_lookups(forgets[i].ino,
+						forgets[i].nlookup))
+			ntfs_inode_invalidate(ctx->vol,
+					INODE(forgets[i].ino));
+	fuse_reply_none(req);
+}
+
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+
+#else /* CACHE_NIDATA_SIZE */
+
+#define ntfs_fuse_reply_entry(req, entry) fuse_reply_entry(req, entry)
+#define ntfs_fuse_reply_create(req, entry, fi) fuse_reply_create(req, entry, fi)
+
+#endif /* CACHE_NIDATA_SIZE */
 
 static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 			const char *name)
 {
 	struct SECURITY_CONTEXT security;
+	struct SECURITY_CONTEXT *scx;
 	struct fuse_entry_param entry;
 	ntfs_inode *dir_ni;
 	u64 iref;
 	BOOL ok = FALSE;
 
+	if (optrace_file)
+		ntfs_fuse_optrace("lookup", "in", (u64)parent, name);
 	if (strlen(name) < 256) {
 		dir_ni = ntfs_inode_open(ctx->vol, INODE(parent));
 		if (dir_ni) {
+			scx = ntfs_fuse_stat_context(req, &security);
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 			/*
 			 * make sure the parent directory is searchable
 			 */
-			if (ntfs_fuse_fill_security_context(req, &security)
-			    && !ntfs_allowed_access(&security,dir_ni,S_IEXEC)) {
+			if (scx->mapping[MAPUSERS]
+			    && !ntfs_allowed_access(scx,dir_ni,S_IEXEC)) {
 				ntfs_inode_close(dir_ni);
 				errno = EACCES;
 			} else {
-#else
-				ntfs_fuse_fill_security_context(req, &security);
 #endif
 				iref = ntfs_inode_lookup_by_mbsname(dir_ni,
 								name);
@@ -1058,17 +1479,24 @@ static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 				ok = !ntfs_inode_close(dir_ni)
 					&& (iref != (u64)-1)
 					&& ntfs_fuse_fillstat(
-						&security,&entry,iref);
+						scx,&entry,iref);
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 			}
 #endif
 		}
 	} else
 		errno = ENAMETOOLONG;
-	if (!ok)
-		fuse_reply_err(req, errno);
-	else
-		fuse_reply_entry(req, &entry);
+	if (!ok) {
+		if ((errno == ENOENT) && (ctx->negative_timeout > 0)) {
+				/* let the kernel remember the name is missing */
+			memset(&entry, 0, sizeof(entry));
+			entry.ino = 0;
+			entry.entry_timeout = ctx->negative_timeout;
+			fuse_reply_entry(req, &entry);
+		} else
+			fuse_reply_err(req, errno);
+	} else
+		ntfs_fuse_reply_entry(req, &entry);
 }
 
 #ifndef DISABLE_PLUGINS
@@ -1226,22 +1654,337 @@ exit:
 	free(buf);
 }
 
-static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
+/*
+ *		Record an open file
+ *
+ *	The files are hashed by inode number, several openings of
+ *	the same inode having their own records. The table is enlarged
+ *	to keep the chains short.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+static int ntfs_fuse_add_open(struct open_file *of)
+{
+	struct open_file **newbuckets;
+	struct open_file *item;
+	struct open_file *next;
+	unsigned int newsize;
+	unsigned int h;
+	unsigned int i;
+	int res;
+
+	res = 0;
+	lock_open_files();
+	if (open_files.count >= 2*open_files.size) {
+		newsize = (open_files.size ? 2*open_files.size : OPEN_BUCKETS);
+		newbuckets = (struct open_file**)
+				ntfs_malloc(newsize*sizeof(struct open_file*));
+		if (newbuckets) {
+			memset(newbuckets, 0,
+				newsize*sizeof(struct open_file*));
+			for (i=0; i<open_files.size; i++) {
+				for (item=open_files.buckets[i]; item;
+							item=next) {
+					next = item->next;
+					h = item->ino % newsize;
+					item->previous = (struct open_file*)NULL;
+					item->next = newbuckets[h];
+					if (newbuckets[h])
+						newbuckets[h]->previous = item;
+					newbuckets[h] = item;
+				}
+			}
+			free(open_files.buckets);
+			open_files.buckets = newbuckets;
+			open_files.size = newsize;
+		} else
+			if (!open_files.size)
+				res = -1;
+	}
+	if (!res) {
+		h = of->ino % open_files.size;
+		of->previous = (struct open_file*)NULL;
+		of->next = open_files.buckets[h];
+		if (of->next)
+			of->next->previous = of;
+		open_files.buckets[h] = of;
+		open_files.count++;
+	}
+	unlock_open_files();
+	return (res);
+}
+
+static void ntfs_fuse_remove_open(struct open_file *of)
+{
+	lock_open_files();
+	if (of->next)
+		of->next->previous = of->previous;
+	if (of->previous)
+		of->previous->next = of->next;
+	else
+		open_files.buckets[of->ino % open_files.size] = of->next;
+	open_files.count--;
+	unlock_open_files();
+}
+
+/*
+ *		Get the first record of the openings of an inode
+ *
+ *	The next ones have to be searched from the returned one.
+ */
+
+static struct open_file *ntfs_fuse_first_open(fuse_ino_t ino)
+{
+	struct open_file *of;
+
+	of = (struct open_file*)NULL;
+	if (open_files.size) {
+		of = open_files.buckets[ino % open_files.size];
+		while (of && (of->ino != ino))
+			of = of->next;
+	}
+	return (of);
+}
+
+static struct open_file *ntfs_fuse_next_open(struct open_file *of)
+{
+	fuse_ino_t ino;
+
+	ino = of->ino;
+	do {
+		of = of->next;
+	} while (of && (of->ino != ino));
+	return (of);
+}
+
+static void ntfs_fuse_free_open_files(void)
+{
+	struct open_file *of;
+	unsigned int i;
+
+	for (i=0; i<open_files.size; i++) {
+		while ((of = open_files.buckets[i])) {
+			open_files.buckets[i] = of->next;
+			ntfs_attr_close(of->na);
+			free(of);
+		}
+	}
+	free(open_files.buckets);
+	open_files.buckets = (struct open_file**)NULL;
+	open_files.size = 0;
+	open_files.count = 0;
+}
+
+/*
+ *		Get the data attribute of an open file
+ *
+ *	The attribute is kept open along with the file, so that it does
+ *	not have to be looked up and its runlist mapped again on each
+ *	request. It is attached to the inode opened for the request.
+ *	When it is in use by a concurrent reader, or when there is no
+ *	open file record, another attribute is opened for the request.
+ *
+ *	Returns the attribute, or NULL if it could not be opened
+ */
+
+static ntfs_attr *ntfs_fuse_get_data_attr(struct open_file *of,
+			ntfs_inode *ni, BOOL *kept)
+{
+	ntfs_attr *na;
+
+	na = (ntfs_attr*)NULL;
+	*kept = FALSE;
+	if (of) {
+		lock_open_files();
+		if (!of->busy) {
+			of->busy = TRUE;
+			na = of->na;
+			of->na = (ntfs_attr*)NULL;
+			*kept = TRUE;
+		}
+		unlock_open_files();
+	}
+	if (na)
+		na->ni = ni;
+	else {
+		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		if (na && of)
+			na->ra = of->ra;
+		if (!na && *kept) {
+			lock_open_files();
+			of->busy = FALSE;
+			unlock_open_files();
+			*kept = FALSE;
+		}
+	}
+	return (na);
+}
+
+/*
+ *		Release the data attribute got by ntfs_fuse_get_data_attr()
+ *
+ *	The attribute is kept for next requests, unless the request
+ *	failed, as it may then not reflect the state of the file.
+ */
+
+static void ntfs_fuse_put_data_attr(struct open_file *of, ntfs_attr *na,
+			BOOL kept, BOOL ok)
+{
+	NAttrClearConcurrentRead(na);
+	if (of)
+		of->ra = na->ra;
+	if (kept && ok) {
+		lock_open_files();
+		of->na = na;
+		of->busy = FALSE;
+		unlock_open_files();
+	} else {
+		ntfs_attr_close(na);
+		if (kept) {
+			lock_open_files();
+			of->busy = FALSE;
+			unlock_open_files();
+		}
+	}
+}
+
+/*
+ *		Close the data attributes kept open for an inode
+ *
+ *	To be called after the data attribute has been changed otherwise
+ *	than through the attributes kept, which would then be stale.
+ *	This is only done in requests which have the volume to
+ *	themselves, so the attributes cannot be in use.
+ */
+
+static void ntfs_fuse_drop_data_attrs(fuse_ino_t ino)
+{
+	struct open_file *of;
+
+	lock_open_files();
+	for (of=ntfs_fuse_first_open(ino); of; of=ntfs_fuse_next_open(of)) {
+		ntfs_attr_close(of->na);
+		of->na = (ntfs_attr*)NULL;
+	}
+	unlock_open_files();
+}
+
+/*
+ *		Check whether an entry is open
+ *
+ *	The size and times recorded in the index for a file being
+ *	written may not be up to date.
+ */
+
+static BOOL ntfs_fuse_is_open(fuse_ino_t ino)
+{
+	BOOL found;
+
+	lock_open_files();
+	found = (ntfs_fuse_first_open(ino) != (struct open_file*)NULL);
+	unlock_open_files();
+	return (found);
+}
+
+/*
+ *		Get the attributes of a directory entry for readdirplus
+ *
+ *	The attributes of plain files are built from the file name
+ *	recorded in the index entry, without opening the inode. The
+ *	inode is opened when the attributes depend on more than the
+ *	file name (directories, reparse points, Interix files, user
+ *	mapping, ...).
+ *	When the attributes cannot be determined, a zero inode number
+ *	is returned, so that the kernel looks the entry up when needed.
+ */
+
+static void ntfs_fuse_entry_stat(ntfs_fuse_fill_context_t *fill_ctx,
+			struct fuse_entry_param *pentry, const struct stat *st,
+			const char *filename, const MFT_REF mref,
+			const FILE_NAME_ATTR *fn)
+{
+	le32 special;
+
+	memset(pentry, 0, sizeof(struct fuse_entry_param));
+	special = FILE_ATTR_REPARSE_POINT | FILE_ATTR_SYSTEM
+			| FILE_ATTR_I30_INDEX_PRESENT;
+#ifdef HAVE_SETXATTR	/* extended attributes interface required */
+	if (ctx->efs_raw)
+		special |= FILE_ATTR_ENCRYPTED;
+#endif /* HAVE_SETXATTR */
+	if (!strcmp(filename, ".") || !strcmp(filename, "..")) {
+		/* not looked up by the kernel */
+	} else if (fn
+	    && !(fn->file_attributes & special)
+	    && !ctx->posix_nlink
+	    && !fill_ctx->scx->mapping[MAPUSERS]
+	    && !ntfs_fuse_is_open(MREF(mref))
+	    && !ntfs_inode_writeback_pending(ctx->vol, MREF(mref))) {
+		pentry->attr.st_ino = MREF(mref);
+		pentry->attr.st_mode = S_IFREG | (0777 & ~ctx->fmask);
+		pentry->attr.st_nlink = 1;
+		pentry->attr.st_uid = ctx->uid;
+		pentry->attr.st_gid = ctx->gid;
+		pentry->attr.st_size = sle64_to_cpu(fn->data_size);
+		pentry->attr.st_blocks =
+			(sle64_to_cpu(fn->allocated_size) + 511) >> 9;
+		ntfs_fuse_settimes(&pentry->attr, fn->last_access_time,
+			fn->last_mft_change_time, fn->last_data_change_time);
+		pentry->ino = MREF(mref);
+		pentry->generation = 1;
+		pentry->attr_timeout = ATTR_TIMEOUT;
+		pentry->entry_timeout = ENTRY_TIMEOUT;
+		return;
+	} else if (ntfs_fuse_fillstat(fill_ctx->scx, pentry, mref))
+		return;
+	memset(pentry, 0, sizeof(struct fuse_entry_param));
+	pentry->attr.st_ino = st->st_ino;
+	pentry->attr.st_mode = st->st_mode;
+}
+
+/*
+ *		Add an entry to a readdir or readdirplus buffer
+ */
+
+static size_t ntfs_fuse_add_entry(ntfs_fuse_fill_context_t *fill_ctx,
+			char *buf, size_t bufsize, const char *name,
+			const struct stat *st,
+			const struct fuse_entry_param *pentry, off_t off)
+{
+	size_t sz;
+
+#ifdef FUSE_CAP_READDIRPLUS
+	if (fill_ctx->plus)
+		sz = fuse_add_direntry_plus(fill_ctx->req, buf, bufsize,
+				name, pentry, off);
+	else
+#endif /* FUSE_CAP_READDIRPLUS */
+		sz = fuse_add_direntry(fill_ctx->req, buf, bufsize,
+				name, st, off);
+	return (sz);
+}
+
+static int ntfs_fuse_filler_fn(ntfs_fuse_fill_context_t *fill_ctx,
 		const ntfschar *name, const int name_len, const int name_type,
 		const s64 pos __attribute__((unused)), const MFT_REF mref,
-		const unsigned dt_type __attribute__((unused)))
+		const unsigned dt_type __attribute__((unused)),
+		const FILE_NAME_ATTR *fn)
 {
-	char *filename = NULL;
+	char namebuf[NTFS_MAX_NAME_LEN*MB_LEN_MAX + 1];
+	char *filename = namebuf;
 	int ret = 0;
 	int filenamelen = -1;
 	size_t sz;
 	ntfs_fuse_fill_item_t *current;
 	ntfs_fuse_fill_item_t *newone;
+	struct fuse_entry_param entry;
 
 	if (name_type == FILE_NAME_DOS)
 		return 0;
         
-	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename, 0)) < 0) {
+	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename,
+				sizeof(namebuf))) < 0) {
 		ntfs_log_perror("Filename decoding failed (inode %llu)",
 				(unsigned long long)MREF(mref));
 		return -1;
@@ -1330,11 +2073,15 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		}
 #endif /* defined(__APPLE__) || defined(__DARWIN__), ... */
 	
+		if (fill_ctx->plus)
+			ntfs_fuse_entry_stat(fill_ctx, &entry, &st,
+					filename, mref, fn);
 		current = fill_ctx->last;
-		sz = fuse_add_direntry(fill_ctx->req,
+		sz = ntfs_fuse_add_entry(fill_ctx,
 				&current->buf[current->off],
 				current->bufsize - current->off,
-				filename, &st, current->off + fill_ctx->off);
+				filename, &st, &entry,
+				current->off + fill_ctx->off);
 		if (!sz || ((current->off + sz) > current->bufsize)) {
 			newone = (ntfs_fuse_fill_item_t*)ntfs_malloc
 				(sizeof(ntfs_fuse_fill_item_t)
@@ -1347,10 +2094,11 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 				fill_ctx->last = newone;
 				fill_ctx->off += current->off;
 				current = newone;
-				sz = fuse_add_direntry(fill_ctx->req,
+				sz = ntfs_fuse_add_entry(fill_ctx,
 					current->buf,
 					current->bufsize - current->off,
-					filename, &st, fill_ctx->off);
+					filename, &st, &entry,
+					fill_ctx->off);
 				if (!sz) {
 					errno = EIO;
 					ntfs_log_error("Could not add a"
@@ -1369,10 +2117,28 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		}
 	}
         
-	free(filename);
 	return ret;
 }
 
+#ifndef DISABLE_PLUGINS
+
+/*
+ *		Filler for the directories listed by a reparse plugin
+ *
+ *	No file name attribute is available, so the inodes are opened
+ *	when replying to readdirplus.
+ */
+
+static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
+		const ntfschar *name, const int name_len, const int name_type,
+		const s64 pos, const MFT_REF mref, const unsigned dt_type)
+{
+	return (ntfs_fuse_filler_fn(fill_ctx, name, name_len, name_type,
+			pos, mref, dt_type, (const FILE_NAME_ATTR*)NULL));
+}
+
+#endif /* DISABLE_PLUGINS */
+
 static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 			 struct fuse_file_info *fi)
 {
@@ -1417,6 +2183,8 @@ static void ntfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 				fill->first = fill->last
 					= (ntfs_fuse_fill_item_t*)NULL;
 				fill->filled = FALSE;
+				fill->plus = FALSE;
+				fill->scx = (struct SECURITY_CONTEXT*)NULL;
 				fill->ino = ino;
 				fill->off = 0;
 #ifndef DISABLE_PLUGINS
@@ -1481,9 +2249,16 @@ static void ntfs_fuse_releasedir(fuse_req_t req,
 	fuse_reply_err(req, -res);
 }
 
-static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-			off_t off __attribute__((unused)),
-			struct fuse_file_info *fi __attribute__((unused)))
+/*
+ *		Read a directory, for readdir or readdirplus
+ *
+ *	The full list is built on the first call, and the entries
+ *	carry their attributes when replying to readdirplus.
+ */
+
+static void ntfs_fuse_readdir_common(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_file_info *fi,
+			BOOL plus)
 {
 #ifndef DISABLE_PLUGINS
 	struct fuse_file_info ufi;
@@ -1491,13 +2266,17 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 	ntfs_fuse_fill_item_t *first;
 	ntfs_fuse_fill_item_t *current;
 	ntfs_fuse_fill_context_t *fill;
+	struct SECURITY_CONTEXT security;
 	ntfs_inode *ni;
 	s64 pos = 0;
 	int err = 0;
 
+	if (optrace_file)
+		ntfs_fuse_optrace((plus ? "readdirplus" : "readdir"), "idd",
+				(u64)ino, (s64)off, (s64)size);
 	fill = (ntfs_fuse_fill_context_t*)(long)fi->fh;
 	if (fill && (fill->ino == ino)) {
-		if (fill->filled && !off) {
+		if (fill->filled && (!off || (fill->plus != plus))) {
 			/* Rewinding : make sure to clear existing results */   
 			current = fill->first;
 			while (current) {
@@ -1520,6 +2299,12 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 				fill->first = first;
 				fill->last = first;
 				fill->off = 0;
+				fill->plus = plus;
+				if (plus) {
+					ntfs_fuse_fill_security_context(req,
+							&security);
+					fill->scx = &security;
+				}
 				ni = ntfs_inode_open(ctx->vol,INODE(ino));
 				if (!ni)
 					err = -errno;
@@ -1540,12 +2325,14 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 						err = -EOPNOTSUPP;
 #endif /* DISABLE_PLUGINS */
 					} else {
-						if (ntfs_readdir(ni, &pos, fill,
-							(ntfs_filldir_t)
-							ntfs_fuse_filler))
+						if (ntfs_readdir_fn(ni, &pos, fill,
+							(ntfs_filldir_fn_t)
+							ntfs_fuse_filler_fn))
 							err = -errno;
 					}
 					fill->filled = TRUE;
+					fill->scx = (struct SECURITY_CONTEXT*)
+							NULL;
 					ntfs_fuse_update_times(ni,
 						NTFS_UPDATE_ATIME);
 					if (ntfs_inode_close(ni))
@@ -1581,6 +2368,11 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		}
 		if (!err) {
 			if (current) {
+#if CACHE_NIDATA_SIZE && defined(FUSE_CAP_READDIRPLUS)
+				if (fill->plus)
+					ntfs_fuse_count_direntplus(current->buf,
+							current->off);
+#endif
 				fuse_reply_buf(req, current->buf, current->off);
 				fill->first = current->next;
 				free(current);
@@ -1598,6 +2390,22 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		fuse_reply_err(req, -err);
 }
 
+static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_readdir_common(req, ino, size, off, fi, FALSE);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+
+static void ntfs_fuse_readdirplus(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off, struct fuse_file_info *fi)
+{
+	ntfs_fuse_readdir_common(req, ino, size, off, fi, TRUE);
+}
+
+#endif /* FUSE_CAP_READDIRPLUS */
+
 static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 		      struct fuse_file_info *fi)
 {
@@ -1611,6 +2419,8 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 	struct SECURITY_CONTEXT security;
 #endif
 
+	if (optrace_file)
+		ntfs_fuse_optrace("open", "id", (u64)ino, (s64)fi->flags);
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (ni) {
 		if (!(ni->flags & FILE_ATTR_REPARSE_POINT)) {
@@ -1655,6 +2465,10 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 		/* mark a future need to compress the last chunk */
 			if (na->data_flags & ATTR_COMPRESSION_MASK)
 				state |= CLOSE_COMPRESSED;
+		/* mark a future need to release the preallocation */
+			else
+				if (ctx->vol->prealloc_size)
+					state |= CLOSE_PREALLOC;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 		/* mark a future need to fixup encrypted inode */
 			if (ctx->efs_raw
@@ -1669,7 +2483,6 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 			if (ino < FILE_first_user)
 				res = -EPERM;
 		}
-		ntfs_attr_close(na);
 close:
 		if (ntfs_inode_close(ni))
 			set_fuse_error(&res);
@@ -1681,17 +2494,22 @@ close:
 			of->parent = 0;
 			of->ino = ino;
 			of->state = state;
+			memset(&of->ra, 0, sizeof(of->ra));
+				/* keep the data attribute for reading */
+			of->na = na;
+			of->busy = FALSE;
+			na = (ntfs_attr*)NULL;
 #ifndef DISABLE_PLUGINS
 			memcpy(&of->fi, fi, sizeof(struct fuse_file_info));
 #endif /* DISABLE_PLUGINS */
-			of->next = ctx->open_files;
-			of->previous = (struct open_file*)NULL;
-			if (ctx->open_files)
-				ctx->open_files->previous = of;
-			ctx->open_files = of;
-			fi->fh = (long)of;
+			if (ntfs_fuse_add_open(of)) {
+				ntfs_attr_close(of->na);
+				free(of);
+			} else
+				fi->fh = (long)of;
 		}
 	}
+	ntfs_attr_close(na);
 	if (res)
 		fuse_reply_err(req, -res);
 	else
@@ -1704,11 +2522,20 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
+	struct open_file *of;
 	int res;
 	char *buf = (char*)NULL;
 	s64 total = 0;
 	s64 max_read;
+	struct ntfs_io_segment seg[READ_MAP_FRAGMENTS];
+	struct iovec iov[READ_MAP_FRAGMENTS];
+	int nseg = 0;
+	BOOL kept;
+	int i;
 
+	if (optrace_file)
+		ntfs_fuse_optrace("read", "idd", (u64)ino, (s64)offset,
+				(s64)size);
 	if (!size) {
 		res = 0;
 		goto exit;
@@ -1728,7 +2555,6 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 #ifndef DISABLE_PLUGINS
 		const plugin_operations_t *ops;
 		REPARSE_POINT *reparse;
-		struct open_file *of;
 
 		of = (struct open_file*)(long)fi->fh;
 		res = CALL_REPARSE_PLUGIN(ni, read, buf, size, offset, &of->fi);
@@ -1740,11 +2566,15 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 #endif /* DISABLE_PLUGINS */
 		goto exit;
 	}
-	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	of = (struct open_file*)(long)fi->fh;
+	na = ntfs_fuse_get_data_attr(of, ni, &kept);
 	if (!na) {
 		res = -errno;
 		goto exit;
 	}
+		/* let other requests proceed while reading the data */
+	if (ctx->threads > 1)
+		NAttrSetConcurrentRead(na);
 	max_read = na->data_size;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 	/* limit reads at next 512 byte boundary for encrypted attributes */
@@ -1760,6 +2590,29 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			goto ok;
 		size = max_read - offset;
 	}
+	if (size && ((ctx->vol->dev->d_cache && (ctx->threads <= 1))
+			|| NDevMapped(ctx->vol->dev))) {
+		/*
+		 * Reply the cached or mapped data in place, not
+		 * copying it. Not done from the cache with several
+		 * threads, as the cached blocks may be evicted by
+		 * another reader.
+		 */
+		s64 ret = ntfs_attr_pread_map(na, offset, size, buf,
+				seg, READ_MAP_FRAGMENTS, &nseg);
+		if (ret != (s64)size)
+			ntfs_log_perror("ntfs_attr_pread_map error reading inode"
+				" %lld at offset %lld: %lld <> %lld",
+				(long long)ni->mft_no, (long long)offset,
+				(long long)size, (long long)ret);
+		if (ret <= 0 || ret > (s64)size) {
+			res = (ret < 0) ? -errno : -EIO;
+			nseg = 0;
+			goto exit;
+		}
+		total = ret;
+		size = 0;
+	}
 	while (size > 0) {
 		s64 ret = ntfs_attr_pread(na, offset, size, buf + total);
 		if (ret != (s64)size)
@@ -1780,26 +2633,129 @@ ok:
 stamps :
 #endif /* DISABLE_PLUGINS */
 	ntfs_fuse_update_times(ni, NTFS_UPDATE_ATIME);
+	if (nseg) {
+		/*
+		 * Reply before closing, as the cached blocks may be
+		 * evicted when the inode is written.
+		 */
+		for (i=0; i<nseg; i++) {
+			iov[i].iov_base = seg[i].buf;
+			iov[i].iov_len = seg[i].count;
+		}
+		fuse_reply_iov(req, iov, nseg);
+	}
 exit:
 	if (na)
-		ntfs_attr_close(na);
+		ntfs_fuse_put_data_attr(of, na, kept, res >= 0);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
-	if (res < 0)
-		fuse_reply_err(req, -res);
-	else
-		fuse_reply_buf(req, buf, res);
+	if (!nseg) {
+		if (res < 0)
+			fuse_reply_err(req, -res);
+		else
+			fuse_reply_buf(req, buf, res);
+	}
 	free(buf);
 }
 
+	/* set when a write request has been turned into an exclusive one */
+static BOOL exclusive_write = FALSE;
+
+/*
+ *		Turn a write request into an exclusive one
+ *
+ *	With several threads, writes are made in shared requests (see
+ *	ntfs_fuse_lock_request()), and a write which cannot be made
+ *	by ntfs_fuse_overwrite() has to get the exclusive lock. Nothing
+ *	may be open when switching, as other requests may run meanwhile.
+ */
+
+static void ntfs_fuse_exclusive_request(void)
+{
+	ntfs_volume_unlock(ctx->vol, TRUE);
+	ntfs_volume_lock(ctx->vol, FALSE);
+	exclusive_write = TRUE;
+}
+
+/*
+ *		Overwrite the data of a file in a shared request
+ *
+ *	When the data written is allocated and initialized, writing it
+ *	does not change any metadata, and it may be transferred while
+ *	other shared requests (reads and overwrites) proceed. Updating
+ *	the times and the archive flag of the file is then deferred until
+ *	the file is released, as done with the dmtime option.
+ *
+ *	Returns TRUE if the write was done (successfully or not), with
+ *		the count written or a negative error code in *pres,
+ *		FALSE if it needs an exclusive request
+ */
+
+static BOOL ntfs_fuse_overwrite(struct open_file *of, fuse_ino_t ino,
+			const char *buf, size_t size, off_t offset, int *pres)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	BOOL done;
+	BOOL kept;
+	s64 ret;
+	int total;
+
+	done = FALSE;
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (ni && !(ni->flags & FILE_ATTR_REPARSE_POINT)) {
+		na = ntfs_fuse_get_data_attr(of, ni, &kept);
+		if (na && ntfs_attr_overwrites(na, offset, size)) {
+			done = TRUE;
+			total = 0;
+			ret = 0;
+			NAttrSetConcurrentWrite(na);
+			while (size) {
+				ret = ntfs_attr_pwrite(na, offset, size,
+						buf + total);
+				if (ret <= 0)
+					break;
+				size   -= ret;
+				offset += ret;
+				total  += ret;
+			}
+			NAttrClearConcurrentWrite(na);
+			*pres = (ret > 0 ? total : -errno);
+			if (*pres > 0) {
+				lock_open_files();
+				of->state |= CLOSE_DMTIME | CLOSE_ARCHIVE;
+				unlock_open_files();
+			}
+		}
+		if (na)
+			ntfs_fuse_put_data_attr(of, na, kept,
+					!done || (*pres >= 0));
+	}
+	if (ni && ntfs_inode_close(ni) && done)
+		set_fuse_error(pres);
+	return (done);
+}
+
 static void ntfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf, 
 			size_t size, off_t offset,
 			struct fuse_file_info *fi __attribute__((unused)))
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
+	struct open_file *of;
+	BOOL kept;
 	int res, total = 0;
 
+	if (optrace_file)
+		ntfs_fuse_optrace("write", "idd", (u64)ino, (s64)offset,
+				(s64)size);
+	of = (struct open_file*)(long)fi->fh;
+	if (ctx->threads > 1) {
+		if (of && ntfs_fuse_overwrite(of, ino, buf, size, offset,
+						&res))
+			goto reply;
+		ntfs_fuse_exclusive_request();
+	}
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (!ni) {
 		res = -errno;
@@ -1809,9 +2765,7 @@ static void ntfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 #ifndef DISABLE_PLUGINS
 		const plugin_operations_t *ops;
 		REPARSE_POINT *reparse;
-		struct open_file *of;
 
-		of = (struct open_file*)(long)fi->fh;
 		res = CALL_REPARSE_PLUGIN(ni, write, buf, size, offset,
 								&of->fi);
 		if (res >= 0) {
@@ -1822,7 +2776,7 @@ static void ntfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 #endif /* DISABLE_PLUGINS */
 		goto exit;
 	}
-	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	na = ntfs_fuse_get_data_attr(of, ni, &kept);
 	if (!na) {
 		res = -errno;
 		goto exit;
@@ -1847,12 +2801,16 @@ stamps :
 		     - sle64_to_cpu(ni->last_data_change_time)) > ctx->dmtime))
 		ntfs_fuse_update_times(ni, NTFS_UPDATE_MCTIME);
 exit:
-	if (na)
-		ntfs_attr_close(na);
+	if (na) {
+			/* the attributes kept for other openings are stale */
+		ntfs_fuse_drop_data_attrs(ino);
+		ntfs_fuse_put_data_attr(of, na, kept, res >= 0);
+	}
 	if (res > 0)
 		set_archive(ni);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
+reply:
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
@@ -2058,7 +3016,10 @@ stamps :
 	errno = (res ? -res : 0);
 exit:
 	res = -errno;
-	ntfs_attr_close(na);
+	if (na) {
+		ntfs_attr_close(na);
+		ntfs_fuse_drop_data_attrs(ino);
+	}
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
 	return res;
@@ -2219,6 +3180,13 @@ static void ntfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 	struct SECURITY_CONTEXT security;
 
 	res = 0;
+	if (optrace_file) {
+		if (to_set & FUSE_SET_ATTR_SIZE)
+			ntfs_fuse_optrace("truncate", "id", (u64)ino,
+					(s64)attr->st_size);
+		if (to_set & ~FUSE_SET_ATTR_SIZE)
+			ntfs_fuse_optrace("setattr", "i", (u64)ino);
+	}
 	ntfs_fuse_fill_security_context(req, &security);
 						/* no flags */
 	if (!(to_set
@@ -2483,6 +3451,10 @@ static int ntfs_fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 			if (fi && (ni->flags & FILE_ATTR_COMPRESSED)) {
 				state |= CLOSE_COMPRESSED;
 			}
+			/* mark a need to release the preallocation */
+			if (fi && !(ni->flags & FILE_ATTR_COMPRESSED)
+			    && ctx->vol->prealloc_size)
+				state |= CLOSE_PREALLOC;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 			/* mark a future need to fixup encrypted inode */
 			if (fi
@@ -2525,12 +3497,13 @@ exit:
 			of->parent = 0;
 			of->ino = e->ino;
 			of->state = state;
-			of->next = ctx->open_files;
-			of->previous = (struct open_file*)NULL;
-			if (ctx->open_files)
-				ctx->open_files->previous = of;
-			ctx->open_files = of;
-			fi->fh = (long)of;
+			memset(&of->ra, 0, sizeof(of->ra));
+			of->na = (ntfs_attr*)NULL;
+			of->busy = FALSE;
+			if (ntfs_fuse_add_open(of))
+				free(of);
+			else
+				fi->fh = (long)of;
 		}
 	}
 	return res;
@@ -2545,10 +3518,13 @@ static void ntfs_fuse_create_file(fuse_req_t req, fuse_ino_t parent,
 
 	res = ntfs_fuse_create(req, parent, name, mode & (S_IFMT | 07777),
 				0, &entry, NULL, fi);
+	if (optrace_file)
+		ntfs_fuse_optrace("create", "inoi", (u64)parent, name,
+			(int)(mode & S_IFMT), (u64)(res < 0 ? 0 : entry.ino));
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_create(req, &entry, fi);
+		ntfs_fuse_reply_create(req, &entry, fi);
 }
 
 static void ntfs_fuse_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
@@ -2559,10 +3535,13 @@ static void ntfs_fuse_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 	res = ntfs_fuse_create(req, parent, name, mode & (S_IFMT | 07777),
 				rdev, &e,NULL,(struct fuse_file_info*)NULL);
+	if (optrace_file)
+		ntfs_fuse_optrace("create", "inoi", (u64)parent, name,
+			(int)(mode & S_IFMT), (u64)(res < 0 ? 0 : e.ino));
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_entry(req, &e);
+		ntfs_fuse_reply_entry(req, &e);
 }
 
 static void ntfs_fuse_symlink(fuse_req_t req, const char *target,
@@ -2573,10 +3552,13 @@ static void ntfs_fuse_symlink(fuse_req_t req, const char *target,
 
 	res = ntfs_fuse_create(req, parent, name, S_IFLNK, 0,
 			&entry, target, (struct fuse_file_info*)NULL);
+	if (optrace_file)
+		ntfs_fuse_optrace("symlink", "inni", (u64)parent, name,
+			target, (u64)(res < 0 ? 0 : entry.ino));
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_entry(req, &entry);
+		ntfs_fuse_reply_entry(req, &entry);
 }
 
 
@@ -2678,10 +3660,13 @@ static void ntfs_fuse_link(fuse_req_t req, fuse_ino_t ino,
 	int res;
 
 	res = ntfs_fuse_newlink(req, ino, newparent, newname, &entry);
+	if (optrace_file)
+		ntfs_fuse_optrace("link", "iin", (u64)ino, (u64)newparent,
+				newname);
 	if (res)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_entry(req, &entry);
+		ntfs_fuse_reply_entry(req, &entry);
 }
 
 static int ntfs_fuse_rm(fuse_req_t req, fuse_ino_t parent, const char *name,
@@ -2794,8 +3779,9 @@ static int ntfs_fuse_rm(fuse_req_t req, fuse_ino_t parent, const char *name,
 		 * name being unlinked, and permissions to do so are the
 		 * same as required for unlinking.
 		 */
-	for (of=ctx->open_files; of; of = of->next) {
-		if ((of->ino == ino) && !(of->state & CLOSE_GHOST)) {
+		/* updates are not concurrent, the records are stable */
+	for (of=ntfs_fuse_first_open(ino); of; of=ntfs_fuse_next_open(of)) {
+		if (!(of->state & CLOSE_GHOST)) {
 			/* file was open, create a ghost in unlink parent */
 			ntfs_inode *gni;
 			u64 gref;
@@ -2885,6 +3871,8 @@ static void ntfs_fuse_unlink(fuse_req_t req, fuse_ino_t parent,
 {
 	int res;
 
+	if (optrace_file)
+		ntfs_fuse_optrace("unlink", "in", (u64)parent, name);
 	res = ntfs_fuse_rm(req, parent, name, RM_LINK);
 	if (res)
 		fuse_reply_err(req, -res);
@@ -3015,6 +4003,9 @@ static void ntfs_fuse_rename(fuse_req_t req, fuse_ino_t parent,
 	ntfs_inode *ni;
         
 	ntfs_log_debug("rename: old: '%s'  new: '%s'\n", name, newname);
+	if (optrace_file)
+		ntfs_fuse_optrace("rename", "inin", (u64)parent, name,
+				(u64)newparent, newname);
         
 	/*
 	 *  FIXME: Rename should be atomic.
@@ -3025,6 +4016,8 @@ static void ntfs_fuse_rename(fuse_req_t req, fuse_ino_t parent,
 		ret = -errno;
 		goto out;
 	}
+		/* record the links changed as the names of a rename */
+	ntfs_usn_renaming(ctx->vol, INODE(ino));
 	/* Check whether target is present */
 	xino = ntfs_fuse_inode_lookup(newparent, newname);
 	if (xino != (fuse_ino_t)-1) {
@@ -3063,12 +4056,65 @@ static void ntfs_fuse_rename(fuse_req_t req, fuse_ino_t parent,
 			ntfs_fuse_rm(req, newparent, newname, RM_ANY);
 	}
 out:
+	ntfs_usn_renaming(ctx->vol, 0);
 	if (ret)
 		fuse_reply_err(req, -ret);
 	else
 		fuse_reply_err(req, 0);
 }
 
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+
+/*
+ *		Invalidate the attributes of an inode cached by the kernel
+ *
+ *	This is needed when the inode is changed in a way the kernel
+ *	cannot know. It is not an error when the kernel does not cache
+ *	the inode, or does not support the notifications.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+static int ntfs_fuse_inval_inode(fuse_ino_t ino)
+{
+	int res;
+
+	res = fuse_lowlevel_notify_inval_inode(ctx->fc, ino, -1, 0);
+	if ((res == -ENOENT) || (res == -ENOSYS))
+		res = 0;
+	if (res) {
+		errno = -res;
+		res = -1;
+	}
+	return (res);
+}
+
+/*
+ *		Invalidate a name cached by the kernel
+ *
+ *	This must not be called while the kernel waits for a request on
+ *	the parent directory, as it locks the directory to invalidate.
+ *
+ *	Returns zero if successful, -1 otherwise
+ */
+
+static int ntfs_fuse_inval_entry(fuse_ino_t parent, const char *name)
+{
+	int res;
+
+	res = fuse_lowlevel_notify_inval_entry(ctx->fc, parent,
+						name, strlen(name));
+	if ((res == -ENOENT) || (res == -ENOSYS))
+		res = 0;
+	if (res) {
+		errno = -res;
+		res = -1;
+	}
+	return (res);
+}
+
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+
 static void ntfs_fuse_release(fuse_req_t req, fuse_ino_t ino,
 			 struct fuse_file_info *fi)
 {
@@ -3078,114 +4124,399 @@ static void ntfs_fuse_release(fuse_req_t req, fuse_ino_t ino,
 	char ghostname[GHOSTLTH];
 	int res;
 
+	if (optrace_file)
+		ntfs_fuse_optrace("release", "i", (u64)ino);
 	of = (struct open_file*)(long)fi->fh;
 	/* Only for marked descriptors there is something to do */
 	if (!of
 	    || !(of->state & (CLOSE_COMPRESSED | CLOSE_ENCRYPTED
-				| CLOSE_DMTIME | CLOSE_REPARSE))) {
+				| CLOSE_DMTIME | CLOSE_REPARSE
+				| CLOSE_PREALLOC | CLOSE_ARCHIVE))) {
+		res = 0;
+		goto out;
+	}
+		/* the closing fixups change the data attribute */
+	ntfs_fuse_drop_data_attrs(ino);
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (!ni) {
+		res = -errno;
+		goto exit;
+	}
+	if (ni->flags & FILE_ATTR_REPARSE_POINT) {
+#ifndef DISABLE_PLUGINS
+		const plugin_operations_t *ops;
+		REPARSE_POINT *reparse;
+
+		res = CALL_REPARSE_PLUGIN(ni, release, &of->fi);
+		if (!res) {
+			goto stamps;
+		}
+#else /* DISABLE_PLUGINS */
+			/* Assume release() was not needed */
 		res = 0;
+#endif /* DISABLE_PLUGINS */
+		goto exit;
+	}
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na) {
+		res = -errno;
+		goto exit;
+	}
+	res = 0;
+	if (of->state & CLOSE_COMPRESSED)
+		res = ntfs_attr_pclose(na);
+	if ((of->state & CLOSE_PREALLOC)
+	    && ntfs_attr_trim_prealloc(na))
+		res = -errno;
+#ifdef HAVE_SETXATTR	/* extended attributes interface required */
+	if (of->state & CLOSE_ENCRYPTED)
+		res = ntfs_efs_fixup_attribute(NULL, na);
+#endif /* HAVE_SETXATTR */
+#ifndef DISABLE_PLUGINS
+stamps :
+#endif /* DISABLE_PLUGINS */
+	if (of->state & CLOSE_DMTIME)
+		ntfs_inode_update_times(ni,NTFS_UPDATE_MCTIME);
+	if (of->state & CLOSE_ARCHIVE) {
+		set_archive(ni);
+		NInoSetDirty(ni);
+	}
+exit:
+	if (na)
+		ntfs_attr_close(na);
+	if (ntfs_inode_close(ni))
+		set_fuse_error(&res);
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+		/* the sizes or times were changed after the last request */
+	if (ni && (ATTR_TIMEOUT > 0.0))
+		ntfs_fuse_inval_inode(ino);
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+out:    
+		/* remove the associate ghost file (even if release failed) */
+	if (of) {
+		if (of->state & CLOSE_GHOST) {
+			sprintf(ghostname,ghostformat,of->ghost);
+			ntfs_fuse_rm(req, of->parent, ghostname, RM_ANY);
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+				/* the kernel may know the name from a listing */
+			if (ENTRY_TIMEOUT > 0.0)
+				ntfs_fuse_inval_entry(of->parent, ghostname);
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+		}
+			/* remove from open files */
+		ntfs_fuse_remove_open(of);
+		ntfs_attr_close(of->na);
+		free(of);
+	}
+	if (res)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_err(req, 0);
+}
+
+static void ntfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
+		       const char *name, mode_t mode)
+{
+	int res;
+	struct fuse_entry_param entry;
+
+	res = ntfs_fuse_create(req, parent, name, S_IFDIR | (mode & 07777),
+			0, &entry, (char*)NULL, (struct fuse_file_info*)NULL);
+	if (optrace_file)
+		ntfs_fuse_optrace("mkdir", "ini", (u64)parent, name,
+			(u64)(res < 0 ? 0 : entry.ino));
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		ntfs_fuse_reply_entry(req, &entry);
+}
+
+static void ntfs_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res;
+
+	if (optrace_file)
+		ntfs_fuse_optrace("rmdir", "in", (u64)parent, name);
+	res = ntfs_fuse_rm(req, parent, name, RM_DIR);
+	if (res)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_err(req, 0);
+}
+
+static void ntfs_fuse_fsync(fuse_req_t req, fuse_ino_t ino,
+			int type __attribute__((unused)),
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	if (optrace_file)
+		ntfs_fuse_optrace("fsync", "i", (u64)ino);
+		/* sync the full device, sharing the flush with other syncs */
+	if (ntfs_volume_sync(ctx->vol))
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_err(req, 0);
+}
+
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+static void ntfs_fuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			off_t offset, off_t length,
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	BOOL keep_size;
+	int res;
+
+	if (optrace_file)
+		ntfs_fuse_optrace("fallocate", "iodd", (u64)ino, mode,
+				(s64)offset, (s64)length);
+	keep_size = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		res = -EOPNOTSUPP;
+		goto out;
+	}
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (!ni) {
+		res = -errno;
+		goto out;
+	}
+	if ((ni->flags & FILE_ATTR_REPARSE_POINT)
+	    || (ni->mft_no < FILE_first_user)) {
+		res = -EOPNOTSUPP;
+		goto exit;
+	}
+	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+	if (!na) {
+		res = -errno;
+		goto exit;
+	}
+	res = 0;
+	if (ntfs_attr_fallocate(na, offset, length, keep_size))
+		res = -errno;
+	else
+		if (!keep_size) {
+			ntfs_fuse_update_times(ni, NTFS_UPDATE_MCTIME);
+			set_archive(ni);
+		}
+	ntfs_attr_close(na);
+	ntfs_fuse_drop_data_attrs(ino);
+exit:
+	if (ntfs_inode_close(ni))
+		set_fuse_error(&res);
+out:
+	fuse_reply_err(req, -res);
+}
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+/*
+ *		Locate the next data or hole of a file
+ *
+ *	The holes are found from the runlist of the data, so that
+ *	copying or backing up sparse files can skip them without
+ *	reading zeroes. Reparse points are reported as having no holes.
+ */
+
+static void ntfs_fuse_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+			int whence, struct fuse_file_info *fi)
+{
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	struct open_file *of;
+	struct SECURITY_CONTEXT security;
+	struct stat stbuf;
+	BOOL kept;
+	s64 pos;
+	int res;
+
+	res = 0;
+	pos = -1;
+	if ((whence != SEEK_DATA) && (whence != SEEK_HOLE)) {
+		res = -EINVAL;
 		goto out;
 	}
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (!ni) {
 		res = -errno;
-		goto exit;
+		goto out;
 	}
 	if (ni->flags & FILE_ATTR_REPARSE_POINT) {
-#ifndef DISABLE_PLUGINS
-		const plugin_operations_t *ops;
-		REPARSE_POINT *reparse;
-
-		res = CALL_REPARSE_PLUGIN(ni, release, &of->fi);
+		res = ntfs_fuse_getstat(ntfs_fuse_stat_context(req, &security),
+					ni, &stbuf);
 		if (!res) {
-			goto stamps;
+			if (off >= stbuf.st_size)
+				res = -ENXIO;
+			else
+				pos = (whence == SEEK_HOLE ? stbuf.st_size : off);
 		}
-#else /* DISABLE_PLUGINS */
-			/* Assume release() was not needed */
-		res = 0;
-#endif /* DISABLE_PLUGINS */
-		goto exit;
-	}
-	na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
-	if (!na) {
-		res = -errno;
-		goto exit;
+	} else {
+		of = (struct open_file*)(long)fi->fh;
+		na = ntfs_fuse_get_data_attr(of, ni, &kept);
+		if (na) {
+			pos = ntfs_attr_seek_data(na, off, whence == SEEK_HOLE);
+			if (pos < 0)
+				res = -errno;
+			ntfs_fuse_put_data_attr(of, na, kept,
+					(pos >= 0) || (errno == ENXIO));
+		} else
+			res = -errno;
 	}
-	res = 0;
-	if (of->state & CLOSE_COMPRESSED)
-		res = ntfs_attr_pclose(na);
-#ifdef HAVE_SETXATTR	/* extended attributes interface required */
-	if (of->state & CLOSE_ENCRYPTED)
-		res = ntfs_efs_fixup_attribute(NULL, na);
-#endif /* HAVE_SETXATTR */
-#ifndef DISABLE_PLUGINS
-stamps :
-#endif /* DISABLE_PLUGINS */
-	if (of->state & CLOSE_DMTIME)
-		ntfs_inode_update_times(ni,NTFS_UPDATE_MCTIME);
-exit:
-	if (na)
-		ntfs_attr_close(na);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
-out:    
-		/* remove the associate ghost file (even if release failed) */
-	if (of) {
-		if (of->state & CLOSE_GHOST) {
-			sprintf(ghostname,ghostformat,of->ghost);
-			ntfs_fuse_rm(req, of->parent, ghostname, RM_ANY);
-		}
-			/* remove from open files list */
-		if (of->next)
-			of->next->previous = of->previous;
-		if (of->previous)
-			of->previous->next = of->next;
-		else
-			ctx->open_files = of->next;
-		free(of);
-	}
+out:
 	if (res)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_err(req, 0);
+		fuse_reply_lseek(req, pos);
 }
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE) */
 
-static void ntfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
-		       const char *name, mode_t mode)
-{
-	int res;
-	struct fuse_entry_param entry;
-
-	res = ntfs_fuse_create(req, parent, name, S_IFDIR | (mode & 07777),
-			0, &entry, (char*)NULL, (struct fuse_file_info*)NULL);
-	if (res < 0)
-		fuse_reply_err(req, -res);
-	else
-		fuse_reply_entry(req, &entry);
-}
+#ifdef FUSE_INTERNAL
+/*
+ *		Copy the data of a file into another one
+ *
+ *	The data is copied within the volume by large chunks, without
+ *	being transferred to the kernel. The holes of the source are not
+ *	copied where the destination has no data yet, so that a copy of
+ *	a sparse file is sparse, and data written to a compressed
+ *	destination is compressed as usual.
+ *	At most COPY_MAX_SIZE bytes are copied in a request, so as not
+ *	to keep the volume locked for too long, the caller iterating
+ *	after a short copy.
+ */
 
-static void ntfs_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+static void ntfs_fuse_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+			off_t off_in, struct fuse_file_info *fi_in,
+			fuse_ino_t ino_out, off_t off_out,
+			struct fuse_file_info *fi_out, size_t len, int flags)
 {
+	ntfs_inode *ni_in = NULL;
+	ntfs_inode *ni_out = NULL;
+	ntfs_attr *na_in = NULL;
+	ntfs_attr *na_out = NULL;
+	struct open_file *of_in;
+	struct open_file *of_out;
+	BOOL kept_in = FALSE;
+	BOOL kept_out = FALSE;
+	char *buf = (char*)NULL;
+	s64 out_size;
+	s64 limit;
+	s64 end;
+	s64 pos;
+	s64 count;
+	s64 done;
+	s64 ret;
 	int res;
 
-	res = ntfs_fuse_rm(req, parent, name, RM_DIR);
-	if (res)
-		fuse_reply_err(req, -res);
+	res = 0;
+	pos = off_in;
+	if (flags || (off_in < 0) || (off_out < 0)) {
+		res = -EINVAL;
+		goto out;
+	}
+	if (ino_out < FILE_first_user) {
+		res = -EPERM;
+		goto out;
+	}
+	if (len > COPY_MAX_SIZE)
+		len = COPY_MAX_SIZE;
+	of_in = (struct open_file*)(long)fi_in->fh;
+	of_out = (struct open_file*)(long)fi_out->fh;
+	ni_in = ntfs_inode_open(ctx->vol, INODE(ino_in));
+	if (ni_in && (ino_out != ino_in))
+		ni_out = ntfs_inode_open(ctx->vol, INODE(ino_out));
 	else
-		fuse_reply_err(req, 0);
-}
-
-static void ntfs_fuse_fsync(fuse_req_t req,
-			fuse_ino_t ino __attribute__((unused)),
-			int type __attribute__((unused)),
-			struct fuse_file_info *fi __attribute__((unused)))
-{
-		/* sync the full device */
-	if (ntfs_device_sync(ctx->vol->dev))
-		fuse_reply_err(req, errno);
+		ni_out = ni_in;
+	if (!ni_in || !ni_out) {
+		res = -errno;
+		goto exit;
+	}
+	if ((ni_in->flags | ni_out->flags) & FILE_ATTR_REPARSE_POINT) {
+		/* let the kernel copy through the plugins */
+		res = -EOPNOTSUPP;
+		goto exit;
+	}
+	buf = (char*)ntfs_malloc(COPY_CHUNK_SIZE);
+	na_in = ntfs_fuse_get_data_attr(of_in, ni_in, &kept_in);
+		/* a single attribute when copying within a file */
+	if (na_in && (ni_out != ni_in))
+		na_out = ntfs_fuse_get_data_attr(of_out, ni_out, &kept_out);
 	else
-		fuse_reply_err(req, 0);
+		na_out = na_in;
+	if (!buf || !na_in || !na_out) {
+		res = -errno;
+		goto exit;
+	}
+	end = off_in + len;
+	if (end > na_in->data_size)
+		end = na_in->data_size;
+	out_size = na_out->data_size;
+	while ((pos < end) && !res) {
+		limit = ntfs_attr_seek_data(na_in, pos, TRUE);
+		if (limit == pos) {
+			/* in a hole, skip it if nothing has to be erased */
+			limit = ntfs_attr_seek_data(na_in, pos, FALSE);
+			if ((limit < 0) || (limit > end))
+				limit = end;
+			if ((off_out + pos - off_in) >= out_size) {
+				pos = limit;
+				continue;
+			}
+		}
+		if ((limit < 0) || (limit > end))
+			limit = end;
+		while ((pos < limit) && !res) {
+			count = limit - pos;
+			if (count > COPY_CHUNK_SIZE)
+				count = COPY_CHUNK_SIZE;
+			ret = ntfs_attr_pread(na_in, pos, count, buf);
+			if (ret <= 0) {
+				res = (ret < 0 ? -errno : -EIO);
+				break;
+			}
+			for (done=0; (done<ret) && !res; done+=count) {
+				count = ntfs_attr_pwrite(na_out,
+					off_out + pos - off_in + done,
+					ret - done, buf + done);
+				if (count <= 0)
+					res = (count < 0 ? -errno : -EIO);
+			}
+			if (!res)
+				pos += ret;
+		}
+	}
+		/* a final hole was skipped */
+	if (!res && ((off_out + pos - off_in) > na_out->data_size)
+	    && ntfs_attr_truncate(na_out, off_out + pos - off_in))
+		res = -errno;
+	if (pos > off_in) {
+		ntfs_fuse_update_times(ni_out, NTFS_UPDATE_MCTIME);
+		set_archive(ni_out);
+		if (ni_in != ni_out)
+			ntfs_fuse_update_times(ni_in, NTFS_UPDATE_ATIME);
+	}
+exit:
+	if (na_out) {
+			/* the attributes kept for other openings are stale */
+		ntfs_fuse_drop_data_attrs(ino_out);
+		if (na_out != na_in)
+			ntfs_fuse_put_data_attr(of_out, na_out, kept_out, !res);
+	}
+	if (na_in)
+		ntfs_fuse_put_data_attr(of_in, na_in, kept_in, !res);
+	free(buf);
+	if ((ni_out != ni_in) && ntfs_inode_close(ni_out))
+		set_fuse_error(&res);
+	if (ntfs_inode_close(ni_in))
+		set_fuse_error(&res);
+out:
+		/* report a partial copy as successful */
+	if (pos > off_in)
+		fuse_reply_write(req, pos - off_in);
+	else
+		fuse_reply_err(req, -res);
 }
+#endif /* FUSE_INTERNAL */
 
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
 static void ntfs_fuse_ioctl(fuse_req_t req __attribute__((unused)),
@@ -3199,10 +4530,36 @@ static void ntfs_fuse_ioctl(fuse_req_t req __attribute__((unused)),
 	char *buf = (char*)NULL;
 	int bufsz;
 	int ret = 0;
+#if defined(FITRIM) && defined(BLKDISCARD)
+	struct fstrim_range range;
+#endif
 
 	if (flags & FUSE_IOCTL_COMPAT) {
 		ret = -ENOSYS;
+#if defined(FITRIM) && defined(BLKDISCARD)
+	} else if ((unsigned int)cmd == FITRIM) {
+		/*
+		 * Trimming does not need the inode, and the volume lock
+		 * may be released while trimming, so no inode is kept open.
+		 */
+		if ((in_bufsz < sizeof(range)) || (out_bufsz < sizeof(range)))
+			ret = -EINVAL;
+		else {
+			memcpy(&range, data, sizeof(range));
+			ret = ntfs_volume_trim(ctx->vol, &range);
+			if (!ret) {
+				fuse_reply_ioctl(req, 0, &range,
+						sizeof(range));
+				return;
+			}
+		}
+#endif
 	} else {
+#ifdef NTFS_IOC_DEFRAG
+			/* the runlists of the open files are changed */
+		if ((unsigned int)cmd == NTFS_IOC_DEFRAG)
+			ntfs_fuse_drop_data_attrs(ino);
+#endif
 		ni = ntfs_inode_open(ctx->vol, INODE(ino));
 		if (!ni) {
 			ret = -errno;
@@ -3225,6 +4582,8 @@ static void ntfs_fuse_ioctl(fuse_req_t req __attribute__((unused)),
 		 * sign-extended.
 		 */
 		ret = ntfs_ioctl(ni, (unsigned int)cmd, arg, flags, buf);
+			/* the flags of the data attribute may have changed */
+		ntfs_fuse_drop_data_attrs(ino);
 		if (ntfs_inode_close (ni))
 			set_fuse_error(&ret);
 	}
@@ -3271,12 +4630,12 @@ static void ntfs_fuse_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
 		goto close_attr;
 	}
         
-	if (ntfs_attr_map_whole_runlist(na)) {
-		ret = -errno;
+		/* only map the part of the runlist holding the block */
+	lcn = ntfs_attr_vcn_to_lcn(na, vidx / cl_per_bl);
+	if (lcn == (LCN)LCN_EIO) {
+		ret = -EIO;
 		goto close_attr;
 	}
-        
-	lcn = ntfs_rl_vcn_to_lcn(na->rl, vidx / cl_per_bl);
 	lidx = (lcn > 0) ? lcn * cl_per_bl + vidx % cl_per_bl : 0;
         
 close_attr:
@@ -3462,7 +4821,6 @@ static int fix_xattr_prefix(const char *name, int namespace, ntfschar **lename)
 
 static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-	ntfs_attr_search_ctx *actx = NULL;
 	ntfs_inode *ni;
 	char *list = (char*)NULL;
 	int ret = 0;
@@ -3488,11 +4846,6 @@ static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 		goto exit;
 	}
 #endif
-	actx = ntfs_attr_get_search_ctx(ni, NULL);
-	if (!actx) {
-		ret = -errno;
-		goto exit;
-	}
 	if (size) {
 		list = (char*)malloc(size);
 		if (!list) {
@@ -3503,16 +4856,10 @@ static void ntfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 
 	if ((ctx->streams == NF_STREAMS_INTERFACE_XATTR)
 	    || (ctx->streams == NF_STREAMS_INTERFACE_OPENXATTR)) {
-		ret = ntfs_fuse_listxattr_common(ni, actx, list, size,
+		ret = ntfs_fuse_listxattr_common(ni, list, size,
 				ctx->streams == NF_STREAMS_INTERFACE_XATTR);
-		if (ret < 0)
-			goto exit;
 	}
-	if (errno != ENOENT)
-		ret = -errno;
 exit:
-	if (actx)
-		ntfs_attr_put_search_ctx(actx);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&ret);
 out :
@@ -3809,16 +5156,17 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		} else
 			res = -errno;
 #endif
-#if CACHEING && !defined(FUSE_INTERNAL) && FUSE_VERSION >= 28
+			/* the data attribute may have been changed */
+		ntfs_fuse_drop_data_attrs(ino);
+#if CACHEING && (defined(FUSE_INTERNAL) || FUSE_VERSION >= 28)
 		/*
 		 * Most of system xattr settings cause changes to some
 		 * file attribute (st_mode, st_nlink, st_mtime, etc.),
 		 * so we must invalidate cached data when cacheing is
-		 * in use (not possible with internal fuse or external
-		 * fuse before 2.8)
+		 * in use (not possible with external fuse before 2.8)
 		 */
 		if ((res >= 0)
-		    && fuse_lowlevel_notify_inval_inode(ctx->fc, ino, -1, 0))
+		    && ntfs_fuse_inval_inode(ino))
 			res = -errno;
 #endif
 		if (res < 0)
@@ -4056,17 +5404,17 @@ static void ntfs_fuse_removexattr(fuse_req_t req, fuse_ino_t ino, const char *na
 			} else
 				res = -errno;
 #endif
-#if CACHEING && !defined(FUSE_INTERNAL) && FUSE_VERSION >= 28
+				/* the data attribute may have been changed */
+			ntfs_fuse_drop_data_attrs(ino);
+#if CACHEING && (defined(FUSE_INTERNAL) || FUSE_VERSION >= 28)
 		/*
 		 * Some allowed system xattr removals cause changes to
 		 * some file attribute (st_mode, st_nlink, etc.),
 		 * so we must invalidate cached data when cacheing is
-		 * in use (not possible with internal fuse or external
-		 * fuse before 2.8)
+		 * in use (not possible with external fuse before 2.8)
 		 */
 			if ((res >= 0)
-			    && fuse_lowlevel_notify_inval_inode(ctx->fc,
-						ino, -1, 0))
+			    && ntfs_fuse_inval_inode(ino))
 				res = -errno;
 #endif
 			break;
@@ -4183,6 +5531,12 @@ static void register_internal_reparse_plugins(void)
 	static const plugin_operations_t wsl_ops = {
 		.getattr = wsl_getstat,
 	} ;
+	static const plugin_operations_t wof_ops = {
+		.getattr = wof_getattr,
+		.open = wof_open,
+		.read = wof_read,
+		.release = wof_release,
+	} ;
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_MOUNT_POINT,
 					&ops, (void*)NULL);
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_SYMLINK,
@@ -4197,6 +5551,8 @@ static void register_internal_reparse_plugins(void)
 					&wsl_ops, (void*)NULL);
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_LX_BLK,
 					&wsl_ops, (void*)NULL);
+	register_reparse_plugin(ctx, IO_REPARSE_TAG_WOF,
+					&wof_ops, (void*)NULL);
 }
 #endif /* DISABLE_PLUGINS */
 
@@ -4232,6 +5588,10 @@ static void ntfs_close(void)
 		ntfs_log_perror("Failed to close volume %s", opts.device);
         
 	ctx->vol = NULL;
+#if CACHE_NIDATA_SIZE
+	ntfs_fuse_free_lookups();
+#endif /* CACHE_NIDATA_SIZE */
+	ntfs_fuse_free_open_files();
 }
 
 static void ntfs_fuse_destroy2(void *notused __attribute__((unused)))
@@ -4239,12 +5599,322 @@ static void ntfs_fuse_destroy2(void *notused __attribute__((unused)))
 	ntfs_close();
 }
 
+#ifdef FUSE_INTERNAL
+
+/*
+ *		Names of the requests, as shown in the latency report
+ */
+
+static const char *const ntfs_fuse_opnames[] = {
+	[FUSE_LOOKUP] = "lookup",
+	[FUSE_FORGET] = "forget",
+	[FUSE_GETATTR] = "getattr",
+	[FUSE_SETATTR] = "setattr",
+	[FUSE_READLINK] = "readlink",
+	[FUSE_SYMLINK] = "symlink",
+	[FUSE_MKNOD] = "mknod",
+	[FUSE_MKDIR] = "mkdir",
+	[FUSE_UNLINK] = "unlink",
+	[FUSE_RMDIR] = "rmdir",
+	[FUSE_RENAME] = "rename",
+	[FUSE_LINK] = "link",
+	[FUSE_OPEN] = "open",
+	[FUSE_READ] = "read",
+	[FUSE_WRITE] = "write",
+	[FUSE_STATFS] = "statfs",
+	[FUSE_RELEASE] = "release",
+	[FUSE_FSYNC] = "fsync",
+	[FUSE_SETXATTR] = "setxattr",
+	[FUSE_GETXATTR] = "getxattr",
+	[FUSE_LISTXATTR] = "listxattr",
+	[FUSE_REMOVEXATTR] = "removexattr",
+	[FUSE_FLUSH] = "flush",
+	[FUSE_INIT] = "init",
+	[FUSE_OPENDIR] = "opendir",
+	[FUSE_READDIR] = "readdir",
+	[FUSE_RELEASEDIR] = "releasedir",
+	[FUSE_FSYNCDIR] = "fsyncdir",
+	[FUSE_GETLK] = "getlk",
+	[FUSE_SETLK] = "setlk",
+	[FUSE_SETLKW] = "setlkw",
+	[FUSE_ACCESS] = "access",
+	[FUSE_CREATE] = "create",
+	[FUSE_INTERRUPT] = "interrupt",
+	[FUSE_BMAP] = "bmap",
+	[FUSE_DESTROY] = "destroy",
+	[FUSE_IOCTL] = "ioctl",
+	[FUSE_BATCH_FORGET] = "batch_forget",
+	[FUSE_FALLOCATE] = "fallocate",
+	[FUSE_READDIRPLUS] = "readdirplus",
+	[FUSE_LSEEK] = "lseek",
+	[FUSE_COPY_FILE_RANGE] = "copy_file_range",
+} ;
+
+#define NR_OPNAMES (int)(sizeof(ntfs_fuse_opnames)/sizeof(const char*))
+
+static pthread_key_t stats_key;	/* start time of the current request */
+
+/*
+ *		Measure the latency of a request
+ *
+ *	The start time is kept per worker thread, as a worker serves
+ *	its request from beginning to end.
+ */
+
+static void ntfs_fuse_stats_request(int opcode, int done)
+{
+	u64 *start;
+
+	start = (u64*)pthread_getspecific(stats_key);
+	if (!start) {
+		start = (u64*)ntfs_malloc(sizeof(u64));
+		if (!start || pthread_setspecific(stats_key, start)) {
+			free(start);
+			return;
+		}
+	}
+	if (!done)
+		*start = ntfs_stats_clock();
+	else
+		if ((opcode > 0) && (opcode < NR_OPNAMES)
+		    && ntfs_fuse_opnames[opcode] && ctx->vol)
+			ntfs_stats_record_op(ctx->vol, opcode,
+				ntfs_fuse_opnames[opcode],
+				ntfs_stats_clock() - *start);
+}
+
+	/* set when a request has been made exclusive for trimming */
+static BOOL exclusive_trim = FALSE;
+	/* set by SIGUSR2, when memory gets short */
+static volatile sig_atomic_t memory_pressure = 0;
+
+/*
+ *		Trim the caches when they use more than the memory budget,
+ *	or on memory pressure
+ *
+ *	Only to be called when no inode is open and the volume is not
+ *	used by other requests.
+ */
+
+/*
+ *		Unmap the runlists of the data attributes kept open, but
+ *	the extent of the next sequential read
+ *
+ *	The inode of a kept attribute is only valid during a request,
+ *	so it is opened again meanwhile, the attribute being marked busy
+ *	as the lock of the open files cannot be held while opening.
+ */
+
+static s64 ntfs_fuse_release_runlists(void)
+{
+	struct open_file *of;
+	ntfs_inode *ni;
+	ntfs_attr *na;
+	unsigned int i;
+	s64 released;
+
+	released = 0;
+	lock_open_files();
+	for (i=0; i<open_files.size; i++)
+		for (of=open_files.buckets[i]; of; of=of->next) {
+			na = of->na;
+			if (na && !of->busy && NAttrNonResident(na)
+			    && na->rl) {
+				of->busy = TRUE;
+				unlock_open_files();
+				ni = ntfs_inode_open(ctx->vol, INODE(of->ino));
+				if (ni) {
+					na->ni = ni;
+					released += ntfs_attr_rl_release(na,
+						of->ra.next
+						>> ctx->vol->cluster_size_bits);
+					ntfs_inode_close(ni);
+				}
+				lock_open_files();
+				of->busy = FALSE;
+			}
+		}
+	unlock_open_files();
+	return (released);
+}
+
+static void ntfs_fuse_trim_caches(void)
+{
+	BOOL pressure;
+	s64 released;
+
+	pressure = (memory_pressure != 0);
+	memory_pressure = 0;
+	if (pressure || (ctx->mem_budget > 0))
+		ntfs_trim_caches(ctx->vol, pressure);
+	if (pressure) {
+		released = ntfs_fuse_release_runlists();
+		if (released)
+			ntfs_log_debug("Released %lld bytes of runlists\n",
+					(long long)released);
+	}
+}
+
+/*
+ *		Memory pressure signal handler
+ */
+
+static void ntfs_fuse_memory_pressure(int sig __attribute__((unused)))
+{
+	memory_pressure = 1;
+}
+
+/*
+ *		Lock the volume around a request served by a worker thread
+ *
+ *	Requests which do not update the volume get a shared lock, so
+ *	that reading files, looking up names and getting attributes
+ *	proceed in parallel, though they are only really concurrent
+ *	while transferring file data. Writes also start as shared
+ *	requests, overwrites of allocated data proceed in parallel
+ *	while transferring data, and other writes are turned into
+ *	exclusive requests. The index blocks which have
+ *	been kept dirty for too long are written at the end of updates.
+ *	Forgetting inodes may close cached inodes, so it is an update.
+ *
+ *	On memory pressure, the next request which does not write is
+ *	made exclusive, so that the caches can be trimmed at its end.
+ *
+ *	The locks are taken in this order : the volume access lock,
+ *	the volume state lock (only held by shared requests), then the
+ *	lock of the open files and the lock of the block cache, which
+ *	are only held briefly and never while taking another lock.
+ */
+
+static void ntfs_fuse_lock_request(void *data __attribute__((unused)),
+			int opcode, int done)
+{
+	BOOL shared;
+
+	switch (opcode) {
+	case FUSE_LOOKUP :
+	case FUSE_GETATTR :
+	case FUSE_READLINK :
+	case FUSE_OPEN :
+	case FUSE_READ :
+	case FUSE_LSEEK :
+	case FUSE_STATFS :
+	case FUSE_GETXATTR :
+	case FUSE_LISTXATTR :
+	case FUSE_OPENDIR :
+	case FUSE_READDIR :
+	case FUSE_READDIRPLUS :
+	case FUSE_RELEASEDIR :
+	case FUSE_ACCESS :
+		shared = TRUE;
+		break;
+	case FUSE_WRITE :
+			/* unless turned exclusive while being processed */
+		shared = !(done && exclusive_write);
+		if (done)
+			exclusive_write = FALSE;
+		break;
+#if !CACHE_NIDATA_SIZE
+	case FUSE_FORGET :
+	case FUSE_BATCH_FORGET :
+#endif /* !CACHE_NIDATA_SIZE */
+	case FUSE_INTERRUPT :
+		/* not forwarded to the file system */
+		return;
+	case FUSE_DESTROY :
+		/* wait for the other requests, the volume is then closed */
+		if (!done && ctx->vol) {
+			ntfs_volume_lock(ctx->vol, FALSE);
+			ntfs_volume_unlock(ctx->vol, FALSE);
+		}
+		return;
+	default :
+		shared = FALSE;
+		break;
+	}
+	if (done && exclusive_trim) {
+		shared = FALSE;
+		exclusive_trim = FALSE;
+	}
+	if (ctx->vol) {
+			/* no inode is open, write the old inodes and blocks */
+		if (done && !shared) {
+			ntfs_volume_flush_metadata(ctx->vol, FALSE);
+			ntfs_fuse_trim_caches();
+		}
+		if (done)
+			ntfs_volume_unlock(ctx->vol, shared);
+		else {
+			if (shared && memory_pressure
+			    && (opcode != FUSE_WRITE)) {
+				ntfs_volume_lock(ctx->vol, FALSE);
+				exclusive_trim = TRUE;
+			} else
+				ntfs_volume_lock(ctx->vol, shared);
+		}
+	}
+}
+
+/*
+ *		Declare the request to the tracing of device transfers
+ */
+
+static void ntfs_fuse_trace_request(int opcode, int done)
+{
+	if (ctx->vol) {
+		if (done)
+			ntfs_trace_request_end(ctx->vol->dev);
+		else
+			ntfs_trace_request(ctx->vol->dev, opcode);
+	}
+}
+
+/*
+ *		Hook called by the workers before and after each request
+ *
+ *	The latency is measured inside the lock, so that it does not
+ *	include the time spent waiting for the other requests.
+ */
+
+static void ntfs_fuse_request_hook(void *data, int opcode, int done)
+{
+	if (done) {
+		if (ctx->stats)
+			ntfs_fuse_stats_request(opcode, done);
+		if (ctx->trace > 0)
+			ntfs_fuse_trace_request(opcode, done);
+		if (ctx->threads > 1)
+			ntfs_fuse_lock_request(data, opcode, done);
+		else
+			if ((ctx->mem_budget > 0) && ctx->vol)
+				ntfs_fuse_trim_caches();
+	} else {
+		if (ctx->threads > 1)
+			ntfs_fuse_lock_request(data, opcode, done);
+		if (ctx->trace > 0)
+			ntfs_fuse_trace_request(opcode, done);
+		if (ctx->stats)
+			ntfs_fuse_stats_request(opcode, done);
+	}
+}
+
+#endif /* FUSE_INTERNAL */
+
 static struct fuse_lowlevel_ops ntfs_3g_ops = {
 	.lookup 	= ntfs_fuse_lookup,
+#if CACHE_NIDATA_SIZE
+	.forget 	= ntfs_fuse_forget,
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+	.forget_multi	= ntfs_fuse_forget_multi,
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+#endif /* CACHE_NIDATA_SIZE */
 	.getattr	= ntfs_fuse_getattr,
 	.readlink	= ntfs_fuse_readlink,
 	.opendir	= ntfs_fuse_opendir,
 	.readdir	= ntfs_fuse_readdir,
+#ifdef FUSE_CAP_READDIRPLUS
+	.readdirplus	= ntfs_fuse_readdirplus,
+#endif /* FUSE_CAP_READDIRPLUS */
 	.releasedir	= ntfs_fuse_releasedir,
 	.open		= ntfs_fuse_open,
 	.release	= ntfs_fuse_release,
@@ -4267,6 +5937,15 @@ static struct fuse_lowlevel_ops ntfs_3g_ops = {
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
 	.ioctl		= ntfs_fuse_ioctl,
 #endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+	.fallocate	= ntfs_fuse_fallocate,
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+#if defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+	.lseek		= ntfs_fuse_lseek,
+#endif /* defined(FUSE_INTERNAL) && defined(SEEK_DATA) && defined(SEEK_HOLE) */
+#ifdef FUSE_INTERNAL
+	.copy_file_range = ntfs_fuse_copy_file_range,
+#endif /* FUSE_INTERNAL */
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 	.access 	= ntfs_fuse_access,
 #endif
@@ -4307,10 +5986,55 @@ static int ntfs_fuse_init(void)
 	return 0;
 }
 
+#ifdef FUSE_INTERNAL
+
+/*
+ *		Get the number of pages to request per read or write
+ *
+ *	The number requested is limited by what the kernel accepts, so
+ *	that the receive buffers are not uselessly big, and by what the
+ *	cluster allocator can safely handle on the volume.
+ *	Returns zero if the default number of pages has to be used.
+ */
+
+static int ntfs_fuse_max_pages(int wanted)
+{
+	FILE *f;
+	s64 safe;
+	int limit;
+	int pages;
+
+	pages = (wanted > MAX_PAGES ? MAX_PAGES : wanted);
+	limit = KERNEL_MAX_PAGES;
+		/* the limit is configurable since Linux 6.13 */
+	f = fopen("/proc/sys/fs/fuse/max_pages_limit", "r");
+	if (f) {
+		if ((fscanf(f, "%d", &limit) != 1) || (limit <= 0))
+			limit = KERNEL_MAX_PAGES;
+		fclose(f);
+	}
+	if (pages > limit)
+		pages = limit;
+	safe = ((ctx->vol->nr_clusters << ctx->vol->cluster_size_bits)
+			/ SAFE_CAPACITY_PER_WRITE_BYTE) / getpagesize();
+	if (pages > safe) {
+		ntfs_log_info("The volume is too small for requests of"
+				" %d pages\n", pages);
+		pages = safe;
+	}
+	if (pages <= FUSE_DEFAULT_MAX_PAGES)
+		pages = 0;
+	return (pages);
+}
+
+#endif /* FUSE_INTERNAL */
+
 static int ntfs_open(const char *device)
 {
 	unsigned long flags = 0;
 	ntfs_volume *vol;
+	int i;
+	int snapped;
         
 	if (!ctx->blkdev)
 		flags |= NTFS_MNT_EXCLUSIVE;
@@ -4323,6 +6047,12 @@ static int ntfs_open(const char *device)
 		flags |= NTFS_MNT_RECOVER;
 	if (ctx->hiberfile)
 		flags |= NTFS_MNT_IGNORE_HIBERFILE;
+	if (ctx->uring)
+		flags |= NTFS_MNT_URING;
+	if (ctx->direct_device_io)
+		flags |= NTFS_MNT_DIRECT_IO;
+	if (ctx->fast_mount)
+		flags |= NTFS_MNT_DEFER_LOADS;
 
 	ctx->vol = vol = ntfs_mount(device, flags);
 	if (!vol) {
@@ -4331,10 +6061,90 @@ static int ntfs_open(const char *device)
 	}
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
+	if ((ctx->block_cache > 0)
+	    && ntfs_create_block_cache(ctx->vol,
+				(s64)ctx->block_cache << 20))
+		ntfs_log_perror("Could not create the block cache");
+	if ((ctx->record_cache > 0)
+	    && ntfs_create_mftrec_cache(ctx->vol,
+				(s64)ctx->record_cache << 20))
+		ntfs_log_perror("Could not create the mft record cache");
+	if ((ctx->index_cache > 0)
+	    && ntfs_create_index_cache(ctx->vol,
+				(s64)ctx->index_cache << 20))
+		ntfs_log_perror("Could not create the index block cache");
+	if ((ctx->index_writeback > 0)
+	    && ntfs_set_index_writeback(ctx->vol,
+				(s64)ctx->index_writeback << 20))
+		ntfs_log_perror("Could not delay the index block writes");
+	if ((ctx->lazy_delete > 0)
+	    && ntfs_set_index_lazy_delete(ctx->vol, ctx->lazy_delete))
+		ntfs_log_perror("Could not remove the directory entries lazily");
+	if ((ctx->prealloc > 0)
+	    && ntfs_set_prealloc_size(ctx->vol, (s64)ctx->prealloc << 20))
+		ntfs_log_perror("Could not set the preallocation size");
+	if ((ctx->hole_unit > 0)
+	    && ntfs_set_hole_unit(ctx->vol, (s64)ctx->hole_unit << 10))
+		ntfs_log_perror("Could not set the hole allocation unit");
+	if ((ctx->bitmap_writeback > 0)
+	    && ntfs_set_lcnbmp_writeback(ctx->vol,
+				(s64)ctx->bitmap_writeback << 20))
+		ntfs_log_perror("Could not delay the $Bitmap writes");
+	if (ctx->discard && !ctx->ro
+	    && ntfs_set_cluster_discard(ctx->vol, TRUE))
+		ntfs_log_perror("Could not discard the freed clusters");
+	if ((ctx->mft_writeback > 0)
+	    && ntfs_set_mft_writeback(ctx->vol, ctx->mft_writeback))
+		ntfs_log_perror("Could not delay the mft record writes");
+	for (i=0; i<NTFS_LRU_CACHES; i++)
+		if ((ctx->lru_cache[i] >= 0)
+		    && ntfs_set_cache_size(ctx->vol, i, ctx->lru_cache[i]))
+			ntfs_log_perror("Could not resize a cache");
+		/* after resizing the inode cache which it relies on */
+	if ((ctx->inode_writeback > 0)
+	    && ntfs_set_inode_writeback(ctx->vol, ctx->inode_writeback))
+		ntfs_log_perror("Could not delay the inode writes");
+#ifdef FUSE_INTERNAL
+	if (ctx->threads > MAX_THREADS)
+		ctx->threads = MAX_THREADS;
+	if (ctx->max_pages > 0)
+		ctx->max_pages = ntfs_fuse_max_pages(ctx->max_pages);
+	if ((ctx->threads > 1) && ntfs_set_concurrent(ctx->vol, TRUE))
+		ctx->threads = 1;
+	if (ctx->stats && ntfs_set_stats(ctx->vol, TRUE))
+		ntfs_log_perror("Could not keep the statistics");
+	if ((ctx->trace > 0) && ntfs_set_trace(ctx->vol, ctx->trace))
+		ntfs_log_perror("Could not trace the device transfers");
+	if (ctx->stats && pthread_key_create(&stats_key, free)) {
+		ntfs_log_perror("Could not measure the latencies");
+		ctx->stats = FALSE;
+	}
+	if ((ctx->mem_budget > 0)
+	    && ntfs_set_memory_budget(ctx->vol, (s64)ctx->mem_budget << 20))
+		ntfs_log_perror("Could not set the memory budget");
+#else
+	if (ctx->threads > 1) {
+		ntfs_log_info("Option threads needs the integrated FUSE\n");
+		ctx->threads = 1;
+	}
+	if (ctx->mem_budget > 0) {
+		ntfs_log_info("Option mem_budget needs the integrated FUSE\n");
+		ctx->mem_budget = 0;
+	}
+	if (ctx->stats && ntfs_set_stats(ctx->vol, TRUE))
+		ntfs_log_perror("Could not keep the statistics");
+	if ((ctx->trace > 0) && ntfs_set_trace(ctx->vol, ctx->trace))
+		ntfs_log_perror("Could not trace the device transfers");
+#endif
 	if (ctx->compression)
 		NVolSetCompression(ctx->vol);
 	else
 		NVolClearCompression(ctx->vol);
+	if (ctx->compression_level
+	    && ntfs_set_compression_level(ctx->vol, ctx->compression_level))
+		goto err_out;
+	if (ctx->uncompressed_overwrites)
+		NVolSetUncompressedOverwrites(ctx->vol);
 #ifdef HAVE_SETXATTR
 			/* archivers must see hidden files */
 	if (ctx->efs_raw)
@@ -4343,20 +6153,30 @@ static int ntfs_open(const char *device)
 	if (ntfs_set_shown_files(ctx->vol, ctx->show_sys_files,
 				!ctx->hide_hid_files, ctx->hide_dot_files))
 		goto err_out;
+	if (ntfs_set_compact_runlists(ctx->vol, TRUE))
+		goto err_out;
 
 	if (ctx->ignore_case && ntfs_set_ignore_case(vol))
 		goto err_out;
         
-	vol->free_clusters = ntfs_attr_get_free_bits(vol->lcnbmp_na);
-	if (vol->free_clusters < 0) {
-		ntfs_log_perror("Failed to read NTFS $Bitmap");
-		goto err_out;
+	/* the free space may be known from a snapshot */
+	snapped = 0;
+	if (ctx->snapshot_path) {
+		snapped = ntfs_volume_snapshot_load(vol,
+					ctx->snapshot_path);
+		if (snapped < 0)
+			goto err_out;
 	}
+	if (!snapped) {
+		/* only estimate the free clusters of big volumes for now */
+		if (ntfs_cluster_count_free(vol, TRUE))
+			goto err_out;
 
-	vol->free_mft_records = ntfs_get_nr_free_mft_records(vol);
-	if (vol->free_mft_records < 0) {
-		ntfs_log_perror("Failed to calculate free MFT records");
-		goto err_out;
+		vol->free_mft_records = ntfs_get_nr_free_mft_records(vol);
+		if (vol->free_mft_records < 0) {
+			ntfs_log_perror("Failed to calculate free MFT records");
+			goto err_out;
+		}
 	}
 
 	if (ctx->hiberfile && ntfs_volume_check_hiberfile(vol, 0)) {
@@ -4545,6 +6365,11 @@ static struct fuse_session *mount_fuse(char *parsed_options)
 	if (ctx->debug)
 		if (fuse_opt_add_arg(&args, "-odebug") == -1)
 			goto err;
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+	if (ctx->splice)
+		if (fuse_opt_add_arg(&args, "-osplice_write") == -1)
+			goto err;
+#endif
         
 	se = fuse_lowlevel_new(&args , &ntfs_3g_ops, sizeof(ntfs_3g_ops), NULL);
 	if (!se)
@@ -4553,7 +6378,24 @@ static struct fuse_session *mount_fuse(char *parsed_options)
         
 	if (fuse_set_signal_handlers(se))
 		goto err_destroy;
+#ifdef FUSE_INTERNAL
+	if (ctx->mem_budget > 0) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = ntfs_fuse_memory_pressure;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGUSR2, &sa, (struct sigaction*)NULL))
+			ntfs_log_perror("Could not catch memory pressure");
+	}
+#endif
 	fuse_session_add_chan(se, ctx->fc);
+#ifdef FUSE_CAP_MAX_PAGES
+		/* the receive buffers must be big enough before starting */
+	if (ctx->max_pages > 0)
+		fuse_chan_set_bufsize(ctx->fc,
+			(size_t)ctx->max_pages*getpagesize() + 0x1000);
+#endif /* defined(FUSE_CAP_MAX_PAGES) */
 out:
 	fuse_opt_free_args(&args);
 	return se;
@@ -4703,8 +6545,8 @@ int main(int argc, char *argv[])
 	if (drop_privs())
 		goto err_out;
 #endif  
-	if (stat(opts.device, &sbuf)) {
-		ntfs_log_perror("Failed to access '%s'", opts.device);
+	if (stat(opts.dev_file, &sbuf)) {
+		ntfs_log_perror("Failed to access '%s'", opts.dev_file);
 		err = NTFS_VOLUME_NO_PRIVILEGE;
 		goto err_out;
 	}
@@ -4806,8 +6648,11 @@ int main(int argc, char *argv[])
 			permissions_mode = "Ownership and permissions disabled";
 		}
 	}
+		/* the context used when the requester does not matter */
+	ctx->security.pseccache = &ctx->seccache;
 	if (ctx->usermap_path)
 		free (ctx->usermap_path);
+	free(ctx->snapshot_path);
 
 #if defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS)
 	xattr_mapping = ntfs_xattr_build_mapping(ctx->vol,
@@ -4825,6 +6670,19 @@ int main(int argc, char *argv[])
 	register_internal_reparse_plugins();
 #endif /* DISABLE_PLUGINS */
 
+		/* opened before daemonizing changes the current directory */
+	if (ctx->optrace_path) {
+		optrace_file = fopen(ctx->optrace_path, "a");
+		if (optrace_file)
+			fprintf(optrace_file, "# lowntfs-3g operation trace"
+					" of %s\n", opts.device);
+		else
+			ntfs_log_perror("Could not open the trace file %s",
+					ctx->optrace_path);
+		free(ctx->optrace_path);
+		ctx->optrace_path = (char*)NULL;
+	}
+
 	se = mount_fuse(parsed_options);
 	if (!se) {
 		err = NTFS_VOLUME_FUSE_ERROR;
@@ -4843,14 +6701,37 @@ int main(int argc, char *argv[])
 	if (permissions_mode)
 		ntfs_log_info("%s, configuration type %d\n",permissions_mode,
 			5 + POSIXACLS*6 - KERNELPERMS*3 + CACHEING);
+	/* threads do not survive daemonizing, start them now */
+	if ((ctx->compress_threads > 1)
+	    && ntfs_set_compress_threads(ctx->vol, ctx->compress_threads))
+		ntfs_log_perror("Could not start the compression threads");
+	if (ntfs_cluster_count_start(ctx->vol))
+		ntfs_log_perror("Could not count the free clusters");
+	if (ctx->prefetch_path
+	    && ntfs_prefetch_start(ctx->vol, ctx->prefetch_path))
+		ntfs_log_perror("Could not prefetch from %s",
+				ctx->prefetch_path);
+	free(ctx->prefetch_path);
+	ctx->prefetch_path = (char*)NULL;
         
-	fuse_session_loop(se);
+#ifdef FUSE_INTERNAL
+		/* a single worker is used for measuring, tracing or trimming */
+	if ((ctx->threads > 1) || ctx->stats || (ctx->trace > 0)
+	    || (ctx->mem_budget > 0))
+		fuse_session_loop_pool(se, ctx->threads,
+				ntfs_fuse_request_hook, (void*)NULL);
+	else
+#endif
+		fuse_session_loop(se);
 	fuse_remove_signal_handlers(se);
         
 	err = 0;
 
 	fuse_unmount(opts.mnt_point, ctx->fc);
 	fuse_session_destroy(se);
+	if (optrace_file && fclose(optrace_file))
+		ntfs_log_perror("Could not write the operation trace");
+	optrace_file = (FILE*)NULL;
 err_out:
 	ntfs_mount_error(opts.device, opts.mnt_point, err);
 	if (ctx->abs_mnt_point)
@@ -0,0 +1,1156 @@
+/**
+ * ntfs-3g.bench - Measure the speed of file system workloads
+ *
+ * This program runs standard workload mixes on a mounted file system,
+ * optionally creating the volume by mkntfs and mounting it by ntfs-3g
+ * or lowntfs-3g, and reports the throughput and latency percentiles of
+ * each operation as lines of JSON, so that the results of versions of
+ * the drivers can be compared by scripts.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <getopt.h>
+
+#include "types.h"
+
+#define BENCH_COUNT 10000	/* default files of the metadata storm */
+#define BENCH_ENTRIES 100000	/* default entries of the listed directory */
+#define BENCH_DATA 256		/* default MB of sequential data */
+#define BENCH_RANDOM 20000	/* default random operations */
+#define BENCH_PASSES 3		/* passes over the listed directory and tree */
+#define BENCH_CHUNK 1048576	/* bytes of sequential transfers */
+#define BENCH_BLOCK 4096	/* bytes of random transfers */
+#define BENCH_FANOUT 10		/* subdirectories and files per directory */
+
+#define FILE_ATTR_COMPRESSED 0x800	/* as in layout.h */
+
+enum {
+	WORKLOAD_METADATA = 1,
+	WORKLOAD_SEQIO = 2,
+	WORKLOAD_RANDIO = 4,
+	WORKLOAD_LISTING = 8,
+	WORKLOAD_COMPRESSED = 16,
+	WORKLOAD_ACL = 32,
+	WORKLOAD_ALL = 63
+} ;
+
+static const struct {
+	const char *name;
+	int bit;
+} workload_names[] = {
+	{ "metadata", WORKLOAD_METADATA },
+	{ "seqio", WORKLOAD_SEQIO },
+	{ "randio", WORKLOAD_RANDIO },
+	{ "listing", WORKLOAD_LISTING },
+	{ "compressed", WORKLOAD_COMPRESSED },
+	{ "acl", WORKLOAD_ACL },
+	{ "all", WORKLOAD_ALL },
+} ;
+
+#define WORKLOAD_NAMES (int)(sizeof(workload_names)/sizeof(workload_names[0]))
+
+static const char *EXEC_NAME = "ntfs-3g.bench";
+
+static struct options {
+	char *dir;		/* directory, or mount point of the image */
+	char *image;		/* image to mount, created if size is set */
+	char *driver;		/* ntfs-3g or lowntfs-3g */
+	char *mkntfs;		/* mkntfs used for creating the image */
+	char *mount_options;	/* options of the driver */
+	int workloads;		/* WORKLOAD_* to run */
+	int count;		/* files of the metadata storm */
+	int entries;		/* entries of the listed directory */
+	int data;		/* MB of sequential data */
+	int random;		/* random operations */
+	int size;		/* MB of the image to create, 0 if none */
+	int verbose;
+} opts;
+
+/*
+ *		Latencies of an operation
+ */
+
+struct SAMPLES {
+	unsigned int *lat;	/* microseconds */
+	size_t count;
+	size_t size;
+	unsigned long long lost;	/* samples not recorded */
+	unsigned long long bytes;
+} ;
+
+static unsigned long long bench_seed = 0x9e3779b97f4a7c15ULL;
+
+static const char *usage_msg =
+"\n"
+"%s %s - Measure the speed of file system workloads\n"
+"\n"
+"Usage:    %s [options] directory\n"
+"\n"
+"Options:\n"
+"    -w, --workloads LIST  Run the workloads in LIST, separated by commas,\n"
+"                          among metadata, seqio, randio, listing,\n"
+"                          compressed and acl (default all)\n"
+"    -i, --image FILE      Mount FILE on directory before running\n"
+"    -d, --driver PATH     Mount by PATH, ntfs-3g or lowntfs-3g\n"
+"    -o, --options OPTS    Mount with options OPTS\n"
+"    -c, --create MB       Create the image of MB megabytes by mkntfs\n"
+"    -m, --mkntfs PATH     Use PATH as mkntfs (default mkntfs)\n"
+"    -n, --count NUM       Files of the metadata storm (default %d)\n"
+"    -e, --entries NUM     Entries of the directory listed (default %d)\n"
+"    -s, --data MB         Megabytes of sequential data (default %d)\n"
+"    -r, --random NUM      Random operations (default %d)\n"
+"    -v, --verbose         Show the output of the commands run\n"
+"    -h, --help            Print this help\n"
+"\n"
+"Example:  %s -c 4096 -i bench.img -d lowntfs-3g -o acl /mnt/bench\n"
+"\n";
+
+static void usage(void)
+{
+	printf(usage_msg, EXEC_NAME, VERSION, EXEC_NAME, BENCH_COUNT,
+		BENCH_ENTRIES, BENCH_DATA, BENCH_RANDOM, EXEC_NAME);
+}
+
+/*
+ *		Parse a list of workload names
+ *
+ *	Returns the WORKLOAD_* bits, or 0 if a name is unknown
+ */
+
+static int parse_workloads(const char *list)
+{
+	const char *p;
+	int workloads;
+	int len;
+	int i;
+
+	workloads = 0;
+	p = list;
+	do {
+		len = strcspn(p, ",");
+		for (i=0; (i<WORKLOAD_NAMES)
+			&& ((len != (int)strlen(workload_names[i].name))
+			    || strncmp(p, workload_names[i].name, len)); i++) { }
+		if (i >= WORKLOAD_NAMES) {
+			fprintf(stderr, "Unknown workload '%.*s'\n", len, p);
+			return (0);
+		}
+		workloads |= workload_names[i].bit;
+		p += len;
+	} while (*p++);
+	return (workloads);
+}
+
+static int parse_count(const char *arg, int *pvalue)
+{
+	char *end;
+	long value;
+
+	value = strtol(arg, &end, 0);
+	if (*end || (value <= 0) || (value > 100000000)) {
+		fprintf(stderr, "Bad value '%s'\n", arg);
+		return (-1);
+	}
+	*pvalue = value;
+	return (0);
+}
+
+/*
+ *		Parse the options
+ *
+ *	Returns 0 if the program has to proceed
+ *		1 if it has to stop with an error
+ *		-1 if it has to stop successfully
+ */
+
+static int parse_options(int argc, char *argv[])
+{
+	static const char *sopt = "-c:d:e:hi:m:n:o:r:s:vw:";
+	static const struct option lopt[] = {
+		{ "create",	required_argument,	NULL, 'c' },
+		{ "driver",	required_argument,	NULL, 'd' },
+		{ "entries",	required_argument,	NULL, 'e' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ "image",	required_argument,	NULL, 'i' },
+		{ "mkntfs",	required_argument,	NULL, 'm' },
+		{ "count",	required_argument,	NULL, 'n' },
+		{ "options",	required_argument,	NULL, 'o' },
+		{ "random",	required_argument,	NULL, 'r' },
+		{ "data",	required_argument,	NULL, 's' },
+		{ "verbose",	no_argument,		NULL, 'v' },
+		{ "workloads",	required_argument,	NULL, 'w' },
+		{ NULL,		0,			NULL,  0  }
+	};
+	int err = 0;
+	int c;
+
+	opterr = 0; /* we handle the errors */
+	opts.workloads = WORKLOAD_ALL;
+	opts.count = BENCH_COUNT;
+	opts.entries = BENCH_ENTRIES;
+	opts.data = BENCH_DATA;
+	opts.random = BENCH_RANDOM;
+	opts.mkntfs = "mkntfs";
+
+	while ((c = getopt_long(argc, argv, sopt, lopt, NULL)) != -1) {
+		switch (c) {
+		case 1:	/* a non-option argument */
+			if (opts.dir) {
+				fprintf(stderr, "You must specify exactly one "
+					"directory\n");
+				err++;
+			} else
+				opts.dir = optarg;
+			break;
+		case 'c':
+			if (parse_count(optarg, &opts.size))
+				err++;
+			break;
+		case 'd':
+			opts.driver = optarg;
+			break;
+		case 'e':
+			if (parse_count(optarg, &opts.entries))
+				err++;
+			break;
+		case 'h':
+			usage();
+			return (-1);
+		case 'i':
+			opts.image = optarg;
+			break;
+		case 'm':
+			opts.mkntfs = optarg;
+			break;
+		case 'n':
+			if (parse_count(optarg, &opts.count))
+				err++;
+			break;
+		case 'o':
+			opts.mount_options = optarg;
+			break;
+		case 'r':
+			if (parse_count(optarg, &opts.random))
+				err++;
+			break;
+		case 's':
+			if (parse_count(optarg, &opts.data))
+				err++;
+			break;
+		case 'v':
+			opts.verbose++;
+			break;
+		case 'w':
+			opts.workloads = parse_workloads(optarg);
+			if (!opts.workloads)
+				err++;
+			break;
+		default:
+			fprintf(stderr, "Bad option '%s'\n", argv[optind-1]);
+			err++;
+			break;
+		}
+	}
+	if (!err && !opts.dir) {
+		fprintf(stderr, "You must specify a directory\n");
+		err++;
+	}
+	if (!err && (!opts.image != !opts.driver)) {
+		fprintf(stderr, "An image needs a driver, and a driver"
+			" needs an image\n");
+		err++;
+	}
+	if (!err && opts.size && !opts.image) {
+		fprintf(stderr, "You must specify the image to create\n");
+		err++;
+	}
+	if (err)
+		usage();
+	return (err ? 1 : 0);
+}
+
+static unsigned long long now_us(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec*1000000 + ts.tv_nsec/1000);
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, (struct timezone*)NULL);
+	return ((unsigned long long)tv.tv_sec*1000000 + tv.tv_usec);
+#endif
+}
+
+/*
+ *		Pseudo-random numbers, the same for each run
+ */
+
+static unsigned long long bench_random(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return (bench_seed);
+}
+
+static void sample_add(struct SAMPLES *s, unsigned long long start)
+{
+	unsigned long long elapsed;
+	unsigned int *lat;
+	size_t size;
+
+	elapsed = now_us() - start;
+	if (s->count >= s->size) {
+		size = (s->size ? 2*s->size : 4096);
+		lat = (unsigned int*)realloc(s->lat, size*sizeof(*lat));
+		if (lat) {
+			s->lat = lat;
+			s->size = size;
+		}
+	}
+	if (s->count < s->size)
+		s->lat[s->count++] = (elapsed > 0xffffffffULL
+					? 0xffffffff : elapsed);
+	else
+		s->lost++;
+}
+
+static int compare_lat(const void *p1, const void *p2)
+{
+	unsigned int l1 = *(const unsigned int*)p1;
+	unsigned int l2 = *(const unsigned int*)p2;
+
+	return (l1 < l2 ? -1 : (l1 > l2 ? 1 : 0));
+}
+
+static unsigned int percentile(const struct SAMPLES *s, int permille)
+{
+	return (s->count ? s->lat[(s->count - 1)*permille/1000] : 0);
+}
+
+/*
+ *		Print the result of an operation as a line of JSON
+ *
+ *	@elapsed is the duration of all the operations, including
+ *	the time not spent in the operations sampled, such as syncing.
+ *	The samples are reset for the next operation.
+ */
+
+static void report(const char *workload, const char *op, struct SAMPLES *s,
+			unsigned long long elapsed)
+{
+	unsigned long long ops;
+	double seconds;
+
+	ops = s->count + s->lost;
+	seconds = (elapsed ? elapsed : 1)/1000000.0;
+	if (s->count)
+		qsort(s->lat, s->count, sizeof(*s->lat), compare_lat);
+	printf("{\"workload\":\"%s\",\"op\":\"%s\",\"count\":%llu,"
+		"\"seconds\":%.6f,\"ops_per_s\":%.1f",
+		workload, op, ops, elapsed/1000000.0, ops/seconds);
+	if (s->bytes)
+		printf(",\"bytes\":%llu,\"mb_per_s\":%.2f",
+			s->bytes, s->bytes/seconds/1048576.0);
+	printf(",\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,"
+		"\"p999_us\":%u,\"max_us\":%u}\n",
+		percentile(s, 500), percentile(s, 900), percentile(s, 990),
+		percentile(s, 999), percentile(s, 1000));
+	fflush(stdout);
+	s->count = 0;
+	s->lost = 0;
+	s->bytes = 0;
+}
+
+static void report_skipped(const char *workload, const char *reason)
+{
+	printf("{\"workload\":\"%s\",\"skipped\":\"%s\"}\n",
+		workload, reason);
+	fflush(stdout);
+}
+
+/*
+ *		Drop the cached pages of a file, so that it is read
+ *	again from the file system
+ */
+
+static void drop_cache(int fd)
+{
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+ *		Create, stat and unlink many files in a directory
+ */
+
+static int workload_metadata(const char *base)
+{
+	static const char *name = "metadata";
+	struct SAMPLES s;
+	struct stat st;
+	char path[4096];
+	unsigned long long start;
+	unsigned long long op;
+	int err;
+	int fd;
+	int i;
+
+	memset(&s, 0, sizeof(s));
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	if (mkdir(path, 0755)) {
+		fprintf(stderr, "Could not create %s : %s\n",
+			path, strerror(errno));
+		return (-1);
+	}
+	err = 0;
+	start = now_us();
+	for (i=0; (i<opts.count) && !err; i++) {
+		snprintf(path, sizeof(path), "%s/%s/f%08d", base, name, i);
+		op = now_us();
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if ((fd < 0) || close(fd))
+			err = -1;
+		sample_add(&s, op);
+	}
+	if (!err)
+		report(name, "create", &s, now_us() - start);
+	start = now_us();
+	for (i=0; (i<opts.count) && !err; i++) {
+		snprintf(path, sizeof(path), "%s/%s/f%08d", base, name, i);
+		op = now_us();
+		if (stat(path, &st))
+			err = -1;
+		sample_add(&s, op);
+	}
+	if (!err)
+		report(name, "stat", &s, now_us() - start);
+	start = now_us();
+	for (i=0; (i<opts.count) && !err; i++) {
+		snprintf(path, sizeof(path), "%s/%s/f%08d", base, name, i);
+		op = now_us();
+		if (unlink(path))
+			err = -1;
+		sample_add(&s, op);
+	}
+	if (!err)
+		report(name, "unlink", &s, now_us() - start);
+	else
+		fprintf(stderr, "Failed on %s : %s\n", path, strerror(errno));
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	if (!err && rmdir(path)) {
+		fprintf(stderr, "Could not remove %s : %s\n",
+			path, strerror(errno));
+		err = -1;
+	}
+	free(s.lat);
+	return (err);
+}
+
+/*
+ *		Fill a buffer with data which does not compress
+ */
+
+static void fill_random(char *buf, size_t size)
+{
+	unsigned long long r;
+	size_t i;
+
+	for (i=0; (i + sizeof(r))<=size; i+=sizeof(r)) {
+		r = bench_random();
+		memcpy(&buf[i], &r, sizeof(r));
+	}
+}
+
+/*
+ *		Fill a buffer with data which looks like text, so that it
+ *	compresses to about a third of its size
+ */
+
+static void fill_text(char *buf, size_t size)
+{
+	static const char *words[] = {
+		"the ", "volume ", "cluster ", "of ", "index ", "attribute ",
+		"record ", "and ", "runlist ", "to ", "compression ", "a ",
+		"bitmap ", "in ", "file ", "directory "
+	} ;
+	const char *w;
+	size_t i;
+
+	i = 0;
+	while (i < size) {
+		for (w=words[bench_random() % 16]; *w && (i < size); w++)
+			buf[i++] = *w;
+	}
+}
+
+/*
+ *		Write a file sequentially, then read it back
+ *
+ *	The time for syncing the file is included in the write time.
+ */
+
+static int sequential(const char *workload, const char *path, BOOL text)
+{
+	struct SAMPLES s;
+	struct stat st;
+	char *buf;
+	unsigned long long start;
+	unsigned long long op;
+	long long size;
+	long long pos;
+	int err;
+	int fd;
+
+	memset(&s, 0, sizeof(s));
+	size = (long long)opts.data*1048576;
+	buf = (char*)malloc(BENCH_CHUNK);
+	if (!buf)
+		return (-1);
+	if (text)
+		fill_text(buf, BENCH_CHUNK);
+	else
+		fill_random(buf, BENCH_CHUNK);
+	err = -1;
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd >= 0) {
+		err = 0;
+		start = now_us();
+		for (pos=0; (pos<size) && !err; pos+=BENCH_CHUNK) {
+			op = now_us();
+			if (write(fd, buf, BENCH_CHUNK) != BENCH_CHUNK)
+				err = -1;
+			sample_add(&s, op);
+			s.bytes += BENCH_CHUNK;
+		}
+		if (!err && fsync(fd))
+			err = -1;
+		if (!err)
+			report(workload, "write", &s, now_us() - start);
+		drop_cache(fd);
+		start = now_us();
+		for (pos=0; (pos<size) && !err; pos+=BENCH_CHUNK) {
+			op = now_us();
+			if (pread(fd, buf, BENCH_CHUNK, pos) != BENCH_CHUNK)
+				err = -1;
+			sample_add(&s, op);
+			s.bytes += BENCH_CHUNK;
+		}
+		if (!err) {
+			report(workload, "read", &s, now_us() - start);
+			if (text && !fstat(fd, &st))
+				printf("{\"workload\":\"%s\","
+					"\"bytes\":%lld,"
+					"\"allocated_bytes\":%lld}\n",
+					workload, (long long)st.st_size,
+					(long long)st.st_blocks*512);
+		}
+		if (close(fd))
+			err = -1;
+	}
+	if (err)
+		fprintf(stderr, "Failed on %s : %s\n", path, strerror(errno));
+	if ((fd >= 0) && unlink(path))
+		err = -1;
+	free(s.lat);
+	free(buf);
+	return (err);
+}
+
+static int workload_seqio(const char *base)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/seqio", base);
+	return (sequential("seqio", path, FALSE));
+}
+
+/*
+ *		Read and write random blocks of fragmented files
+ *
+ *	Two files are grown by interleaved blocks, so that their clusters
+ *	are interleaved, and one of them is then accessed randomly.
+ */
+
+static int workload_randio(const char *base)
+{
+	static const char *name = "randio";
+	struct SAMPLES s;
+	char path[2][4096];
+	char buf[BENCH_BLOCK];
+	unsigned long long start;
+	unsigned long long op;
+	long long blocks;
+	long long i;
+	off_t pos;
+	int fd[2];
+	int err;
+	int j;
+
+	memset(&s, 0, sizeof(s));
+	blocks = (long long)opts.data*1048576/BENCH_BLOCK/2;
+	if (blocks < 2)
+		blocks = 2;
+	err = 0;
+	for (j=0; j<2; j++) {
+		snprintf(path[j], sizeof(path[j]), "%s/%s%d", base, name, j);
+		fd[j] = open(path[j], O_CREAT | O_TRUNC | O_RDWR, 0644);
+		if (fd[j] < 0)
+			err = -1;
+	}
+	start = now_us();
+	for (i=0; (i<blocks) && !err; i++) {
+		for (j=0; (j<2) && !err; j++) {
+			fill_random(buf, BENCH_BLOCK);
+			op = now_us();
+			if (write(fd[j], buf, BENCH_BLOCK) != BENCH_BLOCK
+#ifdef HAVE_FDATASYNC
+			    || fdatasync(fd[j]))
+#else
+			    || fsync(fd[j]))
+#endif
+				err = -1;
+			sample_add(&s, op);
+			s.bytes += BENCH_BLOCK;
+		}
+	}
+	if (!err)
+		report(name, "fragment", &s, now_us() - start);
+	if (!err)
+		drop_cache(fd[0]);
+	start = now_us();
+	for (i=0; (i<opts.random) && !err; i++) {
+		pos = (off_t)(bench_random() % blocks)*BENCH_BLOCK;
+		op = now_us();
+		if (pread(fd[0], buf, BENCH_BLOCK, pos) != BENCH_BLOCK)
+			err = -1;
+		sample_add(&s, op);
+		s.bytes += BENCH_BLOCK;
+	}
+	if (!err)
+		report(name, "random_read", &s, now_us() - start);
+	start = now_us();
+	for (i=0; (i<opts.random) && !err; i++) {
+		pos = (off_t)(bench_random() % blocks)*BENCH_BLOCK;
+		op = now_us();
+		if (pwrite(fd[0], buf, BENCH_BLOCK, pos) != BENCH_BLOCK)
+			err = -1;
+		sample_add(&s, op);
+		s.bytes += BENCH_BLOCK;
+	}
+	if (!err && fsync(fd[0]))
+		err = -1;
+	if (!err)
+		report(name, "random_write", &s, now_us() - start);
+	else
+		fprintf(stderr, "Failed on %s : %s\n", path[0],
+			strerror(errno));
+	for (j=0; j<2; j++) {
+		if ((fd[j] >= 0) && (close(fd[j]) || unlink(path[j])))
+			err = -1;
+	}
+	free(s.lat);
+	return (err);
+}
+
+/*
+ *		List a directory with many entries
+ *
+ *	The latency sampled is the one of each readdir(), and most of
+ *	them only get an entry already fetched.
+ */
+
+static int workload_listing(const char *base)
+{
+	static const char *name = "listing";
+	struct SAMPLES s;
+	struct dirent *ent;
+	char path[4096];
+	unsigned long long start;
+	unsigned long long op;
+	long long found;
+	DIR *dir;
+	int pass;
+	int err;
+	int fd;
+	int i;
+
+	memset(&s, 0, sizeof(s));
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	if (mkdir(path, 0755)) {
+		fprintf(stderr, "Could not create %s : %s\n",
+			path, strerror(errno));
+		return (-1);
+	}
+	err = 0;
+	start = now_us();
+	for (i=0; (i<opts.entries) && !err; i++) {
+		snprintf(path, sizeof(path), "%s/%s/entry-%08d",
+			base, name, i);
+		op = now_us();
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if ((fd < 0) || close(fd))
+			err = -1;
+		sample_add(&s, op);
+	}
+	if (!err)
+		report(name, "populate", &s, now_us() - start);
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	for (pass=0; (pass<BENCH_PASSES) && !err; pass++) {
+		found = 0;
+		start = now_us();
+		dir = opendir(path);
+		if (dir) {
+			do {
+				op = now_us();
+				ent = readdir(dir);
+				sample_add(&s, op);
+				if (ent)
+					found++;
+			} while (ent);
+			closedir(dir);
+		}
+		if (!dir || (found < opts.entries))
+			err = -1;
+		else
+			report(name, "readdir", &s, now_us() - start);
+	}
+	for (i=0; i<opts.entries; i++) {
+		snprintf(path, sizeof(path), "%s/%s/entry-%08d",
+			base, name, i);
+		if (unlink(path) && (errno != ENOENT))
+			err = -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	if (rmdir(path))
+		err = -1;
+	if (err)
+		fprintf(stderr, "Failed on %s : %s\n", path, strerror(errno));
+	free(s.lat);
+	return (err);
+}
+
+/*
+ *		Write and read a file in a compressed directory
+ *
+ *	The directory is marked compressed through the extended attribute
+ *	system.ntfs_attrib_be, which only ntfs-3g provides.
+ */
+
+static int workload_compressed(const char *base)
+{
+	static const char *name = "compressed";
+	char path[4096];
+	unsigned char attrib[4];
+	int err;
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	if (mkdir(path, 0755)) {
+		fprintf(stderr, "Could not create %s : %s\n",
+			path, strerror(errno));
+		return (-1);
+	}
+	err = 0;
+#ifdef HAVE_SETXATTR
+	if (getxattr(path, "system.ntfs_attrib_be", attrib, 4) == 4) {
+		attrib[2] |= FILE_ATTR_COMPRESSED >> 8;
+		if (setxattr(path, "system.ntfs_attrib_be", attrib, 4, 0))
+			err = 1;
+	} else
+		err = 1;
+#else
+	err = 1;
+#endif
+	if (err)
+		report_skipped(name, "compression cannot be set");
+	else {
+		snprintf(path, sizeof(path), "%s/%s/data", base, name);
+		err = sequential(name, path, TRUE);
+	}
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	if (rmdir(path))
+		err = -1;
+	return (err > 0 ? 0 : err);
+}
+
+#ifdef HAVE_SETXATTR
+
+/*
+ *		Set a Posix ACL granting access to an extra user and
+ *	group, in the format of the extended attributes
+ */
+
+static int set_acl(const char *path, const char *attr)
+{
+	static const unsigned short tags[] = {
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20
+	} ;
+	static const unsigned short perms[] = { 7, 5, 5, 5, 5, 5 } ;
+	static const unsigned int ids[] = {
+		0xffffffff, 1000, 0xffffffff, 1000, 0xffffffff, 0xffffffff
+	} ;
+	unsigned char acl[4 + 6*8];
+	unsigned char *p;
+	int i;
+
+	memset(acl, 0, sizeof(acl));
+	acl[0] = 2;	/* version, little endian */
+	p = &acl[4];
+	for (i=0; i<6; i++) {
+		p[0] = tags[i];
+		p[1] = tags[i] >> 8;
+		p[2] = perms[i];
+		p[4] = ids[i];
+		p[5] = ids[i] >> 8;
+		p[6] = ids[i] >> 16;
+		p[7] = ids[i] >> 24;
+		p += 8;
+	}
+	return (setxattr(path, attr, acl, sizeof(acl), 0));
+}
+
+/*
+ *		Build or remove the tree of directories and files
+ *
+ *	Returns 0 if successful, 1 if ACLs are not supported,
+ *		-1 if failed
+ */
+
+static int acl_tree(const char *path, int depth, BOOL build)
+{
+	char sub[4096];
+	int err;
+	int fd;
+	int i;
+
+	err = 0;
+	if (build) {
+		if (mkdir(path, 0755))
+			err = -1;
+		else
+			if (set_acl(path, "system.posix_acl_access")
+			    || set_acl(path, "system.posix_acl_default"))
+				err = ((errno == EOPNOTSUPP)
+					|| (errno == ENOTSUP) ? 1 : -1);
+	}
+	for (i=0; (i<BENCH_FANOUT) && !err; i++) {
+		if (depth) {
+			snprintf(sub, sizeof(sub), "%s/d%d", path, i);
+			err = acl_tree(sub, depth - 1, build);
+		} else {
+			snprintf(sub, sizeof(sub), "%s/f%d", path, i);
+			if (build) {
+				fd = open(sub, O_CREAT | O_EXCL | O_WRONLY,
+						0644);
+				if ((fd < 0)
+				    || (write(fd, sub, strlen(sub)) < 0)
+				    || close(fd))
+					err = -1;
+			} else
+				if (unlink(sub) && (errno != ENOENT))
+					err = -1;
+		}
+	}
+	if (!build && rmdir(path) && (errno != ENOENT))
+		err = -1;
+	return (err);
+}
+
+/*
+ *		Traverse the tree, getting the attributes of each file and
+ *	checking the access to it
+ */
+
+static int acl_traverse(const char *path, struct SAMPLES *stats,
+			struct SAMPLES *opens)
+{
+	struct dirent *ent;
+	struct stat st;
+	char sub[4096];
+	char buf[256];
+	unsigned long long op;
+	DIR *dir;
+	int err;
+	int fd;
+
+	err = 0;
+	dir = opendir(path);
+	if (!dir)
+		return (-1);
+	while (!err && ((ent = readdir(dir)))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+		op = now_us();
+		if (stat(sub, &st) || access(sub, R_OK))
+			err = -1;
+		sample_add(stats, op);
+		if (err)
+			break;
+		if (S_ISDIR(st.st_mode))
+			err = acl_traverse(sub, stats, opens);
+		else {
+			op = now_us();
+			fd = open(sub, O_RDONLY);
+			if ((fd < 0) || (read(fd, buf, sizeof(buf)) < 0)
+			    || close(fd))
+				err = -1;
+			sample_add(opens, op);
+		}
+	}
+	closedir(dir);
+	return (err);
+}
+
+#endif /* HAVE_SETXATTR */
+
+/*
+ *		Traverse a tree of directories and files with ACLs
+ *
+ *	The file system has to be mounted with the option acl.
+ */
+
+static int workload_acl(const char *base)
+{
+	static const char *name = "acl";
+#ifdef HAVE_SETXATTR
+	struct SAMPLES stats;
+	struct SAMPLES opens;
+	char path[4096];
+	unsigned long long start;
+	unsigned long long elapsed;
+	int pass;
+	int err;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&opens, 0, sizeof(opens));
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	start = now_us();
+	err = acl_tree(path, 2, TRUE);
+	elapsed = now_us() - start;
+	if (err > 0)
+		report_skipped(name, "acls not supported");
+	if (!err)
+		printf("{\"workload\":\"%s\",\"op\":\"build\","
+			"\"seconds\":%.6f}\n", name, elapsed/1000000.0);
+	for (pass=0; (pass<BENCH_PASSES) && !err; pass++) {
+		start = now_us();
+		err = acl_traverse(path, &stats, &opens);
+		elapsed = now_us() - start;
+		if (!err) {
+			report(name, "stat_access", &stats, elapsed);
+			report(name, "open_read", &opens, elapsed);
+		}
+	}
+	if (err < 0)
+		fprintf(stderr, "Failed on the tree %s : %s\n",
+			path, strerror(errno));
+	if (acl_tree(path, 2, FALSE))
+		err = -1;
+	free(stats.lat);
+	free(opens.lat);
+	return (err > 0 ? 0 : err);
+#else
+	(void)base;
+	report_skipped(name, "no extended attributes");
+	return (0);
+#endif
+}
+
+/*
+ *		Run a command and wait for its completion
+ *
+ *	Returns its exit code, or -1 if it could not be run
+ */
+
+static int run(char *const argv[])
+{
+	pid_t pid;
+	int status;
+	int fd;
+
+	if (opts.verbose) {
+		int i;
+
+		fprintf(stderr, "Running");
+		for (i=0; argv[i]; i++)
+			fprintf(stderr, " %s", argv[i]);
+		fprintf(stderr, "\n");
+	}
+	pid = fork();
+	if (pid < 0)
+		return (-1);
+	if (!pid) {
+		if (!opts.verbose) {
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0) {
+				dup2(fd, 1);
+				dup2(fd, 2);
+				close(fd);
+			}
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) != pid)
+		return (-1);
+	return (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+static int create_image(void)
+{
+	char *argv[6];
+	int fd;
+	int res;
+
+	res = -1;
+	fd = open(opts.image, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd >= 0) {
+		if (!ftruncate(fd, (off_t)opts.size*1048576) && !close(fd)) {
+			argv[0] = opts.mkntfs;
+			argv[1] = "-F";
+			argv[2] = "-f";
+			argv[3] = "-q";
+			argv[4] = opts.image;
+			argv[5] = (char*)NULL;
+			res = run(argv);
+		} else
+			close(fd);
+	}
+	if (res)
+		fprintf(stderr, "Could not create the image %s\n",
+			opts.image);
+	return (res);
+}
+
+static int mount_image(void)
+{
+	char *argv[6];
+	int i;
+	int res;
+
+	i = 0;
+	argv[i++] = opts.driver;
+	if (opts.mount_options) {
+		argv[i++] = "-o";
+		argv[i++] = opts.mount_options;
+	}
+	argv[i++] = opts.image;
+	argv[i++] = opts.dir;
+	argv[i] = (char*)NULL;
+	res = run(argv);
+	if (res)
+		fprintf(stderr, "Could not mount %s on %s\n",
+			opts.image, opts.dir);
+	return (res);
+}
+
+static int unmount_image(void)
+{
+	char *argv[4];
+	int res;
+
+	argv[0] = "fusermount";
+	argv[1] = "-u";
+	argv[2] = opts.dir;
+	argv[3] = (char*)NULL;
+	res = run(argv);
+	if (res) {
+		argv[0] = "umount";
+		argv[1] = opts.dir;
+		argv[2] = (char*)NULL;
+		res = run(argv);
+	}
+	if (res)
+		fprintf(stderr, "Could not unmount %s\n", opts.dir);
+	return (res);
+}
+
+int main(int argc, char *argv[])
+{
+	int err;
+	int res;
+
+	res = parse_options(argc, argv);
+	if (res)
+		return (res < 0 ? 0 : res);
+	if (opts.size && create_image())
+		return (1);
+	if (opts.image && mount_image())
+		return (1);
+	printf("{\"bench\":\"%s\",\"version\":\"%s\",\"driver\":\"%s\","
+		"\"options\":\"%s\",\"count\":%d,\"entries\":%d,"
+		"\"data_mb\":%d,\"random\":%d}\n", EXEC_NAME, VERSION,
+		(opts.driver ? opts.driver : ""),
+		(opts.mount_options ? opts.mount_options : ""),
+		opts.count, opts.entries, opts.data, opts.random);
+	err = 0;
+	if (opts.workloads & WORKLOAD_METADATA)
+		err |= workload_metadata(opts.dir);
+	if (opts.workloads & WORKLOAD_SEQIO)
+		err |= workload_seqio(opts.dir);
+	if (opts.workloads & WORKLOAD_RANDIO)
+		err |= workload_randio(opts.dir);
+	if (opts.workloads & WORKLOAD_LISTING)
+		err |= workload_listing(opts.dir);
+	if (opts.workloads & WORKLOAD_COMPRESSED)
+		err |= workload_compressed(opts.dir);
+	if (opts.workloads & WORKLOAD_ACL)
+		err |= workload_acl(opts.dir);
+	if (opts.image && unmount_image())
+		err = -1;
+	return (err ? 1 : 0);
+}
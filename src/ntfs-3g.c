@@ -107,7 +107,15 @@
 #include "xattrs.h"
 #include "misc.h"
 #include "ioctl.h"
+#include "blkcache.h"
+#include "cache.h"
+#include "compress.h"
+#include "lcnalloc.h"
 #include "plugin.h"
+#include "stats.h"
+#include "trace.h"
+#include "prefetch.h"
+#include "usnjrnl.h"
 
 #include "ntfs-3g_common.h"
 
@@ -170,9 +178,24 @@ enum {
 	CLOSE_COMPRESSED = 1,
 	CLOSE_ENCRYPTED = 2,
 	CLOSE_DMTIME = 4,
-	CLOSE_REPARSE = 8
+	CLOSE_REPARSE = 8,
+	CLOSE_PREALLOC = 16
 };
 
+	/*
+	 * The inode of an open file is recorded in fuse_file_info->fh
+	 * along with the above flags, so that it does not have to be
+	 * found again from the path : the flags are in the low byte,
+	 * followed by the inode number on four bytes, the sequence number
+	 * and a marker which tells the handle from the ones defined by
+	 * the reparse plugins.
+	 */
+#define FH_FLAGS 0xff
+#define FH_MARKER 0xa5
+#define FH_IS_RECORDED(fh) (((fh) >> 56) == FH_MARKER)
+#define FH_INUM(fh) (((fh) >> 8) & 0xffffffff)
+#define FH_SEQNO(fh) (((fh) >> 40) & 0xffff)
+
 static struct ntfs_options opts;
 
 const char *EXEC_NAME = "ntfs-3g";
@@ -812,6 +835,7 @@ static int ntfs_fuse_getattr(const char *org_path, struct stat *stbuf)
 	int stream_name_len;
 	BOOL withusermapping;
 	struct SECURITY_CONTEXT security;
+	u32 changes = 0;
 
 	stream_name_len = ntfs_fuse_parse_path(org_path, &path, &stream_name);
 	if (stream_name_len < 0)
@@ -835,6 +859,10 @@ static int ntfs_fuse_getattr(const char *org_path, struct stat *stbuf)
                	goto exit;
 	}
 #endif
+		/* the stat of the unnamed stream does not depend on the caller */
+	if (!stream_name_len
+	    && ntfs_inode_fetch_stat(ctx->vol, ni->mft_no, stbuf, &changes))
+		goto exit;
 	stbuf->st_nlink = le16_to_cpu(ni->mrec->link_count);
 	if (ctx->posix_nlink
 	    && !(ni->flags & FILE_ATTR_REPARSE_POINT))
@@ -1075,6 +1103,8 @@ nodata :
 	stbuf->st_mtime = ts.tv_sec;
 	}
 #endif
+	if (!res && !stream_name_len)
+		ntfs_inode_enter_stat(ni, stbuf, changes);
 exit:
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
@@ -1258,14 +1288,16 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		const s64 pos __attribute__((unused)), const MFT_REF mref,
 		const unsigned dt_type __attribute__((unused)))
 {
-	char *filename = NULL;
+	char namebuf[NTFS_MAX_NAME_LEN*MB_LEN_MAX + 1];
+	char *filename = namebuf;
 	int ret = 0;
 	int filenamelen = -1;
 
 	if (name_type == FILE_NAME_DOS)
 		return 0;
 	
-	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename, 0)) < 0) {
+	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename,
+				sizeof(namebuf))) < 0) {
 		ntfs_log_perror("Filename decoding failed (inode %llu)",
 				(unsigned long long)MREF(mref));
 		return -1;
@@ -1275,7 +1307,6 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		ntfs_log_error("Unable to access '%s' (inode %llu) with "
 				"current named streams access interface.\n",
 				filename, (unsigned long long)MREF(mref));
-		free(filename);
 		return 0;
 	} else {
 		struct stat st = { .st_ino = MREF(mref) };
@@ -1363,7 +1394,6 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		ret = fill_ctx->filler(fill_ctx->buf, filename, &st, 0);
 	}
 	
-	free(filename);
 	return ret;
 }
 
@@ -1459,12 +1489,51 @@ static int ntfs_fuse_readdir(const char *path, void *buf,
 	return err;
 }
 
+/*
+ *		Record the inode of a file being opened or created
+ */
+
+static void ntfs_fuse_record_fh(struct fuse_file_info *fi, ntfs_inode *ni)
+{
+	if (fi && !(ni->mft_no >> 32))
+		fi->fh = (fi->fh & FH_FLAGS)
+			| ((u64)ni->mft_no << 8)
+			| ((u64)le16_to_cpu(ni->mrec->sequence_number) << 40)
+			| ((u64)FH_MARKER << 56);
+}
+
+/*
+ *		Get the inode of an open file
+ *
+ *	The inode recorded when opening is used if it is still the same
+ *	file, otherwise the inode is found from the path.
+ */
+
+static ntfs_inode *ntfs_fuse_fh_inode(const char *path,
+			const struct fuse_file_info *fi)
+{
+	ntfs_inode *ni;
+
+	ni = (ntfs_inode*)NULL;
+	if (fi && FH_IS_RECORDED(fi->fh)) {
+		ni = ntfs_inode_open(ctx->vol, FH_INUM(fi->fh));
+		if (ni
+		    && (!(ni->mrec->flags & MFT_RECORD_IN_USE)
+			|| ni->mrec->base_mft_record
+			|| (le16_to_cpu(ni->mrec->sequence_number)
+				!= FH_SEQNO(fi->fh))
+			|| (ni->flags & FILE_ATTR_REPARSE_POINT))) {
+			ntfs_inode_close(ni);
+			ni = (ntfs_inode*)NULL;
+		}
+	}
+	if (!ni)
+		ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	return (ni);
+}
+
 static int ntfs_fuse_open(const char *org_path,
-#if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 		struct fuse_file_info *fi)
-#else
-		struct fuse_file_info *fi __attribute__((unused)))
-#endif
 {
 	ntfs_inode *ni;
 	ntfs_attr *na = NULL;
@@ -1526,6 +1595,10 @@ static int ntfs_fuse_open(const char *org_path,
 		/* mark a future need to compress the last chunk */
 			if (na->data_flags & ATTR_COMPRESSION_MASK)
 				fi->fh |= CLOSE_COMPRESSED;
+		/* mark a future need to release the preallocation */
+			else
+				if (ctx->vol->prealloc_size)
+					fi->fh |= CLOSE_PREALLOC;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 			/* mark a future need to fixup encrypted inode */
 			if (ctx->efs_raw
@@ -1540,6 +1613,8 @@ static int ntfs_fuse_open(const char *org_path,
 			if (ni->mft_no < FILE_first_user)
 				res = -EPERM;
 		}
+		if (res >= 0)
+			ntfs_fuse_record_fh(fi, ni);
 		ntfs_attr_close(na);
 close:
 		if (ntfs_inode_close(ni))
@@ -1553,7 +1628,7 @@ close:
 }
 
 static int ntfs_fuse_read(const char *org_path, char *buf, size_t size,
-		off_t offset, struct fuse_file_info *fi __attribute__((unused)))
+		off_t offset, struct fuse_file_info *fi)
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
@@ -1569,7 +1644,7 @@ static int ntfs_fuse_read(const char *org_path, char *buf, size_t size,
 	stream_name_len = ntfs_fuse_parse_path(org_path, &path, &stream_name);
 	if (stream_name_len < 0)
 		return stream_name_len;
-	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	ni = ntfs_fuse_fh_inode(path, fi);
 	if (!ni) {
 		res = -errno;
 		goto exit;
@@ -1644,7 +1719,7 @@ exit:
 }
 
 static int ntfs_fuse_write(const char *org_path, const char *buf, size_t size,
-		off_t offset, struct fuse_file_info *fi __attribute__((unused)))
+		off_t offset, struct fuse_file_info *fi)
 {
 	ntfs_inode *ni = NULL;
 	ntfs_attr *na = NULL;
@@ -1657,7 +1732,7 @@ static int ntfs_fuse_write(const char *org_path, const char *buf, size_t size,
 		res = stream_name_len;
 		goto out;
 	}
-	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	ni = ntfs_fuse_fh_inode(path, fi);
 	if (!ni) {
 		res = -errno;
 		goto exit;
@@ -1734,7 +1809,8 @@ static int ntfs_fuse_release(const char *org_path,
 
 	/* Only for marked descriptors there is something to do */
 	
-	if (!fi->fh) {
+	if (!fi->fh
+	    || (FH_IS_RECORDED(fi->fh) && !(fi->fh & FH_FLAGS))) {
 		res = 0;
 		goto out;
 	}
@@ -1743,7 +1819,7 @@ static int ntfs_fuse_release(const char *org_path,
 		res = stream_name_len;
 		goto out;
 	}
-	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	ni = ntfs_fuse_fh_inode(path, fi);
 	if (!ni) {
 		res = -errno;
 		goto exit;
@@ -1775,6 +1851,9 @@ static int ntfs_fuse_release(const char *org_path,
 	res = 0;
 	if (fi->fh & CLOSE_COMPRESSED)
 		res = ntfs_attr_pclose(na);
+	if ((fi->fh & CLOSE_PREALLOC)
+	    && ntfs_attr_trim_prealloc(na))
+		res = -errno;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 	if (fi->fh & CLOSE_ENCRYPTED)
 		res = ntfs_efs_fixup_attribute(NULL, na);
@@ -2211,6 +2290,10 @@ static int ntfs_fuse_create(const char *org_path, mode_t typemode, dev_t dev,
 			if (fi && (ni->flags & FILE_ATTR_COMPRESSED)) {
 				fi->fh |= CLOSE_COMPRESSED;
 			}
+			/* mark a need to release the preallocation */
+			if (fi && !(ni->flags & FILE_ATTR_COMPRESSED)
+			    && ctx->vol->prealloc_size)
+				fi->fh |= CLOSE_PREALLOC;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 			/* mark a future need to fixup encrypted inode */
 			if (fi
@@ -2221,6 +2304,7 @@ static int ntfs_fuse_create(const char *org_path, mode_t typemode, dev_t dev,
 			/* mark a need to update the mtime */
 			if (fi && ctx->dmtime)
 				fi->fh |= CLOSE_DMTIME;
+			ntfs_fuse_record_fh(fi, ni);
 			NInoSetDirty(ni);
 			/*
 			 * closing ni requires access to dir_ni to
@@ -2284,6 +2368,10 @@ static int ntfs_fuse_create_stream(const char *path,
 		/* mark a future need to compress the last block */
 		if (ni->flags & FILE_ATTR_COMPRESSED)
 			fi->fh |= CLOSE_COMPRESSED;
+		/* mark a future need to release the preallocation */
+		else
+			if (ctx->vol->prealloc_size)
+				fi->fh |= CLOSE_PREALLOC;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 		/* mark a future need to fixup encrypted inode */
 		if (ctx->efs_raw
@@ -2293,6 +2381,8 @@ static int ntfs_fuse_create_stream(const char *path,
 		if (ctx->dmtime)
 			fi->fh |= CLOSE_DMTIME;
 	}
+	if (res >= 0)
+		ntfs_fuse_record_fh(fi, ni);
 
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
@@ -2722,6 +2812,8 @@ static int ntfs_fuse_rename(const char *old_path, const char *new_path)
 		ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
 		if (ni) {
 			same = ni->mft_no == inum;
+				/* record the links changed as a rename */
+			ntfs_usn_renaming(ctx->vol, ni->mft_no);
 			if (ntfs_inode_close(ni))
 				ret = -errno;
 			else
@@ -2733,6 +2825,13 @@ static int ntfs_fuse_rename(const char *old_path, const char *new_path)
 		goto out;
 	}
 
+	if (ctx->vol->usn_journal) {
+		ni = ntfs_pathname_to_inode(ctx->vol, NULL, old_path);
+		if (ni) {
+			ntfs_usn_renaming(ctx->vol, ni->mft_no);
+			ntfs_inode_close(ni);
+		}
+	}
 	ret = ntfs_fuse_link(old_path, new_path);
 	if (ret)
 		goto out;
@@ -2741,6 +2840,7 @@ static int ntfs_fuse_rename(const char *old_path, const char *new_path)
 	if (ret)
 		ntfs_fuse_unlink(new_path);
 out:
+	ntfs_usn_renaming(ctx->vol, 0);
 	free(path);
 	if (stream_name_len)
 		free(stream_name);
@@ -2908,12 +3008,70 @@ static int ntfs_fuse_fsync(const char *path __attribute__((unused)),
 	int ret;
 
 		/* sync the full device */
-	ret = ntfs_device_sync(ctx->vol->dev);
+	ret = ntfs_volume_sync(ctx->vol);
 	if (ret)
 		ret = -errno;
 	return (ret);
 }
 
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+static int ntfs_fuse_fallocate(const char *org_path, int mode,
+			off_t offset, off_t length,
+			struct fuse_file_info *fi __attribute__((unused)))
+{
+	ntfs_inode *ni = NULL;
+	ntfs_attr *na = NULL;
+	char *path = NULL;
+	ntfschar *stream_name;
+	int stream_name_len, res;
+	BOOL keep_size;
+
+	keep_size = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		res = -EOPNOTSUPP;
+		goto out;
+	}
+	stream_name_len = ntfs_fuse_parse_path(org_path, &path, &stream_name);
+	if (stream_name_len < 0) {
+		res = stream_name_len;
+		goto out;
+	}
+	ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+	if (!ni) {
+		res = -errno;
+		goto exit;
+	}
+	if ((ni->flags & FILE_ATTR_REPARSE_POINT)
+	    || (ni->mft_no < FILE_first_user)) {
+		res = -EOPNOTSUPP;
+		goto exit;
+	}
+	na = ntfs_attr_open(ni, AT_DATA, stream_name, stream_name_len);
+	if (!na) {
+		res = -errno;
+		goto exit;
+	}
+	res = 0;
+	if (ntfs_attr_fallocate(na, offset, length, keep_size))
+		res = -errno;
+	else
+		if (!keep_size) {
+			ntfs_fuse_update_times(ni, NTFS_UPDATE_MCTIME);
+			set_archive(ni);
+		}
+exit:
+	if (na)
+		ntfs_attr_close(na);
+	if (ni && ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	free(path);
+	if (stream_name_len)
+		free(stream_name);
+out:
+	return res;
+}
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
+
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
 static int ntfs_fuse_ioctl(const char *path,
 			int cmd, void *arg,
@@ -2974,12 +3132,12 @@ static int ntfs_fuse_bmap(const char *path, size_t blocksize, uint64_t *idx)
 		goto close_attr;
 	}
 	
-	if (ntfs_attr_map_whole_runlist(na)) {
-		ret = -errno;
+		/* only map the part of the runlist holding the block */
+	lcn = ntfs_attr_vcn_to_lcn(na, *idx / cl_per_bl);
+	if (lcn == (LCN)LCN_EIO) {
+		ret = -EIO;
 		goto close_attr;
 	}
-	
-	lcn = ntfs_rl_vcn_to_lcn(na->rl, *idx / cl_per_bl);
 	*idx = (lcn > 0) ? lcn * cl_per_bl + *idx % cl_per_bl : 0;
 	
 close_attr:
@@ -3145,7 +3303,6 @@ static int fix_xattr_prefix(const char *name, int namespace, ntfschar **lename)
 
 static int ntfs_fuse_listxattr(const char *path, char *list, size_t size)
 {
-	ntfs_attr_search_ctx *actx = NULL;
 	ntfs_inode *ni;
 	int ret = 0;
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
@@ -3172,24 +3329,12 @@ static int ntfs_fuse_listxattr(const char *path, char *list, size_t size)
 		goto exit;
 	}
 #endif
-	actx = ntfs_attr_get_search_ctx(ni, NULL);
-	if (!actx) {
-		ret = -errno;
-		goto exit;
-	}
-
 	if ((ctx->streams == NF_STREAMS_INTERFACE_XATTR)
 	    || (ctx->streams == NF_STREAMS_INTERFACE_OPENXATTR)) {
-		ret = ntfs_fuse_listxattr_common(ni, actx, list, size,
+		ret = ntfs_fuse_listxattr_common(ni, list, size,
 				ctx->streams == NF_STREAMS_INTERFACE_XATTR);
-		if (ret < 0)
-			goto exit;
 	}
-	if (errno != ENOENT)
-		ret = -errno;
 exit:
-	if (actx)
-		ntfs_attr_put_search_ctx(actx);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&ret);
 	return ret;
@@ -3882,6 +4027,12 @@ static void register_internal_reparse_plugins(void)
 	static const plugin_operations_t wsl_ops = {
 		.getattr = wsl_getattr,
 	} ;
+	static const plugin_operations_t wof_ops = {
+		.getattr = wof_getattr,
+		.open = wof_open,
+		.read = wof_read,
+		.release = wof_release,
+	} ;
 
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_MOUNT_POINT,
 					&ops, (void*)NULL);
@@ -3899,6 +4050,8 @@ static void register_internal_reparse_plugins(void)
 					&wsl_ops, (void*)NULL);
 	register_reparse_plugin(ctx, IO_REPARSE_TAG_LX_BLK,
 					&wsl_ops, (void*)NULL);
+	register_reparse_plugin(ctx, IO_REPARSE_TAG_WOF,
+					&wof_ops, (void*)NULL);
 }
 #endif /* DISABLE_PLUGINS */
 
@@ -3977,6 +4130,9 @@ static struct fuse_operations ntfs_3g_ops = {
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
         .ioctl		= ntfs_fuse_ioctl,
 #endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28) */
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29)
+	.fallocate	= ntfs_fuse_fallocate,
+#endif /* defined(FUSE_INTERNAL) || (FUSE_VERSION >= 29) */
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 	.access		= ntfs_fuse_access,
 	.opendir	= ntfs_fuse_opendir,
@@ -4022,6 +4178,8 @@ static int ntfs_fuse_init(void)
 static int ntfs_open(const char *device)
 {
 	unsigned long flags = 0;
+	int i;
+	int snapped;
 	
 	if (!ctx->blkdev)
 		flags |= NTFS_MNT_EXCLUSIVE;
@@ -4034,6 +4192,12 @@ static int ntfs_open(const char *device)
 		flags |= NTFS_MNT_RECOVER;
 	if (ctx->hiberfile)
 		flags |= NTFS_MNT_IGNORE_HIBERFILE;
+	if (ctx->uring)
+		flags |= NTFS_MNT_URING;
+	if (ctx->direct_device_io)
+		flags |= NTFS_MNT_DIRECT_IO;
+	if (ctx->fast_mount)
+		flags |= NTFS_MNT_DEFER_LOADS;
 
 	ctx->vol = ntfs_mount(device, flags);
 	if (!ctx->vol) {
@@ -4042,10 +4206,58 @@ static int ntfs_open(const char *device)
 	}
 	if (ctx->sync && ctx->vol->dev)
 		NDevSetSync(ctx->vol->dev);
+	if ((ctx->block_cache > 0)
+	    && ntfs_create_block_cache(ctx->vol,
+				(s64)ctx->block_cache << 20))
+		ntfs_log_perror("Could not create the block cache");
+	if ((ctx->record_cache > 0)
+	    && ntfs_create_mftrec_cache(ctx->vol,
+				(s64)ctx->record_cache << 20))
+		ntfs_log_perror("Could not create the mft record cache");
+	if ((ctx->index_cache > 0)
+	    && ntfs_create_index_cache(ctx->vol,
+				(s64)ctx->index_cache << 20))
+		ntfs_log_perror("Could not create the index block cache");
+	if ((ctx->index_writeback > 0)
+	    && ntfs_set_index_writeback(ctx->vol,
+				(s64)ctx->index_writeback << 20))
+		ntfs_log_perror("Could not delay the index block writes");
+	if ((ctx->lazy_delete > 0)
+	    && ntfs_set_index_lazy_delete(ctx->vol, ctx->lazy_delete))
+		ntfs_log_perror("Could not remove the directory entries lazily");
+	if ((ctx->prealloc > 0)
+	    && ntfs_set_prealloc_size(ctx->vol, (s64)ctx->prealloc << 20))
+		ntfs_log_perror("Could not set the preallocation size");
+	if ((ctx->hole_unit > 0)
+	    && ntfs_set_hole_unit(ctx->vol, (s64)ctx->hole_unit << 10))
+		ntfs_log_perror("Could not set the hole allocation unit");
+	if ((ctx->bitmap_writeback > 0)
+	    && ntfs_set_lcnbmp_writeback(ctx->vol,
+				(s64)ctx->bitmap_writeback << 20))
+		ntfs_log_perror("Could not delay the $Bitmap writes");
+	if (ctx->discard && !ctx->ro
+	    && ntfs_set_cluster_discard(ctx->vol, TRUE))
+		ntfs_log_perror("Could not discard the freed clusters");
+	if ((ctx->mft_writeback > 0)
+	    && ntfs_set_mft_writeback(ctx->vol, ctx->mft_writeback))
+		ntfs_log_perror("Could not delay the mft record writes");
+	for (i=0; i<NTFS_LRU_CACHES; i++)
+		if ((ctx->lru_cache[i] >= 0)
+		    && ntfs_set_cache_size(ctx->vol, i, ctx->lru_cache[i]))
+			ntfs_log_perror("Could not resize a cache");
+	if (ctx->stats && ntfs_set_stats(ctx->vol, TRUE))
+		ntfs_log_perror("Could not keep the statistics");
+	if ((ctx->trace > 0) && ntfs_set_trace(ctx->vol, ctx->trace))
+		ntfs_log_perror("Could not trace the device transfers");
 	if (ctx->compression)
 		NVolSetCompression(ctx->vol);
 	else
 		NVolClearCompression(ctx->vol);
+	if (ctx->compression_level
+	    && ntfs_set_compression_level(ctx->vol, ctx->compression_level))
+		goto err_out;
+	if (ctx->uncompressed_overwrites)
+		NVolSetUncompressedOverwrites(ctx->vol);
 #ifdef HAVE_SETXATTR
 			/* archivers must see hidden files */
 	if (ctx->efs_raw)
@@ -4054,17 +4266,27 @@ static int ntfs_open(const char *device)
 	if (ntfs_set_shown_files(ctx->vol, ctx->show_sys_files,
 				!ctx->hide_hid_files, ctx->hide_dot_files))
 		goto err_out;
-	
-	ctx->vol->free_clusters = ntfs_attr_get_free_bits(ctx->vol->lcnbmp_na);
-	if (ctx->vol->free_clusters < 0) {
-		ntfs_log_perror("Failed to read NTFS $Bitmap");
+	if (ntfs_set_compact_runlists(ctx->vol, TRUE))
 		goto err_out;
+	
+	/* the free space may be known from a snapshot */
+	snapped = 0;
+	if (ctx->snapshot_path) {
+		snapped = ntfs_volume_snapshot_load(ctx->vol,
+					ctx->snapshot_path);
+		if (snapped < 0)
+			goto err_out;
 	}
+	if (!snapped) {
+		/* only estimate the free clusters of big volumes for now */
+		if (ntfs_cluster_count_free(ctx->vol, TRUE))
+			goto err_out;
 
-	ctx->vol->free_mft_records = ntfs_get_nr_free_mft_records(ctx->vol);
-	if (ctx->vol->free_mft_records < 0) {
-		ntfs_log_perror("Failed to calculate free MFT records");
-		goto err_out;
+		ctx->vol->free_mft_records = ntfs_get_nr_free_mft_records(ctx->vol);
+		if (ctx->vol->free_mft_records < 0) {
+			ntfs_log_perror("Failed to calculate free MFT records");
+			goto err_out;
+		}
 	}
 
 	if (ctx->hiberfile && ntfs_volume_check_hiberfile(ctx->vol, 0)) {
@@ -4430,8 +4652,8 @@ int main(int argc, char *argv[])
 	if (drop_privs())
 		goto err_out;
 #endif	
-	if (stat(opts.device, &sbuf)) {
-		ntfs_log_perror("Failed to access '%s'", opts.device);
+	if (stat(opts.dev_file, &sbuf)) {
+		ntfs_log_perror("Failed to access '%s'", opts.dev_file);
 		err = NTFS_VOLUME_NO_PRIVILEGE;
 		goto err_out;
 	}
@@ -4466,6 +4688,15 @@ int main(int argc, char *argv[])
 	/* We must do this after ntfs_open() to be able to set the blksize */
 	if (ctx->blkdev && set_fuseblk_options(&parsed_options))
 		goto err_out;
+	/* Names not found are remembered by fuse */
+	if (ctx->negative_timeout > 0) {
+		char options[40];
+
+		snprintf(options, sizeof(options), ",negative_timeout=%d",
+				ctx->negative_timeout);
+		if (ntfs_strappend(&parsed_options, options))
+			goto err_out;
+	}
 
 	ctx->vol->abs_mnt_point = ctx->abs_mnt_point;
 	ctx->security.vol = ctx->vol;
@@ -4534,6 +4765,9 @@ int main(int argc, char *argv[])
 	}
 	if (ctx->usermap_path)
 		free (ctx->usermap_path);
+	free(ctx->snapshot_path);
+		/* the operation trace is only recorded by lowntfs-3g */
+	free(ctx->optrace_path);
 
 #if defined(HAVE_SETXATTR) && defined(XATTR_MAPPINGS)
 	xattr_mapping = ntfs_xattr_build_mapping(ctx->vol,
@@ -4569,6 +4803,18 @@ int main(int argc, char *argv[])
 	if (permissions_mode)
 	        ntfs_log_info("%s, configuration type %d\n",permissions_mode,
 			4 + POSIXACLS*6 - KERNELPERMS*3 + CACHEING);
+	/* threads do not survive daemonizing, start them now */
+	if ((ctx->compress_threads > 1)
+	    && ntfs_set_compress_threads(ctx->vol, ctx->compress_threads))
+		ntfs_log_perror("Could not start the compression threads");
+	if (ntfs_cluster_count_start(ctx->vol))
+		ntfs_log_perror("Could not count the free clusters");
+	if (ctx->prefetch_path
+	    && ntfs_prefetch_start(ctx->vol, ctx->prefetch_path))
+		ntfs_log_perror("Could not prefetch from %s",
+				ctx->prefetch_path);
+	free(ctx->prefetch_path);
+	ctx->prefetch_path = (char*)NULL;
 	if ((ctx->vol->secure_flags & (1 << SECURITY_RAW))
 	    && !ctx->uid && ctx->gid)
 		ntfs_log_error("Warning : using problematic uid==0 and gid!=0\n");
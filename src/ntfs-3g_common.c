@@ -44,6 +44,10 @@
 #include <errno.h>
 #endif
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
 #include <getopt.h>
 #include <fuse.h>
 
@@ -53,6 +57,7 @@
 #include "security.h"
 #include "xattrs.h"
 #include "reparse.h"
+#include "compress.h"
 #include "plugin.h"
 #include "ntfs-3g_common.h"
 #include "realpath.h"
@@ -128,6 +133,52 @@ const struct DEFOPTION optionlist[] = {
 	{ "efs_raw", OPT_EFS_RAW, FLGOPT_BOGUS },
 	{ "posix_nlink", OPT_POSIX_NLINK, FLGOPT_BOGUS },
 	{ "special_files", OPT_SPECIAL_FILES, FLGOPT_STRING },
+	{ "uring", OPT_URING, FLGOPT_BOGUS },
+	{ "direct_device_io", OPT_DIRECT_DEVICE_IO, FLGOPT_BOGUS },
+	{ "fast_mount", OPT_FAST_MOUNT, FLGOPT_BOGUS },
+	{ "snapshot", OPT_SNAPSHOT, FLGOPT_STRING },
+	{ "prefetch", OPT_PREFETCH, FLGOPT_STRING },
+	{ "optrace", OPT_OPTRACE, FLGOPT_STRING },
+	{ "block_cache", OPT_BLOCK_CACHE, FLGOPT_DECIMAL },
+	{ "threads", OPT_THREADS, FLGOPT_DECIMAL },
+	{ "splice", OPT_SPLICE, FLGOPT_BOGUS },
+	{ "readdirplus", OPT_READDIRPLUS, FLGOPT_BOGUS },
+	{ "writeback_cache", OPT_WRITEBACK_CACHE, FLGOPT_BOGUS },
+	{ "max_pages", OPT_MAX_PAGES, FLGOPT_DECIMAL },
+	{ "compress_threads", OPT_COMPRESS_THREADS, FLGOPT_DECIMAL },
+	{ "compression_level", OPT_COMPRESSION_LEVEL, FLGOPT_DECIMAL },
+	{ "uncompressed_overwrites", OPT_UNCOMPRESSED_OVERWRITES, FLGOPT_BOGUS },
+	{ "record_cache", OPT_RECORD_CACHE, FLGOPT_DECIMAL },
+	{ "index_cache", OPT_INDEX_CACHE, FLGOPT_DECIMAL },
+	{ "index_writeback", OPT_INDEX_WRITEBACK, FLGOPT_DECIMAL },
+	{ "lazy_delete", OPT_LAZY_DELETE, FLGOPT_DECIMAL },
+	{ "prealloc", OPT_PREALLOC, FLGOPT_DECIMAL },
+	{ "hole_unit", OPT_HOLE_UNIT, FLGOPT_DECIMAL },
+	{ "bitmap_writeback", OPT_BITMAP_WRITEBACK, FLGOPT_DECIMAL },
+	{ "discard", OPT_DISCARD, FLGOPT_BOGUS },
+	{ "inode_writeback", OPT_INODE_WRITEBACK, FLGOPT_DECIMAL },
+	{ "mft_writeback", OPT_MFT_WRITEBACK, FLGOPT_DECIMAL },
+	{ "inode_cache", OPT_INODE_CACHE, FLGOPT_DECIMAL },
+	{ "nidata_cache", OPT_NIDATA_CACHE, FLGOPT_DECIMAL },
+	{ "lookup_cache", OPT_LOOKUP_CACHE, FLGOPT_DECIMAL },
+	{ "securid_cache", OPT_SECURID_CACHE, FLGOPT_DECIMAL },
+	{ "legacy_cache", OPT_LEGACY_CACHE, FLGOPT_DECIMAL },
+	{ "listing_cache", OPT_LISTING_CACHE, FLGOPT_DECIMAL },
+	{ "symlink_cache", OPT_SYMLINK_CACHE, FLGOPT_DECIMAL },
+	{ "ea_cache", OPT_EA_CACHE, FLGOPT_DECIMAL },
+	{ "streams_cache", OPT_STREAMS_CACHE, FLGOPT_DECIMAL },
+	{ "stat_cache", OPT_STAT_CACHE, FLGOPT_DECIMAL },
+	{ "securdesc_cache", OPT_SECURDESC_CACHE, FLGOPT_DECIMAL },
+	{ "inherit_cache", OPT_INHERIT_CACHE, FLGOPT_DECIMAL },
+	{ "sdh_cache", OPT_SDH_CACHE, FLGOPT_DECIMAL },
+	{ "traverse_cache", OPT_TRAVERSE_CACHE, FLGOPT_DECIMAL },
+	{ "groups_cache", OPT_GROUPS_CACHE, FLGOPT_DECIMAL },
+	{ "mem_budget", OPT_MEM_BUDGET, FLGOPT_DECIMAL },
+	{ "negative_timeout", OPT_NEGATIVE_TIMEOUT, FLGOPT_DECIMAL },
+	{ "attr_timeout", OPT_ATTR_TIMEOUT, FLGOPT_DECIMAL },
+	{ "entry_timeout", OPT_ENTRY_TIMEOUT, FLGOPT_DECIMAL },
+	{ "stats", OPT_STATS, FLGOPT_BOGUS },
+	{ "trace", OPT_TRACE, FLGOPT_DECIMAL },
 	{ (const char*)NULL, 0, 0 } /* end marker */
 } ;
 
@@ -244,8 +295,11 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 	int want_permissions = 0;
 	int intarg;
 	const struct DEFOPTION *poptl;
+	int i;
 
 	ctx->secure_flags = 0;
+	for (i=0; i<NTFS_LRU_CACHES; i++)
+		ctx->lru_cache[i] = -1;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 	ctx->efs_raw = FALSE;
 #endif /* HAVE_SETXATTR */
@@ -504,6 +558,162 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 			case OPT_POSIX_NLINK :
 				ctx->posix_nlink = TRUE;
 				break;
+			case OPT_URING :
+				ctx->uring = TRUE;
+				break;
+			case OPT_DIRECT_DEVICE_IO :
+				ctx->direct_device_io = TRUE;
+				break;
+			case OPT_FAST_MOUNT :
+				ctx->fast_mount = TRUE;
+				break;
+			case OPT_STATS :
+				ctx->stats = TRUE;
+				break;
+			case OPT_TRACE :
+				ctx->trace = intarg;
+				break;
+			case OPT_SNAPSHOT :
+				free(ctx->snapshot_path);
+				ctx->snapshot_path = strdup(val);
+				if (!ctx->snapshot_path) {
+					ntfs_log_error("no more memory to store "
+						"'snapshot' option.\n");
+					goto err_exit;
+				}
+				break;
+			case OPT_PREFETCH :
+				free(ctx->prefetch_path);
+				ctx->prefetch_path = strdup(val);
+				if (!ctx->prefetch_path) {
+					ntfs_log_error("no more memory to store "
+						"'prefetch' option.\n");
+					goto err_exit;
+				}
+				break;
+			case OPT_OPTRACE :
+				free(ctx->optrace_path);
+				ctx->optrace_path = strdup(val);
+				if (!ctx->optrace_path) {
+					ntfs_log_error("no more memory to store "
+						"'optrace' option.\n");
+					goto err_exit;
+				}
+				break;
+			case OPT_BLOCK_CACHE :
+				ctx->block_cache = intarg;
+				break;
+			case OPT_THREADS :
+				ctx->threads = intarg;
+				break;
+			case OPT_SPLICE :
+				ctx->splice = TRUE;
+				break;
+			case OPT_READDIRPLUS :
+				ctx->readdirplus = TRUE;
+				break;
+			case OPT_WRITEBACK_CACHE :
+				ctx->writeback_cache = TRUE;
+				break;
+			case OPT_MAX_PAGES :
+				ctx->max_pages = intarg;
+				break;
+			case OPT_COMPRESS_THREADS :
+				ctx->compress_threads = intarg;
+				break;
+			case OPT_COMPRESSION_LEVEL :
+				ctx->compression_level = intarg;
+				break;
+			case OPT_UNCOMPRESSED_OVERWRITES :
+				ctx->uncompressed_overwrites = TRUE;
+				break;
+			case OPT_RECORD_CACHE :
+				ctx->record_cache = intarg;
+				break;
+			case OPT_INDEX_CACHE :
+				ctx->index_cache = intarg;
+				break;
+			case OPT_INDEX_WRITEBACK :
+				ctx->index_writeback = intarg;
+				break;
+			case OPT_LAZY_DELETE :
+				ctx->lazy_delete = intarg;
+				break;
+			case OPT_PREALLOC :
+				ctx->prealloc = intarg;
+				break;
+			case OPT_HOLE_UNIT :
+				ctx->hole_unit = intarg;
+				break;
+			case OPT_BITMAP_WRITEBACK :
+				ctx->bitmap_writeback = intarg;
+				break;
+			case OPT_DISCARD :
+				ctx->discard = TRUE;
+				break;
+			case OPT_INODE_WRITEBACK :
+				ctx->inode_writeback = intarg;
+				break;
+			case OPT_MFT_WRITEBACK :
+				ctx->mft_writeback = intarg;
+				break;
+			case OPT_INODE_CACHE :
+				ctx->lru_cache[NTFS_CACHE_INODE] = intarg;
+				break;
+			case OPT_NIDATA_CACHE :
+				ctx->lru_cache[NTFS_CACHE_NIDATA] = intarg;
+				break;
+			case OPT_LOOKUP_CACHE :
+				ctx->lru_cache[NTFS_CACHE_LOOKUP] = intarg;
+				break;
+			case OPT_SECURID_CACHE :
+				ctx->lru_cache[NTFS_CACHE_SECURID] = intarg;
+				break;
+			case OPT_LEGACY_CACHE :
+				ctx->lru_cache[NTFS_CACHE_LEGACY] = intarg;
+				break;
+			case OPT_LISTING_CACHE :
+				ctx->lru_cache[NTFS_CACHE_LISTING] = intarg;
+				break;
+			case OPT_SYMLINK_CACHE :
+				ctx->lru_cache[NTFS_CACHE_SYMLINK] = intarg;
+				break;
+			case OPT_EA_CACHE :
+				ctx->lru_cache[NTFS_CACHE_EA] = intarg;
+				break;
+			case OPT_STREAMS_CACHE :
+				ctx->lru_cache[NTFS_CACHE_STREAMS] = intarg;
+				break;
+			case OPT_STAT_CACHE :
+				ctx->lru_cache[NTFS_CACHE_STAT] = intarg;
+				break;
+			case OPT_SECURDESC_CACHE :
+				ctx->lru_cache[NTFS_CACHE_SECURDESC] = intarg;
+				break;
+			case OPT_INHERIT_CACHE :
+				ctx->lru_cache[NTFS_CACHE_INHERIT] = intarg;
+				break;
+			case OPT_SDH_CACHE :
+				ctx->lru_cache[NTFS_CACHE_SDH] = intarg;
+				break;
+			case OPT_TRAVERSE_CACHE :
+				ctx->lru_cache[NTFS_CACHE_TRAVERSE] = intarg;
+				break;
+			case OPT_GROUPS_CACHE :
+				ctx->lru_cache[NTFS_CACHE_GROUPS] = intarg;
+				break;
+			case OPT_MEM_BUDGET :
+				ctx->mem_budget = intarg;
+				break;
+			case OPT_NEGATIVE_TIMEOUT :
+				ctx->negative_timeout = intarg;
+				break;
+			case OPT_ATTR_TIMEOUT :
+				ctx->attr_timeout = intarg;
+				break;
+			case OPT_ENTRY_TIMEOUT :
+				ctx->entry_timeout = intarg;
+				break;
 			case OPT_SPECIAL_FILES :
 				if (!strcmp(val, "interix"))
 					ctx->special_files = NTFS_FILES_INTERIX;
@@ -590,6 +800,7 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 			int argc, char *argv[])
 {
 	int c;
+	int prefix;
 
 	static const char *sopt = "-o:hnsvV";
 	static const struct option lopt[] = {
@@ -607,14 +818,22 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 		switch (c) {
 		case 1:	/* A non-option argument */
 			if (!popts->device) {
-				popts->device = ntfs_malloc(PATH_MAX + 1);
+				prefix = 0;
+#ifdef NTFS_DEVICE_MEM_IO_OPS
+				/* keep the prefix of a memory device */
+				prefix = ntfs_device_mem_name(optarg);
+#endif
+				popts->device = ntfs_malloc(PATH_MAX + 1
+							+ prefix);
 				if (!popts->device)
 					return -1;
 				
 				/* Canonicalize device name (mtab, etc) */
 				popts->arg_device = optarg;
-				if (!ntfs_realpath_canonicalize(optarg,
-						popts->device)) {
+				memcpy(popts->device, optarg, prefix);
+				popts->dev_file = &popts->device[prefix];
+				if (!ntfs_realpath_canonicalize(&optarg[prefix],
+						popts->dev_file)) {
 					ntfs_log_perror("%s: Failed to access "
 					     "volume '%s'", EXEC_NAME, optarg);
 					free(popts->device);
@@ -681,32 +900,31 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 
 #ifdef HAVE_SETXATTR
 
-int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
-			char *list, size_t size, BOOL prefixing)
+int ntfs_fuse_listxattr_common(ntfs_inode *ni, char *list, size_t size,
+			BOOL prefixing)
 {
 	int ret = 0;
 	char *to = list;
+	char *names;
+	char *tmp_name;
+	int names_size;
+	int pos;
 #ifdef XATTR_MAPPINGS
 	BOOL accepted;
 	const struct XATTRMAPPING *item;
 #endif /* XATTR_MAPPINGS */
 
 		/* first list the regular user attributes (ADS) */
-	while (!ntfs_attr_lookup(AT_DATA, NULL, 0, CASE_SENSITIVE,
-				0, NULL, 0, actx)) {
-		char *tmp_name = NULL;
+	names_size = ntfs_attr_stream_names(ni, &names);
+	if (names_size < 0) {
+		ret = -errno;
+		goto exit;
+	}
+	for (pos=0; pos<names_size; pos+=strlen(tmp_name)+1) {
 		int tmp_name_len;
 
-		if (!actx->attr->name_length)
-			continue;
-		tmp_name_len = ntfs_ucstombs(
-			(ntfschar *)((u8*)actx->attr +
-				le16_to_cpu(actx->attr->name_offset)),
-			actx->attr->name_length, &tmp_name, 0);
-		if (tmp_name_len < 0) {
-			ret = -errno;
-			goto exit;
-		}
+		tmp_name = &names[pos];
+		tmp_name_len = strlen(tmp_name);
 				/*
 				 * When using name spaces, do not return
 				 * security, trusted or system attributes
@@ -734,13 +952,13 @@ int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
 				*to = 0;
 				to++;
 			} else {
-				free(tmp_name);
+				free(names);
 				ret = -ERANGE;
 				goto exit;
 			}
 		}
-		free(tmp_name);
 	}
+	free(names);
 #ifdef XATTR_MAPPINGS
 		/* now append the system attributes mapped to user space */
 	for (item=ni->vol->xattr_mapping; item; item=item->next) {
@@ -895,6 +1113,78 @@ void close_reparse_plugins(ntfs_fuse_context_t *ctx)
 	}
 }
 
+/*
+ *		Define attributes for a system compressed file
+ *		(internal plugin)
+ *
+ *	These files are only readable, Windows has to be used for
+ *	modifying them, or for decompressing them.
+ */
+
+int wof_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			struct stat *stbuf)
+{
+	s64 size;
+	s64 allocated;
+	int res;
+
+	if (!ntfs_wof_getsize(ni, reparse, &size, &allocated)) {
+		stbuf->st_size = size;
+		stbuf->st_blocks = (allocated + 511) >> 9;
+		stbuf->st_mode = S_IFREG | 0555;
+		res = 0;
+	} else
+		res = -errno;
+	return (res);
+}
+
+/*
+ *		Open a system compressed file for reading
+ *		(internal plugin)
+ *
+ *	The reading context is kept in fi->fh until the file is released.
+ */
+
+int wof_open(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			struct fuse_file_info *fi)
+{
+	struct WOF_FILE *wof;
+	int res;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		res = -EOPNOTSUPP;
+	else {
+		wof = ntfs_wof_open(ni, reparse);
+		if (wof) {
+			fi->fh = (long)wof;
+			res = 0;
+		} else
+			res = -errno;
+	}
+	return (res);
+}
+
+int wof_read(ntfs_inode *ni,
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	s64 res;
+
+	res = ntfs_wof_pread((struct WOF_FILE*)(long)fi->fh, ni,
+				offset, size, buf);
+	return (res < 0 ? -errno : (int)res);
+}
+
+int wof_release(ntfs_inode *ni __attribute__((unused)),
+			const REPARSE_POINT *reparse __attribute__((unused)),
+			struct fuse_file_info *fi)
+{
+	ntfs_wof_close((struct WOF_FILE*)(long)fi->fh);
+	fi->fh = 0;
+	return (0);
+}
+
 #endif /* DISABLE_PLUGINS */
 
 #ifdef HAVE_SETXATTR
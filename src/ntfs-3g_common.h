@@ -24,12 +24,18 @@
 #define _NTFS_3G_COMMON_H
 
 #include "inode.h"
+#include "cache.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01	/* fallocate() mode, as on Linux */
+#endif
 
 struct ntfs_options {
         char    *mnt_point;     /* Mount point */    
         char    *options;       /* Mount options */  
         char    *device;        /* Device to mount */
 	char	*arg_device;	/* Device requested in argv */
+	char	*dev_file;	/* File backing the device */
 } ;
 
 typedef enum {
@@ -94,6 +100,52 @@ enum {
 	OPT_EFS_RAW,
 	OPT_POSIX_NLINK,
 	OPT_SPECIAL_FILES,
+	OPT_URING,
+	OPT_DIRECT_DEVICE_IO,
+	OPT_FAST_MOUNT,
+	OPT_SNAPSHOT,
+	OPT_BLOCK_CACHE,
+	OPT_THREADS,
+	OPT_SPLICE,
+	OPT_READDIRPLUS,
+	OPT_WRITEBACK_CACHE,
+	OPT_MAX_PAGES,
+	OPT_COMPRESS_THREADS,
+	OPT_COMPRESSION_LEVEL,
+	OPT_UNCOMPRESSED_OVERWRITES,
+	OPT_RECORD_CACHE,
+	OPT_INDEX_CACHE,
+	OPT_INDEX_WRITEBACK,
+	OPT_LAZY_DELETE,
+	OPT_PREALLOC,
+	OPT_HOLE_UNIT,
+	OPT_BITMAP_WRITEBACK,
+	OPT_DISCARD,
+	OPT_INODE_WRITEBACK,
+	OPT_MFT_WRITEBACK,
+	OPT_INODE_CACHE,
+	OPT_NIDATA_CACHE,
+	OPT_LOOKUP_CACHE,
+	OPT_SECURID_CACHE,
+	OPT_LEGACY_CACHE,
+	OPT_LISTING_CACHE,
+	OPT_SYMLINK_CACHE,
+	OPT_EA_CACHE,
+	OPT_STREAMS_CACHE,
+	OPT_STAT_CACHE,
+	OPT_SECURDESC_CACHE,
+	OPT_INHERIT_CACHE,
+	OPT_SDH_CACHE,
+	OPT_TRAVERSE_CACHE,
+	OPT_GROUPS_CACHE,
+	OPT_MEM_BUDGET,
+	OPT_PREFETCH,
+	OPT_NEGATIVE_TIMEOUT,
+	OPT_ATTR_TIMEOUT,
+	OPT_ENTRY_TIMEOUT,
+	OPT_STATS,
+	OPT_TRACE,
+	OPT_OPTRACE,
 } ;
 
 			/* Option flags */
@@ -156,6 +208,38 @@ typedef struct {
 	BOOL blkdev;
 	BOOL mounted;
 	BOOL posix_nlink;
+	BOOL uring;
+	BOOL direct_device_io;
+	BOOL fast_mount;
+	char *snapshot_path;	/* sidecar file for mount-time metadata */
+	char *prefetch_path;	/* sidecar file for the ranges prefetched */
+	char *optrace_path;	/* file recording the requests */
+	int block_cache;	/* size of block cache in MB, or 0 */
+	int record_cache;	/* size of mft record cache in MB, or 0 */
+	int index_cache;	/* size of index block cache in MB, or 0 */
+	int index_writeback;	/* size of delayed index blocks in MB, or 0 */
+	int lazy_delete;	/* number of entries removed lazily, or 0 */
+	int prealloc;		/* max MB preallocated when appending, or 0 */
+	int hole_unit;		/* KB allocated at once in holes, or 0 */
+	int bitmap_writeback;	/* size of delayed $Bitmap pages in MB, or 0 */
+	BOOL discard;		/* discard the freed clusters */
+	int inode_writeback;	/* number of delayed inodes, or 0 */
+	int mft_writeback;	/* number of delayed mft records, or 0 */
+	int lru_cache[NTFS_LRU_CACHES]; /* entries in caches, -1 for default */
+	int mem_budget;		/* MB the caches may use, or 0 */
+	int negative_timeout;	/* seconds names not found are cached */
+	int attr_timeout;	/* seconds attributes are cached, or 0 */
+	int entry_timeout;	/* seconds names found are cached, or 0 */
+	int threads;		/* number of threads serving requests */
+	BOOL splice;
+	BOOL readdirplus;
+	BOOL writeback_cache;
+	int max_pages;		/* max pages in a request, 0 for default */
+	int compress_threads;	/* threads (de)compressing big blocks */
+	int compression_level;	/* NTFS_COMPRESS_*, or 0 for default */
+	BOOL uncompressed_overwrites;
+	BOOL stats;		/* keep the performance counters */
+	int trace;		/* device transfers traced, or 0 */
 	ntfs_volume_special_files special_files;
 #ifdef HAVE_SETXATTR	/* extended attributes interface required */
 	BOOL efs_raw;
@@ -174,7 +258,6 @@ typedef struct {
 #endif /* DISABLE_PLUGINS */
 	struct PERMISSIONS_CACHE *seccache;
 	struct SECURITY_CONTEXT security;
-	struct open_file *open_files; /* only defined in lowntfs-3g */
 	u64 latest_ghost;
 } ntfs_fuse_context_t;
 
@@ -204,8 +287,8 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 			int argc, char *argv[]);
 
-int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
- 			char *list, size_t size, BOOL prefixing);
+int ntfs_fuse_listxattr_common(ntfs_inode *ni, char *list, size_t size,
+			BOOL prefixing);
 BOOL user_xattrs_allowed(ntfs_fuse_context_t *ctx, ntfs_inode *ni);
 
 #ifndef DISABLE_PLUGINS
@@ -216,6 +299,16 @@ const struct plugin_operations *select_reparse_plugin(ntfs_fuse_context_t *ctx,
 int register_reparse_plugin(ntfs_fuse_context_t *ctx, le32 tag,
                                 const plugin_operations_t *ops, void *handle);
 
+int wof_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			struct stat *stbuf);
+int wof_open(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			struct fuse_file_info *fi);
+int wof_read(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi);
+int wof_release(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			struct fuse_file_info *fi);
+
 #endif /* DISABLE_PLUGINS */
 
 #endif /* _NTFS_3G_COMMON_H */
@@ -28,6 +28,8 @@
 #include "unistr.h"
 #include "logging.h"
 #include "dir.h"
+#include "blkcache.h"
+#include "compress.h"
 
 #include "uefi_driver.h"
 #include "uefi_bridge.h"
@@ -277,6 +279,178 @@ NtfsSetLogger(UINTN Level)
 	ntfs_log_set_levels(levels);
 }
 
+/* Global policy for updating the access time on reads */
+static UINTN AtimePolicy = FS_ATIME_RELATIVE;
+
+/*
+ * You can control the update of the access time of the files being read
+ * by setting the shell environment variable FS_ATIME to one of the values
+ * defined in the FS_ATIME constants. By default, the access time is only
+ * updated when it is older than the last modification, so that reading
+ * files does not lead to writing their MFT records over and over.
+ */
+VOID
+NtfsSetAtimePolicy(VOID)
+{
+	EFI_GUID ShellVariable = SHELL_VARIABLE_GUID;
+	EFI_STATUS Status;
+	CHAR16 AtimeVar[4] = { 0 };
+	UINTN AtimeVarSize = sizeof(AtimeVar);
+
+	Status = gRT->GetVariable(L"FS_ATIME", &ShellVariable, NULL, &AtimeVarSize, AtimeVar);
+	/* The variable should only ever be a single decimal digit */
+	if ((Status == EFI_SUCCESS) && (AtimeVar[1] == 0) &&
+		(AtimeVar[0] >= L'0') && (AtimeVar[0] <= L'0' + FS_ATIME_ENABLED))
+		AtimePolicy = AtimeVar[0] - L'0';
+
+	PrintExtra(L"AtimePolicy = %d\n", AtimePolicy);
+}
+
+/* Application processors decompressing the compressed files with ours */
+static struct NTFS_PROCESSORS Processors = { 0 };
+#ifndef __MAKEWITH_GNUEFI
+static EFI_MP_SERVICES_PROTOCOL* MpServices = NULL;
+static EFI_EVENT MpEvent = NULL;
+
+/* The calls of a procedure to spread over the processors */
+typedef struct {
+	void (*Proc)(void* Arg, int Index);
+	VOID* Arg;
+	UINT32 Count;
+	volatile UINT32 Next;
+} NTFS_PROCESSOR_WORK;
+
+/*
+ * Make the calls not yet claimed by another processor. This runs on the
+ * application processors, which must not call any service.
+ */
+static VOID EFIAPI
+NtfsProcessorWork(VOID* Buffer)
+{
+	NTFS_PROCESSOR_WORK* Work = (NTFS_PROCESSOR_WORK*)Buffer;
+	UINT32 Index;
+
+	while ((Index = InterlockedIncrement(&Work->Next) - 1) < Work->Count)
+		Work->Proc(Work->Arg, (int)Index);
+}
+
+/*
+ * Spread the calls over the application processors and ours, and return
+ * when all of them are done. Non blocking requests are not accepted after
+ * the platform is ready to boot, in which case our processor only gets
+ * the calls which could not be dispatched.
+ */
+static void
+NtfsRunProcessors(void* data, void (*proc)(void* arg, int index),
+	void* arg, int n)
+{
+	NTFS_PROCESSOR_WORK Work = { proc, arg, (UINT32)n, 0 };
+	EFI_STATUS Status = EFI_NOT_STARTED;
+
+	if (MpEvent != NULL) {
+		Status = MpServices->StartupAllAPs(MpServices, NtfsProcessorWork,
+			FALSE, MpEvent, 0, &Work, NULL);
+		if (Status == EFI_UNSUPPORTED) {
+			gBS->CloseEvent(MpEvent);
+			MpEvent = NULL;
+		}
+	}
+	if (MpEvent == NULL)
+		Status = MpServices->StartupAllAPs(MpServices, NtfsProcessorWork,
+			FALSE, NULL, 0, &Work, NULL);
+	NtfsProcessorWork(&Work);
+	if ((MpEvent != NULL) && (Status == EFI_SUCCESS)) {
+		while (gBS->CheckEvent(MpEvent) == EFI_NOT_READY)
+			CpuPause();
+	}
+}
+#endif /* __MAKEWITH_GNUEFI */
+
+/*
+ * The compression blocks of the compressed files are decompressed by the
+ * application processors along with ours, when the firmware provides the
+ * MP Services protocol. You can limit the count of processors used, ours
+ * included, by setting the shell environment variable FS_PROCESSORS to a
+ * decimal number, 0 or 1 meaning that only ours is used.
+ */
+VOID
+NtfsSetProcessors(VOID)
+{
+#ifndef __MAKEWITH_GNUEFI
+	EFI_GUID ShellVariable = SHELL_VARIABLE_GUID;
+	EFI_STATUS Status;
+	CHAR16 ProcVar[4] = { 0 };
+	UINTN ProcVarSize = sizeof(ProcVar);
+	UINTN Count, Enabled, Limit, i;
+
+	Status = gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL,
+		(VOID**)&MpServices);
+	if (EFI_ERROR(Status))
+		return;
+	Status = MpServices->GetNumberOfProcessors(MpServices, &Count, &Enabled);
+	if (EFI_ERROR(Status))
+		return;
+
+	Status = gRT->GetVariable(L"FS_PROCESSORS", &ShellVariable, NULL,
+		&ProcVarSize, ProcVar);
+	if (Status == EFI_SUCCESS) {
+		for (i = 0, Limit = 0; (i < ARRAY_SIZE(ProcVar)) &&
+			(ProcVar[i] >= L'0') && (ProcVar[i] <= L'9'); i++)
+			Limit = 10 * Limit + ProcVar[i] - L'0';
+		if ((i > 0) && (Enabled > Limit))
+			Enabled = Limit;
+	}
+	if (Enabled < 2)
+		return;
+
+	if (gBS->CreateEvent(0, 0, NULL, NULL, &MpEvent) != EFI_SUCCESS)
+		MpEvent = NULL;
+	Processors.count = (int)Enabled;
+	Processors.run = NtfsRunProcessors;
+#endif /* __MAKEWITH_GNUEFI */
+
+	PrintExtra(L"Processors = %d\n", Processors.count);
+}
+
+/*
+ * Release the event used to wait for the application processors
+ */
+VOID
+NtfsFreeProcessors(VOID)
+{
+#ifndef __MAKEWITH_GNUEFI
+	if (MpEvent != NULL)
+		gBS->CloseEvent(MpEvent);
+	MpEvent = NULL;
+#endif
+	Processors.count = 0;
+}
+
+/*
+ * Release the memory kept by the allocator for the next allocations
+ */
+VOID
+NtfsReleaseMemory(VOID)
+{
+	malloc_trim(0);
+}
+
+/*
+ * Update the times of an inode, applying the access time policy
+ */
+static VOID
+NtfsUpdateTimes(ntfs_inode* ni, ntfs_time_update_flags mask)
+{
+	if (AtimePolicy == FS_ATIME_DISABLED)
+		mask &= ~NTFS_UPDATE_ATIME;
+	else if (AtimePolicy == FS_ATIME_RELATIVE && mask == NTFS_UPDATE_ATIME &&
+		(sle64_to_cpu(ni->last_access_time) >= sle64_to_cpu(ni->last_data_change_time)) &&
+		(sle64_to_cpu(ni->last_access_time) >= sle64_to_cpu(ni->last_mft_change_time)))
+		return;
+	if (mask)
+		ntfs_inode_update_times(ni, mask);
+}
+
 BOOLEAN
 NtfsIsVolumeReadOnly(VOID* NtfsVolume)
 {
@@ -300,13 +474,36 @@ NtfsIsVolumeReadOnly(VOID* NtfsVolume)
  * for, and perform look up to prevent double inode open.
  */
 
-/* A file lookup entry */
+/*
+ * A file lookup entry, linked in the list of all the entries, and in
+ * the hash tables by path and by inode number, so that lookups do not
+ * have to scan all the open files.
+ */
 typedef struct {
 	LIST_ENTRY* ForwardLink;
 	LIST_ENTRY* BackLink;
+	LIST_ENTRY PathLink;
+	LIST_ENTRY InumLink;
 	EFI_NTFS_FILE* File;
+	UINT64 Inum;
 } LookupEntry;
 
+/*
+ * Get the bucket of a path in the path hash table (FNV-1a).
+ * An empty path designates the root.
+ */
+static UINTN
+NtfsLookupPathHash(CONST CHAR16* Path)
+{
+	UINT32 Hash = 2166136261U;
+
+	if (Path[0] == 0)
+		Hash = (Hash ^ PATH_CHAR) * 16777619U;
+	for (; *Path != 0; Path++)
+		Hash = (Hash ^ *Path) * 16777619U;
+	return Hash % LOOKUP_HASH_SIZE;
+}
+
 /*
  * Look for an existing file instance in our list, either
  * by matching a File->Path (if Inum is 0) or the inode
@@ -320,15 +517,14 @@ typedef struct {
 static EFI_NTFS_FILE*
 NtfsLookup(EFI_NTFS_FILE* File, UINT64 Inum, BOOLEAN IgnoreSelf)
 {
-	LookupEntry* ListHead = (LookupEntry*)&File->FileSystem->LookupListHead;
+	LIST_ENTRY *Head, *Link;
 	LookupEntry* Entry;
-	ntfs_inode* ni;
 
-	for (Entry = (LookupEntry*)ListHead->ForwardLink;
-		Entry != ListHead;
-		Entry = (LookupEntry*)Entry->ForwardLink) {
-		FS_ASSERT(Entry->File->NtfsInode != NULL);
-		if (Inum == 0) {
+	if (Inum == 0) {
+		Head = &File->FileSystem->LookupPathHash[NtfsLookupPathHash(File->Path)];
+		for (Link = Head->ForwardLink; Link != Head; Link = Link->ForwardLink) {
+			Entry = BASE_CR(Link, LookupEntry, PathLink);
+			FS_ASSERT(Entry->File->NtfsInode != NULL);
 			/* If IgnoreSelf is active, prevent param from matching */
 			if (IgnoreSelf && Entry->File == File)
 				continue;
@@ -337,9 +533,14 @@ NtfsLookup(EFI_NTFS_FILE* File, UINT64 Inum, BOOLEAN IgnoreSelf)
 				return Entry->File;
 			if (StrCmp(File->Path, Entry->File->Path) == 0)
 				return Entry->File;
-		} else {
-			ni = Entry->File->NtfsInode;
-			if (ni->mft_no == GetInodeNumber(Inum))
+		}
+	} else {
+		Inum = GetInodeNumber(Inum);
+		Head = &File->FileSystem->LookupInumHash[Inum % LOOKUP_HASH_SIZE];
+		for (Link = Head->ForwardLink; Link != Head; Link = Link->ForwardLink) {
+			Entry = BASE_CR(Link, LookupEntry, InumLink);
+			FS_ASSERT(Entry->File->NtfsInode != NULL);
+			if (Entry->Inum == Inum)
 				return Entry->File;
 		}
 	}
@@ -372,12 +573,18 @@ NtfsLookupParent(EFI_NTFS_FILE* File)
 static VOID
 NtfsLookupAdd(EFI_NTFS_FILE* File)
 {
-	LIST_ENTRY* ListHead = &File->FileSystem->LookupListHead;
+	EFI_FS* FileSystem = File->FileSystem;
 	LookupEntry* Entry = AllocatePool(sizeof(LookupEntry));
 
 	if (Entry) {
 		Entry->File = File;
-		InsertTailList(ListHead, (LIST_ENTRY*)Entry);
+		Entry->Inum = ((ntfs_inode*)File->NtfsInode)->mft_no;
+		InsertTailList(&FileSystem->LookupListHead, (LIST_ENTRY*)Entry);
+		InsertTailList(&FileSystem->LookupPathHash[NtfsLookupPathHash(File->Path)],
+			&Entry->PathLink);
+		InsertTailList(&FileSystem->LookupInumHash[Entry->Inum % LOOKUP_HASH_SIZE],
+			&Entry->InumLink);
+		File->LookupEntry = Entry;
 	}
 }
 
@@ -387,17 +594,29 @@ NtfsLookupAdd(EFI_NTFS_FILE* File)
 static VOID
 NtfsLookupRem(EFI_NTFS_FILE* File)
 {
-	LookupEntry* ListHead = (LookupEntry*)&File->FileSystem->LookupListHead;
-	LookupEntry* Entry;
+	LookupEntry* Entry = (LookupEntry*)File->LookupEntry;
 
-	for (Entry = (LookupEntry*)ListHead->ForwardLink;
-		Entry != ListHead;
-		Entry = (LookupEntry*)Entry->ForwardLink) {
-		if (File == Entry->File) {
-			RemoveEntryList((LIST_ENTRY*)Entry);
-			FreePool(Entry);
-			return;
-		}
+	if (Entry != NULL) {
+		RemoveEntryList((LIST_ENTRY*)Entry);
+		RemoveEntryList(&Entry->PathLink);
+		RemoveEntryList(&Entry->InumLink);
+		FreePool(Entry);
+		File->LookupEntry = NULL;
+	}
+}
+
+/*
+ * Update the path hash of a file instance whose path has changed
+ */
+static VOID
+NtfsLookupRename(EFI_NTFS_FILE* File)
+{
+	LookupEntry* Entry = (LookupEntry*)File->LookupEntry;
+
+	if (Entry != NULL) {
+		RemoveEntryList(&Entry->PathLink);
+		InsertTailList(&File->FileSystem->LookupPathHash[NtfsLookupPathHash(File->Path)],
+			&Entry->PathLink);
 	}
 }
 
@@ -405,16 +624,19 @@ NtfsLookupRem(EFI_NTFS_FILE* File)
  * Clear the lookup list and free all allocated resources
  */
 static VOID
-NtfsLookupFree(LIST_ENTRY* List)
+NtfsLookupFree(EFI_FS* FileSystem)
 {
-	LookupEntry *ListHead = (LookupEntry*)List, *Entry;
+	LookupEntry *ListHead = (LookupEntry*)&FileSystem->LookupListHead, *Entry;
+	INTN i;
 
-	for (Entry = (LookupEntry*)ListHead->ForwardLink;
-		Entry != ListHead;
-		Entry = (LookupEntry*)Entry->ForwardLink) {
+	while ((Entry = (LookupEntry*)ListHead->ForwardLink) != ListHead) {
 		RemoveEntryList((LIST_ENTRY*)Entry);
 		FreePool(Entry);
 	}
+	for (i = 0; i < LOOKUP_HASH_SIZE; i++) {
+		InitializeListHead(&FileSystem->LookupPathHash[i]);
+		InitializeListHead(&FileSystem->LookupInumHash[i]);
+	}
 }
 
 /*
@@ -480,6 +702,38 @@ NtfsOpenInodeFromPath(EFI_FS* FileSystem, CONST CHAR16* Path)
 	return ni;
 }
 
+/*
+ * Share the memory allowed for the block caches among the mounted
+ * volumes, plus Extra volumes about to be mounted, and return the
+ * share of each volume. The caches of the volumes already mounted
+ * are resized to their new share.
+ */
+static s64
+NtfsShareBlockCaches(INTN Extra)
+{
+	EFI_FS* FileSystem;
+	INTN Count = Extra;
+	s64 Share;
+
+	for (FileSystem = (EFI_FS*)FsListHead.ForwardLink;
+		FileSystem != (EFI_FS*)&FsListHead;
+		FileSystem = (EFI_FS*)FileSystem->ForwardLink) {
+		if (FileSystem->NtfsVolume != NULL)
+			Count++;
+	}
+	Share = (Count > 0) ? BLOCK_CACHE_UEFI_SIZE / Count : BLOCK_CACHE_UEFI_SIZE;
+	if (Share < BLOCK_CACHE_UEFI_MIN)
+		Share = BLOCK_CACHE_UEFI_MIN;
+	for (FileSystem = (EFI_FS*)FsListHead.ForwardLink;
+		FileSystem != (EFI_FS*)&FsListHead;
+		FileSystem = (EFI_FS*)FileSystem->ForwardLink) {
+		if (FileSystem->NtfsVolume != NULL &&
+			((ntfs_volume*)FileSystem->NtfsVolume)->dev->d_cache != NULL)
+			ntfs_resize_block_cache(FileSystem->NtfsVolume, Share);
+	}
+	return Share;
+}
+
 /*
  * Mount an NTFS volume an initilize the related attributes
  */
@@ -490,6 +744,7 @@ NtfsMountVolume(EFI_FS* FileSystem)
 	ntfs_volume* vol = NULL;
 	ntfs_mount_flags flags = NTFS_MNT_EXCLUSIVE | NTFS_MNT_IGNORE_HIBERFILE | NTFS_MNT_MAY_RDONLY;
 	char* device = NULL;
+	INTN i;
 
 	/* Don't double mount a volume */
 	if (FileSystem->MountCount++ > 0)
@@ -505,8 +760,12 @@ NtfsMountVolume(EFI_FS* FileSystem)
 	/* Insert this filesystem in our list so that ntfs_mount() can locate it */
 	InsertTailList(&FsListHead, (LIST_ENTRY*)FileSystem);
 
-	/* Initialize the Lookup List for this volume */
+	/* Initialize the Lookup List and tables for this volume */
 	InitializeListHead(&FileSystem->LookupListHead);
+	for (i = 0; i < LOOKUP_HASH_SIZE; i++) {
+		InitializeListHead(&FileSystem->LookupPathHash[i]);
+		InitializeListHead(&FileSystem->LookupInumHash[i]);
+	}
 
 	ntfs_log_set_handler(ntfs_log_handler_uefi);
 
@@ -541,8 +800,26 @@ NtfsMountVolume(EFI_FS* FileSystem)
 	/* Store the serial to detect media change/removal */
 	FileSystem->NtfsVolumeSerial = vol->vol_serial;
 
-	/* Population of free space must be done manually */
-	ntfs_volume_get_free_space(vol);
+	/*
+	 * There is no cache of the device below us, so provide our own,
+	 * within the memory allowed for the caches of all the volumes
+	 */
+	if (ntfs_create_block_cache(vol, NtfsShareBlockCaches(1)) < 0)
+		PrintWarning(L"Could not create block cache: %a\n", strerror(errno));
+
+	/* Memory is scarce, keep the runlists of big attributes compact */
+	ntfs_set_compact_runlists(vol, TRUE);
+
+	/* Decompress on all the processors we were given */
+	if ((Processors.count > 1) &&
+		(ntfs_set_compress_processors(vol, &Processors) < 0))
+		PrintWarning(L"Could not use the processors: %a\n", strerror(errno));
+
+	/*
+	 * Counting the free space reads the whole bitmaps, so leave it
+	 * to the first query, the counts being maintained from then on
+	 */
+	NVolSetFreeSpaceUncounted(vol);
 	FileSystem->NtfsVolume = vol;
 	ntfs_mbstoucs(vol->vol_name, &FileSystem->NtfsVolumeLabel);
 	PrintInfo(L"Mounted volume '%s'\n", FileSystem->NtfsVolumeLabel);
@@ -559,13 +836,17 @@ NtfsUnmountVolume(EFI_FS* FileSystem)
 	ntfs_umount(FileSystem->NtfsVolume, FALSE);
 
 	PrintInfo(L"Unmounted volume '%s'\n", FileSystem->NtfsVolumeLabel);
-	NtfsLookupFree(&FileSystem->LookupListHead);
+	NtfsLookupFree(FileSystem);
 	free(FileSystem->NtfsVolumeLabel);
 	FileSystem->NtfsVolumeLabel = NULL;
 	FileSystem->MountCount = 0;
 	FileSystem->TotalRefCount = 0;
 
 	RemoveEntryList((LIST_ENTRY*)FileSystem);
+	FileSystem->NtfsVolume = NULL;
+
+	/* Let the other volumes use the memory released */
+	NtfsShareBlockCaches(0);
 
 	return EFI_SUCCESS;
 }
@@ -578,7 +859,8 @@ NtfsGetVolumeFreeSpace(VOID* NtfsVolume)
 {
 	ntfs_volume* vol = (ntfs_volume*)NtfsVolume;
 
-	ntfs_volume_get_free_space(vol);
+	if (NVolFreeSpaceUncounted(vol) && ntfs_volume_get_free_space(vol))
+		return 0;
 
 	return vol->free_clusters * vol->cluster_size;
 }
@@ -619,6 +901,56 @@ NtfsAllocateFile(EFI_NTFS_FILE** File, EFI_FS* FileSystem)
 	return EFI_SUCCESS;
 }
 
+/*
+ * Data of a file read ahead, when the file is read sequentially. The
+ * next chunk is read asynchronously through DiskIo2 into the buffer,
+ * while the caller processes the current one. It is only used if no
+ * write was made through the block cache meanwhile.
+ */
+typedef struct {
+	EFI_DISK_IO2_TOKEN Token;
+	BOOLEAN Pending;	/* the read has not been waited for */
+	UINT8* Buffer;		/* READ_AHEAD_SIZE bytes */
+	INT64 Offset;		/* offset in file of the data read ahead */
+	INT64 Length;		/* size of the data read ahead */
+	INT64 Next;		/* offset of the next sequential read */
+	unsigned long Changes;	/* changes of the cache when read */
+} READ_AHEAD;
+
+/*
+ * Wait for the completion of the read ahead, if any
+ */
+static VOID
+NtfsWaitReadAhead(READ_AHEAD* Ra)
+{
+	if (Ra->Pending) {
+		while (gBS->CheckEvent(Ra->Token.Event) == EFI_NOT_READY)
+			;
+		if (EFI_ERROR(Ra->Token.TransactionStatus))
+			Ra->Length = 0;
+		Ra->Pending = FALSE;
+	}
+}
+
+/*
+ * Release the read ahead of a file, once the read in progress is done
+ */
+static VOID
+NtfsReleaseReadAhead(EFI_NTFS_FILE* File)
+{
+	READ_AHEAD* Ra = (READ_AHEAD*)File->ReadAhead;
+
+	if (Ra == NULL)
+		return;
+	NtfsWaitReadAhead(Ra);
+	if (Ra->Token.Event != NULL)
+		gBS->CloseEvent(Ra->Token.Event);
+	if (Ra->Buffer != NULL)
+		FreePool(Ra->Buffer);
+	FreePool(Ra);
+	File->ReadAhead = NULL;
+}
+
 /*
  * Free an allocated EFI_NTFS_FILE data structure
  */
@@ -629,11 +961,58 @@ NtfsFreeFile(EFI_NTFS_FILE* File)
 		return;
 	/* Only destroy a file that has no refs */
 	if (File->RefCount <= 0) {
+		if (File->DirCursor != NULL)
+			FreePool(File->DirCursor);
+		NtfsReleaseReadAhead(File);
+		if (File->InfoCache != NULL)
+			FreePool(File->InfoCache);
 		FreePool(File->Path);
 		FreePool(File);
 	}
 }
 
+/*
+ * Get the data attribute of a file, which is kept open for the lifetime
+ * of the file instance, so that its runlist is not mapped again on each
+ * read or write. As there is no write-back cache above us, the small
+ * appends are gathered by the library.
+ */
+static ntfs_attr*
+NtfsGetDataAttr(EFI_NTFS_FILE* File)
+{
+	if (File->NtfsAttr == NULL) {
+		File->NtfsAttr = ntfs_attr_open(File->NtfsInode, AT_DATA, AT_UNNAMED, 0);
+		if (File->NtfsAttr != NULL)
+			ntfs_attr_set_append_buffer(File->NtfsAttr, 0);
+	}
+	return File->NtfsAttr;
+}
+
+/*
+ * Write the appends gathered for a file, which have to be accounted
+ * for in its size before it is used.
+ */
+static int
+NtfsFlushAppends(EFI_NTFS_FILE* File)
+{
+	if (File == NULL || File->NtfsAttr == NULL)
+		return 0;
+	return ntfs_attr_flush_append(File->NtfsAttr);
+}
+
+/*
+ * Close the data attribute of a file. This must be done before the inode
+ * is closed, and when the attribute is changed behind its back.
+ */
+static VOID
+NtfsReleaseDataAttr(EFI_NTFS_FILE* File)
+{
+	if (File->NtfsAttr != NULL) {
+		ntfs_attr_close(File->NtfsAttr);
+		File->NtfsAttr = NULL;
+	}
+}
+
 /*
  * Open or reopen a file instance
  */
@@ -677,6 +1056,9 @@ NtfsCloseFile(EFI_NTFS_FILE* File)
 
 	if (File == NULL || File->NtfsInode == NULL)
 		return;
+	/* Writing the gathered appends makes the inode dirty */
+	if (NtfsFlushAppends(File))
+		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
 	/*
 	 * If the inode is dirty, ntfs_inode_close() will issue an
 	 * ntfs_inode_sync() which may try to open the parent inode.
@@ -693,6 +1075,7 @@ NtfsCloseFile(EFI_NTFS_FILE* File)
 			ntfs_inode_close(Parent->NtfsInode);
 		}
 	}
+	NtfsReleaseDataAttr(File);
 	ntfs_inode_close(File->NtfsInode);
 	if (Parent != NULL) {
 		Parent->NtfsInode = ntfs_inode_open(File->FileSystem->NtfsVolume, parent_inum);
@@ -713,7 +1096,7 @@ NtfsReadDirectory(EFI_NTFS_FILE* File, NTFS_DIRHOOK Hook, VOID* HookData)
 	if (File->DirPos == -1)
 		return EFI_END_OF_FILE;
 
-	if (ntfs_readdir(File->NtfsInode, &File->DirPos, HookData, Hook)) {
+	if (ntfs_readdir_fn(File->NtfsInode, &File->DirPos, HookData, Hook)) {
 		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
 		return ErrnoToEfiStatus();
 	}
@@ -721,6 +1104,109 @@ NtfsReadDirectory(EFI_NTFS_FILE* File, NTFS_DIRHOOK Hook, VOID* HookData)
 	return EFI_SUCCESS;
 }
 
+/*
+ * Copy the data read ahead at the current offset of a file, and
+ * return the count of bytes copied
+ */
+static s64
+NtfsUseReadAhead(EFI_NTFS_FILE* File, ntfs_attr* na, UINT8* Data, s64 Size)
+{
+	READ_AHEAD* Ra = (READ_AHEAD*)File->ReadAhead;
+	struct ntfs_device* dev = na->ni->vol->dev;
+	s64 n;
+
+	if (Ra == NULL || Ra->Length == 0 || File->Offset < Ra->Offset
+		|| File->Offset >= Ra->Offset + Ra->Length)
+		return 0;
+	NtfsWaitReadAhead(Ra);
+	/* Obsolete if anything was written meanwhile */
+	if (dev->d_cache == NULL || Ra->Changes != dev->d_cache->changes)
+		Ra->Length = 0;
+	n = Ra->Offset + Ra->Length - File->Offset;
+	if (n <= 0)
+		return 0;
+	if (n > Size)
+		n = Size;
+	CopyMem(Data, &Ra->Buffer[File->Offset - Ra->Offset], (UINTN)n);
+	return n;
+}
+
+/*
+ * Start reading ahead the data which follows a sequential read, up to
+ * the end of the run. Only plain data attributes are read ahead, as
+ * the data is taken from the device as is.
+ */
+static VOID
+NtfsStartReadAhead(EFI_NTFS_FILE* File, ntfs_attr* na, s64 Start)
+{
+	EFI_FS* FileSystem = File->FileSystem;
+	ntfs_volume* vol = na->ni->vol;
+	READ_AHEAD* Ra = (READ_AHEAD*)File->ReadAhead;
+	runlist_element* rl;
+	EFI_STATUS Status;
+	VCN vcn;
+	s64 pos, end;
+
+	if (FileSystem->DiskIo2 == NULL || vol->dev->d_cache == NULL
+		|| !NAttrNonResident(na)
+		|| (na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED)))
+		return;
+	if (Ra == NULL) {
+		Ra = AllocateZeroPool(sizeof(READ_AHEAD));
+		if (Ra == NULL)
+			return;
+		File->ReadAhead = Ra;
+	}
+	/* The read is sequential when it starts where the previous one ended */
+	if (Start != Ra->Next) {
+		Ra->Next = File->Offset;
+		return;
+	}
+	Ra->Next = File->Offset;
+	/* Not again while enough data is still ahead */
+	if (Ra->Length != 0 && File->Offset >= Ra->Offset
+		&& Ra->Offset + Ra->Length - File->Offset >= READ_AHEAD_SIZE / 2)
+		return;
+	if (Ra->Buffer == NULL) {
+		Ra->Buffer = AllocatePool(READ_AHEAD_SIZE);
+		if (Ra->Buffer == NULL)
+			return;
+	}
+	if (Ra->Token.Event == NULL && EFI_ERROR(gBS->CreateEvent(0,
+			TPL_CALLBACK, NULL, NULL, &Ra->Token.Event))) {
+		Ra->Token.Event = NULL;
+		return;
+	}
+	NtfsWaitReadAhead(Ra);
+	Ra->Length = 0;
+
+	/* Locate the data on the device, up to the end of the run */
+	end = min(File->Offset + READ_AHEAD_SIZE, na->initialized_size);
+	if (File->Offset >= end)
+		return;
+	vcn = File->Offset >> vol->cluster_size_bits;
+	rl = ntfs_attr_find_vcn(na, vcn);
+	if (rl == NULL || rl->lcn < 0)
+		return;
+	end = min(end, (rl->vcn + rl->length) << vol->cluster_size_bits);
+	pos = ((rl->lcn + vcn - rl->vcn) << vol->cluster_size_bits)
+		+ (File->Offset & (vol->cluster_size - 1));
+	/* The cached data would be more recent */
+	if (ntfs_block_cache_dirty(vol->dev, pos, end - File->Offset))
+		return;
+
+	Ra->Token.TransactionStatus = EFI_NOT_READY;
+	Status = FileSystem->DiskIo2->ReadDiskEx(FileSystem->DiskIo2,
+		FileSystem->BlockIo->Media->MediaId, pos, &Ra->Token,
+		(UINTN)(end - File->Offset), Ra->Buffer);
+	if (EFI_ERROR(Status))
+		return;
+	Ra->Pending = TRUE;
+	Ra->Offset = File->Offset;
+	Ra->Length = end - File->Offset;
+	Ra->Changes = vol->dev->d_cache->changes;
+}
+
 /*
  * Read from an open file into a data buffer
  */
@@ -728,12 +1214,13 @@ EFI_STATUS
 NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 {
 	ntfs_attr* na = NULL;
-	s64 max_read, size = *Len;
+	s64 max_read, n, start, size = *Len;
 
 	*Len = 0;
+	start = File->Offset;
 
-	na = ntfs_attr_open(File->NtfsInode, AT_DATA, AT_UNNAMED, 0);
-	if (!na) {
+	na = NtfsGetDataAttr(File);
+	if (!na || NtfsFlushAppends(File)) {
 		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
 		return ErrnoToEfiStatus();
 	}
@@ -742,12 +1229,16 @@ NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 	if (File->Offset + size > max_read) {
 		if (File->Offset > max_read) {
 			/* Per UEFI specs */
-			ntfs_attr_close(na);
 			return EFI_DEVICE_ERROR;
 		}
 		size = max_read - File->Offset;
 	}
 
+	n = NtfsUseReadAhead(File, na, Data, size);
+	size -= n;
+	File->Offset += n;
+	*Len += n;
+
 	while (size > 0) {
 		s64 ret = ntfs_attr_pread(na, File->Offset, size, &((UINT8*)Data)[*Len]);
 		if (ret != size)
@@ -755,7 +1246,6 @@ NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 				((ntfs_inode*)File->NtfsInode)->mft_no,
 				File->Offset, *Len, ret);
 		if (ret <= 0 || ret > size) {
-			ntfs_attr_close(na);
 			if (ret >= 0)
 				errno = EIO;
 			PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
@@ -766,10 +1256,10 @@ NtfsReadFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 		*Len += ret;
 	}
 
-	ntfs_attr_close(na);
+	NtfsStartReadAhead(File, na, start);
 
 	if (!NtfsIsVolumeReadOnly(File->FileSystem->NtfsVolume))
-		ntfs_inode_update_times(File->NtfsInode, NTFS_UPDATE_MCTIME);
+		NtfsUpdateTimes(File->NtfsInode, NTFS_UPDATE_ATIME);
 
 	return EFI_SUCCESS;
 }
@@ -782,19 +1272,95 @@ NtfsGetFileSize(EFI_NTFS_FILE* File)
 {
 	if (File->NtfsInode == NULL)
 		return 0;
+	if (NtfsFlushAppends(File))
+		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
 	return ((ntfs_inode*)File->NtfsInode)->data_size;
 }
 
+/*
+ * The information of an open file, as last returned, along with the
+ * fields of the inode it was built from, so that it only has to be
+ * built again when the inode has changed
+ */
+typedef struct {
+	EFI_FILE_INFO Info;
+	ntfs_time CreationTime;
+	ntfs_time AccessTime;
+	ntfs_time ChangeTime;
+	s64 DataSize;
+	s64 AllocatedSize;
+	FILE_ATTR_FLAGS Flags;
+	BOOLEAN IsDir;
+} FILE_INFO_CACHE;
+
+/*
+ * Get the cached information of an open file, if still current
+ */
+static BOOLEAN
+NtfsGetCachedInfo(EFI_NTFS_FILE* File, ntfs_inode* ni, EFI_FILE_INFO* Info,
+	BOOLEAN IsDir)
+{
+	FILE_INFO_CACHE* Cache = (FILE_INFO_CACHE*)File->InfoCache;
+
+	if (Cache == NULL || Cache->IsDir != IsDir
+		|| Cache->CreationTime != ni->creation_time
+		|| Cache->AccessTime != ni->last_access_time
+		|| Cache->ChangeTime != ni->last_data_change_time
+		|| Cache->DataSize != ni->data_size
+		|| Cache->AllocatedSize != ni->allocated_size
+		|| Cache->Flags != ni->flags)
+		return FALSE;
+	Info->FileSize = Cache->Info.FileSize;
+	Info->PhysicalSize = Cache->Info.PhysicalSize;
+	Info->CreateTime = Cache->Info.CreateTime;
+	Info->LastAccessTime = Cache->Info.LastAccessTime;
+	Info->ModificationTime = Cache->Info.ModificationTime;
+	Info->Attribute = Cache->Info.Attribute;
+	return TRUE;
+}
+
+/*
+ * Keep the information of an open file for the next queries
+ */
+static VOID
+NtfsCacheInfo(EFI_NTFS_FILE* File, ntfs_inode* ni, CONST EFI_FILE_INFO* Info,
+	BOOLEAN IsDir)
+{
+	FILE_INFO_CACHE* Cache = (FILE_INFO_CACHE*)File->InfoCache;
+
+	if (Cache == NULL) {
+		Cache = AllocatePool(sizeof(FILE_INFO_CACHE));
+		if (Cache == NULL)
+			return;
+		File->InfoCache = Cache;
+	}
+	Cache->Info.FileSize = Info->FileSize;
+	Cache->Info.PhysicalSize = Info->PhysicalSize;
+	Cache->Info.CreateTime = Info->CreateTime;
+	Cache->Info.LastAccessTime = Info->LastAccessTime;
+	Cache->Info.ModificationTime = Info->ModificationTime;
+	Cache->Info.Attribute = Info->Attribute;
+	Cache->CreationTime = ni->creation_time;
+	Cache->AccessTime = ni->last_access_time;
+	Cache->ChangeTime = ni->last_data_change_time;
+	Cache->DataSize = ni->data_size;
+	Cache->AllocatedSize = ni->allocated_size;
+	Cache->Flags = ni->flags;
+	Cache->IsDir = IsDir;
+}
+
 /*
  * Fill an EFI_FILE_INFO struct with data from the NTFS inode.
  * This function takes either a File or an MREF (with the MREF
- * being used if it's non-zero).
+ * being used if it's non-zero). The information of the open
+ * files is cached, so that repeated queries are cheap.
  */
 EFI_STATUS
 NtfsGetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info, CONST UINT64 MRef, BOOLEAN IsDir)
 {
 	BOOLEAN NeedClose = FALSE;
 	EFI_NTFS_FILE* Existing = NULL;
+	EFI_NTFS_FILE* Cached = File;
 	ntfs_inode* ni = File->NtfsInode;
 
 	/*
@@ -803,6 +1369,7 @@ NtfsGetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info, CONST UINT64 MRef, BOO
 	 */
 	if (MRef != 0) {
 		Existing = NtfsLookupInum(File, MRef);
+		Cached = Existing;
 		if (Existing != NULL) {
 			ni = Existing->NtfsInode;
 		} else {
@@ -815,6 +1382,11 @@ NtfsGetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info, CONST UINT64 MRef, BOO
 	if (ni == NULL)
 		return EFI_NOT_FOUND;
 
+	if (NtfsFlushAppends(Cached))
+		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
+	if (Cached != NULL && NtfsGetCachedInfo(Cached, ni, Info, IsDir))
+		return EFI_SUCCESS;
+
 	Info->FileSize = ni->data_size;
 	Info->PhysicalSize = ni->allocated_size;
 	UnixTimeToEfiTime(NTFS_TO_UNIX_TIME(ni->creation_time), &Info->CreateTime);
@@ -833,12 +1405,57 @@ NtfsGetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info, CONST UINT64 MRef, BOO
 	if (ni->flags & FILE_ATTR_ARCHIVE)
 		Info->Attribute |= EFI_FILE_ARCHIVE;
 
+	if (Cached != NULL)
+		NtfsCacheInfo(Cached, ni, Info, IsDir);
 	if (NeedClose)
 		ntfs_inode_close(ni);
 
 	return EFI_SUCCESS;
 }
 
+/*
+ * Fill the Info attributes of a directory entry from the file name
+ * attribute of its index entry, so that the inode does not have to be
+ * opened. Fall back to reading the inode for the emulated '.' and '..',
+ * for files that are open (as their index entry may not be up to date
+ * yet) and for reparse points (whose sizes are not in the index).
+ */
+EFI_STATUS
+NtfsGetDirEntryInfo(EFI_NTFS_FILE* Parent, EFI_FILE_INFO* Info,
+	CONST UINT64 MRef, CONST VOID* FileName, BOOLEAN IsDir)
+{
+	CONST FILE_NAME_ATTR* fn = (CONST FILE_NAME_ATTR*)FileName;
+	le32 flags;
+
+	if (fn == NULL || NtfsLookupInum(Parent, MRef) != NULL ||
+		(fn->file_attributes & FILE_ATTR_REPARSE_POINT))
+		return NtfsGetFileInfo(Parent, Info, MRef, IsDir);
+
+	Info->FileSize = sle64_to_cpu(fn->data_size);
+	Info->PhysicalSize = sle64_to_cpu(fn->allocated_size);
+	UnixTimeToEfiTime(NTFS_TO_UNIX_TIME(sle64_to_cpu(fn->creation_time)),
+		&Info->CreateTime);
+	UnixTimeToEfiTime(NTFS_TO_UNIX_TIME(sle64_to_cpu(fn->last_access_time)),
+		&Info->LastAccessTime);
+	UnixTimeToEfiTime(NTFS_TO_UNIX_TIME(sle64_to_cpu(fn->last_data_change_time)),
+		&Info->ModificationTime);
+
+	flags = fn->file_attributes;
+	Info->Attribute = 0;
+	if (IsDir)
+		Info->Attribute |= EFI_FILE_DIRECTORY;
+	if (flags & FILE_ATTR_READONLY || NtfsIsVolumeReadOnly(Parent->FileSystem->NtfsVolume))
+		Info->Attribute |= EFI_FILE_READ_ONLY;
+	if (flags & FILE_ATTR_HIDDEN)
+		Info->Attribute |= EFI_FILE_HIDDEN;
+	if (flags & FILE_ATTR_SYSTEM)
+		Info->Attribute |= EFI_FILE_SYSTEM;
+	if (flags & FILE_ATTR_ARCHIVE)
+		Info->Attribute |= EFI_FILE_ARCHIVE;
+
+	return EFI_SUCCESS;
+}
+
 /*
  * For extra safety, as well as in an effort to reduce the size of the
  * read-only driver executable, guard all the function calls that alter
@@ -1041,6 +1658,7 @@ NtfsDeleteFile(EFI_NTFS_FILE* File)
 		return EFI_ACCESS_DENIED;
 
 	/* Delete the file */
+	NtfsReleaseDataAttr(File);
 	r = ntfs_delete(File->FileSystem->NtfsVolume, NULL, File->NtfsInode,
 		dir_ni, File->BaseName, SafeStrLen(File->BaseName));
 	NtfsLookupRem(File);
@@ -1086,7 +1704,7 @@ NtfsWriteFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 	if (ni->flags & FILE_ATTR_READONLY)
 		return EFI_WRITE_PROTECTED;
 
-	na = ntfs_attr_open(File->NtfsInode, AT_DATA, AT_UNNAMED, 0);
+	na = NtfsGetDataAttr(File);
 	if (!na) {
 		PrintError(L"%a failed (open): %a\n", __FUNCTION__, strerror(errno));
 		return ErrnoToEfiStatus();
@@ -1095,7 +1713,6 @@ NtfsWriteFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 	while (size > 0) {
 		s64 ret = ntfs_attr_pwrite(na, File->Offset, size, &((UINT8*)Data)[*Len]);
 		if (ret <= 0) {
-			ntfs_attr_close(na);
 			if (ret >= 0)
 				errno = EIO;
 			PrintError(L"%a failed (write): %a\n", __FUNCTION__, strerror(errno));
@@ -1106,8 +1723,6 @@ NtfsWriteFile(EFI_NTFS_FILE* File, VOID* Data, UINTN* Len)
 		*Len += ret;
 	}
 
-	ntfs_attr_close(na);
-
 	ntfs_inode_update_times(File->NtfsInode, NTFS_UPDATE_MCTIME);
 
 	return EFI_SUCCESS;
@@ -1218,6 +1833,7 @@ NtfsMoveFile(EFI_NTFS_FILE* File, CHAR16* NewPath)
 	OldBaseName = File->BaseName;
 	File->Path = NewPath;
 	File->BaseName = &NewPath[Len + 1];
+	NtfsLookupRename(File);
 	/* So that we free the right string on exit */
 	NewPath = OldPath;
 
@@ -1226,6 +1842,7 @@ NtfsMoveFile(EFI_NTFS_FILE* File, CHAR16* NewPath)
 		ntfs_inode_close(newparent_ni);
 
 	/* Delete the old reference */
+	NtfsReleaseDataAttr(File);
 	if (ntfs_delete(ni->vol, NULL, ni, parent_ni, OldBaseName, StrLen(OldBaseName))) {
 		Status = ErrnoToEfiStatus();
 		goto out;
@@ -1342,13 +1959,14 @@ NtfsSetFileInfo(EFI_NTFS_FILE* File, EFI_FILE_INFO* Info, BOOLEAN ReadOnly)
 		/* Non attribute change of read-only file */
 		if (ReadOnly)
 			return EFI_ACCESS_DENIED;
-		na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+		na = NtfsGetDataAttr(File);
 		if (!na) {
 			PrintError(L"%a ntfs_attr_open failed: %a\n", __FUNCTION__, strerror(errno));
 			return ErrnoToEfiStatus();
 		}
 		r = ntfs_attr_truncate(na, Info->FileSize);
-		ntfs_attr_close(na);
+		/* Get a fresh attribute on next access */
+		NtfsReleaseDataAttr(File);
 		if (r) {
 			PrintError(L"%a ntfs_attr_truncate failed: %a\n", __FUNCTION__, strerror(errno));
 			return ErrnoToEfiStatus();
@@ -1392,6 +2010,11 @@ NtfsFlushFile(EFI_NTFS_FILE* File)
 	u64 parent_inum;
 
 	ni = File->NtfsInode;
+	/* The gathered appends make the file dirty */
+	if (NtfsFlushAppends(File)) {
+		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
+		return ErrnoToEfiStatus();
+	}
 	/* Nothing to do if the file is not dirty */
 	if (!NInoDirty(ni) && NInoAttrListDirty(ni))
 		return EFI_SUCCESS;
@@ -1409,6 +2032,11 @@ NtfsFlushFile(EFI_NTFS_FILE* File)
 		PrintError(L"%a failed: %a\n", __FUNCTION__, strerror(errno));
 		Status = ErrnoToEfiStatus();
 	}
+	/* Write the blocks held in our cache to the device */
+	if (ntfs_device_sync(ni->vol->dev) < 0 && !EFI_ERROR(Status)) {
+		PrintError(L"%a: Failed to sync device: %a\n", __FUNCTION__, strerror(errno));
+		Status = ErrnoToEfiStatus();
+	}
 	if (Parent != NULL) {
 		Parent->NtfsInode = ntfs_inode_open(File->FileSystem->NtfsVolume, parent_inum);
 		if (Parent->NtfsInode == NULL) {
@@ -19,6 +19,7 @@
  */
 
 #include "uefi_driver.h"
+#include "uefi_bridge.h"
 #include "uefi_logging.h"
 #include "uefi_support.h"
 
@@ -340,6 +341,10 @@ FSDriverUninstall(EFI_HANDLE ImageHandle)
 		&MutexGUID, &MutexProtocol,
 		NULL);
 
+	/* Give the pages kept by the allocator back to the firmware */
+	NtfsReleaseMemory();
+	NtfsFreeProcessors();
+
 	PrintDebug(L"FS driver uninstalled.\n");
 	return EFI_SUCCESS;
 }
@@ -362,6 +367,8 @@ FSDriverInstall(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
 	InitializeLib(ImageHandle, SystemTable);
 #endif
 	SetLogging();
+	NtfsSetAtimePolicy();
+	NtfsSetProcessors();
 	EfiImageHandle = ImageHandle;
 
 	/* Prevent the driver from being loaded twice by detecting and trying to
@@ -35,9 +35,31 @@
 /* Structure used with DirHook */
 typedef struct {
 	EFI_NTFS_FILE* Parent;
-	EFI_FILE_INFO* Info;
+	struct _DIR_CURSOR* Cursor;
 } DIR_DATA;
 
+/*
+ * Directory entries read in advance, as EFI_FILE_INFO records aligned
+ * to 8 bytes, so that a whole index block gets decoded on a single
+ * ntfs_readdir() instead of being parsed again from DirPos on each read.
+ */
+typedef struct _DIR_CURSOR {
+	UINTN Used;		/* Size of the buffered entries */
+	UINTN Next;		/* Offset of the next entry to return */
+	UINT64 Data[DIR_CURSOR_SIZE / sizeof(UINT64)];
+} DIR_CURSOR;
+
+/* Maximum size of a directory entry, for a 255 characters name */
+#define DIR_ENTRY_MAX_SIZE  (SIZE_OF_EFI_FILE_INFO + 256 * sizeof(CHAR16))
+#define DIR_ENTRY_ALIGN(x)  (((x) + 7) & ~((UINTN)7))
+
+/* Structure used for completing a ReadEx() request */
+typedef struct {
+	EFI_FILE_HANDLE This;
+	EFI_FILE_IO_TOKEN* Token;
+	EFI_EVENT Event;
+} READ_REQUEST;
+
 /**
  * Open file
  *
@@ -293,10 +315,12 @@ FileDelete(EFI_FILE_HANDLE This)
  */
 static INT32 DirHook(VOID* Data, CONST CHAR16* Name,
 	CONST INT32 NameLen, CONST INT32 NameType, CONST INT64 Pos,
-	CONST UINT64 MRef, CONST UINT32 DtType)
+	CONST UINT64 MRef, CONST UINT32 DtType, CONST VOID* FileName)
 {
 	EFI_STATUS Status;
 	DIR_DATA* HookData = (DIR_DATA*)Data;
+	DIR_CURSOR* Cursor = HookData->Cursor;
+	EFI_FILE_INFO* Info;
 
 	/* Don't list any system files except root */
 	if (GetInodeNumber(MRef) < FILE_FIRST_USER && GetInodeNumber(MRef) != FILE_ROOT)
@@ -305,25 +329,24 @@ static INT32 DirHook(VOID* Data, CONST CHAR16* Name,
 	/* Sanity check since the maximum size of an NTFS file name is 255 */
 	FS_ASSERT(NameLen < 256);
 
-	if (HookData->Info->Size < ((UINTN)NameLen + 1) * sizeof(CHAR16)) {
-		NtfsSetErrno(EFI_BUFFER_TOO_SMALL);
-		return -1;
-	}
-	CopyMem(HookData->Info->FileName, Name, NameLen * sizeof(CHAR16));
-	HookData->Info->FileName[NameLen] = 0;
-	HookData->Info->Size = SIZE_OF_EFI_FILE_INFO + ((UINTN)NameLen + 1) * sizeof(CHAR16);
+	Info = (EFI_FILE_INFO*)((UINT8*)Cursor->Data + Cursor->Used);
+	ZeroMem(Info, SIZE_OF_EFI_FILE_INFO);
+	CopyMem(Info->FileName, Name, NameLen * sizeof(CHAR16));
+	Info->FileName[NameLen] = 0;
+	Info->Size = SIZE_OF_EFI_FILE_INFO + ((UINTN)NameLen + 1) * sizeof(CHAR16);
 
-	/* Set the Info attributes we obtain from the inode */
-	Status = NtfsGetFileInfo(HookData->Parent, HookData->Info,
-		MRef, (DtType == 4));	/* DtType is 4 for directories */
+	/* Set the Info attributes from the index entry */
+	Status = NtfsGetDirEntryInfo(HookData->Parent, Info, MRef,
+		FileName, (DtType == 4));	/* DtType is 4 for directories */
 	if (EFI_ERROR(Status)) {
 		PrintStatusError(Status, L"Could not get directory entry info");
 		NtfsSetErrno(Status);
 		return -1;
 	}
+	Cursor->Used += DIR_ENTRY_ALIGN((UINTN)Info->Size);
 
-	/* One shot */
-	return 1;
+	/* Stop when there may not be enough room left for the next entry */
+	return (sizeof(Cursor->Data) - Cursor->Used < DIR_ENTRY_MAX_SIZE) ? 1 : 0;
 }
 
 /**
@@ -337,21 +360,45 @@ static INT32 DirHook(VOID* Data, CONST CHAR16* Name,
 static EFI_STATUS
 FileReadDir(EFI_NTFS_FILE* File, UINTN* Len, VOID* Data)
 {
-	DIR_DATA HookData = { File, (EFI_FILE_INFO*)Data };
+	DIR_DATA HookData = { File, NULL };
+	DIR_CURSOR* Cursor;
+	EFI_FILE_INFO* Info;
 	EFI_STATUS Status;
 
-	HookData.Info->Size = *Len;
-	Status = NtfsReadDirectory(File, DirHook, &HookData);
-	if (EFI_ERROR(Status)) {
-		if (Status == EFI_END_OF_FILE) {
-			*Len = 0;
-			return EFI_SUCCESS;
+	if (File->DirCursor == NULL) {
+		File->DirCursor = AllocatePool(sizeof(DIR_CURSOR));
+		if (File->DirCursor == NULL)
+			return EFI_OUT_OF_RESOURCES;
+		((DIR_CURSOR*)File->DirCursor)->Used = 0;
+		((DIR_CURSOR*)File->DirCursor)->Next = 0;
+	}
+	Cursor = (DIR_CURSOR*)File->DirCursor;
+
+	/* Refill the cursor once all the buffered entries have been returned */
+	if (Cursor->Next >= Cursor->Used) {
+		Cursor->Used = 0;
+		Cursor->Next = 0;
+		HookData.Cursor = Cursor;
+		Status = NtfsReadDirectory(File, DirHook, &HookData);
+		/* Return the entries we got first, and the error on the next read */
+		if (EFI_ERROR(Status) && Cursor->Used == 0) {
+			if (Status == EFI_END_OF_FILE) {
+				*Len = 0;
+				return EFI_SUCCESS;
+			}
+			PrintStatusError(Status, L"Directory listing failed");
+			return Status;
 		}
-		PrintStatusError(Status, L"Directory listing failed");
-		return Status;
 	}
 
-	*Len = (UINTN)HookData.Info->Size;
+	Info = (EFI_FILE_INFO*)((UINT8*)Cursor->Data + Cursor->Next);
+	if (*Len < Info->Size) {
+		*Len = (UINTN)Info->Size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	CopyMem(Data, Info, (UINTN)Info->Size);
+	*Len = (UINTN)Info->Size;
+	Cursor->Next += DIR_ENTRY_ALIGN((UINTN)Info->Size);
 	return EFI_SUCCESS;
 }
 
@@ -381,11 +428,54 @@ FileRead(EFI_FILE_HANDLE This, UINTN* Len, VOID* Data)
 	return NtfsReadFile(File, Data, Len);
 }
 
-/* Ex version */
+/*
+ * Perform a ReadEx() request and signal its completion to the caller
+ */
+static VOID EFIAPI
+FileReadNotify(EFI_EVENT Event, VOID* Context)
+{
+	READ_REQUEST* Request = (READ_REQUEST*)Context;
+	EFI_FILE_IO_TOKEN* Token = Request->Token;
+
+	Token->Status = FileRead(Request->This, &(Token->BufferSize), Token->Buffer);
+	gBS->CloseEvent(Event);
+	FreePool(Request);
+	gBS->SignalEvent(Token->Event);
+}
+
+/*
+ * Ex version
+ *
+ * When the caller provides an event, the read is performed from the
+ * notification function of an event we signal at TPL_CALLBACK, so
+ * that a caller running at TPL_CALLBACK gets control back before the
+ * read is performed, and the multiple runs of the file are then read
+ * concurrently using DiskIo2. As the notification only runs when the
+ * TPL is lowered below TPL_CALLBACK, it never interrupts one of our
+ * own file operations.
+ */
 EFI_STATUS EFIAPI
 FileReadEx(IN EFI_FILE_PROTOCOL *This, IN OUT EFI_FILE_IO_TOKEN *Token)
 {
-	return FileRead(This, &(Token->BufferSize), Token->Buffer);
+	EFI_STATUS Status;
+	READ_REQUEST* Request;
+
+	if (Token->Event == NULL)
+		return FileRead(This, &(Token->BufferSize), Token->Buffer);
+
+	Request = AllocateZeroPool(sizeof(*Request));
+	if (Request == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	Request->This = This;
+	Request->Token = Token;
+	Status = gBS->CreateEvent(EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+		FileReadNotify, Request, &Request->Event);
+	if (EFI_ERROR(Status)) {
+		FreePool(Request);
+		return Status;
+	}
+	gBS->SignalEvent(Request->Event);
+	return EFI_SUCCESS;
 }
 
 /**
@@ -451,6 +541,10 @@ FileSetPosition(EFI_FILE_HANDLE This, UINT64 Position)
 		if (Position != 0)
 			return EFI_UNSUPPORTED;
 		File->DirPos = 0;
+		if (File->DirCursor != NULL) {
+			((DIR_CURSOR*)File->DirCursor)->Used = 0;
+			((DIR_CURSOR*)File->DirCursor)->Next = 0;
+		}
 		return EFI_SUCCESS;
 	}
 